@@ -6,3 +6,7 @@
 TOOLPREFIX := arm-none-argentum-
 
 # BASE_FLAGS += -mcpu=cortex-a9 -mhard-float -mfpu=vfp
+
+# Target board: "realview" (RealView PB-A8 and PBX-A9, selected at boot time)
+# or "virt" (the QEMU virt machine with virtio devices, RAM at 1GB)
+MACH ?= realview
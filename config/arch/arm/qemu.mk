@@ -1,11 +1,42 @@
 # QEMU executable
 QEMU := qemu-system-arm
 
-#QEMUOPTS := -M realview-pb-a8 -m 256
-QEMUOPTS := -M realview-pbx-a9 -m 256 -smp $(CPUS)
+# Host iperf (version 2) client, and the settings used by `make qemu-perf`
+IPERF      := iperf
+PERF_PORT  := 5001
+PERF_TIME  := 10
+PERF_FLAGS :=
+PERF_LOG   := $(OBJ)/qemu-perf.log
+
+# Console log and time limit (in seconds) of `make bench`
+BENCH_LOG     := $(OBJ)/bench.log
+BENCH_TIMEOUT := 600
+
+# Forward the port of the in-kernel iperf server
+ifdef LWIPERF
+  QEMUHOSTFWD := ,hostfwd=tcp::$(PERF_PORT)-:5001
+endif
+
+ifeq ($(MACH),virt)
+  QEMUOPTS := -M virt -cpu cortex-a15 -m 256 -smp $(CPUS)
+else
+  #QEMUOPTS := -M realview-pb-a8 -m 256
+  QEMUOPTS := -M realview-pbx-a9 -m 256 -smp $(CPUS)
+endif
 QEMUOPTS += -kernel $(KERNEL).bin
-QEMUOPTS += -drive if=sd,format=raw,file=$(OBJ)/fs.img
-QEMUOPTS += -nic user,hostfwd=tcp::8080-:80
+# Pass a filesystem image to be mounted as the root from the RAM disk
+ifdef INITRD
+  QEMUOPTS += -initrd $(INITRD)
+endif
+ifeq ($(MACH),virt)
+  QEMUOPTS += -drive if=none,format=raw,file=$(OBJ)/fs.img,id=hd0
+  QEMUOPTS += -device virtio-blk-device,drive=hd0
+  QEMUOPTS += -netdev user,id=net0,hostfwd=tcp::8080-:80$(QEMUHOSTFWD)
+  QEMUOPTS += -device virtio-net-device,netdev=net0
+else
+  QEMUOPTS += -drive if=sd,format=raw,file=$(OBJ)/fs.img
+  QEMUOPTS += -nic user,hostfwd=tcp::8080-:80$(QEMUHOSTFWD)
+endif
 QEMUOPTS += -serial mon:stdio
 
 $(KERNEL).bin: $(KERNEL)
@@ -17,4 +48,44 @@ qemu: $(OBJ)/fs.img $(KERNEL).bin
 qemu-gdb: $(OBJ)/fs.img $(KERNEL).bin
 	$(QEMU) $(QEMUOPTS) -s -S
 
-.PHONY: qemu qemu-gdb
+# Boot the kernel with the iperf server in the background and measure the TCP
+# throughput with the host client. The kernel side of the report is printed
+# from the serial log after the client one.
+qemu-perf:
+	$(V)$(MAKE) --no-print-directory LWIPERF=1 qemu-perf-run
+
+QEMUPERFOPTS := $(filter-out -serial mon:stdio, $(QEMUOPTS))
+QEMUPERFOPTS += -serial file:$(PERF_LOG) -display none
+
+qemu-perf-run: $(OBJ)/fs.img $(KERNEL).bin
+	@echo "+ QEMU [PERF] $(PERF_LOG)"
+	$(V)rm -f $(PERF_LOG); \
+	$(QEMU) $(QEMUPERFOPTS) & qemu=$$!; \
+	trap "kill $$qemu 2>/dev/null" EXIT; \
+	for i in $$(seq 120); do \
+	  grep -q "lwiperf: listening" $(PERF_LOG) 2>/dev/null && break; \
+	  sleep 1; \
+	done; \
+	$(IPERF) -c 127.0.0.1 -p $(PERF_PORT) -t $(PERF_TIME) -f m $(PERF_FLAGS); \
+	sleep 1; \
+	grep "lwiperf: \(done\|aborted\)" $(PERF_LOG)
+
+# Boot from an image that makes init run the user-space benchmark suite, wait
+# for it to complete and print the results, one "BENCH <name> <value> <unit>"
+# line per measurement. Fails if any benchmark fails or the run times out.
+QEMUBENCHOPTS := $(subst $(OBJ)/fs.img,$(OBJ)/bench.img,$(QEMUPERFOPTS))
+QEMUBENCHOPTS := $(subst $(PERF_LOG),$(BENCH_LOG),$(QEMUBENCHOPTS))
+
+bench: $(OBJ)/bench.img $(KERNEL).bin
+	@echo "+ QEMU [BENCH] $(BENCH_LOG)"
+	$(V)rm -f $(BENCH_LOG); \
+	$(QEMU) $(QEMUBENCHOPTS) & qemu=$$!; \
+	trap "kill $$qemu 2>/dev/null" EXIT; \
+	for i in $$(seq $(BENCH_TIMEOUT)); do \
+	  grep -q "^BENCH-END" $(BENCH_LOG) 2>/dev/null && break; \
+	  sleep 1; \
+	done; \
+	tr -d '\r' < $(BENCH_LOG) | grep "^BENCH[ -]"; \
+	tr -d '\r' < $(BENCH_LOG) | grep -q "^BENCH-END 0$$"
+
+.PHONY: bench qemu qemu-gdb qemu-perf qemu-perf-run
@@ -0,0 +1,93 @@
+#include <stdint.h>
+
+#include <kernel/mm/memlayout.h>
+#include <kernel/types.h>
+
+#include <arch/arm/cache.h>
+#include <arch/arm/mach.h>
+#include <arch/arm/regs.h>
+
+/*
+ * The L1 operations work by virtual address and the outer cache operations by
+ * physical address. The inner level is always cleaned first, so that the lines
+ * it writes back can be cleaned from the outer level in turn, and invalidated
+ * last, so that no line is refilled from stale outer cache contents.
+ */
+
+/**
+ * Initialize the outer cache of the machine, if there is one. Must be called
+ * once by the bootstrap processor.
+ */
+void
+arch_cache_init(void)
+{
+  if (mach_current->cache_init != NULL)
+    mach_current->cache_init();
+}
+
+/**
+ * Write back the cached data in the given range, before a DMA master reads
+ * the memory.
+ *
+ * @param va The start kernel virtual address.
+ * @param n  The length of the range, in bytes.
+ */
+void
+arch_dcache_clean(const void *va, size_t n)
+{
+  uintptr_t p;
+
+  for (p = ROUND_DOWN((uintptr_t) va, CP15_DCACHE_LINE);
+       p < (uintptr_t) va + n;
+       p += CP15_DCACHE_LINE)
+    cp15_dccmvac(p);
+  dsb();
+
+  if (mach_current->cache_clean != NULL)
+    mach_current->cache_clean(KVA2PA((void *) va), n);
+}
+
+/**
+ * Discard the cached data in the given range, after a DMA master has written
+ * the memory. The range should be aligned on cache lines.
+ *
+ * @param va The start kernel virtual address.
+ * @param n  The length of the range, in bytes.
+ */
+void
+arch_dcache_invalidate(const void *va, size_t n)
+{
+  uintptr_t p;
+
+  if (mach_current->cache_invalidate != NULL)
+    mach_current->cache_invalidate(KVA2PA((void *) va), n);
+
+  for (p = ROUND_DOWN((uintptr_t) va, CP15_DCACHE_LINE);
+       p < (uintptr_t) va + n;
+       p += CP15_DCACHE_LINE)
+    cp15_dcimvac(p);
+  dsb();
+}
+
+/**
+ * Write back and discard the cached data in the given range, before a DMA
+ * master writes the memory, so that no dirty line gets evicted over the
+ * incoming data.
+ *
+ * @param va The start kernel virtual address.
+ * @param n  The length of the range, in bytes.
+ */
+void
+arch_dcache_flush(const void *va, size_t n)
+{
+  uintptr_t p;
+
+  for (p = ROUND_DOWN((uintptr_t) va, CP15_DCACHE_LINE);
+       p < (uintptr_t) va + n;
+       p += CP15_DCACHE_LINE)
+    cp15_dccimvac(p);
+  dsb();
+
+  if (mach_current->cache_flush != NULL)
+    mach_current->cache_flush(KVA2PA((void *) va), n);
+}
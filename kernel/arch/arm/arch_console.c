@@ -12,3 +12,11 @@ arch_console_putc(char c)
 {
   mach_current->console_putc(c);
 }
+
+struct Page *
+arch_console_fb(unsigned *order_store)
+{
+  if (mach_current->console_fb == NULL)
+    return NULL;
+  return mach_current->console_fb(order_store);
+}
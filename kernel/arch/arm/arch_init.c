@@ -1,6 +1,12 @@
+#include <errno.h>
 #include <stdint.h>
+#include <string.h>
 
+#include <arch/arm/cache.h>
 #include <arch/arm/mach.h>
+#include <kernel/core/cpu.h>
+#include <kernel/core/percpu.h>
+#include <kernel/drivers/ramdisk.h>
 #include <kernel/vm.h>
 #include <kernel/page.h>
 #include <kernel/interrupt.h>
@@ -8,17 +14,45 @@
 void main(void);
 void mp_main(void);
 
+static physaddr_t arch_mem_size(physaddr_t);
+
+// The initial RAM disk loaded by the bootloader, if any
+static physaddr_t arch_initrd_start;
+static physaddr_t arch_initrd_end;
+
+/**
+ * Initialization code for the bootstrap processor.
+ *
+ * @param mach_type   The machine type passed by the bootloader (R1).
+ * @param boot_params Physical address of the ATAG list or the device tree
+ *                    blob passed by the bootloader (R2).
+ */
 void
-arch_init(uintptr_t mach_type)
+arch_init(uintptr_t mach_type, physaddr_t boot_params)
 {
+  // Must run before page_init_low() puts the boot parameters on the free list
+  physaddr_t mem_size = arch_mem_size(boot_params);
+
+  // Keep the RAM disk image away from the page allocator
+  if (arch_initrd_end > arch_initrd_start)
+    page_reserve(arch_initrd_start, arch_initrd_end);
+
+  // Must run before anything touches the per-CPU variables
+  k_percpu_init();
+
   // Initialize the memory manager
-  page_init_low();  // Physical page allocator (lower memory)
+  page_init_low(mem_size);  // Physical page allocator (lower memory)
   arch_vm_init();   // Memory management unit and kernel mappings
   page_init_high(); // Physical page allocator (higher memory)
 
+  k_arch_cpu_init_percpu();
+
   // Initialize the machine
   mach_init(mach_type);
 
+  // Enable the outer cache
+  arch_cache_init();
+
   // Initialize the interrupt controller
   arch_interrupt_init();
 
@@ -26,9 +60,14 @@ arch_init(uintptr_t mach_type)
 }
 
 void
-arch_init_devices(void)
+arch_init_storage(void)
 {
   mach_current->storage_init();
+}
+
+void
+arch_init_eth(void)
+{
   mach_current->eth_init();
 }
 
@@ -42,13 +81,230 @@ arch_mp_init(void)
 {
   // Per-CPU initialization
   arch_vm_init_percpu(); // Load the kernel page table
+  k_arch_cpu_init_percpu();
   arch_interrupt_init_percpu();
 
   mp_main();
 }
 
-void
-arch_eth_write(const void *buf, size_t n)
+/**
+ * Get the initial RAM disk loaded by the bootloader.
+ *
+ * @param size_store Pointer to the memory location to store the image size.
+ *
+ * @return The kernel virtual address of the image, or NULL if there is none.
+ */
+void *
+arch_initrd(size_t *size_store)
+{
+  if ((arch_initrd_end <= arch_initrd_start) ||
+      (arch_initrd_start < PHYS_RAM_BASE) ||
+      (arch_initrd_end > PHYS_RAM_BASE + (physaddr_t) page_count * PAGE_SIZE))
+    return NULL;
+
+  *size_store = arch_initrd_end - arch_initrd_start;
+  return PA2KVA(arch_initrd_start);
+}
+
+int
+arch_eth_write(struct pbuf *p)
+{
+  return mach_current->eth_write(p);
+}
+
+int
+arch_eth_stats(struct NetIfStats *stats)
+{
+  if (mach_current->eth_stats == NULL)
+    return -ENODEV;
+
+  mach_current->eth_stats(stats);
+  return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Memory size detection
+ * ----------------------------------------------------------------------------
+ *
+ * The bootloader passes either a list of ATAGs or a flattened device tree.
+ * Both must lie within the memory mapped by entry_pgdir. Only the memory bank
+ * starting at PHYS_RAM_BASE is used by the kernel. The location of the
+ * initial RAM disk is picked up on the way. If the parameters are out of
+ * reach (QEMU puts the device tree 128MB into RAM), the size defaults to
+ * PHYS_LIMIT.
+ */
+
+#define ATAG_NONE         0x00000000
+#define ATAG_CORE         0x54410001
+#define ATAG_MEM          0x54410002
+#define ATAG_INITRD2      0x54420005
+
+struct Atag {
+  uint32_t size;          ///< Tag size in words, including this header
+  uint32_t tag;           ///< Tag type
+  uint32_t data[];
+};
+
+#define FDT_MAGIC         0xD00DFEED
+#define FDT_BEGIN_NODE    1
+#define FDT_END_NODE      2
+#define FDT_PROP          3
+#define FDT_NOP           4
+#define FDT_END           9
+
+struct FdtHeader {
+  uint32_t magic;
+  uint32_t totalsize;
+  uint32_t off_dt_struct;
+  uint32_t off_dt_strings;
+  uint32_t off_mem_rsvmap;
+  uint32_t version;
+  uint32_t last_comp_version;
+  uint32_t boot_cpuid_phys;
+  uint32_t size_dt_strings;
+  uint32_t size_dt_struct;
+};
+
+// Device tree values are big-endian
+static inline uint32_t
+fdt32(uint32_t v)
+{
+  return __builtin_bswap32(v);
+}
+
+static physaddr_t
+arch_mem_size_atags(struct Atag *atag, physaddr_t end)
+{
+  physaddr_t size = 0;
+
+  while ((KVA2PA(atag) + sizeof(*atag) <= end) && (atag->tag != ATAG_NONE)) {
+    if (atag->size < 2)
+      break;
+
+    // data[0] is the bank size, data[1] is the start address
+    if ((atag->tag == ATAG_MEM) && (atag->size >= 4) &&
+        (atag->data[1] == PHYS_RAM_BASE))
+      size = atag->data[0];
+
+    // data[0] is the start address, data[1] is the size
+    if ((atag->tag == ATAG_INITRD2) && (atag->size >= 4)) {
+      arch_initrd_start = atag->data[0];
+      arch_initrd_end   = atag->data[0] + atag->data[1];
+    }
+
+    atag = (struct Atag *) ((uint32_t *) atag + atag->size);
+  }
+
+  return size;
+}
+
+// Read a number of the given width (in 32-bit cells)
+static physaddr_t
+arch_mem_size_cells(const uint32_t *p, uint32_t cells)
+{
+  // Ignore higher words, the kernel cannot address more than 4 GiB anyway
+  return (cells > 0) ? fdt32(p[cells - 1]) : 0;
+}
+
+static physaddr_t
+arch_mem_size_fdt(struct FdtHeader *fdt, physaddr_t end)
+{
+  const uint32_t *p, *struct_end;
+  const char *strings;
+  uint32_t addr_cells = 2, size_cells = 1;
+  int depth = 0, in_memory = 0, in_chosen = 0;
+  physaddr_t size = 0;
+
+  if ((KVA2PA(fdt) + sizeof(*fdt) > end) ||
+      (KVA2PA(fdt) + fdt32(fdt->totalsize) > end))
+    return 0;
+
+  p          = (const uint32_t *) ((uint8_t *) fdt + fdt32(fdt->off_dt_struct));
+  struct_end = (const uint32_t *) ((uint8_t *) fdt + fdt32(fdt->totalsize));
+  strings    = (const char *) fdt + fdt32(fdt->off_dt_strings);
+
+  while (p < struct_end) {
+    uint32_t token = fdt32(*p++);
+
+    switch (token) {
+    case FDT_BEGIN_NODE: {
+      const char *name = (const char *) p;
+      size_t len = strlen(name);
+
+      depth++;
+      in_memory = (depth == 2) && (strncmp(name, "memory", 6) == 0) &&
+                  ((name[6] == '\0') || (name[6] == '@'));
+      in_chosen = (depth == 2) && (strcmp(name, "chosen") == 0);
+
+      p += (len + 1 + 3) / 4;
+      break;
+    }
+    case FDT_END_NODE:
+      depth--;
+      in_memory = in_chosen = 0;
+      break;
+    case FDT_PROP: {
+      uint32_t len  = fdt32(p[0]);
+      const char *name = strings + fdt32(p[1]);
+      const uint32_t *value = p + 2;
+
+      if (depth == 1) {
+        if (strcmp(name, "#address-cells") == 0)
+          addr_cells = fdt32(value[0]);
+        else if (strcmp(name, "#size-cells") == 0)
+          size_cells = fdt32(value[0]);
+      } else if (in_memory && (strcmp(name, "reg") == 0)) {
+        uint32_t entry = (addr_cells + size_cells) * sizeof(uint32_t);
+
+        for ( ; len >= entry; len -= entry, value += addr_cells + size_cells)
+          if ((size == 0) &&
+              (arch_mem_size_cells(value, addr_cells) == PHYS_RAM_BASE))
+            size = arch_mem_size_cells(value + addr_cells, size_cells);
+      } else if (in_chosen && (strcmp(name, "linux,initrd-start") == 0)) {
+        arch_initrd_start = arch_mem_size_cells(value, len / sizeof(uint32_t));
+      } else if (in_chosen && (strcmp(name, "linux,initrd-end") == 0)) {
+        arch_initrd_end = arch_mem_size_cells(value, len / sizeof(uint32_t));
+      }
+
+      p += 2 + (fdt32(p[0]) + 3) / 4;
+      break;
+    }
+    case FDT_NOP:
+      break;
+    default:
+      // FDT_END, or a malformed blob
+      return size;
+    }
+  }
+
+  return size;
+}
+
+/**
+ * Detect the size of physical memory.
+ *
+ * @param boot_params Physical address of the boot parameters.
+ *
+ * @return The memory size in bytes or 0 if it cannot be determined.
+ */
+static physaddr_t
+arch_mem_size(physaddr_t boot_params)
 {
-  mach_current->eth_write(buf, n);
+  uint32_t *p;
+
+  if ((boot_params % sizeof(uint32_t)) != 0)
+    return 0;
+  if ((boot_params < PHYS_RAM_BASE) ||
+      (boot_params + 2 * sizeof(uint32_t) > PHYS_ENTRY_LIMIT))
+    return 0;
+
+  p = (uint32_t *) PA2KVA(boot_params);
+
+  if (fdt32(p[0]) == FDT_MAGIC)
+    return arch_mem_size_fdt((struct FdtHeader *) p, PHYS_ENTRY_LIMIT);
+  if (p[1] == ATAG_CORE)
+    return arch_mem_size_atags((struct Atag *) p, PHYS_ENTRY_LIMIT);
+
+  return 0;
 }
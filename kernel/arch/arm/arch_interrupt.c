@@ -2,9 +2,9 @@
 #include <kernel/interrupt.h>
 
 void
-arch_interrupt_ipi(void)
+arch_interrupt_ipi(unsigned cpu, int irq)
 {
-  mach_current->interrupt_ipi();
+  mach_current->interrupt_ipi(cpu, irq);
 }
 
 int
@@ -1,5 +1,6 @@
 KERNEL_SRCFILES += \
 	kernel/arch/${ARCH}/core/arch_cpu.c \
+	kernel/arch/${ARCH}/core/arch_fpu.c \
 	kernel/arch/${ARCH}/core/arch_irq.c \
 	kernel/arch/${ARCH}/core/arch_spinlock.c \
 	kernel/arch/${ARCH}/core/arch_switch.S \
@@ -10,15 +11,25 @@ KERNEL_SRCFILES += \
 	kernel/arch/${ARCH}/drivers/ds1338.c \
 	kernel/arch/${ARCH}/drivers/sbcon.c \
 	kernel/arch/${ARCH}/drivers/pl180.c \
+	kernel/arch/${ARCH}/drivers/pl080.c \
+	kernel/arch/${ARCH}/drivers/pl310.c \
 	kernel/arch/${ARCH}/drivers/lan9118.c \
 	kernel/arch/${ARCH}/drivers/gic.c \
 	kernel/arch/${ARCH}/drivers/ptimer.c \
+	kernel/arch/${ARCH}/drivers/gltimer.c \
 	kernel/arch/${ARCH}/drivers/sp804.c \
-	kernel/arch/${ARCH}/mach/realview/realview.c \
+	kernel/arch/${ARCH}/drivers/gtimer.c \
+	kernel/arch/${ARCH}/drivers/pl031.c \
+	kernel/arch/${ARCH}/drivers/psci.c \
+	kernel/arch/${ARCH}/lib/memcpy.S \
+	kernel/arch/${ARCH}/lib/memmove.S \
+	kernel/arch/${ARCH}/lib/memset.S \
+	kernel/arch/${ARCH}/mach/${MACH}/${MACH}.c \
 	kernel/arch/${ARCH}/mach/mach.c \
 	kernel/arch/${ARCH}/mm/arch_vm.c \
 	kernel/arch/${ARCH}/process/arch_process.c \
 	kernel/arch/${ARCH}/process/arch_signal.c \
+	kernel/arch/${ARCH}/arch_cache.c \
 	kernel/arch/${ARCH}/arch_console.c \
 	kernel/arch/${ARCH}/arch_init.c \
 	kernel/arch/${ARCH}/arch_interrupt.c \
@@ -30,5 +41,36 @@ KERNEL_SRCFILES += \
 	kernel/arch/${ARCH}/entry.S \
 	kernel/arch/${ARCH}/trapentry.S
 
-KERNEL_CFLAGS += -mapcs-frame -Ikernel/arch/${ARCH}/include
+KERNEL_CFLAGS += -Ikernel/arch/${ARCH}/include
+
+# RAM starts at 1GB on the virt board, the devices occupy the space below it.
+# The kernel is linked and direct-maps memory for one RAM base only.
+ifeq ($(MACH),virt)
+	PHYS_RAM_BASE := 0x40000000
+else
+	PHYS_RAM_BASE := 0x00000000
+endif
+KERNEL_CFLAGS += -DPHYS_RAM_BASE=$(PHYS_RAM_BASE)
+KERNEL_LDSYMS += PHYS_RAM_BASE=$(PHYS_RAM_BASE)
+
+# The debug profile keeps the APCS frame chain for the backtrace code
+ifneq ($(KERNEL_PROFILE),release)
+	KERNEL_CFLAGS += -mapcs-frame
+endif
+
+# The assembly string routines replace the generic C versions
+KERNEL_SRCFILES := $(filter-out kernel/lib/memcpy.c kernel/lib/memmove.c \
+	kernel/lib/memset.c, $(KERNEL_SRCFILES))
+
+# Run `make NEON=1` to copy large blocks using the NEON unit (Cortex-A8 and
+# Cortex-A9 cores with the Advanced SIMD extension)
+ifdef NEON
+	KERNEL_CFLAGS += -DARM_NEON
+endif
+
+# Run `make MMCI_DMA=1` to move the SD card data using the DMA controller (the
+# MMCI emulated by QEMU does not generate DMA requests)
+ifdef MMCI_DMA
+	KERNEL_CFLAGS += -DREALVIEW_MMCI_DMA
+endif
 KERNEL_LDFILE := kernel/arch/${ARCH}/kernel.ld
@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <string.h>
 
 
 #include <kernel/monitor.h>
@@ -8,6 +9,64 @@
 
 #include <arch/arm/regs.h>
 
+#ifdef KDEBUG_CFI
+
+// Give up on corrupted stacks after this many frames
+#define BACKTRACE_MAX   64
+
+// The release kernel has no frame pointer chain, unwind the stack using the
+// call frame information instead
+void
+arch_mon_backtrace(struct TrapFrame *tf)
+{
+  struct PcDebugInfo info;
+  struct DebugFrame frame;
+  uintptr_t pc, ra, sp;
+  int i;
+
+  if (tf != NULL) {
+    memcpy(&frame.regs[0], &tf->r0, 13 * sizeof(uint32_t));
+    frame.regs[13] = tf->sp;
+    frame.regs[14] = tf->lr;
+    frame.regs[15] = tf->pc;
+  } else {
+    // Any address past the prologue of this function will do for the PC
+    asm volatile(
+      "\tstmia %1, {r0-r12}\n"
+      "\tstr   sp, [%1, #52]\n"
+      "\tstr   lr, [%1, #56]\n"
+      "\tmov   %0, pc\n"
+      : "=&r" (frame.regs[15])
+      : "r" (frame.regs)
+      : "memory");
+  }
+
+  pc = frame.regs[15];
+
+  for (i = 0; i < BACKTRACE_MAX; i++) {
+    debug_info_pc(pc, &info);
+
+    cprintf("  [%p] %s (%s at line %d)\n",
+            pc, info.fn_name, info.file, info.line);
+
+    sp = frame.regs[13];
+
+    // Look up the caller by the call instruction rather than the return
+    // address, which may already belong to the next function
+    if (debug_frame_unwind(i ? pc - 1 : pc, &frame, &ra) < 0)
+      break;
+
+    // The stack grows down, so the caller's frame is always higher
+    if ((ra == 0) || (frame.cfa <= sp))
+      break;
+
+    frame.regs[13] = frame.cfa;
+    frame.regs[15] = pc = ra;
+  }
+}
+
+#else   // !KDEBUG_CFI
+
 void
 arch_mon_backtrace(struct TrapFrame *tf)
 {
@@ -22,3 +81,5 @@ arch_mon_backtrace(struct TrapFrame *tf)
             fp[-1], info.fn_name, info.file, info.line);
   }
 }
+
+#endif  // !KDEBUG_CFI
@@ -8,37 +8,26 @@ sys_arch_get_num(void)
 {
   struct Process *current = process_current();
 
-  int *pc = (int *) (current->thread->tf->pc - 4);
+  int *pc = (int *) (k_thread_current()->tf->pc - 4);
   int r;
 
-  if ((r = vm_user_check_buf(current->vm->pgtab, (uintptr_t) pc, sizeof(int), VM_READ)) < 0)
+  if ((r = vm_user_check_buf(current->vm, (uintptr_t) pc, sizeof(int), VM_READ)) < 0)
     return r;
 
   return *pc & 0xFFFFFF;
 }
 
-// Get the n-th argument from the current process' trap frame.
-// Support up to 6 system call arguments
-int32_t
-sys_arch_get_arg(int n)
+// Get all of the arguments from the current thread's trap frame. Up to 6
+// arguments are passed in R0-R5.
+void
+sys_arch_get_args(int32_t *args)
 {
-  struct Process *current = process_current();
+  struct TrapFrame *tf = k_thread_current()->tf;
 
-  switch (n) {
-  case 0:
-    return current->thread->tf->r0;
-  case 1:
-    return current->thread->tf->r1;
-  case 2:
-    return current->thread->tf->r2;
-  case 3:
-    return current->thread->tf->r3;
-  case 4:
-    return current->thread->tf->r4;
-  case 5:
-    return current->thread->tf->r5;
-  default:
-    panic("Invalid argument number: %d", n);
-    return 0;
-  }
+  args[0] = tf->r0;
+  args[1] = tf->r1;
+  args[2] = tf->r2;
+  args[3] = tf->r3;
+  args[4] = tf->r4;
+  args[5] = tf->r5;
 }
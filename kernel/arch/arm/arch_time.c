@@ -1,4 +1,5 @@
 #include <arch/arm/mach.h>
+#include <kernel/core/hrtimer.h>
 #include <kernel/time.h>
 
 void
@@ -12,3 +13,77 @@ arch_get_time_seconds(void)
 {
   return mach_current->rtc_get_time();
 }
+
+/**
+ * Get the free-running counter of the machine, called after the timers have
+ * been initialized.
+ *
+ * @return Pointer to the clock source, or NULL if there is none.
+ */
+struct ClockSource *
+arch_clock_source(void)
+{
+  if (mach_current->clock_source == NULL)
+    return NULL;
+  return mach_current->clock_source();
+}
+
+/**
+ * Replace the periodic tick on the current CPU with a one-shot timer.
+ * 
+ * @param ticks The number of ticks until the timer interrupt.
+ * 
+ * @return 0 on success, -1 if the timer doesn't support one-shot mode.
+ */
+int
+k_arch_tick_stop(unsigned long ticks)
+{
+  if (mach_current->timer_set_oneshot == NULL)
+    return -1;
+
+  mach_current->timer_set_oneshot(ticks);
+  return 0;
+}
+
+/**
+ * Switch the timer on the current CPU back to periodic mode.
+ * 
+ * @return The number of whole ticks elapsed since the k_arch_tick_stop() call.
+ */
+unsigned long
+k_arch_tick_restart(void)
+{
+  return mach_current->timer_set_periodic();
+}
+
+/**
+ * Check whether the machine has a one-shot timer for the high-resolution
+ * timers.
+ */
+int
+k_arch_hrtimer_supported(void)
+{
+  return mach_current->hrtimer_set != NULL;
+}
+
+/**
+ * Get the monotonic time, in nanoseconds. The machines convert the deadlines
+ * for k_arch_hrtimer_set() from the same clock source.
+ */
+uint64_t
+k_arch_hrtimer_now(void)
+{
+  return time_monotonic();
+}
+
+/**
+ * Program the one-shot timer of the current CPU. When it fires, the machine
+ * calls k_hrtimer_irq().
+ *
+ * @param deadline The time of the interrupt, in nanoseconds.
+ */
+void
+k_arch_hrtimer_set(uint64_t deadline)
+{
+  mach_current->hrtimer_set(deadline);
+}
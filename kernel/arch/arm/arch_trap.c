@@ -14,11 +14,17 @@
 #include <kernel/interrupt.h>
 #include <kernel/time.h>
 #include <kernel/signal.h>
+#include <kernel/prof.h>
+#include <kernel/core/cpu.h>
 
+#include <arch/arm/fpu.h>
 #include <arch/arm/regs.h>
 
 static void trap_handle_abort(struct TrapFrame *);
 
+// The frame of the interrupt being handled by each CPU
+static struct TrapFrame *trap_irq_frames[K_CPU_MAX];
+
 /**
  * Common entry point for all traps, including system calls. The TrapFrame
  * structure is built on the stack in trapentry.S
@@ -26,8 +32,6 @@ static void trap_handle_abort(struct TrapFrame *);
 void
 trap(struct TrapFrame *tf)
 {
-  extern char *panicstr;
-
   struct KThread *my_thread = k_thread_current();
   struct Process *my_process = my_thread ? my_thread->process : NULL;
 
@@ -43,7 +47,7 @@ trap(struct TrapFrame *tf)
 
   // User-mode trap frame address should never change, there's logic in the
   // kernel that relies on this!
-  if (((tf->psr & PSR_M_MASK) == PSR_M_USR) && (my_process->thread->tf != tf))
+  if (((tf->psr & PSR_M_MASK) == PSR_M_USR) && (my_thread->tf != tf))
     panic("user-mode trap frame address unexpectedly changed");
 
   // Dispatch based on what type of trap occured.
@@ -58,9 +62,14 @@ trap(struct TrapFrame *tf)
     k_irq_disable();
     break;
   case T_IRQ:
+    trap_irq_frames[k_cpu_id()] = tf;
     interrupt_dispatch();
     break;
   case T_UNDEF:
+    // The first VFP/NEON instruction since the thread was switched in
+    if (arch_fpu_trap(tf))
+      break;
+
     if ((tf->psr & PSR_M_MASK) == PSR_M_USR) {
       // TODO: ILL_ILLOPC
       if (signal_generate(my_process->pid, SIGILL, 0) != 0)
@@ -74,10 +83,12 @@ trap(struct TrapFrame *tf)
   }
 
   if ((tf->psr & PSR_M_MASK) == PSR_M_USR) {
+    process_thread_check_exit();
     signal_deliver_pending();
 
     while (my_process->state != PROCESS_STATE_ACTIVE) {
       k_thread_suspend();
+      process_thread_check_exit();
       signal_deliver_pending();
     }
   }
@@ -104,8 +115,11 @@ trap_handle_abort(struct TrapFrame *tf)
   process = process_current();
   assert(process != NULL);
 
-  // Try to handle VM fault first (it may be caused by copy-on-write pages)
-  if (((status & 0xF) == 0xF) && vm_handle_fault(process->vm->pgtab, address) == 0) {
+  // Try to handle VM fault first (it may be caused by copy-on-write pages or
+  // the first access to anonymous memory)
+  if ((((status & 0xF) == 0xF) || ((status & 0xF) == 0x7)) &&
+      (vm_handle_fault(process->vm, address,
+                       (tf->trapno == T_DABT) && (status & DFSR_WNR)) == 0)) {
     return;
   }
 
@@ -175,25 +189,25 @@ print_trapframe(struct TrapFrame *tf)
   cprintf("  r12  %p    pc   %p\n", tf->r12, tf->pc);
 }
 
-int
-ipi_irq(int, void *)
-{
-  return 1;
-}
-
 int
 timer_irq(int, void *)
 {
-  struct Process *my_process = process_current();
+  struct KThread *my_thread = k_thread_current();
+  struct Process *my_process = my_thread ? my_thread->process : NULL;
+  struct TrapFrame *tf = trap_irq_frames[k_cpu_id()];
+  int user = (tf->psr & PSR_M_MASK) == PSR_M_USR;
+
+  prof_tick(tf->pc, user);
 
   if (my_process != NULL) {
-    if ((my_process->thread->tf->psr & PSR_M_MASK) != PSR_M_USR) {
+    if ((my_thread->tf->psr & PSR_M_MASK) != PSR_M_USR) {
       process_update_times(my_process, 0, 1);
     } else {
       process_update_times(my_process, 1, 0);
     }
   }
 
+  k_tick_account(user);
   k_tick();
 
   time_tick();
@@ -1,4 +1,7 @@
+#include <sys/perf.h>
+
 #include <kernel/core/cpu.h>
+#include <kernel/types.h>
 #include <arch/arm/regs.h>
 
 // In case of four Cortex-A9 processors, the CPU IDs are 0x0, 0x1, 0x2, and
@@ -8,3 +11,38 @@ k_arch_cpu_id(void)
 {
   return cp15_mpidr_get() & CP15_MPIDR_CPU_ID;
 }
+
+// Events counted by the event counters 0, 1, ... (see sys/perf.h)
+static const uint32_t arch_perf_events[PERF_COUNTER_MAX - 1] = {
+  PMU_EVENT_L1D_CACHE_REFILL,
+  PMU_EVENT_L1I_CACHE_REFILL,
+  PMU_EVENT_L1D_TLB_REFILL,
+  PMU_EVENT_BR_MIS_PRED,
+};
+
+// Start the cycle counter and the event counters on the current CPU
+void
+k_arch_cpu_init_percpu(void)
+{
+  uint32_t pmcr = cp15_pmcr_get();
+  uint32_t enable = CP15_PMCNTENSET_C;
+  unsigned i, n;
+
+  // Cortex-A8 implements four event counters, Cortex-A9 six
+  n = (pmcr & CP15_PMCR_N_MASK) >> CP15_PMCR_N_SHIFT;
+
+  for (i = 0; (i < n) && (i < ARRAY_SIZE(arch_perf_events)); i++) {
+    cp15_pmselr_set(i);
+    cp15_pmxevtyper_set(arch_perf_events[i]);
+    enable |= 1U << i;
+  }
+
+  cp15_pmcr_set(pmcr | CP15_PMCR_E | CP15_PMCR_C | CP15_PMCR_P);
+  cp15_pmcntenset_set(enable);
+}
+
+uint32_t
+k_arch_cpu_cycles(void)
+{
+  return cp15_pmccntr_get();
+}
@@ -0,0 +1,221 @@
+/**
+ * @file
+ * Lazy VFP/NEON context switching
+ *
+ * The VFP registers are not part of the kernel context, so switching between
+ * threads that never touch them costs nothing. Every thread starts its time
+ * slice with the unit disabled. Its first VFP or NEON instruction raises an
+ * Undefined Instruction exception, and arch_fpu_trap() then loads the thread's
+ * registers, enables the unit and restarts the instruction.
+ *
+ * A thread that has enabled the unit gets its registers saved when it is
+ * switched out, since it may resume on another processor. Each processor
+ * remembers whose registers it still holds, so a thread that comes back to
+ * the same processor, with no one else having used the unit there in the
+ * meantime, does not have to reload them.
+ *
+ * Kernel code may use the unit between arch_fpu_begin() and arch_fpu_end().
+ * Other kernel code must not touch it, except for memcpy(), which only uses
+ * NEON when the unit is already enabled and preserves the registers.
+ */
+
+#include <string.h>
+
+#include <kernel/core/cpu.h>
+#include <kernel/core/irq.h>
+#include <kernel/thread.h>
+
+#include <arch/trap.h>
+#include <arch/arm/fpu.h>
+#include <arch/arm/regs.h>
+
+// The thread whose state the VFP registers of each CPU hold, or NULL
+static struct KThread *arch_fpu_owner[K_CPU_MAX];
+
+// The compiler may be targeting a soft-float ABI, let the assembler accept VFP
+// and NEON instructions anyway
+#define FPU_ASM(insn)   ".fpu neon\n" insn
+
+static inline uint32_t
+arch_fpexc_get(void)
+{
+  uint32_t val;
+
+  asm volatile(FPU_ASM("vmrs %0, fpexc") : "=r" (val));
+  return val;
+}
+
+static inline void
+arch_fpexc_set(uint32_t val)
+{
+  asm volatile(FPU_ASM("vmsr fpexc, %0") : : "r" (val));
+}
+
+// VFPv3-D16 implementations only have the lower half of the registers
+static int
+arch_fpu_has_d32(void)
+{
+  uint32_t mvfr0;
+
+  asm volatile(FPU_ASM("vmrs %0, mvfr0") : "=r" (mvfr0));
+  return (mvfr0 & 0xF) == 2;
+}
+
+static void
+arch_fpu_store(struct FPUContext *fpu)
+{
+  asm volatile(FPU_ASM("vstmia %0, {d0-d15}")
+    : : "r" (&fpu->d[0]) : "memory");
+  if (arch_fpu_has_d32())
+    asm volatile(FPU_ASM("vstmia %0, {d16-d31}")
+      : : "r" (&fpu->d[16]) : "memory");
+  asm volatile(FPU_ASM("vmrs %0, fpscr") : "=r" (fpu->fpscr));
+}
+
+static void
+arch_fpu_load(const struct FPUContext *fpu)
+{
+  asm volatile(FPU_ASM("vldmia %0, {d0-d15}")
+    : : "r" (&fpu->d[0]) : "memory");
+  if (arch_fpu_has_d32())
+    asm volatile(FPU_ASM("vldmia %0, {d16-d31}")
+      : : "r" (&fpu->d[16]) : "memory");
+  asm volatile(FPU_ASM("vmsr fpscr, %0") : : "r" (fpu->fpscr));
+}
+
+/**
+ * Handle an Undefined Instruction exception that may have been caused by the
+ * first VFP or NEON instruction in a time slice. Must be called with
+ * interrupts disabled.
+ *
+ * @param tf The trap frame
+ *
+ * @return 1 if the instruction should be restarted, 0 if it is really
+ *         undefined.
+ */
+int
+arch_fpu_trap(struct TrapFrame *tf)
+{
+  struct KThread *thread = k_thread_current();
+  unsigned cpu = k_cpu_id();
+
+  // The unit has already been enabled, so the instruction is not valid
+  if ((thread == NULL) || (arch_fpexc_get() & FPEXC_EN))
+    return 0;
+
+  arch_fpexc_set(FPEXC_EN);
+
+  if ((arch_fpu_owner[cpu] != thread) || (thread->fpu.cpu != cpu)) {
+    arch_fpu_load(&thread->fpu);
+    arch_fpu_owner[cpu] = thread;
+    thread->fpu.cpu = cpu;
+  }
+
+  // trap_undef computed the address of a 4-byte ARM instruction, but Thumb
+  // mode reports the address of the undefined one plus 2
+  if (tf->psr & PSR_T)
+    tf->pc += 2;
+
+  return 1;
+}
+
+/**
+ * Save the VFP registers of the current thread if they may have been changed
+ * since they were loaded, so that thread->fpu is up to date.
+ *
+ * @param thread The current thread
+ */
+void
+arch_fpu_save(struct KThread *thread)
+{
+  if (arch_fpexc_get() & FPEXC_EN)
+    arch_fpu_store(&thread->fpu);
+}
+
+/**
+ * Forget the VFP registers loaded for the current thread, after its saved
+ * state has been replaced (e.g. by returning from a signal handler).
+ *
+ * @param thread The current thread
+ */
+void
+arch_fpu_discard(struct KThread *thread)
+{
+  k_irq_state_save();
+
+  arch_fpexc_set(0);
+  thread->fpu.cpu = K_CPU_MAX;
+
+  k_irq_state_restore();
+}
+
+/**
+ * Save the VFP registers of a thread that is being switched out and disable
+ * the unit, so that the next thread traps on first use. Called with the
+ * scheduler lock held.
+ *
+ * @param thread The thread that has been running
+ */
+void
+arch_thread_fpu_stop(struct KThread *thread)
+{
+  if (!(arch_fpexc_get() & FPEXC_EN))
+    return;
+
+  // The registers keep a copy, the owner stays the same
+  arch_fpu_store(&thread->fpu);
+  arch_fpexc_set(0);
+}
+
+/**
+ * Give a new thread a copy of the VFP state of the current one.
+ *
+ * @param thread  The new thread
+ * @param current The current thread
+ */
+void
+arch_thread_fpu_copy(struct KThread *thread, struct KThread *current)
+{
+  k_irq_state_save();
+
+  arch_fpu_save(current);
+  thread->fpu = current->fpu;
+  thread->fpu.cpu = K_CPU_MAX;
+
+  k_irq_state_restore();
+}
+
+/**
+ * Start using the VFP/NEON unit in the kernel. The registers of the current
+ * thread are saved first. Interrupts stay disabled until arch_fpu_end(), so
+ * the section must not sleep and should be short. Sections do not nest.
+ */
+void
+arch_fpu_begin(void)
+{
+  struct KThread *thread;
+
+  k_irq_state_save();
+
+  if (arch_fpexc_get() & FPEXC_EN) {
+    if ((thread = k_thread_current()) != NULL)
+      arch_fpu_store(&thread->fpu);
+  } else {
+    arch_fpexc_set(FPEXC_EN);
+  }
+
+  // The registers are about to be overwritten
+  arch_fpu_owner[k_cpu_id()] = NULL;
+}
+
+/**
+ * Stop using the VFP/NEON unit in the kernel. The current thread reloads its
+ * registers the next time it uses the unit.
+ */
+void
+arch_fpu_end(void)
+{
+  arch_fpexc_set(0);
+
+  k_irq_state_restore();
+}
@@ -5,41 +5,100 @@
 
 #include <arch/arm/regs.h>
 
-// ARMv7-specific code to acquire a spinlock
-void
-k_arch_spinlock_acquire(volatile int *locked)
+// ARMv7-specific code to acquire a ticket spinlock. Returns the number of
+// times the CPU had to wait for the lock holder to signal an event.
+unsigned long
+k_arch_spinlock_acquire(volatile uint32_t *tickets)
 {
-  int tmp1, tmp2;
+  unsigned long spins = 0;
+  uint32_t val, tmp1, tmp2;
 
   asm volatile(
-    "\tmov     %2, #1\n"        // Load the "lock acquired" value
     "\t1:\n"
-    "\tldrex   %1, [%0]\n"      // Read the lock field
-    "\tcmp     %1, #0\n"        // Is the lock free?
-    "\tbne     1b\n"            // No - try again
-    "\tstrex   %1, %2, [%0]\n"  // Try and acquire the lock
-    "\tcmp     %1, #0\n"        // Did this succeed?
+    "\tldrex   %0, [%3]\n"      // Read the lock word
+    "\tadd     %1, %0, %4\n"    // Take the next ticket
+    "\tstrex   %2, %1, [%3]\n"  // Try and store the new lock word
+    "\tteq     %2, #0\n"        // Did this succeed?
     "\tbne     1b\n"            // No - try again
-    : "+r"(locked), "=r"(tmp1), "=r"(tmp2)
-    :
+    : "=&r"(val), "=&r"(tmp1), "=&r"(tmp2)
+    : "r"(tickets), "I"(K_SPINLOCK_TICKET)
     : "memory", "cc");
+
+  // Sleep until the holder releases the lock and our ticket is being served.
+  // If the event has been signaled after reading the lock word, WFE returns
+  // immediately.
+  while (K_SPINLOCK_OWNER(*tickets) != K_SPINLOCK_NEXT(val)) {
+    asm volatile("wfe");
+    spins++;
+  }
+
+  asm volatile("dmb" ::: "memory");
+
+  return spins;
+}
+
+// ARMv7-specific code to acquire a ticket spinlock only if it is free. Returns
+// a non-zero value on success.
+int
+k_arch_spinlock_try_acquire(volatile uint32_t *tickets)
+{
+  uint32_t val, contended, res;
+
+  do {
+    asm volatile(
+      "\tldrex   %0, [%3]\n"          // Read the lock word
+      "\tmov     %2, #0\n"
+      "\tsubs    %1, %0, %0, ror #16\n" // Is the lock free?
+      "\taddeq   %0, %0, %4\n"        // Yes - take the next ticket
+      "\tstrexeq %2, %0, [%3]\n"      // And try to store the new lock word
+      : "=&r"(val), "=&r"(contended), "=&r"(res)
+      : "r"(tickets), "I"(K_SPINLOCK_TICKET)
+      : "memory", "cc");
+  } while (res != 0);
+
+  if (contended != 0)
+    return 0;
+
+  asm volatile("dmb" ::: "memory");
+
+  return 1;
 }
 
-// ARMv7-specific code to release a spinlock
+// ARMv7-specific code to release a ticket spinlock
 void
-k_arch_spinlock_release(volatile int *locked)
+k_arch_spinlock_release(volatile uint32_t *tickets)
 {
-  int tmp;
+  asm volatile("dmb" ::: "memory");
 
+  // Only the lock holder modifies the owner half of the lock word, so a plain
+  // halfword store is enough. The store also clears the exclusive monitors of
+  // other CPUs that are taking tickets at the same time.
+  *(volatile uint16_t *) tickets = K_SPINLOCK_OWNER(*tickets) + 1;
+
+  // Wake up the CPUs waiting for the lock
   asm volatile(
-    "\tmov     %1, #0\n"
-    "\tstr     %1, [%0]\n"
-    : "+r"(locked), "=r"(tmp)
-    :
-    : "cc", "memory"
-  );
+    "\tdsb\n"
+    "\tsev\n"
+    ::: "memory");
 }
 
+#ifdef KDEBUG_CFI
+
+// Without the frame pointer, walking the call frame information on every
+// acquisition would be far too slow, so only the immediate caller is recorded
+void
+k_arch_spinlock_save_callstack(struct KSpinLock *spin)
+{
+  int i;
+
+  spin->pcs[0] = (uintptr_t) __builtin_return_address(0);
+
+  for (i = 1; i < SPIN_MAX_PCS; i++)
+    spin->pcs[i] = 0;
+}
+
+#else   // !KDEBUG_CFI
+
 // Record the current call stack by following the frame pointer chain.
 // To properly generate stack backtrace structures, the code must be compiled
 // with the -mapcs-frame and -fno-omit-frame-pointer flags
@@ -60,6 +119,8 @@ k_arch_spinlock_save_callstack(struct KSpinLock *spin)
     spin->pcs[i] = 0;
 }
 
+#endif  // !KDEBUG_CFI
+
 static void
 print_info(uintptr_t pc)
 {
@@ -1,9 +1,11 @@
 #include <string.h>
 
+#include <kernel/core/cpu.h>
 #include <kernel/thread.h>
 #include <kernel/page.h>
 
 #include <arch/trap.h>
+#include <arch/arm/regs.h>
 
 void
 arch_thread_init_stack(struct KThread *thread, void (*entry)(void))
@@ -22,6 +24,10 @@ arch_thread_init_stack(struct KThread *thread, void (*entry)(void))
   thread->context = (struct Context *) sp;
   memset(thread->context, 0, sizeof(struct Context));
   thread->context->lr = (uint32_t) entry;
+
+  // Start with the default FPSCR and zero registers, loaded on first use
+  memset(&thread->fpu, 0, sizeof(thread->fpu));
+  thread->fpu.cpu = K_CPU_MAX;
 }
 
 void
@@ -29,3 +35,67 @@ arch_thread_idle(void)
 {
   asm volatile("wfi");
 }
+
+/**
+ * Make the user-mode thread pointer of the given thread visible to user code
+ * via the read-only TPIDRURO register.
+ */
+void
+arch_thread_load_tls(struct KThread *thread)
+{
+  cp15_tpidruro_set(thread->tls);
+}
+
+// The counters are never reset, so each CPU remembers their values when the
+// current thread started counting, and the thread is charged the difference
+static uint32_t arch_perf_start[K_CPU_MAX][PERF_COUNTER_MAX];
+
+static void
+arch_perf_read(uint32_t *values)
+{
+  unsigned i, n;
+
+  n = (cp15_pmcr_get() & CP15_PMCR_N_MASK) >> CP15_PMCR_N_SHIFT;
+
+  values[PERF_CYCLES] = cp15_pmccntr_get();
+
+  // Selecting an unimplemented counter is unpredictable, report zero instead
+  for (i = 1; i < PERF_COUNTER_MAX; i++) {
+    if (i > n) {
+      values[i] = 0;
+      continue;
+    }
+
+    cp15_pmselr_set(i - 1);
+    values[i] = cp15_pmxevcntr_get();
+  }
+}
+
+/**
+ * Start charging the performance counters to the given thread, which is about
+ * to run on the current CPU. Must be called with interrupts disabled.
+ */
+void
+arch_thread_perf_start(struct KThread *thread)
+{
+  (void) thread;
+
+  arch_perf_read(arch_perf_start[k_cpu_id()]);
+}
+
+/**
+ * Add the events counted since arch_thread_perf_start() to the given thread.
+ * Must be called with interrupts disabled.
+ */
+void
+arch_thread_perf_stop(struct KThread *thread)
+{
+  uint32_t *start = arch_perf_start[k_cpu_id()];
+  uint32_t now[PERF_COUNTER_MAX];
+  unsigned i;
+
+  arch_perf_read(now);
+
+  for (i = 0; i < PERF_COUNTER_MAX; i++)
+    thread->perf[i] += now[i] - start[i];
+}
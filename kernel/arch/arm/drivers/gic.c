@@ -10,6 +10,8 @@
 #define ICDIPR0       0x400       // Interrupt Priority Registers
 #define ICDIPTR0      0x800       // Interrupt Processor Targets Registers
 #define ICDSGIR       0xF00       // Software Generated Interrupt Register
+  #define ICDSGIR_OTHERS  (1U << 24)          //   All CPUs except self
+  #define ICDSGIR_CPU(n)  (1U << (16 + (n)))  //   Only the given CPU
 
 // CPU interface registers
 #define ICCICR        0x000       // CPU Interface Control Register
@@ -36,6 +38,14 @@ gic_icd_write(struct Gic *gic, uint32_t reg, uint32_t data)
   gic->icd[reg >> 2] = data;
 }
 
+// The priority and target registers hold one byte per interrupt, and writing
+// them by bytes leaves the neighbouring interrupts alone
+static inline void
+gic_icd_write8(struct Gic *gic, uint32_t reg, uint8_t data)
+{
+  ((volatile uint8_t *) gic->icd)[reg] = data;
+}
+
 void
 gic_init(struct Gic *gic, void *icc_base, void *icd_base)
 { 
@@ -63,10 +73,10 @@ void
 gic_setup(struct Gic *gic, unsigned irq, unsigned cpu)
 {
   // Set priority to 128 for all interrupts
-  gic_icd_write(gic, ICDIPR0  + irq, 0x80 << ((irq & 0x3) << 3));
+  gic_icd_write8(gic, ICDIPR0  + irq, 0x80);
 
   // Set target CPU
-  gic_icd_write(gic, ICDIPTR0 + irq, (1U << cpu) << ((irq & 0x3) << 3));
+  gic_icd_write8(gic, ICDIPTR0 + irq, 1U << cpu);
 }
 
 void
@@ -96,5 +106,11 @@ gic_eoi(struct Gic *gic, unsigned irq)
 void
 gic_sgi(struct Gic *gic, unsigned irq)
 {
-  gic_icd_write(gic, ICDSGIR, (1 << 24) | (0xF << 16) | irq);
+  gic_icd_write(gic, ICDSGIR, ICDSGIR_OTHERS | (0xF << 16) | irq);
+}
+
+void
+gic_sgi_cpu(struct Gic *gic, unsigned irq, unsigned cpu)
+{
+  gic_icd_write(gic, ICDSGIR, ICDSGIR_CPU(cpu) | irq);
 }
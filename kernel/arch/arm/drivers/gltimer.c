@@ -0,0 +1,99 @@
+// See ARM(R) Cortex(R)-A9 MPCore Technical Reference Manual, section 4.3
+// "Global timer"
+
+#include <arch/arm/gltimer.h>
+
+// Global timer registers
+#define COUNT_LO      0x000   // Global Timer Counter Register, low word
+#define COUNT_HI      0x004   // Global Timer Counter Register, high word
+#define CTRL          0x008   // Global Timer Control Register
+  #define CTRL_EN       (1U << 0)   // Timer Enable
+  #define CTRL_COMP     (1U << 1)   // Comparator Enable (banked)
+  #define CTRL_IRQEN    (1U << 2)   // IRQ Enable (banked)
+#define ISR           0x00C   // Global Timer Interrupt Status Register (banked)
+#define COMP_LO       0x010   // Comparator Value Register, low word (banked)
+#define COMP_HI       0x014   // Comparator Value Register, high word (banked)
+
+#define NS_PER_COUNT  (1000000000U / GLTIMER_FREQ)
+#define SET_MARGIN    100U          // Counts to add to a missed deadline
+
+static inline uint32_t
+gltimer_read(struct GlTimer *gltimer, uint32_t reg)
+{
+  return gltimer->base[reg >> 2];
+}
+
+static inline void
+gltimer_write(struct GlTimer *gltimer, uint32_t reg, uint32_t data)
+{
+  gltimer->base[reg >> 2] = data;
+}
+
+/**
+ * Start the counter shared by all CPUs. The counter runs at the peripheral
+ * clock rate, and each CPU has a comparator of its own.
+ */
+void
+gltimer_init(struct GlTimer *gltimer, void *base)
+{
+  gltimer->base = (volatile uint32_t *) base;
+
+  if (!(gltimer_read(gltimer, CTRL) & CTRL_EN))
+    gltimer_write(gltimer, CTRL, CTRL_EN);
+}
+
+/**
+ * Get the count since the counter was started, at GLTIMER_FREQ.
+ */
+uint64_t
+gltimer_count(struct GlTimer *gltimer)
+{
+  uint32_t hi, lo;
+
+  // The two halves cannot be read at once, retry if the low one wraps around
+  do {
+    hi = gltimer_read(gltimer, COUNT_HI);
+    lo = gltimer_read(gltimer, COUNT_LO);
+  } while (gltimer_read(gltimer, COUNT_HI) != hi);
+
+  return ((uint64_t) hi << 32) | lo;
+}
+
+/**
+ * Program the comparator of the current CPU to generate an interrupt at the
+ * given time.
+ *
+ * @param deadline The time, in nanoseconds
+ */
+void
+gltimer_set(struct GlTimer *gltimer, uint64_t deadline)
+{
+  uint64_t count = (deadline + NS_PER_COUNT - 1) / NS_PER_COUNT;
+  uint64_t now;
+
+  // Some revisions fire only when the counter equals the comparator, so a
+  // deadline the counter has already passed would never come. Check after
+  // programming and move the deadline a bit further if necessary.
+  for (;;) {
+    gltimer_write(gltimer, CTRL, CTRL_EN);
+    gltimer_write(gltimer, COMP_LO, (uint32_t) count);
+    gltimer_write(gltimer, COMP_HI, (uint32_t) (count >> 32));
+    gltimer_write(gltimer, CTRL, CTRL_EN | CTRL_COMP | CTRL_IRQEN);
+
+    if ((now = gltimer_count(gltimer)) < count)
+      break;
+
+    count = now + SET_MARGIN;
+  }
+}
+
+/**
+ * Clear the pending interrupt and disable the comparator of the current CPU
+ * until programmed again.
+ */
+void
+gltimer_eoi(struct GlTimer *gltimer)
+{
+  gltimer_write(gltimer, CTRL, CTRL_EN);
+  gltimer_write(gltimer, ISR, 1);
+}
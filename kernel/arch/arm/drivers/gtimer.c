@@ -0,0 +1,157 @@
+// See ARM(R) Architecture Reference Manual ARMv7-A and ARMv7-R edition,
+// Chapter B8 "The Generic Timer"
+
+#include <arch/arm/gtimer.h>
+#include <arch/arm/regs.h>
+#include <kernel/core/percpu.h>
+#include <kernel/time.h>
+
+// Virtual timer control register bits
+#define CTL_ENABLE    (1U << 0)   // Timer enable
+#define CTL_IMASK     (1U << 1)   // Interrupt mask
+#define CTL_ISTATUS   (1U << 2)   // Timer condition met
+
+// The timer has no reload register, each CPU remembers the compare value it
+// has programmed last and the time the one-shot timer was set
+static __percpu uint64_t gtimer_deadline;
+static __percpu uint64_t gtimer_start;
+
+// The number of counter increments per one tick
+static inline uint64_t
+gtimer_tick_counts(struct GTimer *gtimer, int rate)
+{
+  return gtimer->freq / rate;
+}
+
+/**
+ * Initialize the Generic Timer driver. The counter frequency is programmed
+ * into CNTFRQ by the firmware (or the emulator).
+ */
+void
+gtimer_init(struct GTimer *gtimer)
+{
+  gtimer->freq = cp15_cntfrq_get();
+}
+
+/**
+ * Start generating periodic interrupts with the virtual timer of the current
+ * CPU.
+ */
+void
+gtimer_init_percpu(struct GTimer *gtimer, int rate)
+{
+  uint64_t *deadline = K_PERCPU_THIS(gtimer_deadline);
+
+  *deadline = cp15_cntvct_get() + gtimer_tick_counts(gtimer, rate);
+  cp15_cntv_cval_set(*deadline);
+  cp15_cntv_ctl_set(CTL_ENABLE);
+
+  // Let user programs read the count for clock_gettime(CLOCK_MONOTONIC)
+  cp15_cntkctl_set(cp15_cntkctl_get() | CP15_CNTKCTL_PL0PCTEN);
+}
+
+/**
+ * Program the virtual timer of the current CPU to generate a single interrupt
+ * after the specified number of ticks.
+ */
+void
+gtimer_set_oneshot(struct GTimer *gtimer, int rate, unsigned long ticks)
+{
+  uint64_t *deadline = K_PERCPU_THIS(gtimer_deadline);
+  uint64_t *start    = K_PERCPU_THIS(gtimer_start);
+
+  *start    = cp15_cntvct_get();
+  *deadline = *start + ticks * gtimer_tick_counts(gtimer, rate);
+  cp15_cntv_cval_set(*deadline);
+  cp15_cntv_ctl_set(CTL_ENABLE);
+}
+
+/**
+ * Switch the virtual timer of the current CPU back to the periodic mode.
+ * 
+ * @return The number of whole ticks elapsed since the one-shot timer was
+ *         programmed.
+ */
+unsigned long
+gtimer_set_periodic(struct GTimer *gtimer, int rate)
+{
+  uint64_t start = *K_PERCPU_THIS(gtimer_start);
+  uint64_t now   = cp15_cntvct_get();
+
+  gtimer_init_percpu(gtimer, rate);
+
+  return (now - start) / gtimer_tick_counts(gtimer, rate);
+}
+
+/**
+ * Clear the virtual timer interrupt by moving the deadline one tick forward.
+ * The interrupt is level-sensitive and stays asserted until then.
+ */
+void
+gtimer_eoi(struct GTimer *gtimer, int rate)
+{
+  uint64_t *deadline = K_PERCPU_THIS(gtimer_deadline);
+  uint64_t counts    = gtimer_tick_counts(gtimer, rate);
+  uint64_t now       = cp15_cntvct_get();
+
+  // Count from the previous deadline rather than from now to avoid drift, but
+  // do not schedule the next interrupt in the past if ticks were missed
+  *deadline += counts;
+  if (*deadline <= now)
+    *deadline = now + counts;
+
+  cp15_cntv_cval_set(*deadline);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * High-resolution timer
+ * ----------------------------------------------------------------------------
+ *
+ * The virtual timer generates the ticks, the physical timer of each CPU is
+ * free for the one-shot high-resolution timer. Both compare against the
+ * physical count here, so the times are the same on all CPUs.
+ */
+
+/**
+ * Get the physical count, the clock source of the machine (see
+ * arch_clock_source). The count runs at gtimer->freq since the counter was
+ * started.
+ */
+uint64_t
+gtimer_count(struct GTimer *gtimer)
+{
+  (void) gtimer;
+  return cp15_cntpct_get();
+}
+
+/**
+ * Program the physical timer of the current CPU to generate an interrupt at
+ * the given time. If the time has passed, the interrupt comes at once.
+ *
+ * @param deadline The time, in nanoseconds
+ */
+void
+gtimer_hr_set(struct GTimer *gtimer, uint64_t deadline)
+{
+  uint64_t count;
+
+  // Round up, so that the interrupt never comes early
+  count = (deadline / NS_PER_SECOND) * gtimer->freq +
+          ((deadline % NS_PER_SECOND) * gtimer->freq + NS_PER_SECOND - 1) /
+          NS_PER_SECOND;
+
+  cp15_cntp_cval_set(count);
+  cp15_cntp_ctl_set(CTL_ENABLE);
+}
+
+/**
+ * Clear the physical timer interrupt. The interrupt is level-sensitive, so the
+ * timer is disabled until programmed again.
+ */
+void
+gtimer_hr_eoi(struct GTimer *gtimer)
+{
+  (void) gtimer;
+  cp15_cntp_ctl_set(0);
+}
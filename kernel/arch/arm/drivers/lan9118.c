@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -13,6 +14,8 @@
 
 #include <arch/arm/lan9118.h>
 
+#include <lwip/pbuf.h>
+
 // RX an TX FIFO ports, divided by 4 for use as uint32_t[] indices
 #define RX_DATA_FIFO_PORT   (0x00 / 4)
 #define TX_DATA_FIFO_PORT   (0x20 / 4)
@@ -55,6 +58,9 @@
 #define INT_EN              (0x5C / 4)    // Interrupt Enable
 #define BYTE_TEST           (0x64 / 4)    // Read-only byte order testing
 #define FIFO_INT            (0x68 / 4)    // FIFO Level Interrupts
+#define   FIFO_INT_TDAL_SHIFT 24          //   TX Data Available Level
+#define   FIFO_INT_TDAL_MASK  (0xFF << 24)
+#define   FIFO_INT_TSL_SHIFT  16          //   TX Status Level
 #define RX_CFG              (0x6C / 4)    // Receive Configuration
 #define   RX_CFG_RX_DUMP      (1 << 15)   //   Force RX Discard
 #define TX_CFG              (0x70 / 4)    // Transmit Configuration
@@ -68,6 +74,8 @@
 #define RX_DP_CTL           (0x78 / 4)    // RX Datapath Control
 #define RX_FIFO_INF         (0x7C / 4)    // Receive FIFO Information
 #define TX_FIFO_INF         (0x80 / 4)    // Transmit FIFO Information
+#define   TX_FIFO_INF_TDFREE(x)   ((x) & 0xFFFF)          // Data FIFO free
+#define   TX_FIFO_INF_TXSUSED(x)  (((x) >> 16) & 0xFF)    // Status FIFO used
 #define PMT_CTRL            (0x84 / 4)    // Power Management Control
 #define   PMT_CTRL_MODE_MASK  (3 << 12)   // Power Management Mode bitmask
 #define   PMT_CTRL_PHY_RST    (1 << 10) 
@@ -103,7 +111,21 @@
 #define MAC_MII_DATA        7
 #define MAC_FLOW            8
 
-static int eth_irq_thread(int, void *);
+// TX command words
+#define TX_CMD_A_OFFSET_SHIFT 16          // Data Start Offset
+#define TX_CMD_A_FIRST_SEG  (1 << 13)     // First Segment
+#define TX_CMD_A_LAST_SEG   (1 << 12)     // Last Segment
+#define TX_CMD_B_TAG_SHIFT  16            // Packet Tag
+
+// TX status word
+#define TX_STS_ES           (1 << 15)     // Error Status
+
+// Raise TSFL_INT once this many TX status words are pending
+#define TX_STATUS_LEVEL     16
+
+static int  eth_irq_thread(int, void *);
+static void eth_rx_poll(void *);
+static void eth_rx_discard(struct Lan9118 *, uint32_t);
 
 // Read from a MAC register
 uint32_t
@@ -189,6 +211,12 @@ lan9118_init(struct Lan9118 *lan9118)
 
   lan9118->base = (volatile uint32_t *) PA2KVA(PHYS_ETH);
 
+  k_spinlock_init(&lan9118->lock, "lan9118");
+  lan9118->tx_head   = 0;
+  lan9118->tx_count  = 0;
+  lan9118->tx_tag    = 0;
+  memset(&lan9118->stats, 0, sizeof(lan9118->stats));
+
   // Write BYTE_TEST to wake chip up in case it is in sleep mode.
   lan9118->base[BYTE_TEST] = 0;
 
@@ -234,54 +262,284 @@ lan9118_init(struct Lan9118 *lan9118)
   mac_cr |= (MAC_CR_TXEN | MAC_CR_RXEN);
   mac_write(lan9118, MAC_CR, mac_cr);
 
-  lan9118->base[FIFO_INT] = 0xFF000000;
+  lan9118->base[FIFO_INT] = (0xFF << FIFO_INT_TDAL_SHIFT) |
+                            (TX_STATUS_LEVEL << FIFO_INT_TSL_SHIFT);
 
-  // Enable interrupts
-  lan9118->base[INT_EN] |= RSFL_INT;
+  // Enable interrupts. RSFL_INT is masked while polling, and TDFA_INT is only
+  // enabled while the TX queue is not empty
+  lan9118->base[INT_EN] |= RSFL_INT | TSFL_INT;
 
   interrupt_attach_thread(IRQ_ETH, eth_irq_thread, lan9118);
 }
 
-static void
-eth_rx(struct Lan9118 *lan9118)
+/*
+ * ----------------------------------------------------------------------------
+ * Receive
+ * ----------------------------------------------------------------------------
+ *
+ * Reception works in the NAPI style. The first RSFL_INT masks itself and
+ * schedules a poll in the lwIP thread, which then drains a limited number of
+ * frames at a time and hands them to the stack directly, rescheduling itself
+ * for as long as frames keep arriving. The interrupt is re-enabled only once
+ * the RX FIFO is empty, so a packet flood costs one interrupt rather than one
+ * per frame, and the other lwIP work gets its turn between the polls.
+ */
+
+// Receive up to budget frames, return the number of frames removed from the
+// RX FIFO
+static unsigned
+eth_rx(struct Lan9118 *lan9118, unsigned budget)
 {
-  uint32_t rx_used;
-  
-  rx_used = (lan9118->base[RX_FIFO_INF] >> 16) & 0xFF;
+  unsigned count;
+
+  for (count = 0; count < budget; count++) {
+    uint32_t rx_status, packet_len, *data;
 
-  while(rx_used > 0) {
-    uint32_t rx_status, packet_len;
+    if (((lan9118->base[RX_FIFO_INF] >> 16) & 0xFF) == 0)
+      break;
 
     rx_status = lan9118->base[RX_STATUS_FIFO_PORT];
     packet_len = (rx_status >> 16) & 0x3FFF;
 
-    if (rx_status & (1 << 15)) {
-      // Packet has error: discard and update status
-      uint32_t i, tmp;
-
-      for (i = ROUND_UP(packet_len, sizeof(uint32_t)); i > 0; i -= sizeof(uint32_t))
-        tmp = lan9118->base[RX_DATA_FIFO_PORT];
-      (void) tmp;
+    if ((rx_status & (1 << 15)) || (packet_len > NET_RX_BUFFER_SIZE)) {
+      lan9118->stats.rx_errors++;
+      eth_rx_discard(lan9118, packet_len);
+    } else if ((data = (uint32_t *) net_rx_buffer_alloc()) == NULL) {
+      lan9118->stats.rx_dropped++;
+      eth_rx_discard(lan9118, packet_len);
     } else {
       uint32_t i;
-      struct Page *p;
-      uint32_t *data;
-      uint8_t *packet;
-  
-      p = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_ETH_RX);
-      packet = (uint8_t *) page2kva(p);
-      data = (uint32_t *) page2kva(p);
+      void *packet = data;
 
+      // Drain the FIFO straight into the buffer handed to the stack
       for (i = ROUND_UP(packet_len, sizeof(uint32_t)); i > 0; i -= sizeof(uint32_t))
         *data++ = lan9118->base[RX_DATA_FIFO_PORT];
 
-      net_enqueue(packet, packet_len);
+      net_rx_buffer_input(packet, packet_len);
+      lan9118->stats.rx_frames++;
+    }
+  }
+
+  // The counter is cleared on read
+  lan9118->stats.rx_overruns += lan9118->base[RX_DROP];
+
+  return count;
+}
+
+// Remove a frame that cannot be passed up from the RX data FIFO
+static void
+eth_rx_discard(struct Lan9118 *lan9118, uint32_t packet_len)
+{
+  uint32_t i, tmp;
+
+  for (i = ROUND_UP(packet_len, sizeof(uint32_t)); i > 0; i -= sizeof(uint32_t))
+    tmp = lan9118->base[RX_DATA_FIFO_PORT];
+  (void) tmp;
+}
+
+// Switch reception back to interrupts. RSFL_INT is acknowledged before the
+// poll starts, so a frame that arrived after the last check raises the
+// interrupt right away.
+static void
+eth_rx_irq_enable(struct Lan9118 *lan9118)
+{
+  k_spinlock_acquire(&lan9118->lock);
+  lan9118->base[INT_EN] |= RSFL_INT;
+  k_spinlock_release(&lan9118->lock);
+}
+
+// Runs in the lwIP thread
+static void
+eth_rx_poll(void *arg)
+{
+  struct Lan9118 *lan9118 = (struct Lan9118 *) arg;
+
+  // The budget is used up, so there are probably more frames to come
+  if ((eth_rx(lan9118, LAN9118_RX_BUDGET) == LAN9118_RX_BUDGET) &&
+      (net_rx_poll_schedule(eth_rx_poll, lan9118) == 0))
+    return;
+
+  eth_rx_irq_enable(lan9118);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Transmit
+ * ----------------------------------------------------------------------------
+ *
+ * Each pbuf of the chain is written into the TX data FIFO as a separate buffer
+ * of the same frame, so no intermediate copy is needed. The transmitter is
+ * left running, and frames are submitted back to back for as long as there is
+ * room in the data FIFO. Frames that do not fit wait in the TX queue until
+ * TDFA_INT reports that enough space has been freed up. Status words are
+ * drained (TSFL_INT) so the status FIFO never fills up and stalls the
+ * transmitter.
+ */
+
+// Get the number of TX data FIFO bytes needed to hold the frame
+static size_t
+eth_tx_space(struct pbuf *p)
+{
+  struct pbuf *q;
+  size_t n = 0;
+
+  for (q = p; q != NULL; q = q->next) {
+    if (q->len == 0)
+      continue;
+
+    n += 2 * sizeof(uint32_t) +
+         ROUND_UP(((uintptr_t) q->payload & 0x3) + q->len, sizeof(uint32_t));
+  }
+
+  return n;
+}
+
+// Write the frame into the TX data FIFO
+static void
+eth_tx_frame(struct Lan9118 *lan9118, struct pbuf *p)
+{
+  struct pbuf *q;
+  uint32_t cmd_b, first;
+  size_t left;
+
+  cmd_b = ((uint32_t) lan9118->tx_tag++ << TX_CMD_B_TAG_SHIFT) | p->tot_len;
+  first = TX_CMD_A_FIRST_SEG;
+  left  = p->tot_len;
+
+  for (q = p; (q != NULL) && (left > 0); q = q->next) {
+    const uint32_t *data;
+    uint32_t offset, cmd_a, i;
+
+    if (q->len == 0)
+      continue;
+
+    left -= q->len;
+
+    // The device skips the leading bytes, so the data can be read by words
+    offset = (uintptr_t) q->payload & 0x3;
+    data   = (const uint32_t *) ((uintptr_t) q->payload - offset);
+
+    cmd_a = (offset << TX_CMD_A_OFFSET_SHIFT) | first | q->len;
+    if (left == 0)
+      cmd_a |= TX_CMD_A_LAST_SEG;
+    first = 0;
+
+    lan9118->base[TX_DATA_FIFO_PORT] = cmd_a;
+    lan9118->base[TX_DATA_FIFO_PORT] = cmd_b;
 
-      page_free_one(p);
+    for (i = ROUND_UP(offset + q->len, sizeof(uint32_t)); i > 0; i -= sizeof(uint32_t))
+      lan9118->base[TX_DATA_FIFO_PORT] = *data++;
+  }
+}
+
+// Drain the TX status FIFO
+static void
+eth_tx_status(struct Lan9118 *lan9118)
+{
+  uint32_t used;
+
+  used = TX_FIFO_INF_TXSUSED(lan9118->base[TX_FIFO_INF]);
+
+  for ( ; used > 0; used--)
+    if (lan9118->base[TX_STATUS_FIFO_PORT] & TX_STS_ES)
+      lan9118->stats.tx_errors++;
+}
+
+// Move as many queued frames into the TX data FIFO as there is space for. If
+// some frames are left, ask for an interrupt once the head one fits.
+static void
+eth_tx_submit(struct Lan9118 *lan9118)
+{
+  size_t space, free_space;
+
+  free_space = TX_FIFO_INF_TDFREE(lan9118->base[TX_FIFO_INF]);
+
+  while (lan9118->tx_count > 0) {
+    struct pbuf *p = lan9118->tx_queue[lan9118->tx_head];
+
+    if ((space = eth_tx_space(p)) > free_space) {
+      uint32_t level = MIN(ROUND_UP(space, 64) / 64, 0xFFU);
+
+      lan9118->base[FIFO_INT] = (lan9118->base[FIFO_INT] & ~FIFO_INT_TDAL_MASK) |
+                                (level << FIFO_INT_TDAL_SHIFT);
+      lan9118->base[INT_STS] = TDFA_INT;
+      lan9118->base[INT_EN] |= TDFA_INT;
+      return;
     }
 
-    rx_used = (lan9118->base[RX_FIFO_INF] >> 16) & 0xFF;
+    eth_tx_frame(lan9118, p);
+    lan9118->stats.tx_frames++;
+    free_space -= space;
+
+    lan9118->tx_head = (lan9118->tx_head + 1) % LAN9118_TX_QUEUE_SIZE;
+    lan9118->tx_count--;
+
+    pbuf_free(p);
+  }
+
+  lan9118->base[INT_EN] &= ~TDFA_INT;
+}
+
+/**
+ * Transmit a frame.
+ *
+ * The frame is written into the device immediately if there is enough room in
+ * the TX data FIFO. Otherwise, the driver takes a reference to the pbuf chain
+ * and queues it until space frees up.
+ *
+ * @param lan9118 Pointer to the device
+ * @param p       The pbuf chain holding the frame
+ *
+ * @retval 0       Success
+ * @retval -ENOBUFS The TX queue is full
+ */
+int
+lan9118_write(struct Lan9118 *lan9118, struct pbuf *p)
+{
+  int r = 0;
+
+  k_spinlock_acquire(&lan9118->lock);
+
+  // Keep the status FIFO from filling up between TSFL interrupts
+  eth_tx_status(lan9118);
+
+  if ((lan9118->tx_count == 0) &&
+      (eth_tx_space(p) <= TX_FIFO_INF_TDFREE(lan9118->base[TX_FIFO_INF]))) {
+    eth_tx_frame(lan9118, p);
+    lan9118->stats.tx_frames++;
+  } else if (lan9118->tx_count < LAN9118_TX_QUEUE_SIZE) {
+    unsigned tail;
+
+    tail = (lan9118->tx_head + lan9118->tx_count) % LAN9118_TX_QUEUE_SIZE;
+
+    pbuf_ref(p);
+    lan9118->tx_queue[tail] = p;
+    lan9118->tx_count++;
+    lan9118->stats.tx_stalls++;
+
+    eth_tx_submit(lan9118);
+  } else {
+    lan9118->stats.tx_dropped++;
+    r = -ENOBUFS;
   }
+
+  k_spinlock_release(&lan9118->lock);
+
+  return r;
+}
+
+/**
+ * Get a snapshot of the driver counters.
+ *
+ * @param lan9118 Pointer to the device
+ * @param stats   Where to store the counters
+ */
+void
+lan9118_stats(struct Lan9118 *lan9118, struct NetIfStats *stats)
+{
+  k_spinlock_acquire(&lan9118->lock);
+  *stats = lan9118->stats;
+  k_spinlock_release(&lan9118->lock);
 }
 
 static int
@@ -302,42 +560,29 @@ eth_irq_thread(int irq, void *arg)
   status = lan9118->base[INT_STS] & lan9118->base[INT_EN];
 
   if (status & RSFL_INT) {
-    eth_rx(lan9118);
-    lan9118->base[INT_STS] |= RSFL_INT;
-  }
+    k_spinlock_acquire(&lan9118->lock);
+    lan9118->base[INT_EN] &= ~RSFL_INT;
+    k_spinlock_release(&lan9118->lock);
 
-  if (status & ~(RSFL_INT))
-    panic("Unexpected interupt %x", status & ~(RSFL_INT));
-
-  return 1;
-}
+    lan9118->base[INT_STS] = RSFL_INT;
 
-void
-lan9118_write(struct Lan9118 *lan9118, const void *buf, size_t n)
-{
-  (void) lan9118;
-
-  static int last_tag;
-  
-  uint32_t *data;
-  uint32_t cmd_a, cmd_b;
-
-  data = (uint32_t *) buf;
-
-  cmd_a = (((uintptr_t) buf & 0x3) << 16) | 0x00003000 | (n + 14);
-  cmd_b = (last_tag++ << 16) | (n + 14);
-
-  k_irq_state_save();
-
-  lan9118->base[TX_DATA_FIFO_PORT] = cmd_a;
-  lan9118->base[TX_DATA_FIFO_PORT] = cmd_b;
+    // If no poll can be scheduled, try again on the next frame
+    if (net_rx_poll_schedule(eth_rx_poll, lan9118) != 0)
+      eth_rx_irq_enable(lan9118);
+  }
 
-  for (uint32_t i = (n+14+3)/sizeof(uint32_t); i > 0; i--)
-    lan9118->base[TX_DATA_FIFO_PORT] = *data++;
+  if (status & (TSFL_INT | TDFA_INT)) {
+    // Acknowledge first, so that any later events raise a new interrupt
+    lan9118->base[INT_STS] = status & (TSFL_INT | TDFA_INT);
 
-  lan9118->base[TX_CFG] = TX_CFG_TX_ON;
+    k_spinlock_acquire(&lan9118->lock);
+    eth_tx_status(lan9118);
+    eth_tx_submit(lan9118);
+    k_spinlock_release(&lan9118->lock);
+  }
 
-  lan9118->base[TX_CFG] = TX_CFG_STOP_TX;
+  if (status & ~(RSFL_INT | TSFL_INT | TDFA_INT))
+    panic("Unexpected interupt %x", status & ~(RSFL_INT | TSFL_INT | TDFA_INT));
 
-  k_irq_state_restore();
+  return 1;
 }
@@ -19,6 +19,7 @@
 #define   UARTCR_RXE        (1U << 9)   //   Receive enable
 #define UARTIMSC          (0x038 / 4)   // Interrupt Mask Set/Clear Register
 #define   UARTIMSC_RXIM     (1U << 4)   //   Receive interrupt mask
+#define   UARTIMSC_TXIM     (1U << 5)   //   Transmit interrupt mask
 
 /**
  * Initialize the UART driver.
@@ -78,6 +79,38 @@ pl011_write(void *ctx, int data)
   return 0;
 }
 
+/**
+ * Check whether the transmit FIFO can take another character.
+ *
+ * @param pl011 Pointer to the UART driver instance.
+ * @return Nonzero if the FIFO is not full, zero otherwise.
+ */
+static int
+pl011_tx_ready(void *ctx)
+{
+  struct Pl011 *pl011 = (struct Pl011 *) ctx;
+
+  return !(pl011->base[UARTFR] & UARTFR_TXFF);
+}
+
+/**
+ * Enable or disable the transmit interrupt. While enabled, the interrupt is
+ * asserted as long as the FIFO is filled below the trigger level.
+ *
+ * @param pl011 Pointer to the UART driver instance.
+ * @param enable Whether to enable the interrupt.
+ */
+static void
+pl011_tx_irq_enable(void *ctx, int enable)
+{
+  struct Pl011 *pl011 = (struct Pl011 *) ctx;
+
+  if (enable)
+    pl011->base[UARTIMSC] |= UARTIMSC_TXIM;
+  else
+    pl011->base[UARTIMSC] &= ~UARTIMSC_TXIM;
+}
+
 /**
  * Read a data character from the UART device.
  * 
@@ -97,6 +130,8 @@ pl011_read(void *ctx)
 }
 
 struct UartOps pl011_ops = {
-  .read = pl011_read,
-  .write = pl011_write,
+  .read          = pl011_read,
+  .write         = pl011_write,
+  .tx_ready      = pl011_tx_ready,
+  .tx_irq_enable = pl011_tx_irq_enable,
 };
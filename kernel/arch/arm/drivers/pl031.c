@@ -0,0 +1,49 @@
+// See the PrimeCell Real Time Clock (PL031) Technical Reference Manual
+
+#include <arch/arm/pl031.h>
+
+// RTC registers, divided by 4 for use as uint32_t[] indicies
+#define RTCDR             (0x000 / 4)   // Data Register
+#define RTCLR             (0x008 / 4)   // Load Register
+#define RTCCR             (0x00C / 4)   // Control Register
+#define   RTCCR_START       (1U << 0)   //   Start the counter
+
+/**
+ * Initialize the RTC driver.
+ *
+ * @param pl031 Pointer to the RTC driver instance.
+ * @param base  Memory base address.
+ */
+void
+pl031_init(struct PL031 *pl031, void *base)
+{
+  pl031->base = (volatile uint32_t *) base;
+
+  // The counter keeps running once started, even across a reset
+  pl031->base[RTCCR] = RTCCR_START;
+}
+
+/**
+ * Get the current time.
+ *
+ * @param pl031 Pointer to the RTC driver instance.
+ *
+ * @return The number of seconds since the Epoch.
+ */
+time_t
+pl031_get_time(struct PL031 *pl031)
+{
+  return (time_t) pl031->base[RTCDR];
+}
+
+/**
+ * Set the current time.
+ *
+ * @param pl031 Pointer to the RTC driver instance.
+ * @param time  The number of seconds since the Epoch.
+ */
+void
+pl031_set_time(struct PL031 *pl031, time_t time)
+{
+  pl031->base[RTCLR] = (uint32_t) time;
+}
@@ -0,0 +1,268 @@
+#include <errno.h>
+
+#include <kernel/interrupt.h>
+#include <kernel/mm/memlayout.h>
+#include <kernel/spinlock.h>
+
+#include <arch/arm/cache.h>
+#include <arch/arm/pl080.h>
+#include <arch/arm/regs.h>
+
+/*******************************************************************************
+ * ARM PrimeCell DMA Controller (PL080/PL081) driver.
+ *
+ * Each transfer is described by a chain of linked list items kept in the
+ * channel structure, one item per memory segment (or per 4095 words of it).
+ * The controller acts as the flow controller and raises the terminal count
+ * interrupt after the last item, at which point the completion callback is
+ * invoked in interrupt context.
+ *
+ * See ARM PrimeCell DMA Controller (PL080) Technical Reference Manual.
+ ******************************************************************************/
+
+// DMAC registers, divided by 4 for use as uint32_t[] indices
+enum {
+  DMAC_INT_STATUS       = (0x000 / 4),  // Interrupt status register
+  DMAC_INT_TC_STATUS    = (0x004 / 4),  // Terminal count interrupt status
+  DMAC_INT_TC_CLEAR     = (0x008 / 4),  // Terminal count interrupt clear
+  DMAC_INT_ERR_STATUS   = (0x00C / 4),  // Error interrupt status
+  DMAC_INT_ERR_CLEAR    = (0x010 / 4),  // Error interrupt clear
+  DMAC_ENBLD_CHNS       = (0x01C / 4),  // Enabled channel register
+  DMAC_CONFIGURATION    = (0x030 / 4),  // Configuration register
+};
+
+// Channel registers, relative to DMAC_CHANNEL(n)
+enum {
+  DMAC_CH_SRC_ADDR      = (0x000 / 4),  // Channel source address
+  DMAC_CH_DEST_ADDR     = (0x004 / 4),  // Channel destination address
+  DMAC_CH_LLI           = (0x008 / 4),  // Channel linked list item
+  DMAC_CH_CONTROL       = (0x00C / 4),  // Channel control register
+  DMAC_CH_CONFIGURATION = (0x010 / 4),  // Channel configuration register
+};
+
+#define DMAC_CHANNEL(n)   ((0x100 + (n) * 0x20) / 4)
+
+// Configuration register bits
+enum {
+  DMAC_CONFIG_E = (1 << 0),             // DMAC enable
+};
+
+// Channel control register bits
+enum {
+  DMAC_CONTROL_SIZE_MAX = 0xFFF,        // Maximum transfer size (in words)
+  DMAC_CONTROL_SB8      = (2 << 12),    // Source burst size: 8 transfers
+  DMAC_CONTROL_DB8      = (2 << 15),    // Destination burst size: 8 transfers
+  DMAC_CONTROL_SW32     = (2 << 18),    // Source width: 32 bits
+  DMAC_CONTROL_DW32     = (2 << 21),    // Destination width: 32 bits
+  DMAC_CONTROL_SI       = (1 << 26),    // Source increment
+  DMAC_CONTROL_DI       = (1 << 27),    // Destination increment
+  DMAC_CONTROL_I        = (1U << 31),   // Terminal count interrupt enable
+};
+
+// Channel configuration register bits
+enum {
+  DMAC_CH_CONFIG_E      = (1 << 0),     // Channel enable
+  DMAC_CH_CONFIG_IE     = (1 << 14),    // Interrupt error mask
+  DMAC_CH_CONFIG_ITC    = (1 << 15),    // Terminal count interrupt mask
+};
+
+#define DMAC_CH_CONFIG_SRC_PERIPH(n)  ((n) << 1)
+#define DMAC_CH_CONFIG_DST_PERIPH(n)  ((n) << 6)
+#define DMAC_CH_CONFIG_FLOW(n)        ((n) << 11)
+
+static int pl080_irq(int, void *);
+
+/**
+ * Initialize the DMA controller driver.
+ *
+ * @param dmac Pointer to the driver instance.
+ * @param base Memory base address.
+ * @param irq  The combined interrupt line.
+ *
+ * @return 0 on success, a non-zero value on error.
+ */
+int
+pl080_init(struct PL080 *dmac, void *base, int irq)
+{
+  unsigned i;
+
+  dmac->base = (volatile uint32_t *) base;
+  k_spinlock_init(&dmac->lock, "pl080");
+
+  for (i = 0; i < PL080_CHANNELS; i++) {
+    dmac->base[DMAC_CHANNEL(i) + DMAC_CH_CONFIGURATION] = 0;
+    dmac->channels[i].callback = NULL;
+  }
+
+  dmac->base[DMAC_INT_TC_CLEAR]  = 0xFF;
+  dmac->base[DMAC_INT_ERR_CLEAR] = 0xFF;
+  dmac->base[DMAC_CONFIGURATION] = DMAC_CONFIG_E;
+
+  interrupt_attach(irq, pl080_irq, dmac);
+
+  return 0;
+}
+
+/**
+ * Start a transfer between memory and a peripheral.
+ *
+ * @param dmac        Pointer to the driver instance.
+ * @param channel     The channel number.
+ * @param type        PL080_MEM_TO_PERIPH or PL080_PERIPH_TO_MEM.
+ * @param periph      The peripheral request line.
+ * @param periph_addr Physical address of the peripheral data register.
+ * @param segs        The memory segments (physical addresses).
+ * @param n           The number of segments.
+ * @param callback    The function to call in interrupt context when the
+ *                    transfer completes, receives a non-zero value on error.
+ * @param arg         The callback argument.
+ *
+ * @retval 0       Success.
+ * @retval -EBUSY  The channel is busy.
+ * @retval -EINVAL The segments do not fit into the linked list.
+ */
+int
+pl080_start(struct PL080 *dmac, unsigned channel, int type, unsigned periph,
+            uint32_t periph_addr, const struct PL080Segment *segs, unsigned n,
+            void (*callback)(void *, int), void *arg)
+{
+  struct PL080Channel *ch = &dmac->channels[channel];
+  volatile uint32_t *regs = &dmac->base[DMAC_CHANNEL(channel)];
+  uint32_t control, config;
+  unsigned i, count;
+
+  control = DMAC_CONTROL_SB8 | DMAC_CONTROL_DB8 |
+            DMAC_CONTROL_SW32 | DMAC_CONTROL_DW32;
+  if (type == PL080_MEM_TO_PERIPH) {
+    control |= DMAC_CONTROL_SI;
+    config = DMAC_CH_CONFIG_DST_PERIPH(periph);
+  } else {
+    control |= DMAC_CONTROL_DI;
+    config = DMAC_CH_CONFIG_SRC_PERIPH(periph);
+  }
+
+  k_spinlock_acquire(&dmac->lock);
+
+  if (dmac->base[DMAC_ENBLD_CHNS] & (1U << channel)) {
+    k_spinlock_release(&dmac->lock);
+    return -EBUSY;
+  }
+
+  // Build the linked list, splitting segments that do not fit into one item
+  for (i = count = 0; i < n; i++) {
+    uint32_t addr = segs[i].addr;
+    size_t words  = segs[i].length / sizeof(uint32_t);
+
+    while (words > 0) {
+      size_t chunk = words < DMAC_CONTROL_SIZE_MAX ? words : DMAC_CONTROL_SIZE_MAX;
+      struct PL080Lli *lli;
+
+      if (count >= PL080_LLI_MAX) {
+        k_spinlock_release(&dmac->lock);
+        return -EINVAL;
+      }
+
+      lli = &ch->lli[count++];
+      lli->src     = (type == PL080_MEM_TO_PERIPH) ? addr : periph_addr;
+      lli->dst     = (type == PL080_MEM_TO_PERIPH) ? periph_addr : addr;
+      lli->next    = 0;
+      lli->control = control | chunk;
+
+      if (count > 1)
+        ch->lli[count - 2].next = KVA2PA(lli);
+
+      addr  += chunk * sizeof(uint32_t);
+      words -= chunk;
+    }
+  }
+
+  if (count == 0) {
+    k_spinlock_release(&dmac->lock);
+    return -EINVAL;
+  }
+
+  ch->lli[count - 1].control |= DMAC_CONTROL_I;
+
+  // The controller fetches the items from memory, bypassing the cache
+  arch_dcache_clean(ch->lli, count * sizeof(struct PL080Lli));
+
+  ch->callback = callback;
+  ch->arg      = arg;
+
+  regs[DMAC_CH_SRC_ADDR]      = ch->lli[0].src;
+  regs[DMAC_CH_DEST_ADDR]     = ch->lli[0].dst;
+  regs[DMAC_CH_LLI]           = ch->lli[0].next;
+  regs[DMAC_CH_CONTROL]       = ch->lli[0].control;
+  regs[DMAC_CH_CONFIGURATION] = config |
+                                DMAC_CH_CONFIG_FLOW(type) |
+                                DMAC_CH_CONFIG_IE |
+                                DMAC_CH_CONFIG_ITC |
+                                DMAC_CH_CONFIG_E;
+
+  k_spinlock_release(&dmac->lock);
+
+  return 0;
+}
+
+/**
+ * Abort the transfer in progress on the channel. The completion callback is
+ * not invoked.
+ *
+ * @param dmac    Pointer to the driver instance.
+ * @param channel The channel number.
+ */
+void
+pl080_stop(struct PL080 *dmac, unsigned channel)
+{
+  k_spinlock_acquire(&dmac->lock);
+
+  dmac->base[DMAC_CHANNEL(channel) + DMAC_CH_CONFIGURATION] = 0;
+  dmac->base[DMAC_INT_TC_CLEAR]  = 1U << channel;
+  dmac->base[DMAC_INT_ERR_CLEAR] = 1U << channel;
+
+  dmac->channels[channel].callback = NULL;
+
+  k_spinlock_release(&dmac->lock);
+}
+
+// Acknowledge the channel interrupts and invoke the completion callbacks
+static int
+pl080_irq(int irq, void *arg)
+{
+  struct PL080 *dmac = (struct PL080 *) arg;
+  uint32_t tc, err;
+  unsigned i;
+
+  (void) irq;
+
+  k_spinlock_acquire(&dmac->lock);
+
+  tc  = dmac->base[DMAC_INT_TC_STATUS];
+  err = dmac->base[DMAC_INT_ERR_STATUS];
+
+  dmac->base[DMAC_INT_TC_CLEAR]  = tc;
+  dmac->base[DMAC_INT_ERR_CLEAR] = err;
+
+  for (i = 0; i < PL080_CHANNELS; i++) {
+    struct PL080Channel *ch = &dmac->channels[i];
+    void (*callback)(void *, int);
+
+    if (!((tc | err) & (1U << i)) || (ch->callback == NULL))
+      continue;
+
+    // A channel that reported an error may still be enabled
+    if (err & (1U << i))
+      dmac->base[DMAC_CHANNEL(i) + DMAC_CH_CONFIGURATION] = 0;
+
+    callback = ch->callback;
+    ch->callback = NULL;
+
+    k_spinlock_release(&dmac->lock);
+    callback(ch->arg, (err & (1U << i)) != 0);
+    k_spinlock_acquire(&dmac->lock);
+  }
+
+  k_spinlock_release(&dmac->lock);
+
+  return 1;
+}
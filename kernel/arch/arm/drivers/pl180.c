@@ -1,11 +1,19 @@
 #include <kernel/drivers/sd.h>
+#include <kernel/mm/memlayout.h>
+#include <kernel/types.h>
+#include <arch/arm/cache.h>
 #include <arch/arm/pl180.h>
+#include <arch/arm/regs.h>
 
 /*******************************************************************************
  * ARM PrimeCell Multimedia Card Interface (PL180) driver.
  * 
  * Note: this code works in QEMU but hasn't been tested on real hardware!
  * 
+ * If a DMA controller is attached with pl180_init_dma(), data transfers go
+ * through the DMA channel whenever the buffers are aligned to cache lines, so
+ * that the cache maintenance does not affect neighbouring data.
+ *
  * See ARM PrimeCell Multimedia Card Interface (PL180) Technical Reference
  * Manual.
  ******************************************************************************/
@@ -48,6 +56,14 @@ enum {
   MCI_POWER_ROD     = (1 << 7),   // Rod control
 };
 
+// Clock control register bits
+enum {
+  MCI_CLOCK_DIV_MASK = 0xFF,      // MCICLK = MCLK / (2 * (div + 1))
+  MCI_CLOCK_ENABLE   = (1 << 8),  // Enable the bus clock
+  MCI_CLOCK_BYPASS   = (1 << 10), // Drive the bus directly with MCLK
+  MCI_CLOCK_WIDE_BUS = (1 << 11), // 4-bit bus (on controllers having it)
+};
+
 // Command register bits
 enum {
   MCI_COMMAND_RESPONSE  = (1 << 6),   // Wait for a response
@@ -59,6 +75,7 @@ enum {
 enum {
   MCI_DATA_CTRL_ENABLE    = (1 << 0),   // Data transafer enabled
   MCI_DATA_CTRL_DIRECTION = (1 << 1),   // From card to controller
+  MCI_DATA_CTRL_DMA       = (1 << 3),   // DMA enabled
 };
 
 // Status flags
@@ -87,27 +104,87 @@ enum {
   MCI_RX_DATA_AVLBL  = (1 << 21),   // Receive FIFO data available
 };
 
+// Data transfer error flags
+#define MCI_DATA_ERRORS (MCI_DATA_CRC_FAIL | MCI_DATA_TIME_OUT | \
+                         MCI_TX_UNDERRUN | MCI_RX_OVERRUN | MCI_START_BIT_ERR)
+
+// Interrupts that signal the need to move the next burst through the FIFO. The
+// tail of a transfer that is smaller than half the FIFO is signalled by the
+// data end flag.
+#define MCI_MASK_RX   (MCI_RX_FIFO_HALF | MCI_DATA_END | MCI_DATA_ERRORS)
+#define MCI_MASK_TX   (MCI_TX_FIFO_HALF | MCI_DATA_ERRORS)
+// Interrupts that signal the end of a data transfer
+#define MCI_MASK_END  (MCI_DATA_END | MCI_DATA_ERRORS)
+
+#define MCI_FIFO_HALF_WORDS   8     // Half the FIFO depth, in 32-bit words
+
+// Program the bus clock, the fastest rate not above the given one
+static void
+pl180_set_clock(struct PL180 *pl180, uint32_t hz, uint32_t flags)
+{
+  uint32_t div;
+
+  if (hz >= pl180->mclk) {
+    pl180->base[MCI_CLOCK] = MCI_CLOCK_ENABLE | MCI_CLOCK_BYPASS | flags;
+    return;
+  }
+
+  div = (pl180->mclk + 2 * hz - 1) / (2 * hz);
+  div = MIN(MAX(div, 1U), MCI_CLOCK_DIV_MASK + 1U) - 1;
+
+  pl180->base[MCI_CLOCK] = MCI_CLOCK_ENABLE | div | flags;
+}
+
 /**
  * Initialize the MMCI driver.
  *
  * @param pl180 Pointer to the driver instance.
  * @param base Memory base address.
+ * @param mclk The controller clock rate, in Hz.
  *
  * @return 0 on success, a non-zero value on error. 
  */
 int
-pl180_init(struct PL180 *pl180, void *base)
+pl180_init(struct PL180 *pl180, void *base, uint32_t mclk)
 { 
-  pl180->base = (volatile uint32_t *) base;
+  pl180->base       = (volatile uint32_t *) base;
+  pl180->mclk       = mclk;
+  pl180->dmac       = NULL;
+  pl180->dma_active = 0;
 
   // Power on, 3.6 volts, rod control.
   pl180->base[MCI_POWER] = MCI_POWER_CTRL_ON | (0xF << 2) | MCI_POWER_ROD;
 
+  // The card identification must run at a slow clock
+  pl180_set_clock(pl180, SD_CLOCK_IDENT, 0);
+
   return 0;
 }
 
 /**
- * Enable interrupts on the card.
+ * Use a DMA controller channel for data transfers.
+ *
+ * @param pl180   Pointer to the driver instance.
+ * @param pa      Physical memory base address of the MMCI.
+ * @param dmac    Pointer to the DMA controller driver instance.
+ * @param channel The DMA channel to use.
+ * @param periph  The DMA request line the MMCI is connected to.
+ */
+void
+pl180_init_dma(struct PL180 *pl180, uint32_t pa, struct PL080 *dmac,
+               unsigned channel, unsigned periph)
+{
+  k_semaphore_init(&pl180->dma_done, 0);
+
+  pl180->fifo_pa     = pa + MCI_FIFO * sizeof(uint32_t);
+  pl180->dma_channel = channel;
+  pl180->dma_periph  = periph;
+  pl180->dmac        = dmac;
+}
+
+/**
+ * Enable interrupts on the card. The data interrupts are unmasked by each
+ * transfer as needed.
  * 
  * @param pl180 Pointer to the driver instance.
  */
@@ -116,7 +193,8 @@ pl180_irq_enable(void *ctx)
 {
   struct PL180 *pl180 = (struct PL180 *) ctx;
 
-  pl180->base[MCI_MASK0] = MCI_TX_FIFO_EMPTY | MCI_RX_DATA_AVLBL;
+  pl180->base[MCI_MASK1] = 0;
+  pl180->base[MCI_MASK0] = 0;
   return 0;
 }
 
@@ -180,22 +258,49 @@ pl180_send_cmd(void *ctx, uint32_t cmd, uint32_t arg, int resp_type,
   return status & err_flags;
 }
 
+/**
+ * Switch the bus width and the clock rate.
+ *
+ * @param pl180 Pointer to the driver instance.
+ * @param width The bus width, 1 or 4 bits.
+ * @param hz The highest clock rate the card supports, in Hz.
+ *
+ * @return 0 on success, a non-zero value on error.
+ */
+static int
+pl180_set_bus(void *ctx, unsigned width, uint32_t hz)
+{
+  struct PL180 *pl180 = (struct PL180 *) ctx;
+
+  pl180_set_clock(pl180, hz, (width == 4) ? MCI_CLOCK_WIDE_BUS : 0);
+  return 0;
+}
+
 /**
  * Prepare data transfer to or from the card.
  * 
  * @param pl180 Pointer to the driver instance.
  * @param data_length The number of bytes to be transferred.
+ * @param block_log log2 of the data block length.
  * @param direction Transfer direction: 0 = send, 1 = receive.
  */
 static int
-pl180_begin_transfer(void *ctx, uint32_t data_length, int direction)
+pl180_begin_transfer(void *ctx, uint32_t data_length, unsigned block_log,
+                     int direction)
 {
   struct PL180 *pl180 = (struct PL180 *) ctx;
   uint32_t data_ctrl;
 
-  data_ctrl = (SD_BLOCKLEN_LOG << 4) | MCI_DATA_CTRL_ENABLE;
+  data_ctrl = (block_log << 4) | MCI_DATA_CTRL_ENABLE;
   if (direction)
     data_ctrl |= MCI_DATA_CTRL_DIRECTION;
+  if (pl180->dma_active)
+    data_ctrl |= MCI_DATA_CTRL_DMA;
+
+  if (pl180->dma_active)
+    pl180->base[MCI_MASK0] = MCI_MASK_END;
+  else
+    pl180->base[MCI_MASK0] = direction ? MCI_MASK_RX : MCI_MASK_TX;
 
   pl180->base[MCI_DATA_TIMER]  = 0xFFFF;
   pl180->base[MCI_DATA_LENGTH] = data_length;
@@ -297,10 +402,243 @@ pl180_send_data(void *ctx, const void *buf, size_t n)
   return status & err_flags;
 }
 
+/**
+ * Receive as much data as is available in the FIFO, without waiting.
+ * 
+ * @param pl180 Pointer to the driver instance.
+ * @param buf Pointer to the memory block to store the data.
+ * @param n The maximum number of bytes to read.
+ * 
+ * @return The number of bytes read, or a negative value on error.
+ */
+static int
+pl180_fifo_receive(void *ctx, void *buf, size_t n)
+{
+  struct PL180 *pl180 = (struct PL180 *) ctx;
+  uint32_t status, *dst;
+  size_t i;
+
+  dst = (uint32_t *) buf;
+  while (n > 0) {
+    status = pl180->base[MCI_STATUS];
+
+    if (status & MCI_DATA_ERRORS)
+      return -1;
+
+    // Read a whole burst without checking the status after each word.
+    if ((status & MCI_RX_FIFO_HALF) &&
+        (n >= MCI_FIFO_HALF_WORDS * sizeof(uint32_t))) {
+      for (i = 0; i < MCI_FIFO_HALF_WORDS; i++)
+        *dst++ = pl180->base[MCI_FIFO];
+      n -= MCI_FIFO_HALF_WORDS * sizeof(uint32_t);
+    } else if (status & MCI_RX_DATA_AVLBL) {
+      *dst++ = pl180->base[MCI_FIFO];
+      n -= sizeof(uint32_t);
+    } else {
+      break;
+    }
+  }
+
+  return (uint8_t *) dst - (uint8_t *) buf;
+}
+
+/**
+ * Send as much data as fits into the FIFO, without waiting.
+ * 
+ * @param pl180 Pointer to the driver instance.
+ * @param buf Pointer to the memory block to read the data from.
+ * @param n The maximum number of bytes to write.
+ * 
+ * @return The number of bytes written, or a negative value on error.
+ */
+static int
+pl180_fifo_send(void *ctx, const void *buf, size_t n)
+{
+  struct PL180 *pl180 = (struct PL180 *) ctx;
+  const uint32_t *src;
+  uint32_t status;
+  size_t i;
+
+  src = (const uint32_t *) buf;
+  while (n > 0) {
+    status = pl180->base[MCI_STATUS];
+
+    if (status & MCI_DATA_ERRORS)
+      return -1;
+
+    // Write a whole burst without checking the status after each word.
+    if ((status & MCI_TX_FIFO_HALF) &&
+        (n >= MCI_FIFO_HALF_WORDS * sizeof(uint32_t))) {
+      for (i = 0; i < MCI_FIFO_HALF_WORDS; i++)
+        pl180->base[MCI_FIFO] = *src++;
+      n -= MCI_FIFO_HALF_WORDS * sizeof(uint32_t);
+    } else if (!(status & MCI_TX_FIFO_FULL)) {
+      pl180->base[MCI_FIFO] = *src++;
+      n -= sizeof(uint32_t);
+    } else {
+      break;
+    }
+  }
+
+  // Nothing more to put into the FIFO, wait for the card to take the rest.
+  if (n == 0)
+    pl180->base[MCI_MASK0] = MCI_MASK_END;
+
+  return (const uint8_t *) src - (const uint8_t *) buf;
+}
+
+/**
+ * Check whether the data transfer has ended, once all data has been moved
+ * through the FIFO. If not, the data end interrupt is unmasked.
+ * 
+ * @param pl180 Pointer to the driver instance.
+ * 
+ * @return 1 if the transfer has ended, 0 if not yet, or a negative value on
+ *         error.
+ */
+static int
+pl180_data_end(void *ctx)
+{
+  struct PL180 *pl180 = (struct PL180 *) ctx;
+  uint32_t status, flags;
+
+  flags = MCI_DATA_ERRORS | MCI_DATA_END | MCI_DATA_BLOCK_END;
+
+  status = pl180->base[MCI_STATUS];
+  if (!(status & (MCI_DATA_ERRORS | MCI_DATA_END))) {
+    // The flag is sticky, so the interrupt fires if it was set meanwhile
+    pl180->base[MCI_MASK0] = MCI_MASK_END;
+    return 0;
+  }
+
+  // Clear status flags.
+  pl180->base[MCI_CLEAR] = status & flags;
+  pl180->base[MCI_MASK0] = 0;
+
+  return (status & MCI_DATA_ERRORS) ? -1 : 1;
+}
+
+// Called by the DMA controller driver in interrupt context
+static void
+pl180_dma_callback(void *arg, int error)
+{
+  struct PL180 *pl180 = (struct PL180 *) arg;
+
+  pl180->dma_error = error;
+  k_semaphore_put(&pl180->dma_done);
+}
+
+/**
+ * Set up a DMA transfer to or from the card.
+ *
+ * @param pl180 Pointer to the driver instance.
+ * @param segs The memory segments that take part in the transfer.
+ * @param n The number of segments.
+ * @param direction Transfer direction: 0 = send, 1 = receive.
+ *
+ * @return 0 on success, a non-zero value if DMA cannot be used.
+ */
+static int
+pl180_dma_start(void *ctx, const struct SDSegment *segs, unsigned n,
+                int direction)
+{
+  struct PL180 *pl180 = (struct PL180 *) ctx;
+  unsigned i;
+
+  if ((pl180->dmac == NULL) || (n > SD_MAX_SEGMENTS))
+    return -1;
+
+  // Cache maintenance works on whole lines
+  for (i = 0; i < n; i++)
+    if (((uintptr_t) segs[i].data % CP15_DCACHE_LINE != 0) ||
+        (segs[i].length % CP15_DCACHE_LINE != 0))
+      return -1;
+
+  // Write back the data to be sent. Lines of the receive buffers are also
+  // invalidated, so that no dirty lines get evicted over the incoming data.
+  for (i = 0; i < n; i++) {
+    if (direction)
+      arch_dcache_flush(segs[i].data, segs[i].length);
+    else
+      arch_dcache_clean(segs[i].data, segs[i].length);
+
+    pl180->dma_list[i].addr   = KVA2PA(segs[i].data);
+    pl180->dma_list[i].length = segs[i].length;
+  }
+
+  pl180->dma_segs    = segs;
+  pl180->dma_nsegs   = n;
+  pl180->dma_receive = direction;
+  pl180->dma_error   = 0;
+
+  if (pl080_start(pl180->dmac, pl180->dma_channel,
+                  direction ? PL080_PERIPH_TO_MEM : PL080_MEM_TO_PERIPH,
+                  pl180->dma_periph, pl180->fifo_pa,
+                  pl180->dma_list, n,
+                  pl180_dma_callback, pl180) != 0)
+    return -1;
+
+  // The FIFO interrupts are left masked, the DMA engine drains the FIFO
+  pl180->dma_active = 1;
+
+  return 0;
+}
+
+/**
+ * Wait for the DMA transfer to complete.
+ *
+ * @param pl180 Pointer to the driver instance.
+ *
+ * @return 0 on success, a non-zero value on error.
+ */
+static int
+pl180_dma_wait(void *ctx)
+{
+  struct PL180 *pl180 = (struct PL180 *) ctx;
+  uint32_t status, err_flags, flags;
+  unsigned i;
+
+  err_flags = MCI_DATA_CRC_FAIL | MCI_DATA_TIME_OUT | MCI_TX_UNDERRUN
+            | MCI_RX_OVERRUN | MCI_START_BIT_ERR;
+  flags = err_flags | MCI_DATA_END;
+
+  // Make sure the card has finished the data transfer.
+  do {
+    status = pl180->base[MCI_STATUS];
+  } while (!(status & flags));
+
+  if (status & err_flags) {
+    pl080_stop(pl180->dmac, pl180->dma_channel);
+    // The completion may have been reported just before stopping
+    k_semaphore_try_get(&pl180->dma_done);
+  } else
+    k_semaphore_get(&pl180->dma_done);
+
+  // Clear status flags.
+  pl180->base[MCI_CLEAR] = status & flags;
+
+  // Drop the lines speculatively loaded while the transfer was in progress
+  if (pl180->dma_receive)
+    for (i = 0; i < pl180->dma_nsegs; i++)
+      arch_dcache_invalidate(pl180->dma_segs[i].data,
+                             pl180->dma_segs[i].length);
+
+  pl180->dma_active = 0;
+  pl180->base[MCI_MASK0] = 0;
+
+  return (status & err_flags) || pl180->dma_error;
+}
+
 struct SDOps pl180_ops = {
   .begin_transfer = pl180_begin_transfer,
   .irq_enable = pl180_irq_enable,
   .receive_data = pl180_receive_data,
   .send_data = pl180_send_data,
   .send_cmd = pl180_send_cmd,
+  .fifo_receive = pl180_fifo_receive,
+  .fifo_send = pl180_fifo_send,
+  .data_end = pl180_data_end,
+  .dma_start = pl180_dma_start,
+  .dma_wait = pl180_dma_wait,
+  .set_bus = pl180_set_bus,
 };
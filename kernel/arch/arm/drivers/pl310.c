@@ -0,0 +1,185 @@
+#include <errno.h>
+
+#include <kernel/spinlock.h>
+
+#include <arch/arm/pl310.h>
+
+/*******************************************************************************
+ * ARM PrimeCell Level 2 Cache Controller (PL310, also known as L2C-310).
+ *
+ * The controller sits between the Cortex-A9 processors and the memory and
+ * caches the physical addresses marked as outer cacheable by the page tables.
+ * Unlike the L1 caches, it is not maintained by the CP15 operations: before a
+ * DMA transfer, the lines must be cleaned or invalidated by physical address
+ * both in L1 (by virtual address) and here.
+ *
+ * See CoreLink Level 2 Cache Controller L2C-310 Technical Reference Manual.
+ ******************************************************************************/
+
+// L2CC registers, divided by 4 for use as uint32_t[] indices
+enum {
+  L2CC_CACHE_ID          = (0x000 / 4),  // Cache ID register
+  L2CC_CTRL              = (0x100 / 4),  // Control register
+  L2CC_AUX_CTRL          = (0x104 / 4),  // Auxiliary control register
+  L2CC_INT_MASK          = (0x214 / 4),  // Interrupt mask register
+  L2CC_INT_CLEAR         = (0x220 / 4),  // Interrupt clear register
+  L2CC_CACHE_SYNC        = (0x730 / 4),  // Cache sync
+  L2CC_INV_LINE_PA       = (0x770 / 4),  // Invalidate line by PA
+  L2CC_INV_WAY           = (0x77C / 4),  // Invalidate by way
+  L2CC_CLEAN_LINE_PA     = (0x7B0 / 4),  // Clean line by PA
+  L2CC_CLEAN_WAY         = (0x7BC / 4),  // Clean by way
+  L2CC_CLEAN_INV_LINE_PA = (0x7F0 / 4),  // Clean and invalidate line by PA
+  L2CC_CLEAN_INV_WAY     = (0x7FC / 4),  // Clean and invalidate by way
+};
+
+// Control register bits
+enum {
+  L2CC_CTRL_EN           = (1 << 0),     // L2 cache enable
+};
+
+// Auxiliary control register bits
+enum {
+  L2CC_AUX_ASSOC_16      = (1 << 16),    // 16-way associativity
+  L2CC_AUX_DATA_PREFETCH = (1 << 28),    // Data prefetch enable
+  L2CC_AUX_INSN_PREFETCH = (1 << 29),    // Instruction prefetch enable
+};
+
+#define L2CC_AUX_WAY_SIZE(x)    (((x) >> 17) & 0x7)
+#define L2CC_CACHE_ID_PART(x)   (((x) >> 6) & 0xF)
+
+// Part number of the L2C-310 in the Cache ID register
+#define L2CC_PART_L310          0x3
+
+// All interrupt sources
+#define L2CC_INT_ALL            0x1FF
+
+static void
+pl310_sync(struct PL310 *l2cc)
+{
+  l2cc->base[L2CC_CACHE_SYNC] = 0;
+  while (l2cc->base[L2CC_CACHE_SYNC] & 1)
+    ;
+}
+
+// Apply a background operation to all ways and wait for its completion
+static void
+pl310_op_way(struct PL310 *l2cc, unsigned reg)
+{
+  l2cc->base[reg] = l2cc->way_mask;
+  while (l2cc->base[reg] & l2cc->way_mask)
+    ;
+  pl310_sync(l2cc);
+}
+
+// Apply a line operation to all lines covering the given physical range
+static void
+pl310_op_range(struct PL310 *l2cc, unsigned reg, uint32_t pa, size_t n)
+{
+  uint32_t end = pa + n;
+
+  for (pa &= ~(PL310_LINE_SIZE - 1); pa < end; pa += PL310_LINE_SIZE)
+    l2cc->base[reg] = pa;
+  pl310_sync(l2cc);
+}
+
+/**
+ * Initialize the L2 cache controller and enable the cache.
+ *
+ * @param l2cc Pointer to the driver instance.
+ * @param base Memory base address.
+ *
+ * @return 0 on success, a negative error code otherwise.
+ */
+int
+pl310_init(struct PL310 *l2cc, void *base)
+{
+  uint32_t aux;
+
+  l2cc->base = (volatile uint32_t *) base;
+  k_spinlock_init(&l2cc->lock, "pl310");
+
+  if (L2CC_CACHE_ID_PART(l2cc->base[L2CC_CACHE_ID]) != L2CC_PART_L310)
+    return -ENODEV;
+
+  aux = l2cc->base[L2CC_AUX_CTRL];
+
+  l2cc->way_mask = (aux & L2CC_AUX_ASSOC_16) ? 0xFFFF : 0xFF;
+  l2cc->size     = (8192U << L2CC_AUX_WAY_SIZE(aux)) *
+                   ((aux & L2CC_AUX_ASSOC_16) ? 16 : 8);
+
+  // Already enabled by the boot firmware, the configuration is locked
+  if (l2cc->base[L2CC_CTRL] & L2CC_CTRL_EN)
+    return 0;
+
+  // Sequential accesses are common (page zeroing and copying, block I/O)
+  l2cc->base[L2CC_AUX_CTRL] = aux | L2CC_AUX_DATA_PREFETCH |
+                              L2CC_AUX_INSN_PREFETCH;
+
+  // The contents are undefined after reset
+  pl310_op_way(l2cc, L2CC_INV_WAY);
+
+  l2cc->base[L2CC_INT_MASK]  = 0;
+  l2cc->base[L2CC_INT_CLEAR] = L2CC_INT_ALL;
+
+  l2cc->base[L2CC_CTRL] = L2CC_CTRL_EN;
+
+  return 0;
+}
+
+/**
+ * Write back the dirty lines in the given physical address range.
+ *
+ * @param l2cc Pointer to the driver instance.
+ * @param pa   The start physical address.
+ * @param n    The length of the range, in bytes.
+ */
+void
+pl310_clean(struct PL310 *l2cc, uint32_t pa, size_t n)
+{
+  k_spinlock_acquire(&l2cc->lock);
+
+  // Going through every line of a range larger than the cache takes longer
+  // than cleaning the whole cache
+  if (n >= l2cc->size)
+    pl310_op_way(l2cc, L2CC_CLEAN_WAY);
+  else
+    pl310_op_range(l2cc, L2CC_CLEAN_LINE_PA, pa, n);
+
+  k_spinlock_release(&l2cc->lock);
+}
+
+/**
+ * Discard the lines in the given physical address range without writing them
+ * back. Partial lines at either end of the range are lost as well.
+ *
+ * @param l2cc Pointer to the driver instance.
+ * @param pa   The start physical address.
+ * @param n    The length of the range, in bytes.
+ */
+void
+pl310_invalidate(struct PL310 *l2cc, uint32_t pa, size_t n)
+{
+  k_spinlock_acquire(&l2cc->lock);
+  pl310_op_range(l2cc, L2CC_INV_LINE_PA, pa, n);
+  k_spinlock_release(&l2cc->lock);
+}
+
+/**
+ * Write back and discard the lines in the given physical address range.
+ *
+ * @param l2cc Pointer to the driver instance.
+ * @param pa   The start physical address.
+ * @param n    The length of the range, in bytes.
+ */
+void
+pl310_flush(struct PL310 *l2cc, uint32_t pa, size_t n)
+{
+  k_spinlock_acquire(&l2cc->lock);
+
+  if (n >= l2cc->size)
+    pl310_op_way(l2cc, L2CC_CLEAN_INV_WAY);
+  else
+    pl310_op_range(l2cc, L2CC_CLEAN_INV_LINE_PA, pa, n);
+
+  k_spinlock_release(&l2cc->lock);
+}
@@ -0,0 +1,38 @@
+// See ARM(R) Power State Coordination Interface (DEN 0022)
+
+#include <arch/arm/psci.h>
+
+// Function IDs, SMC32 calling convention
+#define PSCI_FN_CPU_ON        0x84000003
+
+// The firmware is entered with HVC, as expected by QEMU when it emulates PSCI
+// itself (there is no EL2 or EL3 code running)
+static int
+psci_call(uint32_t fn, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+  register uint32_t r0 asm("r0") = fn;
+  register uint32_t r1 asm("r1") = arg0;
+  register uint32_t r2 asm("r2") = arg1;
+  register uint32_t r3 asm("r3") = arg2;
+
+  asm volatile (".arch_extension virt\n\thvc #0"
+                : "+r" (r0)
+                : "r" (r1), "r" (r2), "r" (r3)
+                : "memory");
+
+  return (int) r0;
+}
+
+/**
+ * Power up a processor.
+ *
+ * @param mpidr The MPIDR affinity value of the target processor.
+ * @param entry The physical address to start execution at, with the MMU off.
+ *
+ * @return PSCI_SUCCESS or a negative PSCI error code.
+ */
+int
+psci_cpu_on(uint32_t mpidr, uint32_t entry)
+{
+  return psci_call(PSCI_FN_CPU_ON, mpidr, entry, 0);
+}
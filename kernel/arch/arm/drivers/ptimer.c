@@ -14,12 +14,25 @@
 #define PERIPHCLK     100000000U    // Peripheral clock rate, in Hz
 #define PRESCALER     99U           // Prescaler value
 
+static inline uint32_t
+ptimer_read(struct PTimer *ptimer, uint32_t reg)
+{
+  return ptimer->base[reg >> 2];
+}
+
 static inline void
 ptimer_write(struct PTimer *ptimer, uint32_t reg, uint32_t data)
 {
   ptimer->base[reg >> 2] = data;
 }
 
+// The number of timer counts per one tick
+static inline uint32_t
+ptimer_tick_counts(int rate)
+{
+  return PERIPHCLK / ((PRESCALER + 1) * rate);
+}
+
 void
 ptimer_init(struct PTimer *ptimer, void *base)
 {
@@ -29,13 +42,44 @@ ptimer_init(struct PTimer *ptimer, void *base)
 void
 ptimer_init_percpu(struct PTimer *ptimer, int rate)
 {
-  ptimer_write(ptimer, LOAD, PERIPHCLK / ((PRESCALER + 1) * rate) - 1);
+  ptimer_write(ptimer, LOAD, ptimer_tick_counts(rate) - 1);
   ptimer_write(ptimer, CTRL, (PRESCALER << 8) |
                              CTRL_AUTO |
                              CTRL_IRQEN |
                              CTRL_EN);
 }
 
+/**
+ * Program the private timer of the current CPU to generate a single interrupt
+ * after the specified number of ticks.
+ */
+void
+ptimer_set_oneshot(struct PTimer *ptimer, int rate, unsigned long ticks)
+{
+  ptimer_write(ptimer, CTRL, 0);
+  ptimer_write(ptimer, LOAD, ticks * ptimer_tick_counts(rate) - 1);
+  ptimer_write(ptimer, CTRL, (PRESCALER << 8) |
+                             CTRL_IRQEN |
+                             CTRL_EN);
+}
+
+/**
+ * Switch the private timer of the current CPU back to the periodic mode.
+ * 
+ * @return The number of whole ticks elapsed since the one-shot timer was
+ *         programmed.
+ */
+unsigned long
+ptimer_set_periodic(struct PTimer *ptimer, int rate)
+{
+  uint32_t load  = ptimer_read(ptimer, LOAD);
+  uint32_t count = ptimer_read(ptimer, COUNT);
+
+  ptimer_init_percpu(ptimer, rate);
+
+  return (load + 1 - count) / ptimer_tick_counts(rate);
+}
+
 /**
  * Clear the private timer pending interrupt.
  */
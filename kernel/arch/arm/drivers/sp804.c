@@ -3,9 +3,14 @@
 #include <arch/arm/sp804.h>
 
 // Timer registers
+#define TIMER1_LOAD         0x000     // Load Register
+#define TIMER1_VALUE        0x004     // Current Value Register
 #define TIMER1_CONTROL      0x008     // Control Register
 #define TIMER1_INT_CLR      0x00C     // Interrupt Clear Register
 #define TIMER1_BG_LOAD      0x018     // Background Load Register
+#define TIMER2_LOAD         0x020     // Load Register
+#define TIMER2_VALUE        0x024     // Current Value Register
+#define TIMER2_CONTROL      0x028     // Control Register
 #define TIMER_PERIPH_ID0    0xFE0     // Timer Peripheral ID0 Register
 #define TIMER_PERIPH_ID1    0xFE4     // Timer Peripheral ID1 Register
 #define TIMER_PERIPH_ID2    0xFE8     // Timer Peripheral ID2 Register
@@ -21,12 +26,13 @@
 #define INT_ENABLE          (1 << 5)  // Interrupt Enable
 #define TIMER_PRE_0         (0 << 2)  // 0 stages of prescale
 #define TIMER_SIZE_32       (1 << 1)  // 32-bit counter
+#define TIMER_ONESHOT       (1 << 0)  // One-shot count mode
 
 // Hard-coded values for identification registers
 #define PERIPH_ID           0x00141804
 #define PCELL_ID            0xB105F00D
 
-#define REF_CLOCK           1000000U   // 1MHz
+#define REF_CLOCK           SP804_FREQ
 
 static inline uint32_t
 sp804_read(struct Sp804 *sp804, uint32_t reg)
@@ -71,9 +77,76 @@ sp804_init(struct Sp804 *sp804, void *base, int rate)
   return 0;
 }
 
+/**
+ * Program the timer to generate a single interrupt after the specified number
+ * of ticks.
+ */
+void
+sp804_set_oneshot(struct Sp804 *sp804, int rate, unsigned long ticks)
+{
+  sp804_write(sp804, TIMER1_CONTROL, 0);
+  sp804_write(sp804, TIMER1_LOAD, ticks * (REF_CLOCK / rate));
+  sp804_write(sp804, TIMER1_CONTROL,
+              TIMER_SIZE_32 |
+              TIMER_ONESHOT |
+              INT_ENABLE |
+              TIMER_PRE_0 |
+              TIMER_EN);
+}
+
+/**
+ * Switch the timer back to the periodic mode.
+ * 
+ * @return The number of whole ticks elapsed since the one-shot timer was
+ *         programmed.
+ */
+unsigned long
+sp804_set_periodic(struct Sp804 *sp804, int rate)
+{
+  uint32_t load  = sp804_read(sp804, TIMER1_LOAD);
+  uint32_t value = sp804_read(sp804, TIMER1_VALUE);
+
+  sp804_write(sp804, TIMER1_CONTROL, 0);
+  sp804_write(sp804, TIMER1_LOAD, REF_CLOCK / rate);
+  sp804_write(sp804, TIMER1_BG_LOAD, REF_CLOCK / rate);
+  sp804_write(sp804, TIMER1_CONTROL,
+              TIMER_SIZE_32 |
+              TIMER_MODE_PERIODIC |
+              INT_ENABLE |
+              TIMER_PRE_0 |
+              TIMER_EN);
+
+  return (load - value) / (REF_CLOCK / rate);
+}
+
 void
 sp804_eoi(struct Sp804 *sp804)
 {
   // Writing random value clears the interrupt output
   sp804_write(sp804, TIMER1_INT_CLR, 0xFFFFFFFF);
 }
+
+/**
+ * Start the second timer of the module as a free-running counter, with no
+ * interrupts.
+ */
+void
+sp804_counter_init(struct Sp804 *sp804)
+{
+  sp804_write(sp804, TIMER2_CONTROL, 0);
+  sp804_write(sp804, TIMER2_LOAD, 0xFFFFFFFF);
+  sp804_write(sp804, TIMER2_CONTROL,
+              TIMER_SIZE_32 |
+              TIMER_PRE_0 |
+              TIMER_EN);
+}
+
+/**
+ * Get the value of the free-running counter, at SP804_FREQ. The timer counts
+ * down, so the value is inverted to make it grow. Wraps around every 32 bits.
+ */
+uint32_t
+sp804_counter_read(struct Sp804 *sp804)
+{
+  return ~sp804_read(sp804, TIMER2_VALUE);
+}
@@ -0,0 +1,19 @@
+#ifndef __KERNEL_INCLUDE_ARCH_ARM_CACHE_H__
+#define __KERNEL_INCLUDE_ARCH_ARM_CACHE_H__
+
+#include <stddef.h>
+
+/**
+ * @file include/arch/arm/cache.h
+ *
+ * Data cache maintenance for buffers shared with DMA masters. The operations
+ * take kernel virtual addresses and apply to both the L1 cache and the outer
+ * cache of the machine, if there is one.
+ */
+
+void arch_cache_init(void);
+void arch_dcache_clean(const void *, size_t);
+void arch_dcache_invalidate(const void *, size_t);
+void arch_dcache_flush(const void *, size_t);
+
+#endif  // !__KERNEL_INCLUDE_ARCH_ARM_CACHE_H__
@@ -0,0 +1,19 @@
+#ifndef __KERNEL_INCLUDE_ARCH_ARM_FPU_H__
+#define __KERNEL_INCLUDE_ARCH_ARM_FPU_H__
+
+/**
+ * @file include/arch/arm/fpu.h
+ *
+ * Lazy switching of the VFP/NEON registers, and their use in the kernel.
+ */
+
+struct KThread;
+struct TrapFrame;
+
+int  arch_fpu_trap(struct TrapFrame *);
+void arch_fpu_save(struct KThread *);
+void arch_fpu_discard(struct KThread *);
+void arch_fpu_begin(void);
+void arch_fpu_end(void);
+
+#endif  // !__KERNEL_INCLUDE_ARCH_ARM_FPU_H__
@@ -22,5 +22,6 @@ void     gic_disable(struct Gic *, unsigned);
 unsigned gic_intid(struct Gic *);
 void     gic_eoi(struct Gic *, unsigned);
 void     gic_sgi(struct Gic *, unsigned);
+void     gic_sgi_cpu(struct Gic *, unsigned, unsigned);
 
 #endif  // !__KERNEL_GIC_H__
@@ -0,0 +1,17 @@
+#ifndef __KERNEL_GLTIMER_H__
+#define __KERNEL_GLTIMER_H__
+
+#include <stdint.h>
+
+#define GLTIMER_FREQ  100000000U    ///< Peripheral clock rate, in Hz
+
+struct GlTimer {
+  volatile uint32_t *base;
+};
+
+void     gltimer_init(struct GlTimer *, void *base);
+uint64_t gltimer_count(struct GlTimer *);
+void     gltimer_set(struct GlTimer *, uint64_t);
+void     gltimer_eoi(struct GlTimer *);
+
+#endif  // !__KERNEL_GLTIMER_H__
@@ -0,0 +1,19 @@
+#ifndef __KERNEL_GTIMER_H__
+#define __KERNEL_GTIMER_H__
+
+#include <stdint.h>
+
+struct GTimer {
+  uint32_t freq;
+};
+
+void     gtimer_init(struct GTimer *);
+void     gtimer_init_percpu(struct GTimer *, int);
+void     gtimer_eoi(struct GTimer *, int);
+void     gtimer_set_oneshot(struct GTimer *, int, unsigned long);
+unsigned long gtimer_set_periodic(struct GTimer *, int);
+uint64_t gtimer_count(struct GTimer *);
+void     gtimer_hr_set(struct GTimer *, uint64_t);
+void     gtimer_hr_eoi(struct GTimer *);
+
+#endif  // !__KERNEL_GTIMER_H__
@@ -14,11 +14,35 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <kernel/net.h>
+#include <kernel/spinlock.h>
+
+struct pbuf;
+
+/** The maximum number of frames waiting for TX data FIFO space */
+#define LAN9118_TX_QUEUE_SIZE   32
+/** The maximum number of frames received during one poll */
+#define LAN9118_RX_BUDGET       16
+
 struct Lan9118 {
   volatile uint32_t *base;
+
+  /** Protects INT_EN, the TX FIFOs and the TX queue */
+  struct KSpinLock   lock;
+  /** Frames waiting for TX data FIFO space */
+  struct pbuf       *tx_queue[LAN9118_TX_QUEUE_SIZE];
+  /** Index of the oldest queued frame */
+  unsigned           tx_head;
+  /** The number of queued frames */
+  unsigned           tx_count;
+  /** Tag for the next frame, echoed back in its TX status word */
+  uint16_t           tx_tag;
+  /** Driver counters, the TX ones are protected by the lock */
+  struct NetIfStats  stats;
 };
 
 void lan9118_init(struct Lan9118 *);
-void lan9118_write(struct Lan9118 *, const void *, size_t);
+int  lan9118_write(struct Lan9118 *, struct pbuf *);
+void lan9118_stats(struct Lan9118 *, struct NetIfStats *);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_DRIVERS_ETH_H__
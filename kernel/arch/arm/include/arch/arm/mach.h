@@ -1,22 +1,31 @@
 #ifndef __KERNEL_INCLUDE_KERNEL_MACH_H__
 #define __KERNEL_INCLUDE_KERNEL_MACH_H__
 
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 
+#include <kernel/mm/memlayout.h>
+
 #define MACH_REALVIEW_PB_A8   1897
 #define MACH_REALVIEW_PBX_A9  1901
+/** Boards described by a device tree, i.e. the QEMU "virt" machine */
+#define MACH_VIRT             0xFFFFFFFF
 
 #define MACH_MAX  5108
 
 struct Buf;
+struct ClockSource;
+struct NetIfStats;
+struct Page;
+struct pbuf;
 struct Screen;
 struct Tty;
 
 struct Machine {
   uint32_t type;
 
-  void   (*interrupt_ipi)(void);
+  void   (*interrupt_ipi)(unsigned, int);
   int    (*interrupt_id)(void);
   void   (*interrupt_enable)(int, int);
   void   (*interrupt_mask)(int);
@@ -27,16 +36,26 @@ struct Machine {
 
   void   (*timer_init)(void);
   void   (*timer_init_percpu)(void);
+  void   (*timer_set_oneshot)(unsigned long);
+  unsigned long (*timer_set_periodic)(void);
+  struct ClockSource *(*clock_source)(void);
+  void   (*hrtimer_set)(uint64_t);
 
   void   (*rtc_init)(void);
   time_t (*rtc_get_time)(void);
   void   (*rtc_set_time)(time_t);
 
+  void   (*cache_init)(void);
+  void   (*cache_clean)(physaddr_t, size_t);
+  void   (*cache_invalidate)(physaddr_t, size_t);
+  void   (*cache_flush)(physaddr_t, size_t);
+
   int    (*storage_init)(void);
  
   int    (*console_init)(void);
   int    (*console_getc)(void);
   void   (*console_putc)(char);
+  struct Page *(*console_fb)(unsigned *);
 
   void   (*tty_out_char)(struct Tty *, char);
   void   (*tty_flush)(struct Tty *);
@@ -46,7 +65,8 @@ struct Machine {
   void   (*tty_init)(struct Tty *, int);
 
   int    (*eth_init)(void);
-  void   (*eth_write)(const void *, size_t);
+  int    (*eth_write)(struct pbuf *);
+  void   (*eth_stats)(struct NetIfStats *);
 };
 
 extern struct Machine *mach_current;
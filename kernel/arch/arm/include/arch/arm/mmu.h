@@ -41,7 +41,7 @@
 #define L2_TABLE_SIZE       (L2_NR_ENTRIES * 4)
 
 /** The number of bytes mapped by a section */
-#define L1_SECTION_SIZE     1232896
+#define L1_SECTION_SIZE     1048576
 /** The number of bytes mapped by a small page */
 #define L2_PAGE_SM_SIZE     4096
 /** The number of bytes mapped by a large page */
@@ -70,6 +70,12 @@
 #define L1_DESC_SECT_NG           (1 << 17)     ///< Not global
 #define L1_DESC_SECT_SUPER        (1 << 18)     ///< Supersection
 #define L1_DESC_SECT_NS           (1 << 19)     ///< Non-secure
+
+/** Normal memory, inner and outer write-back with write-allocate */
+#define L1_DESC_SECT_WBWA \
+  (L1_DESC_SECT_TEX(1) | L1_DESC_SECT_C | L1_DESC_SECT_B)
+/** Normal memory, inner and outer non-cacheable (write-combining) */
+#define L1_DESC_SECT_WC           L1_DESC_SECT_TEX(1)
 /** @} */
 
 /** Page table base address */
@@ -96,6 +102,12 @@
 
 #define L2_DESC_SM_XN             (1 << 0)      ///< Execute-never
 #define L2_DESC_SM_TEX(x)         ((x) << 6)    ///< TEX remap
+
+/** Normal memory, inner and outer write-back with write-allocate */
+#define L2_DESC_SM_WBWA \
+  (L2_DESC_SM_TEX(1) | L2_DESC_C | L2_DESC_B)
+/** Normal memory, inner and outer non-cacheable (write-combining) */
+#define L2_DESC_SM_WC             L2_DESC_SM_TEX(1)
 /** @} */
 
 /** Large page base address */
@@ -0,0 +1,24 @@
+#ifndef __KERNEL_DRIVERS_RTC_PL031_H__
+#define __KERNEL_DRIVERS_RTC_PL031_H__
+
+/**
+ * @file kernel/drivers/rtc/pl031.h
+ * 
+ * PrimeCell Real Time Clock (PL031) driver.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * PL031 driver instance.
+ */
+struct PL031 {
+  volatile uint32_t *base;    ///< Memory base address
+};
+
+void   pl031_init(struct PL031 *, void *);
+time_t pl031_get_time(struct PL031 *);
+void   pl031_set_time(struct PL031 *, time_t);
+
+#endif  // !__KERNEL_DRIVERS_RTC_PL031_H__
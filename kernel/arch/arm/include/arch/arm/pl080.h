@@ -0,0 +1,58 @@
+#ifndef __KERNEL_PL080_H__
+#define __KERNEL_PL080_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kernel/spinlock.h>
+
+#define PL080_CHANNELS    8       ///< The number of DMA channels
+#define PL080_LLI_MAX     72      ///< Maximum linked list items per transfer
+
+// Transfer types
+#define PL080_MEM_TO_PERIPH   1
+#define PL080_PERIPH_TO_MEM   2
+
+/**
+ * A contiguous piece of memory taking part in a transfer.
+ */
+struct PL080Segment {
+  uint32_t addr;                ///< Physical address
+  size_t   length;              ///< Length in bytes (a multiple of 4)
+};
+
+/**
+ * Linked list item, as read by the controller.
+ */
+struct PL080Lli {
+  uint32_t src;
+  uint32_t dst;
+  uint32_t next;
+  uint32_t control;
+};
+
+/**
+ * DMA channel state.
+ */
+struct PL080Channel {
+  struct PL080Lli lli[PL080_LLI_MAX] __attribute__((aligned(32)));
+  void          (*callback)(void *, int);   ///< Completion callback
+  void           *arg;                      ///< Callback argument
+};
+
+/**
+ * PL080 Driver instance.
+ */
+struct PL080 {
+  volatile uint32_t  *base;     ///< Memory base address
+  struct KSpinLock    lock;
+  struct PL080Channel channels[PL080_CHANNELS];
+};
+
+int  pl080_init(struct PL080 *, void *, int);
+int  pl080_start(struct PL080 *, unsigned, int, unsigned, uint32_t,
+                 const struct PL080Segment *, unsigned,
+                 void (*)(void *, int), void *);
+void pl080_stop(struct PL080 *, unsigned);
+
+#endif  // !__KERNEL_PL080_H__
@@ -2,13 +2,30 @@
 #define __KERNEL_DRIVERS_SD_PL180_H__
 
 #include <stdint.h>
+#include <kernel/core/semaphore.h>
 #include <kernel/drivers/sd.h>
 
+#include <arch/arm/pl080.h>
+
 struct PL180 {
   volatile uint32_t *base;
+  uint32_t           mclk;          // Controller clock rate, in Hz
+  uint32_t           fifo_pa;       // Physical address of the data FIFO
+  struct PL080      *dmac;          // DMA controller (NULL if not used)
+  unsigned           dma_channel;   // DMA channel number
+  unsigned           dma_periph;    // DMA request line of the MMCI
+  int                dma_active;    // Set while a DMA transfer is set up
+  int                dma_receive;   // Direction of the DMA transfer
+  int                dma_error;     // Set by the DMA completion callback
+  struct KSemaphore  dma_done;
+  const struct SDSegment *dma_segs;
+  unsigned           dma_nsegs;
+  struct PL080Segment dma_list[SD_MAX_SEGMENTS];
 };
 
-int  pl180_init(struct PL180 *, void *);
+int  pl180_init(struct PL180 *, void *, uint32_t);
+void pl180_init_dma(struct PL180 *, uint32_t, struct PL080 *, unsigned,
+                    unsigned);
 
 extern struct SDOps pl180_ops;
 
@@ -0,0 +1,27 @@
+#ifndef __KERNEL_PL310_H__
+#define __KERNEL_PL310_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kernel/spinlock.h>
+
+/** Cache line size, in bytes */
+#define PL310_LINE_SIZE   32
+
+/**
+ * PL310 Driver instance.
+ */
+struct PL310 {
+  volatile uint32_t *base;      ///< Memory base address
+  struct KSpinLock   lock;      ///< Serializes the maintenance operations
+  uint32_t           way_mask;  ///< Bitmask of all cache ways
+  size_t             size;      ///< Total cache size, in bytes
+};
+
+int  pl310_init(struct PL310 *, void *);
+void pl310_clean(struct PL310 *, uint32_t, size_t);
+void pl310_invalidate(struct PL310 *, uint32_t, size_t);
+void pl310_flush(struct PL310 *, uint32_t, size_t);
+
+#endif  // !__KERNEL_PL310_H__
@@ -0,0 +1,20 @@
+#ifndef __KERNEL_PSCI_H__
+#define __KERNEL_PSCI_H__
+
+/**
+ * @file kernel/arch/arm/psci.h
+ *
+ * Power State Coordination Interface (PSCI) calls into the firmware.
+ */
+
+#include <stdint.h>
+
+/** PSCI return codes */
+#define PSCI_SUCCESS          0
+#define PSCI_NOT_SUPPORTED    -1
+#define PSCI_INVALID_PARAMS   -2
+#define PSCI_ALREADY_ON       -4
+
+int psci_cpu_on(uint32_t, uint32_t);
+
+#endif  // !__KERNEL_PSCI_H__
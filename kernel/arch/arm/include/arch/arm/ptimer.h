@@ -10,5 +10,7 @@ struct PTimer {
 void     ptimer_init(struct PTimer*, void *base);
 void     ptimer_init_percpu(struct PTimer *, int);
 void     ptimer_eoi(struct PTimer *);
+void     ptimer_set_oneshot(struct PTimer *, int, unsigned long);
+unsigned long ptimer_set_periodic(struct PTimer *, int);
 
 #endif  // !__KERNEL_PTIMER_H__
@@ -48,12 +48,53 @@
 #define CP15_TTBR1(x)   p15, 0, x, c2, c0, 1  ///< Translation Table Base 1
 #define CP15_TTBCR(x)   p15, 0, x, c2, c0, 2  ///< Translation Table Base Ctrl
 #define CP15_DFSR(x)    p15, 0, x, c5, c0, 0  ///< Data Fault Status
+#define DFSR_WNR        (1U << 11)            ///< Abort caused by a write
 #define CP15_IFSR(x)    p15, 0, x, c5, c0, 1  ///< Instruction Fault Status
 #define CP15_DFAR(x)    p15, 0, x, c6, c0, 0  ///< Data Fault Address
 #define CP15_IFAR(x)    p15, 0, x, c6, c0, 2  ///< Instruction Fault Address
 #define CP15_DACR(x)    p15, 0, x, c3, c0, 0  ///< Domain Access Control
+#define CP15_CONTEXTIDR(x) p15, 0, x, c13, c0, 1 ///< Context ID
+#define CP15_TPIDRURO(x) p15, 0, x, c13, c0, 3 ///< User Read-Only Thread ID
+#define CP15_PMCR(x)    p15, 0, x, c9, c12, 0 ///< Performance Monitor Control
+#define CP15_PMCNTENSET(x) p15, 0, x, c9, c12, 1 ///< Count Enable Set
+#define CP15_PMSELR(x)  p15, 0, x, c9, c12, 5 ///< Event Counter Selection
+#define CP15_PMCCNTR(x) p15, 0, x, c9, c13, 0 ///< Cycle Count
+#define CP15_PMXEVTYPER(x) p15, 0, x, c9, c13, 1 ///< Event Type Select
+#define CP15_PMXEVCNTR(x) p15, 0, x, c9, c13, 2 ///< Event Count
+#define CP15_CNTFRQ(x)  p15, 0, x, c14, c0, 0 ///< Counter Frequency
+#define CP15_CNTKCTL(x) p15, 0, x, c14, c1, 0 ///< Timer PL1 Control
+#define CP15_CNTP_CTL(x) p15, 0, x, c14, c2, 1 ///< Physical Timer Control
+#define CP15_CNTV_CTL(x) p15, 0, x, c14, c3, 1 ///< Virtual Timer Control
 /** @} */
 
+/** @defgroup CntkctlBits Timer PL1 Control Register bits
+ *  @{
+ */
+#define CP15_CNTKCTL_PL0PCTEN  (1U << 0)  ///< PL0 access to CNTPCT
+/** @} */
+
+/** @defgroup PmcrBits Performance Monitor Control Register bits
+ *  @{
+ */
+#define CP15_PMCR_E       (1 << 0)    ///< Enable all counters
+#define CP15_PMCR_P       (1 << 1)    ///< Event counter reset
+#define CP15_PMCR_C       (1 << 2)    ///< Cycle counter reset
+#define CP15_PMCR_N_SHIFT 11          ///< Number of event counters
+#define CP15_PMCR_N_MASK  (0x1F << CP15_PMCR_N_SHIFT)
+/** @} */
+
+/** @defgroup PmuEvents Common architectural PMU events
+ *  @{
+ */
+#define PMU_EVENT_L1I_CACHE_REFILL  0x01  ///< Level 1 instruction cache refill
+#define PMU_EVENT_L1D_CACHE_REFILL  0x03  ///< Level 1 data cache refill
+#define PMU_EVENT_L1D_TLB_REFILL    0x05  ///< Level 1 data TLB refill
+#define PMU_EVENT_BR_MIS_PRED       0x10  ///< Mispredicted branch
+/** @} */
+
+/** Cycle counter enable bit in the PMCNTENSET register */
+#define CP15_PMCNTENSET_C (1U << 31)
+
 /** @defgroup SctlrBits System Control Register bits
  *  @{
  */
@@ -165,10 +206,76 @@ CP15_SETTER(cp15_sctlr_set, CP15_SCTLR(%0));
 CP15_SETTER(cp15_ttbr0_set, CP15_TTBR0(%0));
 CP15_SETTER(cp15_ttbr1_set, CP15_TTBR1(%0));
 CP15_SETTER(cp15_ttbcr_set, CP15_TTBCR(%0));
+CP15_SETTER(cp15_contextidr_set, CP15_CONTEXTIDR(%0));
+CP15_SETTER(cp15_tpidruro_set, CP15_TPIDRURO(%0));
 CP15_GETTER(cp15_dfsr_get, CP15_DFSR(%0));
 CP15_GETTER(cp15_ifsr_get, CP15_IFSR(%0));
 CP15_GETTER(cp15_dfar_get, CP15_DFAR(%0));
 CP15_GETTER(cp15_ifar_get, CP15_IFAR(%0));
+CP15_GETTER(cp15_pmcr_get, CP15_PMCR(%0));
+CP15_SETTER(cp15_pmcr_set, CP15_PMCR(%0));
+CP15_SETTER(cp15_pmcntenset_set, CP15_PMCNTENSET(%0));
+CP15_SETTER(cp15_pmselr_set, CP15_PMSELR(%0));
+CP15_GETTER(cp15_pmccntr_get, CP15_PMCCNTR(%0));
+CP15_SETTER(cp15_pmxevtyper_set, CP15_PMXEVTYPER(%0));
+CP15_GETTER(cp15_pmxevcntr_get, CP15_PMXEVCNTR(%0));
+CP15_GETTER(cp15_cntfrq_get, CP15_CNTFRQ(%0));
+CP15_GETTER(cp15_cntkctl_get, CP15_CNTKCTL(%0));
+CP15_SETTER(cp15_cntkctl_set, CP15_CNTKCTL(%0));
+CP15_SETTER(cp15_cntp_ctl_set, CP15_CNTP_CTL(%0));
+CP15_SETTER(cp15_cntv_ctl_set, CP15_CNTV_CTL(%0));
+
+/**
+ * Get the physical count of the Generic Timer.
+ *
+ * @return The 64-bit value of CNTPCT.
+ */
+static inline uint64_t
+cp15_cntpct_get(void)
+{
+  uint32_t lo, hi;
+
+  asm volatile ("isb\n\tmrrc p15, 0, %0, %1, c14" : "=r" (lo), "=r" (hi));
+  return ((uint64_t) hi << 32) | lo;
+}
+
+/**
+ * Set the compare value of the Generic Timer physical timer.
+ *
+ * @param val The new value of CNTP_CVAL.
+ */
+static inline void
+cp15_cntp_cval_set(uint64_t val)
+{
+  asm volatile ("mcrr p15, 2, %0, %1, c14\n\tisb"
+                : : "r" ((uint32_t) val), "r" ((uint32_t) (val >> 32)));
+}
+
+/**
+ * Get the virtual count of the Generic Timer.
+ *
+ * @return The 64-bit value of CNTVCT.
+ */
+static inline uint64_t
+cp15_cntvct_get(void)
+{
+  uint32_t lo, hi;
+
+  asm volatile ("isb\n\tmrrc p15, 1, %0, %1, c14" : "=r" (lo), "=r" (hi));
+  return ((uint64_t) hi << 32) | lo;
+}
+
+/**
+ * Set the compare value of the Generic Timer virtual timer.
+ *
+ * @param val The new value of CNTV_CVAL.
+ */
+static inline void
+cp15_cntv_cval_set(uint64_t val)
+{
+  asm volatile ("mcrr p15, 3, %0, %1, c14\n\tisb"
+                : : "r" ((uint32_t) val), "r" ((uint32_t) (val >> 32)));
+}
 
 /**
  * Invalidate entire unified TLB.
@@ -188,6 +295,73 @@ cp15_tlbimva(uintptr_t va)
   asm volatile ("mcr p15, 0, %0, c8, c7, 1" : : "r"(va));
 }
 
+/**
+ * Invalidate entire unified TLB on all CPUs in the Inner Shareable domain.
+ */
+static inline void
+cp15_tlbiallis(void)
+{
+  asm volatile ("mcr p15, 0, %0, c8, c3, 0" : : "r"(0));
+}
+
+/**
+ * TLB Invalidate by MVA for all ASIDs on all CPUs in the Inner Shareable
+ * domain (requires the Multiprocessing Extensions).
+ */
+static inline void
+cp15_tlbimvaais(uintptr_t va)
+{
+  asm volatile ("mcr p15, 0, %0, c8, c3, 3" : : "r"(va));
+}
+
+/**
+ * TLB Invalidate by ASID on all CPUs in the Inner Shareable domain.
+ */
+static inline void
+cp15_tlbiasidis(unsigned long asid)
+{
+  asm volatile ("mcr p15, 0, %0, c8, c3, 2" : : "r"(asid));
+}
+
+/** Data cache line size on Cortex-A9, in bytes */
+#define CP15_DCACHE_LINE  32
+
+/**
+ * Clean data cache line by MVA to the Point of Coherency.
+ */
+static inline void
+cp15_dccmvac(uintptr_t va)
+{
+  asm volatile ("mcr p15, 0, %0, c7, c10, 1" : : "r"(va) : "memory");
+}
+
+/**
+ * Invalidate data cache line by MVA to the Point of Coherency.
+ */
+static inline void
+cp15_dcimvac(uintptr_t va)
+{
+  asm volatile ("mcr p15, 0, %0, c7, c6, 1" : : "r"(va) : "memory");
+}
+
+/**
+ * Clean and invalidate data cache line by MVA to the Point of Coherency.
+ */
+static inline void
+cp15_dccimvac(uintptr_t va)
+{
+  asm volatile ("mcr p15, 0, %0, c7, c14, 1" : : "r"(va) : "memory");
+}
+
+/**
+ * Data Synchronization Barrier.
+ */
+static inline void
+dsb(void)
+{
+  asm volatile ("dsb" : : : "memory");
+}
+
 /**
  * Get the value of the R11 (FP) register.
  *
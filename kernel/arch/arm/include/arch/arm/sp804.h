@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#define SP804_FREQ    1000000U      ///< Reference clock rate, in Hz
+
 /**
  * Sp804 Driver instance.
  */
@@ -12,5 +14,9 @@ struct Sp804 {
 
 int  sp804_init(struct Sp804 *, void *, int);
 void sp804_eoi(struct Sp804 *);
+void sp804_set_oneshot(struct Sp804 *, int, unsigned long);
+unsigned long sp804_set_periodic(struct Sp804 *, int);
+void     sp804_counter_init(struct Sp804 *);
+uint32_t sp804_counter_read(struct Sp804 *);
 
 #endif  // !__KERNEL_SP804_H__
@@ -8,8 +8,6 @@
  * See https://wiki.osdev.org/Calling_Conventions
  */
 struct Context {
-  uint32_t s[32];
-  uint32_t fpscr;
   uint32_t r4;
   uint32_t r5;
   uint32_t r6;
@@ -21,4 +19,15 @@ struct Context {
   uint32_t lr;
 };
 
+/**
+ * VFP/NEON registers of a thread. They are not part of the kernel context and
+ * are only saved and restored when needed (see arch_fpu.c).
+ */
+struct FPUContext {
+  uint64_t d[32];
+  uint32_t fpscr;
+  /** The CPU whose registers may still hold this state, or K_CPU_MAX */
+  uint32_t cpu;
+};
+
 #endif  // !__ARCH_ARM_CONTEXT_H__
@@ -1,11 +1,17 @@
+#include <sys/timepage.h>
+
 #include <arch/arm/mach.h>
+#include <kernel/core/hrtimer.h>
 #include <kernel/mm/memlayout.h>
 #include <kernel/trap.h>
 #include <kernel/interrupt.h>
 #include <kernel/spinlock.h>
 #include <kernel/fs/buf.h>
+#include <kernel/fs/iosched.h>
 #include <kernel/page.h>
 #include <kernel/dev.h>
+#include <kernel/iostat.h>
+#include <kernel/time.h>
 #include <kernel/tty.h>
 
 #include <kernel/drivers/sd.h>
@@ -16,28 +22,34 @@
 #include <arch/arm/ds1338.h>
 #include <arch/arm/sbcon.h>
 #include <arch/arm/gic.h>
+#include <arch/arm/gltimer.h>
 #include <arch/arm/ptimer.h>
 #include <arch/arm/sp804.h>
+#include <arch/arm/pl080.h>
 #include <arch/arm/pl180.h>
 #include <arch/arm/pl050.h>
 #include <arch/arm/pl011.h>
 #include <arch/arm/pl111.h>
+#include <arch/arm/pl310.h>
 #include <arch/arm/lan9118.h>
 
 // #define PHYS_GICC         0x1F000100    ///< Interrupt interface
+#define PHYS_GLTIMER      0x1F000200    ///< Global timer
 #define PHYS_PTIMER       0x1F000600    ///< Private timer
 // #define PHYS_GICD         0x1F001000    ///< Distributor
+#define PHYS_L2CC         0x1F002000    ///< L2 cache controller
 
 #define TICK_RATE     100U          // Desired timer events rate, in Hz
 
 static struct Gic gic;
+static struct GlTimer gltimer;
 static struct PTimer ptimer;
 static struct Sp804 timer01;
 
 static void
-realview_interrupt_ipi(void)
+realview_interrupt_ipi(unsigned cpu, int irq)
 {
-  gic_sgi(&gic, 0);
+  gic_sgi_cpu(&gic, irq, cpu);
 }
 
 static int
@@ -75,8 +87,7 @@ realview_interrupt_init_pbx_a9(void)
 {
   gic_init(&gic, PA2KVA(0x1F000100), PA2KVA(0x1F001000));
 
-  interrupt_attach(0, ipi_irq, NULL);
-
+  // Release the secondary processors from the boot monitor
   *(volatile int *) PA2KVA(0x10000030) = 0x10000;
   gic_sgi(&gic, 0);
 }
@@ -85,7 +96,6 @@ static void
 realview_interrupt_init_percpu(void)
 {
   gic_init_percpu(&gic);
-  interrupt_unmask(0);
 }
 
 static void
@@ -162,6 +172,7 @@ static void
 realview_pb_a8_timer_init(void)
 {
   sp804_init(&timer01, PA2KVA(0x10011000), TICK_RATE);
+  sp804_counter_init(&timer01);
   interrupt_attach(36, realview_pb_a8_timer_irq, NULL);
 }
 
@@ -171,24 +182,78 @@ realview_pb_a8_timer_init_percpu(void)
 
 }
 
+static void
+realview_pb_a8_timer_set_oneshot(unsigned long ticks)
+{
+  sp804_set_oneshot(&timer01, TICK_RATE, ticks);
+}
+
+static unsigned long
+realview_pb_a8_timer_set_periodic(void)
+{
+  return sp804_set_periodic(&timer01, TICK_RATE);
+}
+
+// The first timer of the module generates the ticks, the second one is left
+// free-running to measure the time between them
+static uint64_t
+realview_pb_a8_clock_read(void)
+{
+  return sp804_counter_read(&timer01);
+}
+
+static struct ClockSource realview_pb_a8_clock = {
+  .read = realview_pb_a8_clock_read,
+  .mask = 0xFFFFFFFFULL,
+  .freq = SP804_FREQ,
+  .user = TP_COUNTER_NONE,
+};
+
+static struct ClockSource *
+realview_pb_a8_clock_source(void)
+{
+  return &realview_pb_a8_clock;
+}
+
+#ifdef REALVIEW_MMCI_DMA
+#define DMA_CHANNEL_MCI   0         // DMA channel used by the MMCI
+#define DMA_PERIPH_MCI    4         // DMA request line of the MMCI
+
+static struct PL080 dmac;
+#endif
+
 struct PL180 mmci;
 static struct SD sd;
 
+#define MMCI_CLOCK        24000000U     // MMCI clock rate, in Hz
+#define STORAGE_DEPTH     32            // Buffers the SD driver gets at once
+
+static struct IoQueue storage_queue;
+
 void
-realview_storage_request(struct Buf *buf)
+realview_storage_request(struct Buf **bufs, unsigned n)
 {
-  sd_request(&sd, buf);
+  sd_request(&sd, bufs, n);
 }
 
 struct BlockDev storage_dev = {
   .request = realview_storage_request,
+  .queue   = &storage_queue,
 };
 
 int
 realview_storage_init(void)
 {
-  pl180_init(&mmci, PA2KVA(PHYS_MMCI));
+  pl180_init(&mmci, PA2KVA(PHYS_MMCI), MMCI_CLOCK);
+#ifdef REALVIEW_MMCI_DMA
+  pl080_init(&dmac, PA2KVA(PHYS_DMAC), IRQ_DMAC);
+  pl180_init_dma(&mmci, PHYS_MMCI, &dmac, DMA_CHANNEL_MCI, DMA_PERIPH_MCI);
+#endif
   sd_init(&sd, &pl180_ops, &mmci, IRQ_MCIA);
+  if (io_queue_init(&storage_queue, &storage_dev, &io_deadline_sched,
+                    STORAGE_DEPTH) != 0)
+    panic("cannot initialize the storage queue");
+  iostat_register(&sd.stats, "sd0", 0x0000);
   dev_register_block(0, &storage_dev);
   return 0;
 }
@@ -207,16 +272,22 @@ static struct Pl011 pl011;
 static struct Display display;
 static struct Pl111 lcd;
 
+#define FB_ORDER  8                     // 1MB, enough for 640x480x16
+
+static struct Page *fb_page;
+
 int
 realview_console_init(void)
 {
   struct Page *page;
 
-  // Allocate the frame buffer.
-  if ((page = page_alloc_block(8, PAGE_ALLOC_ZERO, PAGE_TAG_FB)) == NULL)
+  // Allocate the frame buffer. Blocks are naturally aligned, so it can be
+  // mapped into user space with a single section.
+  if ((page = page_alloc_block(FB_ORDER, PAGE_ALLOC_ZERO, PAGE_TAG_FB)) == NULL)
     panic("cannot allocate framebuffer");
 
   page->ref_count++;
+  fb_page = page;
 
   pl111_init(&lcd, PA2KVA(PHYS_LCD), page2pa(page), PL111_RES_VGA);
 
@@ -241,6 +312,18 @@ realview_console_getc(void)
   return uart_getc(&uart0);
 }
 
+struct Page *
+realview_console_fb(unsigned *order_store)
+{
+  if (order_store != NULL)
+    *order_store = FB_ORDER;
+
+  // The caller is about to give user space direct access to the pixels
+  display_map_user(&display);
+
+  return fb_page;
+}
+
 void
 realview_console_putc(char c)
 {
@@ -257,10 +340,16 @@ realview_eth_init(void)
   return 0;
 }
 
+int
+realview_eth_write(struct pbuf *p)
+{
+  return lan9118_write(&lan9118, p);
+}
+
 void
-realview_eth_write(const void *buf, size_t n)
+realview_eth_stats(struct NetIfStats *stats)
 {
-  lan9118_write(&lan9118, buf, n);
+  lan9118_stats(&lan9118, stats);
 }
 
 #define NSCREENS    6   // For now, all ttys are screens
@@ -324,6 +413,9 @@ MACH_DEFINE(realview_pb_a8) {
 
   .timer_init            = realview_pb_a8_timer_init,
   .timer_init_percpu     = realview_pb_a8_timer_init_percpu,
+  .timer_set_oneshot     = realview_pb_a8_timer_set_oneshot,
+  .timer_set_periodic    = realview_pb_a8_timer_set_periodic,
+  .clock_source          = realview_pb_a8_clock_source,
 
   .rtc_init              = realview_rtc_init,
   .rtc_get_time          = realview_rtc_get_time,
@@ -334,6 +426,7 @@ MACH_DEFINE(realview_pb_a8) {
   .console_init          = realview_console_init,
   .console_getc          = realview_console_getc,
   .console_putc          = realview_console_putc,
+  .console_fb            = realview_console_fb,
 
   .tty_erase             = realview_tty_erase,
   .tty_flush             = realview_tty_flush,
@@ -344,6 +437,7 @@ MACH_DEFINE(realview_pb_a8) {
 
   .eth_init              = realview_eth_init,
   .eth_write             = realview_eth_write,
+  .eth_stats             = realview_eth_stats,
 };
 
 static int
@@ -354,12 +448,28 @@ realview_pbx_a9_timer_irq(int irq, void *arg)
   return timer_irq(irq, arg);
 }
 
+// The private timers generate the ticks, the comparators of the global timer
+// run the high-resolution timers
+static int
+realview_pbx_a9_hrtimer_irq(int irq, void *arg)
+{
+  (void) irq;
+  (void) arg;
+
+  gltimer_eoi(&gltimer);
+  k_hrtimer_irq();
+  return 1;
+}
+
 static void
 realview_pbx_a9_timer_init(void)
 {
   ptimer_init(&ptimer, PA2KVA(PHYS_PTIMER));
   ptimer_init_percpu(&ptimer, TICK_RATE);
   interrupt_attach(29, realview_pbx_a9_timer_irq, NULL);
+
+  gltimer_init(&gltimer, PA2KVA(PHYS_GLTIMER));
+  interrupt_attach(27, realview_pbx_a9_hrtimer_irq, NULL);
 }
 
 static void
@@ -367,6 +477,84 @@ realview_pbx_a9_timer_init_percpu(void)
 {
   ptimer_init_percpu(&ptimer, TICK_RATE);
   interrupt_unmask(29);
+  interrupt_unmask(27);
+}
+
+static void
+realview_pbx_a9_timer_set_oneshot(unsigned long ticks)
+{
+  ptimer_set_oneshot(&ptimer, TICK_RATE, ticks);
+}
+
+static unsigned long
+realview_pbx_a9_timer_set_periodic(void)
+{
+  return ptimer_set_periodic(&ptimer, TICK_RATE);
+}
+
+static uint64_t
+realview_pbx_a9_clock_read(void)
+{
+  return gltimer_count(&gltimer);
+}
+
+// User mode cannot reach the global timer registers
+static struct ClockSource realview_pbx_a9_clock = {
+  .read = realview_pbx_a9_clock_read,
+  .mask = ~0ULL,
+  .freq = GLTIMER_FREQ,
+  .user = TP_COUNTER_NONE,
+};
+
+static struct ClockSource *
+realview_pbx_a9_clock_source(void)
+{
+  return &realview_pbx_a9_clock;
+}
+
+static void
+realview_pbx_a9_hrtimer_set(uint64_t deadline)
+{
+  gltimer_set(&gltimer, deadline);
+}
+
+/*******************************************************************************
+ * Outer cache.
+ *
+ * PBX-A9 has a PL310 L2 cache controller in the MPCore private memory region.
+ * PB-A8 has no outer cache: the Cortex-A8 L2 cache is maintained along with
+ * L1 by the CP15 operations.
+ ******************************************************************************/
+
+static struct PL310 l2cc;
+static int l2cc_enabled;
+
+static void
+realview_pbx_a9_cache_init(void)
+{
+  if (pl310_init(&l2cc, PA2KVA(PHYS_L2CC)) == 0)
+    l2cc_enabled = 1;
+}
+
+static void
+realview_pbx_a9_cache_clean(physaddr_t pa, size_t n)
+{
+  if (l2cc_enabled)
+    pl310_clean(&l2cc, pa, n);
+}
+
+static void
+realview_pbx_a9_cache_invalidate(physaddr_t pa, size_t n)
+{
+  if (l2cc_enabled)
+    pl310_invalidate(&l2cc, pa, n);
+}
+
+static void
+realview_pbx_a9_cache_flush(physaddr_t pa, size_t n)
+{
+  if (l2cc_enabled)
+    pl310_flush(&l2cc, pa, n);
 }
 
 MACH_DEFINE(realview_pbx_a9) {
@@ -383,6 +571,15 @@ MACH_DEFINE(realview_pbx_a9) {
 
   .timer_init            = realview_pbx_a9_timer_init,
   .timer_init_percpu     = realview_pbx_a9_timer_init_percpu,
+  .timer_set_oneshot     = realview_pbx_a9_timer_set_oneshot,
+  .timer_set_periodic    = realview_pbx_a9_timer_set_periodic,
+  .clock_source          = realview_pbx_a9_clock_source,
+  .hrtimer_set           = realview_pbx_a9_hrtimer_set,
+
+  .cache_init            = realview_pbx_a9_cache_init,
+  .cache_clean           = realview_pbx_a9_cache_clean,
+  .cache_invalidate      = realview_pbx_a9_cache_invalidate,
+  .cache_flush           = realview_pbx_a9_cache_flush,
 
   .rtc_init              = realview_rtc_init,
   .rtc_get_time          = realview_rtc_get_time,
@@ -393,6 +590,7 @@ MACH_DEFINE(realview_pbx_a9) {
   .console_init          = realview_console_init,
   .console_getc          = realview_console_getc,
   .console_putc          = realview_console_putc,
+  .console_fb            = realview_console_fb,
 
   .tty_erase             = realview_tty_erase,
   .tty_flush             = realview_tty_flush,
@@ -403,4 +601,5 @@ MACH_DEFINE(realview_pbx_a9) {
 
   .eth_init              = realview_eth_init,
   .eth_write             = realview_eth_write,
+  .eth_stats             = realview_eth_stats,
 };
@@ -0,0 +1,387 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <sys/timepage.h>
+
+#include <arch/arm/mach.h>
+#include <kernel/core/cpu.h>
+#include <kernel/core/hrtimer.h>
+#include <kernel/mm/memlayout.h>
+#include <kernel/trap.h>
+#include <kernel/interrupt.h>
+#include <kernel/spinlock.h>
+#include <kernel/time.h>
+#include <kernel/fs/buf.h>
+#include <kernel/fs/iosched.h>
+#include <kernel/dev.h>
+#include <kernel/iostat.h>
+#include <kernel/tty.h>
+
+#include <kernel/drivers/uart.h>
+#include <kernel/drivers/virtio.h>
+
+#include <arch/arm/gic.h>
+#include <arch/arm/gtimer.h>
+#include <arch/arm/pl011.h>
+#include <arch/arm/pl031.h>
+#include <arch/arm/psci.h>
+
+/*******************************************************************************
+ * QEMU "virt" board.
+ *
+ * A machine with no real hardware counterpart, made of the devices that are
+ * cheapest to emulate: a GICv2, the Generic Timer, a PL011 UART, a PL031 RTC
+ * and a row of virtio-mmio windows for the disk and the network card. There
+ * is no display or keyboard, all ttys go to the serial port. RAM starts at
+ * 1GB (see PHYS_RAM_BASE), the devices live below it.
+ *
+ * The kernel is booted with a device tree, so the bootloader passes ~0 as the
+ * machine type.
+ ******************************************************************************/
+
+#define PHYS_GICD         0x08000000    ///< Distributor
+#define PHYS_GICC         0x08010000    ///< Interrupt interface
+#define PHYS_UART         0x09000000    ///< PL011 UART
+#define PHYS_RTC          0x09010000    ///< PL031 RTC
+#define PHYS_VIRTIO       0x0A000000    ///< The first virtio-mmio window
+
+#define IRQ_UART          33
+#define IRQ_VIRTIO        48            ///< Interrupt of the first window
+#define IRQ_VTIMER        27            ///< Virtual timer PPI
+#define IRQ_PTIMER        30            ///< Non-secure physical timer PPI
+
+#define VIRTIO_WINDOWS    32            ///< The number of virtio-mmio windows
+#define VIRTIO_WINDOW     0x200         ///< The size of one window
+
+#define TICK_RATE     100U          // Desired timer events rate, in Hz
+
+// Entry point of the secondary processors, see entry.S
+extern uint8_t entry[];
+
+static struct Gic gic;
+static struct GTimer gtimer;
+
+static void
+virt_interrupt_ipi(unsigned cpu, int irq)
+{
+  gic_sgi_cpu(&gic, irq, cpu);
+}
+
+static int
+virt_interrupt_id(void)
+{
+  return gic_intid(&gic);
+}
+
+static void
+virt_interrupt_enable(int irq, int cpu)
+{
+  gic_setup(&gic, irq, cpu);
+}
+
+static void
+virt_interrupt_mask(int irq)
+{
+  gic_disable(&gic, irq);
+}
+
+static void
+virt_interrupt_unmask(int irq)
+{
+  gic_enable(&gic, irq);
+}
+
+static void
+virt_interrupt_init(void)
+{
+  unsigned cpu;
+
+  gic_init(&gic, PA2KVA(PHYS_GICC), PA2KVA(PHYS_GICD));
+
+  // Power up the secondary processors. The entry code runs with the MMU off,
+  // so pass its physical address. CPUs that do not exist are simply refused.
+  for (cpu = 1; cpu < K_CPU_MAX; cpu++)
+    psci_cpu_on(cpu, (uint32_t) (uintptr_t) entry);
+}
+
+static void
+virt_interrupt_init_percpu(void)
+{
+  gic_init_percpu(&gic);
+}
+
+static void
+virt_interrupt_eoi(int irq)
+{
+  gic_eoi(&gic, irq);
+}
+
+static int
+virt_timer_irq(int irq, void *arg)
+{
+  gtimer_eoi(&gtimer, TICK_RATE);
+  return timer_irq(irq, arg);
+}
+
+// The physical timer runs the high-resolution timers
+static int
+virt_hrtimer_irq(int irq, void *arg)
+{
+  (void) irq;
+  (void) arg;
+
+  gtimer_hr_eoi(&gtimer);
+  k_hrtimer_irq();
+  return 1;
+}
+
+static void
+virt_timer_init(void)
+{
+  gtimer_init(&gtimer);
+  gtimer_init_percpu(&gtimer, TICK_RATE);
+  interrupt_attach(IRQ_VTIMER, virt_timer_irq, NULL);
+  interrupt_attach(IRQ_PTIMER, virt_hrtimer_irq, NULL);
+}
+
+static void
+virt_timer_init_percpu(void)
+{
+  gtimer_init_percpu(&gtimer, TICK_RATE);
+  interrupt_unmask(IRQ_VTIMER);
+  interrupt_unmask(IRQ_PTIMER);
+}
+
+static void
+virt_timer_set_oneshot(unsigned long ticks)
+{
+  gtimer_set_oneshot(&gtimer, TICK_RATE, ticks);
+}
+
+static unsigned long
+virt_timer_set_periodic(void)
+{
+  return gtimer_set_periodic(&gtimer, TICK_RATE);
+}
+
+static uint64_t
+virt_clock_read(void)
+{
+  return gtimer_count(&gtimer);
+}
+
+// User programs read the physical count directly, see gtimer_init_percpu
+static struct ClockSource virt_clock = {
+  .read = virt_clock_read,
+  .mask = ~0ULL,
+  .user = TP_COUNTER_CNTPCT,
+};
+
+static struct ClockSource *
+virt_clock_source(void)
+{
+  virt_clock.freq = gtimer.freq;
+  return &virt_clock;
+}
+
+static void
+virt_hrtimer_set(uint64_t deadline)
+{
+  gtimer_hr_set(&gtimer, deadline);
+}
+
+static struct PL031 rtc;
+
+static void
+virt_rtc_init(void)
+{
+  pl031_init(&rtc, PA2KVA(PHYS_RTC));
+}
+
+static time_t
+virt_rtc_get_time(void)
+{
+  return pl031_get_time(&rtc);
+}
+
+static void
+virt_rtc_set_time(time_t time)
+{
+  pl031_set_time(&rtc, time);
+}
+
+// The I/O window and the interrupt of a virtio-mmio transport
+#define VIRTIO_BASE(i)  PA2KVA(PHYS_VIRTIO + (i) * VIRTIO_WINDOW)
+#define VIRTIO_IRQ(i)   (IRQ_VIRTIO + (i))
+
+static struct VirtioBlk blk;
+static struct IoQueue storage_queue;
+
+static void
+virt_storage_request(struct Buf **bufs, unsigned n)
+{
+  virtio_blk_request(&blk, bufs, n);
+}
+
+static struct BlockDev virt_storage_dev = {
+  .request = virt_storage_request,
+  .queue   = &storage_queue,
+};
+
+static int
+virt_storage_init(void)
+{
+  unsigned i;
+
+  for (i = 0; i < VIRTIO_WINDOWS; i++)
+    if (virtio_blk_init(&blk, VIRTIO_BASE(i), VIRTIO_IRQ(i)) == 0)
+      break;
+
+  if (i == VIRTIO_WINDOWS) {
+    warn("no virtio block device");
+    return -ENODEV;
+  }
+
+  if (io_queue_init(&storage_queue, &virt_storage_dev, &io_deadline_sched,
+                    blk.depth) != 0)
+    panic("cannot initialize the storage queue");
+  iostat_register(&blk.stats, "vda", 0x0000);
+  dev_register_block(VIRTIO_BLK_MAJOR, &virt_storage_dev);
+  return 0;
+}
+
+#define UART_CLOCK        24000000U     // UART clock rate, in Hz
+#define UART_BAUD_RATE    115200        // Required baud rate
+
+static struct Uart uart0;
+static struct Pl011 pl011;
+
+static int
+virt_console_init(void)
+{
+  pl011_init(&pl011, PA2KVA(PHYS_UART), UART_CLOCK, UART_BAUD_RATE);
+  uart_init(&uart0, &pl011_ops, &pl011, IRQ_UART);
+
+  return 0;
+}
+
+static int
+virt_console_getc(void)
+{
+  return uart_getc(&uart0);
+}
+
+static void
+virt_console_putc(char c)
+{
+  uart_putc(&uart0, c);
+}
+
+static struct VirtioNet net;
+
+static int
+virt_eth_init(void)
+{
+  unsigned i;
+
+  for (i = 0; i < VIRTIO_WINDOWS; i++)
+    if (virtio_net_init(&net, VIRTIO_BASE(i), VIRTIO_IRQ(i)) == 0)
+      return 0;
+
+  warn("no virtio network device");
+  return -ENODEV;
+}
+
+static int
+virt_eth_write(struct pbuf *p)
+{
+  return virtio_net_write(&net, p);
+}
+
+static void
+virt_eth_stats(struct NetIfStats *stats)
+{
+  virtio_net_stats(&net, stats);
+}
+
+static void
+virt_tty_out_char(struct Tty *tty, char c)
+{
+  // Only the system console has somewhere to go
+  if (tty == tty_system)
+    uart_putc(&uart0, c);
+}
+
+static void
+virt_tty_flush(struct Tty *tty)
+{
+  (void) tty;
+}
+
+static void
+virt_tty_erase(struct Tty *tty)
+{
+  virt_tty_out_char(tty, '\b');
+  virt_tty_out_char(tty, ' ');
+  virt_tty_out_char(tty, '\b');
+}
+
+static void
+virt_tty_switch(struct Tty *tty)
+{
+  (void) tty;
+}
+
+static void
+virt_tty_init_system(void)
+{
+  mach_current->console_init();
+}
+
+static void
+virt_tty_init(struct Tty *tty, int i)
+{
+  (void) i;
+
+  tty->out.screen = NULL;
+}
+
+MACH_DEFINE(virt) {
+  .type = MACH_VIRT,
+
+  .interrupt_ipi         = virt_interrupt_ipi,
+  .interrupt_id          = virt_interrupt_id,
+  .interrupt_enable      = virt_interrupt_enable,
+  .interrupt_init        = virt_interrupt_init,
+  .interrupt_init_percpu = virt_interrupt_init_percpu,
+  .interrupt_mask        = virt_interrupt_mask,
+  .interrupt_unmask      = virt_interrupt_unmask,
+  .interrupt_eoi         = virt_interrupt_eoi,
+
+  .timer_init            = virt_timer_init,
+  .timer_init_percpu     = virt_timer_init_percpu,
+  .timer_set_oneshot     = virt_timer_set_oneshot,
+  .timer_set_periodic    = virt_timer_set_periodic,
+  .clock_source          = virt_clock_source,
+  .hrtimer_set           = virt_hrtimer_set,
+
+  .rtc_init              = virt_rtc_init,
+  .rtc_get_time          = virt_rtc_get_time,
+  .rtc_set_time          = virt_rtc_set_time,
+
+  .storage_init          = virt_storage_init,
+
+  .console_init          = virt_console_init,
+  .console_getc          = virt_console_getc,
+  .console_putc          = virt_console_putc,
+
+  .tty_erase             = virt_tty_erase,
+  .tty_flush             = virt_tty_flush,
+  .tty_init              = virt_tty_init,
+  .tty_init_system       = virt_tty_init_system,
+  .tty_out_char          = virt_tty_out_char,
+  .tty_switch            = virt_tty_switch,
+
+  .eth_init              = virt_eth_init,
+  .eth_write             = virt_eth_write,
+  .eth_stats             = virt_eth_stats,
+};
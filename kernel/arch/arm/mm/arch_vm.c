@@ -1,6 +1,12 @@
+#include <errno.h>
+#include <string.h>
 #include <sys/mman.h>
 
+#include <kernel/core/cpu.h>
+#include <kernel/core/irq.h>
+#include <kernel/core/percpu.h>
 #include <kernel/mm/memlayout.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 #include <kernel/page.h>
 
@@ -21,55 +27,225 @@
  * Since the ARM hardware support 1K page tables at the second level, but our
  * kernel manages physical memory in units of 4K pages, we fit two second-level
  * tables in one page (and use the remaining space to store extra flags that are
- * not provided by the hardware for each page table entry).
+ * not provided by the hardware for each page table entry). Large user regions
+ * can also be mapped with 1MB sections directly in the first-level table; the
+ * two entries that share a second-level table page are then managed
+ * independently, and the page is only freed when neither of them uses it.
+ *
+ * User mappings are not global, and their TLB entries are tagged with the
+ * 8-bit address space identifier (ASID) of the owning address space, so the
+ * TLB does not have to be flushed on context switches. ASIDs are allocated
+ * per address space and carry a generation number in the upper bits. When all
+ * ASIDs of the current generation are used up, a new generation starts and
+ * each CPU flushes its TLB before loading an ASID from the new generation. The
+ * ASIDs running on other CPUs at that moment are reserved and keep their
+ * numbers, as in the Linux kernel.
  */
 
 #define MAKE_L1_SECTION(pa, ap) \
-  ((pa) | L1_DESC_TYPE_SECT | L1_DESC_SECT_AP(ap) | L1_DESC_SECT_B | L1_DESC_SECT_C)
+  ((pa) | L1_DESC_TYPE_SECT | L1_DESC_SECT_AP(ap) | L1_DESC_SECT_WBWA)
+
+// Higher-half mapping of the n-th megabyte of RAM
+#define ENTRY_SECTION(n) \
+  [L1_IDX(VIRT_KERNEL_BASE + PHYS_RAM_BASE) + (n)] = \
+    MAKE_L1_SECTION(PHYS_RAM_BASE + (n) * 0x100000, AP_PRIV_RW)
 
 // Initial translation table to "get off the ground"
 __attribute__((__aligned__(L1_TABLE_SIZE))) l1_desc_t
 entry_pgdir[L1_NR_ENTRIES] = {
-  // Identity mapping for the first 1MB of physical memory (just enough to
-  // load the entry point code):
-  [0x0]                            = MAKE_L1_SECTION(0x000000, AP_PRIV_RW),
-
-  // Higher-half mappings for the first 16MB of physical memory (should be
-  // enough to initialize the page allocator, setup the master translation table
-  // and allocate the LCD framebuffer):
-  [L1_IDX(VIRT_KERNEL_BASE) + 0x0] = MAKE_L1_SECTION(0x000000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0x1] = MAKE_L1_SECTION(0x100000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0x2] = MAKE_L1_SECTION(0x200000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0x3] = MAKE_L1_SECTION(0x300000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0x4] = MAKE_L1_SECTION(0x400000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0x5] = MAKE_L1_SECTION(0x500000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0x6] = MAKE_L1_SECTION(0x600000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0x7] = MAKE_L1_SECTION(0x700000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0x8] = MAKE_L1_SECTION(0x800000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0x9] = MAKE_L1_SECTION(0x900000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0xA] = MAKE_L1_SECTION(0xA00000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0xB] = MAKE_L1_SECTION(0xB00000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0xC] = MAKE_L1_SECTION(0xC00000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0xD] = MAKE_L1_SECTION(0xD00000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0xE] = MAKE_L1_SECTION(0xE00000, AP_PRIV_RW),
-  [L1_IDX(VIRT_KERNEL_BASE) + 0xF] = MAKE_L1_SECTION(0xF00000, AP_PRIV_RW),
+  // Identity mapping for the first 1MB of RAM (just enough to load the entry
+  // point code):
+  [L1_IDX(PHYS_RAM_BASE)] = MAKE_L1_SECTION(PHYS_RAM_BASE, AP_PRIV_RW),
+
+  // Higher-half mappings for the first 16MB of RAM (should be enough to
+  // initialize the page allocator, setup the master translation table and
+  // allocate the LCD framebuffer):
+  ENTRY_SECTION(0), ENTRY_SECTION(1), ENTRY_SECTION(2), ENTRY_SECTION(3),
+  ENTRY_SECTION(4), ENTRY_SECTION(5), ENTRY_SECTION(6), ENTRY_SECTION(7),
+  ENTRY_SECTION(8), ENTRY_SECTION(9), ENTRY_SECTION(10), ENTRY_SECTION(11),
+  ENTRY_SECTION(12), ENTRY_SECTION(13), ENTRY_SECTION(14), ENTRY_SECTION(15),
 };
 
 // Master kernel page table.
 static void *kernel_pgtab;
+// Protects the second-level tables of the vmalloc region
+static struct KSpinLock kernel_map_lock = K_SPINLOCK_INITIALIZER("kernel_map");
 
 #define L2_TABLES_PER_PAGE  2
 
+// Page block allocation order for user process page tables (8Kb)
+#define PGTAB_ORDER 1
+
+static struct Page *arch_vm_table_page(l1_desc_t *, unsigned);
+static int          arch_vm_table_alloc(l1_desc_t *, unsigned);
+static struct Page *arch_vm_cache_get(unsigned, int, int);
+static void         arch_vm_cache_put(struct Page *, unsigned);
+static unsigned long arch_vm_cache_shrink(void);
+
+/*
+ * Every new address space needs a first-level table and a few second-level
+ * table pages, all of which must be zeroed. Creating address spaces is frequent
+ * (each fork and exec), so the tables released by exiting processes are cleared
+ * and kept in small per-CPU caches, and the next process picks them up without
+ * going through the page allocator. The caches are dropped when the memory
+ * runs low.
+ */
+
+#define PGTAB_CACHE_SIZE  8     ///< First-level tables per CPU
+#define PTTAB_CACHE_SIZE  32    ///< Second-level table pages per CPU
+
+struct PgTabCache {
+  struct KSpinLock lock;
+  struct {
+    unsigned     count;
+    unsigned     size;
+    struct Page *pages[PTTAB_CACHE_SIZE];
+  } bins[PGTAB_ORDER + 1];           // Indexed by the block order
+};
+
+static __percpu struct PgTabCache arch_vm_cache = {
+  .lock = K_SPINLOCK_INITIALIZER("arch_vm_cache"),
+  .bins = {
+    [0]           = { .size = PTTAB_CACHE_SIZE },
+    [PGTAB_ORDER] = { .size = PGTAB_CACHE_SIZE },
+  },
+};
+
+static struct PageShrinker arch_vm_cache_shrinker = {
+  .name   = "arch_vm_cache",
+  .shrink = arch_vm_cache_shrink,
+};
+
+#define ASID_BITS       8
+#define ASID_MASK       ((1UL << ASID_BITS) - 1)
+#define ASID_GENERATION (1UL << ASID_BITS)
+
+static struct {
+  struct KSpinLock lock;
+  /** The current generation (in the bits above ASID_MASK) */
+  unsigned long    generation;
+  /** The next candidate ASID number */
+  unsigned long    next;
+  /** ASID numbers used in the current generation */
+  unsigned long    map[(ASID_MASK + 1) / (sizeof(unsigned long) * 8)];
+  /** The ASID loaded on each CPU (0 if running the kernel page table) */
+  unsigned long    active[K_CPU_MAX];
+  /** ASIDs that were active during the last rollover */
+  unsigned long    reserved[K_CPU_MAX];
+  /** CPUs that must flush their TLBs before loading a new ASID */
+  unsigned         flush_pending;
+} asid_info = {
+  .lock       = K_SPINLOCK_INITIALIZER("asid"),
+  .generation = ASID_GENERATION,
+  .next       = 1,
+  .map        = { 1 },    // ASID 0 is used by the kernel page table
+};
+
+#define ASID_MAP_WORD(n)  ((n) / (sizeof(unsigned long) * 8))
+#define ASID_MAP_BIT(n)   (1UL << ((n) % (sizeof(unsigned long) * 8)))
+
+// Start a new ASID generation
+static void
+arch_vm_asid_rollover(void)
+{
+  int i;
+
+  asid_info.generation += ASID_GENERATION;
+  if (asid_info.generation == 0)
+    asid_info.generation = ASID_GENERATION;
+
+  memset(asid_info.map, 0, sizeof(asid_info.map));
+  asid_info.map[0] = 1;
+
+  // The ASIDs currently in use keep their numbers in the new generation
+  for (i = 0; i < K_CPU_MAX; i++) {
+    unsigned long asid = asid_info.active[i];
+
+    asid_info.reserved[i] = asid;
+    if (asid != 0)
+      asid_info.map[ASID_MAP_WORD(asid & ASID_MASK)] |=
+        ASID_MAP_BIT(asid & ASID_MASK);
+  }
+
+  asid_info.flush_pending = (1U << K_CPU_MAX) - 1;
+  asid_info.next = 1;
+}
+
+// Assign an ASID from the current generation
+static unsigned long
+arch_vm_asid_new(unsigned long asid)
+{
+  unsigned long n;
+  int i, found = 0;
+
+  debug_assert(k_spinlock_holding(&asid_info.lock));
+
+  if (asid != 0) {
+    for (i = 0; i < K_CPU_MAX; i++) {
+      if (asid_info.reserved[i] == asid) {
+        asid_info.reserved[i] = asid_info.generation | (asid & ASID_MASK);
+        found = 1;
+      }
+    }
+
+    if (found)
+      return asid_info.generation | (asid & ASID_MASK);
+  }
+
+  for (n = asid_info.next; n <= ASID_MASK; n++)
+    if (!(asid_info.map[ASID_MAP_WORD(n)] & ASID_MAP_BIT(n)))
+      break;
+
+  if (n > ASID_MASK) {
+    arch_vm_asid_rollover();
+
+    // At most K_CPU_MAX ASIDs are reserved, so there is always a free one
+    for (n = 1; n <= ASID_MASK; n++)
+      if (!(asid_info.map[ASID_MAP_WORD(n)] & ASID_MAP_BIT(n)))
+        break;
+  }
+
+  asid_info.map[ASID_MAP_WORD(n)] |= ASID_MAP_BIT(n);
+  asid_info.next = n + 1;
+
+  return asid_info.generation | n;
+}
+
 /**
- * Load a page table.
+ * Load a user page table.
  *
  * @param pgtab Pointer to the page table to be loaded.
+ * @param asid  Pointer to the ASID of the address space. Initially it must be
+ *              zero, and it is updated when a new ASID is assigned.
  */
 void
-arch_vm_load(void *pgtab)
+arch_vm_load(void *pgtab, unsigned long *asid)
 {
+  unsigned cpu;
+
+  k_spinlock_acquire(&asid_info.lock);
+
+  cpu = k_cpu_id();
+
+  if ((*asid & ~ASID_MASK) != asid_info.generation)
+    *asid = arch_vm_asid_new(*asid);
+
+  asid_info.active[cpu] = *asid;
+
+  if (asid_info.flush_pending & (1U << cpu)) {
+    asid_info.flush_pending &= ~(1U << cpu);
+    cp15_tlbiall();
+  }
+
+  k_spinlock_release(&asid_info.lock);
+
+  // Never let the previous translation table be used with the new ASID
+  cp15_ttbr0_set(KVA2PA(kernel_pgtab));
+  asm volatile ("isb" ::: "memory");
+  cp15_contextidr_set(*asid & ASID_MASK);
+  asm volatile ("isb" ::: "memory");
   cp15_ttbr0_set(KVA2PA(pgtab));
-  cp15_tlbiall();
+  asm volatile ("isb" ::: "memory");
 }
 
 /**
@@ -78,7 +254,16 @@ arch_vm_load(void *pgtab)
 void
 arch_vm_load_kernel(void)
 {
-  arch_vm_load(kernel_pgtab);
+  // The master table has no user mappings, so the reserved ASID 0 never
+  // tags any TLB entries
+  cp15_ttbr0_set(KVA2PA(kernel_pgtab));
+  asm volatile ("isb" ::: "memory");
+  cp15_contextidr_set(0);
+  asm volatile ("isb" ::: "memory");
+
+  k_spinlock_acquire(&asid_info.lock);
+  asid_info.active[k_cpu_id()] = 0;
+  k_spinlock_release(&asid_info.lock);
 }
 
 /**
@@ -159,16 +344,78 @@ arch_vm_pte_set(void *pte, physaddr_t pa, int flags)
   bits = L2_DESC_AP(prot_to_ap[flags & (PROT_WRITE | PROT_READ | VM_USER)]);
   if ((flags & VM_USER) && !(flags & PROT_EXEC))
     bits |= L2_DESC_SM_XN;
-  if (!(flags & PROT_NOCACHE))
-    bits |= (L2_DESC_B | L2_DESC_C);
+  if (flags & VM_WC)
+    bits |= L2_DESC_SM_WC;
+  else if (!(flags & PROT_NOCACHE))
+    bits |= L2_DESC_SM_WBWA;
+  if (flags & VM_USER)
+    bits |= L2_DESC_NG;
 
   *(l2_desc_t *) pte = pa | bits | L2_DESC_TYPE_SM;
   *pte_ext(pte) = flags;
 }
 
 /**
- * Clear a page table entry.
+ * Make a page table entry invalid, but keep the mapping flags that can later
+ * be retrieved by arch_vm_pte_flags().
  * 
+ * @param pte   Pointer to the page table entry
+ * @param flags Mapping flags
+ */
+void
+arch_vm_pte_set_flags(void *pte, int flags)
+{
+  *(l2_desc_t *) pte = 0;
+  *pte_ext(pte) = flags;
+}
+
+/**
+ * Make a page table entry invalid, but keep both the physical address (that
+ * can later be retrieved by arch_vm_pte_addr()) and the mapping flags. The
+ * caller is responsible for invalidating the TLB entries.
+ *
+ * @param pte   Pointer to the page table entry
+ * @param flags Mapping flags
+ */
+void
+arch_vm_pte_set_old(void *pte, int flags)
+{
+  *(l2_desc_t *) pte &= ~L2_DESC_TYPE_MASK;
+  *pte_ext(pte) = flags;
+}
+
+/**
+ * Make a page table entry invalid, keeping the swap slot that holds the page
+ * contents as well as the mapping flags.
+ *
+ * @param pte   Pointer to the page table entry
+ * @param slot  The swap slot number
+ * @param flags Mapping flags
+ */
+void
+arch_vm_pte_set_swap(void *pte, unsigned long slot, int flags)
+{
+  // The two lowest bits must stay clear for the entry to remain invalid
+  *(l2_desc_t *) pte = (l2_desc_t) slot << 2;
+  *pte_ext(pte) = flags;
+}
+
+/**
+ * Return the swap slot kept in an entry set by arch_vm_pte_set_swap().
+ *
+ * @param pte Pointer to the page table entry
+ *
+ * @return The swap slot number
+ */
+unsigned long
+arch_vm_pte_swap(void *pte)
+{
+  return *(l2_desc_t *) pte >> 2;
+}
+
+/**
+ * Clear a page table entry.
+ *
  * @param pte Pointer to the page table entry
  */
 void
@@ -186,7 +433,58 @@ arch_vm_pte_clear(void *pte)
 void
 arch_vm_invalidate(uintptr_t va)
 {
-  cp15_tlbimva(va);
+  // The page table may belong to an address space that is not loaded on this
+  // CPU, so drop the entries for all ASIDs on all CPUs
+  asm volatile ("dsb ishst" ::: "memory");
+  cp15_tlbimvaais(va & ~(PAGE_SIZE - 1));
+  asm volatile ("dsb ish\n\tisb" ::: "memory");
+}
+
+/**
+ * Invalidate all TLB entries (for all ASIDs on all CPUs).
+ */
+void
+arch_vm_invalidate_all(void)
+{
+  asm volatile ("dsb ishst" ::: "memory");
+  cp15_tlbiallis();
+  asm volatile ("dsb ish\n\tisb" ::: "memory");
+}
+
+// Above this number of pages, dropping all entries of the address space at
+// once is cheaper than invalidating the pages one by one
+#define INVALIDATE_RANGE_MAX  32
+
+/**
+ * Invalidate TLB entries for a range of user addresses on all CPUs, waiting
+ * for the completion only once.
+ *
+ * @param asid  The ASID of the address space the range belongs to
+ * @param start The start of the range
+ * @param end   The end of the range (exclusive)
+ */
+void
+arch_vm_invalidate_range(unsigned long asid, uintptr_t start, uintptr_t end)
+{
+  uintptr_t va;
+
+  start = ROUND_DOWN(start, PAGE_SIZE);
+
+  asm volatile ("dsb ishst" ::: "memory");
+
+  if ((end - start) <= INVALIDATE_RANGE_MAX * PAGE_SIZE) {
+    for (va = start; va < end; va += PAGE_SIZE)
+      cp15_tlbimvaais(va);
+  } else if ((asid & ASID_MASK) != 0) {
+    // Entries tagged with an ASID of an older generation are never used, a
+    // CPU flushes its TLB before switching to the new generation
+    cp15_tlbiasidis(asid & ASID_MASK);
+  } else {
+    // The address space has not been given an ASID yet
+    cp15_tlbiallis();
+  }
+
+  asm volatile ("dsb ish\n\tisb" ::: "memory");
 }
 
 /**
@@ -216,28 +514,191 @@ arch_vm_lookup(void *pgtab, uintptr_t va, int alloc)
   tt = (l1_desc_t *) pgtab;
   tte = &tt[L1_IDX(va)];
   if ((*tte & L1_DESC_TYPE_MASK) == L1_DESC_TYPE_FAULT) {
-    struct Page *page;
-    physaddr_t pa;
-
-    if (!alloc || (page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_PGTAB)) == NULL)
+    if (!alloc || (arch_vm_table_alloc(tt, L1_IDX(va)) != 0))
       return NULL;
-  
-    page->ref_count++;
-
-    pa = page2pa(page);
-
-    // Allocate space for two second-level page tables at a time
-    tt[(L1_IDX(va) & ~1) + 0] = pa | L1_DESC_TYPE_TABLE;
-    tt[(L1_IDX(va) & ~1) + 1] = (pa + L2_TABLE_SIZE) | L1_DESC_TYPE_TABLE;
   } else if ((*tte & L1_DESC_TYPE_MASK) != L1_DESC_TYPE_TABLE) {
-    // trying to remap a fixed section
-    panic("not a page table");
+    // User sections must be split before the individual pages are modified
+    if (alloc || (pgtab == kernel_pgtab))
+      panic("not a page table");
+    return NULL;
   }
 
   pte = PA2KVA(L1_DESC_TABLE_BASE(*tte));
   return &pte[L2_IDX(va)];
 }
 
+// Get the page holding the second-level tables for the given pair of
+// first-level entries, or NULL if neither of them points to a table
+static struct Page *
+arch_vm_table_page(l1_desc_t *tt, unsigned idx)
+{
+  l1_desc_t *pair = &tt[idx & ~(L2_TABLES_PER_PAGE - 1)];
+  int i;
+
+  for (i = 0; i < L2_TABLES_PER_PAGE; i++)
+    if ((pair[i] & L1_DESC_TYPE_MASK) == L1_DESC_TYPE_TABLE)
+      return pa2page(L2_DESC_SM_BASE(pair[i]));
+
+  return NULL;
+}
+
+// Point an empty first-level entry to a second-level table
+static int
+arch_vm_table_alloc(l1_desc_t *tt, unsigned idx)
+{
+  l1_desc_t *pair = &tt[idx & ~(L2_TABLES_PER_PAGE - 1)];
+  struct Page *page;
+  physaddr_t pa;
+  int i;
+
+  assert((tt[idx] & L1_DESC_TYPE_MASK) == L1_DESC_TYPE_FAULT);
+
+  // The other entry of the pair may already own the page (if this one has
+  // been used for a section before)
+  if ((page = arch_vm_table_page(tt, idx)) == NULL) {
+    page = arch_vm_cache_get(0, PAGE_ALLOC_ZERO, PAGE_TAG_PGTAB);
+    if (page == NULL)
+      return -ENOMEM;
+    page->ref_count++;
+  }
+
+  pa = page2pa(page);
+
+  // Allocate space for two second-level page tables at a time
+  for (i = 0; i < L2_TABLES_PER_PAGE; i++)
+    if ((pair[i] & L1_DESC_TYPE_MASK) == L1_DESC_TYPE_FAULT)
+      pair[i] = (pa + i * L2_TABLE_SIZE) | L1_DESC_TYPE_TABLE;
+
+  return 0;
+}
+
+/**
+ * Get the number of page tables that share the second-level tables mapping
+ * the given user virtual address.
+ *
+ * @param pgtab Pointer to the page table
+ * @param va    The virtual address
+ *
+ * @return The number of owners, or 0 if there are no second-level tables
+ */
+int
+arch_vm_table_refs(void *pgtab, uintptr_t va)
+{
+  struct Page *page;
+
+  if ((page = arch_vm_table_page((l1_desc_t *) pgtab, L1_IDX(va))) == NULL)
+    return 0;
+
+  return __atomic_load_n(&page->ref_count, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Make the destination page table use the same second-level tables as the
+ * source one for the given address (VM_TABLE_SIZE bytes around it). The
+ * entries must not be modified through either page table while the tables
+ * are shared (see arch_vm_table_copy()).
+ *
+ * @param src   Pointer to the source page table
+ * @param dst   Pointer to the destination page table
+ * @param va    The virtual address
+ */
+void
+arch_vm_table_share(void *src, void *dst, uintptr_t va)
+{
+  l1_desc_t *src_pair = &((l1_desc_t *) src)[L1_IDX(va) & ~(L2_TABLES_PER_PAGE - 1)];
+  l1_desc_t *dst_pair = &((l1_desc_t *) dst)[L1_IDX(va) & ~(L2_TABLES_PER_PAGE - 1)];
+  struct Page *page;
+  int i;
+
+  if ((page = arch_vm_table_page(src_pair, 0)) == NULL)
+    return;
+
+  // Already shared while cloning another region covered by the same tables
+  if (arch_vm_table_page(dst_pair, 0) == page)
+    return;
+
+  for (i = 0; i < L2_TABLES_PER_PAGE; i++) {
+    if ((src_pair[i] & L1_DESC_TYPE_MASK) != L1_DESC_TYPE_TABLE)
+      continue;
+
+    if ((dst_pair[i] & L1_DESC_TYPE_MASK) != L1_DESC_TYPE_FAULT)
+      panic("entry already in use");
+    dst_pair[i] = src_pair[i];
+  }
+
+  page->ref_count++;
+}
+
+/**
+ * Replace the shared second-level tables mapping the given address with a
+ * private copy. The caller must make sure the tables are shared with at least
+ * one other page table, and that no one modifies them during the copy.
+ *
+ * @param pgtab Pointer to the page table
+ * @param va    The virtual address
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ */
+int
+arch_vm_table_copy(void *pgtab, uintptr_t va)
+{
+  l1_desc_t *pair = &((l1_desc_t *) pgtab)[L1_IDX(va) & ~(L2_TABLES_PER_PAGE - 1)];
+  struct Page *page, *old_page;
+  physaddr_t pa;
+  int i;
+
+  old_page = arch_vm_table_page(pair, 0);
+  if ((old_page == NULL) || (old_page->ref_count < 2))
+    panic("tables not shared");
+
+  if ((page = arch_vm_cache_get(0, 0, PAGE_TAG_PGTAB)) == NULL)
+    return -ENOMEM;
+  page->ref_count++;
+
+  // Copy the flags stored after the hardware tables as well
+  memmove(page2kva(page), page2kva(old_page), PAGE_SIZE);
+
+  pa = page2pa(page);
+  for (i = 0; i < L2_TABLES_PER_PAGE; i++)
+    if ((pair[i] & L1_DESC_TYPE_MASK) == L1_DESC_TYPE_TABLE)
+      pair[i] = (pa + i * L2_TABLE_SIZE) | L1_DESC_TYPE_TABLE;
+
+  old_page->ref_count--;
+
+  // The translations stay the same, but cached table walks may still refer to
+  // the old tables, which can be freed as soon as the other owners drop them
+  arch_vm_invalidate_all();
+
+  return 0;
+}
+
+/**
+ * Stop using the shared second-level tables mapping the given address,
+ * without touching any of their entries. The caller must make sure the tables
+ * are shared with at least one other page table.
+ *
+ * @param pgtab Pointer to the page table
+ * @param va    The virtual address
+ */
+void
+arch_vm_table_detach(void *pgtab, uintptr_t va)
+{
+  l1_desc_t *pair = &((l1_desc_t *) pgtab)[L1_IDX(va) & ~(L2_TABLES_PER_PAGE - 1)];
+  struct Page *page;
+  int i;
+
+  page = arch_vm_table_page(pair, 0);
+  if ((page == NULL) || (page->ref_count < 2))
+    panic("tables not shared");
+
+  for (i = 0; i < L2_TABLES_PER_PAGE; i++)
+    if ((pair[i] & L1_DESC_TYPE_MASK) == L1_DESC_TYPE_TABLE)
+      pair[i] = 0;
+
+  page->ref_count--;
+}
+
 /**
  * Set a 1Mb section entry.
  * 
@@ -253,12 +714,164 @@ init_section_desc(l1_desc_t *tte, physaddr_t pa, int flags)
   bits = L1_DESC_SECT_AP(prot_to_ap[flags & (PROT_WRITE | PROT_READ | VM_USER)]);
   if ((flags & VM_USER) && !(flags & PROT_EXEC))
     bits |= L1_DESC_SECT_XN;
-  if (!(flags & PROT_NOCACHE))
-    bits |= (L1_DESC_SECT_B | L1_DESC_SECT_C);
+  if (flags & VM_WC)
+    bits |= L1_DESC_SECT_WC;
+  else if (!(flags & PROT_NOCACHE))
+    bits |= L1_DESC_SECT_WBWA;
+  if (flags & VM_USER)
+    bits |= L1_DESC_SECT_NG;
 
   *tte = pa | bits | L1_DESC_TYPE_SECT;
 }
 
+/**
+ * Check whether the given user virtual address is mapped by a section.
+ *
+ * @param pgtab       Pointer to the page table
+ * @param va          The virtual address
+ * @param pa_store    Pointer to the memory location to store the physical
+ *                    address of the page containing va
+ * @param flags_store Pointer to the memory location to store the mapping flags
+ *
+ * @return 1 if va belongs to a section, 0 otherwise
+ */
+int
+arch_vm_section_lookup(void *pgtab, uintptr_t va, physaddr_t *pa_store,
+                       int *flags_store)
+{
+  l1_desc_t tte = ((l1_desc_t *) pgtab)[L1_IDX(va)];
+  int ap, flags;
+
+  if ((tte & L1_DESC_TYPE_MASK) != L1_DESC_TYPE_SECT)
+    return 0;
+
+  ap = (tte >> 10) & 0x23;
+
+  flags = VM_PAGE | PROT_READ;
+  if ((ap == AP_PRIV_RW) || (ap == AP_BOTH_RW))
+    flags |= PROT_WRITE;
+  if ((ap == AP_USER_RO) || (ap == AP_BOTH_RW) || (ap == AP_BOTH_RO))
+    flags |= VM_USER;
+  if (!(tte & L1_DESC_SECT_XN))
+    flags |= PROT_EXEC;
+  if ((tte & L1_DESC_SECT_WBWA) == L1_DESC_SECT_WC)
+    flags |= VM_WC;
+  else if (!(tte & L1_DESC_SECT_C))
+    flags |= PROT_NOCACHE;
+
+  if (pa_store != NULL)
+    *pa_store = L1_DESC_SECT_BASE(tte) + ROUND_DOWN(va % L1_SECTION_SIZE,
+                                                    PAGE_SIZE);
+  if (flags_store != NULL)
+    *flags_store = flags;
+
+  return 1;
+}
+
+/**
+ * Map a 1MB section at the given user virtual address. All pages previously
+ * mapped in the section range must have been removed (reservations made by
+ * arch_vm_pte_set_flags() are discarded).
+ *
+ * @param pgtab Pointer to the page table
+ * @param va    The section-aligned virtual address
+ * @param pa    The section-aligned physical address
+ * @param flags Mapping flags
+ */
+void
+arch_vm_section_set(void *pgtab, uintptr_t va, physaddr_t pa, int flags)
+{
+  l1_desc_t *tt = (l1_desc_t *) pgtab;
+  l1_desc_t *tte = &tt[L1_IDX(va)];
+  struct Page *page;
+
+  assert((va % L1_SECTION_SIZE) == 0);
+  assert((pa % L1_SECTION_SIZE) == 0);
+
+  if ((va >= VIRT_KERNEL_BASE) || (pgtab == kernel_pgtab))
+    panic("not a user address %p", va);
+
+  if ((*tte & L1_DESC_TYPE_MASK) == L1_DESC_TYPE_TABLE) {
+    l2_desc_t *pt = (l2_desc_t *) PA2KVA(L1_DESC_TABLE_BASE(*tte));
+    int i;
+
+    for (i = 0; i < L2_NR_ENTRIES; i++) {
+      if (arch_vm_pte_valid(&pt[i]))
+        panic("pte still in use");
+      arch_vm_pte_clear(&pt[i]);
+    }
+
+    page = pa2page(L2_DESC_SM_BASE(*tte));
+    *tte = 0;
+
+    // Free the table page if the other entry of the pair does not use it
+    if ((arch_vm_table_page(tt, L1_IDX(va)) == NULL) &&
+        (--page->ref_count == 0))
+      arch_vm_cache_put(page, 0);
+  } else if ((*tte & L1_DESC_TYPE_MASK) != L1_DESC_TYPE_FAULT) {
+    panic("section already mapped at %p", va);
+  }
+
+  init_section_desc(tte, pa, flags);
+}
+
+/**
+ * Remove a section mapping.
+ *
+ * @param pgtab Pointer to the page table
+ * @param va    The section-aligned virtual address
+ */
+void
+arch_vm_section_clear(void *pgtab, uintptr_t va)
+{
+  l1_desc_t *tte = &((l1_desc_t *) pgtab)[L1_IDX(va)];
+
+  assert((*tte & L1_DESC_TYPE_MASK) == L1_DESC_TYPE_SECT);
+
+  *tte = 0;
+  arch_vm_invalidate(va);
+}
+
+/**
+ * Replace a section mapping with a second-level table that maps the same
+ * physical memory using small pages with the same permissions.
+ *
+ * @param pgtab Pointer to the page table
+ * @param va    A virtual address inside the section
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ */
+int
+arch_vm_section_split(void *pgtab, uintptr_t va)
+{
+  l1_desc_t *tt = (l1_desc_t *) pgtab;
+  l1_desc_t *tte = &tt[L1_IDX(va)];
+  l2_desc_t *pt;
+  physaddr_t pa;
+  int i, flags;
+
+  if (!arch_vm_section_lookup(pgtab, ROUND_DOWN(va, L1_SECTION_SIZE), &pa,
+                              &flags))
+    panic("not a section");
+
+  // Break the old mapping before making the new one, so that the TLB never
+  // holds entries of both sizes for the same address
+  *tte = 0;
+  arch_vm_invalidate(va);
+
+  if (arch_vm_table_alloc(tt, L1_IDX(va)) != 0) {
+    init_section_desc(tte, pa, flags);
+    return -ENOMEM;
+  }
+
+  pt = (l2_desc_t *) PA2KVA(L1_DESC_TABLE_BASE(*tte));
+  for (i = 0; i < L2_NR_ENTRIES; i++)
+    arch_vm_pte_set(&pt[i], pa + i * PAGE_SIZE, flags);
+
+  return 0;
+}
+
 /**
  * Setup a permanent mapping for the given memory region in the master
  * translation table. The memory region must be page-aligned.
@@ -307,6 +920,79 @@ init_fixed_mapping(uintptr_t va, uint32_t pa, size_t n, int flags)
   }
 }
 
+/**
+ * Map a page into the vmalloc region of the kernel address space. The
+ * second-level tables are allocated on demand and never freed.
+ *
+ * @param va    The kernel virtual address
+ * @param pa    The physical address to map to
+ * @param flags Mapping flags
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ */
+int
+arch_vm_kernel_map(uintptr_t va, physaddr_t pa, int flags)
+{
+  l2_desc_t *pte;
+
+  if ((va < VIRT_VMALLOC_BASE) || (va >= VIRT_VMALLOC_LIMIT))
+    panic("va %p is outside of the vmalloc region", va);
+
+  k_spinlock_acquire(&kernel_map_lock);
+
+  if ((pte = arch_vm_lookup(kernel_pgtab, va, 1)) == NULL) {
+    k_spinlock_release(&kernel_map_lock);
+    return -ENOMEM;
+  }
+
+  if (arch_vm_pte_valid(pte))
+    panic("PTE for %p already exists", va);
+
+  arch_vm_pte_set(pte, pa, flags);
+
+  k_spinlock_release(&kernel_map_lock);
+
+  // Make the new entry visible to the table walks on all CPUs
+  asm volatile ("dsb ishst\n\tisb" ::: "memory");
+
+  return 0;
+}
+
+/**
+ * Remove a page mapping from the vmalloc region. The caller must invalidate
+ * the TLB entries (see arch_vm_invalidate_range()) before reusing the page.
+ *
+ * @param va       The kernel virtual address
+ * @param pa_store Pointer to the memory location to store the physical
+ *                 address that was mapped
+ *
+ * @retval 0       Success
+ * @retval -EINVAL No page is mapped at the given address
+ */
+int
+arch_vm_kernel_unmap(uintptr_t va, physaddr_t *pa_store)
+{
+  l2_desc_t *pte;
+  int r = -EINVAL;
+
+  if ((va < VIRT_VMALLOC_BASE) || (va >= VIRT_VMALLOC_LIMIT))
+    panic("va %p is outside of the vmalloc region", va);
+
+  k_spinlock_acquire(&kernel_map_lock);
+
+  if (((pte = arch_vm_lookup(kernel_pgtab, va, 0)) != NULL) &&
+      arch_vm_pte_valid(pte)) {
+    *pa_store = arch_vm_pte_addr(pte);
+    arch_vm_pte_clear(pte);
+    r = 0;
+  }
+
+  k_spinlock_release(&kernel_map_lock);
+
+  return r;
+}
+
 /**
  * Initialize MMU, create and load the master page table. This function must be
  * called only on the bootstrap processor.
@@ -325,20 +1011,29 @@ arch_vm_init(void)
   kernel_pgtab = page2kva(page);
   page->ref_count++;
 
-  // Map all physical memory at VIRT_KERNEL_BASE
+  // Map I/O devices below RAM, if there are any
+  // Permissions: kernel RW, user NONE, disable cache
+  if (PHYS_RAM_BASE != 0)
+    init_fixed_mapping(VIRT_KERNEL_BASE, 0, PHYS_RAM_BASE,
+                       PROT_READ | PROT_WRITE | PROT_NOCACHE);
+
+  // Map all physical memory at VIRT_KERNEL_BASE + PHYS_RAM_BASE
   // Permissions: kernel RW, user NONE
-  init_fixed_mapping(VIRT_KERNEL_BASE, 0, PHYS_LIMIT, PROT_READ | PROT_WRITE);
+  init_fixed_mapping(VIRT_KERNEL_BASE + PHYS_RAM_BASE, PHYS_RAM_BASE,
+                     PHYS_LIMIT - PHYS_RAM_BASE, PROT_READ | PROT_WRITE);
 
-  // Map I/O devices
+  // Map I/O devices, up to the region used by vmalloc
   // Permissions: kernel RW, user NONE, disable cache 
   init_fixed_mapping(VIRT_KERNEL_BASE + PHYS_LIMIT, PHYS_LIMIT,
-                    VIRT_VECTOR_BASE - (VIRT_KERNEL_BASE + PHYS_LIMIT),
+                    VIRT_VMALLOC_BASE - (VIRT_KERNEL_BASE + PHYS_LIMIT),
                     PROT_READ | PROT_WRITE | PROT_NOCACHE);
 
   // Map exception vectors at VIRT_VECTOR_BASE
   // Permissions: kernel R, user NONE
   init_fixed_mapping(VIRT_VECTOR_BASE, (physaddr_t) _start, PAGE_SIZE, PROT_READ);
 
+  page_shrinker_register(&arch_vm_cache_shrinker);
+
   arch_vm_init_percpu();
 }
 
@@ -353,13 +1048,11 @@ arch_vm_init_percpu(void)
   cp15_ttbr1_set(KVA2PA(kernel_pgtab));
 
   cp15_ttbcr_set(1);  // TTBR0 table size is 8Kb
+  cp15_contextidr_set(0);
 
   cp15_tlbiall();
 }
 
-// Page block allocation order for user process page tables (8Kb)
-#define PGTAB_ORDER 1
-
 /**
  * Create a user process page table.
  *
@@ -370,7 +1063,8 @@ arch_vm_create(void)
 {
   struct Page *page;
 
-  if ((page = page_alloc_block(PGTAB_ORDER, PAGE_ALLOC_ZERO, PAGE_TAG_VM)) == NULL)
+  page = arch_vm_cache_get(PGTAB_ORDER, PAGE_ALLOC_ZERO, PAGE_TAG_VM);
+  if (page == NULL)
     return NULL;
 
   page->ref_count++;
@@ -400,11 +1094,14 @@ arch_vm_destroy(void *pgtab)
   for (i = 0; i < L1_IDX(VIRT_KERNEL_BASE); i += L2_TABLES_PER_PAGE) {
     l2_desc_t *pt;
 
-    if (!trtab[i])
+    for (j = 0; j < L2_TABLES_PER_PAGE; j++)
+      if ((trtab[i + j] & L1_DESC_TYPE_MASK) == L1_DESC_TYPE_SECT)
+        panic("section still in use");
+
+    if ((page = arch_vm_table_page(trtab, i)) == NULL)
       continue;
 
-    page = pa2page(L2_DESC_SM_BASE(trtab[i]));
-    pt   = (l2_desc_t *) page2kva(page);
+    pt = (l2_desc_t *) page2kva(page);
 
     // Check that the caller has removed all mappings
     for (j = 0; j < L2_NR_ENTRIES * L2_TABLES_PER_PAGE; j++)
@@ -412,11 +1109,110 @@ arch_vm_destroy(void *pgtab)
         panic("pte still in use");
 
     if (--page->ref_count == 0)
-      page_free_one(page);
+      arch_vm_cache_put(page, 0);
   }
 
   // Finally, free the first-level translation table itself
   page = kva2page(trtab);
   if (--page->ref_count == 0)
-    page_free_block(page, PGTAB_ORDER);
+    arch_vm_cache_put(page, PGTAB_ORDER);
+}
+
+/**
+ * Allocate a page table block, preferably from the cache of the current CPU.
+ * Cached blocks are always zeroed.
+ *
+ * @param order     PGTAB_ORDER for a first-level table, 0 for a page of
+ *                  second-level tables
+ * @param flags     Page allocation flags
+ * @param debug_tag Tag for blocks taken from the page allocator
+ *
+ * @return Pointer to the page structure or NULL if out of memory
+ */
+static struct Page *
+arch_vm_cache_get(unsigned order, int flags, int debug_tag)
+{
+  struct PgTabCache *cache;
+  struct Page *page = NULL;
+
+  k_irq_state_save();
+
+  cache = K_PERCPU_THIS(arch_vm_cache);
+
+  k_spinlock_acquire(&cache->lock);
+  if (cache->bins[order].count > 0)
+    page = cache->bins[order].pages[--cache->bins[order].count];
+  k_spinlock_release(&cache->lock);
+
+  k_irq_state_restore();
+
+  if (page == NULL)
+    page = page_alloc_block(order, flags, debug_tag);
+
+  return page;
+}
+
+/**
+ * Release a page table block that is no longer referenced. The block is
+ * cleared and kept in the cache of the current CPU, unless the cache is full.
+ *
+ * @param page  Pointer to the page structure
+ * @param order The block order, as passed to arch_vm_cache_get()
+ */
+static void
+arch_vm_cache_put(struct Page *page, unsigned order)
+{
+  struct PgTabCache *cache;
+  int cached = 0;
+
+  // Clear it here, on the exit path, rather than in the next fork. The entries
+  // are invalid, but the pages may still hold the software flags.
+  memset(page2kva(page), 0, PAGE_SIZE << order);
+
+  k_irq_state_save();
+
+  cache = K_PERCPU_THIS(arch_vm_cache);
+
+  k_spinlock_acquire(&cache->lock);
+  if (cache->bins[order].count < cache->bins[order].size) {
+    cache->bins[order].pages[cache->bins[order].count++] = page;
+    cached = 1;
+  }
+  k_spinlock_release(&cache->lock);
+
+  k_irq_state_restore();
+
+  if (!cached)
+    page_free_block(page, order);
+}
+
+// Return the cached page tables of all CPUs to the page allocator
+static unsigned long
+arch_vm_cache_shrink(void)
+{
+  unsigned long freed = 0;
+  unsigned i, order;
+
+  for (i = 0; i < K_CPU_MAX; i++) {
+    struct PgTabCache *cache = K_PERCPU_PTR(arch_vm_cache, i);
+
+    // Shrinkers must not wait for locks, skip the cache if it is busy
+    k_irq_state_save();
+
+    if (k_spinlock_try_acquire(&cache->lock) == 0) {
+      for (order = 0; order <= PGTAB_ORDER; order++) {
+        while (cache->bins[order].count > 0) {
+          page_free_block(cache->bins[order].pages[--cache->bins[order].count],
+                          order);
+          freed += 1U << order;
+        }
+      }
+
+      k_spinlock_release(&cache->lock);
+    }
+
+    k_irq_state_restore();
+  }
+
+  return freed;
 }
@@ -3,8 +3,15 @@
 int
 arch_process_copy(struct Process *parent, struct Process *child)
 {
-  *child->thread->tf = *parent->thread->tf;
+  (void) parent;
+
+  // Only the calling thread is duplicated
+  *child->thread->tf = *k_thread_current()->tf;
   child->thread->tf->r0 = 0;
+  child->thread->tls = k_thread_current()->tls;
+
+  // The callee-saved VFP registers must survive the call to fork()
+  arch_thread_fpu_copy(child->thread, k_thread_current());
 
   return 0;
 }
@@ -1,29 +1,39 @@
 #include <errno.h>
+#include <string.h>
 
 #include <kernel/process.h>
 #include <kernel/signal.h>
 #include <kernel/vmspace.h>
 #include <kernel/console.h>
 
+#include <arch/arm/fpu.h>
 #include <arch/arm/regs.h>
 
 int
 arch_signal_prepare(struct Process *process, struct SignalFrame *frame)
 {
-  uintptr_t ctx_va = process->thread->tf->sp - sizeof(struct SignalFrame);
+  struct KThread *thread = k_thread_current();
+  struct TrapFrame *tf = thread->tf;
+  uintptr_t ctx_va = (tf->sp - sizeof(struct SignalFrame)) & ~7U;
 
-  frame->ucontext.uc_mcontext.r0  = process->thread->tf->r0;
-  frame->ucontext.uc_mcontext.sp  = process->thread->tf->sp;
-  frame->ucontext.uc_mcontext.lr  = process->thread->tf->lr;
-  frame->ucontext.uc_mcontext.pc  = process->thread->tf->pc;
-  frame->ucontext.uc_mcontext.psr = process->thread->tf->psr;
+  frame->ucontext.uc_mcontext.r0  = tf->r0;
+  frame->ucontext.uc_mcontext.sp  = tf->sp;
+  frame->ucontext.uc_mcontext.lr  = tf->lr;
+  frame->ucontext.uc_mcontext.pc  = tf->pc;
+  frame->ucontext.uc_mcontext.psr = tf->psr;
 
-  if (vm_copy_out(process->vm->pgtab, frame, ctx_va, sizeof *frame) != 0)
+  // The handler is free to clobber the caller-saved VFP registers
+  arch_fpu_save(thread);
+  memcpy(frame->ucontext.uc_mcontext.d, thread->fpu.d,
+         sizeof(frame->ucontext.uc_mcontext.d));
+  frame->ucontext.uc_mcontext.fpscr = thread->fpu.fpscr;
+
+  if (vm_copy_out(process->vm, frame, ctx_va, sizeof *frame) != 0)
     return SIGKILL;
 
-  process->thread->tf->r0 = ctx_va;
-  process->thread->tf->sp = ctx_va;
-  process->thread->tf->pc = process->signal_stub;
+  tf->r0 = ctx_va;
+  tf->sp = ctx_va;
+  tf->pc = process->signal_stub;
 
   return 0;
 }
@@ -31,17 +41,26 @@ arch_signal_prepare(struct Process *process, struct SignalFrame *frame)
 int
 arch_signal_return(struct Process *process, const struct SignalFrame *ctx)
 {
+  struct KThread *thread = k_thread_current();
+  struct TrapFrame *tf = thread->tf;
+
+  (void) process;
+
   // Prevent malicious users from executing in kernel mode
   if ((ctx->ucontext.uc_mcontext.psr & PSR_M_MASK) != PSR_M_USR)
     return -EINVAL;
 
   // No need to check other regs - bad values will lead to page faults
 
-  process->thread->tf->r0  = ctx->ucontext.uc_mcontext.r0;
-  process->thread->tf->sp  = ctx->ucontext.uc_mcontext.sp;
-  process->thread->tf->lr  = ctx->ucontext.uc_mcontext.lr;
-  process->thread->tf->pc  = ctx->ucontext.uc_mcontext.pc;
-  process->thread->tf->psr = ctx->ucontext.uc_mcontext.psr;
+  tf->r0  = ctx->ucontext.uc_mcontext.r0;
+  tf->sp  = ctx->ucontext.uc_mcontext.sp;
+  tf->lr  = ctx->ucontext.uc_mcontext.lr;
+  tf->pc  = ctx->ucontext.uc_mcontext.pc;
+  tf->psr = ctx->ucontext.uc_mcontext.psr;
+
+  memcpy(thread->fpu.d, ctx->ucontext.uc_mcontext.d, sizeof(thread->fpu.d));
+  thread->fpu.fpscr = ctx->ucontext.uc_mcontext.fpscr;
+  arch_fpu_discard(thread);
 
-  return process->thread->tf->r0;;
+  return tf->r0;
 }
@@ -0,0 +1,338 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <kernel/bench.h>
+#include <kernel/console.h>
+#include <kernel/core/cpu.h>
+#include <kernel/core/mailbox.h>
+#include <kernel/fs/buf.h>
+#include <kernel/mutex.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/types.h>
+#include <kernel/vm.h>
+#include <kernel/vmspace.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Kernel microbenchmarks
+ * ----------------------------------------------------------------------------
+ *
+ * Each benchmark runs a pair of operations (e.g. get and put) in batches of
+ * BENCH_BATCH iterations and reports the fastest batch, which filters out
+ * interrupts and migrations to another CPU. Everything runs uncontended in the
+ * calling thread, so the results show the cost of the fast paths only. The
+ * scheduler benchmark adds idle low-priority threads to the run queue, but
+ * they never get to run while it is measuring.
+ *
+ * The results are printed to the console in the same format as the user-space
+ * benchmarks: "BENCH kernel_<name> <cycles> cycles/op".
+ */
+
+#define BENCH_BATCH   256
+
+// The number of low-priority threads kept ready during the scheduler benchmark
+#define BENCH_SCHED_PARKED  32
+
+// Run body in batches and store the minimum number of cycles per batch in best
+#define BENCH_MEASURE(best, batches, body)                  \
+  do {                                                      \
+    unsigned long bench_i;                                  \
+    unsigned bench_j;                                       \
+                                                            \
+    (best) = UINT32_MAX;                                    \
+    for (bench_i = 0; bench_i < (batches); bench_i++) {     \
+      uint32_t bench_start = k_cpu_cycles();                \
+      uint32_t bench_cycles;                                \
+                                                            \
+      for (bench_j = 0; bench_j < BENCH_BATCH; bench_j++) { \
+        body;                                               \
+      }                                                     \
+                                                            \
+      bench_cycles = k_cpu_cycles() - bench_start;          \
+      if (bench_cycles < (best))                            \
+        (best) = bench_cycles;                              \
+    }                                                       \
+  } while (0)
+
+static void
+bench_report(const char *name, uint32_t best)
+{
+  cprintf("BENCH kernel_%s %u.%02u cycles/op\n", name,
+          best / BENCH_BATCH, (best % BENCH_BATCH) * 100 / BENCH_BATCH);
+}
+
+static int
+bench_object_pool(unsigned long batches)
+{
+  struct KObjectPool *pool;
+  uint32_t best;
+  void *obj;
+
+  if ((pool = k_object_pool_create("bench", 64, 0, NULL, NULL)) == NULL)
+    return -ENOMEM;
+
+  BENCH_MEASURE(best, batches, {
+    if ((obj = k_object_pool_get(pool)) != NULL)
+      k_object_pool_put(pool, obj);
+  });
+
+  k_object_pool_destroy(pool);
+
+  bench_report("object_pool_get_put", best);
+  return 0;
+}
+
+static int
+bench_page(unsigned long batches)
+{
+  struct Page *page;
+  uint32_t best;
+
+  BENCH_MEASURE(best, batches, {
+    if ((page = page_alloc_one(0, 0)) != NULL)
+      page_free_one(page);
+  });
+
+  bench_report("page_alloc_free", best);
+  return 0;
+}
+
+static int
+bench_spinlock(unsigned long batches)
+{
+  static struct KSpinLock lock = K_SPINLOCK_INITIALIZER("bench");
+  uint32_t best;
+
+  BENCH_MEASURE(best, batches, {
+    k_spinlock_acquire(&lock);
+    k_spinlock_release(&lock);
+  });
+
+  bench_report("spinlock_acquire_release", best);
+  return 0;
+}
+
+static int
+bench_mutex(unsigned long batches)
+{
+  struct KMutex mutex;
+  uint32_t best;
+
+  k_mutex_init(&mutex, "bench");
+
+  BENCH_MEASURE(best, batches, {
+    k_mutex_lock(&mutex);
+    k_mutex_unlock(&mutex);
+  });
+
+  k_mutex_fini(&mutex);
+
+  bench_report("mutex_lock_unlock", best);
+  return 0;
+}
+
+static int
+bench_mailbox(unsigned long batches, int spsc)
+{
+  struct KMailBox *mailbox;
+  uint32_t best, msg = 0;
+
+  mailbox = spsc ? k_mailbox_create_spsc(sizeof(msg), sizeof(msg) * 16)
+                 : k_mailbox_create(sizeof(msg), sizeof(msg) * 16);
+  if (mailbox == NULL)
+    return -ENOMEM;
+
+  BENCH_MEASURE(best, batches, {
+    k_mailbox_try_send(mailbox, &msg);
+    k_mailbox_try_receive(mailbox, &msg);
+  });
+
+  k_mailbox_destroy(mailbox);
+
+  bench_report(spsc ? "mailbox_spsc_send_receive" : "mailbox_send_receive",
+               best);
+  return 0;
+}
+
+static int
+bench_buf(unsigned long batches, dev_t dev, size_t block_size)
+{
+  struct Buf *buf;
+  uint32_t best;
+
+  // Bring the block into the cache
+  if ((buf = buf_read(0, block_size, dev)) == NULL)
+    return -EIO;
+  buf_release(buf);
+
+  BENCH_MEASURE(best, batches, {
+    if ((buf = buf_read(0, block_size, dev)) != NULL)
+      buf_release(buf);
+  });
+
+  bench_report("buf_read_hit", best);
+  return 0;
+}
+
+static int
+bench_vm_lookup(unsigned long batches)
+{
+  struct KThread *thread = k_thread_current();
+  struct VMSpace *vm = process_current()->vm;
+  uintptr_t va = ROUND_DOWN(thread->tf->sp, PAGE_SIZE);
+  uint32_t best;
+  int flags;
+
+  k_spinlock_acquire(&vm->lock);
+
+  if (vm_page_lookup(vm, va, &flags) == NULL) {
+    k_spinlock_release(&vm->lock);
+    return -EFAULT;
+  }
+
+  BENCH_MEASURE(best, batches, {
+    vm_page_lookup(vm, va, &flags);
+  });
+
+  k_spinlock_release(&vm->lock);
+
+  bench_report("vm_page_lookup", best);
+  return 0;
+}
+
+// Shared by the scheduler benchmark and its parked threads, freed by the last
+// one to let it go
+struct BenchSched {
+  volatile int  stop;
+  int           refs;
+};
+
+static void
+bench_sched_put(struct BenchSched *bench)
+{
+  if (__sync_sub_and_fetch(&bench->refs, 1) == 0)
+    k_free(bench);
+}
+
+// Stays in the run queue, yielding, until the benchmark is over
+static void
+bench_sched_park(void *arg)
+{
+  struct BenchSched *bench = (struct BenchSched *) arg;
+
+  while (!bench->stop)
+    k_thread_yield();
+
+  bench_sched_put(bench);
+}
+
+// Measure a switch to the scheduler and back with the given number of ready
+// threads on the same CPU. They have the lowest priority, so the current thread
+// is picked again every time, and they only get to run and exit once it blocks
+// or returns to user mode.
+static int
+bench_sched(unsigned long batches, unsigned parked)
+{
+  struct KThread *my_thread = k_thread_current();
+  struct BenchSched *bench;
+  char name[32];
+  unsigned affinity, mask, i;
+  uint32_t best;
+  int r;
+
+  if (my_thread->priority >= THREAD_MAX_PRIORITIES - 1)
+    return -EINVAL;
+
+  if ((bench = (struct BenchSched *) k_malloc(sizeof(*bench))) == NULL)
+    return -ENOMEM;
+
+  bench->stop = 0;
+  bench->refs = 1;
+
+  // Stay on this CPU, so that no other one can run the parked threads
+  affinity = k_thread_get_affinity(my_thread);
+  if ((r = k_thread_set_affinity(my_thread, 1U << k_cpu_id())) != 0) {
+    bench_sched_put(bench);
+    return r;
+  }
+  k_thread_yield();
+  mask = k_thread_get_affinity(my_thread);
+
+  for (i = 0; i < parked; i++) {
+    struct KThread *thread;
+
+    thread = k_thread_create(NULL, bench_sched_park, bench,
+                             THREAD_MAX_PRIORITIES - 1);
+    if (thread == NULL) {
+      r = -ENOMEM;
+      break;
+    }
+
+    __sync_add_and_fetch(&bench->refs, 1);
+
+    k_thread_set_affinity(thread, mask);
+    k_thread_resume(thread);
+  }
+
+  if (r == 0) {
+    BENCH_MEASURE(best, batches, {
+      k_thread_yield();
+    });
+
+    snprintf(name, sizeof(name), "sched_yield_%u_parked", parked);
+    bench_report(name, best);
+  }
+
+  bench->stop = 1;
+  bench_sched_put(bench);
+
+  k_thread_set_affinity(my_thread, affinity);
+
+  return r;
+}
+
+/**
+ * Run all kernel microbenchmarks in the context of the current process.
+ *
+ * @param dev        The block device for the buffer cache benchmark
+ * @param block_size The block size of the file system on that device
+ * @param batches    The number of batches to run for each benchmark
+ *
+ * @return 0 on success, a negative error code if some benchmark failed.
+ */
+int
+bench_run(dev_t dev, size_t block_size, unsigned long batches)
+{
+  int r = 0, err;
+
+  if ((batches == 0) || (block_size == 0) || (block_size % 512 != 0))
+    return -EINVAL;
+
+  if ((err = bench_object_pool(batches)) != 0)
+    r = err;
+  if ((err = bench_page(batches)) != 0)
+    r = err;
+  if ((err = bench_spinlock(batches)) != 0)
+    r = err;
+  if ((err = bench_mutex(batches)) != 0)
+    r = err;
+  if ((err = bench_mailbox(batches, 0)) != 0)
+    r = err;
+  if ((err = bench_mailbox(batches, 1)) != 0)
+    r = err;
+  if ((err = bench_buf(batches, dev, block_size)) != 0)
+    r = err;
+  if ((err = bench_vm_lookup(batches)) != 0)
+    r = err;
+  if ((err = bench_sched(batches, 0)) != 0)
+    r = err;
+  if ((err = bench_sched(batches, BENCH_SCHED_PARKED)) != 0)
+    r = err;
+
+  return r;
+}
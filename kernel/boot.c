@@ -0,0 +1,203 @@
+#include <errno.h>
+#include <stdint.h>
+
+#include <kernel/boot.h>
+#include <kernel/console.h>
+#include <kernel/core/cpu.h>
+#include <kernel/core/irq.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/waitqueue.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Boot time profiling
+ * ----------------------------------------------------------------------------
+ *
+ * main() calls boot_stage() after each initializer, recording the cycles spent
+ * since the previous stage. Slow initializers that do not depend on each other
+ * (e.g. those busy-waiting on the hardware) are handed to boot_async() instead,
+ * and run in kernel threads once the scheduler starts. Their durations are
+ * measured in the threads themselves, so they overlap with each other and with
+ * the first user process up to the moment it calls boot_wait().
+ */
+
+// The maximum number of recorded stages
+#define BOOT_STAGES_MAX   32
+// The maximum number of initializers running in the background
+#define BOOT_JOBS_MAX     4
+
+struct BootStage {
+  const char *name;
+  uint32_t    cycles;   ///< Time spent in the stage
+  int         cpu;      ///< The CPU that ran an asynchronous stage, or -1
+};
+
+struct BootJob {
+  const char *name;
+  void      (*func)(void);
+};
+
+static struct {
+  struct KSpinLock  lock;
+  struct KWaitQueue queue;    ///< boot_wait() sleeps here
+  unsigned          pending;  ///< Asynchronous initializers still running
+  uint32_t          last;     ///< Cycle counter when the last stage ended
+  unsigned long long total;   ///< Cycles spent in the synchronous stages
+  unsigned          nstages;
+  struct BootStage  stages[BOOT_STAGES_MAX];
+  unsigned          njobs;
+  struct BootJob    jobs[BOOT_JOBS_MAX];
+} boot = {
+  .lock = K_SPINLOCK_INITIALIZER("boot"),
+};
+
+static void
+boot_record(const char *name, uint32_t cycles, int cpu)
+{
+  struct BootStage *stage;
+
+  k_spinlock_acquire(&boot.lock);
+
+  if (boot.nstages < BOOT_STAGES_MAX) {
+    stage = &boot.stages[boot.nstages++];
+    stage->name   = name;
+    stage->cycles = cycles;
+    stage->cpu    = cpu;
+  }
+
+  k_spinlock_release(&boot.lock);
+}
+
+/**
+ * Start measuring the boot time. Must be called at the very beginning of
+ * main().
+ */
+void
+boot_init(void)
+{
+  k_waitqueue_init(&boot.queue);
+  boot.last = k_cpu_cycles();
+}
+
+/**
+ * Record the end of a synchronous initialization stage.
+ *
+ * @param name The name of the stage (must be a string constant)
+ */
+void
+boot_stage(const char *name)
+{
+  uint32_t now = k_cpu_cycles();
+
+  boot_record(name, now - boot.last, -1);
+  boot.total += now - boot.last;
+
+  // Do not count the bookkeeping itself
+  boot.last = k_cpu_cycles();
+}
+
+static void
+boot_job_run(void *arg)
+{
+  struct BootJob *job = (struct BootJob *) arg;
+  uint32_t start;
+
+  start = k_cpu_cycles();
+  job->func();
+
+  // The thread may have migrated, but the cycle counters of all CPUs run at
+  // the same rate and are reset at roughly the same time
+  k_irq_state_save();
+  boot_record(job->name, k_cpu_cycles() - start, k_cpu_id());
+  k_irq_state_restore();
+
+  k_spinlock_acquire(&boot.lock);
+  if (--boot.pending == 0)
+    k_waitqueue_wakeup_all(&boot.queue);
+  k_spinlock_release(&boot.lock);
+
+  k_thread_exit();
+}
+
+/**
+ * Run an initializer in a kernel thread. The thread starts once the
+ * scheduler is running; until boot_wait() returns, nothing else may depend on
+ * the initializer having finished.
+ *
+ * @param name The name of the stage (must be a string constant)
+ * @param func The initializer
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory or too many initializers
+ */
+int
+boot_async(const char *name, void (*func)(void))
+{
+  struct KThread *thread;
+  struct BootJob *job;
+
+  if (boot.njobs == BOOT_JOBS_MAX)
+    return -ENOMEM;
+
+  job = &boot.jobs[boot.njobs];
+  job->name = name;
+  job->func = func;
+
+  if ((thread = k_thread_create(NULL, boot_job_run, job, 0)) == NULL)
+    return -ENOMEM;
+
+  boot.njobs++;
+
+  k_spinlock_acquire(&boot.lock);
+  boot.pending++;
+  k_spinlock_release(&boot.lock);
+
+  k_thread_resume(thread);
+
+  return 0;
+}
+
+/**
+ * Wait until all initializers started by boot_async() have finished. Must be
+ * called from a thread context before user space starts using the services
+ * they set up.
+ */
+void
+boot_wait(void)
+{
+  k_spinlock_acquire(&boot.lock);
+
+  while (boot.pending > 0)
+    k_waitqueue_sleep(&boot.queue, &boot.lock);
+
+  k_spinlock_release(&boot.lock);
+}
+
+/**
+ * Display the duration of each initialization stage.
+ */
+void
+boot_print_stats(void)
+{
+  unsigned i;
+
+  k_spinlock_acquire(&boot.lock);
+
+  cprintf("%-24s %12s %s\n", "STAGE", "KCYCLES", "CPU");
+
+  for (i = 0; i < boot.nstages; i++) {
+    struct BootStage *stage = &boot.stages[i];
+
+    if (stage->cpu < 0)
+      cprintf("%-24s %12lu main\n", stage->name,
+              (unsigned long) (stage->cycles / 1000));
+    else
+      cprintf("%-24s %12lu %d (async)\n", stage->name,
+              (unsigned long) (stage->cycles / 1000), stage->cpu);
+  }
+
+  cprintf("%-24s %12llu\n", "total (main)", boot.total / 1000);
+
+  k_spinlock_release(&boot.lock);
+}
@@ -1,14 +1,9 @@
 #include <stdio.h>
 
 #include <kernel/console.h>
+#include <kernel/klog.h>
 #include <kernel/tty.h>
 #include <kernel/monitor.h>
-#include <kernel/spinlock.h>
-
-static struct KSpinLock lock = K_SPINLOCK_INITIALIZER("cprintf");
-static int locking = 1;
-
-
 
 /**
  * Return the next input character from the console. Polls for any pending
@@ -42,11 +37,23 @@ console_putc(char c)
 
 const char *panicstr;
 
+// A message being formatted, passed to the log in pieces of KLOG_MSG_MAX
+struct CprintfBuf {
+  char   data[KLOG_MSG_MAX];
+  size_t len;
+};
+
 static int
 cputc(void *arg, int c)
 {
-  (void) arg;
-  console_putc(c);
+  struct CprintfBuf *buf = (struct CprintfBuf *) arg;
+
+  buf->data[buf->len++] = c;
+  if (buf->len == sizeof(buf->data)) {
+    klog_write(buf->data, buf->len);
+    buf->len = 0;
+  }
+
   return 1;
 }
 
@@ -54,6 +61,9 @@ int   __printf(int (*)(void *, int), void *, const char *, va_list);
 
 /**
  * Printf-like formatted output to the console.
+ *
+ * The message goes to the kernel log, which writes it to the console later
+ * (see klog.c).
  * 
  * @param format The format string.
  * @param ap     A variable argument list.
@@ -61,13 +71,13 @@ int   __printf(int (*)(void *, int), void *, const char *, va_list);
 void
 vcprintf(const char *format, va_list ap)
 {
-  if (locking)
-    k_spinlock_acquire(&lock);
+  struct CprintfBuf buf;
 
-  __printf(cputc, NULL, format, ap);
-  
-  if (locking)
-    k_spinlock_release(&lock);
+  buf.len = 0;
+  __printf(cputc, &buf, format, ap);
+
+  if (buf.len > 0)
+    klog_write(buf.data, buf.len);
 }
 
 /**
@@ -91,8 +101,8 @@ __panic(const char *file, int line, const char *format, ...)
   va_list ap;
 
   if (!panicstr) {
+    // From now on, the messages are written synchronously
     panicstr = format;
-    locking = 0;
 
     cprintf("kernel panic at %s:%d: ", file, line);
 
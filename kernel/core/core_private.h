@@ -5,6 +5,7 @@
 #include <kernel/thread.h>
 #include <kernel/console.h>
 #include <kernel/core/cpu.h>
+#include <kernel/core/percpu.h>
 
 struct Context;
 struct KListLink;
@@ -13,29 +14,67 @@ struct KTimer;
 
 void            _k_sched_resume(struct KThread *, int);
 void            _k_sched_may_yield(struct KThread *);
+int             _k_sched_can_preempt(struct KCpu *);
+void            _k_sched_preempt(void);
+void            _k_sched_yield(void);
 void            _k_sched_yield_locked(void);
 void            _k_sched_enqueue(struct KThread *);
 void            _k_sched_wakeup_all_locked(struct KListLink *, int);
+void            _k_sched_wakeup_locked(struct KListLink *, int);
 struct KThread *_k_sched_wakeup_one_locked(struct KListLink *, int);
 int             _k_sched_sleep(struct KListLink *, int, unsigned long, struct KSpinLock *);
+int             _k_sched_sleep_ns(struct KListLink *, int, uint64_t, struct KSpinLock *);
+void            _k_sched_hrtimer_callback(void *);
+int             _k_sched_handoff(struct KListLink *, struct KListLink *,
+                                 struct KSpinLock *);
 void            _k_sched_raise_priority(struct KThread *, int);
 void            _k_sched_recalc_priority(struct KThread *);
 void            _k_sched_tick(void);
 void            _k_sched_update_effective_priority(void);
+unsigned long   _k_sched_next_timeout(void);
 
-int             _k_mutex_get_highest_priority(struct KListLink *);
+int             _k_mutex_get_highest_priority(struct KThread *);
 void            _k_mutex_may_raise_priority(struct KMutex *, int);
 
 void            _k_timer_start(struct KTimer *, unsigned long);
 void            _k_timer_tick(void);
+unsigned long   _k_timer_next_timeout(void);
 
-void            _k_timeout_process_queue(struct KListLink *, void (*)(struct KTimeout *));
+void            _k_tick_idle_enter(void);
+void            _k_tick_idle_exit(void);
+void            _k_tick_idle_kick(unsigned);
+
+void            _k_work_run_local(void);
+
+#define K_TIMEOUT_ROOT_BITS   8
+#define K_TIMEOUT_ROOT_SIZE   (1 << K_TIMEOUT_ROOT_BITS)
+#define K_TIMEOUT_LEVEL_BITS  6
+#define K_TIMEOUT_LEVEL_SIZE  (1 << K_TIMEOUT_LEVEL_BITS)
+#define K_TIMEOUT_LEVELS      4
+
+/**
+ * Hierarchical timer wheel (see timeout.c).
+ */
+struct KTimeoutQueue {
+  /** The number of ticks processed so far */
+  unsigned long    now;
+  /** Entries expiring within the next K_TIMEOUT_ROOT_SIZE ticks */
+  struct KListLink root[K_TIMEOUT_ROOT_SIZE];
+  /** Entries expiring later */
+  struct KListLink levels[K_TIMEOUT_LEVELS][K_TIMEOUT_LEVEL_SIZE];
+};
+
+void            _k_timeout_queue_init(struct KTimeoutQueue *);
+void            _k_timeout_process_queue(struct KTimeoutQueue *, void (*)(struct KTimeout *));
 void            _k_timeout_init(struct KTimeout *);
-void            _k_timeout_enqueue(struct KListLink *queue, struct KTimeout *entry, unsigned long delay);
-void            _k_timeout_dequeue(struct KListLink *queue, struct KTimeout *entry);
+void            _k_timeout_enqueue(struct KTimeoutQueue *queue, struct KTimeout *entry, unsigned long delay);
+void            _k_timeout_dequeue(struct KTimeoutQueue *queue, struct KTimeout *entry);
 void            _k_timeout_fini(struct KTimeout *timer);
+unsigned long   _k_timeout_next(struct KTimeoutQueue *queue);
 
 extern struct KSpinLock _k_sched_spinlock;
+extern struct KTimeoutQueue _k_sched_timeouts;
+extern unsigned _k_sched_cpus;
 
 // Compare thread priorities. Note that a smaller priority value corresponds
 // to a higher priority! Returns a number less than, equal to, or greater than
@@ -77,18 +116,55 @@ _k_sched_wakeup_one(struct KListLink *queue, int result)
   _k_sched_unlock();
 }
 
+#define K_SCHED_BITMAP_WORDS  ((THREAD_MAX_PRIORITIES + 31) / 32)
+
+/**
+ * Per-CPU run queue. Contains one list of ready threads per priority level.
+ * 
+ * The bitmap tracks which lists are non-empty. Priority p corresponds to bit
+ * (31 - p % 32) of word p / 32, so that counting the leading zeros of the
+ * first non-zero word gives the highest ready priority.
+ *
+ * The lock also protects the current thread and the idle flag of the CPU (see
+ * the locking rules in sched.c).
+ */
+struct KSchedQueue {
+  struct KSpinLock lock;    ///< Protects the queue
+  struct KListLink list[THREAD_MAX_PRIORITIES];  ///< Ready threads
+  uint32_t         bitmap[K_SCHED_BITMAP_WORDS]; ///< Non-empty lists
+  int              length;  ///< The total number of ready threads
+};
+
+/** The number of kernel stacks of exited threads kept by each CPU */
+#define K_KSTACK_CACHE_SIZE 4
+
 /**
  * The kernel maintains a special structure for each processor, which
  * records the per-CPU information.
  */
 struct KCpu {
-  struct Context *sched_context;  ///< Saved scheduler context
-  struct KThread *thread;         ///< The currently running kernel task
-  int             lock_count;     ///< Sheculer lock nesting level
-  int             irq_save_count; ///< Nesting level of k_irq_state_save() calls
-  int             irq_flags;      ///< IRQ state before the first k_irq_state_save()
+  unsigned           id;             ///< The processor ID
+  struct Context    *sched_context;  ///< Saved scheduler context
+  struct KThread    *thread;         ///< The currently running kernel task
+  struct KSchedQueue sched_queue;    ///< Threads ready to run on this CPU
+  int                lock_count;     ///< Sheculer lock nesting level
+  int                preempt_count;  ///< Nesting level of k_preempt_disable()
+  int                irq_save_count; ///< Nesting level of k_irq_state_save() calls
+  int                irq_flags;      ///< IRQ state before the first k_irq_state_save()
+  int                idle;           ///< Whether waiting for an interrupt
+  volatile int       tickless;       ///< Whether the periodic tick is stopped
+  unsigned long      idle_ticks;     ///< One-shot timer delay when tickless
+  struct KListLink   dead_threads;   ///< Exited threads not reclaimed yet
+  void              *kstacks[K_KSTACK_CACHE_SIZE];  ///< Free kernel stacks
+  unsigned           kstacks_count;  ///< The number of free kernel stacks
+  struct KCpuStats   stats;          ///< Usage counters
 };
 
+extern struct KCpu _k_cpu_data;
+
+/** The CPU structure of the given processor */
+#define _K_CPU(i)   K_PERCPU_PTR(_k_cpu_data, i)
+
 struct KCpu    *_k_cpu(void);
 
 #endif  // !__CORE_PRIVATE_H
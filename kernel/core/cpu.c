@@ -1,13 +1,34 @@
+#include <string.h>
+
 #include <kernel/assert.h>
 #include <kernel/core/cpu.h>
 #include <kernel/core/irq.h>
+#include <kernel/core/percpu.h>
 
 #include "core_private.h"
 
-// TODO: should be architecture-specific
-#define K_CPU_MAX   4
+struct KCpu _k_cpu_data __percpu;
+
+/**
+ * Set up the per-CPU variables of all processors. Must be called by the
+ * bootstrap processor before any per-CPU variable is used.
+ */
+void
+k_percpu_init(void)
+{
+  unsigned i;
+
+  if ((uintptr_t) (__percpu_limit__ - __percpu_begin__) <
+      K_CPU_MAX * K_PERCPU_SIZE)
+    panic("not enough space for per-CPU data");
 
-static struct KCpu _k_cpus[K_CPU_MAX];
+  for (i = 1; i < K_CPU_MAX; i++)
+    memcpy(__percpu_begin__ + i * K_PERCPU_SIZE, __percpu_begin__,
+           K_PERCPU_SIZE);
+
+  for (i = 0; i < K_CPU_MAX; i++)
+    _K_CPU(i)->id = i;
+}
 
 /**
  * Get the current CPU structure.
@@ -24,5 +45,5 @@ _k_cpu(void)
   if (k_arch_irq_is_enabled())
     panic("interruptible");
 
-  return &_k_cpus[k_cpu_id()];
+  return _K_CPU(k_cpu_id());
 }
@@ -0,0 +1,251 @@
+/**
+ * @file
+ * High-resolution timers
+ *
+ * The tick-based timeouts round every delay up to whole ticks, which is too
+ * coarse for short sleeps. Machines that have a spare one-shot timer next to
+ * the tick timer (see k_arch_hrtimer_set) run high-resolution timers on it.
+ *
+ * Each processor has a queue of its own, sorted by the expiration time, and
+ * programs its timer for the head of the queue. A timer is put on the queue of
+ * the processor that starts it and expires on that processor. There are few
+ * such timers at a time (mostly short sleeps), so a sorted list is enough.
+ */
+
+#include <kernel/assert.h>
+#include <errno.h>
+
+#include <kernel/core/hrtimer.h>
+#include <kernel/core/irq.h>
+#include <kernel/spinlock.h>
+
+#include "core_private.h"
+
+struct KHrTimerQueue {
+  struct KSpinLock lock;
+  /** Active timers, the earliest first */
+  struct KListLink head;
+  /** The timer whose callback is running */
+  struct KHrTimer *running;
+};
+
+static __percpu struct KHrTimerQueue k_hrtimer_queue;
+
+/**
+ * Initialize the queues of all processors.
+ *
+ * This function must be called prior to starting any high-resolution timers.
+ */
+void
+k_hrtimer_system_init(void)
+{
+  unsigned i;
+
+  for (i = 0; i < K_CPU_MAX; i++) {
+    struct KHrTimerQueue *queue = K_PERCPU_PTR(k_hrtimer_queue, i);
+
+    k_spinlock_init(&queue->lock, "k_hrtimer");
+    k_list_init(&queue->head);
+    queue->running = NULL;
+  }
+}
+
+/**
+ * Check whether the machine can run high-resolution timers. If not,
+ * k_hrtimer_start() fails and the callers should fall back to ticks.
+ */
+int
+k_hrtimer_supported(void)
+{
+  return k_arch_hrtimer_supported();
+}
+
+/**
+ * Get the monotonic time since boot.
+ *
+ * @return The time, in nanoseconds. Without a high-resolution timer it
+ *         advances by whole ticks.
+ */
+uint64_t
+k_hrtimer_now(void)
+{
+  return k_arch_hrtimer_now();
+}
+
+void
+k_hrtimer_init(struct KHrTimer *timer, void (*callback)(void *),
+               void *callback_arg)
+{
+  if (timer == NULL)
+    panic("timer is NULL");
+
+  k_list_null(&timer->link);
+  timer->queue        = NULL;
+  timer->expires      = 0;
+  timer->callback     = callback;
+  timer->callback_arg = callback_arg;
+}
+
+/**
+ * Start the timer on the current processor.
+ *
+ * @param timer Pointer to the timer
+ * @param delay The delay before the timer expires, in nanoseconds
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The timer is already active
+ * @retval -ENOSYS There is no high-resolution timer
+ */
+int
+k_hrtimer_start(struct KHrTimer *timer, uint64_t delay)
+{
+  struct KHrTimerQueue *queue;
+  struct KListLink *link;
+  int r = 0;
+
+  if (timer == NULL)
+    panic("timer is NULL");
+
+  if (!k_arch_hrtimer_supported())
+    return -ENOSYS;
+
+  // Stay on this processor until the timer is on its queue
+  k_irq_state_save();
+
+  queue = K_PERCPU_THIS(k_hrtimer_queue);
+
+  k_spinlock_acquire(&queue->lock);
+
+  if (timer->queue != NULL) {
+    r = -EINVAL;
+  } else {
+    timer->expires = k_arch_hrtimer_now() + delay;
+    timer->queue   = queue;
+
+    KLIST_FOREACH(&queue->head, link) {
+      struct KHrTimer *t = KLIST_CONTAINER(link, struct KHrTimer, link);
+      if (t->expires > timer->expires)
+        break;
+    }
+    k_list_add_back(link, &timer->link);
+
+    // The new timer is the nearest one
+    if (queue->head.next == &timer->link)
+      k_arch_hrtimer_set(timer->expires);
+  }
+
+  k_spinlock_release(&queue->lock);
+
+  k_irq_state_restore();
+
+  return r;
+}
+
+/**
+ * Stop the timer. If the timer is the nearest one, its interrupt still comes
+ * and finds nothing to do.
+ *
+ * @param timer Pointer to the timer
+ *
+ * @return 0
+ */
+int
+k_hrtimer_stop(struct KHrTimer *timer)
+{
+  struct KHrTimerQueue *queue;
+
+  if (timer == NULL)
+    panic("timer is NULL");
+
+  // The timer may expire on its processor meanwhile
+  while ((queue = __atomic_load_n(&timer->queue, __ATOMIC_ACQUIRE)) != NULL) {
+    k_spinlock_acquire(&queue->lock);
+
+    if (timer->queue == queue) {
+      k_list_remove(&timer->link);
+      timer->queue = NULL;
+    }
+
+    k_spinlock_release(&queue->lock);
+  }
+
+  return 0;
+}
+
+/**
+ * Stop the timer and wait until its callback returns, if it is running on
+ * another processor, so that the timer can be freed. Must not be called while
+ * holding a lock the callback takes.
+ *
+ * @param timer Pointer to the timer
+ */
+void
+k_hrtimer_fini(struct KHrTimer *timer)
+{
+  unsigned i;
+
+  k_hrtimer_stop(timer);
+
+  for (i = 0; i < K_CPU_MAX; i++) {
+    struct KHrTimerQueue *queue = K_PERCPU_PTR(k_hrtimer_queue, i);
+
+    while (__atomic_load_n(&queue->running, __ATOMIC_ACQUIRE) == timer)
+      ;
+  }
+}
+
+/**
+ * Check whether the timer is waiting to expire.
+ */
+int
+k_hrtimer_active(struct KHrTimer *timer)
+{
+  return __atomic_load_n(&timer->queue, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/**
+ * Run the expired timers of the current processor and program the timer for
+ * the next one. Called by the timer interrupt handler, after the interrupt
+ * has been cleared.
+ */
+void
+k_hrtimer_irq(void)
+{
+  struct KHrTimerQueue *queue = K_PERCPU_THIS(k_hrtimer_queue);
+  struct KHrTimer *timer;
+  void (*callback)(void *);
+  void *callback_arg;
+  uint64_t now;
+
+  k_spinlock_acquire(&queue->lock);
+
+  now = k_arch_hrtimer_now();
+
+  while (!k_list_is_empty(&queue->head)) {
+    timer = KLIST_CONTAINER(queue->head.next, struct KHrTimer, link);
+    if (timer->expires > now) {
+      k_arch_hrtimer_set(timer->expires);
+      break;
+    }
+
+    // Once off the queue, the timer may be reused by its owner
+    callback     = timer->callback;
+    callback_arg = timer->callback_arg;
+
+    k_list_remove(&timer->link);
+    __atomic_store_n(&timer->queue, NULL, __ATOMIC_RELEASE);
+    queue->running = timer;
+
+    k_spinlock_release(&queue->lock);
+
+    callback(callback_arg);
+
+    k_spinlock_acquire(&queue->lock);
+
+    __atomic_store_n(&queue->running, NULL, __ATOMIC_RELEASE);
+
+    now = k_arch_hrtimer_now();
+  }
+
+  k_spinlock_release(&queue->lock);
+}
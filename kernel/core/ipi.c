@@ -0,0 +1,185 @@
+#include <kernel/assert.h>
+#include <errno.h>
+
+#include <kernel/core/cpu.h>
+#include <kernel/core/ipi.h>
+#include <kernel/core/irq.h>
+#include <kernel/core/list.h>
+#include <kernel/interrupt.h>
+#include <kernel/spinlock.h>
+
+#include "core_private.h"
+
+/*
+ * ----------------------------------------------------------------------------
+ * Inter-processor interrupts
+ * ----------------------------------------------------------------------------
+ *
+ * K_IPI_RESCHEDULE carries no data: taking the interrupt is enough to wake up
+ * an idle processor, and to make the thread running there go through the
+ * interrupt exit path, where a pending reschedule or signal is acted upon.
+ *
+ * K_IPI_CALL runs a function on another processor. The caller queues the
+ * request on the target processor, sends the interrupt and spins until the
+ * function has returned. The caller must be interruptible, so that two
+ * processors calling each other at the same time cannot deadlock.
+ */
+
+struct KIpiCall {
+  struct KListLink   link;
+  void             (*func)(void *);
+  void              *arg;
+  int                done;
+};
+
+static struct {
+  struct KSpinLock lock;
+  /** Calls waiting to be run by each CPU */
+  struct KListLink calls[K_CPU_MAX];
+  /** CPUs ready to take the interrupts */
+  unsigned         online;
+} k_ipi = {
+  .lock = K_SPINLOCK_INITIALIZER("k_ipi"),
+};
+
+static int
+k_ipi_reschedule_irq(int irq, void *arg)
+{
+  (void) irq;
+  (void) arg;
+
+  // Nothing else to do, k_irq_handler_end() will switch threads if necessary
+  return 1;
+}
+
+static int
+k_ipi_call_irq(int irq, void *arg)
+{
+  struct KListLink *calls = &k_ipi.calls[k_cpu_id()];
+
+  (void) irq;
+  (void) arg;
+
+  k_spinlock_acquire(&k_ipi.lock);
+
+  while (!k_list_is_empty(calls)) {
+    struct KIpiCall *call = KLIST_CONTAINER(calls->next, struct KIpiCall, link);
+
+    k_list_remove(&call->link);
+
+    k_spinlock_release(&k_ipi.lock);
+
+    call->func(call->arg);
+
+    // The structure lives on the caller's stack, don't touch it after this
+    __atomic_store_n(&call->done, 1, __ATOMIC_RELEASE);
+
+    k_spinlock_acquire(&k_ipi.lock);
+  }
+
+  k_spinlock_release(&k_ipi.lock);
+
+  return 1;
+}
+
+/**
+ * Attach the inter-processor interrupt handlers. Must be called by the
+ * bootstrap processor after the interrupt controller has been initialized.
+ */
+void
+k_ipi_init(void)
+{
+  int i;
+
+  for (i = 0; i < K_CPU_MAX; i++)
+    k_list_init(&k_ipi.calls[i]);
+
+  interrupt_attach(K_IPI_RESCHEDULE, k_ipi_reschedule_irq, NULL);
+  interrupt_attach(K_IPI_CALL, k_ipi_call_irq, NULL);
+}
+
+/**
+ * Start taking inter-processor interrupts on the current processor.
+ */
+void
+k_ipi_init_percpu(void)
+{
+  // Software-generated interrupts are enabled separately on each processor
+  interrupt_unmask(K_IPI_RESCHEDULE);
+  interrupt_unmask(K_IPI_CALL);
+
+  k_spinlock_acquire(&k_ipi.lock);
+  k_ipi.online |= 1U << k_cpu_id();
+  k_spinlock_release(&k_ipi.lock);
+}
+
+/**
+ * Interrupt the given processor, so that it leaves the idle state or preempts
+ * the thread it is running.
+ *
+ * @param cpu The processor ID.
+ */
+void
+k_ipi_reschedule(unsigned cpu)
+{
+  if (cpu != k_cpu_id())
+    arch_interrupt_ipi(cpu, K_IPI_RESCHEDULE);
+}
+
+/**
+ * Run a function on the given processor and wait for it to return. The
+ * function is called from the interrupt handler, so it must not sleep.
+ *
+ * @param cpu  The processor ID.
+ * @param func The function to run.
+ * @param arg  The argument to pass to the function.
+ *
+ * @retval 0       Success.
+ * @retval -ENODEV The processor is not running.
+ */
+int
+k_ipi_call(unsigned cpu, void (*func)(void *), void *arg)
+{
+  struct KIpiCall call;
+
+  if (!k_arch_irq_is_enabled())
+    panic("not interruptible");
+
+  if (cpu >= K_CPU_MAX)
+    return -ENODEV;
+
+  call.func = func;
+  call.arg  = arg;
+  call.done = 0;
+
+  // Stay on the current processor until the request is sent
+  k_irq_state_save();
+
+  if (cpu == k_cpu_id()) {
+    func(arg);
+    k_irq_state_restore();
+    return 0;
+  }
+
+  k_spinlock_acquire(&k_ipi.lock);
+
+  if (!(k_ipi.online & (1U << cpu))) {
+    k_spinlock_release(&k_ipi.lock);
+    k_irq_state_restore();
+    return -ENODEV;
+  }
+
+  k_list_add_back(&k_ipi.calls[cpu], &call.link);
+
+  k_spinlock_release(&k_ipi.lock);
+
+  arch_interrupt_ipi(cpu, K_IPI_CALL);
+
+  // Keep taking interrupts while waiting, the target may be calling us too
+  k_irq_state_restore();
+
+  while (!__atomic_load_n(&call.done, __ATOMIC_ACQUIRE))
+    ;
+
+  return 0;
+}
@@ -26,18 +26,66 @@ k_irq_state_save(void)
 
 /**
  * Restore the interrupt state saved by a preceding k_irq_state_save() call.
+ *
+ * Leaving the outermost level is a preemption point: if the current thread
+ * was asked to give up the CPU while it could not be preempted (for example,
+ * because it has woken up a higher-priority thread while holding a spinlock),
+ * the switch happens here.
  */
 void
 k_irq_state_restore(void)
 {
+  struct KCpu *my_cpu;
+  struct KThread *my_thread;
+  int preempt;
+
   if (k_arch_irq_is_enabled())
     panic("interruptible");
 
-  if (--_k_cpu()->irq_save_count < 0)
+  my_cpu = _k_cpu();
+
+  if (--my_cpu->irq_save_count < 0)
     panic("interruptible");
 
-  if (_k_cpu()->irq_save_count == 0)
-    k_arch_irq_state_restore(_k_cpu()->irq_flags);
+  if (my_cpu->irq_save_count == 0) {
+    my_thread = my_cpu->thread;
+    preempt = (my_thread != NULL) &&
+              (my_thread->flags & THREAD_FLAG_RESCHEDULE) &&
+              (my_cpu->lock_count == 0) &&
+              (my_cpu->preempt_count == 0);
+
+    k_arch_irq_state_restore(my_cpu->irq_flags);
+
+    // Not if the interrupts stay disabled, the caller may rely on that
+    if (preempt && k_arch_irq_is_enabled())
+      _k_sched_preempt();
+  }
+}
+
+/**
+ * Disable preemption of the current thread without disabling interrupts.
+ * Calls may be nested, and the thread must not sleep until the matching
+ * k_preempt_enable() call.
+ */
+void
+k_preempt_disable(void)
+{
+  k_irq_state_save();
+  _k_cpu()->preempt_count++;
+  k_irq_state_restore();
+}
+
+/**
+ * Enable preemption disabled by a preceding k_preempt_disable() call. If a
+ * higher-priority thread has become ready meanwhile, switch to it.
+ */
+void
+k_preempt_enable(void)
+{
+  k_irq_state_save();
+  if (--_k_cpu()->preempt_count < 0)
+    panic("preempt_count < 0");
+  k_irq_state_restore();
 }
 
 /**
@@ -58,8 +106,14 @@ void
 k_irq_handler_end(void)
 {
   struct KCpu *my_cpu;
+  int preempt = 0;
 
-  _k_sched_lock();
+  // Run the deferred work while still counted as being in a handler, so that
+  // any threads it wakes up are scheduled below
+  if (_k_cpu()->lock_count == 1)
+    _k_work_run_local();
+
+  k_irq_state_save();
 
   my_cpu = _k_cpu();
 
@@ -70,14 +124,16 @@ k_irq_handler_end(void)
     struct KThread *my_thread = my_cpu->thread;
 
     // Before resuming the current thread, check whether it must give up the CPU
-    // or exit.
-    if ((my_thread != NULL) && (my_thread->flags & THREAD_FLAG_RESCHEDULE)) {
-      my_thread->flags &= ~THREAD_FLAG_RESCHEDULE;
-
-      _k_sched_enqueue(my_thread);
-      _k_sched_yield_locked();
-    }
+    // or exit. The thread may have been interrupted in kernel mode, unless it
+    // has disabled preemption, otherwise the flag is checked again once it
+    // enables preemption.
+    preempt = (my_thread != NULL) &&
+              (my_thread->flags & THREAD_FLAG_RESCHEDULE) &&
+              (my_cpu->preempt_count == 0);
   }
 
-  _k_sched_unlock();
+  k_irq_state_restore();
+
+  if (preempt)
+    _k_sched_preempt();
 }
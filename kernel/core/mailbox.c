@@ -17,6 +17,11 @@ static void k_mailbox_init_common(struct KMailBox *, size_t, void *, size_t);
 static void k_mailbox_fini_common(struct KMailBox *);
 static int  k_mailbox_try_receive_locked(struct KMailBox *, void *);
 static int  k_mailbox_try_send_locked(struct KMailBox *, const void *);
+static void k_mailbox_put_locked(struct KMailBox *, const void *);
+static struct KThread *k_mailbox_first_waiter(struct KListLink *);
+static size_t k_mailbox_spsc_get(struct KMailBox *, void *, size_t);
+static size_t k_mailbox_spsc_put(struct KMailBox *, const void *, size_t);
+static int  k_mailbox_spsc_wait(struct KMailBox *, int, unsigned long);
 
 static struct KObjectPool *k_mailbox_pool;
 
@@ -52,6 +57,29 @@ k_mailbox_create(size_t msg_size, size_t buf_size)
   return mailbox;
 }
 
+/**
+ * Create a mailbox for exactly one sending and one receiving task (each may be
+ * a different task over time, but never two at once). Messages go through a
+ * ring indexed by atomic counters, so the lock is only taken when one side
+ * has to block or wake up the other, i.e. when the mailbox becomes empty or
+ * full.
+ *
+ * @param msg_size The size of a message in bytes
+ * @param buf_size The size of the message buffer in bytes
+ *
+ * @return The new mailbox, or NULL if out of memory
+ */
+struct KMailBox *
+k_mailbox_create_spsc(size_t msg_size, size_t buf_size)
+{
+  struct KMailBox *mailbox;
+
+  if ((mailbox = k_mailbox_create(msg_size, buf_size)) != NULL)
+    mailbox->flags |= K_MAILBOX_SPSC;
+
+  return mailbox;
+}
+
 int
 k_mailbox_init(struct KMailBox *mailbox,
                size_t msg_size,
@@ -76,6 +104,11 @@ k_mailbox_init_common(struct KMailBox *mailbox, size_t msg_size, void *start,
   mailbox->msg_size  = msg_size;
   mailbox->capacity  = buf_size / msg_size;
   mailbox->size      = 0;
+
+  mailbox->head             = 0;
+  mailbox->tail             = 0;
+  mailbox->receiver_waiting = 0;
+  mailbox->sender_waiting   = 0;
 }
 
 void
@@ -114,7 +147,7 @@ k_mailbox_fini(struct KMailBox *mailbox)
 static void
 k_mailbox_fini_common(struct KMailBox *mailbox)
 {
-  assert(k_spinlock_holding(&mailbox->lock));
+  debug_assert(k_spinlock_holding(&mailbox->lock));
 
   _k_sched_wakeup_all(&mailbox->receivers, -EINVAL);
   _k_sched_wakeup_all(&mailbox->senders, -EINVAL);
@@ -128,6 +161,9 @@ k_mailbox_try_receive(struct KMailBox *mailbox, void *message)
   if ((mailbox == NULL) || (mailbox->type != K_MAILBOX_TYPE))
     panic("bad mailbox pointer");
 
+  if (mailbox->flags & K_MAILBOX_SPSC)
+    return k_mailbox_spsc_get(mailbox, message, 1) ? 0 : -EAGAIN;
+
   k_spinlock_acquire(&mailbox->lock);
   r = k_mailbox_try_receive_locked(mailbox, message);
   k_spinlock_release(&mailbox->lock);
@@ -135,6 +171,38 @@ k_mailbox_try_receive(struct KMailBox *mailbox, void *message)
   return r;
 }
 
+/**
+ * Receive as many messages as are available, up to the given number, without
+ * blocking. The lock is taken at most once for the whole batch.
+ *
+ * @param mailbox  The mailbox
+ * @param messages The buffer for the messages
+ * @param n        The maximum number of messages to receive
+ *
+ * @return The number of messages received
+ */
+size_t
+k_mailbox_try_receive_batch(struct KMailBox *mailbox, void *messages,
+                            size_t n)
+{
+  uint8_t *p = (uint8_t *) messages;
+  size_t i;
+
+  if ((mailbox == NULL) || (mailbox->type != K_MAILBOX_TYPE))
+    panic("bad mailbox pointer");
+
+  if (mailbox->flags & K_MAILBOX_SPSC)
+    return k_mailbox_spsc_get(mailbox, messages, n);
+
+  k_spinlock_acquire(&mailbox->lock);
+  for (i = 0; i < n; i++, p += mailbox->msg_size)
+    if (k_mailbox_try_receive_locked(mailbox, p) < 0)
+      break;
+  k_spinlock_release(&mailbox->lock);
+
+  return i;
+}
+
 int
 k_mailbox_timed_receive(struct KMailBox *mailbox,
                         void *message,
@@ -145,18 +213,24 @@ k_mailbox_timed_receive(struct KMailBox *mailbox,
   if ((mailbox == NULL) || (mailbox->type != K_MAILBOX_TYPE))
     panic("bad mailbox pointer");
 
+  if (mailbox->flags & K_MAILBOX_SPSC) {
+    while (k_mailbox_spsc_get(mailbox, message, 1) == 0)
+      if ((r = k_mailbox_spsc_wait(mailbox, 1, timeout)) < 0)
+        return r;
+    return 0;
+  }
+
   k_spinlock_acquire(&mailbox->lock);
 
-  while ((r = k_mailbox_try_receive_locked(mailbox, message)) != 0) {
-    if (r != -EAGAIN)
-      break;
+  if ((r = k_mailbox_try_receive_locked(mailbox, message)) == -EAGAIN) {
+    // The sender copies the message straight into our buffer and wakes us up
+    // with a zero result, so there is no need to retry afterwards
+    k_thread_current()->sleep_data = message;
 
     r = _k_sched_sleep(&mailbox->receivers,
                        THREAD_STATE_SLEEP,
                        timeout,
                        &mailbox->lock);
-    if (r < 0)
-      break;
   }
 
   k_spinlock_release(&mailbox->lock);
@@ -167,7 +241,9 @@ k_mailbox_timed_receive(struct KMailBox *mailbox,
 static int
 k_mailbox_try_receive_locked(struct KMailBox *mailbox, void *message)
 {
-  assert(k_spinlock_holding(&mailbox->lock));
+  debug_assert(k_spinlock_holding(&mailbox->lock));
+
+  struct KThread *sender;
 
   if (mailbox->size == 0)
     return -EAGAIN;
@@ -178,8 +254,15 @@ k_mailbox_try_receive_locked(struct KMailBox *mailbox, void *message)
   if (mailbox->read_ptr >= mailbox->buf_end)
     mailbox->read_ptr = mailbox->buf_start;
 
-  if (mailbox->size-- == mailbox->capacity)
-    _k_sched_wakeup_one(&mailbox->senders, 0);
+  mailbox->size--;
+
+  // Move the message of the first blocked sender into the freed slot
+  _k_sched_lock();
+  if ((sender = k_mailbox_first_waiter(&mailbox->senders)) != NULL) {
+    k_mailbox_put_locked(mailbox, sender->sleep_data);
+    _k_sched_resume(sender, 0);
+  }
+  _k_sched_unlock();
 
   return 0;
 }
@@ -192,6 +275,9 @@ k_mailbox_try_send(struct KMailBox *mailbox, const void *message)
   if ((mailbox == NULL) || (mailbox->type != K_MAILBOX_TYPE))
     panic("bad mailbox pointer");
 
+  if (mailbox->flags & K_MAILBOX_SPSC)
+    return k_mailbox_spsc_put(mailbox, message, 1) ? 0 : -EAGAIN;
+
   k_spinlock_acquire(&mailbox->lock);
   r = k_mailbox_try_send_locked(mailbox, message);
   k_spinlock_release(&mailbox->lock);
@@ -199,6 +285,38 @@ k_mailbox_try_send(struct KMailBox *mailbox, const void *message)
   return r;
 }
 
+/**
+ * Send as many of the given messages as fit into the mailbox without
+ * blocking. The lock is taken at most once for the whole batch.
+ *
+ * @param mailbox  The mailbox
+ * @param messages The messages to send
+ * @param n        The number of messages
+ *
+ * @return The number of messages sent
+ */
+size_t
+k_mailbox_try_send_batch(struct KMailBox *mailbox, const void *messages,
+                         size_t n)
+{
+  const uint8_t *p = (const uint8_t *) messages;
+  size_t i;
+
+  if ((mailbox == NULL) || (mailbox->type != K_MAILBOX_TYPE))
+    panic("bad mailbox pointer");
+
+  if (mailbox->flags & K_MAILBOX_SPSC)
+    return k_mailbox_spsc_put(mailbox, messages, n);
+
+  k_spinlock_acquire(&mailbox->lock);
+  for (i = 0; i < n; i++, p += mailbox->msg_size)
+    if (k_mailbox_try_send_locked(mailbox, p) < 0)
+      break;
+  k_spinlock_release(&mailbox->lock);
+
+  return i;
+}
+
 int
 k_mailbox_timed_send(struct KMailBox *mailbox,
                      const void *message,
@@ -209,18 +327,24 @@ k_mailbox_timed_send(struct KMailBox *mailbox,
   if ((mailbox == NULL) || (mailbox->type != K_MAILBOX_TYPE))
     panic("bad mailbox pointer");
 
+  if (mailbox->flags & K_MAILBOX_SPSC) {
+    while (k_mailbox_spsc_put(mailbox, message, 1) == 0)
+      if ((r = k_mailbox_spsc_wait(mailbox, 0, timeout)) < 0)
+        return r;
+    return 0;
+  }
+
   k_spinlock_acquire(&mailbox->lock);
 
-  while ((r = k_mailbox_try_send_locked(mailbox, message)) != 0) {
-    if (r != -EAGAIN)
-      break;
+  if ((r = k_mailbox_try_send_locked(mailbox, message)) == -EAGAIN) {
+    // The receiver that frees up a slot moves the message into the buffer on
+    // our behalf
+    k_thread_current()->sleep_data = (void *) message;
 
     r = _k_sched_sleep(&mailbox->senders,
                        THREAD_STATE_SLEEP,
                        timeout,
                        &mailbox->lock);
-    if (r < 0)
-      break;
   }
 
   k_spinlock_release(&mailbox->lock);
@@ -231,21 +355,166 @@ k_mailbox_timed_send(struct KMailBox *mailbox,
 static int
 k_mailbox_try_send_locked(struct KMailBox *mailbox, const void *message)
 {
-  assert(k_spinlock_holding(&mailbox->lock));
-  
+  struct KThread *receiver;
+
+  debug_assert(k_spinlock_holding(&mailbox->lock));
+
+  // Receivers only block on an empty mailbox. Hand the message directly to
+  // the first one, so that it does not have to go through the buffer and no
+  // other task can take it before the receiver gets to run.
+  if (mailbox->size == 0) {
+    _k_sched_lock();
+
+    if ((receiver = k_mailbox_first_waiter(&mailbox->receivers)) != NULL) {
+      memmove(receiver->sleep_data, message, mailbox->msg_size);
+      _k_sched_resume(receiver, 0);
+    }
+
+    _k_sched_unlock();
+
+    if (receiver != NULL)
+      return 0;
+  }
+
   if (mailbox->size == mailbox->capacity)
     return -EAGAIN;
-  
+
+  k_mailbox_put_locked(mailbox, message);
+
+  return 0;
+}
+
+static void
+k_mailbox_put_locked(struct KMailBox *mailbox, const void *message)
+{
   memmove(mailbox->write_ptr, message, mailbox->msg_size);
 
   mailbox->write_ptr += mailbox->msg_size;
   if (mailbox->write_ptr >= mailbox->buf_end)
     mailbox->write_ptr = mailbox->buf_start;
 
-  if (mailbox->size++ == 0)
-    _k_sched_wakeup_one(&mailbox->receivers, 0);
+  mailbox->size++;
+}
 
-  return 0;
+/*
+ * ----------------------------------------------------------------------------
+ * Single-producer/single-consumer mode
+ * ----------------------------------------------------------------------------
+ *
+ * The producer only writes tail and the consumer only writes head, so each
+ * side publishes its progress with a release store and observes the other's
+ * with an acquire load. A side that finds the ring empty (or full) raises its
+ * waiting flag and checks the ring again under the lock before going to sleep.
+ * The other side checks the flag after each update, and only then takes the
+ * lock to wake it up. A full barrier on both sides guarantees that at least
+ * one of them sees the other's store, so no wakeup is lost.
+ */
+
+// Wake up the other side if it has announced that it is about to sleep
+static void
+k_mailbox_spsc_wakeup(struct KMailBox *mailbox, int *waiting,
+                      struct KListLink *queue)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (!__atomic_load_n(waiting, __ATOMIC_RELAXED))
+    return;
+
+  k_spinlock_acquire(&mailbox->lock);
+  __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+  _k_sched_wakeup_all(queue, 0);
+  k_spinlock_release(&mailbox->lock);
+}
+
+// Take up to n messages from the ring (called by the consumer only)
+static size_t
+k_mailbox_spsc_get(struct KMailBox *mailbox, void *messages, size_t n)
+{
+  uint8_t *p = (uint8_t *) messages;
+  unsigned long head, tail, i;
+
+  head = mailbox->head;
+  tail = __atomic_load_n(&mailbox->tail, __ATOMIC_ACQUIRE);
+
+  if ((n = MIN(n, tail - head)) == 0)
+    return 0;
+
+  for (i = head; i != head + n; i++, p += mailbox->msg_size)
+    memmove(p, mailbox->buf_start + (i % mailbox->capacity) * mailbox->msg_size,
+            mailbox->msg_size);
+
+  __atomic_store_n(&mailbox->head, head + n, __ATOMIC_RELEASE);
+
+  k_mailbox_spsc_wakeup(mailbox, &mailbox->sender_waiting, &mailbox->senders);
+
+  return n;
+}
+
+// Add up to n messages to the ring (called by the producer only)
+static size_t
+k_mailbox_spsc_put(struct KMailBox *mailbox, const void *messages, size_t n)
+{
+  const uint8_t *p = (const uint8_t *) messages;
+  unsigned long head, tail, i;
+
+  tail = mailbox->tail;
+  head = __atomic_load_n(&mailbox->head, __ATOMIC_ACQUIRE);
+
+  if ((n = MIN(n, mailbox->capacity - (tail - head))) == 0)
+    return 0;
+
+  for (i = tail; i != tail + n; i++, p += mailbox->msg_size)
+    memmove(mailbox->buf_start + (i % mailbox->capacity) * mailbox->msg_size,
+            p, mailbox->msg_size);
+
+  __atomic_store_n(&mailbox->tail, tail + n, __ATOMIC_RELEASE);
+
+  k_mailbox_spsc_wakeup(mailbox, &mailbox->receiver_waiting,
+                        &mailbox->receivers);
+
+  return n;
+}
+
+// Sleep until the ring is no longer empty (for the receiver) or full (for the
+// sender). Returns 0 if the operation should be retried.
+static int
+k_mailbox_spsc_wait(struct KMailBox *mailbox, int receiver,
+                    unsigned long timeout)
+{
+  int *waiting;
+  unsigned long used;
+  int r = 0;
+
+  waiting = receiver ? &mailbox->receiver_waiting : &mailbox->sender_waiting;
+
+  k_spinlock_acquire(&mailbox->lock);
+
+  __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  used = __atomic_load_n(&mailbox->tail, __ATOMIC_ACQUIRE) -
+         __atomic_load_n(&mailbox->head, __ATOMIC_ACQUIRE);
+
+  if (receiver ? (used == 0) : (used == mailbox->capacity))
+    r = _k_sched_sleep(receiver ? &mailbox->receivers : &mailbox->senders,
+                       THREAD_STATE_SLEEP,
+                       timeout,
+                       &mailbox->lock);
+  else
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+
+  k_spinlock_release(&mailbox->lock);
+
+  return r;
+}
+
+// The caller must be holding the scheduler lock
+static struct KThread *
+k_mailbox_first_waiter(struct KListLink *queue)
+{
+  if (k_list_is_empty(queue))
+    return NULL;
+  return KLIST_CONTAINER(queue->next, struct KThread, link);
 }
 
 static void
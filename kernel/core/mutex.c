@@ -12,9 +12,102 @@ static void k_mutex_ctor(void *, size_t);
 static void k_mutex_dtor(void *, size_t);
 static void k_mutex_init_common(struct KMutex *, const char *);
 static void k_mutex_fini_common(struct KMutex *);
+static int  k_mutex_try_lock_fast(struct KMutex *, struct KThread *);
 
 static struct KObjectPool *k_mutex_pool;
 
+// How many times to check a mutex held by a running thread before sleeping
+#define K_MUTEX_SPIN_MAX  1000
+
+/*
+ * The owner word holds the owning thread and the K_MUTEX_WAITERS bit. While
+ * the bit is clear, the owner has the mutex all to itself: it took the mutex
+ * with a compare-and-swap from zero and releases it with a compare-and-swap
+ * back to zero, without the scheduler lock. Such a mutex is not on the list
+ * of the owned mutexes, it does not affect the priority of the owner.
+ *
+ * A thread that is about to wait sets the bit under the scheduler lock and
+ * puts the mutex on the owner's list, so that the priority inheritance works
+ * as usual and the owner has to take the slow path on unlock. The bit, and
+ * the list membership, stay with the mutex as long as its queue is not empty.
+ */
+
+// Get the thread holding the mutex, or NULL
+static inline struct KThread *
+k_mutex_owner(struct KMutex *mutex)
+{
+  uintptr_t owner = __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED);
+
+  return (struct KThread *) (owner & ~K_MUTEX_WAITERS);
+}
+
+/*
+ * Each thread counts the mutexes on its owned_mutexes list by their priority,
+ * and keeps a bitmap of the non-zero counts, so that the priority to inherit
+ * is found with a single CLZ instead of walking the list. The counts change
+ * whenever a mutex joins or leaves the list, or its priority changes while it
+ * is on the list. All under the scheduler lock.
+ */
+
+#define K_MUTEX_PRIORITY_BIT(priority)  (1U << (31 - ((priority) % 32)))
+
+static void
+k_mutex_inherit_add(struct KThread *thread, int priority)
+{
+  if (priority >= THREAD_MAX_PRIORITIES)
+    return;
+
+  if (thread->inherited_count[priority]++ == 0)
+    thread->inherited_bitmap[priority / 32] |= K_MUTEX_PRIORITY_BIT(priority);
+}
+
+static void
+k_mutex_inherit_remove(struct KThread *thread, int priority)
+{
+  if (priority >= THREAD_MAX_PRIORITIES)
+    return;
+
+  assert(thread->inherited_count[priority] > 0);
+
+  if (--thread->inherited_count[priority] == 0)
+    thread->inherited_bitmap[priority / 32] &= ~K_MUTEX_PRIORITY_BIT(priority);
+}
+
+// Put the mutex on the owner's list of mutexes with waiters
+static void
+k_mutex_link(struct KMutex *mutex, struct KThread *owner)
+{
+  k_list_add_front(&owner->owned_mutexes, &mutex->link);
+  k_mutex_inherit_add(owner, mutex->priority);
+}
+
+static void
+k_mutex_unlink(struct KMutex *mutex, struct KThread *owner)
+{
+  if (k_list_is_null(&mutex->link))
+    return;
+
+  k_list_remove(&mutex->link);
+  k_mutex_inherit_remove(owner, mutex->priority);
+}
+
+// Change the mutex priority, updating the counts of the owner
+static void
+k_mutex_set_priority(struct KMutex *mutex, int priority)
+{
+  struct KThread *owner = k_mutex_owner(mutex);
+
+  if (mutex->priority == priority)
+    return;
+
+  if ((owner != NULL) && !k_list_is_null(&mutex->link)) {
+    k_mutex_inherit_remove(owner, mutex->priority);
+    k_mutex_inherit_add(owner, priority);
+  }
+
+  mutex->priority = priority;
+}
+
 void
 k_mutex_system_init(void)
 {
@@ -91,7 +184,7 @@ k_mutex_fini_common(struct KMutex *mutex)
 {
   _k_sched_lock();
 
-  if (mutex->owner != NULL)
+  if (k_mutex_owner(mutex) != NULL)
     panic("mutex locked");
 
   _k_sched_wakeup_all_locked(&mutex->queue, -EINVAL);
@@ -102,48 +195,109 @@ k_mutex_fini_common(struct KMutex *mutex)
 void
 _k_mutex_may_raise_priority(struct KMutex *mutex, int priority)
 {
-  assert(mutex->owner != NULL);
+  struct KThread *owner = k_mutex_owner(mutex);
+
+  assert(owner != NULL);
 
   if (mutex->priority > priority) {
-    mutex->priority = priority;
+    k_mutex_set_priority(mutex, priority);
     
     // Temporarily raise the owner's priority
     // If the owner is waiting for another mutex, this may lead to
     // priority recalculation for other mutexes and threads
-    if (mutex->owner->priority > priority)
-      _k_sched_raise_priority(mutex->owner, priority);
+    if (owner->priority > priority)
+      _k_sched_raise_priority(owner, priority);
   }
 }
 
+// Take a free mutex nobody waits for, without the scheduler lock
+static int
+k_mutex_try_lock_fast(struct KMutex *mutex, struct KThread *current)
+{
+  uintptr_t expected = 0;
+
+  return __atomic_compare_exchange_n(&mutex->owner, &expected,
+                                     (uintptr_t) current, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
 static int
 k_mutex_try_lock_locked(struct KMutex *mutex)
 {
   struct KThread *current = k_thread_current();
+  struct KThread *owner;
+  uintptr_t old, new;
 
   // TODO: assert holding sched
 
-  if (mutex->owner != NULL)
-    return (mutex->owner == current) ? -EDEADLK : -EAGAIN;
+  old = __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED);
+
+  do {
+    owner = (struct KThread *) (old & ~K_MUTEX_WAITERS);
+    if (owner != NULL)
+      return (owner == current) ? -EDEADLK : -EAGAIN;
+
+    // Keep the slow unlock while other threads are waiting
+    new = (uintptr_t) current;
+    if (!k_list_is_empty(&mutex->queue))
+      new |= K_MUTEX_WAITERS;
+  } while (!__atomic_compare_exchange_n(&mutex->owner, &old, new, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
   
   // The highest-priority thread always locks the mutex first
   assert(current->priority <= mutex->priority);
 
-  mutex->owner = current;
-  k_list_add_front(&current->owned_mutexes, &mutex->link);
+  if (new & K_MUTEX_WAITERS)
+    k_mutex_link(mutex, current);
   
   return 0;
 }
 
+/*
+ * Make the owner release the mutex through the slow path before going to
+ * sleep. Called with the scheduler lock held.
+ *
+ * Returns -EAGAIN if the mutex has been released meanwhile.
+ */
+static int
+k_mutex_set_waiters(struct KMutex *mutex)
+{
+  struct KThread *owner;
+  uintptr_t old;
+
+  old = __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED);
+
+  do {
+    if ((old & ~K_MUTEX_WAITERS) == 0)
+      return -EAGAIN;
+    if (old & K_MUTEX_WAITERS)
+      break;
+  } while (!__atomic_compare_exchange_n(&mutex->owner, &old,
+                                        old | K_MUTEX_WAITERS, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  // With the bit set, the owner cannot change without the scheduler lock
+  owner = (struct KThread *) (old & ~K_MUTEX_WAITERS);
+  if (k_list_is_null(&mutex->link))
+    k_mutex_link(mutex, owner);
+
+  return 0;
+}
+
 int
 k_mutex_try_lock(struct KMutex *mutex)
 {
+  struct KThread *current = k_thread_current();
   int r;
 
-  if (k_thread_current() == NULL)
+  if (current == NULL)
     panic("current task is NULL");
   if ((mutex == NULL) || (mutex->type != K_MUTEX_TYPE))
     panic("bad mutex pointer");
 
+  if (k_mutex_try_lock_fast(mutex, current))
+    return 0;
+
   _k_sched_lock();
   r = k_mutex_try_lock_locked(mutex);
   _k_sched_unlock();
@@ -151,6 +305,31 @@ k_mutex_try_lock(struct KMutex *mutex)
   return r;
 }
 
+/*
+ * Wait for a mutex held by a thread running on another CPU, which is likely to
+ * release it soon, without going through the scheduler. Gives up as soon as
+ * the owner changes or stops running, or after K_MUTEX_SPIN_MAX checks.
+ *
+ * Called with the scheduler lock held, the lock is dropped while spinning.
+ */
+static void
+k_mutex_spin(struct KMutex *mutex, struct KThread *owner)
+{
+  unsigned long spins;
+
+  _k_sched_unlock();
+
+  for (spins = 0; spins < K_MUTEX_SPIN_MAX; spins++) {
+    if (k_mutex_owner(mutex) != owner)
+      break;
+    if (__atomic_load_n(&owner->state, __ATOMIC_RELAXED) !=
+        THREAD_STATE_RUNNING)
+      break;
+  }
+
+  _k_sched_lock();
+}
+
 /**
  * Acquire the mutex.
  * 
@@ -160,19 +339,40 @@ int
 k_mutex_timed_lock(struct KMutex *mutex, unsigned long timeout)
 {
   struct KThread *my_task = k_thread_current();
-  int r;
+  struct KThread *owner;
+  int r, spun = 0;
 
   if (my_task == NULL)
     panic("current task is NULL");
   if ((mutex == NULL) || (mutex->type != K_MUTEX_TYPE))
     panic("bad mutex pointer");
 
+  if (k_mutex_try_lock_fast(mutex, my_task))
+    return 0;
+
   _k_sched_lock();
 
   while ((r = k_mutex_try_lock_locked(mutex)) != 0) {
     if (r != -EAGAIN)
       break;
 
+    // Without the waiters bit, the owner may release the mutex at any moment
+    if ((owner = k_mutex_owner(mutex)) == NULL)
+      continue;
+
+    // Spin once per sleep while the owner runs on another CPU, unless there
+    // are sleeping threads of higher priority to take the mutex first
+    if (!spun && (owner->state == THREAD_STATE_RUNNING) &&
+        (my_task->priority <= mutex->priority)) {
+      k_mutex_spin(mutex, owner);
+      spun = 1;
+      continue;
+    }
+    spun = 0;
+
+    if (k_mutex_set_waiters(mutex) != 0)
+      continue;
+
     _k_mutex_may_raise_priority(mutex, my_task->priority);
 
     my_task->sleep_on_mutex = mutex;
@@ -188,33 +388,35 @@ k_mutex_timed_lock(struct KMutex *mutex, unsigned long timeout)
   return 0;
 }
 
+/**
+ * Get the highest priority of the threads waiting for the mutexes owned by
+ * the given thread.
+ *
+ * @return The priority, or THREAD_MAX_PRIORITIES if nobody is waiting.
+ */
 int
-_k_mutex_get_highest_priority(struct KListLink *mutex_list)
+_k_mutex_get_highest_priority(struct KThread *thread)
 {
-  struct KListLink *link;
-  int max_priority;
+  int i;
 
-  max_priority = THREAD_MAX_PRIORITIES;
-  KLIST_FOREACH(mutex_list, link) {
-    struct KMutex *mutex = KLIST_CONTAINER(link, struct KMutex, link);
+  for (i = 0; i < THREAD_PRIORITY_WORDS; i++)
+    if (thread->inherited_bitmap[i] != 0)
+      return i * 32 + __builtin_clz(thread->inherited_bitmap[i]);
 
-    if (mutex->priority < max_priority)
-      max_priority = mutex->priority;
-  }
-
-  return max_priority;
+  return THREAD_MAX_PRIORITIES;
 }
 
 void
 _k_mutex_recalc_priority(struct KMutex *mutex)
 {
   if (k_list_is_empty(&mutex->queue)) {
-    mutex->priority = THREAD_MAX_PRIORITIES;
+    k_mutex_set_priority(mutex, THREAD_MAX_PRIORITIES);
   } else {
+    // The queue is sorted, the first waiter has the highest priority
     struct KThread *thread;
 
     thread = KLIST_CONTAINER(mutex->queue.next, struct KThread, link);
-    mutex->priority = thread->priority;
+    k_mutex_set_priority(mutex, thread->priority);
   }
 }
 
@@ -226,16 +428,28 @@ _k_mutex_recalc_priority(struct KMutex *mutex)
 int
 k_mutex_unlock(struct KMutex *mutex)
 {
+  uintptr_t expected;
+
   if (!k_mutex_holding(mutex))
     panic("not holding");
 
+  // Nobody is waiting
+  expected = (uintptr_t) k_thread_current();
+  if (__atomic_compare_exchange_n(&mutex->owner, &expected, 0, 0,
+                                  __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    return 0;
+
   _k_sched_lock();
 
-  k_list_remove(&mutex->link);
-  mutex->owner = NULL;
+  k_mutex_unlink(mutex, k_thread_current());
   
   _k_sched_wakeup_one_locked(&mutex->queue, 0);
 
+  // Until all waiters are gone, the mutex can only be taken by the slow path
+  __atomic_store_n(&mutex->owner,
+                   k_list_is_empty(&mutex->queue) ? 0 : K_MUTEX_WAITERS,
+                   __ATOMIC_RELEASE);
+
   _k_mutex_recalc_priority(mutex);
   _k_sched_update_effective_priority();
 
@@ -258,9 +472,8 @@ k_mutex_holding(struct KMutex *mutex)
   if ((mutex == NULL) || (mutex->type != K_MUTEX_TYPE))
     panic("bad mutex pointer");
 
-  _k_sched_lock();
-  owner = mutex->owner;
-  _k_sched_unlock();
+  // Only the current task can make itself the owner or stop being one
+  owner = k_mutex_owner(mutex);
 
   return (owner != NULL) && (owner == k_thread_current());
 }
@@ -274,7 +487,7 @@ k_mutex_ctor(void *p, size_t n)
   k_list_init(&mutex->queue);
   k_list_null(&mutex->link);
   mutex->type = K_MUTEX_TYPE;
-  mutex->owner = NULL;
+  mutex->owner = 0;
 }
 
 static void
@@ -285,5 +498,5 @@ k_mutex_dtor(void *p, size_t n)
 
   assert(k_list_is_empty(&mutex->queue));
   assert(k_list_is_null(&mutex->link));
-  assert(mutex->owner == NULL);
+  assert(mutex->owner == 0);
 }
@@ -4,8 +4,13 @@
 
 #include <kernel/assert.h>
 #include <kernel/console.h>
+#include <kernel/core/cpu.h>
+#include <kernel/core/irq.h>
+#include <kernel/core/timer.h>
+#include <kernel/core/work.h>
 #include <kernel/object_pool.h>
 #include <kernel/page.h>
+#include <kernel/time.h>
 #include <kernel/types.h>
 
 /**
@@ -41,6 +46,29 @@
  *    the need to have a per-cache hash table for mapping objects to bufctls.
  *
  * For more info on the slab allocator, see the original paper.
+ *
+ * Magazines
+ * ---------
+ *
+ * To avoid taking the pool lock on every allocation, each CPU caches
+ * constructed objects in two magazines, as described in the paper "Magazines
+ * and Vmem: Extending the Slab Allocator to Many CPUs and Arbitrary Resources"
+ * by Jeff Bonwick and Jonathan Adams. Objects are allocated from and freed to
+ * the loaded magazine with interrupts disabled and without any locks. When the
+ * loaded magazine is empty (or full), it is swapped with the previous one.
+ * Only if both magazines are unsuitable, the CPU takes the pool lock and
+ * exchanges a magazine with the depot shared by all CPUs, or falls back to the
+ * slab layer.
+ *
+ * Trimming
+ * --------
+ *
+ * Slabs with all objects free are kept, so that allocations at a slab boundary
+ * do not create and destroy slabs over and over. Each pool tracks the fewest
+ * such slabs it had during a trimming period: no allocation needed those, so
+ * at the end of the period they are returned to the page allocator, down to
+ * the retention target of the pool. Under memory pressure, the shrinker
+ * releases all of them regardless of the target.
  */
 
 static int                 k_object_pool_init(struct KObjectPool *, const char *,
@@ -49,36 +77,87 @@ static int                 k_object_pool_init(struct KObjectPool *, const char *
                                               void (*)(void *, size_t));
 static struct KObjectSlab *k_object_pool_slab_create(struct KObjectPool *);
 static void                k_object_pool_slab_destroy(struct KObjectSlab *);
+static void                k_object_pool_slab_release(struct KObjectSlab *);
 static void               *k_object_pool_slab_get(struct KObjectSlab *);
 static void                k_object_pool_slab_put(struct KObjectSlab *, void *);                            
+static void               *k_object_pool_slab_alloc(struct KObjectPool *);
+static unsigned            k_object_pool_slab_alloc_bulk(struct KObjectPool *,
+                                                         void **, unsigned);
+static void                k_object_pool_slab_free(struct KObjectPool *, void *);
+static int                 k_object_pool_put_common(struct KObjectPool *, void *,
+                                                    int);
+static void                k_object_pool_magazine_flush(struct KObjectPool *,
+                                                        struct KObjectMagazine *);
+static void               *tag_to_object(struct KObjectSlab *,
+                                         struct KObjectTag *);
 
 /** Linked list to keep track of all object pools in the system */
 static struct {
-  struct KListLink head;
-  struct KSpinLock lock;
+  struct KListLink   head;
+  struct KRWSpinLock lock;
 } pool_list = {
   KLIST_INITIALIZER(pool_list.head),
-  K_SPINLOCK_INITIALIZER("pool_list"),
+  K_RWSPINLOCK_INITIALIZER("pool_list"),
 };
 
 /** Pool of pool descriptors */
 static struct KObjectPool pool_of_pools;
 
-// TODO: maybe there is a better sequence of sizes rather than just powers of 2
-#define ANON_POOLS_LENGTH     12
+/** Pool of magazines */
+static struct KObjectPool magazine_pool;
+
+/** The maximum number of full magazines kept in the depot of each pool */
+#define K_OBJECT_DEPOT_MAX    4
+
+/** The number of free slabs kept by each pool, unless set otherwise */
+#define K_OBJECT_POOL_RETAIN  1
+
+/** How often the slabs not needed during the last period are released */
+#define K_OBJECT_POOL_TRIM_PERIOD seconds2ticks(5)
+
+static unsigned long k_object_pool_shrink(void);
+static void          k_object_pool_trim(void *);
+
+static struct KTimer k_object_pool_trim_timer;
+static struct KWork  k_object_pool_trim_work;
+
+static struct PageShrinker k_object_pool_shrinker = {
+  .name   = "object_pool",
+  .shrink = k_object_pool_shrink,
+};
+
+/*
+ * Size classes used by k_malloc. Between each two consecutive powers of two
+ * there are four classes spaced a quarter of the lower power apart (e.g. 320,
+ * 384, 448, 512), so rounding up never wastes more than 20% of the block.
+ * The classes below ANON_POOLS_STEP_MIN are simply multiples of 8 bytes.
+ */
 #define ANON_POOLS_MIN_SIZE   8U
-#define ANON_POOLS_MAX_SIZE   (ANON_POOLS_MIN_SIZE << (ANON_POOLS_LENGTH - 1))
+#define ANON_POOLS_STEP_MIN   32U
+#define ANON_POOLS_STEP_SHIFT 5       // log2(ANON_POOLS_STEP_MIN)
+#define ANON_POOLS_MAX_SHIFT  14      // log2(ANON_POOLS_MAX_SIZE)
+#define ANON_POOLS_MAX_SIZE   (1U << ANON_POOLS_MAX_SHIFT)
+#define ANON_POOLS_LENGTH     \
+  (int) (ANON_POOLS_STEP_MIN / ANON_POOLS_MIN_SIZE + \
+         4 * (ANON_POOLS_MAX_SHIFT - ANON_POOLS_STEP_SHIFT))
 
 /** Set of anonymous pools to be used by k_malloc */
 static struct KObjectPool *anon_pools[ANON_POOLS_LENGTH];
 
+/** Per-class allocation statistics used to estimate internal fragmentation */
+static struct {
+  unsigned long requests;   ///< The total number of allocations
+  unsigned long long bytes; ///< The total number of bytes requested
+} anon_stats[ANON_POOLS_LENGTH];
+
 /**
  * Create an object pool.
  * 
  * @param name  Identifies the pool for statistics and debugging
  * @param size  The size of each object in bytes
  * @param align The alignment of each object (or 0 if no special alignment is
- *              required).
+ *              required). Pass K_CACHE_LINE_SIZE for objects written to by
+ *              several CPUs, so that each object gets cache lines of its own.
  * @param ctor  Function to construct objects in the pool (or NULL)
  * @param dtor  Function to undo object construction in the pool (or NULL)
  *
@@ -112,11 +191,40 @@ k_object_pool_create(const char *name,
 int
 k_object_pool_destroy(struct KObjectPool *pool)
 {
+  struct KObjectMagazine *mag;
+  int i;
+
   if (pool == &pool_of_pools)
     panic("trying to destroy the pool of pools");
 
   k_spinlock_acquire(&pool->lock);
 
+  // Return all cached objects to the slabs. The pool must not be in use by this
+  // time, so it is safe to access the magazines of other CPUs
+  for (i = 0; i < K_CPU_MAX; i++) {
+    if ((mag = pool->cpus[i].loaded) != NULL) {
+      k_object_pool_magazine_flush(pool, mag);
+      k_object_pool_put(&magazine_pool, mag);
+    }
+    if ((mag = pool->cpus[i].previous) != NULL) {
+      k_object_pool_magazine_flush(pool, mag);
+      k_object_pool_put(&magazine_pool, mag);
+    }
+    pool->cpus[i].loaded = pool->cpus[i].previous = NULL;
+  }
+
+  while ((mag = pool->depot_full) != NULL) {
+    pool->depot_full = mag->next;
+    k_object_pool_magazine_flush(pool, mag);
+    k_object_pool_put(&magazine_pool, mag);
+  }
+  pool->depot_full_count = 0;
+
+  while ((mag = pool->depot_empty) != NULL) {
+    pool->depot_empty = mag->next;
+    k_object_pool_put(&magazine_pool, mag);
+  }
+
   if (!k_list_is_empty(&pool->slabs_empty) || !k_list_is_empty(&pool->slabs_partial)) {
     k_spinlock_release(&pool->lock);
     return -EBUSY;
@@ -134,9 +242,9 @@ k_object_pool_destroy(struct KObjectPool *pool)
 
   k_spinlock_release(&pool->lock);
 
-  k_spinlock_acquire(&pool_list.lock);
+  k_rwspinlock_write_acquire(&pool_list.lock);
   k_list_remove(&pool->link);
-  k_spinlock_release(&pool_list.lock);
+  k_rwspinlock_write_release(&pool_list.lock);
 
   k_object_pool_put(&pool_of_pools, pool);
 
@@ -152,11 +260,313 @@ k_object_pool_destroy(struct KObjectPool *pool)
 void *
 k_object_pool_get(struct KObjectPool *pool)
 {
-  struct KObjectSlab *slab;
+  struct KObjectPoolCpu *cpu;
+  struct KObjectMagazine *mag;
   void *obj;
-  
+
+  if (pool->flags & K_OBJECT_POOL_NO_MAGAZINES) {
+    k_spinlock_acquire(&pool->lock);
+    obj = k_object_pool_slab_alloc(pool);
+    k_spinlock_release(&pool->lock);
+
+    return obj;
+  }
+
+  k_irq_state_save();
+
+  cpu = &pool->cpus[k_cpu_id()];
+
+  // The loaded magazine is empty, but the previous one is full
+  if (((cpu->loaded == NULL) || (cpu->loaded->rounds == 0)) &&
+      (cpu->previous != NULL) && (cpu->previous->rounds > 0)) {
+    mag = cpu->loaded;
+    cpu->loaded = cpu->previous;
+    cpu->previous = mag;
+  }
+
+  if ((cpu->loaded != NULL) && (cpu->loaded->rounds > 0)) {
+    obj = cpu->loaded->objs[--cpu->loaded->rounds];
+    k_irq_state_restore();
+    return obj;
+  }
+
+  // Both magazines are empty, try to get a full one from the depot
   k_spinlock_acquire(&pool->lock);
 
+  if ((mag = pool->depot_full) != NULL) {
+    pool->depot_full = mag->next;
+    pool->depot_full_count--;
+
+    if (cpu->previous != NULL) {
+      cpu->previous->next = pool->depot_empty;
+      pool->depot_empty = cpu->previous;
+    }
+
+    cpu->previous = cpu->loaded;
+    cpu->loaded   = mag;
+
+    obj = mag->objs[--mag->rounds];
+  } else {
+    obj = k_object_pool_slab_alloc(pool);
+  }
+
+  k_spinlock_release(&pool->lock);
+
+  k_irq_state_restore();
+
+  return obj;
+}
+
+/**
+ * Return a previously allocated object into the pool.
+ * 
+ * @param pool Pointer to the pool descriptor
+ * @param obj  Pointer to the object to be deallocated
+ */
+void
+k_object_pool_put(struct KObjectPool *pool, void *obj)
+{
+  k_object_pool_put_common(pool, obj, 0);
+}
+
+/**
+ * Return a previously allocated object into the pool without waiting for the
+ * pool lock. Can be used by the page shrinkers, which may be called while
+ * arbitrary locks are held.
+ * 
+ * @param pool Pointer to the pool descriptor
+ * @param obj  Pointer to the object to be deallocated
+ *
+ * @retval 0       Success
+ * @retval -EAGAIN The pool is locked, the object has not been deallocated
+ */
+int
+k_object_pool_try_put(struct KObjectPool *pool, void *obj)
+{
+  return k_object_pool_put_common(pool, obj, 1);
+}
+
+static int
+k_object_pool_put_common(struct KObjectPool *pool, void *obj, int nowait)
+{
+  struct KObjectPoolCpu *cpu;
+  struct KObjectMagazine *mag;
+
+  if (pool->flags & K_OBJECT_POOL_NO_MAGAZINES) {
+    if (nowait) {
+      if (k_spinlock_try_acquire(&pool->lock) != 0)
+        return -EAGAIN;
+    } else {
+      k_spinlock_acquire(&pool->lock);
+    }
+
+    k_object_pool_slab_free(pool, obj);
+    k_spinlock_release(&pool->lock);
+
+    return 0;
+  }
+
+  k_irq_state_save();
+
+  cpu = &pool->cpus[k_cpu_id()];
+
+  // The loaded magazine is full, but the previous one is empty
+  if (((cpu->loaded == NULL) ||
+       (cpu->loaded->rounds == K_OBJECT_MAGAZINE_SIZE)) &&
+      (cpu->previous != NULL) && (cpu->previous->rounds == 0)) {
+    mag = cpu->loaded;
+    cpu->loaded = cpu->previous;
+    cpu->previous = mag;
+  }
+
+  if ((cpu->loaded != NULL) &&
+      (cpu->loaded->rounds < K_OBJECT_MAGAZINE_SIZE)) {
+    cpu->loaded->objs[cpu->loaded->rounds++] = obj;
+    k_irq_state_restore();
+    return 0;
+  }
+
+  // Both magazines are full, exchange one for an empty magazine
+  if (nowait) {
+    if (k_spinlock_try_acquire(&pool->lock) != 0) {
+      k_irq_state_restore();
+      return -EAGAIN;
+    }
+  } else {
+    k_spinlock_acquire(&pool->lock);
+  }
+
+  if (cpu->loaded != NULL) {
+    if ((mag = cpu->previous) != NULL) {
+      if (pool->depot_full_count < K_OBJECT_DEPOT_MAX) {
+        mag->next = pool->depot_full;
+        pool->depot_full = mag;
+        pool->depot_full_count++;
+      } else {
+        // The depot is large enough, give the objects back to the slabs
+        k_object_pool_magazine_flush(pool, mag);
+        mag->next = pool->depot_empty;
+        pool->depot_empty = mag;
+      }
+    }
+
+    cpu->previous = cpu->loaded;
+    cpu->loaded   = NULL;
+  }
+
+  if ((mag = pool->depot_empty) != NULL) {
+    pool->depot_empty = mag->next;
+  } else if (!nowait) {
+    // Allocating a magazine would require taking another lock
+    mag = (struct KObjectMagazine *) k_object_pool_get(&magazine_pool);
+    if (mag != NULL)
+      mag->rounds = 0;
+  }
+
+  if (mag != NULL) {
+    cpu->loaded = mag;
+    mag->objs[mag->rounds++] = obj;
+  } else {
+    k_object_pool_slab_free(pool, obj);
+  }
+
+  k_spinlock_release(&pool->lock);
+
+  k_irq_state_restore();
+
+  return 0;
+}
+
+/**
+ * Allocate several objects from the pool at once. The pool lock is taken at
+ * most once, and objects are taken from the slabs a whole free list at a time,
+ * so this is cheaper than calling k_object_pool_get in a loop.
+ *
+ * @param pool Pointer to the pool descriptor to allocate from
+ * @param objs Array to store pointers to the allocated objects into
+ * @param n    The number of objects to allocate
+ *
+ * @return The number of objects allocated (less than n if out of memory).
+ */
+unsigned
+k_object_pool_get_bulk(struct KObjectPool *pool, void **objs, unsigned n)
+{
+  struct KObjectPoolCpu *cpu;
+  struct KObjectMagazine *mag;
+  unsigned i = 0;
+
+  if (pool->flags & K_OBJECT_POOL_NO_MAGAZINES) {
+    k_spinlock_acquire(&pool->lock);
+    i = k_object_pool_slab_alloc_bulk(pool, objs, n);
+    k_spinlock_release(&pool->lock);
+
+    return i;
+  }
+
+  k_irq_state_save();
+
+  cpu = &pool->cpus[k_cpu_id()];
+
+  // Use the objects cached by this CPU first
+  if ((mag = cpu->loaded) != NULL)
+    while ((i < n) && (mag->rounds > 0))
+      objs[i++] = mag->objs[--mag->rounds];
+  if ((mag = cpu->previous) != NULL)
+    while ((i < n) && (mag->rounds > 0))
+      objs[i++] = mag->objs[--mag->rounds];
+
+  if (i < n) {
+    k_spinlock_acquire(&pool->lock);
+
+    // Then the depot, emptied magazines stay there for later exchanges
+    while ((i < n) && ((mag = pool->depot_full) != NULL)) {
+      while ((i < n) && (mag->rounds > 0))
+        objs[i++] = mag->objs[--mag->rounds];
+
+      if (mag->rounds == 0) {
+        pool->depot_full = mag->next;
+        pool->depot_full_count--;
+
+        mag->next = pool->depot_empty;
+        pool->depot_empty = mag;
+      }
+    }
+
+    i += k_object_pool_slab_alloc_bulk(pool, objs + i, n - i);
+
+    k_spinlock_release(&pool->lock);
+  }
+
+  k_irq_state_restore();
+
+  return i;
+}
+
+/**
+ * Return several previously allocated objects into the pool at once, taking
+ * the pool lock at most once.
+ *
+ * @param pool Pointer to the pool descriptor
+ * @param objs Array of pointers to the objects to be deallocated
+ * @param n    The number of objects in the array
+ */
+void
+k_object_pool_put_bulk(struct KObjectPool *pool, void **objs, unsigned n)
+{
+  struct KObjectPoolCpu *cpu;
+  struct KObjectMagazine *mag;
+  unsigned i = 0;
+
+  if (pool->flags & K_OBJECT_POOL_NO_MAGAZINES) {
+    k_spinlock_acquire(&pool->lock);
+    for ( ; i < n; i++)
+      k_object_pool_slab_free(pool, objs[i]);
+    k_spinlock_release(&pool->lock);
+
+    return;
+  }
+
+  k_irq_state_save();
+
+  cpu = &pool->cpus[k_cpu_id()];
+
+  // Fill the magazines of this CPU first
+  if ((mag = cpu->loaded) != NULL)
+    while ((i < n) && (mag->rounds < K_OBJECT_MAGAZINE_SIZE))
+      mag->objs[mag->rounds++] = objs[i++];
+  if ((mag = cpu->previous) != NULL)
+    while ((i < n) && (mag->rounds < K_OBJECT_MAGAZINE_SIZE))
+      mag->objs[mag->rounds++] = objs[i++];
+
+  // Whatever doesn't fit goes back to the slabs
+  if (i < n) {
+    k_spinlock_acquire(&pool->lock);
+    for ( ; i < n; i++)
+      k_object_pool_slab_free(pool, objs[i]);
+    k_spinlock_release(&pool->lock);
+  }
+
+  k_irq_state_restore();
+}
+
+// A slab with all objects free is about to leave the slabs_full list
+static inline void
+k_object_pool_full_taken(struct KObjectPool *pool)
+{
+  debug_assert(pool->slabs_full_count > 0);
+
+  if (--pool->slabs_full_count < pool->slabs_full_low)
+    pool->slabs_full_low = pool->slabs_full_count;
+}
+
+// Allocate an object from the slab layer, the pool lock must be held
+static void *
+k_object_pool_slab_alloc(struct KObjectPool *pool)
+{
+  struct KObjectSlab *slab;
+
+  debug_assert(k_spinlock_holding(&pool->lock));
+
   // First, try to use partially full slabs
   if (!k_list_is_empty(&pool->slabs_partial)) {
     slab = KLIST_CONTAINER(pool->slabs_partial.next, struct KObjectSlab, link);
@@ -174,36 +584,106 @@ k_object_pool_get(struct KObjectPool *pool)
     // Put the selected slab into the partial list. k_object_pool_slab_get() will
     // put it into the empty list later, if necessary
     k_list_remove(&slab->link);
+    k_object_pool_full_taken(pool);
     k_list_add_back(&pool->slabs_partial, &slab->link);
   } 
 
-  obj = k_object_pool_slab_get(slab);
+  return k_object_pool_slab_get(slab);
+}
 
-  k_spinlock_release(&pool->lock);
+// Allocate up to n objects from the slab layer, taking the whole free list of
+// each slab at once, the pool lock must be held
+static unsigned
+k_object_pool_slab_alloc_bulk(struct KObjectPool *pool, void **objs,
+                              unsigned n)
+{
+  struct KObjectSlab *slab;
+  struct KObjectTag *tag;
+  unsigned i = 0;
 
-  return obj;
+  debug_assert(k_spinlock_holding(&pool->lock));
+
+  while (i < n) {
+    if (!k_list_is_empty(&pool->slabs_partial)) {
+      slab = KLIST_CONTAINER(pool->slabs_partial.next, struct KObjectSlab,
+                             link);
+    } else if (!k_list_is_empty(&pool->slabs_full)) {
+      slab = KLIST_CONTAINER(pool->slabs_full.next, struct KObjectSlab, link);
+    } else if ((slab = k_object_pool_slab_create(pool)) == NULL) {
+      break;
+    }
+
+    if (slab->used_count == 0)
+      k_object_pool_full_taken(pool);
+
+    while ((i < n) && ((tag = slab->free) != NULL)) {
+      slab->free = tag->next;
+      slab->used_count++;
+      objs[i++] = tag_to_object(slab, tag);
+    }
+
+    k_list_remove(&slab->link);
+    if (slab->used_count == pool->slab_capacity)
+      k_list_add_back(&pool->slabs_empty, &slab->link);
+    else
+      k_list_add_front(&pool->slabs_partial, &slab->link);
+  }
+
+  return i;
 }
 
-/**
- * Return a previously allocated object into the pool.
- * 
- * @param pool Pointer to the pool descriptor
- * @param obj  Pointer to the object to be deallocated
- */
-void
-k_object_pool_put(struct KObjectPool *pool, void *obj)
+// Return an object to the slab layer, the pool lock must be held
+static void
+k_object_pool_slab_free(struct KObjectPool *pool, void *obj)
 {
   struct Page *page;
-  struct KObjectSlab *slab;
 
-  k_spinlock_acquire(&pool->lock);
+  debug_assert(k_spinlock_holding(&pool->lock));
 
   page = kva2page(ROUND_DOWN(obj, PAGE_SIZE << pool->slab_page_order));
-  slab = page->slab;
 
-  k_object_pool_slab_put(slab, obj);
+  k_object_pool_slab_put(page->slab, obj);
+}
 
-  k_spinlock_release(&pool->lock);
+// Return all objects from the magazine to the slab layer
+static void
+k_object_pool_magazine_flush(struct KObjectPool *pool,
+                             struct KObjectMagazine *mag)
+{
+  while (mag->rounds > 0)
+    k_object_pool_slab_free(pool, mag->objs[--mag->rounds]);
+}
+
+// Get the index of the smallest size class that fits the given size
+static int
+k_malloc_class(size_t size)
+{
+  unsigned n, shift;
+
+  if (size <= ANON_POOLS_STEP_MIN)
+    return (size > 0) ? (size - 1) / ANON_POOLS_MIN_SIZE : 0;
+
+  // 2^shift < size <= 2^(shift + 1), with classes 2^(shift - 2) bytes apart
+  n     = size - 1;
+  shift = 31 - __builtin_clz(n);
+
+  return ANON_POOLS_STEP_MIN / ANON_POOLS_MIN_SIZE +
+         (shift - ANON_POOLS_STEP_SHIFT) * 4 + ((n >> (shift - 2)) & 3);
+}
+
+// Get the block size of the given size class
+static size_t
+k_malloc_class_size(int i)
+{
+  unsigned shift;
+
+  if (i < (int) (ANON_POOLS_STEP_MIN / ANON_POOLS_MIN_SIZE))
+    return (i + 1) * ANON_POOLS_MIN_SIZE;
+
+  i -= ANON_POOLS_STEP_MIN / ANON_POOLS_MIN_SIZE;
+  shift = ANON_POOLS_STEP_SHIFT + i / 4;
+
+  return (size_t) (4 + (i % 4) + 1) << (shift - 2);
 }
 
 /**
@@ -217,13 +697,22 @@ k_object_pool_system_init(void)
 
   // First, solve the "chicken and egg" problem by initializing the static
   // pool of pool descriptors
+  // The per-CPU magazine pointers in the descriptors are cache-line aligned
   if (k_object_pool_init(&pool_of_pools, "pool_of_pools",
-                       sizeof(struct KObjectPool), 0, NULL, NULL) < 0)
+                       sizeof(struct KObjectPool), K_CACHE_LINE_SIZE,
+                       NULL, NULL) < 0)
     panic("cannot initialize pool_of_pools");
 
+  // Magazines are allocated directly from the slab layer
+  if (k_object_pool_init(&magazine_pool, "magazine_pool",
+                       sizeof(struct KObjectMagazine), K_CACHE_LINE_SIZE,
+                       NULL, NULL) < 0)
+    panic("cannot initialize magazine_pool");
+  magazine_pool.flags |= K_OBJECT_POOL_NO_MAGAZINES;
+
   // Then, initialize the set of anonymous pools used by k_malloc and k_free
   for (i = 0; i < ANON_POOLS_LENGTH; i++) {
-    size_t size = ANON_POOLS_MIN_SIZE << i;
+    size_t size = k_malloc_class_size(i);
     char name[K_OBJECT_POOL_NAME_MAX];
 
     snprintf(name, sizeof(name), "anon(%u)", size);
@@ -232,6 +721,45 @@ k_object_pool_system_init(void)
     if (anon_pools[i] == NULL)
       panic("cannot initialize %s", name);
   }
+
+  page_shrinker_register(&k_object_pool_shrinker);
+}
+
+// Runs in the timer context, so leave the work to a worker thread
+static void
+k_object_pool_trim_tick(void *arg)
+{
+  (void) arg;
+
+  k_work_queue(&k_object_pool_trim_work);
+}
+
+/**
+ * Start releasing the free slabs of idle pools in the background. This must be
+ * called after the timers and the deferred work have been initialized.
+ */
+void
+k_object_pool_trim_init(void)
+{
+  k_work_init(&k_object_pool_trim_work, k_object_pool_trim, NULL);
+  k_timer_init(&k_object_pool_trim_timer, k_object_pool_trim_tick, NULL,
+               K_OBJECT_POOL_TRIM_PERIOD, K_OBJECT_POOL_TRIM_PERIOD, 1);
+}
+
+/**
+ * Set the number of slabs with all objects free that the background trimming
+ * leaves in the pool. Pools that see bursts of allocations after idle periods
+ * can keep more, the shrinker still releases them under memory pressure.
+ *
+ * @param pool  The pool descriptor
+ * @param slabs The number of free slabs to keep
+ */
+void
+k_object_pool_set_retain(struct KObjectPool *pool, unsigned slabs)
+{
+  k_spinlock_acquire(&pool->lock);
+  pool->slabs_retain = slabs;
+  k_spinlock_release(&pool->lock);
 }
 
 /**
@@ -247,15 +775,15 @@ k_malloc(size_t size)
 {
   int i;
 
-  // Search the anonymous pool of smallest suitable size
-  for (i = 0; i < ANON_POOLS_LENGTH; i++) {
-    size_t pool_size = ANON_POOLS_MIN_SIZE << i;
+  if (size > ANON_POOLS_MAX_SIZE)
+    return NULL;
 
-    if (size <= pool_size)
-      return k_object_pool_get(anon_pools[i]);
-  }
+  i = k_malloc_class(size);
+
+  __sync_add_and_fetch(&anon_stats[i].requests, 1);
+  __sync_add_and_fetch(&anon_stats[i].bytes, size);
 
-  return NULL;
+  return k_object_pool_get(anon_pools[i]);
 }
 
 /**
@@ -276,6 +804,27 @@ k_free(void *ptr)
   k_object_pool_put(page->slab->pool, ptr);
 }
 
+/**
+ * Deallocate a block of memory previously allocated by 'k_malloc' without
+ * waiting for locks (see k_object_pool_try_put).
+ * 
+ * @param prt Pointer to the memory to be freed
+ *
+ * @retval 0       Success
+ * @retval -EAGAIN The block cannot be freed without waiting
+ */
+int
+k_try_free(void *ptr)
+{
+  struct Page *page;
+
+  page = kva2page(ptr);
+  if (page->slab == NULL)
+    panic("bad pointer");
+
+  return k_object_pool_try_put(page->slab->pool, ptr);
+}
+
 /**
  * Initialize a (statically) allocated object pool.
  * 
@@ -301,9 +850,7 @@ k_object_pool_init(struct KObjectPool *pool,
   unsigned slab_page_order, slab_capacity;
   int flags;
 
-  if (size < align)
-    return -EINVAL;
-  if ((PAGE_SIZE % align) != 0)
+  if ((align != 0) && ((PAGE_SIZE % align) != 0))
     return -EINVAL;
 
   align = align ? ROUND_UP(align, sizeof(uintptr_t)) : sizeof(uintptr_t);
@@ -356,9 +903,18 @@ k_object_pool_init(struct KObjectPool *pool,
   pool->color_max       = wastage;
   pool->color_next      = 0;
 
-  k_spinlock_acquire(&pool_list.lock);
+  pool->slabs_full_count = 0;
+  pool->slabs_full_low   = 0;
+  pool->slabs_retain     = K_OBJECT_POOL_RETAIN;
+
+  memset(pool->cpus, 0, sizeof(pool->cpus));
+  pool->depot_full       = NULL;
+  pool->depot_full_count = 0;
+  pool->depot_empty      = NULL;
+
+  k_rwspinlock_write_acquire(&pool_list.lock);
   k_list_add_back(&pool_list.head, &pool->link);
-  k_spinlock_release(&pool_list.lock);
+  k_rwspinlock_write_release(&pool_list.lock);
 
   strncpy(pool->name, name, K_OBJECT_POOL_NAME_MAX);
   pool->name[K_OBJECT_POOL_NAME_MAX] = '\0';
@@ -395,7 +951,7 @@ k_object_pool_slab_create(struct KObjectPool *pool)
   uint8_t *data, *end, *p;
   unsigned i;
 
-  assert(k_spinlock_holding(&pool->lock));
+  debug_assert(k_spinlock_holding(&pool->lock));
 
   if ((page = page_alloc_block(pool->slab_page_order, 0, PAGE_TAG_SLAB)) == NULL)
     return NULL;
@@ -455,6 +1011,7 @@ k_object_pool_slab_create(struct KObjectPool *pool)
   // Add the newly allocated slab to the full list
   // object_pool_alloc will move it to the partial list
   k_list_add_back(&pool->slabs_full, &slab->link);
+  pool->slabs_full_count++;
 
   return slab;
 }
@@ -466,12 +1023,29 @@ k_object_pool_slab_create(struct KObjectPool *pool)
  */
 static void
 k_object_pool_slab_destroy(struct KObjectSlab *slab)
+{
+  struct KObjectPool *pool = slab->pool;
+
+  k_object_pool_slab_release(slab);
+
+  if (pool->flags & K_OBJECT_POOL_OFF_SLAB)
+    k_free(slab);
+}
+
+/**
+ * Destroy all objects in the slab and free the page block. For off-slab
+ * pools, the slab descriptor itself has to be freed by the caller.
+ * 
+ * @param slab Pointer to the slab descriptor
+ */
+static void
+k_object_pool_slab_release(struct KObjectSlab *slab)
 {
   struct KObjectPool *pool = slab->pool;
   struct Page *page;
   unsigned i;
   
-  assert(k_spinlock_holding(&slab->pool->lock));
+  debug_assert(k_spinlock_holding(&slab->pool->lock));
   assert(slab->used_count == 0);
 
   // Call destructor for all objects
@@ -491,9 +1065,6 @@ k_object_pool_slab_destroy(struct KObjectSlab *slab)
     page[i].slab = NULL;
   }
 
-  if (pool->flags & K_OBJECT_POOL_OFF_SLAB)
-    k_free(slab);
-
   page->ref_count--;
   page_free_block(page, pool->slab_page_order);
 }
@@ -558,9 +1129,256 @@ k_object_pool_slab_put(struct KObjectSlab *slab, void *obj)
     // Slab becomes full
     k_list_remove(&slab->link);
     k_list_add_front(&pool->slabs_full, &slab->link);
+    pool->slabs_full_count++;
   } else if (slab->used_count == pool->slab_capacity - 1) {
     // Slab becomes partially full
     k_list_remove(&slab->link);
     k_list_add_front(&pool->slabs_partial, &slab->link);
   }
 }
+
+// Release the pages of up to n slabs with no allocated objects, the pool lock
+// must be held. Return the number of pages freed.
+static unsigned long
+k_object_pool_release_slabs(struct KObjectPool *pool, unsigned n)
+{
+  unsigned long pages = 0;
+
+  debug_assert(k_spinlock_holding(&pool->lock));
+
+  while ((n-- > 0) && !k_list_is_empty(&pool->slabs_full)) {
+    struct KObjectSlab *slab;
+    struct KObjectPool *desc_pool = NULL;
+
+    slab = KLIST_CONTAINER(pool->slabs_full.next, struct KObjectSlab, link);
+
+    // The off-slab descriptor goes back directly to the slab layer of its
+    // own pool, which has to be locked as well
+    if (pool->flags & K_OBJECT_POOL_OFF_SLAB) {
+      desc_pool = kva2page(slab)->slab->pool;
+
+      if ((desc_pool != pool) &&
+          (k_spinlock_try_acquire(&desc_pool->lock) != 0))
+        break;
+    }
+
+    k_list_remove(&slab->link);
+    k_object_pool_full_taken(pool);
+    k_object_pool_slab_release(slab);
+    pages += 1UL << pool->slab_page_order;
+
+    if (desc_pool != NULL) {
+      k_object_pool_slab_free(desc_pool, slab);
+      if (desc_pool != pool)
+        k_spinlock_release(&desc_pool->lock);
+    }
+  }
+
+  return pages;
+}
+
+// Release the pages of all slabs with no allocated objects. Called by the page
+// allocator when it runs out of memory, so pools that cannot be locked
+// immediately are skipped.
+static unsigned long
+k_object_pool_shrink(void)
+{
+  struct KListLink *l;
+  unsigned long n = 0;
+
+  k_rwspinlock_read_acquire(&pool_list.lock);
+
+  KLIST_FOREACH(&pool_list.head, l) {
+    struct KObjectPool *pool = KLIST_CONTAINER(l, struct KObjectPool, link);
+    struct KObjectMagazine *mag;
+
+    if (k_spinlock_try_acquire(&pool->lock) != 0)
+      continue;
+
+    // Objects cached in the depot go back to the slabs first
+    while ((mag = pool->depot_full) != NULL) {
+      pool->depot_full = mag->next;
+      k_object_pool_magazine_flush(pool, mag);
+      mag->next = pool->depot_empty;
+      pool->depot_empty = mag;
+    }
+    pool->depot_full_count = 0;
+
+    n += k_object_pool_release_slabs(pool, pool->slabs_full_count);
+
+    k_spinlock_release(&pool->lock);
+  }
+
+  k_rwspinlock_read_release(&pool_list.lock);
+
+  return n;
+}
+
+// Release the free slabs that no allocation needed during the last period,
+// down to the retention target of each pool. Busy pools are skipped until the
+// next period, their low mark then covers both.
+static void
+k_object_pool_trim(void *arg)
+{
+  struct KListLink *l;
+
+  (void) arg;
+
+  k_rwspinlock_read_acquire(&pool_list.lock);
+
+  KLIST_FOREACH(&pool_list.head, l) {
+    struct KObjectPool *pool = KLIST_CONTAINER(l, struct KObjectPool, link);
+    unsigned excess = 0;
+
+    if (k_spinlock_try_acquire(&pool->lock) != 0)
+      continue;
+
+    if (pool->slabs_full_count > pool->slabs_retain)
+      excess = MIN(pool->slabs_full_low,
+                   pool->slabs_full_count - pool->slabs_retain);
+
+    k_object_pool_release_slabs(pool, excess);
+    pool->slabs_full_low = pool->slabs_full_count;
+
+    k_spinlock_release(&pool->lock);
+  }
+
+  k_rwspinlock_read_release(&pool_list.lock);
+}
+
+static unsigned
+k_object_pool_count_slabs(struct KListLink *list)
+{
+  struct KListLink *l;
+  unsigned n = 0;
+
+  KLIST_FOREACH(list, l)
+    n++;
+
+  return n;
+}
+
+// Count objects cached in magazines. The magazines of other CPUs change
+// without locking, so the result is only an estimate
+static unsigned
+k_object_pool_count_cached(struct KObjectPool *pool)
+{
+  struct KObjectMagazine *mag;
+  unsigned n = 0;
+  int i;
+
+  for (i = 0; i < K_CPU_MAX; i++) {
+    if ((mag = pool->cpus[i].loaded) != NULL)
+      n += mag->rounds;
+    if ((mag = pool->cpus[i].previous) != NULL)
+      n += mag->rounds;
+  }
+
+  for (mag = pool->depot_full; mag != NULL; mag = mag->next)
+    n += mag->rounds;
+
+  return n;
+}
+
+// Count objects allocated from the slabs on the given list
+static unsigned
+k_object_pool_count_used(struct KListLink *list)
+{
+  struct KListLink *l;
+  unsigned n = 0;
+
+  KLIST_FOREACH(list, l)
+    n += KLIST_CONTAINER(l, struct KObjectSlab, link)->used_count;
+
+  return n;
+}
+
+/**
+ * Collect the statistics of all object pools in the system.
+ *
+ * @param stats Array to store the statistics into
+ * @param max   The number of elements in the array
+ *
+ * @return The number of pools, which may be larger than max.
+ */
+unsigned
+k_object_pool_get_stats(struct KObjectPoolStats *stats, unsigned max)
+{
+  struct KListLink *l;
+  unsigned n = 0;
+
+  k_rwspinlock_read_acquire(&pool_list.lock);
+
+  KLIST_FOREACH(&pool_list.head, l) {
+    struct KObjectPool *pool = KLIST_CONTAINER(l, struct KObjectPool, link);
+    struct KObjectPoolStats *s;
+    unsigned slabs;
+
+    if (n >= max) {
+      n++;
+      continue;
+    }
+    s = &stats[n++];
+
+    k_spinlock_acquire(&pool->lock);
+
+    strcpy(s->name, pool->name);
+    s->obj_size      = pool->obj_size;
+    s->slab_capacity = pool->slab_capacity;
+    s->slab_pages    = 1U << pool->slab_page_order;
+    s->slabs_full    = k_object_pool_count_slabs(&pool->slabs_full);
+    s->slabs_partial = k_object_pool_count_slabs(&pool->slabs_partial);
+    s->slabs_empty   = k_object_pool_count_slabs(&pool->slabs_empty);
+    s->objs_cached   = k_object_pool_count_cached(pool);
+    s->objs_used     = k_object_pool_count_used(&pool->slabs_partial) +
+                       k_object_pool_count_used(&pool->slabs_empty);
+    s->color_max     = pool->color_max;
+
+    k_spinlock_release(&pool->lock);
+
+    // Magazines hold objects already taken from the slabs
+    s->objs_used -= MIN(s->objs_used, s->objs_cached);
+
+    // The space left at the end of each slab (used for coloring) and the
+    // padding of each block
+    slabs = s->slabs_full + s->slabs_partial + s->slabs_empty;
+    s->waste = slabs * (pool->color_max +
+               s->slab_capacity * (pool->block_size - pool->obj_size));
+  }
+
+  k_rwspinlock_read_release(&pool_list.lock);
+
+  return n;
+}
+
+/**
+ * Display the internal fragmentation of the k_malloc size classes, i.e. the
+ * number of bytes lost by rounding the requested sizes up to the block size.
+ */
+void
+k_malloc_print_stats(void)
+{
+  int i;
+
+  cprintf("%-20s %10s %12s %12s %6s\n",
+          "name", "requests", "requested", "wasted", "waste%");
+
+  for (i = 0; i < ANON_POOLS_LENGTH; i++) {
+    unsigned long requests = anon_stats[i].requests;
+    unsigned long long bytes = anon_stats[i].bytes;
+    unsigned long long total, wasted;
+
+    if (requests == 0)
+      continue;
+
+    total  = (unsigned long long) requests * anon_pools[i]->obj_size;
+    wasted = (total > bytes) ? total - bytes : 0;
+
+    cprintf("%-20s %10lu %12llu %12llu %5u%%\n",
+            anon_pools[i]->name,
+            requests,
+            bytes,
+            wasted,
+            (unsigned) (wasted * 100 / total));
+  }
+}
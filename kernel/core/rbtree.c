@@ -0,0 +1,320 @@
+#include <kernel/core/rbtree.h>
+
+/**
+ * @file
+ *
+ * Red-black tree balancing, as described in "Introduction to Algorithms" by
+ * Cormen, Leiserson, Rivest, and Stein. NULL pointers are used as the black
+ * leaves, so the removal fixup has to track the parent of the (possibly NULL)
+ * replacement node explicitly.
+ */
+
+#define K_RBTREE_RED    0
+#define K_RBTREE_BLACK  1
+
+static inline int
+k_rbtree_is_black(struct KRBNode *node)
+{
+  return (node == NULL) || (node->color == K_RBTREE_BLACK);
+}
+
+// Replace the child pointer of the old node's parent (or the tree root)
+static inline void
+k_rbtree_replace(struct KRBTree *tree, struct KRBNode *old,
+                 struct KRBNode *new)
+{
+  if (old->parent == NULL)
+    tree->root = new;
+  else if (old == old->parent->left)
+    old->parent->left = new;
+  else
+    old->parent->right = new;
+}
+
+static void
+k_rbtree_rotate_left(struct KRBTree *tree, struct KRBNode *x)
+{
+  struct KRBNode *y = x->right;
+
+  x->right = y->left;
+  if (y->left != NULL)
+    y->left->parent = x;
+
+  y->parent = x->parent;
+  k_rbtree_replace(tree, x, y);
+
+  y->left   = x;
+  x->parent = y;
+}
+
+static void
+k_rbtree_rotate_right(struct KRBTree *tree, struct KRBNode *x)
+{
+  struct KRBNode *y = x->left;
+
+  x->left = y->right;
+  if (y->right != NULL)
+    y->right->parent = x;
+
+  y->parent = x->parent;
+  k_rbtree_replace(tree, x, y);
+
+  y->right  = x;
+  x->parent = y;
+}
+
+/**
+ * Rebalance the tree after a new node has been attached by k_rbtree_link().
+ *
+ * @param tree The tree.
+ * @param node The node that has just been inserted.
+ */
+void
+k_rbtree_insert_fixup(struct KRBTree *tree, struct KRBNode *node)
+{
+  struct KRBNode *parent, *grandparent, *uncle;
+
+  while (((parent = node->parent) != NULL) &&
+         (parent->color == K_RBTREE_RED)) {
+    // The root is black, so a red parent always has a parent
+    grandparent = parent->parent;
+
+    if (parent == grandparent->left) {
+      uncle = grandparent->right;
+
+      if (!k_rbtree_is_black(uncle)) {
+        parent->color      = K_RBTREE_BLACK;
+        uncle->color       = K_RBTREE_BLACK;
+        grandparent->color = K_RBTREE_RED;
+        node = grandparent;
+        continue;
+      }
+
+      if (node == parent->right) {
+        k_rbtree_rotate_left(tree, parent);
+        node   = parent;
+        parent = node->parent;
+      }
+
+      parent->color      = K_RBTREE_BLACK;
+      grandparent->color = K_RBTREE_RED;
+      k_rbtree_rotate_right(tree, grandparent);
+    } else {
+      uncle = grandparent->left;
+
+      if (!k_rbtree_is_black(uncle)) {
+        parent->color      = K_RBTREE_BLACK;
+        uncle->color       = K_RBTREE_BLACK;
+        grandparent->color = K_RBTREE_RED;
+        node = grandparent;
+        continue;
+      }
+
+      if (node == parent->left) {
+        k_rbtree_rotate_right(tree, parent);
+        node   = parent;
+        parent = node->parent;
+      }
+
+      parent->color      = K_RBTREE_BLACK;
+      grandparent->color = K_RBTREE_RED;
+      k_rbtree_rotate_left(tree, grandparent);
+    }
+  }
+
+  tree->root->color = K_RBTREE_BLACK;
+}
+
+// Restore the black height after a black node has been removed. 'node' is the
+// node that took its place (possibly NULL) and 'parent' is its parent.
+static void
+k_rbtree_remove_fixup(struct KRBTree *tree, struct KRBNode *node,
+                      struct KRBNode *parent)
+{
+  struct KRBNode *sibling;
+
+  while ((node != tree->root) && k_rbtree_is_black(node)) {
+    if (node == parent->left) {
+      sibling = parent->right;
+
+      if (!k_rbtree_is_black(sibling)) {
+        sibling->color = K_RBTREE_BLACK;
+        parent->color  = K_RBTREE_RED;
+        k_rbtree_rotate_left(tree, parent);
+        sibling = parent->right;
+      }
+
+      if (k_rbtree_is_black(sibling->left) &&
+          k_rbtree_is_black(sibling->right)) {
+        sibling->color = K_RBTREE_RED;
+        node   = parent;
+        parent = node->parent;
+        continue;
+      }
+
+      if (k_rbtree_is_black(sibling->right)) {
+        sibling->left->color = K_RBTREE_BLACK;
+        sibling->color       = K_RBTREE_RED;
+        k_rbtree_rotate_right(tree, sibling);
+        sibling = parent->right;
+      }
+
+      sibling->color = parent->color;
+      parent->color  = K_RBTREE_BLACK;
+      sibling->right->color = K_RBTREE_BLACK;
+      k_rbtree_rotate_left(tree, parent);
+    } else {
+      sibling = parent->left;
+
+      if (!k_rbtree_is_black(sibling)) {
+        sibling->color = K_RBTREE_BLACK;
+        parent->color  = K_RBTREE_RED;
+        k_rbtree_rotate_right(tree, parent);
+        sibling = parent->left;
+      }
+
+      if (k_rbtree_is_black(sibling->left) &&
+          k_rbtree_is_black(sibling->right)) {
+        sibling->color = K_RBTREE_RED;
+        node   = parent;
+        parent = node->parent;
+        continue;
+      }
+
+      if (k_rbtree_is_black(sibling->left)) {
+        sibling->right->color = K_RBTREE_BLACK;
+        sibling->color        = K_RBTREE_RED;
+        k_rbtree_rotate_left(tree, sibling);
+        sibling = parent->left;
+      }
+
+      sibling->color = parent->color;
+      parent->color  = K_RBTREE_BLACK;
+      sibling->left->color = K_RBTREE_BLACK;
+      k_rbtree_rotate_right(tree, parent);
+    }
+
+    node = tree->root;
+    break;
+  }
+
+  if (node != NULL)
+    node->color = K_RBTREE_BLACK;
+}
+
+/**
+ * Remove a node from the tree.
+ *
+ * @param tree The tree.
+ * @param node The node to be removed.
+ */
+void
+k_rbtree_remove(struct KRBTree *tree, struct KRBNode *node)
+{
+  struct KRBNode *y, *x, *parent;
+  int color;
+
+  // The node that is actually unlinked has at most one child
+  if ((node->left == NULL) || (node->right == NULL)) {
+    y = node;
+  } else {
+    for (y = node->right; y->left != NULL; y = y->left)
+      ;
+  }
+
+  x      = (y->left != NULL) ? y->left : y->right;
+  parent = y->parent;
+  color  = y->color;
+
+  if (x != NULL)
+    x->parent = parent;
+  k_rbtree_replace(tree, y, x);
+
+  // Put the successor in place of the removed node
+  if (y != node) {
+    y->left   = node->left;
+    y->right  = node->right;
+    y->parent = node->parent;
+    y->color  = node->color;
+
+    if (y->left != NULL)
+      y->left->parent = y;
+    if (y->right != NULL)
+      y->right->parent = y;
+    k_rbtree_replace(tree, node, y);
+
+    if (parent == node)
+      parent = y;
+  }
+
+  if (color == K_RBTREE_BLACK)
+    k_rbtree_remove_fixup(tree, x, parent);
+
+  node->parent = node->left = node->right = NULL;
+}
+
+/**
+ * Get the leftmost (smallest) node in the tree.
+ */
+struct KRBNode *
+k_rbtree_first(struct KRBTree *tree)
+{
+  struct KRBNode *node = tree->root;
+
+  if (node != NULL)
+    while (node->left != NULL)
+      node = node->left;
+
+  return node;
+}
+
+/**
+ * Get the rightmost (largest) node in the tree.
+ */
+struct KRBNode *
+k_rbtree_last(struct KRBTree *tree)
+{
+  struct KRBNode *node = tree->root;
+
+  if (node != NULL)
+    while (node->right != NULL)
+      node = node->right;
+
+  return node;
+}
+
+/**
+ * Get the in-order successor of the node, or NULL if it is the last one.
+ */
+struct KRBNode *
+k_rbtree_next(struct KRBNode *node)
+{
+  if (node->right != NULL) {
+    for (node = node->right; node->left != NULL; node = node->left)
+      ;
+    return node;
+  }
+
+  while ((node->parent != NULL) && (node == node->parent->right))
+    node = node->parent;
+
+  return node->parent;
+}
+
+/**
+ * Get the in-order predecessor of the node, or NULL if it is the first one.
+ */
+struct KRBNode *
+k_rbtree_prev(struct KRBNode *node)
+{
+  if (node->left != NULL) {
+    for (node = node->left; node->right != NULL; node = node->right)
+      ;
+    return node;
+  }
+
+  while ((node->parent != NULL) && (node == node->parent->left))
+    node = node->parent;
+
+  return node->parent;
+}
@@ -0,0 +1,290 @@
+#include <kernel/assert.h>
+#include <errno.h>
+
+#include <kernel/rwmutex.h>
+#include <kernel/object_pool.h>
+#include <kernel/thread.h>
+#include <kernel/console.h>
+
+#include "core_private.h"
+
+static void k_rwmutex_ctor(void *, size_t);
+static void k_rwmutex_dtor(void *, size_t);
+static void k_rwmutex_init_common(struct KRWMutex *, const char *);
+static void k_rwmutex_fini_common(struct KRWMutex *);
+static void k_rwmutex_wakeup_locked(struct KRWMutex *);
+
+static struct KObjectPool *k_rwmutex_pool;
+
+void
+k_rwmutex_system_init(void)
+{
+  k_rwmutex_pool = k_object_pool_create("k_rwmutex",
+                                        sizeof(struct KRWMutex),
+                                        0,
+                                        k_rwmutex_ctor,
+                                        k_rwmutex_dtor);
+  if (k_rwmutex_pool == NULL)
+    panic("cannot create the rwmutex pool");
+}
+
+/**
+ * Initialize a statically allocated reader-writer mutex.
+ *
+ * @param mutex A pointer to the mutex to be initialized.
+ * @param name  The name of the mutex (for debugging purposes).
+ */
+void
+k_rwmutex_init(struct KRWMutex *mutex, const char *name)
+{
+  k_rwmutex_ctor(mutex, sizeof(struct KRWMutex));
+  k_rwmutex_init_common(mutex, name);
+  mutex->flags = K_RWMUTEX_STATIC;
+}
+
+struct KRWMutex *
+k_rwmutex_create(const char *name)
+{
+  struct KRWMutex *mutex;
+
+  if ((mutex = (struct KRWMutex *) k_object_pool_get(k_rwmutex_pool)) == NULL)
+    return NULL;
+
+  k_rwmutex_init_common(mutex, name);
+  mutex->flags = 0;
+
+  return mutex;
+}
+
+static void
+k_rwmutex_init_common(struct KRWMutex *mutex, const char *name)
+{
+  mutex->name            = name;
+  mutex->readers         = 0;
+  mutex->writers_waiting = 0;
+}
+
+void
+k_rwmutex_fini(struct KRWMutex *mutex)
+{
+  if ((mutex == NULL) || (mutex->type != K_RWMUTEX_TYPE))
+    panic("bad rwmutex pointer");
+  if (!(mutex->flags & K_RWMUTEX_STATIC))
+    panic("cannot fini non-static rwmutexes");
+
+  k_rwmutex_fini_common(mutex);
+}
+
+void
+k_rwmutex_destroy(struct KRWMutex *mutex)
+{
+  if ((mutex == NULL) || (mutex->type != K_RWMUTEX_TYPE))
+    panic("bad rwmutex pointer");
+  if (mutex->flags & K_RWMUTEX_STATIC)
+    panic("cannot destroy static rwmutexes");
+
+  k_rwmutex_fini_common(mutex);
+
+  k_object_pool_put(k_rwmutex_pool, mutex);
+}
+
+static void
+k_rwmutex_fini_common(struct KRWMutex *mutex)
+{
+  k_spinlock_acquire(&mutex->lock);
+
+  if ((mutex->writer != NULL) || (mutex->readers != 0))
+    panic("rwmutex locked");
+
+  _k_sched_wakeup_all(&mutex->read_queue, -EINVAL);
+  _k_sched_wakeup_all(&mutex->write_queue, -EINVAL);
+
+  k_spinlock_release(&mutex->lock);
+}
+
+/**
+ * Acquire the mutex for reading.
+ *
+ * @param mutex   A pointer to the mutex to be acquired.
+ * @param timeout The maximum number of ticks to wait or 0 to wait forever.
+ *
+ * @return 0 on success, a negative error code otherwise.
+ */
+int
+k_rwmutex_timed_read_lock(struct KRWMutex *mutex, unsigned long timeout)
+{
+  int r = 0;
+
+  if (k_thread_current() == NULL)
+    panic("current task is NULL");
+  if ((mutex == NULL) || (mutex->type != K_RWMUTEX_TYPE))
+    panic("bad rwmutex pointer");
+
+  k_spinlock_acquire(&mutex->lock);
+
+  if (mutex->writer == k_thread_current())
+    r = -EDEADLK;
+
+  // Waiting writers take precedence to avoid writer starvation
+  while ((r == 0) && ((mutex->writer != NULL) || (mutex->writers_waiting > 0))) {
+    r = _k_sched_sleep(&mutex->read_queue, THREAD_STATE_SLEEP, timeout,
+                       &mutex->lock);
+  }
+
+  if (r == 0)
+    mutex->readers++;
+
+  k_spinlock_release(&mutex->lock);
+
+  return r;
+}
+
+/**
+ * Release the mutex held for reading.
+ *
+ * @param mutex A pointer to the mutex to be released.
+ */
+int
+k_rwmutex_read_unlock(struct KRWMutex *mutex)
+{
+  if ((mutex == NULL) || (mutex->type != K_RWMUTEX_TYPE))
+    panic("bad rwmutex pointer");
+
+  k_spinlock_acquire(&mutex->lock);
+
+  if (mutex->readers <= 0)
+    panic("not held for reading");
+
+  if (--mutex->readers == 0)
+    k_rwmutex_wakeup_locked(mutex);
+
+  k_spinlock_release(&mutex->lock);
+
+  return 0;
+}
+
+/**
+ * Acquire the mutex for writing.
+ *
+ * @param mutex   A pointer to the mutex to be acquired.
+ * @param timeout The maximum number of ticks to wait or 0 to wait forever.
+ *
+ * @return 0 on success, a negative error code otherwise.
+ */
+int
+k_rwmutex_timed_write_lock(struct KRWMutex *mutex, unsigned long timeout)
+{
+  int r = 0;
+
+  if (k_thread_current() == NULL)
+    panic("current task is NULL");
+  if ((mutex == NULL) || (mutex->type != K_RWMUTEX_TYPE))
+    panic("bad rwmutex pointer");
+
+  k_spinlock_acquire(&mutex->lock);
+
+  if (mutex->writer == k_thread_current())
+    r = -EDEADLK;
+
+  if ((r == 0) && ((mutex->writer != NULL) || (mutex->readers > 0))) {
+    mutex->writers_waiting++;
+
+    while ((r == 0) && ((mutex->writer != NULL) || (mutex->readers > 0))) {
+      r = _k_sched_sleep(&mutex->write_queue, THREAD_STATE_SLEEP, timeout,
+                         &mutex->lock);
+    }
+
+    mutex->writers_waiting--;
+
+    // Readers might have been held back only because of us
+    if (r != 0)
+      k_rwmutex_wakeup_locked(mutex);
+  }
+
+  if (r == 0)
+    mutex->writer = k_thread_current();
+
+  k_spinlock_release(&mutex->lock);
+
+  return r;
+}
+
+/**
+ * Release the mutex held for writing.
+ *
+ * @param mutex A pointer to the mutex to be released.
+ */
+int
+k_rwmutex_write_unlock(struct KRWMutex *mutex)
+{
+  if (!k_rwmutex_write_holding(mutex))
+    panic("not holding");
+
+  k_spinlock_acquire(&mutex->lock);
+
+  mutex->writer = NULL;
+  k_rwmutex_wakeup_locked(mutex);
+
+  k_spinlock_release(&mutex->lock);
+
+  return 0;
+}
+
+// Wake up the next writer or, if there are no writers waiting, all readers
+static void
+k_rwmutex_wakeup_locked(struct KRWMutex *mutex)
+{
+  if ((mutex->writer != NULL) || (mutex->readers > 0))
+    return;
+
+  if (mutex->writers_waiting > 0)
+    _k_sched_wakeup_one(&mutex->write_queue, 0);
+  else
+    _k_sched_wakeup_all(&mutex->read_queue, 0);
+}
+
+/**
+ * Check whether the current task is holding the mutex for writing.
+ *
+ * @param mutex A pointer to the mutex.
+ * @return 1 if the current task is holding the mutex, 0 otherwise.
+ */
+int
+k_rwmutex_write_holding(struct KRWMutex *mutex)
+{
+  struct KThread *writer;
+
+  if ((mutex == NULL) || (mutex->type != K_RWMUTEX_TYPE))
+    panic("bad rwmutex pointer");
+
+  k_spinlock_acquire(&mutex->lock);
+  writer = mutex->writer;
+  k_spinlock_release(&mutex->lock);
+
+  return (writer != NULL) && (writer == k_thread_current());
+}
+
+static void
+k_rwmutex_ctor(void *p, size_t n)
+{
+  struct KRWMutex *mutex = (struct KRWMutex *) p;
+  (void) n;
+
+  k_spinlock_init(&mutex->lock, "k_rwmutex");
+  k_list_init(&mutex->read_queue);
+  k_list_init(&mutex->write_queue);
+  mutex->type   = K_RWMUTEX_TYPE;
+  mutex->writer = NULL;
+}
+
+static void
+k_rwmutex_dtor(void *p, size_t n)
+{
+  struct KRWMutex *mutex = (struct KRWMutex *) p;
+  (void) n;
+
+  assert(k_list_is_empty(&mutex->read_queue));
+  assert(k_list_is_empty(&mutex->write_queue));
+  assert(mutex->writer == NULL);
+  assert(mutex->readers == 0);
+}
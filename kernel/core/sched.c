@@ -4,6 +4,8 @@
 
 #include <kernel/console.h>
 #include <kernel/core/cpu.h>
+#include <kernel/core/hrtimer.h>
+#include <kernel/core/ipi.h>
 #include <kernel/core/irq.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
@@ -14,15 +16,50 @@
 #include <kernel/vm.h>
 #include <kernel/object_pool.h>
 #include <kernel/page.h>
+#include <kernel/time.h>
+#include <kernel/trace.h>
 
 #include "core_private.h"
 
 void k_arch_switch(struct Context **, struct Context *);
 
-KLIST_DECLARE(_k_sched_timeouts);
-KLIST_DECLARE(threads_to_destroy);
-static struct KListLink sched_queue[THREAD_MAX_PRIORITIES];
-struct KSpinLock _k_sched_spinlock = K_SPINLOCK_INITIALIZER("sched");
+/*
+ * Locking
+ *
+ * Each run queue has its own lock, protecting the queue itself, the idle flag
+ * and the current thread of its CPU, and the state, CPU and priority of the
+ * threads that are ready or running there. A CPU always holds the lock of its
+ * own queue while switching between a thread and the scheduler loop, so that
+ * no other CPU can pick up a thread before its context has been saved.
+ *
+ * The global scheduler lock protects the wait queues, the timeouts and the
+ * state of the sleeping threads. A thread goes to sleep holding both locks,
+ * and the scheduler loop releases the global one once the thread has been
+ * switched out. A queue lock may be acquired while holding the global lock,
+ * but not the other way round, and no CPU holds more than one queue lock.
+ *
+ * Thread priorities are always changed under the global lock, and also under
+ * the queue lock while the thread is ready or running.
+ */
+
+struct KTimeoutQueue _k_sched_timeouts;
+struct KSpinLock _k_sched_spinlock __cacheline_exclusive =
+  K_SPINLOCK_INITIALIZER("sched");
+
+// The CPUs that have entered the scheduler loop
+unsigned _k_sched_cpus;
+
+// How often the load averages are sampled, in ticks (5 seconds at 100 Hz)
+#define K_SCHED_LOAD_FREQ   500
+
+// Decay factors for 1, 5 and 15 minutes, 1 / exp(5 s / t) in fixed point
+#define K_SCHED_EXP_1       1884
+#define K_SCHED_EXP_5       2014
+#define K_SCHED_EXP_15      2037
+
+// Exponentially damped number of ready and running threads
+static unsigned long k_sched_loadavg[3];
+static unsigned long k_sched_load_ticks;
 
 /**
  * Initialize the scheduler data structures.
@@ -32,62 +69,364 @@ struct KSpinLock _k_sched_spinlock = K_SPINLOCK_INITIALIZER("sched");
 void
 k_sched_init(void)
 {
-  int i;
+  int i, j;
 
-  thread_cache = k_object_pool_create("thread_cache", sizeof(struct KThread), 0,
-                                   NULL, NULL);
+  thread_cache = k_object_pool_create("thread_cache", sizeof(struct KThread),
+                                      K_CACHE_LINE_SIZE, NULL, NULL);
   if (thread_cache == NULL)
     panic("cannot allocate thread cache");
 
-  for (i = 0; i < THREAD_MAX_PRIORITIES; i++)
-    k_list_init(&sched_queue[i]);
+  _k_timeout_queue_init(&_k_sched_timeouts);
+
+  for (i = 0; i < K_CPU_MAX; i++) {
+    struct KSchedQueue *queue = &_K_CPU(i)->sched_queue;
+
+    k_spinlock_init(&queue->lock, "sched_queue");
+    for (j = 0; j < THREAD_MAX_PRIORITIES; j++)
+      k_list_init(&queue->list[j]);
+    for (j = 0; j < K_SCHED_BITMAP_WORDS; j++)
+      queue->bitmap[j] = 0;
+    queue->length = 0;
+
+    k_list_init(&_K_CPU(i)->dead_threads);
+    _K_CPU(i)->kstacks_count = 0;
+
+    _K_CPU(i)->preempt_count = 0;
+    memset(&_K_CPU(i)->stats, 0, sizeof(_K_CPU(i)->stats));
+  }
+}
+
+#define K_SCHED_BITMAP_BIT(priority)  (1U << (31 - ((priority) % 32)))
+
+// Add the specified thread to the run queue of the given CPU
+static void
+k_sched_insert(struct KCpu *cpu, struct KThread *th)
+{
+  struct KSchedQueue *queue = &cpu->sched_queue;
+
+  debug_assert(k_spinlock_holding(&queue->lock));
+
+  th->state = THREAD_STATE_READY;
+  th->cpu   = cpu;
+
+  k_list_add_back(&queue->list[th->priority], &th->link);
+  queue->bitmap[th->priority / 32] |= K_SCHED_BITMAP_BIT(th->priority);
+  queue->length++;
+}
+
+// Wake up one idle processor, so it can steal a thread just added to the run
+// queue. The processor is no longer considered idle, so that the next thread
+// added before it wakes up goes to another one. The flag is claimed without
+// taking the queue lock of that processor.
+static void
+k_sched_kick_idle(struct KCpu *my_cpu, struct KThread *th)
+{
+  unsigned i;
+
+  for (i = 0; i < K_CPU_MAX; i++) {
+    struct KCpu *cpu = _K_CPU(i);
+
+    if (!(th->affinity & (1U << i)))
+      continue;
+
+    if ((cpu != my_cpu) && __sync_bool_compare_and_swap(&cpu->idle, 1, 0)) {
+      k_ipi_reschedule(i);
+      return;
+    }
+  }
+}
+
+// Choose the run queue for a thread: the current CPU if the thread is allowed
+// to run there, otherwise an idle or the least loaded one among the allowed CPUs.
+// The other queues are not locked, the lengths are only a hint.
+static struct KCpu *
+k_sched_select_cpu(struct KCpu *my_cpu, struct KThread *th)
+{
+  struct KCpu *best = NULL;
+  unsigned i;
+
+  if (th->affinity & (1U << my_cpu->id))
+    return my_cpu;
+
+  for (i = 0; i < K_CPU_MAX; i++) {
+    struct KCpu *cpu = _K_CPU(i);
+
+    if (!(th->affinity & _k_sched_cpus & (1U << i)))
+      continue;
+
+    if (cpu->idle)
+      return cpu;
+
+    if ((best == NULL) ||
+        (cpu->sched_queue.length < best->sched_queue.length))
+      best = cpu;
+  }
+
+  // k_thread_set_affinity() never leaves a thread without an online CPU, but
+  // the mask may be set before the secondary processors have started
+  return best != NULL ? best : my_cpu;
 }
 
-// Add the specified thread to the run queue with the corresponding priority
+// Let another CPU know that a thread has been added to its run queue: wake it
+// up if idle, or preempt its current thread if the new one is more important.
+// The caller must be holding the lock of that queue.
+static void
+k_sched_notify(struct KCpu *cpu, struct KThread *th)
+{
+  debug_assert(k_spinlock_holding(&cpu->sched_queue.lock));
+
+  if (cpu->idle) {
+    cpu->idle = 0;
+    k_ipi_reschedule(cpu->id);
+  } else if ((cpu->thread != NULL) &&
+             (_k_sched_priority_cmp(th, cpu->thread) > 0)) {
+    cpu->thread->flags |= THREAD_FLAG_RESCHEDULE;
+    k_ipi_reschedule(cpu->id);
+  }
+}
+
+// Add the specified thread to the run queue of the current CPU, or of another
+// one if the thread's affinity mask does not include the current CPU
 void
 _k_sched_enqueue(struct KThread *th)
 {
-  if (!k_spinlock_holding(&_k_sched_spinlock))
-    panic("scheduler not locked");
+  struct KCpu *my_cpu, *cpu;
 
-  th->state = THREAD_STATE_READY;
-  k_list_add_back(&sched_queue[th->priority], &th->link);
+  debug_assert(k_spinlock_holding(&_k_sched_spinlock));
+
+  my_cpu = _k_cpu();
+  cpu    = k_sched_select_cpu(my_cpu, th);
+
+  k_spinlock_acquire(&cpu->sched_queue.lock);
+
+  k_sched_insert(cpu, th);
+  if (cpu != my_cpu)
+    k_sched_notify(cpu, th);
+
+  k_spinlock_release(&cpu->sched_queue.lock);
+
+  // Wake up idle processors so they can steal the new thread
+  if ((cpu == my_cpu) && (th != my_cpu->thread))
+    k_sched_kick_idle(my_cpu, th);
+}
+
+// Remove a ready thread from the run queue it currently belongs to. The caller
+// sets the new state and CPU of the thread.
+static void
+k_sched_remove(struct KThread *th)
+{
+  struct KSchedQueue *queue;
+
+  assert(th->state == THREAD_STATE_READY);
+  assert(th->cpu != NULL);
+
+  queue = &th->cpu->sched_queue;
+
+  debug_assert(k_spinlock_holding(&queue->lock));
+
+  k_list_remove(&th->link);
+  if (k_list_is_empty(&queue->list[th->priority]))
+    queue->bitmap[th->priority / 32] &= ~K_SCHED_BITMAP_BIT(th->priority);
+  queue->length--;
+}
+
+// Get the highest priority in the run queue, or THREAD_MAX_PRIORITIES if the
+// queue is empty
+static int
+k_sched_top_priority(struct KSchedQueue *queue)
+{
+  int i;
+
+  for (i = 0; i < K_SCHED_BITMAP_WORDS; i++)
+    // Compiles into a single CLZ instruction on ARMv7
+    if (queue->bitmap[i] != 0)
+      return i * 32 + __builtin_clz(queue->bitmap[i]);
+
+  return THREAD_MAX_PRIORITIES;
+}
+
+// Retrieve the highest-priority thread from the run queue of the current CPU,
+// which the caller must be holding locked
+static struct KThread *
+k_sched_dequeue(struct KCpu *my_cpu)
+{
+  struct KSchedQueue *queue = &my_cpu->sched_queue;
+  struct KThread *thread;
+  int priority;
+
+  if (queue->length == 0)
+    return NULL;
+
+  if ((priority = k_sched_top_priority(queue)) == THREAD_MAX_PRIORITIES)
+    panic("run queue length mismatch");
+
+  thread = KLIST_CONTAINER(queue->list[priority].next, struct KThread, link);
+  k_sched_remove(thread);
+
+  thread->state = THREAD_STATE_RUNNING;
+
+  return thread;
 }
 
-// Retrieve the highest-priority thread from the run queue
+// Retrieve the highest-priority thread allowed to run on the CPU my_cpu from
+// the run queue of another CPU, which the caller must be holding locked
 static struct KThread *
-k_sched_dequeue(void)
+k_sched_dequeue_allowed(struct KCpu *cpu, struct KCpu *my_cpu)
 {
-  struct KListLink *link;
+  struct KSchedQueue *queue = &cpu->sched_queue;
   int i;
-  
-  if (!k_spinlock_holding(&_k_sched_spinlock))
-    panic("scheduler not locked");
 
-  for (i = 0; i < THREAD_MAX_PRIORITIES; i++) {
-    if (!k_list_is_empty(&sched_queue[i])) {
-      link = sched_queue[i].next;
-      k_list_remove(link);
+  for (i = 0; i < K_SCHED_BITMAP_WORDS; i++) {
+    uint32_t bits = queue->bitmap[i];
+
+    while (bits != 0) {
+      int bit = __builtin_clz(bits);
+      struct KListLink *link, *list = &queue->list[i * 32 + bit];
+
+      for (link = list->next; link != list; link = link->next) {
+        struct KThread *thread = KLIST_CONTAINER(link, struct KThread, link);
 
-      return KLIST_CONTAINER(link, struct KThread, link);
+        if (thread->affinity & (1U << my_cpu->id)) {
+          k_sched_remove(thread);
+          thread->state = THREAD_STATE_RUNNING;
+          thread->cpu   = my_cpu;
+          return thread;
+        }
+      }
+
+      bits &= ~(1U << (31 - bit));
     }
   }
 
   return NULL;
 }
 
+// Take a ready thread from the busiest run queue of another CPU, skipping the
+// threads that are not allowed to run on this one. Called without holding any
+// queue lock; the lengths are compared unlocked, then the chosen queue is
+// locked to take a thread from it.
+static struct KThread *
+k_sched_steal(struct KCpu *my_cpu)
+{
+  unsigned tried = 1U << my_cpu->id;
+
+  for (;;) {
+    struct KCpu *busiest = NULL;
+    struct KThread *thread;
+    unsigned i;
+
+    for (i = 0; i < K_CPU_MAX; i++) {
+      struct KCpu *cpu = _K_CPU(i);
+
+      if ((tried & (1U << i)) || (cpu->sched_queue.length == 0))
+        continue;
+
+      if ((busiest == NULL) ||
+          (cpu->sched_queue.length > busiest->sched_queue.length))
+        busiest = cpu;
+    }
+
+    if (busiest == NULL)
+      return NULL;
+
+    k_spinlock_acquire(&busiest->sched_queue.lock);
+    thread = k_sched_dequeue_allowed(busiest, my_cpu);
+    k_spinlock_release(&busiest->sched_queue.lock);
+
+    if (thread != NULL)
+      return thread;
+
+    tried |= 1U << busiest->id;
+  }
+}
+
+// Lock the run queue of the current CPU
+static struct KCpu *
+k_sched_lock_my_queue(void)
+{
+  struct KCpu *my_cpu;
+
+  // Do not let the current thread move to another CPU meanwhile
+  k_irq_state_save();
+  my_cpu = _k_cpu();
+  k_spinlock_acquire(&my_cpu->sched_queue.lock);
+  k_irq_state_restore();
+
+  return my_cpu;
+}
+
+// Lock the run queue of a thread that is ready or running, so that it cannot
+// be switched in or out meanwhile. Returns the CPU of the locked queue, or NULL
+// if the thread is in any other state.
+static struct KCpu *
+k_sched_lock_thread(struct KThread *th)
+{
+  struct KCpu *cpu;
+
+  debug_assert(k_spinlock_holding(&_k_sched_spinlock));
+
+  for (;;) {
+    if ((th->state != THREAD_STATE_READY) &&
+        (th->state != THREAD_STATE_RUNNING))
+      return NULL;
+
+    // The thread may be taken by another CPU before the lock is acquired
+    cpu = th->cpu;
+    k_spinlock_acquire(&cpu->sched_queue.lock);
+
+    if (((th->state == THREAD_STATE_READY) ||
+         (th->state == THREAD_STATE_RUNNING)) && (th->cpu == cpu))
+      return cpu;
+
+    k_spinlock_release(&cpu->sched_queue.lock);
+  }
+}
+
+// Move a thread preempted because it is not allowed to run on this CPU anymore
+// to another run queue. Only the scheduler loop can do that, once the thread
+// has been switched out.
 static void
-k_sched_switch(struct KThread *thread)
+k_sched_migrate(struct KCpu *my_cpu, struct KThread *thread)
 {
-  struct KCpu *my_cpu = _k_cpu();
+  // The global lock must be acquired first. Keep the interrupts disabled.
+  k_irq_state_save();
+  k_spinlock_release(&my_cpu->sched_queue.lock);
 
-  if (thread->process != NULL)
-    arch_vm_load(thread->process->vm->pgtab);
+  _k_sched_lock();
+  _k_sched_enqueue(thread);
+  _k_sched_unlock();
 
-  thread->state = THREAD_STATE_RUNNING;
+  k_spinlock_acquire(&my_cpu->sched_queue.lock);
+  k_irq_state_restore();
+}
+
+// Run a thread taken from a run queue until it switches back. Called and
+// returns holding the run queue lock of the current CPU: the thread releases
+// it after resuming, and acquires it again before switching back.
+static void
+k_sched_switch(struct KCpu *my_cpu, struct KThread *thread)
+{
+  struct KSchedQueue *queue = &my_cpu->sched_queue;
+  struct Process *process = thread->process;
+
+  // An exiting process may have already released its address space
+  if ((process != NULL) && (process->vm != NULL))
+    arch_vm_load(process->vm->pgtab, &process->vm->asid);
+  if (process != NULL)
+    arch_thread_load_tls(thread);
+  if (thread->perf_enabled)
+    arch_thread_perf_start(thread);
 
   thread->cpu = my_cpu;
   my_cpu->thread = thread;
+  my_cpu->stats.switches++;
+
+  // A thread stolen from another CPU was taken with this queue unlocked, and a
+  // more important one may have been added here in the meantime
+  if (k_sched_top_priority(queue) < thread->priority)
+    thread->flags |= THREAD_FLAG_RESCHEDULE;
+
+  trace(TRACE_SCHED_SWITCH, (uintptr_t) thread, thread->priority);
 
   if (thread->context->lr < VIRT_KERNEL_BASE)
     panic("bad PC");
@@ -97,46 +436,91 @@ k_sched_switch(struct KThread *thread)
   if ((intptr_t) thread->context - (intptr_t) thread->kstack < 64)
     panic("stack underflow %p %p", thread->context, thread->kstack);
 
-  my_cpu->thread = NULL;
-  thread->cpu = NULL;
+  if (thread->perf_enabled)
+    arch_thread_perf_stop(thread);
+  arch_thread_fpu_stop(thread);
 
-  if (thread->process != NULL)
+  if (process != NULL)
     arch_vm_load_kernel();
+
+  my_cpu->thread = NULL;
+
+  switch (thread->state) {
+  case THREAD_STATE_READY:
+    // Put back into this run queue by k_sched_yield_queue_locked()
+    break;
+  case THREAD_STATE_RUNNING:
+    k_sched_migrate(my_cpu, thread);
+    break;
+  default:
+    // Gone to sleep, suspended or exited holding the global lock. Once it is
+    // released, the thread may be woken up and resumed by another CPU.
+    thread->cpu = NULL;
+    _k_sched_unlock();
+    break;
+  }
 }
 
+/*
+ * Reclaim the threads that have exited on this CPU. Called from the scheduler
+ * loop, so none of them can still be running on its kernel stack. A few stacks
+ * are kept for k_thread_create(), the rest are returned to the page allocator.
+ * The list is only accessed by its own CPU with the interrupts disabled.
+ */
 static void
-k_sched_idle(void)
+k_sched_reap(struct KCpu *my_cpu)
 {
-  // Cleanup destroyed threads
-  while (!k_list_is_empty(&threads_to_destroy)) {
+  while (!k_list_is_empty(&my_cpu->dead_threads)) {
     struct KThread *thread;
-    struct Page *kstack_page;
-    
-    thread = KLIST_CONTAINER(threads_to_destroy.next, struct KThread, link);
+    struct Page *kstack_page = NULL;
+
+    thread = KLIST_CONTAINER(my_cpu->dead_threads.next, struct KThread, link);
 
     k_list_remove(&thread->link);
 
-    _k_sched_unlock();
+    if (my_cpu->kstacks_count < K_KSTACK_CACHE_SIZE)
+      my_cpu->kstacks[my_cpu->kstacks_count++] = thread->kstack;
+    else
+      kstack_page = kva2page(thread->kstack);
 
-    // Free the thread kernel stack
-    kstack_page = kva2page(thread->kstack);
-    kstack_page->ref_count--;
-    assert(kstack_page->ref_count == 0);
-    page_free_one(kstack_page);
+    k_spinlock_release(&my_cpu->sched_queue.lock);
+
+    if (kstack_page != NULL) {
+      kstack_page->ref_count--;
+      assert(kstack_page->ref_count == 0);
+      page_free_one(kstack_page);
+    }
 
     // Free the thread object
     k_object_pool_put(thread_cache, thread);
 
-    _k_sched_lock();
+    k_spinlock_acquire(&my_cpu->sched_queue.lock);
   }
+}
 
-  _k_sched_unlock();
+static void
+k_sched_idle(struct KCpu *my_cpu)
+{
+  // From now on, anyone adding a runnable thread sends us a wakeup IPI
+  my_cpu->idle = 1;
 
-  k_irq_enable();
-  
+  // Keep interrupts masked from before the queue is unlocked until WFI: a
+  // wakeup IPI that arrives in between stays pending and wakes the processor
+  // up, instead of being handled while it still looks busy. Stop the periodic
+  // tick while sleeping.
+  k_irq_state_save();
+  k_spinlock_release(&my_cpu->sched_queue.lock);
+
+  _k_tick_idle_enter();
   arch_thread_idle();
+  _k_tick_idle_exit();
 
-  _k_sched_lock();
+  // Handle the interrupt that woke us up
+  k_irq_state_restore();
+
+  k_spinlock_acquire(&my_cpu->sched_queue.lock);
+
+  my_cpu->idle = 0;
 }
 
 /**
@@ -145,59 +529,137 @@ k_sched_idle(void)
 void
 k_sched_start(void)
 {
+  struct KCpu *my_cpu = _k_cpu();
+
   _k_sched_lock();
+  _k_sched_cpus |= 1U << my_cpu->id;
+  _k_sched_unlock();
+
+  k_spinlock_acquire(&my_cpu->sched_queue.lock);
 
   for (;;) {
-    struct KThread *next = k_sched_dequeue();
+    struct KThread *next;
+
+    // Prefer threads from the local run queue. If there are none, try to grab
+    // work from other processors before going idle. No CPU holds two queue
+    // locks at a time, so let this one go while stealing.
+    if ((next = k_sched_dequeue(my_cpu)) == NULL) {
+      k_irq_state_save();
+      k_spinlock_release(&my_cpu->sched_queue.lock);
+
+      next = k_sched_steal(my_cpu);
+
+      k_spinlock_acquire(&my_cpu->sched_queue.lock);
+      k_irq_state_restore();
+    }
 
     if (next != NULL) {
-      assert(next->state == THREAD_STATE_READY);
-      k_sched_switch(next);
-    } else {
-      k_sched_idle();
+      assert(next->state == THREAD_STATE_RUNNING);
+      k_sched_switch(my_cpu, next);
+
+      // Do not wait until the CPU is idle, or a busy system would never get
+      // the memory back
+      if (!k_list_is_empty(&my_cpu->dead_threads))
+        k_sched_reap(my_cpu);
+    } else if (my_cpu->sched_queue.length == 0) {
+      // Nothing has been added while this queue was unlocked
+      k_sched_idle(my_cpu);
     }
   }
 }
 
-// Switch back from the current thread context back to the scheduler loop
-void
-_k_sched_yield_locked(void)
+// Switch from the current thread back to the scheduler loop, holding the run
+// queue lock of the current CPU. Returns holding the run queue lock of the CPU
+// the thread has been resumed on.
+static void
+k_sched_switch_out(struct KCpu *my_cpu)
 {
   int irq_flags;
 
-  if (!k_spinlock_holding(&_k_sched_spinlock))
-    panic("scheduler not locked");
+  debug_assert(k_spinlock_holding(&my_cpu->sched_queue.lock));
 
-  irq_flags = _k_cpu()->irq_flags;
-  k_arch_switch(&k_thread_current()->context, _k_cpu()->sched_context);
+  irq_flags = my_cpu->irq_flags;
+  k_arch_switch(&my_cpu->thread->context, my_cpu->sched_context);
   _k_cpu()->irq_flags = irq_flags;
 }
 
+// Put the current thread back into the run queue of its CPU, which the caller
+// must be holding locked, and switch to the scheduler loop
+static void
+k_sched_yield_queue_locked(struct KCpu *my_cpu)
+{
+  struct KThread *my_thread = my_cpu->thread;
+
+  // A thread that may no longer run here is left to k_sched_migrate(), it
+  // cannot be added to another queue before its context is saved
+  if (my_thread->affinity & (1U << my_cpu->id))
+    k_sched_insert(my_cpu, my_thread);
+
+  k_sched_switch_out(my_cpu);
+}
+
+/**
+ * Put the current thread back into the run queue and let the scheduler choose
+ * the next thread to run. Must be called holding no spinlocks.
+ */
+void
+_k_sched_yield(void)
+{
+  struct KCpu *my_cpu = k_sched_lock_my_queue();
+
+  k_sched_yield_queue_locked(my_cpu);
+
+  k_spinlock_release(&_k_cpu()->sched_queue.lock);
+}
+
+/**
+ * Switch from the current thread to the scheduler loop, after having put it to
+ * sleep holding the global scheduler lock. The lock is released by the loop
+ * once the thread has been switched out, and is held again on return.
+ */
+void
+_k_sched_yield_locked(void)
+{
+  struct KCpu *my_cpu = _k_cpu();
+
+  debug_assert(k_spinlock_holding(&_k_sched_spinlock));
+  debug_assert(my_cpu->thread->state != THREAD_STATE_RUNNING);
+  debug_assert(my_cpu->thread->state != THREAD_STATE_READY);
+
+  k_spinlock_acquire(&my_cpu->sched_queue.lock);
+  k_sched_switch_out(my_cpu);
+
+  // The global lock must be acquired first. Keep the interrupts disabled.
+  k_irq_state_save();
+  k_spinlock_release(&_k_cpu()->sched_queue.lock);
+  _k_sched_lock();
+  k_irq_state_restore();
+}
+
+/**
+ * Insert a thread into a wait queue sorted by priority, behind the threads of
+ * the same or higher priority. The search starts from the tail: the waiters
+ * mostly share the same priority, so the thread usually goes right there.
+ */
 void
 _k_sched_add(struct KListLink *queue, struct KThread *thread)
 {
   struct KListLink *l;
   struct KThread *other_thread;
 
-  for (l = queue->next; l != queue; l = l->next) {
+  for (l = queue->prev; l != queue; l = l->prev) {
     other_thread = KLIST_CONTAINER(l, struct KThread, link);
-    if (_k_sched_priority_cmp(thread, other_thread) > 0)
+    if (_k_sched_priority_cmp(thread, other_thread) <= 0)
       break;
   }
 
-  k_list_add_back(l, &thread->link);
+  k_list_add_front(l, &thread->link);
 }
 
-/**
- * Put the current thread into sleep.
- *
- * @param queue An optional queue to insert the thread into.
- * @param state The state indicating a kind of sleep.
- * @param lock  An optional spinlock to release while going to sleep.
- */
-int
-_k_sched_sleep(struct KListLink *queue, int state, unsigned long timeout,
-               struct KSpinLock *lock)
+// Sleep with either a tick-based or a high-resolution timeout, or neither
+static int
+k_sched_sleep(struct KListLink *queue, int state, unsigned long timeout,
+              uint64_t timeout_ns, struct KSpinLock *lock)
 {
   struct KCpu *my_cpu;
   struct KThread *my_thread;
@@ -207,19 +669,26 @@ _k_sched_sleep(struct KListLink *queue, int state, unsigned long timeout,
     k_spinlock_release(lock);
   }
 
-  if (!k_spinlock_holding(&_k_sched_spinlock))
-    panic("scheduler not locked");
+  debug_assert(k_spinlock_holding(&_k_sched_spinlock));
 
   my_cpu = _k_cpu();
   my_thread = my_cpu->thread;
 
   if (my_cpu->lock_count > 0)
     panic("called from an IRQ context");
+  if (my_cpu->preempt_count > 0)
+    panic("called with preemption disabled");
   if (my_cpu->thread == NULL)
     panic("called not by a thread");
 
+  trace(TRACE_SCHED_SLEEP, (uintptr_t) my_thread, timeout);
+
   if (timeout != 0) {
     _k_timeout_enqueue(&_k_sched_timeouts, &my_thread->timer, timeout);
+  } else if (timeout_ns != 0) {
+    my_thread->sleep_hrtimer = 1;
+    if (k_hrtimer_start(&my_thread->hrtimer, timeout_ns) != 0)
+      panic("cannot start hrtimer");
   }
 
   my_thread->state = state;
@@ -233,6 +702,9 @@ _k_sched_sleep(struct KListLink *queue, int state, unsigned long timeout,
     if (my_thread->timer.link.next != NULL) {
       _k_timeout_dequeue(&_k_sched_timeouts, &my_thread->timer);
     }
+  } else if (timeout_ns != 0) {
+    k_hrtimer_stop(&my_thread->hrtimer);
+    my_thread->sleep_hrtimer = 0;
   }
 
   // someone may call this function while holding _k_sched_spinlock?
@@ -244,22 +716,70 @@ _k_sched_sleep(struct KListLink *queue, int state, unsigned long timeout,
   return my_thread->sleep_result;
 }
 
+/**
+ * Put the current thread into sleep.
+ *
+ * @param queue   An optional queue to insert the thread into.
+ * @param state   The state indicating a kind of sleep.
+ * @param timeout The maximum number of ticks to sleep, or 0 to sleep until
+ *                woken up.
+ * @param lock    An optional spinlock to release while going to sleep.
+ */
+int
+_k_sched_sleep(struct KListLink *queue, int state, unsigned long timeout,
+               struct KSpinLock *lock)
+{
+  return k_sched_sleep(queue, state, timeout, 0, lock);
+}
+
+/**
+ * Put the current thread into sleep with a timeout in nanoseconds. The timeout
+ * runs on a high-resolution timer if there is one, otherwise it is rounded up
+ * to whole ticks.
+ *
+ * @param queue   An optional queue to insert the thread into.
+ * @param state   The state indicating a kind of sleep.
+ * @param timeout The maximum time to sleep, in nanoseconds, or 0 to sleep
+ *                until woken up.
+ * @param lock    An optional spinlock to release while going to sleep.
+ */
+int
+_k_sched_sleep_ns(struct KListLink *queue, int state, uint64_t timeout,
+                  struct KSpinLock *lock)
+{
+  if (!k_hrtimer_supported())
+    return k_sched_sleep(queue, state,
+                         (timeout + NS_PER_TICK - 1) / NS_PER_TICK, 0, lock);
+  return k_sched_sleep(queue, state, 0, timeout, lock);
+}
+
 void
 _k_sched_raise_priority(struct KThread *thread, int priority)
 {
-  assert(k_spinlock_holding(&_k_sched_spinlock));
+  struct KCpu *cpu;
+
+  debug_assert(k_spinlock_holding(&_k_sched_spinlock));
   assert(thread->priority > priority);
 
+  if ((cpu = k_sched_lock_thread(thread)) != NULL) {
+    if (thread->state == THREAD_STATE_READY) {
+      // Move into another list within the same run queue
+      k_sched_remove(thread);
+      thread->priority = priority;
+      k_sched_insert(cpu, thread);
+    } else {
+      thread->priority = priority;
+    }
+
+    k_spinlock_release(&cpu->sched_queue.lock);
+    return;
+  }
+
   thread->priority = priority;
 
   // TODO: change priorities for all owned mutexes
 
   switch (thread->state) {
-  case THREAD_STATE_READY:
-    // Move into another run queue
-    k_list_remove(&thread->link);
-    _k_sched_enqueue(thread);
-    break;
   case THREAD_STATE_MUTEX:
     // Re-insert to update priority
     k_list_remove(&thread->link);
@@ -275,8 +795,7 @@ _k_sched_raise_priority(struct KThread *thread, int priority)
 void
 _k_sched_resume(struct KThread *thread, int result)
 {
-  if (!k_spinlock_holding(&_k_sched_spinlock))
-    panic("sched not locked");
+  debug_assert(k_spinlock_holding(&_k_sched_spinlock));
 
   switch (thread->state) {
   case THREAD_STATE_SLEEP:
@@ -305,8 +824,7 @@ _k_sched_resume(struct KThread *thread, int result)
 void
 _k_sched_wakeup_all_locked(struct KListLink *queue, int result)
 {
-  if (!k_spinlock_holding(&_k_sched_spinlock))
-    panic("sched not locked");
+  debug_assert(k_spinlock_holding(&_k_sched_spinlock));
 
   while (!k_list_is_empty(queue)) {
     struct KListLink *link = queue->next;
@@ -316,6 +834,31 @@ _k_sched_wakeup_all_locked(struct KListLink *queue, int result)
   }
 }
 
+// Resume all shared waiters and the highest priority exclusive one
+// The caller must be holding the scheduler lock
+void
+_k_sched_wakeup_locked(struct KListLink *queue, int result)
+{
+  struct KListLink *link, *next;
+  int exclusive = 0;
+
+  debug_assert(k_spinlock_holding(&_k_sched_spinlock));
+
+  for (link = queue->next; link != queue; link = next) {
+    struct KThread *thread = KLIST_CONTAINER(link, struct KThread, link);
+
+    next = link->next;
+
+    if (thread->sleep_exclusive) {
+      if (exclusive)
+        continue;
+      exclusive = 1;
+    }
+
+    _k_sched_resume(thread, result);
+  }
+}
+
 // Resume and return the highest priority thread waiting on the given queue
 // The caller must be holding the scheduler lock
 struct KThread *
@@ -323,8 +866,7 @@ _k_sched_wakeup_one_locked(struct KListLink *queue, int result)
 {
   struct KThread *thread;
 
-  if (!k_spinlock_holding(&_k_sched_spinlock))
-    panic("sched not locked");
+  debug_assert(k_spinlock_holding(&_k_sched_spinlock));
 
   if (k_list_is_empty(queue))
     return NULL;
@@ -338,6 +880,103 @@ _k_sched_wakeup_one_locked(struct KListLink *queue, int result)
   return thread;
 }
 
+/**
+ * Wake up the highest-priority thread sleeping on one queue and put the
+ * current thread to sleep on another one in a single step.
+ *
+ * The woken thread goes to the head of the current CPU's run queue and no idle
+ * processor is kicked to steal it, so it normally runs here right after the
+ * caller blocks, with the caches still warm. Meant for synchronous message
+ * passing, where two threads take turns.
+ *
+ * @param wake_queue  The queue to wake up a thread from.
+ * @param sleep_queue The queue to put the current thread on.
+ * @param lock        An optional spinlock to release while going to sleep.
+ */
+int
+_k_sched_handoff(struct KListLink *wake_queue, struct KListLink *sleep_queue,
+                 struct KSpinLock *lock)
+{
+  struct KSchedQueue *queue;
+  struct KThread *thread;
+  int r;
+
+  _k_sched_lock();
+  if (lock != NULL)
+    k_spinlock_release(lock);
+
+  if (!k_list_is_empty(wake_queue)) {
+    thread = KLIST_CONTAINER(wake_queue->next, struct KThread, link);
+    assert(thread->state == THREAD_STATE_SLEEP);
+
+    k_list_remove(&thread->link);
+    thread->sleep_result = 0;
+
+    if (thread->affinity & (1U << _k_cpu()->id)) {
+      queue = &_k_cpu()->sched_queue;
+
+      k_spinlock_acquire(&queue->lock);
+
+      thread->state = THREAD_STATE_READY;
+      thread->cpu   = _k_cpu();
+
+      k_list_add_front(&queue->list[thread->priority], &thread->link);
+      queue->bitmap[thread->priority / 32] |=
+        K_SCHED_BITMAP_BIT(thread->priority);
+      queue->length++;
+
+      k_spinlock_release(&queue->lock);
+    } else {
+      // Not allowed to run here, so no point in keeping the caches warm
+      _k_sched_enqueue(thread);
+    }
+  }
+
+  r = _k_sched_sleep(sleep_queue, THREAD_STATE_SLEEP, 0, NULL);
+
+  _k_sched_unlock();
+  if (lock != NULL)
+    k_spinlock_acquire(lock);
+
+  return r;
+}
+
+/*
+ * Check whether the current thread can be switched out right away. It cannot
+ * while running an IRQ handler, with preemption disabled, or while holding any
+ * spinlock other than its run queue lock: the thread may resume on another
+ * CPU, and the other CPUs would spin on that lock in the meantime.
+ */
+int
+_k_sched_can_preempt(struct KCpu *my_cpu)
+{
+  return (my_cpu->lock_count == 0) &&
+         (my_cpu->preempt_count == 0) &&
+         (my_cpu->irq_save_count == 1);
+}
+
+/*
+ * Switch out the current thread if it has been asked to give up the CPU while
+ * it could not be preempted. Called once it has become preemptible again.
+ */
+void
+_k_sched_preempt(void)
+{
+  struct KCpu *my_cpu;
+  struct KThread *my_thread;
+
+  my_cpu    = k_sched_lock_my_queue();
+  my_thread = my_cpu->thread;
+
+  if ((my_thread != NULL) && (my_thread->flags & THREAD_FLAG_RESCHEDULE) &&
+      _k_sched_can_preempt(my_cpu)) {
+    my_thread->flags &= ~THREAD_FLAG_RESCHEDULE;
+    k_sched_yield_queue_locked(my_cpu);
+  }
+
+  k_spinlock_release(&_k_cpu()->sched_queue.lock);
+}
+
 // Check whether a reschedule is required (taking into account the priority
 // of a thread most recently added to the run queue)
 void
@@ -346,24 +985,20 @@ _k_sched_may_yield(struct KThread *thread)
   struct KCpu *my_cpu;
   struct KThread *my_thread;
 
-  if (!k_spinlock_holding(&_k_sched_spinlock))
-    panic("scheduler not locked");
-
-
+  debug_assert(k_spinlock_holding(&_k_sched_spinlock));
 
   my_cpu = _k_cpu();
   my_thread = my_cpu->thread;
 
-  if ((my_thread != NULL) && (_k_sched_priority_cmp(thread, my_thread) > 0)) {
-    if (my_cpu->lock_count > 0) {
-      // Cannot yield right now, delay until the last call to k_irq_handler_end()
-      // or thread_unlock().
-      my_thread->flags |= THREAD_FLAG_RESCHEDULE;
-    } else {
-      _k_sched_enqueue(my_thread);
-      _k_sched_yield_locked();
-    }
-  }
+  // A thread queued on another CPU has been dealt with by _k_sched_enqueue()
+  if (thread->cpu != my_cpu)
+    return;
+
+  // Not while holding the global lock, the caller expects its state to stay
+  // the same. Delay until the last call to k_irq_handler_end(),
+  // k_preempt_enable() or k_spinlock_release().
+  if ((my_thread != NULL) && (_k_sched_priority_cmp(thread, my_thread) > 0))
+    my_thread->flags |= THREAD_FLAG_RESCHEDULE;
 }
 
 void
@@ -381,26 +1016,280 @@ k_thread_timeout_callback(struct KTimeout *entry)
   }
 }
 
+// The thread may have been woken up before the timer expired and then started
+// another sleep, so only wake it up if this sleep has a pending hrtimer. Runs
+// in the timer interrupt.
+void
+_k_sched_hrtimer_callback(void *arg)
+{
+  struct KThread *thread = (struct KThread *) arg;
+
+  _k_sched_lock();
+
+  if ((thread->state == THREAD_STATE_SLEEP) && thread->sleep_hrtimer &&
+      !k_hrtimer_active(&thread->hrtimer))
+    _k_sched_resume(thread, -ETIMEDOUT);
+
+  _k_sched_unlock();
+}
+
+static unsigned long
+k_sched_load_decay(unsigned long load, unsigned long exp, unsigned long active)
+{
+  return (load * exp + active * ((1UL << K_LOAD_SHIFT) - exp)) >> K_LOAD_SHIFT;
+}
+
+// Sample the number of ready and running threads on each CPU. The run queues
+// are not locked, a slightly stale length makes no difference here.
+static void
+k_sched_update_load(void)
+{
+  unsigned long total = 0;
+  unsigned i;
+
+  for (i = 0; i < K_CPU_MAX; i++) {
+    struct KCpu *cpu = _K_CPU(i);
+    unsigned long active;
+
+    active  = cpu->sched_queue.length + (cpu->thread != NULL);
+    active <<= K_LOAD_SHIFT;
+    total  += active;
+
+    cpu->stats.runq_avg = k_sched_load_decay(cpu->stats.runq_avg,
+                                             K_SCHED_EXP_1, active);
+  }
+
+  k_sched_loadavg[0] = k_sched_load_decay(k_sched_loadavg[0], K_SCHED_EXP_1,
+                                          total);
+  k_sched_loadavg[1] = k_sched_load_decay(k_sched_loadavg[1], K_SCHED_EXP_5,
+                                          total);
+  k_sched_loadavg[2] = k_sched_load_decay(k_sched_loadavg[2], K_SCHED_EXP_15,
+                                          total);
+}
+
 void
 _k_sched_tick(void)
 {
   struct KThread *current_task = k_thread_current();
 
-  // Tell the scheduler that the current task has used up its time slice
-  // TODO: add support for other sheduling policies
-  if (current_task != NULL) {
+  // Tell the scheduler that the current task has used up its time slice.
+  // SCHED_FIFO threads keep running until they block, yield or are preempted
+  // by a higher-priority thread.
+  if ((current_task != NULL) && (current_task->policy != SCHED_FIFO)) {
     _k_sched_lock();
-    current_task->flags |= THREAD_FLAG_RESCHEDULE;
+    if (current_task->ticks_left <= 1) {
+      current_task->ticks_left = k_thread_timeslice(current_task);
+      current_task->flags |= THREAD_FLAG_RESCHEDULE;
+    } else {
+      current_task->ticks_left--;
+    }
     _k_sched_unlock();
   }
 
   if (k_cpu_id() == 0) {
     _k_sched_lock();
     _k_timeout_process_queue(&_k_sched_timeouts, k_thread_timeout_callback);
+    if (++k_sched_load_ticks >= K_SCHED_LOAD_FREQ) {
+      k_sched_load_ticks = 0;
+      k_sched_update_load();
+    }
     _k_sched_unlock();
   }
 }
 
+/**
+ * Get the usage counters of a processor.
+ *
+ * @param cpu   The processor ID
+ * @param stats Where to store the counters
+ *
+ * @retval 0       Success
+ * @retval -ENODEV The processor does not exist or has not started yet
+ */
+int
+k_sched_get_stats(unsigned cpu, struct KCpuStats *stats)
+{
+  int r = 0;
+
+  if (cpu >= K_CPU_MAX)
+    return -ENODEV;
+
+  _k_sched_lock();
+  if (_k_sched_cpus & (1U << cpu))
+    *stats = _K_CPU(cpu)->stats;
+  else
+    r = -ENODEV;
+  _k_sched_unlock();
+
+  return r;
+}
+
+/**
+ * Get the system load averages over 1, 5 and 15 minutes, as fixed-point
+ * numbers with K_LOAD_SHIFT fractional bits.
+ *
+ * @param avg Where to store the three averages
+ */
+void
+k_sched_get_loadavg(unsigned long *avg)
+{
+  _k_sched_lock();
+  avg[0] = k_sched_loadavg[0];
+  avg[1] = k_sched_loadavg[1];
+  avg[2] = k_sched_loadavg[2];
+  _k_sched_unlock();
+}
+
+unsigned long
+_k_sched_next_timeout(void)
+{
+  unsigned long ticks;
+
+  _k_sched_lock();
+  ticks = _k_timeout_next(&_k_sched_timeouts);
+  _k_sched_unlock();
+
+  return ticks;
+}
+
+/**
+ * Get the length of the time slice given to a thread.
+ *
+ * @param thread The thread
+ *
+ * @return The time slice in ticks, 0 if the thread runs until it blocks.
+ */
+unsigned
+k_thread_timeslice(struct KThread *thread)
+{
+  switch (thread->policy) {
+  case SCHED_FIFO:
+    return 0;
+  case SCHED_RR:
+    return THREAD_RR_TICKS;
+  default:
+    return 1;
+  }
+}
+
+/**
+ * Change the scheduling policy and the base priority of a thread. A priority
+ * inherited through a mutex the thread owns is kept until it is released.
+ *
+ * @param thread   The thread
+ * @param policy   SCHED_OTHER, SCHED_FIFO or SCHED_RR
+ * @param priority The new base priority
+ */
+void
+k_thread_set_sched(struct KThread *thread, int policy, int priority)
+{
+  struct KCpu *cpu;
+  int effective;
+
+  assert((priority >= 0) && (priority < THREAD_MAX_PRIORITIES));
+
+  _k_sched_lock();
+
+  thread->policy         = policy;
+  thread->ticks_left     = k_thread_timeslice(thread);
+  thread->saved_priority = priority;
+
+  effective = _k_mutex_get_highest_priority(thread);
+  if (effective > priority)
+    effective = priority;
+
+  if (effective < thread->priority) {
+    _k_sched_raise_priority(thread, effective);
+  } else if (effective > thread->priority) {
+    if ((cpu = k_sched_lock_thread(thread)) == NULL) {
+      // Sleeping threads are woken up in a slightly stale order
+      thread->priority = effective;
+    } else if (thread->state == THREAD_STATE_READY) {
+      k_sched_remove(thread);
+      thread->priority = effective;
+      k_sched_insert(cpu, thread);
+    } else {
+      // Let a thread that now has a higher priority run
+      thread->priority = effective;
+      thread->flags |= THREAD_FLAG_RESCHEDULE;
+    }
+
+    if (cpu != NULL)
+      k_spinlock_release(&cpu->sched_queue.lock);
+  }
+
+  _k_sched_unlock();
+}
+
+/**
+ * Restrict the set of CPUs a thread is allowed to run on. A ready thread is
+ * moved to an allowed run queue at once, a running one is preempted if its
+ * current CPU is not in the new set. The caller may use k_thread_yield() to
+ * move the current thread without waiting for the next reschedule.
+ *
+ * @param thread The thread
+ * @param mask   The allowed CPUs, one bit per CPU
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The mask includes none of the running CPUs
+ */
+int
+k_thread_set_affinity(struct KThread *thread, unsigned mask)
+{
+  struct KCpu *cpu;
+
+  _k_sched_lock();
+
+  if ((mask & _k_sched_cpus) == 0) {
+    _k_sched_unlock();
+    return -EINVAL;
+  }
+
+  thread->affinity = mask & K_CPU_MASK_ALL;
+
+  // Other states are checked the next time the thread becomes ready
+  if ((cpu = k_sched_lock_thread(thread)) != NULL) {
+    if (thread->affinity & (1U << cpu->id)) {
+      k_spinlock_release(&cpu->sched_queue.lock);
+    } else if (thread->state == THREAD_STATE_READY) {
+      k_sched_remove(thread);
+      k_spinlock_release(&cpu->sched_queue.lock);
+
+      _k_sched_enqueue(thread);
+    } else {
+      // Preempt the thread, so that it goes to an allowed run queue
+      thread->flags |= THREAD_FLAG_RESCHEDULE;
+      k_spinlock_release(&cpu->sched_queue.lock);
+
+      if (cpu != _k_cpu())
+        k_ipi_reschedule(cpu->id);
+    }
+  }
+
+  _k_sched_unlock();
+
+  return 0;
+}
+
+/**
+ * Get the set of CPUs a thread is allowed to run on.
+ *
+ * @param thread The thread
+ *
+ * @return The allowed CPUs, one bit per CPU.
+ */
+unsigned
+k_thread_get_affinity(struct KThread *thread)
+{
+  unsigned mask;
+
+  _k_sched_lock();
+  mask = thread->affinity;
+  _k_sched_unlock();
+
+  return mask;
+}
+
 void
 _k_sched_update_effective_priority(void)
 {
@@ -409,7 +1298,7 @@ _k_sched_update_effective_priority(void)
 
   new_priority = thread->saved_priority;
 
-  max_mutex_priority = _k_mutex_get_highest_priority(&thread->owned_mutexes);
+  max_mutex_priority = _k_mutex_get_highest_priority(thread);
   if (max_mutex_priority < new_priority)
     new_priority = max_mutex_priority;
 
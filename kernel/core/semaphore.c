@@ -12,6 +12,7 @@ static void k_semaphore_ctor(void *, size_t);
 static void k_semaphore_dtor(void *, size_t);
 static void k_semaphore_init_common(struct KSemaphore *, int);
 static void k_semaphore_fini_common(struct KSemaphore *);
+static int  k_semaphore_try_get_fast(struct KSemaphore *);
 static int  k_semaphore_try_get_locked(struct KSemaphore *);
 
 static struct KObjectPool *k_semaphore_pool;
@@ -96,6 +97,9 @@ k_semaphore_try_get(struct KSemaphore *semaphore)
   if ((semaphore == NULL) || (semaphore->type != K_SEMAPHORE_TYPE))
     panic("bad semaphore pointer");
 
+  if ((r = k_semaphore_try_get_fast(semaphore)) >= 0)
+    return r;
+
   k_spinlock_acquire(&semaphore->lock);
   r = k_semaphore_try_get_locked(semaphore);
   k_spinlock_release(&semaphore->lock);
@@ -111,47 +115,98 @@ k_semaphore_timed_get(struct KSemaphore *semaphore, unsigned long timeout)
   if ((semaphore == NULL) || (semaphore->type != K_SEMAPHORE_TYPE))
     panic("bad semaphore pointer");
 
-  k_spinlock_acquire(&semaphore->lock);
+  if ((r = k_semaphore_try_get_fast(semaphore)) >= 0)
+    return r;
 
-  while ((r = k_semaphore_try_get_locked(semaphore)) != 0) {
-    if (r != -EAGAIN)
-      break;
+  k_spinlock_acquire(&semaphore->lock);
 
+  // k_semaphore_put() hands the unit over to the woken task without touching
+  // the count, so a zero result means the semaphore has been acquired
+  if ((r = k_semaphore_try_get_locked(semaphore)) == -EAGAIN)
     r = _k_sched_sleep(&semaphore->queue,
                        THREAD_STATE_SLEEP,
                        timeout,
                        &semaphore->lock);
-    if (r < 0)
-      break;
-  }
 
   k_spinlock_release(&semaphore->lock);
 
   return r;
 }
 
+/*
+ * The count is only non-zero when the queue is empty, so a non-zero count can
+ * be decremented, and a count without K_SEMAPHORE_WAITERS incremented, without
+ * taking the lock. The bit is set under the lock by the tasks going to sleep,
+ * and cleared under the lock by k_semaphore_put() once the queue is empty.
+ */
+
+// Decrement a positive count, without the lock
 static int
-k_semaphore_try_get_locked(struct KSemaphore *semaphore)
+k_semaphore_try_get_fast(struct KSemaphore *semaphore)
 {
-  assert(semaphore->count >= 0);
+  unsigned long count = __atomic_load_n(&semaphore->count, __ATOMIC_RELAXED);
 
-  if (semaphore->count == 0)
-    return -EAGAIN;
+  do {
+    if ((count == 0) || (count & K_SEMAPHORE_WAITERS))
+      return -EAGAIN;
+  } while (!__atomic_compare_exchange_n(&semaphore->count, &count, count - 1,
+                                        0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED));
+
+  return count - 1;
+}
 
-  return --semaphore->count;
+// Decrement a positive count, or mark the semaphore as having waiters so that
+// the caller can go to sleep
+static int
+k_semaphore_try_get_locked(struct KSemaphore *semaphore)
+{
+  unsigned long count = __atomic_load_n(&semaphore->count, __ATOMIC_RELAXED);
+
+  for (;;) {
+    if (count & K_SEMAPHORE_WAITERS)
+      return -EAGAIN;
+
+    if (count == 0) {
+      // k_semaphore_put() may increment the count meanwhile
+      if (__atomic_compare_exchange_n(&semaphore->count, &count,
+                                      K_SEMAPHORE_WAITERS, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return -EAGAIN;
+    } else if (__atomic_compare_exchange_n(&semaphore->count, &count,
+                                           count - 1, 0, __ATOMIC_ACQUIRE,
+                                           __ATOMIC_RELAXED)) {
+      return count - 1;
+    }
+  }
 }
 
 int
 k_semaphore_put(struct KSemaphore *semaphore)
 {
+  unsigned long count;
+
   if ((semaphore == NULL) || (semaphore->type != K_SEMAPHORE_TYPE))
     panic("bad semaphore pointer");
+
+  // Nobody is waiting
+  count = __atomic_load_n(&semaphore->count, __ATOMIC_RELAXED);
+  while (!(count & K_SEMAPHORE_WAITERS)) {
+    if (__atomic_compare_exchange_n(&semaphore->count, &count, count + 1, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      return 0;
+  }
   
   k_spinlock_acquire(&semaphore->lock);
-  
-  semaphore->count++;
 
-  _k_sched_wakeup_one(&semaphore->queue, 0);
+  // Only the lock holders change the count once the bit is set. The waiters
+  // may have timed out, then the unit stays with the semaphore.
+  _k_sched_lock();
+  if (_k_sched_wakeup_one_locked(&semaphore->queue, 0) == NULL)
+    __atomic_store_n(&semaphore->count, 1, __ATOMIC_RELEASE);
+  else if (k_list_is_empty(&semaphore->queue))
+    __atomic_store_n(&semaphore->count, 0, __ATOMIC_RELEASE);
+  _k_sched_unlock();
 
   k_spinlock_release(&semaphore->lock);
 
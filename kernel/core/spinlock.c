@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stddef.h>
 #include <string.h>
 
@@ -11,6 +12,16 @@
 
 #include "core_private.h"
 
+#ifdef K_SPINLOCK_STATS
+// The list of statically initialized locks reported by the kernel monitor.
+// Locks initialized using k_spinlock_init() are usually embedded into dynamic
+// objects that may be freed, so they are never added to the list.
+static struct KSpinLock *k_spinlock_stats_list;
+
+static void k_spinlock_stats_acquired(struct KSpinLock *, unsigned long);
+static void k_spinlock_stats_released(struct KSpinLock *);
+#endif
+
 /**
  * Initialize a spinlock.
  * 
@@ -20,9 +31,28 @@
 void
 k_spinlock_init(struct KSpinLock *spin, const char *name)
 {
-  spin->locked = 0;
-  spin->cpu    = NULL;
-  spin->name   = name;
+  spin->tickets = 0;
+  spin->cpu     = NULL;
+  spin->name    = name;
+
+#ifdef K_SPINLOCK_STATS
+  memset(&spin->stats, 0, sizeof(spin->stats));
+  spin->stats.registered = -1;
+#endif
+}
+
+// Remember who has acquired the lock, to be printed if something goes wrong.
+// Only the full debug level walks the call stack, the others keep the caller.
+static inline void
+k_spinlock_save_owner(struct KSpinLock *spin, uintptr_t pc)
+{
+#if K_DEBUG_LEVEL >= K_DEBUG_FULL
+  (void) pc;
+  k_arch_spinlock_save_callstack(spin);
+#else
+  spin->pcs[0] = pc;
+  spin->pcs[1] = 0;
+#endif
 }
 
 /**
@@ -33,18 +63,59 @@ k_spinlock_init(struct KSpinLock *spin, const char *name)
 void
 k_spinlock_acquire(struct KSpinLock *spin)
 {
+  unsigned long spins;
+
+#if K_DEBUG_LEVEL >= K_DEBUG_ASSERT
   if (k_spinlock_holding(spin)) {
     k_arch_spinlock_print_callstack(spin);
     panic("CPU %x is already holding %s", k_cpu_id(), spin->name);
   }
+#endif
 
   // Disable interrupts to avoid deadlocks
   k_irq_state_save();
 
-  k_arch_spinlock_acquire(&spin->locked);
+  spins = k_arch_spinlock_acquire(&spin->tickets);
 
   spin->cpu = _k_cpu();
-  k_arch_spinlock_save_callstack(spin);
+  k_spinlock_save_owner(spin, (uintptr_t) __builtin_return_address(0));
+
+#ifdef K_SPINLOCK_STATS
+  k_spinlock_stats_acquired(spin, spins);
+#else
+  (void) spins;
+#endif
+}
+
+/**
+ * Try to acquire the spinlock without waiting.
+ *
+ * @param lock A pointer to the spinlock to be acquired.
+ *
+ * @retval 0       Success.
+ * @retval -EAGAIN The lock is held by this or another CPU.
+ */
+int
+k_spinlock_try_acquire(struct KSpinLock *spin)
+{
+  if (k_spinlock_holding(spin))
+    return -EAGAIN;
+
+  k_irq_state_save();
+
+  if (!k_arch_spinlock_try_acquire(&spin->tickets)) {
+    k_irq_state_restore();
+    return -EAGAIN;
+  }
+
+  spin->cpu = _k_cpu();
+  k_spinlock_save_owner(spin, (uintptr_t) __builtin_return_address(0));
+
+#ifdef K_SPINLOCK_STATS
+  k_spinlock_stats_acquired(spin, 0);
+#endif
+
+  return 0;
 }
 
 /**
@@ -55,16 +126,22 @@ k_spinlock_acquire(struct KSpinLock *spin)
 void
 k_spinlock_release(struct KSpinLock *spin)
 {
+#if K_DEBUG_LEVEL >= K_DEBUG_ASSERT
   if (!k_spinlock_holding(spin)) {
     k_arch_spinlock_print_callstack(spin);
     panic("CPU %d cannot release %s: held by %d\n",
           k_cpu_id(), spin->name, spin->cpu);
   }
+#endif
+
+#ifdef K_SPINLOCK_STATS
+  k_spinlock_stats_released(spin);
+#endif
 
   spin->cpu = NULL;
   spin->pcs[0] = 0;
 
-  k_arch_spinlock_release(&spin->locked);
+  k_arch_spinlock_release(&spin->tickets);
   
   k_irq_state_restore();
 }
@@ -77,12 +154,238 @@ k_spinlock_release(struct KSpinLock *spin)
  */
 int
 k_spinlock_holding(struct KSpinLock *spin)
+{
+  // The holder keeps interrupts disabled. If they are enabled, the current
+  // CPU cannot be holding the lock; otherwise, the thread cannot migrate
+  // while the owner is compared.
+  if (k_arch_irq_is_enabled())
+    return 0;
+
+  return (K_SPINLOCK_OWNER(spin->tickets) != K_SPINLOCK_NEXT(spin->tickets)) &&
+         (spin->cpu == _k_cpu());
+}
+
+/**
+ * Initialize a reader-writer spinlock.
+ * 
+ * @param rw   A pointer to the lock to be initialized.
+ * @param name The name of the lock (for debugging purposes).
+ */
+void
+k_rwspinlock_init(struct KRWSpinLock *rw, const char *name)
+{
+  rw->state  = 0;
+  rw->writer = NULL;
+  rw->name   = name;
+}
+
+/**
+ * Acquire the reader-writer spinlock for reading.
+ *
+ * @param rw A pointer to the lock to be acquired.
+ */
+void
+k_rwspinlock_read_acquire(struct KRWSpinLock *rw)
+{
+  uint32_t state;
+
+  if (k_rwspinlock_write_holding(rw))
+    panic("CPU %x is already holding %s for writing", k_cpu_id(), rw->name);
+
+  // Disable interrupts to avoid deadlocks
+  k_irq_state_save();
+
+  for (;;) {
+    state = rw->state;
+
+    // Do not let new readers in while there is a writer, or a writer waiting
+    if ((state & (K_RWSPINLOCK_WRITER | K_RWSPINLOCK_PENDING)) == 0) {
+      if (__sync_bool_compare_and_swap(&rw->state, state, state + 1))
+        break;
+    }
+  }
+
+  __sync_synchronize();
+}
+
+/**
+ * Try to acquire the reader-writer spinlock for reading without waiting.
+ *
+ * @param rw A pointer to the lock to be acquired.
+ *
+ * @retval 0       Success.
+ * @retval -EAGAIN The lock is held or awaited by a writer.
+ */
+int
+k_rwspinlock_try_read_acquire(struct KRWSpinLock *rw)
+{
+  uint32_t state;
+
+  k_irq_state_save();
+
+  state = rw->state;
+
+  if ((state & (K_RWSPINLOCK_WRITER | K_RWSPINLOCK_PENDING)) ||
+      !__sync_bool_compare_and_swap(&rw->state, state, state + 1)) {
+    k_irq_state_restore();
+    return -EAGAIN;
+  }
+
+  __sync_synchronize();
+
+  return 0;
+}
+
+/**
+ * Release the reader-writer spinlock held for reading.
+ *
+ * @param rw A pointer to the lock to be released.
+ */
+void
+k_rwspinlock_read_release(struct KRWSpinLock *rw)
+{
+  if ((rw->state & K_RWSPINLOCK_READERS) == 0)
+    panic("CPU %x cannot release %s: not held for reading",
+          k_cpu_id(), rw->name);
+
+  __sync_fetch_and_sub(&rw->state, 1);
+
+  k_irq_state_restore();
+}
+
+/**
+ * Acquire the reader-writer spinlock for writing.
+ *
+ * @param rw A pointer to the lock to be acquired.
+ */
+void
+k_rwspinlock_write_acquire(struct KRWSpinLock *rw)
+{
+  uint32_t state;
+
+  if (k_rwspinlock_write_holding(rw))
+    panic("CPU %x is already holding %s", k_cpu_id(), rw->name);
+
+  // Disable interrupts to avoid deadlocks
+  k_irq_state_save();
+
+  for (;;) {
+    state = rw->state;
+
+    if ((state & ~K_RWSPINLOCK_PENDING) == 0) {
+      // No readers and no writer, take the lock. This also clears the pending
+      // bit, another waiting writer will set it again.
+      if (__sync_bool_compare_and_swap(&rw->state, state, K_RWSPINLOCK_WRITER))
+        break;
+    } else if (!(state & K_RWSPINLOCK_PENDING)) {
+      // Hold back new readers
+      __sync_bool_compare_and_swap(&rw->state, state,
+                                   state | K_RWSPINLOCK_PENDING);
+    }
+  }
+
+  __sync_synchronize();
+
+  rw->writer = _k_cpu();
+}
+
+/**
+ * Release the reader-writer spinlock held for writing.
+ *
+ * @param rw A pointer to the lock to be released.
+ */
+void
+k_rwspinlock_write_release(struct KRWSpinLock *rw)
+{
+  if (!k_rwspinlock_write_holding(rw))
+    panic("CPU %x cannot release %s: held by %p\n",
+          k_cpu_id(), rw->name, rw->writer);
+
+  rw->writer = NULL;
+
+  // Keep the pending bit that might have been set by another writer
+  __sync_fetch_and_and(&rw->state, ~K_RWSPINLOCK_WRITER);
+
+  k_irq_state_restore();
+}
+
+/**
+ * Check whether the current CPU is holding the lock for writing.
+ *
+ * @param rw A pointer to the lock.
+ * @return 1 if the current CPU is holding the lock, 0 otherwise.
+ */
+int
+k_rwspinlock_write_holding(struct KRWSpinLock *rw)
 {
   int r;
 
   k_irq_state_save();
-  r = spin->locked && (spin->cpu == _k_cpu());
+  r = (rw->state & K_RWSPINLOCK_WRITER) && (rw->writer == _k_cpu());
   k_irq_state_restore();
 
   return r;
 }
+
+#ifdef K_SPINLOCK_STATS
+
+// Called with the lock held
+static void
+k_spinlock_stats_acquired(struct KSpinLock *spin, unsigned long spins)
+{
+  struct KSpinLockStats *stats = &spin->stats;
+
+  stats->acquisitions++;
+  if (spins > 0) {
+    stats->contentions++;
+    stats->spins += spins;
+  }
+
+  // The lock is held, so no other CPU can register it at the same time
+  if (stats->registered == 0) {
+    stats->registered = 1;
+
+    do {
+      stats->next = k_spinlock_stats_list;
+    } while (!__sync_bool_compare_and_swap(&k_spinlock_stats_list,
+                                           stats->next, spin));
+  }
+
+  stats->acquired_at = k_cpu_cycles();
+}
+
+// Called with the lock held
+static void
+k_spinlock_stats_released(struct KSpinLock *spin)
+{
+  uint32_t hold = k_cpu_cycles() - spin->stats.acquired_at;
+
+  if (hold > spin->stats.max_hold)
+    spin->stats.max_hold = hold;
+}
+
+#endif  // K_SPINLOCK_STATS
+
+/**
+ * Display contention statistics for all registered spinlocks.
+ */
+void
+k_spinlock_print_stats(void)
+{
+#ifdef K_SPINLOCK_STATS
+  struct KSpinLock *spin;
+
+  cprintf("%-20s %10s %10s %10s %10s\n",
+          "name", "acquired", "contended", "spins", "max hold");
+
+  for (spin = k_spinlock_stats_list; spin != NULL; spin = spin->stats.next)
+    cprintf("%-20s %10lu %10lu %10lu %10u\n",
+            spin->name,
+            spin->stats.acquisitions,
+            spin->stats.contentions,
+            spin->stats.spins,
+            spin->stats.max_hold);
+#else
+  cprintf("Spinlock statistics are disabled, rebuild with SPINLOCK_STATS=1\n");
+#endif
+}
@@ -4,6 +4,7 @@
 
 #include <kernel/console.h>
 #include <kernel/core/cpu.h>
+#include <kernel/core/ipi.h>
 #include <kernel/core/irq.h>
 #include <kernel/thread.h>
 #include <kernel/spinlock.h>
@@ -53,12 +54,7 @@ k_thread_yield(void)
   if (current == NULL)
     panic("no current thread");
 
-  _k_sched_lock();
-
-  _k_sched_enqueue(current);
-  _k_sched_yield_locked();
-
-  _k_sched_unlock();
+  _k_sched_yield();
 }
 
 // Execution of each thread begins here.
@@ -67,8 +63,8 @@ k_thread_run(void)
 {
   struct KThread *my_thread = k_thread_current();
 
-  // Still holding the scheduler lock (acquired in k_sched_start)
-  _k_sched_unlock();
+  // Still holding the run queue lock of this CPU (acquired in k_sched_start)
+  k_spinlock_release(&_k_cpu()->sched_queue.lock);
 
   k_irq_enable();
 
@@ -82,13 +78,43 @@ k_thread_interrupt(struct KThread *thread)
 {
   _k_sched_lock();
 
-  // TODO: if thread is running, send an SGI
+  // A thread running on another processor would only notice the pending
+  // signal after that processor's next tick; interrupt it right away
+  if ((thread->state == THREAD_STATE_RUNNING) && (thread->cpu != _k_cpu()))
+    k_ipi_reschedule(thread->cpu->id);
 
   _k_sched_resume(thread, -EINTR);
 
   _k_sched_unlock();
 }
 
+// Reuse the stack of a thread that has exited on this CPU, or allocate a new one
+static void *
+k_thread_stack_alloc(void)
+{
+  struct Page *stack_page;
+  struct KCpu *my_cpu;
+  void *stack = NULL;
+
+  k_irq_state_save();
+
+  my_cpu = _k_cpu();
+  if (my_cpu->kstacks_count > 0)
+    stack = my_cpu->kstacks[--my_cpu->kstacks_count];
+
+  k_irq_state_restore();
+
+  if (stack != NULL)
+    return stack;
+
+  if ((stack_page = page_alloc_one(0, PAGE_TAG_KSTACK)) == NULL)
+    return NULL;
+
+  stack_page->ref_count++;
+
+  return page2kva(stack_page);
+}
+
 /**
  * Initialize the kernel thread. After successful initialization, the thread
  * is placed into suspended state and must be explicitly made runnable by a call
@@ -106,38 +132,46 @@ struct KThread *
 k_thread_create(struct Process *process, void (*entry)(void *), void *arg,
                 int priority)
 {
-  struct Page *stack_page;
   struct KThread *thread;
   uint8_t *stack;
 
   if ((thread = (struct KThread *) k_object_pool_get(thread_cache)) == NULL)
     return NULL;
 
-  if ((stack_page = page_alloc_one(0, PAGE_TAG_KSTACK)) == NULL) {
+  if ((stack = k_thread_stack_alloc()) == NULL) {
     k_object_pool_put(thread_cache, thread);
     return NULL;
   }
 
-  stack = (uint8_t *) page2kva(stack_page);
-  stack_page->ref_count++;
-
   k_list_init(&thread->owned_mutexes);
+  memset(thread->inherited_count, 0, sizeof(thread->inherited_count));
+  memset(thread->inherited_bitmap, 0, sizeof(thread->inherited_bitmap));
   k_list_null(&thread->link);
+  k_list_null(&thread->process_link);
   thread->sleep_on_mutex     = NULL;
 
   thread->flags          = 0;
+  thread->policy         = SCHED_OTHER;
+  thread->ticks_left     = 1;
+  thread->affinity       = K_CPU_MASK_ALL;
   thread->saved_priority = priority;
   thread->priority       = priority;
   thread->state          = THREAD_STATE_SUSPENDED;
   thread->entry          = entry;
   thread->arg            = arg;
   thread->err            = 0;
+  thread->sleep_exclusive = 0;
   thread->process        = process;
+  thread->tls            = 0;
+  thread->journal_handles = 0;
+  thread->perf_enabled   = 0;
   
   thread->kstack         = stack;
   thread->tf             = NULL;
 
   _k_timeout_init(&thread->timer);
+  k_hrtimer_init(&thread->hrtimer, _k_sched_hrtimer_callback, thread);
+  thread->sleep_hrtimer = 0;
 
   arch_thread_init_stack(thread, k_thread_run);
 
@@ -151,18 +185,19 @@ void
 k_thread_exit(void)
 {
   struct KThread *thread = k_thread_current();
-  extern struct KListLink threads_to_destroy;
 
   if (thread == NULL)
     panic("no current thread");
 
   _k_timeout_fini(&thread->timer);
+  k_hrtimer_fini(&thread->hrtimer);
 
   _k_sched_lock();
 
   thread->state = THREAD_STATE_DESTROYED;
 
-  k_list_add_back(&threads_to_destroy, &thread->link);
+  // The scheduler loop of this CPU frees the thread after switching away
+  k_list_add_back(&_k_cpu()->dead_threads, &thread->link);
 
   _k_sched_yield_locked();
 
@@ -7,15 +7,20 @@
  */
 
 #include <kernel/core/cpu.h>
+#include <kernel/core/ipi.h>
+#include <kernel/core/seqcount.h>
 #include <kernel/core/timer.h>
+#include <kernel/interrupt.h>
 #include <kernel/core/tick.h>
 #include <kernel/spinlock.h>
 #include <kernel/thread.h>
 
 #include "core_private.h"
 
+// The lock serializes writers only, readers use the sequence counter
 static struct KSpinLock k_tick_lock = K_SPINLOCK_INITIALIZER("k_tick");
-static unsigned long long k_tick_counter = 0;
+static struct KSeqCount k_tick_seq = K_SEQCOUNT_INITIALIZER;
+static volatile unsigned long long k_tick_counter = 0;
 
 /**
  * Notify the kernel that a tick occured.
@@ -29,22 +34,53 @@ k_tick(void)
   // TODO: all timeouts are processed by CPU #0, is it ok?
   if (k_cpu_id() == 0) {
     k_spinlock_acquire(&k_tick_lock);
+    k_seqcount_write_begin(&k_tick_seq);
     k_tick_counter++;
+    k_seqcount_write_end(&k_tick_seq);
     k_spinlock_release(&k_tick_lock);
   }
 }
 
+/**
+ * Charge the current tick to the state the processor was interrupted in.
+ * Called by the timer interrupt handler on each CPU, before k_tick().
+ *
+ * @param user Whether the processor was running user code
+ */
+void
+k_tick_account(int user)
+{
+  struct KCpu *my_cpu = _k_cpu();
+  struct KThread *my_thread = my_cpu->thread;
+
+  // The timer interrupt itself accounts for one level of lock_count
+  if (user)
+    my_cpu->stats.user++;
+  else if (my_cpu->lock_count > 1)
+    my_cpu->stats.irq++;
+  else if (my_thread == NULL)
+    my_cpu->stats.idle++;
+  else if (my_thread->flags & THREAD_FLAG_INTERRUPT)
+    my_cpu->stats.irq++;
+  else
+    my_cpu->stats.system++;
+}
+
 /**
  * Get the current value of the tick counter.
+ * 
+ * Can be called from any CPU without taking locks or disabling interrupts.
  */
 unsigned long long
 k_tick_get(void)
 {
   unsigned long long counter;
+  unsigned seq;
 
-  k_spinlock_acquire(&k_tick_lock);
-  counter = k_tick_counter;
-  k_spinlock_release(&k_tick_lock);
+  do {
+    seq = k_seqcount_read_begin(&k_tick_seq);
+    counter = k_tick_counter;
+  } while (k_seqcount_read_retry(&k_tick_seq, seq));
 
   return counter;
 }
@@ -54,6 +90,152 @@ k_tick_set(unsigned long long counter)
 {
   // TODO: update timeouts
   k_spinlock_acquire(&k_tick_lock);
+  k_seqcount_write_begin(&k_tick_seq);
   k_tick_counter = counter;
+  k_seqcount_write_end(&k_tick_seq);
   k_spinlock_release(&k_tick_lock);
 }
+
+/*
+ * ----------------------------------------------------------------------------
+ * Tickless idle
+ * ----------------------------------------------------------------------------
+ * 
+ * When a processor has nothing to run, there is no reason to interrupt it at
+ * the tick rate. Before going idle, the periodic tick is replaced with a
+ * one-shot timer that fires when the earliest pending timeout expires. CPU #0
+ * processes all timeouts, so the other processors can sleep until they are
+ * explicitly woken up with an IPI.
+ *
+ * CPU #0 also advances the tick counter that everyone else reads, so it keeps
+ * its periodic tick as long as any other processor is still ticking. Once all
+ * of them are idle, it stops as well. A processor that wakes up while CPU #0
+ * is tickless kicks it and waits until the counter has caught up, so nothing
+ * ever runs with a stale tick count.
+ * 
+ * The ticks missed while sleeping are accounted for after the wakeup.
+ */
+
+// The maximum number of ticks to stay idle, in case an IPI wakeup is lost
+#define K_TICK_IDLE_MAX   100
+
+// Check whether all running processors other than CPU #0 have stopped their
+// periodic tick
+static int
+k_tick_others_tickless(void)
+{
+  unsigned cpus = _k_sched_cpus;
+  unsigned i;
+
+  for (i = 1; i < K_CPU_MAX; i++)
+    if ((cpus & (1U << i)) && !_K_CPU(i)->tickless)
+      return 0;
+
+  return 1;
+}
+
+/**
+ * Stop the periodic tick on the current processor before going idle.
+ * 
+ * Must be called with interrupts disabled.
+ */
+void
+_k_tick_idle_enter(void)
+{
+  struct KCpu *my_cpu = _k_cpu();
+  unsigned long ticks = K_TICK_IDLE_MAX;
+
+  // Mark the CPU first, so that anyone adding a new timeout or a runnable
+  // thread from now on sends us a wakeup IPI
+  my_cpu->tickless = 1;
+
+  if (k_cpu_id() == 0) {
+    unsigned long sched_ticks, timer_ticks;
+
+    // Pairs with the barrier in _k_tick_idle_exit(): either we see another
+    // processor still ticking, or it sees us tickless once it wakes up
+    __sync_synchronize();
+
+    if (!k_tick_others_tickless()) {
+      my_cpu->tickless = 0;
+      return;
+    }
+
+    sched_ticks = _k_sched_next_timeout();
+    timer_ticks = _k_timer_next_timeout();
+
+    if ((sched_ticks != 0) && (sched_ticks < ticks))
+      ticks = sched_ticks;
+    if ((timer_ticks != 0) && (timer_ticks < ticks))
+      ticks = timer_ticks;
+  }
+
+  // Something is going to expire on the next tick anyway, or the timer doesn't
+  // support one-shot mode
+  if ((ticks <= 1) || (k_arch_tick_stop(ticks) != 0)) {
+    my_cpu->tickless = 0;
+    return;
+  }
+
+  my_cpu->idle_ticks = ticks;
+}
+
+/**
+ * Restart the periodic tick on the current processor after leaving the idle
+ * state.
+ * 
+ * Must be called with interrupts disabled.
+ */
+void
+_k_tick_idle_exit(void)
+{
+  struct KCpu *my_cpu = _k_cpu();
+  unsigned long elapsed;
+
+  if (!my_cpu->tickless)
+    return;
+
+  elapsed = k_arch_tick_restart();
+
+  // If the one-shot timer has expired, the last tick will be delivered by the
+  // pending timer interrupt
+  if (elapsed >= my_cpu->idle_ticks)
+    elapsed = my_cpu->idle_ticks - 1;
+
+  my_cpu->stats.idle += elapsed;
+
+  // Only CPU #0 maintains the tick counter and processes timeouts. The current
+  // thread is NULL, so there is nothing else to account for. It is marked
+  // ticking again only once the counter is up to date.
+  if (k_cpu_id() == 0) {
+    while (elapsed-- > 0)
+      k_tick();
+
+    my_cpu->tickless = 0;
+    return;
+  }
+
+  my_cpu->tickless = 0;
+
+  // If CPU #0 has stopped its tick because everyone was idle, the counter has
+  // not moved since. Wake it up and wait for it to catch up.
+  __sync_synchronize();
+
+  if (_K_CPU(0)->tickless) {
+    k_ipi_reschedule(0);
+    while (_K_CPU(0)->tickless)
+      ;
+  }
+}
+
+/**
+ * Wake up a processor that has stopped its periodic tick.
+ * 
+ * @param cpu The processor ID.
+ */
+void
+_k_tick_idle_kick(unsigned cpu)
+{
+  if (_K_CPU(cpu)->tickless && (cpu != k_cpu_id()))
+    k_ipi_reschedule(cpu);
+}
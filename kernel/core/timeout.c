@@ -1,10 +1,42 @@
+/**
+ * @file
+ * Timeout queues
+ *
+ * Each timeout queue is a hierarchical timer wheel. The root level contains
+ * one list per tick for entries that expire within the next
+ * K_TIMEOUT_ROOT_SIZE ticks. Each of the upper levels covers
+ * K_TIMEOUT_LEVEL_SIZE times longer intervals. When the root level wraps
+ * around, the entries from the next slot of the upper level are redistributed
+ * ("cascaded") into the lower levels.
+ *
+ * Insertion and removal take constant time, processing a tick takes constant
+ * amortized time regardless of the number of pending timeouts.
+ */
+
 #include "core_private.h"
 
+static void k_timeout_insert(struct KTimeoutQueue *, struct KTimeout *);
+
+void
+_k_timeout_queue_init(struct KTimeoutQueue *queue)
+{
+  int i, j;
+
+  for (i = 0; i < K_TIMEOUT_ROOT_SIZE; i++)
+    k_list_init(&queue->root[i]);
+
+  for (i = 0; i < K_TIMEOUT_LEVELS; i++)
+    for (j = 0; j < K_TIMEOUT_LEVEL_SIZE; j++)
+      k_list_init(&queue->levels[i][j]);
+
+  queue->now = 0;
+}
+
 void
 _k_timeout_init(struct KTimeout *timeout)
 {
   k_list_null(&timeout->link);
-  timeout->remain = 0;
+  timeout->expires = 0;
 }
 
 void
@@ -13,73 +45,155 @@ _k_timeout_fini(struct KTimeout *timeout)
   k_list_remove(&timeout->link);
 }
 
+// The index of the slot in the given upper level
+static inline unsigned
+k_timeout_level_index(unsigned long ticks, int level)
+{
+  return (ticks >> (K_TIMEOUT_ROOT_BITS + level * K_TIMEOUT_LEVEL_BITS)) &
+         (K_TIMEOUT_LEVEL_SIZE - 1);
+}
+
+// Put the entry into the slot that corresponds to its expiration time
+static void
+k_timeout_insert(struct KTimeoutQueue *queue, struct KTimeout *timeout)
+{
+  unsigned long expires = timeout->expires;
+  unsigned long idx = expires - queue->now;
+  struct KListLink *slot;
+  int level;
+
+  if (idx < K_TIMEOUT_ROOT_SIZE) {
+    slot = &queue->root[expires & (K_TIMEOUT_ROOT_SIZE - 1)];
+  } else {
+    for (level = 0; level < K_TIMEOUT_LEVELS - 1; level++) {
+      unsigned shift = K_TIMEOUT_ROOT_BITS + (level + 1) * K_TIMEOUT_LEVEL_BITS;
+
+      if (idx < (1UL << shift))
+        break;
+    }
+
+    slot = &queue->levels[level][k_timeout_level_index(expires, level)];
+  }
+
+  k_list_add_back(slot, &timeout->link);
+}
+
 void
-_k_timeout_enqueue(struct KListLink *queue,
+_k_timeout_enqueue(struct KTimeoutQueue *queue,
                    struct KTimeout *timeout,
                    unsigned long delay)
 {
-  struct KListLink *next_link;
-
   if (delay == 0)
     panic("delay must be greater than 0");
 
-  timeout->remain = delay;
+  // Expires when processing the delay-th tick from now
+  timeout->expires = queue->now + delay - 1;
 
-  KLIST_FOREACH(queue, next_link) {
-    struct KTimeout *next = KLIST_CONTAINER(next_link, struct KTimeout, link);
+  k_timeout_insert(queue, timeout);
 
-    if (next->remain > timeout->remain) {
-      next->remain -= timeout->remain;
-      break;
-    }
-
-    timeout->remain -= next->remain;
-  }
-
-  k_list_add_back(next_link, &timeout->link);
+  // Timeouts are processed by CPU #0. If it has stopped its tick, it has to
+  // recalculate the time until the next expiry.
+  _k_tick_idle_kick(0);
 }
 
 void
-_k_timeout_dequeue(struct KListLink *queue, struct KTimeout *timeout)
+_k_timeout_dequeue(struct KTimeoutQueue *queue, struct KTimeout *timeout)
 {
-  struct KListLink *next_link = timeout->link.next;
+  (void) queue;
 
-  assert(next_link != NULL);
+  assert(timeout->link.next != NULL);
 
   k_list_remove(&timeout->link);
+}
 
-  if (next_link != queue) {
-    struct KTimeout *next = KLIST_CONTAINER(next_link, struct KTimeout, link);
-    next->remain += timeout->remain;
+// Redistribute entries from the given upper-level slot into lower levels
+static unsigned
+k_timeout_cascade(struct KTimeoutQueue *queue, int level)
+{
+  unsigned idx = k_timeout_level_index(queue->now, level);
+  struct KListLink *slot = &queue->levels[level][idx];
+
+  while (!k_list_is_empty(slot)) {
+    struct KListLink *link = slot->next;
+
+    k_list_remove(link);
+    k_timeout_insert(queue, KLIST_CONTAINER(link, struct KTimeout, link));
   }
+
+  return idx;
 }
 
 void
-_k_timeout_process_queue(struct KListLink *queue,
+_k_timeout_process_queue(struct KTimeoutQueue *queue,
                          void (*callback)(struct KTimeout *))
 {
-  struct KListLink *link;
-  struct KTimeout *timeout;
+  unsigned idx = queue->now & (K_TIMEOUT_ROOT_SIZE - 1);
+  struct KListLink *slot = &queue->root[idx];
+  struct KListLink expired;
+  int level;
+
+  // The root level has wrapped around, refill it from the upper levels
+  if (idx == 0) {
+    for (level = 0; level < K_TIMEOUT_LEVELS; level++)
+      if (k_timeout_cascade(queue, level) != 0)
+        break;
+  }
+
+  queue->now++;
 
-  if (k_list_is_empty(queue))
+  // Detach the expired entries, since the callbacks may insert new entries into
+  // the same slot
+  if (k_list_is_empty(slot))
     return;
 
-  link = queue->next;
-  timeout = KLIST_CONTAINER(link, struct KTimeout, link);
+  expired.next = slot->next;
+  expired.prev = slot->prev;
+  expired.next->prev = &expired;
+  expired.prev->next = &expired;
+  k_list_init(slot);
 
-  assert(timeout->remain != 0);
+  while (!k_list_is_empty(&expired)) {
+    struct KListLink *link = expired.next;
+    struct KTimeout *timeout = KLIST_CONTAINER(link, struct KTimeout, link);
 
-  timeout->remain--;
+    assert(timeout->expires == queue->now - 1);
 
-  while (timeout->remain == 0) {
     k_list_remove(link);
 
     callback(timeout);
+  }
+}
+
+/**
+ * Get the number of ticks until the first entry in the queue may expire.
+ *
+ * The result can be smaller than the actual time, since entries from the upper
+ * levels are not examined until they are moved into the root level.
+ *
+ * @return The number of ticks or 0 if the queue is empty.
+ */
+unsigned long
+_k_timeout_next(struct KTimeoutQueue *queue)
+{
+  unsigned idx = queue->now & (K_TIMEOUT_ROOT_SIZE - 1);
+  unsigned long bound, i;
+  int level, j;
 
-    if (k_list_is_empty(queue))
-      break;
+  // The number of ticks until the upper levels are examined again
+  bound = (idx == 0) ? 1 : K_TIMEOUT_ROOT_SIZE - idx;
 
-    link = queue->next;
-    timeout = KLIST_CONTAINER(link, struct KTimeout, link);
-  }
+  for (i = 0; i < bound; i++)
+    if (!k_list_is_empty(&queue->root[(idx + i) & (K_TIMEOUT_ROOT_SIZE - 1)]))
+      return i + 1;
+
+  for (i = 0; i < K_TIMEOUT_ROOT_SIZE; i++)
+    if (!k_list_is_empty(&queue->root[i]))
+      return bound;
+
+  for (level = 0; level < K_TIMEOUT_LEVELS; level++)
+    for (j = 0; j < K_TIMEOUT_LEVEL_SIZE; j++)
+      if (!k_list_is_empty(&queue->levels[level][j]))
+        return bound;
+
+  return 0;
 }
@@ -10,10 +10,21 @@
 static void k_timer_enqueue(struct KTimer *, unsigned long);
 static void k_timer_dequeue(struct KTimer *);
 
-static KLIST_DECLARE(k_timer_queue);
+static struct KTimeoutQueue k_timer_queue;
 static struct KSpinLock k_timer_lock = K_SPINLOCK_INITIALIZER("k_timer");
 static struct KTimer *k_timer_current;
 
+/**
+ * Initialize the kernel timer queue.
+ * 
+ * This function must be called prior to starting any kernel timers.
+ */
+void
+k_timer_system_init(void)
+{
+  _k_timeout_queue_init(&k_timer_queue);
+}
+
 int
 k_timer_init(struct KTimer *timer,
              void (*callback)(void *),
@@ -90,6 +101,33 @@ k_timer_stop(struct KTimer *timer)
   return 0;
 }
 
+/**
+ * Get the time left before the timer expires.
+ *
+ * @param timer Pointer to the timer.
+ *
+ * @return The number of ticks until expiration, or 0 if the timer is not
+ *         active.
+ */
+unsigned long
+k_timer_remain(struct KTimer *timer)
+{
+  unsigned long remain = 0;
+
+  if (timer == NULL)
+    panic("timer is NULL");
+
+  k_spinlock_acquire(&k_timer_lock);
+
+  // The entry expires when the queue processes its expires-th tick
+  if (!k_list_is_null(&timer->entry.link))
+    remain = timer->entry.expires - k_timer_queue.now + 1;
+
+  k_spinlock_release(&k_timer_lock);
+
+  return remain;
+}
+
 int
 k_timer_fini(struct KTimer *timer)
 {
@@ -132,16 +170,28 @@ _k_timer_tick(void)
   }
 }
 
+unsigned long
+_k_timer_next_timeout(void)
+{
+  unsigned long ticks;
+
+  k_spinlock_acquire(&k_timer_lock);
+  ticks = _k_timeout_next(&k_timer_queue);
+  k_spinlock_release(&k_timer_lock);
+
+  return ticks;
+}
+
 static void
 k_timer_enqueue(struct KTimer *timer, unsigned long delay)
 {
-  assert(k_spinlock_holding(&k_timer_lock));
+  debug_assert(k_spinlock_holding(&k_timer_lock));
   _k_timeout_enqueue(&k_timer_queue, &timer->entry, delay);
 }
 
 static void
 k_timer_dequeue(struct KTimer *timer)
 {
-  assert(k_spinlock_holding(&k_timer_lock));
+  debug_assert(k_spinlock_holding(&k_timer_lock));
   _k_timeout_dequeue(&k_timer_queue, &timer->entry);
 }
@@ -34,6 +34,81 @@ k_waitqueue_timed_sleep(struct KWaitQueue *chan, struct KSpinLock *lock, unsigne
   return _k_sched_sleep(&chan->head, THREAD_STATE_SLEEP, timeout, lock);
 }
 
+/**
+ * Wait on the given wait channel for at most the given time, which is not
+ * rounded to ticks if the machine has a high-resolution timer.
+ *
+ * @param chan    A pointer to the wait channel to sleep on.
+ * @param lock    A pointer to the spinlock to be released.
+ * @param timeout The maximum time to sleep, in nanoseconds.
+ *
+ * @return 0 if woken up, -ETIMEDOUT if the time has run out, or -EINTR.
+ */
+int
+k_waitqueue_timed_sleep_ns(struct KWaitQueue *chan, struct KSpinLock *lock,
+                           uint64_t timeout)
+{
+  return _k_sched_sleep_ns(&chan->head, THREAD_STATE_SLEEP, timeout, lock);
+}
+
+/**
+ * Wait on the given wait channel as an exclusive waiter and release an
+ * optional spinlock.
+ * 
+ * @param chan A pointer to the wait channel to sleep on.
+ * @param lock A pointer to the spinlock to be released.
+ */
+int
+k_waitqueue_sleep_exclusive(struct KWaitQueue *chan, struct KSpinLock *lock)
+{
+  return k_waitqueue_timed_sleep_exclusive(chan, lock, 0);
+}
+
+int
+k_waitqueue_timed_sleep_exclusive(struct KWaitQueue *chan,
+                                  struct KSpinLock *lock,
+                                  unsigned long timeout)
+{
+  struct KThread *thread = k_thread_current();
+  int r;
+
+  // Only read by the wakers while the thread is on the queue
+  thread->sleep_exclusive = 1;
+  r = _k_sched_sleep(&chan->head, THREAD_STATE_SLEEP, timeout, lock);
+  thread->sleep_exclusive = 0;
+
+  return r;
+}
+
+/**
+ * Wake up the highest-priority task sleeping on one wait channel and sleep on
+ * another one, handing the processor over to the woken task directly.
+ *
+ * @param wake  A pointer to the wait channel to wake up a task from.
+ * @param sleep A pointer to the wait channel to sleep on.
+ * @param lock  A pointer to the spinlock to be released.
+ */
+int
+k_waitqueue_handoff(struct KWaitQueue *wake, struct KWaitQueue *sleep,
+                    struct KSpinLock *lock)
+{
+  return _k_sched_handoff(&wake->head, &sleep->head, lock);
+}
+
+/**
+ * Wake up all shared waiters and the highest-priority exclusive waiter
+ * sleeping on the wait channel.
+ * 
+ * @param chan A pointer to the wait channel
+ */
+void
+k_waitqueue_wakeup(struct KWaitQueue *chan)
+{
+  _k_sched_lock();
+  _k_sched_wakeup_locked(&chan->head, 0);
+  _k_sched_unlock();
+}
+
 /**
  * Wakeup the highest-priority task sleeling on the wait channel.
  * 
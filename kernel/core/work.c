@@ -0,0 +1,178 @@
+#include <kernel/assert.h>
+
+#include <kernel/core/cpu.h>
+#include <kernel/core/irq.h>
+#include <kernel/core/list.h>
+#include <kernel/core/semaphore.h>
+#include <kernel/core/work.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+
+#include "core_private.h"
+
+/*
+ * ----------------------------------------------------------------------------
+ * Deferred work
+ * ----------------------------------------------------------------------------
+ *
+ * Interrupt handlers queue short pieces of work that need not run with the
+ * line masked, such as completing requests or releasing buffers. Work queued
+ * by a handler goes to a list of the current processor, which only that
+ * processor touches with interrupts disabled, and runs when the outermost
+ * handler returns, before the interrupted thread is resumed or preempted.
+ *
+ * Work queued from a thread, and whatever is left over after a batch, is
+ * passed to a worker thread shared by all processors (threads cannot be bound
+ * to a processor, so a per-processor worker would not stay there anyway).
+ *
+ * Work functions must not sleep. Threaded interrupt handlers remain the way to
+ * do anything longer.
+ */
+
+// Maximum number of items run on each interrupt exit
+#define K_WORK_BATCH  16
+
+static struct {
+  /** Work queued by interrupt handlers on each CPU */
+  struct KListLink  local[K_CPU_MAX];
+  /** Work left for the worker thread */
+  struct KListLink  queue;
+  struct KSpinLock  lock;
+  struct KSemaphore semaphore;
+} k_work = {
+  .lock = K_SPINLOCK_INITIALIZER("k_work"),
+};
+
+static void
+k_work_run(struct KWork *work)
+{
+  // Clear the flag first, so that the function can queue the item again
+  __atomic_store_n(&work->pending, 0, __ATOMIC_RELEASE);
+  work->func(work->arg);
+}
+
+// Pass the item to the worker thread
+static void
+k_work_defer(struct KWork *work)
+{
+  k_spinlock_acquire(&k_work.lock);
+  k_list_add_back(&k_work.queue, &work->link);
+  k_spinlock_release(&k_work.lock);
+
+  k_semaphore_put(&k_work.semaphore);
+}
+
+static void
+k_work_thread(void *arg)
+{
+  (void) arg;
+
+  for (;;) {
+    struct KWork *work;
+
+    if (k_semaphore_get(&k_work.semaphore) < 0)
+      panic("k_semaphore_get");
+
+    k_spinlock_acquire(&k_work.lock);
+
+    assert(!k_list_is_empty(&k_work.queue));
+
+    work = KLIST_CONTAINER(k_work.queue.next, struct KWork, link);
+    k_list_remove(&work->link);
+
+    k_spinlock_release(&k_work.lock);
+
+    k_work_run(work);
+  }
+}
+
+/**
+ * Initialize the deferred work queues and start the worker thread. Must be
+ * called after the scheduler has been initialized.
+ */
+void
+k_work_system_init(void)
+{
+  struct KThread *thread;
+  int i;
+
+  for (i = 0; i < K_CPU_MAX; i++)
+    k_list_init(&k_work.local[i]);
+  k_list_init(&k_work.queue);
+  k_semaphore_init(&k_work.semaphore, 0);
+
+  if ((thread = k_thread_create(NULL, k_work_thread, NULL, 0)) == NULL)
+    panic("cannot create the deferred work thread");
+
+  k_thread_resume(thread);
+}
+
+/**
+ * Initialize a deferred work item.
+ *
+ * @param work The item to initialize.
+ * @param func The function to run.
+ * @param arg  The argument to pass to the function.
+ */
+void
+k_work_init(struct KWork *work, void (*func)(void *), void *arg)
+{
+  k_list_init(&work->link);
+  work->func    = func;
+  work->arg     = arg;
+  work->pending = 0;
+}
+
+/**
+ * Queue a work item. When called from an interrupt handler, the item runs on
+ * the same processor as soon as the handler returns; otherwise, it runs in the
+ * worker thread. Queueing an item that is still pending does nothing.
+ *
+ * @param work The item to queue.
+ *
+ * @return 1 if the item has been queued, 0 if it was already pending.
+ */
+int
+k_work_queue(struct KWork *work)
+{
+  int in_irq;
+
+  if (__atomic_exchange_n(&work->pending, 1, __ATOMIC_ACQ_REL))
+    return 0;
+
+  k_irq_state_save();
+
+  in_irq = _k_cpu()->lock_count > 0;
+  if (in_irq)
+    k_list_add_back(&k_work.local[k_cpu_id()], &work->link);
+
+  k_irq_state_restore();
+
+  if (!in_irq)
+    k_work_defer(work);
+
+  return 1;
+}
+
+/**
+ * Run the work queued by the interrupt handlers on the current processor.
+ * Called on the way out of the outermost interrupt handler, with interrupts
+ * disabled.
+ */
+void
+_k_work_run_local(void)
+{
+  struct KListLink *local = &k_work.local[k_cpu_id()];
+  int n;
+
+  for (n = 0; !k_list_is_empty(local); n++) {
+    struct KWork *work = KLIST_CONTAINER(local->next, struct KWork, link);
+
+    k_list_remove(&work->link);
+
+    if (n < K_WORK_BATCH)
+      k_work_run(work);
+    else
+      k_work_defer(work);
+  }
+}
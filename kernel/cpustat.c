@@ -0,0 +1,240 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <kernel/core/cpu.h>
+#include <kernel/core/tick.h>
+#include <kernel/cpustat.h>
+#include <kernel/dev.h>
+#include <kernel/object_pool.h>
+#include <kernel/poll.h>
+#include <kernel/process.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * CPU usage report
+ * ----------------------------------------------------------------------------
+ *
+ * A text report read from /dev/cpustat, one record per line:
+ *
+ *   ticks <ticks since boot> <ticks per second>
+ *   load <1 min> <5 min> <15 min>
+ *   cpu<N> <user> <system> <irq> <idle> <switches> <runq avg>
+ *   proc <pid> <ppid> <uid> <state> <threads> <policy> <priority> <utime>
+ *        <stime> <name>
+ *
+ * The times are in ticks and only grow, so a tool can read the report twice
+ * and divide the differences by the elapsed ticks. The load and the run queue
+ * averages count the ready and running threads, sampled every 5 seconds.
+ */
+
+#define CPUSTAT_MAJOR       0x09
+
+// Large enough for the whole report, the output is truncated otherwise
+#define CPUSTAT_REPORT_SIZE 8192
+
+// Processes shown in the report
+#define CPUSTAT_PROCS_MAX   64U
+
+struct CpuStatBuf {
+  char   *data;
+  size_t  size;
+  size_t  len;
+};
+
+static void
+cpustat_printf(struct CpuStatBuf *buf, const char *format, ...)
+{
+  va_list ap;
+  int n;
+
+  if (buf->len >= buf->size)
+    return;
+
+  va_start(ap, format);
+  n = vsnprintf(buf->data + buf->len, buf->size - buf->len, format, ap);
+  va_end(ap);
+
+  if (n > 0)
+    buf->len = MIN(buf->len + n, buf->size);
+}
+
+// Integer and hundredths of a load average
+#define CPUSTAT_LOAD_INT(x)   ((x) >> K_LOAD_SHIFT)
+#define CPUSTAT_LOAD_FRAC(x)  \
+  ((((x) & ((1UL << K_LOAD_SHIFT) - 1)) * 100) >> K_LOAD_SHIFT)
+
+static void
+cpustat_cpus(struct CpuStatBuf *buf)
+{
+  struct KCpuStats stats;
+  unsigned long load[3];
+  unsigned i;
+
+  k_sched_get_loadavg(load);
+
+  cpustat_printf(buf, "ticks %llu %u\n", k_tick_get(), TICKS_PER_SECOND);
+  cpustat_printf(buf, "load %lu.%02lu %lu.%02lu %lu.%02lu\n",
+                 CPUSTAT_LOAD_INT(load[0]), CPUSTAT_LOAD_FRAC(load[0]),
+                 CPUSTAT_LOAD_INT(load[1]), CPUSTAT_LOAD_FRAC(load[1]),
+                 CPUSTAT_LOAD_INT(load[2]), CPUSTAT_LOAD_FRAC(load[2]));
+
+  for (i = 0; i < K_CPU_MAX; i++) {
+    if (k_sched_get_stats(i, &stats) != 0)
+      continue;
+
+    cpustat_printf(buf, "cpu%u %lu %lu %lu %lu %lu %lu.%02lu\n", i,
+                   stats.user, stats.system, stats.irq, stats.idle,
+                   stats.switches,
+                   CPUSTAT_LOAD_INT(stats.runq_avg),
+                   CPUSTAT_LOAD_FRAC(stats.runq_avg));
+  }
+}
+
+static char
+cpustat_state(int state)
+{
+  switch (state) {
+  case PROCESS_STATE_ACTIVE:
+    return 'A';
+  case PROCESS_STATE_ZOMBIE:
+    return 'Z';
+  case PROCESS_STATE_STOPPED:
+    return 'T';
+  default:
+    return '?';
+  }
+}
+
+static void
+cpustat_procs(struct CpuStatBuf *buf)
+{
+  struct ProcessStats *stats;
+  unsigned i, n;
+
+  stats = (struct ProcessStats *)
+    k_malloc(CPUSTAT_PROCS_MAX * sizeof(struct ProcessStats));
+  if (stats == NULL)
+    return;
+
+  n = process_get_stats(stats, CPUSTAT_PROCS_MAX);
+
+  for (i = 0; i < MIN(n, CPUSTAT_PROCS_MAX); i++)
+    cpustat_printf(buf, "proc %d %d %u %c %d %d %d %lu %lu %s\n",
+                   (int) stats[i].pid,
+                   (int) stats[i].ppid,
+                   (unsigned) stats[i].uid,
+                   cpustat_state(stats[i].state),
+                   stats[i].threads,
+                   stats[i].policy,
+                   stats[i].priority,
+                   (unsigned long) stats[i].utime,
+                   (unsigned long) stats[i].stime,
+                   stats[i].name);
+
+  k_free(stats);
+}
+
+/**
+ * Format the CPU usage report.
+ *
+ * @param data Buffer to store the report into
+ * @param size The size of the buffer
+ *
+ * @return The length of the report.
+ */
+size_t
+cpustat_report(char *data, size_t size)
+{
+  struct CpuStatBuf buf = { data, size, 0 };
+
+  cpustat_cpus(&buf);
+  cpustat_procs(&buf);
+
+  return buf.len;
+}
+
+static ssize_t
+cpustat_read_at(dev_t dev, uintptr_t va, size_t n, off_t off)
+{
+  char *data;
+  size_t len;
+  ssize_t r;
+
+  (void) dev;
+
+  if ((data = (char *) k_malloc(CPUSTAT_REPORT_SIZE)) == NULL)
+    return -ENOMEM;
+
+  len = cpustat_report(data, CPUSTAT_REPORT_SIZE);
+
+  if ((off < 0) || ((size_t) off >= len)) {
+    r = 0;
+  } else {
+    n = MIN(n, len - (size_t) off);
+    r = vm_space_copy_out(data + off, va, n);
+    if (r == 0)
+      r = n;
+  }
+
+  k_free(data);
+
+  return r;
+}
+
+static ssize_t
+cpustat_read(dev_t dev, uintptr_t va, size_t n)
+{
+  return cpustat_read_at(dev, va, n, 0);
+}
+
+static ssize_t
+cpustat_write(dev_t dev, uintptr_t va, size_t n)
+{
+  (void) dev;
+  (void) va;
+  (void) n;
+
+  return -EBADF;
+}
+
+static int
+cpustat_ioctl(dev_t dev, int request, int arg)
+{
+  (void) dev;
+  (void) request;
+  (void) arg;
+
+  return -ENOTTY;
+}
+
+static int
+cpustat_poll(dev_t dev, struct PollEntry *entry)
+{
+  (void) dev;
+  (void) entry;
+
+  return POLLIN;
+}
+
+static struct CharDev cpustat_device = {
+  .read    = cpustat_read,
+  .read_at = cpustat_read_at,
+  .write   = cpustat_write,
+  .ioctl   = cpustat_ioctl,
+  .poll    = cpustat_poll,
+};
+
+/**
+ * Register the CPU usage device (/dev/cpustat).
+ */
+void
+cpustat_init(void)
+{
+  dev_register_char(CPUSTAT_MAJOR, &cpustat_device);
+}
@@ -20,21 +20,35 @@ struct PsfHeader {
 
 static void display_draw_cursor(struct Display *);
 static void display_erase_cursor(struct Display *);
+static void display_put_char(struct Display *, unsigned, char, uint16_t, uint16_t);
 static void display_draw_char(struct Display *, unsigned, char, uint16_t, uint16_t);
+static void display_copy_words(uint32_t *, const uint32_t *, size_t);
+static void display_fill_words(uint32_t *, uint32_t, size_t);
 
 void
 display_draw_char_at(struct Display *display, unsigned i)
 {
-  display_draw_char(display,
-                    i,
-                    display->screen->buf[i].ch,
-                    display->screen->buf[i].fg,
-                    display->screen->buf[i].bg);
+  struct ScreenCell *cell = screen_view_cell(display->screen, i);
+
+  display_put_char(display, i, cell->ch, cell->fg, cell->bg);
 
   if (i == display->cursor_pos)
     display->cursor_visible = 0;
 }
 
+/**
+ * Bring the given range of cells on the framebuffer in sync with the screen
+ * contents. Only the cells that actually differ are painted.
+ */
+void
+display_redraw(struct Display *display, unsigned from, unsigned to)
+{
+  unsigned i;
+
+  for (i = from; i <= to; i++)
+    display_draw_char_at(display, i);
+}
+
 /**
  * Initialize the display driver.
  */
@@ -44,15 +58,19 @@ display_init(struct Display *display, void *base)
   extern uint8_t _binary_kernel_drivers_console_vga_font_psf_start[];
 
   struct PsfHeader *psf;
+  unsigned i;
 
   psf = (struct PsfHeader *) _binary_kernel_drivers_console_vga_font_psf_start;
-  if ((psf->magic != PSF_MAGIC) || (psf->charsize != 16))
+  if ((psf->magic != PSF_MAGIC) || (psf->charsize != DISPLAY_GLYPH_HEIGHT))
     return -EINVAL;
 
   display->font.bitmap       = (uint8_t *) (psf + 1);
-  display->font.glyph_width  = 8;
+  display->font.glyph_width  = DISPLAY_GLYPH_WIDTH;
   display->font.glyph_height = psf->charsize;
 
+  for (i = 0; i < DISPLAY_GLYPH_CACHE; i++)
+    display->glyph_cache[i].key = 0;
+
   display->pos = 0;
   display->cursor_pos = 0;
   display->cursor_visible = 0;
@@ -61,9 +79,27 @@ display_init(struct Display *display, void *base)
   display->fb_height = DEFAULT_FB_HEIGHT;
   display->fb_base   = (uint16_t *) base;
 
+  // The framebuffer is zero-filled, i.e. all cells are blank and black
+  for (i = 0; i < SCREEN_COLS * SCREEN_ROWS; i++) {
+    display->shadow[i].ch = ' ';
+    display->shadow[i].fg = COLOR_WHITE;
+    display->shadow[i].bg = COLOR_BLACK;
+  }
+  display->shadow_valid = 1;
+
   return 0;
 }
 
+/**
+ * Called when the framebuffer gets mapped into user space. From then on, its
+ * contents may change behind our back, so every cell is always repainted.
+ */
+void
+display_map_user(struct Display *display)
+{
+  display->shadow_valid = 0;
+}
+
 void
 display_update(struct Display *display, struct Screen *screen)
 {
@@ -71,13 +107,17 @@ display_update(struct Display *display, struct Screen *screen)
 
   display->screen = screen;
 
+  // Switching between screens with similar contents (e.g. several shells)
+  // only repaints the cells that differ
   for (i = 0; i < display->screen->cols * display->screen->rows; i++)
     display_draw_char_at(display, i);
 
   display->pos = display->screen->pos;
   display->cursor_pos = display->pos;
 
-  display_draw_cursor(display);
+  // The cursor is not in the view while looking at the history
+  if (display->screen->scroll == 0)
+    display_draw_cursor(display);
 }
 
 void
@@ -99,7 +139,9 @@ display_erase(struct Display *display, unsigned from, unsigned to)
   unsigned i;
   
   for (i = from; i <= to; i++) {
-    display_draw_char(display, i, ' ', display->screen->buf[i].fg, display->screen->buf[i].bg);
+    struct ScreenCell *cell = screen_view_cell(display->screen, i);
+
+    display_put_char(display, i, ' ', cell->fg, cell->bg);
 
     if (i == display->cursor_pos)
       display->cursor_visible = 0;
@@ -121,6 +163,9 @@ display_flush(struct Display *display)
 void
 display_scroll_down(struct Display *display, unsigned n)
 {
+  size_t row_words, shift_words, total_words;
+  unsigned i, cells;
+
   display->pos = display->screen->pos;
 
   if (display->cursor_pos < display->screen->cols * n) {
@@ -130,23 +175,41 @@ display_scroll_down(struct Display *display, unsigned n)
     display->cursor_pos -= display->screen->cols * n;
   }
 
-  memmove(&display->fb_base[0],
-          &display->fb_base[display->fb_width * display->font.glyph_height * n],
-          sizeof(display->fb_base[0]) * display->fb_width * (display->fb_height - display->font.glyph_height * n));
-  memset(&display->fb_base[display->fb_width * (display->fb_height - display->font.glyph_height * n)],
-         0,
-         sizeof(display->fb_base[0]) * display->fb_width * display->font.glyph_height * n);
+  // Each framebuffer row takes a whole number of words, so move them a word
+  // at a time rather than a byte at a time
+  row_words   = display->fb_width * sizeof(display->fb_base[0]) / sizeof(uint32_t);
+  shift_words = row_words * display->font.glyph_height * n;
+  total_words = row_words * display->fb_height;
+
+  display_copy_words((uint32_t *) display->fb_base,
+                     (uint32_t *) display->fb_base + shift_words,
+                     total_words - shift_words);
+  display_fill_words((uint32_t *) display->fb_base + total_words - shift_words,
+                     0,
+                     shift_words);
+
+  // Keep the shadow in sync with the moved pixels
+  cells = display->screen->cols * display->screen->rows;
+
+  memmove(&display->shadow[0], &display->shadow[display->screen->cols * n],
+          sizeof(display->shadow[0]) * (cells - display->screen->cols * n));
+
+  for (i = cells - display->screen->cols * n; i < cells; i++) {
+    display->shadow[i].ch = ' ';
+    display->shadow[i].fg = COLOR_WHITE;
+    display->shadow[i].bg = COLOR_BLACK;
+  }
 }
 
 static void
 display_erase_cursor(struct Display *display)
 {
   if (display->cursor_visible) {
-    display_draw_char(display,
-                      display->cursor_pos,
-                      display->screen->buf[display->cursor_pos].ch,
-                      display->screen->buf[display->cursor_pos].fg,
-                      display->screen->buf[display->cursor_pos].bg);
+    struct ScreenCell *cell = screen_view_cell(display->screen,
+                                               display->cursor_pos);
+
+    display_put_char(display, display->cursor_pos, cell->ch, cell->fg,
+                     cell->bg);
     display->cursor_visible = 0;
   }
 }
@@ -155,11 +218,12 @@ static void
 display_draw_cursor(struct Display *display)
 {
   if (!display->cursor_visible) {
-    display_draw_char(display, 
-                      display->cursor_pos,
-                      display->screen->buf[display->cursor_pos].ch,
-                      display->screen->buf[display->cursor_pos].bg,
-                      display->screen->buf[display->cursor_pos].fg);
+    struct ScreenCell *cell = screen_view_cell(display->screen,
+                                               display->cursor_pos);
+
+    // Inverted colors
+    display_put_char(display, display->cursor_pos, cell->ch, cell->bg,
+                     cell->fg);
     display->cursor_visible = 1;
   }
 }
@@ -188,28 +252,134 @@ colors[] = {
   [COLOR_BRIGHT_WHITE]    = RGB565(255, 255, 255),
 };
 
-// Naive code to draw a character on the screen pixel-by-pixel. A more
-// efficient solution would use boolean operations and a "mask lookup table"
-// instead.
-// TODO: implement this solution for better performance!
+// Check whether painting the given character would leave the cell unchanged.
+// All blank cells with the same background look the same.
+static int
+display_cell_same(struct ScreenCell *cell, char c, uint16_t fg, uint16_t bg)
+{
+  int blank = (c == ' ') || (c == '\0');
+
+  if (cell->bg != bg)
+    return 0;
+  if (blank)
+    return (cell->ch == ' ') || (cell->ch == '\0');
+  return (cell->ch == (uint8_t) c) && (cell->fg == fg);
+}
+
+// Paint the character unless the cell already shows it
+static void
+display_put_char(struct Display *display, unsigned pos, char c, uint16_t fg, uint16_t bg)
+{
+  if (display->shadow_valid && display_cell_same(&display->shadow[pos], c, fg, bg))
+    return;
+
+  display_draw_char(display, pos, c, fg, bg);
+}
+
+// Get the glyph for the given character rendered in the given colors, either
+// from the cache or by expanding the font bitmap into the (direct-mapped)
+// cache slot for that key.
+static struct DisplayGlyph *
+display_glyph_get(struct Display *display, char c, uint16_t fg, uint16_t bg)
+{
+  struct DisplayGlyph *glyph;
+  uint32_t pairs[4];
+  uint16_t key;
+  uint8_t *bitmap;
+  unsigned y;
+
+  // The character is never zero here, so neither is the key
+  key   = (uint8_t) c | (fg << 8) | (bg << 12);
+  glyph = &display->glyph_cache[((key * 2654435761U) >> 16) % DISPLAY_GLYPH_CACHE];
+
+  if (glyph->key == key)
+    return glyph;
+
+  // All combinations of two adjacent pixels, indexed by their bitmap bits.
+  // The left pixel goes to the lower halfword.
+  pairs[0] = colors[bg] | ((uint32_t) colors[bg] << 16);
+  pairs[1] = colors[bg] | ((uint32_t) colors[fg] << 16);
+  pairs[2] = colors[fg] | ((uint32_t) colors[bg] << 16);
+  pairs[3] = colors[fg] | ((uint32_t) colors[fg] << 16);
+
+  bitmap = &display->font.bitmap[(uint8_t) c * DISPLAY_GLYPH_HEIGHT];
+
+  for (y = 0; y < DISPLAY_GLYPH_HEIGHT; y++) {
+    glyph->rows[y][0] = pairs[(bitmap[y] >> 6) & 3];
+    glyph->rows[y][1] = pairs[(bitmap[y] >> 4) & 3];
+    glyph->rows[y][2] = pairs[(bitmap[y] >> 2) & 3];
+    glyph->rows[y][3] = pairs[(bitmap[y] >> 0) & 3];
+  }
+
+  glyph->key = key;
+
+  return glyph;
+}
+
+// Draw a character on the screen by copying its pre-rendered rows
 static void
 display_draw_char(struct Display *display, unsigned pos, char c, uint16_t fg, uint16_t bg)
 { 
-  static uint8_t mask[] = { 128, 64, 32, 16, 8, 4, 2, 1 };
+  struct DisplayGlyph *glyph;
+  uint32_t *row;
+  uint16_t x0, y0, y;
 
-  uint8_t *glyph;
-  uint16_t x0, y0, x, y;
+  display->shadow[pos].ch = c;
+  display->shadow[pos].fg = fg;
+  display->shadow[pos].bg = bg;
 
   if (c == '\0')
     c = ' ';
-  glyph = &display->font.bitmap[c * display->font.glyph_height];
+  glyph = display_glyph_get(display, c, fg, bg);
+
+  x0 = (pos % display->screen->cols) * DISPLAY_GLYPH_WIDTH;
+  y0 = (pos / display->screen->cols) * DISPLAY_GLYPH_HEIGHT;
 
-  x0 = (pos % display->screen->cols) * display->font.glyph_width;
-  y0 = (pos / display->screen->cols) * display->font.glyph_height;
+  row = (uint32_t *) &display->fb_base[display->fb_width * y0 + x0];
+
+  for (y = 0; y < DISPLAY_GLYPH_HEIGHT; y++) {
+    row[0] = glyph->rows[y][0];
+    row[1] = glyph->rows[y][1];
+    row[2] = glyph->rows[y][2];
+    row[3] = glyph->rows[y][3];
+
+    row += display->fb_width / 2;
+  }
+}
+
+// Copy words in ascending order (the areas may overlap if dst < src)
+static void
+display_copy_words(uint32_t *dst, const uint32_t *src, size_t n)
+{
+  for ( ; n >= 8; n -= 8, dst += 8, src += 8) {
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[2];
+    dst[3] = src[3];
+    dst[4] = src[4];
+    dst[5] = src[5];
+    dst[6] = src[6];
+    dst[7] = src[7];
+  }
+
+  for ( ; n > 0; n--)
+    *dst++ = *src++;
+}
+
+static void
+display_fill_words(uint32_t *dst, uint32_t value, size_t n)
+{
+  for ( ; n >= 8; n -= 8, dst += 8) {
+    dst[0] = value;
+    dst[1] = value;
+    dst[2] = value;
+    dst[3] = value;
+    dst[4] = value;
+    dst[5] = value;
+    dst[6] = value;
+    dst[7] = value;
+  }
 
-  for (x = 0; x < display->font.glyph_width; x++)
-    for (y = 0; y < display->font.glyph_height; y++)
-      display->fb_base[display->fb_width * (y0 + y) + (x0 + x)] = (glyph[y] & mask[x])
-        ? colors[fg]
-        : colors[bg];
+  for ( ; n > 0; n--)
+    *dst++ = value;
 }
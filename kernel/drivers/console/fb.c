@@ -0,0 +1,127 @@
+#include <errno.h>
+#include <sys/fb.h>
+
+#include <kernel/console.h>
+#include <kernel/dev.h>
+#include <kernel/drivers/display.h>
+#include <kernel/drivers/fb.h>
+#include <kernel/page.h>
+#include <kernel/poll.h>
+#include <kernel/process.h>
+#include <kernel/types.h>
+#include <kernel/vm.h>
+#include <kernel/vmspace.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Framebuffer device
+ * ----------------------------------------------------------------------------
+ *
+ * /dev/fb0 gives user space direct access to the console framebuffer. The
+ * block is mapped with a single section, shared with the display controller
+ * and the text console rather than copied.
+ *
+ * The user mapping is write-combining (normal non-cacheable memory): pixel
+ * stores skip the data cache, so the controller sees them without any cache
+ * maintenance, but unlike device memory they may still be buffered and merged
+ * into bursts.
+ */
+
+#define FB_BPP  16
+
+/**
+ * Map the console framebuffer into the current process.
+ *
+ * @return The user virtual address of the framebuffer or a negative error
+ *         code.
+ */
+intptr_t
+fb_map(void)
+{
+  struct Page *fb;
+  unsigned fb_order;
+
+  if ((fb = arch_console_fb(&fb_order)) == NULL)
+    return -ENODEV;
+
+  return vmspace_map_block(process_current()->vm, fb, fb_order,
+                           PROT_READ | PROT_WRITE | VM_WC | VM_USER);
+}
+
+static int
+fb_get_info(uintptr_t va)
+{
+  struct fb_info info;
+  unsigned fb_order;
+
+  if (arch_console_fb(&fb_order) == NULL)
+    return -ENODEV;
+
+  info.width  = DEFAULT_FB_WIDTH;
+  info.height = DEFAULT_FB_HEIGHT;
+  info.bpp    = FB_BPP;
+  info.stride = DEFAULT_FB_WIDTH * FB_BPP / 8;
+  info.size   = PAGE_SIZE << fb_order;
+
+  return vm_copy_out(process_current()->vm, &info, va, sizeof info);
+}
+
+static ssize_t
+fb_read(dev_t dev, uintptr_t va, size_t n)
+{
+  (void) dev;
+  (void) va;
+  (void) n;
+
+  return -EINVAL;
+}
+
+static ssize_t
+fb_write(dev_t dev, uintptr_t va, size_t n)
+{
+  (void) dev;
+  (void) va;
+  (void) n;
+
+  return -EINVAL;
+}
+
+static int
+fb_ioctl(dev_t dev, int request, int arg)
+{
+  (void) dev;
+
+  switch (request) {
+  case FBIOGETINFO:
+    return fb_get_info(arg);
+  case FBIOMAP:
+    return fb_map();
+  default:
+    return -ENOTTY;
+  }
+}
+
+static int
+fb_poll(dev_t dev, struct PollEntry *entry)
+{
+  (void) dev;
+  (void) entry;
+
+  return POLLOUT;
+}
+
+static struct CharDev fb_device = {
+  .read  = fb_read,
+  .write = fb_write,
+  .ioctl = fb_ioctl,
+  .poll  = fb_poll,
+};
+
+/**
+ * Register the framebuffer device (/dev/fb0).
+ */
+void
+fb_init(void)
+{
+  dev_register_char(FB_MAJOR, &fb_device);
+}
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <string.h>
 
 #include <kernel/tty.h>
 #include <kernel/mm/memlayout.h>
@@ -39,31 +40,65 @@ static char *key_sequences[KEY_MAX] = {
 // Keymap size in characters
 #define KEYMAP_LENGTH       256
 
+// The most input characters passed to the tty at once
+#define PS2_INPUT_BATCH     64
+
 /**
  * Handle interrupt from the keyboard.
  * 
- * Get data and store it into the console buffer.
+ * Get data and store it into the console buffer. The characters are passed
+ * to the tty in batches, so the input lock is taken and the readers are woken
+ * up once per batch rather than once per key.
  */
 static int
 ps2_kbd_irq_thread(int irq, void *arg)
 {
   struct PS2 *ps2 = (struct PS2 *) arg;
-  char buf[2];
+  struct Tty *tty = tty_current;
+  char buf[PS2_INPUT_BATCH + 1];
+  size_t n = 0, len;
+  const char *seq;
+  char ch;
   int c;
 
   (void) irq;
 
   while ((c = ps2_kbd_getc(ps2)) >= 0) {
+    // Alt + Fn switched the console, the keys so far belong to the old one
+    if (tty != tty_current) {
+      if (n > 0) {
+        buf[n] = '\0';
+        tty_process_input(tty, buf);
+        n = 0;
+      }
+      tty = tty_current;
+    }
+
     if ((c == 0) || (c >= KEY_MAX))
       continue;
 
     if (key_sequences[c] != NULL) {
-      tty_process_input(tty_current, key_sequences[c]);
+      seq = key_sequences[c];
+      len = strlen(seq);
     } else {
-      buf[0] = c & 0xFF;
-      buf[1] = '\0';
-      tty_process_input(tty_current, buf);
+      ch  = c & 0xFF;
+      seq = &ch;
+      len = 1;
     }
+
+    if (n + len > PS2_INPUT_BATCH) {
+      buf[n] = '\0';
+      tty_process_input(tty, buf);
+      n = 0;
+    }
+
+    memcpy(&buf[n], seq, len);
+    n += len;
+  }
+
+  if (n > 0) {
+    buf[n] = '\0';
+    tty_process_input(tty, buf);
   }
 
   return 1;
@@ -244,6 +279,13 @@ ps2_kbd_getc(struct PS2 *ps2)
     return 0;
   }
 
+  // Shift + Page Up / Page Down scroll through the console history
+  if ((key_state & STATE_SHIFT) &&
+      ((scan_code == 0xC9) || (scan_code == 0xD1))) {
+    tty_scroll((scan_code == 0xC9) ? SCREEN_ROWS / 2 : -(SCREEN_ROWS / 2));
+    return 0;
+  }
+
   // TODO: may need more columns: Alt, Ctrl + Alt, Alt + Shift, etc.
   if (key_state & STATE_CTRL)
     keymap_col = KEYMAP_COL_CTRL;
@@ -17,9 +17,12 @@ screen_init(struct Screen *screen, struct Display *display)
   screen->esc_cur_param = -1;
   screen->cols          = SCREEN_COLS;
   screen->rows          = SCREEN_ROWS;
+  screen->top           = 0;
+  screen->history       = 0;
+  screen->scroll        = 0;
   screen->display       = display;
  
-  for (i = 0; i < screen->cols * screen->rows; i++) {
+  for (i = 0; i < SCREEN_COLS * SCREEN_LINES; i++) {
     screen->buf[i].ch = ' ';
     screen->buf[i].fg = COLOR_WHITE;
     screen->buf[i].bg = COLOR_BLACK;
@@ -47,9 +50,11 @@ screen_erase(struct Screen *screen, unsigned from, unsigned to)
   size_t i;
 
   for (i = from; i <= to; i++) {
-    screen->buf[i].ch = ' ';
-    screen->buf[i].fg = screen->fg_color;
-    screen->buf[i].bg = screen->bg_color;
+    struct ScreenCell *cell = screen_cell(screen, i);
+
+    cell->ch = ' ';
+    cell->fg = screen->fg_color;
+    cell->bg = screen->bg_color;
   }
 
   if (screen_is_current(screen))
@@ -59,9 +64,31 @@ screen_erase(struct Screen *screen, unsigned from, unsigned to)
 static void
 screen_set_char(struct Screen *screen, unsigned i, char c)
 {
-  screen->buf[i].ch = c;
-  screen->buf[i].fg = screen->fg_color & 0xF;
-  screen->buf[i].bg = screen->bg_color & 0xF;
+  struct ScreenCell *cell = screen_cell(screen, i);
+
+  cell->ch = c;
+  cell->fg = screen->fg_color & 0xF;
+  cell->bg = screen->bg_color & 0xF;
+}
+
+// Get the first cell of the given visible row, the row is contiguous
+static struct ScreenCell *
+screen_row(struct Screen *screen, unsigned row)
+{
+  return &screen->buf[((screen->top + row) % SCREEN_LINES) * screen->cols];
+}
+
+static void
+screen_clear_row(struct Screen *screen, unsigned row)
+{
+  struct ScreenCell *cells = screen_row(screen, row);
+  unsigned i;
+
+  for (i = 0; i < screen->cols; i++) {
+    cells[i].ch = ' ';
+    cells[i].fg = COLOR_WHITE;
+    cells[i].bg = COLOR_BLACK;
+  }
 }
 
 #define DISPLAY_TAB_WIDTH  4
@@ -74,14 +101,13 @@ screen_scroll_down(struct Screen *screen, unsigned n)
   if (screen_is_current(screen))
     display_flush(screen->display);
 
-  memmove(&screen->buf[0], &screen->buf[screen->cols * n],
-          sizeof(screen->buf[0]) * (screen->cols * (screen->rows - n)));
-
-  for (i = screen->cols * (screen->rows - n); i < screen->cols * screen->rows; i++) {
-    screen->buf[i].ch = ' ';
-    screen->buf[i].fg = COLOR_WHITE;
-    screen->buf[i].bg = COLOR_BLACK;
+  // The top rows become history, and the oldest history row (or an unused
+  // one) comes in at the bottom
+  for (i = 0; i < n; i++) {
+    screen->top = (screen->top + 1) % SCREEN_LINES;
+    screen_clear_row(screen, screen->rows - 1);
   }
+  screen->history = MIN(screen->history + n, (unsigned) SCREEN_HISTORY);
 
   screen->pos -= n * screen->cols;
 
@@ -92,29 +118,30 @@ screen_scroll_down(struct Screen *screen, unsigned n)
 static void
 screen_insert_rows(struct Screen *screen, unsigned rows)
 {
-  unsigned max_rows, start_pos, end_pos, n, i;
+  unsigned max_rows, start_row, start_pos, i;
   
   max_rows  = screen->rows - screen->pos / screen->cols;
   rows      = MIN(max_rows, rows);
 
-  start_pos = screen->pos - (screen->pos % screen->cols);
-  end_pos   = start_pos + rows * screen->cols;
-  n         = (max_rows - rows) * screen->cols;
+  start_row = screen->pos / screen->cols;
+  start_pos = start_row * screen->cols;
 
   if (screen_is_current(screen))
     display_flush(screen->display);
 
-  for (i = 0; i < rows * screen->cols; i++) {
-    screen->buf[i + start_pos].ch = ' ';
-    screen->buf[i + start_pos].fg = COLOR_WHITE;
-    screen->buf[i + start_pos].bg = COLOR_BLACK;
-  }
+  // Move the rows below the cursor down, one row at a time since the ring
+  // may wrap around between them
+  for (i = screen->rows; i > start_row + rows; i--)
+    memcpy(screen_row(screen, i - 1), screen_row(screen, i - 1 - rows),
+           sizeof(screen->buf[0]) * screen->cols);
 
-  memmove(&screen->buf[end_pos], &screen->buf[start_pos],
-          sizeof(screen->buf[0]) * n);
+  for (i = 0; i < rows; i++)
+    screen_clear_row(screen, start_row + i);
   
+  // Only the cells that have actually changed get repainted
   if (screen_is_current(screen))
-    display_flush(screen->display);
+    display_redraw(screen->display, start_pos,
+                   screen->cols * screen->rows - 1);
 }
 
 static int
@@ -307,11 +334,11 @@ screen_handle_esc(struct Screen *screen, char c)
 
     for (m = screen->pos - screen->pos % SCREEN_COLS + SCREEN_COLS - 1; m >= screen->pos; m--) {
       if (m > screen->pos) {
-        screen->buf[m] = screen->buf[m - n];
+        *screen_cell(screen, m) = *screen_cell(screen, m - n);
       } else {
-        screen->buf[m].ch = ' ';
-        screen->buf[m].fg = screen->fg_color;
-        screen->buf[m].bg = screen->bg_color;
+        screen_cell(screen, m)->ch = ' ';
+        screen_cell(screen, m)->fg = screen->fg_color;
+        screen_cell(screen, m)->bg = screen->bg_color;
       }
 
       if (screen_is_current(screen))
@@ -368,7 +395,7 @@ screen_handle_esc(struct Screen *screen, char c)
 
   case 'b':
     for (n = 0; n < screen->esc_params[0]; n++)
-      screen_print_char(screen, screen->buf[screen->pos - 1].ch);
+      screen_print_char(screen, screen_cell(screen, screen->pos - 1)->ch);
     break;
 
   // TODO
@@ -397,6 +424,10 @@ screen_out_char(struct Screen *screen, char c)
 {
   int i;
 
+  // New output brings the view back to the live rows
+  if (screen->scroll != 0)
+    screen_scroll_view(screen, -(int) screen->scroll);
+
   switch (screen->state) {
   case PARSER_NORMAL:
     if (c == '\x1b')
@@ -458,3 +489,31 @@ screen_backspace(struct Screen *screen)
   if (screen->pos > 0)
     screen_set_char(screen, --screen->pos, ' ');
 }
+
+/**
+ * Scroll the view through the history rows. The contents are not changed,
+ * and any output scrolls the view back to the live rows.
+ *
+ * @param screen The screen
+ * @param n      The number of rows to scroll back (if positive) or forward
+ *               (if negative)
+ */
+void
+screen_scroll_view(struct Screen *screen, int n)
+{
+  unsigned scroll;
+
+  if (n > 0)
+    scroll = MIN(screen->scroll + n, screen->history);
+  else
+    scroll = (screen->scroll > (unsigned) -n) ? screen->scroll + n : 0;
+
+  if (scroll == screen->scroll)
+    return;
+
+  screen->scroll = scroll;
+
+  // Only the cells that differ get repainted
+  if (screen_is_current(screen))
+    display_update(screen->display, screen);
+}
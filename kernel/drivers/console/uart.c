@@ -1,7 +1,20 @@
+#include <kernel/console.h>
 #include <kernel/drivers/uart.h>
 #include <kernel/tty.h>
+#include <kernel/thread.h>
 #include <kernel/interrupt.h>
 
+/*******************************************************************************
+ * Generic UART driver.
+ *
+ * Output goes into a ring buffer and the transmit interrupt moves it into the
+ * hardware FIFO, so the callers do not spin while the characters are sent at
+ * the line rate. When the ring is full, the caller drains it itself. Output
+ * is written synchronously if the hardware driver cannot tell when the FIFO
+ * has room, before there are threads to serve the interrupt, and after a
+ * panic (the monitor runs with nothing else to drain the ring).
+ ******************************************************************************/
+
 static int uart_irq_thread(int, void *);
 
 int
@@ -10,6 +23,11 @@ uart_init(struct Uart *uart, struct UartOps *ops, void *ctx, int irq)
   uart->ops = ops;
   uart->ctx = ctx;
 
+  k_spinlock_init(&uart->tx_lock, "uart_tx");
+  uart->tx_head  = 0;
+  uart->tx_count = 0;
+  uart->tx_irq   = 0;
+
   interrupt_attach_thread(irq, uart_irq_thread, uart);
 
   return 0;
@@ -30,13 +48,97 @@ uart_getc(struct Uart *uart)
   }
 }
 
-int
-uart_putc(struct Uart *uart, int c)
+static int
+uart_tx_has_irq(struct Uart *uart)
+{
+  return (uart->ops->tx_ready != NULL) && (uart->ops->tx_irq_enable != NULL);
+}
+
+static void
+uart_tx_enqueue(struct Uart *uart, int c)
+{
+  unsigned tail = (uart->tx_head + uart->tx_count) % UART_TX_BUF_SIZE;
+
+  uart->tx_buf[tail] = c;
+  uart->tx_count++;
+}
+
+static int
+uart_tx_dequeue(struct Uart *uart)
+{
+  int c = uart->tx_buf[uart->tx_head];
+
+  uart->tx_head = (uart->tx_head + 1) % UART_TX_BUF_SIZE;
+  uart->tx_count--;
+
+  return c;
+}
+
+// Move characters from the ring into the FIFO while it has room
+static void
+uart_tx_fill(struct Uart *uart)
+{
+  while ((uart->tx_count > 0) && uart->ops->tx_ready(uart->ctx))
+    uart->ops->write(uart->ctx, uart_tx_dequeue(uart));
+}
+
+// Write out the whole ring, waiting for the FIFO as necessary
+static void
+uart_tx_flush(struct Uart *uart)
+{
+  while (uart->tx_count > 0)
+    uart->ops->write(uart->ctx, uart_tx_dequeue(uart));
+}
+
+static void
+uart_putc_sync(struct Uart *uart, int c)
 {
   if (c == '\n')
      uart->ops->write(uart->ctx, '\r');
 
   uart->ops->write(uart->ctx, c);
+}
+
+int
+uart_putc(struct Uart *uart, int c)
+{
+  unsigned need = (c == '\n') ? 2 : 1;
+
+  if (!uart_tx_has_irq(uart)) {
+    uart_putc_sync(uart, c);
+    return 0;
+  }
+
+  // The lock may be held by a CPU that will never release it
+  if (panicstr != NULL) {
+    uart_tx_flush(uart);
+    uart_putc_sync(uart, c);
+    return 0;
+  }
+
+  k_spinlock_acquire(&uart->tx_lock);
+
+  if (k_thread_current() == NULL) {
+    // Nobody would serve the interrupt yet, keep the order with the ring
+    uart_tx_flush(uart);
+    uart_putc_sync(uart, c);
+  } else {
+    if (uart->tx_count + need > UART_TX_BUF_SIZE)
+      uart_tx_flush(uart);
+
+    if (c == '\n')
+      uart_tx_enqueue(uart, '\r');
+    uart_tx_enqueue(uart, c);
+
+    uart_tx_fill(uart);
+
+    if ((uart->tx_count > 0) && !uart->tx_irq) {
+      uart->ops->tx_irq_enable(uart->ctx, 1);
+      uart->tx_irq = 1;
+    }
+  }
+
+  k_spinlock_release(&uart->tx_lock);
 
   return 0;
 }
@@ -46,17 +148,44 @@ uart_irq_thread(int irq, void *arg)
 {
   struct Uart *uart = (struct Uart *) arg;
 
-  char buf[2];
+  char buf[UART_RX_BATCH + 1];
+  size_t n = 0;
   int c;
 
   (void) irq;
 
+  // Drain the whole FIFO and pass the characters to the tty in batches, so
+  // the input lock is taken and the readers are woken up once per batch
   while ((c = uart_getc(uart)) >= 0) {
-    if (c != 0) {
-      buf[0] = c;
-      buf[1] = '\0';
+    if (c == 0)
+      continue;
+
+    buf[n++] = c;
+
+    if (n == UART_RX_BATCH) {
+      buf[n] = '\0';
       tty_process_input(tty_system, buf);
+      n = 0;
+    }
+  }
+
+  if (n > 0) {
+    buf[n] = '\0';
+    tty_process_input(tty_system, buf);
+  }
+
+  if (uart_tx_has_irq(uart)) {
+    k_spinlock_acquire(&uart->tx_lock);
+
+    uart_tx_fill(uart);
+
+    // Nothing left to send, stop the interrupt until there is
+    if ((uart->tx_count == 0) && uart->tx_irq) {
+      uart->ops->tx_irq_enable(uart->ctx, 0);
+      uart->tx_irq = 0;
     }
+
+    k_spinlock_release(&uart->tx_lock);
   }
 
   return 1;
@@ -0,0 +1,80 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/dev.h>
+#include <kernel/drivers/ramdisk.h>
+#include <kernel/fs/buf.h>
+
+/*******************************************************************************
+ * RAM Disk Driver
+ *
+ * Serves block requests from a filesystem image kept in memory. The image is
+ * either linked into the kernel (see RAMDISK_IMAGE in kernel.mk) or loaded by
+ * the bootloader as the initial RAM disk, in which case the architecture code
+ * keeps its pages away from the page allocator. Requests are completed right
+ * away by copying the data, the image itself is modified by the writes.
+ ******************************************************************************/
+
+// Set by the linker if the kernel has been built with an embedded image
+extern uint8_t _binary_obj_kernel_ramdisk_img_start[] __attribute__((weak));
+extern uint8_t _binary_obj_kernel_ramdisk_img_end[] __attribute__((weak));
+
+static struct {
+  uint8_t *data;
+  size_t   size;
+} ramdisk;
+
+static void
+ramdisk_request(struct Buf **bufs, unsigned n)
+{
+  unsigned i;
+
+  for (i = 0; i < n; i++) {
+    struct Buf *buf = bufs[i];
+    size_t off = (size_t) buf->block_no * buf->block_size;
+
+    if ((off >= ramdisk.size) || (buf->block_size > ramdisk.size - off)) {
+      // There is no way to report an error, make the block read as zeros
+      warn("block %lu beyond the end of the RAM disk", buf->block_no);
+      if (!(buf->flags & BUF_DIRTY))
+        memset(buf->data, 0, buf->block_size);
+    } else if (buf->flags & BUF_DIRTY) {
+      memmove(ramdisk.data + off, buf->data, buf->block_size);
+    } else {
+      memmove(buf->data, ramdisk.data + off, buf->block_size);
+    }
+
+    buf_io_done(buf);
+  }
+}
+
+static struct BlockDev ramdisk_dev = {
+  .request = ramdisk_request,
+};
+
+/**
+ * Register the RAM disk, if there is an image to serve.
+ *
+ * @retval 0       Success
+ * @retval -ENODEV No image linked into the kernel or loaded by the bootloader
+ */
+int
+ramdisk_init(void)
+{
+  if (_binary_obj_kernel_ramdisk_img_start != NULL) {
+    ramdisk.data = _binary_obj_kernel_ramdisk_img_start;
+    ramdisk.size = _binary_obj_kernel_ramdisk_img_end -
+                   _binary_obj_kernel_ramdisk_img_start;
+  } else if ((ramdisk.data = (uint8_t *) arch_initrd(&ramdisk.size)) == NULL) {
+    return -ENODEV;
+  }
+
+  dev_register_block(RAMDISK_MAJOR, &ramdisk_dev);
+
+  cprintf("RAM disk: %u KiB\n", ramdisk.size / 1024);
+
+  return 0;
+}
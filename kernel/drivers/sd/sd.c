@@ -1,13 +1,23 @@
 #include <kernel/assert.h>
+#include <kernel/core/tick.h>
 #include <kernel/drivers/sd.h>
 #include <kernel/fs/buf.h>
 #include <kernel/interrupt.h>
+#include <kernel/iostat.h>
 
 /*******************************************************************************
  * SD Card Driver
  *
- * The driver keeps the list of pending buffer requests in a queue, processing
- * them one at a time.
+ * The driver keeps the list of pending buffer requests in a queue sorted by
+ * the card address. Requests are served in one direction (C-SCAN), starting
+ * from the position of the previous transfer. Adjacent requests of the same
+ * kind are merged into one multi-block transfer, with each buffer receiving
+ * its part of the data.
+ *
+ * If the host controller supports DMA, the data of the whole run is moved by
+ * the DMA engine while the interrupt thread sleeps, otherwise the thread
+ * copies it through the controller FIFO. Controllers that can signal FIFO
+ * levels get one burst moved per interrupt, so the thread sleeps in between.
  * 
  * For details on SD card programming, see "SD Specifications. Part 1. Physical
  * Layer Simplified Specification. Version 1.10".
@@ -18,6 +28,7 @@ enum {
   CMD_GO_IDLE_STATE        = 0,
   CMD_ALL_SEND_CID         = 2,
   CMD_SEND_RELATIVE_ADDR   = 3,
+  CMD_SWITCH_FUNC          = 6,
   CMD_SELECT_CARD          = 7,
   CMD_SEND_IF_COND         = 8,
   CMD_STOP_TRANSMISSION    = 12,
@@ -30,6 +41,28 @@ enum {
   CMD_APP                  = 55,
 };
 
+// Application-specific commands, each preceded by CMD_APP
+enum {
+  ACMD_SET_BUS_WIDTH       = 6,
+};
+
+// SET_BUS_WIDTH argument values
+enum {
+  BUS_WIDTH_1              = 0,
+  BUS_WIDTH_4              = 2,
+};
+
+// SWITCH_FUNC arguments: set (or only check) the access mode in function
+// group 1, leaving the other groups unchanged
+#define SWITCH_FUNC_SET           (1U << 31)
+#define SWITCH_FUNC_HIGH_SPEED    0x00FFFFF1
+
+// The function status data block returned by SWITCH_FUNC
+#define SWITCH_STATUS_LENGTH      64
+#define SWITCH_STATUS_LENGTH_LOG  6
+// The byte holding the function selected in group 1 (bits 379:376)
+#define SWITCH_STATUS_GROUP1      16
+
 // OCR Register fields
 enum {
   OCR_VDD_MASK = (0xFFFF << 8), // VDD Voltage Window bitmask
@@ -37,7 +70,55 @@ enum {
 };
 
 static int  sd_irq_thread(int, void *);
-static void sd_start_transfer(struct SD *, struct Buf *);
+static void sd_start_transfer(struct SD *);
+static int  sd_fifo_transfer(struct SD *);
+
+// Try to switch the card to the high speed mode. Returns 1 on success.
+static int
+sd_switch_high_speed(struct SDOps *ops, void *ctx)
+{
+  uint8_t status[SWITCH_STATUS_LENGTH] __attribute__((aligned(4)));
+  int r;
+
+  ops->begin_transfer(ctx, SWITCH_STATUS_LENGTH, SWITCH_STATUS_LENGTH_LOG, 1);
+
+  // Version 1.00 cards do not know the command
+  if (ops->send_cmd(ctx, CMD_SWITCH_FUNC,
+                    SWITCH_FUNC_SET | SWITCH_FUNC_HIGH_SPEED,
+                    SD_RESPONSE_R1, NULL) != 0)
+    return 0;
+
+  r = ops->receive_data(ctx, status, sizeof(status));
+
+  // The transfer has been polled, clear the data end state as well
+  while (ops->data_end(ctx) == 0)
+    ;
+
+  return (r == 0) && ((status[SWITCH_STATUS_GROUP1] & 0xF) == 1);
+}
+
+// Negotiate the widest bus and the fastest clock supported by both the card
+// and the host. All SD memory cards support the 4-bit bus.
+static void
+sd_set_bus(struct SDOps *ops, void *ctx, uint32_t rca)
+{
+  unsigned width = 1;
+  uint32_t clock = SD_CLOCK_DEFAULT;
+
+  if (ops->set_bus == NULL)
+    return;
+
+  if ((ops->send_cmd(ctx, CMD_APP, rca, SD_RESPONSE_R1, NULL) == 0) &&
+      (ops->send_cmd(ctx, ACMD_SET_BUS_WIDTH, BUS_WIDTH_4, SD_RESPONSE_R1,
+                     NULL) == 0))
+    width = 4;
+
+  // The high speed timing is only valid with the 4-bit bus
+  if ((width == 4) && sd_switch_high_speed(ops, ctx))
+    clock = SD_CLOCK_HIGH_SPEED;
+
+  ops->set_bus(ctx, width, clock);
+}
 
 int
 sd_init(struct SD *sd, struct SDOps *ops, void *ctx, int irq)
@@ -67,11 +148,20 @@ sd_init(struct SD *sd, struct SDOps *ops, void *ctx, int irq)
   // Set the block length (512 bytes) for all I/O operations
   ops->send_cmd(ctx, CMD_SET_BLOCKLEN, SD_BLOCKLEN, SD_RESPONSE_R1, NULL);
 
+  // Leave the slow identification mode clock
+  sd_set_bus(ops, ctx, rca & 0xFFFF0000);
+
   sd->ops = ops;
   sd->ctx = ctx;
 
   // Initialize the buffer queue
   k_list_init(&sd->queue);
+  k_list_init(&sd->active);
+  sd->current  = &sd->active;
+  sd->offset   = 0;
+  sd->length   = 0;
+  sd->position = 0;
+  sd->dma      = 0;
   k_spinlock_init(&sd->lock, "sd_queue");
 
   // Enable interrupts
@@ -82,108 +172,264 @@ sd_init(struct SD *sd, struct SDOps *ops, void *ctx, int irq)
   return 0;
 }
 
+// The card address of the first byte of the buffer
+static inline uint32_t
+sd_buf_addr(struct Buf *buf)
+{
+  return buf->block_no * buf->block_size;
+}
+
+// Insert the buffer into the queue, keeping it sorted by the card address
+static void
+sd_queue_insert(struct SD *sd, struct Buf *buf)
+{
+  struct KListLink *l;
+
+  debug_assert(k_spinlock_holding(&sd->lock));
+
+  for (l = sd->queue.prev; l != &sd->queue; l = l->prev) {
+    struct Buf *b = KLIST_CONTAINER(l, struct Buf, queue_link);
+
+    if (sd_buf_addr(b) <= sd_buf_addr(buf))
+      break;
+  }
+
+  // Insert after l
+  buf->queue_link.prev = l;
+  buf->queue_link.next = l->next;
+  l->next->prev = &buf->queue_link;
+  l->next = &buf->queue_link;
+}
+
+/**
+ * Queue data transfer requests. buf_io_done() is called for each buffer when
+ * its transfer is completed.
+ *
+ * @param sd   The card
+ * @param bufs The buffers to be read (if invalid) or written (if dirty)
+ * @param n    The number of buffers
+ */
 void
-sd_request(struct SD *sd, struct Buf *buf)
+sd_request(struct SD *sd, struct Buf **bufs, unsigned n)
 {
-  if (buf->block_size % SD_BLOCKLEN != 0)
-    panic("block size must be a multiple of %u", SD_BLOCKLEN);
+  unsigned i;
 
   k_spinlock_acquire(&sd->lock);
 
-  // Add buffer to the queue.
-  k_list_add_back(&sd->queue, &buf->queue_link);
+  for (i = 0; i < n; i++) {
+    if (bufs[i]->block_size % SD_BLOCKLEN != 0)
+      panic("block size must be a multiple of %u", SD_BLOCKLEN);
 
-  // If the buffer is at the front of the queue, immediately send it to the
-  // hardware.
-  if (sd->queue.next == &buf->queue_link)
-    sd_start_transfer(sd, buf);
+    sd_queue_insert(sd, bufs[i]);
+    iostat_queue(&sd->stats, bufs[i]);
+  }
 
-  // Wait for the R/W operation to finish.
-  // TODO: deal with errors!
-  while ((buf->flags & (BUF_DIRTY | BUF_VALID)) != BUF_VALID)
-    k_waitqueue_sleep(&buf->wait_queue, &sd->lock);
+  // If the card is idle, immediately send the requests to the hardware.
+  if (k_list_is_empty(&sd->active))
+    sd_start_transfer(sd);
 
   k_spinlock_release(&sd->lock);
 }
 
-// Send the data transfer request to the hardware.
+// Move the next run of adjacent buffers from the queue to the active list and
+// send the data transfer request to the hardware.
 static void
-sd_start_transfer(struct SD *sd, struct Buf *buf)
+sd_start_transfer(struct SD *sd)
 {
-  uint32_t cmd, arg;
-  size_t nblocks;
+  struct KListLink *l;
+  struct Buf *buf, *next;
+  uint32_t cmd, arg, length;
+  unsigned n;
+  int write;
+
+  debug_assert(k_spinlock_holding(&sd->lock));
+  assert(k_list_is_empty(&sd->active));
+
+  if (k_list_is_empty(&sd->queue))
+    return;
+
+  // Continue from the current position, wrapping around to the lowest address
+  for (l = sd->queue.next; l != &sd->queue; l = l->next)
+    if (sd_buf_addr(KLIST_CONTAINER(l, struct Buf, queue_link)) >= sd->position)
+      break;
+  if (l == &sd->queue)
+    l = sd->queue.next;
+
+  buf    = KLIST_CONTAINER(l, struct Buf, queue_link);
+  write  = (buf->flags & BUF_DIRTY) != 0;
+  arg    = sd_buf_addr(buf);
+  length = 0;
+  n      = 0;
+
+  for (;;) {
+    assert(buf->block_size % SD_BLOCKLEN == 0);
+
+    l = buf->queue_link.next;
 
-  assert(k_spinlock_holding(&sd->lock));
-  assert(buf->queue_link.prev == &sd->queue);
-  assert(buf->block_size % SD_BLOCKLEN == 0);
+    k_list_remove(&buf->queue_link);
+    k_list_add_back(&sd->active, &buf->queue_link);
+    iostat_start(&sd->stats, buf, n > 0);
+    length += buf->block_size;
 
-  nblocks = buf->block_size / SD_BLOCKLEN;
+    sd->segments[n].data   = buf->data;
+    sd->segments[n].length = buf->block_size;
+    n++;
+
+    if (l == &sd->queue)
+      break;
+
+    next = KLIST_CONTAINER(l, struct Buf, queue_link);
+    if ((((next->flags & BUF_DIRTY) != 0) != write) ||
+        (sd_buf_addr(next) != arg + length) ||
+        (length + next->block_size > SD_MAX_TRANSFER))
+      break;
+
+    buf = next;
+  }
 
-  if (buf->flags & BUF_DIRTY) {
-    sd->ops->begin_transfer(sd->ctx, buf->block_size, 0);
-    cmd = (nblocks > 1) ? CMD_WRITE_MULTIPLE_BLOCK : CMD_WRITE_BLOCK;
+  // Fall back to the FIFO transfers if the buffers are not suitable for DMA
+  sd->dma = (sd->ops->dma_start != NULL) &&
+            (sd->ops->dma_start(sd->ctx, sd->segments, n, !write) == 0);
+
+  if (write) {
+    sd->ops->begin_transfer(sd->ctx, length, SD_BLOCKLEN_LOG, 0);
+    cmd = (length > SD_BLOCKLEN) ? CMD_WRITE_MULTIPLE_BLOCK : CMD_WRITE_BLOCK;
   } else {
-    sd->ops->begin_transfer(sd->ctx, buf->block_size, 1);
-    cmd = (nblocks > 1) ? CMD_READ_MULTIPLE_BLOCK : CMD_READ_SINGLE_BLOCK;
+    sd->ops->begin_transfer(sd->ctx, length, SD_BLOCKLEN_LOG, 1);
+    cmd = (length > SD_BLOCKLEN) ? CMD_READ_MULTIPLE_BLOCK : CMD_READ_SINGLE_BLOCK;
   }
 
-  arg = buf->block_no * buf->block_size;
+  sd->current    = sd->active.next;
+  sd->offset     = 0;
+  sd->start_time = k_tick_get();
+  sd->length     = length;
+  sd->position   = arg + length;
 
   if (sd->ops->send_cmd(sd->ctx, cmd, arg, SD_RESPONSE_R1, NULL) != 0)
     panic("error sending cmd %d, arg %d", cmd, arg);
 }
 
+// Move the data of the current run through the FIFO, starting where the
+// previous interrupt left off. Returns 1 when the whole run is complete, 0 if
+// the next interrupt has to be waited for.
+static int
+sd_fifo_transfer(struct SD *sd)
+{
+  struct Buf *buf;
+  int r;
+
+  debug_assert(k_spinlock_holding(&sd->lock));
+
+  while (sd->current != &sd->active) {
+    buf = KLIST_CONTAINER(sd->current, struct Buf, queue_link);
+
+    assert((buf->flags & (BUF_DIRTY | BUF_VALID)) != BUF_VALID);
+
+    if (buf->flags & BUF_DIRTY) {
+      r = sd->ops->fifo_send(sd->ctx, buf->data + sd->offset,
+                             buf->block_size - sd->offset);
+      if (r < 0)
+        panic("error writing block %d", buf->block_no);
+    } else {
+      r = sd->ops->fifo_receive(sd->ctx, buf->data + sd->offset,
+                                buf->block_size - sd->offset);
+      if (r < 0)
+        panic("error reading block %d", buf->block_no);
+    }
+
+    sd->offset += r;
+    if (sd->offset < buf->block_size)
+      return 0;
+
+    sd->current = sd->current->next;
+    sd->offset  = 0;
+  }
+
+  if ((r = sd->ops->data_end(sd->ctx)) < 0)
+    panic("data transfer error");
+
+  return r;
+}
+
 // Handle the SD card interrupts. Complete the current data transfer operation
-// and wake up the corresponding task.
+// and wake up the corresponding tasks.
 static int
 sd_irq_thread(int irq, void *arg)
 {
   struct SD *sd = (struct SD *) arg;
-  struct KListLink *link;
-  struct Buf *buf, *next_buf;
+  struct KListLink done, *link;
+  struct Buf *buf;
+  int r;
 
   (void) irq;
 
   k_spinlock_acquire(&sd->lock);
 
-  if (k_list_is_empty(&sd->queue))
+  if (k_list_is_empty(&sd->active))
     panic("queue is empty");
 
-  // Grab the first buffer in the queue to find out whether a read or write
-  // operation is happening
-  link = sd->queue.next;
-  k_list_remove(link);
-
-  buf = KLIST_CONTAINER(link, struct Buf, queue_link);
-
-  assert((buf->flags & (BUF_DIRTY | BUF_VALID)) != BUF_VALID);
-  assert(buf->block_size % SD_BLOCKLEN == 0);
-
-  // Transfer the data and update the corresponding buffer flags.
-  if (buf->flags & BUF_DIRTY) {
-    if (sd->ops->send_data(sd->ctx, buf->data, buf->block_size) != 0)
-      panic("error writing block %d", buf->block_no);
-    buf->flags &= ~BUF_DIRTY;
+  buf = KLIST_CONTAINER(sd->active.next, struct Buf, queue_link);
+
+  if (sd->dma) {
+    // The active list stays non-empty, so no other transfer can be started
+    // while the lock is released
+    k_spinlock_release(&sd->lock);
+    r = sd->ops->dma_wait(sd->ctx);
+    k_spinlock_acquire(&sd->lock);
+
+    if (r != 0)
+      panic("DMA error, starting block %d", buf->block_no);
+  } else if (sd->ops->fifo_receive != NULL) {
+    // Sleep until the FIFO needs attention again
+    if (!sd_fifo_transfer(sd)) {
+      k_spinlock_release(&sd->lock);
+      return 1;
+    }
   } else {
-    if (sd->ops->receive_data(sd->ctx, buf->data, buf->block_size) != 0)
-      panic("error reading block %d", buf->block_no);
-    buf->flags |= BUF_VALID;
+    // Transfer the data for each buffer of the run in turn.
+    for (link = sd->active.next; link != &sd->active; link = link->next) {
+      buf = KLIST_CONTAINER(link, struct Buf, queue_link);
+
+      assert((buf->flags & (BUF_DIRTY | BUF_VALID)) != BUF_VALID);
+
+      if (buf->flags & BUF_DIRTY) {
+        if (sd->ops->send_data(sd->ctx, buf->data, buf->block_size) != 0)
+          panic("error writing block %d", buf->block_no);
+      } else {
+        if (sd->ops->receive_data(sd->ctx, buf->data, buf->block_size) != 0)
+          panic("error reading block %d", buf->block_no);
+      }
+    }
   }
 
   // Multiple block transfers must be stopped manually by issuing CMD12.
-  if (buf->block_size > SD_BLOCKLEN)
+  if (sd->length > SD_BLOCKLEN)
     sd->ops->send_cmd(sd->ctx, CMD_STOP_TRANSMISSION, 0, SD_RESPONSE_R1B, NULL);
 
-  // Begin processing the next buffer in the queue.
-  if (!k_list_is_empty(&sd->queue)) {
-    next_buf = KLIST_CONTAINER(sd->queue.next, struct Buf, queue_link);
-    sd_start_transfer(sd, next_buf);
+  k_list_init(&done);
+  while (!k_list_is_empty(&sd->active)) {
+    link = sd->active.next;
+    k_list_remove(link);
+    k_list_add_back(&done, link);
+
+    iostat_done(&sd->stats, KLIST_CONTAINER(link, struct Buf, queue_link),
+                sd->start_time);
   }
+  iostat_busy(&sd->stats, sd->start_time);
 
-  // Resume the task waiting for the buf data.
-  k_waitqueue_wakeup_all(&buf->wait_queue);
+  // Begin processing the next buffers in the queue.
+  sd_start_transfer(sd);
 
   k_spinlock_release(&sd->lock);
 
+  // Report the completed buffers.
+  // TODO: deal with errors!
+  while (!k_list_is_empty(&done)) {
+    link = done.next;
+    k_list_remove(link);
+
+    buf_io_done(KLIST_CONTAINER(link, struct Buf, queue_link));
+  }
+
   return 1;
 }
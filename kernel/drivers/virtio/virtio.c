@@ -0,0 +1,401 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/drivers/virtio.h>
+#include <kernel/page.h>
+#include <kernel/types.h>
+
+/*******************************************************************************
+ * Virtio MMIO Transport
+ *
+ * Devices are discovered by probing the register windows the board provides
+ * for them. The virtqueues use the legacy layout, which also suits the modern
+ * devices: the descriptor table and the available ring share the first page,
+ * the used ring starts on the second one. The rings live in normal cacheable
+ * memory, the emulated devices are cache coherent.
+ ******************************************************************************/
+
+// MMIO registers, divided by 4 for use as uint32_t[] indicies
+#define MAGIC_VALUE         (0x000 / 4)   // "virt"
+#define   MAGIC               0x74726976
+#define VERSION             (0x004 / 4)   // Device version number
+#define DEVICE_ID           (0x008 / 4)   // Virtio subsystem device ID
+#define DEVICE_FEATURES     (0x010 / 4)   // Features supported by the device
+#define DEVICE_FEATURES_SEL (0x014 / 4)   // Device features word selection
+#define DRIVER_FEATURES     (0x020 / 4)   // Features activated by the driver
+#define DRIVER_FEATURES_SEL (0x024 / 4)   // Driver features word selection
+#define GUEST_PAGE_SIZE     (0x028 / 4)   // Guest page size (legacy)
+#define QUEUE_SEL           (0x030 / 4)   // Virtual queue index
+#define QUEUE_NUM_MAX       (0x034 / 4)   // Maximum virtual queue size
+#define QUEUE_NUM           (0x038 / 4)   // Virtual queue size
+#define QUEUE_ALIGN         (0x03C / 4)   // Used ring alignment (legacy)
+#define QUEUE_PFN           (0x040 / 4)   // Guest page number (legacy)
+#define QUEUE_READY         (0x044 / 4)   // Virtual queue ready bit
+#define QUEUE_NOTIFY        (0x050 / 4)   // Queue notifier
+#define INTERRUPT_STATUS    (0x060 / 4)   // Interrupt status
+#define INTERRUPT_ACK       (0x064 / 4)   // Interrupt acknowledge
+#define STATUS              (0x070 / 4)   // Device status
+#define   STATUS_ACKNOWLEDGE  (1U << 0)   //   The device has been noticed
+#define   STATUS_DRIVER       (1U << 1)   //   The driver knows how to drive it
+#define   STATUS_DRIVER_OK    (1U << 2)   //   The driver is ready
+#define   STATUS_FEATURES_OK  (1U << 3)   //   Feature negotiation complete
+#define   STATUS_FAILED       (1U << 7)   //   Something went wrong
+#define QUEUE_DESC_LOW      (0x080 / 4)   // Descriptor table address
+#define QUEUE_DESC_HIGH     (0x084 / 4)
+#define QUEUE_DRIVER_LOW    (0x090 / 4)   // Available ring address
+#define QUEUE_DRIVER_HIGH   (0x094 / 4)
+#define QUEUE_DEVICE_LOW    (0x0A0 / 4)   // Used ring address
+#define QUEUE_DEVICE_HIGH   (0x0A4 / 4)
+#define CONFIG              0x100         // Device configuration space
+
+// VIRTIO_F_VERSION_1 (feature bit 32), required from modern devices
+#define FEATURES_HI_VERSION_1 (1U << 0)
+
+// Ring flags
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  (1U << 0)
+#define VIRTQ_USED_F_NO_NOTIFY      (1U << 0)
+
+// The rings take two pages: one for the descriptors and the available ring,
+// one for the used ring
+#define VIRTQ_PAGE_ORDER    1
+
+/**
+ * Check whether there is a device behind an MMIO register window.
+ *
+ * @param dev  The device to be initialized
+ * @param base The register window (kernel virtual address)
+ * @param irq  The interrupt line of the window
+ *
+ * @return The device ID, or 0 if there is no device.
+ */
+int
+virtio_probe(struct VirtioDevice *dev, void *base, int irq)
+{
+  dev->base    = (volatile uint32_t *) base;
+  dev->irq     = irq;
+  dev->version = dev->base[VERSION];
+  dev->id      = 0;
+
+  if ((dev->base[MAGIC_VALUE] != MAGIC) ||
+      ((dev->version != 1) && (dev->version != 2)))
+    return 0;
+
+  // ID 0 is a placeholder for an unused window
+  dev->id = dev->base[DEVICE_ID];
+
+  return dev->id;
+}
+
+/**
+ * Reset the device and negotiate the features.
+ *
+ * @param dev            The device
+ * @param features       The device-specific features (bits 0 to 31) the
+ *                       driver can use
+ * @param features_store Where to store the features accepted by the device
+ *
+ * @retval 0       Success
+ * @retval -ENODEV The device did not accept the features
+ */
+int
+virtio_setup(struct VirtioDevice *dev, uint32_t features,
+             uint32_t *features_store)
+{
+  dev->base[STATUS] = 0;
+  dev->base[STATUS] |= STATUS_ACKNOWLEDGE;
+  dev->base[STATUS] |= STATUS_DRIVER;
+
+  dev->base[DEVICE_FEATURES_SEL] = 0;
+  features &= dev->base[DEVICE_FEATURES];
+
+  dev->base[DRIVER_FEATURES_SEL] = 0;
+  dev->base[DRIVER_FEATURES]     = features;
+
+  if (dev->version == 1) {
+    dev->base[GUEST_PAGE_SIZE] = PAGE_SIZE;
+  } else {
+    dev->base[DEVICE_FEATURES_SEL] = 1;
+    if (!(dev->base[DEVICE_FEATURES] & FEATURES_HI_VERSION_1)) {
+      dev->base[STATUS] |= STATUS_FAILED;
+      return -ENODEV;
+    }
+
+    dev->base[DRIVER_FEATURES_SEL] = 1;
+    dev->base[DRIVER_FEATURES]     = FEATURES_HI_VERSION_1;
+
+    dev->base[STATUS] |= STATUS_FEATURES_OK;
+    if (!(dev->base[STATUS] & STATUS_FEATURES_OK)) {
+      dev->base[STATUS] |= STATUS_FAILED;
+      return -ENODEV;
+    }
+  }
+
+  if (features_store != NULL)
+    *features_store = features;
+
+  return 0;
+}
+
+/**
+ * Allocate the rings of a virtqueue and pass them to the device.
+ *
+ * @param dev   The device
+ * @param vq    The virtqueue to be initialized
+ * @param index The queue number
+ *
+ * @retval 0       Success
+ * @retval -ENODEV The device has no such queue
+ * @retval -ENOMEM Out of memory
+ */
+int
+virtio_queue_init(struct VirtioDevice *dev, struct Virtq *vq, unsigned index)
+{
+  struct Page *page;
+  physaddr_t pa;
+  uint8_t *va;
+  unsigned i;
+
+  dev->base[QUEUE_SEL] = index;
+
+  if ((dev->version == 1) ? dev->base[QUEUE_PFN] : dev->base[QUEUE_READY])
+    return -ENODEV;
+  if (dev->base[QUEUE_NUM_MAX] == 0)
+    return -ENODEV;
+
+  if ((page = page_alloc_block(VIRTQ_PAGE_ORDER, PAGE_ALLOC_ZERO,
+                               PAGE_TAG_VIRTIO)) == NULL)
+    return -ENOMEM;
+  page->ref_count++;
+
+  pa = page2pa(page);
+  va = (uint8_t *) page2kva(page);
+
+  vq->index     = index;
+  vq->size      = MIN(dev->base[QUEUE_NUM_MAX], (uint32_t) VIRTQ_SIZE_MAX);
+  vq->desc      = (struct VirtqDesc *) va;
+  vq->avail     = (struct VirtqAvail *) (va + vq->size * sizeof(vq->desc[0]));
+  vq->used      = (struct VirtqUsed *) (va + PAGE_SIZE);
+  vq->free_head = 0;
+  vq->num_free  = vq->size;
+  vq->last_used = 0;
+
+  for (i = 0; i < vq->size; i++) {
+    vq->desc[i].next = i + 1;
+    vq->cookies[i]   = NULL;
+  }
+
+  dev->base[QUEUE_NUM] = vq->size;
+
+  if (dev->version == 1) {
+    dev->base[QUEUE_ALIGN] = PAGE_SIZE;
+    dev->base[QUEUE_PFN]   = pa >> PAGE_SHIFT;
+  } else {
+    dev->base[QUEUE_DESC_LOW]    = pa;
+    dev->base[QUEUE_DESC_HIGH]   = 0;
+    dev->base[QUEUE_DRIVER_LOW]  = pa + ((uint8_t *) vq->avail - va);
+    dev->base[QUEUE_DRIVER_HIGH] = 0;
+    dev->base[QUEUE_DEVICE_LOW]  = pa + PAGE_SIZE;
+    dev->base[QUEUE_DEVICE_HIGH] = 0;
+    dev->base[QUEUE_READY]       = 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Tell the device that the driver is ready.
+ *
+ * @param dev The device
+ */
+void
+virtio_ready(struct VirtioDevice *dev)
+{
+  dev->base[STATUS] |= STATUS_DRIVER_OK;
+}
+
+/**
+ * Acknowledge the device interrupt.
+ *
+ * @param dev The device
+ *
+ * @return The interrupt status (bit 0: used buffers, bit 1: configuration
+ *         change).
+ */
+uint32_t
+virtio_irq_ack(struct VirtioDevice *dev)
+{
+  uint32_t status = dev->base[INTERRUPT_STATUS];
+
+  dev->base[INTERRUPT_ACK] = status;
+
+  return status;
+}
+
+/**
+ * Read a byte from the device configuration space.
+ *
+ * @param dev    The device
+ * @param offset The offset into the configuration space
+ */
+uint8_t
+virtio_config_read8(struct VirtioDevice *dev, unsigned offset)
+{
+  return ((volatile uint8_t *) dev->base + CONFIG)[offset];
+}
+
+/**
+ * Read a 32-bit word from the device configuration space.
+ *
+ * @param dev    The device
+ * @param offset The offset into the configuration space, must be aligned
+ */
+uint32_t
+virtio_config_read32(struct VirtioDevice *dev, unsigned offset)
+{
+  return dev->base[(CONFIG + offset) / 4];
+}
+
+/**
+ * Make a descriptor chain available to the device. The chain always starts at
+ * vq->free_head, so the caller may set up the data pointed to by the chain
+ * for that head before calling this function.
+ *
+ * @param vq     The virtqueue
+ * @param segs   The segments of the chain
+ * @param n      The number of segments
+ * @param cookie The value virtq_get() returns once the chain is used
+ *
+ * @return The head descriptor, or -ENOSPC if there are not enough free
+ *         descriptors.
+ */
+int
+virtq_add(struct Virtq *vq, const struct VirtqSeg *segs, unsigned n,
+          void *cookie)
+{
+  uint16_t head, i;
+  unsigned k;
+
+  assert(n > 0);
+
+  if (vq->num_free < n)
+    return -ENOSPC;
+
+  head = i = vq->free_head;
+
+  for (k = 0; k < n; k++) {
+    struct VirtqDesc *desc = &vq->desc[i];
+
+    desc->addr  = segs[k].addr;
+    desc->len   = segs[k].len;
+    desc->flags = (segs[k].write ? VIRTQ_DESC_F_WRITE : 0) |
+                  ((k + 1 < n) ? VIRTQ_DESC_F_NEXT : 0);
+
+    // The last descriptor keeps pointing to the rest of the free list
+    if (k + 1 < n)
+      i = desc->next;
+  }
+
+  vq->free_head  = vq->desc[i].next;
+  vq->num_free  -= n;
+  vq->cookies[head] = cookie;
+
+  vq->avail->ring[vq->avail->idx % vq->size] = head;
+
+  // The entry must be visible before the index
+  __sync_synchronize();
+  vq->avail->idx++;
+
+  return head;
+}
+
+/**
+ * Notify the device about new available chains, unless it has asked not to.
+ *
+ * @param dev The device
+ * @param vq  The virtqueue
+ */
+void
+virtq_kick(struct VirtioDevice *dev, struct Virtq *vq)
+{
+  // The index must be visible before the flags are checked
+  __sync_synchronize();
+
+  if (!(*(volatile uint16_t *) &vq->used->flags & VIRTQ_USED_F_NO_NOTIFY))
+    dev->base[QUEUE_NOTIFY] = vq->index;
+}
+
+/**
+ * Check whether the device has used any chains not yet taken by virtq_get().
+ *
+ * @param vq The virtqueue
+ */
+int
+virtq_pending(struct Virtq *vq)
+{
+  return vq->last_used != *(volatile uint16_t *) &vq->used->idx;
+}
+
+/**
+ * Ask the device to interrupt (or not) when it uses chains of the queue. The
+ * device may ignore the request, so the interrupts can still arrive.
+ *
+ * @param vq     The virtqueue
+ * @param enable Whether the interrupts are wanted
+ */
+void
+virtq_irq_enable(struct Virtq *vq, int enable)
+{
+  if (enable)
+    vq->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+  else
+    vq->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+  __sync_synchronize();
+}
+
+/**
+ * Take the next chain used by the device and put its descriptors back on the
+ * free list.
+ *
+ * @param vq        The virtqueue
+ * @param len_store Where to store the number of bytes the device wrote, may
+ *                  be NULL
+ *
+ * @return The cookie passed to virtq_add(), or NULL if no chain has been used.
+ */
+void *
+virtq_get(struct Virtq *vq, uint32_t *len_store)
+{
+  struct VirtqUsedElem *elem;
+  uint16_t head, i;
+  void *cookie;
+
+  if (!virtq_pending(vq))
+    return NULL;
+
+  // Read the entry only after the index
+  __sync_synchronize();
+
+  elem = &vq->used->ring[vq->last_used % vq->size];
+  head = elem->id;
+
+  assert(head < vq->size);
+
+  if (len_store != NULL)
+    *len_store = elem->len;
+
+  for (i = head; vq->desc[i].flags & VIRTQ_DESC_F_NEXT; i = vq->desc[i].next)
+    vq->num_free++;
+  vq->num_free++;
+
+  vq->desc[i].next = vq->free_head;
+  vq->free_head    = head;
+
+  cookie = vq->cookies[head];
+  vq->cookies[head] = NULL;
+
+  vq->last_used++;
+
+  return cookie;
+}
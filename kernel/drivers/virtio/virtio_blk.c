@@ -0,0 +1,203 @@
+#include <kernel/assert.h>
+#include <errno.h>
+
+#include <kernel/console.h>
+#include <kernel/core/list.h>
+#include <kernel/core/tick.h>
+#include <kernel/drivers/virtio.h>
+#include <kernel/fs/buf.h>
+#include <kernel/interrupt.h>
+#include <kernel/iostat.h>
+#include <kernel/types.h>
+
+/*******************************************************************************
+ * Virtio Block Device Driver
+ *
+ * Each request is a chain of a header, the data of one or more buffers and a
+ * status byte. The I/O scheduler passes runs of adjacent buffers, which are
+ * merged into one request, and never more buffers than the queue can take, so
+ * the requests go straight to the device. Several of them are in flight at
+ * once, and the device may complete them in any order.
+ ******************************************************************************/
+
+// Request types
+#define VIRTIO_BLK_T_IN     0
+#define VIRTIO_BLK_T_OUT    1
+
+// Request status values
+#define VIRTIO_BLK_S_OK     0
+
+#define VIRTIO_BLK_SECTOR   512
+
+// Configuration space: the capacity, in sectors (64-bit)
+#define CONFIG_CAPACITY     0x00
+
+// The header, the data and the status
+#define REQ_DESCS(nbufs)    ((nbufs) + 2)
+
+static int virtio_blk_irq_thread(int, void *);
+
+/**
+ * Initialize the driver, if there is a block device behind the window.
+ *
+ * @param blk  The driver instance
+ * @param base The register window
+ * @param irq  The interrupt line
+ *
+ * @retval 0       Success
+ * @retval -ENODEV No block device
+ * @retval -ENOMEM Out of memory
+ */
+int
+virtio_blk_init(struct VirtioBlk *blk, void *base, int irq)
+{
+  uint32_t capacity;
+  int r;
+
+  if (virtio_probe(&blk->dev, base, irq) != VIRTIO_ID_BLOCK)
+    return -ENODEV;
+
+  if ((r = virtio_setup(&blk->dev, 0, NULL)) != 0)
+    return r;
+  if ((r = virtio_queue_init(&blk->dev, &blk->vq, 0)) != 0)
+    return r;
+
+  k_spinlock_init(&blk->lock, "virtio_blk");
+
+  // Enough for every buffer to be a request of its own
+  blk->depth      = blk->vq.size / REQ_DESCS(1);
+  blk->active     = 0;
+  blk->busy_start = 0;
+
+  interrupt_attach_thread(irq, virtio_blk_irq_thread, blk);
+
+  virtio_ready(&blk->dev);
+
+  // Ignore the high word, the disks are much smaller than 2 TiB
+  capacity = virtio_config_read32(&blk->dev, CONFIG_CAPACITY);
+  cprintf("virtio-blk: %u MiB\n", capacity / (1024 * 1024 / VIRTIO_BLK_SECTOR));
+
+  return 0;
+}
+
+/**
+ * Send data transfer requests to the device. buf_io_done() is called for each
+ * buffer when its transfer is completed.
+ *
+ * @param blk  The driver instance
+ * @param bufs The buffers to be read (if invalid) or written (if dirty)
+ * @param n    The number of buffers, at most blk->depth may be in flight
+ */
+void
+virtio_blk_request(struct VirtioBlk *blk, struct Buf **bufs, unsigned n)
+{
+  struct VirtqSeg segs[REQ_DESCS(VIRTIO_BLK_SEGS_MAX)];
+  unsigned i, j;
+
+  k_spinlock_acquire(&blk->lock);
+
+  for (i = 0; i < n; i++) {
+    if (bufs[i]->block_size % VIRTIO_BLK_SECTOR != 0)
+      panic("block size must be a multiple of %u", VIRTIO_BLK_SECTOR);
+    iostat_queue(&blk->stats, bufs[i]);
+  }
+
+  for (i = 0; i < n; i += j) {
+    struct VirtioBlkReq *req = &blk->reqs[blk->vq.free_head];
+    int write = (bufs[i]->flags & BUF_DIRTY) != 0;
+    uint64_t next;
+
+    req->type       = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    req->reserved   = 0;
+    req->sector     = (uint64_t) bufs[i]->block_no * bufs[i]->block_size /
+                      VIRTIO_BLK_SECTOR;
+    req->status     = 0xFF;
+    req->start_time = k_tick_get();
+
+    segs[0].addr  = KVA2PA(req);
+    segs[0].len   = sizeof(req->type) + sizeof(req->reserved) +
+                    sizeof(req->sector);
+    segs[0].write = 0;
+
+    // Take the following buffers that continue the same transfer
+    next = req->sector;
+    for (j = 0; (i + j < n) && (j < VIRTIO_BLK_SEGS_MAX); j++) {
+      struct Buf *buf = bufs[i + j];
+
+      if ((((buf->flags & BUF_DIRTY) != 0) != write) ||
+          ((uint64_t) buf->block_no * buf->block_size / VIRTIO_BLK_SECTOR !=
+           next))
+        break;
+
+      req->bufs[j] = buf;
+      iostat_start(&blk->stats, buf, j > 0);
+
+      segs[j + 1].addr  = KVA2PA(buf->data);
+      segs[j + 1].len   = buf->block_size;
+      segs[j + 1].write = !write;
+
+      next += buf->block_size / VIRTIO_BLK_SECTOR;
+    }
+    req->nbufs = j;
+
+    segs[j + 1].addr  = KVA2PA(&req->status);
+    segs[j + 1].len   = sizeof(req->status);
+    segs[j + 1].write = 1;
+
+    if (virtq_add(&blk->vq, segs, REQ_DESCS(j), req) < 0)
+      panic("too many requests");
+
+    if (blk->active++ == 0)
+      blk->busy_start = req->start_time;
+  }
+
+  virtq_kick(&blk->dev, &blk->vq);
+
+  k_spinlock_release(&blk->lock);
+}
+
+// Handle the device interrupts. Collect the completed requests and wake up
+// the corresponding tasks.
+static int
+virtio_blk_irq_thread(int irq, void *arg)
+{
+  struct VirtioBlk *blk = (struct VirtioBlk *) arg;
+  struct VirtioBlkReq *req;
+  struct KListLink done, *link;
+  unsigned i;
+
+  (void) irq;
+
+  virtio_irq_ack(&blk->dev);
+
+  k_list_init(&done);
+
+  k_spinlock_acquire(&blk->lock);
+
+  while ((req = (struct VirtioBlkReq *) virtq_get(&blk->vq, NULL)) != NULL) {
+    if (req->status != VIRTIO_BLK_S_OK)
+      panic("I/O error %d, starting block %d", req->status,
+            req->bufs[0]->block_no);
+
+    for (i = 0; i < req->nbufs; i++) {
+      iostat_done(&blk->stats, req->bufs[i], req->start_time);
+      k_list_add_back(&done, &req->bufs[i]->queue_link);
+    }
+
+    assert(blk->active > 0);
+    if (--blk->active == 0)
+      iostat_busy(&blk->stats, blk->busy_start);
+  }
+
+  k_spinlock_release(&blk->lock);
+
+  // Report the completed buffers.
+  while (!k_list_is_empty(&done)) {
+    link = done.next;
+    k_list_remove(link);
+
+    buf_io_done(KLIST_CONTAINER(link, struct Buf, queue_link));
+  }
+
+  return 1;
+}
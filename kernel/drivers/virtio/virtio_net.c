@@ -0,0 +1,329 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/drivers/virtio.h>
+#include <kernel/interrupt.h>
+#include <kernel/net.h>
+#include <kernel/types.h>
+
+#include <lwip/pbuf.h>
+
+/*******************************************************************************
+ * Virtio Network Device Driver
+ *
+ * Receive buffers come from the network stack (see net_rx_buffer_alloc()),
+ * each one posted with a separate descriptor for the virtio header, so the
+ * frames are passed up without copying. Reception works in the NAPI style,
+ * like the LAN9118 driver: the interrupt suppresses itself and schedules a
+ * poll in the lwIP thread, which takes a limited number of frames at a time
+ * and refills the queue. The stack is initialized after the driver, so the
+ * first poll is scheduled by the first transmitted frame.
+ *
+ * Transmitted frames are passed as the chain of the header followed by each
+ * pbuf of the frame. The pbufs are referenced until the device has used them.
+ ******************************************************************************/
+
+// Feature bits
+#define VIRTIO_NET_F_MAC      (1U << 5)   // The device has a MAC address
+
+// Configuration space: the MAC address (6 bytes)
+#define CONFIG_MAC            0x00
+
+// Queue numbers
+#define RX_QUEUE              0
+#define TX_QUEUE              1
+
+// Header sizes, the legacy devices do not have the num_buffers field
+#define HDR_LEN_LEGACY        10
+#define HDR_LEN               12
+
+// Used by the stack (see net.c)
+extern uint8_t mac_addr[6];
+
+static int  virtio_net_irq_thread(int, void *);
+static void virtio_net_rx_poll(void *);
+
+/**
+ * Initialize the driver, if there is a network device behind the window.
+ *
+ * @param net  The driver instance
+ * @param base The register window
+ * @param irq  The interrupt line
+ *
+ * @retval 0       Success
+ * @retval -ENODEV No network device
+ * @retval -ENOMEM Out of memory
+ */
+int
+virtio_net_init(struct VirtioNet *net, void *base, int irq)
+{
+  uint32_t features;
+  unsigned i;
+  int r;
+
+  if (virtio_probe(&net->dev, base, irq) != VIRTIO_ID_NET)
+    return -ENODEV;
+
+  if ((r = virtio_setup(&net->dev, VIRTIO_NET_F_MAC, &features)) != 0)
+    return r;
+  if ((r = virtio_queue_init(&net->dev, &net->rx, RX_QUEUE)) != 0)
+    return r;
+  if ((r = virtio_queue_init(&net->dev, &net->tx, TX_QUEUE)) != 0)
+    return r;
+
+  k_spinlock_init(&net->lock, "virtio_net");
+  memset(&net->tx_hdr, 0, sizeof(net->tx_hdr));
+  memset(&net->stats, 0, sizeof(net->stats));
+
+  net->hdr_len    = (net->dev.version == 1) ? HDR_LEN_LEGACY : HDR_LEN;
+  net->rx_posted  = 0;
+  net->rx_polling = 0;
+
+  if (features & VIRTIO_NET_F_MAC) {
+    for (i = 0; i < sizeof(mac_addr); i++)
+      mac_addr[i] = virtio_config_read8(&net->dev, CONFIG_MAC + i);
+  } else {
+    // The default address used by QEMU, locally administered
+    static const uint8_t default_mac[] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+    memcpy(mac_addr, default_mac, sizeof(mac_addr));
+  }
+
+  interrupt_attach_thread(irq, virtio_net_irq_thread, net);
+
+  virtio_ready(&net->dev);
+
+  return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Receive
+ * ----------------------------------------------------------------------------
+ */
+
+// Post receive buffers until there are enough of them or the stack runs out,
+// runs in the lwIP thread
+static void
+virtio_net_rx_fill(struct VirtioNet *net)
+{
+  unsigned posted = net->rx_posted;
+
+  while ((net->rx_posted < VIRTIO_NET_RX_BUFS) && (net->rx.num_free >= 2)) {
+    struct VirtqSeg segs[2];
+    void *data;
+
+    if ((data = net_rx_buffer_alloc()) == NULL)
+      break;
+
+    segs[0].addr  = KVA2PA(&net->rx_hdrs[net->rx.free_head]);
+    segs[0].len   = net->hdr_len;
+    segs[0].write = 1;
+    segs[1].addr  = KVA2PA(data);
+    segs[1].len   = NET_RX_BUFFER_SIZE;
+    segs[1].write = 1;
+
+    if (virtq_add(&net->rx, segs, 2, data) < 0)
+      panic("no descriptors");
+
+    net->rx_posted++;
+  }
+
+  if (net->rx_posted != posted)
+    virtq_kick(&net->dev, &net->rx);
+}
+
+// Receive up to budget frames, return the number of frames taken from the
+// queue
+static unsigned
+virtio_net_rx(struct VirtioNet *net, unsigned budget)
+{
+  unsigned count;
+
+  for (count = 0; count < budget; count++) {
+    uint32_t len;
+    void *data;
+
+    if ((data = virtq_get(&net->rx, &len)) == NULL)
+      break;
+
+    net->rx_posted--;
+
+    if ((len <= net->hdr_len) || (len > net->hdr_len + NET_RX_BUFFER_SIZE)) {
+      net->stats.rx_errors++;
+      net_rx_buffer_free(data);
+    } else {
+      net_rx_buffer_input(data, len - net->hdr_len);
+      net->stats.rx_frames++;
+    }
+  }
+
+  return count;
+}
+
+// Schedule a poll unless there is one already
+static int
+virtio_net_rx_schedule(struct VirtioNet *net)
+{
+  if (!__sync_bool_compare_and_swap(&net->rx_polling, 0, 1))
+    return 0;
+
+  virtq_irq_enable(&net->rx, 0);
+
+  if (net_rx_poll_schedule(virtio_net_rx_poll, net) != 0) {
+    // Try again on the next interrupt
+    virtq_irq_enable(&net->rx, 1);
+    __sync_lock_release(&net->rx_polling);
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+// Switch reception back to interrupts. A frame that arrived after the last
+// check may not have raised one, so look at the queue once more.
+static void
+virtio_net_rx_irq_enable(struct VirtioNet *net)
+{
+  virtq_irq_enable(&net->rx, 1);
+  __sync_lock_release(&net->rx_polling);
+
+  if (virtq_pending(&net->rx))
+    virtio_net_rx_schedule(net);
+}
+
+// Runs in the lwIP thread
+static void
+virtio_net_rx_poll(void *arg)
+{
+  struct VirtioNet *net = (struct VirtioNet *) arg;
+  unsigned count;
+
+  count = virtio_net_rx(net, VIRTIO_NET_RX_BUDGET);
+  virtio_net_rx_fill(net);
+
+  // The budget is used up, so there are probably more frames to come
+  if ((count == VIRTIO_NET_RX_BUDGET) &&
+      (net_rx_poll_schedule(virtio_net_rx_poll, net) == 0))
+    return;
+
+  virtio_net_rx_irq_enable(net);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Transmit
+ * ----------------------------------------------------------------------------
+ */
+
+// Release the frames the device is done with
+static void
+virtio_net_tx_reclaim(struct VirtioNet *net)
+{
+  struct pbuf *p;
+
+  while ((p = (struct pbuf *) virtq_get(&net->tx, NULL)) != NULL)
+    pbuf_free(p);
+}
+
+/**
+ * Transmit a frame.
+ *
+ * The driver takes a reference to the pbuf chain until the device has sent
+ * the frame.
+ *
+ * @param net The driver instance
+ * @param p   The pbuf chain holding the frame
+ *
+ * @retval 0        Success
+ * @retval -ENOBUFS The TX queue is full
+ */
+int
+virtio_net_write(struct VirtioNet *net, struct pbuf *p)
+{
+  struct VirtqSeg segs[VIRTIO_NET_TX_SEGS_MAX];
+  struct pbuf *q;
+  unsigned n;
+  size_t left;
+  int r = 0;
+
+  // The stack is up by now, so the receive buffers can be posted
+  if (net->rx_posted == 0)
+    virtio_net_rx_schedule(net);
+
+  segs[0].addr  = KVA2PA(&net->tx_hdr);
+  segs[0].len   = net->hdr_len;
+  segs[0].write = 0;
+  n = 1;
+
+  for (q = p, left = p->tot_len; (q != NULL) && (left > 0); q = q->next) {
+    if (q->len == 0)
+      continue;
+
+    if (n == VIRTIO_NET_TX_SEGS_MAX) {
+      k_spinlock_acquire(&net->lock);
+      net->stats.tx_errors++;
+      k_spinlock_release(&net->lock);
+      return -ENOBUFS;
+    }
+
+    segs[n].addr  = KVA2PA(q->payload);
+    segs[n].len   = q->len;
+    segs[n].write = 0;
+    n++;
+
+    left -= q->len;
+  }
+
+  k_spinlock_acquire(&net->lock);
+
+  virtio_net_tx_reclaim(net);
+
+  if (virtq_add(&net->tx, segs, n, p) >= 0) {
+    pbuf_ref(p);
+    virtq_kick(&net->dev, &net->tx);
+    net->stats.tx_frames++;
+  } else {
+    net->stats.tx_dropped++;
+    r = -ENOBUFS;
+  }
+
+  k_spinlock_release(&net->lock);
+
+  return r;
+}
+
+/**
+ * Get a snapshot of the driver counters.
+ *
+ * @param net   The driver instance
+ * @param stats Where to store the counters
+ */
+void
+virtio_net_stats(struct VirtioNet *net, struct NetIfStats *stats)
+{
+  k_spinlock_acquire(&net->lock);
+  *stats = net->stats;
+  k_spinlock_release(&net->lock);
+}
+
+static int
+virtio_net_irq_thread(int irq, void *arg)
+{
+  struct VirtioNet *net = (struct VirtioNet *) arg;
+
+  (void) irq;
+
+  // Acknowledge first, so that any later events raise a new interrupt
+  virtio_irq_ack(&net->dev);
+
+  if (virtq_pending(&net->rx))
+    virtio_net_rx_schedule(net);
+
+  k_spinlock_acquire(&net->lock);
+  virtio_net_tx_reclaim(net);
+  k_spinlock_release(&net->lock);
+
+  return 1;
+}
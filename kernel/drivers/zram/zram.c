@@ -0,0 +1,233 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/dev.h>
+#include <kernel/drivers/zram.h>
+#include <kernel/fs/buf.h>
+#include <kernel/lz4.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/spinlock.h>
+#include <kernel/types.h>
+#include <kernel/vmalloc.h>
+
+/*******************************************************************************
+ * Compressed RAM Disk Driver
+ *
+ * Serves block requests from memory, keeping each page of the disk compressed
+ * with LZ4 in a separate k_malloc() allocation. Pages that do not shrink below
+ * ZRAM_MAX_SIZE are stored as they are, pages filled with zeros (including the
+ * ones never written) take no memory at all. The disk is meant as a swap area
+ * that trades CPU time for I/O (see SWAP_ZRAM in kernel.mk). Requests are
+ * completed right away, and a single lock serializes them, since they all
+ * share the scratch buffers.
+ ******************************************************************************/
+
+#ifndef ZRAM_BLOCKS
+#define ZRAM_BLOCKS   0
+#endif
+
+// Compressed pages larger than this are stored uncompressed
+#define ZRAM_MAX_SIZE (PAGE_SIZE * 3 / 4)
+
+struct ZramPage {
+  void    *data;    ///< Stored data, or NULL if the page is all zeros
+  uint16_t size;    ///< The size of the data, PAGE_SIZE if uncompressed
+};
+
+static struct {
+  struct KSpinLock  lock;
+  struct ZramPage  *pages;
+  unsigned long     npages;
+  unsigned long     used;
+  unsigned long     zero;
+  unsigned long     raw;
+  unsigned long     bytes;
+  // Scratch buffers, protected by the lock
+  uint8_t           page[PAGE_SIZE];
+  uint8_t           out[PAGE_SIZE];
+  uint16_t          table[LZ4_HASH_SIZE];
+} zram = {
+  .lock = K_SPINLOCK_INITIALIZER("zram"),
+};
+
+static int
+zram_is_zero(const uint8_t *data)
+{
+  const unsigned long *p = (const unsigned long *) data;
+  size_t i;
+
+  for (i = 0; i < PAGE_SIZE / sizeof(*p); i++)
+    if (p[i] != 0)
+      return 0;
+  return 1;
+}
+
+static void
+zram_page_free(struct ZramPage *zp)
+{
+  if (zp->data != NULL) {
+    zram.used--;
+    zram.bytes -= zp->size;
+    if (zp->size == PAGE_SIZE)
+      zram.raw--;
+    k_free(zp->data);
+    zp->data = NULL;
+  } else if (zp->size != 0) {
+    zram.zero--;
+  }
+  zp->size = 0;
+}
+
+static void
+zram_page_read(struct ZramPage *zp, uint8_t *dst)
+{
+  if (zp->data == NULL) {
+    memset(dst, 0, PAGE_SIZE);
+  } else if (zp->size == PAGE_SIZE) {
+    memmove(dst, zp->data, PAGE_SIZE);
+  } else if (lz4_decompress(zp->data, zp->size, dst, PAGE_SIZE) != PAGE_SIZE) {
+    panic("corrupted compressed page");
+  }
+}
+
+static void
+zram_page_write(struct ZramPage *zp, const uint8_t *src)
+{
+  const void *data;
+  void *copy;
+  size_t size;
+
+  zram_page_free(zp);
+
+  if (zram_is_zero(src)) {
+    // Zero pages are told from the never written ones only for the stats
+    zp->size = 1;
+    zram.zero++;
+    return;
+  }
+
+  size = lz4_compress(src, PAGE_SIZE, zram.out, ZRAM_MAX_SIZE, zram.table);
+  if (size == 0) {
+    data = src;
+    size = PAGE_SIZE;
+  } else {
+    data = zram.out;
+  }
+
+  if ((copy = k_malloc(size)) == NULL) {
+    // There is no way to report an error, the page reads back as zeros
+    warn("out of memory storing a compressed page");
+    return;
+  }
+
+  memmove(copy, data, size);
+  zp->data = copy;
+  zp->size = size;
+
+  zram.used++;
+  zram.bytes += size;
+  if (size == PAGE_SIZE)
+    zram.raw++;
+}
+
+static void
+zram_transfer(struct Buf *buf)
+{
+  unsigned long long off = (unsigned long long) buf->block_no * buf->block_size;
+  size_t done;
+
+  if ((off >= zram.npages * PAGE_SIZE) ||
+      (buf->block_size > zram.npages * PAGE_SIZE - off)) {
+    warn("block %lu beyond the end of the compressed RAM disk", buf->block_no);
+    if (!(buf->flags & BUF_DIRTY))
+      memset(buf->data, 0, buf->block_size);
+    return;
+  }
+
+  // A block may cover several pages, or only a part of one
+  for (done = 0; done < buf->block_size; ) {
+    struct ZramPage *zp = &zram.pages[(off + done) / PAGE_SIZE];
+    size_t page_off = (off + done) % PAGE_SIZE;
+    size_t n = MIN(PAGE_SIZE - page_off, buf->block_size - done);
+
+    if (!(buf->flags & BUF_DIRTY)) {
+      zram_page_read(zp, zram.page);
+      memmove(buf->data + done, zram.page + page_off, n);
+    } else if (n == PAGE_SIZE) {
+      zram_page_write(zp, buf->data + done);
+    } else {
+      zram_page_read(zp, zram.page);
+      memmove(zram.page + page_off, buf->data + done, n);
+      zram_page_write(zp, zram.page);
+    }
+
+    done += n;
+  }
+}
+
+static void
+zram_request(struct Buf **bufs, unsigned n)
+{
+  unsigned i;
+
+  for (i = 0; i < n; i++) {
+    k_spinlock_acquire(&zram.lock);
+    zram_transfer(bufs[i]);
+    k_spinlock_release(&zram.lock);
+
+    buf_io_done(bufs[i]);
+  }
+}
+
+static struct BlockDev zram_dev = {
+  .request = zram_request,
+};
+
+/**
+ * Register the compressed RAM disk, unless disabled at build time.
+ *
+ * @retval 0       Success
+ * @retval -ENODEV Built with ZRAM_BLOCKS=0
+ * @retval -ENOMEM Not enough memory for the page table
+ */
+int
+zram_init(void)
+{
+  if (ZRAM_BLOCKS == 0)
+    return -ENODEV;
+
+  zram.pages = (struct ZramPage *) vmalloc(ZRAM_BLOCKS * sizeof(zram.pages[0]),
+                                           PAGE_ALLOC_ZERO);
+  if (zram.pages == NULL)
+    return -ENOMEM;
+  zram.npages = ZRAM_BLOCKS;
+
+  dev_register_block(ZRAM_MAJOR, &zram_dev);
+
+  cprintf("Compressed RAM disk: %u KiB\n", ZRAM_BLOCKS * PAGE_SIZE / 1024);
+
+  return 0;
+}
+
+/**
+ * Get the compressed RAM disk usage statistics.
+ *
+ * @param stats Pointer to the structure to store the statistics into
+ */
+void
+zram_get_stats(struct ZramStats *stats)
+{
+  k_spinlock_acquire(&zram.lock);
+
+  stats->total = zram.npages;
+  stats->used  = zram.used;
+  stats->zero  = zram.zero;
+  stats->raw   = zram.raw;
+  stats->bytes = zram.bytes;
+
+  k_spinlock_release(&zram.lock);
+}
@@ -0,0 +1,458 @@
+#include <errno.h>
+#include <fcntl.h>
+
+#include <kernel/core/tick.h>
+#include <kernel/console.h>
+#include <kernel/epoll.h>
+#include <kernel/fd.h>
+#include <kernel/fs/file.h>
+#include <kernel/mutex.h>
+#include <kernel/object_pool.h>
+#include <kernel/process.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Event polling
+ * ----------------------------------------------------------------------------
+ *
+ * The item lists (of both sets and files) and the item fields are protected
+ * by a single mutex, which is also held while the events of ready items are
+ * being collected, so that the items and their files stay alive even though
+ * no file references are taken. The ready lists are modified by the poll
+ * entry callbacks and are therefore protected by the per-set spinlocks.
+ *
+ * The items do not keep the watched files open. Instead, when the last
+ * reference to a file is dropped, file_put() calls epoll_file_release() to
+ * remove the file from all sets.
+ *
+ * Epoll files cannot be added to other sets, which rules out loops.
+ */
+
+#define EPOLL_FLAGS   (EPOLLET | EPOLLONESHOT)
+
+static struct KObjectPool *epoll_cache;
+static struct KObjectPool *epoll_item_cache;
+static struct KMutex epoll_mutex;
+
+void
+epoll_init(void)
+{
+  epoll_cache = k_object_pool_create("epoll", sizeof(struct Epoll), 0,
+                                     NULL, NULL);
+  if (epoll_cache == NULL)
+    panic("cannot allocate epoll cache");
+
+  epoll_item_cache = k_object_pool_create("epoll_item", sizeof(struct EpollItem),
+                                          0, NULL, NULL);
+  if (epoll_item_cache == NULL)
+    panic("cannot allocate epoll item cache");
+
+  k_mutex_init(&epoll_mutex, "epoll");
+}
+
+/**
+ * Create a new empty epoll set.
+ *
+ * @param fstore Pointer to the memory location to store the new file
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ */
+int
+epoll_open(struct File **fstore)
+{
+  struct Epoll *ep;
+  struct File *f;
+  int r;
+
+  if ((ep = (struct Epoll *) k_object_pool_get(epoll_cache)) == NULL)
+    return -ENOMEM;
+
+  if ((r = file_alloc(&f)) < 0) {
+    k_object_pool_put(epoll_cache, ep);
+    return r;
+  }
+
+  k_spinlock_init(&ep->lock, "epoll");
+  k_list_init(&ep->items);
+  k_list_init(&ep->ready);
+  k_waitqueue_init(&ep->queue);
+  poll_queue_init(&ep->poll_queue);
+
+  f->type  = FD_EPOLL;
+  f->epoll = ep;
+  f->flags = O_RDONLY;
+  f->ref_count++;
+
+  *fstore = f;
+
+  return 0;
+}
+
+// Put the item on the ready list and wake up the waiters
+static void
+epoll_item_ready(struct EpollItem *item)
+{
+  struct Epoll *ep = item->epoll;
+
+  k_spinlock_acquire(&ep->lock);
+
+  if (k_list_is_null(&item->ready_link)) {
+    k_list_add_back(&ep->ready, &item->ready_link);
+    k_waitqueue_wakeup_all(&ep->queue);
+  }
+
+  k_spinlock_release(&ep->lock);
+
+  poll_queue_notify(&ep->poll_queue, POLLIN);
+}
+
+static void
+epoll_item_notify(struct PollEntry *entry, int events)
+{
+  struct EpollItem *item = (struct EpollItem *) entry;
+
+  if (events & (item->events | EPOLLERR | EPOLLHUP) & ~EPOLL_FLAGS) {
+    // A one-shot item stays disabled until it is modified
+    if (item->events & ~EPOLL_FLAGS)
+      epoll_item_ready(item);
+  }
+}
+
+// Check the item state and queue it if there are pending events. The caller
+// must be holding epoll_mutex.
+static void
+epoll_item_check(struct EpollItem *item, struct PollEntry *entry)
+{
+  int revents;
+
+  revents = file_poll(item->file, entry);
+
+  if ((revents & (item->events | EPOLLERR | EPOLLHUP) & ~EPOLL_FLAGS) &&
+      (item->events & ~EPOLL_FLAGS))
+    epoll_item_ready(item);
+}
+
+// Remove the item from its set. The caller must be holding epoll_mutex.
+static void
+epoll_item_free(struct EpollItem *item)
+{
+  struct Epoll *ep = item->epoll;
+
+  poll_entry_remove(&item->entry);
+
+  k_spinlock_acquire(&ep->lock);
+  if (!k_list_is_null(&item->ready_link))
+    k_list_remove(&item->ready_link);
+  k_spinlock_release(&ep->lock);
+
+  k_list_remove(&item->epoll_link);
+  k_list_remove(&item->file_link);
+
+  k_object_pool_put(epoll_item_cache, item);
+}
+
+// Find the item watching the file. The caller must be holding epoll_mutex.
+static struct EpollItem *
+epoll_item_lookup(struct Epoll *ep, struct File *file)
+{
+  struct KListLink *l;
+
+  KLIST_FOREACH(&file->epoll_items, l) {
+    struct EpollItem *item = KLIST_CONTAINER(l, struct EpollItem, file_link);
+
+    if (item->epoll == ep)
+      return item;
+  }
+
+  return NULL;
+}
+
+/**
+ * Destroy the epoll set when the last reference to its file is dropped.
+ *
+ * @param file The epoll file
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+epoll_close(struct File *file)
+{
+  struct Epoll *ep = file->epoll;
+
+  if (file->type != FD_EPOLL)
+    return -EBADF;
+
+  k_mutex_lock(&epoll_mutex);
+
+  while (!k_list_is_empty(&ep->items))
+    epoll_item_free(KLIST_CONTAINER(ep->items.next, struct EpollItem,
+                                    epoll_link));
+
+  k_mutex_unlock(&epoll_mutex);
+
+  k_object_pool_put(epoll_cache, ep);
+
+  return 0;
+}
+
+/**
+ * Remove a file from all epoll sets watching it. Called when the last
+ * reference to the file is dropped.
+ *
+ * @param file The file
+ */
+void
+epoll_file_release(struct File *file)
+{
+  // Nobody can add new items, since that requires a file reference
+  if (k_list_is_empty(&file->epoll_items))
+    return;
+
+  k_mutex_lock(&epoll_mutex);
+
+  while (!k_list_is_empty(&file->epoll_items))
+    epoll_item_free(KLIST_CONTAINER(file->epoll_items.next, struct EpollItem,
+                                    file_link));
+
+  k_mutex_unlock(&epoll_mutex);
+}
+
+/**
+ * Add, modify, or remove an entry of the interest set.
+ *
+ * @param file  The epoll file
+ * @param op    EPOLL_CTL_ADD, EPOLL_CTL_MOD, or EPOLL_CTL_DEL
+ * @param fd    The target file descriptor
+ * @param event The requested events and the user data (ignored for
+ *              EPOLL_CTL_DEL)
+ *
+ * @retval 0       Success
+ * @retval -EBADF  Bad file descriptor
+ * @retval -EINVAL Bad operation, or the target is an epoll file
+ * @retval -EEXIST The file is already in the set
+ * @retval -ENOENT The file is not in the set
+ * @retval -ENOMEM Out of memory
+ */
+int
+epoll_control(struct File *file, int op, int fd, struct epoll_event *event)
+{
+  struct Epoll *ep = file->epoll;
+  struct EpollItem *item;
+  struct File *target;
+  int r = 0;
+
+  if (file->type != FD_EPOLL)
+    return -EINVAL;
+
+  if ((target = fd_lookup(process_current(), fd)) == NULL)
+    return -EBADF;
+
+  if (target->type == FD_EPOLL) {
+    file_put(target);
+    return -EINVAL;
+  }
+
+  k_mutex_lock(&epoll_mutex);
+
+  item = epoll_item_lookup(ep, target);
+
+  switch (op) {
+  case EPOLL_CTL_ADD:
+    if (item != NULL) {
+      r = -EEXIST;
+      break;
+    }
+
+    item = (struct EpollItem *) k_object_pool_get(epoll_item_cache);
+    if (item == NULL) {
+      r = -ENOMEM;
+      break;
+    }
+
+    poll_entry_init(&item->entry, epoll_item_notify);
+    item->epoll  = ep;
+    item->file   = target;
+    item->events = event->events;
+    item->data   = event->data;
+    k_list_null(&item->epoll_link);
+    k_list_null(&item->file_link);
+    k_list_null(&item->ready_link);
+
+    k_list_add_back(&ep->items, &item->epoll_link);
+    k_list_add_back(&target->epoll_items, &item->file_link);
+
+    epoll_item_check(item, &item->entry);
+    break;
+
+  case EPOLL_CTL_MOD:
+    if (item == NULL) {
+      r = -ENOENT;
+      break;
+    }
+
+    item->events = event->events;
+    item->data   = event->data;
+
+    epoll_item_check(item, NULL);
+    break;
+
+  case EPOLL_CTL_DEL:
+    if (item == NULL) {
+      r = -ENOENT;
+      break;
+    }
+
+    epoll_item_free(item);
+    break;
+
+  default:
+    r = -EINVAL;
+    break;
+  }
+
+  k_mutex_unlock(&epoll_mutex);
+
+  // May drop the last reference if the descriptor has been closed meanwhile
+  file_put(target);
+
+  return r;
+}
+
+// Collect the pending events from the ready list. The caller must be holding
+// epoll_mutex.
+static int
+epoll_harvest(struct Epoll *ep, struct epoll_event *events, int max)
+{
+  struct KListLink again;
+  int n;
+
+  k_list_init(&again);
+
+  k_spinlock_acquire(&ep->lock);
+
+  for (n = 0; (n < max) && !k_list_is_empty(&ep->ready); ) {
+    struct EpollItem *item;
+    int revents;
+
+    item = KLIST_CONTAINER(ep->ready.next, struct EpollItem, ready_link);
+
+    // Keep the item linked to prevent the callback from queueing it again
+    // while its state is being checked
+    k_list_remove(&item->ready_link);
+    k_list_add_back(&again, &item->ready_link);
+
+    k_spinlock_release(&ep->lock);
+
+    revents = file_poll(item->file, NULL) &
+              (item->events | EPOLLERR | EPOLLHUP) & ~EPOLL_FLAGS;
+
+    k_spinlock_acquire(&ep->lock);
+
+    if (!(item->events & ~EPOLL_FLAGS))
+      revents = 0;
+
+    if (revents != 0) {
+      events[n].events = revents;
+      events[n].data   = item->data;
+      n++;
+
+      if (item->events & EPOLLONESHOT)
+        item->events &= EPOLL_FLAGS;
+    }
+
+    // Level-triggered items stay on the ready list while they have events
+    if ((revents == 0) || (item->events & (EPOLLET | EPOLLONESHOT)))
+      k_list_remove(&item->ready_link);
+  }
+
+  // Put the items that are still ready at the end of the list
+  while (!k_list_is_empty(&again)) {
+    struct KListLink *l = again.next;
+
+    k_list_remove(l);
+    k_list_add_back(&ep->ready, l);
+  }
+
+  k_spinlock_release(&ep->lock);
+
+  return n;
+}
+
+/**
+ * Wait for events on an epoll set.
+ *
+ * @param file    The epoll file
+ * @param events  Kernel buffer to store the events
+ * @param max     The maximum number of events to return
+ * @param timeout The maximum number of ticks to wait, 0 to return
+ *                immediately, or a negative value to wait indefinitely
+ *
+ * @return The number of events stored, or a negative error code.
+ */
+int
+epoll_collect(struct File *file, struct epoll_event *events, int max,
+              long timeout)
+{
+  struct Epoll *ep = file->epoll;
+  unsigned long long deadline;
+  int r;
+
+  if ((file->type != FD_EPOLL) || (max <= 0))
+    return -EINVAL;
+
+  deadline = (timeout > 0) ? k_tick_get() + timeout : 0;
+
+  for (;;) {
+    k_mutex_lock(&epoll_mutex);
+    r = epoll_harvest(ep, events, max);
+    k_mutex_unlock(&epoll_mutex);
+
+    if ((r > 0) || (timeout == 0))
+      return r;
+
+    k_spinlock_acquire(&ep->lock);
+
+    while (k_list_is_empty(&ep->ready)) {
+      unsigned long long now = k_tick_get();
+
+      if ((timeout > 0) && (now >= deadline)) {
+        k_spinlock_release(&ep->lock);
+        return 0;
+      }
+
+      r = k_waitqueue_timed_sleep(&ep->queue, &ep->lock,
+                                  (timeout > 0) ? deadline - now : 0);
+
+      if ((r < 0) && (r != -ETIMEDOUT)) {
+        k_spinlock_release(&ep->lock);
+        return r;
+      }
+    }
+
+    k_spinlock_release(&ep->lock);
+  }
+}
+
+/**
+ * Check whether the epoll set has pending events.
+ *
+ * @param file  The epoll file
+ * @param entry The entry to register on the set, or NULL
+ *
+ * @return POLLIN if some items may have pending events, 0 otherwise.
+ */
+int
+epoll_poll(struct File *file, struct PollEntry *entry)
+{
+  struct Epoll *ep = file->epoll;
+  int r;
+
+  poll_queue_add(&ep->poll_queue, entry);
+
+  k_spinlock_acquire(&ep->lock);
+  r = k_list_is_empty(&ep->ready) ? 0 : POLLIN;
+  k_spinlock_release(&ep->lock);
+
+  return r;
+}
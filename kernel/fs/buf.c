@@ -2,30 +2,100 @@
 #include <kernel/dev.h>
 #include <kernel/console.h>
 #include <kernel/fs/buf.h>
+#include <kernel/fs/iosched.h>
+#include <kernel/core/cpu.h>
 #include <kernel/core/list.h>
+#include <kernel/core/tick.h>
+#include <kernel/hash.h>
 #include <kernel/object_pool.h>
 #include <kernel/spinlock.h>
 #include <kernel/page.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
+#include <kernel/trace.h>
+#include <kernel/types.h>
 
 struct KObjectPool *buf_pool;
 
-static void buf_request(struct Buf *);
+static void          buf_request(struct Buf *);
+static void          buf_request_list(struct Buf **, unsigned);
+static void          buf_write_batch(struct Buf **, unsigned, int);
+static struct Buf   *buf_lookup_locked(unsigned long, size_t, dev_t);
+static unsigned long buf_shrink(void);
+static void          buf_flush_thread(void *);
+static void          buf_prefetch_thread(void *);
+static unsigned      buf_flush(dev_t, int, unsigned long long, int);
 
-// Maximum size of the buffer cache
-#define BUF_CACHE_MAX_SIZE   1024
+static struct PageShrinker buf_shrinker = {
+  .name   = "buf_cache",
+  .shrink = buf_shrink,
+};
+
+// The buffer cache may use up to this part of the free memory (including the
+// memory taken by the cache itself)
+#define BUF_CACHE_FREE_SHARE      4
+// Minimum limit on the buffer cache size, in pages
+#define BUF_CACHE_MIN_SIZE        128U
+// The number of hash chains
+#define BUF_CACHE_HASH_SIZE       256
+
+// How long a modified buffer may stay in memory before it is written out
+#define BUF_FLUSH_AGE             seconds2ticks(5)
+// How often the flusher thread looks for aged buffers
+#define BUF_FLUSH_INTERVAL        seconds2ticks(1)
+// The maximum number of buffers written out in one pass
+#define BUF_FLUSH_BATCH           32
+// The maximum number of pending read-ahead requests
+#define BUF_PREFETCH_QUEUE_SIZE   64
+// The maximum number of read-ahead requests submitted at once
+#define BUF_PREFETCH_BATCH        16
+
+// Unused buffers of a single block size
+struct BufSizePool {
+  struct KListLink lru;                      ///< Clean buffers, MRU first
+  size_t          count;                     ///< The number of buffers
+};
 
 static struct {
-  size_t          size;
-  struct KListLink head;
+  size_t          size;                      ///< The number of buffers
+  size_t          bytes;                     ///< The memory used for data
+  size_t          max_bytes;                 ///< Current limit on 'bytes'
+  HASH_DECLARE(hash, BUF_CACHE_HASH_SIZE);  ///< All buffers by block number
+  struct BufSizePool pools[BUF_SIZE_POOLS];  ///< Unused buffers by block size
+  struct KListLink dirty;                    ///< Modified buffers, oldest first
+  size_t          dirty_count;
+  unsigned long   hits;                      ///< Lookups finding the block
+  unsigned long   misses;                    ///< Lookups reusing a buffer
+  struct KWaitQueue flush_queue;             ///< The flusher thread waits here
   struct KSpinLock lock;
-} buf_cache;
+} buf_cache __cacheline_exclusive;
+
+// Blocks to be read in the background, protected by buf_cache.lock
+static struct {
+  struct {
+    unsigned long block_no;
+    size_t        block_size;
+    dev_t         dev;
+  }                 queue[BUF_PREFETCH_QUEUE_SIZE];
+  unsigned          head;
+  unsigned          count;
+  struct KWaitQueue wait_queue;              ///< The read-ahead thread waits here
+} buf_prefetch_queue;
+
+// Protects the completion objects and the flags of buffers in flight
+static struct KSpinLock buf_io_lock;
+
+static inline unsigned long
+buf_key(unsigned long block_no, dev_t dev)
+{
+  return block_no ^ ((unsigned long) dev << 16);
+}
 
 static void
 buf_ctor(void *ptr, size_t)
 {
   struct Buf *buf = (struct Buf *) ptr;
 
-  k_waitqueue_init(&buf->wait_queue);
   k_mutex_init(&buf->mutex, "buf");
 }
 
@@ -35,6 +105,9 @@ buf_ctor(void *ptr, size_t)
 void
 buf_init(void)
 {
+  struct KThread *thread;
+  unsigned i;
+
   buf_pool = k_object_pool_create("buf_pool",
                                   sizeof(struct Buf),
                                   0,
@@ -44,7 +117,91 @@ buf_init(void)
     panic("cannot allocate buf_pool");
 
   k_spinlock_init(&buf_cache.lock, "buf_cache");
-  k_list_init(&buf_cache.head);
+  k_spinlock_init(&buf_io_lock, "buf_io");
+  HASH_INIT(buf_cache.hash);
+  for (i = 0; i < BUF_SIZE_POOLS; i++)
+    k_list_init(&buf_cache.pools[i].lru);
+  k_list_init(&buf_cache.dirty);
+  k_waitqueue_init(&buf_cache.flush_queue);
+  buf_cache.max_bytes = BUF_CACHE_MIN_SIZE * PAGE_SIZE;
+
+  page_shrinker_register(&buf_shrinker);
+
+  if ((thread = k_thread_create(NULL, buf_flush_thread, NULL, NZERO)) == NULL)
+    panic("cannot create the buffer flusher thread");
+  k_thread_resume(thread);
+
+  k_waitqueue_init(&buf_prefetch_queue.wait_queue);
+
+  if ((thread = k_thread_create(NULL, buf_prefetch_thread, NULL, NZERO)) == NULL)
+    panic("cannot create the buffer read-ahead thread");
+  k_thread_resume(thread);
+}
+
+/**
+ * Collect the buffer cache statistics.
+ *
+ * @param stats Where to store the statistics
+ */
+void
+buf_get_stats(struct BufStats *stats)
+{
+  unsigned i;
+
+  k_spinlock_acquire(&buf_cache.lock);
+
+  stats->size      = buf_cache.size;
+  stats->bytes     = buf_cache.bytes;
+  stats->max_bytes = buf_cache.max_bytes;
+  stats->dirty     = buf_cache.dirty_count;
+  stats->hits      = buf_cache.hits;
+  stats->misses    = buf_cache.misses;
+
+  stats->unused = 0;
+  for (i = 0; i < BUF_SIZE_POOLS; i++) {
+    stats->unused_by_size[i] = buf_cache.pools[i].count;
+    stats->unused += buf_cache.pools[i].count;
+  }
+
+  k_spinlock_release(&buf_cache.lock);
+}
+
+// Get the pool of unused buffers with the given block size
+static struct BufSizePool *
+buf_size_pool(size_t block_size)
+{
+  unsigned i;
+
+  for (i = 0; i < BUF_SIZE_POOLS; i++)
+    if ((BUF_SIZE_MIN << i) == block_size)
+      return &buf_cache.pools[i];
+
+  panic("bad block size %u", block_size);
+  return NULL;
+}
+
+// Recompute the limit on the memory used by the cache. It follows the amount
+// of free memory, so the cache grows while memory is plentiful and stops
+// growing once other users need it.
+static size_t
+buf_cache_limit(void)
+{
+  size_t limit;
+
+  debug_assert(k_spinlock_holding(&buf_cache.lock));
+
+  limit = ((size_t) page_free_count * PAGE_SIZE + buf_cache.bytes) /
+          BUF_CACHE_FREE_SHARE;
+  buf_cache.max_bytes = MAX(limit, BUF_CACHE_MIN_SIZE * PAGE_SIZE);
+
+  return buf_cache.max_bytes;
+}
+
+// Too many modified buffers, write them out without waiting for them to age
+static int
+buf_cache_too_dirty(void)
+{
+  return buf_cache.dirty_count > MAX(buf_cache.size, BUF_CACHE_MIN_SIZE) / 4;
 }
 
 static uint8_t *
@@ -86,13 +243,99 @@ buf_free_data(void *data, size_t block_size)
   page_free_block(page, page_order);
 }
 
+// Remove an unused buffer whose data has already been freed from the cache
+static void
+buf_destroy_locked(struct Buf *b)
+{
+  debug_assert(k_spinlock_holding(&buf_cache.lock));
+  assert(b->ref_count == 0);
+
+  k_list_remove(&b->cache_link);
+  HASH_REMOVE(&b->hash_link);
+  buf_size_pool(b->block_size)->count--;
+  buf_cache.bytes -= b->block_size;
+  buf_cache.size--;
+
+  // buf_pool is only allocated from with buf_cache.lock held, so this CPU
+  // cannot be holding the pool lock at this point
+  k_object_pool_put(buf_pool, b);
+}
+
+// Free the least recently used buffer of the pool that holds the most unused
+// memory, other than the given one. Returns 0 on success, or -1 if there are
+// no such buffers.
+static int
+buf_evict_other_locked(struct BufSizePool *pool)
+{
+  struct BufSizePool *victim = NULL;
+  size_t victim_bytes = 0;
+  struct Buf *b;
+  unsigned i;
+
+  for (i = 0; i < BUF_SIZE_POOLS; i++) {
+    struct BufSizePool *p = &buf_cache.pools[i];
+
+    if ((p != pool) && (p->count * (BUF_SIZE_MIN << i) > victim_bytes)) {
+      victim = p;
+      victim_bytes = p->count * (BUF_SIZE_MIN << i);
+    }
+  }
+
+  if (victim == NULL)
+    return -1;
+
+  b = KLIST_CONTAINER(victim->lru.prev, struct Buf, cache_link);
+  buf_free_data(b->data, b->block_size);
+  buf_destroy_locked(b);
+
+  return 0;
+}
+
+// Drop all unused buffers from the cache. Called by the page allocator when it
+// runs out of memory, so no locks can be waited for.
+static unsigned long
+buf_shrink(void)
+{
+  struct KListLink *l, *prev;
+  unsigned long n = 0;
+  unsigned i;
+
+  if (k_spinlock_try_acquire(&buf_cache.lock) != 0)
+    return 0;
+
+  // Start from the least recently used buffers. Unused buffers are never
+  // dirty, since buf_release() writes them out.
+  for (i = 0; i < BUF_SIZE_POOLS; i++) {
+    struct BufSizePool *pool = &buf_cache.pools[i];
+
+    for (l = pool->lru.prev; l != &pool->lru; l = prev) {
+      struct Buf *b = KLIST_CONTAINER(l, struct Buf, cache_link);
+
+      prev = l->prev;
+
+      if (b->block_size < PAGE_SIZE) {
+        if (k_try_free(b->data) != 0)
+          break;
+      } else {
+        buf_free_data(b->data, b->block_size);
+        n += ROUND_UP(b->block_size, PAGE_SIZE) / PAGE_SIZE;
+      }
+
+      buf_destroy_locked(b);
+    }
+  }
+
+  k_spinlock_release(&buf_cache.lock);
+
+  return n;
+}
+
 static struct Buf *
 buf_alloc(size_t block_size)
 {
   struct Buf *buf;
 
-  assert(k_spinlock_holding(&buf_cache.lock));
-  assert(buf_cache.size < BUF_CACHE_MAX_SIZE);
+  debug_assert(k_spinlock_holding(&buf_cache.lock));
 
   if ((buf = (struct Buf *) k_object_pool_get(buf_pool)) == NULL)
     return NULL;
@@ -109,48 +352,66 @@ buf_alloc(size_t block_size)
   buf->block_size = block_size;
   buf->cache_link.prev = NULL;
   buf->cache_link.next = NULL;
+  buf->hash_link.prev  = NULL;
+  buf->hash_link.next  = NULL;
+  buf->dirty_link.prev = NULL;
+  buf->dirty_link.next = NULL;
   buf->queue_link.prev = NULL;
   buf->queue_link.next = NULL;
+  buf->completion      = NULL;
 
-  k_list_add_front(&buf_cache.head, &buf->cache_link);
   buf_cache.size++;
+  buf_cache.bytes += block_size;
 
   return buf;
 }
 
-// Scan the cache for a buffer with the given block number and device.
+// Find a buffer with the given block number and device in the cache.
 static struct Buf *
 buf_get(unsigned block_no, size_t block_size, dev_t dev)
 {
-  struct KListLink *l;
-  struct Buf *b, *unused = NULL;
+  struct BufSizePool *pool = buf_size_pool(block_size);
+  size_t limit;
+  struct Buf *b;
 
   k_spinlock_acquire(&buf_cache.lock);
 
-  // TODO: use a hash table for faster lookups
-  KLIST_FOREACH(&buf_cache.head, l) {
-    b = KLIST_CONTAINER(l, struct Buf, cache_link);
+  if ((b = buf_lookup_locked(block_no, block_size, dev)) != NULL) {
+    // Buffers in use are not on the LRU list
+    if (b->ref_count++ == 0) {
+      k_list_remove(&b->cache_link);
+      pool->count--;
+    }
+    buf_cache.hits++;
 
-    if ((b->block_no == block_no) &&
-        (b->dev == dev) &&
-        (b->block_size == block_size)) {
-      b->ref_count++;
+    k_spinlock_release(&buf_cache.lock);
 
-      k_spinlock_release(&buf_cache.lock);
+    return b;
+  }
 
-      return b;
-    }
+  // Grow the buffer cache while within its limit, otherwise reuse the least
+  // recently used buffer of the same size that held a different block. Unused
+  // buffers of other sizes are freed to make room, rather than having their
+  // data reallocated.
+  limit = buf_cache_limit();
+  while ((buf_cache.bytes + block_size > limit) &&
+         k_list_is_empty(&pool->lru) &&
+         (buf_evict_other_locked(pool) == 0))
+    ;
 
-    // Remember the least recently used free buffer.
-    if (b->ref_count == 0)
-      unused = b;
+  b = NULL;
+  if (buf_cache.bytes + block_size <= limit) {
+    while (((b = buf_alloc(block_size)) == NULL) &&
+           k_list_is_empty(&pool->lru) &&
+           (buf_evict_other_locked(pool) == 0))
+      ;
   }
 
-  // Grow the buffer cache. If the maximum cache size is already reached, try
-  // to reuse a buffer that held a different block.
-  if ((buf_cache.size >= BUF_CACHE_MAX_SIZE) ||
-      ((b = buf_alloc(block_size)) == NULL))
-    b = unused;
+  if ((b == NULL) && !k_list_is_empty(&pool->lru)) {
+    b = KLIST_CONTAINER(pool->lru.prev, struct Buf, cache_link);
+    k_list_remove(&b->cache_link);
+    pool->count--;
+  }
 
   if (b == NULL) {
     // Out of free blocks.
@@ -158,27 +419,15 @@ buf_get(unsigned block_no, size_t block_size, dev_t dev)
     return NULL;
   }
 
-  // TODO: realloc
-  if (b->block_size != block_size) {
-    buf_free_data(b->data, b->block_size);
-
-    if ((b->data = buf_alloc_data(block_size)) == NULL) {
-      k_list_remove(&b->cache_link);
-      k_object_pool_put(buf_pool, b);
-
-      k_spinlock_release(&buf_cache.lock);
-
-      return NULL;
-    }
-
-    b->block_size = block_size;
-  }
+  HASH_REMOVE(&b->hash_link);
 
-  b->block_size = block_size;
   b->block_no   = block_no;
   b->dev        = dev;
   b->ref_count  = 1;
   b->flags      = 0;
+  buf_cache.misses++;
+
+  HASH_PUT(buf_cache.hash, &b->hash_link, buf_key(block_no, dev));
 
   k_spinlock_release(&buf_cache.lock);
 
@@ -198,8 +447,10 @@ buf_read(unsigned block_no, size_t block_size, dev_t dev)
 {
   struct Buf *buf;
 
-  if ((buf = buf_get(block_no, block_size, dev)) == NULL)
-    return NULL;
+  // All buffers may be in use or waiting to be written out
+  while ((buf = buf_get(block_no, block_size, dev)) == NULL)
+    if (buf_flush(0, 1, 0, BUF_META) == 0)
+      return NULL;
 
   k_mutex_lock(&buf->mutex);
 
@@ -230,36 +481,375 @@ buf_write(struct Buf *buf)
   buf_request(buf);
 }
 
+// Drop a reference to the buffer. Unused buffers go to the LRU list, unless
+// they have to be written out first.
+static void
+buf_put_locked(struct Buf *buf)
+{
+  debug_assert(k_spinlock_holding(&buf_cache.lock));
+
+  if (--buf->ref_count > 0)
+    return;
+
+  // Nobody else can modify the flags of an unused buffer. A buffer that the
+  // flusher took off the dirty list but had to skip goes back to it.
+  if (buf->flags & BUF_DIRTY) {
+    if (buf->dirty_link.next == NULL) {
+      buf->dirty_time = k_tick_get();
+      k_list_add_back(&buf_cache.dirty, &buf->dirty_link);
+      buf_cache.dirty_count++;
+    }
+    return;
+  }
+
+  if (buf->dirty_link.next != NULL) {
+    k_list_remove(&buf->dirty_link);
+    buf_cache.dirty_count--;
+  }
+
+  k_list_add_front(&buf_size_pool(buf->block_size)->lru, &buf->cache_link);
+  buf_size_pool(buf->block_size)->count++;
+}
+
 /**
- * Release the buffer.
+ * Release the buffer. Modified buffers are not written immediately, but left
+ * in the cache for the flusher thread.
  * 
  * @param buf Pointer to the Buf structure to be released.
  */
 void 
 buf_release(struct Buf *buf)
 { 
+  int dirty;
+
   if (!(buf->flags & BUF_VALID))
     warn("buffer not valid");
 
-  if (buf->flags & BUF_DIRTY) {
-    buf_write(buf);
+  dirty = buf->flags & BUF_DIRTY;
+  
+  k_mutex_unlock(&buf->mutex);
+
+  k_spinlock_acquire(&buf_cache.lock);
+
+  if (dirty && (buf->dirty_link.next == NULL)) {
+    buf->dirty_time = k_tick_get();
+    k_list_add_back(&buf_cache.dirty, &buf->dirty_link);
+
+    // Too many modified buffers, do not wait for them to age
+    buf_cache.dirty_count++;
+    if (buf_cache_too_dirty())
+      k_waitqueue_wakeup_one(&buf_cache.flush_queue);
+  }
 
-    if (buf->flags & BUF_DIRTY) {
-      panic("buffer still dirty");
+  buf_put_locked(buf);
+
+  k_spinlock_release(&buf_cache.lock);
+}
+
+// Write out a batch of buffers sorted by the block number and drop the
+// references to them. Buffers on the same device are passed to the driver
+// together, so it can merge adjacent blocks into longer transfers. Buffers
+// with any of the 'skip' flags set are left dirty.
+static void
+buf_write_batch(struct Buf **batch, unsigned n, int skip)
+{
+  struct Buf *locked[BUF_FLUSH_BATCH];
+  struct BufCompletion completion;
+  unsigned i, j, k;
+
+  // Waiting for a buffer mutex while holding others could deadlock, so the
+  // buffers used by other tasks are written one by one afterwards
+  for (i = 0, k = 0; i < n; i++) {
+    if (k_mutex_try_lock(&batch[i]->mutex) != 0)
+      continue;
+
+    if ((batch[i]->flags & (BUF_DIRTY | skip)) == BUF_DIRTY) {
+      locked[k++] = batch[i];
+      batch[i] = NULL;
+    } else {
+      k_mutex_unlock(&batch[i]->mutex);
     }
   }
-  
-  k_mutex_unlock(&buf->mutex);
+
+  buf_completion_init(&completion, NULL);
+
+  for (i = 0; i < k; i = j) {
+    for (j = i + 1; (j < k) && (locked[j]->dev == locked[i]->dev); j++)
+      ;
+    buf_submit(&locked[i], j - i, &completion);
+  }
+
+  buf_wait(&completion);
+
+  for (i = 0; i < k; i++)
+    k_mutex_unlock(&locked[i]->mutex);
+
+  for (i = 0; i < n; i++) {
+    if (batch[i] == NULL)
+      continue;
+
+    k_mutex_lock(&batch[i]->mutex);
+    if ((batch[i]->flags & (BUF_DIRTY | skip)) == BUF_DIRTY)
+      buf_request(batch[i]);
+    k_mutex_unlock(&batch[i]->mutex);
+  }
+
+  k_spinlock_acquire(&buf_cache.lock);
+
+  for (i = 0; i < k; i++)
+    buf_put_locked(locked[i]);
+  for (i = 0; i < n; i++)
+    if (batch[i] != NULL)
+      buf_put_locked(batch[i]);
+
+  k_spinlock_release(&buf_cache.lock);
+}
+
+// Write out modified buffers that have been dirty for at least the given
+// number of ticks, in block order, except the ones with any of the 'skip'
+// flags set. Returns the number of buffers written.
+static unsigned
+buf_flush(dev_t dev, int any_dev, unsigned long long age, int skip)
+{
+  struct Buf *batch[BUF_FLUSH_BATCH];
+  struct KListLink *l, *next;
+  unsigned long long now;
+  unsigned i, n, total;
+
+  total = 0;
+
+  do {
+    k_spinlock_acquire(&buf_cache.lock);
+
+    now = k_tick_get();
+    n   = 0;
+
+    for (l = buf_cache.dirty.next;
+         (l != &buf_cache.dirty) && (n < BUF_FLUSH_BATCH);
+         l = next) {
+      struct Buf *b = KLIST_CONTAINER(l, struct Buf, dirty_link);
+
+      next = l->next;
+
+      // The list is sorted by the time the buffers became dirty
+      if ((now - b->dirty_time) < age)
+        break;
+      if ((!any_dev && (b->dev != dev)) || (b->flags & skip))
+        continue;
+
+      // Whoever modifies the buffer again puts it back on the list
+      k_list_remove(&b->dirty_link);
+      buf_cache.dirty_count--;
+      b->ref_count++;
+
+      // Keep the batch sorted by the block number
+      for (i = n++; (i > 0) && ((batch[i - 1]->dev > b->dev) ||
+                                ((batch[i - 1]->dev == b->dev) &&
+                                 (batch[i - 1]->block_no > b->block_no))); i--)
+        batch[i] = batch[i - 1];
+      batch[i] = b;
+    }
+
+    k_spinlock_release(&buf_cache.lock);
+
+    buf_write_batch(batch, n, skip);
+
+    total += n;
+  } while (n == BUF_FLUSH_BATCH);
+
+  return total;
+}
+
+/**
+ * Write out all modified buffers belonging to the given device, except the
+ * ones held back for the journal (BUF_META) and the ones already in it
+ * (BUF_LOGGED), which are as durable as if written.
+ *
+ * @param dev ID of the device.
+ */
+void
+buf_sync(dev_t dev)
+{
+  buf_flush(dev, 0, 0, BUF_META | BUF_LOGGED);
+}
+
+/**
+ * Write out all modified buffers belonging to the given device, including
+ * the ones already in the journal, so that the journal space can be reused.
+ *
+ * @param dev ID of the device.
+ */
+void
+buf_checkpoint(dev_t dev)
+{
+  buf_flush(dev, 0, 0, BUF_META);
+}
+
+/**
+ * Write out all modified buffers that are not held back for the journal.
+ */
+void
+buf_sync_all(void)
+{
+  buf_flush(0, 1, 0, BUF_META);
+}
+
+/**
+ * Collect the modified buffers of the given device that have all of the
+ * given flags set, taking a reference to each one. The buffers are not
+ * locked, the caller releases them with buf_release() after locking.
+ *
+ * @param dev   ID of the device.
+ * @param flags The flags to look for.
+ * @param bufs  Where to store the buffers.
+ * @param max   The maximum number of buffers to store.
+ *
+ * @return The number of buffers stored.
+ */
+unsigned
+buf_collect_dirty(dev_t dev, int flags, struct Buf **bufs, unsigned max)
+{
+  struct KListLink *l;
+  unsigned n = 0;
 
   k_spinlock_acquire(&buf_cache.lock);
 
-  if (--buf->ref_count == 0) {
-    // Return the buffer to the cache.
-    k_list_remove(&buf->cache_link);
-    k_list_add_front(&buf_cache.head, &buf->cache_link);
+  KLIST_FOREACH(&buf_cache.dirty, l) {
+    struct Buf *b = KLIST_CONTAINER(l, struct Buf, dirty_link);
+
+    if (n == max)
+      break;
+
+    if ((b->dev == dev) && ((b->flags & flags) == flags)) {
+      b->ref_count++;
+      bufs[n++] = b;
+    }
   }
 
   k_spinlock_release(&buf_cache.lock);
+
+  return n;
+}
+
+static void
+buf_flush_thread(void *arg)
+{
+  unsigned long long age;
+
+  (void) arg;
+
+  for (;;) {
+    k_spinlock_acquire(&buf_cache.lock);
+
+    k_waitqueue_timed_sleep(&buf_cache.flush_queue, &buf_cache.lock,
+                            BUF_FLUSH_INTERVAL);
+
+    age = buf_cache_too_dirty() ? 0 : BUF_FLUSH_AGE;
+
+    k_spinlock_release(&buf_cache.lock);
+
+    buf_flush(0, 1, age, BUF_META);
+  }
+}
+
+// Look up a cached buffer without taking a reference
+static struct Buf *
+buf_lookup_locked(unsigned long block_no, size_t block_size, dev_t dev)
+{
+  struct KListLink *l;
+
+  debug_assert(k_spinlock_holding(&buf_cache.lock));
+
+  HASH_FOREACH_ENTRY(buf_cache.hash, l, buf_key(block_no, dev)) {
+    struct Buf *b = KLIST_CONTAINER(l, struct Buf, hash_link);
+
+    if ((b->block_no == block_no) &&
+        (b->dev == dev) &&
+        (b->block_size == block_size))
+      return b;
+  }
+
+  return NULL;
+}
+
+/**
+ * Ask for the given block to be read into the cache in the background, since
+ * it is likely to be needed soon. Does nothing if the block is already cached
+ * or too many requests are pending.
+ *
+ * @param block_no The filesystem block number.
+ * @param dev      ID of the device the block belongs to.
+ */
+void
+buf_prefetch(unsigned block_no, size_t block_size, dev_t dev)
+{
+  unsigned i;
+
+  k_spinlock_acquire(&buf_cache.lock);
+
+  if ((buf_prefetch_queue.count < BUF_PREFETCH_QUEUE_SIZE) &&
+      (buf_lookup_locked(block_no, block_size, dev) == NULL)) {
+    i = (buf_prefetch_queue.head + buf_prefetch_queue.count++) %
+        BUF_PREFETCH_QUEUE_SIZE;
+
+    buf_prefetch_queue.queue[i].block_no   = block_no;
+    buf_prefetch_queue.queue[i].block_size = block_size;
+    buf_prefetch_queue.queue[i].dev        = dev;
+
+    k_waitqueue_wakeup_one(&buf_prefetch_queue.wait_queue);
+  }
+
+  k_spinlock_release(&buf_cache.lock);
+}
+
+// Submit the requested blocks in batches, so that the driver can merge the
+// adjacent ones. A task that needs one of them in the meantime finds the
+// buffer in the cache and waits for its mutex.
+static void
+buf_prefetch_thread(void *arg)
+{
+  struct Buf *bufs[BUF_PREFETCH_BATCH];
+  struct BufCompletion completion;
+  unsigned i, k, n;
+
+  (void) arg;
+
+  buf_completion_init(&completion, NULL);
+
+  for (;;) {
+    unsigned long block_no[BUF_PREFETCH_BATCH];
+    size_t block_size[BUF_PREFETCH_BATCH];
+    dev_t dev[BUF_PREFETCH_BATCH];
+
+    k_spinlock_acquire(&buf_cache.lock);
+
+    while (buf_prefetch_queue.count == 0)
+      k_waitqueue_sleep(&buf_prefetch_queue.wait_queue, &buf_cache.lock);
+
+    for (n = 0; (n < BUF_PREFETCH_BATCH) && (buf_prefetch_queue.count > 0); n++) {
+      i = buf_prefetch_queue.head;
+
+      block_no[n]   = buf_prefetch_queue.queue[i].block_no;
+      block_size[n] = buf_prefetch_queue.queue[i].block_size;
+      dev[n]        = buf_prefetch_queue.queue[i].dev;
+
+      buf_prefetch_queue.head = (i + 1) % BUF_PREFETCH_QUEUE_SIZE;
+      buf_prefetch_queue.count--;
+    }
+
+    k_spinlock_release(&buf_cache.lock);
+
+    // Blocks that are busy are skipped, whoever holds them will read them
+    for (i = 0, k = 0; i < n; i++)
+      if ((bufs[k] = buf_read_async(block_no[i], block_size[i], dev[i],
+                                    &completion)) != NULL)
+        k++;
+
+    buf_wait(&completion);
+
+    for (i = 0; i < k; i++)
+      buf_release(bufs[i]);
+  }
 }
 
 /**
@@ -270,16 +860,174 @@ buf_release(struct Buf *buf)
  */
 static void
 buf_request(struct Buf *buf)
+{
+  buf_request_list(&buf, 1);
+}
+
+// Pass several buffers of the same device to the driver at once and wait for
+// all of them
+static void
+buf_request_list(struct Buf **bufs, unsigned n)
+{
+  struct BufCompletion completion;
+
+  buf_completion_init(&completion, NULL);
+  buf_submit(bufs, n, &completion);
+  buf_wait(&completion);
+}
+
+/**
+ * Initialize a completion object.
+ *
+ * @param completion The completion object.
+ * @param callback   The function to call once all submitted requests are
+ *                   done, or NULL to wait for them with buf_wait(). The
+ *                   callback runs in the driver context and must not sleep.
+ */
+void
+buf_completion_init(struct BufCompletion *completion,
+                    void (*callback)(struct BufCompletion *))
+{
+  completion->pending  = 0;
+  completion->callback = callback;
+  k_waitqueue_init(&completion->wait_queue);
+}
+
+/**
+ * Get a buffer for the given block and start reading its contents without
+ * waiting for them. The data may only be used after buf_wait() returns.
+ *
+ * @param block_no   The filesystem block number.
+ * @param block_size The block size.
+ * @param dev        ID of the device the block belongs to.
+ * @param completion The completion object to report to.
+ *
+ * @return A pointer to the locked Buf structure, or NULL if unable to allocate
+ *         a block or the buffer is being used by another task.
+ */
+struct Buf *
+buf_read_async(unsigned block_no, size_t block_size, dev_t dev,
+               struct BufCompletion *completion)
+{
+  struct Buf *buf;
+
+  if ((buf = buf_get(block_no, block_size, dev)) == NULL)
+    return NULL;
+
+  // The caller may already hold other buffers, so waiting could deadlock
+  if (k_mutex_try_lock(&buf->mutex) != 0) {
+    k_spinlock_acquire(&buf_cache.lock);
+    buf_put_locked(buf);
+    k_spinlock_release(&buf_cache.lock);
+
+    return NULL;
+  }
+
+  if (!(buf->flags & BUF_VALID))
+    buf_submit(&buf, 1, completion);
+
+  return buf;
+}
+
+/**
+ * Pass several buffers of the same device to the driver without waiting for
+ * the operations to complete. Invalid buffers are read, dirty buffers are
+ * written. The caller must hold the mutexes of all buffers until the
+ * completion is reported.
+ *
+ * @param bufs       The buffers to be processed.
+ * @param n          The number of buffers.
+ * @param completion The completion object to report to.
+ */
+void
+buf_submit(struct Buf **bufs, unsigned n, struct BufCompletion *completion)
 {
   struct BlockDev *dev;
+  unsigned long long now = k_tick_get();
+  unsigned i;
 
-  if (!k_mutex_holding(&buf->mutex))
-    panic("buf not locked");
-  if ((buf->flags & (BUF_DIRTY | BUF_VALID)) == BUF_VALID)
-    panic("nothing to do");
+  for (i = 0; i < n; i++) {
+    if (!k_mutex_holding(&bufs[i]->mutex))
+      panic("buf not locked");
+    if ((bufs[i]->flags & (BUF_DIRTY | BUF_VALID)) == BUF_VALID)
+      panic("nothing to do");
+    if (bufs[i]->completion != NULL)
+      panic("buf already submitted");
+    assert(bufs[i]->dev == bufs[0]->dev);
+  }
+
+  if ((dev = dev_lookup_block(bufs[0]->dev)) == NULL)
+    panic("no block device %d found", bufs[0]->dev);
+
+  k_spinlock_acquire(&buf_io_lock);
+
+  for (i = 0; i < n; i++) {
+    bufs[i]->completion  = completion;
+    bufs[i]->submit_time = now;
+    trace(TRACE_BUF_SUBMIT, bufs[i]->block_no, bufs[i]->flags);
+  }
+  completion->pending += n;
+
+  k_spinlock_release(&buf_io_lock);
+
+  if (dev->queue != NULL)
+    io_queue_submit(dev->queue, bufs, n);
+  else
+    dev->request(bufs, n);
+}
+
+/**
+ * Wait until all buffers submitted with the given completion object are done.
+ *
+ * @param completion The completion object.
+ */
+void
+buf_wait(struct BufCompletion *completion)
+{
+  k_spinlock_acquire(&buf_io_lock);
+
+  while (completion->pending > 0)
+    k_waitqueue_sleep(&completion->wait_queue, &buf_io_lock);
+
+  k_spinlock_release(&buf_io_lock);
+}
+
+/**
+ * Called by the block device driver when the operation on the buffer has
+ * completed.
+ *
+ * @param buf The buffer.
+ */
+void
+buf_io_done(struct Buf *buf)
+{
+  struct BufCompletion *completion;
+  void (*callback)(struct BufCompletion *) = NULL;
+  // The buffer may be reused as soon as the completion is reported
+  struct BlockDev *dev = dev_lookup_block(buf->dev);
+
+  trace(TRACE_BUF_DONE, buf->block_no, buf->flags);
+
+  k_spinlock_acquire(&buf_io_lock);
+
+  if (buf->flags & BUF_DIRTY)
+    buf->flags &= ~(BUF_DIRTY | BUF_LOGGED);
+  else
+    buf->flags |= BUF_VALID;
+
+  completion = buf->completion;
+  buf->completion = NULL;
+
+  if ((completion != NULL) && (--completion->pending == 0)) {
+    if ((callback = completion->callback) == NULL)
+      k_waitqueue_wakeup_all(&completion->wait_queue);
+  }
+
+  k_spinlock_release(&buf_io_lock);
 
-  if ((dev = dev_lookup_block(buf->dev)) == NULL)
-    panic("no block device %d found", buf->dev);
+  if (callback != NULL)
+    callback(completion);
 
-  dev->request(buf);
+  if ((dev != NULL) && (dev->queue != NULL))
+    io_queue_done(dev->queue);
 }
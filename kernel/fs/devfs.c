@@ -23,6 +23,15 @@ static struct DevfsNode {
   { 7, "tty4", S_IFCHR | 0666, 0x0104 },
   { 8, "tty5", S_IFCHR | 0666, 0x0105 },
   { 9, "zero", S_IFCHR | 0666, 0x0202 },
+  { 10, "netstat", S_IFCHR | 0444, 0x0300 },
+  { 11, "prof", S_IFCHR | 0644, 0x0400 },
+  { 12, "trace", S_IFCHR | 0644, 0x0500 },
+  { 13, "sysstat", S_IFCHR | 0644, 0x0600 },
+  { 14, "meminfo", S_IFCHR | 0444, 0x0700 },
+  { 15, "fb0", S_IFCHR | 0666, 0x0800 },
+  { 16, "cpustat", S_IFCHR | 0444, 0x0900 },
+  { 17, "iostat", S_IFCHR | 0444, 0x0A00 },
+  { 18, "kmsg", S_IFCHR | 0444, 0x0B00 },
 };
 
 #define NDEV  (sizeof(devices) / sizeof devices[0])
@@ -230,6 +239,7 @@ devfs_mount(dev_t dev)
   
   devfs->name  = "devfs";
   devfs->dev   = dev;
+  devfs->flags = 0;
   devfs->extra = NULL;
   devfs->ops   = &devfs_ops;
 
@@ -8,6 +8,7 @@
 #include <kernel/fs/fs.h>
 #include <kernel/object_pool.h>
 #include <kernel/process.h>
+#include <kernel/thread.h>
 #include <kernel/types.h>
 #include <kernel/time.h>
 
@@ -19,7 +20,7 @@
  * ----------------------------------------------------------------------------
  */
 
-static struct Inode *
+struct Inode *
 ext2_inode_get(struct FS *fs, ino_t inum)
 {
   struct Inode *inode = fs_inode_get(inum, fs->dev);
@@ -157,8 +158,7 @@ ext2_dirent_read(struct Inode *dir, struct Ext2DirEntry *de, off_t off)
   if (ret != de->name_len)
     panic("Cannot read directory");
 
-  dir->atime  = time_get_seconds();
-  dir->flags |= FS_INODE_DIRTY;
+  fs_inode_touch_atime(dir);
 
   return 0;
 }
@@ -181,12 +181,23 @@ ext2_lookup(struct Inode *dirp, const char *name)
   struct Ext2DirEntry de;
   off_t off;
   size_t name_len;
+  uint32_t ino;
 
   if (!S_ISDIR(dirp->mode))
     panic("not a directory");
 
   name_len = strlen(name);
 
+  switch (ext2_htree_lookup(dirp, name, name_len, &ino)) {
+  case 0:
+    return ext2_inode_get(dirp->fs, ino);
+  case -ENOENT:
+    return NULL;
+  default:
+    // Not indexed, fall back to the linear scan
+    break;
+  }
+
   for (off = 0; off < dirp->size; off += de.rec_len) {
     ext2_dirent_read(dirp, &de, off);
 
@@ -207,6 +218,7 @@ int
 ext2_link(struct Inode *dir, char *name, struct Inode *inode)
 {
   struct Inode *existing_inode;
+  struct Ext2InodeExtra *extra;
   struct Ext2DirEntry de, new_de;
   off_t off;
   ssize_t name_len, de_len, new_len;
@@ -248,7 +260,24 @@ ext2_link(struct Inode *dir, char *name, struct Inode *inode)
   new_de.file_type = file_type;
   strncpy(new_de.name, name, ROUND_UP(name_len, sizeof(uint32_t)));
 
-  for (off = 0; off < dir->size; off += de.rec_len) {
+  if (ext2_htree_add(dir, &new_de) == 0) {
+    inode->ctime = time_get_seconds();
+    inode->nlink++;
+    inode->flags |= FS_INODE_DIRTY;
+
+    return 0;
+  }
+
+  // The entry may end up in any block, so the hashed index becomes invalid
+  ext2_htree_clear(dir);
+
+  // Skip the blocks known to have no room for the entry
+  extra = (struct Ext2InodeExtra *) dir->extra;
+  off = (new_len >= extra->dir_hint_len)
+      ? (off_t) extra->dir_hint_block * sb->block_size
+      : 0;
+
+  for ( ; off < dir->size; off += de.rec_len) {
     ext2_dirent_read(dir, &de, off);
 
     if (de.inode == 0) {
@@ -262,6 +291,9 @@ ext2_link(struct Inode *dir, char *name, struct Inode *inode)
       inode->nlink++;
       inode->flags |= FS_INODE_DIRTY;
 
+      extra->dir_hint_block = off / sb->block_size;
+      extra->dir_hint_len   = new_len;
+
       return ext2_dirent_write(dir, &new_de, off);
     }
 
@@ -279,12 +311,18 @@ ext2_link(struct Inode *dir, char *name, struct Inode *inode)
       ext2_dirent_write(dir, &de, off);
       ext2_dirent_write(dir, &new_de, off + de_len);
 
+      extra->dir_hint_block = off / sb->block_size;
+      extra->dir_hint_len   = new_len;
+
       return 0;
     }
   }
 
   assert(off % sb->block_size == 0);
 
+  extra->dir_hint_block = off / sb->block_size;
+  extra->dir_hint_len   = new_len;
+
   new_de.rec_len = sb->block_size;
   dir->size = off + sb->block_size;
 
@@ -324,9 +362,11 @@ ext2_dir_empty(struct Inode *dir)
 int
 ext2_unlink(struct Inode *dir, struct Inode *ip)
 {
+  struct Ext2InodeExtra *extra;
   struct Ext2DirEntry de;
   off_t off, prev_off;
   size_t rec_len;
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (dir->fs->extra);
 
   if (dir->ino == ip->ino)
     return -EBUSY;
@@ -337,8 +377,13 @@ ext2_unlink(struct Inode *dir, struct Inode *ip)
     if (de.inode != ip->ino)
       continue;
 
-    if (prev_off == off) {
-      // Removed the first entry - create an unused entry
+    // The block may now have room for new entries
+    extra = (struct Ext2InodeExtra *) dir->extra;
+    extra->dir_hint_block = MIN(extra->dir_hint_block,
+                                (uint32_t) (off / sb->block_size));
+
+    if ((off % sb->block_size) == 0) {
+      // Removed the first entry in a block - create an unused entry
       memset(de.name, 0, de.name_len);
       de.name_len  = 0;
       de.file_type = 0;
@@ -385,13 +430,15 @@ ext2_rmdir(struct Inode *dir, struct Inode *ip)
 void
 ext2_inode_delete(struct Inode *inode)
 {
+  mode_t mode = inode->mode;
+
   ext2_trunc(inode, 0);
 
   inode->mode = 0;
   inode->size = 0;
   ext2_inode_write(inode);
 
-  ext2_inode_free((struct Ext2SuperblockData *) (inode->fs->extra), inode->dev, inode->ino);
+  ext2_inode_free((struct Ext2SuperblockData *) (inode->fs->extra), inode->dev, inode->ino, mode);
 }
 
 /*
@@ -403,11 +450,164 @@ ext2_inode_delete(struct Inode *inode)
 #define EXT2_SB_NO            1
 #define EXT2_SB_OFFSET        0
 
+// The maximum number of descriptor blocks passed to the driver at once
+#define EXT2_GD_BATCH         16U
+
+// Copy the descriptors stored in one block of the table
+static void
+ext2_groups_parse(struct Ext2SuperblockData *sb, struct Buf *buf, uint32_t g)
+{
+  uint32_t gds_per_block = sb->block_size / sb->desc_size;
+  uint32_t i, n = MIN(gds_per_block, sb->groups_count - g);
+
+  for (i = 0; i < n; i++) {
+    struct Ext2GroupInfo *gi = &sb->groups[g + i];
+    struct Ext2BlockGroup *gd;
+
+    gd = (struct Ext2BlockGroup *) &buf->data[i * sb->desc_size];
+
+    k_mutex_init(&gi->mutex, "ext2_group");
+    gi->block_bitmap      = gd->block_bitmap;
+    gi->inode_bitmap      = gd->inode_bitmap;
+    gi->inode_table       = gd->inode_table;
+    gi->free_blocks_count = gd->free_blocks_count;
+    gi->free_inodes_count = gd->free_inodes_count;
+    gi->used_dirs_count   = gd->used_dirs_count;
+    gi->dirty             = 0;
+    gi->block_hint        = 0;
+    gi->inode_hint        = 0;
+  }
+}
+
+// Load the group descriptor table into memory. The blocks are submitted
+// together, so that the driver can read the whole table in one transfer.
+static void
+ext2_groups_load(struct Ext2SuperblockData *sb, dev_t dev)
+{
+  uint32_t gd_start      = sb->block_size > 1024U ? 1 : 2;
+  uint32_t gds_per_block = sb->block_size / sb->desc_size;
+  uint32_t gd_blocks     = (sb->groups_count + gds_per_block - 1) / gds_per_block;
+  struct Buf *bufs[EXT2_GD_BATCH];
+  struct BufCompletion completion;
+  uint32_t b, i, n;
+
+  buf_completion_init(&completion, NULL);
+
+  for (b = 0; b < gd_blocks; b += n) {
+    n = MIN(EXT2_GD_BATCH, gd_blocks - b);
+
+    for (i = 0; i < n; i++)
+      bufs[i] = buf_read_async(gd_start + b + i, sb->block_size, dev,
+                               &completion);
+
+    buf_wait(&completion);
+
+    for (i = 0; i < n; i++) {
+      // Busy or out of buffers, fall back to a synchronous read
+      if ((bufs[i] == NULL) &&
+          ((bufs[i] = buf_read(gd_start + b + i, sb->block_size, dev)) == NULL))
+        panic("cannot read the group descriptor table");
+
+      ext2_groups_parse(sb, bufs[i], (b + i) * gds_per_block);
+
+      buf_release(bufs[i]);
+    }
+  }
+}
+
+// Walk the bitmaps of all groups in the background and move the free bit
+// hints past the used entries, so that the allocations do not have to
+// rediscover the group state. The bitmaps stay in the buffer cache.
+static void
+ext2_groups_scan(void *arg)
+{
+  struct FS *fs = (struct FS *) arg;
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) fs->extra;
+  uint32_t g;
+
+  for (g = 0; g < sb->groups_count; g++) {
+    struct Ext2GroupInfo *gi = &sb->groups[g];
+
+    // Let the next group's bitmaps arrive while this one is scanned
+    if (g + 1 < sb->groups_count) {
+      buf_prefetch(gi[1].block_bitmap, sb->block_size, fs->dev);
+      buf_prefetch(gi[1].inode_bitmap, sb->block_size, fs->dev);
+    }
+
+    k_mutex_lock(&gi->mutex);
+
+    if (gi->free_blocks_count == 0)
+      gi->block_hint = sb->blocks_per_group;
+    else
+      ext2_bitmap_hint(sb, gi->block_bitmap, sb->blocks_per_group, fs->dev,
+                       &gi->block_hint);
+
+    if (gi->free_inodes_count == 0)
+      gi->inode_hint = sb->inodes_per_group;
+    else
+      ext2_bitmap_hint(sb, gi->inode_bitmap, sb->inodes_per_group, fs->dev,
+                       &gi->inode_hint);
+
+    k_mutex_unlock(&gi->mutex);
+  }
+
+  k_thread_exit();
+}
+
+// Write the modified free counts back to the group descriptor table and
+// return the total number of free inodes
+static uint32_t
+ext2_groups_sync(struct Ext2SuperblockData *sb, dev_t dev)
+{
+  uint32_t gd_start      = sb->block_size > 1024U ? 1 : 2;
+  uint32_t gds_per_block = sb->block_size / sb->desc_size;
+  uint32_t free_inodes   = 0;
+  uint32_t g, i;
+
+  for (g = 0; g < sb->groups_count; g += gds_per_block) {
+    uint32_t n = MIN(gds_per_block, sb->groups_count - g);
+    struct Buf *buf = NULL;
+
+    for (i = 0; i < n; i++) {
+      struct Ext2GroupInfo *gi = &sb->groups[g + i];
+      struct Ext2BlockGroup *gd;
+
+      k_mutex_lock(&gi->mutex);
+
+      free_inodes += gi->free_inodes_count;
+
+      if (gi->dirty) {
+        if ((buf == NULL) &&
+            ((buf = buf_read(gd_start + g / gds_per_block, sb->block_size, dev)) == NULL))
+          panic("cannot read the group descriptor table");
+
+        gd = (struct Ext2BlockGroup *) &buf->data[i * sb->desc_size];
+        gd->free_blocks_count = gi->free_blocks_count;
+        gd->free_inodes_count = gi->free_inodes_count;
+        gd->used_dirs_count   = gi->used_dirs_count;
+
+        ext2_journal_dirty(sb, buf);
+        gi->dirty = 0;
+      }
+
+      k_mutex_unlock(&gi->mutex);
+    }
+
+    if (buf != NULL)
+      buf_release(buf);
+  }
+
+  return free_inodes;
+}
+
 void
 ext2_sb_sync(struct Ext2SuperblockData *sb, dev_t dev)
 {
   struct Ext2Superblock *raw;
   struct Buf *buf;
+  uint32_t free_inodes;
+
+  free_inodes = ext2_groups_sync(sb, dev);
 
   k_mutex_lock(&sb->mutex);
 
@@ -420,14 +620,34 @@ ext2_sb_sync(struct Ext2SuperblockData *sb, dev_t dev)
 
   raw->wtime             = sb->wtime;
   raw->free_blocks_count = sb->free_blocks_count;
+  raw->free_inodes_count = free_inodes;
 
-  buf->flags = BUF_DIRTY;
+  // Not journaled: the 1K buffer may alias the first block of the table
+  // cache, and a lost update of the free counts is repaired by e2fsck
+  buf->flags |= BUF_DIRTY;
 
   buf_release(buf);
 
   k_mutex_unlock(&sb->mutex);
 }
 
+/**
+ * Write the in-memory superblock and group descriptor data to the buffer
+ * cache. On a journaled filesystem, also commit the running transaction.
+ *
+ * @param fs The filesystem
+ */
+void
+ext2_sync(struct FS *fs)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) fs->extra;
+
+  if (sb->journal != NULL)
+    ext2_journal_commit(sb);
+  else
+    ext2_sb_sync(sb, fs->dev);
+}
+
 ssize_t
 ext2_readdir(struct Inode *dir, void *buf, FillDirFunc filldir, off_t off)
 {
@@ -447,6 +667,63 @@ ext2_readdir(struct Inode *dir, void *buf, FillDirFunc filldir, off_t off)
   return de.rec_len;
 }
 
+/**
+ * Store the directory entries from the given offset up to the end of its
+ * block, reading the block only once. Unused entries are skipped.
+ *
+ * @param dir     The directory inode
+ * @param buf     The argument for filldir
+ * @param filldir The function to store entries with
+ * @param off     The offset of the first entry
+ *
+ * @return The number of bytes of the directory consumed, 0 at the end of the
+ *         directory, or a negative error code.
+ */
+ssize_t
+ext2_readdir_batch(struct Inode *dir, void *buf, FillDirFunc filldir,
+                   off_t off)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) dir->fs->extra;
+  uint32_t block_id, pos, end;
+  struct Buf *b;
+
+  assert(S_ISDIR(dir->mode));
+
+  if (off >= dir->size)
+    return 0;
+
+  if ((block_id = ext2_inode_get_block(dir, off / sb->block_size, 0)) == 0)
+    return -EIO;
+  if ((b = buf_read(block_id, sb->block_size, dir->dev)) == NULL)
+    return -EIO;
+
+  pos = off % sb->block_size;
+  end = MIN(sb->block_size, (uint32_t) (dir->size - (off - pos)));
+
+  while (pos < end) {
+    struct Ext2DirEntry *de = (struct Ext2DirEntry *) &b->data[pos];
+
+    if ((de->rec_len < DE_NAME_OFFSET) ||
+        (pos + de->rec_len > sb->block_size) ||
+        (DE_NAME_OFFSET + de->name_len > de->rec_len)) {
+      buf_release(b);
+      return -EIO;
+    }
+
+    if ((de->inode != 0) &&
+        (filldir(buf, de->inode, de->name, de->name_len) == 0))
+      break;
+
+    pos += de->rec_len;
+  }
+
+  buf_release(b);
+
+  fs_inode_touch_atime(dir);
+
+  return pos - off % sb->block_size;
+}
+
 #define MAX_FAST_SYMLINK_NAMELEN  60
 
 ssize_t
@@ -465,39 +742,170 @@ ext2_readlink(struct Inode *inode, char *buf, size_t n)
   return ext2_read(inode, (uintptr_t) buf, n, 0);
 }
 
+/*
+ * ----------------------------------------------------------------------------
+ * Journaled operations
+ * ----------------------------------------------------------------------------
+ *
+ * Each operation that modifies the filesystem runs as one journal handle, so
+ * that its metadata updates are committed together.
+ */
+
+#define EXT2_SB(inode)  ((struct Ext2SuperblockData *) (inode)->fs->extra)
+
+static int
+ext2_j_inode_write(struct Inode *inode)
+{
+  int r;
+
+  ext2_journal_start(EXT2_SB(inode));
+  r = ext2_inode_write(inode);
+  ext2_journal_stop(EXT2_SB(inode));
+
+  return r;
+}
+
+static void
+ext2_j_inode_delete(struct Inode *inode)
+{
+  ext2_journal_start(EXT2_SB(inode));
+  ext2_inode_delete(inode);
+  ext2_journal_stop(EXT2_SB(inode));
+}
+
+static void
+ext2_j_inode_release(struct Inode *inode)
+{
+  ext2_journal_start(EXT2_SB(inode));
+  ext2_inode_release(inode);
+  ext2_journal_stop(EXT2_SB(inode));
+}
+
+static ssize_t
+ext2_j_write(struct Inode *inode, uintptr_t va, size_t n, off_t off)
+{
+  ssize_t r;
+
+  ext2_journal_start(EXT2_SB(inode));
+  r = ext2_write(inode, va, n, off);
+  ext2_journal_stop(EXT2_SB(inode));
+
+  return r;
+}
+
+static void
+ext2_j_trunc(struct Inode *inode, off_t length)
+{
+  ext2_journal_start(EXT2_SB(inode));
+  ext2_trunc(inode, length);
+  ext2_journal_stop(EXT2_SB(inode));
+}
+
+static int
+ext2_j_rmdir(struct Inode *dir, struct Inode *ip)
+{
+  int r;
+
+  ext2_journal_start(EXT2_SB(dir));
+  r = ext2_rmdir(dir, ip);
+  ext2_journal_stop(EXT2_SB(dir));
+
+  return r;
+}
+
+static int
+ext2_j_create(struct Inode *dirp, char *name, mode_t mode,
+              struct Inode **istore)
+{
+  int r;
+
+  ext2_journal_start(EXT2_SB(dirp));
+  r = ext2_create(dirp, name, mode, istore);
+  ext2_journal_stop(EXT2_SB(dirp));
+
+  return r;
+}
+
+static int
+ext2_j_mkdir(struct Inode *dirp, char *name, mode_t mode,
+             struct Inode **istore)
+{
+  int r;
+
+  ext2_journal_start(EXT2_SB(dirp));
+  r = ext2_mkdir(dirp, name, mode, istore);
+  ext2_journal_stop(EXT2_SB(dirp));
+
+  return r;
+}
+
+static int
+ext2_j_mknod(struct Inode *dirp, char *name, mode_t mode, dev_t dev,
+             struct Inode **istore)
+{
+  int r;
+
+  ext2_journal_start(EXT2_SB(dirp));
+  r = ext2_mknod(dirp, name, mode, dev, istore);
+  ext2_journal_stop(EXT2_SB(dirp));
+
+  return r;
+}
+
+static int
+ext2_j_link(struct Inode *dir, char *name, struct Inode *inode)
+{
+  int r;
+
+  ext2_journal_start(EXT2_SB(dir));
+  r = ext2_link(dir, name, inode);
+  ext2_journal_stop(EXT2_SB(dir));
+
+  return r;
+}
+
+static int
+ext2_j_unlink(struct Inode *dir, struct Inode *ip)
+{
+  int r;
+
+  ext2_journal_start(EXT2_SB(dir));
+  r = ext2_unlink(dir, ip);
+  ext2_journal_stop(EXT2_SB(dir));
+
+  return r;
+}
+
 struct FSOps ext2fs_ops = {
-  .inode_read   = ext2_inode_read,
-  .inode_write  = ext2_inode_write,
-  .inode_delete = ext2_inode_delete,
-  .read         = ext2_read,
-  .write        = ext2_write,
-  .trunc        = ext2_trunc,
-  .rmdir        = ext2_rmdir,
-  .readdir      = ext2_readdir,
-  .readlink     = ext2_readlink,
-  .create       = ext2_create,
-  .mkdir        = ext2_mkdir,
-  .mknod        = ext2_mknod,
-  .link         = ext2_link,
-  .unlink       = ext2_unlink,
-  .lookup       = ext2_lookup,
+  .inode_read    = ext2_inode_read,
+  .inode_write   = ext2_j_inode_write,
+  .inode_delete  = ext2_j_inode_delete,
+  .inode_release = ext2_j_inode_release,
+  .read          = ext2_read,
+  .write         = ext2_j_write,
+  .trunc         = ext2_j_trunc,
+  .rmdir         = ext2_j_rmdir,
+  .readdir       = ext2_readdir,
+  .readdir_batch = ext2_readdir_batch,
+  .readlink      = ext2_readlink,
+  .create        = ext2_j_create,
+  .mkdir         = ext2_j_mkdir,
+  .mknod         = ext2_j_mknod,
+  .link          = ext2_j_link,
+  .unlink        = ext2_j_unlink,
+  .lookup        = ext2_lookup,
+  .sync          = ext2_sync,
+  .prefetch      = ext2_prefetch,
 };
 
-struct Inode *
-ext2_mount(dev_t dev)
+// Read the superblock fields we use and the group descriptor table
+static uint32_t
+ext2_sb_load(struct Ext2SuperblockData *sb, dev_t dev)
 {
-  struct Buf *buf;
   struct Ext2Superblock *raw;
-  struct Ext2SuperblockData *sb;
-  struct FS *ext2fs;
-
-  if ((ext2fs = (struct FS *) k_malloc(sizeof(struct FS))) == NULL)
-    panic("cannot allocate FS");
-  if ((sb = (struct Ext2SuperblockData *) k_malloc(sizeof(struct Ext2SuperblockData))) == NULL)
-    panic("cannt allocate superblock");
+  struct Buf *buf;
+  uint32_t journal_inum;
 
-  k_mutex_init(&sb->mutex, "ext2_sb_mutex");
-  
   if ((buf = buf_read(1, 1024, dev)) == NULL)
     panic("cannot read the superblock");
 
@@ -513,10 +921,58 @@ ext2_mount(dev_t dev)
   sb->wtime             = raw->wtime;
   sb->inode_size        = raw->inode_size;
 
+  sb->dir_index = (raw->rev_level > 0) &&
+                  (raw->feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX);
+  sb->hash_unsigned = (raw->flags & EXT2_FLAGS_UNSIGNED_HASH) != 0;
+  memmove(sb->hash_seed, raw->hash_seed, sizeof(sb->hash_seed));
+
+  // 64-bit filesystems may use larger descriptors, with the high halves of
+  // the fields following the ones we use
+  if ((raw->rev_level > 0) &&
+      (raw->feature_incompat & EXT2_FEATURE_INCOMPAT_64BIT) &&
+      (raw->desc_size > sizeof(struct Ext2BlockGroup)))
+    sb->desc_size = raw->desc_size;
+  else
+    sb->desc_size = sizeof(struct Ext2BlockGroup);
+
+  journal_inum = ((raw->rev_level > 0) &&
+                  (raw->feature_compat & EXT2_FEATURE_COMPAT_HAS_JOURNAL))
+               ? raw->journal_inum
+               : 0;
+
   buf_release(buf);
 
   sb->block_size = 1024 << sb->log_block_size;
 
+  sb->groups_count = (sb->block_count + sb->blocks_per_group - 1) /
+                     sb->blocks_per_group;
+  if ((sb->groups = (struct Ext2GroupInfo *) k_malloc(sb->groups_count * sizeof(struct Ext2GroupInfo))) == NULL)
+    panic("cannot allocate block group info");
+
+  ext2_groups_load(sb, dev);
+
+  return journal_inum;
+}
+
+struct Inode *
+ext2_mount(dev_t dev)
+{
+  struct Ext2SuperblockData *sb;
+  struct KThread *scan;
+  struct FS *ext2fs;
+  uint32_t journal_inum;
+
+  if ((ext2fs = (struct FS *) k_malloc(sizeof(struct FS))) == NULL)
+    panic("cannot allocate FS");
+  if ((sb = (struct Ext2SuperblockData *) k_malloc(sizeof(struct Ext2SuperblockData))) == NULL)
+    panic("cannt allocate superblock");
+
+  k_mutex_init(&sb->mutex, "ext2_sb_mutex");
+  sb->dir_rotor = 0;
+  sb->journal   = NULL;
+
+  journal_inum = ext2_sb_load(sb, dev);
+
   cprintf("Filesystem size = %dM, inodes_count = %d, block_count = %d\n",
           sb->block_count * sb->block_size / (1024 * 1024),
           sb->inodes_count, sb->block_count);
@@ -525,8 +981,20 @@ ext2_mount(dev_t dev)
 
   ext2fs->name  = "ext2";
   ext2fs->dev   = dev;
+  ext2fs->flags = 0;
   ext2fs->extra = sb;
   ext2fs->ops   = &ext2fs_ops;
 
+  // The replayed log may have changed the superblock and the descriptors
+  if ((journal_inum != 0) && (ext2_journal_load(ext2fs, journal_inum) > 0)) {
+    k_free(sb->groups);
+    ext2_sb_load(sb, dev);
+  }
+
+  // The bitmaps are only needed by the allocations, so do not wait for them
+  if ((scan = k_thread_create(NULL, ext2_groups_scan, ext2fs,
+                              THREAD_MAX_PRIORITIES - 1)) != NULL)
+    k_thread_resume(scan);
+
   return ext2_inode_get(ext2fs, 2);
 }
@@ -5,6 +5,7 @@
 #include <sys/types.h>
 
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <kernel/fs/fs.h>
 
 /**
@@ -46,8 +47,69 @@ struct Ext2Superblock {
   uint32_t first_ino;
   uint16_t inode_size;
   uint16_t block_group_nr;
+  uint32_t feature_compat;
+  uint32_t feature_incompat;
+  uint32_t feature_ro_compat;
+  uint8_t  uuid[16];
+  char     volume_name[16];
+  char     last_mounted[64];
+  uint32_t algo_bitmap;
+  uint8_t  prealloc_blocks;
+  uint8_t  prealloc_dir_blocks;
+  uint16_t reserved_gdt_blocks;
+  uint8_t  journal_uuid[16];
+  uint32_t journal_inum;
+  uint32_t journal_dev;
+  uint32_t last_orphan;
+  /** Seed for the directory index hash function */
+  uint32_t hash_seed[4];
+  /** The default directory index hash version */
+  uint8_t  def_hash_version;
+  uint8_t  jnl_backup_type;
+  uint16_t desc_size;
+  uint32_t default_mount_opts;
+  uint32_t first_meta_bg;
+  uint32_t mkfs_time;
+  uint32_t jnl_blocks[17];
+  uint32_t blocks_count_hi;
+  uint32_t r_blocks_count_hi;
+  uint32_t free_blocks_count_hi;
+  uint16_t min_extra_isize;
+  uint16_t want_extra_isize;
+  uint32_t flags;
 } __attribute__((packed));
 
+// Compatible feature set flags
+#define EXT2_FEATURE_COMPAT_HAS_JOURNAL 0x0004
+#define EXT2_FEATURE_COMPAT_DIR_INDEX   0x0020
+
+// Incompatible feature set flags
+#define EXT2_FEATURE_INCOMPAT_RECOVER   0x0004
+#define EXT2_FEATURE_INCOMPAT_64BIT     0x0080
+
+// Superblock flags
+#define EXT2_FLAGS_SIGNED_HASH          0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH        0x0002
+
+/**
+ * In-memory copy of a block group descriptor. The free counts are written
+ * back to the descriptor table by ext2_sb_sync().
+ */
+struct Ext2GroupInfo {
+  struct KMutex mutex;      ///< Protects the counts, the hints and the bitmaps
+  uint32_t block_bitmap;    ///< ID of the first block of the block bitmap
+  uint32_t inode_bitmap;    ///< ID of the first block of the inode bitmap
+  uint32_t inode_table;     ///< ID of the first block of the inode table
+  uint32_t free_blocks_count;
+  uint32_t free_inodes_count;
+  uint32_t used_dirs_count;
+  int      dirty;           ///< The counts differ from the on-disk descriptor
+  uint32_t block_hint;      ///< All blocks below this one are in use
+  uint32_t inode_hint;      ///< All inodes below this one are in use
+};
+
+struct Ext2Journal;
+
 struct Ext2SuperblockData {
   struct KMutex mutex;
 
@@ -62,6 +124,20 @@ struct Ext2SuperblockData {
   uint16_t inode_size;
 
   uint32_t block_size;
+
+  uint32_t groups_count;
+  uint32_t desc_size;       ///< Size of a group descriptor on the disk
+  struct Ext2GroupInfo *groups;
+
+  int      dir_index;       ///< Whether hashed directory indexes can be used
+  int      hash_unsigned;   ///< Whether names are hashed as unsigned chars
+  uint32_t hash_seed[4];
+
+  /** The group where the search for the next top-level directory starts */
+  uint32_t dir_rotor;
+
+  /** The metadata journal, or NULL if the filesystem has none */
+  struct Ext2Journal *journal;
 };
 
 /**
@@ -110,8 +186,45 @@ struct Ext2Inode {
 struct Ext2InodeExtra {
   uint32_t        blocks;
   uint32_t        block[15];
+  uint32_t        flags;
+
+  // Reads may run in parallel with the inode locked for reading, so the
+  // read-ahead state and the run cache below are protected by this lock
+  struct KSpinLock lock;
+
+  // Read-ahead state
+  uint32_t        ra_next;      ///< The block expected to be read next
+  uint32_t        ra_end;       ///< The block after the last prefetched one
+  uint32_t        ra_window;    ///< The number of blocks to read ahead
+
+  // Block allocation state, protected by the inode lock
+  uint32_t        last_block;   ///< The block allocated most recently
+  uint32_t        prealloc_start; ///< The first reserved block
+  uint32_t        prealloc_count; ///< The number of reserved blocks left
+
+  // The run of consecutive blocks mapped most recently (an extent or a part
+  // of an indirect block)
+  uint32_t        ext_block;    ///< The first logical block
+  uint32_t        ext_start;    ///< The first physical block
+  uint32_t        ext_len;      ///< The number of blocks, 0 if none cached
+
+  // Directory free space hint, protected by the inode lock: the blocks below
+  // dir_hint_block have no gap for an entry of dir_hint_len bytes or more
+  uint32_t        dir_hint_block;
+  uint32_t        dir_hint_len;
 };
 
+// Inode flags
+#define EXT2_INDEX_FL   0x00001000    ///< Hashed directory index
+#define EXT2_EXTENTS_FL 0x00080000    ///< The blocks are mapped by extents
+
+// Initial and maximum read-ahead window sizes, in blocks
+#define EXT2_RA_MIN_BLOCKS  4U
+#define EXT2_RA_MAX_BLOCKS  64U
+
+// The number of blocks reserved ahead for a growing regular file
+#define EXT2_PREALLOC_BLOCKS  8U
+
 // File format
 #define EXT2_S_IFMASK   (0xF << 12)
 #define EXT2_S_IFIFO    (0x1 << 12)
@@ -155,25 +268,58 @@ struct Ext2DirEntry {
 #define EXT2_FT_SOCK      6
 #define EXT2_FT_SYMLINK   7
 
+struct Buf;
 struct Inode;
 
+/**
+ * A run of consecutive blocks waiting to be freed together.
+ */
+struct Ext2FreeBatch {
+  uint32_t start;       ///< The first block of the run
+  uint32_t count;       ///< The number of blocks, 0 if none are pending
+};
+
 extern struct FS ext2fs;
 
-int           ext2_bitmap_alloc(struct Ext2SuperblockData *, uint32_t, size_t, dev_t, uint32_t *);
-int           ext2_bitmap_free(struct Ext2SuperblockData *, uint32_t, dev_t, uint32_t);
+int           ext2_bitmap_alloc(struct Ext2SuperblockData *, uint32_t, size_t, dev_t, uint32_t, uint32_t, uint32_t *, uint32_t *);
+int           ext2_bitmap_free(struct Ext2SuperblockData *, uint32_t, dev_t, uint32_t, uint32_t *);
+int           ext2_bitmap_free_range(struct Ext2SuperblockData *, uint32_t, dev_t, uint32_t, uint32_t, uint32_t *);
+void          ext2_bitmap_hint(struct Ext2SuperblockData *, uint32_t, size_t, dev_t, uint32_t *);
 
-int           ext2_block_alloc(struct Ext2SuperblockData *, dev_t, uint32_t *);
+int           ext2_block_alloc(struct Ext2SuperblockData *, dev_t, uint32_t *, uint32_t);
+int           ext2_block_alloc_run(struct Ext2SuperblockData *, dev_t, uint32_t, uint32_t, uint32_t *);
 void          ext2_block_free(struct Ext2SuperblockData *, dev_t, uint32_t);
+void          ext2_block_free_run(struct Ext2SuperblockData *, dev_t, uint32_t, uint32_t);
+void          ext2_block_free_batch(struct Ext2SuperblockData *, dev_t, struct Ext2FreeBatch *, uint32_t);
+void          ext2_block_free_flush(struct Ext2SuperblockData *, dev_t, struct Ext2FreeBatch *);
 int           ext2_block_zero(struct Ext2SuperblockData *, uint32_t, uint32_t);
 
+int           ext2_journal_load(struct FS *, uint32_t);
+void          ext2_journal_start(struct Ext2SuperblockData *);
+void          ext2_journal_stop(struct Ext2SuperblockData *);
+void          ext2_journal_commit(struct Ext2SuperblockData *);
+void          ext2_journal_dirty(struct Ext2SuperblockData *, struct Buf *);
+void          ext2_journal_dirty_data(struct Buf *);
+void          ext2_journal_revoke(struct Ext2SuperblockData *, uint32_t);
+
+uint32_t      ext2_extent_get_block(struct Inode *, uint32_t);
+void          ext2_extent_trunc(struct Inode *, uint32_t);
+
+int           ext2_htree_lookup(struct Inode *, const char *, size_t, uint32_t *);
+int           ext2_htree_add(struct Inode *, struct Ext2DirEntry *);
+void          ext2_htree_clear(struct Inode *);
+
 int           ext2_inode_alloc(struct Ext2SuperblockData *, mode_t, dev_t, dev_t, uint32_t *, uint32_t);
-void          ext2_inode_free(struct Ext2SuperblockData *, dev_t, uint32_t);
+void          ext2_inode_free(struct Ext2SuperblockData *, dev_t, uint32_t, mode_t);
 
 void          ext2_sb_sync(struct Ext2SuperblockData *, dev_t);
+void          ext2_sync(struct FS *);
 struct Inode *ext2_mount(dev_t);
+struct Inode *ext2_inode_get(struct FS *, ino_t);
 int           ext2_inode_read(struct Inode *);
 int           ext2_inode_write(struct Inode *);
 void          ext2_inode_delete(struct Inode *);
+void          ext2_inode_release(struct Inode *);
 
 int           ext2_create(struct Inode *, char *, mode_t,
                                 struct Inode **);
@@ -185,10 +331,14 @@ int           ext2_rmdir(struct Inode *, struct Inode *);
 int           ext2_mknod(struct Inode *, char *, mode_t, dev_t, struct Inode **);
 void          ext2_trunc(struct Inode *, off_t);
 ssize_t       ext2_read(struct Inode *, uintptr_t, size_t, off_t);
+void          ext2_prefetch(struct Inode *, off_t, size_t);
 ssize_t       ext2_write(struct Inode *, uintptr_t, size_t, off_t);
 
 ssize_t       ext2_readdir(struct Inode *, void *, FillDirFunc, off_t);
+ssize_t       ext2_readdir_batch(struct Inode *, void *, FillDirFunc, off_t);
 ssize_t       ext2_readlink(struct Inode *, char *, size_t);
 uint32_t      ext2_inode_get_block(struct Inode *, uint32_t, int);
+int           ext2_run_get(struct Ext2InodeExtra *, uint32_t, uint32_t *);
+void          ext2_run_set(struct Ext2InodeExtra *, uint32_t, uint32_t, uint32_t);
 
 #endif  // !__KERNEL_FS_EXT2_H__
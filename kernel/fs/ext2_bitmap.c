@@ -27,53 +27,177 @@ bit_clear(uint32_t *bmap, size_t n)
   bmap[n / BITS_PER_WORD] &= ~(1U << (n % BITS_PER_WORD)); 
 }
 
+// Find the first zero bit in the range [from, to) of a bitmap block. Full
+// words are skipped without testing individual bits. Returns `to` if all bits
+// in the range are set.
+static uint32_t
+bit_find_zero(const uint32_t *bmap, uint32_t from, uint32_t to)
+{
+  uint32_t n = from;
+
+  while (n < to) {
+    // Treat the bits below n as used
+    uint32_t word = bmap[n / BITS_PER_WORD] | ((1U << (n % BITS_PER_WORD)) - 1);
+
+    n = ROUND_DOWN(n, BITS_PER_WORD);
+
+    if (word != ~0U)
+      return MIN(n + __builtin_ctz(~word), to);
+
+    n += BITS_PER_WORD;
+  }
+
+  return to;
+}
+
+// Look for a free bit in the range [from, to) and allocate it, together with
+// up to `max - 1` free bits that immediately follow it in the same bitmap
+// block. Returns the number of bits allocated.
+static int
+ext2_bitmap_scan(struct Ext2SuperblockData *sb, uint32_t bstart, dev_t dev,
+                 uint32_t from, uint32_t to, uint32_t max, uint32_t *bstore)
+{
+  uint32_t bits_per_block = sb->block_size * BITS_PER_BYTE;
+  uint32_t b, bi, end, n;
+
+  for (b = from; b < to; b = end) {
+    struct Buf *buf;
+    uint32_t *bmap, base;
+
+    if ((buf = buf_read(bstart + b / bits_per_block, sb->block_size, dev)) == NULL)
+      // TODO: recover from I/O errors
+      panic("cannot read the bitmap block %d", bstart + b / bits_per_block);
+
+    bmap = (uint32_t *) buf->data;
+    base = ROUND_DOWN(b, bits_per_block);
+    end  = MIN(to, base + bits_per_block);
+
+    bi = bit_find_zero(bmap, b - base, end - base);
+    if (bi == end - base) {
+      buf_release(buf);
+      continue;
+    }
+
+    for (n = 0; (n < max) && (base + bi + n < end) && !bit_test(bmap, bi + n); n++)
+      bit_set(bmap, bi + n);
+
+    ext2_journal_dirty(sb, buf);
+
+    buf_release(buf);
+    // TODO: recover from I/O errors
+
+    *bstore = base + bi;
+
+    return n;
+  }
+
+  return -ENOMEM;
+}
+
 /**
- * Try to allocate a bit from the bitmap.
+ * Try to allocate a bit from the bitmap, preferably a run of consecutive bits.
+ *
+ * The hint is the lowest bit number that may be unused, i.e. all bits below
+ * it are known to be set. It is kept in memory by the caller, protected by
+ * the same lock as the bitmap.
  * 
  * @param bstart Starting block ID of the bitmap.
  * @param blen   The length of the bitmap (in bits).
  * @param dev    The device where the bitmap is located.
- * @param bstore Pointer to the memory location to store the allocated bit
- *               number of.
+ * @param goal   The bit number to start the search from.
+ * @param max    The maximum number of consecutive bits to allocate.
+ * @param hint   Pointer to the free bit hint.
+ * @param bstore Pointer to the memory location to store the number of the
+ *               first allocated bit.
+ * 
+ * @return The number of allocated bits (at least 1), or -ENOMEM if there are
+ *         no unused bits
+ */
+int
+ext2_bitmap_alloc(struct Ext2SuperblockData *sb, uint32_t bstart, size_t blen,
+                  dev_t dev, uint32_t goal, uint32_t max, uint32_t *hint,
+                  uint32_t *bstore)
+{
+  uint32_t first = MIN(*hint, blen);
+  int r;
+
+  if ((goal < first) || (goal >= blen))
+    goal = first;
+
+  // Search forward from the goal, then wrap around to the first bit that may
+  // be unused
+  if ((r = ext2_bitmap_scan(sb, bstart, dev, goal, blen, max, bstore)) > 0) {
+    if (goal == first)
+      *hint = *bstore + r;
+    return r;
+  }
+
+  if ((r = ext2_bitmap_scan(sb, bstart, dev, first, goal, max, bstore)) > 0) {
+    *hint = *bstore + r;
+    return r;
+  }
+
+  *hint = blen;
+
+  return -ENOMEM;
+}
+
+/**
+ * Free a run of allocated bits. Each bitmap block the run spans is read and
+ * updated once, and the words entirely covered by the run are cleared at once.
+ * 
+ * @param bstart Starting block number of the bitmap.
+ * @param dev    The device where the bitmap is located.
+ * @param bit_no The first bit number to be freed.
+ * @param count  The number of bits to be freed.
+ * @param hint   Pointer to the free bit hint.
  * 
  * @retval 0       on success
- * @retval -ENOMEM if there are no unused bits
  */
 int
-ext2_bitmap_alloc(struct Ext2SuperblockData *sb, uint32_t bstart, size_t blen, dev_t dev, uint32_t *bstore)
+ext2_bitmap_free_range(struct Ext2SuperblockData *sb, uint32_t bstart,
+                       dev_t dev, uint32_t bit_no, uint32_t count,
+                       uint32_t *hint)
 {
   uint32_t bits_per_block = sb->block_size * BITS_PER_BYTE;
-  uint32_t b, bi;
+  uint32_t b, bi, end, n;
+
+  if (bit_no < *hint)
+    *hint = bit_no;
 
-  for (b = 0; b < blen; b += bits_per_block) {
+  for (n = 0; count > 0; bit_no += n, count -= n) {
     struct Buf *buf;
     uint32_t *bmap;
 
-    if ((buf = buf_read(bstart + b / bits_per_block, sb->block_size, dev)) == NULL)
-      // TODO: recover from I/O errors
-      panic("cannot read the bitmap block %d", bstart + b / bits_per_block);
-
-    bmap = (uint32_t *) buf->data;
-
-    for (bi = 0; bi < MIN(bits_per_block, blen - b); bi++) {
-      if (bit_test(bmap, bi))
-        continue;
-
-      bit_set(bmap, bi);
-      buf->flags |= BUF_DIRTY;
+    b  = bit_no / bits_per_block;
+    bi = bit_no % bits_per_block;
+    n  = MIN(count, bits_per_block - bi);
 
-      buf_release(buf);
+    if ((buf = buf_read(bstart + b, sb->block_size, dev)) == NULL)
       // TODO: recover from I/O errors
+      panic("cannot read the bitmap block %d", bstart + b);
 
-      *bstore = b + bi;
+    bmap = (uint32_t *) buf->data;
 
-      return 0;
+    for (end = bi + n; bi < end; ) {
+      if ((bi % BITS_PER_WORD == 0) && (end - bi >= BITS_PER_WORD)) {
+        if (bmap[bi / BITS_PER_WORD] != ~0U)
+          panic("bit not allocated");
+        bmap[bi / BITS_PER_WORD] = 0;
+        bi += BITS_PER_WORD;
+      } else {
+        if (!bit_test(bmap, bi))
+          panic("bit not allocated");
+        bit_clear(bmap, bi);
+        bi++;
+      }
     }
 
+    ext2_journal_dirty(sb, buf);
     buf_release(buf);
   }
 
-  return -ENOMEM;
+  return 0;
 }
 
 /**
@@ -82,34 +206,53 @@ ext2_bitmap_alloc(struct Ext2SuperblockData *sb, uint32_t bstart, size_t blen, d
  * @param bstart Starting block number of the bitmap.
  * @param dev    The device where the bitmap is located.
  * @param bit_no The bit number to be freed.
+ * @param hint   Pointer to the free bit hint.
  * 
  * @retval 0       on success
  */
 int
-ext2_bitmap_free(struct Ext2SuperblockData *sb, uint32_t bstart, dev_t dev, uint32_t bit_no)
+ext2_bitmap_free(struct Ext2SuperblockData *sb, uint32_t bstart, dev_t dev,
+                 uint32_t bit_no, uint32_t *hint)
+{
+  return ext2_bitmap_free_range(sb, bstart, dev, bit_no, 1, hint);
+}
+
+/**
+ * Advance the free bit hint past the bits that are in use, without allocating
+ * anything. Used to warm up the hints in the background, so that the first
+ * allocations after mounting do not have to scan the bitmap from the start.
+ *
+ * @param bstart Starting block ID of the bitmap.
+ * @param blen   The length of the bitmap (in bits).
+ * @param dev    The device where the bitmap is located.
+ * @param hint   Pointer to the free bit hint.
+ */
+void
+ext2_bitmap_hint(struct Ext2SuperblockData *sb, uint32_t bstart, size_t blen,
+                 dev_t dev, uint32_t *hint)
 {
   uint32_t bits_per_block = sb->block_size * BITS_PER_BYTE;
-  uint32_t b, bi;
-  struct Buf *buf;
-  uint32_t *bmap;
+  uint32_t b, base, end;
 
-  b  = bit_no / bits_per_block;
-  bi = bit_no % bits_per_block;
+  for (b = *hint; b < blen; b = end) {
+    struct Buf *buf;
+    uint32_t bi;
 
-  if ((buf = buf_read(bstart + b, sb->block_size, dev)) == NULL)
-    // TODO: recover from I/O errors
-    panic("cannot read the bitmap block %d", bstart + b);
+    if ((buf = buf_read(bstart + b / bits_per_block, sb->block_size, dev)) == NULL)
+      return;
 
-  bmap = (uint32_t *) buf->data;
+    base = ROUND_DOWN(b, bits_per_block);
+    end  = MIN(blen, base + bits_per_block);
 
-  if (!bit_test(bmap, bi))
-    panic("bit not allocated");
+    bi = bit_find_zero((uint32_t *) buf->data, b - base, end - base);
 
-  bit_clear(bmap, bi);
-  buf->flags |= BUF_DIRTY;
+    buf_release(buf);
 
-  buf_release(buf);
-  // TODO: recover from I/O errors
+    if (bi != end - base) {
+      *hint = base + bi;
+      return;
+    }
+  }
 
-  return 0;
+  *hint = blen;
 }
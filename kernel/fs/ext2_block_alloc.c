@@ -25,7 +25,7 @@ ext2_block_zero(struct Ext2SuperblockData *sb, uint32_t block_id, uint32_t dev)
     panic("cannot read block %d", block_id);
 
   memset(buf->data, 0, sb->block_size);
-  buf->flags |= BUF_DIRTY;
+  ext2_journal_dirty_data(buf);
 
   buf_release(buf);
   // TODO: recover from I/O errors!
@@ -33,49 +33,63 @@ ext2_block_zero(struct Ext2SuperblockData *sb, uint32_t block_id, uint32_t dev)
   return 0;
 }
 
-// Try to allocate a block from the block group descriptor pointed to by `gd`.
-// If there is a free block, mark it as used and store its number (relative to
-// the group) into the memory location pointed to by `bstore`. Otherwise,
-// return `-ENOMEM`.
+// Try to allocate up to `max` consecutive blocks from the block group `g`,
+// starting the search from the block `goal` (relative to the group). If there
+// is a free block, mark the run as used and store the number of its first
+// block (relative to the group) into the memory location pointed to by
+// `bstore`. Otherwise, return `-ENOMEM`.
 static int
-ext2_block_group_alloc(struct Ext2SuperblockData *sb, struct Ext2BlockGroup *gd, dev_t dev, uint32_t *bstore)
+ext2_block_group_alloc(struct Ext2SuperblockData *sb, uint32_t g, dev_t dev,
+                       uint32_t goal, uint32_t max, uint32_t *bstore)
 {
-  if (gd->free_blocks_count == 0)
+  struct Ext2GroupInfo *gi = &sb->groups[g];
+  int r;
+
+  k_mutex_lock(&gi->mutex);
+
+  if (gi->free_blocks_count == 0) {
+    k_mutex_unlock(&gi->mutex);
     return -ENOMEM;
+  }
 
-  if (ext2_bitmap_alloc(sb, gd->block_bitmap, sb->blocks_per_group, dev,
-                        bstore) < 0)
+  if ((r = ext2_bitmap_alloc(sb, gi->block_bitmap, sb->blocks_per_group, dev,
+                             goal, MIN(max, gi->free_blocks_count),
+                             &gi->block_hint, bstore)) < 0)
     // If free_blocks_count isn't zero, but we couldn't find a free block, the
     // filesystem is corrupted.
     panic("no free blocks");
 
-  gd->free_blocks_count--;
+  gi->free_blocks_count -= r;
+  gi->dirty = 1;
 
-  return 0;
+  k_mutex_unlock(&gi->mutex);
+
+  return r;
 }
 
 /**
- * Allocate a zeroed block.
+ * Allocate a run of consecutive blocks, as close to the goal as possible. The
+ * blocks are not zeroed.
  * 
- * @param dev    The device to allocate block from.
- * @param bstore Pointer to the memory location where to store the allocated
- *               block number.
- * @param inode  The number of the inode for which the allocation is performed
- *               (used as a hint where to begin the search).
+ * @param dev    The device to allocate blocks from.
+ * @param goal   The preferred block number (used as a hint where to begin the
+ *               search).
+ * @param max    The maximum number of blocks to allocate.
+ * @param bstore Pointer to the memory location where to store the first
+ *               allocated block number.
  *
- * @retval 0       Success
+ * @return The number of blocks allocated (at least 1), or a negative error
+ *         code.
+ * @retval -ENOSPC No free blocks left.
  * @retval -ENOMEM Couldn't find a free block.
  */
 int
-ext2_block_alloc(struct Ext2SuperblockData *sb, dev_t dev, uint32_t *bstore)
+ext2_block_alloc_run(struct Ext2SuperblockData *sb, dev_t dev, uint32_t goal,
+                     uint32_t max, uint32_t *bstore)
 {
   struct Process *my_process = process_current();
-  
-  uint32_t gd_start      = sb->block_size > 1024U ? 1 : 2;
-  uint32_t gds_total     = sb->block_count / sb->blocks_per_group;
-  uint32_t gds_per_block = sb->block_size / sizeof(struct Ext2BlockGroup);
-
-  uint32_t g, gi;
+  uint32_t gds_total = sb->groups_count;
+  uint32_t i, g, want;
 
   k_mutex_lock(&sb->mutex);
   
@@ -90,52 +104,109 @@ ext2_block_alloc(struct Ext2SuperblockData *sb, dev_t dev, uint32_t *bstore)
     return -ENOSPC;
   }
 
-  sb->free_blocks_count--;
+  want = MIN(max, sb->free_blocks_count);
+  sb->free_blocks_count -= want;
 
   k_mutex_unlock(&sb->mutex);
 
-  // TODO: do not exceed r_blocks_count for ordinary users!
-  // TODO: update free_blocks_count
+  if (goal >= gds_total * sb->blocks_per_group)
+    goal = 0;
 
-  // TODO: try to allocate a new block in the same group as its inode
-  // TODO: try to allocate consecutive sequences of blocks
+  // Start with the group containing the goal, then scan the following groups
+  for (i = 0; i < gds_total; i++) {
+    uint32_t block_id;
+    int r;
 
-  // Scan all group descriptors for a free block
-  for (g = 0; g < gds_total; g += gds_per_block) {
-    struct Buf *buf;
+    g = (goal / sb->blocks_per_group + i) % gds_total;
 
-    if ((buf = buf_read(gd_start + (g / gds_per_block), sb->block_size, dev)) == NULL)
-      // TODO: recover from I/O errors
-      panic("cannot read the group descriptor table");
+    r = ext2_block_group_alloc(sb, g, dev,
+                               (i == 0) ? goal % sb->blocks_per_group : 0,
+                               want, &block_id);
+    if (r > 0) {
+      if ((uint32_t) r < want) {
+        k_mutex_lock(&sb->mutex);
+        sb->free_blocks_count += want - r;
+        k_mutex_unlock(&sb->mutex);
+      }
 
-    for (gi = 0; gi < MIN(gds_per_block, gds_total - g); gi++) {
-      struct Ext2BlockGroup *gd = (struct Ext2BlockGroup *) buf->data + gi;
-      uint32_t block_id;
+      *bstore = block_id + g * sb->blocks_per_group;
 
-      if (ext2_block_group_alloc(sb, gd, dev, &block_id) == 0) {
-        buf->flags |= BUF_DIRTY;
+      return r;
+    }
+  }
 
-        buf_release(buf);
-        // TODO: recover from I/O errors
+  k_mutex_lock(&sb->mutex);
+  sb->free_blocks_count += want;
+  k_mutex_unlock(&sb->mutex);
 
-        block_id += (g + gi) * sb->blocks_per_group;
+  return -ENOMEM;
+}
 
-        ext2_block_zero(sb, block_id, dev);
+/**
+ * Allocate a zeroed block.
+ * 
+ * @param dev    The device to allocate block from.
+ * @param bstore Pointer to the memory location where to store the allocated
+ *               block number.
+ * @param goal   The preferred block number (used as a hint where to begin the
+ *               search).
+ *
+ * @retval 0       Success
+ * @retval -ENOSPC No free blocks left.
+ * @retval -ENOMEM Couldn't find a free block.
+ */
+int
+ext2_block_alloc(struct Ext2SuperblockData *sb, dev_t dev, uint32_t *bstore,
+                 uint32_t goal)
+{
+  int r;
 
-        *bstore = block_id;
+  if ((r = ext2_block_alloc_run(sb, dev, goal, 1, bstore)) < 0)
+    return r;
 
-        return 0;
-      }
-    }
+  ext2_block_zero(sb, *bstore, dev);
+
+  return 0;
+}
+
+/**
+ * Free a run of consecutive filesystem blocks. The bitmap of each group the
+ * run spans is updated in one pass, and the free counts once per group.
+ * 
+ * @param dev   The device the blocks belong to.
+ * @param start The first block number.
+ * @param count The number of blocks.
+ */
+void
+ext2_block_free_run(struct Ext2SuperblockData *sb, dev_t dev, uint32_t start,
+                    uint32_t count)
+{
+  uint32_t b, g, n, total = count;
+
+  for (b = start; count > 0; b += n, count -= n) {
+    struct Ext2GroupInfo *gi;
+
+    g  = b / sb->blocks_per_group;
+    gi = &sb->groups[g];
+    n  = MIN(count, (g + 1) * sb->blocks_per_group - b);
 
-    buf_release(buf);
+    k_mutex_lock(&gi->mutex);
+
+    ext2_bitmap_free_range(sb, gi->block_bitmap, dev,
+                           b % sb->blocks_per_group, n, &gi->block_hint);
+
+    gi->free_blocks_count += n;
+    gi->dirty = 1;
+
+    k_mutex_unlock(&gi->mutex);
   }
 
   k_mutex_lock(&sb->mutex);
-  sb->free_blocks_count++;
+  sb->free_blocks_count += total;
   k_mutex_unlock(&sb->mutex);
 
-  return -ENOMEM;
+  for (b = start; b < start + total; b++)
+    ext2_journal_revoke(sb, b);
 }
 
 /**
@@ -147,28 +218,50 @@ ext2_block_alloc(struct Ext2SuperblockData *sb, dev_t dev, uint32_t *bstore)
 void
 ext2_block_free(struct Ext2SuperblockData *sb, dev_t dev, uint32_t bno)
 {
-  struct Buf *buf;
-  struct Ext2BlockGroup *gd;
-  uint32_t gds_per_block, gd_idx, g, gi;
-
-  uint32_t gd_start = sb->block_size > 1024U ? 1 : 2;
-  gds_per_block = sb->block_size / sizeof(struct Ext2BlockGroup);
-  gd_idx = bno / sb->blocks_per_group;
-  g  = gd_idx / gds_per_block;
-  gi = gd_idx % gds_per_block;
-
-  buf = buf_read(gd_start + g, sb->block_size, dev);
-
-  gd = (struct Ext2BlockGroup *) buf->data + gi;
+  ext2_block_free_run(sb, dev, bno, 1);
+}
 
-  ext2_bitmap_free(sb, gd->block_bitmap, dev, bno % sb->blocks_per_group);
+/**
+ * Queue a block to be freed. Blocks adjacent to the ones already queued are
+ * merged into one run; any other block first frees the pending run.
+ *
+ * @param dev   The device the block belongs to.
+ * @param batch The pending run.
+ * @param bno   The block number.
+ */
+void
+ext2_block_free_batch(struct Ext2SuperblockData *sb, dev_t dev,
+                      struct Ext2FreeBatch *batch, uint32_t bno)
+{
+  if (batch->count > 0) {
+    if (bno == batch->start + batch->count) {
+      batch->count++;
+      return;
+    }
+    if (bno + 1 == batch->start) {
+      batch->start--;
+      batch->count++;
+      return;
+    }
 
-  gd->free_blocks_count++;
-  buf->flags |= BUF_DIRTY;
+    ext2_block_free_run(sb, dev, batch->start, batch->count);
+  }
 
-  buf_release(buf);
+  batch->start = bno;
+  batch->count = 1;
+}
 
-  k_mutex_lock(&sb->mutex);
-  sb->free_blocks_count++;
-  k_mutex_unlock(&sb->mutex);
+/**
+ * Free the pending run queued by ext2_block_free_batch().
+ *
+ * @param dev   The device the blocks belong to.
+ * @param batch The pending run.
+ */
+void
+ext2_block_free_flush(struct Ext2SuperblockData *sb, dev_t dev,
+                      struct Ext2FreeBatch *batch)
+{
+  if (batch->count > 0)
+    ext2_block_free_run(sb, dev, batch->start, batch->count);
+  batch->count = 0;
 }
@@ -0,0 +1,268 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/fs/buf.h>
+#include <kernel/fs/fs.h>
+#include <kernel/types.h>
+
+#include "ext2.h"
+
+/*
+ * ----------------------------------------------------------------------------
+ * Extent trees
+ * ----------------------------------------------------------------------------
+ *
+ * Inodes with EXT2_EXTENTS_FL set (created by ext4 tools) map the file with a
+ * tree of extents instead of indirect blocks. The root of the tree lives in
+ * the i_block area of the inode, index and leaf nodes occupy whole blocks.
+ * Each leaf entry maps a run of up to 32768 logical blocks to consecutive
+ * physical blocks.
+ *
+ * Only lookups and truncation are supported, extent-mapped files cannot grow.
+ */
+
+#define EXT2_EXT_MAGIC        0xF30A
+#define EXT2_EXT_MAX_DEPTH    5
+#define EXT2_EXT_INIT_MAX_LEN 32768       ///< Longer extents are uninitialized
+
+struct Ext2ExtentHeader {
+  uint16_t magic;
+  uint16_t entries;               ///< The number of valid entries
+  uint16_t max;                   ///< Capacity of the node
+  uint16_t depth;                 ///< 0 for leaf nodes
+  uint32_t generation;
+} __attribute__((packed));
+
+// Leaf node entry
+struct Ext2Extent {
+  uint32_t block;                 ///< The first logical block
+  uint16_t len;                   ///< The number of blocks
+  uint16_t start_hi;
+  uint32_t start_lo;              ///< The first physical block
+} __attribute__((packed));
+
+// Index node entry
+struct Ext2ExtentIdx {
+  uint32_t block;                 ///< The first logical block of the subtree
+  uint32_t leaf_lo;               ///< The block containing the child node
+  uint16_t leaf_hi;
+  uint16_t unused;
+} __attribute__((packed));
+
+// Validate a node header, `size` is the space available for the node
+static int
+ext2_extent_check(struct Ext2ExtentHeader *eh, size_t size, unsigned depth)
+{
+  return (eh->magic == EXT2_EXT_MAGIC) &&
+         (eh->depth == depth) &&
+         (eh->entries <= eh->max) &&
+         (sizeof(*eh) + eh->max * sizeof(struct Ext2Extent) <= size);
+}
+
+// Decode the length of a leaf entry. Uninitialized extents read as zeros.
+static inline uint32_t
+ext2_extent_len(struct Ext2Extent *ex, int *uninit)
+{
+  if (ex->len > EXT2_EXT_INIT_MAX_LEN) {
+    *uninit = 1;
+    return ex->len - EXT2_EXT_INIT_MAX_LEN;
+  }
+
+  *uninit = 0;
+  return ex->len;
+}
+
+/**
+ * Map a logical block of an extent-mapped inode.
+ *
+ * The extent found last is remembered in the inode, so sequential accesses
+ * are usually served without walking the tree.
+ *
+ * @param inode The inode (must be locked)
+ * @param n     The logical block number
+ *
+ * @return The physical block number, or 0 if the block is not mapped
+ */
+uint32_t
+ext2_extent_get_block(struct Inode *inode, uint32_t n)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) inode->extra;
+  struct Ext2ExtentHeader *eh;
+  struct Buf *buf = NULL;
+  unsigned depth;
+  uint32_t id;
+
+  if (ext2_run_get(extra, n, &id))
+    return id;
+
+  eh    = (struct Ext2ExtentHeader *) extra->block;
+  depth = eh->depth;
+
+  if ((depth > EXT2_EXT_MAX_DEPTH) ||
+      !ext2_extent_check(eh, sizeof(extra->block), depth))
+    return 0;
+
+  for (;;) {
+    uint32_t lo, hi;
+
+    if (eh->entries == 0)
+      break;
+
+    // Find the last entry starting at or before the block
+    for (lo = 1, hi = eh->entries; lo < hi; ) {
+      uint32_t mid = (lo + hi) / 2;
+
+      if (((struct Ext2Extent *) (eh + 1))[mid].block > n)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+    if (depth == 0) {
+      struct Ext2Extent *ex = (struct Ext2Extent *) (eh + 1) + (lo - 1);
+      uint32_t len, start;
+      int uninit;
+
+      len = ext2_extent_len(ex, &uninit);
+
+      if ((n < ex->block) || ((n - ex->block) >= len) ||
+          uninit || (ex->start_hi != 0))
+        break;
+
+      start = ex->start_lo;
+      ext2_run_set(extra, ex->block, start, len);
+
+      id = start + (n - ex->block);
+
+      if (buf != NULL)
+        buf_release(buf);
+
+      return id;
+    } else {
+      struct Ext2ExtentIdx *ix = (struct Ext2ExtentIdx *) (eh + 1) + (lo - 1);
+      uint32_t leaf;
+
+      if ((n < ix->block) || (ix->leaf_hi != 0))
+        break;
+
+      leaf = ix->leaf_lo;
+
+      if (buf != NULL)
+        buf_release(buf);
+
+      if ((buf = buf_read(leaf, sb->block_size, inode->dev)) == NULL)
+        return 0;
+
+      eh = (struct Ext2ExtentHeader *) buf->data;
+
+      if (!ext2_extent_check(eh, sb->block_size, --depth))
+        break;
+    }
+  }
+
+  if (buf != NULL)
+    buf_release(buf);
+
+  return 0;
+}
+
+static void
+ext2_extent_free_range(struct Inode *inode, uint32_t start, uint32_t count)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) inode->extra;
+  size_t blocks_inc = (1024U / 512U) << sb->log_block_size;
+
+  ext2_block_free_run(sb, inode->dev, start, count);
+  extra->blocks -= blocks_inc * count;
+}
+
+// Remove the mappings of all logical blocks starting from `n` from the node.
+// Return 1 if the node has no more entries.
+static int
+ext2_extent_trunc_node(struct Inode *inode, struct Ext2ExtentHeader *eh,
+                       uint32_t n)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
+  size_t blocks_inc = (1024U / 512U) << sb->log_block_size;
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) inode->extra;
+  int i;
+
+  for (i = eh->entries - 1; i >= 0; i--) {
+    if (eh->depth == 0) {
+      struct Ext2Extent *ex = (struct Ext2Extent *) (eh + 1) + i;
+      uint32_t len;
+      int uninit;
+
+      len = ext2_extent_len(ex, &uninit);
+
+      if (ex->block + len <= n)
+        break;
+
+      if (ex->block >= n) {
+        ext2_extent_free_range(inode, ex->start_lo, len);
+        eh->entries--;
+      } else {
+        ext2_extent_free_range(inode, ex->start_lo + (n - ex->block),
+                               len - (n - ex->block));
+        ex->len = (n - ex->block) + (uninit ? EXT2_EXT_INIT_MAX_LEN : 0);
+        break;
+      }
+    } else {
+      struct Ext2ExtentIdx *ix = (struct Ext2ExtentIdx *) (eh + 1) + i;
+      struct Ext2ExtentHeader *child;
+      struct Buf *buf;
+      int empty;
+
+      if ((buf = buf_read(ix->leaf_lo, sb->block_size, inode->dev)) == NULL)
+        panic("cannot read extent node");
+
+      child = (struct Ext2ExtentHeader *) buf->data;
+      if (!ext2_extent_check(child, sb->block_size, eh->depth - 1))
+        panic("bad extent node");
+
+      empty = ext2_extent_trunc_node(inode, child, n);
+
+      ext2_journal_dirty(sb, buf);
+      buf_release(buf);
+
+      if (!empty)
+        break;
+
+      ext2_block_free(sb, inode->dev, ix->leaf_lo);
+      extra->blocks -= blocks_inc;
+      eh->entries--;
+
+      if (ix->block < n)
+        break;
+    }
+  }
+
+  return eh->entries == 0;
+}
+
+/**
+ * Free the blocks of an extent-mapped inode starting from the given logical
+ * block.
+ *
+ * @param inode The inode (must be locked)
+ * @param n     The first logical block to free
+ */
+void
+ext2_extent_trunc(struct Inode *inode, uint32_t n)
+{
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) inode->extra;
+  struct Ext2ExtentHeader *eh = (struct Ext2ExtentHeader *) extra->block;
+
+  if ((eh->depth > EXT2_EXT_MAX_DEPTH) ||
+      !ext2_extent_check(eh, sizeof(extra->block), eh->depth))
+    panic("bad extent tree root");
+
+  // An empty tree starts over with the root as the only leaf
+  if (ext2_extent_trunc_node(inode, eh, n))
+    eh->depth = 0;
+
+  inode->flags |= FS_INODE_DIRTY;
+}
@@ -0,0 +1,586 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <kernel/fs/buf.h>
+#include <kernel/fs/fs.h>
+#include <kernel/types.h>
+
+#include "ext2.h"
+
+/*
+ * ----------------------------------------------------------------------------
+ * Hashed directory index (htree)
+ * ----------------------------------------------------------------------------
+ *
+ * The first block of an indexed directory holds the "." and ".." entries
+ * followed by the root of a B-tree keyed by the hash of the file names. The
+ * ".." entry covers the rest of the block, so the index is invisible to code
+ * that reads the directory linearly. Interior nodes are blocks consisting of a
+ * single unused entry followed by the index entries. The leaves are ordinary
+ * directory blocks, each holding the names from a range of hash values.
+ *
+ * Leaves that fill up cannot be split yet; in that case the index is dropped
+ * and the directory falls back to linear scanning, the same way kernels
+ * without dir_index support treat indexed directories they modify.
+ */
+
+#define EXT2_DX_MAX_LEVELS    2           ///< Root and one level of nodes
+#define EXT2_DX_ROOT_INFO     24          ///< Offset of the root info
+#define EXT2_DX_NODE_ENTRIES  8           ///< Offset of the entries in a node
+#define EXT2_DX_BLOCK_MASK    0x0FFFFFFF
+
+// Hash versions
+#define EXT2_HASH_LEGACY      0
+#define EXT2_HASH_HALF_MD4    1
+#define EXT2_HASH_TEA         2
+#define EXT2_HASH_UNSIGNED    3           ///< Added to get unsigned variants
+
+#define DE_NAME_OFFSET        offsetof(struct Ext2DirEntry, name)
+
+struct Ext2DxRootInfo {
+  uint32_t reserved_zero;
+  uint8_t  hash_version;
+  uint8_t  info_length;
+  uint8_t  indirect_levels;
+  uint8_t  unused_flags;
+} __attribute__((packed));
+
+// The first entry of each index block stores the limit and the count instead
+// of the hash value
+struct Ext2DxEntry {
+  uint32_t hash;
+  uint32_t block;
+} __attribute__((packed));
+
+struct Ext2DxCountLimit {
+  uint16_t limit;
+  uint16_t count;
+} __attribute__((packed));
+
+// Position within one level of the index
+struct Ext2DxFrame {
+  uint32_t block;                 ///< Directory block of the index node
+  uint32_t offset;                ///< Offset of the entries within the node
+  uint32_t count;                 ///< The number of entries in the node
+  uint32_t at;                    ///< The entry being followed
+};
+
+/*
+ * Hash functions, compatible with the ones used by Linux and e2fsprogs.
+ */
+
+#define ROL32(x, s)   (((x) << (s)) | ((x) >> (32 - (s))))
+
+#define F(x, y, z)    ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z)    (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z)    ((x) ^ (y) ^ (z))
+
+#define ROUND(f, a, b, c, d, x, s)  (a += f(b, c, d) + (x), a = ROL32(a, s))
+
+#define K1  0U
+#define K2  013240474631U
+#define K3  015666365641U
+
+static void
+ext2_half_md4(uint32_t buf[4], const uint32_t in[8])
+{
+  uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  ROUND(F, a, b, c, d, in[0] + K1,  3);
+  ROUND(F, d, a, b, c, in[1] + K1,  7);
+  ROUND(F, c, d, a, b, in[2] + K1, 11);
+  ROUND(F, b, c, d, a, in[3] + K1, 19);
+  ROUND(F, a, b, c, d, in[4] + K1,  3);
+  ROUND(F, d, a, b, c, in[5] + K1,  7);
+  ROUND(F, c, d, a, b, in[6] + K1, 11);
+  ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+  ROUND(G, a, b, c, d, in[1] + K2,  3);
+  ROUND(G, d, a, b, c, in[3] + K2,  5);
+  ROUND(G, c, d, a, b, in[5] + K2,  9);
+  ROUND(G, b, c, d, a, in[7] + K2, 13);
+  ROUND(G, a, b, c, d, in[0] + K2,  3);
+  ROUND(G, d, a, b, c, in[2] + K2,  5);
+  ROUND(G, c, d, a, b, in[4] + K2,  9);
+  ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+  ROUND(H, a, b, c, d, in[3] + K3,  3);
+  ROUND(H, d, a, b, c, in[7] + K3,  9);
+  ROUND(H, c, d, a, b, in[2] + K3, 11);
+  ROUND(H, b, c, d, a, in[6] + K3, 15);
+  ROUND(H, a, b, c, d, in[1] + K3,  3);
+  ROUND(H, d, a, b, c, in[5] + K3,  9);
+  ROUND(H, c, d, a, b, in[0] + K3, 11);
+  ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+#define TEA_DELTA   0x9E3779B9U
+
+static void
+ext2_tea(uint32_t buf[4], const uint32_t in[4])
+{
+  uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+  int n;
+
+  for (n = 0; n < 16; n++) {
+    sum += TEA_DELTA;
+    b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+    b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+  }
+
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+// Read a name character the way the filesystem creator's compiler did
+static inline int
+ext2_hash_char(const char *name, size_t i, int is_unsigned)
+{
+  return is_unsigned ? (int) (unsigned char) name[i]
+                     : (int) (signed char) name[i];
+}
+
+static uint32_t
+ext2_legacy_hash(const char *name, size_t len, int is_unsigned)
+{
+  uint32_t hash, hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash = hash1 + (hash0 ^ (uint32_t) (ext2_hash_char(name, i, is_unsigned) * 7152373));
+    if (hash & 0x80000000U)
+      hash -= 0x7FFFFFFF;
+    hash1 = hash0;
+    hash0 = hash;
+  }
+
+  return hash0 << 1;
+}
+
+// Pack up to `num` words of the name into `buf`, padding with the length
+static void
+ext2_str2hashbuf(const char *name, size_t len, uint32_t *buf, int num,
+                 int is_unsigned)
+{
+  uint32_t pad, val;
+  size_t i;
+
+  pad  = (uint32_t) len | ((uint32_t) len << 8);
+  pad |= pad << 16;
+  val  = pad;
+
+  if (len > (size_t) num * 4)
+    len = num * 4;
+
+  for (i = 0; i < len; i++) {
+    val = (uint32_t) ext2_hash_char(name, i, is_unsigned) + (val << 8);
+    if ((i % 4) == 3) {
+      *buf++ = val;
+      val = pad;
+      num--;
+    }
+  }
+
+  if (--num >= 0)
+    *buf++ = val;
+  while (--num >= 0)
+    *buf++ = pad;
+}
+
+static uint32_t
+ext2_dx_hash(struct Ext2SuperblockData *sb, unsigned version,
+             const char *name, size_t len)
+{
+  uint32_t buf[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+  uint32_t in[8], hash;
+  int is_unsigned = version >= EXT2_HASH_UNSIGNED;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (sb->hash_seed[i] != 0) {
+      memcpy(buf, sb->hash_seed, sizeof(buf));
+      break;
+    }
+  }
+
+  switch (is_unsigned ? version - EXT2_HASH_UNSIGNED : version) {
+  case EXT2_HASH_LEGACY:
+    hash = ext2_legacy_hash(name, len, is_unsigned);
+    break;
+  case EXT2_HASH_HALF_MD4:
+    for ( ; len > 0; name += MIN(len, 32U), len -= MIN(len, 32U)) {
+      ext2_str2hashbuf(name, len, in, 8, is_unsigned);
+      ext2_half_md4(buf, in);
+    }
+    hash = buf[1];
+    break;
+  case EXT2_HASH_TEA:
+    for ( ; len > 0; name += MIN(len, 16U), len -= MIN(len, 16U)) {
+      ext2_str2hashbuf(name, len, in, 4, is_unsigned);
+      ext2_tea(buf, in);
+    }
+    hash = buf[0];
+    break;
+  default:
+    panic("bad hash version %u", version);
+  }
+
+  // The lowest bit marks hash collisions continued in the next leaf, and the
+  // largest value is reserved as an end-of-directory marker
+  hash &= ~1U;
+  if (hash == (0x7FFFFFFFU << 1))
+    hash = 0x7FFFFFFEU << 1;
+
+  return hash;
+}
+
+/*
+ * Index traversal.
+ */
+
+static struct Buf *
+ext2_dx_read(struct Inode *dir, uint32_t n)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) dir->fs->extra;
+  uint32_t block_id;
+
+  if (n >= dir->size / sb->block_size)
+    return NULL;
+  if ((block_id = ext2_inode_get_block(dir, n, 0)) == 0)
+    return NULL;
+
+  return buf_read(block_id, sb->block_size, dir->dev);
+}
+
+// Validate the count and limit of the index node entries at `offset`
+static int
+ext2_dx_check(struct Ext2SuperblockData *sb, struct Buf *buf, uint32_t offset)
+{
+  struct Ext2DxCountLimit *cl = (struct Ext2DxCountLimit *) &buf->data[offset];
+
+  return (cl->count > 0) && (cl->count <= cl->limit) &&
+         (offset + cl->limit * sizeof(struct Ext2DxEntry) <= sb->block_size);
+}
+
+// Walk the index from the root down to the leaf that may contain the name.
+// Fill in the path to the leaf and store the name hash into `hash_store`.
+static int
+ext2_dx_probe(struct Inode *dir, const char *name, size_t name_len,
+              uint32_t *hash_store, struct Ext2DxFrame *frames,
+              int *levels_store, uint32_t *leaf_store)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) dir->fs->extra;
+  struct Ext2DxRootInfo *info;
+  struct Buf *buf;
+  uint32_t hash, n, offset;
+  unsigned version;
+  int levels, lvl;
+
+  if ((buf = ext2_dx_read(dir, 0)) == NULL)
+    return -EIO;
+
+  info = (struct Ext2DxRootInfo *) &buf->data[EXT2_DX_ROOT_INFO];
+
+  if ((info->reserved_zero != 0) ||
+      (info->info_length != sizeof(struct Ext2DxRootInfo)) ||
+      (info->hash_version > EXT2_HASH_TEA) ||
+      (info->indirect_levels >= EXT2_DX_MAX_LEVELS)) {
+    buf_release(buf);
+    return -EINVAL;
+  }
+
+  version = info->hash_version;
+  if (sb->hash_unsigned)
+    version += EXT2_HASH_UNSIGNED;
+
+  levels = info->indirect_levels + 1;
+  offset = EXT2_DX_ROOT_INFO + info->info_length;
+
+  hash = ext2_dx_hash(sb, version, name, name_len);
+
+  for (lvl = 0, n = 0; ; lvl++) {
+    struct Ext2DxEntry *entries;
+    uint32_t count, lo, hi;
+
+    if (!ext2_dx_check(sb, buf, offset)) {
+      buf_release(buf);
+      return -EINVAL;
+    }
+
+    entries = (struct Ext2DxEntry *) &buf->data[offset];
+    count   = ((struct Ext2DxCountLimit *) entries)->count;
+
+    // Find the last entry with a hash not greater than the target. The first
+    // entry covers everything below the hash of the second one.
+    for (lo = 1, hi = count; lo < hi; ) {
+      uint32_t mid = (lo + hi) / 2;
+
+      if (entries[mid].hash > hash)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+    frames[lvl].block  = n;
+    frames[lvl].offset = offset;
+    frames[lvl].count  = count;
+    frames[lvl].at     = lo - 1;
+
+    n = entries[lo - 1].block & EXT2_DX_BLOCK_MASK;
+
+    buf_release(buf);
+
+    if (lvl + 1 == levels)
+      break;
+
+    if ((buf = ext2_dx_read(dir, n)) == NULL)
+      return -EIO;
+    offset = EXT2_DX_NODE_ENTRIES;
+  }
+
+  *hash_store   = hash;
+  *levels_store = levels;
+  *leaf_store   = n;
+
+  return 0;
+}
+
+// Move to the next leaf if it continues the run of entries with the same hash.
+// Return 1 if there is such a leaf, 0 if the search is over.
+static int
+ext2_dx_next(struct Inode *dir, uint32_t hash, struct Ext2DxFrame *frames,
+             int levels, uint32_t *leaf_store)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) dir->fs->extra;
+  struct Ext2DxEntry *entries;
+  struct Buf *buf;
+  uint32_t n;
+  int lvl;
+
+  for (lvl = levels - 1; lvl >= 0; lvl--)
+    if (++frames[lvl].at < frames[lvl].count)
+      break;
+
+  if (lvl < 0)
+    return 0;
+
+  if ((buf = ext2_dx_read(dir, frames[lvl].block)) == NULL)
+    return -EIO;
+
+  entries = (struct Ext2DxEntry *) &buf->data[frames[lvl].offset];
+
+  if ((entries[frames[lvl].at].hash & ~1U) != hash) {
+    buf_release(buf);
+    return 0;
+  }
+
+  n = entries[frames[lvl].at].block & EXT2_DX_BLOCK_MASK;
+
+  buf_release(buf);
+
+  // Descend to the leftmost leaf of the subtree
+  for (lvl++; lvl < levels; lvl++) {
+    if ((buf = ext2_dx_read(dir, n)) == NULL)
+      return -EIO;
+
+    if (!ext2_dx_check(sb, buf, EXT2_DX_NODE_ENTRIES)) {
+      buf_release(buf);
+      return -EINVAL;
+    }
+
+    entries = (struct Ext2DxEntry *) &buf->data[EXT2_DX_NODE_ENTRIES];
+
+    frames[lvl].block  = n;
+    frames[lvl].offset = EXT2_DX_NODE_ENTRIES;
+    frames[lvl].count  = ((struct Ext2DxCountLimit *) entries)->count;
+    frames[lvl].at     = 0;
+
+    n = entries[0].block & EXT2_DX_BLOCK_MASK;
+
+    buf_release(buf);
+  }
+
+  *leaf_store = n;
+
+  return 1;
+}
+
+// Search a leaf block for the name
+static int
+ext2_dx_leaf_find(struct Inode *dir, uint32_t n, const char *name,
+                  size_t name_len, uint32_t *ino_store)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) dir->fs->extra;
+  struct Ext2DirEntry *de;
+  struct Buf *buf;
+  uint32_t off;
+
+  if ((buf = ext2_dx_read(dir, n)) == NULL)
+    return -EIO;
+
+  for (off = 0; off + DE_NAME_OFFSET <= sb->block_size; off += de->rec_len) {
+    de = (struct Ext2DirEntry *) &buf->data[off];
+
+    if ((de->rec_len < DE_NAME_OFFSET) || (off + de->rec_len > sb->block_size))
+      break;
+
+    if ((de->inode != 0) &&
+        (de->name_len == name_len) &&
+        (memcmp(de->name, name, name_len) == 0)) {
+      *ino_store = de->inode;
+      buf_release(buf);
+      return 0;
+    }
+  }
+
+  buf_release(buf);
+
+  return -ENOENT;
+}
+
+static int
+ext2_htree_indexed(struct Inode *dir)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) dir->fs->extra;
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) dir->extra;
+
+  return sb->dir_index && (extra->flags & EXT2_INDEX_FL);
+}
+
+/**
+ * Look up a name using the hashed directory index.
+ *
+ * @param dir       The directory inode (must be locked)
+ * @param name      The name to look up
+ * @param name_len  The length of the name
+ * @param ino_store Pointer to the memory location to store the inode number
+ *
+ * @retval 0       Success
+ * @retval -ENOENT The name does not exist
+ * @retval -EINVAL The directory is not indexed or the index is not valid, the
+ *                 caller should scan the directory linearly
+ * @retval -EIO    An I/O error occured
+ */
+int
+ext2_htree_lookup(struct Inode *dir, const char *name, size_t name_len,
+                  uint32_t *ino_store)
+{
+  struct Ext2DxFrame frames[EXT2_DX_MAX_LEVELS];
+  uint32_t hash, leaf;
+  int levels, r;
+
+  if (!ext2_htree_indexed(dir))
+    return -EINVAL;
+
+  if ((r = ext2_dx_probe(dir, name, name_len, &hash, frames, &levels,
+                         &leaf)) < 0)
+    return r;
+
+  for (;;) {
+    if ((r = ext2_dx_leaf_find(dir, leaf, name, name_len, ino_store)) != -ENOENT)
+      return r;
+
+    if ((r = ext2_dx_next(dir, hash, frames, levels, &leaf)) <= 0)
+      return (r == 0) ? -ENOENT : r;
+  }
+}
+
+/**
+ * Add an entry to the leaf selected by the hashed directory index.
+ *
+ * @param dir    The directory inode (must be locked)
+ * @param new_de The entry to add, rec_len is filled in by this function
+ *
+ * @retval 0       Success
+ * @retval -ENOSPC The leaf is full
+ * @retval -EINVAL The directory is not indexed or the index is not valid
+ * @retval -EIO    An I/O error occured
+ */
+int
+ext2_htree_add(struct Inode *dir, struct Ext2DirEntry *new_de)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) dir->fs->extra;
+  struct Ext2DxFrame frames[EXT2_DX_MAX_LEVELS];
+  struct Ext2DirEntry *de;
+  struct Buf *buf;
+  uint32_t hash, leaf, off, new_len;
+  int levels, r;
+
+  if (!ext2_htree_indexed(dir))
+    return -EINVAL;
+
+  if ((r = ext2_dx_probe(dir, new_de->name, new_de->name_len, &hash, frames,
+                         &levels, &leaf)) < 0)
+    return r;
+
+  if ((buf = ext2_dx_read(dir, leaf)) == NULL)
+    return -EIO;
+
+  new_len = ROUND_UP(DE_NAME_OFFSET + new_de->name_len, sizeof(uint32_t));
+
+  for (off = 0; off + DE_NAME_OFFSET <= sb->block_size; off += de->rec_len) {
+    uint32_t de_len;
+
+    de = (struct Ext2DirEntry *) &buf->data[off];
+
+    if ((de->rec_len < DE_NAME_OFFSET) || (off + de->rec_len > sb->block_size))
+      break;
+
+    if (de->inode == 0) {
+      if (de->rec_len < new_len)
+        continue;
+
+      // Reuse an empty entry
+      new_de->rec_len = de->rec_len;
+      memmove(de, new_de, DE_NAME_OFFSET + new_de->name_len);
+
+      ext2_journal_dirty(sb, buf);
+      buf_release(buf);
+
+      return 0;
+    }
+
+    de_len = ROUND_UP(DE_NAME_OFFSET + de->name_len, sizeof(uint32_t));
+
+    if ((de->rec_len - de_len) >= new_len) {
+      // Found enough space
+      new_de->rec_len = de->rec_len - de_len;
+      de->rec_len     = de_len;
+      memmove(&buf->data[off + de_len], new_de,
+              DE_NAME_OFFSET + new_de->name_len);
+
+      ext2_journal_dirty(sb, buf);
+      buf_release(buf);
+
+      return 0;
+    }
+  }
+
+  buf_release(buf);
+
+  return -ENOSPC;
+}
+
+/**
+ * Drop the hashed index of a directory after it has been modified in a way
+ * the index cannot reflect.
+ *
+ * @param dir The directory inode (must be locked)
+ */
+void
+ext2_htree_clear(struct Inode *dir)
+{
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) dir->extra;
+
+  if (extra->flags & EXT2_INDEX_FL) {
+    extra->flags &= ~EXT2_INDEX_FL;
+    dir->flags   |= FS_INODE_DIRTY;
+  }
+}
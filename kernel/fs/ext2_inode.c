@@ -26,37 +26,23 @@ static uint32_t
 ext2_locate_inode(struct Inode *inode, uint32_t *offset)
 {
   struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
-  unsigned gds_per_block    = sb->block_size / sizeof(struct Ext2BlockGroup);
   unsigned inodes_per_block = sb->block_size / sb->inode_size;
+  unsigned block_group, local_inode_idx;
 
-  struct Buf *buf;
-  struct Ext2BlockGroup *gd;
-  unsigned block_group, gd_table_block, gd_table_idx;
-  unsigned local_inode_idx, block;
-  uint32_t gd_start      = sb->block_size > 1024U ? 1 : 2;
-
-  // 1. Determine which block group the inode belongs to and read the
-  //    corresponding block group descriptor
+  // 1. Determine which block group the inode belongs to. The inode table
+  //    location is cached in memory at mount time
 
-  block_group    = (inode->ino - 1) / sb->inodes_per_group;
-  gd_table_block = gd_start + (block_group / gds_per_block);
-  gd_table_idx   = (block_group % gds_per_block);
-
-  if ((buf = buf_read(gd_table_block, sb->block_size, inode->dev)) == NULL)
+  block_group = (inode->ino - 1) / sb->inodes_per_group;
+  if (block_group >= sb->groups_count)
     return 0;
 
-  gd = (struct Ext2BlockGroup *) buf->data + gd_table_idx;
-
   // 2. Determine the index in the local inode table of this group descriptor
 
   local_inode_idx  = (inode->ino - 1) % sb->inodes_per_group;
 
-  block   = gd->inode_table + local_inode_idx / inodes_per_block;
   *offset = (local_inode_idx % inodes_per_block) * sb->inode_size;
 
-  buf_release(buf);
-
-  return block;
+  return sb->groups[block_group].inode_table + local_inode_idx / inodes_per_block;
 }
 
 int
@@ -85,14 +71,30 @@ ext2_inode_read(struct Inode *inode)
   inode->mtime = raw->mtime;
   inode->ctime = raw->ctime;
 
-  // cprintf("%p\n", raw->flags);
-
   extra = (struct Ext2InodeExtra *) inode->extra;
 
   // Read ext2-specific fields
   extra->blocks = raw->blocks;
+  extra->flags  = raw->flags;
   memmove(extra->block, raw->block, sizeof(extra->block));
 
+  k_spinlock_init(&extra->lock, "ext2_inode");
+
+  extra->ra_next   = 0;
+  extra->ra_end    = 0;
+  extra->ra_window = 0;
+
+  extra->last_block     = 0;
+  extra->prealloc_start = 0;
+  extra->prealloc_count = 0;
+
+  extra->ext_block = 0;
+  extra->ext_start = 0;
+  extra->ext_len   = 0;
+
+  extra->dir_hint_block = 0;
+  extra->dir_hint_len   = 0;
+
   if (S_ISCHR(inode->mode) || S_ISBLK(inode->mode)) {
     ext2_read(inode, (uintptr_t) &inode->rdev, sizeof(inode->rdev), 0);
   }
@@ -132,9 +134,10 @@ ext2_inode_write(struct Inode *inode)
 
   // Update ext2-specific fields
   raw->blocks = extra->blocks;
+  raw->flags  = extra->flags;
   memmove(raw->block, extra->block, sizeof(extra->block));
 
-  buf->flags |= BUF_DIRTY;
+  ext2_journal_dirty(sb, buf);
 
   buf_release(buf);
 
@@ -143,6 +146,85 @@ ext2_inode_write(struct Inode *inode)
 
 #define EXT2_MAX_DIRECT_BLOCKS  12
 
+// Return the reserved blocks that have not been used to the free pool
+static void
+ext2_prealloc_discard(struct Inode *inode)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) inode->extra;
+
+  if (extra->prealloc_count > 0) {
+    ext2_block_free_run(sb, inode->dev, extra->prealloc_start,
+                        extra->prealloc_count);
+    extra->prealloc_start += extra->prealloc_count;
+    extra->prealloc_count  = 0;
+  }
+}
+
+/**
+ * Called when the last reference to the inode is dropped.
+ *
+ * @param inode The inode (must be locked).
+ */
+void
+ext2_inode_release(struct Inode *inode)
+{
+  ext2_prealloc_discard(inode);
+}
+
+// Choose where to look for a free block for the n-th block of the file: right
+// after the previously allocated block or, for a new file, in the group that
+// contains the inode.
+static uint32_t
+ext2_block_goal(struct Inode *inode, uint32_t n)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) inode->extra;
+
+  if (extra->last_block != 0)
+    return extra->last_block + 1;
+
+  if ((n > 0) && (n <= EXT2_MAX_DIRECT_BLOCKS) && (extra->block[n - 1] != 0))
+    return extra->block[n - 1] + 1;
+
+  return ((inode->ino - 1) / sb->inodes_per_group) * sb->blocks_per_group;
+}
+
+// Allocate a zeroed block for the inode near the goal. Regular files reserve
+// several blocks that follow the allocated one, so that sequential writes get
+// contiguous blocks even if other files grow at the same time.
+static int
+ext2_inode_block_alloc(struct Inode *inode, uint32_t goal, uint32_t *bstore)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) inode->extra;
+  uint32_t id;
+  int r;
+
+  if ((extra->prealloc_count > 0) && (extra->prealloc_start == goal)) {
+    id = extra->prealloc_start++;
+    extra->prealloc_count--;
+  } else {
+    ext2_prealloc_discard(inode);
+
+    r = ext2_block_alloc_run(sb, inode->dev, goal,
+                             S_ISREG(inode->mode) ? 1 + EXT2_PREALLOC_BLOCKS : 1,
+                             &id);
+    if (r < 0)
+      return r;
+
+    extra->prealloc_start = id + 1;
+    extra->prealloc_count = r - 1;
+  }
+
+  ext2_block_zero(sb, id, inode->dev);
+
+  extra->last_block = id;
+  *bstore = id;
+
+  return 0;
+}
+
 uint32_t
 ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
 {
@@ -152,14 +234,21 @@ ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
   uint32_t lvl_limit, lvl_idx_mask, lvl_idx_shift;
   uint32_t id, *id_store;
   struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) inode->extra;
+  uint32_t goal, lblock = n;
   int lvl;
 
+  // Allocating blocks in extent-mapped files is not supported
+  if (extra->flags & EXT2_EXTENTS_FL)
+    return ext2_extent_get_block(inode, n);
+
+  goal = alloc ? ext2_block_goal(inode, n) : 0;
+
   if (n < EXT2_MAX_DIRECT_BLOCKS) {
     // Direct block
     id_store = &extra->block[n];
 
     if ((id = *id_store) == 0) {
-      if (!alloc || (ext2_block_alloc(sb, inode->dev, &id) != 0))
+      if (!alloc || (ext2_inode_block_alloc(inode, goal, &id) != 0))
         return 0;
 
       *id_store = id;
@@ -171,6 +260,11 @@ ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
     return id;
   }
 
+  // Consecutive blocks listed in the same indirect block are remembered, so
+  // sequential accesses need not follow the chain for each block
+  if (ext2_run_get(extra, lblock, &id))
+    return id;
+
   n -= EXT2_MAX_DIRECT_BLOCKS;
 
   lvl_limit     = (1U << shift_per_lvl);
@@ -195,9 +289,11 @@ ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
   // Get the ID of the first indirect block in the chain
   id_store = &extra->block[EXT2_MAX_DIRECT_BLOCKS + lvl];
   if ((id = *id_store) == 0) {
-    if (!alloc || (ext2_block_alloc(sb, inode->dev, &id) != 0))
+    if (!alloc || (ext2_inode_block_alloc(inode, goal, &id) != 0))
       return 0;
 
+    goal = id + 1;
+
     *id_store = id;
     extra->blocks += blocks_inc;
     inode->flags |= FS_INODE_DIRTY;
@@ -215,16 +311,26 @@ ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
     id_store += (n >> lvl_idx_shift) & lvl_idx_mask;
 
     if ((id = *id_store) == 0) {
-      if (!alloc || (ext2_block_alloc(sb, inode->dev, &id) != 0)) {
+      if (!alloc || (ext2_inode_block_alloc(inode, goal, &id) != 0)) {
         buf_release(buf);
         return 0;
       }
 
+      goal = id + 1;
+
       *id_store = id;
       extra->blocks += blocks_inc;
       inode->flags |= FS_INODE_DIRTY;
 
-      buf->flags |= BUF_DIRTY;
+      ext2_journal_dirty(sb, buf);
+    } else if (lvl == 0) {
+      uint32_t *ids_end = (uint32_t *) buf->data + (lvl_idx_mask + 1);
+      uint32_t len;
+
+      for (len = 1; (id_store + len < ids_end) && (id_store[len] == id + len); len++)
+        ;
+
+      ext2_run_set(extra, lblock, id, len);
     }
     buf_release(buf);
   
@@ -235,7 +341,8 @@ ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
 }
 
 static void
-ext2_trunc_indirect(struct Inode *inode, uint32_t *id_store, int lvl, size_t to)
+ext2_trunc_indirect(struct Inode *inode, uint32_t *id_store, int lvl, size_t to,
+                    struct Ext2FreeBatch *batch)
 {
   struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
   size_t blocks_inc    = (1024U / 512U) << sb->log_block_size;
@@ -254,14 +361,14 @@ ext2_trunc_indirect(struct Inode *inode, uint32_t *id_store, int lvl, size_t to)
     size_t i;
 
     for (i = to; i < (inc << shift_per_lvl); i = ROUND_DOWN(i + inc, inc))
-      ext2_trunc_indirect(inode, &ids[i / inc], lvl - 1, i % inc);
+      ext2_trunc_indirect(inode, &ids[i / inc], lvl - 1, i % inc, batch);
 
-    buf->flags |= BUF_DIRTY;
+    ext2_journal_dirty(sb, buf);
     buf_release(buf);
   }
 
   if (to == 0) {
-    ext2_block_free(sb, inode->dev, id);
+    ext2_block_free_batch(sb, inode->dev, batch, id);
     extra->blocks -= blocks_inc;
     *id_store = 0;
   }
@@ -275,16 +382,27 @@ ext2_trunc(struct Inode *inode, off_t length)
   size_t n          = (length + sb->block_size - 1) / sb->block_size;
   size_t end        = (inode->size + sb->block_size - 1) / sb->block_size;
   struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) inode->extra;
+  struct Ext2FreeBatch batch = { .start = 0, .count = 0 };
   
   uint32_t shift_per_lvl = (10 - 2 + sb->log_block_size);
   uint32_t lvl_start, lvl_limit;
 
   int lvl;
 
+  ext2_prealloc_discard(inode);
+  extra->last_block = 0;
+  extra->ext_len    = 0;
+
+  if (extra->flags & EXT2_EXTENTS_FL) {
+    if (n < end)
+      ext2_extent_trunc(inode, n);
+    return;
+  }
+
   // Free direct blocks
   for ( ; (n < end) && (n < EXT2_MAX_DIRECT_BLOCKS); n++) {
     if (extra->block[n] != 0) {
-      ext2_block_free(sb, inode->dev, extra->block[n]);
+      ext2_block_free_batch(sb, inode->dev, &batch, extra->block[n]);
       extra->block[n] = 0;
       extra->blocks -= blocks_inc;
     }
@@ -299,13 +417,131 @@ ext2_trunc(struct Inode *inode, off_t length)
     if (n < lvl_end) {
       ext2_trunc_indirect(inode,
                           &extra->block[EXT2_MAX_DIRECT_BLOCKS + lvl], lvl,
-                          n - lvl_start);
+                          n - lvl_start, &batch);
       n = lvl_end;
     }
 
     lvl_start  += lvl_limit;
     lvl_limit <<= shift_per_lvl;
   }
+
+  ext2_block_free_flush(sb, inode->dev, &batch);
+}
+
+// Detect sequential reads and prefetch the blocks that follow the range
+// being read. The window doubles while the reads stay sequential.
+static void
+ext2_read_ahead(struct Inode *inode, off_t off, size_t nbyte)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) inode->extra;
+  uint32_t first, end, last, n, stop;
+
+  first = off / sb->block_size;
+  end   = (off + nbyte + sb->block_size - 1) / sb->block_size;
+  last  = (inode->size + sb->block_size - 1) / sb->block_size;
+
+  k_spinlock_acquire(&extra->lock);
+
+  // The first read from the beginning of the file also counts as sequential
+  if (first == extra->ra_next) {
+    extra->ra_window = MIN(MAX(extra->ra_window * 2, EXT2_RA_MIN_BLOCKS),
+                           EXT2_RA_MAX_BLOCKS);
+  } else {
+    extra->ra_window = 0;
+    extra->ra_end    = 0;
+  }
+
+  extra->ra_next = end;
+
+  n    = MAX(end, extra->ra_end);
+  stop = MIN(end + extra->ra_window, last);
+
+  // Claim the window, so that concurrent readers do not prefetch it again
+  if (stop > n)
+    extra->ra_end = stop;
+
+  k_spinlock_release(&extra->lock);
+
+  for ( ; n < stop; n++) {
+    uint32_t block_id = ext2_inode_get_block(inode, n, 0);
+
+    if (block_id != 0)
+      buf_prefetch(block_id, sb->block_size, inode->dev);
+  }
+}
+
+/**
+ * Prefetch the blocks of a range of a regular file, e.g. when a memory mapping
+ * of the file is expected to be accessed soon. At most one read-ahead window
+ * is requested, since the prefetch queue would drop the rest anyway.
+ *
+ * @param inode The inode (locked shared or exclusively)
+ * @param off   The file offset
+ * @param nbyte The number of bytes, must not go beyond EOF
+ */
+void
+ext2_prefetch(struct Inode *inode, off_t off, size_t nbyte)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
+  uint32_t n, end;
+
+  n   = off / sb->block_size;
+  end = (off + nbyte + sb->block_size - 1) / sb->block_size;
+  end = MIN(end, n + EXT2_RA_MAX_BLOCKS);
+
+  for ( ; n < end; n++) {
+    uint32_t block_id = ext2_inode_get_block(inode, n, 0);
+
+    if (block_id != 0)
+      buf_prefetch(block_id, sb->block_size, inode->dev);
+  }
+}
+
+/**
+ * Look up a logical block in the run of blocks mapped most recently.
+ *
+ * @param extra    The inode data
+ * @param lblock   The logical block number
+ * @param id_store Pointer to the memory location to store the physical block
+ *                 number
+ *
+ * @return 1 if the block belongs to the run, 0 otherwise.
+ */
+int
+ext2_run_get(struct Ext2InodeExtra *extra, uint32_t lblock, uint32_t *id_store)
+{
+  int found;
+
+  k_spinlock_acquire(&extra->lock);
+
+  if ((found = ((lblock - extra->ext_block) < extra->ext_len)))
+    *id_store = extra->ext_start + (lblock - extra->ext_block);
+
+  k_spinlock_release(&extra->lock);
+
+  return found;
+}
+
+/**
+ * Remember a run of consecutive blocks.
+ *
+ * @param extra  The inode data
+ * @param lblock The first logical block
+ * @param start  The first physical block
+ * @param len    The number of blocks
+ */
+void
+ext2_run_set(struct Ext2InodeExtra *extra, uint32_t lblock, uint32_t start,
+             uint32_t len)
+{
+  k_spinlock_acquire(&extra->lock);
+
+  extra->ext_block = lblock;
+  extra->ext_start = start;
+  extra->ext_len   = len;
+
+  k_spinlock_release(&extra->lock);
 }
 
 ssize_t
@@ -314,6 +550,9 @@ ext2_read(struct Inode *inode, uintptr_t va, size_t nbyte, off_t off)
   size_t total, n;
   struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
 
+  if (S_ISREG(inode->mode) && (nbyte > 0))
+    ext2_read_ahead(inode, off, nbyte);
+
   for (total = 0; total < nbyte; total += n, off += n, va += n) {
     uint32_t block_id = ext2_inode_get_block(inode, off / sb->block_size, 0);
     int r;
@@ -367,7 +606,12 @@ ext2_write(struct Inode *inode, uintptr_t va, size_t nbyte, off_t off)
     }
 
     vm_space_copy_in(&buf->data[off % sb->block_size], va, n);
-    buf->flags |= BUF_DIRTY;
+
+    // Directory contents are metadata, regular file data is not journaled
+    if (S_ISDIR(inode->mode))
+      ext2_journal_dirty(sb, buf);
+    else
+      ext2_journal_dirty_data(buf);
 
     buf_release(buf);
   }
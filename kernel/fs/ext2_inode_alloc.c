@@ -1,32 +1,186 @@
 #include <kernel/assert.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <kernel/console.h>
 #include <kernel/fs/buf.h>
 #include <kernel/time.h>
+#include <kernel/types.h>
 
 #include "ext2.h"
 
-// Try to allocate an inode from the inode group descriptor pointed to by `gd`.
-// If there is a free inode, mark it as used and store its number into the
-// memory location pointed to by `istore`. Otherwise, return `-ENOMEM`.
+#define EXT2_ROOT_INO   2
+
+// Try to allocate an inode from the group `g`. If there is a free inode, mark
+// it as used and store its number (relative to the group) into the memory
+// location pointed to by `istore`. Otherwise, return `-ENOMEM`.
 static int
-ext2_inode_group_alloc(struct Ext2SuperblockData *sb, struct Ext2BlockGroup *gd, dev_t dev, uint32_t *istore)
+ext2_inode_group_alloc(struct Ext2SuperblockData *sb, uint32_t g, dev_t dev,
+                       int dir, uint32_t *istore)
 {
-  if (gd->free_inodes_count == 0)
+  struct Ext2GroupInfo *gi = &sb->groups[g];
+
+  k_mutex_lock(&gi->mutex);
+
+  if (gi->free_inodes_count == 0) {
+    k_mutex_unlock(&gi->mutex);
     return -ENOMEM;
+  }
 
-  if (ext2_bitmap_alloc(sb, gd->inode_bitmap, sb->inodes_per_group, dev, istore))
+  if (ext2_bitmap_alloc(sb, gi->inode_bitmap, sb->inodes_per_group, dev, 0, 1,
+                        &gi->inode_hint, istore) < 0)
     // If free_inodes_count isn't zero, but we cannot find a free inode, the
     // filesystem is corrupted.
     panic("no free inodes");
 
-  gd->free_inodes_count--;
+  gi->free_inodes_count--;
+  if (dir)
+    gi->used_dirs_count++;
+  gi->dirty = 1;
+
+  k_mutex_unlock(&gi->mutex);
+
+  return 0;
+}
+
+/*
+ * Orlov placement. Directories created in the root (usually unrelated trees,
+ * such as home directories) are spread across the groups with more than the
+ * average number of free inodes and blocks, preferring the groups with the
+ * fewest directories. Other directories stay close to their parent unless its
+ * group is already crowded, and files go into the group of their directory,
+ * so that a path walk touches nearby inode table and directory blocks.
+ *
+ * The group counts are read without the group locks: they are only hints, and
+ * the allocation itself falls back to a linear scan of all groups.
+ */
+
+struct Ext2GroupTotals {
+  uint32_t avefreei;    ///< The average number of free inodes in a group
+  uint32_t avefreeb;    ///< The average number of free blocks in a group
+  uint32_t ndirs;       ///< The total number of directories
+};
+
+static void
+ext2_inode_totals(struct Ext2SuperblockData *sb, struct Ext2GroupTotals *t)
+{
+  uint32_t g, freei = 0, freeb = 0;
+
+  t->ndirs = 0;
+
+  for (g = 0; g < sb->groups_count; g++) {
+    freei    += sb->groups[g].free_inodes_count;
+    freeb    += sb->groups[g].free_blocks_count;
+    t->ndirs += sb->groups[g].used_dirs_count;
+  }
+
+  t->avefreei = freei / sb->groups_count;
+  t->avefreeb = freeb / sb->groups_count;
+}
+
+// Pick a group for a new top-level directory
+static int
+ext2_inode_group_top_dir(struct Ext2SuperblockData *sb,
+                         struct Ext2GroupTotals *t, uint32_t *gstore)
+{
+  uint32_t i, best = sb->groups_count;
+
+  for (i = 0; i < sb->groups_count; i++) {
+    uint32_t g = (sb->dir_rotor + i) % sb->groups_count;
+    struct Ext2GroupInfo *gi = &sb->groups[g];
+
+    if ((gi->free_inodes_count == 0) ||
+        (gi->free_inodes_count < t->avefreei) ||
+        (gi->free_blocks_count < t->avefreeb))
+      continue;
+
+    if ((best == sb->groups_count) ||
+        (gi->used_dirs_count < sb->groups[best].used_dirs_count) ||
+        ((gi->used_dirs_count == sb->groups[best].used_dirs_count) &&
+         (gi->free_blocks_count > sb->groups[best].free_blocks_count)))
+      best = g;
+  }
+
+  if (best == sb->groups_count)
+    return -ENOMEM;
+
+  // The next search starts past this group, so that equally good groups
+  // are taken in turn
+  sb->dir_rotor = (best + 1) % sb->groups_count;
 
+  *gstore = best;
   return 0;
 }
 
+// Pick a group for a new directory deeper in the tree: the first one from the
+// parent's group on that is not crowded with directories and still has a fair
+// share of free inodes and blocks
+static int
+ext2_inode_group_dir(struct Ext2SuperblockData *sb, struct Ext2GroupTotals *t,
+                     uint32_t parent_group, uint32_t *gstore)
+{
+  uint32_t max_dirs, min_inodes, min_blocks, i;
+
+  max_dirs   = t->ndirs / sb->groups_count + sb->inodes_per_group / 16;
+  min_inodes = t->avefreei - MIN(t->avefreei, sb->inodes_per_group / 4);
+  min_blocks = t->avefreeb - MIN(t->avefreeb, sb->blocks_per_group / 4);
+
+  for (i = 0; i < sb->groups_count; i++) {
+    uint32_t g = (parent_group + i) % sb->groups_count;
+    struct Ext2GroupInfo *gi = &sb->groups[g];
+
+    if ((gi->used_dirs_count > max_dirs) ||
+        (gi->free_inodes_count == 0) ||
+        (gi->free_inodes_count < min_inodes) ||
+        (gi->free_blocks_count < min_blocks))
+      continue;
+
+    *gstore = g;
+    return 0;
+  }
+
+  // Settle for any group with at least the average number of free inodes
+  for (i = 0; i < sb->groups_count; i++) {
+    uint32_t g = (parent_group + i) % sb->groups_count;
+
+    if ((sb->groups[g].free_inodes_count > 0) &&
+        (sb->groups[g].free_inodes_count >= t->avefreei)) {
+      *gstore = g;
+      return 0;
+    }
+  }
+
+  return -ENOMEM;
+}
+
+// Pick a group for a new file: the parent's group if it has room for both the
+// inode and its data, then groups probed at growing distances from it
+static int
+ext2_inode_group_file(struct Ext2SuperblockData *sb, uint32_t parent_group,
+                      uint32_t *gstore)
+{
+  uint32_t g = parent_group, i;
+
+  if ((sb->groups[g].free_inodes_count > 0) &&
+      (sb->groups[g].free_blocks_count > 0)) {
+    *gstore = g;
+    return 0;
+  }
+
+  for (i = 1; i < sb->groups_count; i <<= 1) {
+    g = (g + i) % sb->groups_count;
+
+    if ((sb->groups[g].free_inodes_count > 0) &&
+        (sb->groups[g].free_blocks_count > 0)) {
+      *gstore = g;
+      return 0;
+    }
+  }
+
+  return -ENOMEM;
+}
+
 static int
 ext2_inode_init(struct Ext2SuperblockData *sb, dev_t dev, uint32_t table, uint32_t inum, uint16_t mode,
                 dev_t rdev)
@@ -50,12 +204,13 @@ ext2_inode_init(struct Ext2SuperblockData *sb, dev_t dev, uint32_t table, uint32
 
   if (((mode & EXT2_S_IFMASK) == EXT2_S_IFBLK) ||
       ((mode & EXT2_S_IFMASK) == EXT2_S_IFCHR)) {
-    ext2_block_alloc(sb, dev, &raw->block[0]);
+    ext2_block_alloc(sb, dev, &raw->block[0],
+                     ((inum - 1) / sb->inodes_per_group) * sb->blocks_per_group);
     struct Buf *block_buf;
 
     block_buf = buf_read(raw->block[0], sb->block_size, dev);
     memmove(block_buf->data, &rdev, sizeof rdev);
-    block_buf->flags |= BUF_DIRTY;
+    ext2_journal_dirty_data(block_buf);
     buf_release(block_buf);
 
     raw->size = sizeof rdev;
@@ -63,7 +218,7 @@ ext2_inode_init(struct Ext2SuperblockData *sb, dev_t dev, uint32_t table, uint32
     raw->blocks += sb->block_size / 512;
   }
 
-  buf->flags |= BUF_DIRTY;
+  ext2_journal_dirty(sb, buf);
   buf_release(buf);
 
   return 0;
@@ -72,9 +227,12 @@ ext2_inode_init(struct Ext2SuperblockData *sb, dev_t dev, uint32_t table, uint32
 /**
  * Allocate an inode.
  * 
+ * @param mode   The file mode; directories are placed differently from other
+ *               files.
  * @param dev    The device to allocate inode from.
  * @param istore Pointer to the memory location where to store the allocated
  *               inode number.
+ * @param parent The inode number of the parent directory.
  *
  * @retval 0       Success
  * @retval -ENOMEM Couldn't find a free inode.
@@ -83,69 +241,39 @@ int
 ext2_inode_alloc(struct Ext2SuperblockData *sb, mode_t mode, dev_t rdev, dev_t dev,
                  uint32_t *istore, uint32_t parent)
 {
-  struct Buf *buf;
-  struct Ext2BlockGroup *gd;
-  uint32_t gds_per_block, g, gi;
-  uint32_t inum;
-  uint32_t gd_start      = sb->block_size > 1024U ? 1 : 2;
-
-  gds_per_block = sb->block_size / sizeof(struct Ext2BlockGroup);
-
-  // First try to find a free block in the same group as the specified inode
-  g  = (parent - 1) / sb->inodes_per_group;
-  gi = g % gds_per_block;
-  g  = g - gi;
-
-  if ((buf = buf_read(gd_start + (g / gds_per_block), sb->block_size, dev)) == NULL)
-    panic("cannot read the group descriptor table");
-
-  gd = (struct Ext2BlockGroup *) buf->data + gi;
-
-  if (ext2_inode_group_alloc(sb, gd, dev, &inum) == 0) {
-    uint32_t table;
-
-    table = gd->inode_table;
-
-    buf->flags |= BUF_DIRTY;
-    buf_release(buf);
-
-    inum += 1 + (g + gi) * sb->inodes_per_group;
-
-    ext2_inode_init(sb, dev, table, inum, mode, rdev);
-
-    if (istore)
-      *istore = inum;
-
-    return 0;
+  struct Ext2GroupTotals totals;
+  uint32_t parent_group = (parent - 1) / sb->inodes_per_group;
+  uint32_t start, g, i, inum;
+  int r, dir = S_ISDIR(mode);
+
+  if (dir) {
+    ext2_inode_totals(sb, &totals);
+
+    if (parent == EXT2_ROOT_INO)
+      r = ext2_inode_group_top_dir(sb, &totals, &start);
+    else
+      r = ext2_inode_group_dir(sb, &totals, parent_group, &start);
+  } else {
+    r = ext2_inode_group_file(sb, parent_group, &start);
   }
 
-  // Scan all group descriptors for a free inode
-  for (g = 0; g < sb->inodes_count / sb->inodes_per_group; g += gds_per_block) {
-    if ((buf = buf_read(2 + (g / gds_per_block), sb->block_size, dev)) == NULL)
-      panic("cannot read the group descriptor table");
-
-    for (gi = 0; gi < gds_per_block; gi++) {
-      gd = (struct Ext2BlockGroup *) buf->data + gi;
-      if (ext2_inode_group_alloc(sb, gd, dev, &inum) == 0) {
-        uint32_t table;
+  if (r != 0)
+    start = parent_group;
 
-        table = gd->inode_table;
+  // Start with the chosen group, then scan all the other groups
+  for (i = 0; i < sb->groups_count; i++) {
+    g = (start + i) % sb->groups_count;
 
-        buf->flags |= BUF_DIRTY;
-        buf_release(buf);
+    if (ext2_inode_group_alloc(sb, g, dev, dir, &inum) == 0) {
+      inum += 1 + g * sb->inodes_per_group;
 
-        inum += 1 + (g + gi) * sb->inodes_per_group;
+      ext2_inode_init(sb, dev, sb->groups[g].inode_table, inum, mode, rdev);
 
-        ext2_inode_init(sb, dev, table, inum, mode, rdev);
+      if (istore)
+        *istore = inum;
 
-        if (istore)
-          *istore = inum;
-
-        return 0;
-      }
+      return 0;
     }
-
-    buf_release(buf);
   }
   
   return -ENOMEM;
@@ -154,30 +282,25 @@ ext2_inode_alloc(struct Ext2SuperblockData *sb, mode_t mode, dev_t rdev, dev_t d
 /**
  * Free a disk inode.
  * 
- * @param dev The device the inode belongs to.
- * @param bno The inode number.
+ * @param dev  The device the inode belongs to.
+ * @param bno  The inode number.
+ * @param mode The mode the inode had, to keep the directory counts.
  */
 void
-ext2_inode_free(struct Ext2SuperblockData *sb, dev_t dev, uint32_t ino)
+ext2_inode_free(struct Ext2SuperblockData *sb, dev_t dev, uint32_t ino,
+                mode_t mode)
 {
-  struct Buf *buf;
-  struct Ext2BlockGroup *gd;
-  uint32_t gds_per_block, gd_idx, g, gi;
-  uint32_t gd_start = sb->block_size > 1024U ? 1 : 2;
-
-  gds_per_block = sb->block_size / sizeof(struct Ext2BlockGroup);
-  gd_idx = ino / sb->inodes_per_group;
-  g  = gd_idx / gds_per_block;
-  gi = gd_idx % gds_per_block;
+  struct Ext2GroupInfo *gi = &sb->groups[(ino - 1) / sb->inodes_per_group];
 
-  buf = buf_read(gd_start + g, sb->block_size, dev);
+  k_mutex_lock(&gi->mutex);
 
-  gd = (struct Ext2BlockGroup *) buf->data + gi;
+  ext2_bitmap_free(sb, gi->inode_bitmap, dev, (ino - 1) % sb->inodes_per_group,
+                   &gi->inode_hint);
 
-  ext2_bitmap_free(sb, gd->inode_bitmap, dev, (ino - 1) % sb->inodes_per_group);
+  gi->free_inodes_count++;
+  if (S_ISDIR(mode) && (gi->used_dirs_count > 0))
+    gi->used_dirs_count--;
+  gi->dirty = 1;
 
-  gd->free_inodes_count++;
-  buf->flags |= BUF_DIRTY;
-
-  buf_release(buf);
+  k_mutex_unlock(&gi->mutex);
 }
@@ -0,0 +1,999 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/fs/buf.h>
+#include <kernel/fs/fs.h>
+#include <kernel/hash.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/rwmutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
+#include <kernel/types.h>
+#include <kernel/vmalloc.h>
+#include <kernel/waitqueue.h>
+
+#include "ext2.h"
+
+/*
+ * ----------------------------------------------------------------------------
+ * Metadata journal
+ * ----------------------------------------------------------------------------
+ *
+ * Filesystems with the has_journal feature (ext3, or ext4 without the 64-bit
+ * and checksum journal features) keep a log of metadata updates in the
+ * journal inode, in the JBD2 on-disk format. Modified metadata buffers are
+ * marked with BUF_META instead of being written in place. Every few seconds,
+ * on fsync() or when the transaction grows too large, the commit writes the
+ * data buffers of the device first (ordered mode), then copies of all
+ * metadata buffers followed by a commit block to the log, in one sequential
+ * run. The committed buffers are then marked BUF_LOGGED and left to the
+ * buffer cache flusher, so the in-place writes are delayed and batched.
+ *
+ * Each file system operation runs as a handle, holding the commit lock for
+ * reading, so that a transaction never contains half of an operation. The
+ * handles nest, since the operations call each other through the inode
+ * cache. The log is never wrapped around: when the space left after a commit
+ * may not fit the largest transaction, all logged buffers are written in
+ * place and the log starts over from the beginning (a checkpoint).
+ *
+ * Blocks that were logged since the last checkpoint and then freed get
+ * revoke records, so that replaying the log does not overwrite the data a
+ * reused block may hold by then. The superblock is not journaled, since it
+ * is cached as a separate 1K buffer; the free counts it holds are only hints.
+ *
+ * When mounted, a filesystem whose log is not empty is recovered the same
+ * way as by e2fsck: a scan pass finds the last committed transaction, a
+ * second pass collects the revoke records and the last pass writes the
+ * logged blocks to their places.
+ */
+
+#define JBD_MAGIC               0xC03B3998U
+
+// Journal block types
+#define JBD_DESCRIPTOR_BLOCK    1
+#define JBD_COMMIT_BLOCK        2
+#define JBD_SUPERBLOCK_V2       4
+#define JBD_REVOKE_BLOCK        5
+
+// Descriptor tag flags
+#define JBD_FLAG_ESCAPE         1   ///< The first word was the magic number
+#define JBD_FLAG_SAME_UUID      2   ///< No UUID follows the tag
+#define JBD_FLAG_LAST_TAG       8   ///< The last tag in the descriptor
+
+// Incompatible journal feature flags
+#define JBD_FEATURE_INCOMPAT_REVOKE   0x0001
+
+// How often the running transaction is committed
+#define EXT2_JOURNAL_INTERVAL   seconds2ticks(5)
+// The number of log blocks passed to the driver at once
+#define EXT2_JOURNAL_BATCH      32
+// Upper limit on the size of a transaction, in blocks
+#define EXT2_JOURNAL_MAX_TRANS  1024U
+// The number of hash chains for the revoke records read during recovery
+#define EXT2_JOURNAL_REVOKE_HASH  64
+
+// All fields of the on-disk structures are big-endian
+struct Ext2JournalHeader {
+  uint32_t magic;
+  uint32_t blocktype;
+  uint32_t sequence;
+} __attribute__((packed));
+
+struct Ext2JournalSuperblock {
+  struct Ext2JournalHeader header;
+  uint32_t blocksize;
+  /** The total number of blocks in the journal */
+  uint32_t maxlen;
+  /** The first block of the log */
+  uint32_t first;
+  /** ID of the first transaction expected in the log */
+  uint32_t sequence;
+  /** The block where the log starts, 0 if the log is empty */
+  uint32_t start;
+  uint32_t errno_;
+  uint32_t feature_compat;
+  uint32_t feature_incompat;
+  uint32_t feature_ro_compat;
+  uint8_t  uuid[16];
+} __attribute__((packed));
+
+struct Ext2JournalTag {
+  uint32_t blocknr;
+  uint16_t checksum;
+  uint16_t flags;
+} __attribute__((packed));
+
+struct Ext2JournalRevokeHeader {
+  struct Ext2JournalHeader header;
+  /** The number of bytes used in the block, including the header */
+  uint32_t count;
+} __attribute__((packed));
+
+struct Ext2Journal {
+  /** Held for reading by handles and for writing by the commit */
+  struct KRWMutex   commit_lock;
+  /** Protects the counters, the revoke list and the logged bitmap */
+  struct KSpinLock  lock;
+  /** The commit thread waits here */
+  struct KWaitQueue wait_queue;
+
+  struct Ext2SuperblockData *sb;
+  dev_t             dev;
+  uint32_t          block_size;
+
+  /** The filesystem block holding each block of the journal */
+  uint32_t         *map;
+  uint32_t          len;          ///< The number of blocks in the journal
+  uint32_t          first;        ///< The first block of the log
+  uint32_t          head;         ///< The next free block of the log
+  uint32_t          start;        ///< The start of the log, 0 if empty
+  uint32_t          sequence;     ///< ID of the running transaction
+  uint32_t          max_trans;    ///< The limit on the transaction size
+  uint8_t           uuid[16];
+
+  /** The number of buffers marked with BUF_META */
+  unsigned          meta_count;
+  /** Blocks freed in the running transaction that need revoke records */
+  uint32_t         *revokes;
+  unsigned          revoke_count;
+  unsigned          revoke_max;
+  /** One bit for each filesystem block logged since the last checkpoint or
+   *  modified by the running transaction */
+  uint32_t         *logged;
+
+  /** Descriptor, revoke and commit blocks are built here */
+  uint8_t          *scratch;
+  /** Private buffers used to write the log, bypassing the cache */
+  struct Buf        bufs[EXT2_JOURNAL_BATCH];
+};
+
+// Revoke record read from the log during recovery
+struct Ext2JournalRevoke {
+  struct KListLink link;
+  uint32_t         block;
+  uint32_t         sequence;    ///< The last transaction revoking the block
+};
+
+struct Ext2JournalRevokeTable {
+  HASH_DECLARE(hash, EXT2_JOURNAL_REVOKE_HASH);
+};
+
+enum {
+  EXT2_JOURNAL_PASS_SCAN,
+  EXT2_JOURNAL_PASS_REVOKE,
+  EXT2_JOURNAL_PASS_REPLAY,
+};
+
+static void ext2_journal_thread(void *);
+
+static inline uint32_t
+ext2_be32(uint32_t v)
+{
+  return __builtin_bswap32(v);
+}
+
+static inline uint16_t
+ext2_be16(uint16_t v)
+{
+  return __builtin_bswap16(v);
+}
+
+// Transaction IDs wrap around, compare them the way JBD2 does
+static inline int
+ext2_journal_seq_after_eq(uint32_t a, uint32_t b)
+{
+  return (int32_t) (a - b) >= 0;
+}
+
+static inline uint32_t
+ext2_journal_next(struct Ext2Journal *j, uint32_t pos)
+{
+  return (pos + 1 < j->len) ? pos + 1 : j->first;
+}
+
+static void
+ext2_journal_header(struct Ext2Journal *j, uint32_t type)
+{
+  struct Ext2JournalHeader *h = (struct Ext2JournalHeader *) j->scratch;
+
+  memset(j->scratch, 0, j->block_size);
+  h->magic     = ext2_be32(JBD_MAGIC);
+  h->blocktype = ext2_be32(type);
+  h->sequence  = ext2_be32(j->sequence);
+}
+
+// Write the first n private buffers, already set up, and wait for them
+static void
+ext2_journal_submit(struct Ext2Journal *j, unsigned n)
+{
+  struct BufCompletion completion;
+  struct Buf *bufs[EXT2_JOURNAL_BATCH];
+  unsigned i;
+
+  for (i = 0; i < n; i++) {
+    bufs[i] = &j->bufs[i];
+    k_mutex_lock(&bufs[i]->mutex);
+    bufs[i]->flags = BUF_DIRTY;
+  }
+
+  buf_completion_init(&completion, NULL);
+  buf_submit(bufs, n, &completion);
+  buf_wait(&completion);
+
+  for (i = 0; i < n; i++)
+    k_mutex_unlock(&bufs[i]->mutex);
+}
+
+// Point a private buffer at the given data and the next block of the log
+static void
+ext2_journal_setup(struct Ext2Journal *j, unsigned i, void *data)
+{
+  j->bufs[i].block_no = j->map[j->head];
+  j->bufs[i].data     = (uint8_t *) data;
+  j->head = ext2_journal_next(j, j->head);
+}
+
+// Update the log start and the expected sequence in the journal superblock
+static void
+ext2_journal_write_super(struct Ext2Journal *j)
+{
+  struct Ext2JournalSuperblock *jsb;
+  struct Buf *buf;
+
+  if ((buf = buf_read(j->map[0], j->block_size, j->dev)) == NULL)
+    panic("cannot read the journal superblock");
+
+  jsb = (struct Ext2JournalSuperblock *) buf->data;
+  jsb->sequence = ext2_be32(j->sequence);
+  jsb->start    = ext2_be32(j->start);
+  jsb->feature_incompat |= ext2_be32(JBD_FEATURE_INCOMPAT_REVOKE);
+
+  buf->flags |= BUF_DIRTY;
+  buf_write(buf);
+  buf_release(buf);
+}
+
+// Write all logged buffers in place and start the log over
+static void
+ext2_journal_checkpoint(struct Ext2Journal *j)
+{
+  buf_checkpoint(j->dev);
+
+  j->start = 0;
+  j->head  = j->first;
+  ext2_journal_write_super(j);
+
+  k_spinlock_acquire(&j->lock);
+  memset(j->logged, 0, ROUND_UP(j->sb->block_count, 32U) / 8);
+  k_spinlock_release(&j->lock);
+}
+
+// The number of log blocks needed to commit the given numbers of buffers and
+// revoke records
+static uint32_t
+ext2_journal_blocks(struct Ext2Journal *j, unsigned n, unsigned revokes)
+{
+  uint32_t per_revoke = (j->block_size -
+                         sizeof(struct Ext2JournalRevokeHeader)) / 4;
+
+  return n + (n + EXT2_JOURNAL_BATCH - 2) / (EXT2_JOURNAL_BATCH - 1) +
+         (revokes + per_revoke - 1) / per_revoke + 1;
+}
+
+// Copy the buffers to the log, each batch preceded by a descriptor block
+static void
+ext2_journal_write_blocks(struct Ext2Journal *j, struct Buf **bufs, unsigned n)
+{
+  uint8_t *copies[EXT2_JOURNAL_BATCH];
+  unsigned i, k, count;
+
+  for (i = 0; i < n; i += count) {
+    uint8_t *p;
+
+    count = MIN(n - i, EXT2_JOURNAL_BATCH - 1U);
+
+    ext2_journal_header(j, JBD_DESCRIPTOR_BLOCK);
+    ext2_journal_setup(j, 0, j->scratch);
+
+    p = j->scratch + sizeof(struct Ext2JournalHeader);
+
+    for (k = 0; k < count; k++) {
+      struct Ext2JournalTag *tag = (struct Ext2JournalTag *) p;
+      struct Buf *b = bufs[i + k];
+      uint16_t flags = 0;
+      uint8_t *data = b->data;
+
+      // A block starting with the magic number would look like a journal
+      // block during recovery, so that word is cleared in the copy
+      copies[k] = NULL;
+      if (*(uint32_t *) data == ext2_be32(JBD_MAGIC)) {
+        if ((copies[k] = (uint8_t *) k_malloc(j->block_size)) == NULL)
+          panic("cannot allocate an escaped journal block");
+        memmove(copies[k], data, j->block_size);
+        memset(copies[k], 0, sizeof(uint32_t));
+        data = copies[k];
+        flags |= JBD_FLAG_ESCAPE;
+      }
+
+      if (k > 0)
+        flags |= JBD_FLAG_SAME_UUID;
+      if (k == count - 1)
+        flags |= JBD_FLAG_LAST_TAG;
+
+      tag->blocknr  = ext2_be32(b->block_no);
+      tag->checksum = 0;
+      tag->flags    = ext2_be16(flags);
+      p += sizeof(*tag);
+
+      if (k == 0) {
+        memmove(p, j->uuid, sizeof(j->uuid));
+        p += sizeof(j->uuid);
+      }
+
+      ext2_journal_setup(j, k + 1, data);
+    }
+
+    ext2_journal_submit(j, count + 1);
+
+    for (k = 0; k < count; k++)
+      if (copies[k] != NULL)
+        k_free(copies[k]);
+  }
+}
+
+static void
+ext2_journal_write_revokes(struct Ext2Journal *j)
+{
+  struct Ext2JournalRevokeHeader *rh;
+  uint32_t per_block = (j->block_size - sizeof(*rh)) / 4;
+  unsigned i, k, count;
+
+  for (i = 0; i < j->revoke_count; i += count) {
+    uint32_t *records;
+
+    count = MIN(j->revoke_count - i, per_block);
+
+    ext2_journal_header(j, JBD_REVOKE_BLOCK);
+    rh = (struct Ext2JournalRevokeHeader *) j->scratch;
+    rh->count = ext2_be32(sizeof(*rh) + count * 4);
+
+    records = (uint32_t *) (j->scratch + sizeof(*rh));
+    for (k = 0; k < count; k++)
+      records[k] = ext2_be32(j->revokes[i + k]);
+
+    ext2_journal_setup(j, 0, j->scratch);
+    ext2_journal_submit(j, 1);
+  }
+}
+
+// Log the running transaction and then mark it committed. Called with the
+// commit lock held for writing.
+static void
+ext2_journal_do_commit(struct Ext2Journal *j)
+{
+  struct Buf **bufs;
+  unsigned i, n;
+
+  // The group descriptors are updated lazily, include them as well
+  ext2_sb_sync(j->sb, j->dev);
+
+  // Ordered mode: the data the new metadata may point to goes first
+  buf_sync(j->dev);
+
+  if ((j->meta_count == 0) && (j->revoke_count == 0))
+    return;
+
+  bufs = NULL;
+  if ((j->meta_count > 0) &&
+      ((bufs = (struct Buf **) vmalloc(j->meta_count * sizeof(*bufs),
+                                       0)) == NULL))
+    panic("cannot allocate the transaction");
+
+  n = buf_collect_dirty(j->dev, BUF_META, bufs, j->meta_count);
+
+  if (ext2_journal_blocks(j, n, j->revoke_count) > j->len - j->head)
+    ext2_journal_checkpoint(j);
+
+  if (ext2_journal_blocks(j, n, j->revoke_count) > j->len - j->head) {
+    // Cannot be made atomic, fall back to writing the blocks in place
+    warn("transaction of %u blocks does not fit into the journal", n);
+
+    for (i = 0; i < n; i++) {
+      k_mutex_lock(&bufs[i]->mutex);
+      bufs[i]->flags &= ~BUF_META;
+      buf_release(bufs[i]);
+    }
+    buf_checkpoint(j->dev);
+  } else {
+    if (j->start == 0) {
+      j->start = j->head;
+      ext2_journal_write_super(j);
+    }
+
+    for (i = 0; i < n; i++)
+      k_mutex_lock(&bufs[i]->mutex);
+
+    ext2_journal_write_blocks(j, bufs, n);
+    ext2_journal_write_revokes(j);
+
+    // Once the commit block is on the disk, the transaction is durable
+    ext2_journal_header(j, JBD_COMMIT_BLOCK);
+    ext2_journal_setup(j, 0, j->scratch);
+    ext2_journal_submit(j, 1);
+
+    // A checkpoint made room for the transaction may have cleared the bits
+    k_spinlock_acquire(&j->lock);
+    for (i = 0; i < n; i++)
+      j->logged[bufs[i]->block_no / 32] |= 1U << (bufs[i]->block_no % 32);
+    k_spinlock_release(&j->lock);
+
+    for (i = 0; i < n; i++) {
+      bufs[i]->flags = (bufs[i]->flags & ~BUF_META) | BUF_LOGGED;
+      buf_release(bufs[i]);
+    }
+
+    j->sequence++;
+  }
+
+  if (bufs != NULL)
+    vfree(bufs);
+
+  k_spinlock_acquire(&j->lock);
+  j->meta_count   = 0;
+  j->revoke_count = 0;
+  k_spinlock_release(&j->lock);
+
+  // Make sure the next transaction fits
+  if (j->len - j->head < j->max_trans)
+    ext2_journal_checkpoint(j);
+}
+
+/**
+ * Commit the running transaction to the journal, after writing the data
+ * buffers of the device. Writes the group descriptors to the buffer cache
+ * either way.
+ *
+ * @param sb The filesystem superblock
+ */
+void
+ext2_journal_commit(struct Ext2SuperblockData *sb)
+{
+  struct Ext2Journal *j = sb->journal;
+
+  assert(j != NULL);
+
+  // The commit would wait for the handle of this very thread
+  if (k_thread_current()->journal_handles > 0)
+    return;
+
+  k_rwmutex_write_lock(&j->commit_lock);
+  ext2_journal_do_commit(j);
+  k_rwmutex_write_unlock(&j->commit_lock);
+}
+
+/**
+ * Start a filesystem operation. All metadata changes made until the matching
+ * ext2_journal_stop() go into the same transaction.
+ *
+ * @param sb The filesystem superblock
+ */
+void
+ext2_journal_start(struct Ext2SuperblockData *sb)
+{
+  struct Ext2Journal *j = sb->journal;
+  struct KThread *current = k_thread_current();
+
+  if (j == NULL)
+    return;
+
+  if (current->journal_handles++ > 0)
+    return;
+
+  // Leave room in the transaction for the operation about to start
+  if (ext2_journal_blocks(j, j->meta_count, j->revoke_count) >=
+      j->max_trans / 2) {
+    k_rwmutex_write_lock(&j->commit_lock);
+    ext2_journal_do_commit(j);
+    k_rwmutex_write_unlock(&j->commit_lock);
+  }
+
+  k_rwmutex_read_lock(&j->commit_lock);
+}
+
+/**
+ * Finish a filesystem operation started with ext2_journal_start().
+ *
+ * @param sb The filesystem superblock
+ */
+void
+ext2_journal_stop(struct Ext2SuperblockData *sb)
+{
+  struct Ext2Journal *j = sb->journal;
+  struct KThread *current = k_thread_current();
+
+  if (j == NULL)
+    return;
+
+  assert(current->journal_handles > 0);
+
+  if (--current->journal_handles == 0)
+    k_rwmutex_read_unlock(&j->commit_lock);
+}
+
+// Drop the revoke record for a block that is logged again
+static void
+ext2_journal_cancel_revoke_locked(struct Ext2Journal *j, uint32_t block)
+{
+  unsigned i;
+
+  for (i = 0; i < j->revoke_count; i++) {
+    if (j->revokes[i] == block) {
+      j->revokes[i] = j->revokes[--j->revoke_count];
+      return;
+    }
+  }
+}
+
+/**
+ * Mark a modified metadata buffer. On a journaled filesystem, the buffer is
+ * held back until committed. The caller must hold the buffer mutex.
+ *
+ * @param sb  The filesystem superblock
+ * @param buf The buffer
+ */
+void
+ext2_journal_dirty(struct Ext2SuperblockData *sb, struct Buf *buf)
+{
+  struct Ext2Journal *j = sb->journal;
+
+  if (j == NULL) {
+    buf->flags |= BUF_DIRTY;
+    return;
+  }
+
+  if (!(buf->flags & BUF_META)) {
+    k_spinlock_acquire(&j->lock);
+    j->meta_count++;
+    j->logged[buf->block_no / 32] |= 1U << (buf->block_no % 32);
+    ext2_journal_cancel_revoke_locked(j, buf->block_no);
+    k_spinlock_release(&j->lock);
+  }
+
+  buf->flags |= BUF_DIRTY | BUF_META;
+  buf->flags &= ~BUF_LOGGED;
+}
+
+/**
+ * Mark a modified data buffer. Its contents no longer match any copy in the
+ * journal. The caller must hold the buffer mutex.
+ *
+ * @param buf The buffer
+ */
+void
+ext2_journal_dirty_data(struct Buf *buf)
+{
+  buf->flags = (buf->flags | BUF_DIRTY) & ~BUF_LOGGED;
+}
+
+/**
+ * Record that a block has been freed, so that the copies of it in the log
+ * are not replayed over whatever the block is reused for.
+ *
+ * @param sb    The filesystem superblock
+ * @param block The block number
+ */
+void
+ext2_journal_revoke(struct Ext2SuperblockData *sb, uint32_t block)
+{
+  struct Ext2Journal *j = sb->journal;
+
+  if (j == NULL)
+    return;
+
+  k_spinlock_acquire(&j->lock);
+
+  if (j->logged[block / 32] & (1U << (block % 32))) {
+    if (j->revoke_count == j->revoke_max) {
+      unsigned max = MAX(j->revoke_max * 2, 64U);
+      uint32_t *revokes;
+
+      if ((revokes = (uint32_t *) k_malloc(max * sizeof(*revokes))) == NULL)
+        panic("cannot allocate revoke records");
+
+      if (j->revokes != NULL) {
+        memmove(revokes, j->revokes, j->revoke_count * sizeof(*revokes));
+        k_free(j->revokes);
+      }
+
+      j->revokes    = revokes;
+      j->revoke_max = max;
+    }
+
+    j->revokes[j->revoke_count++] = block;
+  }
+
+  k_spinlock_release(&j->lock);
+}
+
+static void
+ext2_journal_thread(void *arg)
+{
+  struct Ext2Journal *j = (struct Ext2Journal *) arg;
+  int pending;
+
+  for (;;) {
+    k_spinlock_acquire(&j->lock);
+
+    k_waitqueue_timed_sleep(&j->wait_queue, &j->lock, EXT2_JOURNAL_INTERVAL);
+    pending = (j->meta_count > 0) || (j->revoke_count > 0);
+
+    k_spinlock_release(&j->lock);
+
+    if (pending)
+      ext2_journal_commit(j->sb);
+  }
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Recovery
+ * ----------------------------------------------------------------------------
+ */
+
+static struct Ext2JournalRevoke *
+ext2_journal_revoke_find(struct Ext2JournalRevokeTable *table, uint32_t block)
+{
+  struct KListLink *l;
+
+  HASH_FOREACH_ENTRY(table->hash, l, block) {
+    struct Ext2JournalRevoke *r;
+
+    r = KLIST_CONTAINER(l, struct Ext2JournalRevoke, link);
+    if (r->block == block)
+      return r;
+  }
+
+  return NULL;
+}
+
+static void
+ext2_journal_revoke_add(struct Ext2JournalRevokeTable *table, uint32_t block,
+                        uint32_t sequence)
+{
+  struct Ext2JournalRevoke *r;
+
+  if ((r = ext2_journal_revoke_find(table, block)) == NULL) {
+    if ((r = (struct Ext2JournalRevoke *) k_malloc(sizeof(*r))) == NULL)
+      panic("cannot allocate a revoke record");
+    r->block = block;
+    HASH_PUT(table->hash, &r->link, block);
+  }
+
+  r->sequence = sequence;
+}
+
+// A revoke record applies to the copies logged by the transaction that
+// wrote it and by all earlier ones
+static int
+ext2_journal_revoked(struct Ext2JournalRevokeTable *table, uint32_t block,
+                     uint32_t sequence)
+{
+  struct Ext2JournalRevoke *r = ext2_journal_revoke_find(table, block);
+
+  return (r != NULL) && ext2_journal_seq_after_eq(r->sequence, sequence);
+}
+
+// Copy a logged block to its place. The superblock is also cached as a
+// separate 1K buffer, which has to be kept up to date.
+static void
+ext2_journal_replay_block(struct Ext2Journal *j, uint32_t pos, uint32_t block,
+                          int escaped)
+{
+  struct Buf *log, *buf, *sbuf;
+
+  if ((log = buf_read(j->map[pos], j->block_size, j->dev)) == NULL)
+    panic("cannot read journal block %u", pos);
+  if ((buf = buf_read(block, j->block_size, j->dev)) == NULL)
+    panic("cannot read block %u", block);
+
+  memmove(buf->data, log->data, j->block_size);
+  if (escaped)
+    *(uint32_t *) buf->data = ext2_be32(JBD_MAGIC);
+
+  buf->flags |= BUF_DIRTY;
+  buf_write(buf);
+
+  if ((block == 0) && (j->block_size > 1024U)) {
+    if ((sbuf = buf_read(1, 1024, j->dev)) == NULL)
+      panic("cannot read the superblock");
+    memmove(sbuf->data, &buf->data[1024], 1024);
+    buf_release(sbuf);
+  }
+
+  buf_release(buf);
+  buf_release(log);
+}
+
+// Walk the log from its start. The scan pass returns the ID of the first
+// transaction without the commit block, the replay pass returns the number
+// of blocks written.
+static uint32_t
+ext2_journal_pass(struct Ext2Journal *j, int pass, uint32_t end,
+                  struct Ext2JournalRevokeTable *revokes)
+{
+  uint32_t pos = j->start, seq = j->sequence, replayed = 0;
+
+  while ((pass == EXT2_JOURNAL_PASS_SCAN) || (seq != end)) {
+    struct Ext2JournalHeader *h;
+    struct Buf *buf;
+    uint32_t off, type;
+    int done = 0;
+
+    if ((buf = buf_read(j->map[pos], j->block_size, j->dev)) == NULL)
+      panic("cannot read journal block %u", pos);
+
+    h = (struct Ext2JournalHeader *) buf->data;
+    if ((ext2_be32(h->magic) != JBD_MAGIC) ||
+        (ext2_be32(h->sequence) != seq)) {
+      buf_release(buf);
+      break;
+    }
+
+    type = ext2_be32(h->blocktype);
+    pos  = ext2_journal_next(j, pos);
+
+    switch (type) {
+    case JBD_DESCRIPTOR_BLOCK:
+      off = sizeof(*h);
+      while (off + sizeof(struct Ext2JournalTag) <= j->block_size) {
+        struct Ext2JournalTag *tag = (struct Ext2JournalTag *) &buf->data[off];
+        uint32_t block = ext2_be32(tag->blocknr);
+        uint16_t flags = ext2_be16(tag->flags);
+
+        if ((pass == EXT2_JOURNAL_PASS_REPLAY) &&
+            !ext2_journal_revoked(revokes, block, seq)) {
+          ext2_journal_replay_block(j, pos, block, flags & JBD_FLAG_ESCAPE);
+          replayed++;
+        }
+        pos = ext2_journal_next(j, pos);
+
+        off += sizeof(*tag);
+        if (!(flags & JBD_FLAG_SAME_UUID))
+          off += sizeof(j->uuid);
+        if (flags & JBD_FLAG_LAST_TAG)
+          break;
+      }
+      break;
+
+    case JBD_COMMIT_BLOCK:
+      seq++;
+      break;
+
+    case JBD_REVOKE_BLOCK:
+      if (pass == EXT2_JOURNAL_PASS_REVOKE) {
+        struct Ext2JournalRevokeHeader *rh;
+        uint32_t count;
+
+        rh = (struct Ext2JournalRevokeHeader *) buf->data;
+        count = MIN(ext2_be32(rh->count), j->block_size);
+
+        for (off = sizeof(*rh); off + 4 <= count; off += 4)
+          ext2_journal_revoke_add(revokes,
+                                  ext2_be32(*(uint32_t *) &buf->data[off]),
+                                  seq);
+      }
+      break;
+
+    default:
+      done = 1;
+      break;
+    }
+
+    buf_release(buf);
+
+    if (done)
+      break;
+  }
+
+  return (pass == EXT2_JOURNAL_PASS_REPLAY) ? replayed : seq;
+}
+
+static void
+ext2_journal_recover(struct Ext2Journal *j)
+{
+  struct Ext2JournalRevokeTable *revokes;
+  struct KListLink *l;
+  uint32_t end, n;
+
+  revokes = (struct Ext2JournalRevokeTable *) k_malloc(sizeof(*revokes));
+  if (revokes == NULL)
+    panic("cannot allocate the revoke table");
+  HASH_INIT(revokes->hash);
+
+  end = ext2_journal_pass(j, EXT2_JOURNAL_PASS_SCAN, 0, NULL);
+  ext2_journal_pass(j, EXT2_JOURNAL_PASS_REVOKE, end, revokes);
+  n = ext2_journal_pass(j, EXT2_JOURNAL_PASS_REPLAY, end, revokes);
+
+  HASH_FOREACH(revokes->hash, l) {
+    while (!k_list_is_empty(l)) {
+      struct Ext2JournalRevoke *r;
+
+      r = KLIST_CONTAINER(l->next, struct Ext2JournalRevoke, link);
+      k_list_remove(&r->link);
+      k_free(r);
+    }
+  }
+  k_free(revokes);
+
+  cprintf("Journal: replayed %u blocks from %u transactions\n",
+          n, end - j->sequence);
+
+  j->sequence = end;
+  j->start    = 0;
+  j->head     = j->first;
+  ext2_journal_write_super(j);
+}
+
+// Find the filesystem blocks holding the journal inode
+static uint32_t *
+ext2_journal_map(struct FS *fs, uint32_t inum, uint32_t *len)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) fs->extra;
+  struct Inode *inode;
+  uint32_t *map, i;
+
+  if ((inode = ext2_inode_get(fs, inum)) == NULL)
+    return NULL;
+
+  fs_inode_lock(inode);
+
+  *len = inode->size / sb->block_size;
+
+  if ((*len < 2) ||
+      ((map = (uint32_t *) vmalloc(*len * sizeof(*map), 0)) == NULL)) {
+    map = NULL;
+  } else {
+    for (i = 0; i < *len; i++) {
+      if ((map[i] = ext2_inode_get_block(inode, i, 0)) == 0) {
+        vfree(map);
+        map = NULL;
+        break;
+      }
+    }
+  }
+
+  fs_inode_unlock(inode);
+  fs_inode_put(inode);
+
+  return map;
+}
+
+/**
+ * Load the journal stored in the given inode, replaying the committed
+ * transactions if the filesystem has not been cleanly unmounted, and start
+ * journaling the metadata updates.
+ *
+ * @param fs   The filesystem
+ * @param inum The journal inode number
+ *
+ * @retval 1       The log has been replayed
+ * @retval 0       The log was empty
+ * @retval -EINVAL The journal is damaged or uses unsupported features
+ * @retval -ENOMEM Out of memory
+ */
+int
+ext2_journal_load(struct FS *fs, uint32_t inum)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) fs->extra;
+  struct Ext2JournalSuperblock *jsb;
+  struct Ext2Superblock *raw;
+  struct Ext2Journal *j;
+  struct KThread *thread;
+  struct Buf *buf;
+  uint32_t *map, len, incompat;
+  int i, r = 0;
+
+  if (sb->block_size > PAGE_SIZE) {
+    warn("journal not supported with %u-byte blocks", sb->block_size);
+    return -EINVAL;
+  }
+
+  if ((map = ext2_journal_map(fs, inum, &len)) == NULL) {
+    warn("cannot map the journal inode");
+    return -EINVAL;
+  }
+
+  if ((j = (struct Ext2Journal *) k_malloc(sizeof(*j))) == NULL) {
+    vfree(map);
+    return -ENOMEM;
+  }
+
+  if ((buf = buf_read(map[0], sb->block_size, fs->dev)) == NULL)
+    panic("cannot read the journal superblock");
+
+  jsb = (struct Ext2JournalSuperblock *) buf->data;
+
+  incompat    = ext2_be32(jsb->feature_incompat);
+  j->len      = MIN(ext2_be32(jsb->maxlen), len);
+  j->first    = ext2_be32(jsb->first);
+  j->sequence = ext2_be32(jsb->sequence);
+  j->start    = ext2_be32(jsb->start);
+  memmove(j->uuid, jsb->uuid, sizeof(j->uuid));
+
+  if ((ext2_be32(jsb->header.magic) != JBD_MAGIC) ||
+      (ext2_be32(jsb->header.blocktype) != JBD_SUPERBLOCK_V2) ||
+      (ext2_be32(jsb->blocksize) != sb->block_size) ||
+      (j->first == 0) || (j->first >= j->len) ||
+      (incompat & ~JBD_FEATURE_INCOMPAT_REVOKE) ||
+      (jsb->feature_ro_compat != 0))
+    r = -EINVAL;
+
+  buf_release(buf);
+
+  if (r != 0) {
+    // Writing to the filesystem would corrupt it further
+    if (j->start != 0)
+      panic("cannot recover the journal");
+
+    warn("unsupported journal, mounting without it");
+    k_free(j);
+    vfree(map);
+    return r;
+  }
+
+  k_rwmutex_init(&j->commit_lock, "ext2_journal");
+  k_spinlock_init(&j->lock, "ext2_journal");
+  k_waitqueue_init(&j->wait_queue);
+
+  j->sb           = sb;
+  j->dev          = fs->dev;
+  j->block_size   = sb->block_size;
+  j->map          = map;
+  j->head         = j->first;
+  j->max_trans    = MIN((j->len - j->first) / 4, EXT2_JOURNAL_MAX_TRANS);
+  j->meta_count   = 0;
+  j->revokes      = NULL;
+  j->revoke_count = 0;
+  j->revoke_max   = 0;
+
+  for (i = 0; i < EXT2_JOURNAL_BATCH; i++) {
+    memset(&j->bufs[i], 0, sizeof(j->bufs[i]));
+    k_mutex_init(&j->bufs[i].mutex, "ext2_journal_buf");
+    j->bufs[i].dev        = fs->dev;
+    j->bufs[i].block_size = sb->block_size;
+  }
+
+  j->scratch = (uint8_t *) k_malloc(sb->block_size);
+  j->logged  = (uint32_t *) vmalloc(ROUND_UP(sb->block_count, 32U) / 8,
+                                    PAGE_ALLOC_ZERO);
+  if ((j->scratch == NULL) || (j->logged == NULL))
+    panic("cannot allocate the journal");
+
+  if (j->start != 0) {
+    ext2_journal_recover(j);
+    r = 1;
+  }
+
+  // Tell other systems that the journal may have to be recovered
+  if ((buf = buf_read(1, 1024, fs->dev)) == NULL)
+    panic("cannot read the superblock");
+  raw = (struct Ext2Superblock *) buf->data;
+  raw->feature_incompat |= EXT2_FEATURE_INCOMPAT_RECOVER;
+  buf->flags |= BUF_DIRTY;
+  buf_release(buf);
+
+  sb->journal = j;
+
+  if ((thread = k_thread_create(NULL, ext2_journal_thread, j, NZERO)) == NULL)
+    panic("cannot create the journal commit thread");
+  k_thread_resume(thread);
+
+  cprintf("Journal: %u blocks, transactions up to %u blocks\n",
+          j->len, j->max_trans);
+
+  return r;
+}
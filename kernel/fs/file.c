@@ -3,14 +3,19 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <kernel/console.h>
+#include <kernel/epoll.h>
 #include <kernel/fs/file.h>
 #include <kernel/fs/fs.h>
 #include <kernel/object_pool.h>
 #include <kernel/spinlock.h>
+#include <kernel/vm.h>
 #include <kernel/net.h>
+#include <kernel/net/unix.h>
 #include <kernel/pipe.h>
 
 static struct KSpinLock file_lock;
@@ -40,6 +45,9 @@ file_alloc(struct File **fstore)
   f->node      = NULL;
   f->socket    = 0;
   f->pipe      = NULL;
+  f->epoll     = NULL;
+  f->unix_socket = NULL;
+  k_list_init(&f->epoll_items);
 
   if (fstore != NULL)
     *fstore = f;
@@ -50,9 +58,7 @@ file_alloc(struct File **fstore)
 struct File *
 file_dup(struct File *file)
 {
-  k_spinlock_acquire(&file_lock);
-  file->ref_count++;
-  k_spinlock_release(&file_lock);
+  __atomic_add_fetch(&file->ref_count, 1, __ATOMIC_RELAXED);
 
   return file;
 }
@@ -77,6 +83,10 @@ file_set_flags(struct File *file, int flags)
   k_spinlock_acquire(&file_lock);
   file->flags = (file->flags & ~STATUS_MASK) | (flags & STATUS_MASK);
   k_spinlock_release(&file_lock);
+
+  if (file->type == FD_SOCKET)
+    net_set_nonblocking(file, flags & O_NONBLOCK);
+
   return 0;
 }
 
@@ -84,19 +94,15 @@ void
 file_put(struct File *file)
 {
   int ref_count;
-  
-  k_spinlock_acquire(&file_lock);
-
-  if (file->ref_count < 1)
-    panic("bad ref_count %d", ref_count);
 
-  ref_count = --file->ref_count;
-
-  k_spinlock_release(&file_lock);
+  if ((ref_count = __atomic_sub_fetch(&file->ref_count, 1, __ATOMIC_ACQ_REL)) < 0)
+    panic("bad ref_count %d", ref_count + 1);
 
   if (ref_count > 0)
     return;
 
+  epoll_file_release(file);
+
   switch (file->type) {
     case FD_INODE:
       fs_close(file);
@@ -107,6 +113,12 @@ file_put(struct File *file)
     case FD_SOCKET:
       net_close(file);
       break;
+    case FD_UNIX:
+      unix_close(file);
+      break;
+    case FD_EPOLL:
+      epoll_close(file);
+      break;
     default:
       panic("bad file type");
   }
@@ -125,6 +137,8 @@ file_seek(struct File *file, off_t offset, int whence)
     return fs_seek(file, offset, whence);
   case FD_PIPE:
   case FD_SOCKET:
+  case FD_UNIX:
+  case FD_EPOLL:
     return -ESPIPE;
   default:
     panic("bad file type");
@@ -143,8 +157,12 @@ file_read(struct File *file, uintptr_t va, size_t nbytes)
     return fs_read(file, va, nbytes);
   case FD_SOCKET:
     return net_read(file, va, nbytes);
+  case FD_UNIX:
+    return unix_recvfrom(file, va, nbytes, 0, NULL, NULL);
   case FD_PIPE:
     return pipe_read(file, va, nbytes);
+  case FD_EPOLL:
+    return -EINVAL;
   default:
     panic("bad file type");
     return -EBADF;
@@ -162,12 +180,119 @@ file_write(struct File *file, uintptr_t va, size_t nbytes)
     return fs_write(file, va, nbytes);
   case FD_SOCKET:
     return net_write(file, va, nbytes);
+  case FD_UNIX:
+    return unix_sendto(file, va, nbytes, 0, NULL, 0);
   case FD_PIPE:
     return pipe_write(file, va, nbytes);
+  case FD_EPOLL:
+    return -EINVAL;
+  default:
+    panic("bad file type");
+    return -EBADF;
+  }
+}
+
+/**
+ * Read data into several buffers.
+ *
+ * @param file   The file to read from
+ * @param iov    The buffers (already checked by the caller)
+ * @param iovcnt The number of buffers
+ * @param offp   The offset to read from, or NULL to use the file offset
+ *
+ * @return The number of bytes read, or a negative error code.
+ */
+ssize_t
+file_readv(struct File *file, const struct iovec *iov, int iovcnt, off_t *offp)
+{
+  ssize_t total, r;
+  int i;
+
+  if ((file->flags & O_ACCMODE) == O_WRONLY)
+    return -EBADF;
+
+  switch (file->type) {
+  case FD_INODE:
+    return fs_readv(file, iov, iovcnt, offp);
+  case FD_SOCKET:
+  case FD_UNIX:
+  case FD_PIPE:
+    if (offp != NULL)
+      return -ESPIPE;
+    break;
+  case FD_EPOLL:
+    return -EINVAL;
+  default:
+    panic("bad file type");
+    return -EBADF;
+  }
+
+  // Once some data has been read, do not block waiting for more
+  for (i = 0, total = 0; i < iovcnt; i++) {
+    if ((i > 0) && !(file_poll(file, NULL) & POLLIN))
+      break;
+
+    r = file_read(file, (uintptr_t) iov[i].iov_base, iov[i].iov_len);
+    if (r < 0)
+      return (total > 0) ? total : r;
+
+    total += r;
+
+    if ((size_t) r < iov[i].iov_len)
+      break;
+  }
+
+  return total;
+}
+
+/**
+ * Write data gathered from several buffers.
+ *
+ * @param file   The file to write to
+ * @param iov    The buffers (already checked by the caller)
+ * @param iovcnt The number of buffers
+ * @param offp   The offset to write at, or NULL to use the file offset
+ *
+ * @return The number of bytes written, or a negative error code.
+ */
+ssize_t
+file_writev(struct File *file, const struct iovec *iov, int iovcnt, off_t *offp)
+{
+  ssize_t total, r;
+  int i;
+
+  if ((file->flags & O_ACCMODE) == O_RDONLY)
+    return -EBADF;
+
+  switch (file->type) {
+  case FD_INODE:
+    return fs_writev(file, iov, iovcnt, offp);
+  case FD_SOCKET:
+    return (offp != NULL) ? -ESPIPE : net_writev(file, iov, iovcnt);
+  case FD_UNIX:
+  case FD_PIPE:
+    if (offp != NULL)
+      return -ESPIPE;
+    break;
+  case FD_EPOLL:
+    return -EINVAL;
   default:
     panic("bad file type");
     return -EBADF;
   }
+
+  for (i = 0, total = 0; i < iovcnt; i++) {
+    r = file_write(file, (uintptr_t) iov[i].iov_base, iov[i].iov_len);
+    if (r < 0)
+      return (total > 0) ? total : r;
+
+    total += r;
+
+    if ((size_t) r < iov[i].iov_len)
+      break;
+  }
+
+  return total;
 }
 
 ssize_t
@@ -180,7 +305,9 @@ file_getdents(struct File *file, uintptr_t va, size_t nbytes)
   case FD_INODE:
     return fs_getdents(file, va, nbytes);
   case FD_SOCKET:
+  case FD_UNIX:
   case FD_PIPE:
+  case FD_EPOLL:
     return -ENOTDIR;
   default:
     panic("bad file type");
@@ -196,7 +323,10 @@ file_stat(struct File *file, struct stat *buf)
     return fs_fstat(file, buf);
   case FD_PIPE:
     return pipe_stat(file, buf);
+  case FD_UNIX:
+    return unix_stat(file, buf);
   case FD_SOCKET:
+  case FD_EPOLL:
     return -EBADF;
   default:
     panic("bad file type");
@@ -211,7 +341,9 @@ file_chdir(struct File *file)
   case FD_INODE:
     return fs_fchdir(file);
   case FD_SOCKET:
+  case FD_UNIX:
   case FD_PIPE:
+  case FD_EPOLL:
     return -ENOTDIR;
   default:
     panic("bad file type");
@@ -226,7 +358,9 @@ file_chmod(struct File *file, mode_t mode)
   case FD_INODE:
     return fs_fchmod(file, mode);
   case FD_SOCKET:
+  case FD_UNIX:
   case FD_PIPE:
+  case FD_EPOLL:
     return -EBADF;
   default:
     panic("bad file type");
@@ -241,7 +375,9 @@ file_chown(struct File *file, uid_t uid, gid_t gid)
   case FD_INODE:
     return fs_fchown(file, uid, gid);
   case FD_SOCKET:
+  case FD_UNIX:
   case FD_PIPE:
+  case FD_EPOLL:
     return -EBADF;
   default:
     panic("bad file type");
@@ -256,7 +392,9 @@ file_ioctl(struct File *file, int request, int arg)
   case FD_INODE:
     return fs_ioctl(file, request, arg);
   case FD_SOCKET:
+  case FD_UNIX:
   case FD_PIPE:
+  case FD_EPOLL:
     return -EBADF;
   default:
     panic("bad file type");
@@ -264,19 +402,32 @@ file_ioctl(struct File *file, int request, int arg)
   }
 }
 
+/**
+ * Check the state of a file and optionally register for notifications about
+ * its changes.
+ *
+ * @param file  The file
+ * @param entry The entry to register on the file's poll queue, or NULL
+ *
+ * @return The pending events (POLLIN, POLLOUT, etc.)
+ */
 int
-file_select(struct File *file, struct timeval *timeout)
+file_poll(struct File *file, struct PollEntry *entry)
 {
   switch (file->type) {
   case FD_INODE:
-    return fs_select(file, timeout);
+    return fs_poll(file, entry);
   case FD_SOCKET:
-    return net_select(file, timeout);
+    return net_poll(file, entry);
+  case FD_UNIX:
+    return unix_poll(file, entry);
   case FD_PIPE:
-    return -EBADF;
+    return pipe_poll(file, entry);
+  case FD_EPOLL:
+    return epoll_poll(file, entry);
   default:
     panic("bad file type");
-    return -EBADF;
+    return POLLNVAL;
   }
 }
 
@@ -290,7 +441,9 @@ file_truncate(struct File *file, off_t length)
   case FD_INODE:
     return fs_ftruncate(file, length);
   case FD_SOCKET:
+  case FD_UNIX:
   case FD_PIPE:
+  case FD_EPOLL:
     return -EBADF;
   default:
     panic("bad file type");
@@ -305,10 +458,133 @@ file_sync(struct File *file)
   case FD_INODE:
     return fs_fsync(file);
   case FD_SOCKET:
+  case FD_UNIX:
   case FD_PIPE:
+  case FD_EPOLL:
     return -EBADF;
   default:
     panic("bad file type");
     return -EBADF;
   }
 }
+
+/**
+ * Map a file into the address space of the current process.
+ *
+ * @param file  The file
+ * @param addr  The preferred starting address, or 0
+ * @param n     The size of the mapping in bytes
+ * @param prot  The mapping flags derived from the requested protection
+ * @param flags MAP_SHARED or MAP_PRIVATE
+ * @param off   The page-aligned file offset
+ *
+ * @return The starting virtual address or a negative error code
+ */
+intptr_t
+file_mmap(struct File *file, uintptr_t addr, size_t n, int prot, int flags,
+          off_t off)
+{
+  int mode = file->flags & O_ACCMODE;
+
+  if (mode == O_WRONLY)
+    return -EACCES;
+
+  if (flags & MAP_SHARED) {
+    if (prot & VM_WRITE) {
+      if (mode != O_RDWR)
+        return -EACCES;
+      prot |= VM_SHARED;
+    } else if (mode == O_RDWR) {
+      // May be made writable later by mprotect(). A read-only descriptor can
+      // never write to the file, so its mappings are simply private ones.
+      prot |= VM_SHARED;
+    }
+  }
+
+  switch (file->type) {
+  case FD_INODE:
+    return fs_mmap(file, addr, n, prot, off);
+  case FD_SOCKET:
+  case FD_UNIX:
+  case FD_PIPE:
+  case FD_EPOLL:
+    return -ENODEV;
+  default:
+    panic("bad file type");
+    return -EBADF;
+  }
+}
+
+/**
+ * Move data between two files without copying it through user space. One of
+ * the files must be a pipe.
+ *
+ * @param in  The file to read from
+ * @param out The file to write to
+ * @param n   The maximum number of bytes to move
+ *
+ * @return The number of bytes moved, or a negative error code.
+ */
+ssize_t
+file_splice(struct File *in, struct File *out, size_t n)
+{
+  if (((in->flags & O_ACCMODE) == O_WRONLY) ||
+      ((out->flags & O_ACCMODE) == O_RDONLY))
+    return -EBADF;
+
+  if ((in->type == FD_PIPE) && (out->type == FD_PIPE) && (in->pipe == out->pipe))
+    return -EINVAL;
+
+  if (in->type == FD_PIPE)
+    return pipe_splice_from(in, out, n);
+  if (out->type == FD_PIPE)
+    return pipe_splice_to(in, out, n);
+
+  return -EINVAL;
+}
+
+/**
+ * Copy data from one pipe to another without consuming it.
+ *
+ * @param in  The pipe to read from
+ * @param out The pipe to write to
+ * @param n   The maximum number of bytes to copy
+ *
+ * @return The number of bytes copied, or a negative error code.
+ */
+ssize_t
+file_tee(struct File *in, struct File *out, size_t n)
+{
+  if (((in->flags & O_ACCMODE) == O_WRONLY) ||
+      ((out->flags & O_ACCMODE) == O_RDONLY))
+    return -EBADF;
+
+  if ((in->type != FD_PIPE) || (out->type != FD_PIPE) || (in->pipe == out->pipe))
+    return -EINVAL;
+
+  return pipe_tee(in, out, n);
+}
+
+/**
+ * Copy data from a regular file to another file without copying it through
+ * user space.
+ *
+ * @param out   The file to write to
+ * @param in    The file to read from (must be a regular file)
+ * @param offp  The offset to read from, or NULL to use the file offset
+ * @param count The maximum number of bytes to copy
+ *
+ * @return The number of bytes copied, or a negative error code.
+ */
+ssize_t
+file_sendfile(struct File *out, struct File *in, off_t *offp, size_t count)
+{
+  if (((in->flags & O_ACCMODE) == O_WRONLY) ||
+      ((out->flags & O_ACCMODE) == O_RDONLY))
+    return -EBADF;
+
+  if (in->type != FD_INODE)
+    return -EINVAL;
+
+  return fs_sendfile(in, out, offp, count);
+}
@@ -1,12 +1,19 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <kernel/fs/buf.h>
 #include <kernel/fs/fs.h>
 #include <kernel/fs/file.h>
 #include <kernel/console.h>
+#include <kernel/page.h>
+#include <kernel/process.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
 
 #define STATUS_MASK (O_APPEND | O_NONBLOCK | O_SYNC)
 
@@ -62,6 +69,51 @@ fs_access(const char *path, int amode)
   return r;
 }
 
+/**
+ * Get the status of a file without opening it. Relative paths are looked up
+ * from the given directory, so that a caller going through the entries of a
+ * directory does not have to walk the full path for each of them.
+ *
+ * @param dir  The starting directory, or NULL to use the working directory
+ * @param path The path to the file
+ * @param buf  Pointer to the memory location to store the status
+ *
+ * @retval 0        Success
+ * @retval -ENOTDIR dir is not a directory
+ * @retval -ENOENT  The file does not exist
+ */
+int
+fs_stat_at(struct File *dir, const char *path, struct stat *buf)
+{
+  struct PathNode *start, *path_node;
+  struct Inode *inode;
+  int r;
+
+  if (dir == NULL)
+    start = process_current()->cwd;
+  else if (dir->type == FD_INODE)
+    start = dir->node;
+  else
+    return -ENOTDIR;
+
+  if ((r = fs_lookup_at(start, path, 0, &path_node)) < 0)
+    return r;
+
+  if (path_node == NULL)
+    return -ENOENT;
+
+  inode = fs_path_inode(path_node);
+  fs_path_put(path_node);
+
+  fs_inode_lock_shared(inode);
+  r = fs_inode_stat_locked(inode, buf);
+  fs_inode_unlock_shared(inode);
+
+  fs_inode_put(inode);
+
+  return r;
+}
+
 int
 fs_open(const char *path, int oflag, mode_t mode, struct File **file_store)
 {
@@ -210,8 +262,56 @@ fs_seek(struct File *file, off_t offset, int whence)
 
 ssize_t
 fs_read(struct File *file, uintptr_t va, size_t nbytes)
+{
+  struct iovec iov = { (void *) va, nbytes };
+
+  return fs_readv(file, &iov, 1, NULL);
+}
+
+// Read into each buffer in turn, stopping at the first short read. For
+// devices, only proceed to the next buffer if that would not block.
+static ssize_t
+fs_inode_readv_locked(struct Inode *inode, const struct iovec *iov, int iovcnt,
+                      off_t *off)
+{
+  ssize_t total, r;
+  int i;
+
+  for (i = 0, total = 0; i < iovcnt; i++) {
+    if ((i > 0) && !S_ISREG(inode->mode) &&
+        !(fs_inode_poll_locked(inode, NULL) & POLLIN))
+      break;
+
+    r = fs_inode_read_locked(inode, (uintptr_t) iov[i].iov_base,
+                             iov[i].iov_len, off);
+    if (r < 0)
+      return (total > 0) ? total : r;
+
+    total += r;
+
+    if ((size_t) r < iov[i].iov_len)
+      break;
+  }
+
+  return total;
+}
+
+/**
+ * Read file data into several buffers.
+ *
+ * @param file   The file to read from
+ * @param iov    The buffers
+ * @param iovcnt The number of buffers
+ * @param offp   The offset to read from. If NULL, the file offset is used and
+ *               updated
+ *
+ * @return The number of bytes read, or a negative error code.
+ */
+ssize_t
+fs_readv(struct File *file, const struct iovec *iov, int iovcnt, off_t *offp)
 {
   struct Inode *inode;
+  off_t *off;
   ssize_t r;
 
   if (file->type != FD_INODE)
@@ -221,22 +321,134 @@ fs_read(struct File *file, uintptr_t va, size_t nbytes)
     return -EBADF;
 
   inode = fs_path_inode(file->node);
-  fs_inode_lock(inode);
+  off   = (offp != NULL) ? offp : &file->offset;
 
-  r = fs_inode_read_locked(inode, va, nbytes, &file->offset);
+  // Regular files can be read by several processes at once
+  fs_inode_lock_shared(inode);
+
+  if (S_ISREG(inode->mode)) {
+    r = fs_inode_readv_locked(inode, iov, iovcnt, off);
+    fs_inode_unlock_shared(inode);
+  } else {
+    fs_inode_unlock_shared(inode);
+
+    fs_inode_lock(inode);
+    r = fs_inode_readv_locked(inode, iov, iovcnt, off);
+    fs_inode_unlock(inode);
+  }
 
-  fs_inode_unlock(inode);
   fs_inode_put(inode);
 
   return r;
 }
 
+/**
+ * Write regular file data to another file straight from the page cache.
+ *
+ * The inode is only locked while the next page is looked up, so that a slow
+ * or blocking destination does not hold off other readers of the file.
+ *
+ * @param in    The file to read from (must be a regular file)
+ * @param out   The file to write to
+ * @param offp  The offset to read from. If NULL, the file offset of `in` is
+ *              used and updated
+ * @param count The maximum number of bytes to transfer
+ *
+ * @return The number of bytes transferred, or a negative error code.
+ */
 ssize_t
-fs_write(struct File *file, uintptr_t va, size_t nbytes)
+fs_sendfile(struct File *in, struct File *out, off_t *offp, size_t count)
 {
   struct Inode *inode;
+  size_t total, n;
+  off_t off;
   ssize_t r;
 
+  if (in->type != FD_INODE)
+    panic("not a file");
+
+  inode = fs_path_inode(in->node);
+
+  off = (offp != NULL) ? *offp : in->offset;
+  r   = 0;
+
+  for (total = 0; total < count; total += r, off += r) {
+    struct Page *page;
+
+    fs_inode_lock_shared(inode);
+
+    if (!S_ISREG(inode->mode)) {
+      r = -EINVAL;
+    } else if (!fs_permission(inode, FS_PERM_READ, 0)) {
+      r = -EPERM;
+    } else if ((off < 0) || (off >= inode->size)) {
+      r = (off < 0) ? -EINVAL : 0;
+    } else {
+      n = MIN(count - total, PAGE_SIZE - (size_t) (off % PAGE_SIZE));
+      n = MIN(n, (size_t) (inode->size - off));
+
+      if ((r = fs_page_get_locked(inode, off / PAGE_SIZE, &page)) == 0)
+        r = n;
+    }
+
+    fs_inode_unlock_shared(inode);
+
+    if (r <= 0)
+      break;
+
+    // The reference keeps the page alive even if it leaves the cache
+    r = file_write(out, (uintptr_t) page2kva(page) + off % PAGE_SIZE, n);
+
+    fs_page_put(page);
+
+    if (r <= 0)
+      break;
+
+    if ((size_t) r < n) {
+      total += r;
+      off   += r;
+      break;
+    }
+  }
+
+  fs_inode_put(inode);
+
+  if (offp != NULL)
+    *offp = off;
+  else
+    in->offset = off;
+
+  return (total > 0) ? (ssize_t) total : r;
+}
+
+ssize_t
+fs_write(struct File *file, uintptr_t va, size_t nbytes)
+{
+  struct iovec iov = { (void *) va, nbytes };
+
+  return fs_writev(file, &iov, 1, NULL);
+}
+
+/**
+ * Write file data gathered from several buffers. The inode stays locked for
+ * the whole operation, so the data is not interleaved with other writers.
+ *
+ * @param file   The file to write to
+ * @param iov    The buffers
+ * @param iovcnt The number of buffers
+ * @param offp   The offset to write at. If NULL, the file offset is used and
+ *               updated
+ *
+ * @return The number of bytes written, or a negative error code.
+ */
+ssize_t
+fs_writev(struct File *file, const struct iovec *iov, int iovcnt, off_t *offp)
+{
+  struct Inode *inode;
+  ssize_t total, r;
+  off_t *off;
+  int i;
+
   if (file->type != FD_INODE)
     panic("not a file");
 
@@ -246,15 +458,33 @@ fs_write(struct File *file, uintptr_t va, size_t nbytes)
   inode = fs_path_inode(file->node);
   fs_inode_lock(inode);
 
-  if (file->flags & O_APPEND)
-    file->offset = inode->size;
+  if (offp != NULL) {
+    off = offp;
+  } else {
+    if (file->flags & O_APPEND)
+      file->offset = inode->size;
+    off = &file->offset;
+  }
+
+  for (i = 0, total = 0; i < iovcnt; i++) {
+    r = fs_inode_write_locked(inode, (uintptr_t) iov[i].iov_base,
+                              iov[i].iov_len, off);
+    if (r < 0) {
+      if (total == 0)
+        total = r;
+      break;
+    }
+
+    total += r;
 
-  r = fs_inode_write_locked(inode, va, nbytes, &file->offset);
+    if ((size_t) r < iov[i].iov_len)
+      break;
+  }
 
   fs_inode_unlock(inode);
   fs_inode_put(inode);
 
-  return r;
+  return total;
 }
 
 ssize_t
@@ -290,11 +520,11 @@ fs_fstat(struct File *file, struct stat *buf)
     panic("not a file");
 
   inode = fs_path_inode(file->node);
-  fs_inode_lock(inode);
+  fs_inode_lock_shared(inode);
 
   r = fs_inode_stat_locked(inode, buf);
 
-  fs_inode_unlock(inode);
+  fs_inode_unlock_shared(inode);
   fs_inode_put(inode);
 
   return r;
@@ -375,7 +605,7 @@ fs_ioctl(struct File *file, int request, int arg)
 }
 
 int
-fs_select(struct File *file, struct timeval *timeout)
+fs_poll(struct File *file, struct PollEntry *entry)
 {
   struct Inode *inode;
   int r;
@@ -386,7 +616,7 @@ fs_select(struct File *file, struct timeval *timeout)
   inode = fs_path_inode(file->node);
   fs_inode_lock(inode);
 
-  r = fs_inode_select_locked(inode, timeout);
+  r = fs_inode_poll_locked(inode, entry);
 
   fs_inode_unlock(inode);
   fs_inode_put(inode);
@@ -414,6 +644,49 @@ fs_ftruncate(struct File *file, off_t length)
   return r;
 }
 
+/**
+ * Map a regular file into the address space of the current process. The
+ * pages are read from the page cache on first access.
+ *
+ * @param file  The file
+ * @param addr  The preferred starting address, or 0
+ * @param n     The size of the mapping in bytes
+ * @param flags The mapping flags
+ * @param off   The page-aligned file offset corresponding to the start
+ *
+ * @return The starting virtual address or a negative error code
+ */
+intptr_t
+fs_mmap(struct File *file, uintptr_t addr, size_t n, int flags, off_t off)
+{
+  struct Inode *inode;
+  size_t file_size;
+  intptr_t r;
+
+  if (file->type != FD_INODE)
+    panic("not a file");
+
+  inode = fs_path_inode(file->node);
+  fs_inode_lock_shared(inode);
+
+  if (!S_ISREG(inode->mode)) {
+    r = -ENODEV;
+  } else {
+    // Whole pages are taken from the file, the part beyond EOF reads as zeros
+    file_size = (off < inode->size)
+              ? MIN(ROUND_UP(n, PAGE_SIZE), (size_t) (inode->size - off))
+              : 0;
+
+    r = vmspace_map_file(process_current()->vm, addr, n, flags, inode, off,
+                         file_size);
+  }
+
+  fs_inode_unlock_shared(inode);
+  fs_inode_put(inode);
+
+  return r;
+}
+
 int
 fs_fsync(struct File *file)
 {
@@ -433,3 +706,19 @@ fs_fsync(struct File *file)
 
   return r;
 }
+
+/**
+ * Write all modified filesystem data to the disks.
+ */
+void
+fs_sync(void)
+{
+  struct FS *fs = fs_root->inode->fs;
+
+  fs_inode_flush();
+
+  if (fs->ops->sync != NULL)
+    fs->ops->sync(fs);
+
+  buf_sync_all();
+}
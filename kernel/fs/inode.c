@@ -3,12 +3,20 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <string.h>
+#include <sys/mount.h>
 #include <unistd.h>
 
 #include <kernel/console.h>
+#include <kernel/hash.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/thread.h>
 #include <kernel/tty.h>
+#include <kernel/types.h>
 #include <kernel/time.h>
+#include <kernel/waitqueue.h>
 #include <kernel/fs/buf.h>
 #include <kernel/fs/fs.h>
 #include <kernel/process.h>
@@ -17,69 +25,340 @@
 
 #include "ext2.h"
 
+#define INODE_CACHE_HASH_SIZE  256
+
+// Preferred I/O size reported for regular files, used by stdio as its buffer
+// size. Several pages at once, since the page cache is the unit of transfer
+#define INODE_IO_SIZE          (4 * PAGE_SIZE)
+
+// How often the write-back thread writes out the dirty inodes
+#define INODE_FLUSH_INTERVAL   seconds2ticks(1)
+// The number of dirty inodes sorted and written out at once
+#define INODE_FLUSH_BATCH      32
+
 static struct {
-  struct Inode    buf[INODE_CACHE_SIZE];
-  struct KSpinLock lock;
-  struct KListLink head;
+  HASH_DECLARE(hash, INODE_CACHE_HASH_SIZE);
+  struct KListLink    lru;          ///< Unreferenced inodes, most recent first
+  size_t              count;        ///< The number of cached inodes
+  size_t              size;         ///< Unreferenced inodes are recycled above
+  struct KListLink    dirty;        ///< Inodes to write, oldest first
+  size_t              dirty_count;  ///< The number of dirty inodes
+  struct KWaitQueue   flush_queue;  ///< The write-back thread waits here
+  struct KSpinLock    lock;
+  struct KObjectPool *pool;
 } inode_cache;
 
+// Only one thread writes out the dirty list at a time, so that sync() does
+// not return while the write-back thread still holds some of the inodes
+static struct KMutex inode_flush_mutex;
+
+static void inode_flush_thread(void *);
+
+static void
+inode_ctor(void *ptr, size_t)
+{
+  struct Inode *ip = (struct Inode *) ptr;
+
+  k_rwmutex_init(&ip->lock, "inode");
+  k_list_init(&ip->pages);
+  k_list_null(&ip->dirty_link);
+}
+
 void
 fs_inode_cache_init(void)
 {
-  struct Inode *ip;
-  
+  struct KThread *thread;
+
+  inode_cache.pool = k_object_pool_create("inode",
+                                          sizeof(struct Inode),
+                                          0,
+                                          inode_ctor,
+                                          NULL);
+  if (inode_cache.pool == NULL)
+    panic("cannot allocate the inode pool");
+
+  HASH_INIT(inode_cache.hash);
+  k_list_init(&inode_cache.lru);
+  k_list_init(&inode_cache.dirty);
+  k_waitqueue_init(&inode_cache.flush_queue);
   k_spinlock_init(&inode_cache.lock, "inode_cache");
-  k_list_init(&inode_cache.head);
+  k_mutex_init(&inode_flush_mutex, "inode_flush");
+
+  // Scale the cache with the amount of physical memory
+  inode_cache.size = MAX(INODE_CACHE_SIZE, page_count / INODE_CACHE_PAGES);
+
+  if ((thread = k_thread_create(NULL, inode_flush_thread, NULL, NZERO)) == NULL)
+    panic("cannot create the inode write-back thread");
+  k_thread_resume(thread);
+
+  fs_page_cache_init();
+}
+
+/**
+ * Collect the inode cache statistics.
+ *
+ * @param stats Where to store the statistics
+ */
+void
+fs_inode_cache_get_stats(struct FsCacheStats *stats)
+{
+  struct KListLink *l;
+
+  k_spinlock_acquire(&inode_cache.lock);
+
+  stats->inodes       = inode_cache.count;
+  stats->inodes_dirty = inode_cache.dirty_count;
+  stats->inodes_max   = inode_cache.size;
+
+  stats->inodes_unused = 0;
+  KLIST_FOREACH(&inode_cache.lru, l)
+    stats->inodes_unused++;
+
+  k_spinlock_release(&inode_cache.lock);
+}
+
+static inline unsigned long
+inode_cache_key(ino_t ino, dev_t dev)
+{
+  return (unsigned long) ino ^ ((unsigned long) dev << 16);
+}
+
+static struct Inode *
+inode_cache_lookup(ino_t ino, dev_t dev)
+{
+  struct KListLink *l;
+
+  debug_assert(k_spinlock_holding(&inode_cache.lock));
+
+  HASH_FOREACH_ENTRY(inode_cache.hash, l, inode_cache_key(ino, dev)) {
+    struct Inode *ip = KLIST_CONTAINER(l, struct Inode, hash_link);
 
-  for (ip = inode_cache.buf; ip < &inode_cache.buf[INODE_CACHE_SIZE]; ip++) {
-    k_mutex_init(&ip->mutex, "inode");
-    k_list_add_back(&inode_cache.head, &ip->cache_link);
+    if ((ip->ino == ino) && (ip->dev == dev))
+      return ip;
   }
+
+  return NULL;
+}
+
+// Take the least recently used inode out of the cache. Return the
+// filesystem-specific data and the headers cached by exec to be freed by the
+// caller.
+static struct Inode *
+inode_cache_evict(void **extra_store, void **exec_store)
+{
+  struct Inode *ip;
+
+  debug_assert(k_spinlock_holding(&inode_cache.lock));
+
+  if (k_list_is_empty(&inode_cache.lru))
+    return NULL;
+
+  ip = KLIST_CONTAINER(inode_cache.lru.prev, struct Inode, cache_link);
+
+  k_list_remove(&ip->cache_link);
+  HASH_REMOVE(&ip->hash_link);
+
+  fs_page_cache_drop(ip);
+
+  *extra_store = ip->extra;
+  ip->extra    = NULL;
+
+  *exec_store    = ip->exec_image;
+  ip->exec_image = NULL;
+
+  return ip;
 }
 
 struct Inode *
 fs_inode_get(ino_t ino, dev_t dev)
 {
-  struct KListLink *l;
-  struct Inode *ip, *empty;
+  struct Inode *ip, *new_ip = NULL;
+  void *extra = NULL, *exec_image = NULL;
 
   k_spinlock_acquire(&inode_cache.lock);
 
-  empty = NULL;
-  KLIST_FOREACH(&inode_cache.head, l) {
-    ip = KLIST_CONTAINER(l, struct Inode, cache_link);
-    if ((ip->ino == ino) && (ip->dev == dev) && (ip->ref_count > 0)) {
-      ip->ref_count++;
-      // cprintf("[got %d, %d]\n", ino, ip->ref_count);
+  for (;;) {
+    // Unreferenced inodes keep their contents and cached pages until they are
+    // recycled, so running the same binary again does not have to reread it
+    if ((ip = inode_cache_lookup(ino, dev)) != NULL) {
+      if (ip->ref_count++ == 0)
+        k_list_remove(&ip->cache_link);
 
       k_spinlock_release(&inode_cache.lock);
 
+      if (new_ip != NULL)
+        k_object_pool_put(inode_cache.pool, new_ip);
+
       return ip;
     }
 
-    if (ip->ref_count == 0)
-      empty = ip;
+    if (new_ip != NULL) {
+      ip = new_ip;
+      inode_cache.count++;
+      break;
+    }
+
+    if ((inode_cache.count >= inode_cache.size) &&
+        ((ip = inode_cache_evict(&extra, &exec_image)) != NULL))
+      break;
+
+    // The pool may need to allocate pages, so do not hold the lock
+    k_spinlock_release(&inode_cache.lock);
+    new_ip = (struct Inode *) k_object_pool_get(inode_cache.pool);
+    k_spinlock_acquire(&inode_cache.lock);
+
+    if ((new_ip == NULL) && ((ip = inode_cache_evict(&extra, &exec_image)) == NULL)) {
+      k_spinlock_release(&inode_cache.lock);
+      return NULL;
+    }
+
+    if (new_ip == NULL)
+      break;
   }
 
-  if (empty != NULL) {
-    empty->ref_count = 1;
-    empty->ino       = ino;
-    empty->dev       = dev;
-    empty->fs        = NULL;
-    empty->flags     = 0;
+  ip->ref_count = 1;
+  ip->ino       = ino;
+  ip->dev       = dev;
+  ip->fs        = NULL;
+  ip->flags     = 0;
+  ip->extra     = NULL;
+  ip->exec_image = NULL;
 
-    // cprintf("[inode create %d]\n", ino);
+  HASH_PUT(inode_cache.hash, &ip->hash_link, inode_cache_key(ino, dev));
+
+  k_spinlock_release(&inode_cache.lock);
+
+  if (extra != NULL)
+    k_free(extra);
+  if (exec_image != NULL)
+    k_free(exec_image);
+
+  return ip;
+}
+
+// Write the inode meta info, if modified. The inode must be locked
+static void
+inode_write_back(struct Inode *ip)
+{
+  if (ip->flags & FS_INODE_DIRTY) {
+    ip->fs->ops->inode_write(ip);
+    ip->flags &= ~FS_INODE_DIRTY;
+  }
+}
+
+// Leave a modified inode to the write-back thread. The dirty list holds a
+// reference, so that the inode is not recycled before it is written
+static void
+inode_dirty_add(struct Inode *ip)
+{
+  k_spinlock_acquire(&inode_cache.lock);
+
+  if (k_list_is_null(&ip->dirty_link)) {
+    k_list_add_back(&inode_cache.dirty, &ip->dirty_link);
+    inode_cache.dirty_count++;
+    ip->ref_count++;
+  }
+
+  k_spinlock_release(&inode_cache.lock);
+}
+
+// Take an inode off the dirty list. The caller must hold a reference of its
+// own, so the one held by the list is never the last
+static void
+inode_dirty_remove(struct Inode *ip)
+{
+  k_spinlock_acquire(&inode_cache.lock);
+
+  if (!k_list_is_null(&ip->dirty_link)) {
+    k_list_remove(&ip->dirty_link);
+    inode_cache.dirty_count--;
+    ip->ref_count--;
+    assert(ip->ref_count > 0);
+  }
+
+  k_spinlock_release(&inode_cache.lock);
+}
+
+// Inodes are written in this order, so that the ones sharing a block of the
+// inode table are written one after another
+static inline int
+inode_flush_before(struct Inode *a, struct Inode *b)
+{
+  return (a->dev < b->dev) || ((a->dev == b->dev) && (a->ino < b->ino));
+}
+
+/**
+ * Write out all inodes modified so far. Inodes are taken off the dirty list
+ * in batches, each sorted by the device and the inode number. Filesystems such
+ * as ext2 keep consecutive inodes in the same block, so each block of the
+ * inode table is modified and then written out by the buffer cache only once.
+ */
+void
+fs_inode_flush(void)
+{
+  struct Inode *batch[INODE_FLUSH_BATCH];
+  size_t left;
+  unsigned i, n;
+
+  k_mutex_lock(&inode_flush_mutex);
+
+  // Inodes dirtied again while the list is written wait for the next pass
+  k_spinlock_acquire(&inode_cache.lock);
+  left = inode_cache.dirty_count;
+  k_spinlock_release(&inode_cache.lock);
+
+  while (left > 0) {
+    k_spinlock_acquire(&inode_cache.lock);
+
+    for (n = 0; (n < INODE_FLUSH_BATCH) && (n < left); n++) {
+      struct Inode *ip;
+
+      if (k_list_is_empty(&inode_cache.dirty))
+        break;
+
+      ip = KLIST_CONTAINER(inode_cache.dirty.next, struct Inode, dirty_link);
+      k_list_remove(&ip->dirty_link);
+      inode_cache.dirty_count--;
+
+      // The reference of the list is now held by the batch
+      for (i = n; (i > 0) && inode_flush_before(ip, batch[i - 1]); i--)
+        batch[i] = batch[i - 1];
+      batch[i] = ip;
+    }
 
     k_spinlock_release(&inode_cache.lock);
 
-    return empty;
+    if (n == 0)
+      break;
+    left -= n;
+
+    for (i = 0; i < n; i++) {
+      // Not fs_inode_lock(): the inode may have been deleted meanwhile
+      k_rwmutex_write_lock(&batch[i]->lock);
+      if (batch[i]->flags & FS_INODE_VALID)
+        inode_write_back(batch[i]);
+      k_rwmutex_write_unlock(&batch[i]->lock);
+
+      fs_inode_put(batch[i]);
+    }
   }
 
-  // k_spinlock_release(&inode_cache.lock);
+  k_mutex_unlock(&inode_flush_mutex);
+}
+
+static void
+inode_flush_thread(void *arg)
+{
+  (void) arg;
 
-  panic("out of inodes\n");
+  for (;;) {
+    k_spinlock_acquire(&inode_cache.lock);
+    k_waitqueue_timed_sleep(&inode_cache.flush_queue, &inode_cache.lock,
+                            INODE_FLUSH_INTERVAL);
+    k_spinlock_release(&inode_cache.lock);
 
-  return NULL;
+    fs_inode_flush();
+  }
 }
 
 /**
@@ -107,44 +386,105 @@ fs_inode_duplicate(struct Inode *inode)
 void
 fs_inode_put(struct Inode *inode)
 {   
-  k_mutex_lock(&inode->mutex);
-
-  if (inode->flags & FS_INODE_DIRTY)
-    panic("inode dirty");
+  k_rwmutex_write_lock(&inode->lock);
 
-  // If the link count reaches zero, delete inode from the filesystem before
-  // returning it to the cache
-  if ((inode->flags & FS_INODE_VALID) && (inode->nlink == 0)) {
+  if (inode->flags & FS_INODE_VALID) {
     int ref_count;
 
     k_spinlock_acquire(&inode_cache.lock);
     ref_count = inode->ref_count;
+    // The reference held by the dirty list does not count
+    if (!k_list_is_null(&inode->dirty_link))
+      ref_count--;
     k_spinlock_release(&inode_cache.lock);
 
-    // If this is the last reference to this inode
-    if (ref_count == 1) {
+    // If this is the last reference to this inode and the link count reaches
+    // zero, delete inode from the filesystem before returning it to the cache
+    if ((ref_count == 1) && (inode->nlink == 0)) {
+      inode_write_back(inode);
+      inode_dirty_remove(inode);
+
+      fs_page_cache_drop(inode);
+      fs_inode_exec_invalidate(inode);
       inode->fs->ops->inode_delete(inode);
-      inode->flags &= ~FS_INODE_VALID;
+      inode->flags &= ~(FS_INODE_VALID | FS_INODE_DIRTY);
+    } else if ((ref_count == 1) && (inode->fs->ops->inode_release != NULL)) {
+      inode->fs->ops->inode_release(inode);
     }
   }
 
-  k_mutex_unlock(&inode->mutex);
+  // Reads done with the shared lock leave the access time to be written
+  if ((inode->flags & FS_INODE_VALID) && (inode->flags & FS_INODE_DIRTY))
+    inode_dirty_add(inode);
+
+  k_rwmutex_write_unlock(&inode->lock);
 
   // Return the inode to the cache
   k_spinlock_acquire(&inode_cache.lock);
+
   if (--inode->ref_count == 0) {
-    // cprintf("[inode drop %d]\n", inode->ino);
+    struct Inode *victim = NULL;
+    void *extra = NULL, *exec_image = NULL;
+
+    k_list_add_front(&inode_cache.lru, &inode->cache_link);
+
+    // Shrink the cache back after a burst of referenced inodes
+    if ((inode_cache.count > inode_cache.size) &&
+        ((victim = inode_cache_evict(&extra, &exec_image)) != NULL))
+      inode_cache.count--;
 
-    k_list_remove(&inode->cache_link);
-    k_list_add_front(&inode_cache.head, &inode->cache_link);
+    k_spinlock_release(&inode_cache.lock);
+
+    if (extra != NULL)
+      k_free(extra);
+    if (exec_image != NULL)
+      k_free(exec_image);
+    if (victim != NULL)
+      k_object_pool_put(inode_cache.pool, victim);
+
+    return;
   }
+
   k_spinlock_release(&inode_cache.lock);
 }
 
-static int
+/**
+ * Check whether the current thread holds the inode lock.
+ *
+ * @param ip Pointer to the inode.
+ */
+int
 fs_inode_holding(struct Inode *ip)
 {
-  return k_mutex_holding(&ip->mutex);
+  return k_rwmutex_write_holding(&ip->lock);
+}
+
+/**
+ * Check whether the current process holds the inode lock, either exclusively
+ * or for reading with fs_inode_lock_shared().
+ *
+ * @param ip Pointer to the inode.
+ */
+int
+fs_inode_holding_shared(struct Inode *ip)
+{
+  struct Process *current = process_current();
+
+  return fs_inode_holding(ip) ||
+         ((current != NULL) && (current->shared_inode == ip));
+}
+
+/**
+ * Check whether the inode is locked by anyone, either exclusively by the
+ * current thread or for reading. Readers are not tracked individually, so
+ * this is only good enough for sanity checks.
+ *
+ * @param ip Pointer to the inode.
+ */
+int
+fs_inode_locked(struct Inode *ip)
+{
+  return fs_inode_holding(ip) || (ip->lock.readers > 0);
 }
 
 /**
@@ -155,7 +495,7 @@ fs_inode_holding(struct Inode *ip)
 void
 fs_inode_lock(struct Inode *ip)
 {
-  k_mutex_lock(&ip->mutex);
+  k_rwmutex_write_lock(&ip->lock);
 
   if (ip->flags & FS_INODE_VALID)
     return;
@@ -174,12 +514,101 @@ fs_inode_unlock(struct Inode *ip)
   if (!(ip->flags & FS_INODE_VALID))
     panic("inode not valid");
 
-  if (ip->flags & FS_INODE_DIRTY) {
-    ip->fs->ops->inode_write(ip);
-    ip->flags &= ~FS_INODE_DIRTY;
+  // Written later, together with other inodes in the same block
+  if (ip->flags & FS_INODE_DIRTY)
+    inode_dirty_add(ip);
+
+  k_rwmutex_write_unlock(&ip->lock);
+}
+
+/**
+ * Lock the given inode for reading. Any number of threads may hold the lock
+ * for reading at the same time, so only operations that leave the inode
+ * contents intact are allowed.
+ *
+ * @param ip Pointer to the inode.
+ */
+void
+fs_inode_lock_shared(struct Inode *ip)
+{
+  struct Process *current = process_current();
+
+  for (;;) {
+    k_rwmutex_read_lock(&ip->lock);
+
+    if (ip->flags & FS_INODE_VALID)
+      break;
+
+    // The meta info has to be read with the exclusive lock held
+    k_rwmutex_read_unlock(&ip->lock);
+    fs_inode_lock(ip);
+    fs_inode_unlock(ip);
   }
 
-  k_mutex_unlock(&ip->mutex);
+  // Page faults while the data is copied out to the current process must not
+  // try to lock the same inode again
+  if ((current != NULL) && (current->shared_inode == NULL))
+    current->shared_inode = ip;
+}
+
+void
+fs_inode_unlock_shared(struct Inode *ip)
+{
+  struct Process *current = process_current();
+
+  if ((current != NULL) && (current->shared_inode == ip))
+    current->shared_inode = NULL;
+
+  k_rwmutex_read_unlock(&ip->lock);
+}
+
+/**
+ * Forget the headers cached by exec, once the file contents change.
+ *
+ * @param ip The inode (must be locked)
+ */
+void
+fs_inode_exec_invalidate(struct Inode *ip)
+{
+  if (ip->exec_image != NULL) {
+    k_free(ip->exec_image);
+    ip->exec_image = NULL;
+  }
+}
+
+// With relatime, the access time is still updated once this old
+#define FS_RELATIME_INTERVAL  (24 * 60 * 60)
+
+/**
+ * Update the access time of an inode that has been read, as allowed by the
+ * mount flags of its filesystem. The inode must be locked, possibly shared.
+ *
+ * @param ip The inode
+ */
+void
+fs_inode_touch_atime(struct Inode *ip)
+{
+  int flags = ip->fs->flags;
+  time_t now;
+
+  if (flags & MNT_NOATIME)
+    return;
+  if ((flags & MNT_NODIRATIME) && S_ISDIR(ip->mode))
+    return;
+
+  now = time_get_seconds();
+
+  // Only keep the access time after the last change, enough to tell whether
+  // the file has been read since then
+  if ((flags & MNT_RELATIME) &&
+      (ip->atime > ip->mtime) &&
+      (ip->atime > ip->ctime) &&
+      (now - ip->atime < FS_RELATIME_INTERVAL))
+    return;
+
+  // Other readers may be updating the flags at the same time
+  ip->atime = now;
+  __atomic_or_fetch(&ip->flags, FS_INODE_DIRTY, __ATOMIC_RELAXED);
 }
 
 ssize_t
@@ -187,7 +616,7 @@ fs_inode_read_locked(struct Inode *ip, uintptr_t va, size_t nbyte, off_t *off)
 {
   ssize_t ret;
   
-  if (!fs_inode_holding(ip))
+  if (!fs_inode_locked(ip))
     panic("not locked");
 
   if (!fs_permission(ip, FS_PERM_READ, 0))
@@ -200,8 +629,17 @@ fs_inode_read_locked(struct Inode *ip, uintptr_t va, size_t nbyte, off_t *off)
     if (d == NULL)
       return -ENODEV;
 
+    if (!fs_inode_holding(ip))
+      panic("device inodes must be locked exclusively");
+
     fs_inode_unlock(ip);
-    ret = d->read(ip->rdev, va, nbyte);
+    if (d->read_at != NULL) {
+      ret = d->read_at(ip->rdev, va, nbyte, *off);
+      if (ret > 0)
+        *off += ret;
+    } else {
+      ret = d->read(ip->rdev, va, nbyte);
+    }
     fs_inode_lock(ip);
     return ret;
   }
@@ -209,22 +647,58 @@ fs_inode_read_locked(struct Inode *ip, uintptr_t va, size_t nbyte, off_t *off)
   if ((off_t) (*off + nbyte) < *off)
     return -EINVAL;
 
+  if (ip->flags & FS_INODE_VOLATILE) {
+    if ((ret = ip->fs->ops->read(ip, va, nbyte, *off)) > 0)
+      *off += ret;
+    return ret;
+  }
+
   if ((off_t) (*off + nbyte) > ip->size)
     nbyte = ip->size - *off;
   if (nbyte == 0)
     return 0;
 
-  if ((ret = ip->fs->ops->read(ip, va, nbyte, *off)) < 0)
+  // Regular file data is cached, other files are read directly
+  if (S_ISREG(ip->mode))
+    ret = fs_page_cache_read(ip, va, nbyte, *off);
+  else
+    ret = ip->fs->ops->read(ip, va, nbyte, *off);
+
+  if (ret < 0)
     return ret;
 
-  ip->atime  = time_get_seconds();
-  ip->flags |= FS_INODE_DIRTY;
+  fs_inode_touch_atime(ip);
 
   *off += ret;
 
   return ret;
 }
 
+/**
+ * Start reading a range of a regular file in the background, since it is
+ * likely to be needed soon. Does nothing if the filesystem cannot prefetch.
+ *
+ * @param ip    The inode (locked shared or exclusively)
+ * @param off   The file offset
+ * @param nbyte The number of bytes
+ */
+void
+fs_inode_prefetch_locked(struct Inode *ip, off_t off, size_t nbyte)
+{
+  if (!fs_inode_locked(ip))
+    panic("not locked");
+
+  if (!S_ISREG(ip->mode) || (ip->fs->ops->prefetch == NULL))
+    return;
+
+  if ((off < 0) || (off >= ip->size))
+    return;
+
+  nbyte = MIN(nbyte, (size_t) (ip->size - off));
+  if (nbyte > 0)
+    ip->fs->ops->prefetch(ip, off, nbyte);
+}
+
 ssize_t
 fs_inode_write_locked(struct Inode *ip, uintptr_t va, size_t nbyte, off_t *off)
 {
@@ -258,6 +732,9 @@ fs_inode_write_locked(struct Inode *ip, uintptr_t va, size_t nbyte, off_t *off)
   total = ip->fs->ops->write(ip, va, nbyte, *off);
 
   if (total > 0) {
+    fs_inode_exec_invalidate(ip);
+    fs_page_cache_update(ip, va, total, *off);
+
     *off += total;
 
     if (*off > ip->size)
@@ -283,6 +760,72 @@ fs_filldir(void *buf, ino_t ino, const char *name, size_t name_len)
   return dp->d_reclen;
 }
 
+// The largest chunk of entries collected in the kernel before copying out
+#define FS_READDIR_BATCH_MAX  PAGE_SIZE
+
+struct FsDirBatch {
+  uint8_t *data;
+  size_t   size;
+  size_t   used;
+  int      full;    ///< An entry did not fit
+};
+
+static int
+fs_filldir_batch(void *buf, ino_t ino, const char *name, size_t name_len)
+{
+  struct FsDirBatch *batch = (struct FsDirBatch *) buf;
+  size_t reclen = name_len + offsetof(struct dirent, d_name) + 1;
+
+  if (batch->used + reclen > batch->size) {
+    batch->full = 1;
+    return 0;
+  }
+
+  fs_filldir(&batch->data[batch->used], ino, name, name_len);
+  batch->used += reclen;
+
+  return reclen;
+}
+
+// Collect as many entries as fit into a kernel buffer, each call to the
+// filesystem walking a whole directory block, and copy them out at once
+static ssize_t
+fs_inode_read_dir_batch(struct Inode *ip, uintptr_t va, size_t nbyte,
+                        off_t *off)
+{
+  struct FsDirBatch batch;
+  ssize_t nread = 0;
+  int r;
+
+  batch.size = MIN(nbyte, FS_READDIR_BATCH_MAX);
+  batch.used = 0;
+  batch.full = 0;
+
+  if ((batch.data = (uint8_t *) k_malloc(batch.size)) == NULL)
+    return -ENOMEM;
+
+  while (!batch.full) {
+    if ((nread = ip->fs->ops->readdir_batch(ip, &batch, fs_filldir_batch,
+                                            *off)) <= 0)
+      break;
+    *off += nread;
+  }
+
+  if (batch.used > 0) {
+    if ((r = vm_space_copy_out(batch.data, va, batch.used)) == 0)
+      r = batch.used;
+  } else if (nread < 0) {
+    r = nread;
+  } else {
+    // The end of the directory, or the next entry does not fit
+    r = batch.full ? -EINVAL : 0;
+  }
+
+  k_free(batch.data);
+
+  return r;
+}
+
 ssize_t
 fs_inode_read_dir_locked(struct Inode *ip, uintptr_t va, size_t nbyte, off_t *off)
 {
@@ -302,6 +845,9 @@ fs_inode_read_dir_locked(struct Inode *ip, uintptr_t va, size_t nbyte, off_t *of
   if (!fs_permission(ip, FS_PERM_READ, 0))
     return -EPERM;
 
+  if (ip->fs->ops->readdir_batch != NULL)
+    return fs_inode_read_dir_batch(ip, va, nbyte, off);
+
   while (nbyte > 0) {
     ssize_t nread;
     int r;
@@ -335,7 +881,7 @@ fs_inode_read_dir_locked(struct Inode *ip, uintptr_t va, size_t nbyte, off_t *of
 int
 fs_inode_stat_locked(struct Inode *ip, struct stat *buf)
 {
-  if (!fs_inode_holding(ip))
+  if (!fs_inode_locked(ip))
     panic("not locked");
 
   // TODO: check permissions
@@ -355,7 +901,7 @@ fs_inode_stat_locked(struct Inode *ip, struct stat *buf)
   buf->st_ctim.tv_sec  = ip->ctime;
   buf->st_ctim.tv_nsec = 0;
   buf->st_blocks       = ip->size / S_BLKSIZE;
-  buf->st_blksize      = S_BLKSIZE;
+  buf->st_blksize      = S_ISREG(ip->mode) ? INODE_IO_SIZE : PAGE_SIZE;
 
   return 0;
 }
@@ -374,6 +920,9 @@ fs_inode_truncate_locked(struct Inode *inode, off_t length)
   if (!fs_permission(inode, FS_PERM_WRITE, 0))
     return -EPERM;
 
+  fs_page_cache_invalidate(inode, length, inode->size - length);
+  fs_inode_exec_invalidate(inode);
+
   inode->fs->ops->trunc(inode, length);
   
   inode->size = length;
@@ -520,10 +1069,14 @@ fs_create(const char *path, mode_t mode, dev_t dev, struct PathNode **istore)
 
   dir_inode = fs_path_inode(dir);
 
+  // Keep lookups from caching the name as missing until the node is updated
+  fs_path_node_lock(dir);
   fs_inode_lock(dir_inode);
 
   // (inode->ref_count): +1
   if ((r = fs_inode_create(dir_inode, name, mode, dev, &inode)) == 0) {
+    fs_path_invalidate(dir, name);
+
     if (istore != NULL) {
       struct PathNode *pp;
       
@@ -541,6 +1094,7 @@ fs_create(const char *path, mode_t mode, dev_t dev, struct PathNode **istore)
   }
 
   fs_inode_unlock(dir_inode);
+  fs_path_node_unlock(dir);
   fs_inode_put(dir_inode);
 
   fs_path_put(dir); // (dir->ref_count): -1
@@ -595,11 +1149,14 @@ fs_link(char *path1, char *path2)
   inode = fs_path_inode(pp);
 
   // Always lock inodes in a specific order to avoid deadlocks
+  fs_path_node_lock(dirp);
   fs_inode_lock_two(parent_inode, inode);
 
-  r = fs_inode_link(inode, parent_inode, name);
+  if ((r = fs_inode_link(inode, parent_inode, name)) == 0)
+    fs_path_invalidate(dirp, name);
 
   fs_inode_unlock_two(parent_inode, inode);
+  fs_path_node_unlock(dirp);
 
   fs_inode_put(inode);
   fs_inode_put(parent_inode);
@@ -758,9 +1315,14 @@ int
 fs_permission(struct Inode *inode, mode_t mode, int real)
 {
   struct Process *my_process = process_current();
+  uid_t uid = 0;
+  gid_t gid = 0;
 
-  uid_t uid = real ? my_process->ruid : my_process->euid;
-  gid_t gid = real ? my_process->rgid : my_process->egid;
+  // Kernel threads, such as the tcpip thread serving HTTP, act as the superuser
+  if (my_process != NULL) {
+    uid = real ? my_process->ruid : my_process->euid;
+    gid = real ? my_process->rgid : my_process->egid;
+  }
 
   if (uid == 0)
     return (mode & FS_PERM_EXEC)
@@ -822,10 +1384,8 @@ fs_inode_ioctl_locked(struct Inode *inode, int request, int arg)
 }
 
 int
-fs_inode_select_locked(struct Inode *inode, struct timeval *timeout)
+fs_inode_poll_locked(struct Inode *inode, struct PollEntry *entry)
 {
-  int ret;
-
   if (!fs_inode_holding(inode))
     panic("not locked");
 
@@ -835,15 +1395,13 @@ fs_inode_select_locked(struct Inode *inode, struct timeval *timeout)
     struct CharDev *d = dev_lookup_char(inode->rdev);
 
     if (d == NULL)
-      return -ENODEV;
+      return POLLNVAL;
 
-    fs_inode_unlock(inode);
-    ret = d->select(inode->rdev, timeout);
-    fs_inode_lock(inode);
-    return ret;
+    return d->poll(inode->rdev, entry);
   }
 
-  return 0;
+  // Regular files and directories never block
+  return POLLIN | POLLOUT;
 }
 
 int
@@ -852,7 +1410,15 @@ fs_inode_sync_locked(struct Inode *inode)
   if (!fs_inode_holding(inode))
     panic("not locked");
 
-  // TODO: implement
+  // Do not wait for the write-back thread
+  inode_write_back(inode);
+
+  if (inode->fs->ops->sync != NULL)
+    inode->fs->ops->sync(inode->fs);
+
+  // The buffer cache does not know which blocks belong to the inode, so
+  // write out everything on its device
+  buf_sync(inode->dev);
 
   return 0;
 }
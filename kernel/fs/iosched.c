@@ -0,0 +1,301 @@
+#include <kernel/assert.h>
+#include <errno.h>
+
+#include <kernel/core/list.h>
+#include <kernel/core/tick.h>
+#include <kernel/fs/buf.h>
+#include <kernel/dev.h>
+#include <kernel/fs/iosched.h>
+#include <kernel/object_pool.h>
+#include <kernel/time.h>
+#include <kernel/types.h>
+
+/** The largest number of buffers passed to the driver in one call */
+#define IO_QUEUE_BATCH  16U
+
+/**
+ * Initialize a request queue.
+ *
+ * @param queue The queue to be initialized
+ * @param dev   The block device to send the requests to
+ * @param sched The scheduling policy
+ * @param depth The maximum number of buffers the driver may have at once
+ *
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+io_queue_init(struct IoQueue *queue, struct BlockDev *dev,
+              const struct IoScheduler *sched, unsigned depth)
+{
+  k_spinlock_init(&queue->lock, "io_queue");
+
+  queue->dev         = dev;
+  queue->sched       = sched;
+  queue->data        = NULL;
+  queue->depth       = MAX(depth, 1U);
+  queue->queued      = 0;
+  queue->in_flight   = 0;
+  queue->dispatching = 0;
+
+  return sched->init(queue);
+}
+
+// Feed the driver until it has enough buffers or the scheduler runs out.
+// Only one thread does this at a time, others just leave their buffers to it.
+static void
+io_queue_run(struct IoQueue *queue)
+{
+  struct Buf *bufs[IO_QUEUE_BATCH];
+  unsigned n;
+
+  k_spinlock_acquire(&queue->lock);
+
+  if (queue->dispatching) {
+    k_spinlock_release(&queue->lock);
+    return;
+  }
+
+  queue->dispatching = 1;
+
+  while ((queue->queued > 0) && (queue->in_flight < queue->depth)) {
+    n = MIN(queue->depth - queue->in_flight, IO_QUEUE_BATCH);
+    n = queue->sched->dispatch(queue, bufs, n);
+    assert((n > 0) && (n <= queue->queued));
+
+    queue->queued    -= n;
+    queue->in_flight += n;
+
+    // The driver may complete the buffers before returning
+    k_spinlock_release(&queue->lock);
+    queue->dev->request(bufs, n);
+    k_spinlock_acquire(&queue->lock);
+  }
+
+  queue->dispatching = 0;
+
+  k_spinlock_release(&queue->lock);
+}
+
+/**
+ * Add buffers to the request queue and pass as many of them to the driver as
+ * it can take.
+ *
+ * @param queue The request queue
+ * @param bufs  The buffers to be read (if invalid) or written (if dirty)
+ * @param n     The number of buffers
+ */
+void
+io_queue_submit(struct IoQueue *queue, struct Buf **bufs, unsigned n)
+{
+  unsigned i;
+
+  k_spinlock_acquire(&queue->lock);
+
+  for (i = 0; i < n; i++)
+    queue->sched->add(queue, bufs[i]);
+  queue->queued += n;
+
+  k_spinlock_release(&queue->lock);
+
+  io_queue_run(queue);
+}
+
+/**
+ * Called when the driver has completed a buffer taken from the queue.
+ *
+ * @param queue The request queue
+ */
+void
+io_queue_done(struct IoQueue *queue)
+{
+  k_spinlock_acquire(&queue->lock);
+  assert(queue->in_flight > 0);
+  queue->in_flight--;
+  k_spinlock_release(&queue->lock);
+
+  io_queue_run(queue);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Deadline scheduler
+ * ----------------------------------------------------------------------------
+ *
+ * Reads and writes are kept apart, each in a list sorted by the block address
+ * and in a FIFO list. Buffers are dispatched in batches that sweep one list
+ * in the ascending order of addresses, adjacent buffers are passed together so
+ * that the driver can merge them.
+ *
+ * Someone is usually waiting for a read, while writes come from the write-back
+ * and may be delayed. So reads get shorter deadlines and are preferred when a
+ * new batch starts, but only until writes have been passed over a few times.
+ * A batch begins with the oldest buffer if its deadline has expired.
+ */
+
+#define IO_DEADLINE_READ_EXPIRE     500   ///< Read deadline, in milliseconds
+#define IO_DEADLINE_WRITE_EXPIRE    5000  ///< Write deadline, in milliseconds
+#define IO_DEADLINE_BATCH           16    ///< Buffers dispatched in one sweep
+#define IO_DEADLINE_WRITES_STARVED  2     ///< Read batches before a write one
+
+enum {
+  IO_READ  = 0,
+  IO_WRITE = 1,
+};
+
+struct IoDeadline {
+  struct KListLink   sorted[2];   ///< By the block address (queue_link)
+  struct KListLink   fifo[2];     ///< By the deadline (sched_link)
+  unsigned long long position;    ///< The address after the last dispatched
+  int                dir;         ///< The direction of the current batch
+  unsigned           batch;       ///< Buffers dispatched in the current batch
+  unsigned           starved;     ///< Read batches while writes were queued
+};
+
+static inline unsigned long long
+io_buf_addr(struct Buf *buf)
+{
+  return (unsigned long long) buf->block_no * buf->block_size;
+}
+
+static inline int
+io_buf_dir(struct Buf *buf)
+{
+  return (buf->flags & BUF_DIRTY) ? IO_WRITE : IO_READ;
+}
+
+static int
+io_deadline_init(struct IoQueue *queue)
+{
+  struct IoDeadline *dl;
+
+  if ((dl = (struct IoDeadline *) k_malloc(sizeof(*dl))) == NULL)
+    return -ENOMEM;
+
+  k_list_init(&dl->sorted[IO_READ]);
+  k_list_init(&dl->sorted[IO_WRITE]);
+  k_list_init(&dl->fifo[IO_READ]);
+  k_list_init(&dl->fifo[IO_WRITE]);
+  dl->position = 0;
+  dl->dir      = IO_READ;
+  dl->batch    = 0;
+  dl->starved  = 0;
+
+  queue->data = dl;
+
+  return 0;
+}
+
+static void
+io_deadline_add(struct IoQueue *queue, struct Buf *buf)
+{
+  struct IoDeadline *dl = (struct IoDeadline *) queue->data;
+  int dir = io_buf_dir(buf);
+  struct KListLink *l;
+
+  buf->deadline = k_tick_get() + ms2ticks(dir == IO_READ
+                                           ? IO_DEADLINE_READ_EXPIRE
+                                           : IO_DEADLINE_WRITE_EXPIRE);
+  k_list_add_back(&dl->fifo[dir], &buf->sched_link);
+
+  // Most requests arrive in the ascending order, search from the tail
+  for (l = dl->sorted[dir].prev; l != &dl->sorted[dir]; l = l->prev)
+    if (io_buf_addr(KLIST_CONTAINER(l, struct Buf, queue_link)) <=
+        io_buf_addr(buf))
+      break;
+
+  // Insert after l
+  buf->queue_link.prev = l;
+  buf->queue_link.next = l->next;
+  l->next->prev = &buf->queue_link;
+  l->next = &buf->queue_link;
+}
+
+// The first buffer at or after the current position, NULL if none
+static struct Buf *
+io_deadline_next(struct IoDeadline *dl, int dir)
+{
+  struct KListLink *l;
+
+  KLIST_FOREACH(&dl->sorted[dir], l) {
+    struct Buf *buf = KLIST_CONTAINER(l, struct Buf, queue_link);
+
+    if (io_buf_addr(buf) >= dl->position)
+      return buf;
+  }
+
+  return NULL;
+}
+
+// Pick the buffer to start a new batch with
+static struct Buf *
+io_deadline_start(struct IoDeadline *dl)
+{
+  struct Buf *buf;
+  int reads, writes, dir;
+
+  reads  = !k_list_is_empty(&dl->sorted[IO_READ]);
+  writes = !k_list_is_empty(&dl->sorted[IO_WRITE]);
+
+  if (reads && (!writes || (dl->starved < IO_DEADLINE_WRITES_STARVED))) {
+    dir = IO_READ;
+    if (writes)
+      dl->starved++;
+  } else {
+    dir = IO_WRITE;
+    dl->starved = 0;
+  }
+
+  dl->dir   = dir;
+  dl->batch = 0;
+
+  buf = KLIST_CONTAINER(dl->fifo[dir].next, struct Buf, sched_link);
+  if (buf->deadline <= k_tick_get())
+    return buf;
+
+  // Continue the sweep, wrapping around to the lowest address
+  if ((buf = io_deadline_next(dl, dir)) == NULL)
+    buf = KLIST_CONTAINER(dl->sorted[dir].next, struct Buf, queue_link);
+
+  return buf;
+}
+
+static unsigned
+io_deadline_dispatch(struct IoQueue *queue, struct Buf **bufs, unsigned max)
+{
+  struct IoDeadline *dl = (struct IoDeadline *) queue->data;
+  struct Buf *buf = NULL;
+  unsigned n;
+
+  if (dl->batch < IO_DEADLINE_BATCH)
+    buf = io_deadline_next(dl, dl->dir);
+  if (buf == NULL)
+    buf = io_deadline_start(dl);
+
+  for (n = 0; n < max; ) {
+    struct KListLink *l = buf->queue_link.next;
+
+    k_list_remove(&buf->queue_link);
+    k_list_remove(&buf->sched_link);
+
+    bufs[n++] = buf;
+    dl->position = io_buf_addr(buf) + buf->block_size;
+
+    if (l == &dl->sorted[dl->dir])
+      break;
+
+    buf = KLIST_CONTAINER(l, struct Buf, queue_link);
+    if (io_buf_addr(buf) != dl->position)
+      break;
+  }
+
+  dl->batch += n;
+
+  return n;
+}
+
+const struct IoScheduler io_deadline_sched = {
+  .name     = "deadline",
+  .init     = io_deadline_init,
+  .add      = io_deadline_add,
+  .dispatch = io_deadline_dispatch,
+};
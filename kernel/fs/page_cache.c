@@ -0,0 +1,479 @@
+/**
+ * @file
+ * File page cache
+ *
+ * Keeps pages of regular files in memory, indexed by the inode and the page
+ * number within the file. File reads are served from the cached pages, writes
+ * go to the filesystem and update the cached copies. Processes that map the
+ * same file (e.g. run the same binary) share the cached pages instead of
+ * reading private copies.
+ *
+ * The cache holds one reference to each page, every mapping holds another
+ * one. Pages that are not mapped anywhere stay in the cache until the page
+ * allocator runs out of memory, or the file contents change.
+ *
+ * Shared mappings write to the cached pages directly, and the modified pages
+ * are written back to the file by msync(), munmap() or when the process
+ * exits. Until then, read() already sees the new contents.
+ */
+
+#include <kernel/assert.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <kernel/console.h>
+#include <kernel/fs/fs.h>
+#include <kernel/hash.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/spinlock.h>
+#include <kernel/time.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
+
+struct PageCacheEntry {
+  struct KListLink hash_link;     ///< Link into the cache hash table
+  struct KListLink inode_link;    ///< Link into the inode page list
+  struct KListLink lru_link;      ///< Link into the LRU list
+  struct Inode    *inode;         ///< The file this page belongs to
+  unsigned long    index;         ///< Page number within the file
+  struct Page     *page;          ///< The page holding the file data
+};
+
+static unsigned long page_cache_shrink(void);
+
+static struct PageShrinker page_cache_shrinker = {
+  .name   = "page_cache",
+  .shrink = page_cache_shrink,
+};
+
+#define PAGE_CACHE_HASH_SIZE  256
+
+static struct {
+  HASH_DECLARE(hash, PAGE_CACHE_HASH_SIZE);
+  struct KListLink    lru;          ///< Most recently used entries first
+  struct KSpinLock    lock;         ///< Protects the hash, the lists and refs
+  struct KObjectPool *pool;
+} page_cache;
+
+static inline unsigned long
+page_cache_key(struct Inode *ip, unsigned long index)
+{
+  return ((uintptr_t) ip / sizeof(struct Inode)) + index;
+}
+
+/**
+ * Initialize the page cache.
+ */
+void
+fs_page_cache_init(void)
+{
+  page_cache.pool = k_object_pool_create("page_cache",
+                                         sizeof(struct PageCacheEntry),
+                                         0,
+                                         NULL,
+                                         NULL);
+  if (page_cache.pool == NULL)
+    panic("cannot allocate the page cache pool");
+
+  HASH_INIT(page_cache.hash);
+  k_list_init(&page_cache.lru);
+  k_spinlock_init(&page_cache.lock, "page_cache");
+
+  page_shrinker_register(&page_cache_shrinker);
+}
+
+static struct PageCacheEntry *
+page_cache_lookup(struct Inode *ip, unsigned long index)
+{
+  struct KListLink *l;
+
+  debug_assert(k_spinlock_holding(&page_cache.lock));
+
+  HASH_FOREACH_ENTRY(page_cache.hash, l, page_cache_key(ip, index)) {
+    struct PageCacheEntry *entry;
+
+    entry = KLIST_CONTAINER(l, struct PageCacheEntry, hash_link);
+    if ((entry->inode == ip) && (entry->index == index))
+      return entry;
+  }
+
+  return NULL;
+}
+
+static void
+page_cache_unlink(struct PageCacheEntry *entry)
+{
+  HASH_REMOVE(&entry->hash_link);
+  k_list_remove(&entry->inode_link);
+  k_list_remove(&entry->lru_link);
+}
+
+static void
+page_cache_link(struct PageCacheEntry *entry)
+{
+  HASH_PUT(page_cache.hash, &entry->hash_link,
+           page_cache_key(entry->inode, entry->index));
+  k_list_add_back(&entry->inode->pages, &entry->inode_link);
+  k_list_add_front(&page_cache.lru, &entry->lru_link);
+}
+
+// Drop a reference to a cached page
+static void
+page_cache_unref(struct Page *page)
+{
+  if (__atomic_sub_fetch(&page->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+    page_free_one(page);
+}
+
+// Remove the entry and drop the cache reference to its page. Mappings that
+// still use the page keep it alive.
+static void
+page_cache_remove(struct PageCacheEntry *entry)
+{
+  struct Page *page = entry->page;
+
+  page_cache_unlink(entry);
+  k_object_pool_put(page_cache.pool, entry);
+
+  page_cache_unref(page);
+}
+
+/**
+ * Get a page of file data from the cache, reading it from the file if it is
+ * not cached yet.
+ *
+ * @param ip         The inode (must be locked)
+ * @param index      The page number within the file
+ * @param page_store Pointer to the memory location to store the page. The
+ *                   caller receives a reference to the page, the page
+ *                   contents must not be modified
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The inode is not a regular file or the page is beyond EOF
+ * @retval -ENOMEM Out of memory
+ */
+int
+fs_page_get_locked(struct Inode *ip, unsigned long index,
+                   struct Page **page_store)
+{
+  struct PageCacheEntry *entry, *other;
+  struct Page *page;
+  off_t off;
+  ssize_t r;
+
+  if (!fs_inode_locked(ip))
+    panic("not locked");
+
+  off = (off_t) index * PAGE_SIZE;
+  if (!S_ISREG(ip->mode) || (off >= ip->size))
+    return -EINVAL;
+
+  k_spinlock_acquire(&page_cache.lock);
+
+  if ((entry = page_cache_lookup(ip, index)) != NULL) {
+    __atomic_add_fetch(&entry->page->ref_count, 1, __ATOMIC_RELAXED);
+
+    k_list_remove(&entry->lru_link);
+    k_list_add_front(&page_cache.lru, &entry->lru_link);
+
+    *page_store = entry->page;
+
+    k_spinlock_release(&page_cache.lock);
+
+    return 0;
+  }
+
+  k_spinlock_release(&page_cache.lock);
+
+  // Writers are excluded by the inode lock, but other readers holding it
+  // shared may be reading the same page
+  if ((entry = (struct PageCacheEntry *) k_object_pool_get(page_cache.pool)) == NULL)
+    return -ENOMEM;
+
+  if ((page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_FILE)) == NULL) {
+    k_object_pool_put(page_cache.pool, entry);
+    return -ENOMEM;
+  }
+
+  r = ip->fs->ops->read(ip, (uintptr_t) page2kva(page),
+                        MIN(PAGE_SIZE, (size_t) (ip->size - off)), off);
+  if (r < 0) {
+    page_free_one(page);
+    k_object_pool_put(page_cache.pool, entry);
+    return (int) r;
+  }
+
+  // One reference for the cache, another one for the caller
+  page->ref_count = 2;
+
+  entry->inode = ip;
+  entry->index = index;
+  entry->page  = page;
+
+  k_spinlock_acquire(&page_cache.lock);
+
+  if ((other = page_cache_lookup(ip, index)) != NULL) {
+    // Somebody else has cached the page in the meantime
+    __atomic_add_fetch(&other->page->ref_count, 1, __ATOMIC_RELAXED);
+    *page_store = other->page;
+
+    k_spinlock_release(&page_cache.lock);
+
+    page->ref_count = 0;
+    page_free_one(page);
+    k_object_pool_put(page_cache.pool, entry);
+
+    return 0;
+  }
+
+  page_cache_link(entry);
+  k_spinlock_release(&page_cache.lock);
+
+  *page_store = page;
+
+  return 0;
+}
+
+/**
+ * Take another reference to a page obtained with fs_page_get_locked. Both must
+ * be dropped with fs_page_put.
+ *
+ * @param page The page
+ *
+ * @return The page.
+ */
+struct Page *
+fs_page_dup(struct Page *page)
+{
+  __atomic_add_fetch(&page->ref_count, 1, __ATOMIC_RELAXED);
+  return page;
+}
+
+/**
+ * Drop a page reference obtained with fs_page_get_locked.
+ *
+ * @param page The page
+ */
+void
+fs_page_put(struct Page *page)
+{
+  page_cache_unref(page);
+}
+
+/**
+ * Read file data through the page cache.
+ *
+ * @param ip    The inode (must be locked)
+ * @param va    The destination address (user or kernel)
+ * @param nbyte The number of bytes to read, must not go beyond EOF
+ * @param off   The file offset to read from
+ *
+ * @return The number of bytes read or a negative error code
+ */
+ssize_t
+fs_page_cache_read(struct Inode *ip, uintptr_t va, size_t nbyte, off_t off)
+{
+  size_t total, n;
+
+  for (total = 0; total < nbyte; total += n, off += n, va += n) {
+    struct Page *page;
+    int r;
+
+    n = MIN(nbyte - total, PAGE_SIZE - (size_t) (off % PAGE_SIZE));
+
+    if ((r = fs_page_get_locked(ip, off / PAGE_SIZE, &page)) < 0)
+      return r;
+
+    r = vm_space_copy_out((uint8_t *) page2kva(page) + off % PAGE_SIZE, va, n);
+
+    page_cache_unref(page);
+
+    if (r < 0)
+      return r;
+  }
+
+  return total;
+}
+
+/**
+ * Bring the cached pages up to date after the data has been written to the
+ * file. Pages mapped into address spaces are dropped instead, so that the
+ * mappings keep seeing the contents they were created with.
+ *
+ * @param ip    The inode (must be locked)
+ * @param va    The address of the written data (user or kernel)
+ * @param nbyte The number of bytes written
+ * @param off   The file offset the data has been written to
+ */
+void
+fs_page_cache_update(struct Inode *ip, uintptr_t va, size_t nbyte, off_t off)
+{
+  size_t total, n;
+
+  if (!fs_inode_holding(ip))
+    panic("not locked");
+
+  for (total = 0; total < nbyte; total += n, off += n, va += n) {
+    struct PageCacheEntry *entry;
+    struct Page *page = NULL;
+
+    n = MIN(nbyte - total, PAGE_SIZE - (size_t) (off % PAGE_SIZE));
+
+    k_spinlock_acquire(&page_cache.lock);
+
+    if ((entry = page_cache_lookup(ip, off / PAGE_SIZE)) != NULL) {
+      if (__atomic_load_n(&entry->page->ref_count, __ATOMIC_ACQUIRE) == 1) {
+        // Keep the shrinker away while copying
+        page = entry->page;
+        __atomic_add_fetch(&page->ref_count, 1, __ATOMIC_RELAXED);
+      } else {
+        page_cache_remove(entry);
+      }
+    }
+
+    k_spinlock_release(&page_cache.lock);
+
+    if (page == NULL)
+      continue;
+
+    // No new mappings can be created while the inode is locked
+    if (vm_space_copy_in((uint8_t *) page2kva(page) + off % PAGE_SIZE, va, n) < 0)
+      fs_page_cache_invalidate(ip, off, n);
+
+    page_cache_unref(page);
+  }
+}
+
+/**
+ * Write a page modified through a shared mapping back to the file. Only the
+ * part below EOF is written, so the file never grows.
+ *
+ * @param ip    The inode (must be locked)
+ * @param index The page number within the file
+ * @param page  The page with the new contents
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+fs_page_write_back(struct Inode *ip, unsigned long index, struct Page *page)
+{
+  struct PageCacheEntry *entry;
+  off_t off = (off_t) index * PAGE_SIZE;
+  ssize_t r;
+
+  if (!fs_inode_holding(ip))
+    panic("not locked");
+
+  if (!S_ISREG(ip->mode) || (off >= ip->size))
+    return 0;
+
+  r = ip->fs->ops->write(ip, (uintptr_t) page2kva(page),
+                         MIN(PAGE_SIZE, (size_t) (ip->size - off)), off);
+  if (r < 0)
+    return (int) r;
+
+  // Normally the page is the cached copy itself, but it might have been
+  // replaced after a write() while mapped
+  k_spinlock_acquire(&page_cache.lock);
+  if (((entry = page_cache_lookup(ip, index)) != NULL) && (entry->page != page))
+    page_cache_remove(entry);
+  k_spinlock_release(&page_cache.lock);
+
+  fs_inode_exec_invalidate(ip);
+
+  ip->mtime = time_get_seconds();
+  ip->flags |= FS_INODE_DIRTY;
+
+  return 0;
+}
+
+/**
+ * Drop cached pages that overlap the given range of a file, e.g. after the
+ * file has been truncated.
+ *
+ * @param ip  The inode
+ * @param off The starting offset of the range
+ * @param n   The size of the range in bytes
+ */
+void
+fs_page_cache_invalidate(struct Inode *ip, off_t off, size_t n)
+{
+  struct KListLink *l, *next;
+
+  k_spinlock_acquire(&page_cache.lock);
+
+  for (l = ip->pages.next; l != &ip->pages; l = next) {
+    struct PageCacheEntry *entry;
+    off_t page_off;
+
+    entry = KLIST_CONTAINER(l, struct PageCacheEntry, inode_link);
+    next  = l->next;
+
+    page_off = (off_t) entry->index * PAGE_SIZE;
+    if ((page_off + (off_t) PAGE_SIZE > off) && (page_off < off + (off_t) n))
+      page_cache_remove(entry);
+  }
+
+  k_spinlock_release(&page_cache.lock);
+}
+
+/**
+ * Drop all cached pages of a file, e.g. before the inode is deleted or its
+ * cache slot is reused for another file.
+ *
+ * @param ip The inode
+ */
+void
+fs_page_cache_drop(struct Inode *ip)
+{
+  k_spinlock_acquire(&page_cache.lock);
+
+  while (!k_list_is_empty(&ip->pages))
+    page_cache_remove(KLIST_CONTAINER(ip->pages.next, struct PageCacheEntry,
+                                      inode_link));
+
+  k_spinlock_release(&page_cache.lock);
+}
+
+// Drop the cached pages that are not mapped anywhere. Called by the page
+// allocator when it runs out of memory, so no locks can be waited for.
+static unsigned long
+page_cache_shrink(void)
+{
+  struct KListLink *l, *prev;
+  unsigned long n = 0;
+
+  if (k_spinlock_try_acquire(&page_cache.lock) != 0)
+    return 0;
+
+  // Start from the least recently used pages
+  for (l = page_cache.lru.prev; l != &page_cache.lru; l = prev) {
+    struct PageCacheEntry *entry;
+    struct Page *page;
+
+    entry = KLIST_CONTAINER(l, struct PageCacheEntry, lru_link);
+    page  = entry->page;
+    prev  = l->prev;
+
+    // New references are only taken with page_cache.lock held
+    if (__atomic_load_n(&page->ref_count, __ATOMIC_ACQUIRE) != 1)
+      continue;
+
+    page_cache_unlink(entry);
+
+    // This CPU may be holding the pool lock while allocating a page
+    if (k_object_pool_try_put(page_cache.pool, entry) != 0) {
+      page_cache_link(entry);
+      break;
+    }
+
+    page->ref_count = 0;
+    page_free_one(page);
+    n++;
+  }
+
+  k_spinlock_release(&page_cache.lock);
+
+  return n;
+}
@@ -4,21 +4,45 @@
 #include <unistd.h>
 #include <limits.h>
 #include <string.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
 
 #include <kernel/console.h>
+#include <kernel/dev.h>
+#include <kernel/drivers/ramdisk.h>
 #include <kernel/fs/fs.h>
+#include <kernel/hash.h>
 #include <kernel/object_pool.h>
 #include <kernel/process.h>
 #include <kernel/types.h>
 
 #include "devfs.h"
 #include "ext2.h"
+#include "procfs.h"
+#include "tmpfs.h"
+
+#define FS_PATH_HASH_SIZE   256
+#define FS_PATH_CACHE_SIZE  256
 
 struct PathNode *fs_root;
 
 static struct KObjectPool *fs_path_pool;
-static struct KSpinLock fs_path_lock = K_SPINLOCK_INITIALIZER("fs_path");
+// Protects the path tree structure. Lookups take it for reading and update
+// the reference counts atomically.
+static struct KRWSpinLock fs_path_lock = K_RWSPINLOCK_INITIALIZER("fs_path");
+
+// All nodes except the root are hashed by (parent, name). Nodes referenced
+// only by their parents stay in the tree and are trimmed in LRU order. Nodes
+// without an inode are negative entries, recording that a name does not exist.
+//
+// Lookups take new references under the read lock, so the LRU list may also
+// contain nodes that are in use again. Such nodes are skipped when trimming.
+static struct {
+  HASH_DECLARE(hash, FS_PATH_HASH_SIZE);
+  struct KListLink lru;             ///< Unused nodes, most recent first
+  size_t           lru_count;
+  size_t           count;           ///< All nodes, updated atomically
+} fs_path_cache;
 
 static void
 fs_path_node_ctor(void *ptr, size_t n)
@@ -30,6 +54,8 @@ fs_path_node_ctor(void *ptr, size_t n)
   path_node->ref_count = 0;
   k_list_init(&path_node->children);
   k_list_null(&path_node->siblings);
+  k_list_null(&path_node->hash_link);
+  k_list_null(&path_node->lru_link);
   k_mutex_init(&path_node->mutex, "path_node");
 }
 
@@ -42,10 +68,153 @@ fs_path_node_dtor(void *ptr, size_t n)
   assert(path_node->mounted == NULL);
   assert(path_node->ref_count == 0);
   assert(k_list_is_empty(&path_node->children));
-  assert(k_list_is_empty(&path_node->siblings));
+  assert(k_list_is_null(&path_node->siblings));
+  assert(k_list_is_null(&path_node->hash_link));
+  assert(k_list_is_null(&path_node->lru_link));
   assert(!k_mutex_holding(&path_node->mutex));
 }
 
+static unsigned long
+fs_path_hash(struct PathNode *parent, const char *name)
+{
+  unsigned long h = 2166136261UL;
+
+  // FNV-1a
+  while (*name != '\0')
+    h = (h ^ (unsigned char) *name++) * 16777619UL;
+
+  return h ^ ((uintptr_t) parent / sizeof(struct PathNode));
+}
+
+static struct PathNode *
+fs_path_hash_lookup(struct PathNode *parent, const char *name)
+{
+  unsigned long h = fs_path_hash(parent, name);
+  struct KListLink *l;
+
+  HASH_FOREACH_ENTRY(fs_path_cache.hash, l, h) {
+    struct PathNode *p = KLIST_CONTAINER(l, struct PathNode, hash_link);
+
+    if ((p->hash == h) && (p->parent == parent) && (strcmp(p->name, name) == 0))
+      return p;
+  }
+
+  return NULL;
+}
+
+// Called with the write lock held after a reference is dropped. Detached
+// nodes without references are moved to the list to be freed by the caller.
+static void
+fs_path_release_locked(struct PathNode *path, struct KListLink *victims)
+{
+  if (path->ref_count == 0) {
+    if (path->parent != NULL)
+      panic("path in bad state");
+
+    k_list_add_back(victims, &path->lru_link);
+  } else if ((path->ref_count == 1) && (path->parent != NULL)) {
+    // Only referenced by the parent node
+    if (!k_list_is_null(&path->lru_link))
+      k_list_remove(&path->lru_link);
+    else
+      fs_path_cache.lru_count++;
+
+    k_list_add_front(&fs_path_cache.lru, &path->lru_link);
+  }
+}
+
+// Remove the node from the tree, dropping the references between the node
+// and its parent
+static void
+fs_path_detach_locked(struct PathNode *path, struct KListLink *victims)
+{
+  struct PathNode *parent = path->parent;
+
+  if (parent == NULL)
+    return;
+
+  k_list_remove(&path->siblings);
+  HASH_REMOVE(&path->hash_link);
+
+  if (!k_list_is_null(&path->lru_link)) {
+    k_list_remove(&path->lru_link);
+    fs_path_cache.lru_count--;
+  }
+
+  path->parent = NULL;
+  path->ref_count--;
+  fs_path_release_locked(path, victims);
+
+  parent->ref_count--;
+  fs_path_release_locked(parent, victims);
+}
+
+static void
+fs_path_trim_locked(struct KListLink *victims)
+{
+  while (fs_path_cache.lru_count > FS_PATH_CACHE_SIZE) {
+    struct PathNode *path;
+
+    path = KLIST_CONTAINER(fs_path_cache.lru.prev, struct PathNode, lru_link);
+
+    k_list_remove(&path->lru_link);
+    fs_path_cache.lru_count--;
+
+    if (path->ref_count == 1)
+      fs_path_detach_locked(path, victims);
+  }
+}
+
+// Free the nodes collected by the functions above, with the lock released
+static void
+fs_path_free(struct KListLink *victims)
+{
+  while (!k_list_is_empty(victims)) {
+    struct PathNode *path;
+    
+    path = KLIST_CONTAINER(victims->next, struct PathNode, lru_link);
+    k_list_remove(&path->lru_link);
+
+    // cprintf("[drop %s]\n", path->name);
+
+    if (path->mounted != NULL)
+      panic("TODO: drop mountpoint");
+
+    if (path->inode != NULL)
+      fs_inode_put(path->inode);
+
+    k_object_pool_put(fs_path_pool, path);
+    __atomic_sub_fetch(&fs_path_cache.count, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Collect the path cache statistics.
+ *
+ * @param stats Where to store the statistics
+ */
+void
+fs_path_cache_get_stats(struct FsCacheStats *stats)
+{
+  k_rwspinlock_read_acquire(&fs_path_lock);
+
+  stats->paths        = __atomic_load_n(&fs_path_cache.count, __ATOMIC_RELAXED);
+  stats->paths_unused = fs_path_cache.lru_count;
+  stats->paths_max    = FS_PATH_CACHE_SIZE;
+
+  k_rwspinlock_read_release(&fs_path_lock);
+}
+
+/**
+ * Create a path node.
+ *
+ * @param name   The name of the node
+ * @param inode  The inode (the reference is passed to the node), or NULL to
+ *               create a negative entry
+ * @param parent The parent node, or NULL to create the root node
+ *
+ * @return Pointer to the new node, or NULL if out of memory.
+ */
 struct PathNode *
 fs_path_node_create(const char *name, struct Inode *inode,
                     struct PathNode *parent)
@@ -54,6 +223,7 @@ fs_path_node_create(const char *name, struct Inode *inode,
 
   if ((path = (struct PathNode *) k_object_pool_get(fs_path_pool)) == NULL)
     return NULL;
+  __atomic_add_fetch(&fs_path_cache.count, 1, __ATOMIC_RELAXED);
 
   if (name != NULL)
     strncpy(path->name, name, NAME_MAX);
@@ -63,14 +233,17 @@ fs_path_node_create(const char *name, struct Inode *inode,
   path->ref_count++;
 
   if (parent) {
-    k_spinlock_acquire(&fs_path_lock);
+    k_rwspinlock_write_acquire(&fs_path_lock);
   
     parent->ref_count++;
     
     k_list_add_front(&parent->children, &path->siblings);
     path->ref_count++;
 
-    k_spinlock_release(&fs_path_lock);
+    path->hash = fs_path_hash(parent, path->name);
+    HASH_PUT(fs_path_cache.hash, &path->hash_link, path->hash);
+
+    k_rwspinlock_write_release(&fs_path_lock);
   }
 
   //cprintf("[create %s %d]\n", name, path->ref_count);
@@ -81,9 +254,9 @@ fs_path_node_create(const char *name, struct Inode *inode,
 struct PathNode *
 fs_path_duplicate(struct PathNode *path)
 {
-  k_spinlock_acquire(&fs_path_lock);
-  path->ref_count++;
-  k_spinlock_release(&fs_path_lock);
+  k_rwspinlock_read_acquire(&fs_path_lock);
+  __sync_add_and_fetch(&path->ref_count, 1);
+  k_rwspinlock_read_release(&fs_path_lock);
 
   // cprintf("[dup %s]\n", path);
 
@@ -93,83 +266,93 @@ fs_path_duplicate(struct PathNode *path)
 int
 fs_path_mount(struct PathNode *path, struct Inode *inode)
 {
+  KLIST_DECLARE(victims);
+  struct KListLink *l;
+
   if (path->mounted)
     panic("already mounted");
 
+  k_rwspinlock_write_acquire(&fs_path_lock);
+
   path->mounted = inode;
 
-  // TODO: remove all cached entries???
+  // Drop unused entries cached from the covered directory
+  // TODO: nodes that are still referenced remain visible
+  for (l = path->children.next; l != &path->children; ) {
+    struct PathNode *p = KLIST_CONTAINER(l, struct PathNode, siblings);
+
+    l = l->next;
+
+    if (p->ref_count == 1)
+      fs_path_detach_locked(p, &victims);
+  }
+
+  k_rwspinlock_write_release(&fs_path_lock);
+
+  fs_path_free(&victims);
 
   return 0;
 }
 
+/**
+ * Remove a node from the tree after its name has been deleted.
+ *
+ * @param path The node (the caller's reference remains valid)
+ */
 void
 fs_path_remove(struct PathNode *path)
 {
-  k_spinlock_acquire(&fs_path_lock);
+  KLIST_DECLARE(victims);
 
-  if (path->parent) {
-    path->parent->ref_count--;
-    path->parent = NULL;
-  }
+  k_rwspinlock_write_acquire(&fs_path_lock);
+  fs_path_detach_locked(path, &victims);
+  k_rwspinlock_write_release(&fs_path_lock);
 
-  k_list_remove(&path->siblings);
-  path->ref_count--;
-
-  k_spinlock_release(&fs_path_lock);
+  fs_path_free(&victims);
 }
 
+/**
+ * Drop the negative entry for a name that has just been created.
+ *
+ * @param parent The parent node (its mutex must be locked)
+ * @param name   The new name
+ */
 void
-fs_path_put(struct PathNode *path)
+fs_path_invalidate(struct PathNode *parent, const char *name)
 {
-  k_spinlock_acquire(&fs_path_lock);
-
-  path->ref_count--;
-
-  // cprintf("[put %s %d]\n", path->name, path->ref_count);
+  KLIST_DECLARE(victims);
+  struct PathNode *path;
 
-  if ((path->ref_count == 0) && (path->parent != NULL))
-    panic("path in bad state");
+  k_rwspinlock_write_acquire(&fs_path_lock);
 
-  // Move up the tree and remove all unused nodes. A node is considered unused
-  // in one of two cases:
-  // a) the reference count is 0
-  // b) the reference count is 1, and it's referenced only by the parent node
-  // TODO: parent of unmounted entry??
-  while ((path != NULL) && (path->ref_count < 2)) {
-    struct PathNode *parent = path->parent;
+  if (((path = fs_path_hash_lookup(parent, name)) != NULL) &&
+      (path->inode == NULL))
+    fs_path_detach_locked(path, &victims);
 
-    if ((path->ref_count == 1) && (parent == NULL))
-      // Only one link left, and this is not the parent node
-      break;
+  k_rwspinlock_write_release(&fs_path_lock);
 
-    if (parent) {
-      assert(path->ref_count == 1);
-      k_list_remove(&path->siblings);
-      path->ref_count--;
-    }
+  fs_path_free(&victims);
+}
 
-    k_spinlock_release(&fs_path_lock);
+void
+fs_path_put(struct PathNode *path)
+{
+  KLIST_DECLARE(victims);
 
-    // cprintf("[drop %s %d]\n", path->name, path->inode->ino);
+  k_rwspinlock_write_acquire(&fs_path_lock);
 
-    if (path->mounted != NULL)
-      panic("TODO: drop mountpoint");
-
-    if (path->inode != NULL)
-      fs_inode_put(path->inode);
+  path->ref_count--;
 
-    k_object_pool_put(fs_path_pool, path);
-    
-    k_spinlock_acquire(&fs_path_lock);
+  // cprintf("[put %s %d]\n", path->name, path->ref_count);
 
-    if (parent)
-      parent->ref_count--;
+  // Unused nodes stay cached until trimmed. Nodes removed from the tree are
+  // freed when the last reference is dropped.
+  fs_path_release_locked(path, &victims);
+  fs_path_trim_locked(&victims);
 
-    path = parent;
-  }
+  k_rwspinlock_write_release(&fs_path_lock);
 
-  k_spinlock_release(&fs_path_lock);
+  fs_path_free(&victims);
 }
 
 struct Inode *
@@ -177,15 +360,15 @@ fs_path_inode(struct PathNode *node)
 {
   struct Inode *inode;
 
-  k_spinlock_acquire(&fs_path_lock);
+  k_rwspinlock_read_acquire(&fs_path_lock);
   inode = node->mounted ? node->mounted : node->inode;
-  k_spinlock_release(&fs_path_lock);
+  k_rwspinlock_read_release(&fs_path_lock);
 
   return fs_inode_duplicate(inode);
 }
 
 void
-fs_fs_path_node_lock(struct PathNode *node)
+fs_path_node_lock(struct PathNode *node)
 {
   if ((node->ref_count == 1) && (node->parent != NULL))
     panic("bad path node reference");
@@ -235,26 +418,94 @@ fs_path_next(const char *path, char *name_buf, char **result)
 static struct PathNode *
 fs_path_lookup_cached(struct PathNode *parent, const char *name)
 {
-  struct KListLink *l;
+  struct PathNode *p;
 
-  // TODO: this is a bottleneck! 
-  // if there are many child nodes, comparing all names may take too long, and
-  // we're blocking the entire system. Could we use a per-node mutex instead?
+  k_rwspinlock_read_acquire(&fs_path_lock);
 
-  k_spinlock_acquire(&fs_path_lock);
+  if ((p = fs_path_hash_lookup(parent, name)) != NULL)
+    __sync_add_and_fetch(&p->ref_count, 1);
 
-  KLIST_FOREACH(&parent->children, l) {
-    struct PathNode *p = KLIST_CONTAINER(l, struct PathNode, siblings);
-    
-    if (strcmp(p->name, name) == 0) {
-      p->ref_count++;
-      k_spinlock_release(&fs_path_lock);
-      return p;
+  k_rwspinlock_read_release(&fs_path_lock);
+
+  return p;
+}
+
+// Check whether the name of a cached node still exists, for filesystems whose
+// names come and go on their own
+static int
+fs_path_valid(struct PathNode *path)
+{
+  struct Inode *inode = path->inode;
+
+  return (inode->fs->ops->revalidate == NULL) ||
+         inode->fs->ops->revalidate(inode);
+}
+
+// Walk the cached nodes with the tree lock held for reading for the whole
+// path, taking references only on the nodes returned. Return -EAGAIN if a
+// component is not cached, so the caller has to do the full walk.
+static int
+fs_path_lookup_fast(struct PathNode *start,
+                    const char *path,
+                    char *name_buf,
+                    struct PathNode **store,
+                    struct PathNode **parent_store)
+{
+  struct PathNode *parent, *current;
+  int r;
+
+  k_rwspinlock_read_acquire(&fs_path_lock);
+
+  current = (*path == '/') ? fs_root : start;
+  parent  = NULL;
+
+  while ((r = fs_path_next(path, name_buf, (char **) &path)) > 0) {
+    if (strcmp(name_buf, ".") == 0)
+      continue;
+
+    parent = current;
+
+    if (strcmp(name_buf, "..") == 0)
+      current = parent->parent;
+    else
+      current = fs_path_hash_lookup(parent, name_buf);
+
+    if (current == NULL) {
+      r = -EAGAIN;
+      break;
+    }
+
+    // Negative entry
+    if (current->inode == NULL) {
+      current = NULL;
+      r = (*path == '\0') ? 0 : -ENOENT;
+      break;
+    }
+
+    // The name must be checked by the filesystem first
+    if (current->inode->fs->ops->revalidate != NULL) {
+      r = -EAGAIN;
+      break;
     }
   }
 
-  k_spinlock_release(&fs_path_lock);
-  return NULL;
+  if (r == 0) {
+    if (parent_store != NULL) {
+      if (parent != NULL)
+        __sync_add_and_fetch(&parent->ref_count, 1);
+      *parent_store = parent;
+    }
+
+    if (store != NULL) {
+      if (current != NULL)
+        __sync_add_and_fetch(&current->ref_count, 1);
+      *store = current;
+    }
+  }
+
+  k_rwspinlock_read_release(&fs_path_lock);
+
+  return r;
 }
 
 int
@@ -271,6 +522,11 @@ fs_path_lookup_at(struct PathNode *start,
   if (*path == '\0')
     return -ENOENT;
 
+  // Paths that are already cached are resolved without locking any nodes
+  r = fs_path_lookup_fast(start, path, name_buf, store, parent_store);
+  if (r != -EAGAIN)
+    return r;
+
   // For absolute paths, begin search from the root directory.
   // For relative paths, begin search from the specifed starting directory.
   current = fs_path_duplicate(*path == '/' ? fs_root : start);
@@ -278,6 +534,7 @@ fs_path_lookup_at(struct PathNode *start,
 
   while ((r = fs_path_next(path, name_buf, (char **) &path)) > 0) {
     struct Inode *inode, *parent_inode;
+    int cache_negative;
 
     // Stay in the current directory
     if (strcmp(name_buf, ".") == 0)
@@ -289,7 +546,7 @@ fs_path_lookup_at(struct PathNode *start,
     parent  = current;
     current = NULL;
 
-    fs_fs_path_node_lock(parent);
+    fs_path_node_lock(parent);
 
     // Move to the parent directory
     if (strcmp(name_buf, "..") == 0) {
@@ -306,9 +563,26 @@ fs_path_lookup_at(struct PathNode *start,
       continue;
     }
 
-    if ((current = fs_path_lookup_cached(parent, name_buf)) != NULL) {
+    if (((current = fs_path_lookup_cached(parent, name_buf)) != NULL) &&
+        (current->inode != NULL) && !fs_path_valid(current)) {
+      // The name has gone meanwhile
+      fs_path_remove(current);
+      fs_path_put(current);
+      current = NULL;
+    }
+
+    if (current != NULL) {
       fs_path_node_unlock(parent);
-      continue;
+
+      if (current->inode != NULL)
+        continue;
+
+      // Negative entry
+      fs_path_put(current);
+      current = NULL;
+
+      r = (*path == '\0') ? 0 : -ENOENT;
+      break;
     }
 
     parent_inode = fs_path_inode(parent);
@@ -316,6 +590,9 @@ fs_path_lookup_at(struct PathNode *start,
 
     r = fs_inode_lookup_locked(parent_inode, name_buf, flags, &inode);
 
+    // Names of such filesystems may appear at any time
+    cache_negative = (parent_inode->fs->ops->revalidate == NULL);
+
     fs_inode_unlock(parent_inode);
     fs_inode_put(parent_inode);
 
@@ -325,7 +602,14 @@ fs_path_lookup_at(struct PathNode *start,
         r = -ENOMEM;
       }
     } else {
+      struct PathNode *negative;
+
       current = NULL;
+
+      // Remember that the name does not exist
+      if ((r == 0) && cache_negative &&
+          ((negative = fs_path_node_create(name_buf, NULL, parent)) != NULL))
+        fs_path_put(negative);
     }
 
     fs_path_node_unlock(parent);
@@ -365,6 +649,25 @@ fs_path_lookup(const char *path, char *name_buf, int flags,
 
 int
 fs_lookup(const char *path, int flags, struct PathNode **pp)
+{
+  return fs_lookup_at(process_current()->cwd, path, flags, pp);
+}
+
+/**
+ * Look up a path relative to the given directory rather than the current
+ * working directory. Absolute paths are resolved from the root as usual.
+ *
+ * @param start The starting directory
+ * @param path  The path to look up
+ * @param flags The lookup flags (FS_LOOKUP_*)
+ * @param pp    Pointer to the memory location to store the node (NULL if the
+ *              last component does not exist)
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+fs_lookup_at(struct PathNode *start, const char *path, int flags,
+             struct PathNode **pp)
 {
   char name_buf[NAME_MAX + 1];
 
@@ -373,7 +676,7 @@ fs_lookup(const char *path, int flags, struct PathNode **pp)
     return 0;
   }
 
-  return fs_path_lookup(path, name_buf, flags, pp, NULL);
+  return fs_path_lookup_at(start, path, name_buf, flags, pp, NULL);
 }
 
 int
@@ -396,12 +699,27 @@ fs_lookup_inode(const char *path, int flags, struct Inode **inode_store)
 
 #define FS_ROOT_DEV 0
 #define FS_DEV_DEV  1
+// Used as the root instead of the SD card if a RAM disk image is present
+#define FS_RAM_DEV  (RAMDISK_MAJOR << 8)
+// Memory-backed filesystems get the device IDs from here upwards
+#define FS_TMP_DEV  2
+
+// Reads of the root filesystem update the access times at most once a day
+#ifndef FS_ROOT_MOUNT_FLAGS
+#define FS_ROOT_MOUNT_FLAGS MNT_RELATIME
+#endif
 
 void
 fs_init(void)
-{ 
+{
+  struct Inode *root;
+  dev_t root_dev;
+
   fs_inode_cache_init();
 
+  HASH_INIT(fs_path_cache.hash);
+  k_list_init(&fs_path_cache.lru);
+
   fs_path_pool = k_object_pool_create("fs_path_pool",
                                       sizeof(struct PathNode),
                                       0,
@@ -410,14 +728,22 @@ fs_init(void)
   if (fs_path_pool == NULL)
     panic("cannot allocate fs_path_pool");
 
-  if ((fs_root = fs_path_node_create("/", ext2_mount(FS_ROOT_DEV), NULL)) == NULL)
+  root_dev = (dev_lookup_block(FS_RAM_DEV) != NULL) ? FS_RAM_DEV : FS_ROOT_DEV;
+
+  if ((root = ext2_mount(root_dev)) == NULL)
+    panic("cannot mount the root filesystem");
+  root->fs->flags = FS_ROOT_MOUNT_FLAGS;
+
+  if ((fs_root = fs_path_node_create("/", root, NULL)) == NULL)
     panic("cannot allocate fs root");
 
   fs_root->parent = fs_path_duplicate(fs_root);
 }
 
+static dev_t fs_tmp_dev = FS_TMP_DEV;
+
 int
-fs_mount(const char *type, const char *path)
+fs_mount(const char *type, const char *path, int flags)
 {
   struct PathNode *node;
   struct Inode *root;
@@ -427,11 +753,17 @@ fs_mount(const char *type, const char *path)
 
   if (!strcmp(type, "devfs")) {
     root = devfs_mount(FS_DEV_DEV);
+  } else if (!strcmp(type, "tmpfs")) {
+    root = tmpfs_mount(__atomic_fetch_add(&fs_tmp_dev, 1, __ATOMIC_RELAXED));
+  } else if (!strcmp(type, "procfs")) {
+    root = procfs_mount(__atomic_fetch_add(&fs_tmp_dev, 1, __ATOMIC_RELAXED));
   } else {
     fs_path_put(node);
     return -EINVAL;
   }
 
+  root->fs->flags = flags;
+
   // TODO: add to the list of mount points
 
   return fs_path_mount(node, root);
@@ -0,0 +1,625 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <kernel/cpustat.h>
+#include <kernel/fs/fs.h>
+#include <kernel/interrupt.h>
+#include <kernel/meminfo.h>
+#include <kernel/object_pool.h>
+#include <kernel/process.h>
+#include <kernel/types.h>
+#include <kernel/vm.h>
+#include <kernel/vmspace.h>
+
+#include "procfs.h"
+
+/*
+ * ----------------------------------------------------------------------------
+ * Process filesystem
+ * ----------------------------------------------------------------------------
+ *
+ * Read-only text files generated from the kernel statistics, mounted at /proc:
+ *
+ *   meminfo        page allocator, swap, buffer, inode and path caches
+ *   slabinfo       object pools
+ *   stat           CPU times, load averages and processes (as /dev/cpustat)
+ *   interrupts     interrupts taken by each CPU
+ *   <pid>/status   process attributes and times
+ *   <pid>/maps     memory areas of the process
+ *
+ * Nothing is stored: every read formats a fresh report into a temporary
+ * buffer and copies out the requested range. The reports are built from
+ * snapshots that each subsystem takes under its own lock, so no lock is held
+ * while formatting or copying to the user, and polling is cheap. A file read
+ * in several chunks may change between the chunks.
+ *
+ * The inode numbers encode the process ID and the index of the file, so that
+ * the inodes can be recreated from the numbers alone. Process directories
+ * come and go, so procfs_revalidate() checks cached names against the
+ * process table.
+ */
+
+#define PROCFS_ROOT_INO       2
+
+// The root files get numbers from PROCFS_INO(0, 3), the directory of a
+// process gets PROCFS_INO(pid, 0) and its files follow
+#define PROCFS_INO(pid, i)    (((ino_t) (pid) << 4) | (i))
+#define PROCFS_INO_PID(ino)   ((pid_t) ((ino) >> 4))
+#define PROCFS_INO_INDEX(ino) ((unsigned) ((ino) & 0xF))
+#define PROCFS_ROOT_FIRST     3
+
+// Large enough for every report, the output is truncated otherwise
+#define PROCFS_REPORT_SIZE    8192
+
+// Processes listed in the root directory, memory areas shown in maps and
+// interrupt lines shown in interrupts
+#define PROCFS_PROCS_MAX      64U
+#define PROCFS_AREAS_MAX      128U
+#define PROCFS_IRQS_MAX       64U
+
+// Keeps the inode numbers within 32 bits
+#define PROCFS_PID_MAX        0x7FFFFFF
+
+struct ProcfsBuf {
+  char   *data;
+  size_t  size;
+  size_t  len;
+};
+
+struct ProcfsFile {
+  const char *name;
+  size_t    (*report)(pid_t, char *, size_t);
+};
+
+static void
+procfs_printf(struct ProcfsBuf *buf, const char *format, ...)
+{
+  va_list ap;
+  int n;
+
+  if (buf->len >= buf->size)
+    return;
+
+  va_start(ap, format);
+  n = vsnprintf(buf->data + buf->len, buf->size - buf->len, format, ap);
+  va_end(ap);
+
+  if (n > 0)
+    buf->len = MIN(buf->len + n, buf->size);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Reports
+ * ----------------------------------------------------------------------------
+ */
+
+static size_t
+procfs_meminfo(pid_t pid, char *data, size_t size)
+{
+  (void) pid;
+  return meminfo_page_report(data, size);
+}
+
+static size_t
+procfs_slabinfo(pid_t pid, char *data, size_t size)
+{
+  (void) pid;
+  return meminfo_slab_report(data, size);
+}
+
+static size_t
+procfs_stat(pid_t pid, char *data, size_t size)
+{
+  (void) pid;
+  return cpustat_report(data, size);
+}
+
+static size_t
+procfs_interrupts(pid_t pid, char *data, size_t size)
+{
+  struct ProcfsBuf buf = { data, size, 0 };
+  struct InterruptStats *stats;
+  unsigned cpu, i, n;
+
+  (void) pid;
+
+  stats = (struct InterruptStats *)
+    k_malloc(PROCFS_IRQS_MAX * sizeof(struct InterruptStats));
+  if (stats == NULL)
+    return 0;
+
+  n = interrupt_get_stats(stats, PROCFS_IRQS_MAX);
+
+  procfs_printf(&buf, "%-4s %-5s", "irq", "route");
+  for (cpu = 0; cpu < K_CPU_MAX; cpu++)
+    procfs_printf(&buf, "       cpu%u", cpu);
+  procfs_printf(&buf, "\n");
+
+  for (i = 0; i < MIN(n, PROCFS_IRQS_MAX); i++) {
+    procfs_printf(&buf, "%-4d %-5u", stats[i].irq, stats[i].cpu);
+    for (cpu = 0; cpu < K_CPU_MAX; cpu++)
+      procfs_printf(&buf, " %10lu", stats[i].count[cpu]);
+    procfs_printf(&buf, "\n");
+  }
+
+  k_free(stats);
+
+  return buf.len;
+}
+
+static char
+procfs_state(int state)
+{
+  switch (state) {
+  case PROCESS_STATE_ACTIVE:
+    return 'A';
+  case PROCESS_STATE_ZOMBIE:
+    return 'Z';
+  case PROCESS_STATE_STOPPED:
+    return 'T';
+  default:
+    return '?';
+  }
+}
+
+static size_t
+procfs_status(pid_t pid, char *data, size_t size)
+{
+  struct ProcfsBuf buf = { data, size, 0 };
+  struct VMSpaceAreaInfo *areas;
+  struct ProcessStats stats;
+  unsigned long vm_size = 0;
+  int i, n;
+
+  if (process_get_pid_stats(pid, &stats) != 0)
+    return 0;
+
+  areas = (struct VMSpaceAreaInfo *)
+    k_malloc(PROCFS_AREAS_MAX * sizeof(struct VMSpaceAreaInfo));
+  if (areas != NULL) {
+    n = process_get_areas(pid, areas, PROCFS_AREAS_MAX);
+    for (i = 0; i < (int) MIN((unsigned) MAX(n, 0), PROCFS_AREAS_MAX); i++)
+      vm_size += areas[i].length;
+    k_free(areas);
+  }
+
+  procfs_printf(&buf, "Name:\t%s\n", stats.name);
+  procfs_printf(&buf, "State:\t%c\n", procfs_state(stats.state));
+  procfs_printf(&buf, "Pid:\t%d\n", (int) stats.pid);
+  procfs_printf(&buf, "PPid:\t%d\n", (int) stats.ppid);
+  procfs_printf(&buf, "Pgid:\t%d\n", (int) stats.pgid);
+  procfs_printf(&buf, "Uid:\t%u\n", (unsigned) stats.uid);
+  procfs_printf(&buf, "Gid:\t%u\n", (unsigned) stats.gid);
+  procfs_printf(&buf, "Threads:\t%d\n", stats.threads);
+  procfs_printf(&buf, "Policy:\t%d\n", stats.policy);
+  procfs_printf(&buf, "Priority:\t%d\n", stats.priority);
+  procfs_printf(&buf, "Utime:\t%lu\n", (unsigned long) stats.utime);
+  procfs_printf(&buf, "Stime:\t%lu\n", (unsigned long) stats.stime);
+  procfs_printf(&buf, "VmSize:\t%lu kB\n", vm_size / 1024);
+
+  return buf.len;
+}
+
+static size_t
+procfs_maps(pid_t pid, char *data, size_t size)
+{
+  struct ProcfsBuf buf = { data, size, 0 };
+  struct VMSpaceAreaInfo *areas;
+  int i, n;
+
+  areas = (struct VMSpaceAreaInfo *)
+    k_malloc(PROCFS_AREAS_MAX * sizeof(struct VMSpaceAreaInfo));
+  if (areas == NULL)
+    return 0;
+
+  n = process_get_areas(pid, areas, PROCFS_AREAS_MAX);
+
+  for (i = 0; i < (int) MIN((unsigned) MAX(n, 0), PROCFS_AREAS_MAX); i++)
+    procfs_printf(&buf, "%08lx-%08lx %c%c%c%c %08lx %02x:%02x %lu\n",
+                  (unsigned long) areas[i].start,
+                  (unsigned long) (areas[i].start + areas[i].length),
+                  (areas[i].flags & VM_READ)   ? 'r' : '-',
+                  (areas[i].flags & VM_WRITE)  ? 'w' : '-',
+                  (areas[i].flags & VM_EXEC)   ? 'x' : '-',
+                  (areas[i].flags & VM_SHARED) ? 's' : 'p',
+                  (unsigned long) areas[i].file_offset,
+                  (unsigned) (areas[i].dev >> 8) & 0xFF,
+                  (unsigned) areas[i].dev & 0xFF,
+                  (unsigned long) areas[i].ino);
+
+  k_free(areas);
+
+  return buf.len;
+}
+
+static const struct ProcfsFile procfs_root_files[] = {
+  { "meminfo",    procfs_meminfo },
+  { "slabinfo",   procfs_slabinfo },
+  { "stat",       procfs_stat },
+  { "interrupts", procfs_interrupts },
+};
+
+static const struct ProcfsFile procfs_pid_files[] = {
+  { "status",     procfs_status },
+  { "maps",       procfs_maps },
+};
+
+#define PROCFS_ROOT_FILES \
+  (sizeof(procfs_root_files) / sizeof(procfs_root_files[0]))
+#define PROCFS_PID_FILES \
+  (sizeof(procfs_pid_files) / sizeof(procfs_pid_files[0]))
+
+// Find the file for an inode number, or NULL if it is a directory
+static const struct ProcfsFile *
+procfs_file(ino_t ino)
+{
+  unsigned i = PROCFS_INO_INDEX(ino);
+
+  if (PROCFS_INO_PID(ino) == 0)
+    return ((i >= PROCFS_ROOT_FIRST) && (i - PROCFS_ROOT_FIRST <
+                                         PROCFS_ROOT_FILES))
+      ? &procfs_root_files[i - PROCFS_ROOT_FIRST]
+      : NULL;
+
+  return ((i >= 1) && (i - 1 < PROCFS_PID_FILES))
+    ? &procfs_pid_files[i - 1]
+    : NULL;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Filesystem operations
+ * ----------------------------------------------------------------------------
+ */
+
+static struct Inode *
+procfs_inode_get(struct FS *fs, ino_t ino)
+{
+  struct Inode *inode = fs_inode_get(ino, fs->dev);
+
+  if (inode != NULL && inode->fs == NULL) {
+    inode->fs = fs;
+    inode->extra = NULL;
+  }
+
+  return inode;
+}
+
+static int
+procfs_inode_read(struct Inode *inode)
+{
+  pid_t pid = PROCFS_INO_PID(inode->ino);
+  struct ProcessStats stats;
+
+  inode->uid = 0;
+  inode->gid = 0;
+
+  // The files of a process belong to its owner
+  if ((pid != 0) && (process_get_pid_stats(pid, &stats) == 0)) {
+    inode->uid = stats.uid;
+    inode->gid = stats.gid;
+  }
+
+  if (procfs_file(inode->ino) != NULL) {
+    inode->mode   = S_IFREG | 0444;
+    inode->nlink  = 1;
+    inode->flags |= FS_INODE_VOLATILE;
+  } else {
+    inode->mode   = S_IFDIR | 0555;
+    inode->nlink  = 2;
+  }
+
+  inode->rdev  = 0;
+  inode->size  = 0;
+  inode->atime = 0;
+  inode->mtime = 0;
+  inode->ctime = 0;
+
+  return 0;
+}
+
+static int
+procfs_inode_write(struct Inode *inode)
+{
+  (void) inode;
+  return 0;
+}
+
+static void
+procfs_inode_delete(struct Inode *inode)
+{
+  (void) inode;
+}
+
+static ssize_t
+procfs_read(struct Inode *inode, uintptr_t va, size_t n, off_t off)
+{
+  const struct ProcfsFile *file;
+  char *data;
+  size_t len;
+  ssize_t r;
+
+  if ((file = procfs_file(inode->ino)) == NULL)
+    return -EISDIR;
+
+  if ((data = (char *) k_malloc(PROCFS_REPORT_SIZE)) == NULL)
+    return -ENOMEM;
+
+  len = file->report(PROCFS_INO_PID(inode->ino), data, PROCFS_REPORT_SIZE);
+
+  if ((off < 0) || ((size_t) off >= len)) {
+    r = 0;
+  } else {
+    n = MIN(n, len - (size_t) off);
+    r = vm_space_copy_out(data + off, va, n);
+    if (r == 0)
+      r = n;
+  }
+
+  k_free(data);
+
+  return r;
+}
+
+static ssize_t
+procfs_write(struct Inode *inode, uintptr_t va, size_t n, off_t off)
+{
+  (void) inode;
+  (void) va;
+  (void) n;
+  (void) off;
+  return -EROFS;
+}
+
+static void
+procfs_trunc(struct Inode *inode, off_t size)
+{
+  (void) inode;
+  (void) size;
+}
+
+// Find the process with the lowest ID not below the given one, or 0
+static pid_t
+procfs_next_pid(pid_t min)
+{
+  struct ProcessStats *stats;
+  pid_t next = 0;
+  unsigned i, n;
+
+  stats = (struct ProcessStats *)
+    k_malloc(PROCFS_PROCS_MAX * sizeof(struct ProcessStats));
+  if (stats == NULL)
+    return 0;
+
+  n = process_get_stats(stats, PROCFS_PROCS_MAX);
+
+  for (i = 0; i < MIN(n, PROCFS_PROCS_MAX); i++)
+    if ((stats[i].pid >= min) && ((next == 0) || (stats[i].pid < next)))
+      next = stats[i].pid;
+
+  k_free(stats);
+
+  return next;
+}
+
+static ssize_t
+procfs_readdir(struct Inode *dir, void *buf, FillDirFunc filldir, off_t off)
+{
+  pid_t pid = PROCFS_INO_PID(dir->ino);
+  char name[16];
+  off_t first;
+
+  if (!S_ISDIR(dir->mode))
+    return -ENOTDIR;
+
+  if (off == 0) {
+    filldir(buf, dir->ino, ".", 1);
+    return 1;
+  }
+  if (off == 1) {
+    filldir(buf, PROCFS_ROOT_INO, "..", 2);
+    return 1;
+  }
+
+  if (pid != 0) {
+    const struct ProcfsFile *file;
+    unsigned i = off - 2;
+
+    if (i >= PROCFS_PID_FILES)
+      return 0;
+
+    file = &procfs_pid_files[i];
+    filldir(buf, PROCFS_INO(pid, i + 1), file->name, strlen(file->name));
+    return 1;
+  }
+
+  if (off - 2 < (off_t) PROCFS_ROOT_FILES) {
+    const struct ProcfsFile *file = &procfs_root_files[off - 2];
+
+    filldir(buf, PROCFS_INO(0, PROCFS_ROOT_FIRST + off - 2), file->name,
+            strlen(file->name));
+    return 1;
+  }
+
+  // Past the files, the offset is the lowest process ID to list next, so
+  // processes created or destroyed meanwhile do not shift the others
+  first = 2 + PROCFS_ROOT_FILES;
+
+  if ((pid = procfs_next_pid(off - first)) == 0)
+    return 0;
+
+  snprintf(name, sizeof(name), "%d", (int) pid);
+  filldir(buf, PROCFS_INO(pid, 0), name, strlen(name));
+
+  return (first + pid + 1) - off;
+}
+
+static ssize_t
+procfs_readlink(struct Inode *inode, char *buf, size_t n)
+{
+  (void) inode;
+  (void) buf;
+  (void) n;
+  return -EINVAL;
+}
+
+static int
+procfs_rmdir(struct Inode *parent, struct Inode *inode)
+{
+  (void) parent;
+  (void) inode;
+  return -EROFS;
+}
+
+static int
+procfs_create(struct Inode *dir, char *name, mode_t mode, struct Inode **store)
+{
+  (void) dir;
+  (void) name;
+  (void) mode;
+  (void) store;
+  return -EROFS;
+}
+
+static int
+procfs_mkdir(struct Inode *dir, char *name, mode_t mode, struct Inode **store)
+{
+  (void) dir;
+  (void) name;
+  (void) mode;
+  (void) store;
+  return -EROFS;
+}
+
+static int
+procfs_mknod(struct Inode *dir, char *name, mode_t mode, dev_t dev,
+             struct Inode **store)
+{
+  (void) dir;
+  (void) name;
+  (void) mode;
+  (void) dev;
+  (void) store;
+  return -EROFS;
+}
+
+static int
+procfs_link(struct Inode *parent, char *name, struct Inode *inode)
+{
+  (void) parent;
+  (void) name;
+  (void) inode;
+  return -EROFS;
+}
+
+static int
+procfs_unlink(struct Inode *parent, struct Inode *inode)
+{
+  (void) parent;
+  (void) inode;
+  return -EROFS;
+}
+
+// Parse a process ID, without signs or leading zeros
+static pid_t
+procfs_parse_pid(const char *name)
+{
+  pid_t pid = 0;
+
+  if ((*name < '1') || (*name > '9'))
+    return 0;
+
+  for ( ; *name != '\0'; name++) {
+    if ((*name < '0') || (*name > '9') || (pid > PROCFS_PID_MAX / 10))
+      return 0;
+    pid = pid * 10 + (*name - '0');
+  }
+
+  if (pid > PROCFS_PID_MAX)
+    return 0;
+
+  return pid;
+}
+
+static struct Inode *
+procfs_lookup(struct Inode *dir, const char *name)
+{
+  pid_t pid = PROCFS_INO_PID(dir->ino);
+  struct ProcessStats stats;
+  unsigned i;
+
+  if (pid != 0) {
+    for (i = 0; i < PROCFS_PID_FILES; i++)
+      if (strcmp(name, procfs_pid_files[i].name) == 0)
+        return procfs_inode_get(dir->fs, PROCFS_INO(pid, i + 1));
+    return NULL;
+  }
+
+  for (i = 0; i < PROCFS_ROOT_FILES; i++)
+    if (strcmp(name, procfs_root_files[i].name) == 0)
+      return procfs_inode_get(dir->fs, PROCFS_INO(0, PROCFS_ROOT_FIRST + i));
+
+  if (((pid = procfs_parse_pid(name)) == 0) ||
+      (process_get_pid_stats(pid, &stats) != 0))
+    return NULL;
+
+  return procfs_inode_get(dir->fs, PROCFS_INO(pid, 0));
+}
+
+// The names of a process stay valid while the process exists
+static int
+procfs_revalidate(struct Inode *inode)
+{
+  struct ProcessStats stats;
+  pid_t pid = PROCFS_INO_PID(inode->ino);
+
+  return (pid == 0) || (process_get_pid_stats(pid, &stats) == 0);
+}
+
+struct FSOps procfs_ops = {
+  .inode_read   = procfs_inode_read,
+  .inode_write  = procfs_inode_write,
+  .inode_delete = procfs_inode_delete,
+  .read         = procfs_read,
+  .write        = procfs_write,
+  .trunc        = procfs_trunc,
+  .rmdir        = procfs_rmdir,
+  .readdir      = procfs_readdir,
+  .readlink     = procfs_readlink,
+  .create       = procfs_create,
+  .mkdir        = procfs_mkdir,
+  .mknod        = procfs_mknod,
+  .link         = procfs_link,
+  .unlink       = procfs_unlink,
+  .lookup       = procfs_lookup,
+  .revalidate   = procfs_revalidate,
+};
+
+/**
+ * Create the process filesystem.
+ *
+ * @param dev The device ID identifying the filesystem in the inode cache.
+ *
+ * @return The root directory inode.
+ */
+struct Inode *
+procfs_mount(dev_t dev)
+{
+  struct FS *fs;
+
+  if ((fs = (struct FS *) k_malloc(sizeof(struct FS))) == NULL)
+    panic("cannot allocate FS");
+
+  fs->name  = "procfs";
+  fs->dev   = dev;
+  fs->flags = 0;
+  fs->extra = NULL;
+  fs->ops   = &procfs_ops;
+
+  return procfs_inode_get(fs, PROCFS_ROOT_INO);
+}
@@ -0,0 +1,709 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <kernel/fs/fs.h>
+#include <kernel/hash.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/time.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
+
+#include "tmpfs.h"
+
+/*
+ * ----------------------------------------------------------------------------
+ * Memory-backed filesystem
+ * ----------------------------------------------------------------------------
+ *
+ * Every file lives in a node that holds its attributes, the directory entries
+ * or the data pages. The inode cache may recycle an unreferenced inode at any
+ * time, so the nodes are kept in a hash table of their own and the inodes are
+ * filled from them by tmpfs_inode_read(). While an inode is cached, its fields
+ * are the current attributes, and tmpfs_inode_write() copies them back.
+ *
+ * The data pages are private to the filesystem and are never reclaimed. Reads
+ * of regular files still go through the page cache like for any other
+ * filesystem, but those copies can be dropped by the shrinker at any time.
+ */
+
+#define TMPFS_ROOT_INO      2
+#define TMPFS_HASH_SIZE     64
+
+// A filesystem may take up to this fraction of physical memory
+#define TMPFS_MEM_FRACTION  4
+
+// The page table of a file is a single k_malloc() block (at most 16K)
+#define TMPFS_FILE_PAGES_MAX  (16384 / sizeof(struct Page *))
+
+struct TmpfsDirent {
+  struct KListLink link;
+  ino_t            ino;
+  size_t           name_len;
+  char             name[];
+};
+
+struct TmpfsNode {
+  struct KListLink hash_link;   ///< Link into the node hash table
+  ino_t            ino;
+
+  // Attributes, valid while the node has no cached inode
+  mode_t           mode;
+  nlink_t          nlink;
+  uid_t            uid;
+  gid_t            gid;
+  off_t            size;
+  time_t           atime;
+  time_t           mtime;
+  time_t           ctime;
+  dev_t            rdev;
+
+  // Directory contents, protected by the inode lock
+  ino_t            parent;      ///< The ".." entry
+  struct KListLink entries;     ///< Entries other than "." and ".."
+
+  // File data, protected by the inode lock
+  struct Page    **pages;       ///< NULL entries are holes
+  size_t           npages;      ///< The number of entries in the page table
+};
+
+struct Tmpfs {
+  struct KSpinLock lock;        ///< Protects the hash table and the counters
+  HASH_DECLARE(nodes, TMPFS_HASH_SIZE);
+  ino_t            next_ino;
+  unsigned long    pages_used;
+  unsigned long    pages_max;
+};
+
+static struct TmpfsNode *
+tmpfs_node_lookup(struct FS *fs, ino_t ino)
+{
+  struct Tmpfs *tmpfs = (struct Tmpfs *) fs->extra;
+  struct TmpfsNode *node = NULL;
+  struct KListLink *l;
+
+  k_spinlock_acquire(&tmpfs->lock);
+
+  HASH_FOREACH_ENTRY(tmpfs->nodes, l, ino) {
+    struct TmpfsNode *n = KLIST_CONTAINER(l, struct TmpfsNode, hash_link);
+
+    if (n->ino == ino) {
+      node = n;
+      break;
+    }
+  }
+
+  k_spinlock_release(&tmpfs->lock);
+
+  return node;
+}
+
+static struct Inode *
+tmpfs_inode_get(struct FS *fs, ino_t ino)
+{
+  struct Inode *inode = fs_inode_get(ino, fs->dev);
+
+  // The nodes outlive the inodes, so there is nothing to attach
+  if (inode != NULL && inode->fs == NULL) {
+    inode->fs = fs;
+    inode->extra = NULL;
+  }
+
+  return inode;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Data pages
+ * ----------------------------------------------------------------------------
+ */
+
+static void
+tmpfs_page_free(struct Tmpfs *tmpfs, struct Page *page)
+{
+  page_free_one(page);
+
+  k_spinlock_acquire(&tmpfs->lock);
+  tmpfs->pages_used--;
+  k_spinlock_release(&tmpfs->lock);
+}
+
+// Get the data page with the given index, allocating it if necessary
+static int
+tmpfs_page_get(struct Tmpfs *tmpfs, struct TmpfsNode *node,
+               unsigned long index, struct Page **page_store)
+{
+  struct Page *page;
+
+  if (index >= node->npages) {
+    struct Page **pages;
+    size_t n;
+
+    if (index >= TMPFS_FILE_PAGES_MAX)
+      return -EFBIG;
+
+    n = MIN(MAX(index + 1, MAX(node->npages * 2, 8U)), TMPFS_FILE_PAGES_MAX);
+
+    if ((pages = (struct Page **) k_malloc(n * sizeof(*pages))) == NULL)
+      return -ENOMEM;
+
+    memset(pages, 0, n * sizeof(*pages));
+    if (node->pages != NULL) {
+      memmove(pages, node->pages, node->npages * sizeof(*pages));
+      k_free(node->pages);
+    }
+
+    node->pages  = pages;
+    node->npages = n;
+  }
+
+  if ((page = node->pages[index]) == NULL) {
+    k_spinlock_acquire(&tmpfs->lock);
+
+    if (tmpfs->pages_used >= tmpfs->pages_max) {
+      k_spinlock_release(&tmpfs->lock);
+      return -ENOSPC;
+    }
+    tmpfs->pages_used++;
+
+    k_spinlock_release(&tmpfs->lock);
+
+    if ((page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_TMPFS)) == NULL) {
+      k_spinlock_acquire(&tmpfs->lock);
+      tmpfs->pages_used--;
+      k_spinlock_release(&tmpfs->lock);
+
+      return -ENOMEM;
+    }
+
+    node->pages[index] = page;
+  }
+
+  *page_store = page;
+
+  return 0;
+}
+
+// Copy zeros to the given address (user or kernel)
+static int
+tmpfs_copy_zeros(uintptr_t va, size_t n)
+{
+  static const uint8_t zeros[64];
+  int r;
+
+  for ( ; n > 0; n -= MIN(n, sizeof zeros), va += sizeof zeros)
+    if ((r = vm_space_copy_out(zeros, va, MIN(n, sizeof zeros))) < 0)
+      return r;
+
+  return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Inode operations
+ * ----------------------------------------------------------------------------
+ */
+
+static int
+tmpfs_inode_read(struct Inode *inode)
+{
+  struct TmpfsNode *node;
+
+  if ((node = tmpfs_node_lookup(inode->fs, inode->ino)) == NULL)
+    return -ENOENT;
+
+  inode->mode  = node->mode;
+  inode->nlink = node->nlink;
+  inode->uid   = node->uid;
+  inode->gid   = node->gid;
+  inode->size  = node->size;
+  inode->atime = node->atime;
+  inode->mtime = node->mtime;
+  inode->ctime = node->ctime;
+  inode->rdev  = node->rdev;
+
+  return 0;
+}
+
+static int
+tmpfs_inode_write(struct Inode *inode)
+{
+  struct TmpfsNode *node;
+
+  if ((node = tmpfs_node_lookup(inode->fs, inode->ino)) == NULL)
+    return -ENOENT;
+
+  node->mode  = inode->mode;
+  node->nlink = inode->nlink;
+  node->uid   = inode->uid;
+  node->gid   = inode->gid;
+  node->size  = inode->size;
+  node->atime = inode->atime;
+  node->mtime = inode->mtime;
+  node->ctime = inode->ctime;
+  node->rdev  = inode->rdev;
+
+  return 0;
+}
+
+static void
+tmpfs_trunc(struct Inode *inode, off_t length)
+{
+  struct Tmpfs *tmpfs = (struct Tmpfs *) inode->fs->extra;
+  struct TmpfsNode *node;
+  size_t i;
+
+  if ((node = tmpfs_node_lookup(inode->fs, inode->ino)) == NULL)
+    return;
+
+  for (i = ROUND_UP((size_t) length, PAGE_SIZE) / PAGE_SIZE;
+       i < node->npages;
+       i++) {
+    if (node->pages[i] != NULL) {
+      tmpfs_page_free(tmpfs, node->pages[i]);
+      node->pages[i] = NULL;
+    }
+  }
+
+  // The file may grow again, so the rest of the last page must read as zeros
+  if ((length % PAGE_SIZE) != 0) {
+    i = length / PAGE_SIZE;
+
+    if ((i < node->npages) && (node->pages[i] != NULL))
+      memset((uint8_t *) page2kva(node->pages[i]) + length % PAGE_SIZE, 0,
+             PAGE_SIZE - length % PAGE_SIZE);
+  }
+}
+
+static void
+tmpfs_inode_delete(struct Inode *inode)
+{
+  struct Tmpfs *tmpfs = (struct Tmpfs *) inode->fs->extra;
+  struct TmpfsNode *node;
+
+  if ((node = tmpfs_node_lookup(inode->fs, inode->ino)) == NULL)
+    return;
+
+  tmpfs_trunc(inode, 0);
+
+  // Only empty directories can be removed
+  assert(k_list_is_empty(&node->entries));
+
+  k_spinlock_acquire(&tmpfs->lock);
+  HASH_REMOVE(&node->hash_link);
+  k_spinlock_release(&tmpfs->lock);
+
+  if (node->pages != NULL)
+    k_free(node->pages);
+  k_free(node);
+
+  inode->mode = 0;
+  inode->size = 0;
+}
+
+static ssize_t
+tmpfs_read(struct Inode *inode, uintptr_t va, size_t n, off_t off)
+{
+  struct TmpfsNode *node;
+  size_t total, chunk;
+  int r;
+
+  if ((node = tmpfs_node_lookup(inode->fs, inode->ino)) == NULL)
+    return -ENOENT;
+
+  for (total = 0; total < n; total += chunk, off += chunk, va += chunk) {
+    unsigned long index = off / PAGE_SIZE;
+
+    chunk = MIN(n - total, PAGE_SIZE - (size_t) (off % PAGE_SIZE));
+
+    if ((index < node->npages) && (node->pages[index] != NULL))
+      r = vm_space_copy_out((uint8_t *) page2kva(node->pages[index]) +
+                            off % PAGE_SIZE, va, chunk);
+    else
+      r = tmpfs_copy_zeros(va, chunk);
+
+    if (r < 0)
+      return r;
+  }
+
+  return total;
+}
+
+static ssize_t
+tmpfs_write(struct Inode *inode, uintptr_t va, size_t n, off_t off)
+{
+  struct Tmpfs *tmpfs = (struct Tmpfs *) inode->fs->extra;
+  struct TmpfsNode *node;
+  size_t total, chunk;
+  int r = 0;
+
+  if ((node = tmpfs_node_lookup(inode->fs, inode->ino)) == NULL)
+    return -ENOENT;
+
+  for (total = 0; total < n; total += chunk, off += chunk, va += chunk) {
+    struct Page *page;
+
+    chunk = MIN(n - total, PAGE_SIZE - (size_t) (off % PAGE_SIZE));
+
+    if ((r = tmpfs_page_get(tmpfs, node, off / PAGE_SIZE, &page)) < 0)
+      break;
+
+    if ((r = vm_space_copy_in((uint8_t *) page2kva(page) + off % PAGE_SIZE,
+                              va, chunk)) < 0)
+      break;
+  }
+
+  // Report a partial write, the error is returned by the next attempt
+  return (total > 0) ? (ssize_t) total : r;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Directory operations
+ * ----------------------------------------------------------------------------
+ */
+
+static struct TmpfsDirent *
+tmpfs_dirent_find(struct TmpfsNode *dir, const char *name)
+{
+  size_t name_len = strlen(name);
+  struct KListLink *l;
+
+  KLIST_FOREACH(&dir->entries, l) {
+    struct TmpfsDirent *de = KLIST_CONTAINER(l, struct TmpfsDirent, link);
+
+    if ((de->name_len == name_len) && (memcmp(de->name, name, name_len) == 0))
+      return de;
+  }
+
+  return NULL;
+}
+
+static struct Inode *
+tmpfs_lookup(struct Inode *dir, const char *name)
+{
+  struct TmpfsNode *node;
+  struct TmpfsDirent *de;
+
+  if (!S_ISDIR(dir->mode))
+    panic("not a directory");
+
+  if ((node = tmpfs_node_lookup(dir->fs, dir->ino)) == NULL)
+    return NULL;
+
+  if (strcmp(name, ".") == 0)
+    return tmpfs_inode_get(dir->fs, dir->ino);
+  if (strcmp(name, "..") == 0)
+    return tmpfs_inode_get(dir->fs, node->parent);
+
+  if ((de = tmpfs_dirent_find(node, name)) == NULL)
+    return NULL;
+
+  return tmpfs_inode_get(dir->fs, de->ino);
+}
+
+static ssize_t
+tmpfs_readdir(struct Inode *dir, void *buf, FillDirFunc filldir, off_t off)
+{
+  struct TmpfsNode *node;
+  struct KListLink *l;
+  off_t i;
+
+  if (!S_ISDIR(dir->mode))
+    return -ENOTDIR;
+
+  if ((node = tmpfs_node_lookup(dir->fs, dir->ino)) == NULL)
+    return -ENOENT;
+
+  // The offset is the index of the entry, after "." and ".."
+  if (off == 0) {
+    filldir(buf, dir->ino, ".", 1);
+    return 1;
+  }
+  if (off == 1) {
+    filldir(buf, node->parent, "..", 2);
+    return 1;
+  }
+
+  i = 2;
+  KLIST_FOREACH(&node->entries, l) {
+    if (i++ == off) {
+      struct TmpfsDirent *de = KLIST_CONTAINER(l, struct TmpfsDirent, link);
+
+      filldir(buf, de->ino, de->name, de->name_len);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static ssize_t
+tmpfs_readlink(struct Inode *inode, char *buf, size_t n)
+{
+  if (!S_ISLNK(inode->mode))
+    return -EINVAL;
+
+  return tmpfs_read(inode, (uintptr_t) buf, MIN(n, (size_t) inode->size), 0);
+}
+
+static int
+tmpfs_link(struct Inode *dir, char *name, struct Inode *inode)
+{
+  struct TmpfsDirent *de;
+  struct TmpfsNode *node;
+  size_t name_len;
+
+  if ((node = tmpfs_node_lookup(dir->fs, dir->ino)) == NULL)
+    return -ENOENT;
+
+  name_len = strlen(name);
+  if (name_len > NAME_MAX)
+    return -ENAMETOOLONG;
+
+  if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0) ||
+      (tmpfs_dirent_find(node, name) != NULL))
+    return -EEXIST;
+
+  de = (struct TmpfsDirent *) k_malloc(offsetof(struct TmpfsDirent, name) +
+                                       name_len + 1);
+  if (de == NULL)
+    return -ENOMEM;
+
+  de->ino      = inode->ino;
+  de->name_len = name_len;
+  memmove(de->name, name, name_len + 1);
+
+  k_list_add_back(&node->entries, &de->link);
+
+  // The directory size is the number of entries, as seen by readdir
+  dir->size++;
+  dir->ctime = dir->mtime = time_get_seconds();
+  dir->flags |= FS_INODE_DIRTY;
+
+  inode->ctime = time_get_seconds();
+  inode->nlink++;
+  inode->flags |= FS_INODE_DIRTY;
+
+  return 0;
+}
+
+static int
+tmpfs_unlink(struct Inode *dir, struct Inode *inode)
+{
+  struct TmpfsNode *node;
+  struct KListLink *l;
+
+  if (dir->ino == inode->ino)
+    return -EBUSY;
+
+  if ((node = tmpfs_node_lookup(dir->fs, dir->ino)) == NULL)
+    return -ENOENT;
+
+  KLIST_FOREACH(&node->entries, l) {
+    struct TmpfsDirent *de = KLIST_CONTAINER(l, struct TmpfsDirent, link);
+
+    if (de->ino != inode->ino)
+      continue;
+
+    k_list_remove(&de->link);
+    k_free(de);
+
+    dir->size--;
+    dir->ctime = dir->mtime = time_get_seconds();
+    dir->flags |= FS_INODE_DIRTY;
+
+    if (--inode->nlink > 0)
+      inode->ctime = time_get_seconds();
+    inode->flags |= FS_INODE_DIRTY;
+
+    return 0;
+  }
+
+  return -ENOENT;
+}
+
+static int
+tmpfs_rmdir(struct Inode *dir, struct Inode *inode)
+{
+  struct TmpfsNode *node;
+  int r;
+
+  if ((node = tmpfs_node_lookup(inode->fs, inode->ino)) == NULL)
+    return -ENOENT;
+
+  if (!k_list_is_empty(&node->entries))
+    return -ENOTEMPTY;
+
+  if ((r = tmpfs_unlink(dir, inode)) < 0)
+    return r;
+
+  dir->nlink--;
+  dir->flags |= FS_INODE_DIRTY;
+
+  return 0;
+}
+
+// Create a node and link it into the directory. The new inode is returned
+// locked.
+static int
+tmpfs_inode_create(struct Inode *dir, char *name, mode_t mode, dev_t rdev,
+                   struct Inode **istore)
+{
+  struct Tmpfs *tmpfs = (struct Tmpfs *) dir->fs->extra;
+  struct TmpfsNode *node;
+  struct Inode *ip;
+  int r;
+
+  if (strlen(name) > NAME_MAX)
+    return -ENAMETOOLONG;
+
+  if ((node = (struct TmpfsNode *) k_malloc(sizeof(*node))) == NULL)
+    return -ENOMEM;
+
+  memset(node, 0, sizeof(*node));
+  node->mode   = mode;
+  node->rdev   = rdev;
+  node->parent = dir->ino;
+  node->atime  = node->mtime = node->ctime = time_get_seconds();
+  k_list_init(&node->entries);
+
+  k_spinlock_acquire(&tmpfs->lock);
+  node->ino = tmpfs->next_ino++;
+  HASH_PUT(tmpfs->nodes, &node->hash_link, node->ino);
+  k_spinlock_release(&tmpfs->lock);
+
+  if ((ip = tmpfs_inode_get(dir->fs, node->ino)) == NULL) {
+    k_spinlock_acquire(&tmpfs->lock);
+    HASH_REMOVE(&node->hash_link);
+    k_spinlock_release(&tmpfs->lock);
+
+    k_free(node);
+    return -ENOMEM;
+  }
+
+  fs_inode_lock(ip);
+
+  ip->uid = process_current()->euid;
+  ip->gid = dir->gid;
+  ip->flags |= FS_INODE_DIRTY;
+
+  if ((r = tmpfs_link(dir, name, ip)) < 0) {
+    // Drop the unreachable node together with the inode
+    fs_inode_unlock(ip);
+    fs_inode_put(ip);
+    return r;
+  }
+
+  *istore = ip;
+
+  return 0;
+}
+
+static int
+tmpfs_create(struct Inode *dir, char *name, mode_t mode, struct Inode **istore)
+{
+  assert(istore != NULL);
+  return tmpfs_inode_create(dir, name, mode, 0, istore);
+}
+
+static int
+tmpfs_mkdir(struct Inode *dir, char *name, mode_t mode, struct Inode **istore)
+{
+  int r;
+
+  if (dir->nlink >= LINK_MAX)
+    return -EMLINK;
+
+  assert(istore != NULL);
+
+  if ((r = tmpfs_inode_create(dir, name, mode, 0, istore)) < 0)
+    return r;
+
+  // The ".." entry of the new directory
+  dir->nlink++;
+  dir->flags |= FS_INODE_DIRTY;
+
+  (*istore)->size = 2;
+
+  return 0;
+}
+
+static int
+tmpfs_mknod(struct Inode *dir, char *name, mode_t mode, dev_t dev,
+            struct Inode **istore)
+{
+  assert(istore != NULL);
+  return tmpfs_inode_create(dir, name, mode, dev, istore);
+}
+
+struct FSOps tmpfs_ops = {
+  .inode_read   = tmpfs_inode_read,
+  .inode_write  = tmpfs_inode_write,
+  .inode_delete = tmpfs_inode_delete,
+  .read         = tmpfs_read,
+  .write        = tmpfs_write,
+  .trunc        = tmpfs_trunc,
+  .rmdir        = tmpfs_rmdir,
+  .readdir      = tmpfs_readdir,
+  .readlink     = tmpfs_readlink,
+  .create       = tmpfs_create,
+  .mkdir        = tmpfs_mkdir,
+  .mknod        = tmpfs_mknod,
+  .link         = tmpfs_link,
+  .unlink       = tmpfs_unlink,
+  .lookup       = tmpfs_lookup,
+};
+
+/**
+ * Create an empty memory-backed filesystem. Its data may take up to a quarter
+ * of physical memory; writes beyond that fail with -ENOSPC.
+ *
+ * @param dev The device ID identifying the filesystem in the inode cache.
+ *
+ * @return The root directory inode.
+ */
+struct Inode *
+tmpfs_mount(dev_t dev)
+{
+  struct TmpfsNode *root;
+  struct Tmpfs *tmpfs;
+  struct FS *fs;
+
+  if ((fs = (struct FS *) k_malloc(sizeof(struct FS))) == NULL)
+    panic("cannot allocate FS");
+  if ((tmpfs = (struct Tmpfs *) k_malloc(sizeof(struct Tmpfs))) == NULL)
+    panic("cannot allocate tmpfs");
+  if ((root = (struct TmpfsNode *) k_malloc(sizeof(struct TmpfsNode))) == NULL)
+    panic("cannot allocate tmpfs root");
+
+  k_spinlock_init(&tmpfs->lock, "tmpfs");
+  HASH_INIT(tmpfs->nodes);
+  tmpfs->next_ino   = TMPFS_ROOT_INO + 1;
+  tmpfs->pages_used = 0;
+  tmpfs->pages_max  = page_count / TMPFS_MEM_FRACTION;
+
+  memset(root, 0, sizeof(*root));
+  root->ino    = TMPFS_ROOT_INO;
+  root->mode   = S_IFDIR | S_ISVTX | 0777;
+  root->nlink  = 1;
+  root->size   = 2;
+  root->parent = TMPFS_ROOT_INO;
+  root->atime  = root->mtime = root->ctime = time_get_seconds();
+  k_list_init(&root->entries);
+
+  HASH_PUT(tmpfs->nodes, &root->hash_link, root->ino);
+
+  fs->name  = "tmpfs";
+  fs->dev   = dev;
+  fs->flags = 0;
+  fs->extra = tmpfs;
+  fs->ops   = &tmpfs_ops;
+
+  return tmpfs_inode_get(fs, TMPFS_ROOT_INO);
+}
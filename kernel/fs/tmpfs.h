@@ -0,0 +1,11 @@
+#ifndef __KERNEL_FS_TMPFS_H__
+#define __KERNEL_FS_TMPFS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <kernel/fs/fs.h>
+
+struct Inode *tmpfs_mount(dev_t);
+
+#endif  // !__KERNEL_FS_TMPFS_H__
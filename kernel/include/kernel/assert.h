@@ -24,6 +24,37 @@ void __warn(const char *, int, const char *, ...);
  */
 #define warn(...)  __warn(__FILE__, __LINE__, __VA_ARGS__)
 
+/**
+ * Debug levels, selected at build time with K_DEBUG_LEVEL:
+ *
+ * - K_DEBUG_RELEASE: only the cheap assertions made with assert()
+ * - K_DEBUG_ASSERT:  also the invariant checks made with debug_assert() and
+ *                    the redundant checks on hot paths (lock ownership, page
+ *                    bounds)
+ * - K_DEBUG_FULL:    also record the full call stack on every spinlock
+ *                    acquisition
+ */
+#define K_DEBUG_RELEASE   0
+#define K_DEBUG_ASSERT    1
+#define K_DEBUG_FULL      2
+
+#ifndef K_DEBUG_LEVEL
+#define K_DEBUG_LEVEL     K_DEBUG_FULL
+#endif
+
+#if K_DEBUG_LEVEL >= K_DEBUG_ASSERT
+  /**
+   * Evaluate an invariant that is too expensive or too redundant to check in
+   * release builds.
+   * 
+   * @param expr The expression to be evaluated.
+   */
+  #define debug_assert(expr) \
+    do { if (!(expr)) panic("Assertion failed: %s", #expr); } while(0)
+#else
+  #define debug_assert(ignore)  ((void) 0)
+#endif
+
 #ifdef NDEBUG
   #define assert(ignore)  ((void) 0)
 #else
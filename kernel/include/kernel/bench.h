@@ -0,0 +1,19 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_BENCH_H__
+#define __KERNEL_INCLUDE_KERNEL_BENCH_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/bench.h
+ *
+ * Microbenchmarks of the core kernel primitives.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+int bench_run(dev_t, size_t, unsigned long);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_BENCH_H__
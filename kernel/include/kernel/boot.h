@@ -0,0 +1,20 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_BOOT_H__
+#define __KERNEL_INCLUDE_KERNEL_BOOT_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/boot.h
+ *
+ * Boot time profiling and asynchronous initialization.
+ */
+
+void boot_init(void);
+void boot_stage(const char *);
+int  boot_async(const char *, void (*)(void));
+void boot_wait(void);
+void boot_print_stats(void);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_BOOT_H__
@@ -13,8 +13,14 @@
 
 #include <stdarg.h>
 
-int  arch_console_getc(void);
-void arch_console_putc(char);
+struct Page;
+
+int          arch_console_getc(void);
+void         arch_console_putc(char);
+struct Page *arch_console_fb(unsigned *);
+
+/** The format of the first panic message, NULL until the kernel panics */
+extern const char *panicstr;
 
 void console_putc(char);
 int  console_getc(void);
@@ -1,7 +1,34 @@
 #ifndef __KERNEL_INCLUDE_KERNEL_CORE_CPU_H__
 #define __KERNEL_INCLUDE_KERNEL_CORE_CPU_H__
 
+#include <stdint.h>
+
+/** The maximum number of CPUs supported by the kernel */
+// TODO: should be architecture-specific
+#define K_CPU_MAX   4
+
+/** The CPU mask that includes every supported CPU */
+#define K_CPU_MASK_ALL  ((1U << K_CPU_MAX) - 1)
+
+/** The size of the largest cache line in the system, in bytes */
+// TODO: should be architecture-specific
+#define K_CACHE_LINE_SIZE   32
+
+/** Align a type or a structure member on a cache line boundary */
+#define __cacheline_aligned \
+  __attribute__((aligned(K_CACHE_LINE_SIZE)))
+
+/**
+ * Give a global variable cache lines of its own. Use for the hot locks and
+ * the data written by several CPUs, so that the traffic they cause does not
+ * invalidate unrelated data sitting next to them.
+ */
+#define __cacheline_exclusive \
+  __attribute__((aligned(K_CACHE_LINE_SIZE), section(".data.cacheline")))
+
 unsigned k_arch_cpu_id(void);
+void     k_arch_cpu_init_percpu(void);
+uint32_t k_arch_cpu_cycles(void);
 
 static inline unsigned
 k_cpu_id(void)
@@ -9,4 +36,18 @@ k_cpu_id(void)
   return k_arch_cpu_id();
 }
 
+/**
+ * Read the free-running cycle counter of the current CPU.
+ *
+ * The counter wraps around, so only differences between two readings taken on
+ * the same CPU are meaningful.
+ *
+ * @return The current value of the counter.
+ */
+static inline uint32_t
+k_cpu_cycles(void)
+{
+  return k_arch_cpu_cycles();
+}
+
 #endif  // !__KERNEL_INCLUDE_KERNEL_CORE_CPU_H__
@@ -0,0 +1,43 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_CORE_HRTIMER_H__
+#define __KERNEL_INCLUDE_KERNEL_CORE_HRTIMER_H__
+
+#include <stdint.h>
+
+#include <kernel/core/list.h>
+
+struct KHrTimerQueue;
+
+/**
+ * High-resolution one-shot timer.
+ *
+ * Unlike KTimer, which counts whole ticks, the expiration time is kept in
+ * nanoseconds and the hardware is programmed for the nearest deadline, so the
+ * callback runs as soon as it is due. The callback is called from the timer
+ * interrupt and must not sleep.
+ */
+struct KHrTimer {
+  /** Link into the queue, sorted by the expiration time */
+  struct KListLink       link;
+  /** The queue the timer is on, or NULL if not active */
+  struct KHrTimerQueue  *queue;
+  /** Expiration time, in nanoseconds (see k_hrtimer_now) */
+  uint64_t               expires;
+  void                 (*callback)(void *);
+  void                  *callback_arg;
+};
+
+void     k_hrtimer_system_init(void);
+int      k_hrtimer_supported(void);
+uint64_t k_hrtimer_now(void);
+void     k_hrtimer_init(struct KHrTimer *, void (*)(void *), void *);
+int      k_hrtimer_start(struct KHrTimer *, uint64_t);
+int      k_hrtimer_stop(struct KHrTimer *);
+void     k_hrtimer_fini(struct KHrTimer *);
+int      k_hrtimer_active(struct KHrTimer *);
+void     k_hrtimer_irq(void);
+
+int      k_arch_hrtimer_supported(void);
+uint64_t k_arch_hrtimer_now(void);
+void     k_arch_hrtimer_set(uint64_t);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_CORE_HRTIMER_H__
@@ -0,0 +1,20 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_CORE_IPI_H__
+#define __KERNEL_INCLUDE_KERNEL_CORE_IPI_H__
+
+/**
+ * @file include/kernel/core/ipi.h
+ *
+ * Inter-processor interrupts.
+ */
+
+/** Wake up the processor and let it reschedule on return from the interrupt */
+#define K_IPI_RESCHEDULE  0
+/** Run the functions queued by k_ipi_call() */
+#define K_IPI_CALL        1
+
+void k_ipi_init(void);
+void k_ipi_init_percpu(void);
+void k_ipi_reschedule(unsigned);
+int  k_ipi_call(unsigned, void (*)(void *), void *);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_CORE_IPI_H__
@@ -11,6 +11,8 @@ void k_irq_state_save(void);
 void k_irq_state_restore(void);
 void k_irq_handler_begin(void);
 void k_irq_handler_end(void);
+void k_preempt_disable(void);
+void k_preempt_enable(void);
 
 static inline void
 k_irq_disable(void)
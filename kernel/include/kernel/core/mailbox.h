@@ -19,13 +19,23 @@ struct KMailBox {
   size_t            msg_size;
   struct KListLink  receivers;
   struct KListLink  senders;
+
+  // K_MAILBOX_SPSC only: the number of messages ever received and sent, each
+  // updated by one side and read by the other without taking the lock, and
+  // the flags set by a side that is about to block
+  unsigned long     head;
+  unsigned long     tail;
+  int               receiver_waiting;
+  int               sender_waiting;
 };
 
 #define K_MAILBOX_TYPE    0x4D424F58  // {'M','B','O','X'}
 #define K_MAILBOX_STATIC  (1 << 0)
+#define K_MAILBOX_SPSC    (1 << 1)  // Single producer, single consumer
 
 void             k_mailbox_system_init(void);
 struct KMailBox *k_mailbox_create(size_t, size_t);
+struct KMailBox *k_mailbox_create_spsc(size_t, size_t);
 void             k_mailbox_destroy(struct KMailBox *);
 int              k_mailbox_init(struct KMailBox *, size_t, void *, size_t);
 int              k_mailbox_fini(struct KMailBox *);
@@ -33,6 +43,8 @@ int              k_mailbox_try_receive(struct KMailBox *, void *);
 int              k_mailbox_timed_receive(struct KMailBox *, void *, unsigned long);
 int              k_mailbox_try_send(struct KMailBox *, const void *);
 int              k_mailbox_timed_send(struct KMailBox *, const void *, unsigned long);
+size_t           k_mailbox_try_receive_batch(struct KMailBox *, void *, size_t);
+size_t           k_mailbox_try_send_batch(struct KMailBox *, const void *, size_t);
 
 static inline int
 k_mailbox_receive(struct KMailBox *mailbox, void *message)
@@ -0,0 +1,49 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_CORE_PERCPU_H__
+#define __KERNEL_INCLUDE_KERNEL_CORE_PERCPU_H__
+
+/**
+ * @file include/kernel/core/percpu.h
+ *
+ * Per-CPU variables.
+ *
+ * Variables marked with __percpu are placed into a separate section, which the
+ * linker script replicates K_CPU_MAX times. The first copy belongs to CPU 0
+ * and holds the initial values, the others follow it at a fixed stride and
+ * are filled in by k_percpu_init(). Each copy starts on a new cache line, so
+ * the CPUs never write to the same lines when updating their own variables,
+ * unlike with arrays indexed by the CPU number.
+ */
+
+#include <stdint.h>
+
+#include <kernel/core/cpu.h>
+
+#define __percpu  __attribute__((section(".percpu")))
+
+// These symbols are defined by the linker script kernel.ld
+extern uint8_t __percpu_begin__[], __percpu_end__[], __percpu_limit__[];
+
+/** The distance between two copies of a per-CPU variable, in bytes */
+#define K_PERCPU_SIZE   ((uintptr_t) (__percpu_end__ - __percpu_begin__))
+
+/**
+ * Get a pointer to the copy of a per-CPU variable belonging to the given CPU.
+ *
+ * @param var The per-CPU variable (the copy of CPU 0).
+ * @param cpu The CPU ID.
+ */
+#define K_PERCPU_PTR(var, cpu) \
+  ((__typeof__(&(var))) ((uintptr_t) &(var) + (cpu) * K_PERCPU_SIZE))
+
+/**
+ * Get a pointer to the copy of a per-CPU variable belonging to the current
+ * CPU. The caller must not migrate to another CPU while using the pointer
+ * (e.g. by disabling interrupts).
+ *
+ * @param var The per-CPU variable (the copy of CPU 0).
+ */
+#define K_PERCPU_THIS(var)  K_PERCPU_PTR(var, k_cpu_id())
+
+void k_percpu_init(void);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_CORE_PERCPU_H__
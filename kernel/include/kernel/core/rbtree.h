@@ -0,0 +1,66 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_CORE_RBTREE_H__
+#define __KERNEL_INCLUDE_KERNEL_CORE_RBTREE_H__
+
+/**
+ * @file
+ *
+ * Intrusive red-black tree implementation.
+ *
+ * The tree does not know how to compare the nodes. To insert a node, the
+ * caller descends the tree to find the leaf position, links the node with
+ * k_rbtree_link() and then calls k_rbtree_insert_fixup() to rebalance the
+ * tree.
+ */
+
+#include <stddef.h>
+
+struct KRBNode {
+  struct KRBNode *parent;
+  struct KRBNode *left;
+  struct KRBNode *right;
+  int             color;
+};
+
+struct KRBTree {
+  struct KRBNode *root;
+};
+
+#define KRBTREE_INITIALIZER   { NULL }
+
+#define KRBTREE_CONTAINER(node, type, member) \
+  ((type *) ((size_t) (node) - offsetof(type, member)))
+
+static inline void
+k_rbtree_init(struct KRBTree *tree)
+{
+  tree->root = NULL;
+}
+
+/**
+ * Attach a new node as a leaf of the tree.
+ *
+ * @param node   The node to be inserted.
+ * @param parent The parent node (or NULL if the tree is empty).
+ * @param link   The child pointer of the parent (or the tree root pointer)
+ *               that must point to the new node.
+ */
+static inline void
+k_rbtree_link(struct KRBNode *node, struct KRBNode *parent,
+              struct KRBNode **link)
+{
+  node->parent = parent;
+  node->left   = NULL;
+  node->right  = NULL;
+  node->color  = 0; // New nodes are red
+
+  *link = node;
+}
+
+void            k_rbtree_insert_fixup(struct KRBTree *, struct KRBNode *);
+void            k_rbtree_remove(struct KRBTree *, struct KRBNode *);
+struct KRBNode *k_rbtree_first(struct KRBTree *);
+struct KRBNode *k_rbtree_last(struct KRBTree *);
+struct KRBNode *k_rbtree_next(struct KRBNode *);
+struct KRBNode *k_rbtree_prev(struct KRBNode *);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_CORE_RBTREE_H__
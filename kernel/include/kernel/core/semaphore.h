@@ -4,10 +4,18 @@
 #include <kernel/core/list.h>
 #include <kernel/spinlock.h>
 
+/**
+ * Counting semaphore.
+ *
+ * While nobody waits, the count is adjusted with atomic operations alone. The
+ * lock and the scheduler are only involved when the count drops to zero.
+ */
 struct KSemaphore {
   int              type;
   int              flags;
+  /** Protects the queue */
   struct KSpinLock lock;
+  /** The count, or K_SEMAPHORE_WAITERS if the queue may be non-empty */
   unsigned long    count;
   struct KListLink queue;
 };
@@ -15,6 +23,8 @@ struct KSemaphore {
 #define K_SEMAPHORE_TYPE    0x53454D41  // {'S','E','M','A'}
 #define K_SEMAPHORE_STATIC  (1 << 0)
 
+#define K_SEMAPHORE_WAITERS (1UL << (sizeof(unsigned long) * 8 - 1))
+
 void               k_semaphore_system_init(void);
 void               k_semaphore_init(struct KSemaphore *, int);
 void               k_semaphore_fini(struct KSemaphore *);
@@ -0,0 +1,76 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_CORE_SEQCOUNT_H__
+#define __KERNEL_INCLUDE_KERNEL_CORE_SEQCOUNT_H__
+
+/**
+ * @file
+ * 
+ * Sequence counters.
+ * 
+ * A sequence counter allows readers to access data without taking any locks
+ * or disabling interrupts. The writer increments the counter before and after
+ * each update, so the counter is odd while an update is in progress. A reader
+ * samples the counter before and after reading the data and retries if an
+ * update has been started or completed in between.
+ * 
+ * Writers must be serialized by some other means (e.g. by a spinlock).
+ */
+
+struct KSeqCount {
+  volatile unsigned sequence;
+};
+
+#define K_SEQCOUNT_INITIALIZER  { .sequence = 0 }
+
+static inline void
+k_seqcount_init(struct KSeqCount *seq)
+{
+  seq->sequence = 0;
+}
+
+/**
+ * Begin a read section.
+ * 
+ * @return The counter value to be passed to k_seqcount_read_retry().
+ */
+static inline unsigned
+k_seqcount_read_begin(const struct KSeqCount *seq)
+{
+  unsigned value;
+
+  while ((value = seq->sequence) & 1)
+    ;
+
+  __sync_synchronize();
+
+  return value;
+}
+
+/**
+ * Finish a read section.
+ * 
+ * @return Non-zero if the data was modified during the read section and the
+ *         read must be retried.
+ */
+static inline int
+k_seqcount_read_retry(const struct KSeqCount *seq, unsigned value)
+{
+  __sync_synchronize();
+
+  return seq->sequence != value;
+}
+
+static inline void
+k_seqcount_write_begin(struct KSeqCount *seq)
+{
+  seq->sequence++;
+  __sync_synchronize();
+}
+
+static inline void
+k_seqcount_write_end(struct KSeqCount *seq)
+{
+  __sync_synchronize();
+  seq->sequence++;
+}
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_CORE_SEQCOUNT_H__
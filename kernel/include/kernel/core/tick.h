@@ -5,11 +5,16 @@
 
 struct KTimeout {
   struct KListLink link;
-  unsigned long    remain;
+  /** The tick at which the entry expires (relative to the queue's clock) */
+  unsigned long    expires;
 };
 
 unsigned long long k_tick_get(void);
 void               k_tick_set(unsigned long long);
 void               k_tick(void);
+void               k_tick_account(int);
+
+int                k_arch_tick_stop(unsigned long);
+unsigned long      k_arch_tick_restart(void);
 
 #endif  // !__KERNEL_INCLUDE_TICK_H__
@@ -19,11 +19,13 @@ enum {
   K_TIMER_STATE_RUNNING  = 3,
 };
 
+void k_timer_system_init(void);
 int  k_timer_init(struct KTimer *, void (*)(void *), void *, unsigned long,
                     unsigned long, int);
 int  k_timer_fini(struct KTimer *);
 int  k_timer_start(struct KTimer *);
 int  k_timer_stop(struct KTimer *);
+unsigned long k_timer_remain(struct KTimer *);
 
 void k_tick(void);
 
@@ -0,0 +1,24 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_CORE_WORK_H__
+#define __KERNEL_INCLUDE_KERNEL_CORE_WORK_H__
+
+/**
+ * @file include/kernel/core/work.h
+ *
+ * Deferred work.
+ */
+
+#include <kernel/core/list.h>
+
+struct KWork {
+  struct KListLink   link;
+  void             (*func)(void *);
+  void              *arg;
+  /** Whether the item is queued and has not started running yet */
+  int                pending;
+};
+
+void k_work_system_init(void);
+void k_work_init(struct KWork *, void (*)(void *), void *);
+int  k_work_queue(struct KWork *);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_CORE_WORK_H__
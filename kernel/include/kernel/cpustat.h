@@ -0,0 +1,19 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_CPUSTAT_H__
+#define __KERNEL_INCLUDE_KERNEL_CPUSTAT_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/cpustat.h
+ *
+ * CPU usage report.
+ */
+
+#include <stddef.h>
+
+void   cpustat_init(void);
+size_t cpustat_report(char *, size_t);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_CPUSTAT_H__
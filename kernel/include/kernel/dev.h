@@ -4,17 +4,26 @@
 #include <sys/types.h>
 
 struct Buf;
-struct timeval;
+struct IoQueue;
+struct PollEntry;
 
 struct CharDev {
   ssize_t (*read)(dev_t, uintptr_t, size_t);
   ssize_t (*write)(dev_t, uintptr_t, size_t);
   int     (*ioctl)(dev_t, int, int);
-  int     (*select)(dev_t, struct timeval *);
+  int     (*poll)(dev_t, struct PollEntry *);
+  // Optional, used instead of read() by devices whose contents depend on the
+  // file position (e.g. text snapshots served in several chunks)
+  ssize_t (*read_at)(dev_t, uintptr_t, size_t, off_t);
 };
 
 struct BlockDev {
-  void    (*request)(struct Buf *);
+  // Queue the buffers for processing (read invalid ones, write dirty ones)
+  // without waiting. The driver calls buf_io_done() as each one completes.
+  void    (*request)(struct Buf **, unsigned);
+  // Optional, if set the buffers are passed to the I/O scheduler first, and
+  // the driver only gets them as the queue depth allows
+  struct IoQueue *queue;
 };
 
 struct CharDev  *dev_lookup_char(dev_t);
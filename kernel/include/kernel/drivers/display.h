@@ -9,7 +9,20 @@
 
 #include <stdint.h>
 
-struct Screen;
+#include <kernel/drivers/screen.h>
+
+#define DISPLAY_GLYPH_WIDTH   8     ///< Glyph width in pixels
+#define DISPLAY_GLYPH_HEIGHT  16    ///< Glyph height in pixels
+#define DISPLAY_GLYPH_CACHE   64    ///< Number of pre-rendered glyphs
+
+/**
+ * A glyph pre-rendered in the given colors, ready to be copied to the
+ * framebuffer. Each row holds two pixels per word.
+ */
+struct DisplayGlyph {
+  uint16_t      key;        ///< Character and colors, or 0 if unused
+  uint32_t      rows[DISPLAY_GLYPH_HEIGHT][DISPLAY_GLYPH_WIDTH / 2];
+};
 
 struct Display {
   uint16_t     *fb_base;
@@ -27,6 +40,14 @@ struct Display {
   } font;
 
   struct Screen *screen;
+
+  /** The cells as currently painted on the framebuffer */
+  struct ScreenCell shadow[SCREEN_COLS * SCREEN_ROWS];
+  /** Whether the shadow can be trusted to skip unchanged cells */
+  int               shadow_valid;
+
+  /** Recently drawn glyphs */
+  struct DisplayGlyph glyph_cache[DISPLAY_GLYPH_CACHE];
 };
 
 #define DEFAULT_FB_WIDTH    640
@@ -36,8 +57,10 @@ int  display_init(struct Display *, void *);
 void display_update(struct Display *, struct Screen *);
 void display_erase(struct Display *, unsigned, unsigned);
 void display_draw_char_at(struct Display *, unsigned);
+void display_redraw(struct Display *, unsigned, unsigned);
 void display_scroll_down(struct Display *, unsigned);
 void display_flush(struct Display *);
 void display_update_cursor(struct Display *);
+void display_map_user(struct Display *);
 
 #endif  // !__KERNEL_DRIVERS_CONSOLE_DISPLAY_H__
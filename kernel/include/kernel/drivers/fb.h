@@ -0,0 +1,16 @@
+#ifndef __KERNEL_DRIVERS_FB_H__
+#define __KERNEL_DRIVERS_FB_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <stdint.h>
+
+/** Major character device number of the framebuffer */
+#define FB_MAJOR  0x08
+
+void     fb_init(void);
+intptr_t fb_map(void);
+
+#endif  // !__KERNEL_DRIVERS_FB_H__
@@ -0,0 +1,18 @@
+#ifndef __KERNEL_DRIVERS_RAMDISK_H__
+#define __KERNEL_DRIVERS_RAMDISK_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <stddef.h>
+
+/** Major block device number of the RAM disk */
+#define RAMDISK_MAJOR   1
+
+int   ramdisk_init(void);
+
+// Provided by the architecture code
+void *arch_initrd(size_t *);
+
+#endif  // !__KERNEL_DRIVERS_RAMDISK_H__
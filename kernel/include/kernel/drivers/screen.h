@@ -5,6 +5,14 @@
 #define SCREEN_COLS       80
 #define SCREEN_ROWS       30
 
+/** Rows of scrollback history kept above the visible ones */
+#ifndef SCREEN_HISTORY
+#define SCREEN_HISTORY    100
+#endif
+
+/** The number of rows stored for each screen */
+#define SCREEN_LINES      (SCREEN_ROWS + SCREEN_HISTORY)
+
 enum ParserState {
   PARSER_NORMAL,
   PARSER_ESC,
@@ -13,6 +21,15 @@ enum ParserState {
 
 struct Display;
 
+/**
+ * A single character cell.
+ */
+struct ScreenCell {
+  unsigned ch : 8;
+  unsigned fg : 4;
+  unsigned bg : 4;
+};
+
 struct Screen {
   int                 fg_color;                     // Current foreground color
   int                 bg_color;                     // Current background color
@@ -20,11 +37,14 @@ struct Screen {
   unsigned            esc_params[SCREEN_ESC_MAX];  // The esc sequence parameters
   int                 esc_cur_param;                // Index of the current esc parameter
   int                 esc_question;
-  struct {
-    unsigned ch : 8;
-    unsigned fg : 4;
-    unsigned bg : 4;
-  }                   buf[SCREEN_COLS * SCREEN_ROWS];
+  /**
+   * The rows, a ring buffer with the first visible row at index top and the
+   * history rows before it. Scrolling only moves the index.
+   */
+  struct ScreenCell   buf[SCREEN_COLS * SCREEN_LINES];
+  unsigned            top;
+  unsigned            history;      // The number of history rows kept
+  unsigned            scroll;       // How many rows the view is scrolled back
   unsigned            cols;
   unsigned            rows;
   unsigned            pos;
@@ -56,5 +76,36 @@ void screen_init(struct Screen *, struct Display *);
 void screen_out_char(struct Screen *, char);
 void screen_flush(struct Screen *);
 void screen_backspace(struct Screen *);
+void screen_scroll_view(struct Screen *, int);
+
+/**
+ * Get the cell at the given position of the visible rows.
+ *
+ * @param screen The screen
+ * @param i      The position, counted from the top left corner
+ */
+static inline struct ScreenCell *
+screen_cell(struct Screen *screen, unsigned i)
+{
+  unsigned row = (screen->top + i / screen->cols) % SCREEN_LINES;
+
+  return &screen->buf[row * screen->cols + i % screen->cols];
+}
+
+/**
+ * Get the cell shown at the given position of the display, taking into
+ * account how far the view is scrolled back into the history.
+ *
+ * @param screen The screen
+ * @param i      The position, counted from the top left corner
+ */
+static inline struct ScreenCell *
+screen_view_cell(struct Screen *screen, unsigned i)
+{
+  unsigned row = (screen->top + SCREEN_LINES - screen->scroll +
+                  i / screen->cols) % SCREEN_LINES;
+
+  return &screen->buf[row * screen->cols + i % screen->cols];
+}
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_DRIVERS_SCREEN_H__
@@ -2,12 +2,14 @@
 #define __KERNEL_DRIVERS_SD_H__
 
 #include <stdint.h>
+#include <sys/iostat.h>
 
 #include <kernel/core/list.h>
 #include <kernel/spinlock.h>
 
 #define SD_BLOCKLEN               512         // Single block length in bytes
 #define SD_BLOCKLEN_LOG           9           // log2 of SD_BLOCKLEN
+#define SD_MAX_TRANSFER           (64 * SD_BLOCKLEN)  // Merged request limit
 
 // Response types
 #define SD_RESPONSE_R1            1
@@ -17,24 +19,61 @@
 #define SD_RESPONSE_R6            7
 #define SD_RESPONSE_R7            8
 
+#define SD_MAX_SEGMENTS           (SD_MAX_TRANSFER / SD_BLOCKLEN)
+
+// Bus clock rates, in Hz
+#define SD_CLOCK_IDENT            400000      // Card identification mode
+#define SD_CLOCK_DEFAULT          25000000    // Default speed mode
+#define SD_CLOCK_HIGH_SPEED       50000000    // High speed mode
+
 struct Buf;
 
+// A piece of memory taking part in a DMA transfer
+struct SDSegment {
+  void  *data;
+  size_t length;
+};
+
 struct SDOps {
   int  (*send_cmd)(void *, uint32_t, uint32_t, int, uint32_t *);
   int  (*irq_enable)(void *);
-  int  (*begin_transfer)(void *, uint32_t, int);
+  // Prepare a transfer of the given length, in blocks of 2^n bytes
+  int  (*begin_transfer)(void *, uint32_t, unsigned, int);
   int  (*receive_data)(void *, void *, size_t);
   int  (*send_data)(void *, const void *, size_t);
+  // Optional: move as much data as the FIFO allows without waiting and return
+  // the number of bytes moved, instead of receive_data/send_data
+  int  (*fifo_receive)(void *, void *, size_t);
+  int  (*fifo_send)(void *, const void *, size_t);
+  // Check whether the card has finished the data transfer (returns 1)
+  int  (*data_end)(void *);
+  // Optional: set up a DMA transfer before begin_transfer, returns non-zero
+  // if the data must be transferred by receive_data/send_data instead
+  int  (*dma_start)(void *, const struct SDSegment *, unsigned, int);
+  // Wait for the DMA transfer to complete (may sleep)
+  int  (*dma_wait)(void *);
+  // Optional: switch the host to the given bus width (1 or 4 bits) and the
+  // fastest clock rate not above the given one, in Hz
+  int  (*set_bus)(void *, unsigned, uint32_t);
 };
 
 struct SD {
-  struct KListLink queue;
+  struct KListLink queue;         // Pending buffers, sorted by address
+  struct KListLink active;        // Buffers of the current transfer
+  struct KListLink *current;      // The active buffer being transferred
+  size_t           offset;        // Bytes of the current buffer transferred
+  uint32_t         length;        // Total length of the current transfer
+  uint32_t         position;      // Card address after the last transfer
+  int              dma;           // Whether the current transfer uses DMA
+  unsigned long long start_time;  // When the current transfer started
+  struct iostat    stats;         // I/O statistics, protected by the lock
+  struct SDSegment segments[SD_MAX_SEGMENTS];
   struct KSpinLock lock;
   struct SDOps *ops;
   void *ctx;
 };
 
 int  sd_init(struct SD *, struct SDOps *, void *, int);
-void sd_request(struct SD *, struct Buf *);
+void sd_request(struct SD *, struct Buf **, unsigned);
 
 #endif  // !__KERNEL_DRIVERS_SD_H__
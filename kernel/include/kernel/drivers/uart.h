@@ -5,14 +5,33 @@
 #error "This is a kernel header; user programs should not #include it"
 #endif
 
+#include <kernel/spinlock.h>
+
 struct UartOps {
-  int (*read)(void *);
-  int (*write)(void *, int);
+  int  (*read)(void *);
+  int  (*write)(void *, int);
+  /** Whether a character can be written without waiting (optional) */
+  int  (*tx_ready)(void *);
+  /** Enable or disable the transmit interrupt (optional) */
+  void (*tx_irq_enable)(void *, int);
 };
 
+/** The size of the transmit ring buffer, in characters */
+#define UART_TX_BUF_SIZE  1024
+
+/** The most received characters passed to the tty at once */
+#define UART_RX_BATCH     64
+
 struct Uart {
-  struct UartOps *ops;
-  void *ctx;
+  struct UartOps   *ops;
+  void             *ctx;
+  /** Protects the transmit ring */
+  struct KSpinLock  tx_lock;
+  /** Characters waiting for room in the transmit FIFO */
+  char              tx_buf[UART_TX_BUF_SIZE];
+  unsigned          tx_head;      ///< The next character to transmit
+  unsigned          tx_count;     ///< The number of characters in the ring
+  int               tx_irq;       ///< Whether the transmit interrupt is on
 };
 
 int uart_init(struct Uart *, struct UartOps *, void *, int);
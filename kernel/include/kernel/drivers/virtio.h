@@ -0,0 +1,182 @@
+#ifndef __KERNEL_DRIVERS_VIRTIO_H__
+#define __KERNEL_DRIVERS_VIRTIO_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/drivers/virtio.h
+ *
+ * Virtio devices attached through the MMIO transport.
+ *
+ * See "Virtual I/O Device (VIRTIO) Version 1.1", both the legacy (version 1)
+ * and the modern (version 2) register layouts are supported.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/iostat.h>
+
+#include <kernel/mm/memlayout.h>
+#include <kernel/net.h>
+#include <kernel/spinlock.h>
+
+struct Buf;
+struct pbuf;
+
+/** Device IDs */
+#define VIRTIO_ID_NET           1
+#define VIRTIO_ID_BLOCK         2
+
+/** Descriptor flags */
+#define VIRTQ_DESC_F_NEXT       (1U << 0)   ///< Continues via the next field
+#define VIRTQ_DESC_F_WRITE      (1U << 1)   ///< Device-writable buffer
+
+/** The largest queue size used by the drivers */
+#define VIRTQ_SIZE_MAX          128
+
+struct VirtqDesc {
+  uint64_t addr;                ///< Physical address of the buffer
+  uint32_t len;                 ///< Length of the buffer
+  uint16_t flags;               ///< VIRTQ_DESC_F_*
+  uint16_t next;                ///< The next descriptor in the chain
+};
+
+struct VirtqAvail {
+  uint16_t flags;
+  uint16_t idx;                 ///< Where the driver puts the next entry
+  uint16_t ring[];
+};
+
+struct VirtqUsedElem {
+  uint32_t id;                  ///< The head descriptor of the chain
+  uint32_t len;                 ///< Bytes written into the chain
+};
+
+struct VirtqUsed {
+  uint16_t flags;
+  uint16_t idx;                 ///< Where the device puts the next entry
+  struct VirtqUsedElem ring[];
+};
+
+/** A segment of a descriptor chain */
+struct VirtqSeg {
+  physaddr_t addr;              ///< Physical address of the data
+  size_t     len;               ///< Length of the data
+  int        write;             ///< Whether the device writes the data
+};
+
+/**
+ * A virtqueue, in the legacy layout (the descriptor table and the available
+ * ring, followed by the used ring on the next page).
+ */
+struct Virtq {
+  unsigned           index;       ///< Queue number within the device
+  unsigned           size;        ///< The number of descriptors
+  struct VirtqDesc  *desc;        ///< Descriptor table
+  struct VirtqAvail *avail;       ///< Available ring
+  struct VirtqUsed  *used;        ///< Used ring
+  uint16_t           free_head;   ///< The first unused descriptor
+  unsigned           num_free;    ///< The number of unused descriptors
+  uint16_t           last_used;   ///< The next used entry to process
+  void              *cookies[VIRTQ_SIZE_MAX]; ///< By the head descriptor
+};
+
+/**
+ * A device on the MMIO transport.
+ */
+struct VirtioDevice {
+  volatile uint32_t *base;      ///< Memory base address
+  uint32_t           version;   ///< Register layout version (1 or 2)
+  uint32_t           id;        ///< Device ID
+  int                irq;       ///< Interrupt line
+};
+
+int       virtio_probe(struct VirtioDevice *, void *, int);
+int       virtio_setup(struct VirtioDevice *, uint32_t, uint32_t *);
+int       virtio_queue_init(struct VirtioDevice *, struct Virtq *, unsigned);
+void      virtio_ready(struct VirtioDevice *);
+uint32_t  virtio_irq_ack(struct VirtioDevice *);
+uint8_t   virtio_config_read8(struct VirtioDevice *, unsigned);
+uint32_t  virtio_config_read32(struct VirtioDevice *, unsigned);
+
+int       virtq_add(struct Virtq *, const struct VirtqSeg *, unsigned, void *);
+void      virtq_kick(struct VirtioDevice *, struct Virtq *);
+void     *virtq_get(struct Virtq *, uint32_t *);
+int       virtq_pending(struct Virtq *);
+void      virtq_irq_enable(struct Virtq *, int);
+
+/** Major block device number of the virtio-blk disk (replaces the SD card) */
+#define VIRTIO_BLK_MAJOR        0
+
+/** The most buffers merged into one request */
+#define VIRTIO_BLK_SEGS_MAX     8
+
+/** A block request in flight: the header, the buffers and the status */
+struct VirtioBlkReq {
+  uint32_t      type;
+  uint32_t      reserved;
+  uint64_t      sector;
+  uint8_t       status;
+  unsigned      nbufs;
+  struct Buf   *bufs[VIRTIO_BLK_SEGS_MAX];
+  unsigned long long start_time;
+};
+
+struct VirtioBlk {
+  struct VirtioDevice  dev;
+  struct Virtq         vq;
+  struct KSpinLock     lock;        ///< Protects the queue and the requests
+  struct VirtioBlkReq  reqs[VIRTQ_SIZE_MAX];  ///< By the head descriptor
+  unsigned             depth;       ///< The most buffers in flight
+  unsigned             active;      ///< Requests in flight
+  unsigned long long   busy_start;  ///< When the device became busy
+  struct iostat        stats;       ///< I/O statistics, protected by the lock
+};
+
+int  virtio_blk_init(struct VirtioBlk *, void *, int);
+void virtio_blk_request(struct VirtioBlk *, struct Buf **, unsigned);
+
+/** The number of receive buffers kept posted to the device */
+#define VIRTIO_NET_RX_BUFS      16
+/** The most frames received during one poll */
+#define VIRTIO_NET_RX_BUDGET    16
+/** The most pieces of a transmitted frame, including the header */
+#define VIRTIO_NET_TX_SEGS_MAX  16
+
+/** The header preceding each frame, without the legacy num_buffers field */
+struct VirtioNetHdr {
+  uint8_t  flags;
+  uint8_t  gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+  uint16_t num_buffers;         ///< Only present with VIRTIO_F_VERSION_1
+};
+
+struct VirtioNet {
+  struct VirtioDevice  dev;
+  struct Virtq         rx;
+  struct Virtq         tx;
+  size_t               hdr_len;     ///< The header size used by the device
+  /** Protects the TX queue, the RX queue is only used by the lwIP thread */
+  struct KSpinLock     lock;
+  /** Headers of the posted receive buffers, the data goes into net buffers */
+  struct VirtioNetHdr  rx_hdrs[VIRTQ_SIZE_MAX];
+  /** The number of posted receive buffers */
+  unsigned             rx_posted;
+  /** Whether a receive poll is scheduled (interrupts are suppressed) */
+  int                  rx_polling;
+  /** One (zero) header shared by all transmitted frames */
+  struct VirtioNetHdr  tx_hdr;
+  /** Driver counters, the TX ones are protected by the lock */
+  struct NetIfStats    stats;
+};
+
+int  virtio_net_init(struct VirtioNet *, void *, int);
+int  virtio_net_write(struct VirtioNet *, struct pbuf *);
+void virtio_net_stats(struct VirtioNet *, struct NetIfStats *);
+
+#endif  // !__KERNEL_DRIVERS_VIRTIO_H__
@@ -0,0 +1,25 @@
+#ifndef __KERNEL_DRIVERS_ZRAM_H__
+#define __KERNEL_DRIVERS_ZRAM_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/** Major block device number of the compressed RAM disk */
+#define ZRAM_MAJOR  2
+
+/**
+ * Compressed RAM disk usage statistics.
+ */
+struct ZramStats {
+  unsigned long total;      ///< The number of pages
+  unsigned long used;       ///< Pages holding data
+  unsigned long zero;       ///< Pages written with zeros, not stored
+  unsigned long raw;        ///< Pages stored uncompressed
+  unsigned long bytes;      ///< The memory used by the stored data
+};
+
+int   zram_init(void);
+void  zram_get_stats(struct ZramStats *);
+
+#endif  // !__KERNEL_DRIVERS_ZRAM_H__
@@ -130,6 +130,32 @@
 #define DW_LNE_SET_ADDRESS          0x2
 #define DW_LNE_DEFINE_FILE          0x3
 
+#define DW_CFA_ADVANCE_LOC          0x40
+#define DW_CFA_OFFSET               0x80
+#define DW_CFA_RESTORE              0xC0
+#define DW_CFA_NOP                  0x00
+#define DW_CFA_SET_LOC              0x01
+#define DW_CFA_ADVANCE_LOC1         0x02
+#define DW_CFA_ADVANCE_LOC2         0x03
+#define DW_CFA_ADVANCE_LOC4         0x04
+#define DW_CFA_OFFSET_EXTENDED      0x05
+#define DW_CFA_RESTORE_EXTENDED     0x06
+#define DW_CFA_UNDEFINED            0x07
+#define DW_CFA_SAME_VALUE           0x08
+#define DW_CFA_REGISTER             0x09
+#define DW_CFA_REMEMBER_STATE       0x0A
+#define DW_CFA_RESTORE_STATE        0x0B
+#define DW_CFA_DEF_CFA              0x0C
+#define DW_CFA_DEF_CFA_REGISTER     0x0D
+#define DW_CFA_DEF_CFA_OFFSET       0x0E
+#define DW_CFA_DEF_CFA_EXPRESSION   0x0F
+#define DW_CFA_EXPRESSION           0x10
+#define DW_CFA_OFFSET_EXTENDED_SF   0x11
+#define DW_CFA_DEF_CFA_SF           0x12
+#define DW_CFA_DEF_CFA_OFFSET_SF    0x13
+#define DW_CFA_GNU_ARGS_SIZE        0x2E
+#define DW_CFA_GNU_NEGATIVE_OFFSET_EXTENDED 0x2F
+
 struct DebugArangesHeader {
   uint32_t length;
   uint16_t version;
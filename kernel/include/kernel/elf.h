@@ -29,6 +29,9 @@ typedef struct {
   uint16_t      shstrndx;           ///< Section name string table index
 } Elf32_Ehdr;
 
+#define ET_EXEC     2               ///< Executable file
+#define ET_DYN      3               ///< Shared object file
+
 /**
  * Program Header
  */
@@ -53,4 +56,20 @@ typedef struct {
 #define PT_LOPROC   0x70000000
 #define PT_HIPROC   0x7fffffff
 
+#define PF_X        (1 << 0)        ///< Execute
+#define PF_W        (1 << 1)        ///< Write
+#define PF_R        (1 << 2)        ///< Read
+
+/**
+ * Auxiliary vector entry types, the vector follows the environment on the
+ * initial stack of a process
+ */
+#define AT_NULL     0               ///< End of the vector
+#define AT_PHDR     3               ///< Program headers of the program
+#define AT_PHENT    4               ///< Size of a program header entry
+#define AT_PHNUM    5               ///< The number of program headers
+#define AT_PAGESZ   6               ///< System page size
+#define AT_BASE     7               ///< Base address of the interpreter
+#define AT_ENTRY    9               ///< Entry point of the program
+
 #endif  // !__KERNEL_INCLUDE_KERNEL_ELF_H__
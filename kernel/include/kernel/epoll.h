@@ -0,0 +1,69 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_EPOLL_H__
+#define __KERNEL_INCLUDE_KERNEL_EPOLL_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <sys/epoll.h>
+
+#include <kernel/core/list.h>
+#include <kernel/poll.h>
+#include <kernel/spinlock.h>
+#include <kernel/waitqueue.h>
+
+struct File;
+
+/** The maximum number of events returned at once */
+#define EPOLL_MAX_EVENTS  (4096 / sizeof(struct epoll_event))
+
+/**
+ * A persistent interest set. Each watched file keeps an entry registered on
+ * its poll queue, and the entry callback puts the item on the ready list, so
+ * collecting events costs time proportional to the number of ready files
+ * rather than the number of watched ones.
+ */
+struct Epoll {
+  /** Protects the ready list. */
+  struct KSpinLock    lock;
+  /** All items of the set. */
+  struct KListLink    items;
+  /** Items that may have pending events. */
+  struct KListLink    ready;
+  /** Tasks waiting for events. */
+  struct KWaitQueue   queue;
+  /** Pollers of the epoll file itself. */
+  struct PollQueue    poll_queue;
+};
+
+/**
+ * A file watched by an epoll set.
+ */
+struct EpollItem {
+  /** Registration on the poll queue of the file. */
+  struct PollEntry    entry;
+  /** The set this item belongs to. */
+  struct Epoll       *epoll;
+  /** The watched file. */
+  struct File        *file;
+  /** The requested events and flags. */
+  uint32_t            events;
+  /** User data returned with the events. */
+  epoll_data_t        data;
+  /** Link into the list of items of the set. */
+  struct KListLink    epoll_link;
+  /** Link into the list of items watching the file. */
+  struct KListLink    file_link;
+  /** Link into the ready list. */
+  struct KListLink    ready_link;
+};
+
+void epoll_init(void);
+int  epoll_open(struct File **);
+int  epoll_close(struct File *);
+int  epoll_control(struct File *, int, int, struct epoll_event *);
+int  epoll_collect(struct File *, struct epoll_event *, int, long);
+int  epoll_poll(struct File *, struct PollEntry *);
+void epoll_file_release(struct File *);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_EPOLL_H__
@@ -7,7 +7,7 @@ struct File;
 void         fd_init(struct Process *);
 void         fd_close_all(struct Process *);
 void         fd_close_on_exec(struct Process *);
-void         fd_clone(struct Process *, struct Process *);
+int          fd_clone(struct Process *, struct Process *);
 int          fd_alloc(struct Process *, struct File *, int);
 struct File *fd_lookup(struct Process *, int);
 int          fd_close(struct Process *, int);
@@ -18,6 +18,8 @@
 #include <kernel/mutex.h>
 #include <kernel/waitqueue.h>
 
+struct BufCompletion;
+
 /**
  * 
  * 
@@ -28,21 +30,73 @@ struct Buf {
   dev_t            dev;               ///< ID of the device this block belongs to
   int              flags;             ///< Status flags
   int              ref_count;         ///< The number of references to the block
-  struct KListLink  cache_link;        ///< Link into the buf cache
+  struct KListLink  cache_link;        ///< Link into the LRU list
+  struct KListLink  hash_link;         ///< Link into the buf cache hash
+  struct KListLink  dirty_link;        ///< Link into the list of dirty buffers
+  unsigned long long dirty_time;       ///< When the buffer became dirty
   struct KListLink  queue_link;        ///< Link into the driver queue
-  struct KWaitQueue wait_queue;      ///< Processes waiting for the block data
+  struct KListLink  sched_link;        ///< Link into the I/O scheduler FIFO
+  unsigned long long deadline;         ///< When the I/O should be dispatched
+  unsigned long long submit_time;      ///< When the I/O was submitted
+  struct BufCompletion *completion;  ///< Notified when the I/O is done
   struct KMutex    mutex;             ///< Mutex protecting the block data
   size_t           block_size;        ///< Must be BLOCK_SIZE
   uint8_t         *data;              ///< Block data
 };
 
+/** The smallest supported block size */
+#define BUF_SIZE_MIN    512U
+/** The number of supported block sizes, powers of two from BUF_SIZE_MIN */
+#define BUF_SIZE_POOLS  8
+
 // Buffer status flags
 #define BUF_VALID   (1 << 0)  ///< Buffer has been read from the disk
 #define BUF_DIRTY   (1 << 1)  ///< Buffer needs to be written to the disk
+#define BUF_META    (1 << 2)  ///< Held back until committed to the journal
+#define BUF_LOGGED  (1 << 3)  ///< Dirty contents already committed to it
+
+/**
+ * Tracks a group of submitted buffers, so that the caller can issue several
+ * requests and then wait for all of them at once.
+ */
+struct BufCompletion {
+  unsigned         pending;         ///< The number of buffers still in flight
+  struct KWaitQueue wait_queue;     ///< Tasks waiting for the requests
+  /** Optional function called (from the driver context) once all requests
+   *  submitted so far are done */
+  void           (*callback)(struct BufCompletion *);
+};
+
+/**
+ * Buffer cache statistics.
+ */
+struct BufStats {
+  size_t        size;       ///< The number of buffers
+  size_t        bytes;      ///< The memory used by the buffer data
+  size_t        max_bytes;  ///< The current limit on 'bytes'
+  size_t        unused;     ///< Clean buffers not in use
+  size_t        unused_by_size[BUF_SIZE_POOLS]; ///< The same, by block size
+  size_t        dirty;      ///< Buffers waiting to be written out
+  unsigned long hits;       ///< Lookups that found the block in the cache
+  unsigned long misses;     ///< Lookups that had to read the block
+};
 
 void        buf_init(void);
+void        buf_get_stats(struct BufStats *);
 struct Buf *buf_read(unsigned, size_t, dev_t);
 void        buf_write(struct Buf *);
 void        buf_release(struct Buf *);
+void        buf_sync(dev_t);
+void        buf_checkpoint(dev_t);
+unsigned    buf_collect_dirty(dev_t, int, struct Buf **, unsigned);
+void        buf_prefetch(unsigned, size_t, dev_t);
+void        buf_sync_all(void);
+
+void        buf_completion_init(struct BufCompletion *,
+                                void (*)(struct BufCompletion *));
+struct Buf *buf_read_async(unsigned, size_t, dev_t, struct BufCompletion *);
+void        buf_submit(struct Buf **, unsigned, struct BufCompletion *);
+void        buf_wait(struct BufCompletion *);
+void        buf_io_done(struct Buf *);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_FS_BUF_H__
@@ -5,15 +5,24 @@
 #error "This is a kernel header; user programs should not #include it"
 #endif
 
+#include <stdint.h>
 #include <sys/types.h>
 
+#include <kernel/core/list.h>
+
 struct Inode;
 struct stat;
 struct Pipe;
+struct Epoll;
+struct UnixSocket;
+struct PollEntry;
+struct iovec;
 
 #define FD_INODE    0
 #define FD_PIPE     1
 #define FD_SOCKET   2
+#define FD_EPOLL    3
+#define FD_UNIX     4
 
 struct File {
   int              type;         ///< File type (inode, console, or pipe)
@@ -23,6 +32,9 @@ struct File {
   struct PathNode *node;        ///< Pointer to the corresponding inode
   int              socket;       ///< Socket ID
   struct Pipe     *pipe;         ///< Pointer to the correspondig pipe
+  struct Epoll    *epoll;        ///< Pointer to the corresponding epoll set
+  struct UnixSocket *unix_socket; ///< Pointer to the corresponding local socket
+  struct KListLink epoll_items;  ///< Epoll items watching this file
 };
 
 int          file_alloc(struct File **);
@@ -31,6 +43,8 @@ struct File *file_dup(struct File *);
 void         file_put(struct File *);
 ssize_t      file_read(struct File *, uintptr_t, size_t);
 ssize_t      file_write(struct File *, uintptr_t, size_t);
+ssize_t      file_readv(struct File *, const struct iovec *, int, off_t *);
+ssize_t      file_writev(struct File *, const struct iovec *, int, off_t *);
 ssize_t      file_getdents(struct File *, uintptr_t, size_t);
 int          file_stat(struct File *, struct stat *);
 int          file_chdir(struct File *);
@@ -40,8 +54,12 @@ int          file_set_flags(struct File *, int);
 int          file_chmod(struct File *, mode_t);
 int          file_chown(struct File *, uid_t, gid_t);
 int          file_ioctl(struct File *, int, int);
-int          file_select(struct File *, struct timeval *);
+int          file_poll(struct File *, struct PollEntry *);
 int          file_sync(struct File *);
 int          file_truncate(struct File *, off_t);
+intptr_t     file_mmap(struct File *, uintptr_t, size_t, int, int, off_t);
+ssize_t      file_splice(struct File *, struct File *, size_t);
+ssize_t      file_tee(struct File *, struct File *, size_t);
+ssize_t      file_sendfile(struct File *, struct File *, off_t *, size_t);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_FS_FILE__
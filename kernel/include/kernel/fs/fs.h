@@ -12,11 +12,18 @@
 #include <kernel/elf.h>
 #include <kernel/core/list.h>
 #include <kernel/mutex.h>
+#include <kernel/rwmutex.h>
 
-#define INODE_CACHE_SIZE  32
+/** Minimum number of inodes to keep cached */
+#define INODE_CACHE_SIZE  32U
+/** The inode cache gets one entry per this many physical pages */
+#define INODE_CACHE_PAGES 2048
 
 struct stat;
 struct File;
+struct Page;
+struct PollEntry;
+struct iovec;
 struct FS;
 
 struct Inode {
@@ -24,13 +31,20 @@ struct Inode {
   ino_t           ino;
   dev_t           dev;
 
-  // These two fields are protected by inode_cache.lock
+  // These fields are protected by inode_cache.lock
   int             ref_count;
-  struct KListLink cache_link;
+  struct KListLink hash_link;     ///< Link into the inode cache hash table
+  struct KListLink cache_link;    ///< Link into the LRU list, if unreferenced
+  struct KListLink dirty_link;    ///< Link into the list of inodes to write
 
-  struct KMutex   mutex;
+  // Cached file pages, protected by the page cache lock
+  struct KListLink pages;
+
+  // Held for reading by operations that do not modify the inode, such as
+  // reads of regular files and stat, and for writing by everything else
+  struct KRWMutex lock;
 
-  // The following fields (as well as inode contents) are protected by the mutex
+  // The following fields (as well as inode contents) are protected by the lock
   int             flags;
   mode_t          mode;
   nlink_t         nlink;
@@ -44,6 +58,7 @@ struct Inode {
 
   struct FS      *fs;
   void           *extra;
+  void           *exec_image;     ///< Headers parsed by exec (k_malloc'ed)
 };
 
 struct PathNode {
@@ -55,11 +70,18 @@ struct PathNode {
   struct PathNode    *parent;
   struct KListLink children;
   struct KListLink siblings;
+  struct KListLink hash_link;
+  struct KListLink lru_link;
+  unsigned long    hash;
 
   struct Inode   *inode;
   struct Inode   *mounted;
 };
 
+/**
+ * Store one directory entry. Returns the number of bytes used, or 0 if there
+ * is no room left for the entry.
+ */
 typedef int (*FillDirFunc)(void *, ino_t, const char *, size_t);
 
 struct FSOps {
@@ -67,10 +89,12 @@ struct FSOps {
   int             (*inode_read)(struct Inode *);
   int             (*inode_write)(struct Inode *);
   void            (*inode_delete)(struct Inode *);
+  void            (*inode_release)(struct Inode *);   // Optional
   ssize_t         (*read)(struct Inode *, uintptr_t, size_t, off_t);
   ssize_t         (*write)(struct Inode *, uintptr_t, size_t, off_t);
   int             (*rmdir)(struct Inode *, struct Inode *);
   ssize_t         (*readdir)(struct Inode *, void *, FillDirFunc, off_t);
+  ssize_t         (*readdir_batch)(struct Inode *, void *, FillDirFunc, off_t);  // Optional
   ssize_t         (*readlink)(struct Inode *, char *, size_t);
   int             (*create)(struct Inode *, char *, mode_t, struct Inode **);
   int             (*mkdir)(struct Inode *, char *, mode_t, struct Inode **);
@@ -79,17 +103,35 @@ struct FSOps {
   int             (*unlink)(struct Inode *, struct Inode *);
   struct Inode *  (*lookup)(struct Inode *, const char *);
   void            (*trunc)(struct Inode *, off_t);
+  void            (*sync)(struct FS *);                // Optional
+  void            (*prefetch)(struct Inode *, off_t, size_t);  // Optional
+  int             (*revalidate)(struct Inode *);       // Optional
 };
 
 struct FS {
   dev_t         dev;
+  int           flags;      ///< Mount flags (MNT_*)
   void         *extra;
   struct FSOps *ops;
   char         *name;
 };
 
-#define FS_INODE_VALID  (1 << 0)
-#define FS_INODE_DIRTY  (1 << 1)
+/**
+ * Inode and path cache statistics.
+ */
+struct FsCacheStats {
+  size_t inodes;          ///< Cached inodes
+  size_t inodes_unused;   ///< Cached inodes without references
+  size_t inodes_dirty;    ///< Inodes waiting to be written back
+  size_t inodes_max;      ///< Unused inodes are recycled above this number
+  size_t paths;           ///< Path nodes
+  size_t paths_unused;    ///< Path nodes referenced only by their parents
+  size_t paths_max;       ///< Unused nodes are trimmed above this number
+};
+
+#define FS_INODE_VALID    (1 << 0)
+#define FS_INODE_DIRTY    (1 << 1)
+#define FS_INODE_VOLATILE (1 << 2)  ///< Contents generated on each read
 
 #define FS_PERM_EXEC    (1 << 0)
 #define FS_PERM_WRITE   (1 << 1)
@@ -103,6 +145,7 @@ extern struct PathNode *fs_root;
 void          fs_init(void);
 
 int           fs_lookup(const char *, int, struct PathNode **);
+int           fs_lookup_at(struct PathNode *, const char *, int, struct PathNode **);
 int           fs_lookup_inode(const char *, int, struct Inode **);
 int           fs_path_lookup(const char *, char *, int, struct PathNode **, struct PathNode **);
 int           fs_set_pwd(struct PathNode *);
@@ -113,24 +156,45 @@ struct Inode *fs_inode_duplicate(struct Inode *);
 void          fs_inode_lock(struct Inode *);
 int           fs_inode_access(struct Inode *, int);
 void          fs_inode_unlock(struct Inode *);
+int           fs_inode_holding(struct Inode *);
+void          fs_inode_lock_shared(struct Inode *);
+void          fs_inode_unlock_shared(struct Inode *);
+int           fs_inode_holding_shared(struct Inode *);
+int           fs_inode_locked(struct Inode *);
 int           fs_inode_lookup_locked(struct Inode *, const char *, int, struct Inode **);
 
 ssize_t       fs_inode_read_locked(struct Inode *, uintptr_t, size_t, off_t *);
+void          fs_inode_touch_atime(struct Inode *);
+void          fs_inode_prefetch_locked(struct Inode *, off_t, size_t);
 ssize_t       fs_inode_read_dir_locked(struct Inode *, uintptr_t, size_t, off_t *);
 ssize_t       fs_inode_write_locked(struct Inode *, uintptr_t, size_t, off_t *);
 ssize_t       fs_inode_getdents(struct Inode *, void *, size_t, off_t *);
 int           fs_inode_stat_locked(struct Inode *, struct stat *);
 int           fs_create(const char *, mode_t, dev_t, struct PathNode **);
 void          fs_inode_cache_init(void);
+void          fs_inode_cache_get_stats(struct FsCacheStats *);
+void          fs_inode_flush(void);
+void          fs_inode_exec_invalidate(struct Inode *);
 int           fs_inode_truncate_locked(struct Inode *, off_t length);
 int           fs_inode_chmod_locked(struct Inode *, mode_t);
 int           fs_inode_ioctl_locked(struct Inode *, int, int);
-int           fs_inode_select_locked(struct Inode *, struct timeval *);
+int           fs_inode_poll_locked(struct Inode *, struct PollEntry *);
 int           fs_inode_sync_locked(struct Inode *);
 int           fs_inode_chown_locked(struct Inode *, uid_t, gid_t);
 ssize_t       fs_inode_readlink(struct Inode *, char *, size_t);
 int           fs_permission(struct Inode *, mode_t, int);
 
+// Page cache
+void          fs_page_cache_init(void);
+int           fs_page_get_locked(struct Inode *, unsigned long, struct Page **);
+struct Page  *fs_page_dup(struct Page *);
+void          fs_page_put(struct Page *);
+int           fs_page_write_back(struct Inode *, unsigned long, struct Page *);
+ssize_t       fs_page_cache_read(struct Inode *, uintptr_t, size_t, off_t);
+void          fs_page_cache_update(struct Inode *, uintptr_t, size_t, off_t);
+void          fs_page_cache_invalidate(struct Inode *, off_t, size_t);
+void          fs_page_cache_drop(struct Inode *);
+
 // Path operations
 int              fs_chmod(const char *, mode_t);
 int              fs_open(const char *, int, mode_t, struct File **);
@@ -139,6 +203,7 @@ int              fs_chdir(const char *);
 int              fs_unlink(const char *);
 int              fs_rmdir(const char *);
 int              fs_access(const char *, int);
+int              fs_stat_at(struct File *, const char *, struct stat *);
 ssize_t          fs_readlink(const char *, char *, size_t);
 
 // File operations
@@ -146,26 +211,33 @@ int              fs_close(struct File *);
 off_t            fs_seek(struct File *, off_t, int);
 ssize_t          fs_read(struct File *, uintptr_t, size_t);
 ssize_t          fs_write(struct File *, uintptr_t, size_t);
+ssize_t          fs_readv(struct File *, const struct iovec *, int, off_t *);
+ssize_t          fs_writev(struct File *, const struct iovec *, int, off_t *);
+ssize_t          fs_sendfile(struct File *, struct File *, off_t *, size_t);
 ssize_t          fs_getdents(struct File *, uintptr_t, size_t);
 int              fs_fstat(struct File *, struct stat *);
 int              fs_fchdir(struct File *);
 int              fs_fchmod(struct File *, mode_t);
 int              fs_fchown(struct File *, uid_t, gid_t);
 int              fs_ioctl(struct File *, int, int);
-int              fs_select(struct File *, struct timeval *);
+int              fs_poll(struct File *, struct PollEntry *);
 int              fs_ftruncate(struct File *, off_t);
 int              fs_fsync(struct File *);
+intptr_t         fs_mmap(struct File *, uintptr_t, size_t, int, off_t);
+void             fs_sync(void);
 
+void             fs_path_cache_get_stats(struct FsCacheStats *);
 struct PathNode *fs_path_node_create(const char *, struct Inode *, struct PathNode *);
 struct PathNode *fs_path_duplicate(struct PathNode *);
 void             fs_path_remove(struct PathNode *);
+void             fs_path_invalidate(struct PathNode *, const char *);
 void             fs_path_put(struct PathNode *);
 void             fs_path_node_lock(struct PathNode *);
 void             fs_path_node_unlock(struct PathNode *);
 void             fs_path_lock_two(struct PathNode *, struct PathNode *);
 void             fs_path_unlock_two(struct PathNode *, struct PathNode *);
 int              fs_path_mount(struct PathNode *, struct Inode *);
-int              fs_mount(const char *, const char *);
+int              fs_mount(const char *, const char *, int);
 struct Inode    *fs_path_inode(struct PathNode *);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_FS_FS_H__
@@ -0,0 +1,57 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_FS_IOSCHED_H__
+#define __KERNEL_INCLUDE_KERNEL_FS_IOSCHED_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/fs/iosched.h
+ *
+ * I/O scheduling layer between the buffer cache and block device drivers.
+ */
+
+#include <kernel/spinlock.h>
+
+struct Buf;
+struct BlockDev;
+struct IoQueue;
+
+/**
+ * I/O scheduling policy. All functions are called with the queue lock held.
+ */
+struct IoScheduler {
+  const char *name;
+  /** Set up the policy state of the queue */
+  int       (*init)(struct IoQueue *);
+  /** Add a buffer to the scheduler queues */
+  void      (*add)(struct IoQueue *, struct Buf *);
+  /** Remove up to `max` buffers to be sent to the driver next. Called only if
+   *  there are queued buffers, must return at least one. */
+  unsigned  (*dispatch)(struct IoQueue *, struct Buf **, unsigned max);
+};
+
+/**
+ * Request queue of a block device. Holds the buffers back while the driver
+ * has `depth` buffers in flight, so that the scheduler decides the order in
+ * which they are sent.
+ */
+struct IoQueue {
+  struct KSpinLock          lock;
+  struct BlockDev          *dev;          ///< The device served by the queue
+  const struct IoScheduler *sched;        ///< The scheduling policy
+  void                     *data;         ///< Policy-specific state
+  unsigned                  depth;        ///< Maximum buffers in flight
+  unsigned                  queued;       ///< Buffers held by the scheduler
+  unsigned                  in_flight;    ///< Buffers passed to the driver
+  int                       dispatching;  ///< Someone is feeding the driver
+};
+
+extern const struct IoScheduler io_deadline_sched;
+
+int  io_queue_init(struct IoQueue *, struct BlockDev *,
+                   const struct IoScheduler *, unsigned);
+void io_queue_submit(struct IoQueue *, struct Buf **, unsigned);
+void io_queue_done(struct IoQueue *);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_FS_IOSCHED_H__
@@ -0,0 +1,20 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_FUTEX_H__
+#define __KERNEL_INCLUDE_KERNEL_FUTEX_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/futex.h
+ *
+ * Fast user-space locking.
+ */
+
+#include <stdint.h>
+
+void futex_init(void);
+int  futex_wait(uintptr_t, int, unsigned long);
+int  futex_wake(uintptr_t, int);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_FUTEX_H__
@@ -1,13 +1,14 @@
 #ifndef __KERNEL_INCLUDE_KERNEL_INTERRUPT_H__
 #define __KERNEL_INCLUDE_KERNEL_INTERRUPT_H__
 
+#include <kernel/core/cpu.h>
 #include <kernel/core/semaphore.h>
 
 struct KThread;
 
 void arch_interrupt_init(void);
 void arch_interrupt_init_percpu(void);
-void arch_interrupt_ipi(void);
+void arch_interrupt_ipi(unsigned, int);
 void arch_interrupt_mask(int);
 void arch_interrupt_unmask(int);
 void arch_interrupt_enable(int, int);
@@ -16,8 +17,27 @@ void arch_interrupt_eoi(int);
 
 typedef int (*interrupt_handler_t)(int, void *);
 
+/** Allow an interrupt to be taken by any CPU */
+#define INTERRUPT_CPU_ALL   ((1U << K_CPU_MAX) - 1)
+
+/**
+ * Interrupt counters of a line, see interrupt_get_stats().
+ */
+struct InterruptStats {
+  int                 irq;
+  /** The CPU the interrupt is currently routed to */
+  unsigned            cpu;
+  /** The number of interrupts taken by each CPU */
+  unsigned long       count[K_CPU_MAX];
+};
+
+void interrupt_init_percpu(void);
 void interrupt_attach(int, interrupt_handler_t, void *);
 void interrupt_attach_thread(int, interrupt_handler_t, void *);
+int  interrupt_set_affinity(int, unsigned);
+void interrupt_balance_init(void);
+unsigned interrupt_get_stats(struct InterruptStats *, unsigned);
+void interrupt_print_stats(void);
 void interrupt_dispatch(void);
 
 static inline void
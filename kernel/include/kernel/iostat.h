@@ -0,0 +1,27 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_IOSTAT_H__
+#define __KERNEL_INCLUDE_KERNEL_IOSTAT_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/iostat.h
+ *
+ * Block device I/O statistics.
+ */
+
+#include <sys/iostat.h>
+#include <sys/types.h>
+
+struct Buf;
+
+void iostat_init(void);
+void iostat_register(struct iostat *, const char *, dev_t);
+
+void iostat_queue(struct iostat *, struct Buf *);
+void iostat_start(struct iostat *, struct Buf *, int);
+void iostat_done(struct iostat *, struct Buf *, unsigned long long);
+void iostat_busy(struct iostat *, unsigned long long);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_IOSTAT_H__
@@ -1,6 +1,27 @@
 #ifndef __KERNEL_INCLUDE_KERNEL_IPC_H__
 #define __KERNEL_INCLUDE_KERNEL_IPC_H__
 
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/ipc.h
+ *
+ * Synchronous message passing between processes.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
 void ipc_init(void);
+int  ipc_channel_open(void);
+int  ipc_channel_close(id_t);
+int  ipc_connect(id_t);
+int  ipc_disconnect(int);
+int  ipc_send(int, uintptr_t, size_t, uintptr_t, size_t);
+int  ipc_receive(id_t, uintptr_t, size_t, uintptr_t);
+int  ipc_reply(int, int, uintptr_t, size_t);
+void ipc_process_cleanup(pid_t);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_IPC_H__
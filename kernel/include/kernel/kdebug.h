@@ -14,6 +14,21 @@ struct PcDebugInfo {
   uintptr_t fn_addr;
 };
 
+/** Number of core registers tracked by the call frame unwinder */
+#define DEBUG_FRAME_REGS  16
+
+/**
+ * Register values of a stack frame, as seen by the call frame unwinder.
+ */
+struct DebugFrame {
+  /** The core registers, indexed by their DWARF register numbers */
+  uintptr_t regs[DEBUG_FRAME_REGS];
+  /** The canonical frame address computed by the last unwind step */
+  uintptr_t cfa;
+};
+
 int debug_info_pc(uintptr_t pc, struct PcDebugInfo *info);
+int debug_info_fn(uintptr_t pc, struct PcDebugInfo *info);
+int debug_frame_unwind(uintptr_t pc, struct DebugFrame *frame, uintptr_t *ra);
 
 #endif  // __KERNEL_INCLUDE_KERNEL__KDEBUG_H__
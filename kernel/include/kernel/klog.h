@@ -0,0 +1,23 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_KLOG_H__
+#define __KERNEL_INCLUDE_KERNEL_KLOG_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/klog.h
+ *
+ * Kernel message log.
+ */
+
+#include <stddef.h>
+
+/** The longest message stored as a single record */
+#define KLOG_MSG_MAX  256
+
+void klog_init(void);
+void klog_write(const char *, size_t);
+void klog_flush(void);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_KLOG_H__
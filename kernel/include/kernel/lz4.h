@@ -0,0 +1,26 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_LZ4_H__
+#define __KERNEL_INCLUDE_KERNEL_LZ4_H__
+
+/**
+ * @file include/lz4.h
+ *
+ * LZ4 block compression.
+ */
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** The maximum size of the data compressed at once */
+#define LZ4_MAX_INPUT   65535
+
+/** The number of entries in the hash table used by lz4_compress() */
+#define LZ4_HASH_SIZE   (1U << 12)
+
+size_t lz4_compress(const void *, size_t, void *, size_t, uint16_t *);
+int    lz4_decompress(const void *, size_t, void *, size_t);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_LZ4_H__
@@ -0,0 +1,21 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_MEMINFO_H__
+#define __KERNEL_INCLUDE_KERNEL_MEMINFO_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/meminfo.h
+ *
+ * Memory usage report.
+ */
+
+#include <stddef.h>
+
+void   meminfo_init(void);
+size_t meminfo_report(char *, size_t);
+size_t meminfo_slab_report(char *, size_t);
+size_t meminfo_page_report(char *, size_t);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_MEMINFO_H__
@@ -31,12 +31,18 @@
 #define KXSTACK_R0        8       ///< Offset of saved R0 in exception stack
 #define KXSTACK_PC        12      ///< Offset of saved PC in exception stack
 
+/** Physical address where RAM starts, must be 1MB-aligned (the build
+ * selects it for the board, see arch_kernel.mk) */
+#ifndef PHYS_RAM_BASE
+#define PHYS_RAM_BASE     0x00000000
+#endif
 /** Physical address the kernel executable is loaded at */
-#define PHYS_KERNEL_LOAD  0x00010000
+#define PHYS_KERNEL_LOAD  (PHYS_RAM_BASE + 0x00010000)
 /** Maximum physical memory available during the early boot process */
-#define PHYS_ENTRY_LIMIT  0x01000000
-/** Maximum available physical memory */
-#define PHYS_LIMIT        0x10000000
+#define PHYS_ENTRY_LIMIT  (PHYS_RAM_BASE + 0x01000000)
+/** Maximum physical memory usable by the kernel (the actual size is detected
+ * at boot time) */
+#define PHYS_LIMIT        (PHYS_RAM_BASE + 0x10000000)
 
 #define PHYS_EXTRA_BASE   0x20000000
 #define PHYS_EXTRA_LIMIT  0x40000000
@@ -46,14 +52,24 @@
 #define PHYS_KMI0         0x10006000    ///< Keyboard/Mouse Interface 0
 #define PHYS_UART0        0x10009000    ///< UART 0 Interface
 #define PHYS_LCD          0x10020000    ///< Color LCD Controller configuration
+#define PHYS_DMAC         0x10030000    ///< DMA Controller
 #define PHYS_ETH          0x4E000000    ///< Static memory (CS3) Ethernet
 
 /** Exception vectors are mapped at this virtual address */
 #define VIRT_VECTOR_BASE  0xFFFF0000
 /** All physical memory is mapped at this virtual address */
 #define VIRT_KERNEL_BASE  0x80000000
+/** Non-contiguous kernel allocations are mapped at this virtual address */
+#define VIRT_VMALLOC_BASE 0xF0000000
+/** The end of the region for non-contiguous kernel allocations */
+#define VIRT_VMALLOC_LIMIT  0xFF000000
 /** Top of the user-mode process stack */
 #define VIRT_USTACK_TOP   VIRT_KERNEL_BASE
+/** The read-only time information page is mapped just below the user stack */
+// Must be equal to TIMEPAGE_ADDR in <sys/timepage.h>
+#define VIRT_TIMEPAGE     (VIRT_USTACK_TOP - USTACK_SIZE - PAGE_SIZE)
+/** The program interpreter (the dynamic loader) is loaded at this address */
+#define VIRT_INTERP_BASE  0x70000000
 
 #ifndef __ASSEMBLER__
 
@@ -35,6 +35,39 @@ int mon_kerninfo(int, char **, struct TrapFrame *);
  */
 int mon_backtrace(int, char **, struct TrapFrame *);
 
+/**
+ * Display the object pool, page allocator and cache statistics.
+ */
 int mon_kmeminfo(int, char **, struct TrapFrame *);
 
+/**
+ * Display spinlock contention statistics.
+ */
+int mon_lockstat(int, char **, struct TrapFrame *);
+
+/**
+ * Display the number of interrupts taken by each CPU.
+ */
+int mon_irqstat(int, char **, struct TrapFrame *);
+
+/**
+ * Control the sampling profiler or display the profile.
+ */
+int mon_prof(int, char **, struct TrapFrame *);
+
+/**
+ * Control the tracepoints or display the most recent events.
+ */
+int mon_trace(int, char **, struct TrapFrame *);
+
+/**
+ * Measure memcpy, memmove and memset against the generic C versions.
+ */
+int mon_membench(int, char **, struct TrapFrame *);
+
+/**
+ * Display the time spent in each kernel initialization stage.
+ */
+int mon_boottime(int, char **, struct TrapFrame *);
+
 #endif  // !__KERNEL_INCLUDE_KERNEL_MONITOR_H__
@@ -18,13 +18,24 @@ struct KThread;
  *
  * Mutexes are used if the holding time is long or if the task needs to sleep
  * while holding the lock.
+ *
+ * A free mutex is taken, and a mutex nobody waits for is released, with a
+ * single atomic operation on the owner word. Everything else is done under
+ * the scheduler lock.
  */
 struct KMutex {
   int               type;
   int               flags;
-  /** The task currently holding the mutex. */
-  struct KThread   *owner;
-  /** Link into the list of all mutexes owned by the same thread. */
+  /**
+   * The task currently holding the mutex, ORed with K_MUTEX_WAITERS if
+   * the owner must wake up the queue on unlock.
+   */
+  uintptr_t         owner;
+  /**
+   * Link into the list of all mutexes owned by the same thread. A mutex
+   * taken without contention is only put on the list when another thread
+   * starts waiting for it.
+   */
   struct KListLink  link;
   /** List of tasks waiting for this mutex to be released. */
   struct KListLink  queue;
@@ -37,6 +48,8 @@ struct KMutex {
 #define K_MUTEX_TYPE    0x4D555458  // {'M','U','T','X'}
 #define K_MUTEX_STATIC  (1 << 0)
 
+#define K_MUTEX_WAITERS (1UL << 0)  ///< Unlock through the slow path
+
 void           k_mutex_system_init(void);
 void           k_mutex_init(struct KMutex *, const char *);
 void           k_mutex_fini(struct KMutex *);
@@ -1,13 +1,47 @@
 #ifndef __KERNEL_INCLUDE_KERNEL_NET_H__
 #define __KERNEL_INCLUDE_KERNEL_NET_H__
 
+#include <poll.h>
 #include <stddef.h>
+#include <sys/uio.h>
+
 #include <lwip/sockets.h>
 
 struct File;
+struct PollEntry;
+
+/** Size of a receive buffer, enough for a full Ethernet frame */
+#define NET_RX_BUFFER_SIZE  1536
+/** The smallest number of receive buffers the drivers may hold at once */
+#define NET_RX_BUFFER_MIN   32
+
+/** Counters kept by a network interface driver */
+struct NetIfStats {
+  /** Frames passed up the stack */
+  unsigned long rx_frames;
+  /** Frames discarded due to receive errors */
+  unsigned long rx_errors;
+  /** Frames discarded for lack of receive buffers */
+  unsigned long rx_dropped;
+  /** Frames lost by the device, e.g. due to FIFO overruns */
+  unsigned long rx_overruns;
+  /** Frames written into the device */
+  unsigned long tx_frames;
+  /** Frames reported as failed by the device */
+  unsigned long tx_errors;
+  /** Frames that had to wait for FIFO space */
+  unsigned long tx_stalls;
+  /** Frames rejected because the transmit queue was full */
+  unsigned long tx_dropped;
+};
 
-void net_enqueue(void *, size_t);
-void net_init(void);
+void  net_init(void);
+void *net_rx_buffer_alloc(void);
+void  net_rx_buffer_free(void *);
+void  net_rx_buffer_input(void *, size_t);
+int   net_rx_poll_schedule(void (*)(void *), void *);
+void  net_stats_init(void);
+void  net_httpd_init(void);
 
 int     net_socket(int, int, int, struct File **);
 int     net_accept(struct File *, struct sockaddr *, socklen_t *, struct File **);
@@ -19,9 +53,12 @@ int     net_connect(struct File *, const struct sockaddr *, socklen_t);
 ssize_t net_recvfrom(struct File *, uintptr_t, size_t, int, struct sockaddr *, socklen_t *);
 ssize_t net_sendto(struct File *, uintptr_t, size_t, int, const struct sockaddr *, socklen_t );
 int     net_setsockopt(struct File *, int, int, const void *, socklen_t);
+int     net_getsockopt(struct File *, int, int, void *, socklen_t *);
+void    net_set_nonblocking(struct File *, int);
 ssize_t net_read(struct File *, uintptr_t, size_t);
 ssize_t net_write(struct File *, uintptr_t, size_t);
-int     net_select(struct File *, struct timeval *);
+ssize_t net_writev(struct File *, const struct iovec *, int);
+int     net_poll(struct File *, struct PollEntry *);
 int     net_gethostbyname(const char *, ip_addr_t *);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_NET_H__
@@ -0,0 +1,132 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_NET_UNIX_H__
+#define __KERNEL_INCLUDE_KERNEL_NET_UNIX_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/net/unix.h
+ *
+ * Local (AF_UNIX) sockets.
+ */
+
+#include <stddef.h>
+
+#include <kernel/core/list.h>
+#include <kernel/poll.h>
+#include <kernel/spinlock.h>
+#include <kernel/waitqueue.h>
+
+#include <lwip/sockets.h>
+
+struct File;
+struct Inode;
+struct stat;
+
+#ifndef AF_UNIX
+#define AF_UNIX             1
+#endif
+
+/** The maximum length of a socket path (keep in sync with <sys/un.h>) */
+#define UNIX_PATH_MAX       104
+
+struct sockaddr_un {
+  uint8_t     sun_len;
+  sa_family_t sun_family;
+  char        sun_path[UNIX_PATH_MAX];
+};
+
+/** Stream buffer size (for each direction) and datagram queue limit: 16 KiB */
+#define UNIX_BUFFER_ORDER   2
+
+/** One direction of a stream connection. */
+struct UnixStream {
+  char                  *data;
+  size_t                 read_pos;
+  size_t                 size;
+};
+
+/**
+ * A connected pair of stream sockets. Data moves between the two endpoints
+ * the same way it does through a pipe, with one ring buffer per direction.
+ */
+struct UnixConnection {
+  /** Protects the connection state and both streams. */
+  struct KSpinLock       lock;
+  /** The endpoints, each one is reset to NULL when it is closed. */
+  struct UnixSocket     *sockets[2];
+  /** The data received by each endpoint. */
+  struct UnixStream      streams[2];
+  /** Tasks reading from or writing into each of the streams. */
+  struct KWaitQueue      queues[2];
+};
+
+enum {
+  UNIX_UNCONNECTED,
+  UNIX_LISTENING,
+  UNIX_CONNECTED,
+};
+
+struct UnixSocket {
+  /** SOCK_STREAM or SOCK_DGRAM. */
+  int                    type;
+  /** Protected by unix_lock, as are all of the bind and listen fields. */
+  int                    state;
+  int                    ref_count;
+
+  /** The socket file this socket is bound to, or NULL. */
+  struct Inode          *inode;
+  struct sockaddr_un     address;
+  socklen_t              address_len;
+  /** Link into the table of bound sockets. */
+  struct KListLink       bind_link;
+
+  /** Connections waiting to be accepted by a listening socket. */
+  struct KListLink       accept_queue;
+  struct KWaitQueue      accept_wait;
+  int                    backlog;
+  int                    pending;
+  /** Link into the accept queue of the listening socket. */
+  struct KListLink       accept_link;
+
+  /** The connection of a stream socket, never changes once set. */
+  struct UnixConnection *conn;
+  /** The index of this endpoint within the connection. */
+  int                    side;
+  /** The address of the other endpoint, as reported by accept(). */
+  struct sockaddr_un     peer_address;
+  socklen_t              peer_address_len;
+
+  /** Protects the datagram queue. */
+  struct KSpinLock       lock;
+  /** Received datagrams. */
+  struct KListLink       messages;
+  /** The number of bytes queued. */
+  size_t                 queued;
+  /** Set once the socket is closed. */
+  int                    closed;
+  /** The default destination of a datagram socket, or NULL. */
+  struct Inode          *peer;
+  struct KWaitQueue      recv_wait;
+  struct KWaitQueue      send_wait;
+
+  struct PollQueue       poll_queue;
+};
+
+void    unix_init(void);
+int     unix_socket(int, int, struct File **);
+int     unix_close(struct File *);
+int     unix_bind(struct File *, const struct sockaddr *, socklen_t);
+int     unix_listen(struct File *, int);
+int     unix_connect(struct File *, const struct sockaddr *, socklen_t);
+int     unix_accept(struct File *, struct sockaddr *, socklen_t *, struct File **);
+ssize_t unix_recvfrom(struct File *, uintptr_t, size_t, int, struct sockaddr *,
+                      socklen_t *);
+ssize_t unix_sendto(struct File *, uintptr_t, size_t, int,
+                    const struct sockaddr *, socklen_t);
+int     unix_getsockopt(struct File *, int, int, void *, socklen_t *);
+int     unix_poll(struct File *, struct PollEntry *);
+int     unix_stat(struct File *, struct stat *);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_NET_UNIX_H__
@@ -11,11 +11,37 @@
 #error "This is a kernel header; user programs should not #include it"
 #endif
 
+#include <kernel/core/cpu.h>
 #include <kernel/core/list.h>
 #include <kernel/spinlock.h>
 
 #define K_OBJECT_POOL_NAME_MAX  64
 
+/** The number of objects held by a single magazine */
+#define K_OBJECT_MAGAZINE_SIZE  14
+
+/**
+ * Magazine is a small stack of constructed objects cached by a single CPU.
+ */
+struct KObjectMagazine {
+  /** Link into the depot list. */
+  struct KObjectMagazine *next;
+  /** The number of objects in the magazine. */
+  unsigned                rounds;
+  /** The cached objects. */
+  void                   *objs[K_OBJECT_MAGAZINE_SIZE];
+};
+
+/**
+ * Per-CPU magazine layer of an object pool.
+ */
+struct KObjectPoolCpu {
+  /** The magazine objects are allocated from and freed to. */
+  struct KObjectMagazine *loaded;
+  /** The previously loaded magazine, either full or empty. */
+  struct KObjectMagazine *previous;
+} __cacheline_aligned;
+
 /**
  * Object pool descriptor.
  */
@@ -31,6 +57,12 @@ struct KObjectPool {
   struct KListLink   slabs_partial;
   /** Complete slabs (all blocks free). */
   struct KListLink   slabs_full;
+  /** The number of complete slabs. */
+  unsigned          slabs_full_count;
+  /** The fewest complete slabs since the last trimming. */
+  unsigned          slabs_full_low;
+  /** Complete slabs left by the trimming. */
+  unsigned          slabs_retain;
 
   /** The number of object per one slab. */
   unsigned          slab_capacity;
@@ -54,6 +86,15 @@ struct KObjectPool {
   /** The color offset to be used by the next slab. */
   size_t            color_next;
 
+  /** Per-CPU magazines. */
+  struct KObjectPoolCpu   cpus[K_CPU_MAX];
+  /** Depot of full magazines shared by all CPUs. */
+  struct KObjectMagazine *depot_full;
+  /** The number of magazines in the full depot list. */
+  unsigned                depot_full_count;
+  /** Depot of empty magazines shared by all CPUs. */
+  struct KObjectMagazine *depot_empty;
+
   /** Link into the global list of pool descriptors. */
   struct KListLink   link;
 
@@ -62,7 +103,8 @@ struct KObjectPool {
 };
 
 enum {
-  K_OBJECT_POOL_OFF_SLAB = (1 << 0)
+  K_OBJECT_POOL_OFF_SLAB     = (1 << 0),
+  K_OBJECT_POOL_NO_MAGAZINES = (1 << 1),
 };
 
 struct KObjectTag {
@@ -87,16 +129,52 @@ struct KObjectSlab {
   struct KObjectTag   tags[0];
 };
 
+/**
+ * Object pool statistics.
+ */
+struct KObjectPoolStats {
+  /** Pool name. */
+  char     name[K_OBJECT_POOL_NAME_MAX + 1];
+  /** Size of a single object in bytes. */
+  size_t   obj_size;
+  /** The number of objects per one slab. */
+  unsigned slab_capacity;
+  /** The number of pages per one slab. */
+  unsigned slab_pages;
+  /** The number of slabs with all blocks free, some free and none free. */
+  unsigned slabs_full;
+  unsigned slabs_partial;
+  unsigned slabs_empty;
+  /** Objects allocated by the callers. */
+  unsigned objs_used;
+  /** Objects cached in magazines. */
+  unsigned objs_cached;
+  /** The maximum slab color offset. */
+  size_t   color_max;
+  /** Bytes lost to block rounding and unused slab space. */
+  size_t   waste;
+};
+
 struct KObjectPool *k_object_pool_create(const char *, size_t, size_t,
                                       void (*)(void *, size_t),
                                       void (*)(void *, size_t));
 int                k_object_pool_destroy(struct KObjectPool *);
 void              *k_object_pool_get(struct KObjectPool *);
 void               k_object_pool_put(struct KObjectPool *, void *);
+int                k_object_pool_try_put(struct KObjectPool *, void *);
+unsigned           k_object_pool_get_bulk(struct KObjectPool *, void **,
+                                          unsigned);
+void               k_object_pool_put_bulk(struct KObjectPool *, void **,
+                                          unsigned);
 
 void               k_object_pool_system_init(void);
+void               k_object_pool_trim_init(void);
+void               k_object_pool_set_retain(struct KObjectPool *, unsigned);
+unsigned           k_object_pool_get_stats(struct KObjectPoolStats *, unsigned);
+void               k_malloc_print_stats(void);
 
 void              *k_malloc(size_t);
 void               k_free(void *);
+int                k_try_free(void *);
 
 #endif  // !__KERNEL_OBJECT_POOL_H__
@@ -48,8 +48,19 @@ enum {
   PAGE_TAG_KERNEL_VM,
   PAGE_TAG_ETH_TX,
   PAGE_TAG_PIPE,
+  PAGE_TAG_TIME,
+  PAGE_TAG_INODE,
+  PAGE_TAG_FILE,
+  PAGE_TAG_SOCKET,
+  PAGE_TAG_KDEBUG,
+  PAGE_TAG_TMPFS,
+  PAGE_TAG_VMALLOC,
+  PAGE_TAG_VIRTIO,
 };
 
+/** The number of page tags, keep in sync with the last tag above */
+#define PAGE_TAG_COUNT  (PAGE_TAG_VIRTIO - PAGE_TAG_MAILBOX + 1)
+
 extern struct Page *pages;
 extern unsigned page_count;
 extern unsigned page_free_count;
@@ -63,10 +74,12 @@ extern unsigned page_free_count;
 static inline physaddr_t
 page2pa(struct Page *p)
 {
+#if K_DEBUG_LEVEL >= K_DEBUG_ASSERT
   if ((p < pages) || (p >= &pages[page_count]))
     panic("bad page index %u", (p - pages));
+#endif
 
-  return (p - pages) << PAGE_SHIFT;
+  return PHYS_RAM_BASE + ((physaddr_t) (p - pages) << PAGE_SHIFT);
 }
 
 /**
@@ -90,10 +103,12 @@ page2kva(struct Page *p)
 static inline struct Page *
 pa2page(physaddr_t pa)
 {
-  if ((pa >> PAGE_SHIFT) >= page_count)
-    panic("bad page index %u", pa >> PAGE_SHIFT);
+#if K_DEBUG_LEVEL >= K_DEBUG_ASSERT
+  if ((pa < PHYS_RAM_BASE) || ((pa - PHYS_RAM_BASE) >> PAGE_SHIFT) >= page_count)
+    panic("bad physical address %08lx", pa);
+#endif
 
-  return &pages[pa >> PAGE_SHIFT];
+  return &pages[(pa - PHYS_RAM_BASE) >> PAGE_SHIFT];
 }
 
 /**
@@ -113,13 +128,81 @@ kva2page(void *va)
 
 /** Fill the allocated page block with zeros. */ 
 #define PAGE_ALLOC_ZERO   (1 << 0)
+/** Fail instead of reclaiming memory if no free block is available. */
+#define PAGE_ALLOC_NORECLAIM  (1 << 1)
+
+/**
+ * Shrinker is a callback used by the page allocator to reclaim memory held by
+ * caches when it runs out of free pages.
+ *
+ * The callback can be invoked from any context with arbitrary locks held, so
+ * it must not sleep and must only use non-blocking lock acquisitions.
+ */
+struct PageShrinker {
+  /** Link into the list of registered shrinkers. */
+  struct KListLink link;
+  /** Shrinker name (for debugging purposes). */
+  const char      *name;
+  /** Free the cached memory, return the number of pages released. */
+  unsigned long  (*shrink)(void);
+};
+
+void         page_shrinker_register(struct PageShrinker *);
+
+/**
+ * Migrator is a callback used by the page allocator to move allocated pages
+ * out of a range of physical memory, so that the range can be merged into a
+ * larger free block (see page_compact()).
+ *
+ * The same restrictions as for shrinkers apply. Each vacated page has to be
+ * passed to page_compact_release() instead of being freed.
+ */
+struct PageMigrator {
+  /** Link into the list of registered migrators. */
+  struct KListLink link;
+  /** Migrator name (for debugging purposes). */
+  const char      *name;
+  /** Move pages out of the range, return the number of pages moved. */
+  unsigned long  (*migrate)(struct Page *, unsigned);
+};
+
+void         page_migrator_register(struct PageMigrator *);
+int          page_compact(unsigned);
+void         page_compact_release(struct Page *);
 
-void         page_init_low(void);
+void         page_init_low(physaddr_t);
 void         page_init_high(void);
+void         page_reserve(physaddr_t, physaddr_t);
+void         page_zero_init(void);
 struct Page *page_alloc_block(unsigned, int, int);
 void         page_free_block(struct Page *, unsigned);
 void         page_free_region(physaddr_t, physaddr_t);
 
+/**
+ * Page allocator statistics.
+ */
+struct PageStats {
+  /** The number of free blocks of each order */
+  unsigned free_blocks[PAGE_ORDER_MAX + 1];
+  /** Free single pages kept in the per-CPU caches */
+  unsigned cached;
+  /** Free pre-zeroed pages */
+  unsigned zeroed;
+  /** Allocated pages by tag, the last entry counts untagged pages */
+  unsigned tagged[PAGE_TAG_COUNT + 1];
+  /**
+   * Fragmentation index for each order: per mille of the free pages that lie
+   * in blocks too small for an allocation of that order
+   */
+  unsigned frag_index[PAGE_ORDER_MAX + 1];
+  /** Blocks rebuilt by compaction */
+  unsigned long compacted;
+  /** Pages moved by compaction */
+  unsigned long migrated;
+};
+
+void         page_get_stats(struct PageStats *);
+
 /**
  * Allocate a single page.
  * 
@@ -1,19 +1,28 @@
 #ifndef __KERNEL_INCLUDE_KERNEL_PIPE_H__
 #define __KERNEL_INCLUDE_KERNEL_PIPE_H__
 
+#include <kernel/poll.h>
 #include <kernel/waitqueue.h>
 #include <kernel/spinlock.h>
 
+#define PIPE_DEFAULT_ORDER  2     ///< Default buffer size: 16 KiB
+#define PIPE_MAX_ORDER      4     ///< Maximum buffer size: 64 KiB
+
 struct Pipe {
   struct KSpinLock lock;
   char              *data;
+  unsigned           order;     ///< Page block order of the buffer
+  size_t             capacity;  ///< Buffer size in bytes
   int                read_open;
   int                write_open;
   size_t             read_pos;
   size_t             write_pos;
   size_t             size;
+  int                reading;   ///< A splice is reading the buffer unlocked
+  int                writing;   ///< A splice is filling the buffer unlocked
   struct KWaitQueue read_queue;
   struct KWaitQueue write_queue;
+  struct PollQueue  poll_queue;
 };
 
 void    pipe_init(void);
@@ -22,5 +31,11 @@ int     pipe_close(struct File *);
 ssize_t pipe_read(struct File *, uintptr_t, size_t);
 ssize_t pipe_write(struct File *, uintptr_t, size_t);
 int     pipe_stat(struct File *, struct stat *);
+int     pipe_poll(struct File *, struct PollEntry *);
+int     pipe_get_size(struct File *);
+int     pipe_set_size(struct File *, int);
+ssize_t pipe_splice_from(struct File *, struct File *, size_t);
+ssize_t pipe_splice_to(struct File *, struct File *, size_t);
+ssize_t pipe_tee(struct File *, struct File *, size_t);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_PIPE_H__
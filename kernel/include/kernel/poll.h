@@ -0,0 +1,52 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_POLL_H__
+#define __KERNEL_INCLUDE_KERNEL_POLL_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <poll.h>
+
+#include <kernel/core/list.h>
+#include <kernel/spinlock.h>
+
+/**
+ * Poll queue is embedded into every object that can be waited for using
+ * poll(), select() or epoll. Unlike wait queues, which hold sleeping threads
+ * directly, poll queues hold entries that invoke a callback when the state of
+ * the object changes, so that a single thread can wait for many objects at
+ * once.
+ */
+struct PollQueue {
+  /** Protects the list of entries. */
+  struct KSpinLock  lock;
+  /** The registered entries. */
+  struct KListLink  entries;
+};
+
+struct PollEntry;
+
+/** Poll entry callback, receives the events that may have become pending. */
+typedef void (*PollNotify)(struct PollEntry *, int);
+
+/**
+ * Registration of an interested party on a poll queue.
+ */
+struct PollEntry {
+  /** Link into the list of queue entries. */
+  struct KListLink  link;
+  /** The queue this entry is registered on, or NULL. */
+  struct PollQueue *queue;
+  /** The function to call when the object state changes. */
+  PollNotify        notify;
+};
+
+void poll_queue_init(struct PollQueue *);
+void poll_queue_add(struct PollQueue *, struct PollEntry *);
+void poll_queue_notify(struct PollQueue *, int);
+void poll_entry_init(struct PollEntry *, PollNotify);
+void poll_entry_remove(struct PollEntry *);
+
+int  poll_fds(struct pollfd *, nfds_t, long);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_POLL_H__
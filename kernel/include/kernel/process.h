@@ -27,12 +27,17 @@ struct Inode;
 struct Process;
 struct PathNode;
 struct Signal;
+struct VMSpace;
+struct VMSpaceAreaInfo;
 
 struct FileDesc {
   struct File *file;
   int          flags;
 };
 
+/** The number of file descriptors stored in the process descriptor itself */
+#define FD_INLINE   16
+
 /**
  * Process descriptor.
  */
@@ -41,8 +46,16 @@ struct Process {
   /** The process' address space */
   struct VMSpace        *vm;
 
-  /** Main process thread */
+  /** Main process thread (any of the threads, if the main one has exited) */
   struct KThread        *thread;
+  /** All threads sharing the address space and the descriptor table */
+  struct KListLink      threads;
+  /** The number of threads in the list above */
+  int                   thread_count;
+  /** If not NULL, all threads except this one are being terminated */
+  struct KThread       *single_thread;
+  /** Queue to sleep waiting for the other threads to exit */
+  struct KWaitQueue     thread_queue;
 
   /** Unique thread identifier */
   pid_t                 pid;
@@ -57,11 +70,19 @@ struct Process {
   struct KListLink      children;
   /** Link into the siblings list */
   struct KListLink      sibling_link;
+  /** Children that have exited and wait to be reaped */
+  struct KListLink      zombies;
+  /** Link into the parent's list of zombie children */
+  struct KListLink      zombie_link;
   struct tms            times;
   char                  name[64];
 
   /** Queue to sleep waiting for children */
   struct KWaitQueue     wait_queue;
+  /** The parent suspended in vfork() while this process borrows its VM */
+  struct Process       *vfork_parent;
+  /** Queue to sleep waiting for a vfork() child to exec or exit */
+  struct KWaitQueue     vfork_queue;
   /** Whether the process is a zombie */
   int                   state;
   /** Exit code */
@@ -87,16 +108,29 @@ struct Process {
 
   /** Current working directory */
   struct PathNode      *cwd;
-
-  /** Open file descriptors */
-  struct FileDesc       fd[OPEN_MAX];
+  /** Inode locked for reading while its data is copied out */
+  struct Inode         *shared_inode;
+
+  /** Open file descriptors (either fd_inline or a heap array) */
+  struct FileDesc      *fd;
+  /** The number of entries in the descriptor table */
+  int                   fd_size;
+  /** One more than the highest open file descriptor */
+  int                   fd_end;
+  /** Storage for the lowest numbered file descriptors */
+  struct FileDesc       fd_inline[FD_INLINE];
   /** Lock protecting the file descriptors */
   struct KSpinLock      fd_lock;
 
+  /** Interval timers, in ticks (see setitimer()) */
   struct {
-    struct itimerval value;
-    struct KTimer    timer;
+    /** Time until expiration, 0 if disarmed (unused for ITIMER_REAL) */
+    unsigned long remain;
+    /** Time to reload on expiration, 0 for a one-shot timer */
+    unsigned long interval;
   } itimers[3];
+  /** Drives ITIMER_REAL, the others count process execution time */
+  struct KTimer         itimer_real;
 };
 
 enum {
@@ -110,6 +144,31 @@ enum {
   PROCESS_STATUS_AVAILABLE = (1 << 0),
 };
 
+/** A snapshot of the scheduling state of a process */
+struct ProcessStats {
+  /** Process ID */
+  pid_t    pid;
+  /** Parent process ID, 0 for the first process */
+  pid_t    ppid;
+  /** Process group ID */
+  pid_t    pgid;
+  /** Effective user and group IDs */
+  uid_t    uid;
+  gid_t    gid;
+  /** One of PROCESS_STATE_* */
+  int      state;
+  /** The number of threads */
+  int      threads;
+  /** The scheduling policy and the kernel priority of the main thread */
+  int      policy;
+  int      priority;
+  /** User and system times, in ticks */
+  clock_t  utime;
+  clock_t  stime;
+  /** Process name */
+  char     name[16];
+};
+
 static inline struct Process *
 process_current(void)
 {
@@ -126,12 +185,21 @@ void           process_free(struct Process *);
 pid_t          process_copy(int);
 pid_t          process_wait(pid_t, int *, int);
 int            process_exec(const char *, uintptr_t, uintptr_t);
-void          *process_grow(ptrdiff_t);
 void           process_update_times(struct Process *, clock_t, clock_t);
 void           process_get_times(struct Process *, struct tms *);
 pid_t          process_get_gid(pid_t);
 int            process_set_gid(pid_t, pid_t);
+int            process_set_sched(pid_t, int, int);
+int            process_get_sched(pid_t, int *, int *, unsigned *);
+int            process_set_affinity(pid_t, unsigned);
+int            process_get_affinity(pid_t, unsigned *);
+unsigned       process_get_stats(struct ProcessStats *, unsigned);
+int            process_get_pid_stats(pid_t, struct ProcessStats *);
+int            process_get_areas(pid_t, struct VMSpaceAreaInfo *, unsigned);
 int            process_match_pid(struct Process *, pid_t);
 int            process_set_itimer(int, struct itimerval *, struct itimerval *);
+int            process_thread_create(uintptr_t, uintptr_t, uintptr_t, uintptr_t);
+void           process_thread_exit(uintptr_t);
+void           process_thread_check_exit(void);
 
 #endif  // __KERNEL_INCLUDE_KERNEL_PROCESS_H__
@@ -0,0 +1,24 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_PROF_H__
+#define __KERNEL_INCLUDE_KERNEL_PROF_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/prof.h
+ *
+ * Sampling profiler.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+void   prof_init(void);
+void   prof_start(unsigned);
+void   prof_stop(void);
+void   prof_reset(void);
+void   prof_tick(uintptr_t, int);
+size_t prof_report(char *, size_t);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_PROF_H__
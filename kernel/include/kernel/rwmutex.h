@@ -0,0 +1,67 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_RWMUTEX_H__
+#define __KERNEL_INCLUDE_KERNEL_RWMUTEX_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <kernel/core/list.h>
+#include <kernel/spinlock.h>
+
+struct KThread;
+
+/**
+ * Reader-writer mutex is a sleeping lock that can be held by any number of
+ * readers at the same time, or by a single writer. Waiting writers take
+ * precedence over new readers.
+ *
+ * Reader-writer mutexes are used to protect read-mostly data if the holding
+ * time is long or if the task needs to sleep while holding the lock. Unlike
+ * KMutex, they do not boost the priority of the lock holders.
+ */
+struct KRWMutex {
+  int               type;
+  int               flags;
+  /** Protects the fields below. */
+  struct KSpinLock  lock;
+  /** The number of tasks holding the mutex for reading. */
+  int               readers;
+  /** The task holding the mutex for writing. */
+  struct KThread   *writer;
+  /** The number of tasks waiting for the mutex to be available for writing. */
+  int               writers_waiting;
+  /** List of tasks waiting for this mutex to be available for reading. */
+  struct KListLink  read_queue;
+  /** List of tasks waiting for this mutex to be available for writing. */
+  struct KListLink  write_queue;
+  /** Mutex name (for debugging purposes). */
+  const char       *name;
+};
+
+#define K_RWMUTEX_TYPE    0x52574D58  // {'R','W','M','X'}
+#define K_RWMUTEX_STATIC  (1 << 0)
+
+void             k_rwmutex_system_init(void);
+void             k_rwmutex_init(struct KRWMutex *, const char *);
+void             k_rwmutex_fini(struct KRWMutex *);
+struct KRWMutex *k_rwmutex_create(const char *);
+void             k_rwmutex_destroy(struct KRWMutex *);
+int              k_rwmutex_timed_read_lock(struct KRWMutex *, unsigned long);
+int              k_rwmutex_read_unlock(struct KRWMutex *);
+int              k_rwmutex_timed_write_lock(struct KRWMutex *, unsigned long);
+int              k_rwmutex_write_unlock(struct KRWMutex *);
+int              k_rwmutex_write_holding(struct KRWMutex *);
+
+static inline int
+k_rwmutex_read_lock(struct KRWMutex *mutex)
+{
+  return k_rwmutex_timed_read_lock(mutex, 0);
+}
+
+static inline int
+k_rwmutex_write_lock(struct KRWMutex *mutex)
+{
+  return k_rwmutex_timed_write_lock(mutex, 0);
+}
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_RWMUTEX_H__
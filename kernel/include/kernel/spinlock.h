@@ -12,6 +12,39 @@ struct KCpu;
 /** The maximum depth of call stack that could be recorded by a spinlock */
 #define SPIN_MAX_PCS  10
 
+/**
+ * The lock word of a ticket spinlock. The low half holds the number of the
+ * ticket currently being served, the high half holds the next ticket to be
+ * handed out. The lock is free when both halves are equal.
+ */
+#define K_SPINLOCK_OWNER(tickets)   ((tickets) & 0xFFFF)
+#define K_SPINLOCK_NEXT(tickets)    ((tickets) >> 16)
+#define K_SPINLOCK_TICKET           (1U << 16)
+
+#ifdef K_SPINLOCK_STATS
+
+/**
+ * Spinlock contention statistics.
+ */
+struct KSpinLockStats {
+  /** The number of times the lock was acquired */
+  unsigned long     acquisitions;
+  /** The number of acquisitions that had to wait for the lock */
+  unsigned long     contentions;
+  /** The total number of wait loop iterations */
+  unsigned long     spins;
+  /** The longest time the lock was held (in CPU cycles) */
+  uint32_t          max_hold;
+  /** The cycle counter value at the time the lock was acquired */
+  uint32_t          acquired_at;
+  /** Whether the lock is on the list of locks reported by the monitor */
+  int               registered;
+  /** Link into the list of reported locks */
+  struct KSpinLock *next;
+};
+
+#endif  // K_SPINLOCK_STATS
+
 /**
  * Spinlocks provide mutual exclusion, ensuring only one CPU at a time can hold
  * the lock. A task trying to acquire the lock waits in a loop repeatedly
@@ -19,10 +52,12 @@ struct KCpu;
  *
  * Spinlocks are used if the holding time is short or if the data to be
  * protected is accessed from an interrupt handler context.
+ *
+ * The lock is granted to the waiting CPUs in FIFO order.
  */
 struct KSpinLock {
-  /** Whether the spinlock is held */
-  volatile int  locked;
+  /** The lock word (see K_SPINLOCK_OWNER and K_SPINLOCK_NEXT) */
+  volatile uint32_t tickets;
 
   /** The CPU holding this spinlock */
   struct KCpu   *cpu;
@@ -30,27 +65,88 @@ struct KSpinLock {
   const char   *name;
   /** Saved call stack (an array of program counters) that locked the lock */
   uintptr_t     pcs[SPIN_MAX_PCS];
+
+#ifdef K_SPINLOCK_STATS
+  /** Contention statistics */
+  struct KSpinLockStats stats;
+#endif
 };
 
+#ifdef K_SPINLOCK_STATS
+#define K_SPINLOCK_STATS_INITIALIZER  , .stats = { .registered = 0 }
+#else
+#define K_SPINLOCK_STATS_INITIALIZER
+#endif
+
 /**
  * Initialize a static spinlock.
  * 
  * @param name The name of the spinlock
  */
 #define K_SPINLOCK_INITIALIZER(spin_name) { \
-  .locked = 0,                        \
-  .cpu    = NULL,                     \
-  .name   = (spin_name),              \
-  .pcs    = { 0 }                     \
+  .tickets = 0,                       \
+  .cpu     = NULL,                    \
+  .name    = (spin_name),             \
+  .pcs     = { 0 }                    \
+  K_SPINLOCK_STATS_INITIALIZER        \
+}
+
+/**
+ * Reader-writer spinlocks allow any number of CPUs to hold the lock for
+ * reading at the same time, or a single CPU to hold it for writing. Once a
+ * writer starts waiting for the lock, new readers are held back until it gets
+ * its turn.
+ *
+ * Reader-writer spinlocks are used to protect read-mostly data. They are not
+ * recursive: a CPU must not acquire a lock for reading that it is already
+ * holding.
+ */
+struct KRWSpinLock {
+  /** The lock word: the number of readers and the writer bits */
+  volatile uint32_t state;
+
+  /** The CPU holding this lock for writing */
+  struct KCpu      *writer;
+  /** Lock name (for debugging purposes) */
+  const char       *name;
+};
+
+/** The lock is held by a writer */
+#define K_RWSPINLOCK_WRITER   (1U << 31)
+/** A writer is waiting for the lock */
+#define K_RWSPINLOCK_PENDING  (1U << 30)
+/** Mask for the number of readers holding the lock */
+#define K_RWSPINLOCK_READERS  (K_RWSPINLOCK_PENDING - 1)
+
+/**
+ * Initialize a static reader-writer spinlock.
+ * 
+ * @param name The name of the lock
+ */
+#define K_RWSPINLOCK_INITIALIZER(lock_name) { \
+  .state  = 0,                          \
+  .writer = NULL,                       \
+  .name   = (lock_name),                \
 }
 
 void k_spinlock_init(struct KSpinLock *, const char *);
 void k_spinlock_acquire(struct KSpinLock *);
+int  k_spinlock_try_acquire(struct KSpinLock *);
 void k_spinlock_release(struct KSpinLock *);
 int  k_spinlock_holding(struct KSpinLock *);
+void k_spinlock_print_stats(void);
+
+void k_rwspinlock_init(struct KRWSpinLock *, const char *);
+void k_rwspinlock_read_acquire(struct KRWSpinLock *);
+int  k_rwspinlock_try_read_acquire(struct KRWSpinLock *);
+void k_rwspinlock_read_release(struct KRWSpinLock *);
+void k_rwspinlock_write_acquire(struct KRWSpinLock *);
+void k_rwspinlock_write_release(struct KRWSpinLock *);
+int  k_rwspinlock_write_holding(struct KRWSpinLock *);
 
-void k_arch_spinlock_acquire(volatile int *);
-void k_arch_spinlock_release(volatile int *);
+unsigned long k_arch_spinlock_acquire(volatile uint32_t *);
+int           k_arch_spinlock_try_acquire(volatile uint32_t *);
+void          k_arch_spinlock_release(volatile uint32_t *);
 void k_arch_spinlock_save_callstack(struct KSpinLock *);
 void k_arch_spinlock_print_callstack(struct KSpinLock *);
 
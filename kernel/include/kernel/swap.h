@@ -0,0 +1,53 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_SWAP_H__
+#define __KERNEL_INCLUDE_KERNEL_SWAP_H__
+
+/**
+ * @file include/swap.h
+ *
+ * Swapping anonymous pages out to a block device.
+ */
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <stddef.h>
+
+struct Page;
+
+/** The number of pages written out together, in adjacent slots */
+#define SWAP_CLUSTER  16
+
+/**
+ * A run of adjacent swap slots being filled with pages and written out.
+ */
+struct SwapCluster {
+  /** The first slot of the run */
+  unsigned long first;
+  /** The number of slots in the run */
+  unsigned      size;
+  /** The number of slots filled so far */
+  unsigned      count;
+  /** The pages being written, no longer mapped anywhere */
+  struct Page  *pages[SWAP_CLUSTER];
+};
+
+/**
+ * Swap usage statistics.
+ */
+struct SwapStats {
+  unsigned long total;      ///< The number of slots
+  unsigned long used;       ///< Slots referred to by page table entries
+  unsigned long out;        ///< Pages written out
+  unsigned long in;         ///< Pages read back
+  unsigned long clusters;   ///< Write requests
+};
+
+void swap_init(void);
+void swap_get_stats(struct SwapStats *);
+void swap_cluster_add(struct SwapCluster *, struct Page *);
+int  swap_read(unsigned long, struct Page **);
+void swap_dup(unsigned long);
+void swap_free(unsigned long);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_SWAP_H__
@@ -7,71 +7,114 @@
 
 #include <stdint.h>
 
+/** The maximum number of system call arguments */
+#define SYS_MAX_ARGS  6
+
 int     sys_arch_get_num(void);
-int32_t sys_arch_get_arg(int);
+void    sys_arch_get_args(int32_t *);
 
 int32_t sys_dispatch(void);
 
-int32_t sys_read(void);
-int32_t sys_write(void);
-int32_t sys_exit(void);
-int32_t sys_getpid(void);
-int32_t sys_getppid(void);
-int32_t sys_clock_time(void);
-int32_t sys_fork(void);
-int32_t sys_wait(void);
-int32_t sys_exec(void);
-int32_t sys_open(void);
-int32_t sys_fcntl(void);
-int32_t sys_seek(void);
-int32_t sys_umask(void);
-int32_t sys_chdir(void);
-int32_t sys_fchdir(void);
-int32_t sys_getdents(void);
-int32_t sys_link(void);
-int32_t sys_unlink(void);
-int32_t sys_rmdir(void);
-int32_t sys_stat(void);
-int32_t sys_close(void);
-int32_t sys_sbrk(void);
-int32_t sys_mknod(void);
-int32_t sys_uname(void);
-int32_t sys_chmod(void);
-int32_t sys_socket(void);
-int32_t sys_bind(void);
-int32_t sys_connect(void);
-int32_t sys_listen(void);
-int32_t sys_accept(void);
-int32_t sys_test(void);
-int32_t sys_fchmod(void);
-int32_t sys_sigaction(void);
-int32_t sys_sigreturn(void);
-int32_t sys_nanosleep(void);
-int32_t sys_recvfrom(void);
-int32_t sys_sendto(void);
-int32_t sys_setsockopt(void);
-int32_t sys_getuid(void);
-int32_t sys_geteuid(void);
-int32_t sys_getgid(void);
-int32_t sys_getegid(void);
-int32_t sys_getpgid(void);
-int32_t sys_setpgid(void);
-int32_t sys_access(void);
-int32_t sys_pipe(void);
-int32_t sys_ioctl(void);
-int32_t sys_mmap(void);
-int32_t sys_select(void);
-int32_t sys_sigpending(void);
-int32_t sys_sigprocmask(void);
-int32_t sys_sigsuspend(void);
-int32_t sys_kill(void);
-int32_t sys_fsync(void);
-int32_t sys_ftruncate(void);
-int32_t sys_fchown(void);
-int32_t sys_readlink(void);
-int32_t sys_times(void);
-int32_t sys_mount(void);
-int32_t sys_gethostbyname(void);
-int32_t sys_setitimer(void);
+int32_t sys_read(const int32_t *);
+int32_t sys_write(const int32_t *);
+int32_t sys_exit(const int32_t *);
+int32_t sys_getpid(const int32_t *);
+int32_t sys_getppid(const int32_t *);
+int32_t sys_clock_time(const int32_t *);
+int32_t sys_fork(const int32_t *);
+int32_t sys_wait(const int32_t *);
+int32_t sys_exec(const int32_t *);
+int32_t sys_open(const int32_t *);
+int32_t sys_fcntl(const int32_t *);
+int32_t sys_seek(const int32_t *);
+int32_t sys_umask(const int32_t *);
+int32_t sys_chdir(const int32_t *);
+int32_t sys_fchdir(const int32_t *);
+int32_t sys_getdents(const int32_t *);
+int32_t sys_link(const int32_t *);
+int32_t sys_unlink(const int32_t *);
+int32_t sys_rmdir(const int32_t *);
+int32_t sys_stat(const int32_t *);
+int32_t sys_close(const int32_t *);
+int32_t sys_sbrk(const int32_t *);
+int32_t sys_mknod(const int32_t *);
+int32_t sys_uname(const int32_t *);
+int32_t sys_chmod(const int32_t *);
+int32_t sys_socket(const int32_t *);
+int32_t sys_bind(const int32_t *);
+int32_t sys_connect(const int32_t *);
+int32_t sys_listen(const int32_t *);
+int32_t sys_accept(const int32_t *);
+int32_t sys_test(const int32_t *);
+int32_t sys_fchmod(const int32_t *);
+int32_t sys_sigaction(const int32_t *);
+int32_t sys_sigreturn(const int32_t *);
+int32_t sys_nanosleep(const int32_t *);
+int32_t sys_recvfrom(const int32_t *);
+int32_t sys_sendto(const int32_t *);
+int32_t sys_setsockopt(const int32_t *);
+int32_t sys_getuid(const int32_t *);
+int32_t sys_geteuid(const int32_t *);
+int32_t sys_getgid(const int32_t *);
+int32_t sys_getegid(const int32_t *);
+int32_t sys_getpgid(const int32_t *);
+int32_t sys_setpgid(const int32_t *);
+int32_t sys_access(const int32_t *);
+int32_t sys_pipe(const int32_t *);
+int32_t sys_ioctl(const int32_t *);
+int32_t sys_mmap(const int32_t *);
+int32_t sys_mprotect(const int32_t *);
+int32_t sys_munmap(const int32_t *);
+int32_t sys_select(const int32_t *);
+int32_t sys_sigpending(const int32_t *);
+int32_t sys_sigprocmask(const int32_t *);
+int32_t sys_sigsuspend(const int32_t *);
+int32_t sys_kill(const int32_t *);
+int32_t sys_fsync(const int32_t *);
+int32_t sys_ftruncate(const int32_t *);
+int32_t sys_fchown(const int32_t *);
+int32_t sys_readlink(const int32_t *);
+int32_t sys_times(const int32_t *);
+int32_t sys_mount(const int32_t *);
+int32_t sys_gethostbyname(const int32_t *);
+int32_t sys_setitimer(const int32_t *);
+int32_t sys_sync(const int32_t *);
+int32_t sys_splice(const int32_t *);
+int32_t sys_tee(const int32_t *);
+int32_t sys_sendfile(const int32_t *);
+int32_t sys_poll(const int32_t *);
+int32_t sys_epoll_create(const int32_t *);
+int32_t sys_epoll_ctl(const int32_t *);
+int32_t sys_epoll_wait(const int32_t *);
+int32_t sys_readv(const int32_t *);
+int32_t sys_writev(const int32_t *);
+int32_t sys_pread(const int32_t *);
+int32_t sys_pwrite(const int32_t *);
+int32_t sys_preadv(const int32_t *);
+int32_t sys_pwritev(const int32_t *);
+int32_t sys_getsockopt(const int32_t *);
+int32_t sys_clone(const int32_t *);
+int32_t sys_thread_exit(const int32_t *);
+int32_t sys_futex(const int32_t *);
+int32_t sys_sched_yield(const int32_t *);
+int32_t sys_ring_enter(const int32_t *);
+int32_t sys_perf_ctl(const int32_t *);
+int32_t sys_msync(const int32_t *);
+int32_t sys_madvise(const int32_t *);
+int32_t sys_fstatat(const int32_t *);
+int32_t sys_channel_create(const int32_t *);
+int32_t sys_channel_destroy(const int32_t *);
+int32_t sys_connect_attach(const int32_t *);
+int32_t sys_connect_detach(const int32_t *);
+int32_t sys_msg_send(const int32_t *);
+int32_t sys_msg_receive(const int32_t *);
+int32_t sys_msg_reply(const int32_t *);
+int32_t sys_sched_setscheduler(const int32_t *);
+int32_t sys_sched_getscheduler(const int32_t *);
+int32_t sys_sched_getparam(const int32_t *);
+int32_t sys_sched_rr_get_interval(const int32_t *);
+int32_t sys_sched_setaffinity(const int32_t *);
+int32_t sys_sched_getaffinity(const int32_t *);
+int32_t sys_set_tls(const int32_t *);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_SYSCALL_H__
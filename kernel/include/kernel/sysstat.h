@@ -0,0 +1,54 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_SYSSTAT_H__
+#define __KERNEL_INCLUDE_KERNEL_SYSSTAT_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/sysstat.h
+ *
+ * System call latency statistics.
+ */
+
+#include <stdint.h>
+#include <sys/sysstat.h>
+
+#include <kernel/core/cpu.h>
+
+extern volatile int sysstat_enabled;
+
+void sysstat_init(void);
+void _sysstat_record(unsigned, unsigned, uint32_t);
+
+/**
+ * Remember when a system call started.
+ *
+ * @param cpu    Where to store the ID of the CPU
+ * @param cycles Where to store the cycle counter
+ */
+static inline void
+sysstat_begin(unsigned *cpu, uint32_t *cycles)
+{
+  if (__builtin_expect(sysstat_enabled, 0)) {
+    *cpu    = k_cpu_id();
+    *cycles = k_cpu_cycles();
+  }
+}
+
+/**
+ * Account for a finished system call.
+ *
+ * @param num    The system call number
+ * @param cpu    The CPU stored by sysstat_begin()
+ * @param cycles The cycle counter stored by sysstat_begin()
+ */
+static inline void
+sysstat_end(unsigned num, unsigned cpu, uint32_t cycles)
+{
+  // Only if the collection was already running when the call started
+  if (__builtin_expect(sysstat_enabled, 0) && (cpu < K_CPU_MAX))
+    _sysstat_record(num, cpu, cycles);
+}
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_SYSSTAT_H__
@@ -6,12 +6,29 @@
 #endif
 
 #include <limits.h>
+#include <sched.h>
 #include <stdint.h>
+#include <sys/perf.h>
 
+#include <kernel/core/hrtimer.h>
 #include <kernel/core/tick.h>
 #include <arch/context.h>
 
 #define THREAD_MAX_PRIORITIES  (2 * NZERO)
+/** The number of 32-bit words in a bitmap with one bit per priority */
+#define THREAD_PRIORITY_WORDS  ((THREAD_MAX_PRIORITIES + 31) / 32)
+
+/**
+ * Real-time threads (SCHED_FIFO and SCHED_RR) use the priorities between the
+ * kernel service threads (0) and the normal user threads (NZERO).
+ */
+#define THREAD_RT_PRIORITY_MIN  1
+#define THREAD_RT_PRIORITY_MAX  (NZERO - 1)
+
+/** The time slice of SCHED_RR threads, in ticks */
+#ifndef THREAD_RR_TICKS
+#define THREAD_RR_TICKS         10
+#endif
 
 enum {
   THREAD_STATE_NONE = 0,
@@ -26,6 +43,29 @@ enum {
 enum {
   THREAD_FLAG_RESCHEDULE = (1 << 0),
   THREAD_FLAG_DESTROY    = (1 << 1),
+  THREAD_FLAG_INTERRUPT  = (1 << 2),
+};
+
+/** Load averages are fixed-point numbers with this many fractional bits */
+#define K_LOAD_SHIFT  11
+
+/**
+ * Per-CPU usage counters. The times are in ticks, each tick being charged to
+ * the state the processor was interrupted in.
+ */
+struct KCpuStats {
+  /** Running user code */
+  unsigned long user;
+  /** Running kernel code, on behalf of a process or in a kernel thread */
+  unsigned long system;
+  /** Running an interrupt handler or an interrupt thread */
+  unsigned long irq;
+  /** With nothing to run */
+  unsigned long idle;
+  /** The number of threads switched to */
+  unsigned long switches;
+  /** The average number of ready and running threads over the last minute */
+  unsigned long runq_avg;
 };
 
 struct KObjectPool;
@@ -48,10 +88,21 @@ struct KThread {
   int               saved_priority;
   /** Various flags */
   int               flags;
-  /** CPU */
+  /** Scheduling policy (SCHED_OTHER, SCHED_FIFO or SCHED_RR) */
+  int               policy;
+  /** Ticks left in the current time slice */
+  unsigned          ticks_left;
+  /** The set of CPUs allowed to run this thread, one bit per CPU */
+  unsigned          affinity;
+  /** The CPU running this thread or holding it in its run queue */
   struct KCpu       *cpu;
 
+  /** Owned mutexes that other threads are waiting for */
   struct KListLink   owned_mutexes;
+  /** The number of such mutexes at each mutex priority */
+  uint16_t           inherited_count[THREAD_MAX_PRIORITIES];
+  /** The priorities with non-zero counts, the highest in the top bit */
+  uint32_t           inherited_bitmap[THREAD_PRIORITY_WORDS];
   struct KMutex     *sleep_on_mutex;
 
   /** Bottom of the kernel-mode stack */
@@ -68,16 +119,43 @@ struct KThread {
 
   /** Timer for timeouts */
   struct KTimeout timer;
+  /** Timer for sub-tick timeouts (see _k_sched_sleep_ns) */
+  struct KHrTimer   hrtimer;
+  /** Whether sleeping with hrtimer running */
+  int               sleep_hrtimer;
   /** Value that indicated sleep result */
   int               sleep_result;
+  /** Whether sleeping as an exclusive waiter (see k_waitqueue_wakeup) */
+  int               sleep_exclusive;
+  /** Message buffer of a thread blocked on a mailbox */
+  void             *sleep_data;
   int               err;
 
   /** Tne process this thread belongs to */
   struct Process   *process;
+  /** Link into the list of the process threads */
+  struct KListLink  process_link;
+  /** User-mode thread pointer (see pthread_self) */
+  uintptr_t         tls;
+  /** Depth of the nested filesystem journal handles held by the thread */
+  unsigned          journal_handles;
+
+  /** Whether the performance counters are enabled (see perf_ctl) */
+  int               perf_enabled;
+  /** The performance counters accumulated while the thread was running */
+  uint64_t          perf[PERF_COUNTER_MAX];
+
+  /** Saved VFP/NEON registers */
+  struct FPUContext fpu;
 };
 
 void            arch_thread_init_stack(struct KThread *, void (*)(void));
 void            arch_thread_idle(void);
+void            arch_thread_load_tls(struct KThread *);
+void            arch_thread_perf_start(struct KThread *);
+void            arch_thread_perf_stop(struct KThread *);
+void            arch_thread_fpu_stop(struct KThread *);
+void            arch_thread_fpu_copy(struct KThread *, struct KThread *);
 
 struct KThread *k_thread_current(void);
 struct KThread *k_thread_create(struct Process *, void (*)(void *), void *, int);
@@ -85,10 +163,16 @@ void            k_thread_exit(void);
 int             k_thread_resume(struct KThread *);
 void            k_thread_suspend(void);
 void            k_thread_yield(void);
+void            k_thread_set_sched(struct KThread *, int, int);
+unsigned        k_thread_timeslice(struct KThread *);
+int             k_thread_set_affinity(struct KThread *, unsigned);
+unsigned        k_thread_get_affinity(struct KThread *);
 void            thread_cleanup(struct KThread *);
 void            k_thread_interrupt(struct KThread *);
 
 void            k_sched_init(void);
 void            k_sched_start(void);
+int             k_sched_get_stats(unsigned, struct KCpuStats *);
+void            k_sched_get_loadavg(unsigned long *);
 
 #endif  // __KERNEL_INCLUDE_KERNEL_THREAD_H__
@@ -1,8 +1,13 @@
 #ifndef __KERNEL_INCLUDE_KERNEL_TIME_H__
 #define __KERNEL_INCLUDE_KERNEL_TIME_H__
 
+#include <stdint.h>
 #include <sys/types.h>
 
+struct Page;
+
+extern struct Page *time_page;
+
 /** The number of ticks per one second */
 #define TICKS_PER_SECOND    100
 /** The number of milliseconds in one tick */
@@ -11,15 +16,33 @@
 #define US_PER_TICK         10000
 /** The number of nanoseconds in one tick */
 #define NS_PER_TICK         10000000
+/** The number of nanoseconds in one second */
+#define NS_PER_SECOND       1000000000ULL
+
+/**
+ * A free-running counter that measures the time between ticks.
+ */
+struct ClockSource {
+  /** Read the counter */
+  uint64_t (*read)(void);
+  /** The counter bits, narrower counters wrap around */
+  uint64_t   mask;
+  /** Counter frequency, in Hz */
+  uint32_t   freq;
+  /** How user programs can read the counter (TP_COUNTER_*) */
+  uint32_t   user;
+};
 
 void   arch_time_init(void);
 time_t arch_get_time_seconds(void);
+struct ClockSource *arch_clock_source(void);
 
-time_t time_get_seconds(void);
-void   time_init(void);
-void   time_tick(void);
-int    time_get(clockid_t, struct timespec *);
-int    time_nanosleep(struct timespec *, struct timespec *);
+time_t   time_get_seconds(void);
+void     time_init(void);
+void     time_tick(void);
+uint64_t time_monotonic(void);
+int      time_get(clockid_t, struct timespec *);
+int      time_nanosleep(struct timespec *, struct timespec *);
 
 static inline unsigned long long
 ms2ticks(unsigned long long ms)
@@ -39,6 +62,13 @@ timeval2ticks(const struct timeval *tv)
   return tv->tv_sec * TICKS_PER_SECOND + tv->tv_usec / US_PER_TICK;
 }
 
+static inline void
+ticks2timeval(unsigned long long ticks, struct timeval *tv)
+{
+  tv->tv_sec  = ticks / TICKS_PER_SECOND;
+  tv->tv_usec = (ticks % TICKS_PER_SECOND) * US_PER_TICK;
+}
+
 static inline unsigned long long
 seconds2ticks(unsigned long long seconds)
 {
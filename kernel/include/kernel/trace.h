@@ -0,0 +1,41 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_TRACE_H__
+#define __KERNEL_INCLUDE_KERNEL_TRACE_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kernel/trace.h
+ *
+ * Static tracepoints.
+ */
+
+#include <stdint.h>
+#include <sys/trace.h>
+
+extern volatile int trace_enabled;
+
+void trace_init(void);
+void trace_start(void);
+void trace_stop(void);
+void trace_clear(void);
+void trace_print(unsigned);
+void _trace_record(unsigned, uint32_t, uint32_t);
+
+/**
+ * Record an event if tracing is enabled. Costs a single load and a branch
+ * otherwise.
+ *
+ * @param type The event type (see sys/trace.h)
+ * @param arg0 The first argument of the event
+ * @param arg1 The second argument of the event
+ */
+static inline void
+trace(unsigned type, uint32_t arg0, uint32_t arg1)
+{
+  if (__builtin_expect(trace_enabled, 0))
+    _trace_record(type, arg0, arg1);
+}
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_TRACE_H__
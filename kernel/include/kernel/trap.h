@@ -7,6 +7,5 @@ int  arch_trap_frame_init(struct TrapFrame *, uintptr_t, uintptr_t, uintptr_t, u
 void arch_trap_frame_pop(struct TrapFrame *);
 
 int timer_irq(int, void *);
-int ipi_irq(int, void *);
 
 #endif  // __KERNEL_INCLUDE_KERNEL_TRAP_H__
@@ -15,6 +15,7 @@
 #include <sys/types.h>
 #include <sys/termios.h>
 
+#include <kernel/poll.h>
 #include <kernel/spinlock.h>
 #include <kernel/waitqueue.h>
 #include <kernel/drivers/screen.h>
@@ -29,6 +30,7 @@ struct Tty {
     size_t              write_pos;
     struct KSpinLock    lock;
     struct KWaitQueue   queue;
+    struct PollQueue    poll_queue;
   } in;
   struct {
     struct Screen      *screen;
@@ -54,7 +56,8 @@ void    tty_process_input(struct Tty *, char *);
 ssize_t tty_read(dev_t, uintptr_t, size_t);
 ssize_t tty_write(dev_t, uintptr_t, size_t);
 int     tty_ioctl(dev_t, int, int);
-int     tty_select(dev_t, struct timeval *);
+int     tty_poll(dev_t, struct PollEntry *);
 void    tty_switch(int);
+void    tty_scroll(int);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_DRIVERS_CONSOLE_H__
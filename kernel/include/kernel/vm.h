@@ -19,8 +19,23 @@
 #define VM_USER       (1 << 4)
 #define VM_COW        (1 << 5)
 #define VM_PAGE       (1 << 6)
+#define VM_LAZY       (1 << 7)    ///< Reserved, allocated on first access
+#define VM_FILE       (1 << 8)    ///< Reserved, read from a file on first access
+#define VM_WC         (1 << 9)    ///< Uncached, but writes may be combined
+#define VM_SHARED     (1 << 10)   ///< Shared file mapping, written back to it
+#define VM_DIRTY      (1 << 11)   ///< Shared page written to since last synced
+#define VM_OLD        (1 << 12)   ///< Unmapped to notice the next access
+#define VM_SWAP       (1 << 13)   ///< Reserved, read back from the swap area
+
+/** Allocation order of the blocks mapped by a single section (1MB) */
+#define VM_SECTION_ORDER  8
+/** The number of bytes mapped by a section */
+#define VM_SECTION_SIZE   (PAGE_SIZE << VM_SECTION_ORDER)
+/** The number of bytes mapped by one page of second-level tables */
+#define VM_TABLE_SIZE     (2 * VM_SECTION_SIZE)
 
 struct Page;
+struct VMSpace;
 
 void        *arch_vm_create(void);
 void         arch_vm_destroy(void *);
@@ -29,30 +44,64 @@ int          arch_vm_pte_valid(void *);
 physaddr_t   arch_vm_pte_addr(void *);
 int          arch_vm_pte_flags(void *);
 void         arch_vm_pte_set(void *, physaddr_t, int);
+void         arch_vm_pte_set_flags(void *, int);
+void         arch_vm_pte_set_old(void *, int);
+void         arch_vm_pte_set_swap(void *, unsigned long, int);
+unsigned long arch_vm_pte_swap(void *);
 void         arch_vm_pte_clear(void *);
+int          arch_vm_section_lookup(void *, uintptr_t, physaddr_t *, int *);
+void         arch_vm_section_set(void *, uintptr_t, physaddr_t, int);
+void         arch_vm_section_clear(void *, uintptr_t);
+int          arch_vm_section_split(void *, uintptr_t);
+int          arch_vm_table_refs(void *, uintptr_t);
+void         arch_vm_table_share(void *, void *, uintptr_t);
+int          arch_vm_table_copy(void *, uintptr_t);
+void         arch_vm_table_detach(void *, uintptr_t);
 void         arch_vm_invalidate(uintptr_t);
+void         arch_vm_invalidate_all(void);
+void         arch_vm_invalidate_range(unsigned long, uintptr_t, uintptr_t);
+int          arch_vm_kernel_map(uintptr_t, physaddr_t, int);
+int          arch_vm_kernel_unmap(uintptr_t, physaddr_t *);
 void         arch_vm_init(void);
 void         arch_vm_init_percpu(void);
 void         arch_vm_load_kernel(void);
-void         arch_vm_load(void *);
+void         arch_vm_load(void *, unsigned long *);
 
-struct Page *vm_page_lookup(void *, uintptr_t, int *);
-int          vm_page_insert(void *, struct Page *, uintptr_t, int);
-int          vm_page_remove(void *, uintptr_t);
+void         vm_init(void);
+struct Page *vm_page_lookup(struct VMSpace *, uintptr_t, int *);
+int          vm_page_insert(struct VMSpace *, struct Page *, uintptr_t, int);
+int          vm_page_remove(struct VMSpace *, uintptr_t);
+int          vm_page_migrate(struct VMSpace *, uintptr_t, struct Page *,
+                             struct Page **);
+int          vm_page_age(struct VMSpace *, uintptr_t, unsigned long,
+                         struct Page **);
 
-int          vm_user_alloc(void *, uintptr_t, size_t, int);
-void         vm_user_free(void *, uintptr_t, size_t);
-int          vm_user_clone(void *, void *, uintptr_t, size_t, int);
+int          vm_user_alloc(struct VMSpace *, uintptr_t, size_t, int);
+int          vm_user_discard(struct VMSpace *, uintptr_t, size_t, int);
+int          vm_user_map(struct VMSpace *, struct Page *, uintptr_t, int);
+int          vm_user_copy(struct VMSpace *, uintptr_t, struct VMSpace *,
+                          uintptr_t, size_t);
+int          vm_user_share(struct VMSpace *, uintptr_t, struct VMSpace *,
+                           uintptr_t);
+int          vm_user_map_block(struct VMSpace *, struct Page *, unsigned,
+                               uintptr_t, int);
+void         vm_user_free(struct VMSpace *, uintptr_t, size_t);
+int          vm_user_clone(struct VMSpace *, struct VMSpace *, uintptr_t,
+                           size_t, int);
+void         vm_user_detach(struct VMSpace *, uintptr_t, size_t);
+int          vm_user_protect(struct VMSpace *, uintptr_t, size_t, int);
+int          vm_user_clean(struct VMSpace *, uintptr_t, struct Page **);
 
-int          vm_copy_out(void *, const void *, uintptr_t, size_t);
-int          vm_copy_in(void *, void *, uintptr_t, size_t);
-int          vm_clear(void *, uintptr_t, size_t);
+int          vm_copy_out(struct VMSpace *, const void *, uintptr_t, size_t);
+int          vm_copy_in(struct VMSpace *, void *, uintptr_t, size_t);
+int          vm_copy_in_str(struct VMSpace *, char *, uintptr_t, size_t, int);
+int          vm_clear(struct VMSpace *, uintptr_t, size_t);
 
-int          vm_user_check_str(void *, uintptr_t, size_t *, int);
-int          vm_user_check_ptr(void *, uintptr_t, int);
-int          vm_user_check_buf(void *, uintptr_t, size_t, int);
-int          vm_user_check_args(void *, uintptr_t, size_t *, int);
+int          vm_user_check_str(struct VMSpace *, uintptr_t, size_t *, int);
+int          vm_user_check_ptr(struct VMSpace *, uintptr_t, int);
+int          vm_user_check_buf(struct VMSpace *, uintptr_t, size_t, int);
+int          vm_user_check_args(struct VMSpace *, uintptr_t, size_t *, int);
 
-int          vm_handle_fault(void *, uintptr_t);
+int          vm_handle_fault(struct VMSpace *, uintptr_t, int);
 
 #endif  // !__KERNEL_VM_H__
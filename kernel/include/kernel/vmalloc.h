@@ -0,0 +1,20 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_VMALLOC_H__
+#define __KERNEL_INCLUDE_KERNEL_VMALLOC_H__
+
+/**
+ * @file include/vmalloc.h
+ *
+ * Allocator for large kernel buffers that do not have to be physically
+ * contiguous.
+ */
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <stddef.h>
+
+void *vmalloc(size_t, int);
+void  vfree(void *);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_VMALLOC_H__
@@ -10,37 +10,78 @@
 
 #include <kernel/elf.h>
 #include <kernel/core/list.h>
+#include <kernel/core/rbtree.h>
 #include <kernel/vm.h>
 #include <kernel/spinlock.h>
 
 struct Inode;
 struct Page;
+struct SwapCluster;
 
 struct VMSpaceMapEntry {
-  struct KListLink link;
+  struct KListLink link;            ///< Link into the sorted list of areas
+  struct KRBNode   node;            ///< Node in the tree of areas
   uintptr_t       start;
   size_t          length;
-  int             flags;
+  int             flags;            ///< Mapping flags (VM_PAGE: existing pages)
+  struct Inode   *inode;            ///< The backing file (or NULL)
+  off_t           file_offset;      ///< File offset corresponding to start
+  size_t          file_size;        ///< Bytes taken from the file
+  int             advice;           ///< Expected access pattern (MADV_*)
+};
+
+/**
+ * Snapshot of an area, see vm_space_get_areas().
+ */
+struct VMSpaceAreaInfo {
+  uintptr_t       start;
+  size_t          length;
+  int             flags;            ///< Mapping flags (VM_*)
+  ino_t           ino;              ///< The backing file (or 0)
+  dev_t           dev;
+  off_t           file_offset;
 };
 
 struct VMSpace {
-  void            *pgtab;
-  struct KSpinLock lock;
-  struct KListLink areas;
+  void              *pgtab;
+  struct KSpinLock   lock;          ///< Protects the page table
+  struct KRWSpinLock area_lock;     ///< Protects the list and tree of areas
+  struct KListLink   areas;         ///< Areas sorted by address
+  struct KRBTree     area_tree;     ///< Areas indexed by address
+  uintptr_t          free_start;    ///< No free pages below this address
+  unsigned long      asid;          ///< TLB tag, managed by arch_vm_load()
+  struct KListLink   link;          ///< Link into the list of all spaces
+  uintptr_t          swap_hand;     ///< Where the page scanner continues
 };
 
 void              vm_space_init(void);
 struct VMSpace   *vm_space_create(void);
 void              vm_space_destroy(struct VMSpace *);
+void              vm_space_destroy_deferred(struct VMSpace *);
 struct VMSpace   *vm_space_clone(struct VMSpace *, int);
-int               vm_space_load_inode(void *, void *, struct Inode *,
-                                      size_t, off_t);
 
 intptr_t          vmspace_map(struct VMSpace *, uintptr_t, size_t, int);
+intptr_t          vmspace_map_file(struct VMSpace *, uintptr_t, size_t, int,
+                                   struct Inode *, off_t, size_t);
+int               vmspace_fill_page(struct VMSpace *, uintptr_t,
+                                    struct Page **);
+int               vmspace_map_page(struct VMSpace *, uintptr_t, struct Page *,
+                                   int);
+intptr_t          vmspace_map_block(struct VMSpace *, struct Page *, unsigned,
+                                    int);
+int               vmspace_unmap(struct VMSpace *, uintptr_t, size_t);
+int               vmspace_protect(struct VMSpace *, uintptr_t, size_t, int);
+int               vmspace_sync(struct VMSpace *, uintptr_t, size_t);
+int               vmspace_advise(struct VMSpace *, uintptr_t, size_t, int);
 void              vm_print_areas(struct VMSpace *);
+unsigned          vm_space_get_areas(struct VMSpace *,
+                                     struct VMSpaceAreaInfo *, unsigned);
 
 int               vm_space_copy_out(const void *, uintptr_t, size_t);
 int               vm_space_copy_in(void *, uintptr_t, size_t);
 int               vm_space_clear(uintptr_t, size_t);
+int               vm_space_check_buf(struct VMSpace *, uintptr_t, size_t,
+                                     int);
+unsigned          vm_space_swap_scan(struct SwapCluster *, unsigned);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_VMSPACE_H__
@@ -5,6 +5,8 @@
 #error "This is a kernel header; user programs should not #include it"
 #endif
 
+#include <stdint.h>
+
 #include <kernel/core/list.h>
 
 struct KSpinLock;
@@ -12,6 +14,12 @@ struct KSpinLock;
 /**
  * Wait channel is a structure that allows tasks in the kernel to wait for
  * some associated resource. 
+ *
+ * Waiters are either shared or exclusive. k_waitqueue_wakeup() wakes up all
+ * shared waiters but only the first exclusive one, so that of several threads
+ * competing for the same resource only one runs. An exclusive waiter that
+ * leaves some of the resource unused, or gives up waiting, must pass the
+ * wakeup on by calling k_waitqueue_wakeup() itself.
  */
 struct KWaitQueue {
   /** List of tasks waiting on the channel. */
@@ -26,6 +34,14 @@ struct KWaitQueue {
 void k_waitqueue_init(struct KWaitQueue *);
 int  k_waitqueue_sleep(struct KWaitQueue *, struct KSpinLock *);
 int  k_waitqueue_timed_sleep(struct KWaitQueue *, struct KSpinLock *, unsigned long);
+int  k_waitqueue_timed_sleep_ns(struct KWaitQueue *, struct KSpinLock *,
+                                uint64_t);
+int  k_waitqueue_sleep_exclusive(struct KWaitQueue *, struct KSpinLock *);
+int  k_waitqueue_timed_sleep_exclusive(struct KWaitQueue *, struct KSpinLock *,
+                                       unsigned long);
+int  k_waitqueue_handoff(struct KWaitQueue *, struct KWaitQueue *,
+                         struct KSpinLock *);
+void k_waitqueue_wakeup(struct KWaitQueue *);
 void k_waitqueue_wakeup_one(struct KWaitQueue *);
 void k_waitqueue_wakeup_all(struct KWaitQueue *);
 
@@ -1,46 +1,101 @@
+#include <errno.h>
+
 #include <kernel/console.h>
 #include <kernel/interrupt.h>
 #include <kernel/trap.h>
 #include <kernel/core/cpu.h>
 #include <kernel/core/irq.h>
+#include <kernel/core/timer.h>
+#include <kernel/spinlock.h>
 #include <kernel/thread.h>
+#include <kernel/time.h>
+#include <kernel/trace.h>
 #include <kernel/object_pool.h>
 
 static int  interrupt_handler_call(int);
 static void interrupt_thread_entry(void *);
 static int  interrupt_thread_notify(int, void *);
+static void interrupt_balance(void *);
 
 // TODO: should be architecture-specific?
 #define INTERRUPT_HANDLER_MAX       64
 
+// How often the balancer looks at the interrupt rates, in ticks
+#define INTERRUPT_BALANCE_PERIOD    TICKS_PER_SECOND
+
 struct InterruptThread {
   interrupt_handler_t handler;
   void               *handler_arg;
   int                 irq;
   struct KSemaphore   semaphore;
+  struct KThread     *thread;
 };
 
 static struct {
   interrupt_handler_t handler;
   void *handler_arg;
+  /** The CPUs allowed to take the interrupt */
+  unsigned            affinity;
+  /** The CPU the interrupt is currently routed to */
+  unsigned            cpu;
+  /** Whether the balancer may route the interrupt to another CPU */
+  int                 balance;
+  /** The number of interrupts taken by each CPU */
+  unsigned long       count[K_CPU_MAX];
+  /** The counters at the last balancer run */
+  unsigned long       last[K_CPU_MAX];
 } interrupt_handlers[INTERRUPT_HANDLER_MAX];
 
+// Protects the routing of the interrupts
+static struct KSpinLock interrupt_lock = K_SPINLOCK_INITIALIZER("interrupt");
+
+// The CPUs able to take interrupts
+static unsigned interrupt_cpus;
+
+static struct KTimer interrupt_balance_timer;
+
+/**
+ * Start taking device interrupts on the current CPU.
+ */
 void
-interrupt_attach(int irq, interrupt_handler_t handler, void *handler_arg)
+interrupt_init_percpu(void)
+{
+  k_spinlock_acquire(&interrupt_lock);
+  interrupt_cpus |= 1U << k_cpu_id();
+  k_spinlock_release(&interrupt_lock);
+}
+
+static void
+interrupt_attach_cpu(int irq, interrupt_handler_t handler, void *handler_arg,
+                     int balance)
 {
   if ((irq < 0) || (irq >= INTERRUPT_HANDLER_MAX))
     panic("invalid interrupt id %d", irq);
 
+  k_spinlock_acquire(&interrupt_lock);
+
   if (interrupt_handlers[irq].handler != NULL)
     panic("interrupt handler %d already attached", irq);
 
   interrupt_handlers[irq].handler     = handler;
   interrupt_handlers[irq].handler_arg = handler_arg;
+  interrupt_handlers[irq].affinity    = INTERRUPT_CPU_ALL;
+  interrupt_handlers[irq].cpu         = k_cpu_id();
+  interrupt_handlers[irq].balance     = balance;
 
   arch_interrupt_enable(irq, k_cpu_id());
+
+  k_spinlock_release(&interrupt_lock);
+
   arch_interrupt_unmask(irq);
 }
 
+void
+interrupt_attach(int irq, interrupt_handler_t handler, void *handler_arg)
+{
+  interrupt_attach_cpu(irq, handler, handler_arg, 0);
+}
+
 void
 interrupt_attach_thread(int irq, interrupt_handler_t handler, void *handler_arg)
 {
@@ -57,12 +112,213 @@ interrupt_attach_thread(int irq, interrupt_handler_t handler, void *handler_arg)
   isr->irq         = irq;
   isr->handler     = handler;
   isr->handler_arg = handler_arg;
+  isr->thread      = thread;
+
+  // Charge the time spent in the thread to interrupt handling
+  thread->flags |= THREAD_FLAG_INTERRUPT;
 
-  interrupt_attach(irq, interrupt_thread_notify, isr);
+  // The work is done by the thread, so the line can be served by any CPU
+  interrupt_attach_cpu(irq, interrupt_thread_notify, isr, 1);
 
   k_thread_resume(thread);
 }
 
+/**
+ * Restrict the set of CPUs allowed to take the given interrupt. If the CPU
+ * currently taking the interrupt is not in the set, route it to another one.
+ * An interrupt served by a thread has the thread pinned to the same CPUs.
+ *
+ * @param irq  The interrupt ID
+ * @param cpus The bit mask of the allowed CPUs
+ *
+ * @retval 0       Success
+ * @retval -EINVAL Invalid interrupt ID, or none of the CPUs can take it
+ */
+int
+interrupt_set_affinity(int irq, unsigned cpus)
+{
+  struct InterruptThread *isr = NULL;
+  unsigned cpu, online;
+
+  if ((irq < 0) || (irq >= INTERRUPT_HANDLER_MAX))
+    return -EINVAL;
+
+  k_spinlock_acquire(&interrupt_lock);
+
+  online = cpus & interrupt_cpus;
+
+  if ((interrupt_handlers[irq].handler == NULL) || (online == 0)) {
+    k_spinlock_release(&interrupt_lock);
+    return -EINVAL;
+  }
+
+  interrupt_handlers[irq].affinity = cpus;
+
+  if (!(online & (1U << interrupt_handlers[irq].cpu))) {
+    for (cpu = 0; !(online & (1U << cpu)); cpu++)
+      ;
+
+    interrupt_handlers[irq].cpu = cpu;
+    arch_interrupt_enable(irq, cpu);
+  }
+
+  if (interrupt_handlers[irq].handler == interrupt_thread_notify)
+    isr = (struct InterruptThread *) interrupt_handlers[irq].handler_arg;
+
+  k_spinlock_release(&interrupt_lock);
+
+  // Takes the scheduler lock, so not while holding interrupt_lock
+  if (isr != NULL)
+    (void) k_thread_set_affinity(isr->thread, online);
+
+  return 0;
+}
+
+/**
+ * Start the interrupt balancer. Once a second, it routes the interrupts served
+ * by threads to the CPUs that took the fewest interrupts during the last
+ * period, within the affinity of each line.
+ */
+void
+interrupt_balance_init(void)
+{
+  k_timer_init(&interrupt_balance_timer, interrupt_balance, NULL,
+               INTERRUPT_BALANCE_PERIOD, INTERRUPT_BALANCE_PERIOD, 1);
+}
+
+static void
+interrupt_balance(void *arg)
+{
+  unsigned long rate[INTERRUPT_HANDLER_MAX];
+  unsigned long load[K_CPU_MAX] = { 0 };
+  int placed[INTERRUPT_HANDLER_MAX] = { 0 };
+  unsigned cpu;
+  int irq;
+
+  (void) arg;
+
+  k_spinlock_acquire(&interrupt_lock);
+
+  // Lines that cannot move still load the CPUs that took them
+  for (irq = 0; irq < INTERRUPT_HANDLER_MAX; irq++) {
+    unsigned long delta[K_CPU_MAX];
+
+    rate[irq] = 0;
+
+    for (cpu = 0; cpu < K_CPU_MAX; cpu++) {
+      unsigned long count = interrupt_handlers[irq].count[cpu];
+
+      delta[cpu] = count - interrupt_handlers[irq].last[cpu];
+      interrupt_handlers[irq].last[cpu] = count;
+      rate[irq] += delta[cpu];
+    }
+
+    if ((interrupt_handlers[irq].handler == NULL) ||
+        !interrupt_handlers[irq].balance ||
+        (rate[irq] == 0)) {
+      for (cpu = 0; cpu < K_CPU_MAX; cpu++)
+        load[cpu] += delta[cpu];
+      placed[irq] = 1;
+    }
+  }
+
+  // Place the busiest remaining line on the least loaded allowed CPU, staying
+  // on the current one unless another CPU is strictly better
+  for (;;) {
+    unsigned online, best;
+    int busiest = -1;
+
+    for (irq = 0; irq < INTERRUPT_HANDLER_MAX; irq++)
+      if (!placed[irq] && ((busiest < 0) || (rate[irq] > rate[busiest])))
+        busiest = irq;
+
+    if (busiest < 0)
+      break;
+
+    placed[busiest] = 1;
+
+    online = interrupt_handlers[busiest].affinity & interrupt_cpus;
+    best   = interrupt_handlers[busiest].cpu;
+
+    for (cpu = 0; cpu < K_CPU_MAX; cpu++)
+      if ((online & (1U << cpu)) &&
+          (!(online & (1U << best)) || (load[cpu] < load[best])))
+        best = cpu;
+
+    load[best] += rate[busiest];
+
+    if (best != interrupt_handlers[busiest].cpu) {
+      interrupt_handlers[busiest].cpu = best;
+      arch_interrupt_enable(busiest, best);
+    }
+  }
+
+  k_spinlock_release(&interrupt_lock);
+}
+
+/**
+ * Get the number of interrupts taken by each CPU, for all attached lines.
+ *
+ * The counters are read without locking, each is only updated by its CPU.
+ *
+ * @param stats Where to store the information
+ * @param max   The maximum number of entries to store
+ *
+ * @return The number of attached lines, which may be larger than max.
+ */
+unsigned
+interrupt_get_stats(struct InterruptStats *stats, unsigned max)
+{
+  unsigned cpu, n = 0;
+  int irq;
+
+  for (irq = 0; irq < INTERRUPT_HANDLER_MAX; irq++) {
+    struct InterruptStats *s;
+
+    if (interrupt_handlers[irq].handler == NULL)
+      continue;
+
+    if (n >= max) {
+      n++;
+      continue;
+    }
+
+    s = &stats[n++];
+
+    s->irq = irq;
+    s->cpu = interrupt_handlers[irq].cpu;
+    for (cpu = 0; cpu < K_CPU_MAX; cpu++)
+      s->count[cpu] = interrupt_handlers[irq].count[cpu];
+  }
+
+  return n;
+}
+
+/**
+ * Display the number of interrupts taken by each CPU.
+ */
+void
+interrupt_print_stats(void)
+{
+  unsigned cpu;
+  int irq;
+
+  cprintf("%-4s %-4s", "irq", "cpu");
+  for (cpu = 0; cpu < K_CPU_MAX; cpu++)
+    cprintf("       cpu%u", cpu);
+  cprintf("\n");
+
+  for (irq = 0; irq < INTERRUPT_HANDLER_MAX; irq++) {
+    if (interrupt_handlers[irq].handler == NULL)
+      continue;
+
+    cprintf("%-4d %-4u", irq, interrupt_handlers[irq].cpu);
+    for (cpu = 0; cpu < K_CPU_MAX; cpu++)
+      cprintf(" %10lu", interrupt_handlers[irq].count[cpu]);
+    cprintf("\n");
+  }
+}
+
 void
 interrupt_dispatch(void)
 {
@@ -74,6 +330,12 @@ interrupt_dispatch(void)
   arch_interrupt_mask(irq);
   arch_interrupt_eoi(irq);
 
+  trace(TRACE_IRQ, irq, 0);
+
+  // Each CPU only updates its own counter, and the line is masked meanwhile
+  if ((irq >= 0) && (irq < INTERRUPT_HANDLER_MAX))
+    interrupt_handlers[irq].count[k_cpu_id()]++;
+
   should_unmask = interrupt_handler_call(irq);
   if (should_unmask)
     arch_interrupt_unmask(irq);
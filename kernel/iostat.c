@@ -0,0 +1,236 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/core/tick.h>
+#include <kernel/fs/buf.h>
+#include <kernel/dev.h>
+#include <kernel/iostat.h>
+#include <kernel/poll.h>
+#include <kernel/spinlock.h>
+#include <kernel/time.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Block device I/O statistics
+ * ----------------------------------------------------------------------------
+ *
+ * A driver keeps a struct iostat for each device and updates it as buffers
+ * are queued, start their transfers and complete. The updates are serialized
+ * by the driver (usually with its queue lock), the readers of /dev/iostat
+ * copy the counters without locking.
+ *
+ * The times are measured with the tick counter, so everything shorter than a
+ * tick is counted as 0 ms.
+ */
+
+#define IOSTAT_MAJOR    0x0A
+
+/** The maximum number of devices with statistics */
+#define IOSTAT_DEVICES  8
+
+static struct iostat *iostat_devices[IOSTAT_DEVICES];
+static unsigned iostat_count;
+static struct KSpinLock iostat_lock = K_SPINLOCK_INITIALIZER("iostat");
+
+/**
+ * Make the statistics of a block device visible in /dev/iostat.
+ *
+ * @param stat The statistics, kept by the driver
+ * @param name The device name
+ * @param dev  The device number
+ */
+void
+iostat_register(struct iostat *stat, const char *name, dev_t dev)
+{
+  strncpy(stat->name, name, IOSTAT_NAME_MAX - 1);
+  stat->name[IOSTAT_NAME_MAX - 1] = '\0';
+  stat->dev = dev;
+
+  k_spinlock_acquire(&iostat_lock);
+
+  if (iostat_count == IOSTAT_DEVICES) {
+    k_spinlock_release(&iostat_lock);
+    warn("too many devices, no statistics for %s", name);
+    return;
+  }
+
+  iostat_devices[iostat_count++] = stat;
+
+  k_spinlock_release(&iostat_lock);
+}
+
+static inline unsigned
+iostat_bucket(unsigned long long ms)
+{
+  uint32_t v = (ms > UINT32_MAX) ? UINT32_MAX : (uint32_t) ms;
+
+  return MIN(31U - __builtin_clz(v | 1), IOSTAT_BUCKETS - 1U);
+}
+
+/**
+ * Account for a buffer entering the driver queue.
+ *
+ * @param stat The device statistics
+ * @param buf  The buffer
+ */
+void
+iostat_queue(struct iostat *stat, struct Buf *buf)
+{
+  (void) buf;
+
+  if (++stat->queued > stat->max_queued)
+    stat->max_queued = stat->queued;
+}
+
+/**
+ * Account for the start of a buffer transfer.
+ *
+ * @param stat   The device statistics
+ * @param buf    The buffer
+ * @param merged Whether the buffer joins the transfer of the previous one
+ */
+void
+iostat_start(struct iostat *stat, struct Buf *buf, int merged)
+{
+  unsigned long long ms = ticks2ms(k_tick_get() - buf->submit_time);
+
+  stat->wait_ms += ms;
+  stat->wait_hist[iostat_bucket(ms)]++;
+
+  if (merged) {
+    if (buf->flags & BUF_DIRTY)
+      stat->write_merges++;
+    else
+      stat->read_merges++;
+  }
+}
+
+/**
+ * Account for a completed buffer.
+ *
+ * @param stat  The device statistics
+ * @param buf   The buffer (before buf_io_done() is called for it)
+ * @param start The tick when the transfer started
+ */
+void
+iostat_done(struct iostat *stat, struct Buf *buf, unsigned long long start)
+{
+  unsigned long long ms = ticks2ms(k_tick_get() - start);
+
+  assert(stat->queued > 0);
+  stat->queued--;
+
+  if (buf->flags & BUF_DIRTY) {
+    stat->writes++;
+    stat->write_sectors += buf->block_size / IOSTAT_SECTOR;
+  } else {
+    stat->reads++;
+    stat->read_sectors += buf->block_size / IOSTAT_SECTOR;
+  }
+
+  stat->service_hist[iostat_bucket(ms)]++;
+}
+
+/**
+ * Account for the time the device was busy with a transfer.
+ *
+ * @param stat  The device statistics
+ * @param start The tick when the transfer started
+ */
+void
+iostat_busy(struct iostat *stat, unsigned long long start)
+{
+  stat->service_ms += ticks2ms(k_tick_get() - start);
+}
+
+static ssize_t
+iostat_read_at(dev_t dev, uintptr_t va, size_t n, off_t off)
+{
+  size_t done = 0;
+  int r;
+
+  (void) dev;
+
+  if (off < 0)
+    return -EINVAL;
+
+  while (done < n) {
+    unsigned i = off / sizeof(struct iostat);
+    size_t skip = off % sizeof(struct iostat);
+    size_t len = MIN(sizeof(struct iostat) - skip, n - done);
+    struct iostat copy, *stat = NULL;
+
+    k_spinlock_acquire(&iostat_lock);
+    if (i < iostat_count)
+      stat = iostat_devices[i];
+    k_spinlock_release(&iostat_lock);
+
+    if (stat == NULL)
+      break;
+
+    memcpy(&copy, stat, sizeof(copy));
+
+    if ((r = vm_space_copy_out((uint8_t *) &copy + skip, va + done, len)) < 0)
+      return r;
+
+    done += len;
+    off  += len;
+  }
+
+  return done;
+}
+
+static ssize_t
+iostat_read(dev_t dev, uintptr_t va, size_t n)
+{
+  return iostat_read_at(dev, va, n, 0);
+}
+
+static ssize_t
+iostat_write(dev_t dev, uintptr_t va, size_t n)
+{
+  (void) dev;
+  (void) va;
+  (void) n;
+
+  return -EBADF;
+}
+
+static int
+iostat_ioctl(dev_t dev, int request, int arg)
+{
+  (void) dev;
+  (void) request;
+  (void) arg;
+
+  return -ENOTTY;
+}
+
+static int
+iostat_poll(dev_t dev, struct PollEntry *entry)
+{
+  (void) dev;
+  (void) entry;
+
+  return POLLIN;
+}
+
+static struct CharDev iostat_device = {
+  .read    = iostat_read,
+  .read_at = iostat_read_at,
+  .write   = iostat_write,
+  .ioctl   = iostat_ioctl,
+  .poll    = iostat_poll,
+};
+
+/**
+ * Register the I/O statistics device (/dev/iostat).
+ */
+void
+iostat_init(void)
+{
+  dev_register_char(IOSTAT_MAJOR, &iostat_device);
+}
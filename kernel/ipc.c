@@ -1,25 +1,56 @@
 #include <sys/types.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/channel.h>
+
 #include <kernel/console.h>
 #include <kernel/spinlock.h>
 #include <kernel/assert.h>
 #include <kernel/ipc.h>
 #include <kernel/object_pool.h>
 #include <kernel/hash.h>
+#include <kernel/page.h>
+#include <kernel/process.h>
+#include <kernel/vm.h>
+#include <kernel/waitqueue.h>
+
+/**
+ * @file kernel/ipc.c
+ *
+ * Synchronous message passing (send/receive/reply).
+ *
+ * A sender describes its message and the buffer for the reply in a Message
+ * structure on its own kernel stack, queues it on the channel, and switches to
+ * a waiting receiver directly. The receiver copies the message straight from
+ * the sender's address space and the reply is copied straight back, so the
+ * data never goes through a kernel buffer. Large messages with compatible
+ * alignment are not copied at all: their whole pages are mapped into the
+ * other address space copy-on-write.
+ *
+ * While a receiver or a replier is accessing the sender's memory without
+ * holding ipc_lock, the message is marked busy, and the sender cannot leave
+ * even if interrupted by a signal.
+ */
 
 struct Channel {
-  id_t             id;
+  id_t              id;
+  pid_t             owner;
 
   // Access protected by channel_id.lock
-  struct KListLink id_hash_link;
+  struct KListLink  id_hash_link;
 
   // Access protected by ipc_lock
-  int              ref_count;
-  int              active;
-  struct KListLink connections;
+  int               ref_count;
+  int               active;
+  struct KListLink  connections;
+  struct KListLink  senders;
+  struct KListLink  replies;
+  struct KWaitQueue receivers;
 };
 
 struct Connection {
   id_t             id;
+  pid_t            owner;
 
   // Access protected by ipc_lock
   struct Channel  *channel;
@@ -27,6 +58,33 @@ struct Connection {
   struct KListLink link;
 };
 
+enum {
+  MSG_SEND_BLOCKED,       // Waiting to be received
+  MSG_REPLY_BLOCKED,      // Received, waiting for the reply
+  MSG_DONE,               // Replied to or failed
+};
+
+struct Message {
+  // Access protected by ipc_lock
+  struct KListLink   link;        // Channel's senders or replies list
+  struct KListLink   rcvid_link;  // Link into the reply-blocked hash
+  int                rcvid;
+  int                state;
+  int                busy;
+  int                abandoned;
+  int                status;
+  struct KWaitQueue  queue;
+
+  // Constant while the message is in flight
+  struct Channel    *channel;
+  struct VMSpace    *vm;
+  pid_t              pid;
+  uintptr_t          send_va;
+  size_t             send_n;
+  uintptr_t          reply_va;
+  size_t             reply_n;
+};
+
 static struct KSpinLock ipc_lock = K_SPINLOCK_INITIALIZER("ipc");
 
 #define CHANNEL_ID_HASH_SIZE  32
@@ -48,12 +106,28 @@ static struct {
   struct KSpinLock   lock;
 } connection_desc;
 
+#define RCVID_HASH_SIZE  32
+
+// Access protected by ipc_lock
+static struct {
+  struct KListLink table[RCVID_HASH_SIZE];
+  int              next;
+} rcvid_hash;
+
+// Messages at least this large are remapped rather than copied. Sharing a page
+// costs two TLB shootdowns and usually a copy-on-write fault later, which only
+// pays off for a few pages at a time.
+#define IPC_REMAP_MIN   (4 * PAGE_SIZE)
+
 static void
 ipc_channel_ctor(void *p, size_t)
 {
   struct Channel *channel = (struct Channel *) p;
   k_list_null(&channel->id_hash_link);
   k_list_init(&channel->connections);
+  k_list_init(&channel->senders);
+  k_list_init(&channel->replies);
+  k_waitqueue_init(&channel->receivers);
   channel->active = 0;
 }
 
@@ -63,6 +137,8 @@ ipc_channel_dtor(void *p, size_t)
   struct Channel *channel = (struct Channel *) p;
   assert(k_list_is_null(&channel->id_hash_link));
   assert(k_list_is_empty(&channel->connections));
+  assert(k_list_is_empty(&channel->senders));
+  assert(k_list_is_empty(&channel->replies));
   assert(!channel->active);
 }
 
@@ -73,8 +149,9 @@ ipc_channel_create(struct Channel **channel_store)
   id_t id;
 
   if ((channel = (struct Channel *) k_object_pool_get(channel_pool)) == NULL)
-    panic("cannot create channel");
+    return -ENOMEM;
 
+  channel->owner = process_current()->pid;
   channel->active = 1;
   channel->ref_count = 1;
 
@@ -84,7 +161,7 @@ ipc_channel_create(struct Channel **channel_store)
     panic("channel id overflow");
 
   HASH_PUT(channel_id.table, &channel->id_hash_link, channel->id);
-  
+
   k_spinlock_acquire(&ipc_lock);
 
   if (channel_store != NULL) {
@@ -115,6 +192,9 @@ ipc_channel_get(id_t id)
   struct KListLink *l;
   struct Channel *channel;
 
+  if (id <= 0)
+    return NULL;
+
   k_spinlock_acquire(&channel_id.lock);
 
   HASH_FOREACH_ENTRY(channel_id.table, l, id) {
@@ -137,49 +217,73 @@ ipc_channel_put(struct Channel *channel)
 {
   int ref_remain;
 
-  cprintf("put channel %d\n", channel->id);
-  
   k_spinlock_acquire(&ipc_lock);
 
   ref_remain = --channel->ref_count;
-  
+
   k_spinlock_release(&ipc_lock);
 
   if (ref_remain == 0) {
     assert(!channel->active);
 
-    cprintf("freed channel %d\n", channel->id);
-
     ipc_channel_dtor(channel, sizeof *channel);
     k_object_pool_put(channel_pool, channel);
   }
 }
 
+// Finish the message with the given status and wake up the sender
+static void
+ipc_message_complete(struct Message *msg, int status)
+{
+  debug_assert(k_spinlock_holding(&ipc_lock));
+
+  k_list_remove(&msg->link);
+  HASH_REMOVE(&msg->rcvid_link);
+
+  msg->status = status;
+  msg->state  = MSG_DONE;
+
+  k_waitqueue_wakeup_one(&msg->queue);
+}
+
 void
 ipc_channel_destroy(struct Channel *channel)
 {
-  struct KListLink *link;
-  
+  struct KListLink *link, *next;
+
   k_spinlock_acquire(&channel_id.lock);
   k_list_remove(&channel->id_hash_link);
   k_spinlock_release(&channel_id.lock);
 
   k_spinlock_acquire(&ipc_lock);
 
+  // Someone else has already destroyed it
+  if (!channel->active) {
+    k_spinlock_release(&ipc_lock);
+    return;
+  }
+
   channel->active = 0;
 
-  // Shutdown all connections
-  KLIST_FOREACH(&channel->connections, link) {
-    struct Connection *conn = KLIST_CONTAINER(link, struct Connection, link);
+  // Fail all messages not being accessed at the moment. Receivers and
+  // repliers finish the busy ones themselves.
+  while (!k_list_is_empty(&channel->senders))
+    ipc_message_complete(KLIST_CONTAINER(channel->senders.next,
+                                         struct Message, link),
+                         -ESRCH);
 
-    k_list_remove(&conn->link);
-    conn->channel = NULL;
+  for (link = channel->replies.next; link != &channel->replies; link = next) {
+    struct Message *msg = KLIST_CONTAINER(link, struct Message, link);
 
-    // TODO: shutdown
+    next = link->next;
+    if (!msg->busy)
+      ipc_message_complete(msg, -ESRCH);
   }
 
+  k_waitqueue_wakeup_all(&channel->receivers);
+
   k_spinlock_release(&ipc_lock);
-  
+
   ipc_channel_put(channel);
 }
 
@@ -191,35 +295,40 @@ ipc_connect_attach(struct Channel *channel, struct Connection **conn_store)
 
   connection = (struct Connection *) k_object_pool_get(connection_pool);
   if (connection == NULL)
-    panic("cannot create connection");
+    return -ENOMEM;
 
+  connection->owner = process_current()->pid;
   connection->ref_count = 1;
 
   k_list_null(&connection->link);
 
-  k_spinlock_acquire(&ipc_lock);
-
-  if (!channel->active)
-    panic("channel destroyed");
-
-  connection->channel = ipc_channel_dup(channel);
-  k_list_add_back(&channel->connections, &connection->link);
-
-  k_spinlock_release(&ipc_lock);
-
   k_spinlock_acquire(&connection_desc.lock);
 
   for (id = 0; id < CONNECTION_MAX; id++)
     if (connection_desc.table[id] == NULL)
       break;
 
-  if (id == CONNECTION_MAX)
-    panic("cannot allocate a connection descriptor");
-
-  connection_desc.table[id] = connection;
+  if (id == CONNECTION_MAX) {
+    k_spinlock_release(&connection_desc.lock);
+    k_object_pool_put(connection_pool, connection);
+    return -EAGAIN;
+  }
 
   k_spinlock_acquire(&ipc_lock);
-  connection->ref_count++;
+
+  if (!channel->active) {
+    k_spinlock_release(&ipc_lock);
+    k_spinlock_release(&connection_desc.lock);
+    k_object_pool_put(connection_pool, connection);
+    return -ESRCH;
+  }
+
+  channel->ref_count++;
+  connection->channel = channel;
+  k_list_add_back(&channel->connections, &connection->link);
+
+  connection->id = id;
+  connection_desc.table[id] = connection;
 
   if (conn_store != NULL) {
     connection->ref_count++;
@@ -233,6 +342,492 @@ ipc_connect_attach(struct Channel *channel, struct Connection **conn_store)
   return id;
 }
 
+// Find a connection of the current process by its descriptor
+static struct Connection *
+ipc_connection_get(int coid)
+{
+  struct Connection *connection;
+
+  if ((coid < 0) || (coid >= CONNECTION_MAX))
+    return NULL;
+
+  k_spinlock_acquire(&connection_desc.lock);
+
+  connection = connection_desc.table[coid];
+  if ((connection != NULL) && (connection->owner == process_current()->pid)) {
+    k_spinlock_acquire(&ipc_lock);
+    connection->ref_count++;
+    k_spinlock_release(&ipc_lock);
+  } else {
+    connection = NULL;
+  }
+
+  k_spinlock_release(&connection_desc.lock);
+
+  return connection;
+}
+
+static void
+ipc_connection_put(struct Connection *connection)
+{
+  struct Channel *channel;
+  int ref_remain;
+
+  k_spinlock_acquire(&ipc_lock);
+
+  if ((ref_remain = --connection->ref_count) == 0)
+    k_list_remove(&connection->link);
+
+  k_spinlock_release(&ipc_lock);
+
+  if (ref_remain == 0) {
+    channel = connection->channel;
+    k_object_pool_put(connection_pool, connection);
+    ipc_channel_put(channel);
+  }
+}
+
+static void
+ipc_connect_detach(struct Connection *connection)
+{
+  int attached;
+
+  k_spinlock_acquire(&connection_desc.lock);
+  if ((attached = (connection_desc.table[connection->id] == connection)))
+    connection_desc.table[connection->id] = NULL;
+  k_spinlock_release(&connection_desc.lock);
+
+  // Drop the reference held by the descriptor table. Messages in flight keep
+  // their own ones.
+  if (attached)
+    ipc_connection_put(connection);
+}
+
+// Move a message between two address spaces. Whole pages are remapped if the
+// message is large enough and both buffers have the same offset within a page;
+// the partial pages at both ends are always copied.
+static int
+ipc_copy(struct VMSpace *dst, uintptr_t dst_va, struct VMSpace *src,
+         uintptr_t src_va, size_t n)
+{
+  int remap, r;
+
+  remap = (n >= IPC_REMAP_MIN) &&
+          ((src_va % PAGE_SIZE) == (dst_va % PAGE_SIZE));
+  if (!remap)
+    return vm_user_copy(dst, dst_va, src, src_va, n);
+
+  while (n != 0) {
+    size_t ncopy;
+
+    if (((src_va % PAGE_SIZE) == 0) && (n >= PAGE_SIZE)) {
+      if ((r = vm_user_share(dst, dst_va, src, src_va)) < 0)
+        return r;
+      if (r > 0) {
+        src_va += PAGE_SIZE;
+        dst_va += PAGE_SIZE;
+        n      -= PAGE_SIZE;
+        continue;
+      }
+    }
+
+    ncopy = MIN(PAGE_SIZE - src_va % PAGE_SIZE, n);
+    if ((r = vm_user_copy(dst, dst_va, src, src_va, ncopy)) < 0)
+      return r;
+
+    src_va += ncopy;
+    dst_va += ncopy;
+    n      -= ncopy;
+  }
+
+  return 0;
+}
+
+// Generate an identifier for a newly received message
+static int
+ipc_rcvid_alloc(void)
+{
+  debug_assert(k_spinlock_holding(&ipc_lock));
+
+  if (++rcvid_hash.next <= 0)
+    rcvid_hash.next = 1;
+  return rcvid_hash.next;
+}
+
+/**
+ * Create a new channel owned by the current process.
+ *
+ * @return The channel ID, or a negative error code.
+ */
+int
+ipc_channel_open(void)
+{
+  return ipc_channel_create(NULL);
+}
+
+/**
+ * Destroy a channel owned by the current process. All messages that have not
+ * been replied to yet fail with -ESRCH.
+ *
+ * @param chid The channel ID
+ *
+ * @retval 0      Success
+ * @retval -ESRCH No such channel
+ * @retval -EPERM The channel belongs to another process
+ */
+int
+ipc_channel_close(id_t chid)
+{
+  struct Channel *channel;
+  int r = 0;
+
+  if ((channel = ipc_channel_get(chid)) == NULL)
+    return -ESRCH;
+
+  if (channel->owner != process_current()->pid)
+    r = -EPERM;
+  else
+    ipc_channel_destroy(channel);
+
+  ipc_channel_put(channel);
+
+  return r;
+}
+
+/**
+ * Attach a new connection to the given channel.
+ *
+ * @param chid The channel ID
+ *
+ * @return The connection descriptor, or a negative error code.
+ */
+int
+ipc_connect(id_t chid)
+{
+  struct Channel *channel;
+  int r;
+
+  if ((channel = ipc_channel_get(chid)) == NULL)
+    return -ESRCH;
+
+  r = ipc_connect_attach(channel, NULL);
+
+  ipc_channel_put(channel);
+
+  return r;
+}
+
+/**
+ * Detach a connection of the current process.
+ *
+ * @param coid The connection descriptor
+ *
+ * @retval 0      Success
+ * @retval -EBADF No such connection
+ */
+int
+ipc_disconnect(int coid)
+{
+  struct Connection *connection;
+
+  if ((connection = ipc_connection_get(coid)) == NULL)
+    return -EBADF;
+
+  ipc_connect_detach(connection);
+  ipc_connection_put(connection);
+
+  return 0;
+}
+
+/**
+ * Send a message through the given connection and wait for the reply. The
+ * caller must have checked both buffers.
+ *
+ * @param coid     The connection descriptor
+ * @param send_va  The user address of the message
+ * @param send_n   The size of the message
+ * @param reply_va The user address of the buffer for the reply
+ * @param reply_n  The size of the reply buffer
+ *
+ * @return The status passed to ipc_reply(), or a negative error code.
+ */
+int
+ipc_send(int coid, uintptr_t send_va, size_t send_n, uintptr_t reply_va,
+         size_t reply_n)
+{
+  struct Connection *connection;
+  struct Channel *channel;
+  struct Message msg;
+  int r;
+
+  if ((connection = ipc_connection_get(coid)) == NULL)
+    return -EBADF;
+
+  channel = connection->channel;
+
+  k_list_null(&msg.link);
+  k_list_null(&msg.rcvid_link);
+  k_waitqueue_init(&msg.queue);
+  msg.state     = MSG_SEND_BLOCKED;
+  msg.busy      = 0;
+  msg.abandoned = 0;
+  msg.status    = 0;
+  msg.channel   = channel;
+  msg.vm        = process_current()->vm;
+  msg.pid       = process_current()->pid;
+  msg.send_va   = send_va;
+  msg.send_n    = send_n;
+  msg.reply_va  = reply_va;
+  msg.reply_n   = reply_n;
+
+  k_spinlock_acquire(&ipc_lock);
+
+  if (!channel->active) {
+    k_spinlock_release(&ipc_lock);
+    ipc_connection_put(connection);
+    return -ESRCH;
+  }
+
+  k_list_add_back(&channel->senders, &msg.link);
+
+  // Switch to a waiting receiver right away, it runs on this processor
+  // while our data is still in the cache
+  r = k_waitqueue_handoff(&channel->receivers, &msg.queue, &ipc_lock);
+
+  while (msg.state != MSG_DONE) {
+    if ((r < 0) || msg.abandoned) {
+      // Interrupted. Leave unless someone is accessing our memory right now,
+      // in which case they wake us up when done.
+      if ((msg.state == MSG_SEND_BLOCKED) || !msg.busy) {
+        k_list_remove(&msg.link);
+        HASH_REMOVE(&msg.rcvid_link);
+        msg.status = -EINTR;
+        break;
+      }
+      msg.abandoned = 1;
+    }
+
+    r = k_waitqueue_sleep(&msg.queue, &ipc_lock);
+  }
+
+  k_spinlock_release(&ipc_lock);
+
+  ipc_connection_put(connection);
+
+  return msg.status;
+}
+
+/**
+ * Wait for a message on a channel owned by the current process, and copy it
+ * into the given buffer. The message is truncated if the buffer is too small.
+ * The caller must have checked the buffers.
+ *
+ * @param chid    The channel ID
+ * @param va      The user address of the buffer
+ * @param n       The size of the buffer
+ * @param info_va The user address to store the message information at (or 0)
+ *
+ * @return The receive ID to reply to, or a negative error code.
+ */
+int
+ipc_receive(id_t chid, uintptr_t va, size_t n, uintptr_t info_va)
+{
+  struct VMSpace *vm = process_current()->vm;
+  struct Channel *channel;
+  struct Message *msg;
+  struct msg_info info;
+  int r, rcvid;
+
+  if ((channel = ipc_channel_get(chid)) == NULL)
+    return -ESRCH;
+
+  if (channel->owner != process_current()->pid) {
+    ipc_channel_put(channel);
+    return -EPERM;
+  }
+
+  k_spinlock_acquire(&ipc_lock);
+
+  while (channel->active && k_list_is_empty(&channel->senders)) {
+    if ((r = k_waitqueue_sleep(&channel->receivers, &ipc_lock)) < 0) {
+      k_spinlock_release(&ipc_lock);
+      ipc_channel_put(channel);
+      return r;
+    }
+  }
+
+  if (!channel->active) {
+    k_spinlock_release(&ipc_lock);
+    ipc_channel_put(channel);
+    return -ESRCH;
+  }
+
+  msg = KLIST_CONTAINER(channel->senders.next, struct Message, link);
+  k_list_remove(&msg->link);
+  k_list_add_back(&channel->replies, &msg->link);
+
+  msg->state = MSG_REPLY_BLOCKED;
+  msg->busy  = 1;
+  msg->rcvid = rcvid = ipc_rcvid_alloc();
+  HASH_PUT(rcvid_hash.table, &msg->rcvid_link, msg->rcvid);
+
+  k_spinlock_release(&ipc_lock);
+
+  info.pid       = msg->pid;
+  info.msglen    = MIN(n, msg->send_n);
+  info.srcmsglen = msg->send_n;
+  info.dstmsglen = msg->reply_n;
+
+  r = ipc_copy(vm, va, msg->vm, msg->send_va, info.msglen);
+  if ((r == 0) && (info_va != 0))
+    r = vm_copy_out(vm, &info, info_va, sizeof info);
+
+  k_spinlock_acquire(&ipc_lock);
+
+  msg->busy = 0;
+
+  if (r < 0)
+    ipc_message_complete(msg, r);
+  else if (!channel->active)
+    ipc_message_complete(msg, r = -ESRCH);
+  else if (msg->abandoned)
+    k_waitqueue_wakeup_one(&msg->queue);
+
+  k_spinlock_release(&ipc_lock);
+
+  ipc_channel_put(channel);
+
+  return r < 0 ? r : rcvid;
+}
+
+/**
+ * Reply to a received message and unblock its sender. The reply is truncated
+ * if the sender's buffer is too small. The caller must have checked the
+ * buffer.
+ *
+ * @param rcvid  The receive ID
+ * @param status The value to return to the sender (a negative one makes the
+ *               send fail with that error code)
+ * @param va     The user address of the reply
+ * @param n      The size of the reply
+ *
+ * @retval 0       Success
+ * @retval -ESRCH  No such message, or the sender has been interrupted
+ * @retval -EBUSY  The message is still being received
+ * @retval -EFAULT The sender's buffer is not mapped
+ */
+int
+ipc_reply(int rcvid, int status, uintptr_t va, size_t n)
+{
+  struct KListLink *l;
+  struct Message *msg;
+  int r;
+
+  if (rcvid <= 0)
+    return -ESRCH;
+
+  k_spinlock_acquire(&ipc_lock);
+
+  msg = NULL;
+  HASH_FOREACH_ENTRY(rcvid_hash.table, l, rcvid) {
+    msg = KLIST_CONTAINER(l, struct Message, rcvid_link);
+    if ((msg->rcvid == rcvid) &&
+        (msg->channel->owner == process_current()->pid))
+      break;
+    msg = NULL;
+  }
+
+  if (msg == NULL) {
+    k_spinlock_release(&ipc_lock);
+    return -ESRCH;
+  }
+
+  if (msg->busy) {
+    k_spinlock_release(&ipc_lock);
+    return -EBUSY;
+  }
+
+  // No one else can reply once the message leaves the hash
+  HASH_REMOVE(&msg->rcvid_link);
+  msg->busy = 1;
+
+  k_spinlock_release(&ipc_lock);
+
+  r = ipc_copy(msg->vm, msg->reply_va, process_current()->vm, va,
+               MIN(n, msg->reply_n));
+
+  k_spinlock_acquire(&ipc_lock);
+
+  msg->busy = 0;
+  ipc_message_complete(msg, r < 0 ? r : status);
+
+  k_spinlock_release(&ipc_lock);
+
+  return r;
+}
+
+/**
+ * Destroy all channels and connections owned by the given process. Called
+ * when the process exits.
+ *
+ * @param pid The process ID
+ */
+void
+ipc_process_cleanup(pid_t pid)
+{
+  struct Connection *connection;
+  struct Channel *channel;
+  struct KListLink *l;
+  id_t id;
+
+  for (id = 0; id < CONNECTION_MAX; id++) {
+    k_spinlock_acquire(&connection_desc.lock);
+
+    connection = connection_desc.table[id];
+    if ((connection == NULL) || (connection->owner != pid)) {
+      k_spinlock_release(&connection_desc.lock);
+      continue;
+    }
+
+    // Take over the reference held by the descriptor table
+    connection_desc.table[id] = NULL;
+
+    k_spinlock_release(&connection_desc.lock);
+
+    ipc_connection_put(connection);
+  }
+
+  // Destroying a channel needs channel_id.lock, so find them one at a time
+  do {
+    channel = NULL;
+
+    k_spinlock_acquire(&channel_id.lock);
+
+    HASH_FOREACH(channel_id.table, l) {
+      struct KListLink *link;
+
+      KLIST_FOREACH(l, link) {
+        struct Channel *c = KLIST_CONTAINER(link, struct Channel,
+                                            id_hash_link);
+        if (c->owner == pid) {
+          channel = ipc_channel_dup(c);
+          break;
+        }
+      }
+
+      if (channel != NULL)
+        break;
+    }
+
+    k_spinlock_release(&channel_id.lock);
+
+    if (channel != NULL) {
+      ipc_channel_destroy(channel);
+      ipc_channel_put(channel);
+    }
+  } while (channel != NULL);
+}
+
 void
 ipc_init(void)
 {
@@ -257,11 +852,5 @@ ipc_init(void)
 
   k_spinlock_init(&connection_desc.lock, "connection_desc");
 
-  struct Channel *chan;
-
-  cprintf("IPC! %d %d\n", ipc_channel_create(&chan));
-
-  ipc_channel_destroy(chan);
-  ipc_channel_put(chan);
-
+  HASH_INIT(rcvid_hash.table);
 }
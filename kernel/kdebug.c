@@ -3,23 +3,82 @@
 
 #include <kernel/console.h>
 #include <kernel/kdebug.h>
+#include <kernel/page.h>
+
+// A function described by the debugging information
+struct DebugFn {
+  uintptr_t  lo;
+  uintptr_t  hi;
+  char      *name;
+  /** The compilation unit: its file name and its line number program */
+  char      *file;
+  uint8_t   *line_info;
+};
 
 static int scan_aranges(uintptr_t, struct PcDebugInfo *); 
-static int parse_cu(uint8_t *, uintptr_t, struct PcDebugInfo *);
+static int walk_cu(uint8_t *, struct DebugFn *,
+                   void (*)(struct DebugFn *, void *), void *);
 static int get_debug_line_info(uint8_t *, uintptr_t, struct PcDebugInfo *);
+static struct DebugFn *fn_table_lookup(uintptr_t, int);
+static uint8_t *find_fde(uintptr_t);
 
 static uint16_t get_uhalf(uint8_t *, uint8_t **);
 static uint32_t get_uword(uint8_t *, uint8_t **);
 static uint32_t get_uleb128(uint8_t *, uint8_t **);
 static int32_t  get_sleb128(uint8_t *, uint8_t **);
 
-int
-debug_info_pc(uintptr_t pc, struct PcDebugInfo *info)
+static void
+debug_info_init(uintptr_t pc, struct PcDebugInfo *info)
 {
   info->file = "<uknown>";
   info->line = 0;
   info->fn_name = "<unknown>";
   info->fn_addr = pc;
+}
+
+int
+debug_info_pc(uintptr_t pc, struct PcDebugInfo *info)
+{
+  struct DebugFn *fn;
+
+  debug_info_init(pc, info);
+
+  // Use the function table if it has already been built, but never build it
+  // from here: this may be a panic backtrace
+  if ((fn = fn_table_lookup(pc, 0)) != NULL) {
+    info->file    = fn->file;
+    info->fn_name = fn->name;
+    info->fn_addr = fn->lo;
+    get_debug_line_info(fn->line_info, pc, info);
+    return 0;
+  }
+
+  return scan_aranges(pc, info);
+}
+
+/**
+ * Find the function containing the given address, without the line number.
+ * Builds the function table on first use, so that later lookups only take a
+ * binary search; must not be called from a panic or an interrupt handler.
+ *
+ * @param pc   The address to look up
+ * @param info Where to store the function name, address and file
+ *
+ * @return 0 on success, a negative value if the address is not known.
+ */
+int
+debug_info_fn(uintptr_t pc, struct PcDebugInfo *info)
+{
+  struct DebugFn *fn;
+
+  debug_info_init(pc, info);
+
+  if ((fn = fn_table_lookup(pc, 1)) != NULL) {
+    info->file    = fn->file;
+    info->fn_name = fn->name;
+    info->fn_addr = fn->lo;
+    return 0;
+  }
 
   return scan_aranges(pc, info);
 }
@@ -32,6 +91,20 @@ debug_info_pc(uintptr_t pc, struct PcDebugInfo *info)
 
 extern uint8_t __debug_aranges_begin__[], __debug_aranges_end__[];
 
+struct PcLookup {
+  uintptr_t       pc;
+  struct DebugFn *fn;
+};
+
+static void
+lookup_visit(struct DebugFn *fn, void *arg)
+{
+  struct PcLookup *lookup = (struct PcLookup *) arg;
+
+  if ((lookup->pc >= fn->lo) && (lookup->pc < fn->hi))
+    *lookup->fn = *fn;
+}
+
 /*
  * Scan the address range table for compilation unit that contains the given
  * address.
@@ -41,6 +114,8 @@ scan_aranges(uintptr_t addr, struct PcDebugInfo *info)
 {
   struct DebugArangesHeader *header;
   struct DebugArangesEntry *e;
+  struct PcLookup lookup;
+  struct DebugFn cu, fn;
   uint8_t *ptr;
   
   ptr = __debug_aranges_begin__;
@@ -50,8 +125,26 @@ scan_aranges(uintptr_t addr, struct PcDebugInfo *info)
     ptr = (uint8_t *) (header + 1) + sizeof(uint32_t);
 
     for (e = (struct DebugArangesEntry *) ptr; e->addr || e->length; e++) {
-      if (addr >= e->addr && addr < (e->addr + e->length))
-        return parse_cu((uint8_t *) header->offset, addr, info);
+      if (addr >= e->addr && addr < (e->addr + e->length)) {
+        fn.name = NULL;
+        lookup.pc = addr;
+        lookup.fn = &fn;
+
+        if (walk_cu((uint8_t *) header->offset, &cu, lookup_visit, &lookup) < 0)
+          return -1;
+
+        if (cu.file != NULL)
+          info->file = cu.file;
+        if (cu.line_info != NULL)
+          get_debug_line_info(cu.line_info, addr, info);
+
+        if (fn.name != NULL) {
+          info->fn_name = fn.name;
+          info->fn_addr = fn.lo;
+        }
+
+        return 0;
+      }
     }
 
     ptr = (uint8_t *) (header) + header->length + sizeof header->length;
@@ -60,6 +153,138 @@ scan_aranges(uintptr_t addr, struct PcDebugInfo *info)
   return -1;
 }
 
+/*
+ * ----------------------------------------------------------------------------
+ * Function table
+ * ----------------------------------------------------------------------------
+ *
+ * Scanning the DWARF sections for every address is fine for a backtrace, but
+ * far too slow to symbolize thousands of profiler samples. On first use, all
+ * functions are collected into a table sorted by address, and then each lookup
+ * is a binary search.
+ */
+
+enum {
+  FN_TABLE_NONE,
+  FN_TABLE_BUILDING,
+  FN_TABLE_READY,
+  FN_TABLE_FAILED,
+};
+
+static int             fn_table_state;
+static struct DebugFn *fn_table;
+static unsigned        fn_table_size;
+
+struct FnTableFill {
+  struct DebugFn *table;
+  unsigned        count;
+  unsigned        max;
+};
+
+static void
+fn_table_visit(struct DebugFn *fn, void *arg)
+{
+  struct FnTableFill *fill = (struct FnTableFill *) arg;
+
+  if ((fill->table != NULL) && (fill->count < fill->max))
+    fill->table[fill->count] = *fn;
+  fill->count++;
+}
+
+// Run the visitor on every function of every compilation unit
+static void
+fn_table_walk(struct FnTableFill *fill)
+{
+  struct DebugArangesHeader *header;
+  struct DebugFn cu;
+  uint8_t *ptr;
+
+  for (ptr = __debug_aranges_begin__; ptr < __debug_aranges_end__; ) {
+    header = (struct DebugArangesHeader *) ptr;
+    walk_cu((uint8_t *) header->offset, &cu, fn_table_visit, fill);
+    ptr = (uint8_t *) (header) + header->length + sizeof header->length;
+  }
+}
+
+static int
+fn_table_build(void)
+{
+  struct FnTableFill fill;
+  struct Page *page;
+  unsigned order, i, j;
+
+  // Count the functions first
+  fill.table = NULL;
+  fill.count = 0;
+  fill.max   = 0;
+  fn_table_walk(&fill);
+
+  for (order = 0; (PAGE_SIZE << order) < fill.count * sizeof(struct DebugFn); )
+    order++;
+
+  if ((page = page_alloc_block(order, 0, PAGE_TAG_KDEBUG)) == NULL)
+    return -1;
+  page->ref_count++;
+
+  fill.table = (struct DebugFn *) page2kva(page);
+  fill.max   = fill.count;
+  fill.count = 0;
+  fn_table_walk(&fill);
+
+  // The compiler emits the functions of a unit mostly in address order, and
+  // the units are linked in order too, so insertion sort does little work
+  for (i = 1; i < fill.max; i++) {
+    struct DebugFn tmp = fill.table[i];
+
+    for (j = i; (j > 0) && (fill.table[j - 1].lo > tmp.lo); j--)
+      fill.table[j] = fill.table[j - 1];
+    fill.table[j] = tmp;
+  }
+
+  fn_table      = fill.table;
+  fn_table_size = fill.max;
+
+  return 0;
+}
+
+// Find the function containing the given address, building the table first if
+// allowed. Returns NULL if the table is not available.
+static struct DebugFn *
+fn_table_lookup(uintptr_t pc, int build)
+{
+  int state = __atomic_load_n(&fn_table_state, __ATOMIC_ACQUIRE);
+  unsigned lo, hi;
+
+  if ((state == FN_TABLE_NONE) && build) {
+    // Only one caller builds the table, the others keep scanning meanwhile
+    if (__atomic_compare_exchange_n(&fn_table_state, &state, FN_TABLE_BUILDING,
+                                    0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      state = fn_table_build() == 0 ? FN_TABLE_READY : FN_TABLE_FAILED;
+      __atomic_store_n(&fn_table_state, state, __ATOMIC_RELEASE);
+    }
+  }
+
+  if (state != FN_TABLE_READY)
+    return NULL;
+
+  // Find the last function starting at or below the address
+  lo = 0;
+  hi = fn_table_size;
+  while (lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+
+    if (fn_table[mid].lo <= pc)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if ((lo == 0) || (pc >= fn_table[lo - 1].hi))
+    return NULL;
+
+  return &fn_table[lo - 1];
+}
+
 /*
  * ----------------------------------------------------------------------------
  * Compilation units
@@ -81,25 +306,32 @@ static uint8_t *scan_abbrev_table(uint8_t *, uint32_t);
 static int get_attr_value(uint32_t, union AttrValue *, uint8_t *, uint8_t **);
 static char *get_debug_str(uint8_t *);
 
+/*
+ * Parse the compilation unit, storing its file name and line number program
+ * into cu, and call the visitor for each function defined in it.
+ */
 static int
-parse_cu(uint8_t *ptr, uintptr_t addr, struct PcDebugInfo *info)
+walk_cu(uint8_t *ptr, struct DebugFn *cu,
+        void (*visit)(struct DebugFn *, void *), void *arg)
 {
   struct CompileUnitHeader* header;
   uint8_t *end, *abbrev;
   uint32_t code, tag;
-  uintptr_t fn_hi, fn_lo;
-  char *fn_name;
+  struct DebugFn fn;
   uint32_t attr_name, attr_form;
   union AttrValue val;
 
+  cu->file      = NULL;
+  cu->line_info = NULL;
+
   header = (struct CompileUnitHeader *) ptr;
 
   ptr = (uint8_t *) (header + 1);
   end = (uint8_t *) header + header->length - sizeof(header->length);
 
   while (ptr < end) {
-    fn_name = NULL;
-    fn_hi = fn_lo = 0;
+    fn.name = NULL;
+    fn.hi = fn.lo = 0;
 
     code = get_uleb128(ptr, &ptr);
     if (code == 0)
@@ -124,30 +356,31 @@ parse_cu(uint8_t *ptr, uintptr_t addr, struct PcDebugInfo *info)
       if (tag == DW_TAG_COMPILE_UNIT) {
         switch (attr_name) {
         case DW_AT_NAME:
-          info->file = val.str;
+          cu->file = val.str;
           break;
         case DW_AT_STMT_LIST:
-          get_debug_line_info((uint8_t *) val.num, addr, info);
+          cu->line_info = (uint8_t *) val.num;
           break;
         }
       } else if (tag == DW_TAG_SUBPROGRAM) {
         switch (attr_name) {
         case DW_AT_NAME:
-          fn_name = val.str;
+          fn.name = val.str;
           break;
         case DW_AT_LOW_PC:
-          fn_lo = val.num;
+          fn.lo = val.num;
           break;
         case DW_AT_HIGH_PC:
-          fn_hi = val.num;
+          fn.hi = val.num;
           break;
         }
       }
     }
 
-    if (addr >= fn_lo && addr < fn_hi) {
-      info->fn_name = fn_name;
-      info->fn_addr = fn_lo;
+    if ((fn.name != NULL) && (fn.lo < fn.hi)) {
+      fn.file      = cu->file;
+      fn.line_info = cu->line_info;
+      visit(&fn, arg);
     }
   }
 
@@ -395,6 +628,363 @@ get_debug_line_info(uint8_t *ptr, uintptr_t pc, struct PcDebugInfo *info)
   return -1;
 }
 
+/*
+ * ----------------------------------------------------------------------------
+ * Call frame information
+ * ----------------------------------------------------------------------------
+ *
+ * Without the frame pointer the only record of how to find the caller's frame
+ * is the .debug_frame section. Each FDE covers a range of code and holds a
+ * small program which, run up to the given address, tells where the CFA (the
+ * value of SP in the caller) is and where the callee saved each register.
+ *
+ * Only the instructions emitted by GCC for the C and assembly code in this
+ * kernel are supported; DWARF expressions make the unwinder give up.
+ */
+
+extern uint8_t __debug_frame_begin__[], __debug_frame_end__[];
+
+// Depth of the DW_CFA_remember_state stack
+#define CFA_STATE_MAX   4
+
+enum {
+  RULE_SAME,
+  RULE_UNDEFINED,
+  RULE_OFFSET,
+  RULE_REGISTER,
+};
+
+struct CfaRule {
+  int     type;
+  int32_t value;
+};
+
+struct CfaState {
+  uint32_t       cfa_reg;
+  int32_t        cfa_offset;
+  struct CfaRule rules[DEBUG_FRAME_REGS];
+};
+
+struct Cie {
+  uint32_t  code_align;
+  int32_t   data_align;
+  uint32_t  ra_reg;
+  uint8_t  *insns;
+  uint8_t  *end;
+};
+
+static int
+parse_cie(uint8_t *ptr, struct Cie *cie)
+{
+  uint32_t length;
+  uint8_t version;
+
+  length = get_uword(ptr, &ptr);
+  cie->end = ptr + length;
+
+  if (get_uword(ptr, &ptr) != 0xFFFFFFFF)
+    return -1;
+
+  version = *ptr++;
+  if ((version != 1) && (version != 3) && (version != 4))
+    return -1;
+
+  // No augmentations are generated for .debug_frame
+  if (*ptr++ != '\0')
+    return -1;
+
+  // Address and segment selector sizes
+  if (version == 4)
+    ptr += 2;
+
+  cie->code_align = get_uleb128(ptr, &ptr);
+  cie->data_align = get_sleb128(ptr, &ptr);
+  cie->ra_reg = (version == 1) ? *ptr++ : get_uleb128(ptr, &ptr);
+  cie->insns = ptr;
+
+  return 0;
+}
+
+static void
+set_rule(struct CfaState *state, uint32_t reg, int type, int32_t value)
+{
+  // The VFP registers are of no interest to the unwinder
+  if (reg < DEBUG_FRAME_REGS) {
+    state->rules[reg].type  = type;
+    state->rules[reg].value = value;
+  }
+}
+
+static void
+restore_rule(struct CfaState *state, struct CfaState *initial, uint32_t reg)
+{
+  if (reg < DEBUG_FRAME_REGS)
+    state->rules[reg] = initial->rules[reg];
+}
+
+/*
+ * Run the call frame instructions until the location passes pc. The initial
+ * state is NULL while running the CIE instructions.
+ */
+static int
+run_cfa(uint8_t *ptr, uint8_t *end, struct Cie *cie, uintptr_t loc,
+        uintptr_t pc, struct CfaState *state, struct CfaState *initial)
+{
+  struct CfaState stack[CFA_STATE_MAX];
+  unsigned depth = 0;
+  uint32_t reg, off;
+
+  while (ptr < end) {
+    uint8_t opcode = *ptr++;
+
+    switch (opcode & 0xC0) {
+    case DW_CFA_ADVANCE_LOC:
+      loc += (opcode & 0x3F) * cie->code_align;
+      if (loc > pc)
+        return 0;
+      continue;
+    case DW_CFA_OFFSET:
+      off = get_uleb128(ptr, &ptr);
+      set_rule(state, opcode & 0x3F, RULE_OFFSET, off * cie->data_align);
+      continue;
+    case DW_CFA_RESTORE:
+      if (initial == NULL)
+        return -1;
+      restore_rule(state, initial, opcode & 0x3F);
+      continue;
+    }
+
+    switch (opcode) {
+    case DW_CFA_NOP:
+      break;
+    case DW_CFA_SET_LOC:
+      loc = get_uword(ptr, &ptr);
+      if (loc > pc)
+        return 0;
+      break;
+    case DW_CFA_ADVANCE_LOC1:
+      loc += *ptr++ * cie->code_align;
+      if (loc > pc)
+        return 0;
+      break;
+    case DW_CFA_ADVANCE_LOC2:
+      loc += get_uhalf(ptr, &ptr) * cie->code_align;
+      if (loc > pc)
+        return 0;
+      break;
+    case DW_CFA_ADVANCE_LOC4:
+      loc += get_uword(ptr, &ptr) * cie->code_align;
+      if (loc > pc)
+        return 0;
+      break;
+    case DW_CFA_OFFSET_EXTENDED:
+      reg = get_uleb128(ptr, &ptr);
+      off = get_uleb128(ptr, &ptr);
+      set_rule(state, reg, RULE_OFFSET, off * cie->data_align);
+      break;
+    case DW_CFA_OFFSET_EXTENDED_SF:
+      reg = get_uleb128(ptr, &ptr);
+      set_rule(state, reg, RULE_OFFSET,
+               get_sleb128(ptr, &ptr) * cie->data_align);
+      break;
+    case DW_CFA_GNU_NEGATIVE_OFFSET_EXTENDED:
+      reg = get_uleb128(ptr, &ptr);
+      off = get_uleb128(ptr, &ptr);
+      set_rule(state, reg, RULE_OFFSET, -(off * cie->data_align));
+      break;
+    case DW_CFA_RESTORE_EXTENDED:
+      reg = get_uleb128(ptr, &ptr);
+      if (initial == NULL)
+        return -1;
+      restore_rule(state, initial, reg);
+      break;
+    case DW_CFA_UNDEFINED:
+      reg = get_uleb128(ptr, &ptr);
+      set_rule(state, reg, RULE_UNDEFINED, 0);
+      break;
+    case DW_CFA_SAME_VALUE:
+      reg = get_uleb128(ptr, &ptr);
+      set_rule(state, reg, RULE_SAME, 0);
+      break;
+    case DW_CFA_REGISTER:
+      reg = get_uleb128(ptr, &ptr);
+      off = get_uleb128(ptr, &ptr);
+      if (off >= DEBUG_FRAME_REGS)
+        return -1;
+      set_rule(state, reg, RULE_REGISTER, off);
+      break;
+    case DW_CFA_REMEMBER_STATE:
+      if (depth == CFA_STATE_MAX)
+        return -1;
+      stack[depth++] = *state;
+      break;
+    case DW_CFA_RESTORE_STATE:
+      if (depth == 0)
+        return -1;
+      *state = stack[--depth];
+      break;
+    case DW_CFA_DEF_CFA:
+      state->cfa_reg    = get_uleb128(ptr, &ptr);
+      state->cfa_offset = get_uleb128(ptr, &ptr);
+      break;
+    case DW_CFA_DEF_CFA_SF:
+      state->cfa_reg    = get_uleb128(ptr, &ptr);
+      state->cfa_offset = get_sleb128(ptr, &ptr) * cie->data_align;
+      break;
+    case DW_CFA_DEF_CFA_REGISTER:
+      state->cfa_reg = get_uleb128(ptr, &ptr);
+      break;
+    case DW_CFA_DEF_CFA_OFFSET:
+      state->cfa_offset = get_uleb128(ptr, &ptr);
+      break;
+    case DW_CFA_DEF_CFA_OFFSET_SF:
+      state->cfa_offset = get_sleb128(ptr, &ptr) * cie->data_align;
+      break;
+    case DW_CFA_GNU_ARGS_SIZE:
+      get_uleb128(ptr, &ptr);
+      break;
+    default:
+      // DW_CFA_def_cfa_expression, DW_CFA_expression and vendor extensions
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Find the FDE covering the given address.
+ */
+static uint8_t *
+find_fde(uintptr_t pc)
+{
+  uint8_t *ptr, *next;
+
+  for (ptr = __debug_frame_begin__; ptr < __debug_frame_end__; ptr = next) {
+    uint32_t length, cie_id, loc, range;
+    uint8_t *p;
+
+    length = get_uword(ptr, &p);
+
+    // 64-bit DWARF is never generated for this target
+    if ((length == 0) || (length == 0xFFFFFFFF))
+      break;
+
+    next = p + length;
+
+    cie_id = get_uword(p, &p);
+    if (cie_id == 0xFFFFFFFF)
+      continue;
+
+    loc   = get_uword(p, &p);
+    range = get_uword(p, &p);
+
+    if ((pc >= loc) && (pc < loc + range))
+      return ptr;
+  }
+
+  return NULL;
+}
+
+/**
+ * Unwind one stack frame using the .debug_frame call frame information.
+ *
+ * Computes the register values of the caller of the function executing at
+ * the given address. On entry, the frame must hold the register values at
+ * that address; on success, it is updated with the caller's values and the
+ * CFA, which becomes the caller's stack pointer.
+ *
+ * @param pc    The address within the function: the faulting instruction for
+ *              the innermost frame, the return address minus one for others
+ * @param frame The register values to unwind
+ * @param ra    Where to store the return address into the caller
+ *
+ * @return 0 on success, a negative value if there is no call frame
+ *         information for this address or the outermost frame is reached.
+ */
+int
+debug_frame_unwind(uintptr_t pc, struct DebugFrame *frame, uintptr_t *ra)
+{
+  struct CfaState initial, state;
+  uintptr_t regs[DEBUG_FRAME_REGS];
+  uint8_t *fde, *ptr, *end, *cie_ptr;
+  struct Cie cie;
+  uint32_t length, cie_id, loc;
+  int i;
+
+  if ((fde = find_fde(pc)) == NULL)
+    return -1;
+
+  length = get_uword(fde, &ptr);
+  end = ptr + length;
+
+  // The CIE pointer is relocated to the address of the CIE, fall back to a
+  // section offset just in case
+  cie_id  = get_uword(ptr, &ptr);
+  cie_ptr = (uint8_t *) cie_id;
+  if ((cie_ptr < __debug_frame_begin__) || (cie_ptr >= __debug_frame_end__))
+    cie_ptr = __debug_frame_begin__ + cie_id;
+  if (cie_ptr >= __debug_frame_end__)
+    return -1;
+
+  loc = get_uword(ptr, &ptr);
+  get_uword(ptr, &ptr);
+
+  if (parse_cie(cie_ptr, &cie) < 0)
+    return -1;
+
+  initial.cfa_reg    = 0;
+  initial.cfa_offset = 0;
+  for (i = 0; i < DEBUG_FRAME_REGS; i++) {
+    initial.rules[i].type  = RULE_SAME;
+    initial.rules[i].value = 0;
+  }
+
+  if (run_cfa(cie.insns, cie.end, &cie, loc, (uintptr_t) -1, &initial,
+              NULL) < 0)
+    return -1;
+
+  state = initial;
+  if (run_cfa(ptr, end, &cie, loc, pc, &state, &initial) < 0)
+    return -1;
+
+  if ((state.cfa_reg >= DEBUG_FRAME_REGS) || (cie.ra_reg >= DEBUG_FRAME_REGS))
+    return -1;
+
+  frame->cfa = frame->regs[state.cfa_reg] + state.cfa_offset;
+  if ((frame->cfa == 0) || (frame->cfa % sizeof(uintptr_t)))
+    return -1;
+
+  for (i = 0; i < DEBUG_FRAME_REGS; i++) {
+    struct CfaRule *rule = &state.rules[i];
+
+    switch (rule->type) {
+    case RULE_OFFSET:
+      regs[i] = *(uintptr_t *) (frame->cfa + rule->value);
+      break;
+    case RULE_REGISTER:
+      regs[i] = frame->regs[rule->value];
+      break;
+    case RULE_UNDEFINED:
+      regs[i] = 0;
+      break;
+    default:
+      regs[i] = frame->regs[i];
+      break;
+    }
+  }
+
+  // An undefined return address marks the outermost frame
+  if (state.rules[cie.ra_reg].type == RULE_UNDEFINED)
+    return -1;
+
+  for (i = 0; i < DEBUG_FRAME_REGS; i++)
+    frame->regs[i] = regs[i];
+
+  *ra = regs[cie.ra_reg];
+  return 0;
+}
+
 /*
  * ----------------------------------------------------------------------------
  * Decode data
@@ -6,21 +6,75 @@ LWIPDIR := kernel/net/lwip
 include kernel/net/lwip/Filelists.mk
 
 KERNEL_CFLAGS  := $(CFLAGS) $(INIT_CFLAGS) -Ikernel/include -D__ARGENTUM_KERNEL__
-KERNEL_CFLAGS  += -O1 -fno-omit-frame-pointer -gdwarf-3
+KERNEL_CFLAGS  += -gdwarf-3
 KERNEL_CFLAGS  += -ffreestanding -nostdlib -fno-builtin 
 KERNEL_CFLAGS  += -I$(LWIPDIR)/include -I$(LWIPDIR)/argentum -Wno-type-limits
 
+# Run `make KERNEL_PROFILE=release` to build an optimized kernel. The release
+# profile compiles with -O2 and link-time optimization and drops the frame
+# pointer, so backtraces are unwound from the .debug_frame call frame
+# information instead of following the APCS frame chain.
+KERNEL_PROFILE ?= debug
+
+ifeq ($(KERNEL_PROFILE),release)
+	KERNEL_CFLAGS += -O2 -flto -fomit-frame-pointer -DKDEBUG_CFI
+	KERNEL_DEBUG  ?= 0
+else ifeq ($(KERNEL_PROFILE),debug)
+	KERNEL_CFLAGS += -O1 -fno-omit-frame-pointer
+	KERNEL_DEBUG  ?= 2
+else
+$(error Unknown KERNEL_PROFILE '$(KERNEL_PROFILE)', use 'debug' or 'release')
+endif
+
+# The debug checks compiled in (see include/kernel/assert.h): 0 keeps only the
+# cheap assertions, 1 adds the invariant checks, 2 also records the call stack
+# on every spinlock acquisition. Defaults to 2 for debug and 0 for release.
+KERNEL_CFLAGS += -DK_DEBUG_LEVEL=$(KERNEL_DEBUG)
+
 ifdef PROCESS_NAME
 	KERNEL_MAIN_CFLAGS := -DPROCESS_NAME=$(PROCESS_NAME)
 endif
 
+# Run `make SPINLOCK_STATS=1` to collect spinlock contention statistics
+ifdef SPINLOCK_STATS
+	KERNEL_CFLAGS += -DK_SPINLOCK_STATS
+endif
+
+# Run `make LWIPERF=1` to start an iperf server in the kernel (see qemu-perf)
+ifdef LWIPERF
+	KERNEL_CFLAGS += -DLWIPERF
+endif
+
+# Run `make HTTPD=1` to start an HTTP server in the kernel, serving the files
+# under /var/www straight from the page cache (see kernel/net/httpd.c)
+ifdef HTTPD
+	KERNEL_CFLAGS += -DHTTPD
+endif
+
+# The size of the compressed RAM disk in pages, `make ZRAM_BLOCKS=0` disables it
+ZRAM_BLOCKS ?= 16384
+KERNEL_CFLAGS += -DZRAM_BLOCKS=$(ZRAM_BLOCKS)
+
+# The swap area on the SD card follows the root filesystem (see fs.img in the
+# top-level Makefile). Run `make SWAP_BLOCKS=0` to disable swapping, or
+# `make SWAP_ZRAM=1` to swap to the compressed RAM disk instead.
+ifdef SWAP_ZRAM
+	KERNEL_CFLAGS += -DSWAP_DEV=0x200 -DSWAP_START=0 -DSWAP_BLOCKS=$(ZRAM_BLOCKS)
+else
+	KERNEL_CFLAGS += -DSWAP_START=$(FS_BLOCKS) -DSWAP_BLOCKS=$(SWAP_BLOCKS)
+endif
+
 KERNEL_SRCFILES := \
 	kernel/core/cpu.c \
+	kernel/core/hrtimer.c \
+	kernel/core/ipi.c \
 	kernel/core/irq.c \
 	kernel/core/mutex.c \
+	kernel/core/rwmutex.c \
 	kernel/core/semaphore.c \
 	kernel/core/mailbox.c \
 	kernel/core/object_pool.c \
+	kernel/core/rbtree.c \
 	kernel/core/timer.c \
 	kernel/core/thread.c \
 	kernel/core/sched.c \
@@ -28,39 +82,69 @@ KERNEL_SRCFILES := \
 	kernel/core/tick.c \
 	kernel/core/timeout.c \
 	kernel/core/waitqueue.c \
+	kernel/core/work.c \
 	kernel/drivers/console/display.c \
+	kernel/drivers/console/fb.c \
 	kernel/drivers/console/ps2.c \
 	kernel/drivers/console/screen.c \
 	kernel/drivers/console/uart.c \
+	kernel/drivers/ramdisk/ramdisk.c \
 	kernel/drivers/sd/sd.c \
+	kernel/drivers/virtio/virtio.c \
+	kernel/drivers/virtio/virtio_blk.c \
+	kernel/drivers/virtio/virtio_net.c \
+	kernel/drivers/zram/zram.c \
 	kernel/fs/ext2_bitmap.c \
 	kernel/fs/ext2_block_alloc.c \
+	kernel/fs/ext2_extent.c \
+	kernel/fs/ext2_htree.c \
 	kernel/fs/ext2_inode_alloc.c \
 	kernel/fs/ext2_inode.c \
+	kernel/fs/ext2_journal.c \
 	kernel/fs/ext2.c \
 	kernel/fs/devfs.c \
 	kernel/fs/buf.c \
 	kernel/fs/file.c \
 	kernel/fs/inode.c \
+	kernel/fs/iosched.c \
+	kernel/fs/page_cache.c \
 	kernel/fs/path.c \
+	kernel/fs/procfs.c \
+	kernel/fs/tmpfs.c \
 	kernel/fs/fs.c \
 	kernel/mm/page.c \
+	kernel/mm/swap.c \
 	kernel/mm/vm.c \
+	kernel/mm/vmalloc.c \
 	kernel/net/net.c \
+	kernel/net/stats.c \
+	kernel/net/unix.c \
 	kernel/process/exec.c \
 	kernel/process/fd.c \
+	kernel/process/futex.c \
 	kernel/process/process.c \
 	kernel/process/signal.c \
 	kernel/process/vmspace.c \
+	kernel/bench.c \
+	kernel/boot.c \
 	kernel/console.c \
+	kernel/cpustat.c \
 	kernel/dev.c \
+	kernel/epoll.c \
 	kernel/ipc.c \
 	kernel/interrupt.c \
+	kernel/iostat.c \
 	kernel/kdebug.c \
+	kernel/klog.c \
+	kernel/meminfo.c \
 	kernel/monitor.c \
 	kernel/pipe.c \
+	kernel/poll.c \
+	kernel/prof.c \
 	kernel/syscall.c \
+	kernel/sysstat.c \
 	kernel/time.c \
+	kernel/trace.c \
 	kernel/tty.c \
 	kernel/main.c
 
@@ -87,11 +171,22 @@ KERNEL_SRCFILES += \
 	kernel/lib/strspn.c \
 	kernel/lib/strtok.c \
 	kernel/lib/gmtime.c \
-	kernel/lib/mktime.c
+	kernel/lib/mktime.c \
+	kernel/lib/lz4.c
 
 KERNEL_SRCFILES += $(LWIPNOAPPSFILES)
+ifdef LWIPERF
+	KERNEL_SRCFILES += $(LWIPERFFILES)
+endif
+ifdef HTTPD
+	KERNEL_SRCFILES += \
+		$(LWIPDIR)/apps/http/fs.c \
+		$(LWIPDIR)/apps/http/httpd.c \
+		kernel/net/httpd.c
+endif
 KERNEL_SRCFILES += \
 	kernel/net/lwip/argentum/arch/sys_arch.c \
+	kernel/net/lwip/argentum/arch/chksum.c \
 	kernel/net/lwip/argentum/arch/sio.c
 
 include kernel/arch/${ARCH}/arch_kernel.mk
@@ -99,7 +194,22 @@ include kernel/arch/${ARCH}/arch_kernel.mk
 KERNEL_OBJFILES := $(patsubst %.c, $(OBJ)/%.o, $(KERNEL_SRCFILES))
 KERNEL_OBJFILES := $(patsubst %.S, $(OBJ)/%.o, $(KERNEL_OBJFILES))
 
-KERNEL_LDFLAGS := $(LDFLAGS) -T $(KERNEL_LDFILE) -nostdlib
+comma := ,
+
+# The LTO objects can only be linked by the compiler driver with the linker
+# plugin, so the release profile runs the linker through $(CC)
+ifeq ($(KERNEL_PROFILE),release)
+	KERNEL_LD      := $(CC) $(KERNEL_CFLAGS)
+	KERNEL_LDFLAGS := $(addprefix -Wl$(comma),$(LDFLAGS))
+	KERNEL_LDFLAGS += -T $(KERNEL_LDFILE) -nostdlib
+	KERNEL_LDFLAGS += $(addprefix -Wl$(comma)--defsym$(comma),$(KERNEL_LDSYMS))
+	KERNEL_LDBIN   := -Wl,-b,binary
+else
+	KERNEL_LD      := $(LD)
+	KERNEL_LDFLAGS := $(LDFLAGS) -T $(KERNEL_LDFILE) -nostdlib
+	KERNEL_LDFLAGS += $(addprefix --defsym=,$(KERNEL_LDSYMS))
+	KERNEL_LDBIN   := -b binary
+endif
 
 # Embed the initial process directly into the kernel binary
 ifdef PROCESS_NAME
@@ -112,6 +222,17 @@ KERNEL_BINFILES := $(patsubst %, $(OBJ)/%, $(KERNEL_BINFILES))
 # Embed the VGA font to print characters on LCD
 KERNEL_BINFILES += kernel/drivers/console/vga_font.psf
 
+# Embed a filesystem image to be mounted as the root from the RAM disk
+ifdef RAMDISK_IMAGE
+	KERNEL_BINFILES += $(OBJ)/kernel/ramdisk.img
+endif
+
+# The symbol names are derived from the file name, so use a fixed one
+$(OBJ)/kernel/ramdisk.img: $(RAMDISK_IMAGE)
+	@echo "+ CP [KERNEL] $@"
+	@mkdir -p $(@D)
+	$(V)cp $< $@
+
 $(OBJ)/kernel/%.o: kernel/%.c $(OBJ)/.vars.KERNEL_CFLAGS
 	@echo "+ CC [KERNEL] $<"
 	@mkdir -p $(@D)
@@ -126,10 +247,11 @@ $(OBJ)/kernel/%.o: kernel/%.S $(OBJ)/.vars.KERNEL_CFLAGS
 $(OBJ)/kernel/main.o: override KERNEL_CFLAGS += $(KERNEL_MAIN_CFLAGS)
 $(OBJ)/kernel/main.o: $(OBJ)/.vars.KERNEL_MAIN_CFLAGS
 
-$(OBJ)/kernel/kernel: $(KERNEL_OBJFILES) $(KERNEL_BINFILES) $(KERNEL_LDFILE)
+$(OBJ)/kernel/kernel: $(KERNEL_OBJFILES) $(KERNEL_BINFILES) $(KERNEL_LDFILE) \
+		$(OBJ)/.vars.KERNEL_LDFLAGS
 	@echo "+ LD [KERNEL] $@"
-	$(V)$(LD) -o $@ $(KERNEL_LDFLAGS) $(KERNEL_OBJFILES) $(LIBGCC) \
-		-b binary $(KERNEL_BINFILES)
+	$(V)$(KERNEL_LD) -o $@ $(KERNEL_LDFLAGS) $(KERNEL_OBJFILES) $(LIBGCC) \
+		$(KERNEL_LDBIN) $(KERNEL_BINFILES)
 	$(V)$(OBJDUMP) -S $@ > $@.asm
 	$(V)$(NM) -n $@ > $@.sym
 
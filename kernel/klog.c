@@ -0,0 +1,362 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/core/cpu.h>
+#include <kernel/core/irq.h>
+#include <kernel/core/semaphore.h>
+#include <kernel/dev.h>
+#include <kernel/klog.h>
+#include <kernel/poll.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Kernel message log
+ * ----------------------------------------------------------------------------
+ *
+ * cprintf() formats each message on the stack and appends it to the ring of
+ * the current CPU with interrupts disabled, so logging takes no locks and
+ * never waits for the console devices. A flusher thread takes the messages
+ * out of the rings in the order of their sequence numbers, writes them to the
+ * console and keeps a copy in the history buffer, which is read from
+ * /dev/kmsg (see dmesg).
+ *
+ * The messages are written synchronously before the flusher can run (until
+ * the scheduler is started) and after a panic. If a ring fills up, the writer
+ * flushes the messages itself rather than lose them.
+ */
+
+#define KLOG_MAJOR          0x0B
+
+// The size of each per-CPU ring, in bytes, must be a power of two
+#define KLOG_RING_SIZE      4096
+// The size of the history buffer, in bytes, must be a power of two
+#define KLOG_HISTORY_SIZE   16384
+
+struct KlogHeader {
+  uint32_t seq;                 ///< The global sequence number
+  uint32_t len;                 ///< The length of the text that follows
+};
+
+struct KlogRing {
+  /** The number of bytes ever written, only updated by the owner CPU */
+  volatile unsigned long head;
+  /** The number of bytes ever consumed, only updated under the flush lock */
+  volatile unsigned long tail;
+  char                   buf[KLOG_RING_SIZE];
+} __cacheline_aligned;
+
+static struct KlogRing klog_rings[K_CPU_MAX];
+
+// The next sequence number
+static uint32_t klog_seq;
+
+// Serializes the flushers and thus the console output
+static struct KSpinLock klog_flush_lock = K_SPINLOCK_INITIALIZER("klog_flush");
+
+static struct KSemaphore klog_semaphore;
+static int klog_wakeup;
+static int klog_started;
+
+static struct {
+  struct KSpinLock lock;
+  /** The number of bytes ever appended */
+  unsigned long    end;
+  char             buf[KLOG_HISTORY_SIZE];
+} klog_history = {
+  .lock = K_SPINLOCK_INITIALIZER("klog_history"),
+};
+
+static void
+klog_ring_copy_in(struct KlogRing *ring, unsigned long pos, const void *src,
+                  size_t n)
+{
+  const char *s = (const char *) src;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    ring->buf[(pos + i) & (KLOG_RING_SIZE - 1)] = s[i];
+}
+
+static void
+klog_ring_copy_out(struct KlogRing *ring, unsigned long pos, void *dst,
+                   size_t n)
+{
+  char *d = (char *) dst;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    d[i] = ring->buf[(pos + i) & (KLOG_RING_SIZE - 1)];
+}
+
+// Append a record to the ring of the current CPU, return 0 on success or
+// -ENOSPC if there is no room
+static int
+klog_put(const char *s, size_t n)
+{
+  struct KlogHeader hdr;
+  struct KlogRing *ring;
+  int flags, r = 0;
+
+  flags = k_arch_irq_state_save();
+
+  ring = &klog_rings[k_cpu_id()];
+
+  if (KLOG_RING_SIZE - (ring->head - ring->tail) < sizeof(hdr) + n) {
+    r = -ENOSPC;
+  } else {
+    hdr.seq = __sync_fetch_and_add(&klog_seq, 1);
+    hdr.len = n;
+
+    klog_ring_copy_in(ring, ring->head, &hdr, sizeof(hdr));
+    klog_ring_copy_in(ring, ring->head + sizeof(hdr), s, n);
+
+    // Publish the record only after its contents
+    __sync_synchronize();
+    ring->head += sizeof(hdr) + n;
+  }
+
+  k_arch_irq_state_restore(flags);
+
+  return r;
+}
+
+static void
+klog_history_append(const char *s, size_t n)
+{
+  size_t i;
+
+  k_spinlock_acquire(&klog_history.lock);
+
+  for (i = 0; i < n; i++)
+    klog_history.buf[(klog_history.end + i) & (KLOG_HISTORY_SIZE - 1)] = s[i];
+  klog_history.end += n;
+
+  k_spinlock_release(&klog_history.lock);
+}
+
+// Write out the oldest message in the rings, return 0 if there are none.
+// Called with the flush lock held.
+static int
+klog_flush_one(void)
+{
+  struct KlogRing *ring = NULL;
+  struct KlogHeader hdr, h;
+  char text[KLOG_MSG_MAX];
+  unsigned cpu;
+  size_t i;
+
+  for (cpu = 0; cpu < K_CPU_MAX; cpu++) {
+    struct KlogRing *r = &klog_rings[cpu];
+
+    if (r->head == r->tail)
+      continue;
+
+    __sync_synchronize();
+    klog_ring_copy_out(r, r->tail, &h, sizeof(h));
+
+    if ((ring == NULL) || ((int32_t) (h.seq - hdr.seq) < 0)) {
+      ring = r;
+      hdr  = h;
+    }
+  }
+
+  if (ring == NULL)
+    return 0;
+
+  assert(hdr.len <= KLOG_MSG_MAX);
+  klog_ring_copy_out(ring, ring->tail + sizeof(hdr), text, hdr.len);
+
+  // Let the owner reuse the space only after the contents are copied
+  __sync_synchronize();
+  ring->tail += sizeof(hdr) + hdr.len;
+
+  klog_history_append(text, hdr.len);
+
+  for (i = 0; i < hdr.len; i++)
+    console_putc(text[i]);
+
+  return 1;
+}
+
+/**
+ * Write all pending messages to the console.
+ *
+ * The lock is dropped between the messages, so that long bursts of output do
+ * not keep the interrupts disabled. After a panic, the lock is ignored since
+ * it may be held by a CPU that will never release it.
+ */
+void
+klog_flush(void)
+{
+  int more;
+
+  if (panicstr != NULL) {
+    while (klog_flush_one())
+      ;
+    return;
+  }
+
+  do {
+    k_spinlock_acquire(&klog_flush_lock);
+    more = klog_flush_one();
+    k_spinlock_release(&klog_flush_lock);
+  } while (more);
+}
+
+/**
+ * Append a message to the log.
+ *
+ * @param s The message text
+ * @param n The length of the text, at most KLOG_MSG_MAX
+ */
+void
+klog_write(const char *s, size_t n)
+{
+  assert(n <= KLOG_MSG_MAX);
+
+  while (klog_put(s, n) != 0) {
+    // Messages printed by the console drivers while being flushed
+    if ((panicstr == NULL) && k_spinlock_holding(&klog_flush_lock))
+      return;
+
+    klog_flush();
+  }
+
+  if ((panicstr != NULL) || !klog_started || (k_thread_current() == NULL)) {
+    klog_flush();
+    return;
+  }
+
+  if (__sync_bool_compare_and_swap(&klog_wakeup, 0, 1))
+    k_semaphore_put(&klog_semaphore);
+}
+
+static void
+klog_thread(void *arg)
+{
+  (void) arg;
+
+  for (;;) {
+    k_semaphore_get(&klog_semaphore);
+
+    // Messages logged past this point need another wakeup
+    __sync_lock_release(&klog_wakeup);
+
+    klog_flush();
+  }
+}
+
+static ssize_t
+klog_read_at(dev_t dev, uintptr_t va, size_t n, off_t off)
+{
+  char chunk[256];
+  size_t done = 0;
+  int r;
+
+  (void) dev;
+
+  if (off < 0)
+    return -EINVAL;
+
+  // The offset counts from the oldest byte still kept
+  while (done < n) {
+    unsigned long start, pos;
+    size_t len, i;
+
+    k_spinlock_acquire(&klog_history.lock);
+
+    start = (klog_history.end > KLOG_HISTORY_SIZE)
+          ? klog_history.end - KLOG_HISTORY_SIZE
+          : 0;
+    pos = start + off;
+
+    len = 0;
+    if (pos < klog_history.end)
+      len = MIN(MIN(sizeof(chunk), n - done), klog_history.end - pos);
+
+    for (i = 0; i < len; i++)
+      chunk[i] = klog_history.buf[(pos + i) & (KLOG_HISTORY_SIZE - 1)];
+
+    k_spinlock_release(&klog_history.lock);
+
+    if (len == 0)
+      break;
+
+    if ((r = vm_space_copy_out(chunk, va + done, len)) < 0)
+      return r;
+
+    done += len;
+    off  += len;
+  }
+
+  return done;
+}
+
+static ssize_t
+klog_read(dev_t dev, uintptr_t va, size_t n)
+{
+  return klog_read_at(dev, va, n, 0);
+}
+
+static ssize_t
+klog_dev_write(dev_t dev, uintptr_t va, size_t n)
+{
+  (void) dev;
+  (void) va;
+  (void) n;
+
+  return -EBADF;
+}
+
+static int
+klog_ioctl(dev_t dev, int request, int arg)
+{
+  (void) dev;
+  (void) request;
+  (void) arg;
+
+  return -ENOTTY;
+}
+
+static int
+klog_poll(dev_t dev, struct PollEntry *entry)
+{
+  (void) dev;
+  (void) entry;
+
+  return POLLIN;
+}
+
+static struct CharDev klog_device = {
+  .read    = klog_read,
+  .read_at = klog_read_at,
+  .write   = klog_dev_write,
+  .ioctl   = klog_ioctl,
+  .poll    = klog_poll,
+};
+
+/**
+ * Start the flusher thread and register the log device (/dev/kmsg). Must be
+ * called after the scheduler has been initialized.
+ */
+void
+klog_init(void)
+{
+  struct KThread *thread;
+
+  k_semaphore_init(&klog_semaphore, 0);
+
+  if ((thread = k_thread_create(NULL, klog_thread, NULL, NZERO)) == NULL)
+    panic("cannot create the kernel log thread");
+  k_thread_resume(thread);
+
+  klog_started = 1;
+
+  dev_register_char(KLOG_MAJOR, &klog_device);
+}
@@ -0,0 +1,218 @@
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/lz4.h>
+#include <kernel/types.h>
+
+/*
+ * The compressed block is a sequence of tokens, each followed by a run of
+ * literal bytes and a match, i.e. a 16-bit little-endian offset back into the
+ * output and the number of bytes to be copied from there. The upper and the
+ * lower halves of the token hold the literal length and the match length minus
+ * LZ4_MINMATCH; the value 15 means that the length continues in the following
+ * bytes, each adding up to 255. The last sequence has no match, and the last
+ * LZ4_LAST_LITERALS bytes of the input are always literals.
+ */
+
+#define LZ4_MINMATCH        4
+#define LZ4_LAST_LITERALS   5
+// No match may start within this many bytes from the end of the input
+#define LZ4_MFLIMIT         12
+#define LZ4_MAX_OFFSET      65535
+#define LZ4_HASH_LOG        12
+
+static uint32_t
+lz4_read32(const uint8_t *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static unsigned
+lz4_hash(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// The number of bytes needed to encode the given length next to the token
+static size_t
+lz4_length_size(size_t len)
+{
+  return (len >= 15) ? (len - 15) / 255 + 1 : 0;
+}
+
+static uint8_t *
+lz4_put_length(uint8_t *op, size_t len)
+{
+  if (len < 15)
+    return op;
+
+  for (len -= 15; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = (uint8_t) len;
+
+  return op;
+}
+
+/**
+ * Compress a block of data.
+ *
+ * @param src   The data to compress
+ * @param n     The size of the data, at most LZ4_MAX_INPUT bytes
+ * @param dst   The buffer to store the compressed data into
+ * @param max   The size of the destination buffer
+ * @param table A scratch hash table of LZ4_HASH_SIZE entries
+ *
+ * @return The size of the compressed data, or 0 if it does not fit into the
+ *         destination buffer.
+ */
+size_t
+lz4_compress(const void *src, size_t n, void *dst, size_t max, uint16_t *table)
+{
+  const uint8_t *in = (const uint8_t *) src;
+  const uint8_t *ip = in, *anchor = in, *end = in + n;
+  uint8_t *op = (uint8_t *) dst, *oend = op + max;
+  size_t lit;
+
+  if (n > LZ4_MAX_INPUT)
+    return 0;
+
+  memset(table, 0, LZ4_HASH_SIZE * sizeof(table[0]));
+
+  while ((n > LZ4_MFLIMIT) && (ip < end - LZ4_MFLIMIT)) {
+    const uint8_t *ref, *mp, *rp;
+    uint32_t seq = lz4_read32(ip);
+    unsigned h = lz4_hash(seq);
+    size_t mlen;
+
+    ref = in + table[h];
+    table[h] = (uint16_t) (ip - in);
+
+    if ((ref >= ip) || ((ip - ref) > LZ4_MAX_OFFSET) ||
+        (lz4_read32(ref) != seq)) {
+      ip++;
+      continue;
+    }
+
+    for (mp = ip + LZ4_MINMATCH, rp = ref + LZ4_MINMATCH;
+         (mp < end - LZ4_LAST_LITERALS) && (*mp == *rp);
+         mp++, rp++)
+      ;
+
+    lit  = ip - anchor;
+    mlen = mp - ip - LZ4_MINMATCH;
+
+    if ((size_t) (oend - op) < 1 + lz4_length_size(lit) + lit + 2 +
+                               lz4_length_size(mlen))
+      return 0;
+
+    *op = (uint8_t) ((MIN(lit, 15U) << 4) | MIN(mlen, 15U));
+    op = lz4_put_length(op + 1, lit);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    *op++ = (uint8_t) (ip - ref);
+    *op++ = (uint8_t) ((ip - ref) >> 8);
+    op = lz4_put_length(op, mlen);
+
+    ip = anchor = mp;
+  }
+
+  // The rest goes into the last sequence
+  lit = end - anchor;
+
+  if ((size_t) (oend - op) < 1 + lz4_length_size(lit) + lit)
+    return 0;
+
+  *op = (uint8_t) (MIN(lit, 15U) << 4);
+  op = lz4_put_length(op + 1, lit);
+  memcpy(op, anchor, lit);
+  op += lit;
+
+  return op - (uint8_t *) dst;
+}
+
+// Read the continuation of a length, or return -1 if the input ends first
+static long
+lz4_get_length(const uint8_t **ipp, const uint8_t *iend, size_t len)
+{
+  const uint8_t *ip = *ipp;
+  uint8_t b;
+
+  if (len < 15)
+    return len;
+
+  do {
+    if (ip >= iend)
+      return -1;
+    b = *ip++;
+    len += b;
+  } while (b == 255);
+
+  *ipp = ip;
+  return len;
+}
+
+/**
+ * Decompress a block of data compressed by lz4_compress().
+ *
+ * @param src The compressed data
+ * @param n   The size of the compressed data
+ * @param dst The buffer to store the decompressed data into
+ * @param max The size of the destination buffer
+ *
+ * @return The size of the decompressed data, or -EINVAL if the input is
+ *         malformed or does not fit into the destination buffer.
+ */
+int
+lz4_decompress(const void *src, size_t n, void *dst, size_t max)
+{
+  const uint8_t *ip = (const uint8_t *) src, *iend = ip + n;
+  uint8_t *op = (uint8_t *) dst, *oend = op + max;
+
+  for (;;) {
+    const uint8_t *ref;
+    long lit, mlen;
+    size_t offset;
+    uint8_t token;
+
+    if (ip >= iend)
+      return -EINVAL;
+    token = *ip++;
+
+    if ((lit = lz4_get_length(&ip, iend, token >> 4)) < 0)
+      return -EINVAL;
+    if ((lit > iend - ip) || (lit > oend - op))
+      return -EINVAL;
+
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+
+    // The last sequence has no match
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -EINVAL;
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+
+    if ((offset == 0) || (offset > (size_t) (op - (uint8_t *) dst)))
+      return -EINVAL;
+
+    if ((mlen = lz4_get_length(&ip, iend, token & 15)) < 0)
+      return -EINVAL;
+    mlen += LZ4_MINMATCH;
+    if (mlen > oend - op)
+      return -EINVAL;
+
+    // The match may overlap the bytes being written
+    for (ref = op - offset; mlen > 0; mlen--)
+      *op++ = *ref++;
+  }
+
+  return op - (uint8_t *) dst;
+}
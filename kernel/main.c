@@ -3,26 +3,43 @@
 #include <stdint.h>
 #include <sys/utsname.h>
 
+#include <kernel/boot.h>
 #include <kernel/console.h>
 #include <kernel/core/cpu.h>
+#include <kernel/core/ipi.h>
 #include <kernel/tty.h>
 #include <kernel/fs/buf.h>
 #include <kernel/fs/file.h>
 #include <kernel/core/irq.h>
 #include <kernel/core/mailbox.h>
 #include <kernel/mutex.h>
+#include <kernel/rwmutex.h>
 #include <kernel/core/semaphore.h>
+#include <kernel/core/hrtimer.h>
 #include <kernel/core/timer.h>
+#include <kernel/core/work.h>
+#include <kernel/drivers/fb.h>
+#include <kernel/drivers/ramdisk.h>
+#include <kernel/drivers/zram.h>
 #include <kernel/object_pool.h>
 #include <kernel/vm.h>
 #include <kernel/page.h>
 #include <kernel/vmspace.h>
 #include <kernel/pipe.h>
+#include <kernel/epoll.h>
 #include <kernel/process.h>
+#include <kernel/prof.h>
 #include <kernel/ipc.h>
 #include <kernel/net.h>
 #include <kernel/interrupt.h>
+#include <kernel/iostat.h>
+#include <kernel/klog.h>
+#include <kernel/cpustat.h>
+#include <kernel/meminfo.h>
 #include <kernel/time.h>
+#include <kernel/swap.h>
+#include <kernel/sysstat.h>
+#include <kernel/trace.h>
 
 // Whether the bootstrap processor has finished its initialization?
 int bsp_started;
@@ -36,13 +53,29 @@ struct utsname utsname = {
   .machine = "arm",
 };
 
-void arch_init_devices(void);
+void arch_init_storage(void);
+void arch_init_eth(void);
+
+// Run an initializer and record the time it took
+#define BOOT_STAGE(init)  do { init(); boot_stage(#init); } while (0)
+
+// The network stack needs the Ethernet controller, but neither has to wait
+// for the storage devices
+static void
+main_init_net(void)
+{
+  arch_init_eth();
+  net_init();
+}
 
 void
 mp_main(void)
 {
   cprintf("Starting CPU %d\n", k_cpu_id());
 
+  k_ipi_init_percpu();
+  interrupt_init_percpu();
+
   // Enter the scheduler loop
   k_sched_start();
 }
@@ -55,28 +88,53 @@ mp_main(void)
 void
 main(void)
 {
+  boot_init();
+
   // Initialize core services
-  k_object_pool_system_init();
-  k_mutex_system_init();
-  k_semaphore_system_init();
-  k_mailbox_system_init();
-  k_sched_init();
+  BOOT_STAGE(k_object_pool_system_init);
+  BOOT_STAGE(k_mutex_system_init);
+  BOOT_STAGE(k_rwmutex_system_init);
+  BOOT_STAGE(k_semaphore_system_init);
+  BOOT_STAGE(k_mailbox_system_init);
+  BOOT_STAGE(k_timer_system_init);
+  BOOT_STAGE(k_hrtimer_system_init);
+  BOOT_STAGE(k_sched_init);
+  BOOT_STAGE(k_ipi_init);
+  BOOT_STAGE(k_work_system_init);
+  BOOT_STAGE(k_object_pool_trim_init);
+  BOOT_STAGE(page_zero_init);
+  BOOT_STAGE(klog_init);
 
   // Initialize device drivers
-  tty_init();                   // Console
-  arch_init_devices();
+  BOOT_STAGE(tty_init);                 // Console
+  BOOT_STAGE(ramdisk_init);             // Initial RAM disk, if present
+  BOOT_STAGE(zram_init);                // Compressed RAM disk
+  BOOT_STAGE(interrupt_balance_init);   // Spread device interrupts
 
   // Initialize the remaining kernel services
-  buf_init();           // Buffer cache
-  file_init();          // File table
-  vm_space_init();      // Virtual memory manager
-  pipe_init();          // Pipes
-  process_init();       // Process table
-  net_init();           // Networking
-
-  // ipc_init();
+  BOOT_STAGE(buf_init);         // Buffer cache
+  BOOT_STAGE(file_init);        // File table
+  BOOT_STAGE(vm_space_init);    // Virtual memory manager
+  BOOT_STAGE(swap_init);        // Swap area
+  BOOT_STAGE(pipe_init);        // Pipes
+  BOOT_STAGE(epoll_init);       // Event polling
+  BOOT_STAGE(ipc_init);         // Message passing
+  BOOT_STAGE(prof_init);        // Sampling profiler
+  BOOT_STAGE(trace_init);       // Tracepoints
+  BOOT_STAGE(sysstat_init);     // System call statistics
+  BOOT_STAGE(meminfo_init);     // Memory usage report
+  BOOT_STAGE(cpustat_init);     // CPU usage report
+  BOOT_STAGE(iostat_init);      // Block device I/O statistics
+  BOOT_STAGE(fb_init);          // Framebuffer device
+  BOOT_STAGE(time_init);        // System time, must precede the first process
+  BOOT_STAGE(process_init);     // Process table
 
-  time_init();
+  // The slow device probes run in the background once the scheduler starts;
+  // the first process waits for them before mounting the root file system
+  if (boot_async("storage", arch_init_storage) < 0)
+    panic("cannot start storage initialization");
+  if (boot_async("net", main_init_net) < 0)
+    panic("cannot start network initialization");
 
   // Unblock other CPUs
   bsp_started = 1;
@@ -0,0 +1,320 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <kernel/dev.h>
+#include <kernel/drivers/zram.h>
+#include <kernel/fs/buf.h>
+#include <kernel/fs/fs.h>
+#include <kernel/meminfo.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/poll.h>
+#include <kernel/swap.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Memory usage report
+ * ----------------------------------------------------------------------------
+ *
+ * Collects the statistics of the object pools, the page allocator, the buffer
+ * cache and the inode and path caches into a single text report, printed by
+ * the "kmeminfo" monitor command or read from /dev/meminfo. Each subsystem
+ * takes its own locks while its numbers are collected, so the sections are
+ * consistent by themselves but not with each other.
+ */
+
+#define MEMINFO_MAJOR       0x07
+
+// Large enough for the whole report, the output is truncated otherwise
+#define MEMINFO_REPORT_SIZE 8192
+
+// Object pools shown in the report
+#define MEMINFO_POOLS_MAX   64U
+
+static const char *meminfo_tag_names[PAGE_TAG_COUNT + 1] = {
+  "mailbox", "slab", "kstack", "fb", "eth_rx", "buf", "anon", "pgtab", "vm",
+  "kernel_vm", "eth_tx", "pipe", "time", "inode", "file", "socket", "kdebug",
+  "tmpfs", "vmalloc", "virtio", "other",
+};
+
+struct MemInfoBuf {
+  char   *data;
+  size_t  size;
+  size_t  len;
+};
+
+static void
+meminfo_printf(struct MemInfoBuf *buf, const char *format, ...)
+{
+  va_list ap;
+  int n;
+
+  if (buf->len >= buf->size)
+    return;
+
+  va_start(ap, format);
+  n = vsnprintf(buf->data + buf->len, buf->size - buf->len, format, ap);
+  va_end(ap);
+
+  if (n > 0)
+    buf->len = MIN(buf->len + n, buf->size);
+}
+
+static void
+meminfo_pools(struct MemInfoBuf *buf)
+{
+  struct KObjectPoolStats *stats;
+  unsigned i, n;
+
+  stats = (struct KObjectPoolStats *)
+    k_malloc(MEMINFO_POOLS_MAX * sizeof(struct KObjectPoolStats));
+  if (stats == NULL) {
+    meminfo_printf(buf, "Object pools: out of memory\n\n");
+    return;
+  }
+
+  n = k_object_pool_get_stats(stats, MEMINFO_POOLS_MAX);
+
+  meminfo_printf(buf, "%-20s %7s %6s %5s %8s %8s %6s %6s %6s %5s %8s\n",
+                 "pool", "objsize", "objslab", "pages", "inuse", "cached",
+                 "full", "part", "empty", "color", "waste");
+
+  for (i = 0; i < MIN(n, MEMINFO_POOLS_MAX); i++)
+    meminfo_printf(buf, "%-20s %7u %6u %5u %8u %8u %6u %6u %6u %5u %8u\n",
+                   stats[i].name,
+                   (unsigned) stats[i].obj_size,
+                   stats[i].slab_capacity,
+                   stats[i].slab_pages,
+                   stats[i].objs_used,
+                   stats[i].objs_cached,
+                   stats[i].slabs_full,
+                   stats[i].slabs_partial,
+                   stats[i].slabs_empty,
+                   (unsigned) stats[i].color_max,
+                   (unsigned) stats[i].waste);
+
+  if (n > MEMINFO_POOLS_MAX)
+    meminfo_printf(buf, "%u more pools\n", n - MEMINFO_POOLS_MAX);
+
+  meminfo_printf(buf, "\n");
+
+  k_free(stats);
+}
+
+static void
+meminfo_pages(struct MemInfoBuf *buf)
+{
+  struct PageStats stats;
+  struct SwapStats swap_stats;
+  struct ZramStats zram_stats;
+  unsigned i;
+
+  page_get_stats(&stats);
+
+  meminfo_printf(buf, "Pages: %u total, %u free, %u cached, %u zeroed\n",
+                 page_count, page_free_count, stats.cached, stats.zeroed);
+
+  meminfo_printf(buf, "Compaction: %lu blocks rebuilt, %lu pages moved\n",
+                 stats.compacted, stats.migrated);
+
+  swap_get_stats(&swap_stats);
+  meminfo_printf(buf, "Swap: %lu/%lu slots, %lu out, %lu in, %lu writes\n",
+                 swap_stats.used, swap_stats.total, swap_stats.out,
+                 swap_stats.in, swap_stats.clusters);
+
+  zram_get_stats(&zram_stats);
+  meminfo_printf(buf, "ZRAM: %lu/%lu pages, %lu zero, %lu raw, %lu KiB\n",
+                 zram_stats.used, zram_stats.total, zram_stats.zero,
+                 zram_stats.raw, zram_stats.bytes / 1024);
+
+  meminfo_printf(buf, "%-10s %8s %8s %8s\n",
+                 "order", "blocks", "pages", "frag");
+  for (i = 0; i <= PAGE_ORDER_MAX; i++)
+    meminfo_printf(buf, "%-10u %8u %8u %4u.%03u\n",
+                   i, stats.free_blocks[i], stats.free_blocks[i] << i,
+                   stats.frag_index[i] / 1000, stats.frag_index[i] % 1000);
+
+  meminfo_printf(buf, "%-10s %8s\n", "tag", "pages");
+  for (i = 0; i <= PAGE_TAG_COUNT; i++)
+    if (stats.tagged[i] != 0)
+      meminfo_printf(buf, "%-10s %8u\n", meminfo_tag_names[i], stats.tagged[i]);
+
+  meminfo_printf(buf, "\n");
+}
+
+static void
+meminfo_caches(struct MemInfoBuf *buf)
+{
+  struct BufStats buf_stats;
+  struct FsCacheStats fs_stats;
+  unsigned long lookups;
+  unsigned i;
+
+  buf_get_stats(&buf_stats);
+  fs_inode_cache_get_stats(&fs_stats);
+  fs_path_cache_get_stats(&fs_stats);
+
+  lookups = buf_stats.hits + buf_stats.misses;
+
+  meminfo_printf(buf, "Buffers: %u, %u/%u KiB, %u unused, %u dirty\n",
+                 (unsigned) buf_stats.size, (unsigned) buf_stats.bytes / 1024,
+                 (unsigned) buf_stats.max_bytes / 1024,
+                 (unsigned) buf_stats.unused, (unsigned) buf_stats.dirty);
+  meminfo_printf(buf, "Unused buffers by size:");
+  for (i = 0; i < BUF_SIZE_POOLS; i++)
+    if (buf_stats.unused_by_size[i] != 0)
+      meminfo_printf(buf, " %uB:%u", BUF_SIZE_MIN << i,
+                     (unsigned) buf_stats.unused_by_size[i]);
+  meminfo_printf(buf, "\n");
+  meminfo_printf(buf, "Buffer lookups: %lu hits, %lu misses (%lu%% hits)\n",
+                 buf_stats.hits, buf_stats.misses,
+                 lookups ? buf_stats.hits * 100 / lookups : 0);
+  meminfo_printf(buf, "Inodes: %u, %u unused, %u dirty, limit %u\n",
+                 (unsigned) fs_stats.inodes, (unsigned) fs_stats.inodes_unused,
+                 (unsigned) fs_stats.inodes_dirty,
+                 (unsigned) fs_stats.inodes_max);
+  meminfo_printf(buf, "Paths: %u, %u unused, limit %u\n",
+                 (unsigned) fs_stats.paths, (unsigned) fs_stats.paths_unused,
+                 (unsigned) fs_stats.paths_max);
+}
+
+/**
+ * Format the object pool section of the memory usage report.
+ *
+ * @param data Buffer to store the report into
+ * @param size The size of the buffer
+ *
+ * @return The length of the report.
+ */
+size_t
+meminfo_slab_report(char *data, size_t size)
+{
+  struct MemInfoBuf buf = { data, size, 0 };
+
+  meminfo_pools(&buf);
+
+  return buf.len;
+}
+
+/**
+ * Format the page allocator and cache sections of the memory usage report.
+ *
+ * @param data Buffer to store the report into
+ * @param size The size of the buffer
+ *
+ * @return The length of the report.
+ */
+size_t
+meminfo_page_report(char *data, size_t size)
+{
+  struct MemInfoBuf buf = { data, size, 0 };
+
+  meminfo_pages(&buf);
+  meminfo_caches(&buf);
+
+  return buf.len;
+}
+
+/**
+ * Format the memory usage report.
+ *
+ * @param data Buffer to store the report into
+ * @param size The size of the buffer
+ *
+ * @return The length of the report.
+ */
+size_t
+meminfo_report(char *data, size_t size)
+{
+  struct MemInfoBuf buf = { data, size, 0 };
+
+  meminfo_pools(&buf);
+  meminfo_pages(&buf);
+  meminfo_caches(&buf);
+
+  return buf.len;
+}
+
+static ssize_t
+meminfo_read_at(dev_t dev, uintptr_t va, size_t n, off_t off)
+{
+  char *data;
+  size_t len;
+  ssize_t r;
+
+  (void) dev;
+
+  if ((data = (char *) k_malloc(MEMINFO_REPORT_SIZE)) == NULL)
+    return -ENOMEM;
+
+  len = meminfo_report(data, MEMINFO_REPORT_SIZE);
+
+  if ((off < 0) || ((size_t) off >= len)) {
+    r = 0;
+  } else {
+    n = MIN(n, len - (size_t) off);
+    r = vm_space_copy_out(data + off, va, n);
+    if (r == 0)
+      r = n;
+  }
+
+  k_free(data);
+
+  return r;
+}
+
+static ssize_t
+meminfo_read(dev_t dev, uintptr_t va, size_t n)
+{
+  return meminfo_read_at(dev, va, n, 0);
+}
+
+static ssize_t
+meminfo_write(dev_t dev, uintptr_t va, size_t n)
+{
+  (void) dev;
+  (void) va;
+  (void) n;
+
+  return -EBADF;
+}
+
+static int
+meminfo_ioctl(dev_t dev, int request, int arg)
+{
+  (void) dev;
+  (void) request;
+  (void) arg;
+
+  return -ENOTTY;
+}
+
+static int
+meminfo_poll(dev_t dev, struct PollEntry *entry)
+{
+  (void) dev;
+  (void) entry;
+
+  return POLLIN;
+}
+
+static struct CharDev meminfo_device = {
+  .read    = meminfo_read,
+  .read_at = meminfo_read_at,
+  .write   = meminfo_write,
+  .ioctl   = meminfo_ioctl,
+  .poll    = meminfo_poll,
+};
+
+/**
+ * Register the memory usage device (/dev/meminfo).
+ */
+void
+meminfo_init(void)
+{
+  dev_register_char(MEMINFO_MAJOR, &meminfo_device);
+}
@@ -1,8 +1,13 @@
 #include <string.h>
 
 #include <kernel/console.h>
+#include <kernel/core/cpu.h>
+#include <kernel/core/irq.h>
+#include <kernel/core/percpu.h>
+#include <kernel/core/semaphore.h>
 #include <kernel/page.h>
 #include <kernel/spinlock.h>
+#include <kernel/thread.h>
 #include <kernel/types.h>
 
 /**
@@ -35,13 +40,54 @@
  *    table to place just the pages mapped by entry_pgdir on the free list.
  * 2. main() calls page_init_high() after installing the full kernel
  *    translation table to place the rest of the pages on the free list.
+ *
+ * A region registered with page_reserve() beforehand (e.g. an initial RAM
+ * disk loaded by the bootloader) is never placed on the free list.
+ *
+ * Reclaim
+ * -------
+ *
+ * Other subsystems (such as the object allocator or the buffer cache) register
+ * shrinkers to give cached memory back. If no block of the requested order is
+ * available, the allocator calls the shrinkers and retries before failing.
+ *
+ * Per-CPU Caches
+ * --------------
+ *
+ * Almost all allocations are single pages. To avoid taking the global lock
+ * for each of them, every CPU keeps a small cache of free pages that is
+ * accessed with interrupts disabled and without locking. The cache is refilled
+ * from and drained to the free lists in batches. Recently freed ("hot") pages
+ * are kept at the head of the cache, since they are likely to still be in the
+ * CPU caches, while pages obtained from the free lists ("cold") are appended
+ * to the tail. Draining always starts with the coldest pages.
+ *
+ * Pre-zeroed Pages
+ * ----------------
+ *
+ * A low-priority kernel thread clears free pages in advance and keeps them in
+ * a separate pool, so single-page PAGE_ALLOC_ZERO requests (mostly page faults
+ * and network buffers) do not have to pay for the memset. The thread only
+ * uses pages from the free lists while enough memory is available, and the
+ * pool is given back when the allocator runs out of memory.
+ *
+ * Compaction
+ * ----------
+ *
+ * After a long uptime, free memory tends to be scattered in small blocks, and
+ * higher-order requests fail even though enough pages are free. If reclaim
+ * does not help, the allocator picks the aligned block of the requested order
+ * that holds the fewest movable pages (anonymous user pages mapped once) and
+ * no unmovable ones, takes its free parts off the free lists, and asks the
+ * registered migrators to copy the movable pages elsewhere. The vacated pages
+ * are then freed together with the isolated parts, so that the buddies merge.
  */
 
 /** The kernel uses this array to keep track of physical pages */
 struct Page *pages;
 /** The maximum number of available physical pages */
 unsigned page_count;
-/** The number of free physical pages */
+/** The number of free physical pages (not counting the per-CPU caches) */
 unsigned page_free_count = 0;
 
 /** The list of free pages, grouped by block order */
@@ -50,9 +96,75 @@ static struct {
   unsigned long  *bitmap;
 } page_free_list[PAGE_ORDER_MAX + 1];
 /** The spinlock protecting the allocator structures */
-static struct KSpinLock page_lock;
+static struct KSpinLock page_lock __cacheline_exclusive;
+
+/** The number of pages moved between a per-CPU cache and the free lists */
+#define PAGE_CACHE_BATCH  16
+/** The maximum number of pages kept in a per-CPU cache */
+#define PAGE_CACHE_HIGH   (PAGE_CACHE_BATCH * 4)
+
+/** Per-CPU caches of free single pages */
+struct PageCache {
+  struct KListLink list;
+  unsigned         count;
+};
+
+static struct PageCache page_cache __percpu;
+
+/** The maximum number of pre-zeroed pages */
+#define PAGE_ZERO_HIGH    64
+/** Wake up the zeroing thread when the pool drops below this value */
+#define PAGE_ZERO_LOW     (PAGE_ZERO_HIGH / 2)
+/** Do not zero pages when fewer free pages are left */
+#define PAGE_ZERO_RESERVE (PAGE_ZERO_HIGH * 4)
+
+/** The pool of pre-zeroed single pages */
+static struct {
+  struct KListLink  list;
+  unsigned          count;
+  int               sleeping;
+  struct KSpinLock  lock;
+  struct KSemaphore semaphore;
+} page_zero;
+/** The list of registered shrinkers */
+static struct {
+  struct KListLink   head;
+  struct KRWSpinLock lock;
+} page_shrinkers = {
+  KLIST_INITIALIZER(page_shrinkers.head),
+  K_RWSPINLOCK_INITIALIZER("page_shrinkers"),
+};
+/** The list of registered migrators */
+static struct {
+  struct KListLink   head;
+  struct KRWSpinLock lock;
+} page_migrators = {
+  KLIST_INITIALIZER(page_migrators.head),
+  K_RWSPINLOCK_INITIALIZER("page_migrators"),
+};
+/** The block being compacted, only one compaction pass runs at a time */
+static struct {
+  int              active;
+  struct Page     *start;
+  unsigned         order;
+  /** Parts of the block taken off the free lists, grouped by order */
+  struct KListLink isolated[PAGE_ORDER_MAX + 1];
+  /** Blocks rebuilt so far */
+  unsigned long    compacted;
+  /** Pages moved so far */
+  unsigned long    migrated;
+} page_compaction;
+/** The maximum number of compaction passes for a single allocation */
+#define PAGE_COMPACT_RETRIES  4
+/** The number of allocated pages with each tag */
+static unsigned page_tagged[PAGE_TAG_COUNT + 1];
 /** Whether the allocator is ready to be used */
 static int page_initialized = 0;
+/** Physical memory that must not be placed on the free list */
+static struct {
+  physaddr_t start;
+  physaddr_t end;
+} page_reserved;
 // static int high = 0;
 
 #define BITS_PER_BYTE     8
@@ -62,25 +174,47 @@ static int page_initialized = 0;
 #define BITMAP_MASK(n)    (1U << BITMAP_SHIFT(n))
 
 static void        *boot_alloc(size_t);
+static void         page_free_unreserved(physaddr_t, physaddr_t);
 
 static struct Page *page_buddy(struct Page *, unsigned);
 static void         page_list_add(struct Page *, unsigned);
 static void         page_k_list_remove(struct Page *, unsigned);
 static int          page_list_contains(struct Page *, unsigned);
+static unsigned long page_reclaim(void);
+static struct Page *page_free_containing(struct Page *, unsigned *);
+static struct Page *page_compact_target(unsigned);
+static struct Page *page_alloc_locked(unsigned);
+static void         page_free_locked(struct Page *, unsigned);
+static struct Page *page_cache_get(void);
+static void         page_cache_put(struct Page *);
+static unsigned     page_cache_drain(unsigned);
+static struct Page *page_zero_get(void);
+static unsigned     page_zero_drain(void);
+static void         page_zero_thread(void *);
+static void         page_tag_add(int, int);
 
 /**
  * Begin the page allocator initialization.
+ *
+ * @param mem_size The size of physical memory detected by the architecture
+ *                 code, or 0 if unknown.
  */
 void
-page_init_low(void)
+page_init_low(physaddr_t mem_size)
 {
   unsigned i;
   size_t bitmap_len;
 
   k_spinlock_init(&page_lock, "page_lock");
 
-  // TODO: detect the actual amount of physical memory!
-  page_count = PHYS_LIMIT / PAGE_SIZE;
+  // Memory beyond PHYS_LIMIT is not mapped into the kernel address space, and
+  // at least PHYS_ENTRY_LIMIT is required to boot
+  if ((mem_size == 0) || (mem_size > PHYS_LIMIT - PHYS_RAM_BASE))
+    mem_size = PHYS_LIMIT - PHYS_RAM_BASE;
+  if (mem_size < PHYS_ENTRY_LIMIT - PHYS_RAM_BASE)
+    panic("not enough memory (%u KiB)", mem_size / 1024);
+
+  page_count = mem_size / PAGE_SIZE;
 
   // Allocate the 'pages' array.
   pages = (struct Page *) boot_alloc(page_count * sizeof(struct Page));
@@ -93,9 +227,28 @@ page_init_low(void)
     page_free_list[i].bitmap = (unsigned long *) boot_alloc(bitmap_len);
   }
 
+  for (i = 0; i <= PAGE_ORDER_MAX; i++)
+    k_list_init(&page_compaction.isolated[i]);
+
+  for (i = 0; i < K_CPU_MAX; i++) {
+    k_list_init(&K_PERCPU_PTR(page_cache, i)->list);
+    K_PERCPU_PTR(page_cache, i)->count = 0;
+  }
+
+  k_list_init(&page_zero.list);
+  k_spinlock_init(&page_zero.lock, "page_zero");
+  page_zero.count    = 0;
+  page_zero.sleeping = 0;
+
+  // The early allocations must not have overwritten the reserved region
+  if ((page_reserved.start < KVA2PA(boot_alloc(0))) &&
+      (page_reserved.end > PHYS_KERNEL_LOAD))
+    panic("reserved region [%08lx, %08lx) overlaps the kernel",
+          page_reserved.start, page_reserved.end);
+
   // Place pages mapped by 'entry_pgdir' to the free list.
-  page_free_region(0, PHYS_KERNEL_LOAD);
-  page_free_region(KVA2PA(boot_alloc(0)), PHYS_ENTRY_LIMIT);
+  page_free_unreserved(PHYS_RAM_BASE, PHYS_KERNEL_LOAD);
+  page_free_unreserved(KVA2PA(boot_alloc(0)), PHYS_ENTRY_LIMIT);
 
   page_initialized = 1;
 }
@@ -106,11 +259,62 @@ page_init_low(void)
 void
 page_init_high(void)
 {
-  // TODO: detect the actual amount of physical memory!
-  page_free_region(PHYS_ENTRY_LIMIT, PHYS_LIMIT);
+  page_free_unreserved(PHYS_ENTRY_LIMIT,
+                       PHYS_RAM_BASE + (physaddr_t) page_count * PAGE_SIZE);
   // high = 1;
 }
 
+/**
+ * Keep a region of physical memory off the free list. Must be called before
+ * page_init_low(), only one region can be reserved.
+ *
+ * @param start The starting physical address.
+ * @param end   The ending physical address.
+ */
+void
+page_reserve(physaddr_t start, physaddr_t end)
+{
+  if (page_initialized)
+    panic("called after page_init_low");
+
+  page_reserved.start = ROUND_DOWN(start, PAGE_SIZE);
+  page_reserved.end   = ROUND_UP(end, PAGE_SIZE);
+}
+
+// Free the pages in the given range, except for the reserved region
+static void
+page_free_unreserved(physaddr_t start, physaddr_t end)
+{
+  if ((page_reserved.end <= start) || (page_reserved.start >= end)) {
+    page_free_region(start, end);
+    return;
+  }
+
+  if (start < page_reserved.start)
+    page_free_region(start, page_reserved.start);
+  if (page_reserved.end < end)
+    page_free_region(page_reserved.end, end);
+}
+
+/**
+ * Start the thread that maintains the pool of pre-zeroed pages. This must be
+ * called after the scheduler has been initialized.
+ */
+void
+page_zero_init(void)
+{
+  struct KThread *thread;
+
+  k_semaphore_init(&page_zero.semaphore, 0);
+
+  thread = k_thread_create(NULL, page_zero_thread, NULL,
+                           THREAD_MAX_PRIORITIES - 1);
+  if (thread == NULL)
+    panic("cannot create the page zeroing thread");
+
+  k_thread_resume(thread);
+}
+
 /**
  * Simple boot-time memory allocator to solve the "chicken and egg" problem
  * during the page allocator initialization. The memory obtained via this
@@ -166,21 +370,74 @@ struct Page *
 page_alloc_block(unsigned order, int flags, int debug_tag)
 {
   struct Page *page;
-  unsigned o;
+  int reclaimed = 0, compactions = 0;
 
-  k_spinlock_acquire(&page_lock);
+  if ((order == 0) && (flags & PAGE_ALLOC_ZERO) &&
+      ((page = page_zero_get()) != NULL)) {
+    page->debug_tag = debug_tag;
+    page_tag_add(debug_tag, 1);
+    return page;
+  }
 
-  for (o = order; o <= PAGE_ORDER_MAX; o++)
-    if (!k_list_is_empty(&page_free_list[o].link))
+  for (;;) {
+    if ((order == 0) && ((page = page_cache_get()) != NULL))
       break;
 
-  if (o > PAGE_ORDER_MAX) {
-    // TODO: try to reclaim pages from the slab allocator
+    k_spinlock_acquire(&page_lock);
+    page = page_alloc_locked(order);
     k_spinlock_release(&page_lock);
+
+    if (page != NULL)
+      break;
+
+    if (flags & PAGE_ALLOC_NORECLAIM)
+      return NULL;
+
+    // Drop cached state and retry once. Shrinkers put the released single
+    // pages into the per-CPU cache, so move them back to the free lists where
+    // they can be merged into larger blocks.
+    if (!reclaimed) {
+      reclaimed = 1;
+      if ((page_reclaim() + page_zero_drain() +
+           page_cache_drain(PAGE_CACHE_HIGH)) != 0)
+        continue;
+    }
+
+    // Enough pages may still be free, but not contiguous
+    if ((order > 0) && (compactions++ < PAGE_COMPACT_RETRIES) &&
+        page_compact(order))
+      continue;
+
     panic("out of memory\n");
     return NULL;
   }
 
+  if (flags & PAGE_ALLOC_ZERO)
+    memset(page2kva(page), 0, PAGE_SIZE << order);
+
+  page->debug_tag = debug_tag;
+  page_tag_add(debug_tag, 1 << order);
+
+  return page;
+}
+
+// Take a block of the given order from the free lists, splitting a larger
+// block if necessary
+static struct Page *
+page_alloc_locked(unsigned order)
+{
+  struct Page *page;
+  unsigned o;
+
+  debug_assert(k_spinlock_holding(&page_lock));
+
+  for (o = order; o <= PAGE_ORDER_MAX; o++)
+    if (!k_list_is_empty(&page_free_list[o].link))
+      break;
+
+  if (o > PAGE_ORDER_MAX)
+    return NULL;
+
   page = KLIST_CONTAINER(page_free_list[o].link.next, struct Page, link);
 
   page_k_list_remove(page, o);
@@ -196,16 +453,6 @@ page_alloc_block(unsigned order, int flags, int debug_tag)
   assert(page->ref_count == 0);
   assert(!page_list_contains(page, order));
 
-  // if (high)
-  //   cprintf(" %d\n", page_free_count);
-
-  k_spinlock_release(&page_lock);
-
-  if (flags & PAGE_ALLOC_ZERO)
-    memset(page2kva(page), 0, PAGE_SIZE << order);
-
-  page->debug_tag = debug_tag;
-
   return page;
 }
 
@@ -218,15 +465,30 @@ page_alloc_block(unsigned order, int flags, int debug_tag)
 void
 page_free_block(struct Page *page, unsigned order)
 {
-  struct Page *buddy;
-  unsigned o;
-
   if (page->ref_count != 0)
     panic("page->ref_count != 0 (%u)", page->ref_count);
 
+  page_tag_add(page->debug_tag, -(1 << order));
   page->debug_tag = 0;
 
+  if (order == 0) {
+    page_cache_put(page);
+    return;
+  }
+
   k_spinlock_acquire(&page_lock);
+  page_free_locked(page, order);
+  k_spinlock_release(&page_lock);
+}
+
+// Put a block back on the free lists, merging it with its free buddies
+static void
+page_free_locked(struct Page *page, unsigned order)
+{
+  struct Page *buddy;
+  unsigned o;
+
+  debug_assert(k_spinlock_holding(&page_lock));
 
   for (o = order ; o < PAGE_ORDER_MAX; o++) {
     buddy = page_buddy(page, o);
@@ -242,8 +504,494 @@ page_free_block(struct Page *page, unsigned order)
 
   page_list_add(page, o);
   page_free_count += 1U << order;
+}
+
+// Account for pages allocated or freed with the given tag
+static void
+page_tag_add(int tag, int n)
+{
+  unsigned i = (unsigned) tag - PAGE_TAG_MAILBOX;
+
+  if (i >= PAGE_TAG_COUNT)
+    i = PAGE_TAG_COUNT;
+
+  __atomic_add_fetch(&page_tagged[i], n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Collect the page allocator statistics. The per-CPU caches and the tag
+ * counters change without locking, so these values are only a snapshot.
+ *
+ * @param stats Where to store the statistics
+ */
+void
+page_get_stats(struct PageStats *stats)
+{
+  struct KListLink *l;
+  unsigned i, free, usable;
+
+  k_spinlock_acquire(&page_lock);
+
+  for (i = 0; i <= PAGE_ORDER_MAX; i++) {
+    stats->free_blocks[i] = 0;
+    KLIST_FOREACH(&page_free_list[i].link, l)
+      stats->free_blocks[i]++;
+  }
+
+  stats->cached = 0;
+  for (i = 0; i < K_CPU_MAX; i++)
+    stats->cached += K_PERCPU_PTR(page_cache, i)->count;
+
+  stats->compacted = page_compaction.compacted;
+  stats->migrated  = page_compaction.migrated;
 
   k_spinlock_release(&page_lock);
+
+  // Free pages in blocks of order i or higher can serve a request of order i
+  free = usable = 0;
+  for (i = 0; i <= PAGE_ORDER_MAX; i++)
+    free += stats->free_blocks[i] << i;
+
+  for (i = PAGE_ORDER_MAX + 1; i-- > 0; ) {
+    usable += stats->free_blocks[i] << i;
+    stats->frag_index[i] = free ? (free - usable) * 1000ULL / free : 0;
+  }
+
+  stats->zeroed = page_zero.count;
+
+  for (i = 0; i <= PAGE_TAG_COUNT; i++)
+    stats->tagged[i] = __atomic_load_n(&page_tagged[i], __ATOMIC_RELAXED);
+}
+
+// Allocate a single page from the cache of the current CPU, refilling it from
+// the free lists if it is empty
+static struct Page *
+page_cache_get(void)
+{
+  struct PageCache *cache;
+  struct Page *page = NULL;
+  unsigned i;
+
+  k_irq_state_save();
+
+  cache = K_PERCPU_THIS(page_cache);
+
+  if (cache->count == 0) {
+    k_spinlock_acquire(&page_lock);
+
+    for (i = 0; i < PAGE_CACHE_BATCH; i++) {
+      if ((page = page_alloc_locked(0)) == NULL)
+        break;
+
+      k_list_add_back(&cache->list, &page->link);
+      cache->count++;
+    }
+
+    k_spinlock_release(&page_lock);
+  }
+
+  if (cache->count > 0) {
+    page = KLIST_CONTAINER(cache->list.next, struct Page, link);
+    k_list_remove(&page->link);
+    cache->count--;
+  } else {
+    page = NULL;
+  }
+
+  k_irq_state_restore();
+
+  return page;
+}
+
+// Free a single page to the cache of the current CPU, draining the cache if it
+// grows too large
+static void
+page_cache_put(struct Page *page)
+{
+  struct PageCache *cache;
+
+  k_irq_state_save();
+
+  cache = K_PERCPU_THIS(page_cache);
+
+  k_list_add_front(&cache->list, &page->link);
+
+  if (++cache->count > PAGE_CACHE_HIGH)
+    page_cache_drain(PAGE_CACHE_BATCH);
+
+  k_irq_state_restore();
+}
+
+// Move up to n coldest pages from the cache of the current CPU back to the
+// free lists. Returns the number of pages moved
+static unsigned
+page_cache_drain(unsigned n)
+{
+  struct PageCache *cache;
+  unsigned i;
+
+  k_irq_state_save();
+  k_spinlock_acquire(&page_lock);
+
+  cache = K_PERCPU_THIS(page_cache);
+
+  for (i = 0; (i < n) && (cache->count > 0); i++) {
+    struct KListLink *link = cache->list.prev;
+
+    k_list_remove(link);
+    cache->count--;
+
+    page_free_locked(KLIST_CONTAINER(link, struct Page, link), 0);
+  }
+
+  k_spinlock_release(&page_lock);
+  k_irq_state_restore();
+
+  return i;
+}
+
+// Take a page from the pre-zeroed pool, waking up the zeroing thread if the
+// pool is running low
+static struct Page *
+page_zero_get(void)
+{
+  struct Page *page = NULL;
+  int wakeup = 0;
+
+  k_spinlock_acquire(&page_zero.lock);
+
+  if (page_zero.count > 0) {
+    page = KLIST_CONTAINER(page_zero.list.next, struct Page, link);
+    k_list_remove(&page->link);
+    page_zero.count--;
+  }
+
+  if ((page_zero.count < PAGE_ZERO_LOW) && page_zero.sleeping) {
+    page_zero.sleeping = 0;
+    wakeup = 1;
+  }
+
+  k_spinlock_release(&page_zero.lock);
+
+  if (wakeup)
+    k_semaphore_put(&page_zero.semaphore);
+
+  return page;
+}
+
+// Give all pre-zeroed pages back to the allocator. Returns the number of pages
+// released
+static unsigned
+page_zero_drain(void)
+{
+  struct KListLink list;
+  unsigned n = 0;
+
+  k_list_init(&list);
+
+  k_spinlock_acquire(&page_zero.lock);
+
+  while (!k_list_is_empty(&page_zero.list)) {
+    struct KListLink *link = page_zero.list.next;
+
+    k_list_remove(link);
+    k_list_add_back(&list, link);
+  }
+  page_zero.count = 0;
+
+  k_spinlock_release(&page_zero.lock);
+
+  while (!k_list_is_empty(&list)) {
+    struct KListLink *link = list.next;
+
+    k_list_remove(link);
+    page_cache_put(KLIST_CONTAINER(link, struct Page, link));
+    n++;
+  }
+
+  return n;
+}
+
+static void
+page_zero_thread(void *arg)
+{
+  struct Page *page;
+
+  (void) arg;
+
+  for (;;) {
+    k_spinlock_acquire(&page_zero.lock);
+
+    if (page_zero.count >= PAGE_ZERO_HIGH) {
+      page_zero.sleeping = 1;
+      k_spinlock_release(&page_zero.lock);
+
+      k_semaphore_get(&page_zero.semaphore);
+      continue;
+    }
+
+    k_spinlock_release(&page_zero.lock);
+
+    // Never reclaim memory or dig into the last free pages just to zero them
+    page = NULL;
+
+    k_spinlock_acquire(&page_lock);
+    if (page_free_count > PAGE_ZERO_RESERVE)
+      page = page_alloc_locked(0);
+    k_spinlock_release(&page_lock);
+
+    if (page != NULL)
+      memset(page2kva(page), 0, PAGE_SIZE);
+
+    k_spinlock_acquire(&page_zero.lock);
+
+    if (page != NULL) {
+      k_list_add_back(&page_zero.list, &page->link);
+      page_zero.count++;
+    } else {
+      // Wait until a page is taken from the pool and try again
+      page_zero.sleeping = 1;
+    }
+
+    k_spinlock_release(&page_zero.lock);
+
+    if (page == NULL)
+      k_semaphore_get(&page_zero.semaphore);
+  }
+}
+
+/**
+ * Register a shrinker to be called when the allocator runs out of memory.
+ *
+ * @param shrinker Pointer to the shrinker descriptor.
+ */
+void
+page_shrinker_register(struct PageShrinker *shrinker)
+{
+  // Shrinkers registered later usually belong to higher-level caches that
+  // allocate from the lower-level ones, so call them first
+  k_rwspinlock_write_acquire(&page_shrinkers.lock);
+  k_list_add_front(&page_shrinkers.head, &shrinker->link);
+  k_rwspinlock_write_release(&page_shrinkers.lock);
+}
+
+/**
+ * Call all registered shrinkers.
+ *
+ * @return The total number of pages released.
+ */
+static unsigned long
+page_reclaim(void)
+{
+  struct KListLink *l;
+  unsigned long n = 0;
+
+  // The list is read-mostly, and several CPUs may be reclaiming at once
+  k_rwspinlock_read_acquire(&page_shrinkers.lock);
+
+  KLIST_FOREACH(&page_shrinkers.head, l) {
+    struct PageShrinker *shrinker;
+
+    shrinker = KLIST_CONTAINER(l, struct PageShrinker, link);
+    n += shrinker->shrink();
+  }
+
+  k_rwspinlock_read_release(&page_shrinkers.lock);
+
+  return n;
+}
+
+/**
+ * Register a migrator to be called when compacting memory.
+ *
+ * @param migrator Pointer to the migrator descriptor.
+ */
+void
+page_migrator_register(struct PageMigrator *migrator)
+{
+  k_rwspinlock_write_acquire(&page_migrators.lock);
+  k_list_add_back(&page_migrators.head, &migrator->link);
+  k_rwspinlock_write_release(&page_migrators.lock);
+}
+
+// Find the free block containing the given page. Returns NULL if the page is
+// allocated or kept in a cache
+static struct Page *
+page_free_containing(struct Page *page, unsigned *order_store)
+{
+  unsigned idx = page - pages;
+  unsigned o;
+
+  debug_assert(k_spinlock_holding(&page_lock));
+
+  for (o = 0; o <= PAGE_ORDER_MAX; o++) {
+    struct Page *block = &pages[ROUND_DOWN(idx, 1U << o)];
+
+    if (page_list_contains(block, o)) {
+      *order_store = o;
+      return block;
+    }
+  }
+
+  return NULL;
+}
+
+// Select the block of the given order that can be freed by moving the fewest
+// pages, or NULL if every block holds pages that cannot be moved
+static struct Page *
+page_compact_target(unsigned order)
+{
+  struct Page *best = NULL;
+  unsigned best_moves = ~0U;
+  unsigned start, i;
+
+  debug_assert(k_spinlock_holding(&page_lock));
+
+  for (start = 0; start + (1U << order) <= page_count; start += 1U << order) {
+    unsigned moves = 0;
+
+    for (i = start; i < start + (1U << order); ) {
+      struct Page *block;
+      unsigned o;
+
+      if ((block = page_free_containing(&pages[i], &o)) != NULL) {
+        i = (block - pages) + (1U << o);
+        continue;
+      }
+
+      if ((pages[i].debug_tag != (int) PAGE_TAG_ANON) ||
+          (pages[i].ref_count != 1))
+        break;
+
+      moves++;
+      i++;
+    }
+
+    if ((i == start + (1U << order)) && (moves > 0) && (moves < best_moves)) {
+      best       = &pages[start];
+      best_moves = moves;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * Try to rebuild a free block of the given order by moving allocated pages
+ * out of the way. Called by the allocator when a higher-order request cannot
+ * be satisfied even after reclaim.
+ *
+ * @param order The block order.
+ *
+ * @return A non-zero value if a free block of at least this order has been
+ *         formed, zero otherwise.
+ */
+int
+page_compact(unsigned order)
+{
+  struct Page *start, *block;
+  struct KListLink *l;
+  unsigned long moved = 0;
+  unsigned i, o;
+  int r;
+
+  if ((order == 0) || (order > PAGE_ORDER_MAX))
+    return 0;
+
+  // Another CPU is already compacting, let it finish
+  if (!__sync_bool_compare_and_swap(&page_compaction.active, 0, 1))
+    return 0;
+
+  k_spinlock_acquire(&page_lock);
+
+  if ((start = page_compact_target(order)) == NULL) {
+    k_spinlock_release(&page_lock);
+    __atomic_store_n(&page_compaction.active, 0, __ATOMIC_RELEASE);
+    return 0;
+  }
+
+  // Take the free parts off the free lists, so that the pages are not moved
+  // into the block itself
+  for (i = 0; i < (1U << order); ) {
+    if ((block = page_free_containing(&start[i], &o)) != NULL) {
+      page_k_list_remove(block, o);
+      page_free_count -= 1U << o;
+      k_list_add_back(&page_compaction.isolated[o], &block->link);
+
+      i = (block - start) + (1U << o);
+    } else {
+      i++;
+    }
+  }
+
+  page_compaction.start = start;
+  page_compaction.order = order;
+
+  k_spinlock_release(&page_lock);
+
+  k_rwspinlock_read_acquire(&page_migrators.lock);
+
+  KLIST_FOREACH(&page_migrators.head, l) {
+    struct PageMigrator *migrator;
+
+    migrator = KLIST_CONTAINER(l, struct PageMigrator, link);
+    moved += migrator->migrate(start, 1U << order);
+  }
+
+  k_rwspinlock_read_release(&page_migrators.lock);
+
+  // Give everything back, the buddies merge if all pages have been moved
+  k_spinlock_acquire(&page_lock);
+
+  for (o = 0; o <= PAGE_ORDER_MAX; o++) {
+    while (!k_list_is_empty(&page_compaction.isolated[o])) {
+      block = KLIST_CONTAINER(page_compaction.isolated[o].next, struct Page,
+                              link);
+      k_list_remove(&block->link);
+      page_free_locked(block, o);
+    }
+  }
+
+  r = ((block = page_free_containing(start, &o)) != NULL) && (o >= order);
+
+  page_compaction.start     = NULL;
+  page_compaction.migrated += moved;
+  if (r)
+    page_compaction.compacted++;
+
+  k_spinlock_release(&page_lock);
+
+  __atomic_store_n(&page_compaction.active, 0, __ATOMIC_RELEASE);
+
+  return r;
+}
+
+/**
+ * Give a page vacated by a migrator back to the compaction pass. The page
+ * must have no references left.
+ *
+ * @param page Pointer to the page structure.
+ */
+void
+page_compact_release(struct Page *page)
+{
+  struct Page *start = page_compaction.start;
+
+  if ((start == NULL) || (page < start) ||
+      (page >= start + (1U << page_compaction.order))) {
+    page_free_one(page);
+    return;
+  }
+
+  if (page->ref_count != 0)
+    panic("page->ref_count != 0 (%u)", page->ref_count);
+
+  page_tag_add(page->debug_tag, -1);
+  page->debug_tag = 0;
+
+  k_spinlock_acquire(&page_lock);
+  k_list_add_back(&page_compaction.isolated[0], &page->link);
+  k_spinlock_release(&page_lock);
 }
 
 /**
@@ -258,8 +1006,8 @@ page_free_region(physaddr_t start, physaddr_t end)
   unsigned blk_order, blk_length;
   unsigned page_idx, last_page_idx; 
 
-  page_idx = (start + PAGE_SIZE - 1) / PAGE_SIZE;
-  last_page_idx = (end / PAGE_SIZE);
+  page_idx = (start - PHYS_RAM_BASE + PAGE_SIZE - 1) / PAGE_SIZE;
+  last_page_idx = (end - PHYS_RAM_BASE) / PAGE_SIZE;
 
   while (page_idx < last_page_idx) {
     blk_order  = PAGE_ORDER_MAX;
@@ -275,7 +1023,13 @@ page_free_region(physaddr_t start, physaddr_t end)
       blk_order--;
     }
 
-    page_free_block(&pages[page_idx], blk_order);
+    // Bypass the per-CPU caches, the pages go straight to the free lists
+    if (pages[page_idx].ref_count != 0)
+      panic("page->ref_count != 0 (%u)", pages[page_idx].ref_count);
+
+    k_spinlock_acquire(&page_lock);
+    page_free_locked(&pages[page_idx], blk_order);
+    k_spinlock_release(&page_lock);
 
     page_idx += blk_length;
   }
@@ -0,0 +1,451 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <kernel/boot.h>
+#include <kernel/console.h>
+#include <kernel/core/semaphore.h>
+#include <kernel/dev.h>
+#include <kernel/fs/buf.h>
+#include <kernel/page.h>
+#include <kernel/spinlock.h>
+#include <kernel/swap.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
+#include <kernel/types.h>
+#include <kernel/vmalloc.h>
+#include <kernel/vmspace.h>
+
+/**
+ * @defgroup swap Swapping
+ *
+ * Anonymous memory can be overcommitted by writing pages that have not been
+ * accessed for a while to a swap area on a block device. The area is a range
+ * of page-sized blocks reserved on the SD card right after the root filesystem
+ * (see SWAP_START and SWAP_BLOCKS in kernel.mk), or the whole compressed RAM
+ * disk if built with SWAP_ZRAM. Its blocks are transferred with requests to
+ * the block device driver that bypass the buffer cache.
+ *
+ * The swap daemon keeps the number of free pages above SWAP_FREE_LOW. There is
+ * no reverse mapping from physical pages to page table entries, so the page
+ * scanner sweeps the anonymous areas of all address spaces instead, and the
+ * clock algorithm works on page table entries (see vm_page_age()). The pages
+ * not accessed since the previous sweep are collected into clusters of
+ * adjacent slots, so that each cluster goes to the card as a single
+ * multiple-block write.
+ *
+ * A slot is referred to by the page table entries holding it, counted the
+ * same way as the references to physical pages. Until its cluster has been
+ * written out, a slot can be read straight from the page being written.
+ */
+
+#ifndef SWAP_START
+#define SWAP_START      0
+#endif
+#ifndef SWAP_BLOCKS
+#define SWAP_BLOCKS     0
+#endif
+
+#ifndef SWAP_DEV
+// The device holding the swap area (the SD card)
+#define SWAP_DEV        0
+#endif
+// Start swapping out when fewer free pages are left
+#define SWAP_FREE_LOW   512
+// Stop swapping out when this many free pages are available again
+#define SWAP_FREE_HIGH  1024
+// The maximum number of page table entries visited to fill one cluster
+#define SWAP_SCAN_BATCH 512
+// How often the swap daemon checks the number of free pages
+#define SWAP_INTERVAL   seconds2ticks(1)
+
+static unsigned long swap_shrink(void);
+
+static struct PageShrinker swap_shrinker = {
+  .name   = "swap",
+  .shrink = swap_shrink,
+};
+
+static struct {
+  uint16_t          *map;         ///< Reference counts of the slots
+  unsigned long      size;        ///< The number of slots
+  unsigned long      used;        ///< Slots in use
+  unsigned long      next;        ///< Where to look for free slots
+  struct SwapCluster cluster;     ///< The cluster being written out
+  unsigned long      out;
+  unsigned long      in;
+  unsigned long      clusters;
+  int                sleeping;    ///< Whether the daemon is waiting
+  struct KSemaphore  semaphore;   ///< The daemon waits here
+  struct KSpinLock   lock;
+} swap;
+
+// Buffers used to write out the cluster, only touched by the daemon
+static struct Buf swap_bufs[SWAP_CLUSTER];
+
+static void swap_thread(void *);
+
+/**
+ * Start the swap daemon. The swap area itself is set up once the storage
+ * devices have been probed.
+ */
+void
+swap_init(void)
+{
+  struct KThread *thread;
+
+  k_spinlock_init(&swap.lock, "swap");
+  k_semaphore_init(&swap.semaphore, 0);
+
+  if (SWAP_BLOCKS == 0)
+    return;
+
+  if ((thread = k_thread_create(NULL, swap_thread, NULL, NZERO)) == NULL)
+    panic("cannot create the swap daemon");
+  k_thread_resume(thread);
+}
+
+// Set up the swap area, if there is a device to hold it
+static int
+swap_area_init(void)
+{
+  uint16_t *map;
+  unsigned i;
+
+  // The SD card is probed in the background
+  boot_wait();
+
+  if (dev_lookup_block(SWAP_DEV) == NULL)
+    return -ENODEV;
+
+  map = (uint16_t *) vmalloc(SWAP_BLOCKS * sizeof(map[0]), PAGE_ALLOC_ZERO);
+  if (map == NULL)
+    return -ENOMEM;
+
+  for (i = 0; i < SWAP_CLUSTER; i++)
+    k_mutex_init(&swap_bufs[i].mutex, "swap");
+
+  k_spinlock_acquire(&swap.lock);
+  swap.map  = map;
+  swap.size = SWAP_BLOCKS;
+  k_spinlock_release(&swap.lock);
+
+  page_shrinker_register(&swap_shrinker);
+
+  cprintf("Swap: %lu KiB\n", swap.size * (PAGE_SIZE / 1024));
+
+  return 0;
+}
+
+/**
+ * Collect the swap usage statistics.
+ *
+ * @param stats Where to store the statistics
+ */
+void
+swap_get_stats(struct SwapStats *stats)
+{
+  k_spinlock_acquire(&swap.lock);
+
+  stats->total    = swap.size;
+  stats->used     = swap.used;
+  stats->out      = swap.out;
+  stats->in       = swap.in;
+  stats->clusters = swap.clusters;
+
+  k_spinlock_release(&swap.lock);
+}
+
+/**
+ * Add a reference to a swap slot.
+ *
+ * @param slot The slot number
+ */
+void
+swap_dup(unsigned long slot)
+{
+  k_spinlock_acquire(&swap.lock);
+
+  assert(slot < swap.size);
+  assert(swap.map[slot] > 0);
+
+  if (swap.map[slot] == UINT16_MAX)
+    panic("too many references to swap slot %lu", slot);
+  swap.map[slot]++;
+
+  k_spinlock_release(&swap.lock);
+}
+
+/**
+ * Drop a reference to a swap slot, making it available once the last one is
+ * gone.
+ *
+ * @param slot The slot number
+ */
+void
+swap_free(unsigned long slot)
+{
+  k_spinlock_acquire(&swap.lock);
+
+  assert(slot < swap.size);
+  assert(swap.map[slot] > 0);
+
+  if (--swap.map[slot] == 0)
+    swap.used--;
+
+  k_spinlock_release(&swap.lock);
+}
+
+/**
+ * Record a page that has been assigned the next slot of the cluster. Called
+ * by the page scanner with the lock of the address space held, so that the
+ * slot can be read back from the page immediately.
+ *
+ * @param cluster The cluster
+ * @param page    The page, no longer mapped anywhere
+ */
+void
+swap_cluster_add(struct SwapCluster *cluster, struct Page *page)
+{
+  k_spinlock_acquire(&swap.lock);
+
+  assert(cluster->count < cluster->size);
+  cluster->pages[cluster->count++] = page;
+
+  k_spinlock_release(&swap.lock);
+}
+
+/**
+ * Read the contents of a swap slot into a new page. The caller must hold a
+ * reference to the slot. May sleep.
+ *
+ * @param slot       The slot number
+ * @param page_store Pointer to the memory location to store the page, which
+ *                   has no references yet
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ * @retval -EIO    The slot cannot be read
+ */
+int
+swap_read(unsigned long slot, struct Page **page_store)
+{
+  struct BufCompletion completion;
+  struct Buf buf, *bufp = &buf;
+  struct SwapCluster *cluster = &swap.cluster;
+  struct Page *page;
+
+  if ((page = page_alloc_one(0, PAGE_TAG_ANON)) == NULL)
+    return -ENOMEM;
+
+  k_spinlock_acquire(&swap.lock);
+
+  swap.in++;
+
+  // The cluster holding the slot may still be in flight
+  if ((slot >= cluster->first) && (slot < cluster->first + cluster->count)) {
+    memcpy(page2kva(page), page2kva(cluster->pages[slot - cluster->first]),
+           PAGE_SIZE);
+    k_spinlock_release(&swap.lock);
+
+    *page_store = page;
+    return 0;
+  }
+
+  k_spinlock_release(&swap.lock);
+
+  memset(&buf, 0, sizeof(buf));
+  k_mutex_init(&buf.mutex, "swap");
+
+  buf.block_no   = SWAP_START + slot;
+  buf.dev        = SWAP_DEV;
+  buf.block_size = PAGE_SIZE;
+  buf.data       = (uint8_t *) page2kva(page);
+
+  k_mutex_lock(&buf.mutex);
+
+  buf_completion_init(&completion, NULL);
+  buf_submit(&bufp, 1, &completion);
+  buf_wait(&completion);
+
+  k_mutex_unlock(&buf.mutex);
+  k_mutex_fini(&buf.mutex);
+
+  if (!(buf.flags & BUF_VALID)) {
+    page_free_one(page);
+    return -EIO;
+  }
+
+  *page_store = page;
+  return 0;
+}
+
+// Allocate a run of up to SWAP_CLUSTER free adjacent slots for the cluster.
+// Each slot gets one reference, taken over by the entry it is assigned to
+static unsigned
+swap_cluster_alloc(struct SwapCluster *cluster)
+{
+  unsigned long i, n;
+
+  k_spinlock_acquire(&swap.lock);
+
+  for (i = 0, n = 0; (i < swap.size) && (n < SWAP_CLUSTER); i++) {
+    unsigned long slot = (swap.next + i) % swap.size;
+
+    // Take the first run of free slots, which cannot wrap around the end of
+    // the area
+    if ((swap.map[slot] != 0) || ((n > 0) && (slot == 0))) {
+      if (n > 0)
+        break;
+      continue;
+    }
+
+    if (n++ == 0)
+      cluster->first = slot;
+  }
+
+  for (i = 0; i < n; i++)
+    swap.map[cluster->first + i] = 1;
+  swap.used += n;
+  swap.next  = (cluster->first + n) % swap.size;
+
+  cluster->size  = n;
+  cluster->count = 0;
+
+  k_spinlock_release(&swap.lock);
+
+  return n;
+}
+
+// Write out the pages of the cluster as one request and release them,
+// together with the slots left unused
+static void
+swap_cluster_write(struct SwapCluster *cluster)
+{
+  struct BufCompletion completion;
+  struct Buf *bufs[SWAP_CLUSTER];
+  unsigned i, n;
+
+  n = cluster->count;
+
+  for (i = 0; i < n; i++) {
+    struct Buf *buf = &swap_bufs[i];
+
+    k_mutex_lock(&buf->mutex);
+
+    buf->block_no   = SWAP_START + cluster->first + i;
+    buf->dev        = SWAP_DEV;
+    buf->flags      = BUF_VALID | BUF_DIRTY;
+    buf->block_size = PAGE_SIZE;
+    buf->data       = (uint8_t *) page2kva(cluster->pages[i]);
+
+    bufs[i] = buf;
+  }
+
+  if (n > 0) {
+    buf_completion_init(&completion, NULL);
+    buf_submit(bufs, n, &completion);
+    buf_wait(&completion);
+  }
+
+  for (i = 0; i < n; i++)
+    k_mutex_unlock(&swap_bufs[i].mutex);
+
+  // From now on, the slots are read from the card
+  k_spinlock_acquire(&swap.lock);
+
+  for (i = n; i < cluster->size; i++)
+    if (--swap.map[cluster->first + i] == 0)
+      swap.used--;
+
+  cluster->size  = 0;
+  cluster->count = 0;
+
+  swap.out += n;
+  if (n > 0)
+    swap.clusters++;
+
+  k_spinlock_release(&swap.lock);
+
+  for (i = 0; i < n; i++)
+    page_free_one(cluster->pages[i]);
+}
+
+// Swap out one cluster of pages. Returns the number of pages written out
+static unsigned
+swap_out(void)
+{
+  struct SwapCluster *cluster = &swap.cluster;
+  unsigned n, scanned = 0;
+
+  if (swap_cluster_alloc(cluster) == 0)
+    return 0;
+
+  // Each page needs two visits of the scanner to be swapped out
+  while ((cluster->count < cluster->size) && (scanned < 2 * SWAP_SCAN_BATCH)) {
+    n = vm_space_swap_scan(cluster, SWAP_SCAN_BATCH);
+    if (n == 0)
+      break;
+    scanned += n;
+  }
+
+  n = cluster->count;
+  swap_cluster_write(cluster);
+
+  return n;
+}
+
+static void
+swap_thread(void *arg)
+{
+  int r;
+
+  (void) arg;
+
+  if ((r = swap_area_init()) < 0) {
+    warn("swap disabled: %d", r);
+    return;
+  }
+
+  for (;;) {
+    if (page_free_count < SWAP_FREE_LOW)
+      while ((page_free_count < SWAP_FREE_HIGH) && (swap_out() > 0))
+        ;
+
+    k_spinlock_acquire(&swap.lock);
+    swap.sleeping = 1;
+    k_spinlock_release(&swap.lock);
+
+    // Also check periodically, since the allocator only wakes the daemon up
+    // once it runs out of memory
+    k_semaphore_timed_get(&swap.semaphore, SWAP_INTERVAL);
+
+    k_spinlock_acquire(&swap.lock);
+    swap.sleeping = 0;
+    k_spinlock_release(&swap.lock);
+  }
+}
+
+// Called by the page allocator when it runs out of memory. Writing pages out
+// takes too long to be done here, so only wake up the swap daemon.
+static unsigned long
+swap_shrink(void)
+{
+  int wakeup = 0;
+
+  if (k_spinlock_try_acquire(&swap.lock) != 0)
+    return 0;
+
+  if (swap.sleeping) {
+    swap.sleeping = 0;
+    wakeup = 1;
+  }
+
+  k_spinlock_release(&swap.lock);
+
+  if (wakeup)
+    k_semaphore_put(&swap.semaphore);
+
+  return 0;
+}
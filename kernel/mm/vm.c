@@ -4,16 +4,220 @@
 #include <kernel/vm.h>
 #include <kernel/types.h>
 #include <kernel/spinlock.h>
+#include <kernel/swap.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <kernel/fs/fs.h>
+#include <kernel/vmspace.h>
+#include <kernel/trace.h>
+
+/*
+ * Each address space has its own lock that protects its page table, so page
+ * faults in unrelated processes proceed in parallel. Physical pages may be
+ * shared between several address spaces (after fork or by mapping the same
+ * page more than once), so their reference counters are always updated
+ * atomically with vm_page_ref() and vm_page_unref().
+ *
+ * Large blocks can be mapped with sections (see VM_SECTION_SIZE). A section
+ * holds one reference to the first page of the block. Anonymous sections are
+ * private to one address space and are transparently split into small pages
+ * whenever a single page has to be remapped, so only vm_page_lookup() and
+ * vm_page_flags() must be aware of them. Other sections (e.g. the framebuffer)
+ * can only be mapped and unmapped as a whole.
+ *
+ * To make fork cheap, the child does not get its own copies of the parent's
+ * second-level page tables. Both address spaces point to the same tables,
+ * whose writable entries are turned into copy-on-write ones, and whose pages
+ * are referenced once, on behalf of all the owners. Before changing any entry,
+ * an address space makes a private copy of the table (see vm_table_private()),
+ * taking its own references to the mapped pages. Only tables that are written
+ * to are ever copied, so fork costs time proportional to the number of tables
+ * rather than to the number of pages.
+ *
+ * Shared file mappings (VM_SHARED) map the pages of the page cache directly.
+ * They reuse the copy-on-write machinery to track modifications: clean pages
+ * are mapped read-only with VM_COW, and the first write marks the entry with
+ * VM_DIRTY and makes it writable instead of copying the page. Writing the
+ * page back to the file (see vm_user_clean()) protects it again.
+ *
+ * Reading an untouched page of a private anonymous mapping does not allocate
+ * memory: a single global zero page is mapped read-only instead, with VM_COW
+ * if the mapping is writable, and the first write replaces it with a private
+ * page like any other copy-on-write page.
+ *
+ * Anonymous pages that are not accessed for a while are written out to swap
+ * (see vm_page_age()). The hardware does not track accesses, so the page
+ * scanner emulates the accessed bit by making an entry invalid while keeping
+ * the page address (VM_OLD). The next access faults and simply makes the entry
+ * valid again. Pages still unmapped when the scanner comes back are replaced
+ * with reservations referring to swap slots (VM_SWAP), and read back on the
+ * next access. Only entries of private tables are ever aged, so shared tables
+ * can hold swap entries, but no VM_OLD ones.
+ */
+
+static int vm_section_split(struct VMSpace *, uintptr_t);
+static int vm_table_private(struct VMSpace *, uintptr_t);
+static int vm_flags_check(int, int);
+static int vm_page_flags(struct VMSpace *, uintptr_t, int *);
+static int vm_pte_present(void *);
+static int vm_pte_touch(void *);
+
+// Protects the reference counts of the shared second-level tables
+static struct KSpinLock vm_table_lock = K_SPINLOCK_INITIALIZER("vm_table");
+
+// Mapped by read faults on anonymous memory, never freed
+static struct Page *vm_zero_page;
+
+/**
+ * Initialize the virtual memory manager.
+ */
+void
+vm_init(void)
+{
+  vm_zero_page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_KERNEL_VM);
+  if (vm_zero_page == NULL)
+    panic("cannot allocate the zero page");
+
+  // Keep the page even when no one maps it
+  vm_zero_page->ref_count++;
+}
+
+// Add a reference to a page mapped into a user address space
+static void
+vm_page_ref(struct Page *page)
+{
+  __atomic_add_fetch(&page->ref_count, 1, __ATOMIC_RELAXED);
+}
+
+// Drop a reference to a page, freeing it when the last mapping is gone
+static void
+vm_page_unref(struct Page *page)
+{
+  if (__atomic_sub_fetch(&page->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+    page_free_one(page);
+}
+
+// Add (or drop) one reference to each page mapped by the second-level tables
+// that contain the given address
+static void
+vm_table_ref_pages(struct VMSpace *vm, uintptr_t base, int ref)
+{
+  uintptr_t va;
+
+  for (va = base; va < base + VM_TABLE_SIZE; va += PAGE_SIZE) {
+    void *pte = arch_vm_lookup(vm->pgtab, va, 0);
+    struct Page *page;
+
+    if ((pte == NULL) || !arch_vm_pte_valid(pte) ||
+        !(arch_vm_pte_flags(pte) & VM_PAGE))
+      continue;
+
+    page = pa2page(arch_vm_pte_addr(pte));
+
+    // Never drops the last reference, the original tables still hold one
+    if (ref)
+      vm_page_ref(page);
+    else
+      __atomic_sub_fetch(&page->ref_count, 1, __ATOMIC_RELAXED);
+  }
+
+  // Swapped out pages are referred to by their slots instead
+  for (va = base; va < base + VM_TABLE_SIZE; va += PAGE_SIZE) {
+    void *pte = arch_vm_lookup(vm->pgtab, va, 0);
+
+    if ((pte == NULL) || arch_vm_pte_valid(pte) ||
+        !(arch_vm_pte_flags(pte) & VM_SWAP))
+      continue;
+
+    if (ref)
+      swap_dup(arch_vm_pte_swap(pte));
+    else
+      swap_free(arch_vm_pte_swap(pte));
+  }
+}
+
+/**
+ * Make sure the second-level tables mapping the given address are not shared
+ * with other address spaces. Must be called before modifying any of their
+ * entries, or relying on the reference counts of the pages they map.
+ *
+ * @param vm The address space
+ * @param va The virtual address
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ */
+static int
+vm_table_private(struct VMSpace *vm, uintptr_t va)
+{
+  uintptr_t base = ROUND_DOWN(va, VM_TABLE_SIZE);
+  int r = 0;
+
+  debug_assert(k_spinlock_holding(&vm->lock));
+
+  // Other owners can only drop their references, and no one can add new ones
+  // without holding our lock, so a single owner is a stable answer
+  if (arch_vm_table_refs(vm->pgtab, base) < 2)
+    return 0;
+
+  k_spinlock_acquire(&vm_table_lock);
+
+  if (arch_vm_table_refs(vm->pgtab, base) > 1) {
+    // Take the references for the copy before it appears, so that the other
+    // owners cannot free any of the pages in the meantime
+    vm_table_ref_pages(vm, base, 1);
+
+    if ((r = arch_vm_table_copy(vm->pgtab, base)) < 0)
+      vm_table_ref_pages(vm, base, 0);
+  }
+
+  k_spinlock_release(&vm_table_lock);
+
+  return r;
+}
+
+// Share the second-level tables containing the given address with a new
+// address space (both locks must be held)
+static void
+vm_table_share(struct VMSpace *src, struct VMSpace *dst, uintptr_t va,
+               int *protected)
+{
+  uintptr_t base = ROUND_DOWN(va, VM_TABLE_SIZE);
+
+  k_spinlock_acquire(&vm_table_lock);
+
+  // Tables that are already shared have no writable entries
+  if (arch_vm_table_refs(src->pgtab, base) == 1) {
+    for (va = base; va < base + VM_TABLE_SIZE; va += PAGE_SIZE) {
+      void *pte = arch_vm_lookup(src->pgtab, va, 0);
+      int flags;
+
+      if (pte == NULL)
+        continue;
 
-struct KSpinLock vm_lock = K_SPINLOCK_INITIALIZER("vm_lock");
+      // Pages unmapped by the page scanner must be write-protected as well
+      vm_pte_touch(pte);
+
+      if (!arch_vm_pte_valid(pte))
+        continue;
+
+      flags = arch_vm_pte_flags(pte);
+      if ((flags & (VM_PAGE | VM_WRITE)) == (VM_PAGE | VM_WRITE)) {
+        arch_vm_pte_set(pte, arch_vm_pte_addr(pte),
+                        (flags & ~VM_WRITE) | VM_COW);
+        *protected = 1;
+      }
+    }
+  }
+
+  arch_vm_table_share(src->pgtab, dst->pgtab, base);
+
+  k_spinlock_release(&vm_table_lock);
+}
 
 /**
  * Find a physical page mapped at the given virtual address.
  * 
- * @param pgtab       Pointer to the page table to search
+ * @param vm          The address space to search
  * @param va          The virtual address to search for
  * @param flags_store Pointer to the memory location to store the mapping flags
  *
@@ -21,27 +225,25 @@ struct KSpinLock vm_lock = K_SPINLOCK_INITIALIZER("vm_lock");
  *         address
  */
 struct Page *
-vm_page_lookup(void *pgtab, uintptr_t va, int *flags_store)
+vm_page_lookup(struct VMSpace *vm, uintptr_t va, int *flags_store)
 {
   void *pte;
 
-  assert(k_spinlock_holding(&vm_lock));
+  debug_assert(k_spinlock_holding(&vm->lock));
 
-  if ((pte = arch_vm_lookup(pgtab, va, 0)) == NULL)
-    return NULL;
+  if ((pte = arch_vm_lookup(vm->pgtab, va, 0)) == NULL) {
+    physaddr_t pa;
+
+    if (!arch_vm_section_lookup(vm->pgtab, va, &pa, flags_store))
+      return NULL;
+    return pa2page(pa);
+  }
 
   if (!arch_vm_pte_valid(pte) || !(arch_vm_pte_flags(pte) & VM_PAGE))
     return NULL;
 
-  if (flags_store) {
-    if (va == 0x8cb8) {
-      *flags_store = *(int *) pte;
-    } else {
-      *flags_store = arch_vm_pte_flags(pte);
-    }
-
-    
-  }
+  if (flags_store)
+    *flags_store = arch_vm_pte_flags(pte);
 
   return pa2page(arch_vm_pte_addr(pte));
 }
@@ -50,7 +252,7 @@ vm_page_lookup(void *pgtab, uintptr_t va, int *flags_store)
  * Map a physical page at the given virtual address. If there is already a page
  * mapped at this address, remove it.
  * 
- * @param pgtab Pointer to the page table
+ * @param vm    The address space
  * @param page  Pointer to the page to be mapped
  * @param va    The virtual address
  * @param flags The mapping flags
@@ -59,333 +261,1552 @@ vm_page_lookup(void *pgtab, uintptr_t va, int *flags_store)
  * @retval -ENOMEM Out of memory
  */
 int
-vm_page_insert(void *pgtab, struct Page *page, uintptr_t va, int flags)
+vm_page_insert(struct VMSpace *vm, struct Page *page, uintptr_t va, int flags)
 {
   void *pte;
+  int r;
 
-  assert(k_spinlock_holding(&vm_lock));
+  debug_assert(k_spinlock_holding(&vm->lock));
 
-  if ((pte = arch_vm_lookup(pgtab, va, 1)) == NULL)
+  if ((r = vm_table_private(vm, va)) < 0)
+    return r;
+  if ((r = vm_section_split(vm, va)) < 0)
+    return r;
+
+  if ((pte = arch_vm_lookup(vm->pgtab, va, 1)) == NULL)
     return -ENOMEM;
 
   // Incrementing the reference counter before calling vm_page_remove() allows
   // us to elegantly handle the situation when the same page is re-inserted at
   // the same virtual address, but with different permissions
-  page->ref_count++;
+  vm_page_ref(page);
 
   // If present, remove the previous mapping
-  vm_page_remove(pgtab, (uintptr_t) va);
+  vm_page_remove(vm, (uintptr_t) va);
 
   arch_vm_pte_set(pte, page2pa(page), flags | VM_PAGE);
 
   return 0;
 }
 
+// Clear the mapping at the given virtual address without touching the TLB.
+// The page that was mapped there (or NULL) is stored into page_store, and the
+// caller must drop its reference only after invalidating the TLB entries, since
+// other CPUs can keep writing to the page until then.
+static int
+vm_page_clear(struct VMSpace *vm, uintptr_t va, struct Page **page_store)
+{
+  void *pte;
+  int r;
+
+  debug_assert(k_spinlock_holding(&vm->lock));
+
+  *page_store = NULL;
+
+  if ((r = vm_table_private(vm, va)) < 0)
+    return r;
+  if ((r = vm_section_split(vm, va)) < 0)
+    return r;
+
+  if ((pte = arch_vm_lookup(vm->pgtab, va, 0)) == NULL)
+    return 0;
+
+  if (!vm_pte_present(pte)) {
+    // Drop the reservation for a page that has never been touched (or that
+    // has been swapped out)
+    if (arch_vm_pte_flags(pte) & VM_SWAP)
+      swap_free(arch_vm_pte_swap(pte));
+    if (arch_vm_pte_flags(pte) & VM_LAZY)
+      arch_vm_pte_clear(pte);
+    return 0;
+  }
+
+  if (!(arch_vm_pte_flags(pte) & VM_PAGE))
+    return 0;
+
+  *page_store = pa2page(arch_vm_pte_addr(pte));
+  arch_vm_pte_clear(pte);
+
+  return 0;
+}
+
 /**
  * Unmap the physical page at the given virtual address. If there is no page
  * mapped at this address, do nothing.
  * 
- * @param pgtab The page table
+ * @param vm    The address space
  * @param va    The virtual address
  *
- * @return 0 on success
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory (to split a section)
  */
 int
-vm_page_remove(void *pgtab, uintptr_t va)
+vm_page_remove(struct VMSpace *vm, uintptr_t va)
 {
   struct Page *page;
+  int r;
+
+  if (((r = vm_page_clear(vm, va, &page)) < 0) || (page == NULL))
+    return r;
+
+  arch_vm_invalidate(va);
+  vm_page_unref(page);
+
+  return 0;
+}
+
+/**
+ * Move the anonymous page mapped at the given virtual address to another
+ * physical page. Used to compact physical memory, so only pages mapped exactly
+ * once, by a table private to this address space, can be moved.
+ *
+ * @param vm        The address space
+ * @param va        The virtual address
+ * @param new_page  The page to copy the contents into
+ * @param old_store Pointer to the memory location to store the vacated page,
+ *                  which has no references left
+ *
+ * @retval 0       Success
+ * @retval -EINVAL No small page is mapped at the given address
+ * @retval -EBUSY  The page is shared and cannot be moved
+ */
+int
+vm_page_migrate(struct VMSpace *vm, uintptr_t va, struct Page *new_page,
+                struct Page **old_store)
+{
+  struct Page *old_page;
   void *pte;
+  int flags;
 
-  assert(k_spinlock_holding(&vm_lock));
+  debug_assert(k_spinlock_holding(&vm->lock));
 
-  if ((pte = arch_vm_lookup(pgtab, va, 0)) == NULL)
-    return 0;
+  if (((pte = arch_vm_lookup(vm->pgtab, va, 0)) == NULL) ||
+      !arch_vm_pte_valid(pte) || !((flags = arch_vm_pte_flags(pte)) & VM_PAGE))
+    return -EINVAL;
 
-  if (!arch_vm_pte_valid(pte) || !(arch_vm_pte_flags(pte) & VM_PAGE))
+  // The pages of a shared table hold one reference on behalf of all owners
+  if (arch_vm_table_refs(vm->pgtab, ROUND_DOWN(va, VM_TABLE_SIZE)) > 1)
+    return -EBUSY;
+
+  old_page = pa2page(arch_vm_pte_addr(pte));
+  if ((old_page->debug_tag != (int) PAGE_TAG_ANON) ||
+      (old_page->ref_count != 1))
+    return -EBUSY;
+
+  // Other threads must not write to the old page while it is being copied,
+  // their faults wait for the lock
+  arch_vm_pte_clear(pte);
+  arch_vm_invalidate_range(__atomic_load_n(&vm->asid, __ATOMIC_RELAXED),
+                           va, va + PAGE_SIZE);
+
+  memcpy(page2kva(new_page), page2kva(old_page), PAGE_SIZE);
+
+  vm_page_ref(new_page);
+  arch_vm_pte_set(pte, page2pa(new_page), flags);
+
+  __atomic_sub_fetch(&old_page->ref_count, 1, __ATOMIC_ACQ_REL);
+  *old_store = old_page;
+
+  return 0;
+}
+
+// Whether the entry maps a page, possibly unmapped by the page scanner
+static int
+vm_pte_present(void *pte)
+{
+  return arch_vm_pte_valid(pte) || (arch_vm_pte_flags(pte) & VM_OLD);
+}
+
+// Map a page unmapped by the page scanner again, since it is being accessed.
+// Returns 1 if the entry has been changed
+static int
+vm_pte_touch(void *pte)
+{
+  int flags = arch_vm_pte_flags(pte);
+
+  if (arch_vm_pte_valid(pte) || !(flags & VM_OLD))
     return 0;
 
+  // Invalid entries are never cached by the TLB
+  arch_vm_pte_set(pte, arch_vm_pte_addr(pte), flags & ~VM_OLD);
+
+  return 1;
+}
+
+/**
+ * Advance the page scanner over the anonymous page mapped at the given virtual
+ * address. A page visited for the first time is unmapped, keeping its address
+ * (VM_OLD), so that the next access brings it back. A page that is still
+ * unmapped on the next visit has not been accessed meanwhile, and its entry is
+ * replaced with a reservation referring to the given swap slot.
+ *
+ * @param vm         The address space
+ * @param va         The page-aligned virtual address
+ * @param slot       The swap slot to write the page into
+ * @param page_store Pointer to the memory location to store the page to be
+ *                   written out, which has no references left
+ *
+ * @retval 1       The page has to be written into the slot
+ * @retval 0       The page has been marked as old
+ * @retval -EINVAL No private anonymous page is mapped at the given address
+ * @retval -EBUSY  The page is shared and cannot be swapped out
+ */
+int
+vm_page_age(struct VMSpace *vm, uintptr_t va, unsigned long slot,
+            struct Page **page_store)
+{
+  struct Page *page;
+  void *pte;
+  int flags;
+
+  debug_assert(k_spinlock_holding(&vm->lock));
+
+  if (((pte = arch_vm_lookup(vm->pgtab, va, 0)) == NULL) ||
+      !vm_pte_present(pte))
+    return -EINVAL;
+
+  flags = arch_vm_pte_flags(pte);
+  if ((flags & (VM_PAGE | VM_USER | VM_SHARED)) != (VM_PAGE | VM_USER))
+    return -EINVAL;
+
+  // The pages of a shared table hold one reference on behalf of all owners
+  if (arch_vm_table_refs(vm->pgtab, ROUND_DOWN(va, VM_TABLE_SIZE)) > 1)
+    return -EBUSY;
+
   page = pa2page(arch_vm_pte_addr(pte));
+  if ((page->debug_tag != (int) PAGE_TAG_ANON) || (page->ref_count != 1))
+    return -EBUSY;
 
-  if (--page->ref_count == 0)
-    page_free_one(page);
+  if (!(flags & VM_OLD)) {
+    arch_vm_pte_set_old(pte, flags | VM_OLD);
+    arch_vm_invalidate_range(__atomic_load_n(&vm->asid, __ATOMIC_RELAXED),
+                             va, va + PAGE_SIZE);
+    return 0;
+  }
 
-  arch_vm_pte_clear(pte);
-  arch_vm_invalidate(va);
+  // The page is read back as a private one
+  if (flags & VM_COW)
+    flags = (flags & ~VM_COW) | VM_WRITE;
+  flags &= ~(VM_PAGE | VM_OLD);
+
+  // The entry is already invalid, so no TLB entries refer to the page
+  arch_vm_pte_set_swap(pte, slot, flags | VM_LAZY | VM_SWAP);
+
+  __atomic_sub_fetch(&page->ref_count, 1, __ATOMIC_ACQ_REL);
+  *page_store = page;
+
+  return 1;
+}
+
+/**
+ * Reserve a page at the given virtual address without allocating memory. The
+ * page is allocated and filled with zeros on first access.
+ *
+ * @param vm    The address space
+ * @param va    The virtual address
+ * @param flags The mapping flags
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ */
+static int
+vm_page_reserve(struct VMSpace *vm, uintptr_t va, int flags)
+{
+  void *pte;
+  int r;
+
+  debug_assert(k_spinlock_holding(&vm->lock));
+
+  if ((r = vm_table_private(vm, va)) < 0)
+    return r;
+  if ((r = vm_section_split(vm, va)) < 0)
+    return r;
+
+  if ((pte = arch_vm_lookup(vm->pgtab, va, 1)) == NULL)
+    return -ENOMEM;
+
+  vm_page_remove(vm, va);
+
+  arch_vm_pte_set_flags(pte, (flags & ~VM_PAGE) | VM_LAZY);
+
+  return 0;
+}
+
+// Drop the reference held by a section mapping
+static void
+vm_section_unref(struct Page *page)
+{
+  if (__atomic_sub_fetch(&page->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+    page_free_block(page, VM_SECTION_ORDER);
+}
+
+/**
+ * Replace the anonymous section containing the given address (if any) with
+ * small pages, each holding its own reference.
+ *
+ * @param vm The address space
+ * @param va The virtual address
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The section cannot be split
+ * @retval -ENOMEM Out of memory
+ */
+static int
+vm_section_split(struct VMSpace *vm, uintptr_t va)
+{
+  struct Page *block;
+  physaddr_t pa;
+  int i, r;
+
+  if (!arch_vm_section_lookup(vm->pgtab, va, &pa, NULL))
+    return 0;
+
+  block = pa2page(ROUND_DOWN(pa, VM_SECTION_SIZE));
+  if ((block->debug_tag != (int) PAGE_TAG_ANON) || (block->ref_count != 1))
+    return -EINVAL;
+
+  // The new table may go into a page shared with the neighbouring entry
+  if ((r = vm_table_private(vm, va)) < 0)
+    return r;
+  if ((r = arch_vm_section_split(vm->pgtab, va)) < 0)
+    return r;
+
+  // The first page already holds the reference of the section
+  for (i = 1; i < (1 << VM_SECTION_ORDER); i++) {
+    block[i].ref_count = 1;
+    block[i].debug_tag = PAGE_TAG_ANON;
+  }
 
   return 0;
 }
 
+/**
+ * Try to back the entire section containing the given address with one
+ * zeroed block. This is only done if all pages of the section have been
+ * reserved with the same flags and none of them has been allocated yet.
+ *
+ * @param vm    The address space
+ * @param va    The faulting virtual address
+ * @param flags The flags of the reservation at va
+ *
+ * @return Pointer to the page at va or NULL if a section cannot be used
+ */
 static struct Page *
-vm_page_cow(void *pgtab, uintptr_t va, struct Page *page, int flags)
+vm_section_alloc(struct VMSpace *vm, uintptr_t va, int flags)
 {
-  struct Page *page_copy;
+  struct Page *block;
+  uintptr_t base;
+  unsigned i;
 
-  assert(flags & VM_COW);
+  base = ROUND_DOWN(va, VM_SECTION_SIZE);
 
-  flags &= ~VM_COW;
-  flags |= VM_WRITE;
+  for (i = 0; i < VM_SECTION_SIZE; i += PAGE_SIZE) {
+    void *pte = arch_vm_lookup(vm->pgtab, base + i, 0);
+
+    if ((pte == NULL) || arch_vm_pte_valid(pte) ||
+        (arch_vm_pte_flags(pte) != flags))
+      return NULL;
+  }
+
+  if (vm_table_private(vm, base) < 0)
+    return NULL;
+
+  block = page_alloc_block(VM_SECTION_ORDER,
+                           PAGE_ALLOC_ZERO | PAGE_ALLOC_NORECLAIM,
+                           PAGE_TAG_ANON);
+  if (block == NULL)
+    return NULL;
+
+  block->ref_count++;
+
+  arch_vm_section_set(vm->pgtab, base, page2pa(block), flags & ~VM_LAZY);
+
+  return block + (va - base) / PAGE_SIZE;
+}
+
+/**
+ * Get a page for a file-backed reservation and fill it with the file
+ * contents. The lock is released while reading the file.
+ *
+ * @param vm          The address space
+ * @param va          The virtual address
+ * @param flags       The flags of the reservation at va
+ * @param flags_store Pointer to the memory location to store the mapping flags
+ *
+ * @return Pointer to the page or NULL on error
+ */
+static struct Page *
+vm_page_read(struct VMSpace *vm, uintptr_t va, int flags, int *flags_store)
+{
+  struct Page *page;
+  void *pte;
+  int r;
+
+  va = ROUND_DOWN(va, PAGE_SIZE);
+
+  k_spinlock_release(&vm->lock);
+  r = vmspace_fill_page(vm, va, &page);
+  k_spinlock_acquire(&vm->lock);
+
+  if (r < 0)
+    return NULL;
+
+  // Someone else might have populated the page in the meantime
+  pte = arch_vm_lookup(vm->pgtab, va, 0);
+  if ((pte == NULL) || arch_vm_pte_valid(pte) ||
+      (arch_vm_pte_flags(pte) != flags)) {
+    vm_page_unref(page);
+    return vm_page_lookup(vm, va, flags_store);
+  }
+
+  flags &= ~(VM_LAZY | VM_FILE);
+
+  // Pages shared with the page cache are copied on the first write
+  if ((r == 1) && (flags & VM_WRITE))
+    flags = (flags & ~VM_WRITE) | VM_COW;
+
+  if (vm_page_insert(vm, page, va, flags) < 0) {
+    vm_page_unref(page);
+    return NULL;
+  }
+
+  // The mapping now holds its own reference
+  vm_page_unref(page);
+
+  if (flags_store != NULL)
+    *flags_store = flags | VM_PAGE;
+
+  return page;
+}
+
+/**
+ * Read a swapped out page back and map it again. The lock is released while
+ * reading the page.
+ *
+ * @param vm          The address space
+ * @param va          The virtual address
+ * @param flags       The flags of the reservation at va
+ * @param flags_store Pointer to the memory location to store the mapping flags
+ *
+ * @return Pointer to the page or NULL on error
+ */
+static struct Page *
+vm_page_swap_in(struct VMSpace *vm, uintptr_t va, int flags, int *flags_store)
+{
+  struct Page *page;
+  unsigned long slot;
+  void *pte;
+  int r;
+
+  va   = ROUND_DOWN(va, PAGE_SIZE);
+  pte  = arch_vm_lookup(vm->pgtab, va, 0);
+  slot = arch_vm_pte_swap(pte);
+
+  // Keep the slot while the lock is not held
+  swap_dup(slot);
+
+  k_spinlock_release(&vm->lock);
+  r = swap_read(slot, &page);
+  k_spinlock_acquire(&vm->lock);
+
+  if (r < 0) {
+    swap_free(slot);
+    return NULL;
+  }
+
+  // Someone else might have read the page in the meantime
+  pte = arch_vm_lookup(vm->pgtab, va, 0);
+  if ((pte == NULL) || arch_vm_pte_valid(pte) ||
+      (arch_vm_pte_flags(pte) != flags) || (arch_vm_pte_swap(pte) != slot)) {
+    swap_free(slot);
+    page_free_one(page);
+    return vm_page_lookup(vm, va, flags_store);
+  }
+
+  flags &= ~(VM_LAZY | VM_SWAP);
+
+  // Replacing the entry drops its reference to the slot
+  r = vm_page_insert(vm, page, va, flags);
+  swap_free(slot);
+
+  if (r < 0) {
+    page_free_one(page);
+    return NULL;
+  }
+
+  if (flags_store != NULL)
+    *flags_store = flags | VM_PAGE;
+
+  return page;
+}
+
+/**
+ * Find a physical page mapped at the given virtual address, allocating a zero
+ * page if the address has been reserved by vm_page_reserve(). Pages reserved
+ * with VM_FILE are read from the file, and swapped out pages are read from the
+ * swap area, which temporarily releases the lock and may sleep, so the caller
+ * must not hold any other spinlocks.
+ *
+ * @param vm          The address space to search
+ * @param va          The virtual address to search for
+ * @param write       Whether the page is about to be written to. Otherwise,
+ *                    private anonymous memory gets the shared zero page
+ * @param flags_store Pointer to the memory location to store the mapping flags
+ *
+ * @return Pointer to the page or NULL if there is no page mapped at the given
+ *         address or out of memory
+ */
+static struct Page *
+vm_page_lookup_alloc(struct VMSpace *vm, uintptr_t va, int write,
+                     int *flags_store)
+{
+  struct Page *page;
+  void *pte;
+  int flags;
+
+  debug_assert(k_spinlock_holding(&vm->lock));
+
+  if ((page = vm_page_lookup(vm, va, flags_store)) != NULL)
+    return page;
+
+  if ((pte = arch_vm_lookup(vm->pgtab, va, 0)) == NULL)
+    return NULL;
+
+  flags = arch_vm_pte_flags(pte);
+
+  // Accessed again after being unmapped by the page scanner
+  if (vm_pte_touch(pte)) {
+    if (flags_store != NULL)
+      *flags_store = flags & ~VM_OLD;
+    return pa2page(arch_vm_pte_addr(pte));
+  }
+
+  if (arch_vm_pte_valid(pte) || !(flags & VM_LAZY))
+    return NULL;
+
+  if (flags & VM_SWAP)
+    return vm_page_swap_in(vm, va, flags, flags_store);
+  if (flags & VM_FILE)
+    return vm_page_read(vm, va, flags, flags_store);
+
+  // Shared mappings are written to in place, so they need their own pages
+  if (!write && !(flags & VM_SHARED)) {
+    flags &= ~VM_LAZY;
+    if (flags & VM_WRITE)
+      flags = (flags & ~VM_WRITE) | VM_COW;
+
+    if (vm_page_insert(vm, vm_zero_page, ROUND_DOWN(va, PAGE_SIZE), flags) < 0)
+      return NULL;
+
+    if (flags_store != NULL)
+      *flags_store = flags | VM_PAGE;
+
+    return vm_zero_page;
+  }
+
+  if ((page = vm_section_alloc(vm, va, flags)) != NULL) {
+    if (flags_store != NULL)
+      *flags_store = (flags & ~VM_LAZY) | VM_PAGE;
+    return page;
+  }
+
+  if ((page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_ANON)) == NULL)
+    return NULL;
+
+  flags &= ~VM_LAZY;
+
+  if (vm_page_insert(vm, page, ROUND_DOWN(va, PAGE_SIZE), flags) < 0) {
+    page_free_one(page);
+    return NULL;
+  }
+
+  if (flags_store != NULL)
+    *flags_store = flags | VM_PAGE;
+
+  return page;
+}
+
+static struct Page *
+vm_page_cow(struct VMSpace *vm, uintptr_t va, struct Page *page, int flags)
+{
+  struct Page *page_copy;
+
+  assert(flags & VM_COW);
+
+  flags &= ~VM_COW;
+  flags |= VM_WRITE;
+
+  // The reference count is only meaningful for private tables
+  if (vm_table_private(vm, va) < 0)
+    return NULL;
+
+  // Pages of shared file mappings are never copied, only marked as modified
+  if (flags & VM_SHARED) {
+    if (vm_page_insert(vm, page, va, flags | VM_DIRTY) < 0)
+      return NULL;
+    return page;
+  }
+
+  // If this is the only one occurence of the page, simply re-insert it with
+  // new permissions. Other address spaces can only drop their references
+  // concurrently, never add new ones, so a stale value only costs a copy.
+  // The zero page always holds an extra reference of its own.
+  if (__atomic_load_n(&page->ref_count, __ATOMIC_ACQUIRE) == 1) {
+    if (vm_page_insert(vm, page, va, flags) < 0)
+      return NULL;
+    return page;
+  }
+
+  // Otherwise, insert a copy of the entire page in its place
+  if ((page_copy = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_ANON)) == NULL)
+    return NULL;
+
+  if (page != vm_zero_page)
+    memmove(page2kva(page_copy), page2kva(page), PAGE_SIZE);
+
+  if (vm_page_insert(vm, page_copy, va, flags) < 0) {
+    page_free_one(page_copy);
+    return NULL;
+  }
+
+  return page_copy;
+}
+
+int
+vm_page_lookup_cow(struct VMSpace *vm, uintptr_t va, struct Page **page_store,
+                   int *flags_store)
+{
+  struct Page *page;
+  int flags;
+
+  if ((page = vm_page_lookup_alloc(vm, va, 1, &flags)) == NULL)
+    return -EFAULT;
+  
+  if (flags & VM_COW) {
+    if ((page = vm_page_cow(vm, va, page, flags)) == NULL)
+      return -ENOMEM;
+  }
+  
+  if (page_store != NULL)
+    *page_store = page;
+  if (flags_store != NULL)
+    *flags_store = flags;
+
+  return 0;
+}
+
+static void
+vm_user_assert(uintptr_t start_va, uintptr_t end_va)
+{
+  if ((start_va >= VIRT_KERNEL_BASE) || (end_va < start_va))
+    panic("invalid va range: [%p,%p)", start_va, end_va);
+}
+
+static void
+vm_user_assert_pages(uintptr_t start_va, uintptr_t end_va)
+{
+  if ((start_va % PAGE_SIZE) != 0)
+    panic("va not page-aligned %p", start_va);
+  if ((start_va >= VIRT_KERNEL_BASE) || (end_va < start_va))
+    panic("invalid va range: [%p,%p)", start_va, end_va);
+}
+
+int
+vm_clear(struct VMSpace *vm, uintptr_t dst_va, size_t n)
+{
+  vm_user_assert(dst_va, dst_va + n);
+
+  while (n != 0) {
+    struct Page *page;
+    uint8_t *kva;
+    size_t offset, ncopy;
+    int r;
+
+    offset = dst_va % PAGE_SIZE;
+    ncopy = MIN(PAGE_SIZE - offset, n);
+
+    k_spinlock_acquire(&vm->lock);
+
+    if ((r = vm_page_lookup_cow(vm, dst_va, &page, NULL)) < 0) {
+      k_spinlock_release(&vm->lock);
+      return r;
+    }
+
+    kva = (uint8_t *) page2kva(page);
+    memset(kva + offset, 0, ncopy);
+
+    k_spinlock_release(&vm->lock);
+
+    dst_va += ncopy;
+    n      -= ncopy;
+  }
+
+  return 0;
+}
+
+int
+vm_copy_out(struct VMSpace *vm, const void *src, uintptr_t dst_va, size_t n)
+{
+  uint8_t *p = (uint8_t *) src;
+
+  vm_user_assert(dst_va, dst_va + n);
+
+  while (n != 0) {
+    struct Page *page;
+    uint8_t *kva;
+    size_t offset, ncopy;
+    int r;
+
+    offset = dst_va % PAGE_SIZE;
+    ncopy = MIN(PAGE_SIZE - offset, n);
+
+    k_spinlock_acquire(&vm->lock);
+
+    if ((r = vm_page_lookup_cow(vm, dst_va, &page, NULL)) < 0) {
+      k_spinlock_release(&vm->lock);
+      return r;
+    }
+
+    kva = (uint8_t *) page2kva(page);
+    memmove(kva + offset, p, ncopy);
+
+    k_spinlock_release(&vm->lock);
+
+    p      += ncopy;
+    dst_va += ncopy;
+    n      -= ncopy;
+  }
+
+  return 0;
+}
+
+int
+vm_copy_in(struct VMSpace *vm, void *dst, uintptr_t src_va, size_t n)
+{
+  uint8_t *p = (uint8_t *) dst;
+
+  vm_user_assert(src_va, src_va + n);
+
+  while (n != 0) {
+    struct Page *page;
+    uint8_t *kva;
+    size_t offset, ncopy;
+
+    offset = src_va % PAGE_SIZE;
+    ncopy  = MIN(PAGE_SIZE - offset, n);
+
+    k_spinlock_acquire(&vm->lock);
+
+    if ((page = vm_page_lookup_alloc(vm, src_va, 0, NULL)) == NULL) {
+      k_spinlock_release(&vm->lock);
+      return -EFAULT;
+    }
+
+    kva = (uint8_t *) page2kva(page);
+    memmove(p, kva + offset, ncopy);
+
+    k_spinlock_release(&vm->lock);
+
+    src_va += ncopy;
+    p      += ncopy;
+    n      -= ncopy;
+  }
+
+  return 0;
+}
+
+/**
+ * Copy a NUL-terminated string from user memory in a single pass, checking
+ * the permissions of each page as it is reached.
+ *
+ * @param vm     The address space
+ * @param dst    The destination buffer
+ * @param src_va The user address of the string
+ * @param max    The size of the destination buffer
+ * @param flags  The required permissions
+ *
+ * @return The length of the string (not counting the terminating NUL), or
+ *         -EFAULT if the string is not readable, or -ENAMETOOLONG if it does
+ *         not fit into the buffer.
+ */
+int
+vm_copy_in_str(struct VMSpace *vm, char *dst, uintptr_t src_va, size_t max,
+               int flags)
+{
+  size_t len = 0;
+
+  while (len < max) {
+    struct Page *page;
+    const char *kva, *end;
+    size_t offset, ncopy;
+    int curr_flags;
+
+    if (src_va >= VIRT_KERNEL_BASE)
+      return -EFAULT;
+
+    offset = src_va % PAGE_SIZE;
+    ncopy  = MIN(PAGE_SIZE - offset, max - len);
+
+    k_spinlock_acquire(&vm->lock);
+
+    page = vm_page_lookup_alloc(vm, src_va, 0, &curr_flags);
+    if ((page == NULL) || !vm_flags_check(curr_flags, flags)) {
+      k_spinlock_release(&vm->lock);
+      return -EFAULT;
+    }
+
+    kva = (const char *) page2kva(page) + offset;
+    if ((end = memchr(kva, '\0', ncopy)) != NULL)
+      ncopy = end - kva + 1;
+    memmove(dst + len, kva, ncopy);
+
+    k_spinlock_release(&vm->lock);
+
+    if (end != NULL)
+      return len + ncopy - 1;
+
+    src_va += ncopy;
+    len    += ncopy;
+  }
+
+  return -ENAMETOOLONG;
+}
+
+/**
+ * Reserve anonymous memory in the given range. No physical pages are allocated
+ * until the memory is actually accessed.
+ *
+ * @param vm       The address space
+ * @param start_va The page-aligned starting virtual address
+ * @param n        The size of the region in bytes
+ * @param flags    The mapping flags
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ */
+int
+vm_user_alloc(struct VMSpace *vm, uintptr_t start_va, size_t n, int flags)
+{
+  uintptr_t va, end_va;
+  int r;
+
+  end_va = ROUND_UP(start_va + n, PAGE_SIZE);
+  vm_user_assert_pages(start_va, end_va);
+
+  for (va = start_va; va < end_va; va += PAGE_SIZE) {
+    k_spinlock_acquire(&vm->lock);
+
+    if ((r = vm_page_reserve(vm, va, flags)) != 0) {
+      k_spinlock_release(&vm->lock);
+
+      vm_user_free(vm, start_va, va - start_va);
+
+      return r;
+    }
+
+    k_spinlock_release(&vm->lock);
+  }
+
+  return 0;
+}
+
+/**
+ * Drop the pages in the given range and reserve them again, so that the next
+ * access gets a new zero page (or reads the file again, if VM_FILE is given).
+ * Modified pages of shared file mappings are kept, since their contents would
+ * be lost otherwise. Unlike vm_user_alloc(), the pages already discarded stay
+ * reserved if an error occurs.
+ *
+ * @param vm       The address space
+ * @param start_va The page-aligned starting virtual address
+ * @param n        The size of the region in bytes
+ * @param flags    The mapping flags
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The range contains a device mapping
+ * @retval -ENOMEM Out of memory
+ */
+int
+vm_user_discard(struct VMSpace *vm, uintptr_t start_va, size_t n, int flags)
+{
+  uintptr_t va, end_va;
+  int r = 0;
+
+  end_va = ROUND_UP(start_va + n, PAGE_SIZE);
+  vm_user_assert_pages(start_va, end_va);
+
+  for (va = start_va; (va < end_va) && (r == 0); va += PAGE_SIZE) {
+    void *pte;
+
+    k_spinlock_acquire(&vm->lock);
+
+    pte = arch_vm_lookup(vm->pgtab, va, 0);
+    if ((pte == NULL) || !arch_vm_pte_valid(pte) ||
+        !(arch_vm_pte_flags(pte) & VM_DIRTY))
+      r = vm_page_reserve(vm, va, flags);
+
+    k_spinlock_release(&vm->lock);
+  }
+
+  return r;
+}
+
+/**
+ * Map an existing physical page at the given user virtual address.
+ *
+ * @param vm    The address space
+ * @param page  The page to map
+ * @param va    The virtual address
+ * @param flags The mapping flags
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ */
+int
+vm_user_map(struct VMSpace *vm, struct Page *page, uintptr_t va, int flags)
+{
+  int r;
+
+  vm_user_assert_pages(va, va + PAGE_SIZE);
+
+  k_spinlock_acquire(&vm->lock);
+  r = vm_page_insert(vm, page, va, flags);
+  k_spinlock_release(&vm->lock);
+
+  return r;
+}
+
+/**
+ * Copy data from one user address space into another, one source page at a
+ * time, without an intermediate kernel buffer. The caller must not hold any
+ * spinlocks, since missing pages may have to be read in.
+ *
+ * @param dst    The destination address space
+ * @param dst_va The destination virtual address
+ * @param src    The source address space
+ * @param src_va The source virtual address
+ * @param n      The number of bytes to copy
+ *
+ * @retval 0       Success
+ * @retval -EFAULT Nothing is mapped or reserved at a given address
+ * @retval -ENOMEM Out of memory
+ */
+int
+vm_user_copy(struct VMSpace *dst, uintptr_t dst_va, struct VMSpace *src,
+             uintptr_t src_va, size_t n)
+{
+  vm_user_assert(src_va, src_va + n);
+
+  while (n != 0) {
+    struct Page *page;
+    size_t offset, ncopy;
+    int r;
+
+    offset = src_va % PAGE_SIZE;
+    ncopy  = MIN(PAGE_SIZE - offset, n);
+
+    k_spinlock_acquire(&src->lock);
+
+    if ((page = vm_page_lookup_alloc(src, src_va, 0, NULL)) == NULL) {
+      k_spinlock_release(&src->lock);
+      return -EFAULT;
+    }
+
+    // Keep the page while the source lock is not held
+    vm_page_ref(page);
+
+    k_spinlock_release(&src->lock);
+
+    r = vm_copy_out(dst, (uint8_t *) page2kva(page) + offset, dst_va, ncopy);
+
+    vm_page_unref(page);
+
+    if (r < 0)
+      return r;
+
+    src_va += ncopy;
+    dst_va += ncopy;
+    n      -= ncopy;
+  }
+
+  return 0;
+}
+
+/**
+ * Map a page of one user address space into another one copy-on-write instead
+ * of copying its contents, e.g. to pass a large message. Only private pages
+ * that are already present can be shared, and only into private writable
+ * mappings; the caller has to copy the data in all other cases.
+ *
+ * @param dst    The destination address space
+ * @param dst_va The page-aligned destination virtual address
+ * @param src    The source address space
+ * @param src_va The page-aligned source virtual address
+ *
+ * @retval 1       The page has been shared
+ * @retval 0       The page cannot be shared and must be copied
+ * @retval -ENOMEM Out of memory
+ */
+int
+vm_user_share(struct VMSpace *dst, uintptr_t dst_va, struct VMSpace *src,
+              uintptr_t src_va)
+{
+  struct Page *page;
+  void *pte;
+  int flags, r;
+
+  vm_user_assert_pages(src_va, src_va + PAGE_SIZE);
+  vm_user_assert_pages(dst_va, dst_va + PAGE_SIZE);
+
+  k_spinlock_acquire(&src->lock);
+
+  pte = arch_vm_lookup(src->pgtab, src_va, 0);
+  if ((pte == NULL) || !arch_vm_pte_valid(pte) ||
+      ((arch_vm_pte_flags(pte) & (VM_PAGE | VM_SHARED)) != VM_PAGE)) {
+    k_spinlock_release(&src->lock);
+    return 0;
+  }
+
+  if ((r = vm_table_private(src, src_va)) < 0) {
+    k_spinlock_release(&src->lock);
+    return r;
+  }
 
-  // If this is the only one occurence of the page, simply re-insert it with
-  // new permissions
-  if (page->ref_count == 1) {
-    if (vm_page_insert(pgtab, page, va, flags) < 0)
-      return NULL;
-    return page;
+  // The table may have been copied
+  pte   = arch_vm_lookup(src->pgtab, src_va, 0);
+  flags = arch_vm_pte_flags(pte);
+  page  = pa2page(arch_vm_pte_addr(pte));
+
+  // From now on, both address spaces copy the page on write, as after fork
+  if (flags & VM_WRITE) {
+    arch_vm_pte_set(pte, page2pa(page), (flags & ~VM_WRITE) | VM_COW);
+    arch_vm_invalidate(src_va);
   }
 
-  // Otherwise, insert a copy of the entire page in its place
-  if ((page_copy = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_ANON)) == NULL)
-    return NULL;
+  vm_page_ref(page);
 
-  memmove(page2kva(page_copy), page2kva(page), PAGE_SIZE);
+  k_spinlock_release(&src->lock);
 
-  if (vm_page_insert(pgtab, page_copy, va, flags) < 0) {
-    page_free_one(page_copy);
-    return NULL;
+  k_spinlock_acquire(&dst->lock);
+
+  r = 0;
+
+  // Sections and shared mappings are always written to in place
+  pte = arch_vm_lookup(dst->pgtab, dst_va, 0);
+  if ((pte != NULL) && (vm_page_flags(dst, dst_va, &flags) == 0) &&
+      (flags & VM_USER) && (flags & (VM_WRITE | VM_COW)) &&
+      !(flags & VM_SHARED)) {
+    flags &= ~(VM_WRITE | VM_LAZY | VM_SWAP | VM_DIRTY);
+    if ((r = vm_page_insert(dst, page, dst_va, flags | VM_COW)) == 0)
+      r = 1;
   }
 
-  return page_copy;
+  k_spinlock_release(&dst->lock);
+
+  vm_page_unref(page);
+
+  return r;
 }
 
+/**
+ * Map a physically contiguous block of pages at the given user virtual address
+ * using sections. The block stays owned by the caller, the mapping only holds
+ * a reference to the first page of each section and must be removed as a
+ * whole.
+ *
+ * @param vm    The address space
+ * @param block The first page of the block
+ * @param order The allocation order of the block (at least VM_SECTION_ORDER)
+ * @param va    The section-aligned virtual address
+ * @param flags The mapping flags
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The block or the address is not suitably aligned
+ */
 int
-vm_page_lookup_cow(void *pgtab, uintptr_t va, struct Page **page_store,
-                   int *flags_store)
+vm_user_map_block(struct VMSpace *vm, struct Page *block, unsigned order,
+                  uintptr_t va, int flags)
 {
-  struct Page *page;
-  int flags;
+  size_t n;
 
-  if ((page = vm_page_lookup(pgtab, va, &flags)) == NULL)
-    return -EFAULT;
-  
-  if (flags & VM_COW) {
-    if ((page = vm_page_cow(pgtab, va, page, flags)) == NULL)
+  if ((order < VM_SECTION_ORDER) || ((va % VM_SECTION_SIZE) != 0) ||
+      ((page2pa(block) % VM_SECTION_SIZE) != 0))
+    return -EINVAL;
+
+  vm_user_assert_pages(va, va + (PAGE_SIZE << order));
+
+  for (n = PAGE_SIZE << order; n != 0; n -= VM_SECTION_SIZE) {
+    k_spinlock_acquire(&vm->lock);
+
+    if (vm_table_private(vm, va) < 0) {
+      k_spinlock_release(&vm->lock);
+      vm_user_free(vm, va - (PAGE_SIZE << order) + n, (PAGE_SIZE << order) - n);
       return -ENOMEM;
+    }
+
+    vm_page_ref(block);
+    arch_vm_section_set(vm->pgtab, va, page2pa(block), flags);
+
+    k_spinlock_release(&vm->lock);
+
+    block += 1U << VM_SECTION_ORDER;
+    va    += VM_SECTION_SIZE;
   }
-  
-  if (page_store != NULL)
-    *page_store = page;
-  if (flags_store != NULL)
-    *flags_store = flags;
 
   return 0;
 }
 
+// Pages unmapped by vm_user_free() whose TLB entries are yet to be invalidated
+#define VM_UNMAP_BATCH  32
+
+struct VMUnmapBatch {
+  uintptr_t    start;
+  uintptr_t    end;
+  unsigned     count;
+  struct Page *pages[VM_UNMAP_BATCH];
+};
+
+// Invalidate the TLB entries for the whole batch on all CPUs at once, and only
+// then release the pages
 static void
-vm_user_assert(uintptr_t start_va, uintptr_t end_va)
+vm_unmap_batch_flush(struct VMSpace *vm, struct VMUnmapBatch *batch)
 {
-  if ((start_va >= VIRT_KERNEL_BASE) || (end_va < start_va))
-    panic("invalid va range: [%p,%p)", start_va, end_va);
+  unsigned i;
+
+  if (batch->count == 0)
+    return;
+
+  arch_vm_invalidate_range(__atomic_load_n(&vm->asid, __ATOMIC_RELAXED),
+                           batch->start, batch->end);
+
+  for (i = 0; i < batch->count; i++)
+    vm_page_unref(batch->pages[i]);
+
+  batch->count = 0;
 }
 
 static void
-vm_user_assert_pages(uintptr_t start_va, uintptr_t end_va)
+vm_unmap_batch_add(struct VMSpace *vm, struct VMUnmapBatch *batch,
+                   uintptr_t va, struct Page *page)
 {
-  if ((start_va % PAGE_SIZE) != 0)
-    panic("va not page-aligned %p", start_va);
-  if ((start_va >= VIRT_KERNEL_BASE) || (end_va < start_va))
-    panic("invalid va range: [%p,%p)", start_va, end_va);
+  if (batch->count == VM_UNMAP_BATCH)
+    vm_unmap_batch_flush(vm, batch);
+
+  if (batch->count == 0)
+    batch->start = va;
+  batch->end = va + PAGE_SIZE;
+  batch->pages[batch->count++] = page;
 }
 
-int
-vm_clear(void *pgtab, uintptr_t dst_va, size_t n)
+void
+vm_user_free(struct VMSpace *vm, uintptr_t start_va, size_t n)
 {
-  vm_user_assert(dst_va, dst_va + n);
+  struct VMUnmapBatch batch;
+  uintptr_t va, end_va;
 
-  while (n != 0) {
+  end_va = ROUND_UP(start_va + n, PAGE_SIZE);
+  vm_user_assert_pages(start_va, end_va);
+
+  batch.count = 0;
+
+  for (va = start_va; va < end_va; va += PAGE_SIZE) {
     struct Page *page;
-    uint8_t *kva;
-    size_t offset, ncopy;
-    int r;
+    physaddr_t pa;
 
-    offset = dst_va % PAGE_SIZE;
-    ncopy = MIN(PAGE_SIZE - offset, n);
+    k_spinlock_acquire(&vm->lock);
 
-    k_spinlock_acquire(&vm_lock);
+    // Drop entire sections without splitting them first
+    if (((va % VM_SECTION_SIZE) == 0) && ((end_va - va) >= VM_SECTION_SIZE) &&
+        arch_vm_section_lookup(vm->pgtab, va, &pa, NULL)) {
+      arch_vm_section_clear(vm->pgtab, va);
+      vm_section_unref(pa2page(pa));
 
-    if ((r = vm_page_lookup_cow(pgtab, dst_va, &page, NULL)) < 0) {
-      k_spinlock_release(&vm_lock);
-      return r;
-    }
+      k_spinlock_release(&vm->lock);
 
-    kva = (uint8_t *) page2kva(page);
-    memset(kva + offset, 0, ncopy);
+      va += VM_SECTION_SIZE - PAGE_SIZE;
+      continue;
+    }
 
-    k_spinlock_release(&vm_lock);
+    if ((vm_page_clear(vm, va, &page) == 0) && (page != NULL))
+      vm_unmap_batch_add(vm, &batch, va, page);
 
-    dst_va += ncopy;
-    n      -= ncopy;
+    k_spinlock_release(&vm->lock);
   }
 
-  return 0;
+  vm_unmap_batch_flush(vm, &batch);
 }
 
-int
-vm_copy_out(void *pgtab, const void *src, uintptr_t dst_va, size_t n)
+// Clone a range of a shared mapping, so that both address spaces map the same
+// pages
+static int
+vm_user_clone_shared(struct VMSpace *src, struct VMSpace *dst, uintptr_t va,
+                     uintptr_t end_va)
 {
-  uint8_t *p = (uint8_t *) src;
+  for ( ; va < end_va; va += PAGE_SIZE) {
+    struct Page *page;
+    physaddr_t pa;
+    int flags, r;
 
-  vm_user_assert(dst_va, dst_va + n);
+    // Pages to be shared must exist first. Reading a file-backed page may
+    // sleep, so it cannot be done with both locks held.
+    k_spinlock_acquire(&src->lock);
+    page = vm_page_lookup_alloc(src, va, 1, NULL);
+    k_spinlock_release(&src->lock);
 
-  while (n != 0) {
-    struct Page *page;
-    uint8_t *kva;
-    size_t offset, ncopy;
-    int r;
+    if (page == NULL)
+      return -EFAULT;
 
-    offset = dst_va % PAGE_SIZE;
-    ncopy = MIN(PAGE_SIZE - offset, n);
+    // The new address space is not visible to anyone else yet, so the lock
+    // order does not matter
+    k_spinlock_acquire(&src->lock);
+    k_spinlock_acquire(&dst->lock);
 
-    k_spinlock_acquire(&vm_lock);
+    if (arch_vm_section_lookup(src->pgtab, va, &pa, &flags)) {
+      struct Page *block = pa2page(ROUND_DOWN(pa, VM_SECTION_SIZE));
 
-    if ((r = vm_page_lookup_cow(pgtab, dst_va, &page, NULL)) < 0) {
-      k_spinlock_release(&vm_lock);
-      return r;
+      // Device memory stays mapped by sections, anonymous memory is split
+      if ((block->debug_tag != (int) PAGE_TAG_ANON) &&
+          ((va % VM_SECTION_SIZE) == 0) && ((end_va - va) >= VM_SECTION_SIZE)) {
+        vm_page_ref(block);
+        arch_vm_section_set(dst->pgtab, va, pa, flags);
+
+        k_spinlock_release(&dst->lock);
+        k_spinlock_release(&src->lock);
+
+        va += VM_SECTION_SIZE - PAGE_SIZE;
+        continue;
+      }
+
+      if ((r = vm_section_split(src, va)) < 0) {
+        k_spinlock_release(&dst->lock);
+        k_spinlock_release(&src->lock);
+        return r;
+      }
     }
 
-    kva = (uint8_t *) page2kva(page);
-    memmove(kva + offset, p, ncopy);
+    // When creating a shared region, remove the copy-on-write bit
+    if ((r = vm_page_lookup_cow(src, va, &page, &flags)) == 0)
+      r = vm_page_insert(dst, page, va, flags);
 
-    k_spinlock_release(&vm_lock);
+    k_spinlock_release(&dst->lock);
+    k_spinlock_release(&src->lock);
 
-    p      += ncopy;
-    dst_va += ncopy;
-    n      -= ncopy;
+    if (r < 0)
+      return r;
   }
 
   return 0;
 }
 
+/**
+ * Copy the mappings in the given range into a new address space. Private
+ * mappings are copied on write, shared ones keep referring to the same pages.
+ *
+ * Instead of copying individual entries, the second-level tables covering the
+ * range are shared between the two address spaces, and copied later only if
+ * either side modifies them.
+ *
+ * @param src      The source address space
+ * @param dst      The new address space
+ * @param start_va The page-aligned starting virtual address
+ * @param n        The size of the range in bytes
+ * @param share    Whether the range is a shared mapping
+ *
+ * @return 0 on success, or a negative error code.
+ */
 int
-vm_copy_in(void *vm, void *dst, uintptr_t src_va, size_t n)
+vm_user_clone(struct VMSpace *src, struct VMSpace *dst, uintptr_t start_va, size_t n, int share)
 {
-  uint8_t *p = (uint8_t *) dst;
-
-  vm_user_assert(src_va, src_va + n);
-
-  while (n != 0) {
-    struct Page *page;
-    uint8_t *kva;
-    size_t offset, ncopy;
+  uintptr_t va, end_va, base;
+  int r = 0, protected = 0;
 
-    offset = src_va % PAGE_SIZE;
-    ncopy  = MIN(PAGE_SIZE - offset, n);
+  end_va = ROUND_UP(start_va + n, PAGE_SIZE);
+  vm_user_assert_pages(start_va, end_va);
 
-    k_spinlock_acquire(&vm_lock);
+  if (share)
+    return vm_user_clone_shared(src, dst, start_va, end_va);
 
-    if ((page = vm_page_lookup(vm, src_va, NULL)) == NULL) {
-      k_spinlock_release(&vm_lock);
-      return -EFAULT;
-    }
+  for (va = start_va; va < end_va; va = base + VM_TABLE_SIZE) {
+    uintptr_t sva;
 
-    kva = (uint8_t *) page2kva(page);
-    memmove(p, kva + offset, ncopy);
+    base = ROUND_DOWN(va, VM_TABLE_SIZE);
 
-    k_spinlock_release(&vm_lock);
+    // The new address space is not visible to anyone else yet, so the lock
+    // order does not matter
+    k_spinlock_acquire(&src->lock);
+    k_spinlock_acquire(&dst->lock);
 
-    src_va += ncopy;
-    p      += ncopy;
-    n      -= ncopy;
-  }
+    for (sva = base; sva < base + VM_TABLE_SIZE; sva += VM_SECTION_SIZE) {
+      struct Page *block;
+      physaddr_t pa;
+      int flags;
 
-  return 0;
-}
+      if (!arch_vm_section_lookup(src->pgtab, sva, &pa, &flags))
+        continue;
 
-int
-vm_user_alloc(void *vm, uintptr_t start_va, size_t n, int flags)
-{
-  struct Page *page;
-  uintptr_t va, end_va;
-  int r;
+      block = pa2page(ROUND_DOWN(pa, VM_SECTION_SIZE));
 
-  end_va = ROUND_UP(start_va + n, PAGE_SIZE);
-  vm_user_assert_pages(start_va, end_va);
+      // Anonymous memory is split to be copied page by page. This is done for
+      // the whole table at once, before it gets shared.
+      if (block->debug_tag == (int) PAGE_TAG_ANON) {
+        if ((r = vm_section_split(src, sva)) < 0)
+          break;
+        continue;
+      }
 
-  for (va = start_va; va < end_va; va += PAGE_SIZE) {
-    k_spinlock_acquire(&vm_lock);
+      // Device memory stays shared, and belongs to the region covering it
+      if ((sva >= end_va) || (sva + VM_SECTION_SIZE <= va))
+        continue;
 
-    if ((page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_ANON)) == NULL) {
-      k_spinlock_release(&vm_lock);
+      if ((sva < va) || ((end_va - sva) < VM_SECTION_SIZE)) {
+        r = -EINVAL;
+        break;
+      }
 
-      vm_user_free(vm, start_va, va - start_va);
-      
-      return -ENOMEM;
+      vm_page_ref(block);
+      arch_vm_section_set(dst->pgtab, sva, pa, flags);
     }
 
-    if ((r = (vm_page_insert(vm, page, va, flags)) != 0)) {
-      page_free_one(page);
-      k_spinlock_release(&vm_lock);
-
-      vm_user_free(vm, start_va, va - start_va);
+    // Pages and reservations are always mapped by second-level tables
+    if (r == 0)
+      vm_table_share(src, dst, base, &protected);
 
-      return r;
-    }
+    k_spinlock_release(&dst->lock);
+    k_spinlock_release(&src->lock);
 
-    k_spinlock_release(&vm_lock);
+    if (r < 0)
+      break;
   }
 
-  return 0;
+  // Drop the cached writable translations of the parent
+  if (protected)
+    arch_vm_invalidate_all();
+
+  return r;
 }
 
+/**
+ * Stop using the second-level tables shared with other address spaces in the
+ * given range, without touching the pages they map. Only used when destroying
+ * an address space, so that its shared tables are not copied just to be
+ * freed.
+ *
+ * @param vm       The address space
+ * @param start_va The page-aligned starting virtual address
+ * @param n        The size of the range in bytes
+ */
 void
-vm_user_free(void *vm, uintptr_t start_va, size_t n)
+vm_user_detach(struct VMSpace *vm, uintptr_t start_va, size_t n)
 {
   uintptr_t va, end_va;
 
   end_va = ROUND_UP(start_va + n, PAGE_SIZE);
   vm_user_assert_pages(start_va, end_va);
 
-  for (va = start_va; va < end_va; va += PAGE_SIZE) {
-    k_spinlock_acquire(&vm_lock);
-    vm_page_remove(vm, va);
-    k_spinlock_release(&vm_lock);
-  }
+  k_spinlock_acquire(&vm->lock);
+  k_spinlock_acquire(&vm_table_lock);
+
+  for (va = ROUND_DOWN(start_va, VM_TABLE_SIZE); va < end_va;
+       va += VM_TABLE_SIZE)
+    if (arch_vm_table_refs(vm->pgtab, va) > 1)
+      arch_vm_table_detach(vm->pgtab, va);
+
+  k_spinlock_release(&vm_table_lock);
+  k_spinlock_release(&vm->lock);
+}
+
+// Permissions for a page that is already present. Writable pages are always
+// write-protected first, since they may still be shared copy-on-write or need
+// to be marked dirty; the first write fault restores the permission cheaply.
+static int
+vm_protect_flags(int old_flags, int flags)
+{
+  flags |= old_flags & (VM_PAGE | VM_DIRTY);
+
+  if (flags & VM_WRITE)
+    flags = (flags & ~VM_WRITE) | VM_COW;
+
+  return flags;
 }
 
+/**
+ * Change the permissions of the pages and the reservations in the given
+ * range. Anonymous sections are split, other sections (e.g. the framebuffer)
+ * can only be changed as a whole.
+ *
+ * @param vm       The address space
+ * @param start_va The page-aligned starting virtual address
+ * @param n        The size of the range in bytes
+ * @param flags    The new mapping flags
+ *
+ * @retval 0       Success
+ * @retval -EINVAL Part of a section would have to be changed
+ * @retval -ENOMEM Out of memory
+ */
 int
-vm_user_clone(void *src, void *dst, uintptr_t start_va, size_t n, int share)
+vm_user_protect(struct VMSpace *vm, uintptr_t start_va, size_t n, int flags)
 {
   uintptr_t va, end_va;
+  int r = 0;
 
   end_va = ROUND_UP(start_va + n, PAGE_SIZE);
   vm_user_assert_pages(start_va, end_va);
- 
-  for (va = start_va ; va < end_va; va += PAGE_SIZE) {
-    struct Page *page;
-    int flags, r;
 
-    k_spinlock_acquire(&vm_lock);
+  for (va = start_va; va < end_va; va += PAGE_SIZE) {
+    void *pte;
+    physaddr_t pa;
+    int old_flags;
 
-    if (share) {
-      // When creating a shared region, remove the copy-on-write bit
-      if ((r = vm_page_lookup_cow(src, va, &page, &flags)) < 0) {
-        k_spinlock_release(&vm_lock);
-        return r;
-      }
-    } else {
-      if ((page = vm_page_lookup(src, va, &flags)) == NULL) {
-        k_spinlock_release(&vm_lock);
-        return -EFAULT;
-      }
+    k_spinlock_acquire(&vm->lock);
 
-      if (flags & VM_WRITE) {
-        flags &= ~VM_WRITE;
-        flags |= VM_COW;
+    if (arch_vm_section_lookup(vm->pgtab, va, &pa, &old_flags)) {
+      struct Page *block = pa2page(ROUND_DOWN(pa, VM_SECTION_SIZE));
 
-        if ((r = vm_page_insert(src, page, va, flags)) < 0) {
-          k_spinlock_release(&vm_lock);
-          return r;
+      if (block->debug_tag != (int) PAGE_TAG_ANON) {
+        if (((va % VM_SECTION_SIZE) != 0) ||
+            ((end_va - va) < VM_SECTION_SIZE)) {
+          k_spinlock_release(&vm->lock);
+          return -EINVAL;
         }
+
+        arch_vm_section_set(vm->pgtab, va, page2pa(block),
+                            flags | (old_flags & VM_WC));
+        arch_vm_invalidate_range(__atomic_load_n(&vm->asid, __ATOMIC_RELAXED),
+                                 va, va + VM_SECTION_SIZE);
+
+        k_spinlock_release(&vm->lock);
+
+        va += VM_SECTION_SIZE - PAGE_SIZE;
+        continue;
+      }
+
+      if ((r = vm_section_split(vm, va)) < 0) {
+        k_spinlock_release(&vm->lock);
+        break;
       }
     }
 
-    if ((r = vm_page_insert(dst, page, va, flags)) < 0) {
-      k_spinlock_release(&vm_lock);
-      return r;
+    // Nothing mapped or reserved here
+    if (arch_vm_lookup(vm->pgtab, va, 0) == NULL) {
+      k_spinlock_release(&vm->lock);
+      continue;
+    }
+
+    if ((r = vm_table_private(vm, va)) < 0) {
+      k_spinlock_release(&vm->lock);
+      break;
+    }
+
+    // Copying the table above may have moved the entry
+    pte = arch_vm_lookup(vm->pgtab, va, 0);
+    old_flags = arch_vm_pte_flags(pte);
+
+    if (vm_pte_present(pte) && (old_flags & VM_PAGE)) {
+      arch_vm_pte_set(pte, arch_vm_pte_addr(pte),
+                      vm_protect_flags(old_flags, flags));
+      arch_vm_invalidate(va);
+    } else if (!arch_vm_pte_valid(pte) && (old_flags & VM_SWAP)) {
+      arch_vm_pte_set_swap(pte, arch_vm_pte_swap(pte),
+                           flags | VM_LAZY | VM_SWAP);
+    } else if (!arch_vm_pte_valid(pte) && (old_flags & VM_LAZY)) {
+      arch_vm_pte_set_flags(pte, flags | (old_flags & (VM_LAZY | VM_FILE)));
     }
 
-    k_spinlock_release(&vm_lock);
+    k_spinlock_release(&vm->lock);
+  }
+
+  return r;
+}
+
+/**
+ * Check whether the page of a shared file mapping at the given address has
+ * been modified, and if so, write-protect it again, so that the next write is
+ * noticed. The caller is responsible for writing the page back to the file.
+ *
+ * @param vm         The address space
+ * @param va         The page-aligned virtual address
+ * @param page_store Pointer to the memory location to store the modified
+ *                   page. The caller receives a reference to the page
+ *
+ * @retval 1       The page was modified
+ * @retval 0       The page is clean or not present
+ * @retval -ENOMEM Out of memory
+ */
+int
+vm_user_clean(struct VMSpace *vm, uintptr_t va, struct Page **page_store)
+{
+  struct Page *page;
+  void *pte;
+  int flags, r;
+
+  vm_user_assert_pages(va, va + PAGE_SIZE);
+
+  k_spinlock_acquire(&vm->lock);
+
+  // Shared tables are only copied if there is actually something to clean
+  pte = arch_vm_lookup(vm->pgtab, va, 0);
+  if ((pte == NULL) || !arch_vm_pte_valid(pte) ||
+      ((arch_vm_pte_flags(pte) & (VM_PAGE | VM_DIRTY)) != (VM_PAGE | VM_DIRTY))) {
+    k_spinlock_release(&vm->lock);
+    return 0;
+  }
+
+  if ((r = vm_table_private(vm, va)) < 0) {
+    k_spinlock_release(&vm->lock);
+    return r;
   }
 
+  pte   = arch_vm_lookup(vm->pgtab, va, 0);
+  flags = arch_vm_pte_flags(pte);
+  page  = pa2page(arch_vm_pte_addr(pte));
+
+  flags &= ~VM_DIRTY;
+  if (flags & VM_WRITE)
+    flags = (flags & ~VM_WRITE) | VM_COW;
+
+  arch_vm_pte_set(pte, page2pa(page), flags);
+  arch_vm_invalidate(va);
+
+  vm_page_ref(page);
+
+  k_spinlock_release(&vm->lock);
+
+  *page_store = page;
+
+  return 1;
+}
+
+/**
+ * Get the mapping flags for the given virtual address without allocating
+ * reserved pages or breaking copy-on-write sharing.
+ *
+ * @param vm          The address space
+ * @param va          The virtual address
+ * @param flags_store Pointer to the memory location to store the mapping flags
+ *
+ * @retval 0       Success
+ * @retval -EFAULT Nothing is mapped or reserved at the given address
+ */
+static int
+vm_page_flags(struct VMSpace *vm, uintptr_t va, int *flags_store)
+{
+  void *pte;
+  int flags;
+
+  debug_assert(k_spinlock_holding(&vm->lock));
+
+  if ((pte = arch_vm_lookup(vm->pgtab, va, 0)) == NULL)
+    return arch_vm_section_lookup(vm->pgtab, va, NULL, flags_store)
+      ? 0
+      : -EFAULT;
+
+  flags = arch_vm_pte_flags(pte);
+
+  if (vm_pte_present(pte) ? !(flags & VM_PAGE) : !(flags & VM_LAZY))
+    return -EFAULT;
+
+  *flags_store = flags & ~VM_OLD;
+
   return 0;
 }
 
@@ -401,21 +1822,21 @@ vm_flags_check(int curr_flags, int flags)
 }
 
 int
-vm_user_check_ptr(void *pgtab, uintptr_t va, int flags)
+vm_user_check_ptr(struct VMSpace *vm, uintptr_t va, int flags)
 {
   int curr_flags;
 
   if (va >= VIRT_KERNEL_BASE)
     return -EFAULT;
 
-  k_spinlock_acquire(&vm_lock);
+  k_spinlock_acquire(&vm->lock);
 
-  if (vm_page_lookup(pgtab, va, &curr_flags) == NULL) {
-    k_spinlock_release(&vm_lock);
+  if (vm_page_flags(vm, va, &curr_flags) < 0) {
+    k_spinlock_release(&vm->lock);
     return -EFAULT;
   }
 
-  k_spinlock_release(&vm_lock);
+  k_spinlock_release(&vm->lock);
 
   if (!vm_flags_check(curr_flags, flags))
     return -EFAULT;
@@ -424,7 +1845,7 @@ vm_user_check_ptr(void *pgtab, uintptr_t va, int flags)
 }
 
 int
-vm_user_check_str(void *vm, uintptr_t va, size_t *len_ptr, int flags)
+vm_user_check_str(struct VMSpace *vm, uintptr_t va, size_t *len_ptr, int flags)
 {
   size_t len = 0;
 
@@ -434,12 +1855,12 @@ vm_user_check_str(void *vm, uintptr_t va, size_t *len_ptr, int flags)
     unsigned off;
     int curr_flags;
 
-    k_spinlock_acquire(&vm_lock);
+    k_spinlock_acquire(&vm->lock);
 
-    page = vm_page_lookup(vm, va, &curr_flags);
+    page = vm_page_lookup_alloc(vm, va, 0, &curr_flags);
 
     if ((page == NULL) || !vm_flags_check(curr_flags, flags)) {
-      k_spinlock_release(&vm_lock);
+      k_spinlock_release(&vm->lock);
       return -EFAULT;
     }
 
@@ -450,7 +1871,7 @@ vm_user_check_str(void *vm, uintptr_t va, size_t *len_ptr, int flags)
         if (len_ptr)
           *len_ptr = len;
 
-        k_spinlock_release(&vm_lock);
+        k_spinlock_release(&vm->lock);
 
         return 0;
       }
@@ -459,14 +1880,14 @@ vm_user_check_str(void *vm, uintptr_t va, size_t *len_ptr, int flags)
       va++;
     }
 
-    k_spinlock_release(&vm_lock);
+    k_spinlock_release(&vm->lock);
   }
 
   return -EFAULT;
 }
 
 int
-vm_user_check_args(void *vm, uintptr_t va, size_t *len_ptr, int flags)
+vm_user_check_args(struct VMSpace *vm, uintptr_t va, size_t *len_ptr, int flags)
 {
   size_t len = 0;
 
@@ -479,12 +1900,12 @@ vm_user_check_args(void *vm, uintptr_t va, size_t *len_ptr, int flags)
     unsigned off;
     int curr_flags;
 
-    k_spinlock_acquire(&vm_lock);
+    k_spinlock_acquire(&vm->lock);
 
-    page = vm_page_lookup(vm, va, &curr_flags);
+    page = vm_page_lookup_alloc(vm, va, 0, &curr_flags);
 
     if ((page == NULL) || !vm_flags_check(curr_flags, flags)) {
-      k_spinlock_release(&vm_lock);
+      k_spinlock_release(&vm->lock);
       return -EFAULT;
     }
 
@@ -495,7 +1916,7 @@ vm_user_check_args(void *vm, uintptr_t va, size_t *len_ptr, int flags)
         if (len_ptr)
           *len_ptr = len;
 
-        k_spinlock_release(&vm_lock);
+        k_spinlock_release(&vm->lock);
 
         return 0;
       }
@@ -504,16 +1925,15 @@ vm_user_check_args(void *vm, uintptr_t va, size_t *len_ptr, int flags)
       va += sizeof *p;
     }
 
-    k_spinlock_release(&vm_lock);
+    k_spinlock_release(&vm->lock);
   }
 
   return -EFAULT;
 }
 
 int
-vm_user_check_buf(void *pgtab, uintptr_t start_va, size_t n, int flags)
+vm_user_check_buf(struct VMSpace *vm, uintptr_t start_va, size_t n, int flags)
 {
-  struct Page *page;
   uintptr_t va, end_va;
 
   end_va = ROUND_UP(start_va + n, PAGE_SIZE);
@@ -523,27 +1943,28 @@ vm_user_check_buf(void *pgtab, uintptr_t start_va, size_t n, int flags)
   for (va = start_va; va < end_va; va += PAGE_SIZE) {
     int r, curr_flags;
 
-    k_spinlock_acquire(&vm_lock);
+    k_spinlock_acquire(&vm->lock);
 
-    // TODO: do not do copy-on-write before actual memory access!
-    if ((r = vm_page_lookup_cow(pgtab, va, &page, &curr_flags)) < 0) {
-      k_spinlock_release(&vm_lock);
+    // Only check permissions. Copy-on-write pages count as writable and are
+    // copied by vm_copy_out() when actually written to.
+    if ((r = vm_page_flags(vm, va, &curr_flags)) < 0) {
+      k_spinlock_release(&vm->lock);
       return r;
     }
 
     if (!vm_flags_check(curr_flags, flags)) {
-      k_spinlock_release(&vm_lock);
+      k_spinlock_release(&vm->lock);
       return -EFAULT;
     }
 
-    k_spinlock_release(&vm_lock);
+    k_spinlock_release(&vm->lock);
   }
 
   return 0;
 }
 
-int
-vm_handle_fault(void *pgtab, uintptr_t va)
+static int
+vm_handle_fault_page(struct VMSpace *vm, uintptr_t va, int write)
 {
   struct Page *fault_page;
   int flags;
@@ -551,58 +1972,50 @@ vm_handle_fault(void *pgtab, uintptr_t va)
   if ((va < PAGE_SIZE) || (va >= VIRT_KERNEL_BASE))
     return -EFAULT;
 
-  k_spinlock_acquire(&vm_lock);
+  k_spinlock_acquire(&vm->lock);
+
+  fault_page = vm_page_lookup(vm, va, &flags);
 
-  fault_page = vm_page_lookup(pgtab, va, &flags);
+  // First access to a reserved anonymous page
+  if (fault_page == NULL) {
+    fault_page = vm_page_lookup_alloc(vm, va, write, &flags);
 
-  if ((fault_page == NULL) || !(flags & VM_COW)) {
-    k_spinlock_release(&vm_lock);
+    k_spinlock_release(&vm->lock);
+
+    return (fault_page != NULL) ? 0 : -EFAULT;
+  }
+
+  if (!(flags & VM_COW)) {
+    k_spinlock_release(&vm->lock);
     return -EFAULT;
   }
 
-  if (vm_page_cow(pgtab, va, fault_page, flags) == NULL) {
-    k_spinlock_release(&vm_lock);
+  if (vm_page_cow(vm, va, fault_page, flags) == NULL) {
+    k_spinlock_release(&vm->lock);
     return -ENOMEM;
   }
 
-  k_spinlock_release(&vm_lock);
+  k_spinlock_release(&vm->lock);
   
   return 0;
 }
 
+/**
+ * Handle a page fault in a user address space.
+ *
+ * @param vm    The address space
+ * @param va    The faulting virtual address
+ * @param write Whether the fault was caused by a write access
+ *
+ * @return 0 if the access can be retried, or a negative error code.
+ */
 int
-vm_space_load_inode(void *pgtab, void *va, struct Inode *ip, size_t n, off_t off)
+vm_handle_fault(struct VMSpace *vm, uintptr_t va, int write)
 {
-  struct Page *page;
-  uint8_t *dst, *kva;
-  int ncopy, offset;
   int r;
 
-  dst = (uint8_t *) va;
+  r = vm_handle_fault_page(vm, va, write);
+  trace(TRACE_VM_FAULT, va, r);
 
-  while (n != 0) {
-    k_spinlock_acquire(&vm_lock);
-
-    page = vm_page_lookup(pgtab, (uintptr_t) dst, NULL);
-    if (page == NULL) {
-      return -EFAULT;
-    }
-
-    // TODO: unsafe?
-
-    k_spinlock_release(&vm_lock);
-
-    kva = (uint8_t *) page2kva(page);
-
-    offset = (uintptr_t) dst % PAGE_SIZE;
-    ncopy  = MIN(PAGE_SIZE - offset, n);
-
-    if ((r = fs_inode_read_locked(ip, (uintptr_t) kva + offset, ncopy, &off)) != ncopy)
-      return r;
-
-    dst += ncopy;
-    n   -= ncopy;
-  }
-
-  return 0;
+  return r;
 }
@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <kernel/console.h>
+#include <kernel/core/list.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/spinlock.h>
+#include <kernel/types.h>
+#include <kernel/vm.h>
+#include <kernel/vmalloc.h>
+
+/**
+ * @defgroup vmalloc Kernel Virtual Allocator
+ *
+ * Physical memory is mapped into the kernel address space as a whole, so a
+ * buffer allocated from the direct mapping needs physically contiguous pages.
+ * Large blocks become hard to find as memory gets fragmented. Buffers that are
+ * only accessed through kernel virtual addresses (and never given to DMA
+ * devices) can instead be built from single pages mapped one after another
+ * into a separate region between VIRT_VMALLOC_BASE and VIRT_VMALLOC_LIMIT.
+ *
+ * The ranges of the region are handed out first-fit from a list of areas
+ * sorted by address. Each area is followed by an unmapped guard page, so that
+ * an overrun faults instead of corrupting the neighbouring buffer.
+ */
+
+struct VMallocArea {
+  /** Link into the sorted list of areas */
+  struct KListLink link;
+  /** The starting virtual address */
+  uintptr_t        va;
+  /** The number of pages, not counting the guard page */
+  size_t           pages;
+};
+
+static struct {
+  struct KListLink areas;
+  struct KSpinLock lock;
+} vmalloc_info = {
+  KLIST_INITIALIZER(vmalloc_info.areas),
+  K_SPINLOCK_INITIALIZER("vmalloc"),
+};
+
+// Find a free range for the area and insert it into the list
+static int
+vmalloc_reserve(struct VMallocArea *area)
+{
+  struct KListLink *l;
+  uintptr_t va = VIRT_VMALLOC_BASE;
+  size_t size = (area->pages + 1) * PAGE_SIZE;
+
+  k_spinlock_acquire(&vmalloc_info.lock);
+
+  KLIST_FOREACH(&vmalloc_info.areas, l) {
+    struct VMallocArea *next = KLIST_CONTAINER(l, struct VMallocArea, link);
+
+    if ((next->va - va) >= size)
+      break;
+
+    va = next->va + (next->pages + 1) * PAGE_SIZE;
+  }
+
+  if ((VIRT_VMALLOC_LIMIT - va) < size) {
+    k_spinlock_release(&vmalloc_info.lock);
+    return -ENOMEM;
+  }
+
+  area->va = va;
+  k_list_add_back(l, &area->link);
+
+  k_spinlock_release(&vmalloc_info.lock);
+
+  return 0;
+}
+
+// Pages unmapped at once, before invalidating their TLB entries
+#define VMALLOC_UNMAP_BATCH 32U
+
+// Unmap the first n pages of the area and free them
+static void
+vmalloc_unmap(struct VMallocArea *area, size_t n)
+{
+  struct Page *batch[VMALLOC_UNMAP_BATCH];
+  size_t i, j, count;
+
+  for (i = 0; i < n; i += count) {
+    count = MIN(n - i, VMALLOC_UNMAP_BATCH);
+
+    for (j = 0; j < count; j++) {
+      uintptr_t va = area->va + (i + j) * PAGE_SIZE;
+      physaddr_t pa;
+
+      if (arch_vm_kernel_unmap(va, &pa) != 0)
+        panic("page %p not mapped", va);
+
+      batch[j] = pa2page(pa);
+    }
+
+    // No CPU may keep using the pages once they are freed
+    arch_vm_invalidate_range(0, area->va + i * PAGE_SIZE,
+                             area->va + (i + count) * PAGE_SIZE);
+
+    for (j = 0; j < count; j++) {
+      batch[j]->ref_count--;
+      page_free_one(batch[j]);
+    }
+  }
+}
+
+/**
+ * Allocate a virtually contiguous kernel buffer made of single pages.
+ *
+ * @param size  The number of bytes to allocate
+ * @param flags Page allocation flags (PAGE_ALLOC_ZERO to clear the buffer)
+ *
+ * @return Pointer to the allocated buffer or NULL if out of memory.
+ */
+void *
+vmalloc(size_t size, int flags)
+{
+  struct VMallocArea *area;
+  size_t i;
+
+  if ((size == 0) || (size > (VIRT_VMALLOC_LIMIT - VIRT_VMALLOC_BASE)))
+    return NULL;
+
+  if ((area = (struct VMallocArea *) k_malloc(sizeof(*area))) == NULL)
+    return NULL;
+
+  k_list_null(&area->link);
+  area->pages = ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE;
+
+  if (vmalloc_reserve(area) != 0) {
+    k_free(area);
+    return NULL;
+  }
+
+  // The range belongs to this area now, map it without holding the lock
+  for (i = 0; i < area->pages; i++) {
+    struct Page *page;
+
+    if ((page = page_alloc_one(flags, PAGE_TAG_VMALLOC)) == NULL)
+      break;
+
+    if (arch_vm_kernel_map(area->va + i * PAGE_SIZE, page2pa(page),
+                           PROT_READ | PROT_WRITE) != 0) {
+      page_free_one(page);
+      break;
+    }
+
+    page->ref_count++;
+  }
+
+  if (i < area->pages) {
+    vmalloc_unmap(area, i);
+
+    k_spinlock_acquire(&vmalloc_info.lock);
+    k_list_remove(&area->link);
+    k_spinlock_release(&vmalloc_info.lock);
+
+    k_free(area);
+    return NULL;
+  }
+
+  return (void *) area->va;
+}
+
+/**
+ * Free a buffer previously allocated by 'vmalloc'.
+ *
+ * @param ptr Pointer to the buffer to be freed (or NULL)
+ */
+void
+vfree(void *ptr)
+{
+  struct VMallocArea *area = NULL;
+  struct KListLink *l;
+
+  if (ptr == NULL)
+    return;
+
+  k_spinlock_acquire(&vmalloc_info.lock);
+
+  KLIST_FOREACH(&vmalloc_info.areas, l) {
+    struct VMallocArea *a = KLIST_CONTAINER(l, struct VMallocArea, link);
+
+    if (a->va == (uintptr_t) ptr) {
+      area = a;
+      break;
+    }
+  }
+
+  k_spinlock_release(&vmalloc_info.lock);
+
+  if (area == NULL)
+    panic("bad pointer %p", ptr);
+
+  // The range stays reserved until all pages are unmapped
+  vmalloc_unmap(area, area->pages);
+
+  k_spinlock_acquire(&vmalloc_info.lock);
+  k_list_remove(&area->link);
+  k_spinlock_release(&vmalloc_info.lock);
+
+  k_free(area);
+}
@@ -1,12 +1,20 @@
+#include <stdlib.h>
 #include <string.h>
 
 
 #include <kernel/tty.h>
+#include <kernel/boot.h>
 #include <kernel/console.h>
+#include <kernel/interrupt.h>
 #include <kernel/kdebug.h>
+#include <kernel/meminfo.h>
 #include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/prof.h>
+#include <kernel/trace.h>
 #include <kernel/mm/memlayout.h>
 #include <kernel/monitor.h>
+#include <kernel/spinlock.h>
 #include <kernel/trap.h>
 #include <kernel/types.h>
 
@@ -89,7 +97,13 @@ static struct Command commands[] = {
   { "help", "Print this list of commands", mon_help },
   { "kerninfo", "Print this list of commands", mon_kerninfo },
   { "backtrace", "Display a list of function call frames", mon_backtrace },
-  { "kmeminfo", "Display the list of object caches", mon_kmeminfo },
+  { "kmeminfo", "Display memory usage statistics", mon_kmeminfo },
+  { "lockstat", "Display spinlock contention statistics", mon_lockstat },
+  { "irqstat", "Display interrupt counts for each CPU", mon_irqstat },
+  { "prof", "Control the profiler or display the profile", mon_prof },
+  { "trace", "Control the tracepoints or display the events", mon_trace },
+  { "membench", "Measure the memory copy routines", mon_membench },
+  { "boottime", "Display the time spent in each boot stage", mon_boottime },
 };
 
 #define MAXARGS 16
@@ -197,10 +211,198 @@ mon_backtrace(int argc, char **argv, struct TrapFrame *tf)
 
 int
 mon_kmeminfo(int argc, char **argv, struct TrapFrame *tf)
+{
+  static char report[8192];
+
+  (void) argc;
+  (void) argv;
+  (void) tf;
+
+  meminfo_report(report, sizeof(report));
+  cprintf("%s\n", report);
+  k_malloc_print_stats();
+
+  return 0;
+}
+
+int
+mon_lockstat(int argc, char **argv, struct TrapFrame *tf)
 {
   (void) argc;
   (void) argv;
   (void) tf;
 
+  k_spinlock_print_stats();
+
+  return 0;
+}
+
+int
+mon_irqstat(int argc, char **argv, struct TrapFrame *tf)
+{
+  (void) argc;
+  (void) argv;
+  (void) tf;
+
+  interrupt_print_stats();
+
+  return 0;
+}
+
+int
+mon_prof(int argc, char **argv, struct TrapFrame *tf)
+{
+  static char report[4096];
+
+  (void) tf;
+
+  if (argc < 2) {
+    prof_report(report, sizeof(report));
+    cprintf("%s", report);
+  } else if (strcmp(argv[1], "start") == 0) {
+    prof_start(argc > 2 ? atoi(argv[2]) : 1);
+  } else if (strcmp(argv[1], "stop") == 0) {
+    prof_stop();
+  } else if (strcmp(argv[1], "reset") == 0) {
+    prof_reset();
+  } else {
+    cprintf("Usage: prof [start [ticks] | stop | reset]\n");
+  }
+
+  return 0;
+}
+
+int
+mon_trace(int argc, char **argv, struct TrapFrame *tf)
+{
+  (void) tf;
+
+  if ((argc < 2) || (strcmp(argv[1], "show") == 0)) {
+    trace_print(argc > 2 ? atoi(argv[2]) : 32);
+  } else if (strcmp(argv[1], "start") == 0) {
+    trace_start();
+  } else if (strcmp(argv[1], "stop") == 0) {
+    trace_stop();
+  } else if (strcmp(argv[1], "clear") == 0) {
+    trace_clear();
+  } else {
+    cprintf("Usage: trace [show [count] | start | stop | clear]\n");
+  }
+
+  return 0;
+}
+
+// The generic byte-at-a-time versions from kernel/lib, for comparison
+
+static void *
+membench_memcpy_c(void *s1, const void *s2, size_t n)
+{
+  char *dst = (char *) s1;
+  const char *src = (const char *) s2;
+
+  for ( ; n > 0; n--)
+    *dst++ = *src++;
+
+  return s1;
+}
+
+static void *
+membench_memset_c(void *s, int c, size_t n)
+{
+  unsigned char *p = (unsigned char *) s;
+
+  for ( ; n > 0; n--)
+    *p++ = (unsigned char) c;
+
+  return s;
+}
+
+#define MEMBENCH_ORDER  1
+#define MEMBENCH_RUNS   64
+
+// Average number of cycles taken by one call
+static unsigned
+membench_copy(void *(*fn)(void *, const void *, size_t),
+              void *dst, const void *src, size_t n)
+{
+  uint32_t start;
+  int i;
+
+  start = k_cpu_cycles();
+  for (i = 0; i < MEMBENCH_RUNS; i++)
+    fn(dst, src, n);
+  return (k_cpu_cycles() - start) / MEMBENCH_RUNS;
+}
+
+static unsigned
+membench_set(void *(*fn)(void *, int, size_t), void *dst, size_t n)
+{
+  uint32_t start;
+  int i;
+
+  start = k_cpu_cycles();
+  for (i = 0; i < MEMBENCH_RUNS; i++)
+    fn(dst, 0x5A, n);
+  return (k_cpu_cycles() - start) / MEMBENCH_RUNS;
+}
+
+int
+mon_membench(int argc, char **argv, struct TrapFrame *tf)
+{
+  static const size_t sizes[] = { 16, 64, 256, 1024, 4096 };
+
+  struct Page *src_page, *dst_page;
+  uint8_t *src, *dst;
+  unsigned i, misalign;
+
+  (void) argc;
+  (void) argv;
+  (void) tf;
+
+  src_page = page_alloc_block(MEMBENCH_ORDER, PAGE_ALLOC_ZERO, PAGE_TAG_KDEBUG);
+  dst_page = page_alloc_block(MEMBENCH_ORDER, PAGE_ALLOC_ZERO, PAGE_TAG_KDEBUG);
+  if ((src_page == NULL) || (dst_page == NULL)) {
+    cprintf("Out of memory\n");
+    goto out;
+  }
+
+  src = (uint8_t *) page2kva(src_page);
+  dst = (uint8_t *) page2kva(dst_page);
+
+  cprintf("%6s %5s %8s %8s %8s %8s %8s\n", "size", "src+", "memcpy",
+          "C", "memmove", "memset", "C");
+
+  // The source misaligned by 0 and by 1 byte, both buffers are already cached
+  for (misalign = 0; misalign < 2; misalign++) {
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      size_t n = sizes[i];
+
+      cprintf("%6u %5u %8u %8u %8u %8u %8u\n", n, misalign,
+              membench_copy(memcpy, dst, src + misalign, n),
+              membench_copy(membench_memcpy_c, dst, src + misalign, n),
+              membench_copy(memmove, dst + 8, dst + misalign, n),
+              membench_set(memset, dst + misalign, n),
+              membench_set(membench_memset_c, dst + misalign, n));
+    }
+  }
+
+out:
+  if (src_page != NULL)
+    page_free_block(src_page, MEMBENCH_ORDER);
+  if (dst_page != NULL)
+    page_free_block(dst_page, MEMBENCH_ORDER);
+
+  return 0;
+}
+
+int
+mon_boottime(int argc, char **argv, struct TrapFrame *tf)
+{
+  (void) argc;
+  (void) argv;
+  (void) tf;
+
+  boot_print_stats();
+
   return 0;
 }
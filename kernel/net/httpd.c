@@ -0,0 +1,320 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <kernel/fs/fs.h>
+#include <kernel/net.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/types.h>
+
+#include <lwip/apps/fs.h>
+#include <lwip/apps/httpd.h>
+#include <lwip/priv/tcp_priv.h>
+#include <lwip/tcp.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * HTTP server files
+ * ----------------------------------------------------------------------------
+ *
+ * The lwIP HTTP server (`make HTTPD=1`) runs in the tcpip thread and serves
+ * the regular files under HTTPD_ROOT that everyone may read, falling back to
+ * the pages compiled into fsdata.c. File data is never copied: each block
+ * handed to the server is the rest of a page cache page, and lwIP sends it
+ * by reference.
+ *
+ * A page must stay alive until the last pbuf referencing its data is freed,
+ * which may be long after the file is closed: segments waiting to be
+ * acknowledged outlive both the request and the connection, and a driver may
+ * still be transmitting from one after the connection has been reset. lwIP
+ * asks for each such pbuf through LWIP_HOOK_TCP_WRITE_NOCOPY_PBUF, and a pbuf
+ * pointing into a page cache page holds a reference to the page, dropped by
+ * its free callback. Besides, the page of the block last handed to the server
+ * is kept in a TCP extension argument until the next block is taken or the
+ * control block is freed, so that the hook can find it.
+ *
+ * A page cache miss reads the page in the tcpip thread, holding up the rest of
+ * the network stack until it is done. The server is meant for small, mostly
+ * cached files: health checks, reports and build artifacts.
+ */
+
+#ifndef HTTPD_ROOT
+#define HTTPD_ROOT        "/var/www"
+#endif
+
+#define HTTPD_PATH_MAX    256
+
+#if LWIP_ALTCP
+#error "the pages are tracked through the raw TCP control blocks"
+#endif
+
+/** The page of the block last handed out on a connection. */
+struct HttpdConn {
+  struct Page        *page;
+};
+
+/** A pbuf sending data in place from a page. */
+struct HttpdPbuf {
+  struct pbuf_custom  pbuf;
+  struct Page        *page;
+};
+
+static u8_t net_httpd_ext_id = LWIP_TCP_PCB_NUM_EXT_ARG_ID_INVALID;
+static struct KObjectPool *net_httpd_pbuf_pool;
+
+static void net_httpd_conn_destroy(u8_t, void *);
+
+static const struct tcp_ext_arg_callbacks net_httpd_ext_callbacks = {
+  .destroy      = net_httpd_conn_destroy,
+  .passive_open = NULL,
+};
+
+// Called by lwIP when the control block of the connection is freed
+static void
+net_httpd_conn_destroy(u8_t id, void *data)
+{
+  struct HttpdConn *conn = (struct HttpdConn *) data;
+
+  (void) id;
+
+  if (conn == NULL)
+    return;
+
+  if (conn->page != NULL)
+    fs_page_put(conn->page);
+
+  k_free(conn);
+}
+
+// Get the state of the connection, attaching it on first use
+static struct HttpdConn *
+net_httpd_conn_get(struct tcp_pcb *pcb)
+{
+  struct HttpdConn *conn;
+
+  conn = (struct HttpdConn *) tcp_ext_arg_get(pcb, net_httpd_ext_id);
+  if (conn != NULL)
+    return conn;
+
+  if ((conn = (struct HttpdConn *) k_malloc(sizeof(*conn))) == NULL)
+    return NULL;
+
+  conn->page = NULL;
+
+  tcp_ext_arg_set_callbacks(pcb, net_httpd_ext_id, &net_httpd_ext_callbacks);
+  tcp_ext_arg_set(pcb, net_httpd_ext_id, conn);
+
+  return conn;
+}
+
+// Called by lwIP, or by a driver, when the last reference to the pbuf is
+// dropped
+static void
+net_httpd_pbuf_release(struct pbuf *p)
+{
+  struct HttpdPbuf *hp = (struct HttpdPbuf *) p;
+
+  fs_page_put(hp->page);
+  k_object_pool_put(net_httpd_pbuf_pool, hp);
+}
+
+/**
+ * Allocate a pbuf to send data by reference, called by tcp_write() through
+ * LWIP_HOOK_TCP_WRITE_NOCOPY_PBUF. Data from the page last handed out on the
+ * connection gets a pbuf holding a reference to the page.
+ *
+ * @param pcb  The control block of the connection
+ * @param data Pointer to the data
+ * @param len  The length of the data
+ *
+ * @return The pbuf, or NULL if out of memory.
+ */
+struct pbuf *
+net_httpd_nocopy_pbuf(struct tcp_pcb *pcb, const void *data, u16_t len)
+{
+  struct HttpdConn *conn;
+  struct HttpdPbuf *hp;
+  struct pbuf *p;
+  const u8_t *kva;
+
+  conn = (struct HttpdConn *) tcp_ext_arg_get(pcb, net_httpd_ext_id);
+
+  if ((conn == NULL) || (conn->page == NULL) ||
+      ((const u8_t *) data < (kva = (const u8_t *) page2kva(conn->page))) ||
+      ((const u8_t *) data + len > kva + PAGE_SIZE)) {
+    // Generated headers and the pages compiled into fsdata.c
+    if ((p = pbuf_alloc(PBUF_RAW, len, PBUF_ROM)) != NULL)
+      ((struct pbuf_rom *) p)->payload = data;
+    return p;
+  }
+
+  if ((hp = (struct HttpdPbuf *) k_object_pool_get(net_httpd_pbuf_pool)) == NULL)
+    return NULL;
+
+  hp->pbuf.custom_free_function = net_httpd_pbuf_release;
+  hp->page = fs_page_dup(conn->page);
+
+  p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &hp->pbuf, (void *) data,
+                          len);
+  if (p == NULL)
+    net_httpd_pbuf_release(&hp->pbuf.pbuf);
+
+  return p;
+}
+
+// Whether the path has a ".." component, which could lead out of the root
+static int
+net_httpd_path_escapes(const char *name)
+{
+  const char *p;
+
+  for (p = name; (p = strchr(p, '.')) != NULL; p++)
+    if (((p == name) || (p[-1] == '/')) && (p[1] == '.') &&
+        ((p[2] == '/') || (p[2] == '\0')))
+      return 1;
+
+  return 0;
+}
+
+int
+fs_open_custom(struct fs_file *file, const char *name)
+{
+  char path[HTTPD_PATH_MAX];
+  struct PathNode *node;
+  struct Inode *inode;
+  off_t size;
+  int ok;
+
+  if ((name[0] != '/') || net_httpd_path_escapes(name) ||
+      (strlen(HTTPD_ROOT) + strlen(name) >= sizeof(path)))
+    return 0;
+
+  snprintf(path, sizeof(path), "%s%s", HTTPD_ROOT, name);
+
+  if ((fs_lookup_at(fs_root, path, 0, &node) < 0) || (node == NULL))
+    return 0;
+
+  inode = fs_path_inode(node);
+  fs_path_put(node);
+
+  fs_inode_lock_shared(inode);
+
+  // Only the files anyone may read, with their data in the page cache
+  ok = S_ISREG(inode->mode) && !(inode->flags & FS_INODE_VOLATILE) &&
+       (inode->mode & S_IROTH) && (inode->size <= INT_MAX);
+  size = inode->size;
+
+  fs_inode_unlock_shared(inode);
+
+  if (!ok) {
+    fs_inode_put(inode);
+    return 0;
+  }
+
+  memset(file, 0, sizeof(*file));
+  file->len        = (int) size;
+  file->index      = 0;
+  file->pextension = inode;
+
+  return 1;
+}
+
+void
+fs_close_custom(struct fs_file *file)
+{
+  fs_inode_put((struct Inode *) file->pextension);
+}
+
+int
+fs_read_ref_custom(struct fs_file *file, const char **data, int count,
+                   struct altcp_pcb *pcb)
+{
+  struct Inode *inode = (struct Inode *) file->pextension;
+  struct HttpdConn *conn;
+  struct Page *page;
+  off_t off = file->index;
+  int n, r;
+
+  if ((conn = net_httpd_conn_get(pcb)) == NULL)
+    return FS_READ_EOF;
+
+  // The pbufs sending the previous block hold their own references
+  if (conn->page != NULL) {
+    fs_page_put(conn->page);
+    conn->page = NULL;
+  }
+
+  // Up to the end of the page
+  n = MIN(count, (int) (PAGE_SIZE - off % PAGE_SIZE));
+  n = MIN(n, file->len - file->index);
+
+  fs_inode_lock_shared(inode);
+
+  // The file may have been truncated since it was opened
+  if (off >= inode->size) {
+    r = -EINVAL;
+  } else {
+    n = (int) MIN((off_t) n, inode->size - off);
+    r = fs_page_get_locked(inode, off / PAGE_SIZE, &page);
+  }
+
+  fs_inode_unlock_shared(inode);
+
+  if (r < 0)
+    return FS_READ_EOF;
+
+  conn->page = page;
+
+  *data = (const char *) page2kva(page) + off % PAGE_SIZE;
+  file->index += n;
+
+  return n;
+}
+
+// Only used by fs_read(), which the server does not call with
+// LWIP_HTTPD_FS_READ_REF
+int
+fs_read_custom(struct fs_file *file, char *buffer, int count)
+{
+  struct Inode *inode = (struct Inode *) file->pextension;
+  off_t off = file->index;
+  ssize_t r;
+  int n;
+
+  fs_inode_lock_shared(inode);
+
+  if (off >= inode->size) {
+    r = -EINVAL;
+  } else {
+    n = (int) MIN((off_t) count, inode->size - off);
+    r = fs_page_cache_read(inode, (uintptr_t) buffer, n, off);
+  }
+
+  fs_inode_unlock_shared(inode);
+
+  if (r <= 0)
+    return FS_READ_EOF;
+
+  file->index += r;
+
+  return (int) r;
+}
+
+/**
+ * Start the HTTP server. Must be called from the tcpip thread.
+ */
+void
+net_httpd_init(void)
+{
+  net_httpd_pbuf_pool = k_object_pool_create("httpd_pbuf",
+                                             sizeof(struct HttpdPbuf), 0,
+                                             NULL, NULL);
+  if (net_httpd_pbuf_pool == NULL)
+    panic("cannot allocate net_httpd_pbuf_pool");
+
+  net_httpd_ext_id = tcp_ext_arg_alloc_id();
+  httpd_init();
+}
@@ -2875,6 +2875,8 @@ lwip_sockopt_to_ipopt(int optname)
     return SOF_KEEPALIVE;
   case SO_REUSEADDR:
     return SOF_REUSEADDR;
+  case SO_REUSEPORT:
+    return SOF_REUSEPORT;
   default:
     LWIP_ASSERT("Unknown socket option", 0);
     return 0;
@@ -2925,6 +2927,7 @@ lwip_getsockopt_impl(int s, int level, int optname, void *optval, socklen_t *opt
         case SO_KEEPALIVE:
 #if SO_REUSE
         case SO_REUSEADDR:
+        case SO_REUSEPORT:
 #endif /* SO_REUSE */
           if ((optname == SO_BROADCAST) &&
               (NETCONNTYPE_GROUP(sock->conn->type) != NETCONN_UDP)) {
@@ -3333,6 +3336,7 @@ lwip_setsockopt_impl(int s, int level, int optname, const void *optval, socklen_
         case SO_KEEPALIVE:
 #if SO_REUSE
         case SO_REUSEADDR:
+        case SO_REUSEPORT:
 #endif /* SO_REUSE */
           if ((optname == SO_BROADCAST) &&
               (NETCONNTYPE_GROUP(sock->conn->type) != NETCONN_UDP)) {
@@ -50,6 +50,9 @@ int fs_read_async_custom(struct fs_file *file, char *buffer, int count, fs_wait_
 #else /* LWIP_HTTPD_FS_ASYNC_READ */
 int fs_read_custom(struct fs_file *file, char *buffer, int count);
 #endif /* LWIP_HTTPD_FS_ASYNC_READ */
+#if LWIP_HTTPD_FS_READ_REF
+int fs_read_ref_custom(struct fs_file *file, const char **data, int count, struct altcp_pcb *pcb);
+#endif /* LWIP_HTTPD_FS_READ_REF */
 #endif /* LWIP_HTTPD_CUSTOM_FILES */
 
 /*-----------------------------------------------------------------------------------*/
@@ -145,6 +148,33 @@ fs_read(struct fs_file *file, char *buffer, int count)
 }
 #endif /* LWIP_HTTPD_DYNAMIC_FILE_READ */
 /*-----------------------------------------------------------------------------------*/
+#if LWIP_HTTPD_FS_READ_REF
+int
+fs_read_ref(struct fs_file *file, const char **data, int count, struct altcp_pcb *pcb)
+{
+  int read;
+  if (file->index == file->len) {
+    return FS_READ_EOF;
+  }
+#if LWIP_HTTPD_CUSTOM_FILES
+  if (file->is_custom_file) {
+    return fs_read_ref_custom(file, data, count, pcb);
+  }
+#endif /* LWIP_HTTPD_CUSTOM_FILES */
+  LWIP_UNUSED_ARG(pcb);
+
+  read = file->len - file->index;
+  if (read > count) {
+    read = count;
+  }
+
+  *data = file->data + file->index;
+  file->index += read;
+
+  return (read);
+}
+#endif /* LWIP_HTTPD_FS_READ_REF */
+/*-----------------------------------------------------------------------------------*/
 #if LWIP_HTTPD_FS_ASYNC_READ
 int
 fs_is_file_ready(struct fs_file *file, fs_wait_cb callback_fn, void *callback_arg)
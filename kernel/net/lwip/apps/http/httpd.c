@@ -1114,6 +1114,24 @@ http_check_eof(struct altcp_pcb *pcb, struct http_state *hs)
     return 0;
   }
 #if LWIP_HTTPD_DYNAMIC_FILE_READ
+#if LWIP_HTTPD_FS_READ_REF
+  /* Send the next block straight from the file system's copy of the data */
+  count = fs_read_ref(hs->handle, &hs->file, bytes_left, pcb);
+  if (count < 0) {
+    LWIP_DEBUGF(HTTPD_DEBUG, ("End of file.\n"));
+    http_eof(pcb, hs);
+    return 0;
+  }
+  LWIP_DEBUGF(HTTPD_DEBUG, ("Referenced %d bytes.\n", count));
+  hs->left = count;
+#if LWIP_HTTPD_SSI
+  if (hs->ssi) {
+    hs->ssi->parse_left = count;
+    hs->ssi->parsed = hs->file;
+  }
+#endif /* LWIP_HTTPD_SSI */
+  return 1;
+#endif /* LWIP_HTTPD_FS_READ_REF */
   /* Do we already have a send buffer allocated? */
   if (hs->buf) {
     /* Yes - get the length of the buffer */
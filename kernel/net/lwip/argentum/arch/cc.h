@@ -3,6 +3,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sys/time.h>
 
@@ -17,4 +18,8 @@ typedef int sys_prot_t;
 
 #define LWIP_RAND() ((u32_t)rand())
 
+uint16_t arch_chksum(const void *, int);
+
+#define LWIP_CHKSUM             arch_chksum
+
 #endif  /* __LWIP_OSDEV_ARCH_CC_H__ */
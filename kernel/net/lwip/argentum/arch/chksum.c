@@ -0,0 +1,84 @@
+#include <stdint.h>
+
+#include <lwip/def.h>
+#include <lwip/inet_chksum.h>
+
+/**
+ * Internet checksum routine used by lwIP (LWIP_CHKSUM).
+ *
+ * Same contract as lwip_standard_chksum(), but adds the data 32 bytes per
+ * iteration into a 64-bit accumulator, so the carries need no handling inside
+ * the loop and the sum is folded only once at the end.
+ *
+ * @param dataptr Start of the buffer, may be an odd byte address.
+ * @param len     The number of bytes in the buffer.
+ *
+ * @return The non-inverted Internet sum in the byte order of the data.
+ */
+uint16_t
+arch_chksum(const void *dataptr, int len)
+{
+  const uint8_t *pb = (const uint8_t *) dataptr;
+  const uint16_t *ps;
+  const uint32_t *pl;
+  uint16_t t = 0;
+  uint64_t sum = 0;
+  uint32_t folded;
+  int odd = ((uintptr_t) pb & 1);
+
+  // Get aligned to uint16_t
+  if (odd && (len > 0)) {
+    ((uint8_t *) &t)[1] = *pb++;
+    len--;
+  }
+
+  // Get aligned to uint32_t
+  ps = (const uint16_t *) (const void *) pb;
+  if (((uintptr_t) ps & 2) && (len > 1)) {
+    sum += *ps++;
+    len -= 2;
+  }
+
+  // Add the bulk of the data
+  pl = (const uint32_t *) (const void *) ps;
+  while (len >= 32) {
+    sum += pl[0];
+    sum += pl[1];
+    sum += pl[2];
+    sum += pl[3];
+    sum += pl[4];
+    sum += pl[5];
+    sum += pl[6];
+    sum += pl[7];
+    pl  += 8;
+    len -= 32;
+  }
+  while (len >= 4) {
+    sum += *pl++;
+    len -= 4;
+  }
+
+  // Consume the left-over bytes, if any
+  ps = (const uint16_t *) (const void *) pl;
+  if (len > 1) {
+    sum += *ps++;
+    len -= 2;
+  }
+  if (len > 0)
+    ((uint8_t *) &t)[0] = *(const uint8_t *) ps;
+
+  sum += t;
+
+  // Fold the 64-bit sum into 16 bits
+  sum = (sum & 0xFFFFFFFFUL) + (sum >> 32);
+  sum = (sum & 0xFFFFFFFFUL) + (sum >> 32);
+  folded = (uint32_t) sum;
+  folded = FOLD_U32T(folded);
+  folded = FOLD_U32T(folded);
+
+  // Swap if alignment was odd
+  if (odd)
+    folded = SWAP_BYTES_IN_WORD(folded);
+
+  return (uint16_t) folded;
+}
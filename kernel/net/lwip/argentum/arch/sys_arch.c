@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include <kernel/core/cpu.h>
 #include <kernel/object_pool.h>
 #include <kernel/page.h>
@@ -8,6 +10,7 @@
 #include <kernel/time.h>
 #include <kernel/types.h>
 #include <lwip/sys.h>
+#include <lwip/tcpip.h>
 
 #include "cc.h"
 #include "sys_arch.h"
@@ -112,9 +115,12 @@ err_t
 sys_mbox_new(sys_mbox_t *mbox, int size)
 {
   struct KMailBox *kmailbox;
-  (void) size;
+  size_t buf_size;
+
+  // lwIP passes 0 for mailboxes whose size is not configured
+  buf_size = (size > 0) ? size * sizeof(void *) : PAGE_SIZE;
 
-  if ((kmailbox = k_mailbox_create(sizeof(void *), PAGE_SIZE)) == NULL)
+  if ((kmailbox = k_mailbox_create(sizeof(void *), buf_size)) == NULL)
     return ERR_MEM;
 
   *mbox = kmailbox;
@@ -130,13 +136,13 @@ sys_mbox_post(sys_mbox_t *mbox, void *msg)
 err_t
 sys_mbox_trypost(sys_mbox_t *mbox, void *msg)
 {
-  return k_mailbox_try_send(*mbox, &msg);
+  return (k_mailbox_try_send(*mbox, &msg) < 0) ? ERR_MEM : ERR_OK;
 }
 
 err_t
 sys_mbox_trypost_fromisr(sys_mbox_t *mbox, void *msg)
 {
-  return k_mailbox_try_send(*mbox, &msg);
+  return sys_mbox_trypost(mbox, msg);
 }
 
 u32_t
@@ -220,6 +226,45 @@ sys_now(void)
   return k_tick_get() * 10;
 }
 
+/* Memory functions: */
+
+void *
+sys_mem_calloc(size_t count, size_t size)
+{
+  void *p;
+
+  if ((size != 0) && (count > (size_t) -1 / size))
+    return NULL;
+
+  if ((p = k_malloc(count * size)) != NULL)
+    memset(p, 0, count * size);
+
+  return p;
+}
+
+/* Core locking: */
+
+static struct KThread *tcpip_thread;
+
+void
+sys_mark_tcpip_thread(void)
+{
+  tcpip_thread = k_thread_current();
+}
+
+// Socket calls run the stack in the context of the calling thread while
+// holding the core lock, and only the tcpip thread may run it without one
+void
+sys_check_core_locking(void)
+{
+  if (lock_tcpip_core != NULL) {
+    if (!k_mutex_holding(lock_tcpip_core))
+      panic("lwIP core lock not held");
+  } else if ((tcpip_thread != NULL) && (k_thread_current() != tcpip_thread)) {
+    panic("lwIP core called outside of the tcpip thread");
+  }
+}
+
 static struct KSpinLock lwip_lock = K_SPINLOCK_INITIALIZER("lwip");
 
 sys_prot_t
@@ -235,3 +280,27 @@ sys_arch_unprotect(sys_prot_t pval)
   (void) pval;
   k_spinlock_release(&lwip_lock);
 }
+
+void *
+sys_memp_pool_create(const char *name, size_t size)
+{
+  return k_object_pool_create(name, size, MEM_ALIGNMENT, NULL, NULL);
+}
+
+void *
+sys_memp_pool_alloc(void *pool, size_t size)
+{
+  // Pools that could not be created fall back to the heap
+  if (pool == NULL)
+    return k_malloc(size);
+  return k_object_pool_get((struct KObjectPool *) pool);
+}
+
+void
+sys_memp_pool_free(void *pool, void *mem)
+{
+  if (pool == NULL)
+    k_free(mem);
+  else
+    k_object_pool_put((struct KObjectPool *) pool, mem);
+}
@@ -1,11 +1,102 @@
 #ifndef __LWIP_OSDEV_LWIPOPTS_H__
 #define __LWIP_OSDEV_LWIPOPTS_H__
 
+#include <stddef.h>
+
 #define LWIP_TIMEVAL_PRIVATE    0
 #define LWIP_NETIF_LOOPBACK     1
 #define LWIP_DNS                1
 #define LWIP_DHCP               1
 #define LWIP_RAW                1
 #define LWIP_SO_RCVTIMEO        1
+#define LWIP_SO_RCVBUF          1
+#define LWIP_SUPPORT_CUSTOM_PBUF 1     // Drivers receive into custom pbufs
+
+// SO_REUSEADDR, and SO_REUSEPORT for pre-forked servers: each worker listens
+// on a socket of its own and tcp_input() deals the connections out in turn,
+// so accepting workers never wake up each other
+#define SO_REUSE                1
+
+// Socket calls run the stack in the caller's context under the core lock
+// instead of being passed to the tcpip thread and waiting for a reply
+#define LWIP_TCPIP_CORE_LOCKING 1
+
+// Declared here since lwIP expands the hooks in files not including sys_arch.h
+void sys_mark_tcpip_thread(void);
+void sys_check_core_locking(void);
+
+#define LWIP_ASSERT_CORE_LOCKED() sys_check_core_locking()
+#define LWIP_MARK_TCPIP_THREAD()  sys_mark_tcpip_thread()
+
+// Loopback traffic never leaves memory, so the loopback interface neither
+// generates nor verifies checksums (see net_init_done)
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
+
+#define TCPIP_MBOX_SIZE           64
+#define DEFAULT_RAW_RECVMBOX_SIZE 32
+#define DEFAULT_UDP_RECVMBOX_SIZE 32
+#define DEFAULT_TCP_RECVMBOX_SIZE 32
+#define DEFAULT_ACCEPTMBOX_SIZE   16
+
+// Take all memory from the kernel allocator, so the stack grows with the load
+// rather than being limited by small static pools and heap
+void *k_malloc(size_t);
+void  k_free(void *);
+void *sys_mem_calloc(size_t, size_t);
+
+#define MEM_LIBC_MALLOC           1
+#define MEMP_MEM_MALLOC           1
+#define mem_clib_malloc           k_malloc
+#define mem_clib_free             k_free
+#define mem_clib_calloc           sys_mem_calloc
+
+// Each memp type gets an object pool of its own, so elements are not rounded
+// up to the k_malloc size classes and the free slabs of pools that went idle
+// are given back to the page allocator by the object pool shrinker
+void *sys_memp_pool_create(const char *, size_t);
+void *sys_memp_pool_alloc(void *, size_t);
+void  sys_memp_pool_free(void *, void *);
+
+#define MEMP_SYS_POOLS            1
+
+// The TCP window and send buffer are sized at boot from the amount of physical
+// memory (see net_tune()), up to the largest window that needs no scaling
+extern unsigned net_tcp_wnd;
+extern unsigned net_tcp_snd_buf;
+
+#define TCP_MSS                   1460
+#define TCP_WND                   net_tcp_wnd
+#define TCP_SND_BUF               net_tcp_snd_buf
+#define NET_TCP_BUF_MAX           (44 * TCP_MSS)
+#define TCP_SND_QUEUELEN          ((4 * NET_TCP_BUF_MAX + (TCP_MSS - 1)) / TCP_MSS)
+
+// Keep the statistics reported by /dev/netstat
+#define LWIP_STATS_LARGE          1
+#define MEMP_STATS                1
+#define MIB2_STATS                1
+
+// The compile-time checks cannot see the values above, net_tune() does them
+#define LWIP_DISABLE_TCP_SANITY_CHECKS 1
+
+// The in-kernel HTTP server (`make HTTPD=1`) serves files from the VFS, with
+// the data sent in place from the page cache (see kernel/net/httpd.c). The
+// headers are generated, since the files do not include them. The page being
+// sent on a connection is kept in a TCP extension argument, and each pbuf
+// referencing it holds its own page reference. The lwIP file functions are
+// prefixed, since fs_open() and others are the kernel's own.
+#ifdef HTTPD
+struct tcp_pcb;
+struct pbuf *net_httpd_nocopy_pbuf(struct tcp_pcb *, const void *,
+                                   unsigned short);
+
+#define LWIP_HOOK_TCP_WRITE_NOCOPY_PBUF(pcb, data, len) \
+  net_httpd_nocopy_pbuf(pcb, data, len)
+#define LWIP_TCP_PCB_NUM_EXT_ARGS      1
+#define LWIP_HTTPD_CUSTOM_FILES        1
+#define LWIP_HTTPD_DYNAMIC_FILE_READ   1
+#define LWIP_HTTPD_DYNAMIC_HEADERS     1
+#define LWIP_HTTPD_FS_READ_REF         1
+#define LWIP_HTTPD_FS_PREFIXED         1
+#endif
 
 #endif  /* __LWIP_OSDEV_LWIPOPTS_H__ */
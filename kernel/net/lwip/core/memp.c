@@ -175,7 +175,12 @@ void
 memp_init_pool(const struct memp_desc *desc)
 {
 #if MEMP_MEM_MALLOC
+#if MEMP_SYS_POOLS
+  *desc->sys_pool = sys_memp_pool_create(desc->sys_name,
+                                         MEMP_SIZE + MEMP_ALIGN_SIZE(desc->size));
+#else /* MEMP_SYS_POOLS */
   LWIP_UNUSED_ARG(desc);
+#endif /* MEMP_SYS_POOLS */
 #else
   int i;
   struct memp *memp;
@@ -251,7 +256,12 @@ do_memp_malloc_pool_fn(const struct memp_desc *desc, const char *file, const int
   SYS_ARCH_DECL_PROTECT(old_level);
 
 #if MEMP_MEM_MALLOC
+#if MEMP_SYS_POOLS
+  memp = (struct memp *)sys_memp_pool_alloc(*desc->sys_pool,
+                                            MEMP_SIZE + MEMP_ALIGN_SIZE(desc->size));
+#else /* MEMP_SYS_POOLS */
   memp = (struct memp *)mem_malloc(MEMP_SIZE + MEMP_ALIGN_SIZE(desc->size));
+#endif /* MEMP_SYS_POOLS */
   SYS_ARCH_PROTECT(old_level);
 #else /* MEMP_MEM_MALLOC */
   SYS_ARCH_PROTECT(old_level);
@@ -378,9 +388,13 @@ do_memp_free_pool(const struct memp_desc *desc, void *mem)
 #endif
 
 #if MEMP_MEM_MALLOC
-  LWIP_UNUSED_ARG(desc);
   SYS_ARCH_UNPROTECT(old_level);
+#if MEMP_SYS_POOLS
+  sys_memp_pool_free(*desc->sys_pool, memp);
+#else /* MEMP_SYS_POOLS */
+  LWIP_UNUSED_ARG(desc);
   mem_free(memp);
+#endif /* MEMP_SYS_POOLS */
 #else /* MEMP_MEM_MALLOC */
   memp->next = *desc->tab;
   *desc->tab = memp;
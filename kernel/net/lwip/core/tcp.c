@@ -720,8 +720,10 @@ tcp_bind(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port)
           /* Omit checking for the same port if both pcbs have REUSEADDR set.
              For SO_REUSEADDR, the duplicate-check for a 5-tuple is done in
              tcp_connect. */
-          if (!ip_get_option(pcb, SOF_REUSEADDR) ||
-              !ip_get_option(cpcb, SOF_REUSEADDR))
+          if ((!ip_get_option(pcb, SOF_REUSEADDR) ||
+               !ip_get_option(cpcb, SOF_REUSEADDR)) &&
+              (!ip_get_option(pcb, SOF_REUSEPORT) ||
+               !ip_get_option(cpcb, SOF_REUSEPORT)))
 #endif /* SO_REUSE */
           {
             /* @todo: check accept_any_ip_version */
@@ -865,13 +867,16 @@ tcp_listen_with_backlog_and_err(struct tcp_pcb *pcb, u8_t backlog, err_t *err)
     goto done;
   }
 #if SO_REUSE
-  if (ip_get_option(pcb, SOF_REUSEADDR)) {
+  if (ip_get_option(pcb, SOF_REUSEADDR | SOF_REUSEPORT)) {
     /* Since SOF_REUSEADDR allows reusing a local address before the pcb's usage
        is declared (listen-/connection-pcb), we have to make sure now that
-       this port is only used once for every local IP. */
+       this port is only used once for every local IP. Listeners that all set
+       SOF_REUSEPORT share the port, tcp_input() spreads the connections. */
     for (lpcb = tcp_listen_pcbs.listen_pcbs; lpcb != NULL; lpcb = lpcb->next) {
       if ((lpcb->local_port == pcb->local_port) &&
-          ip_addr_cmp(&lpcb->local_ip, &pcb->local_ip)) {
+          ip_addr_cmp(&lpcb->local_ip, &pcb->local_ip) &&
+          (!ip_get_option(pcb, SOF_REUSEPORT) ||
+           !ip_get_option(lpcb, SOF_REUSEPORT))) {
         /* this address/port is already used */
         lpcb = NULL;
         res = ERR_USE;
@@ -327,8 +327,11 @@ tcp_input(struct pbuf *p, struct netif *inp)
         if (IP_IS_ANY_TYPE_VAL(lpcb->local_ip)) {
           /* found an ANY TYPE (IPv4/IPv6) match */
 #if SO_REUSE
-          lpcb_any = lpcb;
-          lpcb_prev = prev;
+          /* keep the first one, the others sharing the port come after it */
+          if (lpcb_any == NULL) {
+            lpcb_any = lpcb;
+            lpcb_prev = prev;
+          }
 #else /* SO_REUSE */
           break;
 #endif /* SO_REUSE */
@@ -339,8 +342,10 @@ tcp_input(struct pbuf *p, struct netif *inp)
           } else if (ip_addr_isany(&lpcb->local_ip)) {
             /* found an ANY-match */
 #if SO_REUSE
-            lpcb_any = lpcb;
-            lpcb_prev = prev;
+            if (lpcb_any == NULL) {
+              lpcb_any = lpcb;
+              lpcb_prev = prev;
+            }
 #else /* SO_REUSE */
             break;
 #endif /* SO_REUSE */
@@ -358,6 +363,24 @@ tcp_input(struct pbuf *p, struct netif *inp)
     }
 #endif /* SO_REUSE */
     if (lpcb != NULL) {
+#if SO_REUSE
+      if (ip_get_option(lpcb, SOF_REUSEPORT)) {
+        /* Several listeners may share the port: move this PCB to the end of
+           the list, so that the next connection goes to another one. */
+        if (lpcb->next != NULL) {
+          struct tcp_pcb_listen *last;
+
+          if (prev != NULL) {
+            ((struct tcp_pcb_listen *)prev)->next = lpcb->next;
+          } else {
+            tcp_listen_pcbs.listen_pcbs = lpcb->next;
+          }
+          for (last = lpcb->next; last->next != NULL; last = last->next);
+          last->next = lpcb;
+          lpcb->next = NULL;
+        }
+      } else
+#endif /* SO_REUSE */
       /* Move this PCB to the front of the list so that subsequent
          lookups will be faster (we exploit locality in TCP segment
          arrivals). */
@@ -295,6 +295,28 @@ tcp_seg_add_chksum(u16_t chksum, u16_t len, u16_t *seg_chksum,
 }
 #endif /* TCP_CHECKSUM_ON_COPY */
 
+/** Allocate a pbuf referencing non-volatile data passed to tcp_write without
+ * copying (see LWIP_HOOK_TCP_WRITE_NOCOPY_PBUF).
+ */
+static struct pbuf *
+tcp_pbuf_nocopy(struct tcp_pcb *pcb, pbuf_layer layer, const u8_t *data, u16_t length)
+{
+  struct pbuf *p;
+
+#ifdef LWIP_HOOK_TCP_WRITE_NOCOPY_PBUF
+  LWIP_UNUSED_ARG(layer);
+  p = LWIP_HOOK_TCP_WRITE_NOCOPY_PBUF(pcb, data, length);
+#else /* LWIP_HOOK_TCP_WRITE_NOCOPY_PBUF */
+  LWIP_UNUSED_ARG(pcb);
+  p = pbuf_alloc(layer, length, PBUF_ROM);
+  if (p != NULL) {
+    /* reference the non-volatile payload data */
+    ((struct pbuf_rom *)p)->payload = data;
+  }
+#endif /* LWIP_HOOK_TCP_WRITE_NOCOPY_PBUF */
+  return p;
+}
+
 /** Checks if tcp_write is allowed or not (checks state, snd_buf and snd_queuelen).
  *
  * @param pcb the tcp pcb to check for
@@ -561,13 +583,11 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
           LWIP_ASSERT("tcp_write: ROM pbufs cannot be oversized", pos == 0);
           extendlen = seglen;
         } else {
-          if ((concat_p = pbuf_alloc(PBUF_RAW, seglen, PBUF_ROM)) == NULL) {
+          if ((concat_p = tcp_pbuf_nocopy(pcb, PBUF_RAW, (const u8_t *)arg + pos, seglen)) == NULL) {
             LWIP_DEBUGF(TCP_OUTPUT_DEBUG | LWIP_DBG_LEVEL_SERIOUS,
                         ("tcp_write: could not allocate memory for zero-copy pbuf\n"));
             goto memerr;
           }
-          /* reference the non-volatile payload data */
-          ((struct pbuf_rom *)concat_p)->payload = (const u8_t *)arg + pos;
           queuelen += pbuf_clen(concat_p);
         }
 #if TCP_CHECKSUM_ON_COPY
@@ -624,7 +644,7 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
 #if TCP_OVERSIZE
       LWIP_ASSERT("oversize == 0", oversize == 0);
 #endif /* TCP_OVERSIZE */
-      if ((p2 = pbuf_alloc(PBUF_TRANSPORT, seglen, PBUF_ROM)) == NULL) {
+      if ((p2 = tcp_pbuf_nocopy(pcb, PBUF_TRANSPORT, (const u8_t *)arg + pos, seglen)) == NULL) {
         LWIP_DEBUGF(TCP_OUTPUT_DEBUG | LWIP_DBG_LEVEL_SERIOUS, ("tcp_write: could not allocate memory for zero-copy pbuf\n"));
         goto memerr;
       }
@@ -636,8 +656,6 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
         chksum = SWAP_BYTES_IN_WORD(chksum);
       }
 #endif /* TCP_CHECKSUM_ON_COPY */
-      /* reference the non-volatile payload data */
-      ((struct pbuf_rom *)p2)->payload = (const u8_t *)arg + pos;
 
       /* Second, allocate a pbuf for the headers. */
       if ((p = pbuf_alloc(PBUF_TRANSPORT, optlen, PBUF_RAM)) == NULL) {
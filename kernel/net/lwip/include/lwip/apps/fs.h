@@ -34,11 +34,24 @@
 
 #include "httpd_opts.h"
 #include "lwip/err.h"
+#if LWIP_HTTPD_FS_READ_REF
+#include "lwip/altcp.h"
+#endif /* LWIP_HTTPD_FS_READ_REF */
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#if LWIP_HTTPD_FS_PREFIXED
+#define fs_open             httpd_fs_open
+#define fs_close            httpd_fs_close
+#define fs_read             httpd_fs_read
+#define fs_read_async       httpd_fs_read_async
+#define fs_read_ref         httpd_fs_read_ref
+#define fs_is_file_ready    httpd_fs_is_file_ready
+#define fs_bytes_left       httpd_fs_bytes_left
+#endif /* LWIP_HTTPD_FS_PREFIXED */
+
 #define FS_READ_EOF     -1
 #define FS_READ_DELAYED -2
 
@@ -95,6 +108,9 @@ int fs_read_async(struct fs_file *file, char *buffer, int count, fs_wait_cb call
 int fs_read(struct fs_file *file, char *buffer, int count);
 #endif /* LWIP_HTTPD_FS_ASYNC_READ */
 #endif /* LWIP_HTTPD_DYNAMIC_FILE_READ */
+#if LWIP_HTTPD_FS_READ_REF
+int fs_read_ref(struct fs_file *file, const char **data, int count, struct altcp_pcb *pcb);
+#endif /* LWIP_HTTPD_FS_READ_REF */
 #if LWIP_HTTPD_FS_ASYNC_READ
 int fs_is_file_ready(struct fs_file *file, fs_wait_cb callback_fn, void *callback_arg);
 #endif /* LWIP_HTTPD_FS_ASYNC_READ */
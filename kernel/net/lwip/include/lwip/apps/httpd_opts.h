@@ -379,6 +379,25 @@
 #define LWIP_HTTPD_FS_ASYNC_READ      0
 #endif
 
+/** LWIP_HTTPD_FS_READ_REF==1: with LWIP_HTTPD_DYNAMIC_FILE_READ, get file data
+ * through fs_read_ref(), which points into the file system's own copy of the
+ * data instead of copying it into a send buffer. The data is then sent
+ * without copying, so it must stay valid until the connection has had it
+ * acknowledged or is gone; the connection is passed to help tracking that.
+ */
+#if !defined LWIP_HTTPD_FS_READ_REF || defined __DOXYGEN__
+#define LWIP_HTTPD_FS_READ_REF        0
+#endif
+
+/** LWIP_HTTPD_FS_PREFIXED==1: name the file system functions httpd_fs_open(),
+ * httpd_fs_close() etc. instead of fs_open(), fs_close() etc., for ports with
+ * functions of the same names. Only the files including lwip/apps/fs.h see the
+ * new names, the port's own declarations must be included before it.
+ */
+#if !defined LWIP_HTTPD_FS_PREFIXED || defined __DOXYGEN__
+#define LWIP_HTTPD_FS_PREFIXED        0
+#endif
+
 /** Filename (including path) to use as FS data file */
 #if !defined HTTPD_FSDATA_FILE || defined __DOXYGEN__
 /* HTTPD_USE_CUSTOM_FSDATA: Compatibility with deprecated lwIP option */
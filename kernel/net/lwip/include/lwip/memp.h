@@ -68,12 +68,22 @@ extern const struct memp_desc* const memp_pools[MEMP_MAX];
 
 #if MEMP_MEM_MALLOC
 
+#if MEMP_SYS_POOLS
+#define LWIP_MEMPOOL_DECLARE_SYS_POOL(name) static void *memp_sys_pool_ ## name;
+#define LWIP_MEMPOOL_DECLARE_SYS_POOL_REFERENCE(name) , "lwip_" #name, &memp_sys_pool_ ## name
+#else
+#define LWIP_MEMPOOL_DECLARE_SYS_POOL(name)
+#define LWIP_MEMPOOL_DECLARE_SYS_POOL_REFERENCE(name)
+#endif
+
 #define LWIP_MEMPOOL_DECLARE(name,num,size,desc) \
   LWIP_MEMPOOL_DECLARE_STATS_INSTANCE(memp_stats_ ## name) \
+  LWIP_MEMPOOL_DECLARE_SYS_POOL(name) \
   const struct memp_desc memp_ ## name = { \
     DECLARE_LWIP_MEMPOOL_DESC(desc) \
     LWIP_MEMPOOL_DECLARE_STATS_REFERENCE(memp_stats_ ## name) \
     LWIP_MEM_ALIGN_SIZE(size) \
+    LWIP_MEMPOOL_DECLARE_SYS_POOL_REFERENCE(name) \
   };
 
 #else /* MEMP_MEM_MALLOC */
@@ -271,6 +271,20 @@
 #define MEMP_MEM_MALLOC                 0
 #endif
 
+/**
+ * MEMP_SYS_POOLS==1: With MEMP_MEM_MALLOC, give each pool type an allocator of
+ * its own provided by the port instead of the heap. The port has to implement:
+ * - void *sys_memp_pool_create(const char *name, size_t size): create the
+ *   pool for elements of the given size when the lwIP pool is initialized,
+ *   returns NULL on failure
+ * - void *sys_memp_pool_alloc(void *pool, size_t size): allocate an element,
+ *   from the heap if pool is NULL
+ * - void sys_memp_pool_free(void *pool, void *mem): free an element
+ */
+#if !defined MEMP_SYS_POOLS || defined __DOXYGEN__
+#define MEMP_SYS_POOLS                  0
+#endif
+
 /**
  * MEMP_MEM_INIT==1: Force use of memset to initialize pool memory.
  * Useful if pool are moved in uninitialized section of memory. This will ensure
@@ -2849,6 +2863,30 @@
 #define LWIP_HOOK_TCP_OUT_ADD_TCPOPTS(p, hdr, pcb, opts)
 #endif
 
+/**
+ * LWIP_HOOK_TCP_WRITE_NOCOPY_PBUF:
+ * Hook for allocating the pbufs that reference the data passed to tcp_write()
+ * without TCP_WRITE_FLAG_COPY, instead of plain PBUF_ROM ones. A custom pbuf
+ * can keep the data alive until it is freed, which may be later than the time
+ * the data is acknowledged, e.g. while a netif driver still holds a reference.
+ * Signature:\code{.c}
+ * struct pbuf *my_hook_tcp_write_nocopy_pbuf(struct tcp_pcb *pcb, const u8_t *data, u16_t len);
+ * \endcode
+ * Arguments:
+ * - pcb: tcp_pcb the data is written to
+ * - data: the data to reference
+ * - len: the length of the data
+ * Return value:
+ * - a pbuf with payload pointing to data and len bytes long, or NULL if out of
+ *   memory
+ *
+ * ATTENTION: don't call any tcp api functions that might change tcp state (pcb
+ * state or any pcb lists) from this callback!
+ */
+#ifdef __DOXYGEN__
+#define LWIP_HOOK_TCP_WRITE_NOCOPY_PBUF(pcb, data, len)
+#endif
+
 /**
  * LWIP_HOOK_IP4_INPUT(pbuf, input_netif):
  * Called from ip_input() (IPv4)
@@ -118,6 +118,14 @@ struct memp_desc {
   /** Element size */
   u16_t size;
 
+#if MEMP_MEM_MALLOC && MEMP_SYS_POOLS
+  /** Name of the pool provided by the port */
+  const char *sys_name;
+
+  /** The pool provided by the port, created by memp_init_pool() */
+  void **sys_pool;
+#endif /* MEMP_MEM_MALLOC && MEMP_SYS_POOLS */
+
 #if !MEMP_MEM_MALLOC
   /** Number of elements */
   u16_t num;
@@ -1,10 +1,17 @@
 #include <kernel/console.h>
+#include <kernel/core/tick.h>
 #include <kernel/fs/file.h>
-#include <kernel/page.h>
 #include <kernel/net.h>
+#include <kernel/net/unix.h>
 #include <kernel/thread.h>
+#include <kernel/mm/memlayout.h>
 #include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/poll.h>
+#include <kernel/time.h>
+#include <kernel/types.h>
 #include <kernel/vmspace.h>
+#include <kernel/waitqueue.h>
 #include <netdb.h>
 
 #include <lwip/api.h>
@@ -15,22 +22,185 @@
 #include <lwip/tcpip.h>
 #include <lwip/icmp.h>
 #include <lwip/inet_chksum.h>
+#include <lwip/priv/sockets_priv.h>
+#include <lwip/tcp.h>
+#include <netif/ethernet.h>
 
-void arch_eth_write(const void *, size_t);
+#ifdef LWIPERF
+#include <lwip/apps/lwiperf.h>
+#endif
+#ifdef HTTPD
+#include <lwip/apps/httpd_opts.h>
+#endif
+
+int arch_eth_write(struct pbuf *);
 
 static struct netif eth_netif;
 
+// Pollers of each socket
+static struct PollQueue net_poll_queues[NUM_SOCKETS];
+
+// The netconn callback installed by the socket layer
+static netconn_callback net_socket_callback;
+
+// Send buffer sizes set with SO_SNDBUF, or 0 for the default
+static int net_snd_bufs[NUM_SOCKETS];
+
+static int net_set_snd_buf(struct File *, int);
+static void net_dns_init(void);
+
+/*
+ * ----------------------------------------------------------------------------
+ * Buffer sizing
+ * ----------------------------------------------------------------------------
+ *
+ * lwIP uses the same receive window and send buffer size for every TCP
+ * connection. Instead of fixing them at compile time, they are sized at boot
+ * to the amount of physical memory, as is the number of receive buffers the
+ * drivers may hold on to.
+ */
+
+unsigned net_tcp_wnd     = 4 * TCP_MSS;
+unsigned net_tcp_snd_buf = 2 * TCP_MSS;
+
+// The limit and the current number of receive buffers in use
+static unsigned net_rx_buffer_max = NET_RX_BUFFER_MIN;
+static unsigned net_rx_buffer_count;
+
+static void
+net_tune(void)
+{
+  size_t size;
+
+  // Give each connection 1/1024 of the memory (i.e. 64 KiB per 64 MiB) for
+  // both its window and send buffer, in whole segments
+  size = (size_t) page_count * (PAGE_SIZE / 1024);
+  size = ROUND_DOWN(MIN(size, (size_t) NET_TCP_BUF_MAX), TCP_MSS);
+  size = MAX(size, (size_t) 4 * TCP_MSS);
+
+  net_tcp_wnd     = size;
+  net_tcp_snd_buf = size;
+
+  // Enough to fill the windows of a few connections at once
+  net_rx_buffer_max = MAX(4 * size / TCP_MSS, (size_t) NET_RX_BUFFER_MIN);
+
+  // The checks lwIP would have made at compile time
+  assert(TCP_SNDLOWAT < TCP_SND_BUF);
+  assert(TCP_SND_QUEUELEN >= 2 * (TCP_SND_BUF / TCP_MSS));
+
+  cprintf("net: TCP window %u, send buffer %u, %u receive buffers\n",
+          net_tcp_wnd, net_tcp_snd_buf, net_rx_buffer_max);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Receive buffers
+ * ----------------------------------------------------------------------------
+ *
+ * Network drivers copy received frames straight into buffers taken from a
+ * dedicated object pool, which are then passed up the stack as custom pbufs
+ * with no further copying. Once lwIP is done with a frame, the buffer goes
+ * back to the pool to be reused for the next one.
+ */
+
+struct NetRxBuffer {
+  struct pbuf_custom  pbuf;
+  uint32_t            data[NET_RX_BUFFER_SIZE / sizeof(uint32_t)];
+};
+
+static struct KObjectPool *net_rx_pool;
+
+/**
+ * Get a buffer to receive a frame into.
+ *
+ * @return Pointer to NET_RX_BUFFER_SIZE bytes of word-aligned memory, or NULL
+ *         if out of memory.
+ */
+void *
+net_rx_buffer_alloc(void)
+{
+  struct NetRxBuffer *buf;
+
+  // Drop frames rather than let a flood of them use up all memory
+  if (__sync_add_and_fetch(&net_rx_buffer_count, 1) > net_rx_buffer_max) {
+    __sync_sub_and_fetch(&net_rx_buffer_count, 1);
+    return NULL;
+  }
+
+  if ((buf = (struct NetRxBuffer *) k_object_pool_get(net_rx_pool)) == NULL) {
+    __sync_sub_and_fetch(&net_rx_buffer_count, 1);
+    return NULL;
+  }
+
+  return buf->data;
+}
+
+/**
+ * Return an unused receive buffer.
+ *
+ * @param data Pointer to the buffer data
+ */
 void
-net_enqueue(void *data, size_t count)
+net_rx_buffer_free(void *data)
 {
-  struct pbuf *p = pbuf_alloc(PBUF_RAW, count, PBUF_POOL);
+  k_object_pool_put(net_rx_pool, KLIST_CONTAINER(data, struct NetRxBuffer, data));
+  __sync_sub_and_fetch(&net_rx_buffer_count, 1);
+}
 
-  if (p != NULL) {
-    pbuf_take(p, data, count);
+// Called by lwIP when the last reference to the frame is dropped
+static void
+net_rx_buffer_release(struct pbuf *p)
+{
+  k_object_pool_put(net_rx_pool, (struct NetRxBuffer *) p);
+  __sync_sub_and_fetch(&net_rx_buffer_count, 1);
+}
+
+/**
+ * Pass a received frame up the network stack. The stack takes ownership of
+ * the buffer. Must be called in the lwIP thread (see net_rx_poll_schedule()),
+ * since the frame is processed right away rather than posted as a message.
+ *
+ * @param data   Pointer to the buffer data
+ * @param length The length of the frame
+ */
+void
+net_rx_buffer_input(void *data, size_t length)
+{
+  struct NetRxBuffer *buf = KLIST_CONTAINER(data, struct NetRxBuffer, data);
+  struct pbuf *p;
 
-    if (eth_netif.input(p, &eth_netif) != 0)
-      pbuf_free(p);
+  buf->pbuf.custom_free_function = net_rx_buffer_release;
+
+  // The interface may not be up yet
+  if (eth_netif.input == NULL) {
+    net_rx_buffer_free(data);
+    return;
+  }
+
+  p = pbuf_alloced_custom(PBUF_RAW, length, PBUF_REF, &buf->pbuf, buf->data,
+                          sizeof(buf->data));
+  if (p == NULL) {
+    net_rx_buffer_free(data);
+    return;
   }
+
+  if (eth_netif.input(p, &eth_netif) != ERR_OK)
+    pbuf_free(p);
+}
+
+/**
+ * Schedule a driver receive poll function to run in the lwIP thread. Drivers
+ * use it to process received frames in batches with their interrupts masked.
+ *
+ * @param poll The function to call
+ * @param arg  The argument to pass to the function
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+net_rx_poll_schedule(void (*poll)(void *), void *arg)
+{
+  return (tcpip_try_callback(poll, arg) == ERR_OK) ? 0 : -ENOMEM;
 }
 
 static err_t
@@ -38,14 +208,9 @@ eth_netif_output(struct netif *netif, struct pbuf *p)
 {
   (void) netif;
 
-  struct Page *page = page_alloc_one(0, PAGE_TAG_ETH_TX);
-
-  pbuf_copy_partial(p, page2kva(page), p->tot_len, 0);
-  arch_eth_write(page2kva(page), p->tot_len);
-
-  page_free_one(page);
-
-  return ERR_OK;
+  // The driver writes the pbuf chain straight into the device or, if it has
+  // to queue the frame, keeps its own reference
+  return (arch_eth_write(p) == 0) ? ERR_OK : ERR_MEM;
 }
 
 static err_t 
@@ -70,6 +235,26 @@ eth_netif_init(struct netif *netif)
   return ERR_OK;
 }
 
+#ifdef LWIPERF
+
+// Print the results of an iperf session, `make qemu-perf` greps for these
+static void
+net_perf_report(void *arg, enum lwiperf_report_type type,
+                const ip_addr_t *local_addr, u16_t local_port,
+                const ip_addr_t *remote_addr, u16_t remote_port,
+                u32_t bytes, u32_t ms, u32_t kbps)
+{
+  (void) arg;
+  (void) local_addr;
+  (void) local_port;
+
+  cprintf("lwiperf: %s %s:%u, %u bytes in %u ms, %u kbit/s\n",
+          (type == LWIPERF_TCP_DONE_SERVER) ? "done" : "aborted",
+          ipaddr_ntoa(remote_addr), remote_port, bytes, ms, kbps);
+}
+
+#endif  // LWIPERF
+
 static void
 net_init_done(void *arg)
 {
@@ -78,12 +263,19 @@ net_init_done(void *arg)
   ip4_addr_t addr;
   ip4_addr_t netmask;
   ip4_addr_t gw;
+  struct netif *loop_netif;
+
+  // Loopback pbufs are only ever copied within memory, skip the checksums
+  if ((loop_netif = netif_find("lo0")) != NULL)
+    NETIF_SET_CHECKSUM_CTRL(loop_netif, NETIF_CHECKSUM_DISABLE_ALL);
 
   IP4_ADDR(&addr, 10, 0, 2, 15);
   IP4_ADDR(&netmask, 255, 255, 0, 0);
   IP4_ADDR(&gw, 10, 0, 2, 2);
 
-  netif_add(&eth_netif, &addr, &netmask, &gw, NULL, eth_netif_init, tcpip_input);
+  // Frames are passed up from the driver poll functions already running in the
+  // lwIP thread, so no need to go through tcpip_input()
+  netif_add(&eth_netif, &addr, &netmask, &gw, NULL, eth_netif_init, ethernet_input);
 
   eth_netif.name[0] = 'e';
   eth_netif.name[1] = '0';
@@ -91,23 +283,102 @@ net_init_done(void *arg)
   netif_set_up(&eth_netif);
 
   dhcp_start(&eth_netif);
+
+#ifdef LWIPERF
+  if (lwiperf_start_tcp_server_default(net_perf_report, NULL) == NULL)
+    panic("cannot start lwiperf");
+  cprintf("lwiperf: listening on port %u\n", LWIPERF_TCP_PORT_DEFAULT);
+#endif
+
+#ifdef HTTPD
+  net_httpd_init();
+  cprintf("httpd: listening on port %u\n", HTTPD_SERVER_PORT);
+#endif
 }
 
 void
 net_init(void)
 {
+  int i;
+
+  for (i = 0; i < NUM_SOCKETS; i++)
+    poll_queue_init(&net_poll_queues[i]);
+  net_dns_init();
+
+  net_tune();
+
+  net_rx_pool = k_object_pool_create("net_rx_buffer", sizeof(struct NetRxBuffer),
+                                     0, NULL, NULL);
+  if (net_rx_pool == NULL)
+    panic("cannot allocate net_rx_pool");
+
+  unix_init();
+  net_stats_init();
+
   tcpip_init(net_init_done, NULL);
 }
 
+// Pass the netconn events to the socket layer, then notify the pollers.
+// Called from the TCP/IP thread.
+static void
+net_event(struct netconn *conn, enum netconn_evt evt, u16_t len)
+{
+  int events;
+
+  net_socket_callback(conn, evt, len);
+
+  // Accepted connections receive events before the socket is created
+  if ((conn == NULL) || (conn->socket < LWIP_SOCKET_OFFSET))
+    return;
+
+  switch (evt) {
+  case NETCONN_EVT_RCVPLUS:
+    events = POLLIN;
+    break;
+  case NETCONN_EVT_SENDPLUS:
+    events = POLLOUT;
+    break;
+  case NETCONN_EVT_ERROR:
+    events = POLLIN | POLLOUT | POLLERR;
+    break;
+  default:
+    return;
+  }
+
+  poll_queue_notify(&net_poll_queues[conn->socket - LWIP_SOCKET_OFFSET], events);
+}
+
+// Route the events of the socket's connection through net_event. Accepted
+// connections inherit the callback from the listening one.
+static void
+net_hook_events(int socket)
+{
+  struct lwip_sock *sock = lwip_socket_dbg_get_socket(socket);
+
+  if ((sock == NULL) || (sock->conn == NULL) ||
+      (sock->conn->callback == net_event))
+    return;
+
+  net_socket_callback  = sock->conn->callback;
+  sock->conn->callback = net_event;
+}
+
 int
 net_socket(int domain, int type, int protocol, struct File **fstore)
 {
   struct File *f;
   int r, socket;
 
+  // Local sockets bypass the TCP/IP stack entirely
+  if (domain == AF_UNIX)
+    return unix_socket(type, protocol, fstore);
+
   if ((socket = lwip_socket(domain, type, protocol)) < 0)
     return -errno;
 
+  net_hook_events(socket);
+  net_snd_bufs[socket - LWIP_SOCKET_OFFSET] = 0;
+
   if ((r = file_alloc(&f)) < 0) {
     lwip_close(socket);
     return r;
@@ -115,6 +386,7 @@ net_socket(int domain, int type, int protocol, struct File **fstore)
 
   f->type   = FD_SOCKET;
   f->socket = socket;
+  f->flags  = O_RDWR;
   f->ref_count++;
 
   if (fstore != NULL)
@@ -126,6 +398,8 @@ net_socket(int domain, int type, int protocol, struct File **fstore)
 int
 net_bind(struct File *file, const struct sockaddr *address, socklen_t address_len)
 {
+  if (file->type == FD_UNIX)
+    return unix_bind(file, address, address_len);
   if (file->type != FD_SOCKET)
     return -EBADF;
 
@@ -138,6 +412,8 @@ net_bind(struct File *file, const struct sockaddr *address, socklen_t address_le
 int
 net_listen(struct File *file, int backlog)
 {
+  if (file->type == FD_UNIX)
+    return unix_listen(file, backlog);
   if (file->type != FD_SOCKET)
     return -EBADF;
 
@@ -150,6 +426,8 @@ net_listen(struct File *file, int backlog)
 int
 net_connect(struct File *file, const struct sockaddr *address, socklen_t address_len)
 {
+  if (file->type == FD_UNIX)
+    return unix_connect(file, address, address_len);
   if (file->type != FD_SOCKET)
     return -EBADF;
 
@@ -166,12 +444,17 @@ net_accept(struct File *file, struct sockaddr *address, socklen_t * address_len,
   int r, conn;
   struct File *f;
 
+  if (file->type == FD_UNIX)
+    return unix_accept(file, address, address_len, fstore);
   if (file->type != FD_SOCKET)
     return -EBADF;
 
   if ((conn = lwip_accept(file->socket, address, address_len)) < 0)
     return -errno;
-  
+
+  net_hook_events(conn);
+  net_snd_bufs[conn - LWIP_SOCKET_OFFSET] = 0;
+
   if ((r = file_alloc(&f)) != 0) {
     lwip_close(conn);
     return r;
@@ -181,6 +464,10 @@ net_accept(struct File *file, struct sockaddr *address, socklen_t * address_len,
   f->socket = conn;
   f->flags  = O_RDWR;
   f->ref_count++;
+
+  // Inherit the send buffer size from the listening socket
+  if ((r = net_snd_bufs[file->socket - LWIP_SOCKET_OFFSET]) != 0)
+    net_set_snd_buf(f, r);
   
   if (fstore != NULL)
     *fstore = f;
@@ -200,110 +487,255 @@ net_close(struct File *file)
   return 0;
 }
 
+/*
+ * Socket data is moved through a kernel bounce buffer. lwIP may block inside
+ * the call, and meanwhile a user buffer can be unmapped by a sibling thread,
+ * swapped out, or made copy-on-write by fork(), so the stack never touches
+ * user memory itself: it waits and copies on the bounce buffer, and the data
+ * goes to or from the user pages with vm_space_copy_out() and
+ * vm_space_copy_in(), which look the pages up afresh. Kernel buffers (e.g.
+ * when splicing) are passed to lwIP directly.
+ */
+
+// The largest bounce buffer, which also limits the size of a datagram
+#define NET_BOUNCE_MAX  (4 * PAGE_SIZE)
+
+// Whether the socket carries a stream of bytes rather than datagrams
+static int
+net_is_stream(struct File *file)
+{
+  socklen_t len = sizeof(int);
+  int type;
+
+  if (lwip_getsockopt(file->socket, SOL_SOCKET, SO_TYPE, &type, &len) != 0)
+    return 0;
+
+  return type == SOCK_STREAM;
+}
+
 ssize_t
 net_recvfrom(struct File *file, uintptr_t va, size_t nbytes, int flags,
              struct sockaddr *address, socklen_t *address_len)
+{
+  ssize_t r;
+  size_t n;
+  char *p;
+
+  if (file->type == FD_UNIX)
+    return unix_recvfrom(file, va, nbytes, flags, address, address_len);
+  if (file->type != FD_SOCKET)
+    return -EBADF;
+
+  if (va > VIRT_KERNEL_BASE) {
+    r = lwip_recvfrom(file->socket, (void *) va, nbytes, flags, address,
+                      address_len);
+    return (r < 0) ? -errno : r;
+  }
+
+  // A single call, so that a short read does not block and a datagram is
+  // received whole
+  n = MIN(nbytes, NET_BOUNCE_MAX);
+  if ((p = k_malloc(n)) == NULL)
+    return -ENOMEM;
+
+  r = lwip_recvfrom(file->socket, p, n, flags, address, address_len);
+
+  if (r < 0) {
+    r = -errno;
+  } else if (r > 0) {
+    int err;
+
+    // MSG_TRUNC reports the full length of a datagram
+    if ((err = vm_space_copy_out(p, va, MIN((size_t) r, n))) < 0)
+      r = err;
+  }
+
+  k_free(p);
+
+  return r;
+}
+
+ssize_t
+net_read(struct File *file, uintptr_t buf, size_t nbytes)
+{
+  return net_recvfrom(file, buf, nbytes, 0, NULL, NULL);
+}
+
+ssize_t
+net_sendto(struct File *file, uintptr_t va, size_t nbytes, int flags,
+           const struct sockaddr *dest_addr, socklen_t dest_len)
 {
   ssize_t total, r;
+  size_t n;
   char *p;
 
+  if (file->type == FD_UNIX)
+    return unix_sendto(file, va, nbytes, flags, dest_addr, dest_len);
   if (file->type != FD_SOCKET)
     return -EBADF;
 
-  // TODO: looks like a triple copy!
-  if ((p = k_malloc(PAGE_SIZE)) == NULL)
+  if (va > VIRT_KERNEL_BASE) {
+    r = lwip_sendto(file->socket, (void *) va, nbytes, flags,
+                    (struct sockaddr *) dest_addr, dest_len);
+    return (r < 0) ? -errno : r;
+  }
+
+  // A datagram has to go out in one piece
+  if ((nbytes > NET_BOUNCE_MAX) && !net_is_stream(file))
+    return -EMSGSIZE;
+
+  if ((p = k_malloc(MIN(nbytes, NET_BOUNCE_MAX))) == NULL)
     return -ENOMEM;
 
   total = 0;
-  while (nbytes) {
-    ssize_t nread = MIN(nbytes, PAGE_SIZE);
 
-    r = lwip_recvfrom(file->socket, p, nread, flags, address, address_len);
+  do {
+    n = MIN(nbytes - total, NET_BOUNCE_MAX);
 
-    if (r == 0)
+    if ((r = vm_space_copy_in(p, va + total, n)) < 0)
       break;
-      
-    total += r;
 
+    r = lwip_sendto(file->socket, p, n, flags, (struct sockaddr *) dest_addr,
+                    dest_len);
     if (r < 0) {
-      total = -errno;
-      break;
-    }
-
-    if ((r = vm_space_copy_out(p, va, nread)) < 0) {
-      total = -errno;
+      r = -errno;
       break;
     }
-    
-    if (r < nread)
-      break;
 
-    va     += nread;
-    nbytes -= nread;
-  }
+    total += r;
+  } while (((size_t) total < nbytes) && ((size_t) r == n));
 
   k_free(p);
 
-  return total;
+  return ((r < 0) && (total == 0)) ? r : total;
 }
 
 ssize_t
-net_read(struct File *file, uintptr_t buf, size_t nbytes)
+net_write(struct File *file, uintptr_t va, size_t nbytes)
 {
-  return net_recvfrom(file, buf, nbytes, 0, NULL, NULL);
+  return net_sendto(file, va, nbytes, 0, NULL, 0);
 }
 
+/**
+ * Send data gathered from several buffers.
+ *
+ * Consecutive buffers are packed into one bounce buffer before being handed
+ * to the stack, so that small pieces (e.g. a header followed by a body) do not
+ * end up in separate segments.
+ *
+ * @param file   The socket file
+ * @param iov    The buffers (already checked by the caller)
+ * @param iovcnt The number of buffers
+ *
+ * @return The number of bytes sent, or a negative error code.
+ */
 ssize_t
-net_sendto(struct File *file, uintptr_t va, size_t nbytes, int flags,
-           const struct sockaddr *dest_addr, socklen_t dest_len)
+net_writev(struct File *file, const struct iovec *iov, int iovcnt)
 {
   ssize_t total, r;
+  size_t pos, used;
   char *p;
+  int i;
 
   if (file->type != FD_SOCKET)
     return -EBADF;
 
-  // TODO: looks like a triple copy!
-  if ((p = k_malloc(PAGE_SIZE)) == NULL)
+  if ((p = k_malloc(NET_BOUNCE_MAX)) == NULL)
     return -ENOMEM;
 
   total = 0;
-  while (nbytes) {
-    ssize_t nwrite = MIN(nbytes, PAGE_SIZE);
-    
-    if ((r = vm_space_copy_in(p, va, nwrite)) < 0) {
-      total = -errno;
-      break;
+  used  = 0;
+  i     = 0;
+  pos   = 0;
+
+  while ((i < iovcnt) || (used > 0)) {
+    // Fill the bounce buffer with as much data as possible
+    while ((i < iovcnt) && (used < NET_BOUNCE_MAX)) {
+      size_t n = MIN(iov[i].iov_len - pos, NET_BOUNCE_MAX - used);
+
+      if ((r = vm_space_copy_in(p + used, (uintptr_t) iov[i].iov_base + pos,
+                                n)) < 0)
+        goto out;
+
+      used += n;
+      pos  += n;
+
+      if (pos == iov[i].iov_len) {
+        i++;
+        pos = 0;
+      }
     }
 
-    r = lwip_sendto(file->socket, p, nwrite, flags, (struct sockaddr *) dest_addr, dest_len);
-
-    if (r == 0)
+    if (used == 0)
       break;
 
-    if (r < 0) {
-      total = -errno;
-      break;
+    if ((r = lwip_send(file->socket, p, used, 0)) < 0) {
+      r = -errno;
+      goto out;
     }
 
     total += r;
 
-    if (r < nwrite)
+    if ((size_t) r < used)
       break;
 
-    va     += nwrite;
-    nbytes -= nwrite;
+    used = 0;
   }
 
+  r = 0;
+
+out:
   k_free(p);
 
-  return total;
+  return ((r < 0) && (total == 0)) ? r : total;
 }
 
-ssize_t
-net_write(struct File *file, uintptr_t va, size_t nbytes)
+// Get the PCB of a TCP socket, the caller must be holding the core lock
+static struct tcp_pcb *
+net_tcp_pcb(struct File *file)
 {
-  return net_sendto(file, va, nbytes, 0, NULL, 0);
+  struct lwip_sock *sock;
+
+  if ((sock = lwip_socket_dbg_get_socket(file->socket)) == NULL)
+    return NULL;
+  if ((sock->conn == NULL) ||
+      (NETCONNTYPE_GROUP(netconn_type(sock->conn)) != NETCONN_TCP))
+    return NULL;
+
+  return sock->conn->pcb.tcp;
+}
+
+// lwIP itself has no per-socket send buffer size. But pcb->snd_buf, the free
+// space in the send buffer, is refilled by exactly the amount of data that
+// gets acknowledged, so setting it while nothing is queued limits the buffer
+// for the rest of the connection.
+static int
+net_set_snd_buf(struct File *file, int size)
+{
+  struct tcp_pcb *pcb;
+  int r;
+
+  size = MIN(MAX(size, 2 * TCP_MSS), (int) net_tcp_snd_buf);
+
+  LOCK_TCPIP_CORE();
+
+  if ((pcb = net_tcp_pcb(file)) == NULL) {
+    r = -ENOPROTOOPT;
+  } else if (pcb->state == LISTEN) {
+    // Applied to the connections as they are accepted
+    net_snd_bufs[file->socket - LWIP_SOCKET_OFFSET] = size;
+    r = 0;
+  } else if ((pcb->unsent != NULL) || (pcb->unacked != NULL)) {
+    r = -EBUSY;
+  } else {
+    pcb->snd_buf = size;
+    net_snd_bufs[file->socket - LWIP_SOCKET_OFFSET] = size;
+    r = 0;
+  }
+
+  UNLOCK_TCPIP_CORE();
+
+  return r;
 }
 
 int
@@ -312,9 +744,18 @@ net_setsockopt(struct File *file, int level, int option_name, const void *option
 {
   ssize_t r;
 
+  // Local sockets have no options to tune, accept the generic ones silently
+  if (file->type == FD_UNIX)
+    return (level == SOL_SOCKET) ? 0 : -ENOPROTOOPT;
   if (file->type != FD_SOCKET)
     return -EBADF;
 
+  if ((level == SOL_SOCKET) && (option_name == SO_SNDBUF)) {
+    if (option_len < sizeof(int))
+      return -EINVAL;
+    return net_set_snd_buf(file, *(const int *) option_value);
+  }
+
   if ((r = lwip_setsockopt(file->socket, level, option_name, option_value,
                            option_len)) < 0)
     return -errno;
@@ -322,24 +763,278 @@ net_setsockopt(struct File *file, int level, int option_name, const void *option
   return r;
 }
 
+/**
+ * Switch a socket between blocking and non-blocking mode, following the
+ * O_NONBLOCK file status flag. lwIP keeps the mode in the connection itself,
+ * so that accept(), connect() and the transfers fail with EWOULDBLOCK instead
+ * of waiting.
+ *
+ * @param file     The socket file
+ * @param nonblock Whether the socket must not block
+ */
+void
+net_set_nonblocking(struct File *file, int nonblock)
+{
+  struct lwip_sock *sock;
+
+  // Local sockets check the file flags themselves
+  if (file->type != FD_SOCKET)
+    return;
+
+  if (((sock = lwip_socket_dbg_get_socket(file->socket)) != NULL) &&
+      (sock->conn != NULL))
+    netconn_set_nonblocking(sock->conn, nonblock);
+}
+
+/**
+ * Get a socket option.
+ *
+ * @param file         The socket file
+ * @param level        The protocol level of the option
+ * @param option_name  The option
+ * @param option_value Buffer to store the value into
+ * @param option_len   Holds the buffer size on entry, and the size of the
+ *                     value on return
+ *
+ * @return 0 on success, or a negative error code.
+ */
 int
-net_select(struct File *file, struct timeval *timeout)
+net_getsockopt(struct File *file, int level, int option_name,
+               void *option_value, socklen_t *option_len)
 {
-  int r;
-  fd_set dset;
+  struct tcp_pcb *pcb;
+  int i, value = 0;
 
-  dset.__fds_bits[0] = (1 << file->socket);
+  if (file->type == FD_UNIX)
+    return unix_getsockopt(file, level, option_name, option_value, option_len);
+  if (file->type != FD_SOCKET)
+    return -EBADF;
 
-  if ((r = lwip_select(file->socket + 1, &dset, NULL, NULL, timeout)) < 0)
+  // For TCP, report the sizes actually in effect rather than the values lwIP
+  // keeps for the other protocols
+  if ((level == SOL_SOCKET) &&
+      ((option_name == SO_SNDBUF) || (option_name == SO_RCVBUF))) {
+    if (*option_len < sizeof(int))
+      return -EINVAL;
+
+    i = file->socket - LWIP_SOCKET_OFFSET;
+
+    LOCK_TCPIP_CORE();
+
+    if ((pcb = net_tcp_pcb(file)) != NULL) {
+      if (option_name == SO_RCVBUF)
+        value = net_tcp_wnd;
+      else
+        value = net_snd_bufs[i] ? net_snd_bufs[i] : (int) net_tcp_snd_buf;
+    }
+
+    UNLOCK_TCPIP_CORE();
+
+    if (pcb != NULL) {
+      *(int *) option_value = value;
+      *option_len = sizeof(int);
+      return 0;
+    }
+  }
+
+  if (lwip_getsockopt(file->socket, level, option_name, option_value,
+                      option_len) < 0)
     return -errno;
-  
-  return r;
+
+  return 0;
 }
 
+/**
+ * Check the socket state.
+ *
+ * @param file  The socket file
+ * @param entry The entry to register on the socket, or NULL
+ *
+ * @return The pending events.
+ */
 int
-net_gethostbyname(const char *name, ip_addr_t *addr)
+net_poll(struct File *file, struct PollEntry *entry)
+{
+  struct lwip_sock *sock;
+  int r = 0;
+
+  if (file->type != FD_SOCKET)
+    return POLLNVAL;
+
+  if ((sock = lwip_socket_dbg_get_socket(file->socket)) == NULL)
+    return POLLNVAL;
+
+  poll_queue_add(&net_poll_queues[file->socket - LWIP_SOCKET_OFFSET], entry);
+
+  // The same checks as in lwip_select(), the entry is already registered so
+  // that no change can be missed
+  if ((sock->lastdata.pbuf != NULL) || (sock->rcvevent > 0))
+    r |= POLLIN;
+  if (sock->sendevent != 0)
+    r |= POLLOUT;
+  if (sock->errevent != 0)
+    r |= POLLERR;
+
+  return r;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Name resolution
+ * ----------------------------------------------------------------------------
+ *
+ * Answers, including failures, are remembered for a while, so that programs
+ * resolving the same few names over and over do not send a query each time.
+ * lwIP does not tell the TTL of an answer, but it keeps the recent ones in its
+ * own table for as long as the TTL allows, so the entries here expire early
+ * and a later lookup asks lwIP again. Concurrent lookups of a name that is
+ * being resolved wait for the same query instead of sending their own.
+ */
+
+#define NET_DNS_CACHE_SIZE    32
+#define NET_DNS_NAME_MAX      64    ///< Longer names are not cached
+#define NET_DNS_FOUND_TTL     30    ///< How long answers are kept, in seconds
+#define NET_DNS_FAILED_TTL    5     ///< How long failures are kept, in seconds
+
+enum {
+  NET_DNS_FREE,
+  NET_DNS_PENDING,                  ///< The query is in progress
+  NET_DNS_FOUND,
+  NET_DNS_FAILED,
+};
+
+struct NetDnsEntry {
+  char               name[NET_DNS_NAME_MAX];
+  int                state;
+  int                error;         ///< The error code, if failed
+  ip_addr_t          addr;          ///< The address, if found
+  unsigned long long expires;       ///< When the entry becomes stale, in ticks
+  unsigned long long used;          ///< When last used, for replacement
+};
+
+static struct {
+  struct NetDnsEntry entries[NET_DNS_CACHE_SIZE];
+  struct KSpinLock   lock;
+  /** Callers waiting for a pending query */
+  struct KWaitQueue  queue;
+} net_dns = {
+  .lock = K_SPINLOCK_INITIALIZER("net_dns"),
+};
+
+static void
+net_dns_init(void)
+{
+  k_waitqueue_init(&net_dns.queue);
+}
+
+static int
+net_dns_query(const char *name, ip_addr_t *addr)
 {
   if (netconn_gethostbyname(name, addr) < 0)
     return -errno;
   return 0;
 }
+
+static struct NetDnsEntry *
+net_dns_find(const char *name)
+{
+  struct NetDnsEntry *e;
+
+  for (e = net_dns.entries; e < &net_dns.entries[NET_DNS_CACHE_SIZE]; e++)
+    if ((e->state != NET_DNS_FREE) && (lwip_stricmp(e->name, name) == 0))
+      return e;
+
+  return NULL;
+}
+
+// Take a free entry or the least recently used one that is not pending
+static struct NetDnsEntry *
+net_dns_alloc(void)
+{
+  struct NetDnsEntry *e, *victim = NULL;
+
+  for (e = net_dns.entries; e < &net_dns.entries[NET_DNS_CACHE_SIZE]; e++) {
+    if (e->state == NET_DNS_FREE)
+      return e;
+    if ((e->state != NET_DNS_PENDING) &&
+        ((victim == NULL) || (e->used < victim->used)))
+      victim = e;
+  }
+
+  return victim;
+}
+
+int
+net_gethostbyname(const char *name, ip_addr_t *addr)
+{
+  struct NetDnsEntry *e;
+  unsigned long long now;
+  int r;
+
+  if (strlen(name) >= NET_DNS_NAME_MAX)
+    return net_dns_query(name, addr);
+
+  k_spinlock_acquire(&net_dns.lock);
+
+  for (;;) {
+    now = k_tick_get();
+
+    if ((e = net_dns_find(name)) == NULL)
+      break;
+
+    if (e->state == NET_DNS_PENDING) {
+      if ((r = k_waitqueue_sleep(&net_dns.queue, &net_dns.lock)) < 0) {
+        k_spinlock_release(&net_dns.lock);
+        return r;
+      }
+      continue;
+    }
+
+    if (now >= e->expires)
+      break;
+
+    e->used = now;
+    r = e->error;
+    if (e->state == NET_DNS_FOUND)
+      *addr = e->addr;
+
+    k_spinlock_release(&net_dns.lock);
+
+    return r;
+  }
+
+  // All entries are pending
+  if ((e == NULL) && ((e = net_dns_alloc()) == NULL)) {
+    k_spinlock_release(&net_dns.lock);
+    return net_dns_query(name, addr);
+  }
+
+  strcpy(e->name, name);
+  e->state = NET_DNS_PENDING;
+  e->used  = now;
+
+  k_spinlock_release(&net_dns.lock);
+
+  r = net_dns_query(name, addr);
+
+  k_spinlock_acquire(&net_dns.lock);
+
+  now = k_tick_get();
+
+  if (r == 0) {
+    e->state   = NET_DNS_FOUND;
+    e->error   = 0;
+    e->addr    = *addr;
+    e->expires = now + seconds2ticks(NET_DNS_FOUND_TTL);
+  } else {
+    e->state   = NET_DNS_FAILED;
+    e->error   = r;
+    e->expires = now + seconds2ticks(NET_DNS_FAILED_TTL);
+  }
+
+  k_waitqueue_wakeup_all(&net_dns.queue);
+
+  k_spinlock_release(&net_dns.lock);
+
+  return r;
+}
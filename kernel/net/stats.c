@@ -0,0 +1,332 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <kernel/dev.h>
+#include <kernel/net.h>
+#include <kernel/object_pool.h>
+#include <kernel/poll.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
+
+#include <lwip/api.h>
+#include <lwip/netif.h>
+#include <lwip/stats.h>
+#include <lwip/tcp.h>
+#include <lwip/tcpip.h>
+#include <lwip/udp.h>
+#include <lwip/priv/sockets_priv.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Network statistics device
+ * ----------------------------------------------------------------------------
+ *
+ * Reading /dev/netstat returns a text snapshot of the interface, protocol,
+ * memory pool and socket counters. The snapshot is generated anew on each
+ * read, so a reader that needs consistent numbers should fetch the whole file
+ * at once (the netstat utility does this).
+ */
+
+#define NET_STATS_MAJOR   0x03
+
+// Large enough for all of the sections, the output is truncated otherwise
+#define NET_STATS_SIZE    8192
+
+// Names of the lwIP memory pools (the ones kept by lwIP itself are only
+// compiled with LWIP_DEBUG)
+static const char *const net_stats_pools[] = {
+#define LWIP_MEMPOOL(name, num, size, desc) desc,
+#include <lwip/priv/memp_std.h>
+};
+
+int arch_eth_stats(struct NetIfStats *);
+
+struct NetStatsBuf {
+  char   *data;
+  size_t  size;
+  size_t  len;
+};
+
+static void
+net_stats_printf(struct NetStatsBuf *buf, const char *format, ...)
+{
+  va_list ap;
+  int n;
+
+  if (buf->len >= buf->size)
+    return;
+
+  va_start(ap, format);
+  n = vsnprintf(buf->data + buf->len, buf->size - buf->len, format, ap);
+  va_end(ap);
+
+  if (n > 0)
+    buf->len = MIN(buf->len + n, buf->size);
+}
+
+static void
+net_stats_interfaces(struct NetStatsBuf *buf)
+{
+  struct NetIfStats drv;
+  struct netif *netif;
+  char addr[IP4ADDR_STRLEN_MAX];
+
+  net_stats_printf(buf, "Interfaces:\n");
+
+  NETIF_FOREACH(netif) {
+    const struct stats_mib2_netif_ctrs *c = &netif->mib2_counters;
+
+    net_stats_printf(buf, "%c%c%u mtu %u %s %s\n",
+                     netif->name[0], netif->name[1], netif->num, netif->mtu,
+                     netif_is_up(netif) ? "up" : "down",
+                     ip4addr_ntoa_r(netif_ip4_addr(netif), addr, sizeof(addr)));
+    net_stats_printf(buf, "  rx: octets %lu ucast %lu nucast %lu discards %lu "
+                     "errors %lu unknown %lu\n",
+                     (unsigned long) c->ifinoctets,
+                     (unsigned long) c->ifinucastpkts,
+                     (unsigned long) c->ifinnucastpkts,
+                     (unsigned long) c->ifindiscards,
+                     (unsigned long) c->ifinerrors,
+                     (unsigned long) c->ifinunknownprotos);
+    net_stats_printf(buf, "  tx: octets %lu ucast %lu nucast %lu discards %lu "
+                     "errors %lu\n",
+                     (unsigned long) c->ifoutoctets,
+                     (unsigned long) c->ifoutucastpkts,
+                     (unsigned long) c->ifoutnucastpkts,
+                     (unsigned long) c->ifoutdiscards,
+                     (unsigned long) c->ifouterrors);
+
+    // The only interface with a driver of its own
+    if ((netif->name[0] == 'e') && (arch_eth_stats(&drv) == 0)) {
+      net_stats_printf(buf, "  driver rx: frames %lu errors %lu dropped %lu "
+                       "overruns %lu\n",
+                       drv.rx_frames, drv.rx_errors, drv.rx_dropped,
+                       drv.rx_overruns);
+      net_stats_printf(buf, "  driver tx: frames %lu errors %lu stalls %lu "
+                       "dropped %lu\n",
+                       drv.tx_frames, drv.tx_errors, drv.tx_stalls,
+                       drv.tx_dropped);
+    }
+  }
+}
+
+static void
+net_stats_proto(struct NetStatsBuf *buf, const char *name,
+                const struct stats_proto *p)
+{
+  net_stats_printf(buf, "%-7s %9lu %9lu %6lu %6lu %6lu %6lu %6lu %6lu %6lu "
+                   "%6lu %6lu\n", name,
+                   (unsigned long) p->xmit, (unsigned long) p->recv,
+                   (unsigned long) p->fw, (unsigned long) p->drop,
+                   (unsigned long) p->chkerr, (unsigned long) p->lenerr,
+                   (unsigned long) p->memerr, (unsigned long) p->rterr,
+                   (unsigned long) p->proterr, (unsigned long) p->opterr,
+                   (unsigned long) p->err);
+}
+
+static void
+net_stats_protocols(struct NetStatsBuf *buf)
+{
+  const struct stats_mib2 *m = &lwip_stats.mib2;
+
+  net_stats_printf(buf, "Protocols:\n");
+  net_stats_printf(buf, "%-7s %9s %9s %6s %6s %6s %6s %6s %6s %6s %6s %6s\n",
+                   "", "xmit", "recv", "fw", "drop", "chkerr", "lenerr",
+                   "memerr", "rterr", "proterr", "opterr", "err");
+
+  net_stats_proto(buf, "link",   &lwip_stats.link);
+  net_stats_proto(buf, "etharp", &lwip_stats.etharp);
+  net_stats_proto(buf, "ipfrag", &lwip_stats.ip_frag);
+  net_stats_proto(buf, "ip",     &lwip_stats.ip);
+  net_stats_proto(buf, "icmp",   &lwip_stats.icmp);
+  net_stats_proto(buf, "udp",    &lwip_stats.udp);
+  net_stats_proto(buf, "tcp",    &lwip_stats.tcp);
+
+  net_stats_printf(buf, "tcp: active %lu passive %lu failed %lu resets %lu "
+                   "outrsts %lu\n",
+                   (unsigned long) m->tcpactiveopens,
+                   (unsigned long) m->tcppassiveopens,
+                   (unsigned long) m->tcpattemptfails,
+                   (unsigned long) m->tcpestabresets,
+                   (unsigned long) m->tcpoutrsts);
+  net_stats_printf(buf, "tcp: insegs %lu outsegs %lu retrans %lu inerrs %lu\n",
+                   (unsigned long) m->tcpinsegs,
+                   (unsigned long) m->tcpoutsegs,
+                   (unsigned long) m->tcpretranssegs,
+                   (unsigned long) m->tcpinerrs);
+}
+
+static void
+net_stats_pools_show(struct NetStatsBuf *buf)
+{
+  unsigned i;
+
+  net_stats_printf(buf, "Pools:\n");
+  net_stats_printf(buf, "%-24s %8s %8s %8s\n", "", "used", "max", "err");
+
+  for (i = 0; i < ARRAY_SIZE(net_stats_pools); i++) {
+    const struct stats_mem *s = lwip_stats.memp[i];
+
+    if (s == NULL)
+      continue;
+
+    net_stats_printf(buf, "%-24s %8lu %8lu %8lu\n", net_stats_pools[i],
+                     (unsigned long) s->used, (unsigned long) s->max,
+                     (unsigned long) s->err);
+  }
+}
+
+static void
+net_stats_sockets(struct NetStatsBuf *buf)
+{
+  char local[IP4ADDR_STRLEN_MAX], remote[IP4ADDR_STRLEN_MAX];
+  int i;
+
+  net_stats_printf(buf, "Sockets:\n");
+  net_stats_printf(buf, "%-4s %-5s %-12s %-21s %-21s %6s %6s %6s %4s\n",
+                   "sock", "proto", "state", "local", "remote", "recvq",
+                   "sndbuf", "rcvwnd", "rtx");
+
+  for (i = 0; i < NUM_SOCKETS; i++) {
+    struct lwip_sock *sock;
+    struct netconn *conn;
+
+    sock = lwip_socket_dbg_get_socket(i + LWIP_SOCKET_OFFSET);
+    if ((sock == NULL) || ((conn = sock->conn) == NULL))
+      continue;
+
+    switch (NETCONNTYPE_GROUP(netconn_type(conn))) {
+    case NETCONN_TCP: {
+      struct tcp_pcb *pcb = conn->pcb.tcp;
+
+      if (pcb == NULL)
+        break;
+
+      ip4addr_ntoa_r(ip_2_ip4(&pcb->local_ip), local, sizeof(local));
+      ip4addr_ntoa_r(ip_2_ip4(&pcb->remote_ip), remote, sizeof(remote));
+
+      // Listening PCBs lack the fields of the connected ones
+      if (pcb->state == LISTEN) {
+        net_stats_printf(buf, "%-4d %-5s %-12s %15s:%-5u %15s:%-5u\n", i,
+                         "tcp", tcp_debug_state_str(pcb->state),
+                         local, pcb->local_port, "*", 0);
+        break;
+      }
+
+      net_stats_printf(buf, "%-4d %-5s %-12s %15s:%-5u %15s:%-5u %6d %6u "
+                       "%6u %4u\n", i, "tcp", tcp_debug_state_str(pcb->state),
+                       local, pcb->local_port, remote, pcb->remote_port,
+                       conn->recv_avail, (unsigned) pcb->snd_buf,
+                       (unsigned) pcb->rcv_wnd, (unsigned) pcb->nrtx);
+      break;
+    }
+    case NETCONN_UDP: {
+      struct udp_pcb *pcb = conn->pcb.udp;
+
+      if (pcb == NULL)
+        break;
+
+      ip4addr_ntoa_r(ip_2_ip4(&pcb->local_ip), local, sizeof(local));
+      ip4addr_ntoa_r(ip_2_ip4(&pcb->remote_ip), remote, sizeof(remote));
+
+      net_stats_printf(buf, "%-4d %-5s %-12s %15s:%-5u %15s:%-5u %6d\n", i,
+                       "udp", "", local, pcb->local_port, remote,
+                       pcb->remote_port, conn->recv_avail);
+      break;
+    }
+    default:
+      net_stats_printf(buf, "%-4d %-5s\n", i, "raw");
+      break;
+    }
+  }
+}
+
+static ssize_t
+net_stats_read_at(dev_t dev, uintptr_t va, size_t n, off_t off)
+{
+  struct NetStatsBuf buf;
+  ssize_t r;
+
+  (void) dev;
+
+  if ((buf.data = (char *) k_malloc(NET_STATS_SIZE)) == NULL)
+    return -ENOMEM;
+  buf.size = NET_STATS_SIZE;
+  buf.len  = 0;
+
+  // The socket list and PCBs may only be inspected with the core locked
+  LOCK_TCPIP_CORE();
+  net_stats_interfaces(&buf);
+  net_stats_protocols(&buf);
+  net_stats_pools_show(&buf);
+  net_stats_sockets(&buf);
+  UNLOCK_TCPIP_CORE();
+
+  if ((off < 0) || ((size_t) off >= buf.len)) {
+    r = 0;
+  } else {
+    n = MIN(n, buf.len - (size_t) off);
+    r = vm_space_copy_out(buf.data + off, va, n);
+    if (r == 0)
+      r = n;
+  }
+
+  k_free(buf.data);
+
+  return r;
+}
+
+static ssize_t
+net_stats_read(dev_t dev, uintptr_t va, size_t n)
+{
+  return net_stats_read_at(dev, va, n, 0);
+}
+
+static ssize_t
+net_stats_write(dev_t dev, uintptr_t va, size_t n)
+{
+  (void) dev;
+  (void) va;
+  (void) n;
+
+  return -EBADF;
+}
+
+static int
+net_stats_ioctl(dev_t dev, int request, int arg)
+{
+  (void) dev;
+  (void) request;
+  (void) arg;
+
+  return -ENOTTY;
+}
+
+static int
+net_stats_poll(dev_t dev, struct PollEntry *entry)
+{
+  (void) dev;
+  (void) entry;
+
+  return POLLIN;
+}
+
+static struct CharDev net_stats_device = {
+  .read    = net_stats_read,
+  .read_at = net_stats_read_at,
+  .write   = net_stats_write,
+  .ioctl   = net_stats_ioctl,
+  .poll    = net_stats_poll,
+};
+
+/**
+ * Register the statistics device (/dev/netstat).
+ */
+void
+net_stats_init(void)
+{
+  dev_register_char(NET_STATS_MAJOR, &net_stats_device);
+}
@@ -0,0 +1,1166 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <kernel/console.h>
+#include <kernel/fs/file.h>
+#include <kernel/fs/fs.h>
+#include <kernel/net/unix.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Local sockets
+ * ----------------------------------------------------------------------------
+ *
+ * AF_UNIX sockets never touch the network stack. A stream connection is a pair
+ * of ring buffers that the endpoints copy into and out of, much like a pipe
+ * in each direction, and a datagram is a kernel buffer queued on the receiving
+ * socket. Sockets are bound to socket files created in the filesystem, and
+ * found again by the inode the path resolves to.
+ *
+ * Locking: unix_lock protects the table of bound sockets, the socket states,
+ * the accept queues and the reference counts. The data of a connection is
+ * protected by the connection lock, the datagram queue of a socket by the
+ * socket lock. Neither of the two is held while acquiring unix_lock.
+ */
+
+#define UNIX_BUFFER_SIZE    (PAGE_SIZE << UNIX_BUFFER_ORDER)
+
+/** A queued datagram. */
+struct UnixMessage {
+  struct KListLink   link;
+  size_t             size;
+  struct sockaddr_un address;       ///< The address of the sender
+  socklen_t          address_len;
+  char               data[];
+};
+
+static struct KSpinLock unix_lock = K_SPINLOCK_INITIALIZER("unix");
+static struct KListLink unix_bound;
+
+static struct KObjectPool *unix_socket_cache;
+static struct KObjectPool *unix_connection_cache;
+
+// The length of an unnamed address
+#define UNIX_UNNAMED_LEN    offsetof(struct sockaddr_un, sun_path)
+
+void
+unix_init(void)
+{
+  unix_socket_cache = k_object_pool_create("unix_socket",
+                                           sizeof(struct UnixSocket),
+                                           0, NULL, NULL);
+  if (unix_socket_cache == NULL)
+    panic("cannot allocate unix_socket_cache");
+
+  unix_connection_cache = k_object_pool_create("unix_connection",
+                                               sizeof(struct UnixConnection),
+                                               0, NULL, NULL);
+  if (unix_connection_cache == NULL)
+    panic("cannot allocate unix_connection_cache");
+
+  k_list_init(&unix_bound);
+}
+
+static struct UnixSocket *
+unix_socket_alloc(int type)
+{
+  struct UnixSocket *s;
+
+  if ((s = (struct UnixSocket *) k_object_pool_get(unix_socket_cache)) == NULL)
+    return NULL;
+
+  s->type      = type;
+  s->state     = UNIX_UNCONNECTED;
+  s->ref_count = 1;
+
+  s->inode                     = NULL;
+  s->address.sun_len           = UNIX_UNNAMED_LEN;
+  s->address.sun_family        = AF_UNIX;
+  s->address_len               = UNIX_UNNAMED_LEN;
+  k_list_null(&s->bind_link);
+
+  k_list_init(&s->accept_queue);
+  k_waitqueue_init(&s->accept_wait);
+  s->backlog = 0;
+  s->pending = 0;
+  k_list_null(&s->accept_link);
+
+  s->conn                       = NULL;
+  s->side                       = 0;
+  s->peer_address.sun_len       = UNIX_UNNAMED_LEN;
+  s->peer_address.sun_family    = AF_UNIX;
+  s->peer_address_len           = UNIX_UNNAMED_LEN;
+
+  k_spinlock_init(&s->lock, "unix_socket");
+  k_list_init(&s->messages);
+  s->queued = 0;
+  s->closed = 0;
+  s->peer   = NULL;
+  k_waitqueue_init(&s->recv_wait);
+  k_waitqueue_init(&s->send_wait);
+
+  poll_queue_init(&s->poll_queue);
+
+  return s;
+}
+
+// Drop a reference to the socket. The last reference frees it.
+static void
+unix_socket_put(struct UnixSocket *s)
+{
+  struct KListLink *l;
+  int ref_count;
+
+  k_spinlock_acquire(&unix_lock);
+  ref_count = --s->ref_count;
+  k_spinlock_release(&unix_lock);
+
+  if (ref_count > 0)
+    return;
+
+  while ((l = s->messages.next) != &s->messages) {
+    k_list_remove(l);
+    k_free(KLIST_CONTAINER(l, struct UnixMessage, link));
+  }
+
+  if (s->peer != NULL)
+    fs_inode_put(s->peer);
+
+  k_object_pool_put(unix_socket_cache, s);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Addresses
+ * ----------------------------------------------------------------------------
+ */
+
+// Extract the path from a socket address into a NUL-terminated buffer
+static int
+unix_address_path(const struct sockaddr *address, socklen_t address_len,
+                  char *path)
+{
+  const struct sockaddr_un *sun = (const struct sockaddr_un *) address;
+  size_t len;
+
+  if ((address == NULL) || (address_len <= UNIX_UNNAMED_LEN) ||
+      (address_len > sizeof(struct sockaddr_un)))
+    return -EINVAL;
+  if (sun->sun_family != AF_UNIX)
+    return -EAFNOSUPPORT;
+
+  len = strnlen(sun->sun_path, address_len - UNIX_UNNAMED_LEN);
+  if (len == 0)
+    return -ENOENT;
+
+  memcpy(path, sun->sun_path, len);
+  path[len] = '\0';
+
+  return len;
+}
+
+// Resolve a socket address into the inode of a socket file the caller may
+// connect to
+static int
+unix_address_lookup(const struct sockaddr *address, socklen_t address_len,
+                    struct Inode **inode_store)
+{
+  char path[UNIX_PATH_MAX + 1];
+  struct Inode *inode;
+  int r;
+
+  if ((r = unix_address_path(address, address_len, path)) < 0)
+    return r;
+
+  // (inode->ref_count): +1
+  if ((r = fs_lookup_inode(path, FS_LOOKUP_FOLLOW_LINKS, &inode)) < 0)
+    return r;
+
+  fs_inode_lock_shared(inode);
+
+  if (!S_ISSOCK(inode->mode))
+    r = -ECONNREFUSED;
+  else if (!fs_permission(inode, FS_PERM_WRITE, 0))
+    r = -EACCES;
+
+  fs_inode_unlock_shared(inode);
+
+  if (r < 0) {
+    fs_inode_put(inode);  // (inode->ref_count): -1
+    return r;
+  }
+
+  *inode_store = inode;
+
+  return 0;
+}
+
+// Find the socket bound to the given inode and take a reference to it. The
+// caller must be holding unix_lock.
+static struct UnixSocket *
+unix_bound_get(struct Inode *inode)
+{
+  struct KListLink *l;
+
+  KLIST_FOREACH(&unix_bound, l) {
+    struct UnixSocket *s = KLIST_CONTAINER(l, struct UnixSocket, bind_link);
+
+    if (s->inode == inode) {
+      s->ref_count++;
+      return s;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+unix_address_copy(struct sockaddr *address, socklen_t *address_len,
+                  const struct sockaddr_un *src, socklen_t src_len)
+{
+  if (address != NULL)
+    memcpy(address, src, MIN(*address_len, src_len));
+  if (address_len != NULL)
+    *address_len = src_len;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Socket creation and binding
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * Create a local socket.
+ *
+ * @param type     SOCK_STREAM or SOCK_DGRAM
+ * @param protocol Must be 0
+ * @param fstore   Pointer to the memory address to store the socket file
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+unix_socket(int type, int protocol, struct File **fstore)
+{
+  struct UnixSocket *s;
+  struct File *f;
+  int r;
+
+  if ((type != SOCK_STREAM) && (type != SOCK_DGRAM))
+    return -EPROTOTYPE;
+  if (protocol != 0)
+    return -EPROTONOSUPPORT;
+
+  if ((s = unix_socket_alloc(type)) == NULL)
+    return -ENOMEM;
+
+  if ((r = file_alloc(&f)) < 0) {
+    unix_socket_put(s);
+    return r;
+  }
+
+  f->type        = FD_UNIX;
+  f->unix_socket = s;
+  f->flags       = O_RDWR;
+  f->ref_count++;
+
+  *fstore = f;
+
+  return 0;
+}
+
+/**
+ * Bind a local socket to a path. A new socket file is created at that path,
+ * which must not exist yet.
+ *
+ * @param file        The socket file
+ * @param address     The address to bind to
+ * @param address_len The length of the address
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+unix_bind(struct File *file, const struct sockaddr *address,
+          socklen_t address_len)
+{
+  struct UnixSocket *s = file->unix_socket;
+  char path[UNIX_PATH_MAX + 1];
+  struct Inode *inode;
+  int r, len;
+
+  if (file->type != FD_UNIX)
+    return -EBADF;
+
+  if ((len = unix_address_path(address, address_len, path)) < 0)
+    return len;
+
+  if (s->inode != NULL)
+    return -EINVAL;
+
+  if ((r = fs_create(path, S_IFSOCK | 0777, 0, NULL)) < 0)
+    return (r == -EEXIST) ? -EADDRINUSE : r;
+
+  // (inode->ref_count): +1
+  if ((r = fs_lookup_inode(path, 0, &inode)) < 0)
+    return r;
+
+  k_spinlock_acquire(&unix_lock);
+
+  if (s->inode != NULL) {
+    k_spinlock_release(&unix_lock);
+    fs_inode_put(inode);  // (inode->ref_count): -1
+    return -EINVAL;
+  }
+
+  s->inode = inode;
+  s->address.sun_family = AF_UNIX;
+  memcpy(s->address.sun_path, path, len);
+  s->address_len = UNIX_UNNAMED_LEN + len;
+  if (len < UNIX_PATH_MAX)
+    s->address.sun_path[len] = '\0';
+  s->address.sun_len = s->address_len;
+
+  k_list_add_back(&unix_bound, &s->bind_link);
+
+  k_spinlock_release(&unix_lock);
+
+  return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Stream connections
+ * ----------------------------------------------------------------------------
+ */
+
+static struct UnixConnection *
+unix_connection_alloc(void)
+{
+  struct UnixConnection *conn;
+  int i;
+
+  conn = (struct UnixConnection *) k_object_pool_get(unix_connection_cache);
+  if (conn == NULL)
+    return NULL;
+
+  for (i = 0; i < 2; i++) {
+    struct Page *page;
+
+    if ((page = page_alloc_block(UNIX_BUFFER_ORDER, 0, PAGE_TAG_SOCKET)) == NULL) {
+      if (i > 0) {
+        page = kva2page(conn->streams[0].data);
+        page->ref_count--;
+        page_free_block(page, UNIX_BUFFER_ORDER);
+      }
+      k_object_pool_put(unix_connection_cache, conn);
+      return NULL;
+    }
+
+    page->ref_count++;
+
+    conn->sockets[i]          = NULL;
+    conn->streams[i].data     = (char *) page2kva(page);
+    conn->streams[i].read_pos = 0;
+    conn->streams[i].size     = 0;
+    k_waitqueue_init(&conn->queues[i]);
+  }
+
+  k_spinlock_init(&conn->lock, "unix_connection");
+
+  return conn;
+}
+
+static void
+unix_connection_free(struct UnixConnection *conn)
+{
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    struct Page *page = kva2page(conn->streams[i].data);
+
+    page->ref_count--;
+    page_free_block(page, UNIX_BUFFER_ORDER);
+  }
+
+  k_object_pool_put(unix_connection_cache, conn);
+}
+
+// Detach the endpoint from its connection, waking up the other one. The last
+// endpoint to leave frees the connection.
+static void
+unix_disconnect(struct UnixSocket *s)
+{
+  struct UnixConnection *conn = s->conn;
+  struct UnixSocket *other;
+  int i;
+
+  if (conn == NULL)
+    return;
+
+  k_spinlock_acquire(&conn->lock);
+
+  conn->sockets[s->side] = NULL;
+  other = conn->sockets[!s->side];
+
+  for (i = 0; i < 2; i++)
+    k_waitqueue_wakeup_all(&conn->queues[i]);
+
+  if (other != NULL)
+    poll_queue_notify(&other->poll_queue, POLLIN | POLLOUT | POLLHUP);
+
+  k_spinlock_release(&conn->lock);
+
+  if (other == NULL)
+    unix_connection_free(conn);
+}
+
+/**
+ * Start listening for connections on a bound stream socket.
+ *
+ * @param file    The socket file
+ * @param backlog The maximum number of connections waiting to be accepted
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+unix_listen(struct File *file, int backlog)
+{
+  struct UnixSocket *s = file->unix_socket;
+  int r = 0;
+
+  if (file->type != FD_UNIX)
+    return -EBADF;
+  if (s->type != SOCK_STREAM)
+    return -EOPNOTSUPP;
+
+  k_spinlock_acquire(&unix_lock);
+
+  if (s->inode == NULL) {
+    r = -EDESTADDRREQ;
+  } else if (s->state == UNIX_CONNECTED) {
+    r = -EISCONN;
+  } else {
+    s->state   = UNIX_LISTENING;
+    s->backlog = MAX(backlog, 1);
+  }
+
+  k_spinlock_release(&unix_lock);
+
+  return r;
+}
+
+static int
+unix_stream_connect(struct UnixSocket *s, struct Inode *inode)
+{
+  struct UnixSocket *listener, *server;
+  struct UnixConnection *conn;
+  int r;
+
+  if ((server = unix_socket_alloc(SOCK_STREAM)) == NULL)
+    return -ENOMEM;
+
+  if ((conn = unix_connection_alloc()) == NULL) {
+    unix_socket_put(server);
+    return -ENOMEM;
+  }
+
+  k_spinlock_acquire(&unix_lock);
+
+  if ((listener = unix_bound_get(inode)) == NULL) {
+    r = -ECONNREFUSED;
+  } else if (listener->type != SOCK_STREAM) {
+    r = -EPROTOTYPE;
+  } else if (s->state != UNIX_UNCONNECTED) {
+    r = (s->state == UNIX_CONNECTED) ? -EISCONN : -EINVAL;
+  } else if ((listener->state != UNIX_LISTENING) ||
+             (listener->pending >= listener->backlog)) {
+    r = -ECONNREFUSED;
+  } else {
+    conn->sockets[0] = s;
+    conn->sockets[1] = server;
+
+    s->conn  = conn;
+    s->side  = 0;
+    s->state = UNIX_CONNECTED;
+    s->peer_address     = listener->address;
+    s->peer_address_len = listener->address_len;
+
+    server->conn  = conn;
+    server->side  = 1;
+    server->state = UNIX_CONNECTED;
+    server->address          = listener->address;
+    server->address_len      = listener->address_len;
+    server->peer_address     = s->address;
+    server->peer_address_len = s->address_len;
+
+    // The accept queue now owns the reference to the server endpoint
+    k_list_add_back(&listener->accept_queue, &server->accept_link);
+    listener->pending++;
+
+    k_waitqueue_wakeup(&listener->accept_wait);
+    poll_queue_notify(&listener->poll_queue, POLLIN);
+
+    r = 0;
+  }
+
+  k_spinlock_release(&unix_lock);
+
+  if (listener != NULL)
+    unix_socket_put(listener);
+
+  if (r < 0) {
+    unix_connection_free(conn);
+    unix_socket_put(server);
+  }
+
+  return r;
+}
+
+/**
+ * Accept a connection on a listening socket.
+ *
+ * @param file        The listening socket file
+ * @param address     Buffer to store the address of the connecting socket, or
+ *                    NULL
+ * @param address_len The size of the buffer, set to the address length
+ * @param fstore      Pointer to the memory address to store the new file
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+unix_accept(struct File *file, struct sockaddr *address,
+            socklen_t *address_len, struct File **fstore)
+{
+  struct UnixSocket *s = file->unix_socket, *server;
+  struct File *f;
+  int r;
+
+  if (file->type != FD_UNIX)
+    return -EBADF;
+  if (s->type != SOCK_STREAM)
+    return -EOPNOTSUPP;
+
+  k_spinlock_acquire(&unix_lock);
+
+  for (;;) {
+    if (s->state != UNIX_LISTENING) {
+      k_spinlock_release(&unix_lock);
+      return -EINVAL;
+    }
+
+    if (!k_list_is_empty(&s->accept_queue))
+      break;
+
+    if (file->flags & O_NONBLOCK) {
+      k_spinlock_release(&unix_lock);
+      return -EAGAIN;
+    }
+
+    if ((r = k_waitqueue_sleep_exclusive(&s->accept_wait, &unix_lock)) < 0) {
+      k_waitqueue_wakeup(&s->accept_wait);
+      k_spinlock_release(&unix_lock);
+      return r;
+    }
+  }
+
+  server = KLIST_CONTAINER(s->accept_queue.next, struct UnixSocket, accept_link);
+  k_list_remove(&server->accept_link);
+  s->pending--;
+
+  // Each connection wakes up a single acceptor, let the next one take the rest
+  if (!k_list_is_empty(&s->accept_queue))
+    k_waitqueue_wakeup(&s->accept_wait);
+
+  k_spinlock_release(&unix_lock);
+
+  if ((r = file_alloc(&f)) < 0) {
+    unix_disconnect(server);
+    unix_socket_put(server);
+    return r;
+  }
+
+  f->type        = FD_UNIX;
+  f->unix_socket = server;
+  f->flags       = O_RDWR;
+  f->ref_count++;
+
+  unix_address_copy(address, address_len, &server->peer_address,
+                    server->peer_address_len);
+
+  *fstore = f;
+
+  return 0;
+}
+
+static ssize_t
+unix_stream_recv(struct File *file, struct UnixConnection *conn, int side,
+                 uintptr_t va, size_t n, int flags)
+{
+  struct UnixStream *stream = &conn->streams[side];
+  struct UnixSocket *other;
+  size_t i, pos, left;
+
+  k_spinlock_acquire(&conn->lock);
+
+  while ((stream->size == 0) && (conn->sockets[!side] != NULL)) {
+    int r;
+
+    if ((file->flags & O_NONBLOCK) || (flags & MSG_DONTWAIT)) {
+      k_spinlock_release(&conn->lock);
+      return -EAGAIN;
+    }
+
+    if ((r = k_waitqueue_sleep(&conn->queues[side], &conn->lock)) < 0) {
+      k_spinlock_release(&conn->lock);
+      return r;
+    }
+  }
+
+  // The available data occupies at most two contiguous segments of the ring
+  for (i = 0, pos = stream->read_pos, left = stream->size; (i < n) && (left > 0); ) {
+    size_t chunk;
+    int r;
+
+    chunk = MIN(n - i, left);
+    chunk = MIN(chunk, UNIX_BUFFER_SIZE - pos);
+
+    if ((r = vm_space_copy_out(&stream->data[pos], va + i, chunk)) < 0) {
+      k_spinlock_release(&conn->lock);
+      return (i > 0) ? (ssize_t) i : r;
+    }
+
+    pos   = (pos + chunk) % UNIX_BUFFER_SIZE;
+    left -= chunk;
+    i    += chunk;
+  }
+
+  if (!(flags & MSG_PEEK) && (i > 0)) {
+    stream->read_pos = pos;
+    stream->size     = left;
+
+    k_waitqueue_wakeup_all(&conn->queues[side]);
+    if ((other = conn->sockets[!side]) != NULL)
+      poll_queue_notify(&other->poll_queue, POLLOUT);
+  }
+
+  k_spinlock_release(&conn->lock);
+
+  return i;
+}
+
+static ssize_t
+unix_stream_send(struct File *file, struct UnixConnection *conn, int side,
+                 uintptr_t va, size_t n, int flags)
+{
+  struct UnixStream *stream = &conn->streams[!side];
+  size_t i;
+
+  k_spinlock_acquire(&conn->lock);
+
+  for (i = 0; i < n; ) {
+    size_t chunk, write_pos;
+    int r;
+
+    while ((conn->sockets[!side] != NULL) && (stream->size == UNIX_BUFFER_SIZE)) {
+      if ((file->flags & O_NONBLOCK) || (flags & MSG_DONTWAIT)) {
+        k_spinlock_release(&conn->lock);
+        return (i > 0) ? (ssize_t) i : -EAGAIN;
+      }
+
+      if ((r = k_waitqueue_sleep(&conn->queues[!side], &conn->lock)) < 0) {
+        k_spinlock_release(&conn->lock);
+        return (i > 0) ? (ssize_t) i : r;
+      }
+    }
+
+    if (conn->sockets[!side] == NULL) {
+      k_spinlock_release(&conn->lock);
+      return (i > 0) ? (ssize_t) i : -EPIPE;
+    }
+
+    write_pos = (stream->read_pos + stream->size) % UNIX_BUFFER_SIZE;
+
+    // Fill the free space up to the end of the ring, the rest (if any) goes
+    // to the beginning on the next iteration
+    chunk = MIN(n - i, UNIX_BUFFER_SIZE - stream->size);
+    chunk = MIN(chunk, UNIX_BUFFER_SIZE - write_pos);
+
+    if ((r = vm_space_copy_in(&stream->data[write_pos], va + i, chunk)) < 0) {
+      k_spinlock_release(&conn->lock);
+      return (i > 0) ? (ssize_t) i : r;
+    }
+
+    stream->size += chunk;
+    i            += chunk;
+
+    k_waitqueue_wakeup_all(&conn->queues[!side]);
+    poll_queue_notify(&conn->sockets[!side]->poll_queue, POLLIN);
+  }
+
+  k_spinlock_release(&conn->lock);
+
+  return i;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Datagrams
+ * ----------------------------------------------------------------------------
+ */
+
+static ssize_t
+unix_dgram_send(struct File *file, struct UnixSocket *s, uintptr_t va,
+                size_t n, int flags, struct Inode *inode)
+{
+  struct UnixMessage *msg;
+  struct UnixSocket *dst;
+  ssize_t r;
+
+  if (n > UNIX_BUFFER_SIZE)
+    return -EMSGSIZE;
+
+  // Copy the data in before taking any locks
+  if ((msg = (struct UnixMessage *) k_malloc(sizeof(*msg) + n)) == NULL)
+    return -ENOMEM;
+
+  if ((r = vm_space_copy_in(msg->data, va, n)) < 0) {
+    k_free(msg);
+    return r;
+  }
+
+  k_list_null(&msg->link);
+  msg->size = n;
+  r = 0;
+
+  k_spinlock_acquire(&unix_lock);
+  msg->address     = s->address;
+  msg->address_len = s->address_len;
+  dst = unix_bound_get(inode);
+  k_spinlock_release(&unix_lock);
+
+  if (dst == NULL) {
+    k_free(msg);
+    return -ECONNREFUSED;
+  }
+
+  if (dst->type != SOCK_DGRAM) {
+    unix_socket_put(dst);
+    k_free(msg);
+    return -EPROTOTYPE;
+  }
+
+  k_spinlock_acquire(&dst->lock);
+
+  // Always let a single datagram in, so that large ones cannot get stuck
+  while (!dst->closed && (dst->queued > 0) &&
+         (dst->queued + n > UNIX_BUFFER_SIZE)) {
+    if ((file->flags & O_NONBLOCK) || (flags & MSG_DONTWAIT)) {
+      r = -EAGAIN;
+      break;
+    }
+
+    if ((r = k_waitqueue_sleep(&dst->send_wait, &dst->lock)) < 0)
+      break;
+  }
+
+  if ((r == 0) && dst->closed)
+    r = -ECONNREFUSED;
+
+  if (r == 0) {
+    k_list_add_back(&dst->messages, &msg->link);
+    dst->queued += n;
+
+    k_waitqueue_wakeup_one(&dst->recv_wait);
+    poll_queue_notify(&dst->poll_queue, POLLIN);
+
+    msg = NULL;
+  }
+
+  k_spinlock_release(&dst->lock);
+
+  unix_socket_put(dst);
+
+  if (msg != NULL) {
+    k_free(msg);
+    return r;
+  }
+
+  return n;
+}
+
+static ssize_t
+unix_dgram_recv(struct File *file, struct UnixSocket *s, uintptr_t va,
+                size_t n, int flags, struct sockaddr *address,
+                socklen_t *address_len)
+{
+  struct UnixMessage *msg;
+  ssize_t r;
+
+  k_spinlock_acquire(&s->lock);
+
+  while (k_list_is_empty(&s->messages)) {
+    if ((file->flags & O_NONBLOCK) || (flags & MSG_DONTWAIT)) {
+      k_spinlock_release(&s->lock);
+      return -EAGAIN;
+    }
+
+    if ((r = k_waitqueue_sleep(&s->recv_wait, &s->lock)) < 0) {
+      k_spinlock_release(&s->lock);
+      return r;
+    }
+  }
+
+  msg = KLIST_CONTAINER(s->messages.next, struct UnixMessage, link);
+
+  // The rest of a datagram that does not fit into the buffer is discarded
+  n = MIN(n, msg->size);
+
+  if ((r = vm_space_copy_out(msg->data, va, n)) < 0) {
+    k_spinlock_release(&s->lock);
+    return r;
+  }
+
+  unix_address_copy(address, address_len, &msg->address, msg->address_len);
+
+  if (!(flags & MSG_PEEK)) {
+    k_list_remove(&msg->link);
+    s->queued -= msg->size;
+
+    k_waitqueue_wakeup_all(&s->send_wait);
+  } else {
+    msg = NULL;
+  }
+
+  k_spinlock_release(&s->lock);
+
+  if (msg != NULL)
+    k_free(msg);
+
+  return n;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Socket operations
+ * ----------------------------------------------------------------------------
+ */
+
+// Get the connection of a connected stream socket
+static struct UnixConnection *
+unix_connection(struct UnixSocket *s)
+{
+  struct UnixConnection *conn;
+
+  k_spinlock_acquire(&unix_lock);
+  conn = (s->state == UNIX_CONNECTED) ? s->conn : NULL;
+  k_spinlock_release(&unix_lock);
+
+  return conn;
+}
+
+/**
+ * Connect a local socket. Stream sockets are connected to a listening socket
+ * immediately, without waiting for the connection to be accepted. For datagram
+ * sockets, only the default destination is set.
+ *
+ * @param file        The socket file
+ * @param address     The address to connect to
+ * @param address_len The length of the address
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+unix_connect(struct File *file, const struct sockaddr *address,
+             socklen_t address_len)
+{
+  struct UnixSocket *s = file->unix_socket;
+  struct Inode *inode, *old;
+  int r;
+
+  if (file->type != FD_UNIX)
+    return -EBADF;
+
+  // (inode->ref_count): +1
+  if ((r = unix_address_lookup(address, address_len, &inode)) < 0)
+    return r;
+
+  if (s->type == SOCK_STREAM) {
+    r = unix_stream_connect(s, inode);
+    fs_inode_put(inode);  // (inode->ref_count): -1
+    return r;
+  }
+
+  // The socket keeps the reference
+  k_spinlock_acquire(&s->lock);
+  old     = s->peer;
+  s->peer = inode;
+  k_spinlock_release(&s->lock);
+
+  if (old != NULL)
+    fs_inode_put(old);
+
+  return 0;
+}
+
+/**
+ * Receive data from a local socket.
+ *
+ * @param file        The socket file
+ * @param va          User buffer to receive the data into
+ * @param n           The size of the buffer
+ * @param flags       MSG_PEEK and MSG_DONTWAIT are supported
+ * @param address     Buffer to store the sender address, or NULL
+ * @param address_len The size of the buffer, set to the address length
+ *
+ * @return The number of bytes received, or a negative error code.
+ */
+ssize_t
+unix_recvfrom(struct File *file, uintptr_t va, size_t n, int flags,
+              struct sockaddr *address, socklen_t *address_len)
+{
+  struct UnixSocket *s = file->unix_socket;
+  struct UnixConnection *conn;
+
+  if (file->type != FD_UNIX)
+    return -EBADF;
+
+  if (s->type == SOCK_DGRAM)
+    return unix_dgram_recv(file, s, va, n, flags, address, address_len);
+
+  if ((conn = unix_connection(s)) == NULL)
+    return -ENOTCONN;
+
+  unix_address_copy(address, address_len, &s->peer_address,
+                    s->peer_address_len);
+
+  return unix_stream_recv(file, conn, s->side, va, n, flags);
+}
+
+/**
+ * Send data through a local socket.
+ *
+ * @param file     The socket file
+ * @param va       User buffer holding the data
+ * @param n        The number of bytes to send
+ * @param flags    MSG_DONTWAIT is supported
+ * @param dest     The destination of a datagram, or NULL to use the one set
+ *                 by connect()
+ * @param dest_len The length of the destination address
+ *
+ * @return The number of bytes sent, or a negative error code.
+ */
+ssize_t
+unix_sendto(struct File *file, uintptr_t va, size_t n, int flags,
+            const struct sockaddr *dest, socklen_t dest_len)
+{
+  struct UnixSocket *s = file->unix_socket;
+  struct UnixConnection *conn;
+  struct Inode *inode;
+  ssize_t r;
+
+  if (file->type != FD_UNIX)
+    return -EBADF;
+
+  if (s->type == SOCK_STREAM) {
+    if (dest != NULL)
+      return -EISCONN;
+    if ((conn = unix_connection(s)) == NULL)
+      return -ENOTCONN;
+    return unix_stream_send(file, conn, s->side, va, n, flags);
+  }
+
+  if (dest != NULL) {
+    // (inode->ref_count): +1
+    if ((r = unix_address_lookup(dest, dest_len, &inode)) < 0)
+      return r;
+  } else {
+    k_spinlock_acquire(&s->lock);
+    inode = (s->peer != NULL) ? fs_inode_duplicate(s->peer) : NULL;
+    k_spinlock_release(&s->lock);
+
+    if (inode == NULL)
+      return -EDESTADDRREQ;
+  }
+
+  r = unix_dgram_send(file, s, va, n, flags, inode);
+
+  fs_inode_put(inode);  // (inode->ref_count): -1
+
+  return r;
+}
+
+/**
+ * Check the socket state.
+ *
+ * @param file  The socket file
+ * @param entry The entry to register on the socket, or NULL
+ *
+ * @return The pending events.
+ */
+int
+unix_poll(struct File *file, struct PollEntry *entry)
+{
+  struct UnixSocket *s = file->unix_socket;
+  struct UnixConnection *conn;
+  int r = 0;
+
+  if (file->type != FD_UNIX)
+    return POLLNVAL;
+
+  poll_queue_add(&s->poll_queue, entry);
+
+  if (s->type == SOCK_DGRAM) {
+    k_spinlock_acquire(&s->lock);
+    if (!k_list_is_empty(&s->messages))
+      r |= POLLIN;
+    k_spinlock_release(&s->lock);
+
+    return r | POLLOUT;
+  }
+
+  k_spinlock_acquire(&unix_lock);
+  if ((s->state == UNIX_LISTENING) && !k_list_is_empty(&s->accept_queue))
+    r |= POLLIN;
+  conn = (s->state == UNIX_CONNECTED) ? s->conn : NULL;
+  k_spinlock_release(&unix_lock);
+
+  if (conn != NULL) {
+    k_spinlock_acquire(&conn->lock);
+
+    if (conn->streams[s->side].size > 0)
+      r |= POLLIN;
+
+    if (conn->sockets[!s->side] == NULL)
+      r |= POLLHUP;
+    else if (conn->streams[!s->side].size < UNIX_BUFFER_SIZE)
+      r |= POLLOUT;
+
+    k_spinlock_release(&conn->lock);
+  }
+
+  return r;
+}
+
+int
+unix_getsockopt(struct File *file, int level, int option_name,
+                void *option_value, socklen_t *option_len)
+{
+  struct UnixSocket *s = file->unix_socket;
+  int value;
+
+  if (file->type != FD_UNIX)
+    return -EBADF;
+  if (level != SOL_SOCKET)
+    return -ENOPROTOOPT;
+  if (*option_len < sizeof(int))
+    return -EINVAL;
+
+  switch (option_name) {
+  case SO_TYPE:
+    value = s->type;
+    break;
+  case SO_ACCEPTCONN:
+    value = (s->state == UNIX_LISTENING);
+    break;
+  case SO_ERROR:
+    value = 0;
+    break;
+  case SO_RCVBUF:
+  case SO_SNDBUF:
+    value = UNIX_BUFFER_SIZE;
+    break;
+  default:
+    return -ENOPROTOOPT;
+  }
+
+  *(int *) option_value = value;
+  *option_len = sizeof(int);
+
+  return 0;
+}
+
+int
+unix_stat(struct File *file, struct stat *buf)
+{
+  if (file->type != FD_UNIX)
+    return -EBADF;
+
+  // TODO: use meaningful values
+  memset(buf, 0, sizeof(*buf));
+  buf->st_dev     = 255;
+  buf->st_mode    = S_IFSOCK;
+  buf->st_blksize = UNIX_BUFFER_SIZE;
+
+  return 0;
+}
+
+/**
+ * Release the socket once its file is closed. The socket file in the
+ * filesystem remains in place until unlinked.
+ *
+ * @param file The socket file
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+unix_close(struct File *file)
+{
+  struct UnixSocket *s = file->unix_socket;
+  struct KListLink pending, *l;
+  struct Inode *inode;
+
+  if (file->type != FD_UNIX)
+    return -EBADF;
+
+  k_list_init(&pending);
+
+  k_spinlock_acquire(&unix_lock);
+
+  if ((inode = s->inode) != NULL) {
+    k_list_remove(&s->bind_link);
+    s->inode = NULL;
+  }
+
+  // Take over the connections nobody has accepted yet
+  while ((l = s->accept_queue.next) != &s->accept_queue) {
+    k_list_remove(l);
+    k_list_add_back(&pending, l);
+  }
+  s->pending = 0;
+
+  if (s->state == UNIX_LISTENING)
+    s->state = UNIX_UNCONNECTED;
+
+  k_waitqueue_wakeup_all(&s->accept_wait);
+
+  k_spinlock_release(&unix_lock);
+
+  while ((l = pending.next) != &pending) {
+    struct UnixSocket *server = KLIST_CONTAINER(l, struct UnixSocket, accept_link);
+
+    k_list_remove(l);
+    unix_disconnect(server);
+    unix_socket_put(server);
+  }
+
+  unix_disconnect(s);
+
+  // Refuse further datagrams and wake up the senders waiting for space
+  k_spinlock_acquire(&s->lock);
+  s->closed = 1;
+  k_waitqueue_wakeup_all(&s->send_wait);
+  k_spinlock_release(&s->lock);
+
+  if (inode != NULL)
+    fs_inode_put(inode);
+
+  unix_socket_put(s);
+
+  return 0;
+}
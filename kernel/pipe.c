@@ -1,5 +1,7 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <string.h>
 
 #include <kernel/console.h>
 #include <kernel/fs/file.h>
@@ -8,6 +10,7 @@
 #include <kernel/pipe.h>
 #include <kernel/waitqueue.h>
 #include <kernel/process.h>
+#include <kernel/types.h>
 #include <kernel/vmspace.h>
 
 static struct KObjectPool *pipe_cache;
@@ -33,12 +36,14 @@ pipe_open(struct File **read_store, struct File **write_store)
     goto fail1;
   }
 
-  if ((page = page_alloc_one(0, PAGE_TAG_PIPE)) == NULL) {
+  if ((page = page_alloc_block(PIPE_DEFAULT_ORDER, 0, PAGE_TAG_PIPE)) == NULL) {
     r = -ENOMEM;
     goto fail2;
   }
 
-  pipe->data = (char *) page2kva(page);
+  pipe->data     = (char *) page2kva(page);
+  pipe->order    = PIPE_DEFAULT_ORDER;
+  pipe->capacity = PAGE_SIZE << PIPE_DEFAULT_ORDER;
   page->ref_count++;
 
   if ((r = file_alloc(&read)) < 0)
@@ -53,8 +58,11 @@ pipe_open(struct File **read_store, struct File **write_store)
   pipe->read_pos   = 0;
   pipe->write_pos  = 0;
   pipe->size       = 0;
+  pipe->reading    = 0;
+  pipe->writing    = 0;
   k_waitqueue_init(&pipe->read_queue);
   k_waitqueue_init(&pipe->write_queue);
+  poll_queue_init(&pipe->poll_queue);
 
   read->type  = FD_PIPE;
   read->pipe  = pipe;
@@ -75,7 +83,7 @@ fail4:
   file_put(read);
 fail3:
   page->ref_count--;
-  page_free_one(page);
+  page_free_block(page, PIPE_DEFAULT_ORDER);
 fail2:
   k_object_pool_put(pipe_cache, pipe);
 fail1:
@@ -98,11 +106,13 @@ pipe_close(struct File *file)
     pipe->write_open = 0;
     if (pipe->read_open) {
       k_waitqueue_wakeup_all(&pipe->read_queue);
+      poll_queue_notify(&pipe->poll_queue, POLLIN | POLLHUP);
     }
   } else {
     pipe->read_open = 0;
     if (pipe->write_open) {
       k_waitqueue_wakeup_all(&pipe->write_queue);
+      poll_queue_notify(&pipe->poll_queue, POLLOUT | POLLERR);
     }
   }
 
@@ -115,7 +125,7 @@ pipe_close(struct File *file)
 
   page = kva2page(pipe->data);
   page->ref_count--;
-  page_free_one(page);
+  page_free_block(page, pipe->order);
 
   k_object_pool_put(pipe_cache, pipe);
 
@@ -133,33 +143,44 @@ pipe_read(struct File *file, uintptr_t va, size_t n)
 
   k_spinlock_acquire(&pipe->lock);
 
-  while (pipe->write_open && (pipe->size == 0)) {
+  while ((pipe->write_open && (pipe->size == 0)) || pipe->reading) {
     int r;
 
-    if ((r = k_waitqueue_sleep(&pipe->read_queue, &pipe->lock)) < 0) {
+    if ((r = k_waitqueue_sleep_exclusive(&pipe->read_queue, &pipe->lock)) < 0) {
+      k_waitqueue_wakeup(&pipe->read_queue);
       k_spinlock_release(&pipe->lock);
       return r;
     }
   }
   
-  // TODO: could copy all available data in one or two steps
-
-  for (i = 0; (i < n) && (pipe->size > 0); i++, pipe->size--) {
+  // The available data occupies at most two contiguous segments of the ring
+  for (i = 0; (i < n) && (pipe->size > 0); ) {
+    size_t chunk;
     int r;
 
-    r = vm_space_copy_out(&pipe->data[pipe->read_pos++], va + i, 1);
+    chunk = MIN(n - i, pipe->size);
+    chunk = MIN(chunk, pipe->capacity - pipe->read_pos);
 
-    if (pipe->read_pos == PAGE_SIZE)
-      pipe->read_pos = 0;
+    r = vm_space_copy_out(&pipe->data[pipe->read_pos], va + i, chunk);
 
     if (r < 0) {
+      k_waitqueue_wakeup(&pipe->read_queue);
       k_waitqueue_wakeup_all(&pipe->write_queue);
       k_spinlock_release(&pipe->lock);
       return r;
     }
+
+    pipe->read_pos = (pipe->read_pos + chunk) % pipe->capacity;
+    pipe->size    -= chunk;
+    i             += chunk;
   }
 
+  // Readers are woken up one at a time, pass on what is left to the next one
+  if ((pipe->size > 0) || !pipe->write_open)
+    k_waitqueue_wakeup(&pipe->read_queue);
+
   k_waitqueue_wakeup_all(&pipe->write_queue);
+  poll_queue_notify(&pipe->poll_queue, POLLOUT);
 
   k_spinlock_release(&pipe->lock);
 
@@ -177,30 +198,45 @@ pipe_write(struct File *file, uintptr_t va, size_t n)
   
   k_spinlock_acquire(&pipe->lock);
 
-  // TODO: could copy all available data in one or two steps
-
-  for (i = 0; i < n; i++) {
+  for (i = 0; i < n; ) {
+    size_t chunk, need;
     int r;
 
-    while (pipe->read_open && (pipe->size == PAGE_SIZE)) {
+    // Writes of up to PIPE_BUF bytes must not be interleaved with data from
+    // other writers, so wait until there is room for all of it
+    need = (n <= PIPE_BUF) ? (n - i) : 1;
+
+    while ((pipe->read_open && ((pipe->capacity - pipe->size) < need)) ||
+           pipe->writing) {
       if ((r = k_waitqueue_sleep(&pipe->write_queue, &pipe->lock)) < 0) {
         k_spinlock_release(&pipe->lock);
         return r;
       }
     }
 
-    r = vm_space_copy_in(&pipe->data[pipe->write_pos++], va + i, 1);
-  
-    if (pipe->write_pos == PAGE_SIZE)
-      pipe->write_pos = 0;
+    // Fill the free space up to the end of the ring, the rest (if any) goes
+    // to the beginning on the next iteration
+    chunk = MIN(n - i, pipe->capacity - pipe->size);
+    chunk = MIN(chunk, pipe->capacity - pipe->write_pos);
 
-    if (pipe->size++ == 0)
-      k_waitqueue_wakeup_all(&pipe->read_queue);
+    // The buffer is full and there are no more readers
+    if (chunk == 0)
+      break;
 
-    if (r < 0) {
+    if ((r = vm_space_copy_in(&pipe->data[pipe->write_pos], va + i, chunk)) < 0) {
       k_spinlock_release(&pipe->lock);
       return r;
     }
+
+    pipe->write_pos = (pipe->write_pos + chunk) % pipe->capacity;
+
+    if (pipe->size == 0)
+      k_waitqueue_wakeup(&pipe->read_queue);
+
+    pipe->size += chunk;
+    i          += chunk;
+
+    poll_queue_notify(&pipe->poll_queue, POLLIN);
   }
 
   k_spinlock_release(&pipe->lock);
@@ -234,9 +270,307 @@ pipe_stat(struct File *file, struct stat *buf)
   buf->st_ctim.tv_sec  = 0;
   buf->st_ctim.tv_nsec = 0;
   buf->st_blocks       = 0;
-  buf->st_blksize      = 0;
+  buf->st_blksize      = pipe->capacity;   // Fill the buffer in one write
 
   k_spinlock_release(&pipe->lock);
 
   return 0;
 }
+
+/**
+ * Check the pipe state.
+ *
+ * @param file  The pipe file
+ * @param entry The entry to register on the pipe, or NULL
+ *
+ * @return The pending events. The read end is readable when there is data or
+ *         the write end is closed, the write end is writable when a write of
+ *         PIPE_BUF bytes would not block.
+ */
+int
+pipe_poll(struct File *file, struct PollEntry *entry)
+{
+  struct Pipe *pipe = file->pipe;
+  int r = 0;
+
+  if (file->type != FD_PIPE)
+    return POLLNVAL;
+
+  poll_queue_add(&pipe->poll_queue, entry);
+
+  k_spinlock_acquire(&pipe->lock);
+
+  if ((file->flags & O_ACCMODE) == O_RDONLY) {
+    if (pipe->size > 0)
+      r |= POLLIN;
+    if (!pipe->write_open)
+      r |= POLLHUP;
+  } else {
+    if (!pipe->read_open)
+      r |= POLLERR;
+    else if ((pipe->capacity - pipe->size) >= PIPE_BUF)
+      r |= POLLOUT;
+  }
+
+  k_spinlock_release(&pipe->lock);
+
+  return r;
+}
+
+/**
+ * Get the size of the pipe buffer.
+ *
+ * @param file The pipe file
+ *
+ * @return The buffer size in bytes, or -EBADF if the file is not a pipe.
+ */
+int
+pipe_get_size(struct File *file)
+{
+  struct Pipe *pipe = file->pipe;
+  int r;
+
+  if (file->type != FD_PIPE)
+    return -EBADF;
+
+  k_spinlock_acquire(&pipe->lock);
+  r = (int) pipe->capacity;
+  k_spinlock_release(&pipe->lock);
+
+  return r;
+}
+
+/**
+ * Resize the pipe buffer. The size is rounded up to a power-of-two number of
+ * pages.
+ *
+ * @param file The pipe file
+ * @param size The requested size in bytes
+ *
+ * @return The new buffer size in bytes, or a negative error code:
+ * @retval -EBADF  The file is not a pipe
+ * @retval -EINVAL The size is too large
+ * @retval -EBUSY  The data in the pipe does not fit into the new buffer, or
+ *                 a splice is in progress
+ * @retval -ENOMEM Out of memory
+ */
+int
+pipe_set_size(struct File *file, int size)
+{
+  struct Pipe *pipe = file->pipe;
+  struct Page *page;
+  char *data;
+  size_t capacity, n;
+  unsigned order, old_order;
+
+  if (file->type != FD_PIPE)
+    return -EBADF;
+
+  for (order = 0; (order <= PIPE_MAX_ORDER) && ((PAGE_SIZE << order) < (size_t) size); order++)
+    ;
+
+  if ((size < 0) || (order > PIPE_MAX_ORDER))
+    return -EINVAL;
+
+  if ((page = page_alloc_block(order, 0, PAGE_TAG_PIPE)) == NULL)
+    return -ENOMEM;
+
+  page->ref_count++;
+
+  data     = (char *) page2kva(page);
+  capacity = PAGE_SIZE << order;
+
+  k_spinlock_acquire(&pipe->lock);
+
+  if ((pipe->size > capacity) || pipe->reading || pipe->writing) {
+    k_spinlock_release(&pipe->lock);
+
+    page->ref_count--;
+    page_free_block(page, order);
+
+    return -EBUSY;
+  }
+
+  // Move the data to the beginning of the new buffer
+  n = MIN(pipe->size, pipe->capacity - pipe->read_pos);
+  memmove(data, &pipe->data[pipe->read_pos], n);
+  memmove(&data[n], pipe->data, pipe->size - n);
+
+  // Swap the buffers, the old one is freed below
+  page      = kva2page(pipe->data);
+  old_order = pipe->order;
+
+  pipe->data      = data;
+  pipe->order     = order;
+  pipe->capacity  = capacity;
+  pipe->read_pos  = 0;
+  pipe->write_pos = pipe->size % capacity;
+
+  k_waitqueue_wakeup_all(&pipe->write_queue);
+  poll_queue_notify(&pipe->poll_queue, POLLOUT);
+
+  k_spinlock_release(&pipe->lock);
+
+  page->ref_count--;
+  page_free_block(page, old_order);
+
+  return (int) capacity;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Splicing
+ * ----------------------------------------------------------------------------
+ *
+ * Splicing moves data between a pipe and another file inside the kernel, with
+ * the pipe buffer itself used as the source or the destination of the other
+ * file's read or write operation. Since these may sleep, the pipe lock is
+ * released during the transfer and the reading or writing flag keeps other
+ * consumers or producers (and buffer resizing) away from the buffer.
+ */
+
+static ssize_t
+pipe_splice_out(struct File *file, struct File *out, size_t n, int consume)
+{
+  struct Pipe *pipe = file->pipe;
+  size_t total;
+  ssize_t r = 0;
+
+  if (file->type != FD_PIPE)
+    return -EBADF;
+
+  k_spinlock_acquire(&pipe->lock);
+
+  while ((pipe->write_open && (pipe->size == 0)) || pipe->reading) {
+    if ((r = k_waitqueue_sleep_exclusive(&pipe->read_queue, &pipe->lock)) < 0) {
+      k_waitqueue_wakeup(&pipe->read_queue);
+      k_spinlock_release(&pipe->lock);
+      return r;
+    }
+  }
+
+  // The data occupies at most two contiguous segments of the ring
+  for (total = 0; (total < n) && (total < pipe->size); total += r) {
+    size_t pos, chunk;
+
+    pos   = (pipe->read_pos + total) % pipe->capacity;
+    chunk = MIN(n - total, pipe->size - total);
+    chunk = MIN(chunk, pipe->capacity - pos);
+
+    pipe->reading = 1;
+    k_spinlock_release(&pipe->lock);
+
+    r = file_write(out, (uintptr_t) &pipe->data[pos], chunk);
+
+    k_spinlock_acquire(&pipe->lock);
+    pipe->reading = 0;
+
+    if (r <= 0)
+      break;
+  }
+
+  if (consume && (total > 0)) {
+    pipe->read_pos = (pipe->read_pos + total) % pipe->capacity;
+    pipe->size    -= total;
+  }
+
+  k_waitqueue_wakeup(&pipe->read_queue);
+  k_waitqueue_wakeup_all(&pipe->write_queue);
+  poll_queue_notify(&pipe->poll_queue, POLLIN | POLLOUT);
+
+  k_spinlock_release(&pipe->lock);
+
+  return ((total == 0) && (r < 0)) ? r : (ssize_t) total;
+}
+
+/**
+ * Move data from a pipe to another file.
+ *
+ * @param file The pipe file to read from
+ * @param out  The file to write to
+ * @param n    The maximum number of bytes to move
+ *
+ * @return The number of bytes moved, or a negative error code.
+ */
+ssize_t
+pipe_splice_from(struct File *file, struct File *out, size_t n)
+{
+  return pipe_splice_out(file, out, n, 1);
+}
+
+/**
+ * Duplicate data from one pipe to another without consuming it.
+ *
+ * @param in  The pipe file to read from
+ * @param out The pipe file to write to
+ * @param n   The maximum number of bytes to copy
+ *
+ * @return The number of bytes copied, or a negative error code.
+ */
+ssize_t
+pipe_tee(struct File *in, struct File *out, size_t n)
+{
+  if (out->type != FD_PIPE)
+    return -EINVAL;
+
+  return pipe_splice_out(in, out, n, 0);
+}
+
+/**
+ * Move data from a file to a pipe.
+ *
+ * @param in   The file to read from
+ * @param file The pipe file to write to
+ * @param n    The maximum number of bytes to move
+ *
+ * @return The number of bytes moved, or a negative error code.
+ */
+ssize_t
+pipe_splice_to(struct File *in, struct File *file, size_t n)
+{
+  struct Pipe *pipe = file->pipe;
+  size_t chunk;
+  ssize_t r;
+
+  if (file->type != FD_PIPE)
+    return -EBADF;
+
+  k_spinlock_acquire(&pipe->lock);
+
+  while ((pipe->read_open && (pipe->size == pipe->capacity)) || pipe->writing) {
+    if ((r = k_waitqueue_sleep(&pipe->write_queue, &pipe->lock)) < 0) {
+      k_spinlock_release(&pipe->lock);
+      return r;
+    }
+  }
+
+  if (!pipe->read_open) {
+    k_spinlock_release(&pipe->lock);
+    return -EPIPE;
+  }
+
+  // Fill the free space up to the end of the ring
+  chunk = MIN(n, pipe->capacity - pipe->size);
+  chunk = MIN(chunk, pipe->capacity - pipe->write_pos);
+
+  pipe->writing = 1;
+  k_spinlock_release(&pipe->lock);
+
+  r = file_read(in, (uintptr_t) &pipe->data[pipe->write_pos], chunk);
+
+  k_spinlock_acquire(&pipe->lock);
+  pipe->writing = 0;
+
+  if (r > 0) {
+    pipe->write_pos = (pipe->write_pos + r) % pipe->capacity;
+    pipe->size     += r;
+  }
+
+  k_waitqueue_wakeup(&pipe->read_queue);
+  k_waitqueue_wakeup_all(&pipe->write_queue);
+  poll_queue_notify(&pipe->poll_queue, POLLIN | POLLOUT);
+
+  k_spinlock_release(&pipe->lock);
+
+  return r;
+}
@@ -0,0 +1,253 @@
+#include <errno.h>
+#include <limits.h>
+
+#include <kernel/core/tick.h>
+#include <kernel/console.h>
+#include <kernel/fd.h>
+#include <kernel/fs/file.h>
+#include <kernel/object_pool.h>
+#include <kernel/poll.h>
+#include <kernel/process.h>
+#include <kernel/waitqueue.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Poll queues
+ * ----------------------------------------------------------------------------
+ *
+ * A pollable object calls poll_queue_notify() whenever its state may have
+ * changed, passing the events affected. The callbacks run with the queue lock
+ * held (and possibly with the object lock held, or in interrupt context), so
+ * they must not sleep. Since entries are removed under the same lock, the
+ * callback is never invoked after poll_entry_remove() has returned.
+ */
+
+/**
+ * Initialize a poll queue.
+ *
+ * @param queue Pointer to the queue to be initialized
+ */
+void
+poll_queue_init(struct PollQueue *queue)
+{
+  k_spinlock_init(&queue->lock, "poll_queue");
+  k_list_init(&queue->entries);
+}
+
+/**
+ * Initialize a poll entry.
+ *
+ * @param entry  Pointer to the entry to be initialized
+ * @param notify The function to call when the object state changes
+ */
+void
+poll_entry_init(struct PollEntry *entry, PollNotify notify)
+{
+  k_list_null(&entry->link);
+  entry->queue  = NULL;
+  entry->notify = notify;
+}
+
+/**
+ * Register an entry on a poll queue. A NULL entry is ignored, which lets the
+ * object poll functions be used both to register and to only query the
+ * current state.
+ *
+ * @param queue The queue
+ * @param entry The entry to be registered, or NULL
+ */
+void
+poll_queue_add(struct PollQueue *queue, struct PollEntry *entry)
+{
+  if (entry == NULL)
+    return;
+
+  if (entry->queue != NULL)
+    panic("poll entry already registered");
+
+  k_spinlock_acquire(&queue->lock);
+  entry->queue = queue;
+  k_list_add_back(&queue->entries, &entry->link);
+  k_spinlock_release(&queue->lock);
+}
+
+/**
+ * Remove an entry from the queue it is registered on (if any).
+ *
+ * @param entry The entry
+ */
+void
+poll_entry_remove(struct PollEntry *entry)
+{
+  struct PollQueue *queue = entry->queue;
+
+  if (queue == NULL)
+    return;
+
+  k_spinlock_acquire(&queue->lock);
+  k_list_remove(&entry->link);
+  entry->queue = NULL;
+  k_spinlock_release(&queue->lock);
+}
+
+/**
+ * Notify all entries registered on the queue that the object state may have
+ * changed.
+ *
+ * @param queue  The queue
+ * @param events The events that may have become pending
+ */
+void
+poll_queue_notify(struct PollQueue *queue, int events)
+{
+  struct KListLink *l;
+
+  k_spinlock_acquire(&queue->lock);
+
+  KLIST_FOREACH(&queue->entries, l) {
+    struct PollEntry *entry = KLIST_CONTAINER(l, struct PollEntry, link);
+
+    entry->notify(entry, events);
+  }
+
+  k_spinlock_release(&queue->lock);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Waiting for a set of files
+ * ----------------------------------------------------------------------------
+ *
+ * poll_fds() registers one entry on every file at once, so a single state
+ * change on any of them wakes the caller up. The whole set is scanned again
+ * after each wakeup, persistent interest sets (see epoll.c) avoid that.
+ */
+
+struct PollTable {
+  struct KSpinLock  lock;
+  struct KWaitQueue queue;
+  int               triggered;    ///< Some file has changed its state
+};
+
+struct PollTableEntry {
+  struct PollEntry  entry;
+  struct PollTable *table;
+  struct File      *file;
+  short             events;       ///< The events the caller is interested in
+};
+
+static void
+poll_table_notify(struct PollEntry *entry, int events)
+{
+  struct PollTableEntry *pte = (struct PollTableEntry *) entry;
+  struct PollTable *table = pte->table;
+
+  if (!(events & (pte->events | POLLERR | POLLHUP)))
+    return;
+
+  k_spinlock_acquire(&table->lock);
+  table->triggered = 1;
+  k_waitqueue_wakeup_all(&table->queue);
+  k_spinlock_release(&table->lock);
+}
+
+/**
+ * Wait for events on a set of file descriptors of the current process.
+ *
+ * @param fds     The descriptors and the requested events, the revents fields
+ *                are filled in on return
+ * @param nfds    The number of descriptors
+ * @param timeout The maximum number of ticks to wait, 0 to return
+ *                immediately, or a negative value to wait indefinitely
+ *
+ * @return The number of descriptors with pending events, or a negative error
+ *         code.
+ */
+int
+poll_fds(struct pollfd *fds, nfds_t nfds, long timeout)
+{
+  struct PollTableEntry *entries = NULL;
+  struct PollTable table;
+  unsigned long long deadline;
+  nfds_t i;
+  int r, ready, registered;
+
+  if (nfds > OPEN_MAX)
+    return -EINVAL;
+
+  if ((nfds > 0) &&
+      ((entries = (struct PollTableEntry *) k_malloc(nfds * sizeof(*entries))) == NULL))
+    return -ENOMEM;
+
+  k_spinlock_init(&table.lock, "poll_table");
+  k_waitqueue_init(&table.queue);
+  table.triggered = 0;
+
+  for (i = 0; i < nfds; i++) {
+    poll_entry_init(&entries[i].entry, poll_table_notify);
+    entries[i].table  = &table;
+    entries[i].events = fds[i].events;
+    entries[i].file   = (fds[i].fd < 0) ? NULL
+                                        : fd_lookup(process_current(), fds[i].fd);
+  }
+
+  deadline = (timeout > 0) ? k_tick_get() + timeout : 0;
+
+  for (registered = 0; ; registered = 1) {
+    for (i = 0, ready = 0; i < nfds; i++) {
+      struct PollTableEntry *pte = &entries[i];
+
+      if (pte->file != NULL) {
+        fds[i].revents = file_poll(pte->file, registered ? NULL : &pte->entry) &
+                         (pte->events | POLLERR | POLLHUP);
+      } else {
+        fds[i].revents = (fds[i].fd < 0) ? 0 : POLLNVAL;
+      }
+
+      if (fds[i].revents != 0)
+        ready++;
+    }
+
+    if ((ready > 0) || (timeout == 0)) {
+      r = ready;
+      break;
+    }
+
+    k_spinlock_acquire(&table.lock);
+
+    for (r = 0; !table.triggered && (r == 0); ) {
+      unsigned long long now = k_tick_get();
+
+      if ((timeout > 0) && (now >= deadline)) {
+        r = -ETIMEDOUT;
+        break;
+      }
+
+      r = k_waitqueue_timed_sleep(&table.queue, &table.lock,
+                                  (timeout > 0) ? deadline - now : 0);
+    }
+
+    table.triggered = 0;
+
+    k_spinlock_release(&table.lock);
+
+    if (r == -ETIMEDOUT) {
+      r = 0;
+      break;
+    }
+    if (r < 0)
+      break;
+  }
+
+  for (i = 0; i < nfds; i++) {
+    if (entries[i].file != NULL) {
+      poll_entry_remove(&entries[i].entry);
+      file_put(entries[i].file);
+    }
+  }
+
+  if (entries != NULL)
+    k_free(entries);
+
+  return r;
+}
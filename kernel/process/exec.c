@@ -12,137 +12,455 @@
 #include <kernel/vm.h>
 #include <kernel/page.h>
 #include <kernel/process.h>
+#include <kernel/time.h>
 #include <kernel/vmspace.h>
 #include <kernel/types.h>
 #include <kernel/core/irq.h>
 
+#include "process_private.h"
+
 #define STACK_BOTTOM  (VIRT_USTACK_TOP - USTACK_SIZE)
 #define STACK_PROT    (PROT_READ | PROT_WRITE | VM_USER)
 
+#define VEC_MAX 31
+
+/*
+ * The initial stack contents (the argument and environment strings and their
+ * vectors) are gathered in kernel pages, copying each string straight from
+ * the old address space in a single pass. The pages are then mapped as the
+ * top of the new stack, so nothing has to be copied again.
+ *
+ * The vectors are only complete once the interpreter (if any) is known, so
+ * room for them is left at the start of the area, and the strings follow.
+ * The area is placed so that it ends at the top of the stack.
+ */
+
+/** The most pages taken by the initial stack contents */
+#define EXEC_ARGS_PAGES   3
+#define EXEC_ARGS_SIZE    (EXEC_ARGS_PAGES * PAGE_SIZE)
+
+/** The number of auxiliary vector entries, including AT_NULL */
+#define EXEC_AUXV_MAX     7
+
+/** Room reserved for the vectors at the start of the area */
+#define EXEC_VEC_SIZE     ((2 * (VEC_MAX + 2) + 2 * EXEC_AUXV_MAX) * \
+                           sizeof(uintptr_t))
+
+/** The longest interpreter path, including the terminating NUL */
+#define EXEC_INTERP_MAX   64
+
+struct ExecArgs {
+  struct Page    *pages[EXEC_ARGS_PAGES];
+  size_t          len;              ///< Bytes used, including the vectors
+};
+
+struct ExecContext {
+  struct Inode   *inode;
+  struct VMSpace *vm;
+  struct ExecArgs args;
+  uintptr_t       argv[VEC_MAX + 2];  ///< Offsets of the strings in args
+  int             argc;
+  uintptr_t       envp[VEC_MAX + 2];  ///< Offsets of the strings in args
+  int             envc;
+  uintptr_t       argv_va;
+  uintptr_t       env_va;
+  uintptr_t       sp_va;
+  uintptr_t       entry_va;         ///< Where execution starts
+  uintptr_t       prog_va;          ///< Entry point of the program itself
+  uintptr_t       phdr_va;          ///< Program headers, 0 if not mapped
+  int             phnum;
+  char            interp[EXEC_INTERP_MAX];  ///< Empty if statically linked
+};
+
+static void
+exec_args_init(struct ExecArgs *args)
+{
+  unsigned i;
+
+  for (i = 0; i < EXEC_ARGS_PAGES; i++)
+    args->pages[i] = NULL;
+  args->len = EXEC_VEC_SIZE;
+}
+
+// Free the pages that have not been mapped
+static void
+exec_args_free(struct ExecArgs *args)
+{
+  unsigned i;
+
+  for (i = 0; i < EXEC_ARGS_PAGES; i++) {
+    if (args->pages[i] != NULL) {
+      page_free_one(args->pages[i]);
+      args->pages[i] = NULL;
+    }
+  }
+}
+
+// Get the kernel address of the given offset into the area, allocating the
+// page if necessary
+static char *
+exec_args_kva(struct ExecArgs *args, size_t off)
+{
+  struct Page **pp = &args->pages[off / PAGE_SIZE];
+
+  if ((*pp == NULL) &&
+      ((*pp = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_ANON)) == NULL))
+    return NULL;
+
+  return (char *) page2kva(*pp) + off % PAGE_SIZE;
+}
+
+// Copy kernel data into the area at the given offset
 static int
-user_stack_put(struct VMSpace *vm, const void *buf, size_t n, uintptr_t *va_p)
+exec_args_write(struct ExecArgs *args, size_t off, const void *src, size_t n)
 {
-  uintptr_t va = ROUND_DOWN(*va_p - n, sizeof(uintptr_t));
-  int r;
+  const char *s = (const char *) src;
 
-  if (va < STACK_BOTTOM)
+  if (off + n > EXEC_ARGS_SIZE)
     return -E2BIG;
 
-  if ((r = vm_copy_out(vm->pgtab, buf, va, n)) < 0)
-    return r;
+  while (n > 0) {
+    size_t ncopy = MIN(PAGE_SIZE - off % PAGE_SIZE, n);
+    char *kva;
+
+    if ((kva = exec_args_kva(args, off)) == NULL)
+      return -ENOMEM;
+
+    memcpy(kva, s, ncopy);
 
-  *va_p = va;
+    off += ncopy;
+    s   += ncopy;
+    n   -= ncopy;
+  }
 
   return 0;
 }
 
+// Append a kernel string to the area, return its offset
 static int
-user_stack_put_string(struct VMSpace *vm, const char *s, uintptr_t *va_p)
+exec_args_put_str(struct ExecArgs *args, const char *str, uintptr_t *off_store)
 {
-  return user_stack_put(vm, s, strlen(s) + 1, va_p);
+  size_t n = strlen(str) + 1;
+  int r;
+
+  if ((r = exec_args_write(args, args->len, str, n)) < 0)
+    return r;
+
+  *off_store = args->len;
+  args->len += n;
+
+  return 0;
 }
 
-#define VEC_MAX 31
+// Append a string from the current address space to the area, taking at most
+// max bytes (including the terminating NUL)
+static int
+exec_args_copy_in_str(struct ExecArgs *args, uintptr_t va, size_t max,
+                      uintptr_t *off_store)
+{
+  struct VMSpace *vm = process_current()->vm;
+  size_t off = args->len;
+  int r;
+
+  max = MIN(max, EXEC_ARGS_SIZE - off);
+
+  for (;;) {
+    size_t room = MIN(PAGE_SIZE - off % PAGE_SIZE, max - (off - args->len));
+    char *kva;
+
+    if (room == 0)
+      return -E2BIG;
+
+    if ((kva = exec_args_kva(args, off)) == NULL)
+      return -ENOMEM;
 
+    r = vm_copy_in_str(vm, kva, va, room, VM_READ | VM_USER);
+
+    if (r >= 0) {
+      *off_store = args->len;
+      args->len  = off + r + 1;
+      return 0;
+    }
+
+    // The string continues on the next page of the area
+    if (r != -ENAMETOOLONG)
+      return r;
+
+    off += room;
+    va  += room;
+  }
+}
+
+// Gather a NULL-terminated vector of strings from the current address space
 static int
-user_stack_put_strings(struct VMSpace *vm, char *const args[],
-                       uintptr_t *args_va, uintptr_t *va_p, int *argc_p)
+exec_args_copy_in(struct ExecArgs *args, uintptr_t va, uintptr_t *offs,
+                  int *count_store)
 {
-  int i, r;
-  uintptr_t va;
+  struct VMSpace *vm = process_current()->vm;
+  uintptr_t ptrs[VEC_MAX + 2];
+  size_t count, total, i, n;
+  int r;
+
+  if (va % sizeof(uintptr_t) != 0)
+    return -EFAULT;
+
+  // Fetch the pointers, up to a page at a time, until the terminating NULL
+  for (count = 0; ; count += n) {
+    uintptr_t chunk_va = va + count * sizeof(uintptr_t);
+
+    if (count == VEC_MAX + 2)
+      return -E2BIG;
 
-  for (va = *va_p, i = 0; args[i] != NULL; i++) {
-    if (i > VEC_MAX)
+    n = MIN(VEC_MAX + 2 - count,
+            (PAGE_SIZE - chunk_va % PAGE_SIZE) / sizeof(uintptr_t));
+
+    if ((r = vm_user_check_buf(vm, chunk_va, n * sizeof(uintptr_t),
+                               VM_READ | VM_USER)) < 0)
+      return r;
+    if ((r = vm_copy_in(vm, &ptrs[count], chunk_va,
+                        n * sizeof(uintptr_t))) < 0)
+      return r;
+
+    for (i = count; (i < count + n) && (ptrs[i] != 0); i++)
+      ;
+
+    if (i < count + n) {
+      count = i;
+      break;
+    }
+  }
+
+  // The vector and the strings together must not exceed ARG_MAX
+  total = (count + 1) * sizeof(uintptr_t);
+
+  for (i = 0; i < count; i++) {
+    size_t start = args->len;
+
+    if (total >= ARG_MAX)
       return -E2BIG;
 
-    if ((r = user_stack_put_string(vm, args[i], &va)))
+    if ((r = exec_args_copy_in_str(args, ptrs[i], ARG_MAX - total,
+                                   &offs[i])) < 0)
       return r;
 
-    args_va[i] = va;
+    total += args->len - start;
   }
-  args_va[i] = (uintptr_t) NULL;
+  offs[count] = 0;
 
-  *va_p = va;
-  *argc_p = i;
+  *count_store = count;
 
   return 0;
 }
 
+// Convert the string offsets into user addresses and store the vector
 static int
-user_stack_put_vector(struct VMSpace *vm, uintptr_t *vec, int count,
-                      uintptr_t *va_p)
+exec_args_put_vector(struct ExecArgs *args, size_t off, const uintptr_t *offs,
+                     int count, uintptr_t base)
 {
-  return user_stack_put(vm, vec, (count + 1) * sizeof(uintptr_t), va_p);
-}
+  uintptr_t vec[VEC_MAX + 2];
+  int i;
 
-struct ExecContext {
-  struct Inode   *inode;
-  struct VMSpace *vm;
-  uintptr_t       argv[VEC_MAX + 1];
-  int             argc;
-  uintptr_t       envp[VEC_MAX + 1];
-  int             envc;
-  uintptr_t       argv_va;
-  uintptr_t       env_va;
-  uintptr_t       sp_va;
-  uintptr_t       entry_va;
-};
+  for (i = 0; i < count; i++)
+    vec[i] = base + offs[i];
+  vec[count] = (uintptr_t) NULL;
 
-int
-user_stack_init(char *const argv[], char *const envp[], struct ExecContext *e)
+  return exec_args_write(args, off, vec, (count + 1) * sizeof(uintptr_t));
+}
+
+// Complete the initial stack contents and map them at the top of the stack
+static int
+user_stack_init(struct ExecContext *ctx)
 {
-  uintptr_t va;
+  struct ExecArgs *args = &ctx->args;
+  uintptr_t auxv[2 * EXEC_AUXV_MAX] = {
+    AT_PHDR,   ctx->phdr_va,
+    AT_PHENT,  sizeof(Elf32_Phdr),
+    AT_PHNUM,  ctx->phnum,
+    AT_PAGESZ, PAGE_SIZE,
+    AT_BASE,   (ctx->interp[0] != '\0') ? VIRT_INTERP_BASE : 0,
+    AT_ENTRY,  ctx->prog_va,
+    AT_NULL,   0,
+  };
+  size_t npages, auxv_off, env_off, argv_off;
+  uintptr_t base, va;
+  unsigned i;
   int r;
 
-  va = vmspace_map(e->vm, STACK_BOTTOM, USTACK_SIZE, STACK_PROT);
-  if (va != STACK_BOTTOM)
-    return (int) va;
+  npages = ROUND_UP(args->len, PAGE_SIZE) / PAGE_SIZE;
+  base   = VIRT_USTACK_TOP - npages * PAGE_SIZE;
 
-  // Copy args and environment.
-  va = VIRT_USTACK_TOP;
+  // The auxiliary vector goes right below the strings, the environment
+  // vector below it, and the arguments vector below that. The dynamic loader
+  // finds the auxiliary vector after the end of the environment.
+  auxv_off = EXEC_VEC_SIZE - sizeof(auxv);
+  env_off  = auxv_off - (ctx->envc + 1) * sizeof(uintptr_t);
+  argv_off = env_off - (ctx->argc + 1) * sizeof(uintptr_t);
 
-  // Copy the environment strings
-  if ((r = user_stack_put_strings(e->vm, envp, e->envp, &va, &e->envc)) != 0)
+  if ((r = exec_args_write(args, auxv_off, auxv, sizeof(auxv))) < 0)
     return r;
-  
-  // Copy the initial argument strings (additional arguments may be put later)
-  if ((r = user_stack_put_strings(e->vm, argv, e->argv, &va, &e->argc)) != 0)
+  if ((r = exec_args_put_vector(args, env_off, ctx->envp, ctx->envc,
+                                base)) < 0)
     return r;
+  if ((r = exec_args_put_vector(args, argv_off, ctx->argv, ctx->argc,
+                                base)) < 0)
+    return r;
+
+  ctx->env_va  = base + env_off;
+  ctx->argv_va = base + argv_off;
+
+  // Stack must be aligned to an 8-byte boundary in order for variadic args
+  // to properly work (at least on ARM)!
+  ctx->sp_va = ROUND_DOWN(ctx->argv_va, 8);
+
+  va = vmspace_map(ctx->vm, STACK_BOTTOM, USTACK_SIZE, STACK_PROT);
+  if (va != STACK_BOTTOM)
+    return (int) va;
+
+  // The pages become the ones the stack would get on the first access
+  for (i = 0; i < npages; i++) {
+    if ((r = vm_user_map(ctx->vm, args->pages[i], base + i * PAGE_SIZE,
+                         STACK_PROT)) < 0)
+      return r;
+
+    // The mapping now holds the only reference
+    args->pages[i] = NULL;
+  }
+
+  return 0;
+}
+
+/*
+ * The headers of an executable are read and checked once, then kept with its
+ * inode until the file is modified or the inode is recycled: the program
+ * headers of an ELF file, or the interpreter named on the #! line of a script.
+ * Tools run over and over by scripts then need no header I/O or parsing.
+ */
+
+/** How much of the file is read at once to find the headers */
+#define EXEC_HEAD_SIZE    1024
+/** The most program headers in an ELF file */
+#define EXEC_PHNUM_MAX    128
+
+struct ExecImage {
+  /** The interpreter named by #!, NULL for ELF files */
+  char       *script;
+  Elf32_Ehdr  elf;
+  /** The contents of PT_INTERP, empty if none */
+  char        interp[EXEC_INTERP_MAX];
+  /** Malformed PT_INTERP, only an error if the file is the program itself */
+  int         interp_bad;
+  /** The program headers, or the #! interpreter path of a script */
+  Elf32_Phdr  ph[];
+};
+
+// Read and check the headers of an executable file
+static int
+exec_image_read(struct Inode *inode, struct ExecImage **image_store)
+{
+  uint32_t buf[EXEC_HEAD_SIZE / sizeof(uint32_t)];
+  char *head = (char *) buf;
+  Elf32_Ehdr *elf = (Elf32_Ehdr *) buf;
+  struct ExecImage *image;
+  size_t ph_size;
+  off_t off;
+  int i, n, r;
+
+  off = 0;
+  if ((n = fs_inode_read_locked(inode, (uintptr_t) buf, sizeof(buf),
+                                &off)) < 0)
+    return n;
+
+  if ((n >= 3) && (head[0] == '#') && (head[1] == '!')) {
+    for (i = 2; i < n; i++)
+      if ((head[i] == ' ') || (head[i] == '\t') || (head[i] == '\n'))
+        break;
+
+    if ((image = (struct ExecImage *) k_malloc(sizeof(*image) + i - 1)) == NULL)
+      return -ENOMEM;
+
+    image->script = (char *) image->ph;
+    memcpy(image->script, &head[2], i - 2);
+    image->script[i - 2] = '\0';
 
-  e->sp_va = va;
+    *image_store = image;
+    return 0;
+  }
+
+  if ((n < (int) sizeof(*elf)) ||
+      (memcmp(elf->ident, "\x7f""ELF", 4) != 0) ||
+      (elf->phentsize != sizeof(Elf32_Phdr)) ||
+      (elf->phnum > EXEC_PHNUM_MAX))
+    return -EINVAL;
+
+  ph_size = elf->phnum * sizeof(Elf32_Phdr);
+
+  if ((image = (struct ExecImage *) k_malloc(sizeof(*image) + ph_size)) == NULL)
+    return -ENOMEM;
 
+  image->script     = NULL;
+  image->elf        = *elf;
+  image->interp[0]  = '\0';
+  image->interp_bad = 0;
+
+  // The program headers normally follow the ELF header, within the first read
+  if ((elf->phoff <= (size_t) n) && (ph_size <= n - elf->phoff)) {
+    memcpy(image->ph, head + elf->phoff, ph_size);
+  } else {
+    off = elf->phoff;
+    if ((r = fs_inode_read_locked(inode, (uintptr_t) image->ph, ph_size,
+                                  &off)) != (int) ph_size) {
+      k_free(image);
+      return (r < 0) ? r : -EINVAL;
+    }
+  }
+
+  for (i = 0; i < image->elf.phnum; i++) {
+    Elf32_Phdr *ph = &image->ph[i];
+
+    if (ph->type != PT_INTERP)
+      continue;
+
+    off = ph->offset;
+    if ((ph->filesz < 2) || (ph->filesz > EXEC_INTERP_MAX) ||
+        (fs_inode_read_locked(inode, (uintptr_t) image->interp, ph->filesz,
+                              &off) != (int) ph->filesz) ||
+        (image->interp[ph->filesz - 1] != '\0')) {
+      image->interp[0]  = '\0';
+      image->interp_bad = 1;
+    }
+  }
+
+  *image_store = image;
   return 0;
 }
 
+// Get the headers of an executable, reading them on first use. The inode must
+// be locked, and the headers may only be used until it is unlocked.
 static int
-user_stack_finalize(struct ExecContext *ctx)
+exec_image_get(struct Inode *inode, struct ExecImage **image_store)
 {
-  uintptr_t usp = ctx->sp_va;
+  struct ExecImage *image;
   int r;
 
-  // Put the final environment vector
-  if ((r = user_stack_put_vector(ctx->vm, ctx->envp, ctx->envc, &usp)) < 0)
-    return r;
-  ctx->env_va = usp;
-
-  // Put the final arguments vector
-  if ((r = user_stack_put_vector(ctx->vm, ctx->argv, ctx->argc, &usp)) < 0)
-    return r;
-  ctx->argv_va = usp;
+  // Reading the file requires the permission, whether it is cached or not
+  if (!fs_permission(inode, FS_PERM_READ, 0))
+    return -EPERM;
 
-  // Stack must be aligned to an 8-byte boundary in order for variadic args
-  // to properly work (at least on ARM)!
-  usp = ROUND_DOWN(usp, 8);
-  ctx->sp_va = usp;
+  if (inode->exec_image == NULL) {
+    if ((r = exec_image_read(inode, &image)) < 0)
+      return r;
+    inode->exec_image = image;
+  }
 
+  *image_store = (struct ExecImage *) inode->exec_image;
   return 0;
 }
 
 static int
 resolve_inode(struct Inode *inode, char *p, struct ExecContext *ctx, char **pp)
 {
-  char buf[1024];
-  off_t off;
+  struct ExecImage *image;
+  uintptr_t off_p;
   int i, r;
 
   if (!S_ISREG(inode->mode))
@@ -151,35 +469,29 @@ resolve_inode(struct Inode *inode, char *p, struct ExecContext *ctx, char **pp)
   if (!fs_permission(inode, FS_PERM_EXEC, 0))
     return -EPERM;
 
-  off = 0;
-  if ((r = fs_inode_read_locked(inode, (uintptr_t) buf, 1024, &off)) < 0) 
+  if ((r = exec_image_get(inode, &image)) < 0)
     return r;
 
-  if ((r < 3) || (buf[0] != '#') || (buf[1] != '!')) {
+  if (image->script == NULL) {
     *pp = NULL;
     return 0;
   }
 
-  for (i = 2; i < r; i++)
-    if ((buf[i] == ' ') || (buf[i] == '\t') || (buf[i] == '\n'))
-      break;
-  buf[i] = '\0';
-
   if (ctx->argc > VEC_MAX)
     return -E2BIG;
   
-  if ((r = user_stack_put_string(ctx->vm, p, &ctx->sp_va)) < 0)
+  if ((r = exec_args_put_str(&ctx->args, p, &off_p)) < 0)
     return r;
 
   for (i = ctx->argc; i > 0; i--)
     ctx->argv[i + 1] = ctx->argv[i];
-  ctx->argv[1] = ctx->sp_va;
+  ctx->argv[1] = off_p;
   ctx->argc++;
 
-  if ((p = k_malloc(strlen(&buf[2]) + 1)) == NULL)
+  if ((p = k_malloc(strlen(image->script) + 1)) == NULL)
     return -ENOMEM;
 
-  strncpy(p, &buf[2], strlen(&buf[2]) + 1);
+  strcpy(p, image->script);
 
   *pp = p;
 
@@ -227,120 +539,133 @@ resolve(const char *path, struct ExecContext *ctx)
   return 0;
 }
 
+// Map the loadable segments of an ELF file, adding base to their addresses.
+// For the program itself (interp is not NULL), also find where its headers
+// end up and the name of its interpreter.
 static int
-load_elf(struct ExecContext *ctx)
+load_elf_image(struct ExecContext *ctx, struct Inode *inode, uintptr_t base,
+               Elf32_Ehdr *elf, char *interp)
 {
-  Elf32_Ehdr elf;
-  Elf32_Phdr ph;
-  int r;
-  off_t off;
-  uintptr_t a;
+  struct ExecImage *image;
+  Elf32_Phdr *ph;
+  int i, r, prot;
+  uintptr_t a, va, delta;
 
-  off = 0;
-  if ((r = fs_inode_read_locked(ctx->inode, (uintptr_t) &elf, sizeof(elf),
-                                &off)) != sizeof(elf))
+  if ((r = exec_image_get(inode, &image)) < 0)
+    return r;
+
+  if (image->script != NULL)
     return -EINVAL;
 
-  if (memcmp(elf.ident, "\x7f""ELF", 4) != 0)
+  *elf = image->elf;
+
+  // Programs run at their link addresses, the interpreter is relocatable
+  if (elf->type != ((base == 0) ? ET_EXEC : ET_DYN))
     return -EINVAL;
 
-  off = elf.phoff;
-  while ((size_t) off < elf.phoff + elf.phnum * sizeof(ph)) {
-    if ((r = fs_inode_read_locked(ctx->inode, (uintptr_t) &ph, sizeof(ph),
-                                  &off)) != sizeof(ph))
-      return r;
+  if (interp != NULL) {
+    if (image->interp_bad)
+      return -EINVAL;
+    strcpy(interp, image->interp);
+  }
+
+  for (i = 0; i < elf->phnum; i++) {
+    ph = &image->ph[i];
+
+    if (ph->type == PT_PHDR) {
+      if (interp != NULL)
+        ctx->phdr_va = ph->vaddr;
+      continue;
+    }
 
-    if (ph.type != PT_LOAD)
+    if (ph->type != PT_LOAD)
       continue;
 
-    if (ph.filesz > ph.memsz)
+    if (ph->filesz > ph->memsz)
       return -EINVAL;
 
-    if ((ph.vaddr >= VIRT_KERNEL_BASE) || (ph.vaddr + ph.memsz > VIRT_KERNEL_BASE))
+    va = base + ph->vaddr;
+    if ((va < base) || (va >= VIRT_KERNEL_BASE) ||
+        (va + ph->memsz > VIRT_KERNEL_BASE))
       return -EINVAL;
 
-    a = vmspace_map(ctx->vm, ph.vaddr, ph.memsz,
-                    PROT_READ | PROT_WRITE | PROT_EXEC | VM_USER);
-    if (a != ph.vaddr)
-      return (int) a;
+    // The segment may start in the middle of a page, at the same offset as
+    // in the file
+    delta = va % PAGE_SIZE;
+    if ((ph->offset % PAGE_SIZE) != delta)
+      return -EINVAL;
 
-    if ((r = vm_space_load_inode(ctx->vm->pgtab, (void *) ph.vaddr, ctx->inode,
-                                 ph.filesz, ph.offset)) < 0)
-      return r;
+    // Without PT_PHDR, find the headers in the segment that contains them
+    if ((interp != NULL) && (ctx->phdr_va == 0) &&
+        (elf->phoff >= ph->offset) &&
+        (elf->phoff + elf->phnum * sizeof(*ph) <= ph->offset + ph->filesz))
+      ctx->phdr_va = va + (elf->phoff - ph->offset);
+
+    prot = VM_USER;
+    if (ph->flags & PF_R)
+      prot |= PROT_READ;
+    if (ph->flags & PF_W)
+      prot |= PROT_WRITE;
+    if (ph->flags & PF_X)
+      prot |= PROT_EXEC;
+
+    // The segment contents are read on first access. Read-only pages are
+    // shared with other processes running the same binary.
+    a = vmspace_map_file(ctx->vm, va - delta, ph->memsz + delta, prot,
+                         inode, ph->offset - delta, ph->filesz + delta);
+    if (a != va - delta)
+      return (int) a;
   }
 
-  ctx->entry_va = elf.entry;
-
   return 0;
 }
 
-static void
-sys_free_args(char **args)
+static int
+load_elf(struct ExecContext *ctx)
 {
-  char **p;
+  Elf32_Ehdr elf;
+  int r;
+
+  ctx->interp[0] = '\0';
+  ctx->phdr_va   = 0;
 
-  for (p = args; *p != NULL; p++)
-    k_free(*p);
+  if ((r = load_elf_image(ctx, ctx->inode, 0, &elf, ctx->interp)) != 0)
+    return r;
+
+  ctx->phnum    = elf.phnum;
+  ctx->prog_va  = elf.entry;
+  ctx->entry_va = elf.entry;
 
-  k_free(args);
+  return 0;
 }
 
+// Load the dynamic loader named by the PT_INTERP header of the program. The
+// program is mapped already, the loader starts first and then passes control
+// to it.
 static int
-copy_in_args(uintptr_t va, char ***store)
+load_interp(struct ExecContext *ctx)
 {
-  void *pgtab = process_current()->vm->pgtab;
-  char **args;
-  size_t len;
-  size_t total_len;
+  struct Inode *inode;
+  Elf32_Ehdr elf;
   int r;
 
-  if ((vm_user_check_args(pgtab, va, &len, VM_READ | VM_USER)) < 0)
+  if ((r = fs_lookup_inode(ctx->interp, 0, &inode)) < 0)
     return r;
-  
-  total_len = (len + 1) * sizeof(char *);
-  if (total_len > ARG_MAX)
-    return -E2BIG;
-
-  if ((args = (char **) k_malloc(total_len)) == NULL)
-    return -ENOMEM;
-
-  memset(args, 0, total_len);
 
-  for (size_t i = 0; i < len; i++) {
-    uintptr_t str_va;
-    size_t str_len;
-
-    if ((r = vm_copy_in(pgtab, &str_va, va + (sizeof(char *)*i),
-                        sizeof str_va)) < 0) {
-      sys_free_args(args);
-      return r;
-    }
+  fs_inode_lock(inode);
 
-    if ((r = vm_user_check_str(pgtab, str_va, &str_len,
-                               VM_READ | VM_USER)) < 0) {
-      sys_free_args(args);
-      return r;
-    }
-
-    total_len += str_len + 1;
-    if (total_len > ARG_MAX) {
-      sys_free_args(args);
-      return -E2BIG;
-    }
+  if (!S_ISREG(inode->mode))
+    r = -ENOENT;
+  else
+    r = load_elf_image(ctx, inode, VIRT_INTERP_BASE, &elf, NULL);
 
-    if ((args[i] = k_malloc(str_len + 1)) == NULL) {
-      sys_free_args(args);
-      return -ENOMEM;
-    }
+  fs_inode_unlock(inode);
+  fs_inode_put(inode);
 
-    if ((vm_copy_in(pgtab, args[i], str_va, str_len + 1) != 0) ||
-         (args[i][str_len] != '\0')) {
-      sys_free_args(args);
-      return -EFAULT;
-    }
-  }
+  if (r != 0)
+    return r;
 
-  if (store) *store = args;
+  ctx->entry_va = VIRT_INTERP_BASE + elf.entry;
 
   return 0;
 }
@@ -353,36 +678,42 @@ process_exec(const char *path, uintptr_t argv_va, uintptr_t envp_va)
   int r;
   struct ExecContext ctx;
 
-  char **argv, **envp;
+  // All other threads are terminated before loading the new program
+  if ((r = _process_single_thread(process_current())) != 0)
+    goto out1;
 
   if ((ctx.vm = vm_space_create()) == NULL) {
     r = -ENOMEM;
     goto out1;
   }
 
-  if ((r = copy_in_args(argv_va, &argv)) != 0)
-    goto out2;
+  exec_args_init(&ctx.args);
+
+  if ((r = exec_args_copy_in(&ctx.args, argv_va, ctx.argv, &ctx.argc)) != 0)
+    goto out3;
   
-  if ((r = copy_in_args(envp_va, &envp)) != 0)
+  if ((r = exec_args_copy_in(&ctx.args, envp_va, ctx.envp, &ctx.envc)) != 0)
     goto out3;
 
-  if ((r = user_stack_init(argv, envp, &ctx)) != 0)
-    goto out4;
+  if ((r = vmspace_map_page(ctx.vm, VIRT_TIMEPAGE, time_page,
+                            VM_READ | VM_USER)) != 0)
+    goto out3;
 
   if ((r = resolve(path, &ctx)) != 0)
-    goto out4;
-
-  if ((r = user_stack_finalize(&ctx)) != 0)
-    goto out5;
+    goto out3;
 
   if ((r = load_elf(&ctx)) != 0)
-    goto out5;
+    goto out4;
 
   fs_inode_unlock(ctx.inode);
   fs_inode_put(ctx.inode);
 
-  sys_free_args(envp);
-  sys_free_args(argv);
+  // Dynamically linked programs start in the interpreter
+  if ((ctx.interp[0] != '\0') && ((r = load_interp(&ctx)) != 0))
+    goto out3;
+
+  if ((r = user_stack_init(&ctx)) != 0)
+    goto out3;
 
   proc = process_current();
 
@@ -390,25 +721,31 @@ process_exec(const char *path, uintptr_t argv_va, uintptr_t envp_va)
 
   strncpy(proc->name, path, 63);
 
+  // Under the process lock, see process_get_areas()
+  process_lock();
   old_vm = proc->vm;
   proc->vm = ctx.vm;
+  process_unlock();
+
+  arch_vm_load(ctx.vm->pgtab, &ctx.vm->asid);
 
-  arch_vm_load(ctx.vm->pgtab);
-  vm_space_destroy(old_vm);
+  proc->thread->tls = 0;
+  arch_thread_load_tls(proc->thread);
+
+  // The old address space of a vfork() child belongs to the parent
+  if (!_process_vfork_release(proc))
+    vm_space_destroy_deferred(old_vm);
 
   return arch_trap_frame_init(proc->thread->tf, ctx.entry_va, ctx.argc,
                               ctx.argv_va, 
                               ctx.env_va,
                               ctx.sp_va);
 
-out5:
+out4:
   fs_inode_unlock(ctx.inode);
   fs_inode_put(ctx.inode);
-out4:
-  sys_free_args(envp);
 out3:
-  sys_free_args(argv);
-out2:
+  exec_args_free(&ctx.args);
   vm_space_destroy(ctx.vm);
 out1:
   return r;
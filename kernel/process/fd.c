@@ -1,119 +1,202 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <string.h>
 
 #include <kernel/assert.h>
 #include <kernel/console.h>
 #include <kernel/process.h>
 #include <kernel/fd.h>
 #include <kernel/fs/file.h>
+#include <kernel/object_pool.h>
+#include <kernel/types.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * File descriptor tables
+ * ----------------------------------------------------------------------------
+ *
+ * The lowest FD_INLINE descriptors live in an array embedded in the process
+ * descriptor, which is all most processes ever need. When a higher descriptor
+ * is allocated, the table is moved to a heap array that doubles in size as
+ * needed, up to OPEN_MAX entries. fd_end tracks one more than the highest open
+ * descriptor, so that fork, exec and exit only visit the slots in use.
+ *
+ * The table is shared by all threads of the process, so every access, lookups
+ * included, is serialized by fd_lock. A lookup takes its reference to the
+ * file before the lock is dropped, so that a close() on another thread cannot
+ * free the file under it, and a replaced table is no longer reachable once the
+ * lock is released, so it is freed right away. A file is only put after its
+ * slot has been cleared and the lock released, since closing it may sleep.
+ */
 
 static struct FileDesc *_fd_lookup(struct Process *, int);
-static void             _fd_close(struct FileDesc *);
+static struct File     *_fd_clear(struct FileDesc *);
+static int              _fd_grow(struct Process *, int);
+static void             _fd_trim(struct Process *);
+static void             _fd_table_reset(struct Process *);
 
 void
 fd_init(struct Process *process)
 {
   int i;
 
-  for (i = 0; i < OPEN_MAX; i++) {
-    process->fd[i].file  = NULL;
-    process->fd[i].flags = 0;
+  for (i = 0; i < FD_INLINE; i++) {
+    process->fd_inline[i].file  = NULL;
+    process->fd_inline[i].flags = 0;
   }
 
+  process->fd      = process->fd_inline;
+  process->fd_size = FD_INLINE;
+  process->fd_end  = 0;
+
   k_spinlock_init(&process->fd_lock, "fd_lock");
 }
 
-void
-fd_close_all(struct Process *process)
+// Close the descriptors matching the flags (all of them if zero)
+static void
+_fd_close_matching(struct Process *process, int flags)
 {
+  struct File *file;
   int i;
 
-  // TODO: no need to lock?
+  k_spinlock_acquire(&process->fd_lock);
+
+  for (i = 0; i < process->fd_end; i++) {
+    struct FileDesc *fd = &process->fd[i];
+
+    if ((fd->file == NULL) || ((flags != 0) && !(fd->flags & flags)))
+      continue;
 
-  for (i = 0; i < OPEN_MAX; i++)
-    if (process->fd[i].file != NULL)
-      _fd_close(&process->fd[i]);
+    file = _fd_clear(fd);
+
+    k_spinlock_release(&process->fd_lock);
+    file_put(file);
+    k_spinlock_acquire(&process->fd_lock);
+  }
+
+  _fd_trim(process);
+
+  k_spinlock_release(&process->fd_lock);
 }
 
 void
-fd_close_on_exec(struct Process *process)
+fd_close_all(struct Process *process)
 {
-  int i;
-
-  // TODO: no need to lock the parent?
-
-  for (i = 0; i < OPEN_MAX; i++)
-    if (process->fd[i].flags & FD_CLOEXEC) 
-      _fd_close(&process->fd[i]);
+  _fd_close_matching(process, 0);
+  _fd_table_reset(process);
 }
 
 void
+fd_close_on_exec(struct Process *process)
+{
+  _fd_close_matching(process, FD_CLOEXEC);
+}
+
+int
 fd_clone(struct Process *parent, struct Process *child)
 {
-  int i;
+  int i, end, r;
+
+  for (;;) {
+    k_spinlock_acquire(&parent->fd_lock);
+    end = parent->fd_end;
+    k_spinlock_release(&parent->fd_lock);
 
-  // TODO: no need to lock the parent?
+    if ((end > child->fd_size) && ((r = _fd_grow(child, end)) < 0))
+      return r;
 
-  k_spinlock_acquire(&child->fd_lock);
+    // The child does not run yet, only the parent's siblings may get in
+    k_spinlock_acquire(&parent->fd_lock);
+    k_spinlock_acquire(&child->fd_lock);
 
-  for (i = 0; i < OPEN_MAX; i++) {
+    // Another thread may have opened higher descriptors in the meantime
+    if (parent->fd_end <= child->fd_size)
+      break;
+
+    k_spinlock_release(&child->fd_lock);
+    k_spinlock_release(&parent->fd_lock);
+  }
+
+  end = parent->fd_end;
+
+  for (i = 0; i < end; i++) {
     if (parent->fd[i].file != NULL){
       child->fd[i].file  = file_dup(parent->fd[i].file);
       child->fd[i].flags = parent->fd[i].flags;
     }
   }
 
+  child->fd_end = end;
+
   k_spinlock_release(&child->fd_lock);
+  k_spinlock_release(&parent->fd_lock);
+
+  return 0;
 }
 
 int
 fd_alloc(struct Process *process, struct File *f, int start)
 {
-  int i;
+  int i, size, r;
 
   if (start < 0 || start >= OPEN_MAX)
     return -EINVAL;
 
-  k_spinlock_acquire(&process->fd_lock);
+  for (;;) {
+    k_spinlock_acquire(&process->fd_lock);
+
+    for (i = start; i < process->fd_size; i++) {
+      if (process->fd[i].file == NULL) {
+        process->fd[i].flags = 0;
+        process->fd[i].file  = file_dup(f);
 
-  for (i = start; i < OPEN_MAX; i++) {
-    if (process->fd[i].file == NULL) {
-      process->fd[i].file  = file_dup(f);
-      process->fd[i].flags = 0;
+        if (process->fd_end <= i)
+          process->fd_end = i + 1;
 
-      k_spinlock_release(&process->fd_lock);
+        k_spinlock_release(&process->fd_lock);
 
-      return i;
+        return i;
+      }
     }
-  }
 
-  k_spinlock_release(&process->fd_lock);
+    size = process->fd_size;
+
+    k_spinlock_release(&process->fd_lock);
+
+    if (size >= OPEN_MAX)
+      return -EMFILE;
 
-  return -EMFILE;
+    if ((r = _fd_grow(process, MAX(start, size) + 1)) < 0)
+      return r;
+  }
 }
 
 /**
- * Fetch the nth system call argument as a file descriptor. Check that the
- * file desriptor is valid.
+ * Get the file associated with a file descriptor.
  * 
- * @param n       The argument number.
- * @param fdstore Pointer to the memory address to store the file descriptor.
- * @param fstore  Pointer to the memory address to store the file.
+ * @param process The process
+ * @param n       The file descriptor
  * 
- * @retval 0 on success.
- * @retval -EFAULT if the arguments doesn't point to a valid string.
- * @retval -EBADF if the file descriptor is invalid.
+ * @return A new reference to the file (the caller must release it with
+ *         file_put), or NULL if the file descriptor is invalid.
  */
 struct File *
 fd_lookup(struct Process *process, int n)
 {
   struct FileDesc *fd;
+  struct File *file = NULL;
 
   k_spinlock_acquire(&process->fd_lock);
-  fd = _fd_lookup(process, n);
+
+  // Take the reference while holding the lock, see the comment at the
+  // beginning of this file
+  if (((fd = _fd_lookup(process, n)) != NULL) && (fd->file != NULL))
+    file = file_dup(fd->file);
+
   k_spinlock_release(&process->fd_lock);
 
-  return (fd == NULL || fd->file == NULL) ?  NULL : file_dup(fd->file);
+  return file;
 }
 
 int
@@ -131,10 +214,9 @@ fd_close(struct Process *process, int n)
     return -EBADF;
   }
 
-  file = fd->file;
+  file = _fd_clear(fd);
 
-  fd->file  = NULL;
-  fd->flags = 0;
+  _fd_trim(process);
 
   k_spinlock_release(&process->fd_lock);
 
@@ -194,20 +276,95 @@ fd_set_flags(struct Process *process, int n, int flags)
 static struct FileDesc *
 _fd_lookup(struct Process *process, int n)
 {
-  if ((n < 0) || (n >= OPEN_MAX))
+  if ((n < 0) || (n >= process->fd_size))
     return NULL;
 
   return &process->fd[n];
 }
 
-static void
-_fd_close(struct FileDesc *fd)
+// Empty the slot, returning the file for the caller to put once fd_lock is
+// released
+static struct File *
+_fd_clear(struct FileDesc *fd)
 {
-  assert(fd->file != NULL);
-  
-  file_put(fd->file);
+  struct File *file = fd->file;
+
+  assert(file != NULL);
 
   fd->file  = NULL;
   fd->flags = 0;
+
+  return file;
+}
+
+// Grow the descriptor table to hold at least min_size entries
+static int
+_fd_grow(struct Process *process, int min_size)
+{
+  struct FileDesc *table, *old;
+  int size;
+
+  if (min_size > OPEN_MAX)
+    return -EMFILE;
+
+  for (size = process->fd_size; size < min_size; size *= 2)
+    ;
+  size = MIN(size, OPEN_MAX);
+
+  // Allocate without holding the spinlock
+  if ((table = (struct FileDesc *) k_malloc(size * sizeof(*table))) == NULL)
+    return -ENOMEM;
+
+  k_spinlock_acquire(&process->fd_lock);
+
+  if (process->fd_size >= size) {
+    k_spinlock_release(&process->fd_lock);
+    k_free(table);
+    return 0;
+  }
+
+  old = process->fd;
+
+  memcpy(table, old, process->fd_size * sizeof(*table));
+  memset(&table[process->fd_size], 0,
+         (size - process->fd_size) * sizeof(*table));
+
+  process->fd      = table;
+  process->fd_size = size;
+
+  k_spinlock_release(&process->fd_lock);
+
+  // Lookups hold fd_lock, so nobody can be reading the old table any more
+  if (old != process->fd_inline)
+    k_free(old);
+
+  return 0;
+}
+
+// Lower fd_end past the closed descriptors at the top of the table
+static void
+_fd_trim(struct Process *process)
+{
+  while ((process->fd_end > 0) && (process->fd[process->fd_end - 1].file == NULL))
+    process->fd_end--;
 }
 
+// Go back to the inline table once all descriptors are closed
+static void
+_fd_table_reset(struct Process *process)
+{
+  struct FileDesc *old;
+
+  k_spinlock_acquire(&process->fd_lock);
+
+  old = process->fd;
+
+  process->fd_size = FD_INLINE;
+  process->fd      = process->fd_inline;
+  process->fd_end  = 0;
+
+  k_spinlock_release(&process->fd_lock);
+
+  if (old != process->fd_inline)
+    k_free(old);
+}
@@ -0,0 +1,162 @@
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/core/cpu.h>
+#include <kernel/futex.h>
+#include <kernel/hash.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/vm.h>
+#include <kernel/waitqueue.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Futexes
+ * ----------------------------------------------------------------------------
+ *
+ * A futex is just an aligned word in user memory. The uncontended paths of
+ * the user-space mutexes and condition variables only use atomic operations on
+ * that word, and enter the kernel only to sleep or to wake up the sleepers.
+ *
+ * The value is compared while holding the hash table lock, and the wakers
+ * change the value before taking the same lock, so a wakeup cannot be lost
+ * between the check and the sleep.
+ *
+ * Futexes are keyed by the address space and the user address rather than by
+ * the physical page. All writable user memory is private, and after fork() the
+ * first write to a copy-on-write page moves the word to a new page, so a key
+ * taken from the old page would miss the wakeup.
+ */
+
+// Size of the waiters hash table
+#define NBUCKET   64
+
+struct FutexWaiter {
+  /** Link into the hash table */
+  struct KListLink   link;
+  /** The address space and the user address identifying the futex */
+  struct VMSpace    *vm;
+  uintptr_t          va;
+  /** Set by futex_wake() */
+  int                woken;
+  /** Queue to sleep on (only the owner of this structure ever sleeps there) */
+  struct KWaitQueue  queue;
+};
+
+static struct {
+  struct KListLink table[NBUCKET];
+  struct KSpinLock lock;
+} futex_hash __cacheline_exclusive;
+
+#define FUTEX_KEY(va)   ((va) / sizeof(int))
+
+/**
+ * Initialize the futex hash table.
+ */
+void
+futex_init(void)
+{
+  HASH_INIT(futex_hash.table);
+  k_spinlock_init(&futex_hash.lock, "futex_hash");
+}
+
+/**
+ * Sleep on the futex at the given address, provided that it still holds the
+ * expected value.
+ *
+ * @param va      The user address of the futex word
+ * @param val     The expected value
+ * @param timeout The maximum number of ticks to sleep, or 0 to wait forever
+ *
+ * @retval 0          Woken up by futex_wake()
+ * @retval -EAGAIN    The word did not hold the expected value
+ * @retval -ETIMEDOUT The timeout expired
+ * @retval -EINTR     Interrupted by a signal
+ */
+int
+futex_wait(uintptr_t va, int val, unsigned long timeout)
+{
+  struct VMSpace *vm = process_current()->vm;
+  struct FutexWaiter waiter;
+  int r, cur;
+
+  if (va % sizeof(int))
+    return -EINVAL;
+
+  waiter.vm    = vm;
+  waiter.va    = va;
+  waiter.woken = 0;
+  k_waitqueue_init(&waiter.queue);
+
+  k_spinlock_acquire(&futex_hash.lock);
+
+  // vm_copy_in never sleeps, so it can be called with the lock held
+  if ((r = vm_copy_in(vm, &cur, va, sizeof cur)) < 0)
+    goto out;
+
+  if (cur != val) {
+    r = -EAGAIN;
+    goto out;
+  }
+
+  HASH_PUT(futex_hash.table, &waiter.link, FUTEX_KEY(va));
+
+  while (!waiter.woken) {
+    r = k_waitqueue_timed_sleep(&waiter.queue, &futex_hash.lock, timeout);
+    if (r < 0)
+      break;
+  }
+
+  // A wakeup always wins over a signal or a timeout arriving at the same time
+  if (waiter.woken)
+    r = 0;
+  else
+    HASH_REMOVE(&waiter.link);
+
+out:
+  k_spinlock_release(&futex_hash.lock);
+
+  return r;
+}
+
+/**
+ * Wake up threads sleeping on the futex at the given address.
+ *
+ * @param va The user address of the futex word
+ * @param n  The maximum number of threads to wake up
+ *
+ * @return The number of threads woken up, or a negative error code.
+ */
+int
+futex_wake(uintptr_t va, int n)
+{
+  struct VMSpace *vm = process_current()->vm;
+  struct KListLink *head, *l, *next;
+  int count = 0;
+
+  if (va % sizeof(int))
+    return -EINVAL;
+
+  k_spinlock_acquire(&futex_hash.lock);
+
+  head = &futex_hash.table[FUTEX_KEY(va) % NBUCKET];
+
+  for (l = head->next; (l != head) && (count < n); l = next) {
+    struct FutexWaiter *waiter = KLIST_CONTAINER(l, struct FutexWaiter, link);
+
+    next = l->next;
+
+    if ((waiter->vm != vm) || (waiter->va != va))
+      continue;
+
+    HASH_REMOVE(&waiter->link);
+    waiter->woken = 1;
+    k_waitqueue_wakeup_all(&waiter->queue);
+
+    count++;
+  }
+
+  k_spinlock_release(&futex_hash.lock);
+
+  return count;
+}
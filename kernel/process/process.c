@@ -6,11 +6,14 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include <kernel/boot.h>
 #include <kernel/core/cpu.h>
 #include <kernel/console.h>
 #include <kernel/elf.h>
 #include <kernel/fd.h>
 #include <kernel/fs/fs.h>
+#include <kernel/futex.h>
+#include <kernel/ipc.h>
 #include <kernel/hash.h>
 #include <kernel/object_pool.h>
 #include <kernel/vm.h>
@@ -31,20 +34,29 @@
 struct KObjectPool *process_cache;
 struct KObjectPool *thread_cache;
 
-// Size of PID hash table
-#define NBUCKET   256
+// Initial and maximum numbers of buckets in the PID hash table (the table is
+// allocated with k_malloc, which is limited to 16 KiB)
+#define PID_HASH_INLINE   256
+#define PID_HASH_MAX      (16384 / sizeof(struct KListLink))
 
-// Process ID hash table
+// Process ID hash table. Doubles in size once there are more processes than
+// buckets, so that lookups stay short with thousands of processes.
 static struct {
-  struct KListLink table[NBUCKET];
-  struct KSpinLock lock;
+  struct KListLink  *table;
+  size_t             size;
+  size_t             count;
+  struct KRWSpinLock lock;
+  struct KListLink   inline_table[PID_HASH_INLINE];
 } pid_hash;
 
+#define PID_HASH_BUCKET(pid)  (&pid_hash.table[(pid) % pid_hash.size])
+
 // Lock to protect the parent/child relationships between the processes
 struct KListLink __process_list;
 struct KSpinLock __process_lock;
 
 static void process_run(void *);
+static void process_thread_run(void *);
 
 static struct Process *init_process;
 
@@ -60,7 +72,11 @@ process_ctor(void *buf, size_t)
   struct Process *proc = (struct Process *) buf;
 
   k_waitqueue_init(&proc->wait_queue);
+  k_waitqueue_init(&proc->vfork_queue);
+  k_waitqueue_init(&proc->thread_queue);
+  k_list_init(&proc->threads);
   k_list_init(&proc->children);
+  k_list_init(&proc->zombies);
   k_list_init(&proc->signal_queue);
 }
 
@@ -69,16 +85,22 @@ process_init(void)
 {
   extern uint8_t _binary_obj_user_init_start[];
 
-  process_cache = k_object_pool_create("process_cache", sizeof(struct Process), 0, process_ctor, NULL);
+  process_cache = k_object_pool_create("process_cache", sizeof(struct Process),
+                                       K_CACHE_LINE_SIZE, process_ctor, NULL);
   if (process_cache == NULL)
     panic("cannot allocate process_cache");
   
-  HASH_INIT(pid_hash.table);
-  k_spinlock_init(&pid_hash.lock, "pid_hash");
+  HASH_INIT(pid_hash.inline_table);
+  pid_hash.table = pid_hash.inline_table;
+  pid_hash.size  = PID_HASH_INLINE;
+  pid_hash.count = 0;
+  k_rwspinlock_init(&pid_hash.lock, "pid_hash");
 
   k_list_init(&__process_list);
   k_spinlock_init(&__process_lock, "process_lock");
 
+  futex_init();
+
   // Create the init process
   if (process_create(_binary_obj_user_init_start, &init_process) != 0)
     panic("Cannot create the init process");
@@ -86,11 +108,77 @@ process_init(void)
   signal_init_system();
 }
 
+// Double the size of the PID hash table, moving all processes to the new
+// buckets. Only called when the table is overloaded, so the cost is amortized
+// over the process creations that filled it.
+static void
+pid_hash_grow(void)
+{
+  struct KListLink *table, *old;
+  size_t size, old_size, i;
+
+  old_size = __atomic_load_n(&pid_hash.size, __ATOMIC_RELAXED);
+  if ((size = old_size * 2) > PID_HASH_MAX)
+    return;
+
+  // Allocate without holding the spinlock. Failure only costs longer chains.
+  if ((table = (struct KListLink *) k_malloc(size * sizeof(*table))) == NULL)
+    return;
+
+  for (i = 0; i < size; i++)
+    k_list_init(&table[i]);
+
+  k_rwspinlock_write_acquire(&pid_hash.lock);
+
+  // Another thread has already grown the table
+  if (pid_hash.size != old_size) {
+    k_rwspinlock_write_release(&pid_hash.lock);
+    k_free(table);
+    return;
+  }
+
+  for (i = 0; i < old_size; i++) {
+    struct KListLink *head = &pid_hash.table[i];
+
+    while (!k_list_is_empty(head)) {
+      struct KListLink *l = head->next;
+      struct Process *process = KLIST_CONTAINER(l, struct Process, pid_link);
+
+      k_list_remove(l);
+      k_list_add_back(&table[process->pid % size], l);
+    }
+  }
+
+  old = pid_hash.table;
+  pid_hash.table = table;
+  pid_hash.size  = size;
+
+  k_rwspinlock_write_release(&pid_hash.lock);
+
+  if (old != pid_hash.inline_table)
+    k_free(old);
+}
+
+// Remove the process from the PID hash table
+static void
+pid_hash_remove(struct Process *process)
+{
+  k_rwspinlock_write_acquire(&pid_hash.lock);
+
+  if (!k_list_is_null(&process->pid_link)) {
+    HASH_REMOVE(&process->pid_link);
+    pid_hash.count--;
+  }
+
+  k_rwspinlock_write_release(&pid_hash.lock);
+}
+
 struct Process *
 process_alloc(void)
 {
   static pid_t next_pid;
   struct Process *process;
+  unsigned i;
 
   if ((process = (struct Process *) k_object_pool_get(process_cache)) == NULL)
     return NULL;
@@ -101,14 +189,22 @@ process_alloc(void)
     return NULL;
   }
 
+  k_list_add_back(&process->threads, &process->thread->process_link);
+  process->thread_count  = 1;
+  process->single_thread = NULL;
+
   k_list_init(&process->children);
+  k_list_init(&process->zombies);
   k_list_null(&process->pid_link);
   k_list_null(&process->link);
   k_list_null(&process->sibling_link);
+  k_list_null(&process->zombie_link);
 
   process->parent = NULL;
+  process->vfork_parent = NULL;
   process->state = PROCESS_STATE_ACTIVE;
   process->flags = 0;
+  process->shared_inode = NULL;
 
   memset(process->name, 0, 64);
 
@@ -117,18 +213,27 @@ process_alloc(void)
   process->times.tms_cutime = 0;
   process->times.tms_cstime = 0;
 
-  k_timer_init(&process->itimers[ITIMER_PROF].timer, process_itimer, (void *) process->pid, 0, 0, 0);
-  k_timer_init(&process->itimers[ITIMER_REAL].timer, process_itimer, (void *) process->pid, 0, 0, 0);
-  k_timer_init(&process->itimers[ITIMER_VIRTUAL].timer, process_itimer, (void *) process->pid, 0, 0, 0);
+  // Interval timers are not inherited by the child
+  for (i = 0; i < ARRAY_SIZE(process->itimers); i++) {
+    process->itimers[i].remain   = 0;
+    process->itimers[i].interval = 0;
+  }
+  k_timer_init(&process->itimer_real, process_itimer, (void *) process->pid,
+               0, 0, 0);
+
+  if (__atomic_load_n(&pid_hash.count, __ATOMIC_RELAXED) >=
+      __atomic_load_n(&pid_hash.size, __ATOMIC_RELAXED))
+    pid_hash_grow();
 
-  k_spinlock_acquire(&pid_hash.lock);
+  k_rwspinlock_write_acquire(&pid_hash.lock);
 
   if ((process->pid = ++next_pid) < 0)
     panic("pid overflow");
 
-  HASH_PUT(pid_hash.table, &process->pid_link, process->pid);
+  k_list_add_back(PID_HASH_BUCKET(process->pid), &process->pid_link);
+  pid_hash.count++;
 
-  k_spinlock_release(&pid_hash.lock);
+  k_rwspinlock_write_release(&pid_hash.lock);
 
   fd_init(process);
 
@@ -170,7 +275,7 @@ process_load_binary(struct Process *proc, const void *binary)
     if (addr != ph->vaddr)
       return (int) addr;
 
-    if ((r = vm_copy_out(proc->vm->pgtab, (uint8_t *) elf + ph->offset,
+    if ((r = vm_copy_out(proc->vm, (uint8_t *) elf + ph->offset,
                          ph->vaddr, ph->filesz)) < 0)
       return r;
 
@@ -182,6 +287,10 @@ process_load_binary(struct Process *proc, const void *binary)
   if (addr != (VIRT_USTACK_TOP - USTACK_SIZE))
     return (int) addr;
 
+  if ((r = vmspace_map_page(proc->vm, VIRT_TIMEPAGE, time_page,
+                            VM_READ | VM_USER)) != 0)
+    return r;
+
   return arch_trap_frame_init(proc->thread->tf, elf->entry, 0, 0, 0, VIRT_USTACK_TOP);
 }
 
@@ -238,9 +347,7 @@ process_free(struct Process *process)
   k_list_remove(&process->link);
   process_unlock();
 
-  k_spinlock_acquire(&pid_hash.lock);
-  k_list_remove(&process->pid_link);
-  k_spinlock_release(&pid_hash.lock);
+  pid_hash_remove(process);
 
   // Return the process descriptor to the cache
   k_object_pool_put(process_cache, process);
@@ -252,17 +359,17 @@ pid_lookup(pid_t pid)
   struct KListLink *l;
   struct Process *proc;
 
-  k_spinlock_acquire(&pid_hash.lock);
+  k_rwspinlock_read_acquire(&pid_hash.lock);
 
-  HASH_FOREACH_ENTRY(pid_hash.table, l, pid) {
+  KLIST_FOREACH(PID_HASH_BUCKET(pid), l) {
     proc = KLIST_CONTAINER(l, struct Process, pid_link);
     if (proc->pid == pid) {
-      k_spinlock_release(&pid_hash.lock);
+      k_rwspinlock_read_release(&pid_hash.lock);
       return proc;
     }
   }
 
-  k_spinlock_release(&pid_hash.lock);
+  k_rwspinlock_read_release(&pid_hash.lock);
   return NULL;
 }
 
@@ -273,27 +380,51 @@ process_destroy(int status)
   struct Process *child, *current = process_current();
   int has_zombies;
 
+  // Another thread is already terminating the process
+  if (_process_single_thread(current) != 0)
+    process_thread_exit(0);
+
   if(status)
     cprintf("[k] process #%d destroyed with code 0x%x\n", current->pid, status);
 
   // Remove the pid hash link
   // TODO: place this code somewhere else?
-  k_spinlock_acquire(&pid_hash.lock);
-  HASH_REMOVE(&current->pid_link);
-  k_spinlock_release(&pid_hash.lock);
+  pid_hash_remove(current);
+
+  // A vfork() child must stop using the borrowed address space before the
+  // parent is allowed to run again
+  // The address space is detached with the process lock held, see
+  // process_get_areas()
+  if (current->vfork_parent != NULL) {
+    process_lock();
+    current->vm = NULL;
+    process_unlock();
+
+    arch_vm_load_kernel();
+    _process_vfork_release(current);
+  } else {
+    struct VMSpace *vm = current->vm;
 
-  vm_space_destroy(current->vm);
+    arch_vm_load_kernel();
+
+    process_lock();
+    current->vm = NULL;
+    process_unlock();
+
+    // Freeing the memory of a large process takes a while, so leave it to
+    // the reclaim thread and let the parent see the exit right away
+    vm_space_destroy_deferred(vm);
+  }
 
   fd_close_all(current);
   fs_path_put(current->cwd);
+  ipc_process_cleanup(current->pid);
 
   assert(init_process != NULL);
 
   process_lock();
 
-  k_timer_fini(&current->itimers[ITIMER_PROF].timer);
-  k_timer_fini(&current->itimers[ITIMER_REAL].timer);
-  k_timer_fini(&current->itimers[ITIMER_VIRTUAL].timer);
+  k_timer_fini(&current->itimer_real);
 
   // Move children to the init process
   has_zombies = 0;
@@ -306,8 +437,11 @@ process_destroy(int status)
     k_list_add_back(&init_process->children, l);
 
     // Check whether there is a child available to be cleaned up
-    if (child->state == PROCESS_STATE_ZOMBIE)
+    if (child->state == PROCESS_STATE_ZOMBIE) {
+      k_list_remove(&child->zombie_link);
+      k_list_add_back(&init_process->zombies, &child->zombie_link);
       has_zombies = 1;
+    }
   }
 
   // Wake up the init process to cleanup zombie children
@@ -318,6 +452,9 @@ process_destroy(int status)
   current->flags |= PROCESS_STATUS_AVAILABLE;
   current->status = status;
 
+  if (current->parent != NULL)
+    k_list_add_back(&current->parent->zombies, &current->zombie_link);
+
   _signal_state_change_to_parent(current);
 
   process_unlock();
@@ -325,15 +462,34 @@ process_destroy(int status)
   k_thread_exit();
 }
 
+/**
+ * Create a copy of the current process.
+ *
+ * @param vfork If 0, the child gets a copy-on-write clone of the address
+ *              space. Otherwise, the child borrows the address space of the
+ *              parent, and the parent is suspended until the child calls
+ *              exec or exits, so the cost does not depend on the parent size.
+ *
+ * @return The child PID on success, or a negative error code.
+ */
 pid_t
-process_copy(int share_vm)
+process_copy(int vfork)
 {
   struct Process *child, *current = process_current();
 
   if ((child = process_alloc()) == NULL)
     return -ENOMEM;
 
-  if ((child->vm = vm_space_clone(current->vm, share_vm)) == NULL) {
+  if (vfork) {
+    child->vm = current->vm;
+  } else if ((child->vm = vm_space_clone(current->vm, 0)) == NULL) {
+    process_free(child);
+    return -ENOMEM;
+  }
+
+  if (fd_clone(current, child) < 0) {
+    if (!vfork)
+      vm_space_destroy(child->vm);
     process_free(child);
     return -ENOMEM;
   }
@@ -341,12 +497,17 @@ process_copy(int share_vm)
   process_lock();
 
   child->parent         = current;
+  child->vfork_parent   = vfork ? current : NULL;
 
   arch_process_copy(current, child);
 
-  fd_clone(current, child);
   signal_clone(current, child);
 
+  k_thread_set_sched(child->thread, k_thread_current()->policy,
+                     k_thread_current()->saved_priority);
+  (void) k_thread_set_affinity(child->thread,
+                               k_thread_get_affinity(k_thread_current()));
+
   child->pgid  = current->pgid;
   child->ruid  = current->ruid;
   child->euid  = current->euid;
@@ -364,9 +525,47 @@ process_copy(int share_vm)
 
   k_thread_resume(child->thread);
 
+  if (vfork) {
+    process_lock();
+
+    // The child cannot be reaped before we return, so it is safe to access.
+    // Signals cannot be handled either, since the child may still be using
+    // our stack, so keep sleeping if interrupted.
+    while (child->vfork_parent != NULL)
+      k_waitqueue_sleep(&current->vfork_queue, &__process_lock);
+
+    process_unlock();
+  }
+
   return child->pid;
 }
 
+/**
+ * Resume the parent of a vfork() child. Called when the child no longer uses
+ * the borrowed address space, i.e. after exec has loaded a new one or when the
+ * child exits.
+ *
+ * @param process The child process
+ *
+ * @return 1 if the process was a vfork() child, 0 otherwise.
+ */
+int
+_process_vfork_release(struct Process *process)
+{
+  struct Process *parent;
+
+  process_lock();
+
+  if ((parent = process->vfork_parent) != NULL) {
+    process->vfork_parent = NULL;
+    k_waitqueue_wakeup_all(&parent->vfork_queue);
+  }
+
+  process_unlock();
+
+  return parent != NULL;
+}
+
 /**
  * Check whether the given process ID or group ID matches the given argument.
  * 
@@ -389,6 +588,43 @@ process_match_pid(struct Process *process, pid_t pid)
   return 0;
 }
 
+// Find a zombie child matching the given PID argument. Only zombies are
+// searched, so waiting for any child takes the first one at once.
+static struct Process *
+process_wait_zombie(struct Process *current, pid_t pid)
+{
+  struct KListLink *l;
+
+  KLIST_FOREACH(&current->zombies, l) {
+    struct Process *process = KLIST_CONTAINER(l, struct Process, zombie_link);
+
+    if (process_match_pid(process, pid))
+      return process;
+  }
+
+  return NULL;
+}
+
+// Check whether the current process has any children matching the given PID
+// argument
+static int
+process_wait_match(struct Process *current, pid_t pid)
+{
+  struct KListLink *l;
+
+  if (pid == -1)
+    return !k_list_is_empty(&current->children);
+
+  KLIST_FOREACH(&current->children, l) {
+    struct Process *process = KLIST_CONTAINER(l, struct Process, sibling_link);
+
+    if (process_match_pid(process, pid))
+      return 1;
+  }
+
+  return 0;
+}
+
 pid_t
 process_wait(pid_t pid, int *stat_loc, int options)
 {
@@ -399,57 +635,37 @@ process_wait(pid_t pid, int *stat_loc, int options)
     return -EINVAL;
 
   // TODO: everything related to SIGCHLD
+  // TODO: report stopped children for WUNTRACED
 
   process_lock();
 
   for (;;) {
-    struct KListLink *l;
-    pid_t match = 0;
-
-    KLIST_FOREACH(&current->children, l) {
-      struct Process *process;
-
-      process = KLIST_CONTAINER(l, struct Process, sibling_link);
-
-      if (!process_match_pid(process, pid))
-        continue;
-
-      // Rememeber that we have at least one match
-      match = process->pid;
-
-      if (process->flags & PROCESS_STATUS_AVAILABLE) {
-        if ((process->state == PROCESS_STATE_STOPPED) && !(options & WUNTRACED))
-          continue;
+    struct Process *process;
 
-        // TODO: WCONTINUED
-        if (process->state == PROCESS_STATE_ACTIVE)
-          continue;
+    if ((process = process_wait_zombie(current, pid)) != NULL) {
+      pid_t match = process->pid;
 
-        process->flags &= ~PROCESS_STATUS_AVAILABLE;
-        *stat_loc = process->status;
+      process->flags &= ~PROCESS_STATUS_AVAILABLE;
+      *stat_loc = process->status;
 
-        if (process->state == PROCESS_STATE_ZOMBIE) {
-          k_list_remove(&process->sibling_link);
-          k_list_remove(&process->link);
+      k_list_remove(&process->zombie_link);
+      k_list_remove(&process->sibling_link);
+      k_list_remove(&process->link);
 
-          // Include the times of the terminated child process in the parent's
-          // times structure. Thus, only the times of children for which wait
-          // successfully returns will be included.
-          current->times.tms_cutime += process->times.tms_utime;
-          current->times.tms_cstime += process->times.tms_stime;
+      // Include the times of the terminated child process in the parent's
+      // times structure. Thus, only the times of children for which wait
+      // successfully returns will be included.
+      current->times.tms_cutime += process->times.tms_utime;
+      current->times.tms_cstime += process->times.tms_stime;
 
-          process_unlock();
+      process_unlock();
 
-          process_free(process);
-        } else {
-          process_unlock();
-        }
+      process_free(process);
 
-        return match;
-      }
+      return match;
     }
 
-    if (!match) { // No children matched
+    if (!process_wait_match(current, pid)) { // No children matched
       r = -ECHILD;
       break;
     }
@@ -463,6 +679,10 @@ process_wait(pid_t pid, int *stat_loc, int options)
       if ((r != -EINTR) || (options & WNOHANG)) {
         break;
       }
+
+      // Let the thread exit if the process is being terminated
+      if (current->single_thread != NULL)
+        break;
     }
   }
 
@@ -489,6 +709,9 @@ process_run(void *arg)
   if (!first) {
     first = 1;
 
+    // The storage and network drivers may still be probing
+    boot_wait();
+
     fs_init();
 
     if ((process->cwd == NULL) && (fs_lookup("/", 0, &process->cwd) < 0))
@@ -498,14 +721,178 @@ process_run(void *arg)
   k_irq_disable();
 
   // "Return" to the user space.
-  arch_trap_frame_pop(process->thread->tf);
+  arch_trap_frame_pop(k_thread_current()->tf);
 }
 
-void *
-process_grow(ptrdiff_t increment)
+static void
+process_thread_run(void *arg)
 {
-  panic("deprecated %d\n", increment);
-  return NULL;
+  (void) arg;
+
+  // The process may have begun to exit before this thread got to run
+  process_thread_check_exit();
+
+  k_irq_disable();
+
+  arch_trap_frame_pop(k_thread_current()->tf);
+}
+
+// Get the thread out of a sleep or a stop, so that it checks the process state
+static void
+process_thread_wakeup(struct KThread *thread)
+{
+  k_thread_interrupt(thread);
+  k_thread_resume(thread);
+}
+
+/**
+ * Create a new thread in the current process. The thread shares the address
+ * space, the file descriptors and the signal state with the other threads.
+ *
+ * @param entry The user-mode entry point
+ * @param stack The top of the user-mode stack
+ * @param arg   The argument passed to the entry point function
+ * @param tls   The initial value of the user-mode thread pointer
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ */
+int
+process_thread_create(uintptr_t entry, uintptr_t stack, uintptr_t arg,
+                      uintptr_t tls)
+{
+  struct Process *current = process_current();
+  struct KThread *thread;
+
+  if ((thread = k_thread_create(current, process_thread_run, NULL, NZERO)) == NULL)
+    return -ENOMEM;
+
+  arch_trap_frame_init(thread->tf, entry, arg, 0, 0, stack);
+  thread->tls = tls;
+
+  k_thread_set_sched(thread, k_thread_current()->policy,
+                     k_thread_current()->saved_priority);
+  (void) k_thread_set_affinity(thread,
+                               k_thread_get_affinity(k_thread_current()));
+
+  process_lock();
+
+  // If the process is exiting, the new thread terminates as soon as it runs
+  k_list_add_back(&current->threads, &thread->process_link);
+  current->thread_count++;
+
+  k_thread_resume(thread);
+
+  process_unlock();
+
+  return 0;
+}
+
+/**
+ * Terminate the calling thread. The process exits with status 0 once its last
+ * thread terminates.
+ *
+ * @param clear_va If not 0, the address of a word to be set to 0 once the
+ *                 thread no longer uses its user-mode stack. Threads waiting
+ *                 on that word as a futex are then woken up.
+ */
+void
+process_thread_exit(uintptr_t clear_va)
+{
+  struct Process *current = process_current();
+  struct KThread *my_thread = k_thread_current();
+  int zero = 0;
+
+  if ((clear_va != 0) &&
+      (vm_user_check_buf(current->vm, clear_va, sizeof zero, VM_WRITE) == 0) &&
+      (vm_copy_out(current->vm, &zero, clear_va, sizeof zero) == 0))
+    futex_wake(clear_va, INT_MAX);
+
+  process_lock();
+
+  if (current->thread_count == 1) {
+    process_unlock();
+    process_destroy(0);
+  }
+
+  k_list_remove(&my_thread->process_link);
+  current->thread_count--;
+
+  if (current->thread == my_thread)
+    current->thread = KLIST_CONTAINER(current->threads.next, struct KThread,
+                                      process_link);
+
+  if (current->single_thread != NULL)
+    k_waitqueue_wakeup_all(&current->thread_queue);
+
+  process_unlock();
+
+  k_thread_exit();
+}
+
+/**
+ * Terminate the calling thread if another thread of the same process has
+ * requested to become the only one. Called on every return to user mode.
+ */
+void
+process_thread_check_exit(void)
+{
+  struct Process *current = process_current();
+  struct KThread *single_thread;
+
+  // Once set by another thread, the field cannot be reset before we are gone
+  single_thread = current->single_thread;
+
+  if ((single_thread != NULL) && (single_thread != k_thread_current()))
+    process_thread_exit(0);
+}
+
+/**
+ * Terminate all threads of the current process except the calling one. This
+ * is done before the process exits or executes another program.
+ *
+ * @param process The current process
+ *
+ * @retval 0      The calling thread is the only thread of the process
+ * @retval -EINTR Another thread is already terminating the process, so the
+ *                calling thread must exit
+ */
+int
+_process_single_thread(struct Process *process)
+{
+  struct KThread *my_thread = k_thread_current();
+  struct KListLink *l;
+
+  process_lock();
+
+  if (process->single_thread != NULL) {
+    process_unlock();
+    return -EINTR;
+  }
+
+  if (process->thread_count > 1) {
+    process->single_thread = my_thread;
+
+    KLIST_FOREACH(&process->threads, l) {
+      struct KThread *thread;
+      
+      thread = KLIST_CONTAINER(l, struct KThread, process_link);
+      if (thread != my_thread)
+        process_thread_wakeup(thread);
+    }
+
+    // The other threads exit on their way back to user mode
+    while (process->thread_count > 1)
+      k_waitqueue_sleep(&process->thread_queue, &__process_lock);
+
+    process->single_thread = NULL;
+  }
+
+  process->thread = my_thread;
+
+  process_unlock();
+
+  return 0;
 }
 
 pid_t
@@ -563,12 +950,345 @@ process_set_gid(pid_t pid, pid_t pgid)
   return r;
 }
 
+/**
+ * Change the scheduling policy and priority of all threads of a process.
+ *
+ * @param pid      The process ID, or 0 for the current process
+ * @param policy   SCHED_OTHER, SCHED_FIFO, SCHED_RR, or -1 to keep the
+ *                 current policy
+ * @param priority The priority within the policy (as in sched_param)
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+process_set_sched(pid_t pid, int policy, int priority)
+{
+  struct Process *process, *current = process_current();
+  struct KListLink *l;
+  int r = 0;
+
+  if (pid < 0)
+    return -EINVAL;
+
+  process_lock();
+
+  process = (pid == 0) ? current : pid_lookup(pid);
+  if (process == NULL) {
+    r = -ESRCH;
+    goto out;
+  }
+
+  if (policy < 0)
+    policy = process->thread->policy;
+
+  switch (policy) {
+  case SCHED_OTHER:
+    if (priority != 0)
+      r = -EINVAL;
+    break;
+  case SCHED_FIFO:
+  case SCHED_RR:
+    if ((priority < THREAD_RT_PRIORITY_MIN) ||
+        (priority > THREAD_RT_PRIORITY_MAX))
+      r = -EINVAL;
+    // Only the superuser may use the real-time classes
+    else if (current->euid != 0)
+      r = -EPERM;
+    break;
+  default:
+    r = -EINVAL;
+    break;
+  }
+
+  if ((r == 0) && (current->euid != 0) && (current->euid != process->euid))
+    r = -EPERM;
+
+  if (r == 0) {
+    KLIST_FOREACH(&process->threads, l) {
+      struct KThread *thread;
+
+      thread = KLIST_CONTAINER(l, struct KThread, process_link);
+      k_thread_set_sched(thread, policy,
+                         policy == SCHED_OTHER ? NZERO : NZERO - priority);
+    }
+  }
+
+out:
+  process_unlock();
+
+  return r;
+}
+
+/**
+ * Get the scheduling parameters of a process.
+ *
+ * @param pid             The process ID, or 0 for the current process
+ * @param policy_store    Where to store the policy
+ * @param priority_store  Where to store the priority within the policy
+ * @param timeslice_store Where to store the time slice in ticks
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+process_get_sched(pid_t pid, int *policy_store, int *priority_store,
+                  unsigned *timeslice_store)
+{
+  struct Process *process;
+  struct KThread *thread;
+  int r = 0;
+
+  if (pid < 0)
+    return -EINVAL;
+
+  process_lock();
+
+  if ((process = (pid == 0) ? process_current() : pid_lookup(pid)) == NULL) {
+    r = -ESRCH;
+  } else {
+    thread = process->thread;
+
+    if (policy_store != NULL)
+      *policy_store = thread->policy;
+    if (priority_store != NULL)
+      *priority_store = (thread->policy == SCHED_OTHER)
+                      ? 0
+                      : NZERO - thread->saved_priority;
+    if (timeslice_store != NULL)
+      *timeslice_store = k_thread_timeslice(thread);
+  }
+
+  process_unlock();
+
+  return r;
+}
+
+/**
+ * Restrict all threads of a process to the given set of CPUs. If the current
+ * thread is no longer allowed to run on its CPU, it is moved before returning.
+ *
+ * @param pid  The process ID, or 0 for the current process
+ * @param mask The allowed CPUs, one bit per CPU
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+process_set_affinity(pid_t pid, unsigned mask)
+{
+  struct Process *process, *current = process_current();
+  struct KThread *my_thread = k_thread_current();
+  struct KListLink *l;
+  int r = 0;
+
+  if (pid < 0)
+    return -EINVAL;
+
+  process_lock();
+
+  process = (pid == 0) ? current : pid_lookup(pid);
+  if (process == NULL) {
+    r = -ESRCH;
+  } else if ((current->euid != 0) && (current->euid != process->euid)) {
+    r = -EPERM;
+  } else {
+    KLIST_FOREACH(&process->threads, l) {
+      struct KThread *thread;
+
+      thread = KLIST_CONTAINER(l, struct KThread, process_link);
+      if ((r = k_thread_set_affinity(thread, mask)) != 0)
+        break;
+    }
+  }
+
+  process_unlock();
+
+  // Cannot switch while holding the process lock
+  if ((r == 0) && !(k_thread_get_affinity(my_thread) & (1U << k_cpu_id())))
+    k_thread_yield();
+
+  return r;
+}
+
+/**
+ * Get the set of CPUs the threads of a process are allowed to run on.
+ *
+ * @param pid        The process ID, or 0 for the current process
+ * @param mask_store Where to store the allowed CPUs
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int
+process_get_affinity(pid_t pid, unsigned *mask_store)
+{
+  struct Process *process;
+  int r = 0;
+
+  if (pid < 0)
+    return -EINVAL;
+
+  process_lock();
+
+  if ((process = (pid == 0) ? process_current() : pid_lookup(pid)) == NULL)
+    r = -ESRCH;
+  else
+    *mask_store = k_thread_get_affinity(process->thread);
+
+  process_unlock();
+
+  return r;
+}
+
+// Called with the process lock held
+static void
+process_fill_stats(struct Process *process, struct ProcessStats *s)
+{
+  s->pid      = process->pid;
+  s->ppid     = (process->parent != NULL) ? process->parent->pid : 0;
+  s->pgid     = process->pgid;
+  s->uid      = process->euid;
+  s->gid      = process->egid;
+  s->state    = process->state;
+  s->threads  = process->thread_count;
+  s->utime    = process->times.tms_utime;
+  s->stime    = process->times.tms_stime;
+
+  // The threads of a zombie are gone
+  if (process->state != PROCESS_STATE_ZOMBIE) {
+    s->policy   = process->thread->policy;
+    s->priority = process->thread->priority;
+  } else {
+    s->policy   = SCHED_OTHER;
+    s->priority = 0;
+  }
+
+  strncpy(s->name, process->name, sizeof(s->name) - 1);
+  s->name[sizeof(s->name) - 1] = '\0';
+}
+
+/**
+ * Get the scheduling state and the execution times of all processes.
+ *
+ * @param stats Where to store the information
+ * @param max   The maximum number of entries to store
+ *
+ * @return The number of processes, which may be larger than max.
+ */
+unsigned
+process_get_stats(struct ProcessStats *stats, unsigned max)
+{
+  struct KListLink *l;
+  unsigned n = 0;
+
+  process_lock();
+
+  KLIST_FOREACH(&__process_list, l) {
+    struct Process *process = KLIST_CONTAINER(l, struct Process, link);
+
+    if (n >= max) {
+      n++;
+      continue;
+    }
+
+    process_fill_stats(process, &stats[n++]);
+  }
+
+  process_unlock();
+
+  return n;
+}
+
+/**
+ * Get the scheduling state and the execution times of one process.
+ *
+ * @param pid   The process ID
+ * @param stats Where to store the information
+ *
+ * @retval 0      Success
+ * @retval -ESRCH There is no such process
+ */
+int
+process_get_pid_stats(pid_t pid, struct ProcessStats *stats)
+{
+  struct Process *process;
+  int r = 0;
+
+  process_lock();
+
+  if ((process = pid_lookup(pid)) == NULL)
+    r = -ESRCH;
+  else
+    process_fill_stats(process, stats);
+
+  process_unlock();
+
+  return r;
+}
+
+/**
+ * Take a snapshot of the memory areas of a process.
+ *
+ * The address space cannot be destroyed meanwhile, since exit and exec only
+ * detach it from the process with the process lock held.
+ *
+ * @param pid   The process ID
+ * @param areas Array to store the areas into
+ * @param max   The size of the array
+ *
+ * @return The number of areas (0 for a zombie), which may be larger than max,
+ *         or -ESRCH if there is no such process.
+ */
+int
+process_get_areas(pid_t pid, struct VMSpaceAreaInfo *areas, unsigned max)
+{
+  struct Process *process;
+  int r;
+
+  process_lock();
+
+  if ((process = pid_lookup(pid)) == NULL)
+    r = -ESRCH;
+  else if (process->vm == NULL)
+    r = 0;
+  else
+    r = (int) vm_space_get_areas(process->vm, areas, max);
+
+  process_unlock();
+
+  return r;
+}
+
+// Charge execution time against a virtual or profiling timer. Returns whether
+// the timer has expired.
+static int
+process_itimer_charge(struct Process *process, int which, unsigned long ticks)
+{
+  unsigned long remain = process->itimers[which].remain;
+
+  if ((remain == 0) || (ticks == 0))
+    return 0;
+
+  if (remain > ticks) {
+    process->itimers[which].remain = remain - ticks;
+    return 0;
+  }
+
+  process->itimers[which].remain = process->itimers[which].interval;
+  return 1;
+}
+
 void
 process_update_times(struct Process *process, clock_t user, clock_t system)
 {
   process_lock();
+
   process->times.tms_utime += user;
   process->times.tms_stime += system;
+
+  // ITIMER_VIRTUAL counts user time only, ITIMER_PROF counts both
+  if (process_itimer_charge(process, ITIMER_VIRTUAL, user))
+    _signal_generate_one(process, SIGVTALRM, 0);
+  if (process_itimer_charge(process, ITIMER_PROF, user + system))
+    _signal_generate_one(process, SIGPROF, 0);
+
   process_unlock();
 }
 
@@ -576,11 +1296,15 @@ void
 _process_continue(struct Process *process)
 {
   assert(process != NULL);
-  assert(k_spinlock_holding(&__process_lock));
+  debug_assert(k_spinlock_holding(&__process_lock));
 
   if (process->state == PROCESS_STATE_STOPPED) {
+    struct KListLink *l;
+
     process->state = PROCESS_STATE_ACTIVE;
-    k_thread_interrupt(process->thread);
+
+    KLIST_FOREACH(&process->threads, l)
+      process_thread_wakeup(KLIST_CONTAINER(l, struct KThread, process_link));
 
     _signal_state_change_to_parent(process);
   }
@@ -590,7 +1314,7 @@ void
 _process_stop(struct Process *process)
 {
   assert(process != NULL);
-  assert(k_spinlock_holding(&__process_lock));
+  debug_assert(k_spinlock_holding(&__process_lock));
 
   if (process->state != PROCESS_STATE_STOPPED) {
     process->state = PROCESS_STATE_STOPPED;
@@ -602,32 +1326,80 @@ _process_stop(struct Process *process)
   }
 }
 
+// Convert a timer value to ticks, rounding up so that a short but non-zero
+// value still arms the timer
+static unsigned long
+process_itimer_ticks(const struct timeval *tv)
+{
+  struct timeval rounded;
+
+  if ((tv->tv_sec == 0) && (tv->tv_usec == 0))
+    return 0;
+
+  rounded.tv_sec  = tv->tv_sec;
+  rounded.tv_usec = tv->tv_usec + US_PER_TICK - 1;
+
+  return MAX(timeval2ticks(&rounded), 1ULL);
+}
+
+/**
+ * Arm or disarm an interval timer of the current process.
+ *
+ * @param which  ITIMER_REAL, ITIMER_VIRTUAL or ITIMER_PROF
+ * @param value  The new value, or NULL to only retrieve the current one
+ * @param ovalue Where to store the previous value (may be NULL)
+ *
+ * @retval 0       Success
+ * @retval -EINVAL Invalid timer or timer value
+ */
 int
 process_set_itimer(int which, struct itimerval *value, struct itimerval *ovalue)
 {
   struct Process *process = process_current();
+  unsigned long remain, interval;
 
-  if (which != ITIMER_REAL) {
-    cprintf("TODO: itimer %d\n", which);
+  if ((which < 0) || ((unsigned) which >= ARRAY_SIZE(process->itimers)))
     return -EINVAL;
-  }
 
-  process_lock();
+  if ((value != NULL) &&
+      ((value->it_value.tv_sec < 0) ||
+       (value->it_value.tv_usec < 0) ||
+       (value->it_value.tv_usec >= 1000000) ||
+       (value->it_interval.tv_sec < 0) ||
+       (value->it_interval.tv_usec < 0) ||
+       (value->it_interval.tv_usec >= 1000000)))
+    return -EINVAL;
 
-  // TODO: reimplement using timers
-  k_timer_stop(&process->itimers[which].timer);
+  process_lock();
 
-  if (value->it_value.tv_sec != 0 || value->it_value.tv_usec != 0) {
-    k_timer_init(&process->itimers[which].timer,
-      process_itimer, (void *) process->pid,
-      timeval2ticks(&value->it_value), timeval2ticks(&value->it_interval),
-      1);
+  if (which == ITIMER_REAL) {
+    remain = k_timer_remain(&process->itimer_real);
+    if (value != NULL)
+      k_timer_stop(&process->itimer_real);
+  } else {
+    remain = process->itimers[which].remain;
   }
+  interval = process->itimers[which].interval;
 
-  if (ovalue != NULL)
-    *ovalue = process->itimers[which].value;
+  if (value != NULL) {
+    unsigned long new_remain   = process_itimer_ticks(&value->it_value);
+    unsigned long new_interval = process_itimer_ticks(&value->it_interval);
+
+    process->itimers[which].remain   = new_remain;
+    process->itimers[which].interval = new_interval;
+
+    // The kernel timer reloads itself with the interval on expiration
+    if ((which == ITIMER_REAL) && (new_remain != 0))
+      k_timer_init(&process->itimer_real, process_itimer,
+                   (void *) process->pid, new_remain, new_interval, 1);
+  }
 
   process_unlock();
 
+  if (ovalue != NULL) {
+    ticks2timeval(remain, &ovalue->it_value);
+    ticks2timeval(interval, &ovalue->it_interval);
+  }
+
   return 0;
 }
@@ -11,8 +11,11 @@ extern struct KListLink __process_list;
 
 void _process_continue(struct Process *);
 void _process_stop(struct Process *);
+int  _process_vfork_release(struct Process *);
+int  _process_single_thread(struct Process *);
 
 void _signal_state_change_to_parent(struct Process *);
+int  _signal_generate_one(struct Process *, int, int);
 
 static inline void
 process_lock(void)
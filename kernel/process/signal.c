@@ -17,7 +17,6 @@ static void           signal_free(struct Signal *);
 static int            signal_action_default(struct Process *, struct Signal *, struct sigaction *);
 static int            signal_action_custom(struct Process *, struct Signal *, struct sigaction *);
 static struct Signal *signal_dequeue(struct Process *);
-static int            signal_generate_one(struct Process *, int, int);
 static void           signal_ctor(void *, size_t);
 static void           signal_dtor(void *, size_t);
 
@@ -272,7 +271,7 @@ _signal_state_change_to_parent(struct Process *process)
 {
   struct Process *parent = process->parent;
 
-  assert(k_spinlock_holding(&__process_lock));
+  debug_assert(k_spinlock_holding(&__process_lock));
 
   // TODO: can parent be NULL or itself??
   if ((parent == NULL) || (parent == process))
@@ -285,7 +284,7 @@ _signal_state_change_to_parent(struct Process *process)
       return;
   }
 
-  signal_generate_one(parent, SIGCHLD, 0);
+  _signal_generate_one(parent, SIGCHLD, 0);
 
   k_waitqueue_wakeup_all(&parent->wait_queue);
 }
@@ -297,7 +296,7 @@ signal_return(uintptr_t va)
   struct SignalFrame frame;
   int r;
 
-  if ((r = vm_copy_in(current->vm->pgtab, &frame, va, sizeof frame)) != 0)
+  if ((r = vm_copy_in(current->vm, &frame, va, sizeof frame)) != 0)
     return r;
 
   process_lock();
@@ -329,7 +328,7 @@ signal_generate(pid_t pid, int signo, int code)
     if (signo == 0)
       continue;
 
-    if ((r = signal_generate_one(process, signo, code)) != 0)
+    if ((r = _signal_generate_one(process, signo, code)) != 0)
       break;
   }
 
@@ -338,13 +337,13 @@ signal_generate(pid_t pid, int signo, int code)
   return r;
 }
 
-static int
-signal_generate_one(struct Process *process, int signo, int code)
+int
+_signal_generate_one(struct Process *process, int signo, int code)
 {
   struct Signal *signal;
 
   assert((signo > 0) && (signo <= NSIG));
-  assert(k_spinlock_holding(&__process_lock));
+  debug_assert(k_spinlock_holding(&__process_lock));
 
   // TODO: check for permissions
 
@@ -487,9 +486,11 @@ signal_action_default(struct Process *current,
   case SIGINT:
   case SIGKILL:
   case SIGPIPE:
+  case SIGPROF:
   case SIGTERM:
   case SIGUSR1:
   case SIGUSR2:
+  case SIGVTALRM:
     // Abnormal termination
     return signo;
 
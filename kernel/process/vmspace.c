@@ -4,6 +4,7 @@
 #include <sys/mman.h>
 
 #include <kernel/console.h>
+#include <kernel/core/semaphore.h>
 #include <kernel/tty.h>
 #include <kernel/fs/fs.h>
 #include <kernel/types.h>
@@ -12,16 +13,119 @@
 #include <kernel/page.h>
 #include <kernel/vmspace.h>
 #include <kernel/process.h>
+#include <kernel/swap.h>
+#include <kernel/thread.h>
+
+// How far ahead of a fault the file is prefetched for MADV_SEQUENTIAL areas
+#define VMSPACE_READ_AHEAD  (16 * PAGE_SIZE)
+
+// The number of area descriptors allocated at once when cloning a space
+#define VMSPACE_CLONE_BATCH 8
 
 static struct KObjectPool *vmcache;
 static struct KObjectPool *vm_areacache;
 
+// All address spaces, walked when compacting physical memory. The page
+// scanner moves the spaces it has swept to the back of the list
+static struct {
+  struct KListLink head;
+  struct KSpinLock lock;
+} vm_spaces = {
+  KLIST_INITIALIZER(vm_spaces.head),
+  K_SPINLOCK_INITIALIZER("vm_spaces"),
+};
+
+// Address spaces of exited processes, torn down by the reclaim thread so that
+// the cost of freeing their memory is not paid on the way out of exit()
+static struct {
+  struct KListLink  queue;
+  struct KSpinLock  lock;
+  struct KSemaphore semaphore;
+} vm_reclaim = {
+  .queue = KLIST_INITIALIZER(vm_reclaim.queue),
+  .lock  = K_SPINLOCK_INITIALIZER("vm_reclaim"),
+};
+
+static unsigned long vm_space_migrate(struct Page *, unsigned);
+
+static struct PageMigrator vm_space_migrator = {
+  .name    = "vm_space",
+  .migrate = vm_space_migrate,
+};
+
+static struct VMSpaceMapEntry *vmspace_area_find(struct VMSpace *, uintptr_t);
+static void                    vmspace_area_insert(struct VMSpace *,
+                                                   struct VMSpaceMapEntry *,
+                                                   struct VMSpaceMapEntry *);
+static void                    vmspace_area_remove(struct VMSpace *,
+                                                   struct VMSpaceMapEntry *);
+static void                    vmspace_update_free_start(struct VMSpace *,
+                                                         uintptr_t,
+                                                         uintptr_t);
+static intptr_t                vmspace_map_area(struct VMSpace *, uintptr_t,
+                                                size_t, int, struct Inode *,
+                                                off_t, size_t);
+static int                     vmspace_sync_pages(struct VMSpace *,
+                                                  struct Inode *, uintptr_t,
+                                                  uintptr_t, off_t);
+
 /*
  * ----------------------------------------------------------------------------
  * Check User Memory Permissions
  * ----------------------------------------------------------------------------
  */
 
+// The next area in address order, or NULL
+static struct VMSpaceMapEntry *
+vmspace_area_next(struct VMSpace *vm, struct VMSpaceMapEntry *area)
+{
+  return (area->link.next != &vm->areas)
+    ? KLIST_CONTAINER(area->link.next, struct VMSpaceMapEntry, link)
+    : NULL;
+}
+
+/**
+ * Check that a range of user memory is mapped with the given permissions.
+ * Only the list of areas is consulted, so no page tables are walked and
+ * nothing is faulted in. The pages are allocated later, when actually copied.
+ *
+ * @param vm    The address space
+ * @param va    The starting address
+ * @param n     The size of the range in bytes
+ * @param flags The required permissions
+ *
+ * @retval 0       Success
+ * @retval -EFAULT Part of the range is not mapped or lacks the permissions
+ */
+int
+vm_space_check_buf(struct VMSpace *vm, uintptr_t va, size_t n, int flags)
+{
+  struct VMSpaceMapEntry *area;
+  uintptr_t end = va + n;
+  int r = 0;
+
+  if ((va >= VIRT_KERNEL_BASE) || (end < va) || (end > VIRT_KERNEL_BASE))
+    return -EFAULT;
+
+  k_rwspinlock_read_acquire(&vm->area_lock);
+
+  // Adjacent areas may together cover the range
+  for (area = vmspace_area_find(vm, va); va < end;
+       area = vmspace_area_next(vm, area)) {
+    if ((area == NULL) || (area->start > va) ||
+        ((area->flags & flags) != flags)) {
+      r = -EFAULT;
+      break;
+    }
+
+    va = area->start + area->length;
+  }
+
+  k_rwspinlock_read_release(&vm->area_lock);
+
+  return r;
+}
+
 /*
  * ----------------------------------------------------------------------------
  * Loading Binaries
@@ -42,24 +146,45 @@ vm_space_create(void)
   }
 
   k_spinlock_init(&vm->lock, "vmspace");
+  k_rwspinlock_init(&vm->area_lock, "vmspace_areas");
   k_list_init(&vm->areas);
+  k_rbtree_init(&vm->area_tree);
+  vm->free_start = PAGE_SIZE;
+  vm->asid       = 0;
+  vm->swap_hand  = 0;
+
+  k_spinlock_acquire(&vm_spaces.lock);
+  k_list_add_back(&vm_spaces.head, &vm->link);
+  k_spinlock_release(&vm_spaces.lock);
 
   return vm;
 }
 
-void
-vm_space_destroy(struct VMSpace *vm)
+// Unmap and free everything in an address space that nobody uses any more
+static void
+vm_space_teardown(struct VMSpace *vm)
 {
   struct VMSpaceMapEntry *area;
 
-  // vm_user_free(vm->pgtab, 0, ROUND_UP(vm->heap, PAGE_SIZE));
-  // vm_user_free(vm->pgtab, vm->stack, USTACK_SIZE);
+  // vm_user_free(vm, 0, ROUND_UP(vm->heap, PAGE_SIZE));
+  // vm_user_free(vm, vm->stack, USTACK_SIZE);
   
   while (!k_list_is_empty(&vm->areas)) {
     area = KLIST_CONTAINER(vm->areas.next, struct VMSpaceMapEntry, link);
-    vm_user_free(vm->pgtab, area->start, area->length);
 
-    k_list_remove(&area->link);
+    // Modified pages of the shared mappings go back to their files
+    if ((area->flags & VM_SHARED) && (area->inode != NULL))
+      vmspace_sync_pages(vm, area->inode, area->start,
+                         area->start + area->length, area->file_offset);
+
+    // Tables still shared with other address spaces are simply dropped
+    vm_user_detach(vm, area->start, area->length);
+    vm_user_free(vm, area->start, area->length);
+
+    if (area->inode != NULL)
+      fs_inode_put(area->inode);
+
+    vmspace_area_remove(vm, area);
     k_object_pool_put(vm_areacache, area);
   }
 
@@ -68,125 +193,1258 @@ vm_space_destroy(struct VMSpace *vm)
   k_object_pool_put(vmcache, vm);
 }
 
+void
+vm_space_destroy(struct VMSpace *vm)
+{
+  k_spinlock_acquire(&vm_spaces.lock);
+  k_list_remove(&vm->link);
+  k_spinlock_release(&vm_spaces.lock);
+
+  vm_space_teardown(vm);
+}
+
+/**
+ * Destroy an address space in the background. The memory is freed by the
+ * reclaim thread some time later, so the caller does not wait for it.
+ *
+ * No thread may be using the address space, and the current processor must
+ * have switched away from it.
+ *
+ * @param vm The address space
+ */
+void
+vm_space_destroy_deferred(struct VMSpace *vm)
+{
+  // The page scanner and the compactor no longer see the space
+  k_spinlock_acquire(&vm_spaces.lock);
+  k_list_remove(&vm->link);
+  k_spinlock_release(&vm_spaces.lock);
+
+  k_spinlock_acquire(&vm_reclaim.lock);
+  k_list_add_back(&vm_reclaim.queue, &vm->link);
+  k_spinlock_release(&vm_reclaim.lock);
+
+  k_semaphore_put(&vm_reclaim.semaphore);
+}
+
+static void
+vm_reclaim_thread(void *arg)
+{
+  (void) arg;
+
+  for (;;) {
+    struct VMSpace *vm;
+
+    if (k_semaphore_get(&vm_reclaim.semaphore) < 0)
+      panic("k_semaphore_get");
+
+    k_spinlock_acquire(&vm_reclaim.lock);
+
+    assert(!k_list_is_empty(&vm_reclaim.queue));
+
+    vm = KLIST_CONTAINER(vm_reclaim.queue.next, struct VMSpace, link);
+    k_list_remove(&vm->link);
+
+    k_spinlock_release(&vm_reclaim.lock);
+
+    vm_space_teardown(vm);
+  }
+}
+
 struct VMSpace   *
 vm_space_clone(struct VMSpace *vm, int share)
 {
   struct VMSpace *new_vm;
   struct KListLink *l;
   struct VMSpaceMapEntry *area, *new_area;
+  void *batch[VMSPACE_CLONE_BATCH];
+  unsigned nbatch = 0, next = 0;
 
   if ((new_vm = vm_space_create()) == NULL)
     return NULL;
 
+  // Other threads of the process may be mapping new areas meanwhile
+  k_rwspinlock_read_acquire(&vm->area_lock);
+
   KLIST_FOREACH(&vm->areas, l) {
     area = KLIST_CONTAINER(l, struct VMSpaceMapEntry, link);
 
-    new_area = (struct VMSpaceMapEntry *) k_object_pool_get(vm_areacache);
-    if (new_area == NULL) {
+    // Area descriptors are allocated several at a time
+    if (next == nbatch) {
+      nbatch = k_object_pool_get_bulk(vm_areacache, batch,
+                                      VMSPACE_CLONE_BATCH);
+      next = 0;
+    }
+
+    if (next == nbatch) {
+      k_rwspinlock_read_release(&vm->area_lock);
       vm_space_destroy(new_vm);
       return NULL;
     }
 
-    new_area->start  = area->start;
-    new_area->length = area->length;
-    new_area->flags  = area->flags;
-    k_list_add_back(&new_vm->areas, &new_area->link);
+    new_area = (struct VMSpaceMapEntry *) batch[next++];
+
+    new_area->start       = area->start;
+    new_area->length      = area->length;
+    new_area->flags       = area->flags;
+    new_area->inode       = (area->inode != NULL)
+                          ? fs_inode_duplicate(area->inode)
+                          : NULL;
+    new_area->file_offset = area->file_offset;
+    new_area->file_size   = area->file_size;
+    new_area->advice      = area->advice;
+    vmspace_area_insert(new_vm, new_area, NULL);
 
-    if (vm_user_clone(vm->pgtab, new_vm->pgtab, area->start, area->length, share) < 0) {
+    if (vm_user_clone(vm, new_vm, area->start, area->length, share) < 0) {
+      k_rwspinlock_read_release(&vm->area_lock);
+      k_object_pool_put_bulk(vm_areacache, batch + next, nbatch - next);
       vm_space_destroy(new_vm);
       return NULL;
     }
   }
 
+  new_vm->free_start = vm->free_start;
+
+  k_rwspinlock_read_release(&vm->area_lock);
+
+  // Return the descriptors left unused
+  k_object_pool_put_bulk(vm_areacache, batch + next, nbatch - next);
+
   return new_vm;
 }
 
 void
 vm_space_init(void)
 {
+  struct KThread *thread;
+
+  vm_init();
+
   vmcache = k_object_pool_create("vmcache", sizeof(struct VMSpace), 0, NULL, NULL);
   vm_areacache = k_object_pool_create("vm_areacache", sizeof(struct VMSpaceMapEntry), 0, NULL, NULL);
-}
 
+  page_migrator_register(&vm_space_migrator);
 
-intptr_t
-vmspace_map(struct VMSpace *vm, uintptr_t addr, size_t n, int flags)
+  k_semaphore_init(&vm_reclaim.semaphore, 0);
+
+  if ((thread = k_thread_create(NULL, vm_reclaim_thread, NULL, NZERO)) == NULL)
+    panic("cannot create the reclaim thread");
+  k_thread_resume(thread);
+}
+
+// Move the anonymous pages of the area that lie in the given physical range.
+// Returns the number of pages moved, or -ENOMEM if no page can be allocated
+static long
+vm_space_migrate_area(struct VMSpace *vm, struct VMSpaceMapEntry *area,
+                      struct Page *start, unsigned n)
 {
   uintptr_t va;
-  struct KListLink *l;
-  struct VMSpaceMapEntry *area, *prev, *next;
-  int r;
+  long moved = 0;
 
-  va = addr ? ROUND_UP((uintptr_t) addr, PAGE_SIZE) : PAGE_SIZE;
-  n  = ROUND_UP(n, PAGE_SIZE);
+  for (va = area->start; va < area->start + area->length; va += PAGE_SIZE) {
+    struct Page *page, *new_page, *old_page;
 
-  if ((va >= VIRT_KERNEL_BASE) || ((va + n) > VIRT_KERNEL_BASE) || ((va + n) <= va))
-    return -EINVAL;
+    page = vm_page_lookup(vm, va, NULL);
+    if ((page == NULL) || (page < start) || (page >= start + n))
+      continue;
 
-  // Find Vm area to insert before
-  for (l = vm->areas.next; l != &vm->areas; l = l->next) {
-    area = KLIST_CONTAINER(l, struct VMSpaceMapEntry, link);
+    // Pages freed into the range meanwhile are isolated as well
+    while ((new_page = page_alloc_one(PAGE_ALLOC_NORECLAIM,
+                                      PAGE_TAG_ANON)) != NULL) {
+      if ((new_page < start) || (new_page >= start + n))
+        break;
+      page_compact_release(new_page);
+    }
+
+    if (new_page == NULL)
+      return -ENOMEM;
+
+    if (vm_page_migrate(vm, va, new_page, &old_page) == 0) {
+      page_compact_release(old_page);
+      moved++;
+    } else {
+      page_free_one(new_page);
+    }
+  }
+
+  return moved;
+}
+
+// Page migrator callback: move the anonymous pages of all address spaces out
+// of the given physical range. Busy address spaces are skipped
+static unsigned long
+vm_space_migrate(struct Page *start, unsigned n)
+{
+  struct KListLink *l, *al;
+  unsigned long moved = 0;
+  long r = 0;
+
+  if (k_spinlock_try_acquire(&vm_spaces.lock) != 0)
+    return 0;
+
+  KLIST_FOREACH(&vm_spaces.head, l) {
+    struct VMSpace *vm = KLIST_CONTAINER(l, struct VMSpace, link);
+
+    if (k_rwspinlock_try_read_acquire(&vm->area_lock) != 0)
+      continue;
+
+    KLIST_FOREACH(&vm->areas, al) {
+      struct VMSpaceMapEntry *area;
+
+      area = KLIST_CONTAINER(al, struct VMSpaceMapEntry, link);
+      if (area->inode != NULL)
+        continue;
+
+      if (k_spinlock_try_acquire(&vm->lock) != 0)
+        break;
+
+      r = vm_space_migrate_area(vm, area, start, n);
+
+      k_spinlock_release(&vm->lock);
+
+      if (r < 0)
+        break;
+      moved += r;
+    }
+
+    k_rwspinlock_read_release(&vm->area_lock);
+
+    if ((r < 0) || (moved >= n))
+      break;
+  }
+
+  k_spinlock_release(&vm_spaces.lock);
+
+  return moved;
+}
+
+// Continue sweeping the anonymous areas of the address space from where the
+// scanner has stopped the last time. Returns the number of pages visited, and
+// moves the hand back to the start once the last area has been swept
+static unsigned
+vm_space_swap_scan_one(struct VMSpace *vm, struct SwapCluster *cluster,
+                       unsigned budget)
+{
+  struct VMSpaceMapEntry *area;
+  unsigned n = 0;
+
+  for (area = vmspace_area_find(vm, vm->swap_hand);
+       area != NULL;
+       area = vmspace_area_next(vm, area)) {
+    uintptr_t va, end = area->start + area->length;
+
+    if ((area->inode != NULL) || (area->flags & VM_SHARED))
+      continue;
+
+    va = MAX(vm->swap_hand, area->start);
+
+    k_spinlock_acquire(&vm->lock);
+
+    for ( ; (va < end) && (n < budget) && (cluster->count < cluster->size);
+         va += PAGE_SIZE, n++) {
+      struct Page *page;
+
+      if (vm_page_age(vm, va, cluster->first + cluster->count, &page) == 1)
+        swap_cluster_add(cluster, page);
+    }
+
+    k_spinlock_release(&vm->lock);
+
+    vm->swap_hand = va;
 
+    if (va < end)
+      return n;
+  }
+
+  vm->swap_hand = 0;
+  return n;
+}
+
+/**
+ * Advance the page scanner over the anonymous memory of all address spaces,
+ * filling the cluster with pages that have not been accessed since the
+ * previous visit (see vm_page_age()). The address spaces are swept one after
+ * another, in turn.
+ *
+ * @param cluster The cluster to be filled
+ * @param budget  The maximum number of pages to visit
+ *
+ * @return The number of pages visited, 0 if there is nothing to scan.
+ */
+unsigned
+vm_space_swap_scan(struct SwapCluster *cluster, unsigned budget)
+{
+  struct VMSpace *first = NULL;
+  unsigned n = 0;
+
+  k_spinlock_acquire(&vm_spaces.lock);
+
+  while ((n < budget) && (cluster->count < cluster->size) &&
+         !k_list_is_empty(&vm_spaces.head)) {
+    struct VMSpace *vm;
+
+    vm = KLIST_CONTAINER(vm_spaces.head.next, struct VMSpace, link);
+
+    // Went around all address spaces
+    if (vm == first)
+      break;
+    if (first == NULL)
+      first = vm;
+
+    // Busy address spaces are visited later
+    if (k_rwspinlock_try_read_acquire(&vm->area_lock) == 0) {
+      n += vm_space_swap_scan_one(vm, cluster, budget - n);
+      k_rwspinlock_read_release(&vm->area_lock);
+
+      // Stopped in the middle
+      if (vm->swap_hand != 0)
+        break;
+    }
+
+    k_list_remove(&vm->link);
+    k_list_add_back(&vm_spaces.head, &vm->link);
+  }
+
+  k_spinlock_release(&vm_spaces.lock);
+
+  return n;
+}
+
+
+/**
+ * Find the first area that ends above the given address.
+ *
+ * @param vm The address space
+ * @param va The virtual address
+ *
+ * @return Pointer to the area containing va, or the first area above va, or
+ *         NULL if there is no such area
+ */
+static struct VMSpaceMapEntry *
+vmspace_area_find(struct VMSpace *vm, uintptr_t va)
+{
+  struct KRBNode *node = vm->area_tree.root;
+  struct VMSpaceMapEntry *result = NULL;
+
+  while (node != NULL) {
+    struct VMSpaceMapEntry *area;
+
+    area = KRBTREE_CONTAINER(node, struct VMSpaceMapEntry, node);
+
+    if (va < (area->start + area->length)) {
+      result = area;
+      node = node->left;
+    } else {
+      node = node->right;
+    }
+  }
+
+  return result;
+}
+
+// Insert the area before the given one (or at the end if next is NULL)
+static void
+vmspace_area_insert(struct VMSpace *vm, struct VMSpaceMapEntry *area,
+                    struct VMSpaceMapEntry *next)
+{
+  struct KRBNode **link = &vm->area_tree.root, *parent = NULL;
+
+  while (*link != NULL) {
+    struct VMSpaceMapEntry *other;
+
+    parent = *link;
+    other  = KRBTREE_CONTAINER(parent, struct VMSpaceMapEntry, node);
+    link   = (area->start < other->start) ? &parent->left : &parent->right;
+  }
+
+  k_rbtree_link(&area->node, parent, link);
+  k_rbtree_insert_fixup(&vm->area_tree, &area->node);
+
+  k_list_add_back(next != NULL ? &next->link : &vm->areas, &area->link);
+}
+
+static void
+vmspace_area_remove(struct VMSpace *vm, struct VMSpaceMapEntry *area)
+{
+  k_rbtree_remove(&vm->area_tree, &area->node);
+  k_list_remove(&area->link);
+
+  if (area->start < vm->free_start)
+    vm->free_start = area->start;
+}
+
+// Keep the free_start hint up to date after [va, va + n) has been used
+static void
+vmspace_update_free_start(struct VMSpace *vm, uintptr_t va, uintptr_t n)
+{
+  struct VMSpaceMapEntry *area;
+  uintptr_t end;
+
+  if (va != vm->free_start)
+    return;
+
+  // Skip over the areas that immediately follow the new one
+  end = va + n;
+  for (area = vmspace_area_find(vm, end);
+       (area != NULL) && (area->start <= end);
+       area = vmspace_area_next(vm, area))
+    end = area->start + area->length;
+
+  vm->free_start = end;
+}
+
+/**
+ * Find the first large enough gap at or above the given address.
+ *
+ * @param vm          The address space
+ * @param va          The lowest acceptable address
+ * @param n           The size of the gap (page-aligned)
+ * @param align       The required alignment of the gap start
+ * @param after_store Pointer to the memory location to store the area that
+ *                    follows the gap (or NULL if the gap is above all areas)
+ *
+ * @return The start address of the gap, or -ENOMEM if there is no such gap
+ */
+static intptr_t
+vmspace_find_gap(struct VMSpace *vm, uintptr_t va, size_t n, size_t align,
+                 struct VMSpaceMapEntry **after_store)
+{
+  struct VMSpaceMapEntry *after;
+
+  // There are no free pages below free_start
+  va = ROUND_UP(MAX(va, vm->free_start), align);
+
+  // Start from the area that contains va
+  for (after = vmspace_area_find(vm, va);
+       after != NULL;
+       after = vmspace_area_next(vm, after)) {
     // Can insert before
-    if ((va + n) <= area->start)
+    if (((va + n) <= after->start) && ((va + n) > va))
       break;
 
-    if (va < (area->start + area->length))
-      va = area->start + area->length;
+    if (va < (after->start + after->length))
+      va = ROUND_UP(after->start + after->length, align);
   }
 
-  if ((va + n) > VIRT_KERNEL_BASE)
+  if ((va == 0) || ((va + n) > VIRT_KERNEL_BASE) || ((va + n) <= va))
     return -ENOMEM;
 
-  if ((r = vm_user_alloc(vm->pgtab, va, n, flags)) < 0) {
-    vm_user_free(vm->pgtab, va, n);
+  *after_store = after;
+
+  return va;
+}
+
+intptr_t
+vmspace_map(struct VMSpace *vm, uintptr_t addr, size_t n, int flags)
+{
+  intptr_t r;
+
+  k_rwspinlock_write_acquire(&vm->area_lock);
+  r = vmspace_map_area(vm, addr, n, flags, NULL, 0, 0);
+  k_rwspinlock_write_release(&vm->area_lock);
+
+  return r;
+}
+
+/**
+ * Map a region whose first bytes are backed by a file, such as an ELF
+ * segment. Nothing is read until the pages are accessed; the remaining part
+ * of the region is filled with zeros.
+ *
+ * @param vm        The address space
+ * @param addr      The page-aligned starting address
+ * @param n         The size of the region in bytes
+ * @param flags     The mapping flags
+ * @param ip        The file inode (the area keeps a reference to it)
+ * @param off       The file offset corresponding to addr
+ * @param file_size The number of bytes to take from the file
+ *
+ * @return The starting virtual address or a negative error code
+ */
+intptr_t
+vmspace_map_file(struct VMSpace *vm, uintptr_t addr, size_t n, int flags,
+                 struct Inode *ip, off_t off, size_t file_size)
+{
+  intptr_t r;
+
+  assert(file_size <= n);
+
+  k_rwspinlock_write_acquire(&vm->area_lock);
+  r = vmspace_map_area(vm, addr, n, flags, ip, off, file_size);
+  k_rwspinlock_write_release(&vm->area_lock);
+
+  return r;
+}
+
+static intptr_t
+vmspace_map_area(struct VMSpace *vm, uintptr_t addr, size_t n, int flags,
+                 struct Inode *ip, off_t off, size_t file_size)
+{
+  intptr_t va;
+  struct VMSpaceMapEntry *area, *prev, *next, *after;
+  size_t file_pages;
+  int r;
+
+  va = addr ? ROUND_UP((uintptr_t) addr, PAGE_SIZE) : vm->free_start;
+  n  = ROUND_UP(n, PAGE_SIZE);
+
+  if (((uintptr_t) va >= VIRT_KERNEL_BASE) ||
+      ((va + n) > VIRT_KERNEL_BASE) ||
+      ((va + n) <= (uintptr_t) va))
+    return -EINVAL;
+
+  // Large regions are aligned, so they can be backed by sections
+  if ((va = vmspace_find_gap(vm, va, n,
+                             (n >= VM_SECTION_SIZE) && (addr == 0)
+                               ? VM_SECTION_SIZE
+                               : PAGE_SIZE,
+                             &after)) < 0)
+    return va;
+
+  // Only the pages that overlap the file need to be read
+  file_pages = ROUND_UP(file_size, PAGE_SIZE);
+
+  if (((r = vm_user_alloc(vm, va, file_pages, flags | VM_FILE)) < 0) ||
+      ((r = vm_user_alloc(vm, va + file_pages, n - file_pages, flags)) < 0)) {
+    vm_user_free(vm, va, n);
     return r;
   }
 
-  // Can merge with previous?
-  prev = NULL;
-  if (l->prev != &vm->areas) {
-    prev = KLIST_CONTAINER(l->prev, struct VMSpaceMapEntry, link);
-    if (((prev->start + prev->length) != va) || (prev->flags != flags))
-      prev = NULL;
+  // File-backed areas are never merged
+  if (ip != NULL) {
+    prev = next = NULL;
+    goto insert;
   }
 
+  // Can merge with previous?
+  if (after != NULL)
+    prev = (after->link.prev != &vm->areas)
+      ? KLIST_CONTAINER(after->link.prev, struct VMSpaceMapEntry, link)
+      : NULL;
+  else
+    prev = !k_list_is_empty(&vm->areas)
+      ? KLIST_CONTAINER(vm->areas.prev, struct VMSpaceMapEntry, link)
+      : NULL;
+
+  if ((prev != NULL) &&
+      (((prev->start + prev->length) != (uintptr_t) va) ||
+       (prev->flags != flags) || (prev->inode != NULL) ||
+       (prev->advice != MADV_NORMAL)))
+    prev = NULL;
+
   // Can merge with next?
-  next = NULL;
-  if (l != &vm->areas) {
-    next = KLIST_CONTAINER(l, struct VMSpaceMapEntry, link);
-    if ((next->start != (va + n)) || (next->flags != flags))
-      next = NULL;
-  }
+  next = after;
+  if ((next != NULL) &&
+      ((next->start != (va + n)) || (next->flags != flags) ||
+       (next->inode != NULL) || (next->advice != MADV_NORMAL)))
+    next = NULL;
 
+insert:
   if ((prev != NULL) && (next != NULL)) {
     prev->length += next->length + n;
 
-    k_list_remove(&next->link);
+    vmspace_area_remove(vm, next);
     k_object_pool_put(vm_areacache, next);
   } else if (prev != NULL) {
     prev->length += n;
   } else if (next != NULL) {
-    next->start = va;
+    // The order of the areas does not change, so the tree stays valid
+    next->start   = va;
+    next->length += n;
   } else {
     area = (struct VMSpaceMapEntry *) k_object_pool_get(vm_areacache);
     if (area == NULL) {
-      vm_user_free(vm->pgtab, va, n);
+      vm_user_free(vm, va, n);
       return -ENOMEM;
     }
 
-    area->start  = va;
-    area->length = n;
-    area->flags  = flags;
+    area->start       = va;
+    area->length      = n;
+    area->flags       = flags;
+    area->inode       = (ip != NULL) ? fs_inode_duplicate(ip) : NULL;
+    area->file_offset = off;
+    area->file_size   = file_size;
+    area->advice      = MADV_NORMAL;
 
-    k_list_add_back(l, &area->link);
+    vmspace_area_insert(vm, area, after);
   }
 
+  vmspace_update_free_start(vm, va, n);
+
   // cprintf("[page_free_count %d]\n", page_free_count);
 
   return va;
 }
 
+static int
+vmspace_map_page_locked(struct VMSpace *vm, uintptr_t va, struct Page *page,
+                        int flags)
+{
+  struct VMSpaceMapEntry *area, *after;
+  int r;
+
+  after = vmspace_area_find(vm, va);
+  if ((after != NULL) && (after->start < (va + PAGE_SIZE)))
+    return -EINVAL;
+
+  area = (struct VMSpaceMapEntry *) k_object_pool_get(vm_areacache);
+  if (area == NULL)
+    return -ENOMEM;
+
+  if ((r = vm_user_map(vm, page, va, flags)) < 0) {
+    k_object_pool_put(vm_areacache, area);
+    return r;
+  }
+
+  area->start       = va;
+  area->length      = PAGE_SIZE;
+  area->flags       = flags | VM_PAGE;
+  area->inode       = NULL;
+  area->file_offset = 0;
+  area->file_size   = 0;
+  area->advice      = MADV_NORMAL;
+
+  vmspace_area_insert(vm, area, after);
+  vmspace_update_free_start(vm, va, PAGE_SIZE);
+
+  return 0;
+}
+
+/**
+ * Map a single existing physical page at the given fixed address.
+ *
+ * @param vm    The address space
+ * @param va    The page-aligned user virtual address
+ * @param page  The page to map
+ * @param flags The mapping flags
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The address is already in use
+ * @retval -ENOMEM Out of memory
+ */
+int
+vmspace_map_page(struct VMSpace *vm, uintptr_t va, struct Page *page, int flags)
+{
+  int r;
+
+  k_rwspinlock_write_acquire(&vm->area_lock);
+  r = vmspace_map_page_locked(vm, va, page, flags);
+  k_rwspinlock_write_release(&vm->area_lock);
+
+  return r;
+}
+
+static intptr_t
+vmspace_map_block_locked(struct VMSpace *vm, struct Page *block, unsigned order,
+                         int flags)
+{
+  struct VMSpaceMapEntry *area, *after;
+  size_t n = PAGE_SIZE << order;
+  intptr_t va;
+  int r;
+
+  if ((va = vmspace_find_gap(vm, 0, n, VM_SECTION_SIZE, &after)) < 0)
+    return va;
+
+  area = (struct VMSpaceMapEntry *) k_object_pool_get(vm_areacache);
+  if (area == NULL)
+    return -ENOMEM;
+
+  if ((r = vm_user_map_block(vm, block, order, va, flags)) < 0) {
+    k_object_pool_put(vm_areacache, area);
+    return r;
+  }
+
+  area->start       = va;
+  area->length      = n;
+  area->flags       = flags | VM_PAGE;
+  area->inode       = NULL;
+  area->file_offset = 0;
+  area->file_size   = 0;
+  area->advice      = MADV_NORMAL;
+
+  vmspace_area_insert(vm, area, after);
+  vmspace_update_free_start(vm, va, n);
+
+  return va;
+}
+
+/**
+ * Map a physically contiguous page block (such as the framebuffer) at a free
+ * section-aligned address. The pages are shared with the caller and are not
+ * copied on fork.
+ *
+ * @param vm    The address space
+ * @param block The first page of the block
+ * @param order The allocation order of the block (at least VM_SECTION_ORDER)
+ * @param flags The mapping flags
+ *
+ * @return The starting virtual address or a negative error code
+ */
+intptr_t
+vmspace_map_block(struct VMSpace *vm, struct Page *block, unsigned order,
+                  int flags)
+{
+  intptr_t r;
+
+  k_rwspinlock_write_acquire(&vm->area_lock);
+  r = vmspace_map_block_locked(vm, block, order, flags);
+  k_rwspinlock_write_release(&vm->area_lock);
+
+  return r;
+}
+
+/**
+ * Split an area in two at the given page-aligned address inside it.
+ *
+ * @param vm   The address space
+ * @param area The area to split
+ * @param va   The address where the second part starts
+ *
+ * @return 0 on success, -ENOMEM if out of memory
+ */
+static int
+vmspace_area_split(struct VMSpace *vm, struct VMSpaceMapEntry *area,
+                   uintptr_t va)
+{
+  struct VMSpaceMapEntry *tail;
+  size_t head_length = va - area->start;
+
+  assert((va > area->start) && (va < area->start + area->length));
+
+  tail = (struct VMSpaceMapEntry *) k_object_pool_get(vm_areacache);
+  if (tail == NULL)
+    return -ENOMEM;
+
+  tail->start       = va;
+  tail->length      = area->length - head_length;
+  tail->flags       = area->flags;
+  tail->inode       = (area->inode != NULL)
+                    ? fs_inode_duplicate(area->inode)
+                    : NULL;
+  tail->file_offset = area->file_offset + head_length;
+  tail->file_size   = (area->file_size > head_length)
+                    ? area->file_size - head_length
+                    : 0;
+  tail->advice      = area->advice;
+
+  area->length    = head_length;
+  area->file_size = MIN(area->file_size, head_length);
+
+  vmspace_area_insert(vm, tail, vmspace_area_next(vm, area));
+
+  return 0;
+}
+
+// Make [va, end) start and end on area boundaries, so that the areas covering
+// it can be changed as a whole
+static int
+vmspace_area_isolate(struct VMSpace *vm, uintptr_t va, uintptr_t end)
+{
+  struct VMSpaceMapEntry *area;
+  int r;
+
+  area = vmspace_area_find(vm, va);
+  if ((area != NULL) && (area->start < va) &&
+      ((r = vmspace_area_split(vm, area, va)) < 0))
+    return r;
+
+  area = vmspace_area_find(vm, end);
+  if ((area != NULL) && (area->start < end) &&
+      ((r = vmspace_area_split(vm, area, end)) < 0))
+    return r;
+
+  return 0;
+}
+
+/**
+ * Remove all mappings in the given range. Modified pages of shared file
+ * mappings are written back first.
+ *
+ * @param vm   The address space
+ * @param addr The page-aligned starting address
+ * @param n    The size of the range in bytes
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The range is not valid
+ * @retval -ENOMEM Out of memory (to split an area)
+ */
+int
+vmspace_unmap(struct VMSpace *vm, uintptr_t addr, size_t n)
+{
+  struct VMSpaceMapEntry *area, *next;
+  struct KListLink removed;
+  uintptr_t end;
+  int r;
+
+  n   = ROUND_UP(n, PAGE_SIZE);
+  end = addr + n;
+
+  if (((addr % PAGE_SIZE) != 0) || (n == 0) || (end < addr) ||
+      (end > VIRT_KERNEL_BASE))
+    return -EINVAL;
+
+  // Holes in the range are skipped
+  vmspace_sync(vm, addr, n);
+
+  k_rwspinlock_write_acquire(&vm->area_lock);
+
+  if ((r = vmspace_area_isolate(vm, addr, end)) < 0) {
+    k_rwspinlock_write_release(&vm->area_lock);
+    return r;
+  }
+
+  vm_user_free(vm, addr, n);
+
+  k_list_init(&removed);
+
+  for (area = vmspace_area_find(vm, addr);
+       (area != NULL) && (area->start < end);
+       area = next) {
+    next = vmspace_area_next(vm, area);
+
+    vmspace_area_remove(vm, area);
+    k_list_add_back(&removed, &area->link);
+  }
+
+  k_rwspinlock_write_release(&vm->area_lock);
+
+  // Dropping the last reference to a deleted file may sleep
+  while (!k_list_is_empty(&removed)) {
+    area = KLIST_CONTAINER(removed.next, struct VMSpaceMapEntry, link);
+    k_list_remove(&area->link);
+
+    if (area->inode != NULL)
+      fs_inode_put(area->inode);
+
+    k_object_pool_put(vm_areacache, area);
+  }
+
+  return 0;
+}
+
+/**
+ * Change the access permissions of all mappings in the given range.
+ *
+ * @param vm   The address space
+ * @param addr The page-aligned starting address
+ * @param n    The size of the range in bytes
+ * @param prot The new permissions (PROT_READ, PROT_WRITE and PROT_EXEC)
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The range is not valid
+ * @retval -ENOMEM Part of the range is not mapped, or out of memory
+ */
+int
+vmspace_protect(struct VMSpace *vm, uintptr_t addr, size_t n, int prot)
+{
+  struct VMSpaceMapEntry *area;
+  uintptr_t end, va;
+  int r;
+
+  n   = ROUND_UP(n, PAGE_SIZE);
+  end = addr + n;
+
+  if (((addr % PAGE_SIZE) != 0) || (end < addr) || (end > VIRT_KERNEL_BASE))
+    return -EINVAL;
+
+  if (n == 0)
+    return 0;
+
+  k_rwspinlock_write_acquire(&vm->area_lock);
+
+  // The whole range must be mapped
+  for (va = addr, area = vmspace_area_find(vm, va);
+       va < end;
+       va = area->start + area->length, area = vmspace_area_next(vm, area)) {
+    if ((area == NULL) || (area->start > va)) {
+      k_rwspinlock_write_release(&vm->area_lock);
+      return -ENOMEM;
+    }
+  }
+
+  if ((r = vmspace_area_isolate(vm, addr, end)) < 0) {
+    k_rwspinlock_write_release(&vm->area_lock);
+    return r;
+  }
+
+  for (area = vmspace_area_find(vm, addr);
+       (area != NULL) && (area->start < end);
+       area = vmspace_area_next(vm, area)) {
+    int flags;
+
+    flags = (area->flags & ~(VM_READ | VM_WRITE | VM_EXEC)) | prot;
+
+    if ((r = vm_user_protect(vm, area->start, area->length,
+                             flags & ~VM_PAGE)) < 0)
+      break;
+
+    area->flags = flags;
+  }
+
+  k_rwspinlock_write_release(&vm->area_lock);
+
+  return r;
+}
+
+// Write the modified pages of a shared file mapping in [va, end) back to the
+// file; off is the file offset corresponding to va
+static int
+vmspace_sync_pages(struct VMSpace *vm, struct Inode *inode, uintptr_t va,
+                   uintptr_t end, off_t off)
+{
+  int r = 0;
+
+  for ( ; va < end; va += PAGE_SIZE, off += PAGE_SIZE) {
+    struct Page *page;
+
+    if ((r = vm_user_clean(vm, va, &page)) <= 0) {
+      if (r < 0)
+        break;
+      continue;
+    }
+
+    fs_inode_lock(inode);
+    r = fs_page_write_back(inode, off / PAGE_SIZE, page);
+    fs_inode_unlock(inode);
+
+    fs_page_put(page);
+
+    if (r < 0)
+      break;
+  }
+
+  return r;
+}
+
+/**
+ * Write the modified pages of the shared file mappings in the given range back
+ * to their files. The pages stay mapped.
+ *
+ * @param vm   The address space
+ * @param addr The page-aligned starting address
+ * @param n    The size of the range in bytes
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The range is not valid
+ * @retval -ENOMEM Part of the range is not mapped
+ */
+int
+vmspace_sync(struct VMSpace *vm, uintptr_t addr, size_t n)
+{
+  uintptr_t va, end;
+  int r = 0;
+
+  end = addr + ROUND_UP(n, PAGE_SIZE);
+
+  if (((addr % PAGE_SIZE) != 0) || (end < addr) || (end > VIRT_KERNEL_BASE))
+    return -EINVAL;
+
+  for (va = addr; va < end; ) {
+    struct VMSpaceMapEntry *area;
+    struct Inode *inode = NULL;
+    uintptr_t area_end;
+    off_t off = 0;
+
+    // Writing back sleeps, so the area lock cannot be held meanwhile
+    k_rwspinlock_read_acquire(&vm->area_lock);
+
+    if (((area = vmspace_area_find(vm, va)) == NULL) || (area->start >= end)) {
+      k_rwspinlock_read_release(&vm->area_lock);
+      break;
+    }
+
+    if (area->start > va) {
+      r = -ENOMEM;
+      va = area->start;
+    }
+
+    area_end = MIN(area->start + area->length, end);
+    if ((area->flags & VM_SHARED) && (area->inode != NULL)) {
+      inode = fs_inode_duplicate(area->inode);
+      off   = area->file_offset + (va - area->start);
+    }
+
+    k_rwspinlock_read_release(&vm->area_lock);
+
+    if (inode != NULL) {
+      int err = vmspace_sync_pages(vm, inode, va, area_end, off);
+
+      fs_inode_put(inode);
+
+      if ((err < 0) && (r == 0))
+        r = err;
+    }
+
+    va = area_end;
+  }
+
+  return (va < end) ? -ENOMEM : r;
+}
+
+// Remember the expected access pattern of the areas in [va, end)
+static int
+vmspace_advise_pattern(struct VMSpace *vm, uintptr_t va, uintptr_t end,
+                       int advice)
+{
+  struct VMSpaceMapEntry *area;
+  uintptr_t addr;
+  int r;
+
+  k_rwspinlock_write_acquire(&vm->area_lock);
+
+  // The whole range must be mapped
+  for (addr = va, area = vmspace_area_find(vm, addr);
+       addr < end;
+       addr = area->start + area->length, area = vmspace_area_next(vm, area)) {
+    if ((area == NULL) || (area->start > addr)) {
+      k_rwspinlock_write_release(&vm->area_lock);
+      return -ENOMEM;
+    }
+  }
+
+  if ((r = vmspace_area_isolate(vm, va, end)) == 0) {
+    for (area = vmspace_area_find(vm, va);
+         (area != NULL) && (area->start < end);
+         area = vmspace_area_next(vm, area))
+      area->advice = advice;
+  }
+
+  k_rwspinlock_write_release(&vm->area_lock);
+
+  return r;
+}
+
+// Start reading the file pages of the areas in [va, end)
+static int
+vmspace_prefetch(struct VMSpace *vm, uintptr_t va, uintptr_t end)
+{
+  int r = 0;
+
+  while (va < end) {
+    struct VMSpaceMapEntry *area;
+    struct Inode *inode = NULL;
+    uintptr_t area_end;
+    size_t n = 0;
+    off_t off = 0;
+
+    // Locking the inode sleeps, so the area lock cannot be held meanwhile
+    k_rwspinlock_read_acquire(&vm->area_lock);
+
+    if (((area = vmspace_area_find(vm, va)) == NULL) || (area->start >= end)) {
+      k_rwspinlock_read_release(&vm->area_lock);
+      break;
+    }
+
+    if (area->start > va) {
+      r = -ENOMEM;
+      va = area->start;
+    }
+
+    area_end = MIN(area->start + area->length, end);
+    if ((area->inode != NULL) && (va < area->start + area->file_size)) {
+      inode = fs_inode_duplicate(area->inode);
+      off   = area->file_offset + (va - area->start);
+      n     = MIN(area_end, area->start + area->file_size) - va;
+    }
+
+    k_rwspinlock_read_release(&vm->area_lock);
+
+    if (inode != NULL) {
+      fs_inode_lock_shared(inode);
+      fs_inode_prefetch_locked(inode, off, n);
+      fs_inode_unlock_shared(inode);
+
+      fs_inode_put(inode);
+    }
+
+    va = area_end;
+  }
+
+  return (va < end) ? -ENOMEM : r;
+}
+
+// Free the pages of the areas in [va, end), so that they are allocated (or
+// read from the file) again on the next access
+static int
+vmspace_discard(struct VMSpace *vm, uintptr_t va, uintptr_t end)
+{
+  struct VMSpaceMapEntry *area;
+  int r;
+
+  // Modified pages of the shared mappings must not be lost; any page written
+  // to after this point is kept mapped by vm_user_discard()
+  if ((r = vmspace_sync(vm, va, end - va)) < 0)
+    return r;
+
+  k_rwspinlock_write_acquire(&vm->area_lock);
+
+  for (area = vmspace_area_find(vm, va);
+       (area != NULL) && (area->start < end) && (r == 0);
+       area = vmspace_area_next(vm, area)) {
+    uintptr_t start, stop, file_end;
+
+    // Pages that exist independently of the area cannot be freed
+    if (area->flags & VM_PAGE) {
+      r = -EINVAL;
+      break;
+    }
+
+    start    = MAX(area->start, va);
+    stop     = MIN(area->start + area->length, end);
+    file_end = area->start + ROUND_UP(area->file_size, PAGE_SIZE);
+    file_end = MIN(MAX(file_end, start), stop);
+
+    if (((r = vm_user_discard(vm, start, file_end - start,
+                              area->flags | VM_FILE)) == 0))
+      r = vm_user_discard(vm, file_end, stop - file_end, area->flags);
+  }
+
+  k_rwspinlock_write_release(&vm->area_lock);
+
+  return r;
+}
+
+/**
+ * Advise how the memory in the given range is going to be used.
+ *
+ * MADV_NORMAL, MADV_RANDOM and MADV_SEQUENTIAL are remembered by the areas;
+ * a fault in a sequential file mapping also prefetches the pages that follow.
+ * MADV_WILLNEED starts reading the file pages in the range in the background.
+ * MADV_DONTNEED frees the pages, so that the next access gets zero-filled
+ * memory or reads the file again.
+ *
+ * @param vm     The address space
+ * @param addr   The page-aligned starting address
+ * @param n      The size of the range in bytes
+ * @param advice The advice (one of the MADV_* values)
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The range or the advice is not valid
+ * @retval -ENOMEM Part of the range is not mapped, or out of memory
+ */
+int
+vmspace_advise(struct VMSpace *vm, uintptr_t addr, size_t n, int advice)
+{
+  uintptr_t end;
+
+  n   = ROUND_UP(n, PAGE_SIZE);
+  end = addr + n;
+
+  if (((addr % PAGE_SIZE) != 0) || (end < addr) || (end > VIRT_KERNEL_BASE))
+    return -EINVAL;
+
+  switch (advice) {
+  case MADV_NORMAL:
+  case MADV_RANDOM:
+  case MADV_SEQUENTIAL:
+    return (n > 0) ? vmspace_advise_pattern(vm, addr, end, advice) : 0;
+  case MADV_WILLNEED:
+    return vmspace_prefetch(vm, addr, end);
+  case MADV_DONTNEED:
+    return vmspace_discard(vm, addr, end);
+  default:
+    return -EINVAL;
+  }
+}
+
+/**
+ * Get a page with the contents of a file-backed area. Pages that hold nothing
+ * but file data (or end at EOF) are taken from the page cache and shared with
+ * other mappings of the same file, other pages are read into a private copy.
+ * The caller must not hold any spinlocks, since reading the file may sleep.
+ *
+ * @param vm         The address space
+ * @param va         The page-aligned virtual address
+ * @param page_store Pointer to the memory location to store the page. The
+ *                   caller receives a reference to the page
+ *
+ * @retval 1       Success, the page is shared and must not be modified
+ * @retval 0       Success, the page is a private copy
+ * @retval -EFAULT The address does not belong to a file-backed area
+ * @retval -ENOMEM Out of memory
+ */
+int
+vmspace_fill_page(struct VMSpace *vm, uintptr_t va, struct Page **page_store)
+{
+  struct VMSpaceMapEntry *area;
+  struct Inode *inode;
+  struct Page *page;
+  size_t n, pos, file_size;
+  off_t off, file_offset;
+  int advice, locked, shared;
+  ssize_t r;
+
+  // Another thread may unmap the area once the lock is dropped, so take what
+  // is needed from it while holding the lock
+  k_rwspinlock_read_acquire(&vm->area_lock);
+
+  area = vmspace_area_find(vm, va);
+  if ((area == NULL) || (area->start > va) || (area->inode == NULL)) {
+    k_rwspinlock_read_release(&vm->area_lock);
+    return -EFAULT;
+  }
+
+  inode       = fs_inode_duplicate(area->inode);
+  pos         = va - area->start;
+  file_offset = area->file_offset;
+  file_size   = area->file_size;
+  advice      = area->advice;
+
+  k_rwspinlock_read_release(&vm->area_lock);
+
+  off = file_offset + pos;
+
+  // The inode may be already locked by the current process, e.g. when it
+  // reads its own executable into a buffer that has not been touched yet
+  if ((locked = !fs_inode_holding_shared(inode)))
+    fs_inode_lock_shared(inode);
+
+  // A cached page can be used if its tail does not have to be cleared, i.e.
+  // it is entirely within the area or the file ends there
+  shared = (pos < file_size) && ((off % PAGE_SIZE) == 0) &&
+           (((pos + PAGE_SIZE) <= file_size) ||
+            ((off_t) (file_offset + file_size) >= inode->size));
+
+  if (shared && (fs_page_get_locked(inode, off / PAGE_SIZE, &page) == 0)) {
+    r = 1;
+  } else if ((page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_ANON)) == NULL) {
+    r = -ENOMEM;
+  } else {
+    page->ref_count = 1;
+
+    // The rest of the page stays zero if the file has been truncated
+    r = 0;
+    if (pos < file_size) {
+      n = MIN(PAGE_SIZE, file_size - pos);
+      r = fs_inode_read_locked(inode, (uintptr_t) page2kva(page), n, &off);
+    }
+
+    if (r < 0) {
+      page->ref_count = 0;
+      page_free_one(page);
+    } else {
+      r = 0;
+    }
+  }
+
+  // Do not wait for the file system to notice that the accesses are sequential
+  if ((r >= 0) && (advice == MADV_SEQUENTIAL) && (pos + PAGE_SIZE < file_size))
+    fs_inode_prefetch_locked(inode, file_offset + pos + PAGE_SIZE,
+                             MIN(VMSPACE_READ_AHEAD,
+                                 file_size - (pos + PAGE_SIZE)));
+
+  if (locked)
+    fs_inode_unlock_shared(inode);
+
+  fs_inode_put(inode);
+
+  if (r >= 0)
+    *page_store = page;
+
+  return (int) r;
+}
+
 void
 vm_print_areas(struct VMSpace *vm)
 {
@@ -200,6 +1458,49 @@ vm_print_areas(struct VMSpace *vm)
   }
 }
 
+/**
+ * Take a snapshot of the areas of an address space.
+ *
+ * @param vm    The address space
+ * @param areas Array to store the areas into, in address order
+ * @param max   The size of the array
+ *
+ * @return The number of areas, which may be greater than max.
+ */
+unsigned
+vm_space_get_areas(struct VMSpace *vm, struct VMSpaceAreaInfo *areas,
+                   unsigned max)
+{
+  struct KListLink *l;
+  unsigned n = 0;
+
+  k_rwspinlock_read_acquire(&vm->area_lock);
+
+  KLIST_FOREACH(&vm->areas, l) {
+    struct VMSpaceMapEntry *area;
+    struct VMSpaceAreaInfo *info;
+
+    if (n >= max) {
+      n++;
+      continue;
+    }
+
+    area = KLIST_CONTAINER(l, struct VMSpaceMapEntry, link);
+    info = &areas[n++];
+
+    info->start       = area->start;
+    info->length      = area->length;
+    info->flags       = area->flags;
+    info->ino         = (area->inode != NULL) ? area->inode->ino : 0;
+    info->dev         = (area->inode != NULL) ? area->inode->dev : 0;
+    info->file_offset = area->file_offset;
+  }
+
+  k_rwspinlock_read_release(&vm->area_lock);
+
+  return n;
+}
+
 int
 vm_space_copy_out(const void *src, uintptr_t dst_va, size_t n)
 {
@@ -211,7 +1512,7 @@ vm_space_copy_out(const void *src, uintptr_t dst_va, size_t n)
     return 0;
   }
 
-  return vm_copy_out(process_current()->vm->pgtab, src, dst_va, n);
+  return vm_copy_out(process_current()->vm, src, dst_va, n);
 }
 
 int
@@ -225,7 +1526,7 @@ vm_space_copy_in(void *dst, uintptr_t src_va, size_t n)
     return 0;
   }
 
-  return vm_copy_in(process_current()->vm->pgtab, dst, src_va, n);
+  return vm_copy_in(process_current()->vm, dst, src_va, n);
 }
 
 int
@@ -239,5 +1540,5 @@ vm_space_clear(uintptr_t va, size_t n)
     return 0;
   }
 
-  return vm_clear(process_current()->vm->pgtab, va, n);
+  return vm_clear(process_current()->vm, va, n);
 }
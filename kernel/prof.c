@@ -0,0 +1,362 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/core/cpu.h>
+#include <kernel/dev.h>
+#include <kernel/kdebug.h>
+#include <kernel/object_pool.h>
+#include <kernel/poll.h>
+#include <kernel/process.h>
+#include <kernel/prof.h>
+#include <kernel/thread.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Sampling profiler
+ * ----------------------------------------------------------------------------
+ *
+ * While the profiler is running, every N-th timer tick records the interrupted
+ * PC together with the process that was running into a ring buffer of the CPU
+ * taking the tick. Only that CPU writes to its buffer, from the timer
+ * interrupt, so no locking is needed; the oldest samples are overwritten when
+ * a buffer fills up.
+ *
+ * The report symbolizes the kernel samples with the DWARF information, and
+ * folds the user-mode samples of each process into a single line. It can be
+ * printed from the kernel monitor ("prof") or read from /dev/prof. Writing
+ * "start [N]", "stop" or "reset" to /dev/prof controls the profiler.
+ */
+
+#define PROF_MAJOR        0x04
+
+// Samples kept by each CPU
+#define PROF_SAMPLES      1024
+
+// Distinct functions shown in the report
+#define PROF_ENTRIES_MAX  256
+
+// Large enough for the whole report, the output is truncated otherwise
+#define PROF_REPORT_SIZE  8192
+
+struct ProfSample {
+  uintptr_t pc;
+  pid_t     pid;
+  int       user;
+};
+
+static struct {
+  /** Take a sample every this many ticks, 0 if stopped */
+  volatile unsigned interval;
+  /** Ticks left until the next sample, for each CPU */
+  unsigned          countdown[K_CPU_MAX];
+  /** The number of samples ever recorded by each CPU */
+  unsigned long     count[K_CPU_MAX];
+  struct ProfSample samples[K_CPU_MAX][PROF_SAMPLES];
+} prof;
+
+/**
+ * Start taking samples.
+ *
+ * @param interval Take a sample every this many ticks.
+ */
+void
+prof_start(unsigned interval)
+{
+  prof.interval = interval > 0 ? interval : 1;
+}
+
+/**
+ * Stop taking samples. The samples taken so far are kept.
+ */
+void
+prof_stop(void)
+{
+  prof.interval = 0;
+}
+
+/**
+ * Drop all samples.
+ */
+void
+prof_reset(void)
+{
+  unsigned cpu;
+
+  for (cpu = 0; cpu < K_CPU_MAX; cpu++)
+    prof.count[cpu] = 0;
+}
+
+/**
+ * Called by the timer interrupt handler on every tick.
+ *
+ * @param pc   The interrupted PC.
+ * @param user Whether the CPU was running in user mode.
+ */
+void
+prof_tick(uintptr_t pc, int user)
+{
+  struct KThread *thread;
+  struct ProfSample *sample;
+  unsigned cpu, interval;
+
+  if ((interval = prof.interval) == 0)
+    return;
+
+  cpu = k_cpu_id();
+
+  if (prof.countdown[cpu] > 1) {
+    prof.countdown[cpu]--;
+    return;
+  }
+  prof.countdown[cpu] = interval;
+
+  thread = k_thread_current();
+
+  sample = &prof.samples[cpu][prof.count[cpu]++ % PROF_SAMPLES];
+  sample->pc   = pc;
+  sample->pid  = ((thread != NULL) && (thread->process != NULL))
+               ? thread->process->pid
+               : 0;
+  sample->user = user;
+}
+
+struct ProfEntry {
+  uintptr_t   addr;
+  const char *name;
+  pid_t       pid;
+  unsigned    count;
+};
+
+struct ProfBuf {
+  char   *data;
+  size_t  size;
+  size_t  len;
+};
+
+static void
+prof_printf(struct ProfBuf *buf, const char *format, ...)
+{
+  va_list ap;
+  int n;
+
+  if (buf->len >= buf->size)
+    return;
+
+  va_start(ap, format);
+  n = vsnprintf(buf->data + buf->len, buf->size - buf->len, format, ap);
+  va_end(ap);
+
+  if (n > 0)
+    buf->len = MIN(buf->len + n, buf->size);
+}
+
+// Find or add the entry for the given function, or for the user-mode code of
+// the given process if name is NULL
+static struct ProfEntry *
+prof_entry(struct ProfEntry *entries, unsigned *nentries, uintptr_t addr,
+           const char *name, pid_t pid)
+{
+  unsigned i;
+
+  for (i = 0; i < *nentries; i++)
+    if ((entries[i].addr == addr) && (entries[i].pid == pid))
+      return &entries[i];
+
+  if (*nentries == PROF_ENTRIES_MAX)
+    return NULL;
+
+  entries[i].addr  = addr;
+  entries[i].name  = name;
+  entries[i].pid   = pid;
+  entries[i].count = 0;
+  (*nentries)++;
+
+  return &entries[i];
+}
+
+/**
+ * Generate a flat profile from the samples taken so far.
+ *
+ * @param data The buffer to store the text into.
+ * @param size The size of the buffer.
+ *
+ * @return The length of the text.
+ */
+size_t
+prof_report(char *data, size_t size)
+{
+  struct ProfEntry *entries;
+  struct ProfBuf buf;
+  unsigned cpu, i, j, nentries, total, dropped;
+
+  buf.data = data;
+  buf.size = size;
+  buf.len  = 0;
+
+  entries = (struct ProfEntry *) k_malloc(sizeof(*entries) * PROF_ENTRIES_MAX);
+  if (entries == NULL) {
+    prof_printf(&buf, "Not enough memory\n");
+    return buf.len;
+  }
+
+  nentries = total = dropped = 0;
+
+  for (cpu = 0; cpu < K_CPU_MAX; cpu++) {
+    unsigned long n = MIN(prof.count[cpu], (unsigned long) PROF_SAMPLES);
+
+    for (i = 0; i < n; i++) {
+      struct ProfSample *sample = &prof.samples[cpu][i];
+      struct ProfEntry *entry;
+
+      if (sample->user) {
+        entry = prof_entry(entries, &nentries, 0, NULL, sample->pid);
+      } else {
+        struct PcDebugInfo info;
+
+        debug_info_fn(sample->pc, &info);
+        entry = prof_entry(entries, &nentries, info.fn_addr, info.fn_name, 0);
+      }
+
+      if (entry != NULL)
+        entry->count++;
+      else
+        dropped++;
+
+      total++;
+    }
+  }
+
+  // Busiest first
+  for (i = 1; i < nentries; i++) {
+    struct ProfEntry tmp = entries[i];
+
+    for (j = i; (j > 0) && (entries[j - 1].count < tmp.count); j--)
+      entries[j] = entries[j - 1];
+    entries[j] = tmp;
+  }
+
+  prof_printf(&buf, "%u samples, interval %u ticks\n", total, prof.interval);
+  prof_printf(&buf, "%8s %6s  %-10s %s\n",
+              "samples", "%", "address", "function");
+
+  for (i = 0; i < nentries; i++) {
+    unsigned pct = entries[i].count * 1000 / total;
+
+    if (entries[i].name != NULL)
+      prof_printf(&buf, "%8u %3u.%u%%  %08x   %s\n", entries[i].count,
+                  pct / 10, pct % 10, (unsigned) entries[i].addr,
+                  entries[i].name);
+    else
+      prof_printf(&buf, "%8u %3u.%u%%  %-10s [user, pid %d]\n",
+                  entries[i].count, pct / 10, pct % 10, "", entries[i].pid);
+  }
+
+  if (dropped > 0)
+    prof_printf(&buf, "%8u samples in other functions\n", dropped);
+
+  k_free(entries);
+
+  return buf.len;
+}
+
+static ssize_t
+prof_read_at(dev_t dev, uintptr_t va, size_t n, off_t off)
+{
+  char *data;
+  size_t len;
+  ssize_t r;
+
+  (void) dev;
+
+  if ((data = (char *) k_malloc(PROF_REPORT_SIZE)) == NULL)
+    return -ENOMEM;
+
+  len = prof_report(data, PROF_REPORT_SIZE);
+
+  if ((off < 0) || ((size_t) off >= len)) {
+    r = 0;
+  } else {
+    n = MIN(n, len - (size_t) off);
+    r = vm_space_copy_out(data + off, va, n);
+    if (r == 0)
+      r = n;
+  }
+
+  k_free(data);
+
+  return r;
+}
+
+static ssize_t
+prof_read(dev_t dev, uintptr_t va, size_t n)
+{
+  return prof_read_at(dev, va, n, 0);
+}
+
+static ssize_t
+prof_write(dev_t dev, uintptr_t va, size_t n)
+{
+  char cmd[32];
+  size_t len;
+  int r;
+
+  (void) dev;
+
+  len = MIN(n, sizeof(cmd) - 1);
+  if ((r = vm_space_copy_in(cmd, va, len)) < 0)
+    return r;
+  cmd[len] = '\0';
+
+  if (strncmp(cmd, "start", 5) == 0)
+    prof_start(atoi(cmd + 5));
+  else if (strncmp(cmd, "stop", 4) == 0)
+    prof_stop();
+  else if (strncmp(cmd, "reset", 5) == 0)
+    prof_reset();
+  else
+    return -EINVAL;
+
+  return n;
+}
+
+static int
+prof_ioctl(dev_t dev, int request, int arg)
+{
+  (void) dev;
+  (void) request;
+  (void) arg;
+
+  return -ENOTTY;
+}
+
+static int
+prof_poll(dev_t dev, struct PollEntry *entry)
+{
+  (void) dev;
+  (void) entry;
+
+  return POLLIN | POLLOUT;
+}
+
+static struct CharDev prof_device = {
+  .read    = prof_read,
+  .read_at = prof_read_at,
+  .write   = prof_write,
+  .ioctl   = prof_ioctl,
+  .poll    = prof_poll,
+};
+
+/**
+ * Register the profiler device (/dev/prof).
+ */
+void
+prof_init(void)
+{
+  dev_register_char(PROF_MAJOR, &prof_device);
+}
@@ -1,26 +1,43 @@
 #include <kernel/assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <sched.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/channel.h>
+#include <sys/futex.h>
+#include <sys/perf.h>
+#include <sys/ring.h>
 #include <sys/syscall.h>
 #include <sys/stat.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <sys/utsname.h>
 #include <netdb.h>
 #include <time.h>
 
+#include <kernel/bench.h>
 #include <kernel/console.h>
 #include <kernel/core/cpu.h>
+#include <kernel/epoll.h>
 #include <kernel/fd.h>
 #include <kernel/fs/file.h>
 #include <kernel/fs/fs.h>
+#include <kernel/futex.h>
+#include <kernel/ipc.h>
 #include <kernel/vmspace.h>
 #include <kernel/net.h>
+#include <kernel/net/unix.h>
 #include <kernel/pipe.h>
+#include <kernel/poll.h>
 #include <kernel/process.h>
 #include <kernel/sys.h>
+#include <kernel/sysstat.h>
+#include <kernel/trace.h>
 #include <kernel/types.h>
 #include <kernel/object_pool.h>
 #include <kernel/core/irq.h>
@@ -29,7 +46,7 @@
 
 #include <lwip/sockets.h>
 
-static int32_t (*syscalls[])(void) = {
+static int32_t (*syscalls[])(const int32_t *) = {
   [__SYS_FORK]        = sys_fork,
   [__SYS_EXEC]        = sys_exec,
   [__SYS_WAIT]        = sys_wait,
@@ -80,6 +97,8 @@ static int32_t (*syscalls[])(void) = {
   [__SYS_PIPE]        = sys_pipe,
   [__SYS_IOCTL]       = sys_ioctl,
   [__SYS_MMAP]        = sys_mmap,
+  [__SYS_MPROTECT]    = sys_mprotect,
+  [__SYS_MUNMAP]      = sys_munmap,
   [__SYS_SELECT]      = sys_select,
   [__SYS_SIGSUSPEND]  = sys_sigsuspend,
   [__SYS_KILL]        = sys_kill,
@@ -91,18 +110,70 @@ static int32_t (*syscalls[])(void) = {
   [__SYS_MOUNT]       = sys_mount,
   [__SYS_GETHOSTBYNAME] = sys_gethostbyname,
   [__SYS_SETITIMER]   = sys_setitimer,
+  [__SYS_SYNC]        = sys_sync,
+  [__SYS_SPLICE]      = sys_splice,
+  [__SYS_TEE]         = sys_tee,
+  [__SYS_SENDFILE]    = sys_sendfile,
+  [__SYS_POLL]        = sys_poll,
+  [__SYS_EPOLL_CREATE] = sys_epoll_create,
+  [__SYS_EPOLL_CTL]   = sys_epoll_ctl,
+  [__SYS_EPOLL_WAIT]  = sys_epoll_wait,
+  [__SYS_READV]       = sys_readv,
+  [__SYS_WRITEV]      = sys_writev,
+  [__SYS_PREAD]       = sys_pread,
+  [__SYS_PWRITE]      = sys_pwrite,
+  [__SYS_PREADV]      = sys_preadv,
+  [__SYS_PWRITEV]     = sys_pwritev,
+  [__SYS_GETSOCKOPT]  = sys_getsockopt,
+  [__SYS_CLONE]       = sys_clone,
+  [__SYS_THREAD_EXIT] = sys_thread_exit,
+  [__SYS_FUTEX]       = sys_futex,
+  [__SYS_SCHED_YIELD] = sys_sched_yield,
+  [__SYS_RING_ENTER]  = sys_ring_enter,
+  [__SYS_PERF_CTL]    = sys_perf_ctl,
+  [__SYS_MSYNC]       = sys_msync,
+  [__SYS_MADVISE]     = sys_madvise,
+  [__SYS_FSTATAT]     = sys_fstatat,
+  [__SYS_CHANNEL_CREATE]  = sys_channel_create,
+  [__SYS_CHANNEL_DESTROY] = sys_channel_destroy,
+  [__SYS_CONNECT_ATTACH]  = sys_connect_attach,
+  [__SYS_CONNECT_DETACH]  = sys_connect_detach,
+  [__SYS_MSG_SEND]    = sys_msg_send,
+  [__SYS_MSG_RECEIVE] = sys_msg_receive,
+  [__SYS_MSG_REPLY]   = sys_msg_reply,
+  [__SYS_SCHED_SETSCHEDULER]    = sys_sched_setscheduler,
+  [__SYS_SCHED_GETSCHEDULER]    = sys_sched_getscheduler,
+  [__SYS_SCHED_GETPARAM]        = sys_sched_getparam,
+  [__SYS_SCHED_RR_GET_INTERVAL] = sys_sched_rr_get_interval,
+  [__SYS_SCHED_SETAFFINITY]     = sys_sched_setaffinity,
+  [__SYS_SCHED_GETAFFINITY]     = sys_sched_getaffinity,
+  [__SYS_SET_TLS]               = sys_set_tls,
 };
 
 int32_t
 sys_dispatch(void)
 {
+  int32_t args[SYS_MAX_ARGS];
   int num;
 
   if ((num = sys_arch_get_num()) < 0)
     return num;
 
   if ((num < (int) ARRAY_SIZE(syscalls)) && syscalls[num]) {
-    int r = syscalls[num]();
+    unsigned start_cpu = K_CPU_MAX;
+    uint32_t start_cycles = 0;
+    int r;
+
+    // Decode all of the arguments at once, the handlers only index the array
+    sys_arch_get_args(args);
+
+    trace(TRACE_SYSCALL_ENTER, num, 0);
+    sysstat_begin(&start_cpu, &start_cycles);
+
+    r = syscalls[num](args);
+
+    sysstat_end(num, start_cpu, start_cycles);
+    trace(TRACE_SYSCALL_EXIT, num, r);
 
     // if (r < 0)
     //   cprintf("syscall(%d) -> %d\n", num, r);
@@ -121,51 +192,52 @@ sys_dispatch(void)
  */
 
 static int
-sys_arg_int(int n, int *ip)
+sys_arg_int(const int32_t *args, int n, int *ip)
 {
-  *ip = sys_arch_get_arg(n);
+  *ip = args[n];
   return 0;
 }
 
 static int
-sys_arg_uint(int n, unsigned int *ip)
+sys_arg_uint(const int32_t *args, int n, unsigned int *ip)
 {
-  *ip = sys_arch_get_arg(n);
+  *ip = args[n];
   return 0;
 }
 
 static int
-sys_arg_short(int n, short *ip)
+sys_arg_short(const int32_t *args, int n, short *ip)
 {
-  *ip = (short) sys_arch_get_arg(n);
+  *ip = (short) args[n];
   return 0;
 }
 
 static int
-sys_arg_ushort(int n, unsigned short *ip)
+sys_arg_ushort(const int32_t *args, int n, unsigned short *ip)
 {
-  *ip = (unsigned short) sys_arch_get_arg(n);
+  *ip = (unsigned short) args[n];
   return 0;
 }
 
 static int
-sys_arg_long(int n, long *ip)
+sys_arg_long(const int32_t *args, int n, long *ip)
 {
-  *ip = (long) sys_arch_get_arg(n);
+  *ip = (long) args[n];
   return 0;
 }
 
 static int
-sys_arg_ulong(int n, unsigned long *ip)
+sys_arg_ulong(const int32_t *args, int n, unsigned long *ip)
 {
-  *ip = (unsigned long) sys_arch_get_arg(n);
+  *ip = (unsigned long) args[n];
   return 0;
 }
 
 static int
-sys_arg_ptr(int n, uintptr_t *pp, int perm, int can_be_null)
+sys_arg_ptr(const int32_t *args, int n, uintptr_t *pp, int perm,
+            int can_be_null)
 {
-  uintptr_t ptr = sys_arch_get_arg(n);
+  uintptr_t ptr = args[n];
   int r;
 
   if (ptr == 0) {
@@ -176,7 +248,7 @@ sys_arg_ptr(int n, uintptr_t *pp, int perm, int can_be_null)
     return -EFAULT;
   }
 
-  if ((r = vm_user_check_ptr(process_current()->vm->pgtab, ptr, perm)) < 0)
+  if ((r = vm_space_check_buf(process_current()->vm, ptr, 1, perm)) < 0)
     return r;
 
   *pp = ptr;
@@ -188,6 +260,7 @@ sys_arg_ptr(int n, uintptr_t *pp, int perm, int can_be_null)
  * Fetch the nth system call argument as pointer to a buffer of the specified
  * length. Check that the pointer is valid and the user has right permissions.
  * 
+ * @param args The system call arguments.
  * @param n    The argument number.
  * @param pp   Pointer to the memory address to store the argument value.
  * @param len  The length of the memory region pointed to.
@@ -197,9 +270,10 @@ sys_arg_ptr(int n, uintptr_t *pp, int perm, int can_be_null)
  * @retval -EFAULT if the arguments doesn't point to a valid memory region.
  */
 static int32_t
-sys_arg_va(int n, uintptr_t *pp, size_t len, int perm, int can_be_null)
+sys_arg_va(const int32_t *args, int n, uintptr_t *pp, size_t len, int perm,
+           int can_be_null)
 { 
-  uintptr_t ptr = sys_arch_get_arg(n);
+  uintptr_t ptr = args[n];
   int r;
 
   if (!ptr) {
@@ -210,7 +284,7 @@ sys_arg_va(int n, uintptr_t *pp, size_t len, int perm, int can_be_null)
     return -EFAULT;
   }
 
-  if ((r = vm_user_check_buf(process_current()->vm->pgtab, ptr, len, perm)) < 0)
+  if ((r = vm_space_check_buf(process_current()->vm, ptr, len, perm)) < 0)
     return r;
 
   *pp = ptr;
@@ -218,11 +292,32 @@ sys_arg_va(int n, uintptr_t *pp, size_t len, int perm, int can_be_null)
   return 0;
 }
 
+// Fetch the nth system call argument as a pointer to a structure of the given
+// size and copy the structure into dst, which is usually on the kernel stack.
+// Returns 1 if the structure has been copied, 0 if the pointer is NULL.
+static int32_t
+sys_arg_copy(const int32_t *args, int n, void *dst, size_t len)
+{
+  uintptr_t va = args[n];
+  int r;
+
+  if (va == 0)
+    return 0;
+
+  // vm_copy_in only checks that the pages exist
+  if (((r = vm_space_check_buf(process_current()->vm, va, len,
+                               VM_READ | VM_USER)) < 0) ||
+      ((r = vm_copy_in(process_current()->vm, dst, va, len)) < 0))
+    return r;
+
+  return 1;
+}
+
 static int32_t
-sys_arg_buf(int n, void **store, size_t len, int perm)
+sys_arg_buf(const int32_t *args, int n, void **store, size_t len, int perm)
 { 
-  uintptr_t va = sys_arch_get_arg(n);
-  void *pgtab = process_current()->vm->pgtab;
+  uintptr_t va = args[n];
+  struct VMSpace *vm = process_current()->vm;
   void *p;
   int r;
 
@@ -231,13 +326,13 @@ sys_arg_buf(int n, void **store, size_t len, int perm)
     return 0;
   }
 
-  if ((r = vm_user_check_buf(pgtab, va, len, perm | VM_USER)) < 0)
+  if ((r = vm_space_check_buf(vm, va, len, perm | VM_USER)) < 0)
     return r;
 
   if ((p = k_malloc(len)) == NULL)
     return -ENOMEM;
 
-  if ((r = vm_copy_in(pgtab, p, va, len)) < 0) {
+  if ((r = vm_copy_in(vm, p, va, len)) < 0) {
     k_free(p);
     return r;
   }
@@ -247,34 +342,81 @@ sys_arg_buf(int n, void **store, size_t len, int perm)
   return 0;
 }
 
+// The number of I/O vectors copied onto the kernel stack rather than into a
+// temporary buffer
+#define SYS_IOV_INLINE  8
+
+// Fetch the nth system call argument as an array of cnt I/O vectors. Check
+// that every buffer is valid and the user has right permissions, then copy the
+// array into iov_inline if it fits, or into a temporary buffer otherwise. The
+// caller must free the array if it is not iov_inline.
+static int32_t
+sys_arg_iovec(const int32_t *args, int n, int cnt, int perm,
+              struct iovec *iov_inline, struct iovec **store)
+{
+  struct VMSpace *vm = process_current()->vm;
+  struct iovec *iov;
+  size_t total;
+  int i, r;
+
+  if ((cnt <= 0) || (cnt > IOV_MAX))
+    return -EINVAL;
+
+  if (cnt <= SYS_IOV_INLINE) {
+    iov = iov_inline;
+    if ((r = sys_arg_copy(args, n, iov, cnt * sizeof(*iov))) <= 0)
+      return r < 0 ? r : -EFAULT;
+  } else {
+    if ((r = sys_arg_buf(args, n, (void **) &iov, cnt * sizeof(*iov),
+                         VM_READ)) < 0)
+      return r;
+    if (iov == NULL)
+      return -EFAULT;
+  }
+
+  for (i = 0, total = 0; i < cnt; i++) {
+    // The total length must fit into the return value
+    if (iov[i].iov_len > (size_t) INT_MAX - total) {
+      r = -EINVAL;
+      goto fail;
+    }
+    total += iov[i].iov_len;
+
+    if ((iov[i].iov_len > 0) &&
+        ((r = vm_space_check_buf(vm, (uintptr_t) iov[i].iov_base,
+                                 iov[i].iov_len, perm)) < 0))
+      goto fail;
+  }
+
+  *store = iov;
+
+  return 0;
+
+fail:
+  if (iov != iov_inline)
+    k_free(iov);
+  return r;
+}
+
 // Fetch the nth system call argument as a C string pointer. Check that the
 // pointer is valid, the user has right permissions and the string is properly
-// terminated. If strp is not null, allocate a temporary buffer to copy the
-// string into. Tha caller must deallocate this buffer by calling k_free().
+// terminated, and copy it into a temporary buffer. Tha caller must deallocate
+// this buffer by calling k_free().
 static int32_t
-sys_arg_str(int n, size_t max, int perm, char **strp)
+sys_arg_str(const int32_t *args, int n, size_t max, int perm, char **strp)
 {
-  uintptr_t va = sys_arch_get_arg(n);
-  void *pgtab = process_current()->vm->pgtab;
-  size_t len;
+  uintptr_t va = args[n];
+  struct VMSpace *vm = process_current()->vm;
   char *s;
   int r;
 
-  if ((r = vm_user_check_str(pgtab, va, &len, perm)) < 0)
-    return r;
-
-  if (len >= max)
-    return -ENAMETOOLONG;
-
-  if (strp == NULL)
-    return 0;
-
-  if ((s = k_malloc(len + 1)) == NULL)
+  if ((s = k_malloc(max)) == NULL)
     return -ENOMEM;
 
-  if ((vm_copy_in(pgtab, s, va, len + 1) != 0) || (s[len] != '\0')) {
+  // Checked and copied in a single pass
+  if ((r = vm_copy_in_str(vm, s, va, max, perm)) < 0) {
     k_free(s);
-    return -EFAULT;
+    return r;
   }
 
   *strp = s;
@@ -285,7 +427,13 @@ sys_arg_str(int n, size_t max, int perm, char **strp)
 static int
 sys_copy_out(const void *src, uintptr_t va, size_t n)
 {
-  return vm_copy_out(process_current()->vm->pgtab, src, va, n);
+  return vm_copy_out(process_current()->vm, src, va, n);
+}
+
+static int
+sys_copy_in(void *dst, uintptr_t va, size_t n)
+{
+  return vm_copy_in(process_current()->vm, dst, va, n);
 }
 
 /*
@@ -295,28 +443,28 @@ sys_copy_out(const void *src, uintptr_t va, size_t n)
  */
 
 int32_t
-sys_fork(void)
+sys_fork(const int32_t *args)
 {
-  int r, shared;
+  int r, vfork;
 
-  if ((r = sys_arg_int(0, &shared)) < 0)
+  if ((r = sys_arg_int(args, 0, &vfork)) < 0)
     return r;
 
-  return process_copy(0);
+  return process_copy(vfork);
 }
 
 int32_t
-sys_exec(void)
+sys_exec(const int32_t *args)
 {
   char *path;
   uintptr_t argv, envp;
   int r;
 
-  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &path)) < 0)
+  if ((r = sys_arg_str(args, 0, PATH_MAX, VM_READ, &path)) < 0)
     goto out1;
-  if ((r = sys_arg_va(1, &argv, 1, 0, 0)) < 0)
+  if ((r = sys_arg_va(args, 1, &argv, 1, 0, 0)) < 0)
     goto out2;
-  if ((r = sys_arg_va(2, &envp, 1, 0, 0)) < 0)
+  if ((r = sys_arg_va(args, 2, &envp, 1, 0, 0)) < 0)
     goto out2;
 
   r = process_exec(path, argv, envp);
@@ -328,43 +476,43 @@ out1:
 }
 
 int32_t
-sys_getpgid(void)
+sys_getpgid(const int32_t *args)
 {
   pid_t pid;
   int r;
   
-  if ((r = sys_arg_int(0, &pid)) < 0)
+  if ((r = sys_arg_int(args, 0, &pid)) < 0)
     return r;
 
   return process_get_gid(pid);
 }
 
 int32_t
-sys_setpgid(void)
+sys_setpgid(const int32_t *args)
 {
   pid_t pid, pgid;
   int r;
   
-  if ((r = sys_arg_int(0, &pid)) < 0)
+  if ((r = sys_arg_int(args, 0, &pid)) < 0)
     return r;
-  if ((r = sys_arg_int(1, &pgid)) < 0)
+  if ((r = sys_arg_int(args, 1, &pgid)) < 0)
     return r;
 
   return process_set_gid(pid, pgid);
 }
 
 int32_t
-sys_wait(void)
+sys_wait(const int32_t *args)
 {
   pid_t pid;
   uintptr_t stat_va;
   int r, stat, options;
   
-  if ((r = sys_arg_int(0, &pid)) < 0)
+  if ((r = sys_arg_int(args, 0, &pid)) < 0)
     return r;
-  if ((r = sys_arg_va(1, &stat_va, sizeof(int), VM_WRITE, 1)) < 0)
+  if ((r = sys_arg_va(args, 1, &stat_va, sizeof(int), VM_WRITE, 1)) < 0)
     return r;
-  if ((r = sys_arg_int(2, &options)) < 0)
+  if ((r = sys_arg_int(args, 2, &options)) < 0)
     return r;
 
   if ((r = process_wait(pid, &stat, options)) < 0)
@@ -382,11 +530,11 @@ sys_wait(void)
 }
 
 int32_t
-sys_exit(void)
+sys_exit(const int32_t *args)
 {
   int status, r;
   
-  if ((r = sys_arg_int(0, &status)) < 0)
+  if ((r = sys_arg_int(args, 0, &status)) < 0)
     return r;
 
   process_destroy((status & 0xFF) << 8);
@@ -395,38 +543,50 @@ sys_exit(void)
 }
 
 int32_t
-sys_getpid(void)
+sys_getpid(const int32_t *args)
 {
+  (void) args;
+
   return process_current()->pid;
 }
 
 int32_t
-sys_getuid(void)
+sys_getuid(const int32_t *args)
 {
+  (void) args;
+
   return process_current()->ruid;
 }
 
 int32_t
-sys_geteuid(void)
+sys_geteuid(const int32_t *args)
 {
+  (void) args;
+
   return process_current()->euid;
 }
 
 int32_t
-sys_getgid(void)
+sys_getgid(const int32_t *args)
 {
+  (void) args;
+
   return process_current()->rgid;
 }
 
 int32_t
-sys_getegid(void)
+sys_getegid(const int32_t *args)
 {
+  (void) args;
+
   return process_current()->egid;
 }
 
 int32_t
-sys_getppid(void)
+sys_getppid(const int32_t *args)
 {
+  (void) args;
+
   struct Process *current = process_current(),
                  *parent  = current->parent;
 
@@ -434,13 +594,111 @@ sys_getppid(void)
 }
 
 int32_t
-sys_umask(void)
+sys_clone(const int32_t *args)
+{
+  unsigned long entry, stack, arg, tls;
+  int r;
+
+  // Bad addresses only make the new thread fault, so there's nothing to check
+  if ((r = sys_arg_ulong(args, 0, &entry)) < 0)
+    return r;
+  if ((r = sys_arg_ulong(args, 1, &stack)) < 0)
+    return r;
+  if ((r = sys_arg_ulong(args, 2, &arg)) < 0)
+    return r;
+  if ((r = sys_arg_ulong(args, 3, &tls)) < 0)
+    return r;
+
+  return process_thread_create(entry, stack, arg, tls);
+}
+
+int32_t
+sys_thread_exit(const int32_t *args)
+{
+  uintptr_t clear_va;
+  int r;
+
+  if ((r = sys_arg_va(args, 0, &clear_va, sizeof(int), VM_WRITE, 1)) < 0)
+    return r;
+
+  process_thread_exit(clear_va);
+  // Should not return
+  return 0;
+}
+
+int32_t
+sys_set_tls(const int32_t *args)
+{
+  struct KThread *current = k_thread_current();
+  unsigned long tls;
+  int r;
+
+  // Only user code ever reads the pointer, so there's nothing to check
+  if ((r = sys_arg_ulong(args, 0, &tls)) < 0)
+    return r;
+
+  // The scheduler loads the register from here on each switch to the thread
+  current->tls = tls;
+  arch_thread_load_tls(current);
+
+  return 0;
+}
+
+int32_t
+sys_futex(const int32_t *args)
+{
+  struct timespec timeout;
+  unsigned long ticks;
+  uintptr_t va;
+  int op, val, r, has_timeout;
+
+  if ((r = sys_arg_va(args, 0, &va, sizeof(int), VM_READ, 0)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 1, &op)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &val)) < 0)
+    return r;
+  if ((has_timeout = sys_arg_copy(args, 3, &timeout, sizeof timeout)) < 0)
+    return has_timeout;
+
+  switch (op) {
+  case FUTEX_WAIT:
+    ticks = 0;
+    if (has_timeout) {
+      // A zero timeout must still expire rather than mean "forever"
+      if ((ticks = timespec2ticks(&timeout)) == 0)
+        ticks = 1;
+    }
+    r = futex_wait(va, val, ticks);
+    break;
+  case FUTEX_WAKE:
+    r = futex_wake(va, val);
+    break;
+  default:
+    r = -EINVAL;
+    break;
+  }
+
+  return r;
+}
+
+int32_t
+sys_sched_yield(const int32_t *args)
+{
+  (void) args;
+
+  k_thread_yield();
+  return 0;
+}
+
+int32_t
+sys_umask(const int32_t *args)
 {
   struct Process *proc = process_current();
   mode_t cmask;
   int r;
 
-  if ((r = sys_arg_ulong(0, &cmask)) < 0)
+  if ((r = sys_arg_ulong(args, 0, &cmask)) < 0)
     return r;
 
   r = proc->cmask & (S_IRWXU | S_IRWXG | S_IRWXO);
@@ -450,13 +708,13 @@ sys_umask(void)
 }
 
 int32_t
-sys_times(void)
+sys_times(const int32_t *args)
 {
   uintptr_t times_va;
   struct tms times;
   int r;
 
-  if ((r = sys_arg_va(0, &times_va, sizeof times, VM_WRITE, 0)) < 0)
+  if ((r = sys_arg_va(args, 0, &times_va, sizeof times, VM_WRITE, 0)) < 0)
     return r;
 
   process_get_times(process_current(), &times);
@@ -465,27 +723,25 @@ sys_times(void)
 }
 
 int32_t
-sys_nanosleep(void)
+sys_nanosleep(const int32_t *args)
 {
-  struct timespec *rqtp, rmt;
+  struct timespec rqt, rmt;
   uintptr_t rmt_va;
   int r;
 
-  if ((r = sys_arg_buf(0, (void **) &rqtp, sizeof *rqtp, VM_READ)) < 0)
-    goto out1;
-  if ((r = sys_arg_va(1, &rmt_va, sizeof rmt, VM_WRITE, 1)) < 0)
-    goto out2;
+  if ((r = sys_arg_copy(args, 0, &rqt, sizeof rqt)) < 0)
+    return r;
+  if (r == 0)
+    return -EFAULT;
+  if ((r = sys_arg_va(args, 1, &rmt_va, sizeof rmt, VM_WRITE, 1)) < 0)
+    return r;
 
-  if ((r = time_nanosleep(rqtp, &rmt)) < 0)
-    goto out2;
+  if ((r = time_nanosleep(&rqt, &rmt)) < 0)
+    return r;
 
-  if (rmt_va && ((r = sys_copy_out(&rmt, rmt_va, sizeof rmt)) < 0))
-    goto out2;
+  if (rmt_va)
+    r = sys_copy_out(&rmt, rmt_va, sizeof rmt);
 
-out2:
-  if (rqtp != NULL)
-    k_free(rqtp);
-out1:
   return r;
 }
 
@@ -496,17 +752,24 @@ out1:
  */
 
 int32_t
-sys_mount(void)
+sys_mount(const int32_t *args)
 {
   char *type, *path;
-  int r;
+  int flags, r;
+
+  if ((r = sys_arg_int(args, 2, &flags)) < 0)
+    goto out1;
+  if ((flags & ~(MNT_NOATIME | MNT_NODIRATIME | MNT_RELATIME)) != 0) {
+    r = -EINVAL;
+    goto out1;
+  }
 
-  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &type)) < 0)
+  if ((r = sys_arg_str(args, 0, PATH_MAX, VM_READ, &type)) < 0)
     goto out1;
-  if ((r = sys_arg_str(1, PATH_MAX, VM_READ, &path)) < 0)
+  if ((r = sys_arg_str(args, 1, PATH_MAX, VM_READ, &path)) < 0)
     goto out2;
 
-  r = fs_mount(type, path);
+  r = fs_mount(type, path, flags);
 
   k_free(path);
 out2:
@@ -516,12 +779,12 @@ out1:
 }
 
 int32_t
-sys_chdir(void)
+sys_chdir(const int32_t *args)
 {
   char *path;
   int r;
 
-  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &path)) < 0)
+  if ((r = sys_arg_str(args, 0, PATH_MAX, VM_READ, &path)) < 0)
     return r;
 
   r = fs_chdir(path);
@@ -531,15 +794,15 @@ sys_chdir(void)
 }
 
 int32_t
-sys_chmod(void)
+sys_chmod(const int32_t *args)
 {
   char *path;
   mode_t mode;
   int r;
 
-  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &path)) < 0)
+  if ((r = sys_arg_str(args, 0, PATH_MAX, VM_READ, &path)) < 0)
     goto out1;
-  if ((r = sys_arg_ulong(1, &mode)) < 0)
+  if ((r = sys_arg_ulong(args, 1, &mode)) < 0)
     goto out2;
 
   r = fs_chmod(path, mode);
@@ -551,18 +814,18 @@ out1:
 }
 
 int32_t
-sys_open(void)
+sys_open(const int32_t *args)
 {
   struct File *file;
   char *path;
   int oflag, r;
   mode_t mode;
 
-  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &path)) < 0)
+  if ((r = sys_arg_str(args, 0, PATH_MAX, VM_READ, &path)) < 0)
     goto out1;
-  if ((r = sys_arg_int(1, &oflag)) < 0)
+  if ((r = sys_arg_int(args, 1, &oflag)) < 0)
     goto out2;
-  if ((r = sys_arg_ulong(2, &mode)) < 0)
+  if ((r = sys_arg_ulong(args, 2, &mode)) < 0)
     goto out2;
 
   if ((r = fs_open(path, oflag, mode, &file)) < 0)
@@ -578,14 +841,14 @@ out1:
 }
 
 int32_t
-sys_link(void)
+sys_link(const int32_t *args)
 {
   char *path1, *path2;
   int r;
 
-  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &path1)) < 0)
+  if ((r = sys_arg_str(args, 0, PATH_MAX, VM_READ, &path1)) < 0)
     goto out1;
-  if ((r = sys_arg_str(1, PATH_MAX, VM_READ, &path2)) < 0)
+  if ((r = sys_arg_str(args, 1, PATH_MAX, VM_READ, &path2)) < 0)
     goto out2;
 
   r = fs_link(path1, path2);
@@ -598,18 +861,18 @@ out1:
 }
 
 int32_t
-sys_mknod(void)
+sys_mknod(const int32_t *args)
 {
   char *path;
   mode_t mode;
   dev_t dev;
   int r;
 
-  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &path)) < 0)
+  if ((r = sys_arg_str(args, 0, PATH_MAX, VM_READ, &path)) < 0)
     goto out1;
-  if ((r = sys_arg_ulong(1, &mode)) < 0)
+  if ((r = sys_arg_ulong(args, 1, &mode)) < 0)
     goto out2;
-  if ((r = sys_arg_short(2, &dev)) < 0)
+  if ((r = sys_arg_short(args, 2, &dev)) < 0)
     goto out2;
   
   r = fs_create(path, mode, dev, NULL);
@@ -621,12 +884,12 @@ out1:
 }
 
 int32_t
-sys_unlink(void)
+sys_unlink(const int32_t *args)
 {
   char *path;
   int r;
 
-  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &path)) < 0)
+  if ((r = sys_arg_str(args, 0, PATH_MAX, VM_READ, &path)) < 0)
     return r;
 
   r = fs_unlink(path);
@@ -636,12 +899,12 @@ sys_unlink(void)
 }
 
 int32_t
-sys_rmdir(void)
+sys_rmdir(const int32_t *args)
 {
   char *path;
   int r;
 
-  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &path)) < 0)
+  if ((r = sys_arg_str(args, 0, PATH_MAX, VM_READ, &path)) < 0)
     return r;
 
   r = fs_rmdir(path);
@@ -651,18 +914,18 @@ sys_rmdir(void)
 }
 
 int32_t
-sys_readlink(void)
+sys_readlink(const int32_t *args)
 {
   size_t buf_size;
   uintptr_t buf_va;
   int r;
   char *path, *buf;
 
-  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &path)) < 0)
+  if ((r = sys_arg_str(args, 0, PATH_MAX, VM_READ, &path)) < 0)
     goto out1;
-  if ((r = sys_arg_uint(2, &buf_size)) < 0)
+  if ((r = sys_arg_uint(args, 2, &buf_size)) < 0)
     goto out2;
-  if ((r = sys_arg_va(1, &buf_va, buf_size, VM_WRITE, 0)) < 0)
+  if ((r = sys_arg_va(args, 1, &buf_va, buf_size, VM_WRITE, 0)) < 0)
     goto out2;
 
   if ((buf = (char *) k_malloc(NAME_MAX+1)) == NULL) {
@@ -689,14 +952,14 @@ out1:
 }
 
 int32_t
-sys_access(void)
+sys_access(const int32_t *args)
 {
   char *path;
   int r, amode;
 
-  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &path)) < 0)
+  if ((r = sys_arg_str(args, 0, PATH_MAX, VM_READ, &path)) < 0)
     goto out1;
-  if ((r = sys_arg_int(1, &amode)) < 0)
+  if ((r = sys_arg_int(args, 1, &amode)) < 0)
     goto out2;
 
   r = fs_access(path, amode);
@@ -714,7 +977,7 @@ out1:
  */
 
 int32_t
-sys_getdents(void)
+sys_getdents(const int32_t *args)
 {
   size_t n;
   int fd;
@@ -722,11 +985,11 @@ sys_getdents(void)
   uintptr_t va;
   int r;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     return r;
-  if ((r = sys_arg_uint(2, &n)) < 0)
+  if ((r = sys_arg_uint(args, 2, &n)) < 0)
     return r;
-  if ((r = sys_arg_va(1, &va, n, VM_WRITE, 0)) < 0)
+  if ((r = sys_arg_va(args, 1, &va, n, VM_WRITE, 0)) < 0)
     return r;
 
   if ((file = fd_lookup(process_current(), fd)) == NULL)
@@ -740,12 +1003,12 @@ sys_getdents(void)
 }
 
 int32_t
-sys_fchdir(void)
+sys_fchdir(const int32_t *args)
 {
   struct File *file;
   int r, fd;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     return r;
 
   if ((file = fd_lookup(process_current(), fd)) == NULL)
@@ -759,16 +1022,16 @@ sys_fchdir(void)
 }
 
 int32_t
-sys_stat(void)
+sys_stat(const int32_t *args)
 {
   struct File *file;
   uintptr_t buf_va;
   struct stat buf;
   int r, fd;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     goto out1;
-  if ((r = sys_arg_va(1, &buf_va, sizeof buf, VM_WRITE, 0)) < 0)
+  if ((r = sys_arg_va(args, 1, &buf_va, sizeof buf, VM_WRITE, 0)) < 0)
     goto out1;
 
   if ((file = fd_lookup(process_current(), fd)) == NULL) {
@@ -788,29 +1051,73 @@ out1:
 }
 
 int32_t
-sys_close(void)
+sys_fstatat(const int32_t *args)
+{
+  struct File *dir = NULL;
+  uintptr_t buf_va;
+  struct stat buf;
+  char *path;
+  int r, fd, flags;
+
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    goto out1;
+  if ((r = sys_arg_str(args, 1, PATH_MAX, VM_READ, &path)) < 0)
+    goto out1;
+  if ((r = sys_arg_va(args, 2, &buf_va, sizeof buf, VM_WRITE, 0)) < 0)
+    goto out2;
+  if ((r = sys_arg_int(args, 3, &flags)) < 0)
+    goto out2;
+
+  // The lookup never follows symbolic links, so there is nothing to change
+  if (flags & ~AT_SYMLINK_NOFOLLOW) {
+    r = -EINVAL;
+    goto out2;
+  }
+
+  if ((fd != AT_FDCWD) && (path[0] != '/') &&
+      ((dir = fd_lookup(process_current(), fd)) == NULL)) {
+    r = -EBADF;
+    goto out2;
+  }
+
+  if ((r = fs_stat_at(dir, path, &buf)) < 0)
+    goto out3;
+
+  r = sys_copy_out(&buf, buf_va, sizeof buf);
+
+out3:
+  if (dir != NULL)
+    file_put(dir);
+out2:
+  k_free(path);
+out1:
+  return r;
+}
+
+int32_t
+sys_close(const int32_t *args)
 {
   int r, fd;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     return r;
 
   return fd_close(process_current(), fd);
 }
 
 int32_t
-sys_read(void)
+sys_read(const int32_t *args)
 {
   uintptr_t va;
   size_t n;
   struct File *file;
   int r, fd;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     return r;
-  if ((r = sys_arg_uint(2, &n)) < 0)
+  if ((r = sys_arg_uint(args, 2, &n)) < 0)
     return r;
-  if ((r = sys_arg_va(1, &va, n, VM_READ, 0)) < 0)
+  if ((r = sys_arg_va(args, 1, &va, n, VM_READ, 0)) < 0)
     return r;
 
   if ((file = fd_lookup(process_current(), fd)) == NULL)
@@ -824,17 +1131,17 @@ sys_read(void)
 }
 
 int32_t
-sys_seek(void)
+sys_seek(const int32_t *args)
 {
   struct File *file;
   off_t offset;
   int whence, r, fd;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     return r;
-  if ((r = sys_arg_long(1, &offset)) < 0)
+  if ((r = sys_arg_long(args, 1, &offset)) < 0)
     return r;
-  if ((r = sys_arg_int(2, &whence)) < 0)
+  if ((r = sys_arg_int(args, 2, &whence)) < 0)
     return r;
 
   if ((file = fd_lookup(process_current(), fd)) == NULL)
@@ -848,16 +1155,16 @@ sys_seek(void)
 }
 
 int32_t
-sys_fcntl(void)
+sys_fcntl(const int32_t *args)
 {
   struct File *file;
   int cmd, r, arg, fd;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     return r;
-  if ((r = sys_arg_int(1, &cmd)) < 0)
+  if ((r = sys_arg_int(args, 1, &cmd)) < 0)
     return r;
-  if ((r = sys_arg_int(2, &arg)) < 0)
+  if ((r = sys_arg_int(args, 2, &arg)) < 0)
     return r;
 
   if ((file = fd_lookup(process_current(), fd)) == NULL)
@@ -879,6 +1186,12 @@ sys_fcntl(void)
   case F_SETFD:
     r = fd_set_flags(process_current(), fd, arg);
     break;
+  case F_GETPIPE_SZ:
+    r = pipe_get_size(file);
+    break;
+  case F_SETPIPE_SZ:
+    r = pipe_set_size(file, arg);
+    break;
 
   case F_GETOWN:
   case F_SETOWN:
@@ -900,18 +1213,18 @@ sys_fcntl(void)
 }
 
 int32_t
-sys_write(void)
+sys_write(const int32_t *args)
 {
   uintptr_t va;
   size_t n;
   struct File *file;
   int r, fd;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     return r;
-  if ((r = sys_arg_uint(2, &n)) < 0)
+  if ((r = sys_arg_uint(args, 2, &n)) < 0)
     return r;
-  if ((r = sys_arg_va(1, &va, n, VM_WRITE, 0)) < 0)
+  if ((r = sys_arg_va(args, 1, &va, n, VM_WRITE, 0)) < 0)
     return r;
 
   if ((file = fd_lookup(process_current(), fd)) == NULL)
@@ -925,15 +1238,15 @@ sys_write(void)
 }
 
 int32_t
-sys_fchmod(void)
+sys_fchmod(const int32_t *args)
 {
   struct File *file;
   mode_t mode;
   int r, fd;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     return r;
-  if ((r = sys_arg_ulong(1, &mode)) < 0)
+  if ((r = sys_arg_ulong(args, 1, &mode)) < 0)
     return r;
 
   if ((file = fd_lookup(process_current(), fd)) == NULL)
@@ -947,18 +1260,18 @@ sys_fchmod(void)
 }
 
 int32_t
-sys_fchown(void)
+sys_fchown(const int32_t *args)
 {
   struct File *file;
   int r, fd;
   uid_t uid;
   gid_t gid;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     return r;
-  if ((r = sys_arg_ushort(1, &uid)) < 0)
+  if ((r = sys_arg_ushort(args, 1, &uid)) < 0)
     return r;
-  if ((r = sys_arg_ushort(2, &gid)) < 0)
+  if ((r = sys_arg_ushort(args, 2, &gid)) < 0)
     return r;
 
   if ((file = fd_lookup(process_current(), fd)) == NULL)
@@ -972,228 +1285,320 @@ sys_fchown(void)
 }
 
 int32_t
-sys_select(void)
+sys_select(const int32_t *args)
 {
-  int r, fd, nfds;
-  fd_set *readfds, *writefds, *errorfds;
-  struct timeval *timeout;
+  struct pollfd *fds;
+  fd_set set_copies[3], *sets[3];
+  struct timeval timeout_copy, *timeout;
+  nfds_t i, n;
+  long ticks;
+  int r, fd, nfds, set;
 
-  if ((r = sys_arg_int(0, &nfds)) < 0)
-    goto out1;
-  if ((r = sys_arg_buf(1, (void *) &readfds, sizeof(*readfds), VM_READ)) < 0)
-    goto out1;
-  if ((r = sys_arg_buf(2, (void *) &writefds, sizeof(*writefds), VM_READ)) < 0)
-    goto out2;
-  if ((r = sys_arg_buf(3, (void *) &errorfds, sizeof(*errorfds), VM_READ)) < 0)
-    goto out3;
-  if ((r = sys_arg_buf(4, (void *) &timeout, sizeof(*timeout), VM_READ)) < 0)
-    goto out4;
+  if ((r = sys_arg_int(args, 0, &nfds)) < 0)
+    return r;
+  if ((nfds < 0) || (nfds > FD_SETSIZE))
+    return -EINVAL;
 
-  r = 0;
+  // The sets and the timeout are small enough to be kept on the stack
+  for (set = 0; set < 3; set++) {
+    if ((r = sys_arg_copy(args, set + 1, &set_copies[set],
+                          sizeof(fd_set))) < 0)
+      return r;
+    if ((r > 0) &&
+        ((r = vm_space_check_buf(process_current()->vm, args[set + 1],
+                                 sizeof(fd_set), VM_WRITE | VM_USER)) < 0))
+      return r;
+    sets[set] = (args[set + 1] != 0) ? &set_copies[set] : NULL;
+  }
+
+  if ((r = sys_arg_copy(args, 4, &timeout_copy, sizeof(timeout_copy))) < 0)
+    return r;
+  timeout = (r > 0) ? &timeout_copy : NULL;
+
+  fds = NULL;
+
+  if ((nfds > 0) &&
+      ((fds = (struct pollfd *) k_malloc(nfds * sizeof(*fds))) == NULL)) {
+    r = -ENOMEM;
+    goto out;
+  }
+
+  // Readable, writable, and exceptional conditions map to POLLIN, POLLOUT,
+  // and POLLPRI respectively
+  for (fd = 0, n = 0; fd < nfds; fd++) {
+    short events = 0;
+
+    if ((sets[0] != NULL) && FD_ISSET(fd, sets[0]))
+      events |= POLLIN;
+    if ((sets[1] != NULL) && FD_ISSET(fd, sets[1]))
+      events |= POLLOUT;
+    if ((sets[2] != NULL) && FD_ISSET(fd, sets[2]))
+      events |= POLLPRI;
+
+    if (events != 0) {
+      fds[n].fd      = fd;
+      fds[n].events  = events;
+      fds[n].revents = 0;
+      n++;
+    }
+  }
 
-  for (fd = 0; fd < FD_SETSIZE; fd++) {
-    struct File *file;
+  if (timeout == NULL) {
+    ticks = -1;
+  } else {
+    ticks = timeval2ticks(timeout);
+    if ((ticks == 0) && ((timeout->tv_sec > 0) || (timeout->tv_usec > 0)))
+      ticks = 1;
+  }
+
+  if ((r = poll_fds(fds, n, ticks)) < 0)
+    goto out;
 
-    // TODO: writefds
-    // TODO: errorfds
-    // TODO: timeout
+  for (set = 0; set < 3; set++)
+    if (sets[set] != NULL)
+      FD_ZERO(sets[set]);
 
-    if ((readfds == NULL) || !FD_ISSET(fd, readfds))
-      continue;
+  for (i = 0, r = 0; i < n; i++) {
+    short revents = fds[i].revents;
 
-    if ((file = fd_lookup(process_current(), fd)) == NULL) {
+    if (revents & POLLNVAL) {
       r = -EBADF;
-      break;
+      goto out;
+    }
+
+    if ((fds[i].events & POLLIN) && (revents & (POLLIN | POLLHUP | POLLERR))) {
+      FD_SET(fds[i].fd, sets[0]);
+      r++;
+    }
+    if ((fds[i].events & POLLOUT) && (revents & (POLLOUT | POLLERR))) {
+      FD_SET(fds[i].fd, sets[1]);
+      r++;
     }
+    if (revents & POLLPRI) {
+      FD_SET(fds[i].fd, sets[2]);
+      r++;
+    }
+  }
 
-    r += file_select(file, timeout);
+  for (set = 0; set < 3; set++) {
+    int err;
 
-    file_put(file);
+    if ((sets[set] != NULL) &&
+        ((err = sys_copy_out(sets[set], args[set + 1],
+                             sizeof(fd_set))) < 0)) {
+      r = err;
+      goto out;
+    }
   }
 
-out4:
-  if (errorfds != NULL)
-    k_free(errorfds);
-out3:
-  if (writefds != NULL)
-    k_free(writefds);
-out2:
-  if (readfds != NULL)  
-    k_free(readfds);
-out1:
+out:
+  if (fds != NULL)
+    k_free(fds);
+
   return r;
 }
 
 int32_t
-sys_ioctl(void)
+sys_poll(const int32_t *args)
 {
-  struct File *file;
-  int r, request, fd, arg;
+  struct pollfd *fds;
+  uintptr_t fds_va;
+  nfds_t nfds;
+  int r, timeout;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_uint(args, 1, &nfds)) < 0)
     return r;
-  if ((r = sys_arg_int(1, &request)) < 0)
+  if (nfds > OPEN_MAX)
+    return -EINVAL;
+  if ((r = sys_arg_int(args, 2, &timeout)) < 0)
     return r;
-  if ((r = sys_arg_int(2, &arg)) < 0)
+
+  fds    = NULL;
+  fds_va = args[0];
+
+  if ((nfds > 0) &&
+      ((r = sys_arg_buf(args, 0, (void **) &fds, nfds * sizeof(*fds),
+                        VM_READ | VM_WRITE)) < 0))
     return r;
 
-  if ((file = fd_lookup(process_current(), fd)) == NULL)
-    return -EBADF;
+  if ((nfds > 0) && (fds == NULL))
+    return -EFAULT;
 
-  r = file_ioctl(file, request, arg);
-  
-  file_put(file);
+  // Round the timeout up to whole ticks
+  r = poll_fds(fds, nfds, (timeout < 0) ? -1 : (long) ms2ticks(timeout + MS_PER_TICK - 1));
+
+  if ((r >= 0) && (nfds > 0)) {
+    int err;
+
+    if ((err = sys_copy_out(fds, fds_va, nfds * sizeof(*fds))) < 0)
+      r = err;
+  }
+
+  if (fds != NULL)
+    k_free(fds);
 
   return r;
 }
 
 int32_t
-sys_ftruncate(void)
+sys_epoll_create(const int32_t *args)
 {
   struct File *file;
-  int r, fd;
-  off_t length;
+  int r, fd, flags;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
-    return r;
-  if ((r = sys_arg_long(1, &length)) < 0)
+  if ((r = sys_arg_int(args, 0, &flags)) < 0)
     return r;
+  if (flags & ~EPOLL_CLOEXEC)
+    return -EINVAL;
 
-  if ((file = fd_lookup(process_current(), fd)) == NULL)
-    return -EBADF;
+  if ((r = epoll_open(&file)) < 0)
+    return r;
 
-  r = file_truncate(file, length);
+  if (((fd = r = fd_alloc(process_current(), file, 0)) >= 0) &&
+      (flags & EPOLL_CLOEXEC))
+    r = fd_set_flags(process_current(), fd, FD_CLOEXEC);
 
   file_put(file);
 
-  return r;
+  return (r < 0) ? r : fd;
 }
 
 int32_t
-sys_fsync(void)
+sys_epoll_ctl(const int32_t *args)
 {
+  struct epoll_event event;
   struct File *file;
-  int r, fd;
+  int r, epfd, op, fd;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_int(args, 0, &epfd)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 1, &op)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &fd)) < 0)
+    return r;
+  if ((r = sys_arg_copy(args, 3, &event, sizeof(event))) < 0)
     return r;
 
-  if ((file = fd_lookup(process_current(), fd)) == NULL)
-    return -EBADF;
+  if ((r == 0) && (op != EPOLL_CTL_DEL))
+    return -EFAULT;
 
-  r = file_sync(file);
+  if ((file = fd_lookup(process_current(), epfd)) == NULL)
+    return -EBADF;
 
+  r = epoll_control(file, op, fd, (args[3] != 0) ? &event : NULL);
   file_put(file);
 
   return r;
 }
 
-/*
- * ----------------------------------------------------------------------------
- * Net system calls
- * ----------------------------------------------------------------------------
- */
-
 int32_t
-sys_socket(void)
+sys_epoll_wait(const int32_t *args)
 {
-  int r;
-  int domain;
-  int type;
-  int protocol;
+  struct epoll_event *events;
   struct File *file;
+  uintptr_t events_va;
+  int r, epfd, max, timeout;
 
-  if ((r = sys_arg_int(0, &domain)) < 0)
+  if ((r = sys_arg_int(args, 0, &epfd)) < 0)
     return r;
-  if ((r = sys_arg_int(1, &type)) < 0)
+  if ((r = sys_arg_int(args, 2, &max)) < 0)
     return r;
-  if ((r = sys_arg_int(2, &protocol)) < 0)
+  if ((r = sys_arg_int(args, 3, &timeout)) < 0)
     return r;
 
-  if ((r = net_socket(domain, type, protocol, &file)) != 0)
+  if (max <= 0)
+    return -EINVAL;
+  if ((size_t) max > EPOLL_MAX_EVENTS)
+    max = EPOLL_MAX_EVENTS;
+
+  if ((r = sys_arg_va(args, 1, &events_va, max * sizeof(*events),
+                     VM_WRITE, 0)) < 0)
     return r;
 
-  r = fd_alloc(process_current(), file, 0);
+  if ((file = fd_lookup(process_current(), epfd)) == NULL)
+    return -EBADF;
+
+  if ((events = (struct epoll_event *) k_malloc(max * sizeof(*events))) == NULL) {
+    file_put(file);
+    return -ENOMEM;
+  }
+
+  // Round the timeout up to whole ticks
+  r = epoll_collect(file, events, max,
+                    (timeout < 0) ? -1 : (long) ms2ticks(timeout + MS_PER_TICK - 1));
 
   file_put(file);
+
+  if (r > 0) {
+    int err;
+
+    if ((err = sys_copy_out(events, events_va, r * sizeof(*events))) < 0)
+      r = err;
+  }
+
+  k_free(events);
+
   return r;
 }
 
 int32_t
-sys_bind(void)
+sys_ioctl(const int32_t *args)
 {
   struct File *file;
-  struct sockaddr *address;
-  socklen_t address_len;
-  int r, fd;
+  int r, request, fd, arg;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     return r;
-  if ((r = sys_arg_va(1, (uintptr_t *) &address, sizeof(*address), VM_READ, 0)) < 0)
+  if ((r = sys_arg_int(args, 1, &request)) < 0)
     return r;
-  if ((r = sys_arg_ulong(2, &address_len)) < 0)
+  if ((r = sys_arg_int(args, 2, &arg)) < 0)
     return r;
-  
+
   if ((file = fd_lookup(process_current(), fd)) == NULL)
     return -EBADF;
 
-  r = net_bind(file, address, address_len);
-
+  r = file_ioctl(file, request, arg);
+  
   file_put(file);
 
   return r;
 }
 
 int32_t
-sys_connect(void)
+sys_ftruncate(const int32_t *args)
 {
   struct File *file;
-  struct sockaddr *address;
-  socklen_t address_len;
   int r, fd;
+  off_t length;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
-    goto out1;
-  if ((r = sys_arg_buf(1, (void *) &address, sizeof(*address), VM_READ)) < 0)
-    goto out1;
-  if (address == NULL) {
-    r = -EFAULT;
-    goto out1;
-  }
-  if ((r = sys_arg_ulong(2, &address_len)) < 0)
-    goto out2;
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    return r;
+  if ((r = sys_arg_long(args, 1, &length)) < 0)
+    return r;
 
-  if ((file = fd_lookup(process_current(), fd)) == NULL) {
-    r = -EBADF;
-    goto out2;
-  }
+  if ((file = fd_lookup(process_current(), fd)) == NULL)
+    return -EBADF;
 
-  r = net_connect(file, address, address_len);
+  r = file_truncate(file, length);
 
   file_put(file);
 
-out2:
-  if (address != NULL)
-    k_free(address);
-out1:
   return r;
 }
 
 int32_t
-sys_listen(void)
+sys_fsync(const int32_t *args)
 {
   struct File *file;
-  int backlog, r, fd;
+  int r, fd;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
-    return r;
-  if ((r = sys_arg_int(1, &backlog)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     return r;
 
   if ((file = fd_lookup(process_current(), fd)) == NULL)
     return -EBADF;
 
-  r = net_listen(file, backlog);
+  r = file_sync(file);
 
   file_put(file);
 
@@ -1201,404 +1606,1235 @@ sys_listen(void)
 }
 
 int32_t
-sys_accept(void)
+sys_sync(const int32_t *args)
 {
-  struct File *sockf, *connf;
-  uintptr_t address_va, address_len_va;
-  struct sockaddr address;
-  socklen_t address_len;
-  int r, fd, conn_fd;
+  (void) args;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
-    goto out1;
-  if ((r = sys_arg_va(1, &address_va, sizeof(address), VM_WRITE, 1)) < 0)
-    goto out1;
-  if ((r = sys_arg_va(2, &address_len_va, sizeof(address_len), VM_WRITE, 1)) < 0)
-    goto out1;
+  fs_sync();
+  return 0;
+}
 
-  if ((sockf = fd_lookup(process_current(), fd)) == NULL) {
-    r = -EBADF;
-    goto out1;
-  }
+int32_t
+sys_splice(const int32_t *args)
+{
+  struct File *in, *out;
+  size_t n;
+  int r, fd_in, fd_out;
 
-  if ((conn_fd = r = net_accept(sockf, &address, &address_len, &connf)) < 0)
-    goto out2;
+  if ((r = sys_arg_int(args, 0, &fd_in)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &fd_out)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 4, &n)) < 0)
+    return r;
 
-  if ((r = fd_alloc(process_current(), connf, 0)) < 0)
-    goto out3;
+  // Explicit offsets are not supported, the file offsets are used instead
+  if ((args[1] != 0) || (args[3] != 0))
+    return -EINVAL;
 
-  if (address_va && (r = sys_copy_out(&address, address_va,
-                                      sizeof(address))) < 0)
-    goto out3;
-  if (address_len_va && (r = sys_copy_out(&address_len, address_len_va,
-                                          sizeof(address_len))) < 0)
-    goto out3;
+  if ((in = fd_lookup(process_current(), fd_in)) == NULL)
+    return -EBADF;
 
-  r = conn_fd;
+  if ((out = fd_lookup(process_current(), fd_out)) == NULL) {
+    file_put(in);
+    return -EBADF;
+  }
+
+  r = file_splice(in, out, n);
+
+  file_put(out);
+  file_put(in);
 
-out3:
-  file_put(connf);
-out2:
-  file_put(sockf);
-out1:
   return r;
 }
 
 int32_t
-sys_recvfrom(void)
+sys_tee(const int32_t *args)
 {
-  struct File *file;
-  uintptr_t buffer_va;
-  size_t length;
-  int flags;
-  struct sockaddr address;
-  socklen_t address_len;
-  uintptr_t address_va, address_len_va;
-  int r, fd;
-  ssize_t nread;
+  struct File *in, *out;
+  size_t n;
+  int r, fd_in, fd_out;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
-    return r;
-  if ((r = sys_arg_uint(2, &length)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd_in)) < 0)
     return r;
-  if ((r = sys_arg_va(1, &buffer_va, length, VM_WRITE, 0)) < 0)
+  if ((r = sys_arg_int(args, 1, &fd_out)) < 0)
     return r;
-  if ((r = sys_arg_int(3, &flags)) < 0)
-    return r;
-  if ((r = sys_arg_va(4, &address_va, sizeof address, VM_WRITE, 1)) < 0)
-    return r;
-  if ((r = sys_arg_va(5, &address_len_va, sizeof address_len, VM_WRITE, 1)) < 0)
+  if ((r = sys_arg_uint(args, 2, &n)) < 0)
     return r;
 
-  if ((file = fd_lookup(process_current(), fd)) == NULL)
+  if ((in = fd_lookup(process_current(), fd_in)) == NULL)
     return -EBADF;
 
-  if ((nread = r = net_recvfrom(file, buffer_va, length, flags, &address, &address_len)) < 0)
-    return r;
+  if ((out = fd_lookup(process_current(), fd_out)) == NULL) {
+    file_put(in);
+    return -EBADF;
+  }
 
-  file_put(file);
+  r = file_tee(in, out, n);
 
-  if (address_va && (r = sys_copy_out(&address, address_va,
-                                      sizeof(address))) < 0)
-    return r;
-  if (address_len_va && (r = sys_copy_out(&address_len, address_len_va,
-                                          sizeof(address_len))) < 0)
-    return r;
+  file_put(out);
+  file_put(in);
 
-  return nread;
+  return r;
 }
 
 int32_t
-sys_sendto(void)
+sys_sendfile(const int32_t *args)
 {
-  struct File *file;
-  uintptr_t message_va;
-  size_t length;
-  int flags;
-  struct sockaddr *dest_addr;
-  socklen_t dest_len;
-  int r, fd;
+  struct File *in, *out;
+  uintptr_t off_va;
+  off_t off;
+  size_t n;
+  int r, fd_in, fd_out;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
-    goto out1;
-  if ((r = sys_arg_uint(2, &length)) < 0)
-    goto out1;
-  if ((r = sys_arg_va(1, &message_va, length, VM_READ, 0)) < 0)
-    goto out1;
-  if ((r = sys_arg_int(3, &flags)) < 0)
-    goto out1;
-  if ((r = sys_arg_ulong(5, &dest_len)) < 0)
-    goto out2;
-  if ((r = sys_arg_buf(4, (void **) &dest_addr, dest_len, VM_READ)) < 0)
-    goto out1;
+  if ((r = sys_arg_int(args, 0, &fd_out)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 1, &fd_in)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 2, &off_va, sizeof off, VM_READ | VM_WRITE, 1)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 3, &n)) < 0)
+    return r;
 
-  if ((file = fd_lookup(process_current(), fd)) == NULL) {
-    r = -EBADF;
-    goto out2;
+  if (off_va && ((r = vm_copy_in(process_current()->vm, &off, off_va,
+                                 sizeof off)) < 0))
+    return r;
+
+  if ((in = fd_lookup(process_current(), fd_in)) == NULL)
+    return -EBADF;
+
+  if ((out = fd_lookup(process_current(), fd_out)) == NULL) {
+    file_put(in);
+    return -EBADF;
   }
 
-  r = net_sendto(file, message_va, length, flags, dest_addr, dest_len);
+  r = file_sendfile(out, in, off_va ? &off : NULL, n);
 
-  file_put(file);
+  file_put(out);
+  file_put(in);
+
+  if ((r >= 0) && off_va) {
+    int err;
+
+    if ((err = sys_copy_out(&off, off_va, sizeof off)) < 0)
+      return err;
+  }
 
-out2:
-  if (dest_addr != NULL)
-    k_free(dest_addr);
-out1:
   return r;
 }
 
-int32_t
-sys_setsockopt(void)
+// Common part of the vectored and positional read and write calls
+static int32_t
+sys_rw_iovec(int fd, const struct iovec *iov, int iovcnt, off_t *offp,
+             int write)
 {
   struct File *file;
-  int level;
-  int option_name;
-  void *option_value;
-  socklen_t option_len;
-  int r, fd;
+  int r;
 
-  if ((r = sys_arg_int(0, &fd)) < 0)
-    goto out1;
-  if ((r = sys_arg_int(1, &level)) < 0)
-    goto out1;
-  if ((r = sys_arg_int(2, &option_name)) < 0)
-    goto out1;
-  if ((r = sys_arg_ulong(4, &option_len)) < 0)
-    goto out1;
-  if ((r = sys_arg_buf(3, (void **) &option_value, option_len, VM_READ)) < 0)
-    goto out1;
+  if ((offp != NULL) && (*offp < 0))
+    return -EINVAL;
 
-  if ((file = fd_lookup(process_current(), fd)) == NULL) {
-    r = -EBADF;
-    goto out2;
-  }
+  if ((file = fd_lookup(process_current(), fd)) == NULL)
+    return -EBADF;
 
-  r = net_setsockopt(file, level, option_name, option_value, option_len);
+  r = write ? file_writev(file, iov, iovcnt, offp)
+            : file_readv(file, iov, iovcnt, offp);
 
   file_put(file);
 
-out2:
-  if (option_value != NULL)
-    k_free(option_value);
-out1:
   return r;
 }
 
 int32_t
-sys_gethostbyname(void)
+sys_readv(const int32_t *args)
 {
-  char *name;
-  ip_addr_t addr;
-  uintptr_t addr_va;
-  int r;
+  struct iovec iov_inline[SYS_IOV_INLINE], *iov;
+  int r, fd, iovcnt;
 
-  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &name)) < 0)
-    goto out1;
-  if ((r = sys_arg_va(1, &addr_va, sizeof addr, VM_WRITE, 0)) < 0)
-    goto out2;
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &iovcnt)) < 0)
+    return r;
+  if ((r = sys_arg_iovec(args, 1, iovcnt, VM_WRITE, iov_inline, &iov)) < 0)
+    return r;
 
-  if ((r = net_gethostbyname(name, &addr)) < 0)
-    goto out2;
+  r = sys_rw_iovec(fd, iov, iovcnt, NULL, 0);
 
-  r = sys_copy_out(&addr, addr_va, sizeof addr);
+  if (iov != iov_inline)
+    k_free(iov);
 
-out2:
-  k_free(name);
-out1:
   return r;
 }
 
-/*
- * ----------------------------------------------------------------------------
- * Signal system calls
- * ----------------------------------------------------------------------------
- */
-
 int32_t
-sys_sigaction(void)
+sys_writev(const int32_t *args)
 {
-  int sig;
-  uintptr_t stub;
-  struct sigaction *act, oact;
-  uintptr_t oact_va;
-  int r;
+  struct iovec iov_inline[SYS_IOV_INLINE], *iov;
+  int r, fd, iovcnt;
 
-  if ((r = sys_arg_int(0, &sig)) < 0)
-    goto out1;
-  if ((r = sys_arg_ptr(1, &stub, VM_READ | VM_EXEC, 1)) < 0)
-    goto out1;
-  if ((r = sys_arg_buf(2, (void *) &act, sizeof *act, VM_READ)) < 0)
-    goto out1;
-  if ((r = sys_arg_va(3, &oact_va, sizeof oact, VM_WRITE, 1)) < 0)
-    goto out2;
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &iovcnt)) < 0)
+    return r;
+  if ((r = sys_arg_iovec(args, 1, iovcnt, VM_READ, iov_inline, &iov)) < 0)
+    return r;
 
-  if ((r = signal_action_change(sig, stub, act, &oact)) < 0)
-    goto out2;
+  r = sys_rw_iovec(fd, iov, iovcnt, NULL, 1);
 
-  if (oact_va)
-    r = sys_copy_out(&oact, oact_va, sizeof oact);
+  if (iov != iov_inline)
+    k_free(iov);
 
-out2:
-  if (act != NULL)
-    k_free(act);
-out1:
   return r;
 }
 
 int32_t
-sys_sigreturn(void)
+sys_pread(const int32_t *args)
 {
-  uintptr_t ctx_va;
-  int r;
+  struct iovec iov;
+  uintptr_t va;
+  size_t n;
+  off_t off;
+  int r, fd;
 
-  if ((r = sys_arg_ptr(0, &ctx_va, VM_READ, 0)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 2, &n)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 1, &va, n, VM_WRITE, 0)) < 0)
+    return r;
+  if ((r = sys_arg_long(args, 3, &off)) < 0)
     return r;
 
-  return signal_return(ctx_va);
+  iov.iov_base = (void *) va;
+  iov.iov_len  = n;
+
+  return sys_rw_iovec(fd, &iov, 1, &off, 0);
 }
 
 int32_t
-sys_sigpending(void)
+sys_pwrite(const int32_t *args)
 {
-  uintptr_t set_va;
-  sigset_t set;
-  int r;
+  struct iovec iov;
+  uintptr_t va;
+  size_t n;
+  off_t off;
+  int r, fd;
 
-  if ((r = sys_arg_va(0, &set_va, sizeof set, VM_WRITE, 0)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
     return r;
-
-  if ((r = signal_pending(&set)) < 0)
+  if ((r = sys_arg_uint(args, 2, &n)) < 0)
     return r;
-
-  if (set_va && ((r = sys_copy_out(&set, set_va, sizeof set)) < 0))
+  if ((r = sys_arg_va(args, 1, &va, n, VM_READ, 0)) < 0)
+    return r;
+  if ((r = sys_arg_long(args, 3, &off)) < 0)
     return r;
-  
-  return 0;
-}
-
-int32_t
-sys_sigprocmask(void)
-{
-  sigset_t *set, oset;
-  uintptr_t oset_va;
-  int how, r;
-
-  if ((r = sys_arg_int(0, &how)) < 0)
-    goto out1;
-  if ((r = sys_arg_buf(1, (void **) &set, sizeof *set, VM_READ)) < 0)
-    goto out1;
-  if ((r = sys_arg_va(2, &oset_va, sizeof oset, VM_WRITE, 1)) < 0)
-    goto out2;
-
-  if ((r = signal_mask_change(how, set, &oset)) < 0)
-    goto out2;
-
-  if ((oset_va && ((r = sys_copy_out(&oset, oset_va, sizeof oset)) < 0)))
-    goto out2;
 
-  r = 0;
+  iov.iov_base = (void *) va;
+  iov.iov_len  = n;
 
-out2:
-  if (set != NULL)
-    k_free(set);
-out1:
-  return r;
+  return sys_rw_iovec(fd, &iov, 1, &off, 1);
 }
 
 int32_t
-sys_sigsuspend(void)
+sys_preadv(const int32_t *args)
 {
-  sigset_t *mask;
-  int r;
+  struct iovec iov_inline[SYS_IOV_INLINE], *iov;
+  off_t off;
+  int r, fd, iovcnt;
 
-  if ((r = sys_arg_buf(0, (void **) &mask, sizeof *mask, VM_READ)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &iovcnt)) < 0)
+    return r;
+  if ((r = sys_arg_long(args, 3, &off)) < 0)
+    return r;
+  if ((r = sys_arg_iovec(args, 1, iovcnt, VM_WRITE, iov_inline, &iov)) < 0)
     return r;
-  if (mask == NULL)
-    return -EFAULT;
 
-  r = signal_suspend(mask);
+  r = sys_rw_iovec(fd, iov, iovcnt, &off, 0);
 
-  k_free(mask);
+  if (iov != iov_inline)
+    k_free(iov);
 
   return r;
 }
 
 int32_t
-sys_kill(void)
+sys_pwritev(const int32_t *args)
 {
-  pid_t pid;
-  int sig, r;
+  struct iovec iov_inline[SYS_IOV_INLINE], *iov;
+  off_t off;
+  int r, fd, iovcnt;
 
-  if ((r = sys_arg_int(0, &pid)) < 0)
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &iovcnt)) < 0)
     return r;
-  if ((r = sys_arg_int(1, &sig)) < 0)
+  if ((r = sys_arg_long(args, 3, &off)) < 0)
+    return r;
+  if ((r = sys_arg_iovec(args, 1, iovcnt, VM_READ, iov_inline, &iov)) < 0)
     return r;
 
-  return signal_generate(pid, sig, 0);
+  r = sys_rw_iovec(fd, iov, iovcnt, &off, 1);
+
+  if (iov != iov_inline)
+    k_free(iov);
+
+  return r;
 }
 
 /*
  * ----------------------------------------------------------------------------
- * Miscellaneous system calls
+ * Net system calls
  * ----------------------------------------------------------------------------
  */
 
 int32_t
-sys_clock_time(void)
+sys_socket(const int32_t *args)
 {
-  clockid_t clock_id;
-  uintptr_t prev_va;
-  struct timespec timespec;
   int r;
-  
-  if ((r = sys_arg_ulong(0, &clock_id)) < 0)
+  int domain;
+  int type;
+  int protocol;
+  struct File *file;
+
+  if ((r = sys_arg_int(args, 0, &domain)) < 0)
     return r;
-  if ((r = sys_arg_va(1, &prev_va, sizeof(struct timespec), VM_WRITE, 1)) < 0)
+  if ((r = sys_arg_int(args, 1, &type)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &protocol)) < 0)
     return r;
 
-  if ((r = time_get(clock_id, &timespec)) == 0)
-    r = sys_copy_out(&timespec, prev_va, sizeof(struct timespec));
+  if ((r = net_socket(domain, type, protocol, &file)) != 0)
+    return r;
+
+  r = fd_alloc(process_current(), file, 0);
 
+  file_put(file);
   return r;
 }
 
-int32_t
-sys_sbrk(void)
-{
-  panic("deprecated!\n");
-  return -ENOSYS;
-}
+// The largest socket address accepted from user space
+#define SYS_ADDRESS_MAX sizeof(struct sockaddr_un)
 
 int32_t
-sys_uname(void)
+sys_bind(const int32_t *args)
 {
-  extern struct utsname utsname;  // defined in main.c
-
-  uintptr_t va;
-  int r;
+  struct File *file;
+  struct sockaddr *address;
+  socklen_t address_len;
+  int r, fd;
+
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    goto out1;
+  if ((r = sys_arg_ulong(args, 2, &address_len)) < 0)
+    goto out1;
+  if (address_len > SYS_ADDRESS_MAX) {
+    r = -EINVAL;
+    goto out1;
+  }
+  if ((r = sys_arg_buf(args, 1, (void **) &address, address_len, VM_READ)) < 0)
+    goto out1;
+  if (address == NULL) {
+    r = -EFAULT;
+    goto out1;
+  }
+
+  if ((file = fd_lookup(process_current(), fd)) == NULL) {
+    r = -EBADF;
+    goto out2;
+  }
+
+  r = net_bind(file, address, address_len);
+
+  file_put(file);
+
+out2:
+  k_free(address);
+out1:
+  return r;
+}
+
+int32_t
+sys_connect(const int32_t *args)
+{
+  struct File *file;
+  struct sockaddr *address;
+  socklen_t address_len;
+  int r, fd;
+
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    goto out1;
+  if ((r = sys_arg_ulong(args, 2, &address_len)) < 0)
+    goto out1;
+  if (address_len > SYS_ADDRESS_MAX) {
+    r = -EINVAL;
+    goto out1;
+  }
+  if ((r = sys_arg_buf(args, 1, (void *) &address, address_len, VM_READ)) < 0)
+    goto out1;
+  if (address == NULL) {
+    r = -EFAULT;
+    goto out1;
+  }
+
+  if ((file = fd_lookup(process_current(), fd)) == NULL) {
+    r = -EBADF;
+    goto out2;
+  }
+
+  r = net_connect(file, address, address_len);
+
+  file_put(file);
+
+out2:
+  if (address != NULL)
+    k_free(address);
+out1:
+  return r;
+}
+
+int32_t
+sys_listen(const int32_t *args)
+{
+  struct File *file;
+  int backlog, r, fd;
+
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 1, &backlog)) < 0)
+    return r;
+
+  if ((file = fd_lookup(process_current(), fd)) == NULL)
+    return -EBADF;
+
+  r = net_listen(file, backlog);
+
+  file_put(file);
+
+  return r;
+}
+
+// Fetch an optional address buffer (argument n) and its in/out length
+// (argument n + 1). The size of the buffer is limited to the length passed in.
+static int32_t
+sys_arg_address(const int32_t *args, int n, uintptr_t *address_va,
+                uintptr_t *address_len_va, socklen_t *user_len)
+{
+  int r;
+
+  *user_len = 0;
+
+  if ((r = sys_arg_va(args, n + 1, address_len_va, sizeof(socklen_t),
+                      VM_READ | VM_WRITE, 1)) < 0)
+    return r;
+  if (*address_len_va && ((r = sys_copy_in(user_len, *address_len_va,
+                                           sizeof(socklen_t))) < 0))
+    return r;
+
+  return sys_arg_va(args, n, address_va, *user_len, VM_WRITE, 1);
+}
+
+// Copy a socket address returned by the stack out to the buffers fetched by
+// sys_arg_address(args, ). An address longer than the buffer is truncated.
+static int
+sys_copy_out_address(const void *address, socklen_t address_len,
+                     uintptr_t address_va, uintptr_t address_len_va,
+                     socklen_t user_len)
+{
+  int r;
+
+  if (address_va && ((r = sys_copy_out(address, address_va,
+                                       MIN(address_len, user_len))) < 0))
+    return r;
+  if (address_len_va && ((r = sys_copy_out(&address_len, address_len_va,
+                                           sizeof(address_len))) < 0))
+    return r;
+
+  return 0;
+}
+
+int32_t
+sys_accept(const int32_t *args)
+{
+  struct File *sockf, *connf;
+  uintptr_t address_va, address_len_va;
+  struct sockaddr_un address;   // Large enough for any supported family
+  socklen_t address_len, user_len;
+  int r, fd, conn_fd;
+
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    goto out1;
+  if ((r = sys_arg_address(args, 1, &address_va, &address_len_va,
+                           &user_len)) < 0)
+    goto out1;
+
+  if ((sockf = fd_lookup(process_current(), fd)) == NULL) {
+    r = -EBADF;
+    goto out1;
+  }
+
+  address_len = sizeof(address);
+
+  if ((r = net_accept(sockf, (struct sockaddr *) &address, &address_len,
+                      &connf)) < 0)
+    goto out2;
+
+  if ((conn_fd = r = fd_alloc(process_current(), connf, 0)) < 0)
+    goto out3;
+
+  if ((r = sys_copy_out_address(&address, address_len, address_va,
+                                address_len_va, user_len)) < 0)
+    goto out3;
+
+  r = conn_fd;
+
+out3:
+  file_put(connf);
+out2:
+  file_put(sockf);
+out1:
+  return r;
+}
+
+int32_t
+sys_recvfrom(const int32_t *args)
+{
+  struct File *file;
+  uintptr_t buffer_va;
+  size_t length;
+  int flags;
+  struct sockaddr_un address;   // Large enough for any supported family
+  socklen_t address_len, user_len;
+  uintptr_t address_va, address_len_va;
+  int r, fd;
+  ssize_t nread;
+
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 2, &length)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 1, &buffer_va, length, VM_WRITE, 0)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 3, &flags)) < 0)
+    return r;
+  if ((r = sys_arg_address(args, 4, &address_va, &address_len_va,
+                           &user_len)) < 0)
+    return r;
+
+  if ((file = fd_lookup(process_current(), fd)) == NULL)
+    return -EBADF;
+
+  // Zero length means the stack has no address to report
+  address_len = sizeof(address);
+
+  nread = net_recvfrom(file, buffer_va, length, flags,
+                       address_va ? (struct sockaddr *) &address : NULL,
+                       address_va ? &address_len : NULL);
+
+  file_put(file);
+
+  if (nread < 0)
+    return nread;
+
+  if (address_va && ((r = sys_copy_out_address(&address, address_len,
+                                               address_va, address_len_va,
+                                               user_len)) < 0))
+    return r;
+
+  return nread;
+}
+
+int32_t
+sys_sendto(const int32_t *args)
+{
+  struct File *file;
+  uintptr_t message_va;
+  size_t length;
+  int flags;
+  struct sockaddr *dest_addr;
+  socklen_t dest_len;
+  int r, fd;
+
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    goto out1;
+  if ((r = sys_arg_uint(args, 2, &length)) < 0)
+    goto out1;
+  if ((r = sys_arg_va(args, 1, &message_va, length, VM_READ, 0)) < 0)
+    goto out1;
+  if ((r = sys_arg_int(args, 3, &flags)) < 0)
+    goto out1;
+  if ((r = sys_arg_ulong(args, 5, &dest_len)) < 0)
+    goto out2;
+  if ((r = sys_arg_buf(args, 4, (void **) &dest_addr, dest_len, VM_READ)) < 0)
+    goto out1;
+
+  if ((file = fd_lookup(process_current(), fd)) == NULL) {
+    r = -EBADF;
+    goto out2;
+  }
+
+  r = net_sendto(file, message_va, length, flags, dest_addr, dest_len);
+
+  file_put(file);
+
+out2:
+  if (dest_addr != NULL)
+    k_free(dest_addr);
+out1:
+  return r;
+}
+
+int32_t
+sys_setsockopt(const int32_t *args)
+{
+  struct File *file;
+  int level;
+  int option_name;
+  void *option_value;
+  socklen_t option_len;
+  int r, fd;
+
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    goto out1;
+  if ((r = sys_arg_int(args, 1, &level)) < 0)
+    goto out1;
+  if ((r = sys_arg_int(args, 2, &option_name)) < 0)
+    goto out1;
+  if ((r = sys_arg_ulong(args, 4, &option_len)) < 0)
+    goto out1;
+  if ((r = sys_arg_buf(args, 3, (void **) &option_value, option_len,
+                       VM_READ)) < 0)
+    goto out1;
+
+  if ((file = fd_lookup(process_current(), fd)) == NULL) {
+    r = -EBADF;
+    goto out2;
+  }
+
+  r = net_setsockopt(file, level, option_name, option_value, option_len);
+
+  file_put(file);
+
+out2:
+  if (option_value != NULL)
+    k_free(option_value);
+out1:
+  return r;
+}
+
+int32_t
+sys_getsockopt(const int32_t *args)
+{
+  struct File *file;
+  int level;
+  int option_name;
+  int option_value[8];    // Large enough for any supported option
+  socklen_t option_len;
+  uintptr_t option_value_va, option_len_va;
+  int r, fd;
+
+  if ((r = sys_arg_int(args, 0, &fd)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 1, &level)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &option_name)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 4, &option_len_va, sizeof(option_len),
+                      VM_READ | VM_WRITE, 0)) < 0)
+    return r;
+  if ((r = sys_copy_in(&option_len, option_len_va, sizeof(option_len))) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 3, &option_value_va, option_len, VM_WRITE, 0)) < 0)
+    return r;
+
+  option_len = MIN(option_len, sizeof(option_value));
+
+  if ((file = fd_lookup(process_current(), fd)) == NULL)
+    return -EBADF;
+
+  r = net_getsockopt(file, level, option_name, option_value, &option_len);
+
+  file_put(file);
+
+  if (r < 0)
+    return r;
+
+  if ((r = sys_copy_out(option_value, option_value_va, option_len)) < 0)
+    return r;
+  if ((r = sys_copy_out(&option_len, option_len_va, sizeof(option_len))) < 0)
+    return r;
+
+  return 0;
+}
+
+int32_t
+sys_gethostbyname(const int32_t *args)
+{
+  char *name;
+  ip_addr_t addr;
+  uintptr_t addr_va;
+  int r;
+
+  if ((r = sys_arg_str(args, 0, PATH_MAX, VM_READ, &name)) < 0)
+    goto out1;
+  if ((r = sys_arg_va(args, 1, &addr_va, sizeof addr, VM_WRITE, 0)) < 0)
+    goto out2;
+
+  if ((r = net_gethostbyname(name, &addr)) < 0)
+    goto out2;
+
+  r = sys_copy_out(&addr, addr_va, sizeof addr);
+
+out2:
+  k_free(name);
+out1:
+  return r;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Signal system calls
+ * ----------------------------------------------------------------------------
+ */
+
+int32_t
+sys_sigaction(const int32_t *args)
+{
+  int sig;
+  uintptr_t stub;
+  struct sigaction act, oact;
+  uintptr_t oact_va;
+  int r, has_act;
+
+  if ((r = sys_arg_int(args, 0, &sig)) < 0)
+    return r;
+  if ((r = sys_arg_ptr(args, 1, &stub, VM_READ | VM_EXEC, 1)) < 0)
+    return r;
+  if ((has_act = sys_arg_copy(args, 2, &act, sizeof act)) < 0)
+    return has_act;
+  if ((r = sys_arg_va(args, 3, &oact_va, sizeof oact, VM_WRITE, 1)) < 0)
+    return r;
+
+  if ((r = signal_action_change(sig, stub, has_act ? &act : NULL, &oact)) < 0)
+    return r;
+
+  if (oact_va)
+    r = sys_copy_out(&oact, oact_va, sizeof oact);
+
+  return r;
+}
+
+int32_t
+sys_sigreturn(const int32_t *args)
+{
+  uintptr_t ctx_va;
+  int r;
+
+  if ((r = sys_arg_ptr(args, 0, &ctx_va, VM_READ, 0)) < 0)
+    return r;
+
+  return signal_return(ctx_va);
+}
+
+int32_t
+sys_sigpending(const int32_t *args)
+{
+  uintptr_t set_va;
+  sigset_t set;
+  int r;
+
+  if ((r = sys_arg_va(args, 0, &set_va, sizeof set, VM_WRITE, 0)) < 0)
+    return r;
+
+  if ((r = signal_pending(&set)) < 0)
+    return r;
+
+  if (set_va && ((r = sys_copy_out(&set, set_va, sizeof set)) < 0))
+    return r;
+  
+  return 0;
+}
+
+int32_t
+sys_sigprocmask(const int32_t *args)
+{
+  sigset_t set, oset;
+  uintptr_t oset_va;
+  int how, r, has_set;
+
+  if ((r = sys_arg_int(args, 0, &how)) < 0)
+    return r;
+  if ((has_set = sys_arg_copy(args, 1, &set, sizeof set)) < 0)
+    return has_set;
+  if ((r = sys_arg_va(args, 2, &oset_va, sizeof oset, VM_WRITE, 1)) < 0)
+    return r;
+
+  if ((r = signal_mask_change(how, has_set ? &set : NULL, &oset)) < 0)
+    return r;
+
+  if ((oset_va && ((r = sys_copy_out(&oset, oset_va, sizeof oset)) < 0)))
+    return r;
+
+  return 0;
+}
+
+int32_t
+sys_sigsuspend(const int32_t *args)
+{
+  sigset_t mask;
+  int r;
+
+  if ((r = sys_arg_copy(args, 0, &mask, sizeof mask)) < 0)
+    return r;
+  if (r == 0)
+    return -EFAULT;
+
+  return signal_suspend(&mask);
+}
+
+int32_t
+sys_kill(const int32_t *args)
+{
+  pid_t pid;
+  int sig, r;
+
+  if ((r = sys_arg_int(args, 0, &pid)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 1, &sig)) < 0)
+    return r;
+
+  return signal_generate(pid, sig, 0);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Miscellaneous system calls
+ * ----------------------------------------------------------------------------
+ */
+
+int32_t
+sys_clock_time(const int32_t *args)
+{
+  clockid_t clock_id;
+  uintptr_t prev_va;
+  struct timespec timespec;
+  int r;
+  
+  if ((r = sys_arg_ulong(args, 0, &clock_id)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 1, &prev_va, sizeof(struct timespec),
+                     VM_WRITE, 1)) < 0)
+    return r;
+
+  if ((r = time_get(clock_id, &timespec)) == 0)
+    r = sys_copy_out(&timespec, prev_va, sizeof(struct timespec));
+
+  return r;
+}
+
+// There is no break-based heap, user programs (including malloc) get memory
+// with mmap() and release it with munmap()
+int32_t
+sys_sbrk(const int32_t *args)
+{
+  (void) args;
+
+  return -ENOMEM;
+}
+
+int32_t
+sys_uname(const int32_t *args)
+{
+  extern struct utsname utsname;  // defined in main.c
+
+  uintptr_t va;
+  int r;
+
+  if ((r = sys_arg_va(args, 0, &va, sizeof utsname, VM_WRITE, 0)) < 0)
+    return r;
+
+  return sys_copy_out(&utsname, va, sizeof utsname);
+}
+
+int32_t
+sys_test(const int32_t *args)
+{
+  int i, r, mode;
+
+  if ((r = sys_arg_int(args, 0, &mode)) < 0)
+    return r;
+
+  // Run the kernel microbenchmarks: (mode, dev, block size, batches)
+  if (mode == __SYS_TEST_BENCH) {
+    unsigned long batches;
+    unsigned block_size;
+    int dev;
+
+    if ((r = sys_arg_int(args, 1, &dev)) < 0)
+      return r;
+    if ((r = sys_arg_uint(args, 2, &block_size)) < 0)
+      return r;
+    if ((r = sys_arg_ulong(args, 3, &batches)) < 0)
+      return r;
+
+    return bench_run(dev, block_size, batches);
+  }
+
+  for (i = 0; i < 6; i++) {
+    int arg;
+
+    if ((r = sys_arg_int(args, i, &arg)) < 0)
+      return r;
+    cprintf("[%d]: %d\n", i, arg);
+  }
+  return 0;
+}
+
+int32_t
+sys_mmap(const int32_t *args)
+{
+  struct File *file;
+  uintptr_t addr;
+  size_t n;
+  off_t off;
+  int prot, flags, fd;
+  int r;
 
-  if ((r = sys_arg_va(0, &va, sizeof utsname, VM_WRITE, 0)) < 0)
+  if ((r = sys_arg_uint(args, 0, &addr)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 1, &n)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &prot)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 3, &flags)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 4, &fd)) < 0)
+    return r;
+  if ((r = sys_arg_long(args, 5, &off)) < 0)
     return r;
 
-  return sys_copy_out(&utsname, va, sizeof utsname);
+  // Do not let user space pass the internal mapping flags
+  prot &= PROT_READ | PROT_WRITE | PROT_EXEC | PROT_NOCACHE;
+  prot |= VM_USER;
+
+  if (flags & MAP_ANONYMOUS)
+    return (int32_t) vmspace_map(process_current()->vm, addr, n, prot);
+
+  if ((n == 0) || (off < 0) || ((off % PAGE_SIZE) != 0) ||
+      (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE)))
+    return -EINVAL;
+
+  if ((file = fd_lookup(process_current(), fd)) == NULL)
+    return -EBADF;
+
+  r = (int32_t) file_mmap(file, addr, n, prot, flags, off);
+
+  file_put(file);
+
+  return r;
 }
 
 int32_t
-sys_test(void)
+sys_mprotect(const int32_t *args)
 {
-  int i, r;
+  uintptr_t addr;
+  size_t n;
+  int prot, r;
 
-  for (i = 0; i < 6; i++) {
-    int arg;
+  if ((r = sys_arg_uint(args, 0, &addr)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 1, &n)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &prot)) < 0)
+    return r;
 
-    if ((r = sys_arg_int(i, &arg)) < 0)
-      return r;
-    cprintf("[%d]: %d\n", i, arg);
-  }
-  return 0;
+  prot &= PROT_READ | PROT_WRITE | PROT_EXEC;
+
+  return vmspace_protect(process_current()->vm, addr, n, prot);
 }
 
 int32_t
-sys_mmap(void)
+sys_munmap(const int32_t *args)
 {
   uintptr_t addr;
   size_t n;
-  int prot;
   int r;
 
-  if ((r = sys_arg_uint(0, &addr)) < 0)
+  if ((r = sys_arg_uint(args, 0, &addr)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 1, &n)) < 0)
+    return r;
+
+  return vmspace_unmap(process_current()->vm, addr, n);
+}
+
+int32_t
+sys_msync(const int32_t *args)
+{
+  uintptr_t addr;
+  size_t n;
+  int flags, r;
+
+  if ((r = sys_arg_uint(args, 0, &addr)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 1, &n)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &flags)) < 0)
+    return r;
+
+  // Pages are always written back synchronously, and nothing is cached apart
+  // from the mapped pages themselves, so there is nothing to invalidate
+  if ((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) ||
+      ((flags & MS_ASYNC) && (flags & MS_SYNC)))
+    return -EINVAL;
+
+  return vmspace_sync(process_current()->vm, addr, n);
+}
+
+int32_t
+sys_madvise(const int32_t *args)
+{
+  uintptr_t addr;
+  size_t n;
+  int advice, r;
+
+  if ((r = sys_arg_uint(args, 0, &addr)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 1, &n)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 2, &advice)) < 0)
+    return r;
+
+  return vmspace_advise(process_current()->vm, addr, n, advice);
+}
+
+int32_t
+sys_channel_create(const int32_t *args)
+{
+  (void) args;
+
+  return ipc_channel_open();
+}
+
+int32_t
+sys_channel_destroy(const int32_t *args)
+{
+  int chid, r;
+
+  if ((r = sys_arg_int(args, 0, &chid)) < 0)
+    return r;
+
+  return ipc_channel_close(chid);
+}
+
+int32_t
+sys_connect_attach(const int32_t *args)
+{
+  int chid, r;
+
+  if ((r = sys_arg_int(args, 0, &chid)) < 0)
+    return r;
+
+  return ipc_connect(chid);
+}
+
+int32_t
+sys_connect_detach(const int32_t *args)
+{
+  int coid, r;
+
+  if ((r = sys_arg_int(args, 0, &coid)) < 0)
+    return r;
+
+  return ipc_disconnect(coid);
+}
+
+int32_t
+sys_msg_send(const int32_t *args)
+{
+  uintptr_t send_va, reply_va;
+  size_t send_n, reply_n;
+  int coid, r;
+
+  if ((r = sys_arg_int(args, 0, &coid)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 2, &send_n)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 1, &send_va, send_n, VM_READ, send_n == 0)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 4, &reply_n)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 3, &reply_va, reply_n, VM_WRITE,
+                      reply_n == 0)) < 0)
+    return r;
+
+  return ipc_send(coid, send_va, send_n, reply_va, reply_n);
+}
+
+int32_t
+sys_msg_receive(const int32_t *args)
+{
+  uintptr_t va, info_va;
+  size_t n;
+  int chid, r;
+
+  if ((r = sys_arg_int(args, 0, &chid)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 2, &n)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 1, &va, n, VM_WRITE, n == 0)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 3, &info_va, sizeof(struct msg_info), VM_WRITE,
+                      1)) < 0)
+    return r;
+
+  return ipc_receive(chid, va, n, info_va);
+}
+
+int32_t
+sys_msg_reply(const int32_t *args)
+{
+  uintptr_t va;
+  size_t n;
+  int rcvid, status, r;
+
+  if ((r = sys_arg_int(args, 0, &rcvid)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 1, &status)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 3, &n)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 2, &va, n, VM_READ, n == 0)) < 0)
+    return r;
+
+  return ipc_reply(rcvid, status, va, n);
+}
+
+int32_t
+sys_sched_setscheduler(const int32_t *args)
+{
+  struct sched_param param;
+  uintptr_t va;
+  int pid, policy, r;
+
+  if ((r = sys_arg_int(args, 0, &pid)) < 0)
+    return r;
+  if ((r = sys_arg_int(args, 1, &policy)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 2, &va, sizeof param, VM_READ, 0)) < 0)
+    return r;
+  if ((r = sys_copy_in(&param, va, sizeof param)) < 0)
+    return r;
+
+  return process_set_sched(pid, policy, param.sched_priority);
+}
+
+int32_t
+sys_sched_getscheduler(const int32_t *args)
+{
+  int pid, policy, r;
+
+  if ((r = sys_arg_int(args, 0, &pid)) < 0)
+    return r;
+
+  if ((r = process_get_sched(pid, &policy, NULL, NULL)) < 0)
+    return r;
+
+  return policy;
+}
+
+int32_t
+sys_sched_getparam(const int32_t *args)
+{
+  struct sched_param param;
+  uintptr_t va;
+  int pid, r;
+
+  if ((r = sys_arg_int(args, 0, &pid)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 1, &va, sizeof param, VM_WRITE, 0)) < 0)
+    return r;
+
+  memset(&param, 0, sizeof param);
+  if ((r = process_get_sched(pid, NULL, &param.sched_priority, NULL)) < 0)
+    return r;
+
+  return sys_copy_out(&param, va, sizeof param);
+}
+
+int32_t
+sys_sched_rr_get_interval(const int32_t *args)
+{
+  struct timespec ts;
+  unsigned ticks;
+  uintptr_t va;
+  int pid, r;
+
+  if ((r = sys_arg_int(args, 0, &pid)) < 0)
+    return r;
+  if ((r = sys_arg_va(args, 1, &va, sizeof ts, VM_WRITE, 0)) < 0)
+    return r;
+
+  if ((r = process_get_sched(pid, NULL, NULL, &ticks)) < 0)
+    return r;
+
+  ts.tv_sec  = ticks / TICKS_PER_SECOND;
+  ts.tv_nsec = (ticks % TICKS_PER_SECOND) * (1000000000 / TICKS_PER_SECOND);
+
+  return sys_copy_out(&ts, va, sizeof ts);
+}
+
+// The kernel keeps one bit per CPU in an unsigned int. Only the first word of
+// a larger user mask is looked at, the CPUs it describes do not exist.
+int32_t
+sys_sched_setaffinity(const int32_t *args)
+{
+  unsigned size, mask;
+  int pid, r;
+
+  if ((r = sys_arg_int(args, 0, &pid)) < 0)
+    return r;
+  if ((r = sys_arg_uint(args, 1, &size)) < 0)
+    return r;
+  if (size < sizeof mask)
+    return -EINVAL;
+  if ((r = sys_arg_copy(args, 2, &mask, sizeof mask)) < 0)
+    return r;
+  if (r == 0)
+    return -EFAULT;
+
+  return process_set_affinity(pid, mask);
+}
+
+// Returns the number of bytes stored, the rest of the user mask is untouched
+int32_t
+sys_sched_getaffinity(const int32_t *args)
+{
+  unsigned size, mask;
+  uintptr_t va;
+  int pid, r;
+
+  if ((r = sys_arg_int(args, 0, &pid)) < 0)
     return r;
-  if ((r = sys_arg_uint(1, &n)) < 0)
+  if ((r = sys_arg_uint(args, 1, &size)) < 0)
     return r;
-  if ((r = sys_arg_int(2, &prot)) < 0)
+  if (size < sizeof mask)
+    return -EINVAL;
+  if ((r = sys_arg_va(args, 2, &va, sizeof mask, VM_WRITE, 0)) < 0)
     return r;
 
-  return (int32_t) vmspace_map(process_current()->vm, addr, n, prot | VM_USER);
+  if ((r = process_get_affinity(pid, &mask)) < 0)
+    return r;
+
+  if ((r = sys_copy_out(&mask, va, sizeof mask)) < 0)
+    return r;
+
+  return sizeof mask;
 }
 
 int32_t
-sys_pipe(void)
+sys_pipe(const int32_t *args)
 {
   struct Process *my_process = process_current();
   uintptr_t fd_va;
@@ -1606,7 +2842,7 @@ sys_pipe(void)
   int fd[2];
   int r;
 
-  if ((r = sys_arg_va(0, &fd_va, sizeof fd, VM_WRITE, 0)) < 0)
+  if ((r = sys_arg_va(args, 0, &fd_va, sizeof fd, VM_WRITE, 0)) < 0)
     goto out1;
 
   if ((r = pipe_open(&read_file, &write_file)) < 0)
@@ -1631,30 +2867,177 @@ out1:
 
 
 int32_t
-sys_setitimer(void)
+sys_setitimer(const int32_t *args)
 {
-  struct itimerval *value, ovalue;
+  struct itimerval value, ovalue;
   uintptr_t ovalue_va;
-  int which, r;
+  int which, r, has_value;
 
-  if ((r = sys_arg_int(0, &which)) < 0)
-    goto out1;
-  if ((r = sys_arg_buf(1, (void **) &value, sizeof *value, VM_READ)) < 0)
-    goto out1;
-  if ((r = sys_arg_va(2, &ovalue_va, sizeof ovalue, VM_WRITE, 1)) < 0)
-    goto out2;
-    
-  if ((r = process_set_itimer(which, value, &ovalue)) < 0)
-    goto out2;
+  if ((r = sys_arg_int(args, 0, &which)) < 0)
+    return r;
+  if ((has_value = sys_arg_copy(args, 1, &value, sizeof value)) < 0)
+    return has_value;
+  if ((r = sys_arg_va(args, 2, &ovalue_va, sizeof ovalue, VM_WRITE, 1)) < 0)
+    return r;
 
-  if ((ovalue_va && ((r = sys_copy_out(&ovalue, ovalue_va, sizeof ovalue)) < 0)))
-    goto out2;
+  r = process_set_itimer(which, has_value ? &value : NULL, &ovalue);
+  if (r < 0)
+    return r;
 
-  r = 0;
+  if (ovalue_va &&
+      ((r = sys_copy_out(&ovalue, ovalue_va, sizeof ovalue)) < 0))
+    return r;
 
-out2:
-  if (value != NULL)
-    k_free(value);
-out1:
-  return r;
+  return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Submission ring
+ * ----------------------------------------------------------------------------
+ */
+
+// Limit the ring size so that its length in bytes cannot overflow
+#define RING_SIZE_MAX   (1U << 16)
+
+// System calls that replace or discard the caller's trap frame cannot be
+// queued, and neither can the ring itself
+static int
+sys_ring_allowed(uint32_t num)
+{
+  switch (num) {
+  case __SYS_FORK:
+  case __SYS_EXEC:
+  case __SYS_EXIT:
+  case __SYS_CLONE:
+  case __SYS_THREAD_EXIT:
+  case __SYS_SIGRETURN:
+  case __SYS_RING_ENTER:
+    return 0;
+  default:
+    return (num < ARRAY_SIZE(syscalls)) && (syscalls[num] != NULL);
+  }
+}
+
+int32_t
+sys_ring_enter(const int32_t *args)
+{
+  struct ring ring;
+  struct ring_entry entry;
+  uintptr_t ring_va, entry_va;
+  uint32_t head;
+  unsigned max, done;
+  int r;
+
+  if ((r = sys_arg_copy(args, 0, &ring, sizeof ring)) < 0)
+    return r;
+  if (r == 0)
+    return -EFAULT;
+  if ((r = sys_arg_uint(args, 1, &max)) < 0)
+    return r;
+
+  ring_va = args[0];
+  head    = ring.head;
+
+  if ((ring.mask >= RING_SIZE_MAX) || ((ring.mask & (ring.mask + 1)) != 0))
+    return -EINVAL;
+  if ((ring.tail - head) > (ring.mask + 1))
+    return -EINVAL;
+
+  // Validate all of the entries at once, so that only the copies can fail
+  // while the batch is being run
+  if ((r = vm_space_check_buf(process_current()->vm,
+                              ring_va + offsetof(struct ring, entries),
+                              (ring.mask + 1) * sizeof(entry),
+                              VM_READ | VM_WRITE | VM_USER)) < 0)
+    return r;
+
+  // Entries queued after the tail has been read wait for the next call
+  max = MIN(max, MIN(ring.tail - head, (uint32_t) RING_BATCH_MAX));
+
+  for (done = 0; done < max; ) {
+    entry_va = ring_va + offsetof(struct ring, entries) +
+               (head & ring.mask) * sizeof(entry);
+
+    if ((r = sys_copy_in(&entry, entry_va, sizeof entry)) < 0)
+      break;
+
+    if (!sys_ring_allowed(entry.num))
+      entry.result = -ENOSYS;
+    else
+      entry.result = syscalls[entry.num]((const int32_t *) entry.args);
+
+    if ((r = sys_copy_out(&entry.result,
+                          entry_va + offsetof(struct ring_entry, result),
+                          sizeof(entry.result))) < 0)
+      break;
+
+    head++;
+    done++;
+
+    // Let the signal be delivered before running the rest of the batch
+    if (entry.result == -EINTR)
+      break;
+  }
+
+  if (done > 0)
+    r = sys_copy_out(&head, ring_va + offsetof(struct ring, head),
+                     sizeof(head));
+
+  return (r < 0) ? r : (int32_t) done;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Performance counters
+ * ----------------------------------------------------------------------------
+ */
+
+int32_t
+sys_perf_ctl(const int32_t *args)
+{
+  struct KThread *thread = k_thread_current();
+  uint64_t values[PERF_COUNTER_MAX];
+  int op = args[0];
+
+  // Keep the thread on this CPU while its counters are being switched
+  k_irq_state_save();
+
+  switch (op) {
+  case PERF_ENABLE:
+    if (!thread->perf_enabled) {
+      thread->perf_enabled = 1;
+      arch_thread_perf_start(thread);
+    }
+    break;
+  case PERF_DISABLE:
+    if (thread->perf_enabled) {
+      arch_thread_perf_stop(thread);
+      thread->perf_enabled = 0;
+    }
+    break;
+  case PERF_READ:
+    // Charge the events counted so far and keep counting
+    if (thread->perf_enabled) {
+      arch_thread_perf_stop(thread);
+      arch_thread_perf_start(thread);
+    }
+    memcpy(values, thread->perf, sizeof(values));
+    break;
+  case PERF_RESET:
+    if (thread->perf_enabled)
+      arch_thread_perf_start(thread);
+    memset(thread->perf, 0, sizeof(thread->perf));
+    break;
+  default:
+    k_irq_state_restore();
+    return -EINVAL;
+  }
+
+  k_irq_state_restore();
+
+  if (op == PERF_READ)
+    return sys_copy_out(values, args[1], sizeof(values));
+
+  return 0;
 }
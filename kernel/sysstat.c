@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/core/cpu.h>
+#include <kernel/core/irq.h>
+#include <kernel/dev.h>
+#include <kernel/poll.h>
+#include <kernel/sysstat.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * System call statistics
+ * ----------------------------------------------------------------------------
+ *
+ * While enabled, sys_dispatch() reads the cycle counter around each call and
+ * adds the result to a log2 histogram kept by the CPU for that system call
+ * number. The counters of different CPUs are not synchronized, so a call that
+ * sleeps and resumes on another CPU is only counted.
+ */
+
+#define SYSSTAT_MAJOR   0x06
+
+volatile int sysstat_enabled;
+
+static struct sysstat sysstat_cpus[K_CPU_MAX][SYSSTAT_MAX];
+
+void
+_sysstat_record(unsigned num, unsigned cpu, uint32_t start)
+{
+  struct sysstat *stat;
+  uint32_t cycles;
+  int flags;
+
+  if (num >= SYSSTAT_MAX)
+    return;
+
+  flags = k_arch_irq_state_save();
+
+  cycles = k_cpu_cycles() - start;
+
+  if (cpu != k_cpu_id()) {
+    stat = &sysstat_cpus[k_cpu_id()][num];
+    stat->migrated++;
+  } else {
+    stat = &sysstat_cpus[cpu][num];
+    stat->cycles += cycles;
+    stat->hist[31 - __builtin_clz(cycles | 1)]++;
+  }
+
+  stat->calls++;
+
+  k_arch_irq_state_restore(flags);
+}
+
+static ssize_t
+sysstat_read_at(dev_t dev, uintptr_t va, size_t n, off_t off)
+{
+  size_t done = 0;
+  int r;
+
+  (void) dev;
+
+  if (off < 0)
+    return -EINVAL;
+
+  while ((done < n) && ((size_t) off < sizeof(struct sysstat) * SYSSTAT_MAX)) {
+    unsigned num = off / sizeof(struct sysstat);
+    size_t skip = off % sizeof(struct sysstat);
+    size_t len = MIN(sizeof(struct sysstat) - skip, n - done);
+    struct sysstat sum;
+    unsigned cpu, i;
+
+    memset(&sum, 0, sizeof(sum));
+
+    for (cpu = 0; cpu < K_CPU_MAX; cpu++) {
+      struct sysstat *stat = &sysstat_cpus[cpu][num];
+
+      sum.calls    += stat->calls;
+      sum.migrated += stat->migrated;
+      sum.cycles   += stat->cycles;
+      for (i = 0; i < SYSSTAT_BUCKETS; i++)
+        sum.hist[i] += stat->hist[i];
+    }
+
+    if ((r = vm_space_copy_out((uint8_t *) &sum + skip, va + done, len)) < 0)
+      return r;
+
+    done += len;
+    off  += len;
+  }
+
+  return done;
+}
+
+static ssize_t
+sysstat_read(dev_t dev, uintptr_t va, size_t n)
+{
+  return sysstat_read_at(dev, va, n, 0);
+}
+
+static ssize_t
+sysstat_write(dev_t dev, uintptr_t va, size_t n)
+{
+  char cmd[16];
+  size_t len;
+  int r;
+
+  (void) dev;
+
+  len = MIN(n, sizeof(cmd) - 1);
+  if ((r = vm_space_copy_in(cmd, va, len)) < 0)
+    return r;
+  cmd[len] = '\0';
+
+  if (strncmp(cmd, "start", 5) == 0)
+    sysstat_enabled = 1;
+  else if (strncmp(cmd, "stop", 4) == 0)
+    sysstat_enabled = 0;
+  else if (strncmp(cmd, "clear", 5) == 0)
+    memset(sysstat_cpus, 0, sizeof(sysstat_cpus));
+  else
+    return -EINVAL;
+
+  return n;
+}
+
+static int
+sysstat_ioctl(dev_t dev, int request, int arg)
+{
+  (void) dev;
+  (void) request;
+  (void) arg;
+
+  return -ENOTTY;
+}
+
+static int
+sysstat_poll(dev_t dev, struct PollEntry *entry)
+{
+  (void) dev;
+  (void) entry;
+
+  return POLLIN | POLLOUT;
+}
+
+static struct CharDev sysstat_device = {
+  .read    = sysstat_read,
+  .read_at = sysstat_read_at,
+  .write   = sysstat_write,
+  .ioctl   = sysstat_ioctl,
+  .poll    = sysstat_poll,
+};
+
+/**
+ * Register the system call statistics device (/dev/sysstat).
+ */
+void
+sysstat_init(void)
+{
+  dev_register_char(SYSSTAT_MAJOR, &sysstat_device);
+}
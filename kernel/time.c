@@ -1,26 +1,169 @@
 #include <sys/types.h>
+#include <sys/timepage.h>
 #include <errno.h>
 
-#include <kernel/core/semaphore.h>
+#include <kernel/core/hrtimer.h>
+#include <kernel/core/seqcount.h>
 #include <kernel/core/tick.h>
+#include <kernel/mm/memlayout.h>
+#include <kernel/page.h>
 #include <kernel/process.h>
 #include <kernel/console.h>
+#include <kernel/spinlock.h>
 #include <kernel/time.h>
+#include <kernel/waitqueue.h>
 
 static unsigned long long skip_ticks = 0;
 static unsigned ticks_to_sync = 0;
 
 #define TICKS_SYNC_PERIOD   TICKS_PER_SECOND
 
+#if VIRT_TIMEPAGE != TIMEPAGE_ADDR
+#error "VIRT_TIMEPAGE and TIMEPAGE_ADDR must be equal"
+#endif
+
+// The page exporting the current time to user programs
+struct Page *time_page;
+static struct timepage *time_page_data;
+
+/*
+ * ----------------------------------------------------------------------------
+ * Monotonic clock
+ * ----------------------------------------------------------------------------
+ *
+ * CLOCK_MONOTONIC is measured with the clock source of the machine (see
+ * arch_clock_source), in nanoseconds since the counter was started. CPU #0
+ * takes a new base on every tick, so the counter deltas stay small enough to
+ * be scaled with a multiplication and a shift, and narrow counters do not wrap
+ * around between the readings. The base is published in the time page, so
+ * user programs that can read the counter do the same without a system call.
+ * Without a clock source, the time advances by whole ticks.
+ */
+
+#define CLOCK_SHIFT   20
+
+static struct ClockSource *clock_source;
+static struct KSeqCount clock_seq = K_SEQCOUNT_INITIALIZER;
+static uint64_t clock_base_cycles;
+static uint64_t clock_base_ns;
+static uint32_t clock_mult;
+
+static void
+clock_init(void)
+{
+  uint64_t cycles;
+
+  if ((clock_source = arch_clock_source()) == NULL)
+    return;
+
+  // Fits in 32 bits for clocks of 1 MHz and faster
+  clock_mult = (NS_PER_SECOND << CLOCK_SHIFT) / clock_source->freq;
+
+  // Start from the exact time of the counter value, the same the hrtimer
+  // drivers convert their deadlines with
+  cycles = clock_source->read() & clock_source->mask;
+  clock_base_cycles = cycles;
+  clock_base_ns     = (cycles / clock_source->freq) * NS_PER_SECOND +
+                      (cycles % clock_source->freq) * NS_PER_SECOND /
+                      clock_source->freq;
+}
+
+static inline uint64_t
+clock_delta_ns(uint64_t cycles, uint64_t base_cycles)
+{
+  return (((cycles - base_cycles) & clock_source->mask) * clock_mult) >>
+         CLOCK_SHIFT;
+}
+
+// Called by CPU #0 on each tick, so there are no concurrent writers
+static void
+clock_rebase(void)
+{
+  uint64_t cycles;
+
+  if (clock_source == NULL)
+    return;
+
+  cycles = clock_source->read();
+
+  k_seqcount_write_begin(&clock_seq);
+  clock_base_ns    += clock_delta_ns(cycles, clock_base_cycles);
+  clock_base_cycles = cycles;
+  k_seqcount_write_end(&clock_seq);
+}
+
+/**
+ * Get the value of CLOCK_MONOTONIC.
+ *
+ * Can be called from any CPU without taking locks or disabling interrupts.
+ *
+ * @return The time, in nanoseconds.
+ */
+uint64_t
+time_monotonic(void)
+{
+  uint64_t base_cycles, base_ns;
+  unsigned seq;
+
+  if (clock_source == NULL)
+    return k_tick_get() * NS_PER_TICK;
+
+  do {
+    seq = k_seqcount_read_begin(&clock_seq);
+    base_cycles = clock_base_cycles;
+    base_ns     = clock_base_ns;
+  } while (k_seqcount_read_retry(&clock_seq, seq));
+
+  return base_ns + clock_delta_ns(clock_source->read(), base_cycles);
+}
+
+static void time_page_update(void);
+static void clock_init(void);
+static void clock_rebase(void);
+
 void
 time_init(void)
 {
   arch_time_init();
+  clock_init();
+
+  if ((time_page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_TIME)) == NULL)
+    panic("cannot allocate the time page");
+  time_page->ref_count++;
+
+  time_page_data = (struct timepage *) page2kva(time_page);
+  time_page_data->tp_rate = TICKS_PER_SECOND;
+  if (clock_source != NULL) {
+    time_page_data->tp_mask    = clock_source->mask;
+    time_page_data->tp_mult    = clock_mult;
+    time_page_data->tp_shift   = CLOCK_SHIFT;
+    time_page_data->tp_counter = clock_source->user;
+  }
 
   if (k_cpu_id() == 0) {
     k_tick_set(seconds2ticks(arch_get_time_seconds()));
     ticks_to_sync = TICKS_SYNC_PERIOD;
   }
+
+  time_page_update();
+}
+
+// Publish the current tick counter value. Only CPU #0 updates the page, so
+// there are no concurrent writers.
+static void
+time_page_update(void)
+{
+  struct KSeqCount *seq = (struct KSeqCount *) &time_page_data->tp_seq;
+
+  k_seqcount_write_begin(seq);
+  time_page_data->tp_ticks = k_tick_get();
+  if (clock_source != NULL) {
+    time_page_data->tp_mono_ns = clock_base_ns;
+    time_page_data->tp_cycles  = clock_base_cycles;
+  } else {
+    time_page_data->tp_mono_ns = k_tick_get() * NS_PER_TICK;
+  }
+  k_seqcount_write_end(seq);
 }
 
 time_t
@@ -33,6 +176,9 @@ void
 time_tick(void)
 {
   if (k_cpu_id() == 0) {
+    clock_rebase();
+    time_page_update();
+
     ticks_to_sync--;
 
     if (skip_ticks > 0) {
@@ -48,6 +194,7 @@ time_tick(void)
 
       if (current_ticks < expected_ticks) {
         k_tick_set(expected_ticks);
+        time_page_update();
       } else if (current_ticks > expected_ticks) {
         skip_ticks = current_ticks - expected_ticks;
       }
@@ -60,45 +207,60 @@ time_tick(void)
 int
 time_get(clockid_t clock_id, struct timespec *tp)
 {
+  uint64_t now;
+
   if (tp == NULL)
     panic("tp is null");
 
-  if ((clock_id != CLOCK_REALTIME) && (clock_id != CLOCK_MONOTONIC))
+  switch (clock_id) {
+  case CLOCK_REALTIME:
+    ticks2timespec(k_tick_get(), tp);
+    return 0;
+  case CLOCK_MONOTONIC:
+    now = time_monotonic();
+    tp->tv_sec  = now / NS_PER_SECOND;
+    tp->tv_nsec = now % NS_PER_SECOND;
+    return 0;
+  default:
     return -EINVAL;
-
-  ticks2timespec(k_tick_get(), tp);
-
-  return 0;
+  }
 }
 
+// Sleeps run on the high-resolution timers (see k_waitqueue_timed_sleep_ns),
+// so short ones are not stretched to a whole tick
 int
 time_nanosleep(struct timespec *rqtp, struct timespec *rmtp)
 {
-  unsigned long long req_ticks, elapsed_ticks;
+  uint64_t req_ns, elapsed_ns;
   int r;
 
   if ((rqtp->tv_nsec < 0) || (rqtp->tv_nsec >= 1000000000L))
     return -EINVAL;
 
-  req_ticks = timespec2ticks(rqtp);
+  req_ns = (uint64_t) rqtp->tv_sec * NS_PER_SECOND + rqtp->tv_nsec;
   
-  if (req_ticks == 0) {
-    elapsed_ticks = 0;
+  if (req_ns == 0) {
+    elapsed_ns = 0;
     r = 0;
   } else {
-    unsigned long start_ticks = k_tick_get();
-    struct KSemaphore sem;
+    uint64_t start_ns = k_hrtimer_now();
+    struct KWaitQueue queue;
+    struct KSpinLock lock;
 
-    k_semaphore_init(&sem, 0);
-    r = k_semaphore_timed_get(&sem, req_ticks);
+    k_waitqueue_init(&queue);
+    k_spinlock_init(&lock, "nanosleep");
 
-    elapsed_ticks = MIN(k_tick_get() - start_ticks, req_ticks);
+    k_spinlock_acquire(&lock);
+    r = k_waitqueue_timed_sleep_ns(&queue, &lock, req_ns);
+    k_spinlock_release(&lock);
 
-    k_semaphore_fini(&sem);
+    elapsed_ns = MIN(k_hrtimer_now() - start_ns, req_ns);
   }
 
-  if (rmtp != NULL)
-    ticks2timespec(elapsed_ticks, rmtp);
+  if (rmtp != NULL) {
+    rmtp->tv_sec  = elapsed_ns / NS_PER_SECOND;
+    rmtp->tv_nsec = elapsed_ns % NS_PER_SECOND;
+  }
 
   return r == -ETIMEDOUT ? 0 : r;
 }
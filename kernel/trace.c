@@ -0,0 +1,271 @@
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/core/cpu.h>
+#include <kernel/core/irq.h>
+#include <kernel/dev.h>
+#include <kernel/poll.h>
+#include <kernel/trace.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Tracepoints
+ * ----------------------------------------------------------------------------
+ *
+ * Each CPU records events into its own ring buffer with interrupts disabled,
+ * so recording needs neither locks nor atomic operations; the oldest events
+ * are overwritten when a buffer wraps around. Readers take no locks either, so
+ * tracing should be stopped to get an exact snapshot.
+ *
+ * The cycle counters of different CPUs are not synchronized, so timestamps
+ * can only be compared between the events of the same CPU.
+ */
+
+#define TRACE_MAJOR   0x05
+
+// Events kept by each CPU, must be a power of two
+#define TRACE_EVENTS  1024
+
+volatile int trace_enabled;
+
+static struct {
+  /** The number of events ever recorded by each CPU */
+  unsigned long      count[K_CPU_MAX];
+  struct trace_event events[K_CPU_MAX][TRACE_EVENTS];
+} trace_buf;
+
+static const char *const trace_names[] = {
+  [TRACE_SCHED_SWITCH]  = "switch",
+  [TRACE_SCHED_SLEEP]   = "sleep",
+  [TRACE_IRQ]           = "irq",
+  [TRACE_SYSCALL_ENTER] = "sys_enter",
+  [TRACE_SYSCALL_EXIT]  = "sys_exit",
+  [TRACE_BUF_SUBMIT]    = "buf_submit",
+  [TRACE_BUF_DONE]      = "buf_done",
+  [TRACE_VM_FAULT]      = "vm_fault",
+};
+
+void
+_trace_record(unsigned type, uint32_t arg0, uint32_t arg1)
+{
+  struct trace_event *event;
+  unsigned cpu;
+  int flags;
+
+  flags = k_arch_irq_state_save();
+
+  cpu   = k_cpu_id();
+  event = &trace_buf.events[cpu][trace_buf.count[cpu]++ & (TRACE_EVENTS - 1)];
+
+  event->cycles = k_cpu_cycles();
+  event->type   = type;
+  event->cpu    = cpu;
+  event->arg0   = arg0;
+  event->arg1   = arg1;
+
+  k_arch_irq_state_restore(flags);
+}
+
+/**
+ * Start recording events.
+ */
+void
+trace_start(void)
+{
+  trace_enabled = 1;
+}
+
+/**
+ * Stop recording events. The events recorded so far are kept.
+ */
+void
+trace_stop(void)
+{
+  trace_enabled = 0;
+}
+
+/**
+ * Drop all events.
+ */
+void
+trace_clear(void)
+{
+  unsigned cpu;
+
+  for (cpu = 0; cpu < K_CPU_MAX; cpu++)
+    trace_buf.count[cpu] = 0;
+}
+
+// Get the number of events kept by the given CPU, and the index of the oldest
+static unsigned
+trace_range(unsigned cpu, unsigned *first)
+{
+  unsigned long count = trace_buf.count[cpu];
+
+  if (count > TRACE_EVENTS) {
+    *first = count & (TRACE_EVENTS - 1);
+    return TRACE_EVENTS;
+  }
+
+  *first = 0;
+  return count;
+}
+
+/**
+ * Print the most recent events of each CPU to the console.
+ *
+ * @param n The maximum number of events to print for each CPU.
+ */
+void
+trace_print(unsigned n)
+{
+  unsigned cpu, first, count, i;
+
+  cprintf("%-4s %10s %10s %-10s %10s %10s\n",
+          "cpu", "cycles", "delta", "event", "arg0", "arg1");
+
+  for (cpu = 0; cpu < K_CPU_MAX; cpu++) {
+    uint32_t prev = 0;
+
+    count = trace_range(cpu, &first);
+    if (count > n) {
+      first = (first + count - n) & (TRACE_EVENTS - 1);
+      count = n;
+    }
+
+    for (i = 0; i < count; i++) {
+      struct trace_event *event;
+      const char *name = NULL;
+
+      event = &trace_buf.events[cpu][(first + i) & (TRACE_EVENTS - 1)];
+
+      if (event->type < ARRAY_SIZE(trace_names))
+        name = trace_names[event->type];
+
+      cprintf("%-4u %10u %10u %-10s %10x %10x\n", cpu, event->cycles,
+              i > 0 ? event->cycles - prev : 0, name ? name : "?",
+              event->arg0, event->arg1);
+
+      prev = event->cycles;
+    }
+  }
+}
+
+// Copy out the events starting from the given byte offset into the sequence
+// of the buffers of all CPUs
+static ssize_t
+trace_read_at(dev_t dev, uintptr_t va, size_t n, off_t off)
+{
+  size_t done = 0;
+  unsigned cpu;
+  int r;
+
+  (void) dev;
+
+  if (off < 0)
+    return -EINVAL;
+
+  for (cpu = 0; (cpu < K_CPU_MAX) && (done < n); cpu++) {
+    unsigned first, count;
+    size_t size;
+
+    count = trace_range(cpu, &first);
+    size  = count * sizeof(struct trace_event);
+
+    if ((size_t) off >= size) {
+      off -= size;
+      continue;
+    }
+
+    // The buffer may wrap around, copy one event at a time
+    while ((done < n) && ((size_t) off < size)) {
+      unsigned i = off / sizeof(struct trace_event);
+      size_t skip = off % sizeof(struct trace_event);
+      size_t len = MIN(sizeof(struct trace_event) - skip, n - done);
+      struct trace_event *event;
+
+      event = &trace_buf.events[cpu][(first + i) & (TRACE_EVENTS - 1)];
+
+      if ((r = vm_space_copy_out((uint8_t *) event + skip, va + done, len)) < 0)
+        return r;
+
+      done += len;
+      off  += len;
+    }
+
+    off = 0;
+  }
+
+  return done;
+}
+
+static ssize_t
+trace_read(dev_t dev, uintptr_t va, size_t n)
+{
+  return trace_read_at(dev, va, n, 0);
+}
+
+static ssize_t
+trace_write(dev_t dev, uintptr_t va, size_t n)
+{
+  char cmd[16];
+  size_t len;
+  int r;
+
+  (void) dev;
+
+  len = MIN(n, sizeof(cmd) - 1);
+  if ((r = vm_space_copy_in(cmd, va, len)) < 0)
+    return r;
+  cmd[len] = '\0';
+
+  if (strncmp(cmd, "start", 5) == 0)
+    trace_start();
+  else if (strncmp(cmd, "stop", 4) == 0)
+    trace_stop();
+  else if (strncmp(cmd, "clear", 5) == 0)
+    trace_clear();
+  else
+    return -EINVAL;
+
+  return n;
+}
+
+static int
+trace_ioctl(dev_t dev, int request, int arg)
+{
+  (void) dev;
+  (void) request;
+  (void) arg;
+
+  return -ENOTTY;
+}
+
+static int
+trace_poll(dev_t dev, struct PollEntry *entry)
+{
+  (void) dev;
+  (void) entry;
+
+  return POLLIN | POLLOUT;
+}
+
+static struct CharDev trace_device = {
+  .read    = trace_read,
+  .read_at = trace_read_at,
+  .write   = trace_write,
+  .ioctl   = trace_ioctl,
+  .poll    = trace_poll,
+};
+
+/**
+ * Register the trace device (/dev/trace).
+ */
+void
+trace_init(void)
+{
+  dev_register_char(TRACE_MAJOR, &trace_device);
+}
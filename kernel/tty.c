@@ -16,18 +16,21 @@
 #include <kernel/time.h>
 #include <kernel/dev.h>
 #include <kernel/signal.h>
+#include <kernel/types.h>
 
 #include <kernel/drivers/kbd.h>
 #include <kernel/drivers/display.h>
+#include <kernel/drivers/fb.h>
 
 static struct CharDev tty_device = {
   .read   = tty_read,
   .write  = tty_write,
   .ioctl  = tty_ioctl,
-  .select = tty_select,
+  .poll   = tty_poll,
 };
 
 #define NTTYS       6   // The total number of virtual ttys
+#define TTY_CHUNK   256 // Bytes output with the lock held
 
 
 static struct Tty ttys[NTTYS];
@@ -52,6 +55,7 @@ tty_init(void)
 
     k_spinlock_init(&tty->in.lock, "tty.in");
     k_waitqueue_init(&tty->in.queue);
+    poll_queue_init(&tty->in.poll_queue);
 
     k_spinlock_init(&tty->out.lock, "screen");
     
@@ -107,6 +111,25 @@ tty_switch(int n)
   }
 }
 
+/**
+ * Scroll the view of the current console through its history.
+ *
+ * @param n The number of rows to scroll back (if positive) or forward (if
+ *          negative)
+ */
+void
+tty_scroll(int n)
+{
+  struct Tty *tty = tty_current;
+
+  if (tty->out.screen == NULL)
+    return;
+
+  k_spinlock_acquire(&tty->out.lock);
+  screen_scroll_view(tty->out.screen, n);
+  k_spinlock_release(&tty->out.lock);
+}
+
 // Send a signal to all processes in the given console process group
 static void
 tty_signal(struct Tty *tty, int signo)
@@ -278,8 +301,10 @@ tty_process_input(struct Tty *tty, char *buf)
     tty->in.size++;
   }
 
-  if ((status & (IN_EOF | IN_EOL)) || !(tty->termios.c_lflag & ICANON))
+  if ((status & (IN_EOF | IN_EOL)) || !(tty->termios.c_lflag & ICANON)) {
     k_waitqueue_wakeup_all(&tty->in.queue);
+    poll_queue_notify(&tty->in.poll_queue, POLLIN);
+  }
 
   k_spinlock_release(&tty->in.lock);
 }
@@ -367,30 +392,33 @@ ssize_t
 tty_write(dev_t dev, uintptr_t buf, size_t nbytes)
 {
   struct Tty *tty = tty_from_dev(dev);
+  char chunk[TTY_CHUNK];
   size_t i;
 
   if (tty == NULL)
     return -ENODEV;
 
-  k_spinlock_acquire(&tty->out.lock);
+  for (i = 0; i < nbytes; ) {
+    size_t j, n = MIN(nbytes - i, sizeof(chunk));
+    int r;
 
-  if (!tty->out.stopped) {
-    // TODO: unlock periodically to not block the entire system?
-    for (i = 0; i != nbytes; i++) {
-      int c, r;
+    // Copy the data before taking the lock, since that may fault
+    if ((r = vm_space_copy_in(chunk, buf + i, n)) < 0)
+      return (i > 0) ? (ssize_t) i : r;
 
-      if ((r = vm_space_copy_in(&c, buf + i, 1)) < 0) {
-        k_spinlock_release(&tty->out.lock);
-        return r;
-      }
+    // Hold the lock (with IRQs disabled) for one chunk at a time only
+    k_spinlock_acquire(&tty->out.lock);
 
-      arch_tty_out_char(tty, c);
+    if (!tty->out.stopped) {
+      for (j = 0; j < n; j++)
+        arch_tty_out_char(tty, chunk[j]);
+      arch_tty_flush(tty);
     }
 
-    arch_tty_flush(tty);
-  }
+    k_spinlock_release(&tty->out.lock);
 
-  k_spinlock_release(&tty->out.lock);
+    i += n;
+  }
   
   return i;
 }
@@ -406,7 +434,7 @@ tty_ioctl(dev_t dev, int request, int arg)
 
   switch (request) {
   case TIOCGETA:
-    return vm_copy_out(process_current()->vm->pgtab,
+    return vm_copy_out(process_current()->vm,
                        &tty->termios,
                        arg,
                        sizeof(struct termios));
@@ -414,7 +442,7 @@ tty_ioctl(dev_t dev, int request, int arg)
   case TIOCSETAW:
     // TODO: drain
   case TIOCSETA:
-    return vm_copy_in(process_current()->vm->pgtab,
+    return vm_copy_in(process_current()->vm,
                       &tty->termios,
                       arg,
                       sizeof(struct termios));
@@ -430,62 +458,68 @@ tty_ioctl(dev_t dev, int request, int arg)
     ws.ws_row = SCREEN_ROWS;
     ws.ws_xpixel = DEFAULT_FB_WIDTH;
     ws.ws_ypixel = DEFAULT_FB_HEIGHT;
-    return vm_copy_out(process_current()->vm->pgtab, &ws, arg, sizeof ws);
+    return vm_copy_out(process_current()->vm, &ws, arg, sizeof ws);
   case TIOCSWINSZ:
     // cprintf("set winsize\n");
-    if (vm_copy_in(process_current()->vm->pgtab, &ws, arg, sizeof ws) < 0)
+    if (vm_copy_in(process_current()->vm, &ws, arg, sizeof ws) < 0)
       return -EFAULT;
     // cprintf("ws_col = %d\n", ws.ws_col);
     // cprintf("ws_row = %d\n", ws.ws_row);
     // cprintf("ws_xpixel = %d\n", ws.ws_xpixel);
     // cprintf("ws_ypixel = %d\n", ws.ws_ypixel);
     return 0;
+  case TIOCMAPFB:
+    // Returns the user virtual address of the framebuffer
+    return fb_map();
   default:
     panic("TODO: %p - %d %c %d\n", request, request & 0xFF, (request >> 8) & 0xF, (request >> 16) & 0x1FFF);
     return -EINVAL;
   }
 }
 
+// Check whether a read would not block. In canonical mode, a complete line
+// must be available.
 static int
-tty_try_select(struct Tty *tty)
+tty_can_read(struct Tty *tty)
 {
-  if (tty->in.size > 0) {
-    if (!(tty->termios.c_lflag & ICANON)) {
+  size_t i;
+
+  if (!(tty->termios.c_lflag & ICANON))
+    return tty->in.size > 0;
+
+  for (i = 0; i < tty->in.size; i++) {
+    char c = tty->in.buf[(tty->in.read_pos + i) % TTY_INPUT_MAX];
+
+    if ((c == '\n') ||
+        (c == tty->termios.c_cc[VEOL]) ||
+        (c == tty->termios.c_cc[VEOF]))
       return 1;
-    } else {
-      // TODO: check whether EOL or EOF seen
-      return 0;
-    }
   }
+
   return 0;
 }
 
+/**
+ * Check the console state.
+ *
+ * @param dev   The device number
+ * @param entry The entry to register for input notifications, or NULL
+ *
+ * @return The pending events.
+ */
 int
-tty_select(dev_t dev, struct timeval *timeout)
+tty_poll(dev_t dev, struct PollEntry *entry)
 {
   struct Tty *tty = tty_from_dev(dev);
   int r;
 
   if (tty == NULL)
-    return -ENODEV;
-
-  k_spinlock_acquire(&tty->in.lock);
-
-  while ((r = tty_try_select(tty)) == 0) {
-    unsigned long t = 0;
+    return POLLNVAL;
 
-    if (timeout != NULL) {
-      t = timeval2ticks(timeout);
-      k_spinlock_release(&tty->in.lock);
-      return 0;
-    }
-
-    if ((r = k_waitqueue_timed_sleep(&tty->in.queue, &tty->in.lock, t)) < 0) {
-      k_spinlock_release(&tty->in.lock);
-      return r;
-    }
-  }
+  poll_queue_add(&tty->in.poll_queue, entry);
 
+  k_spinlock_acquire(&tty->in.lock);
+  r = POLLOUT | (tty_can_read(tty) ? POLLIN : 0);
   k_spinlock_release(&tty->in.lock);
 
   return r;
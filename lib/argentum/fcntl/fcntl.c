@@ -16,6 +16,7 @@ fcntl(int fildes, int cmd, ...)
   case F_SETFD:
   case F_SETFL:
   case F_SETOWN:
+  case F_SETPIPE_SZ:
     arg = va_arg(ap, int);
     break;
   case F_GETLK:
@@ -0,0 +1,9 @@
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+ssize_t
+splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len,
+       unsigned flags)
+{
+  return __syscall6(__SYS_SPLICE, fd_in, off_in, fd_out, off_out, len, flags);
+}
@@ -0,0 +1,8 @@
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+ssize_t
+tee(int fd_in, int fd_out, size_t len, unsigned flags)
+{
+  return __syscall4(__SYS_TEE, fd_in, fd_out, len, flags);
+}
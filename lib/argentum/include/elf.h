@@ -0,0 +1,168 @@
+#ifndef _ELF_H
+#define _ELF_H
+
+#include <stdint.h>
+
+typedef uint32_t  Elf32_Addr;
+typedef uint16_t  Elf32_Half;
+typedef uint32_t  Elf32_Off;
+typedef int32_t   Elf32_Sword;
+typedef uint32_t  Elf32_Word;
+
+#define EI_NIDENT     16
+
+/**
+ * ELF Header
+ */
+typedef struct {
+  unsigned char e_ident[EI_NIDENT]; ///< ELF identification
+  Elf32_Half    e_type;             ///< Object file type
+  Elf32_Half    e_machine;          ///< Required architecture
+  Elf32_Word    e_version;          ///< Object file version
+  Elf32_Addr    e_entry;            ///< Entry point virtual address
+  Elf32_Off     e_phoff;            ///< Program header table's offset
+  Elf32_Off     e_shoff;            ///< Section header table's offset
+  Elf32_Word    e_flags;            ///< Processor-specific flags
+  Elf32_Half    e_ehsize;           ///< ELF header size
+  Elf32_Half    e_phentsize;        ///< Program header entry size
+  Elf32_Half    e_phnum;            ///< The number of program header entries
+  Elf32_Half    e_shentsize;        ///< Section header entry size
+  Elf32_Half    e_shnum;            ///< The number of section header entries
+  Elf32_Half    e_shstrndx;         ///< Section name string table index
+} Elf32_Ehdr;
+
+#define ELFMAG        "\177ELF"
+#define SELFMAG       4
+
+#define ET_EXEC       2             ///< Executable file
+#define ET_DYN        3             ///< Shared object file
+
+#define EM_ARM        40
+
+/**
+ * Program Header
+ */
+typedef struct {
+  Elf32_Word    p_type;             ///< Segment type
+  Elf32_Off     p_offset;           ///< Segment offset
+  Elf32_Addr    p_vaddr;            ///< Segment virtual address
+  Elf32_Addr    p_paddr;            ///< Segment physical address
+  Elf32_Word    p_filesz;           ///< Segment file image size
+  Elf32_Word    p_memsz;            ///< Segment memory image size
+  Elf32_Word    p_flags;            ///< Segment flags
+  Elf32_Word    p_align;            ///< Segment alignment
+} Elf32_Phdr;
+
+#define PT_NULL       0             ///< Unused
+#define PT_LOAD       1             ///< Loadable segment
+#define PT_DYNAMIC    2             ///< Dynamic linking information
+#define PT_INTERP     3             ///< Interpreter pathname
+#define PT_NOTE       4             ///< Auxiliary information
+#define PT_SHLIB      5             ///< Reserved
+#define PT_PHDR       6             ///< Program header table
+
+#define PF_X          (1 << 0)      ///< Execute
+#define PF_W          (1 << 1)      ///< Write
+#define PF_R          (1 << 2)      ///< Read
+
+/**
+ * Dynamic Section Entry
+ */
+typedef struct {
+  Elf32_Sword   d_tag;              ///< Entry type
+  union {
+    Elf32_Word  d_val;
+    Elf32_Addr  d_ptr;
+  } d_un;
+} Elf32_Dyn;
+
+#define DT_NULL         0           ///< End of the dynamic section
+#define DT_NEEDED       1           ///< Name of a needed library
+#define DT_PLTRELSZ     2           ///< Size of the PLT relocations
+#define DT_PLTGOT       3
+#define DT_HASH         4           ///< Symbol hash table
+#define DT_STRTAB       5           ///< String table
+#define DT_SYMTAB       6           ///< Symbol table
+#define DT_RELA         7
+#define DT_RELASZ       8
+#define DT_RELAENT      9
+#define DT_STRSZ        10          ///< Size of the string table
+#define DT_SYMENT       11          ///< Size of a symbol table entry
+#define DT_INIT         12          ///< Initialization function
+#define DT_FINI         13          ///< Termination function
+#define DT_SONAME       14
+#define DT_RPATH        15
+#define DT_SYMBOLIC     16
+#define DT_REL          17          ///< Relocation table
+#define DT_RELSZ        18          ///< Size of the relocation table
+#define DT_RELENT       19          ///< Size of a relocation entry
+#define DT_PLTREL       20          ///< Type of the PLT relocations
+#define DT_DEBUG        21
+#define DT_TEXTREL      22          ///< Relocations apply to read-only text
+#define DT_JMPREL       23          ///< PLT relocations
+#define DT_BIND_NOW     24
+#define DT_INIT_ARRAY   25          ///< Initialization functions
+#define DT_FINI_ARRAY   26          ///< Termination functions
+#define DT_INIT_ARRAYSZ 27
+#define DT_FINI_ARRAYSZ 28
+#define DT_NUM          29          ///< The number of standard entry types
+
+/**
+ * Symbol Table Entry
+ */
+typedef struct {
+  Elf32_Word    st_name;            ///< Offset of the name in the string table
+  Elf32_Addr    st_value;           ///< Symbol value
+  Elf32_Word    st_size;            ///< Size of the object
+  unsigned char st_info;            ///< Type and binding
+  unsigned char st_other;           ///< Visibility
+  Elf32_Half    st_shndx;           ///< Section index
+} Elf32_Sym;
+
+#define ELF32_ST_BIND(i)    ((i) >> 4)
+#define ELF32_ST_TYPE(i)    ((i) & 0xF)
+
+#define STB_LOCAL     0
+#define STB_GLOBAL    1
+#define STB_WEAK      2
+
+#define STT_NOTYPE    0
+#define STT_OBJECT    1
+#define STT_FUNC      2
+#define STT_SECTION   3
+#define STT_FILE      4
+#define STT_TLS       6
+
+#define SHN_UNDEF     0
+
+/**
+ * Relocation Entry
+ */
+typedef struct {
+  Elf32_Addr    r_offset;           ///< Where to apply the relocation
+  Elf32_Word    r_info;             ///< Symbol index and type
+} Elf32_Rel;
+
+#define ELF32_R_SYM(i)      ((i) >> 8)
+#define ELF32_R_TYPE(i)     ((unsigned char) (i))
+
+#define R_ARM_NONE        0
+#define R_ARM_ABS32       2
+#define R_ARM_COPY        20
+#define R_ARM_GLOB_DAT    21
+#define R_ARM_JUMP_SLOT   22
+#define R_ARM_RELATIVE    23
+
+/**
+ * Auxiliary vector entry types, the vector follows the environment on the
+ * initial stack of a process
+ */
+#define AT_NULL       0             ///< End of the vector
+#define AT_PHDR       3             ///< Program headers of the program
+#define AT_PHENT      4             ///< Size of a program header entry
+#define AT_PHNUM      5             ///< The number of program headers
+#define AT_PAGESZ     6             ///< System page size
+#define AT_BASE       7             ///< Base address of the interpreter
+#define AT_ENTRY      9             ///< Entry point of the program
+
+#endif  // !_ELF_H
@@ -152,6 +152,10 @@
 #define NZERO     20
 #endif
 
+#ifndef IOV_MAX
+#define IOV_MAX             1024
+#endif
+
 #ifndef LINK_MAX
 #define LINK_MAX            32767
 #endif
@@ -161,5 +165,21 @@
 #endif
 
 #ifndef OPEN_MAX
-#define OPEN_MAX            32
+#define OPEN_MAX            256
+#endif
+
+#ifndef PIPE_BUF
+#define PIPE_BUF            4096
+#endif
+
+#ifndef PTHREAD_DESTRUCTOR_ITERATIONS
+#define PTHREAD_DESTRUCTOR_ITERATIONS 4
+#endif
+
+#ifndef PTHREAD_KEYS_MAX
+#define PTHREAD_KEYS_MAX    32
+#endif
+
+#ifndef PTHREAD_STACK_MIN
+#define PTHREAD_STACK_MIN   4096
 #endif
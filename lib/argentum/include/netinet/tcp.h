@@ -0,0 +1,14 @@
+#ifndef _SYS_NETINET_TCP_H
+# define _SYS_NETINET_TCP_H
+
+/*
+ * Options for use with getsockopt() and setsockopt() at the IPPROTO_TCP level
+ * (same values as in the kernel network stack).
+ */
+#define TCP_NODELAY     0x01    /* don't delay send to coalesce packets */
+#define TCP_KEEPALIVE   0x02    /* idle time before KEEPALIVE probes, in ms */
+#define TCP_KEEPIDLE    0x03    /* idle time before KEEPALIVE probes, in s */
+#define TCP_KEEPINTVL   0x04    /* interval between KEEPALIVE probes, in s */
+#define TCP_KEEPCNT     0x05    /* number of KEEPALIVE probes to send */
+
+#endif  // !_SYS_NETINET_TCP_H
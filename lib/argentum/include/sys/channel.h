@@ -0,0 +1,41 @@
+#ifndef _SYS_CHANNEL_H
+#define _SYS_CHANNEL_H
+
+/**
+ * @file include/sys/channel.h
+ *
+ * Synchronous message passing. A server creates a channel and receives
+ * messages on it, clients attach connections to the channel and send messages
+ * through them. A sender stays blocked until the server replies, and the
+ * message and the reply are copied directly between the two address spaces
+ * (large page-aligned ones are remapped instead).
+ */
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+/** Information about a received message */
+struct msg_info {
+  /** The process that has sent the message */
+  pid_t  pid;
+  /** The number of bytes received */
+  size_t msglen;
+  /** The size of the message the sender has provided */
+  size_t srcmsglen;
+  /** The size of the buffer the sender has provided for the reply */
+  size_t dstmsglen;
+};
+
+__BEGIN_DECLS
+
+int     channel_create(void);
+int     channel_destroy(int);
+int     connect_attach(int);
+int     connect_detach(int);
+ssize_t msg_send(int, const void *, size_t, void *, size_t);
+int     msg_receive(int, void *, size_t, struct msg_info *);
+int     msg_reply(int, ssize_t, const void *, size_t);
+
+__END_DECLS
+
+#endif  // !_SYS_CHANNEL_H
@@ -0,0 +1,53 @@
+#ifndef _SYS_CPUSET_H
+#define _SYS_CPUSET_H
+
+/**
+ * @file include/sys/cpuset.h
+ *
+ * CPU affinity masks. Each thread of a process may only be scheduled on the
+ * CPUs included in the mask of the process.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+/** The number of CPUs a cpu_set_t can describe */
+#define CPU_SETSIZE   32
+
+/** A set of CPUs */
+typedef struct {
+  unsigned long __bits[CPU_SETSIZE / (8 * sizeof(unsigned long))];
+} cpu_set_t;
+
+#define __CPU_WORD(cpu) ((cpu) / (8 * sizeof(unsigned long)))
+#define __CPU_BIT(cpu)  (1UL << ((cpu) % (8 * sizeof(unsigned long))))
+
+#define CPU_ZERO(set) \
+  __builtin_memset((set), 0, sizeof(cpu_set_t))
+#define CPU_SET(cpu, set) \
+  ((set)->__bits[__CPU_WORD(cpu)] |= __CPU_BIT(cpu))
+#define CPU_CLR(cpu, set) \
+  ((set)->__bits[__CPU_WORD(cpu)] &= ~__CPU_BIT(cpu))
+#define CPU_ISSET(cpu, set) \
+  (((set)->__bits[__CPU_WORD(cpu)] & __CPU_BIT(cpu)) != 0)
+#define CPU_COUNT(set)  __cpu_count(set)
+
+__BEGIN_DECLS
+
+static __inline int
+__cpu_count(const cpu_set_t *set)
+{
+  unsigned i;
+  int count = 0;
+
+  for (i = 0; i < sizeof(set->__bits) / sizeof(set->__bits[0]); i++)
+    count += __builtin_popcountl(set->__bits[i]);
+  return count;
+}
+
+int sched_getaffinity(pid_t, size_t, cpu_set_t *);
+int sched_setaffinity(pid_t, size_t, const cpu_set_t *);
+
+__END_DECLS
+
+#endif  // !_SYS_CPUSET_H
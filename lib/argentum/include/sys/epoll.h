@@ -0,0 +1,48 @@
+#ifndef _SYS_EPOLL_H
+#define _SYS_EPOLL_H
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#define EPOLL_CLOEXEC   0x0001
+
+// Operations for epoll_ctl()
+#define EPOLL_CTL_ADD   1
+#define EPOLL_CTL_DEL   2
+#define EPOLL_CTL_MOD   3
+
+#define EPOLLIN         POLLIN
+#define EPOLLPRI        POLLPRI
+#define EPOLLOUT        POLLOUT
+#define EPOLLERR        POLLERR
+#define EPOLLHUP        POLLHUP
+#define EPOLLONESHOT    (1U << 30)    ///< Disable the descriptor after an event
+#define EPOLLET         (1U << 31)    ///< Edge-triggered notification
+
+typedef union epoll_data {
+  void     *ptr;
+  int       fd;
+  uint32_t  u32;
+  uint64_t  u64;
+} epoll_data_t;
+
+struct epoll_event {
+  uint32_t     events;
+  epoll_data_t data;
+};
+
+#ifndef __ARGENTUM_KERNEL__
+
+__BEGIN_DECLS
+
+int epoll_create(int);
+int epoll_create1(int);
+int epoll_ctl(int, int, int, struct epoll_event *);
+int epoll_wait(int, struct epoll_event *, int, int);
+
+__END_DECLS
+
+#endif
+
+#endif  // !_SYS_EPOLL_H
@@ -0,0 +1,95 @@
+#ifndef _SYS_EVLOOP_H
+#define _SYS_EVLOOP_H
+
+/**
+ * @file include/sys/evloop.h
+ *
+ * Event loop for servers.
+ *
+ * A single process serves many connections by waiting for all of them at
+ * once with epoll and running a callback for each descriptor that becomes
+ * ready, instead of blocking in accept() or read() per process. Timers run
+ * from the same loop.
+ *
+ * Callbacks must not block: the descriptors are expected to be in the
+ * non-blocking mode (see evloop_set_nonblock). For handlers that are easier
+ * to write as a sequence of reads and writes, ev_task_spawn() runs a function
+ * on a stack of its own, and the ev_task_* I/O calls switch back to the loop
+ * whenever they would block. All of it runs in one thread.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+struct evloop;
+
+/**
+ * Descriptor readiness watcher.
+ */
+struct ev_io {
+  /** The descriptor */
+  int         fd;
+  /** The events of interest (EPOLLIN, EPOLLOUT) */
+  uint32_t    events;
+  /** Called with the events that occurred */
+  void      (*callback)(struct evloop *, struct ev_io *, uint32_t);
+  void       *arg;
+  /** Whether the watcher is registered with the loop */
+  int         active;
+};
+
+/**
+ * One-shot timer.
+ */
+struct ev_timer {
+  /** Expiration time, in CLOCK_MONOTONIC nanoseconds */
+  uint64_t    expires;
+  void      (*callback)(struct evloop *, struct ev_timer *);
+  void       *arg;
+  /** Position in the timer heap, or -1 if not active */
+  int         index;
+};
+
+#ifndef __ARGENTUM_KERNEL__
+
+__BEGIN_DECLS
+
+struct evloop *evloop_create(void);
+void           evloop_destroy(struct evloop *);
+int            evloop_run(struct evloop *);
+void           evloop_stop(struct evloop *);
+uint64_t       evloop_now(void);
+int            evloop_set_nonblock(int);
+
+void           ev_io_init(struct ev_io *, int, uint32_t,
+                          void (*)(struct evloop *, struct ev_io *, uint32_t),
+                          void *);
+int            ev_io_start(struct evloop *, struct ev_io *);
+int            ev_io_modify(struct evloop *, struct ev_io *, uint32_t);
+int            ev_io_stop(struct evloop *, struct ev_io *);
+
+void           ev_timer_init(struct ev_timer *,
+                             void (*)(struct evloop *, struct ev_timer *),
+                             void *);
+int            ev_timer_start(struct evloop *, struct ev_timer *,
+                              unsigned long);
+void           ev_timer_stop(struct evloop *, struct ev_timer *);
+
+int            ev_task_spawn(struct evloop *, void (*)(void *), void *,
+                             size_t);
+struct evloop *ev_task_loop(void);
+int            ev_task_wait(int, uint32_t, int);
+int            ev_task_sleep(unsigned long);
+ssize_t        ev_task_read(int, void *, size_t);
+ssize_t        ev_task_write(int, const void *, size_t);
+int            ev_task_accept(int, struct sockaddr *, socklen_t *);
+
+__END_DECLS
+
+#endif
+
+#endif  // !_SYS_EVLOOP_H
@@ -0,0 +1,34 @@
+#ifndef _SYS_FB_H
+#define _SYS_FB_H
+
+/**
+ * @file include/sys/fb.h
+ *
+ * Framebuffer device (/dev/fb0).
+ *
+ * FBIOGETINFO describes the pixel layout, and FBIOMAP maps the whole
+ * framebuffer into the calling process, returning its address. The mapping is
+ * write-combining: stores are buffered and merged on their way to memory, so
+ * filling large areas is fast, but reading pixels back is slow.
+ */
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+struct fb_info {
+  /** Visible width, in pixels */
+  uint32_t width;
+  /** Visible height, in pixels */
+  uint32_t height;
+  /** Bits per pixel (16 means RGB565) */
+  uint32_t bpp;
+  /** Bytes between the starts of two consecutive lines */
+  uint32_t stride;
+  /** The size of the mapping returned by FBIOMAP, in bytes */
+  uint32_t size;
+};
+
+#define FBIOGETINFO   _IOR('F', 0, struct fb_info)  /* get geometry */
+#define FBIOMAP       _IOR('F', 1, void *)          /* map the pixels */
+
+#endif  // !_SYS_FB_H
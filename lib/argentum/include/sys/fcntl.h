@@ -0,0 +1,28 @@
+#ifndef _SYS_FCNTL_H_
+#define _SYS_FCNTL_H_
+
+#include <sys/_default_fcntl.h>
+#include <sys/types.h>
+
+/* Argentum extensions (the values match Linux) */
+#define F_SETPIPE_SZ  1031    /* Set the pipe buffer size */
+#define F_GETPIPE_SZ  1032    /* Get the pipe buffer size */
+
+/* splice() and tee() flags, accepted for compatibility and ignored */
+#define SPLICE_F_MOVE     0x01
+#define SPLICE_F_NONBLOCK 0x02
+#define SPLICE_F_MORE     0x04
+#define SPLICE_F_GIFT     0x08
+
+#ifndef __ARGENTUM_KERNEL__
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+ssize_t splice(int, off_t *, int, off_t *, size_t, unsigned);
+ssize_t tee(int, int, size_t, unsigned);
+
+__END_DECLS
+#endif
+
+#endif /* !_SYS_FCNTL_H_ */
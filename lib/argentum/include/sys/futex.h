@@ -0,0 +1,16 @@
+#ifndef _SYS_FUTEX_H
+#define _SYS_FUTEX_H
+
+/**
+ * @file include/sys/futex.h
+ *
+ * Operations of the futex system call, the building block of the process
+ * private synchronization primitives (see <pthread.h>).
+ */
+
+/** Sleep while the word at the given address holds the given value */
+#define FUTEX_WAIT    0
+/** Wake up at most the given number of threads sleeping on the address */
+#define FUTEX_WAKE    1
+
+#endif  // !_SYS_FUTEX_H
@@ -149,6 +149,7 @@ struct ttysize {
 #define	TIOCEXT		_IOW('t', 96, int)	/* pty: external processing */
 #define	TIOCSIG		_IO('t', 95)		/* pty: generate signal */
 #define TIOCDRAIN	_IO('t', 94)		/* wait till output drained */
+#define	TIOCMAPFB	_IOR('t', 93, void *)	/* map console framebuffer */
 
 #define TTYDISC		0		/* termios tty line discipline */
 #define	TABLDISC	3		/* tablet discipline */
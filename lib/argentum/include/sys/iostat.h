@@ -0,0 +1,54 @@
+#ifndef _SYS_IOSTAT_H
+#define _SYS_IOSTAT_H
+
+/**
+ * @file include/sys/iostat.h
+ *
+ * Block device I/O statistics.
+ *
+ * Reading /dev/iostat returns an array of struct iostat, one for each block
+ * device that keeps statistics. The counters only grow (except for `queued`),
+ * so a tool can read the device twice and divide the differences by the
+ * elapsed time.
+ */
+
+#include <stdint.h>
+
+/** The maximum length of a device name, including the terminating zero */
+#define IOSTAT_NAME_MAX   8
+
+/** The number of histogram buckets */
+#define IOSTAT_BUCKETS    16
+
+/** The size of a sector, in bytes */
+#define IOSTAT_SECTOR     512
+
+struct iostat {
+  /** The device name */
+  char     name[IOSTAT_NAME_MAX];
+  /** The device number */
+  uint32_t dev;
+  /** Buffers currently waiting in the driver queue or being transferred */
+  uint32_t queued;
+  /** The largest value of `queued` seen */
+  uint32_t max_queued;
+  /** Completed read and write buffers */
+  uint32_t reads;
+  uint32_t writes;
+  /** Buffers merged into the transfer of an adjacent buffer */
+  uint32_t read_merges;
+  uint32_t write_merges;
+  /** Sectors read and written */
+  uint64_t read_sectors;
+  uint64_t write_sectors;
+  /** The total time buffers waited from submission to their transfer, ms */
+  uint64_t wait_ms;
+  /** The total time with a transfer in progress (the busy time), ms */
+  uint64_t service_ms;
+  /** wait_hist[k] is the number of buffers that waited [2^k, 2^(k+1)) ms */
+  uint32_t wait_hist[IOSTAT_BUCKETS];
+  /** The same for the time from the start of the transfer to completion */
+  uint32_t service_hist[IOSTAT_BUCKETS];
+};
+
+#endif  // !_SYS_IOSTAT_H
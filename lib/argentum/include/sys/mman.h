@@ -20,11 +20,25 @@
 
 #define MAP_FAILED    ((void *) -1)
 
+#define MS_ASYNC      (1 << 0)
+#define MS_SYNC       (1 << 1)
+#define MS_INVALIDATE (1 << 2)
+
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+
 __BEGIN_DECLS
 
+int    madvise(void *, size_t, int);
 void  *mmap(void *, size_t, int, int, int, off_t);
 int    mprotect(void *, size_t, int);
+int    msync(void *, size_t, int);
 int    munmap(void *, size_t);
+int    shm_open(const char *, int, mode_t);
+int    shm_unlink(const char *);
 
 __END_DECLS
 
@@ -3,9 +3,16 @@
 
 #include <sys/cdefs.h>
 
+// Mount flags
+#define MNT_NOATIME     (1 << 0)    ///< Do not update access times
+#define MNT_NODIRATIME  (1 << 1)    ///< Do not update directory access times
+#define MNT_RELATIME    (1 << 2)    ///< Update access times only if older
+                                    ///< than the modification or change time,
+                                    ///< or once a day
+
 __BEGIN_DECLS
 
-int mount(const char *, const char *);
+int mount(const char *, const char *, int);
 
 __END_DECLS
 
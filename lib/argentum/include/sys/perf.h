@@ -0,0 +1,49 @@
+#ifndef _SYS_PERF_H
+#define _SYS_PERF_H
+
+/**
+ * @file include/sys/perf.h
+ *
+ * Per-thread hardware performance counters.
+ *
+ * Once enabled, the counters of a thread advance only while that thread is
+ * running (in user or kernel mode), so the difference between two readings is
+ * the cost of the code executed in between.
+ */
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+/** Processor cycles */
+#define PERF_CYCLES         0
+/** Level 1 data cache refills */
+#define PERF_L1D_MISS       1
+/** Level 1 instruction cache refills */
+#define PERF_L1I_MISS       2
+/** Data TLB refills */
+#define PERF_DTLB_MISS      3
+/** Mispredicted branches */
+#define PERF_BRANCH_MISS    4
+/** The number of counters */
+#define PERF_COUNTER_MAX    5
+
+/** Start counting for the calling thread */
+#define PERF_ENABLE         0
+/** Stop counting, keeping the values */
+#define PERF_DISABLE        1
+/** Read the current values */
+#define PERF_READ           2
+/** Zero the values */
+#define PERF_RESET          3
+
+#ifndef __ARGENTUM_KERNEL__
+
+__BEGIN_DECLS
+
+int perf_ctl(int, uint64_t *);
+
+__END_DECLS
+
+#endif
+
+#endif  // !_SYS_PERF_H
@@ -0,0 +1,53 @@
+#ifndef _SYS_RING_H
+#define _SYS_RING_H
+
+/**
+ * @file include/sys/ring.h
+ *
+ * System call submission ring.
+ *
+ * A process queues system calls into a ring kept in its own memory and then
+ * has the kernel run all of them with a single ring_enter() call, paying the
+ * trap cost once per batch rather than once per operation. The kernel stores
+ * each result in the entry and advances the head past it, so every entry
+ * between the old and the new head is complete.
+ */
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+/** Maximum number of entries the kernel completes in one ring_enter() */
+#define RING_BATCH_MAX  64
+
+struct ring_entry {
+  /** The system call number */
+  uint32_t num;
+  /** The system call arguments */
+  uint32_t args[6];
+  /** The return value (a negative error code on failure) */
+  int32_t  result;
+};
+
+struct ring {
+  /** Index of the next entry to be run, advanced by the kernel */
+  volatile uint32_t head;
+  /** Index of the next free entry, advanced by the process */
+  volatile uint32_t tail;
+  /** The number of entries minus one (the size must be a power of two) */
+  uint32_t          mask;
+  uint32_t          reserved;
+  /** The entries themselves */
+  struct ring_entry entries[];
+};
+
+#ifndef __ARGENTUM_KERNEL__
+
+__BEGIN_DECLS
+
+int ring_enter(struct ring *, unsigned);
+
+__END_DECLS
+
+#endif
+
+#endif  // !_SYS_RING_H
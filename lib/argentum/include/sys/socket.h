@@ -33,8 +33,8 @@ typedef uint8_t  sa_family_t;
 #define SO_LINGER       0x0080 /* linger on close if data present */
 #define SO_DONTLINGER   ((int)(~SO_LINGER))
 #define SO_OOBINLINE    0x0100 /* Unimplemented: leave received OOB data in line */
-#define SO_REUSEPORT    0x0200 /* Unimplemented: allow local address & port reuse */
-#define SO_SNDBUF       0x1001 /* Unimplemented: send buffer size */
+#define SO_REUSEPORT    0x0200 /* allow local address & port reuse (TCP listeners) */
+#define SO_SNDBUF       0x1001 /* send buffer size (TCP only) */
 #define SO_RCVBUF       0x1002 /* receive buffer size */
 #define SO_SNDLOWAT     0x1003 /* Unimplemented: send low-water mark */
 #define SO_RCVLOWAT     0x1004 /* Unimplemented: receive low-water mark */
@@ -64,6 +64,7 @@ int     accept(int, struct sockaddr *, socklen_t *);
 int     bind(int, const struct sockaddr *, socklen_t);
 int     connect(int, const struct sockaddr *, socklen_t);
 int     getsockname(int, struct sockaddr *,  socklen_t *);
+int     getsockopt(int, int, int, void *, socklen_t *);
 int     listen(int, int);
 int     socket(int, int, int);
 int     setsockopt(int, int, int, const void *, socklen_t);
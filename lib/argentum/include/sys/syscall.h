@@ -71,6 +71,47 @@
 #define __SYS_TIMES         65
 #define __SYS_MOUNT         66
 #define __SYS_SETITIMER     67
+#define __SYS_SYNC          68
+#define __SYS_SPLICE        69
+#define __SYS_TEE           70
+#define __SYS_SENDFILE      71
+#define __SYS_POLL          72
+#define __SYS_EPOLL_CREATE  73
+#define __SYS_EPOLL_CTL     74
+#define __SYS_EPOLL_WAIT    75
+#define __SYS_READV         76
+#define __SYS_WRITEV        77
+#define __SYS_PREAD         78
+#define __SYS_PWRITE        79
+#define __SYS_PREADV        80
+#define __SYS_PWRITEV       81
+#define __SYS_GETSOCKOPT    82
+#define __SYS_CLONE         83
+#define __SYS_THREAD_EXIT   84
+#define __SYS_FUTEX         85
+#define __SYS_SCHED_YIELD   86
+#define __SYS_RING_ENTER    87
+#define __SYS_PERF_CTL      88
+#define __SYS_MSYNC         89
+#define __SYS_MADVISE       90
+#define __SYS_FSTATAT       91
+#define __SYS_CHANNEL_CREATE 92
+#define __SYS_CHANNEL_DESTROY 93
+#define __SYS_CONNECT_ATTACH 94
+#define __SYS_CONNECT_DETACH 95
+#define __SYS_MSG_SEND      96
+#define __SYS_MSG_RECEIVE   97
+#define __SYS_MSG_REPLY     98
+#define __SYS_SCHED_SETSCHEDULER  99
+#define __SYS_SCHED_GETSCHEDULER  100
+#define __SYS_SCHED_GETPARAM      101
+#define __SYS_SCHED_RR_GET_INTERVAL 102
+#define __SYS_SCHED_SETAFFINITY   103
+#define __SYS_SCHED_GETAFFINITY   104
+#define __SYS_SET_TLS             105
+
+// The first argument of __SYS_TEST that runs the kernel microbenchmarks
+#define __SYS_TEST_BENCH    0x6B62
 
 #ifndef __ASSEMBLER__
 
@@ -0,0 +1,33 @@
+#ifndef _SYS_SYSSTAT_H
+#define _SYS_SYSSTAT_H
+
+/**
+ * @file include/sys/sysstat.h
+ *
+ * System call latency statistics.
+ *
+ * Reading /dev/sysstat returns an array of struct sysstat indexed by the
+ * system call number, summed over all CPUs. Writing "start", "stop" or
+ * "clear" to the device controls the collection.
+ */
+
+#include <stdint.h>
+
+/** The number of system call numbers covered */
+#define SYSSTAT_MAX       128
+
+/** The number of histogram buckets */
+#define SYSSTAT_BUCKETS   32
+
+struct sysstat {
+  /** The number of completed calls */
+  uint32_t calls;
+  /** Calls that finished on another CPU, whose latency is not measured */
+  uint32_t migrated;
+  /** The total number of cycles spent in the measured calls */
+  uint64_t cycles;
+  /** hist[k] is the number of calls that took [2^k, 2^(k+1)) cycles */
+  uint32_t hist[SYSSTAT_BUCKETS];
+};
+
+#endif  // !_SYS_SYSSTAT_H
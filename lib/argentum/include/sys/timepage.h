@@ -0,0 +1,71 @@
+#ifndef __SYS_TIMEPAGE_H__
+#define __SYS_TIMEPAGE_H__
+
+/**
+ * @file include/sys/timepage.h
+ * 
+ * Read-only time information page shared by the kernel with user programs.
+ */
+
+#include <sys/cdefs.h>
+#include <stdint.h>
+
+__BEGIN_DECLS
+
+/**
+ * The fixed virtual address the page is mapped at in every process.
+ */
+#define TIMEPAGE_ADDR   0x7FFEF000
+
+/**
+ * Time information page layout.
+ * 
+ * The kernel increments the sequence counter before and after each update, so
+ * it is odd while an update is in progress. To get a consistent snapshot,
+ * sample the counter, read the fields, and retry if the counter was odd or has
+ * changed in between.
+ */
+struct timepage {
+  /**
+   * Sequence counter.
+   */
+  volatile uint32_t tp_seq;
+  /**
+   * The number of clock ticks per second.
+   */
+  uint32_t          tp_rate;
+  /**
+   * The number of clock ticks since the Epoch.
+   */
+  volatile uint64_t tp_ticks;
+  /**
+   * CLOCK_MONOTONIC at the last update, in nanoseconds.
+   */
+  volatile uint64_t tp_mono_ns;
+  /**
+   * The clock source counter at the last update.
+   */
+  volatile uint64_t tp_cycles;
+  /**
+   * The counter bits.
+   */
+  uint64_t          tp_mask;
+  /**
+   * Counter increments are converted to nanoseconds as
+   * (delta * tp_mult) >> tp_shift.
+   */
+  uint32_t          tp_mult;
+  uint32_t          tp_shift;
+  /**
+   * How to read the counter in user mode (TP_COUNTER_*). If it cannot be
+   * read, precise time needs a system call.
+   */
+  uint32_t          tp_counter;
+};
+
+#define TP_COUNTER_NONE     0   ///< Not readable in user mode
+#define TP_COUNTER_CNTPCT   1   ///< ARM Generic Timer physical count
+
+__END_DECLS
+
+#endif  // !__SYS_TIMEPAGE_H__
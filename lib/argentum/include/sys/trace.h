@@ -0,0 +1,45 @@
+#ifndef _SYS_TRACE_H
+#define _SYS_TRACE_H
+
+/**
+ * @file include/sys/trace.h
+ *
+ * Kernel trace events.
+ *
+ * Reading /dev/trace returns the events recorded so far as an array of
+ * struct trace_event, ordered by the CPU and then by time within each CPU.
+ * Writing "start", "stop" or "clear" to the device controls the tracing.
+ */
+
+#include <stdint.h>
+
+/** Switching to a thread (arg0: thread, arg1: priority) */
+#define TRACE_SCHED_SWITCH    1
+/** A thread going to sleep (arg0: thread, arg1: timeout in ticks) */
+#define TRACE_SCHED_SLEEP     2
+/** Taking an interrupt (arg0: IRQ number) */
+#define TRACE_IRQ             3
+/** Entering a system call (arg0: number) */
+#define TRACE_SYSCALL_ENTER   4
+/** Leaving a system call (arg0: number, arg1: result) */
+#define TRACE_SYSCALL_EXIT    5
+/** Passing a buffer to a block driver (arg0: block, arg1: flags) */
+#define TRACE_BUF_SUBMIT      6
+/** A block driver completing a buffer (arg0: block, arg1: flags) */
+#define TRACE_BUF_DONE        7
+/** Handling a user page fault (arg0: address, arg1: result) */
+#define TRACE_VM_FAULT        8
+
+struct trace_event {
+  /** The cycle counter of the CPU when the event was recorded */
+  uint32_t cycles;
+  /** The event type */
+  uint16_t type;
+  /** The CPU that recorded the event */
+  uint16_t cpu;
+  /** Arguments specific to the type of the event */
+  uint32_t arg0;
+  uint32_t arg1;
+};
+
+#endif  // !_SYS_TRACE_H
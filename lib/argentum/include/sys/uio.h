@@ -0,0 +1,28 @@
+#ifndef _SYS_UIO_H
+#define _SYS_UIO_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+struct iovec {
+  void   *iov_base;     ///< Base address of the memory region
+  size_t  iov_len;      ///< Size of the memory region
+};
+
+// Keep lwip from declaring its own copy
+#define iovec iovec
+
+#ifndef __ARGENTUM_KERNEL__
+
+__BEGIN_DECLS
+
+ssize_t readv(int, const struct iovec *, int);
+ssize_t writev(int, const struct iovec *, int);
+ssize_t preadv(int, const struct iovec *, int, off_t);
+ssize_t pwritev(int, const struct iovec *, int, off_t);
+
+__END_DECLS
+
+#endif
+
+#endif  // !_SYS_UIO_H
@@ -6,7 +6,9 @@
 
 __BEGIN_DECLS
 
+// Same layout as struct sockaddr; keep in sync with the kernel
 struct sockaddr_un {
+  uint8_t      sun_len;
   sa_family_t  sun_family;
   char         sun_path[104];
 };
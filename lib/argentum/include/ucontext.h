@@ -25,7 +25,7 @@ typedef struct mcontext_t {
   uint32_t  pc;
   uint32_t  psr;
 
-  uint32_t  s[32];
+  uint64_t  d[32];
   uint32_t  fpscr;
 } mcontext_t;
 
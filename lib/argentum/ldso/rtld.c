@@ -0,0 +1,567 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+ * The dynamic loader (/usr/lib/ld.so.1).
+ *
+ * The kernel maps a dynamically linked program together with the loader, and
+ * starts the loader with the arguments meant for the program's _start(). The
+ * loader relocates itself, maps the libraries the program needs, resolves all
+ * relocations at once (there is no lazy binding), runs the initializers of the
+ * libraries and jumps to the program.
+ *
+ * The libraries are mapped from their files, so their text pages come from
+ * the page cache and are shared by all processes using them. Symbols are
+ * looked up in the program first and then in the libraries in load order.
+ *
+ * The loader cannot use the C library itself, so it talks to the kernel
+ * directly and writes nothing but error messages.
+ */
+
+#define PAGE_SIZE       4096
+
+/** The most libraries a program may use */
+#define RTLD_OBJS_MAX   16
+/** The longest library path */
+#define RTLD_PATH_MAX   256
+
+#define TRUNC_PAGE(x)   ((x) & ~(PAGE_SIZE - 1))
+#define ROUND_PAGE(x)   TRUNC_PAGE((x) + PAGE_SIZE - 1)
+
+struct RtldObject {
+  const char       *name;
+  uintptr_t         base;             ///< Added to the link addresses
+  const Elf32_Dyn  *dynamic;
+  uintptr_t         dyn[DT_NUM];      ///< Dynamic entries, by tag
+  const Elf32_Sym  *symtab;
+  const char       *strtab;
+  const Elf32_Word *hash;             ///< DT_HASH table, NULL if none
+};
+
+typedef void (*rtld_init_t)(void);
+typedef void (*rtld_entry_t)(int, char **, char **);
+
+// The program is always the first object
+static struct RtldObject rtld_objs[RTLD_OBJS_MAX];
+static unsigned          rtld_nobjs;
+
+// The first page of the file being mapped
+static unsigned char     rtld_buf[PAGE_SIZE];
+static char              rtld_path[RTLD_PATH_MAX];
+
+// The directories searched for libraries named without a slash
+static const char *const rtld_dirs[] = { "/usr/lib/", "/lib/" };
+
+extern const Elf32_Dyn _DYNAMIC[] __attribute__((visibility("hidden")));
+
+/*
+ * ----------------------------------------------------------------------------
+ * Helpers
+ * ----------------------------------------------------------------------------
+ */
+
+static size_t
+rtld_strlen(const char *s)
+{
+  size_t n = 0;
+
+  while (s[n] != '\0')
+    n++;
+  return n;
+}
+
+static int
+rtld_strcmp(const char *s1, const char *s2)
+{
+  while ((*s1 != '\0') && (*s1 == *s2)) {
+    s1++;
+    s2++;
+  }
+  return (unsigned char) *s1 - (unsigned char) *s2;
+}
+
+static void
+rtld_memcpy(void *dst, const void *src, size_t n)
+{
+  unsigned char *d = (unsigned char *) dst;
+  const unsigned char *s = (const unsigned char *) src;
+
+  while (n-- > 0)
+    *d++ = *s++;
+}
+
+static void
+rtld_memzero(void *dst, size_t n)
+{
+  volatile unsigned char *d = (volatile unsigned char *) dst;
+
+  while (n-- > 0)
+    *d++ = 0;
+}
+
+static void
+rtld_puts(const char *s)
+{
+  __syscall_r(__SYS_WRITE, 2, (uintptr_t) s, rtld_strlen(s), 0, 0, 0);
+}
+
+static void __attribute__((noreturn))
+rtld_fatal(const char *what, const char *name)
+{
+  rtld_puts("ld.so: ");
+  rtld_puts(what);
+  if (name != NULL) {
+    rtld_puts(": ");
+    rtld_puts(name);
+  }
+  rtld_puts("\n");
+
+  for (;;)
+    __syscall_r(__SYS_EXIT, 127, 0, 0, 0, 0, 0);
+}
+
+static void *
+rtld_mmap(uintptr_t addr, size_t n, int prot, int flags, int fd, off_t off)
+{
+  int32_t r = __syscall_r(__SYS_MMAP, addr, n, prot, flags, fd, off);
+
+  return ((r < 0) && (r > -4096)) ? MAP_FAILED : (void *) r;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Objects
+ * ----------------------------------------------------------------------------
+ */
+
+// Relocate the loader itself. Nothing that needs a relocation (a pointer in
+// static data, a global variable) can be used before this is done.
+static void
+rtld_relocate_self(uintptr_t base)
+{
+  const Elf32_Dyn *d;
+  const Elf32_Rel *rel, *end;
+  uintptr_t rel_addr = 0;
+  size_t rel_size = 0;
+
+  for (d = _DYNAMIC; d->d_tag != DT_NULL; d++) {
+    if (d->d_tag == DT_REL)
+      rel_addr = d->d_un.d_ptr;
+    else if (d->d_tag == DT_RELSZ)
+      rel_size = d->d_un.d_val;
+  }
+
+  // Linked with -Bsymbolic, so all relocations are relative
+  rel = (const Elf32_Rel *) (base + rel_addr);
+  end = (const Elf32_Rel *) (base + rel_addr + rel_size);
+  for ( ; rel < end; rel++)
+    if (ELF32_R_TYPE(rel->r_info) == R_ARM_RELATIVE)
+      *(uintptr_t *) (base + rel->r_offset) += base;
+}
+
+// Find the tables of a mapped object
+static void
+rtld_object_init(struct RtldObject *obj)
+{
+  const Elf32_Dyn *d;
+
+  for (d = obj->dynamic; d->d_tag != DT_NULL; d++)
+    if ((d->d_tag >= 0) && (d->d_tag < DT_NUM) && (d->d_tag != DT_NEEDED))
+      obj->dyn[d->d_tag] = d->d_un.d_val;
+
+  if (obj->dyn[DT_TEXTREL] != 0)
+    rtld_fatal("text relocations are not supported", obj->name);
+
+  obj->symtab = (const Elf32_Sym *) (obj->base + obj->dyn[DT_SYMTAB]);
+  obj->strtab = (const char *) (obj->base + obj->dyn[DT_STRTAB]);
+  obj->hash   = (obj->dyn[DT_HASH] != 0)
+              ? (const Elf32_Word *) (obj->base + obj->dyn[DT_HASH])
+              : NULL;
+}
+
+// Map the loadable segments of a library file
+static void
+rtld_map(struct RtldObject *obj, const char *path)
+{
+  const Elf32_Ehdr *eh = (const Elf32_Ehdr *) rtld_buf;
+  const Elf32_Phdr *ph;
+  uintptr_t lo, hi, va, file_end, mem_end;
+  void *reserved;
+  int fd, n, i;
+
+  if ((fd = __syscall_r(__SYS_OPEN, (uintptr_t) path, O_RDONLY,
+                        0, 0, 0, 0)) < 0)
+    rtld_fatal("cannot open", path);
+
+  n = __syscall_r(__SYS_READ, fd, (uintptr_t) rtld_buf, sizeof(rtld_buf),
+                  0, 0, 0);
+
+  if ((n < (int) sizeof(*eh)) ||
+      (eh->e_ident[0] != ELFMAG[0]) || (eh->e_ident[1] != ELFMAG[1]) ||
+      (eh->e_ident[2] != ELFMAG[2]) || (eh->e_ident[3] != ELFMAG[3]) ||
+      (eh->e_type != ET_DYN) || (eh->e_machine != EM_ARM) ||
+      (eh->e_phentsize != sizeof(*ph)) ||
+      (eh->e_phoff + eh->e_phnum * sizeof(*ph) > (size_t) n))
+    rtld_fatal("not a shared library", path);
+
+  ph = (const Elf32_Phdr *) (rtld_buf + eh->e_phoff);
+
+  // Find a free range for the whole image
+  lo = ~0U;
+  hi = 0;
+  for (i = 0; i < eh->e_phnum; i++) {
+    if (ph[i].p_type != PT_LOAD)
+      continue;
+    if (TRUNC_PAGE(ph[i].p_vaddr) < lo)
+      lo = TRUNC_PAGE(ph[i].p_vaddr);
+    if (ROUND_PAGE(ph[i].p_vaddr + ph[i].p_memsz) > hi)
+      hi = ROUND_PAGE(ph[i].p_vaddr + ph[i].p_memsz);
+  }
+
+  if (hi <= lo)
+    rtld_fatal("no loadable segments", path);
+
+  reserved = rtld_mmap(0, hi - lo, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+  if (reserved == MAP_FAILED)
+    rtld_fatal("out of memory", path);
+  __syscall_r(__SYS_MUNMAP, (uintptr_t) reserved, hi - lo, 0, 0, 0, 0);
+
+  obj->base = (uintptr_t) reserved - lo;
+
+  // Nothing else runs, so the segments get exactly the addresses asked for
+  for (i = 0; i < eh->e_phnum; i++) {
+    int prot = 0;
+
+    if (ph[i].p_type == PT_DYNAMIC)
+      obj->dynamic = (const Elf32_Dyn *) (obj->base + ph[i].p_vaddr);
+
+    if (ph[i].p_type != PT_LOAD)
+      continue;
+
+    if ((ph[i].p_vaddr % PAGE_SIZE) != (ph[i].p_offset % PAGE_SIZE))
+      rtld_fatal("misaligned segment", path);
+
+    if (ph[i].p_flags & PF_R)
+      prot |= PROT_READ;
+    if (ph[i].p_flags & PF_W)
+      prot |= PROT_WRITE;
+    if (ph[i].p_flags & PF_X)
+      prot |= PROT_EXEC;
+
+    va       = obj->base + TRUNC_PAGE(ph[i].p_vaddr);
+    file_end = obj->base + ph[i].p_vaddr + ph[i].p_filesz;
+    mem_end  = obj->base + ph[i].p_vaddr + ph[i].p_memsz;
+
+    // The pages from the file. Read-only ones stay shared with the page cache.
+    if ((ph[i].p_filesz > 0) &&
+        (rtld_mmap(va, file_end - va, prot, MAP_PRIVATE, fd,
+                   TRUNC_PAGE(ph[i].p_offset)) != (void *) va))
+      rtld_fatal("cannot map segment", path);
+
+    // The start of .bss shares the last page with the file data
+    if ((prot & PROT_WRITE) && (mem_end > file_end) && (ph[i].p_filesz > 0))
+      rtld_memzero((void *) file_end,
+                   (ROUND_PAGE(file_end) < mem_end ? ROUND_PAGE(file_end)
+                                                   : mem_end) - file_end);
+
+    // The rest of .bss
+    va = (ph[i].p_filesz > 0) ? ROUND_PAGE(file_end) : va;
+    if ((ROUND_PAGE(mem_end) > va) &&
+        (rtld_mmap(va, ROUND_PAGE(mem_end) - va, prot,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) != (void *) va))
+      rtld_fatal("cannot map segment", path);
+  }
+
+  __syscall_r(__SYS_CLOSE, fd, 0, 0, 0, 0, 0);
+
+  if (obj->dynamic == NULL)
+    rtld_fatal("not a dynamic object", path);
+
+  rtld_object_init(obj);
+}
+
+// Find a library by its DT_NEEDED name and map it
+static void
+rtld_load(const char *name)
+{
+  struct RtldObject *obj;
+  const char *p;
+  unsigned i;
+
+  for (i = 0; i < rtld_nobjs; i++)
+    if ((rtld_objs[i].name != NULL) &&
+        (rtld_strcmp(rtld_objs[i].name, name) == 0))
+      return;
+
+  if (rtld_nobjs == RTLD_OBJS_MAX)
+    rtld_fatal("too many libraries", name);
+
+  obj = &rtld_objs[rtld_nobjs];
+  obj->name = name;
+
+  for (p = name; (*p != '\0') && (*p != '/'); p++)
+    ;
+
+  if (*p == '/') {
+    rtld_map(obj, name);
+  } else {
+    size_t dir_len, name_len = rtld_strlen(name);
+
+    for (i = 0; i < sizeof(rtld_dirs) / sizeof(rtld_dirs[0]); i++) {
+      int fd;
+
+      dir_len = rtld_strlen(rtld_dirs[i]);
+      if (dir_len + name_len >= sizeof(rtld_path))
+        continue;
+
+      rtld_memcpy(rtld_path, rtld_dirs[i], dir_len);
+      rtld_memcpy(rtld_path + dir_len, name, name_len + 1);
+
+      if ((fd = __syscall_r(__SYS_OPEN, (uintptr_t) rtld_path, O_RDONLY,
+                            0, 0, 0, 0)) < 0)
+        continue;
+      __syscall_r(__SYS_CLOSE, fd, 0, 0, 0, 0, 0);
+      break;
+    }
+
+    if (i == sizeof(rtld_dirs) / sizeof(rtld_dirs[0]))
+      rtld_fatal("library not found", name);
+
+    rtld_map(obj, rtld_path);
+  }
+
+  rtld_nobjs++;
+}
+
+// Load the libraries needed by each object, breadth first
+static void
+rtld_load_needed(void)
+{
+  unsigned i;
+
+  for (i = 0; i < rtld_nobjs; i++) {
+    struct RtldObject *obj = &rtld_objs[i];
+    const Elf32_Dyn *d;
+
+    for (d = obj->dynamic; d->d_tag != DT_NULL; d++)
+      if (d->d_tag == DT_NEEDED)
+        rtld_load(obj->strtab + d->d_un.d_val);
+  }
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Symbols and relocations
+ * ----------------------------------------------------------------------------
+ */
+
+static unsigned long
+rtld_hash(const char *name)
+{
+  unsigned long h = 0, g;
+
+  while (*name != '\0') {
+    h = (h << 4) + (unsigned char) *name++;
+    if ((g = h & 0xF0000000) != 0)
+      h ^= g >> 24;
+    h &= ~g;
+  }
+
+  return h;
+}
+
+// Look up a defined global symbol in one object
+static const Elf32_Sym *
+rtld_lookup_in(const struct RtldObject *obj, const char *name,
+               unsigned long h)
+{
+  const Elf32_Word *bucket, *chain;
+  Elf32_Word nbucket, i;
+
+  if (obj->hash == NULL)
+    return NULL;
+
+  nbucket = obj->hash[0];
+  bucket  = &obj->hash[2];
+  chain   = &bucket[nbucket];
+
+  for (i = bucket[h % nbucket]; i != 0; i = chain[i]) {
+    const Elf32_Sym *sym = &obj->symtab[i];
+    unsigned bind = ELF32_ST_BIND(sym->st_info);
+
+    if ((sym->st_shndx == SHN_UNDEF) ||
+        ((bind != STB_GLOBAL) && (bind != STB_WEAK)))
+      continue;
+
+    if (rtld_strcmp(obj->strtab + sym->st_name, name) == 0)
+      return sym;
+  }
+
+  return NULL;
+}
+
+// Find the address of the symbol referenced by a relocation, searching the
+// objects starting with the given one
+static uintptr_t
+rtld_resolve(const struct RtldObject *obj, Elf32_Word sym_index,
+             unsigned first, const Elf32_Sym **sym_store)
+{
+  const Elf32_Sym *ref = &obj->symtab[sym_index];
+  const char *name = obj->strtab + ref->st_name;
+  unsigned long h;
+  unsigned i;
+
+  if (ELF32_ST_BIND(ref->st_info) == STB_LOCAL) {
+    *sym_store = ref;
+    return obj->base + ref->st_value;
+  }
+
+  h = rtld_hash(name);
+
+  for (i = first; i < rtld_nobjs; i++) {
+    const Elf32_Sym *sym;
+
+    if ((sym = rtld_lookup_in(&rtld_objs[i], name, h)) != NULL) {
+      *sym_store = sym;
+      return rtld_objs[i].base + sym->st_value;
+    }
+  }
+
+  if (ELF32_ST_BIND(ref->st_info) != STB_WEAK)
+    rtld_fatal("undefined symbol", name);
+
+  // Unresolved weak references are null
+  *sym_store = NULL;
+  return 0;
+}
+
+static void
+rtld_relocate_table(const struct RtldObject *obj, uintptr_t addr, size_t size)
+{
+  const Elf32_Rel *rel = (const Elf32_Rel *) (obj->base + addr);
+  const Elf32_Rel *end = (const Elf32_Rel *) (obj->base + addr + size);
+
+  for ( ; rel < end; rel++) {
+    uintptr_t *where = (uintptr_t *) (obj->base + rel->r_offset);
+    Elf32_Word sym_index = ELF32_R_SYM(rel->r_info);
+    const Elf32_Sym *sym;
+    uintptr_t value;
+
+    switch (ELF32_R_TYPE(rel->r_info)) {
+    case R_ARM_NONE:
+      break;
+    case R_ARM_RELATIVE:
+      *where += obj->base;
+      break;
+    case R_ARM_ABS32:
+      *where += rtld_resolve(obj, sym_index, 0, &sym);
+      break;
+    case R_ARM_GLOB_DAT:
+    case R_ARM_JUMP_SLOT:
+      *where = rtld_resolve(obj, sym_index, 0, &sym);
+      break;
+    case R_ARM_COPY:
+      // Take the initial value from the library the program was linked with
+      value = rtld_resolve(obj, sym_index, 1, &sym);
+      if (sym != NULL)
+        rtld_memcpy(where, (const void *) value, sym->st_size);
+      break;
+    default:
+      rtld_fatal("unsupported relocation type", obj->name);
+    }
+  }
+}
+
+static void
+rtld_relocate(const struct RtldObject *obj)
+{
+  if (obj->dyn[DT_REL] != 0)
+    rtld_relocate_table(obj, obj->dyn[DT_REL], obj->dyn[DT_RELSZ]);
+  if (obj->dyn[DT_JMPREL] != 0)
+    rtld_relocate_table(obj, obj->dyn[DT_JMPREL], obj->dyn[DT_PLTRELSZ]);
+}
+
+// Run the initializers of a library. Those of the program are run by its own
+// startup code (see crt0.c).
+static void
+rtld_init(const struct RtldObject *obj)
+{
+  const rtld_init_t *fn, *end;
+
+  if (obj->dyn[DT_INIT] != 0)
+    ((rtld_init_t) (obj->base + obj->dyn[DT_INIT]))();
+
+  fn  = (const rtld_init_t *) (obj->base + obj->dyn[DT_INIT_ARRAY]);
+  end = (const rtld_init_t *) (obj->base + obj->dyn[DT_INIT_ARRAY] +
+                               obj->dyn[DT_INIT_ARRAYSZ]);
+  if (obj->dyn[DT_INIT_ARRAY] != 0)
+    for ( ; fn < end; fn++)
+      (*fn)();
+}
+
+/**
+ * The loader entry point, called by the kernel with the program arguments.
+ */
+void __attribute__((noreturn))
+_rtld_start(int argc, char **argv, char **envp)
+{
+  const Elf32_Phdr *phdr = NULL;
+  uintptr_t *auxv, base = 0, entry = 0, phnum = 0;
+  unsigned i;
+
+  // The auxiliary vector follows the environment
+  for (auxv = (uintptr_t *) envp; *auxv != 0; auxv++)
+    ;
+  for (auxv++; auxv[0] != AT_NULL; auxv += 2) {
+    switch (auxv[0]) {
+    case AT_BASE:
+      base = auxv[1];
+      break;
+    case AT_ENTRY:
+      entry = auxv[1];
+      break;
+    case AT_PHDR:
+      phdr = (const Elf32_Phdr *) auxv[1];
+      break;
+    case AT_PHNUM:
+      phnum = auxv[1];
+      break;
+    }
+  }
+
+  rtld_relocate_self(base);
+
+  // The program is mapped at its link addresses
+  if (phdr == NULL)
+    rtld_fatal("no program headers", argv[0]);
+
+  for (i = 0; i < phnum; i++)
+    if (phdr[i].p_type == PT_DYNAMIC)
+      rtld_objs[0].dynamic = (const Elf32_Dyn *) phdr[i].p_vaddr;
+
+  if (rtld_objs[0].dynamic == NULL)
+    rtld_fatal("not a dynamic program", argv[0]);
+
+  rtld_object_init(&rtld_objs[0]);
+  rtld_nobjs = 1;
+
+  rtld_load_needed();
+
+  // Libraries come before the objects that depend on them, so that the
+  // program copies the already relocated initial values of their data
+  for (i = rtld_nobjs; i > 0; i--)
+    rtld_relocate(&rtld_objs[i - 1]);
+
+  for (i = rtld_nobjs - 1; i > 0; i--)
+    rtld_init(&rtld_objs[i]);
+
+  ((rtld_entry_t) entry)(argc, argv, envp);
+
+  for (;;)
+    ;
+}
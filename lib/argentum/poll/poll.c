@@ -1,13 +1,8 @@
-#include <stdio.h>
 #include <poll.h>
+#include <sys/syscall.h>
 
 int
 poll(struct pollfd fds[], nfds_t nfds, int timeout)
 {
-  (void) fds;
-  (void) nfds;
-  (void) timeout;
-
-  fprintf(stderr, "TODO: poll\n");
-  return -1;
+  return __syscall3(__SYS_POLL, fds, nfds, timeout);
 }
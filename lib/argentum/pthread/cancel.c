@@ -0,0 +1,72 @@
+#include <errno.h>
+
+#include "pthread_private.h"
+
+/*
+ * Threads cannot be cancelled, so the cancellation state only matters to the
+ * callers (newlib stdio among them) that save and restore it. The cleanup
+ * handlers still run when a thread calls pthread_exit().
+ */
+
+int
+pthread_setcancelstate(int state, int *oldstate)
+{
+  if ((state != PTHREAD_CANCEL_ENABLE) && (state != PTHREAD_CANCEL_DISABLE))
+    return EINVAL;
+
+  if (oldstate != NULL)
+    *oldstate = PTHREAD_CANCEL_ENABLE;
+  return 0;
+}
+
+int
+pthread_setcanceltype(int type, int *oldtype)
+{
+  if ((type != PTHREAD_CANCEL_DEFERRED) &&
+      (type != PTHREAD_CANCEL_ASYNCHRONOUS))
+    return EINVAL;
+
+  if (oldtype != NULL)
+    *oldtype = PTHREAD_CANCEL_DEFERRED;
+  return 0;
+}
+
+void
+pthread_testcancel(void)
+{
+}
+
+void
+_pthread_cleanup_push(struct _pthread_cleanup_context *context,
+                      void (*routine)(void *), void *arg)
+{
+  struct __pthread *self = __pthread_self();
+
+  context->_routine  = routine;
+  context->_arg      = arg;
+  context->_previous = self->cleanup;
+
+  self->cleanup = context;
+}
+
+void
+_pthread_cleanup_pop(struct _pthread_cleanup_context *context, int execute)
+{
+  struct __pthread *self = __pthread_self();
+
+  self->cleanup = context->_previous;
+
+  if (execute)
+    context->_routine(context->_arg);
+}
+
+void
+__pthread_cleanup_run(struct __pthread *self)
+{
+  struct _pthread_cleanup_context *context;
+
+  while ((context = self->cleanup) != NULL) {
+    self->cleanup = context->_previous;
+    context->_routine(context->_arg);
+  }
+}
@@ -0,0 +1,97 @@
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include "pthread_private.h"
+
+// A condition variable is a sequence number, bumped by every signal. Waiters
+// sleep while the number stays the same as it was when they released the
+// mutex, so a signal sent in between cannot be missed.
+
+int
+pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+  if ((attr != NULL) && !attr->is_initialized)
+    return EINVAL;
+
+  *cond = _PTHREAD_COND_INITIALIZER;
+  return 0;
+}
+
+int
+pthread_cond_destroy(pthread_cond_t *cond)
+{
+  (void) cond;
+  return 0;
+}
+
+static int
+__pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                    const struct timespec *timeout)
+{
+  pthread_cond_t seq = __atomic_load_n(cond, __ATOMIC_RELAXED);
+  int r;
+
+  pthread_mutex_unlock(mutex);
+
+  // Interrupted sleeps count as spurious wakeups
+  r = __futex_wait(cond, (int) seq, timeout);
+
+  pthread_mutex_lock(mutex);
+
+  return r == -ETIMEDOUT ? ETIMEDOUT : 0;
+}
+
+int
+pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+  return __pthread_cond_wait(cond, mutex, NULL);
+}
+
+int
+pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                       const struct timespec *abstime)
+{
+  struct timespec timeout;
+
+  if ((abstime->tv_nsec < 0) || (abstime->tv_nsec >= 1000000000L))
+    return EINVAL;
+
+  if (__pthread_timeout(abstime, &timeout) != 0)
+    return ETIMEDOUT;
+
+  return __pthread_cond_wait(cond, mutex, &timeout);
+}
+
+int
+pthread_cond_signal(pthread_cond_t *cond)
+{
+  __atomic_add_fetch(cond, 1, __ATOMIC_RELEASE);
+  __futex_wake(cond, 1);
+  return 0;
+}
+
+int
+pthread_cond_broadcast(pthread_cond_t *cond)
+{
+  __atomic_add_fetch(cond, 1, __ATOMIC_RELEASE);
+  __futex_wake(cond, INT_MAX);
+  return 0;
+}
+
+int
+pthread_condattr_init(pthread_condattr_t *attr)
+{
+  memset(attr, 0, sizeof(*attr));
+  attr->is_initialized = 1;
+  return 0;
+}
+
+int
+pthread_condattr_destroy(pthread_condattr_t *attr)
+{
+  if (!attr->is_initialized)
+    return EINVAL;
+  attr->is_initialized = 0;
+  return 0;
+}
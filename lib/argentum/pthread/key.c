@@ -0,0 +1,94 @@
+#include <errno.h>
+
+#include "pthread_private.h"
+
+static struct {
+  int    used;
+  void (*destructor)(void *);
+} __pthread_keys[PTHREAD_KEYS_MAX];
+
+static pthread_mutex_t __pthread_keys_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int
+pthread_key_create(pthread_key_t *key, void (*destructor)(void *))
+{
+  pthread_key_t i;
+
+  pthread_mutex_lock(&__pthread_keys_mutex);
+
+  for (i = 0; i < PTHREAD_KEYS_MAX; i++) {
+    if (!__pthread_keys[i].used) {
+      __pthread_keys[i].used       = 1;
+      __pthread_keys[i].destructor = destructor;
+
+      pthread_mutex_unlock(&__pthread_keys_mutex);
+
+      *key = i;
+      return 0;
+    }
+  }
+
+  pthread_mutex_unlock(&__pthread_keys_mutex);
+
+  return EAGAIN;
+}
+
+int
+pthread_key_delete(pthread_key_t key)
+{
+  if ((key >= PTHREAD_KEYS_MAX) || !__pthread_keys[key].used)
+    return EINVAL;
+
+  pthread_mutex_lock(&__pthread_keys_mutex);
+  __pthread_keys[key].used       = 0;
+  __pthread_keys[key].destructor = NULL;
+  pthread_mutex_unlock(&__pthread_keys_mutex);
+
+  return 0;
+}
+
+void *
+pthread_getspecific(pthread_key_t key)
+{
+  if (key >= PTHREAD_KEYS_MAX)
+    return NULL;
+  return (void *) __pthread_self()->specific[key];
+}
+
+int
+pthread_setspecific(pthread_key_t key, const void *value)
+{
+  if ((key >= PTHREAD_KEYS_MAX) || !__pthread_keys[key].used)
+    return EINVAL;
+  __pthread_self()->specific[key] = value;
+  return 0;
+}
+
+/**
+ * Run the destructors for the non-NULL values of the exiting thread.
+ */
+void
+__pthread_key_destroy_specific(struct __pthread *self)
+{
+  int i, again;
+  pthread_key_t key;
+
+  for (i = 0; i < PTHREAD_DESTRUCTOR_ITERATIONS; i++) {
+    again = 0;
+
+    for (key = 0; key < PTHREAD_KEYS_MAX; key++) {
+      void (*destructor)(void *) = __pthread_keys[key].destructor;
+      void *value = (void *) self->specific[key];
+
+      if ((value == NULL) || (destructor == NULL))
+        continue;
+
+      self->specific[key] = NULL;
+      destructor(value);
+      again = 1;
+    }
+
+    if (!again)
+      break;
+  }
+}
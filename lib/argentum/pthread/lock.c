@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <sys/lock.h>
+
+#include "pthread_private.h"
+
+/*
+ * Locks used internally by newlib (stdio streams, atexit, the environment and
+ * so on). Zero means unlocked, so the static locks need no initialization.
+ * Taking a free lock is a single atomic operation; only a thread that finds
+ * the lock held enters the kernel, and only an unlock that may have waiters to
+ * wake up does the same.
+ */
+
+enum {
+  LOCK_UNLOCKED,
+  LOCK_LOCKED,
+  LOCK_CONTENDED,
+};
+
+struct __lock {
+  /** The futex word */
+  int               state;
+  /** The holder of a recursive lock */
+  struct __pthread *owner;
+  /** How many times the holder has acquired a recursive lock */
+  unsigned          count;
+};
+
+struct __lock __lock___sinit_recursive_mutex;
+struct __lock __lock___sfp_recursive_mutex;
+struct __lock __lock___atexit_recursive_mutex;
+struct __lock __lock___at_quick_exit_mutex;
+struct __lock __lock___malloc_recursive_mutex;
+struct __lock __lock___env_recursive_mutex;
+struct __lock __lock___tz_mutex;
+struct __lock __lock___dd_hash_mutex;
+struct __lock __lock___arc4random_mutex;
+
+static int
+lock_try(struct __lock *lock)
+{
+  int state = LOCK_UNLOCKED;
+
+  return __atomic_compare_exchange_n(&lock->state, &state, LOCK_LOCKED, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void
+lock_acquire(struct __lock *lock)
+{
+  if (lock_try(lock))
+    return;
+
+  while (__atomic_exchange_n(&lock->state, LOCK_CONTENDED, __ATOMIC_ACQUIRE)
+         != LOCK_UNLOCKED)
+    __futex_wait(&lock->state, LOCK_CONTENDED, NULL);
+}
+
+static void
+lock_release(struct __lock *lock)
+{
+  if (__atomic_exchange_n(&lock->state, LOCK_UNLOCKED, __ATOMIC_RELEASE) ==
+      LOCK_CONTENDED)
+    __futex_wake(&lock->state, 1);
+}
+
+// Dynamically allocated locks are NULL if the allocation failed, and then
+// quietly do nothing
+
+void
+__retarget_lock_init(_LOCK_T *lock)
+{
+  *lock = (struct __lock *) calloc(1, sizeof(struct __lock));
+}
+
+void
+__retarget_lock_init_recursive(_LOCK_T *lock)
+{
+  __retarget_lock_init(lock);
+}
+
+void
+__retarget_lock_close(_LOCK_T lock)
+{
+  free(lock);
+}
+
+void
+__retarget_lock_close_recursive(_LOCK_T lock)
+{
+  free(lock);
+}
+
+void
+__retarget_lock_acquire(_LOCK_T lock)
+{
+  if (lock != NULL)
+    lock_acquire(lock);
+}
+
+int
+__retarget_lock_try_acquire(_LOCK_T lock)
+{
+  return (lock == NULL) || lock_try(lock);
+}
+
+void
+__retarget_lock_release(_LOCK_T lock)
+{
+  if (lock != NULL)
+    lock_release(lock);
+}
+
+void
+__retarget_lock_acquire_recursive(_LOCK_T lock)
+{
+  struct __pthread *self = __pthread_self();
+
+  if (lock == NULL)
+    return;
+
+  // Only the holder can see itself as the owner, so no atomics are needed
+  if (lock->owner != self) {
+    lock_acquire(lock);
+    lock->owner = self;
+  }
+  lock->count++;
+}
+
+int
+__retarget_lock_try_acquire_recursive(_LOCK_T lock)
+{
+  struct __pthread *self = __pthread_self();
+
+  if (lock == NULL)
+    return 1;
+
+  if (lock->owner != self) {
+    if (!lock_try(lock))
+      return 0;
+    lock->owner = self;
+  }
+  lock->count++;
+
+  return 1;
+}
+
+void
+__retarget_lock_release_recursive(_LOCK_T lock)
+{
+  if (lock == NULL)
+    return;
+
+  if (--lock->count == 0) {
+    lock->owner = NULL;
+    lock_release(lock);
+  }
+}
@@ -0,0 +1,86 @@
+#include <errno.h>
+#include <string.h>
+
+#include "pthread_private.h"
+
+// Mutex states. The initializer value means unlocked, so statically
+// initialized mutexes need no extra setup. A waiter marks the mutex contended,
+// so that only the unlocks that may have someone to wake up enter the kernel.
+#define MUTEX_UNLOCKED    _PTHREAD_MUTEX_INITIALIZER
+#define MUTEX_LOCKED      ((pthread_mutex_t) 0)
+#define MUTEX_CONTENDED   ((pthread_mutex_t) 1)
+
+int
+pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
+{
+  if ((attr != NULL) && !attr->is_initialized)
+    return EINVAL;
+
+  *mutex = MUTEX_UNLOCKED;
+  return 0;
+}
+
+int
+pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+  return *mutex == MUTEX_UNLOCKED ? 0 : EBUSY;
+}
+
+int
+pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+  pthread_mutex_t state = MUTEX_UNLOCKED;
+
+  if (__atomic_compare_exchange_n(mutex, &state, MUTEX_LOCKED, 0,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return 0;
+
+  if (state != MUTEX_CONTENDED)
+    state = __atomic_exchange_n(mutex, MUTEX_CONTENDED, __ATOMIC_ACQUIRE);
+
+  while (state != MUTEX_UNLOCKED) {
+    __futex_wait(mutex, (int) MUTEX_CONTENDED, NULL);
+    state = __atomic_exchange_n(mutex, MUTEX_CONTENDED, __ATOMIC_ACQUIRE);
+  }
+
+  return 0;
+}
+
+int
+pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+  pthread_mutex_t state = MUTEX_UNLOCKED;
+
+  if (__atomic_compare_exchange_n(mutex, &state, MUTEX_LOCKED, 0,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return 0;
+
+  return EBUSY;
+}
+
+int
+pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+  if (__atomic_exchange_n(mutex, MUTEX_UNLOCKED, __ATOMIC_RELEASE) ==
+      MUTEX_CONTENDED)
+    __futex_wake(mutex, 1);
+
+  return 0;
+}
+
+int
+pthread_mutexattr_init(pthread_mutexattr_t *attr)
+{
+  memset(attr, 0, sizeof(*attr));
+  attr->is_initialized = 1;
+  return 0;
+}
+
+int
+pthread_mutexattr_destroy(pthread_mutexattr_t *attr)
+{
+  if (!attr->is_initialized)
+    return EINVAL;
+  attr->is_initialized = 0;
+  return 0;
+}
@@ -0,0 +1,35 @@
+#include <limits.h>
+
+#include "pthread_private.h"
+
+enum {
+  ONCE_NOT_RUN,
+  ONCE_RUNNING,
+  ONCE_DONE,
+};
+
+int
+pthread_once(pthread_once_t *once, void (*init)(void))
+{
+  int state = ONCE_NOT_RUN;
+
+  if (__atomic_load_n(&once->init_executed, __ATOMIC_ACQUIRE) == ONCE_DONE)
+    return 0;
+
+  if (__atomic_compare_exchange_n(&once->init_executed, &state, ONCE_RUNNING,
+                                  0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    init();
+
+    __atomic_store_n(&once->init_executed, ONCE_DONE, __ATOMIC_RELEASE);
+    __futex_wake(&once->init_executed, INT_MAX);
+    return 0;
+  }
+
+  // Another thread is running the routine, wait for it to finish
+  while (state == ONCE_RUNNING) {
+    __futex_wait(&once->init_executed, ONCE_RUNNING, NULL);
+    state = __atomic_load_n(&once->init_executed, __ATOMIC_ACQUIRE);
+  }
+
+  return 0;
+}
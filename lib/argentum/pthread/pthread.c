@@ -0,0 +1,295 @@
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pthread_private.h"
+
+#define PAGE_SIZE   4096
+
+/** Descriptor of the initial thread (its stack belongs to the process) */
+struct __pthread __pthread_main = {
+  .state = __PTHREAD_JOINABLE,
+  .alive = 1,
+};
+
+// Point the thread ID register of the initial thread at its descriptor, so that
+// code reading it with __aeabi_read_tp() gets a valid pointer in every thread
+__attribute__((constructor(101))) static void
+__pthread_init(void)
+{
+  __pthread_main.reent = _impure_ptr;
+  __syscall_r(__SYS_SET_TLS, (uint32_t) &__pthread_main, 0, 0, 0, 0, 0);
+}
+
+/**
+ * Get the reentrancy structure of the calling thread. newlib is built with
+ * __DYNAMIC_REENT__, and <sys/features.h> maps __getreent() to this function,
+ * so errno and the other per-thread state of the C library are reached with a
+ * single read of the thread ID register. The initial thread keeps using the
+ * global structure, also before the constructor above has run.
+ */
+struct _reent *
+__pthread_getreent(void)
+{
+  struct _reent *reent = __pthread_self()->reent;
+
+  return (reent != NULL) ? reent : _impure_ptr;
+}
+
+// Detached threads that have exited, their memory is freed by the next
+// pthread_create() once the kernel reports they have left their stacks
+static struct __pthread *__pthread_zombies;
+
+static void
+__pthread_reap(void)
+{
+  struct __pthread *t, *next;
+
+  t = __atomic_exchange_n(&__pthread_zombies, NULL, __ATOMIC_ACQUIRE);
+
+  for ( ; t != NULL; t = next) {
+    next = t->next;
+
+    if (__atomic_load_n(&t->alive, __ATOMIC_ACQUIRE) == 0) {
+      munmap(t->map, t->map_size);
+      continue;
+    }
+
+    // Still on its way out, try again later
+    t->next = __atomic_load_n(&__pthread_zombies, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&__pthread_zombies, &t->next, t, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+}
+
+static void
+__pthread_start(struct __pthread *self)
+{
+  pthread_exit(self->start(self->arg));
+}
+
+int
+pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+               void *(*start)(void *), void *arg)
+{
+  struct __pthread *t;
+  struct _reent *reent;
+  size_t stack_size, map_size;
+  void *map;
+  int r, state;
+
+  stack_size = __PTHREAD_STACK_DEFAULT;
+  state      = __PTHREAD_JOINABLE;
+
+  if (attr != NULL) {
+    if (!attr->is_initialized)
+      return EINVAL;
+    if (attr->stacksize != 0)
+      stack_size = attr->stacksize;
+    if (attr->detachstate == PTHREAD_CREATE_DETACHED)
+      state = __PTHREAD_DETACHED;
+  }
+
+  __pthread_reap();
+
+  map_size = (stack_size + sizeof(*t) + sizeof(*reent) + PAGE_SIZE - 1) &
+             ~(PAGE_SIZE - 1);
+  map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    return EAGAIN;
+
+  t = (struct __pthread *) ((char *) map + map_size - sizeof(*t));
+  memset(t, 0, sizeof(*t));
+
+  // The reentrancy structure goes right below the descriptor
+  reent = (struct _reent *) (((uintptr_t) t - sizeof(*reent)) & ~7U);
+  _REENT_INIT_PTR(reent);
+
+  t->start    = start;
+  t->arg      = arg;
+  t->state    = state;
+  t->alive    = 1;
+  t->map      = map;
+  t->map_size = map_size;
+  t->reent    = reent;
+
+  // The stack grows down from the reentrancy structure, which is 8-byte
+  // aligned
+  r = __syscall_r(__SYS_CLONE, (uint32_t) __pthread_start,
+                  (uint32_t) reent, (uint32_t) t, (uint32_t) t, 0, 0);
+  if (r < 0) {
+    munmap(map, map_size);
+    return -r;
+  }
+
+  *thread = (pthread_t) t;
+
+  return 0;
+}
+
+void
+pthread_exit(void *value)
+{
+  struct __pthread *self = __pthread_self();
+  int state = __PTHREAD_JOINABLE;
+
+  __pthread_cleanup_run(self);
+  __pthread_key_destroy_specific(self);
+
+  // Free what the C library has allocated for the thread
+  if (self != &__pthread_main)
+    _reclaim_reent(self->reent);
+
+  self->result = value;
+
+  // Nobody is going to join a detached thread, so queue it to be freed
+  if (!__atomic_compare_exchange_n(&self->state, &state, __PTHREAD_EXITING, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+      (self != &__pthread_main)) {
+    self->next = __atomic_load_n(&__pthread_zombies, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&__pthread_zombies, &self->next, self,
+                                        0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+
+  // The kernel clears the alive flag and wakes up the joining thread. If this
+  // is the last thread, the process exits with status 0.
+  for (;;)
+    __syscall_r(__SYS_THREAD_EXIT, (uint32_t) &self->alive, 0, 0, 0, 0, 0);
+}
+
+int
+pthread_join(pthread_t thread, void **value)
+{
+  struct __pthread *t = (struct __pthread *) thread;
+  int alive;
+
+  if (t == __pthread_self())
+    return EDEADLK;
+  if (__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) == __PTHREAD_DETACHED)
+    return EINVAL;
+
+  while ((alive = __atomic_load_n(&t->alive, __ATOMIC_ACQUIRE)) != 0)
+    __futex_wait(&t->alive, alive, NULL);
+
+  if (value != NULL)
+    *value = t->result;
+
+  if (t != &__pthread_main)
+    munmap(t->map, t->map_size);
+
+  return 0;
+}
+
+int
+pthread_detach(pthread_t thread)
+{
+  struct __pthread *t = (struct __pthread *) thread;
+  int state = __PTHREAD_JOINABLE;
+
+  if (__atomic_compare_exchange_n(&t->state, &state, __PTHREAD_DETACHED, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return 0;
+
+  if (state == __PTHREAD_DETACHED)
+    return EINVAL;
+
+  // Already exiting, so the thread is not going to free itself
+  return pthread_join(thread, NULL);
+}
+
+pthread_t
+pthread_self(void)
+{
+  return (pthread_t) __pthread_self();
+}
+
+int
+pthread_equal(pthread_t t1, pthread_t t2)
+{
+  return t1 == t2;
+}
+
+int
+pthread_attr_init(pthread_attr_t *attr)
+{
+  memset(attr, 0, sizeof(*attr));
+  attr->is_initialized = 1;
+  attr->stacksize      = __PTHREAD_STACK_DEFAULT;
+  attr->detachstate    = PTHREAD_CREATE_JOINABLE;
+  return 0;
+}
+
+int
+pthread_attr_destroy(pthread_attr_t *attr)
+{
+  if (!attr->is_initialized)
+    return EINVAL;
+  attr->is_initialized = 0;
+  return 0;
+}
+
+int
+pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize)
+{
+  if (!attr->is_initialized)
+    return EINVAL;
+  *stacksize = attr->stacksize;
+  return 0;
+}
+
+int
+pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize)
+{
+  if (!attr->is_initialized || (stacksize < PTHREAD_STACK_MIN) ||
+      (stacksize > INT_MAX))
+    return EINVAL;
+  attr->stacksize = stacksize;
+  return 0;
+}
+
+int
+pthread_attr_getdetachstate(const pthread_attr_t *attr, int *detachstate)
+{
+  if (!attr->is_initialized)
+    return EINVAL;
+  *detachstate = attr->detachstate;
+  return 0;
+}
+
+int
+pthread_attr_setdetachstate(pthread_attr_t *attr, int detachstate)
+{
+  if (!attr->is_initialized ||
+      ((detachstate != PTHREAD_CREATE_JOINABLE) &&
+       (detachstate != PTHREAD_CREATE_DETACHED)))
+    return EINVAL;
+  attr->detachstate = detachstate;
+  return 0;
+}
+
+/**
+ * Convert an absolute CLOCK_REALTIME timeout into the relative one expected by
+ * the futex system call.
+ *
+ * @return 0 on success, ETIMEDOUT if the time has already passed.
+ */
+int
+__pthread_timeout(const struct timespec *abstime, struct timespec *rel)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  rel->tv_sec  = abstime->tv_sec - now.tv_sec;
+  rel->tv_nsec = abstime->tv_nsec - now.tv_nsec;
+  if (rel->tv_nsec < 0) {
+    rel->tv_sec--;
+    rel->tv_nsec += 1000000000L;
+  }
+
+  return rel->tv_sec < 0 ? ETIMEDOUT : 0;
+}
@@ -0,0 +1,83 @@
+#ifndef _PTHREAD_PRIVATE_H
+#define _PTHREAD_PRIVATE_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/reent.h>
+#include <sys/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+/** Default stack size of a new thread */
+#define __PTHREAD_STACK_DEFAULT   (64 * 1024)
+
+enum {
+  __PTHREAD_JOINABLE,
+  __PTHREAD_DETACHED,
+  __PTHREAD_EXITING,
+};
+
+/**
+ * Thread descriptor. Placed at the top of the memory region holding the
+ * thread stack, so both are freed at once.
+ */
+struct __pthread {
+  /** Link into the list of exited detached threads */
+  struct __pthread *next;
+  /** The start routine and its argument */
+  void           *(*start)(void *);
+  void             *arg;
+  /** The exit status */
+  void             *result;
+  /** Joinable, detached or exiting */
+  int               state;
+  /** Cleared by the kernel once the thread no longer uses its stack */
+  int               alive;
+  /** The region of memory containing the descriptor and the stack */
+  void             *map;
+  size_t            map_size;
+  /** The innermost cleanup handler pushed with pthread_cleanup_push() */
+  struct _pthread_cleanup_context *cleanup;
+  /** Thread-specific data values */
+  const void       *specific[PTHREAD_KEYS_MAX];
+  /** The newlib state of the thread (errno and others), see __getreent() */
+  struct _reent    *reent;
+};
+
+extern struct __pthread __pthread_main;
+
+void __pthread_key_destroy_specific(struct __pthread *);
+void __pthread_cleanup_run(struct __pthread *);
+
+/**
+ * Get the descriptor of the calling thread. The kernel makes it available via
+ * the read-only thread ID register. For the initial thread, the register is 0
+ * until the library constructor in pthread.c sets it.
+ */
+static inline struct __pthread *
+__pthread_self(void)
+{
+  struct __pthread *self;
+
+  asm volatile("mrc p15, 0, %0, c13, c0, 3" : "=r" (self));
+
+  return self != NULL ? self : &__pthread_main;
+}
+
+static inline int
+__futex_wait(volatile void *addr, int val, const struct timespec *timeout)
+{
+  return __syscall_r(__SYS_FUTEX, (uint32_t) addr, FUTEX_WAIT, val,
+                     (uint32_t) timeout, 0, 0);
+}
+
+static inline int
+__futex_wake(volatile void *addr, int n)
+{
+  return __syscall_r(__SYS_FUTEX, (uint32_t) addr, FUTEX_WAKE, n, 0, 0, 0);
+}
+
+int __pthread_timeout(const struct timespec *, struct timespec *);
+
+#endif  // !_PTHREAD_PRIVATE_H
@@ -0,0 +1,19 @@
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+
+int
+sched_get_priority_max(int policy)
+{
+  switch (policy) {
+  case SCHED_OTHER:
+    return 0;
+  case SCHED_FIFO:
+  case SCHED_RR:
+    // The real-time priorities sit between the kernel and the normal threads
+    return NZERO - 1;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+}
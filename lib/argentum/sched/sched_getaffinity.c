@@ -0,0 +1,18 @@
+#include <string.h>
+#include <sys/cpuset.h>
+#include <sys/syscall.h>
+
+int
+sched_getaffinity(pid_t pid, size_t size, cpu_set_t *set)
+{
+  int r;
+
+  // The kernel only stores the bits of the CPUs it supports
+  if ((r = __syscall3(__SYS_SCHED_GETAFFINITY, pid, size, set)) < 0)
+    return r;
+
+  if ((size_t) r < size)
+    memset((char *) set + r, 0, size - r);
+
+  return 0;
+}
@@ -0,0 +1,8 @@
+#include <sched.h>
+#include <sys/syscall.h>
+
+int
+sched_getparam(pid_t pid, struct sched_param *param)
+{
+  return __syscall2(__SYS_SCHED_GETPARAM, pid, param);
+}
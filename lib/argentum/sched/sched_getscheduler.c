@@ -0,0 +1,8 @@
+#include <sched.h>
+#include <sys/syscall.h>
+
+int
+sched_getscheduler(pid_t pid)
+{
+  return __syscall1(__SYS_SCHED_GETSCHEDULER, pid);
+}
@@ -0,0 +1,8 @@
+#include <sched.h>
+#include <sys/syscall.h>
+
+int
+sched_rr_get_interval(pid_t pid, struct timespec *interval)
+{
+  return __syscall2(__SYS_SCHED_RR_GET_INTERVAL, pid, interval);
+}
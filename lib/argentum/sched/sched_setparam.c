@@ -0,0 +1,9 @@
+#include <sched.h>
+#include <sys/syscall.h>
+
+int
+sched_setparam(pid_t pid, const struct sched_param *param)
+{
+  // A negative policy keeps the current one
+  return __syscall3(__SYS_SCHED_SETSCHEDULER, pid, -1, param);
+}
@@ -0,0 +1,8 @@
+#include <sched.h>
+#include <sys/syscall.h>
+
+int
+sched_yield(void)
+{
+  return __syscall0(__SYS_SCHED_YIELD);
+}
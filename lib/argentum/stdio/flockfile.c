@@ -1,9 +1,8 @@
 #include <stdio.h>
+#include <sys/lock.h>
 
 void
 flockfile(FILE *file)
 {
-  (void) file;
-  fprintf(stderr, "TODO: flockfile\n");
-  return -1;
+  __lock_acquire_recursive(file->_lock);
 }
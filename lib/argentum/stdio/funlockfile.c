@@ -1,9 +1,8 @@
 #include <stdio.h>
+#include <sys/lock.h>
 
 void
 funlockfile(FILE *file)
 {
-  (void) file;
-  fprintf(stderr, "TODO: funlockfile\n");
-  return -1;
+  __lock_release_recursive(file->_lock);
 }
@@ -577,8 +577,20 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #endif  /* WIN32 */
 
 #if defined(__ARGENTUM__)
+/* There is no brk heap: all memory comes from anonymous mmap(), which
+   is demand-paged, and goes back to the kernel with munmap() */
 #define HAVE_MORECORE 0
 #define HAVE_MMAP 1
+#define HAVE_MREMAP 0
+/* Large chunks get their own mappings and are unmapped as soon as freed */
+#define DEFAULT_MMAP_THRESHOLD ((size_t)128U * (size_t)1024U)
+/* Give back the free top of a segment once it exceeds this */
+#define DEFAULT_TRIM_THRESHOLD ((size_t)256U * (size_t)1024U)
+/* Look for entirely free segments to unmap more often than every 4095 frees */
+#define MAX_RELEASE_CHECK_RATE 255
+/* Futex-based pthread mutexes: no system call unless contended */
+#define USE_LOCKS 1
+#define USE_SPIN_LOCKS 0
 #endif  /* __ARGENTUM__ */
 
 #if defined(DARWIN) || defined(_DARWIN)
@@ -0,0 +1,8 @@
+#include <sys/channel.h>
+#include <sys/syscall.h>
+
+int
+channel_create(void)
+{
+  return __syscall0(__SYS_CHANNEL_CREATE);
+}
@@ -0,0 +1,8 @@
+#include <sys/channel.h>
+#include <sys/syscall.h>
+
+int
+channel_destroy(int chid)
+{
+  return __syscall1(__SYS_CHANNEL_DESTROY, chid);
+}
@@ -0,0 +1,8 @@
+#include <sys/channel.h>
+#include <sys/syscall.h>
+
+int
+connect_attach(int chid)
+{
+  return __syscall1(__SYS_CONNECT_ATTACH, chid);
+}
@@ -0,0 +1,8 @@
+#include <sys/channel.h>
+#include <sys/syscall.h>
+
+int
+connect_detach(int coid)
+{
+  return __syscall1(__SYS_CONNECT_DETACH, coid);
+}
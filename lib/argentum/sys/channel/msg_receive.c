@@ -0,0 +1,8 @@
+#include <sys/channel.h>
+#include <sys/syscall.h>
+
+int
+msg_receive(int chid, void *msg, size_t bytes, struct msg_info *info)
+{
+  return __syscall4(__SYS_MSG_RECEIVE, chid, msg, bytes, info);
+}
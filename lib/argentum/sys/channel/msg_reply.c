@@ -0,0 +1,8 @@
+#include <sys/channel.h>
+#include <sys/syscall.h>
+
+int
+msg_reply(int rcvid, ssize_t status, const void *msg, size_t bytes)
+{
+  return __syscall4(__SYS_MSG_REPLY, rcvid, status, msg, bytes);
+}
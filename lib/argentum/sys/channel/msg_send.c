@@ -0,0 +1,8 @@
+#include <sys/channel.h>
+#include <sys/syscall.h>
+
+ssize_t
+msg_send(int coid, const void *smsg, size_t sbytes, void *rmsg, size_t rbytes)
+{
+  return __syscall5(__SYS_MSG_SEND, coid, smsg, sbytes, rmsg, rbytes);
+}
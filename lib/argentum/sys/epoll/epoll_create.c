@@ -0,0 +1,14 @@
+#include <errno.h>
+#include <sys/epoll.h>
+
+int
+epoll_create(int size)
+{
+  // The size is only a hint, but must be positive
+  if (size <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return epoll_create1(0);
+}
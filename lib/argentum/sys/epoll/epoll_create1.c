@@ -0,0 +1,8 @@
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+int
+epoll_create1(int flags)
+{
+  return __syscall1(__SYS_EPOLL_CREATE, flags);
+}
@@ -0,0 +1,8 @@
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+int
+epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+  return __syscall4(__SYS_EPOLL_CTL, epfd, op, fd, event);
+}
@@ -0,0 +1,8 @@
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+int
+epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+  return __syscall4(__SYS_EPOLL_WAIT, epfd, events, maxevents, timeout);
+}
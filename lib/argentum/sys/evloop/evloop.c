@@ -0,0 +1,379 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "evloop_private.h"
+
+/**
+ * Create an event loop.
+ *
+ * @return Pointer to the loop, or NULL with errno set.
+ */
+struct evloop *
+evloop_create(void)
+{
+  struct evloop *loop;
+
+  if ((loop = (struct evloop *) calloc(1, sizeof(*loop))) == NULL)
+    return NULL;
+
+  if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    free(loop);
+    return NULL;
+  }
+
+  return loop;
+}
+
+/**
+ * Destroy an event loop. The watchers still registered are forgotten, the
+ * descriptors are left open.
+ */
+void
+evloop_destroy(struct evloop *loop)
+{
+  close(loop->epfd);
+  free(loop->timers);
+  free(loop);
+}
+
+/**
+ * Make evloop_run() return after the callbacks currently being dispatched.
+ */
+void
+evloop_stop(struct evloop *loop)
+{
+  loop->stopped = 1;
+}
+
+/**
+ * Get the current time, in CLOCK_MONOTONIC nanoseconds.
+ */
+uint64_t
+evloop_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Put a descriptor into the non-blocking mode.
+ *
+ * @return 0 on success, or -1 with errno set.
+ */
+int
+evloop_set_nonblock(int fd)
+{
+  int flags;
+
+  if ((flags = fcntl(fd, F_GETFL)) < 0)
+    return -1;
+  if (flags & O_NONBLOCK)
+    return 0;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * I/O watchers
+ * ----------------------------------------------------------------------------
+ */
+
+void
+ev_io_init(struct ev_io *io, int fd, uint32_t events,
+           void (*callback)(struct evloop *, struct ev_io *, uint32_t),
+           void *arg)
+{
+  io->fd       = fd;
+  io->events   = events;
+  io->callback = callback;
+  io->arg      = arg;
+  io->active   = 0;
+}
+
+/**
+ * Start watching the descriptor. Only one watcher may be active for the same
+ * descriptor at a time.
+ *
+ * @return 0 on success, or -1 with errno set.
+ */
+int
+ev_io_start(struct evloop *loop, struct ev_io *io)
+{
+  struct epoll_event event;
+
+  if (io->active) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  event.events   = io->events;
+  event.data.ptr = io;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, io->fd, &event) < 0)
+    return -1;
+
+  io->active = 1;
+  loop->io_count++;
+
+  return 0;
+}
+
+/**
+ * Change the events of interest of an active watcher.
+ *
+ * @return 0 on success, or -1 with errno set.
+ */
+int
+ev_io_modify(struct evloop *loop, struct ev_io *io, uint32_t events)
+{
+  struct epoll_event event;
+
+  if (!io->active) {
+    io->events = events;
+    return 0;
+  }
+
+  event.events   = events;
+  event.data.ptr = io;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, io->fd, &event) < 0)
+    return -1;
+
+  io->events = events;
+
+  return 0;
+}
+
+/**
+ * Stop watching the descriptor. Must be called before the descriptor is
+ * closed or the watcher is freed, also from within a callback.
+ *
+ * @return 0 on success, or -1 with errno set.
+ */
+int
+ev_io_stop(struct evloop *loop, struct ev_io *io)
+{
+  int i;
+
+  if (!io->active)
+    return 0;
+
+  io->active = 0;
+  loop->io_count--;
+
+  // The watcher may have pending events in the batch being dispatched
+  for (i = 0; i < loop->event_count; i++)
+    if (loop->events[i].data.ptr == io)
+      loop->events[i].data.ptr = NULL;
+
+  return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, io->fd, NULL);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Timers
+ * ----------------------------------------------------------------------------
+ */
+
+static void
+ev_timer_place(struct evloop *loop, struct ev_timer *timer, unsigned i)
+{
+  loop->timers[i] = timer;
+  timer->index    = i;
+}
+
+static void
+ev_timer_sift_up(struct evloop *loop, unsigned i)
+{
+  struct ev_timer *timer = loop->timers[i];
+
+  while (i > 0) {
+    unsigned parent = (i - 1) / 2;
+
+    if (loop->timers[parent]->expires <= timer->expires)
+      break;
+    ev_timer_place(loop, loop->timers[parent], i);
+    i = parent;
+  }
+
+  ev_timer_place(loop, timer, i);
+}
+
+static void
+ev_timer_sift_down(struct evloop *loop, unsigned i)
+{
+  struct ev_timer *timer = loop->timers[i];
+
+  for (;;) {
+    unsigned child = 2 * i + 1;
+
+    if (child >= loop->timer_count)
+      break;
+    if ((child + 1 < loop->timer_count) &&
+        (loop->timers[child + 1]->expires < loop->timers[child]->expires))
+      child++;
+    if (timer->expires <= loop->timers[child]->expires)
+      break;
+
+    ev_timer_place(loop, loop->timers[child], i);
+    i = child;
+  }
+
+  ev_timer_place(loop, timer, i);
+}
+
+void
+ev_timer_init(struct ev_timer *timer,
+              void (*callback)(struct evloop *, struct ev_timer *), void *arg)
+{
+  timer->expires  = 0;
+  timer->callback = callback;
+  timer->arg      = arg;
+  timer->index    = -1;
+}
+
+/**
+ * Start the timer, or restart it if already active.
+ *
+ * @param loop  The loop
+ * @param timer The timer
+ * @param ms    The delay in milliseconds, 0 to run the callback on the next
+ *              loop iteration
+ *
+ * @return 0 on success, or -1 with errno set.
+ */
+int
+ev_timer_start(struct evloop *loop, struct ev_timer *timer, unsigned long ms)
+{
+  ev_timer_stop(loop, timer);
+
+  if (loop->timer_count == loop->timer_size) {
+    unsigned size = loop->timer_size ? loop->timer_size * 2 : 16;
+    struct ev_timer **timers;
+
+    timers = (struct ev_timer **) realloc(loop->timers,
+                                          size * sizeof(*timers));
+    if (timers == NULL)
+      return -1;
+
+    loop->timers     = timers;
+    loop->timer_size = size;
+  }
+
+  timer->expires = evloop_now() + (uint64_t) ms * 1000000ULL;
+
+  ev_timer_place(loop, timer, loop->timer_count++);
+  ev_timer_sift_up(loop, timer->index);
+
+  return 0;
+}
+
+/**
+ * Stop the timer, if active.
+ */
+void
+ev_timer_stop(struct evloop *loop, struct ev_timer *timer)
+{
+  struct ev_timer *last;
+  unsigned i;
+
+  if (timer->index < 0)
+    return;
+
+  i = timer->index;
+  timer->index = -1;
+
+  if (i == --loop->timer_count)
+    return;
+
+  // Fill the hole with the last timer and restore the heap order
+  last = loop->timers[loop->timer_count];
+  ev_timer_place(loop, last, i);
+  ev_timer_sift_up(loop, i);
+  ev_timer_sift_down(loop, last->index);
+}
+
+// Run the callbacks of the expired timers
+static void
+ev_timer_run(struct evloop *loop)
+{
+  uint64_t now = evloop_now();
+
+  while ((loop->timer_count > 0) && !loop->stopped) {
+    struct ev_timer *timer = loop->timers[0];
+
+    if (timer->expires > now)
+      break;
+
+    ev_timer_stop(loop, timer);
+    timer->callback(loop, timer);
+  }
+}
+
+// Get the epoll_wait() timeout until the nearest timer
+static int
+ev_timer_timeout(struct evloop *loop)
+{
+  uint64_t now, ms;
+
+  if (loop->timer_count == 0)
+    return -1;
+
+  now = evloop_now();
+  if (loop->timers[0]->expires <= now)
+    return 0;
+
+  // Round up, so that the timer has expired when epoll_wait() returns
+  ms = (loop->timers[0]->expires - now + 999999) / 1000000;
+  return (ms > INT_MAX) ? INT_MAX : (int) ms;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * The loop
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * Dispatch the events until evloop_stop() is called, or there are no active
+ * watchers and timers left.
+ *
+ * @return 0 on success, or -1 with errno set if epoll_wait() fails.
+ */
+int
+evloop_run(struct evloop *loop)
+{
+  int i;
+
+  loop->stopped = 0;
+
+  while (!loop->stopped && ((loop->io_count > 0) || (loop->timer_count > 0))) {
+    int n = epoll_wait(loop->epfd, loop->events, __EVLOOP_EVENTS,
+                       ev_timer_timeout(loop));
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    loop->event_count = n;
+
+    for (i = 0; (i < n) && !loop->stopped; i++) {
+      struct ev_io *io = (struct ev_io *) loop->events[i].data.ptr;
+
+      if (io != NULL)
+        io->callback(loop, io, loop->events[i].events);
+    }
+
+    loop->event_count = 0;
+
+    ev_timer_run(loop);
+  }
+
+  return 0;
+}
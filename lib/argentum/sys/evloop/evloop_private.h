@@ -0,0 +1,40 @@
+#ifndef _EVLOOP_PRIVATE_H
+#define _EVLOOP_PRIVATE_H
+
+#include <sys/evloop.h>
+
+/** The maximum number of events taken from epoll_wait() at once */
+#define __EVLOOP_EVENTS   64
+
+/**
+ * Registers preserved across calls (AAPCS), saved when a task switches to
+ * the loop or back. See __ev_switch in machine/arm/evswitch.S.
+ */
+struct __ev_context {
+  uint32_t r[8];          ///< r4-r11
+  uint32_t sp;
+  uint32_t lr;
+  uint64_t d[8];          ///< d8-d15
+};
+
+struct evloop {
+  /** The epoll instance */
+  int                 epfd;
+  /** Set by evloop_stop() */
+  int                 stopped;
+  /** The number of active I/O watchers */
+  unsigned            io_count;
+  /** Active timers, a binary heap ordered by the expiration time */
+  struct ev_timer   **timers;
+  unsigned            timer_count;
+  unsigned            timer_size;
+  /** Events being dispatched, stopped watchers are removed from here */
+  struct epoll_event  events[__EVLOOP_EVENTS];
+  int                 event_count;
+  /** The loop context, while a task is running */
+  struct __ev_context context;
+};
+
+void __ev_switch(struct __ev_context *, struct __ev_context *);
+
+#endif  // !_EVLOOP_PRIVATE_H
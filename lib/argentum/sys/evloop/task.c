@@ -0,0 +1,258 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "evloop_private.h"
+
+/*
+ * Tasks are coroutines run by the event loop. A task runs until one of the
+ * ev_task_* calls would block, which registers a watcher or a timer and
+ * switches back to the loop. The callback of the watcher switches to the task
+ * again. Tasks are only ever resumed from the loop context, so a task may
+ * spawn other tasks, they start on the next loop iteration.
+ */
+
+/** Stack size used if the caller passes 0 */
+#define EV_TASK_STACK_SIZE  16384
+
+struct ev_task {
+  struct __ev_context context;
+  struct evloop      *loop;
+  void              (*func)(void *);
+  void               *arg;
+  void               *stack;
+  /** Watches the descriptor the task is waiting for */
+  struct ev_io        io;
+  /** Starts the task, or ends a wait */
+  struct ev_timer     timer;
+  /** The events that ended the wait, 0 on timeout */
+  uint32_t            revents;
+  /** Whether the function has returned */
+  int                 done;
+};
+
+/** The task running now, NULL if the loop is */
+static struct ev_task *ev_task_current;
+
+extern void __ev_task_entry(void);
+
+// Switch from the loop to the task, and free the task if it has finished
+static void
+ev_task_resume(struct ev_task *task)
+{
+  ev_task_current = task;
+  __ev_switch(&task->loop->context, &task->context);
+  ev_task_current = NULL;
+
+  if (task->done) {
+    free(task->stack);
+    free(task);
+  }
+}
+
+// Called by __ev_task_entry on the new stack, with the task in r0
+void
+__ev_task_main(struct ev_task *task)
+{
+  task->func(task->arg);
+
+  task->done = 1;
+  __ev_switch(&task->context, &task->loop->context);
+
+  // Never resumed
+  abort();
+}
+
+static void
+ev_task_io_callback(struct evloop *loop, struct ev_io *io, uint32_t events)
+{
+  struct ev_task *task = (struct ev_task *) io->arg;
+
+  (void) loop;
+
+  task->revents = events;
+  ev_task_resume(task);
+}
+
+static void
+ev_task_timer_callback(struct evloop *loop, struct ev_timer *timer)
+{
+  (void) loop;
+
+  ev_task_resume((struct ev_task *) timer->arg);
+}
+
+/**
+ * Start a task. The function runs on a stack of its own, from the next loop
+ * iteration, and the task is freed when it returns.
+ *
+ * @param loop       The loop to run the task
+ * @param func       The function to run
+ * @param arg        The argument to pass to the function
+ * @param stack_size The stack size in bytes, or 0 for the default
+ *
+ * @return 0 on success, or -1 with errno set.
+ */
+int
+ev_task_spawn(struct evloop *loop, void (*func)(void *), void *arg,
+              size_t stack_size)
+{
+  struct ev_task *task;
+
+  if (stack_size == 0)
+    stack_size = EV_TASK_STACK_SIZE;
+  stack_size = (stack_size + 7) & ~7U;
+
+  if ((task = (struct ev_task *) calloc(1, sizeof(*task))) == NULL)
+    return -1;
+
+  if ((task->stack = malloc(stack_size)) == NULL) {
+    free(task);
+    return -1;
+  }
+
+  task->loop = loop;
+  task->func = func;
+  task->arg  = arg;
+
+  // The first switch "returns" into __ev_task_entry with the task in r4
+  task->context.r[0] = (uintptr_t) task;
+  task->context.sp   = (uintptr_t) task->stack + stack_size;
+  task->context.lr   = (uintptr_t) __ev_task_entry;
+
+  ev_io_init(&task->io, -1, 0, ev_task_io_callback, task);
+  ev_timer_init(&task->timer, ev_task_timer_callback, task);
+
+  if (ev_timer_start(loop, &task->timer, 0) != 0) {
+    free(task->stack);
+    free(task);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Get the loop running the current task, or NULL outside of a task.
+ */
+struct evloop *
+ev_task_loop(void)
+{
+  return (ev_task_current != NULL) ? ev_task_current->loop : NULL;
+}
+
+/**
+ * Wait until the descriptor is ready, letting the loop run other tasks.
+ *
+ * @param fd      The descriptor
+ * @param events  The events to wait for (EPOLLIN, EPOLLOUT)
+ * @param timeout The maximum time to wait in milliseconds, or -1 for no limit
+ *
+ * @return The events that occurred, 0 on timeout, or -1 with errno set.
+ */
+int
+ev_task_wait(int fd, uint32_t events, int timeout)
+{
+  struct ev_task *task = ev_task_current;
+
+  if (task == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  task->revents = 0;
+
+  if (fd >= 0) {
+    ev_io_init(&task->io, fd, events, ev_task_io_callback, task);
+    if (ev_io_start(task->loop, &task->io) != 0)
+      return -1;
+  }
+
+  if ((timeout >= 0) && (ev_timer_start(task->loop, &task->timer,
+                                        timeout) != 0)) {
+    ev_io_stop(task->loop, &task->io);
+    return -1;
+  }
+
+  __ev_switch(&task->context, &task->loop->context);
+
+  ev_io_stop(task->loop, &task->io);
+  ev_timer_stop(task->loop, &task->timer);
+
+  return task->revents;
+}
+
+/**
+ * Sleep for the given number of milliseconds, letting the loop run other
+ * tasks.
+ *
+ * @return 0 on success, or -1 with errno set.
+ */
+int
+ev_task_sleep(unsigned long ms)
+{
+  return (ev_task_wait(-1, 0, ms) < 0) ? -1 : 0;
+}
+
+// Whether the operation would have blocked
+static inline int
+ev_task_would_block(void)
+{
+  return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+}
+
+/**
+ * Read from a non-blocking descriptor, waiting for data if there is none.
+ */
+ssize_t
+ev_task_read(int fd, void *buf, size_t n)
+{
+  ssize_t r;
+
+  while (((r = read(fd, buf, n)) < 0) && ev_task_would_block())
+    if (ev_task_wait(fd, EPOLLIN, -1) < 0)
+      return -1;
+
+  return r;
+}
+
+/**
+ * Write all data to a non-blocking descriptor, waiting for space as needed.
+ *
+ * @return The number of bytes written, or -1 with errno set.
+ */
+ssize_t
+ev_task_write(int fd, const void *buf, size_t n)
+{
+  const char *p = (const char *) buf;
+  size_t done = 0;
+
+  while (done < n) {
+    ssize_t r = write(fd, p + done, n - done);
+
+    if (r >= 0) {
+      done += r;
+    } else if (!ev_task_would_block() ||
+               (ev_task_wait(fd, EPOLLOUT, -1) < 0)) {
+      return -1;
+    }
+  }
+
+  return done;
+}
+
+/**
+ * Accept a connection on a non-blocking socket, waiting for one if none is
+ * pending.
+ */
+int
+ev_task_accept(int fd, struct sockaddr *address, socklen_t *address_len)
+{
+  int r;
+
+  while (((r = accept(fd, address, address_len)) < 0) && ev_task_would_block())
+    if (ev_task_wait(fd, EPOLLIN, -1) < 0)
+      return -1;
+
+  return r;
+}
@@ -0,0 +1,9 @@
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+int
+madvise(void *addr, size_t len, int advice)
+{
+  return __syscall3(__SYS_MADVISE, addr, len, advice);
+}
@@ -0,0 +1,9 @@
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+int
+msync(void *addr, size_t len, int flags)
+{
+  return __syscall3(__SYS_MSYNC, addr, len, flags);
+}
@@ -0,0 +1,15 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "shm_private.h"
+
+int
+shm_open(const char *name, int oflag, mode_t mode)
+{
+  char path[PATH_MAX];
+
+  if (__shm_path(name, path) < 0)
+    return -1;
+
+  return open(path, oflag, mode);
+}
@@ -0,0 +1,39 @@
+#ifndef _SHM_PRIVATE_H
+#define _SHM_PRIVATE_H
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+/** Shared memory objects are files in this tmpfs directory */
+#define __SHM_DIR   "/dev/shm"
+
+/**
+ * Build the path of the file backing the named shared memory object. The name
+ * must start with a slash and contain no other ones.
+ *
+ * @return 0 on success, or -1 with errno set
+ */
+static inline int
+__shm_path(const char *name, char *path)
+{
+  size_t len;
+
+  if ((name[0] != '/') || (strchr(name + 1, '/') != NULL) ||
+      (name[1] == '\0')) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if ((len = strlen(name)) >= PATH_MAX - sizeof(__SHM_DIR)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  memcpy(path, __SHM_DIR, sizeof(__SHM_DIR) - 1);
+  memcpy(path + sizeof(__SHM_DIR) - 1, name, len + 1);
+
+  return 0;
+}
+
+#endif  // !_SHM_PRIVATE_H
@@ -0,0 +1,15 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "shm_private.h"
+
+int
+shm_unlink(const char *name)
+{
+  char path[PATH_MAX];
+
+  if (__shm_path(name, path) < 0)
+    return -1;
+
+  return unlink(path);
+}
@@ -2,7 +2,7 @@
 #include <sys/syscall.h>
 
 int
-mount(const char *type, const char *path)
+mount(const char *type, const char *path, int flags)
 {
-  return __syscall2(__SYS_MOUNT, type, path);
+  return __syscall3(__SYS_MOUNT, type, path, flags);
 }
@@ -0,0 +1,8 @@
+#include <sys/perf.h>
+#include <sys/syscall.h>
+
+int
+perf_ctl(int op, uint64_t *values)
+{
+  return __syscall2(__SYS_PERF_CTL, op, values);
+}
@@ -0,0 +1,8 @@
+#include <sys/ring.h>
+#include <sys/syscall.h>
+
+int
+ring_enter(struct ring *ring, unsigned to_submit)
+{
+  return __syscall2(__SYS_RING_ENTER, ring, to_submit);
+}
@@ -0,0 +1,8 @@
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+ssize_t
+sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+  return __syscall4(__SYS_SENDFILE, out_fd, in_fd, offset, count);
+}
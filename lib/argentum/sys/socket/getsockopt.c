@@ -1,16 +1,10 @@
 #include <sys/socket.h>
-#include <stdio.h>
+#include <sys/syscall.h>
 
 int
-getsockopt(int socket, int level, int option_name,
-       void *option_value, socklen_t *option_len)
+getsockopt(int socket, int level, int option_name, void *option_value,
+           socklen_t *option_len)
 {
-  fprintf(stderr, "TODO: getsockopt()\n");
-
-  (void) socket;
-  (void) option_name;
-  (void) option_value;
-  (void) option_len;
-
-  return -1;
+  return __syscall5(__SYS_GETSOCKOPT, socket, level, option_name, option_value,
+                    option_len);
 }
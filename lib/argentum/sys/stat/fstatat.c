@@ -0,0 +1,9 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+int
+fstatat(int fd, const char *path, struct stat *buf, int flags)
+{
+  return __syscall4(__SYS_FSTATAT, fd, path, buf, flags);
+}
@@ -1,9 +1,9 @@
 #include <sys/fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 int
 lstat(const char *path, struct stat *buf)
 {
-  // TODO: do not use stat
-  return stat(path, buf);
+  return fstatat(AT_FDCWD, path, buf, AT_SYMLINK_NOFOLLOW);
 }
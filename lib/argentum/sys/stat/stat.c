@@ -1,20 +1,11 @@
 #include <sys/fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
-#include <stdio.h>
 
 int
 _stat(const char *path, struct stat *buf)
 {
-  int fd, r;
-
-  if ((fd = open(path, O_RDONLY)) < 0)
-    return fd;
-
-  r = fstat(fd, buf);
-
-  close(fd);
-
-  return r;
+  return fstatat(AT_FDCWD, path, buf, 0);
 }
 
 int
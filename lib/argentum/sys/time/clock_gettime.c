@@ -1,8 +1,73 @@
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/timepage.h>
+
+static inline uint64_t
+cntpct_get(void)
+{
+  uint32_t lo, hi;
+
+  asm volatile("isb\n\tmrrc p15, 0, %0, %1, c14" : "=r" (lo), "=r" (hi));
+  return ((uint64_t) hi << 32) | lo;
+}
+
+static int
+clock_gettime_monotonic(const struct timepage *page, struct timespec *tp)
+{
+  uint32_t seq;
+  uint64_t ns;
+
+  // The clock source exists, but only the kernel can read it
+  if ((page->tp_counter == TP_COUNTER_NONE) && (page->tp_mult != 0))
+    return __syscall2(__SYS_CLOCK_TIME, CLOCK_MONOTONIC, tp);
+
+  do {
+    while ((seq = page->tp_seq) & 1)
+      ;
+    __sync_synchronize();
+
+    ns = page->tp_mono_ns;
+    if (page->tp_counter == TP_COUNTER_CNTPCT)
+      ns += (((cntpct_get() - page->tp_cycles) & page->tp_mask) *
+             page->tp_mult) >> page->tp_shift;
+
+    __sync_synchronize();
+  } while (page->tp_seq != seq);
+
+  tp->tv_sec  = ns / 1000000000UL;
+  tp->tv_nsec = ns % 1000000000UL;
+
+  return 0;
+}
 
 int
 clock_gettime(clockid_t clock_id, struct timespec *tp)
 {
-  return __syscall2(__SYS_CLOCK_TIME, clock_id, tp);
+  const struct timepage *page = (const struct timepage *) TIMEPAGE_ADDR;
+  uint32_t seq, rate;
+  uint64_t ticks;
+
+  // Let the kernel report errors for clocks not exported via the time page
+  if (((clock_id != CLOCK_REALTIME) && (clock_id != CLOCK_MONOTONIC)) ||
+      (tp == NULL))
+    return __syscall2(__SYS_CLOCK_TIME, clock_id, tp);
+
+  if (clock_id == CLOCK_MONOTONIC)
+    return clock_gettime_monotonic(page, tp);
+
+  do {
+    while ((seq = page->tp_seq) & 1)
+      ;
+    __sync_synchronize();
+
+    ticks = page->tp_ticks;
+    rate  = page->tp_rate;
+
+    __sync_synchronize();
+  } while (page->tp_seq != seq);
+
+  tp->tv_sec  = ticks / rate;
+  tp->tv_nsec = (ticks % rate) * (1000000000UL / rate);
+
+  return 0;
 }
@@ -9,7 +9,7 @@ _gettimeofday (struct timeval *tp, void *tzp)
   // TODO: handle timezones
   (void) tzp;
 
-  ret = clock_gettime(CLOCK_MONOTONIC, &time);
+  ret = clock_gettime(CLOCK_REALTIME, &time);
 
   if (ret == 0) {
     tp->tv_sec  = time.tv_sec;
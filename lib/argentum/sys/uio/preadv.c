@@ -0,0 +1,8 @@
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+ssize_t
+preadv(int fildes, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  return __syscall4(__SYS_PREADV, fildes, iov, iovcnt, offset);
+}
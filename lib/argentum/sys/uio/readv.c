@@ -0,0 +1,8 @@
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+ssize_t
+readv(int fildes, const struct iovec *iov, int iovcnt)
+{
+  return __syscall3(__SYS_READV, fildes, iov, iovcnt);
+}
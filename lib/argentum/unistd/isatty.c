@@ -0,0 +1,24 @@
+#include <errno.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Only the terminals answer TIOCGETA. Checking for a character device instead
+// would make stdio line-buffer the output to /dev/null or /dev/fb0 as well.
+int
+_isatty(int fildes)
+{
+  struct termios t;
+
+  if (tcgetattr(fildes, &t) != 0) {
+    errno = ENOTTY;
+    return 0;
+  }
+
+  return 1;
+}
+
+int
+isatty(int fildes)
+{
+  return _isatty(fildes);
+}
@@ -0,0 +1,8 @@
+#include <sys/syscall.h>
+#include <unistd.h>
+
+ssize_t
+pread(int fildes, void *buf, size_t n, off_t offset)
+{
+  return __syscall4(__SYS_PREAD, fildes, buf, n, offset);
+}
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
 
@@ -15,7 +16,7 @@ sysconf(int name)
   case _SC_PHYS_PAGES:
     return 256 * 1024 * 1024;
   case _SC_OPEN_MAX:
-    return 20;
+    return OPEN_MAX;
   case _SC_LINE_MAX:
     return 256;
   default:
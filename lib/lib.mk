@@ -1,4 +1,6 @@
-LIB_CFLAGS := -nostdlib
+# The same objects go into libc.a and libc.so, so they are all compiled as
+# position-independent code
+LIB_CFLAGS := -nostdlib -O2 -fPIC
 
 NEWLIB := lib/newlib-4.4.0.20231231
 NEWLIB_TARBALL := tarballs/newlib-4.4.0.20231231.tar.gz
@@ -10,6 +12,8 @@ LIB_SRCFILES := \
 	lib/argentum/arpa/inet/inet_pton.c \
 	lib/argentum/fcntl/fcntl.c \
 	lib/argentum/fcntl/open.c \
+	lib/argentum/fcntl/splice.c \
+	lib/argentum/fcntl/tee.c \
 	lib/argentum/grp/endgrent.c \
 	lib/argentum/grp/getgrent.c \
 	lib/argentum/grp/getgrgid.c \
@@ -19,19 +23,34 @@ LIB_SRCFILES := \
 	lib/argentum/include/arpa/inet.h \
 	lib/argentum/include/arpa/telnet.h \
 	lib/argentum/include/arpa/tftp.h \
+	lib/argentum/include/elf.h \
 	lib/argentum/include/net/if.h \
 	lib/argentum/include/netinet/icmp6.h \
 	lib/argentum/include/netinet/in_systm.h \
 	lib/argentum/include/netinet/in.h \
 	lib/argentum/include/netinet/ip.h \
+	lib/argentum/include/sys/channel.h \
+	lib/argentum/include/sys/cpuset.h \
 	lib/argentum/include/sys/dirent.h \
+	lib/argentum/include/sys/epoll.h \
+	lib/argentum/include/sys/evloop.h \
+	lib/argentum/include/sys/fb.h \
+	lib/argentum/include/sys/fcntl.h \
+	lib/argentum/include/sys/futex.h \
 	lib/argentum/include/sys/ioctl.h \
 	lib/argentum/include/sys/mman.h \
 	lib/argentum/include/sys/mount.h \
+	lib/argentum/include/sys/perf.h \
 	lib/argentum/include/sys/resource.h \
+	lib/argentum/include/sys/ring.h \
+	lib/argentum/include/sys/sendfile.h \
 	lib/argentum/include/sys/socket.h \
 	lib/argentum/include/sys/syscall.h \
+	lib/argentum/include/sys/sysstat.h \
 	lib/argentum/include/sys/termios.h \
+	lib/argentum/include/sys/timepage.h \
+	lib/argentum/include/sys/trace.h \
+	lib/argentum/include/sys/uio.h \
 	lib/argentum/include/sys/un.h \
 	lib/argentum/include/sys/utime.h \
 	lib/argentum/include/sys/utmp.h \
@@ -42,7 +61,15 @@ LIB_SRCFILES := \
 	lib/argentum/include/netdb.h \
 	lib/argentum/include/poll.h \
 	lib/argentum/include/ucontext.h \
+	lib/argentum/machine/arm/aeabi_read_tp.S \
+	lib/argentum/machine/arm/evswitch.S \
+	lib/argentum/machine/arm/memchr.S \
+	lib/argentum/machine/arm/memcpy.S \
+	lib/argentum/machine/arm/memset.S \
 	lib/argentum/machine/arm/sigstub.S \
+	lib/argentum/machine/arm/strcmp.S \
+	lib/argentum/machine/arm/strlen.S \
+	lib/argentum/machine/arm/vfork.S \
 	lib/argentum/mntent/getmntent.c \
 	lib/argentum/netdb/endservent.c \
 	lib/argentum/netdb/gethostbyaddr.c \
@@ -52,6 +79,24 @@ LIB_SRCFILES := \
 	lib/argentum/netdb/netdb.c \
 	lib/argentum/netdb/setservent.c \
 	lib/argentum/poll/poll.c \
+	lib/argentum/pthread/cancel.c \
+	lib/argentum/pthread/cond.c \
+	lib/argentum/pthread/key.c \
+	lib/argentum/pthread/lock.c \
+	lib/argentum/pthread/mutex.c \
+	lib/argentum/pthread/once.c \
+	lib/argentum/pthread/pthread.c \
+	lib/argentum/pthread/pthread_private.h \
+	lib/argentum/sched/sched_getaffinity.c \
+	lib/argentum/sched/sched_get_priority_max.c \
+	lib/argentum/sched/sched_get_priority_min.c \
+	lib/argentum/sched/sched_getparam.c \
+	lib/argentum/sched/sched_getscheduler.c \
+	lib/argentum/sched/sched_rr_get_interval.c \
+	lib/argentum/sched/sched_setaffinity.c \
+	lib/argentum/sched/sched_setparam.c \
+	lib/argentum/sched/sched_setscheduler.c \
+	lib/argentum/sched/sched_yield.c \
 	lib/argentum/signal/kill.c \
 	lib/argentum/signal/killpg.c \
 	lib/argentum/signal/sigaction.c \
@@ -68,13 +113,35 @@ LIB_SRCFILES := \
 	lib/argentum/stdlib/reallocr.c \
 	lib/argentum/stdlib/realpath.c \
 	lib/argentum/stdlib/unlockpt.c \
+	lib/argentum/sys/channel/channel_create.c \
+	lib/argentum/sys/channel/channel_destroy.c \
+	lib/argentum/sys/channel/connect_attach.c \
+	lib/argentum/sys/channel/connect_detach.c \
+	lib/argentum/sys/channel/msg_receive.c \
+	lib/argentum/sys/channel/msg_reply.c \
+	lib/argentum/sys/channel/msg_send.c \
+	lib/argentum/sys/epoll/epoll_create.c \
+	lib/argentum/sys/epoll/epoll_create1.c \
+	lib/argentum/sys/epoll/epoll_ctl.c \
+	lib/argentum/sys/epoll/epoll_wait.c \
+	lib/argentum/sys/evloop/evloop.c \
+	lib/argentum/sys/evloop/evloop_private.h \
+	lib/argentum/sys/evloop/task.c \
 	lib/argentum/sys/ioctl/ioctl.c \
+	lib/argentum/sys/mman/madvise.c \
 	lib/argentum/sys/mman/mmap.c \
 	lib/argentum/sys/mman/mprotect.c \
+	lib/argentum/sys/mman/msync.c \
 	lib/argentum/sys/mman/munmap.c \
+	lib/argentum/sys/mman/shm_open.c \
+	lib/argentum/sys/mman/shm_private.h \
+	lib/argentum/sys/mman/shm_unlink.c \
 	lib/argentum/sys/mount/mount.c \
+	lib/argentum/sys/perf/perf_ctl.c \
 	lib/argentum/sys/resource/getrlimit.c \
 	lib/argentum/sys/resource/setrlimit.c \
+	lib/argentum/sys/ring/ring_enter.c \
+	lib/argentum/sys/sendfile/sendfile.c \
 	lib/argentum/sys/socket/accept.c \
 	lib/argentum/sys/socket/bind.c \
 	lib/argentum/sys/socket/connect.c \
@@ -91,6 +158,7 @@ LIB_SRCFILES := \
 	lib/argentum/sys/stat/chmod.c \
 	lib/argentum/sys/stat/fchmod.c \
 	lib/argentum/sys/stat/fstat.c \
+	lib/argentum/sys/stat/fstatat.c \
 	lib/argentum/sys/stat/lstat.c \
 	lib/argentum/sys/stat/mkdir.c \
 	lib/argentum/sys/stat/mkfifo.c \
@@ -102,6 +170,10 @@ LIB_SRCFILES := \
 	lib/argentum/sys/time/select.c \
 	lib/argentum/sys/time/setitimer.c \
 	lib/argentum/sys/times/times.c \
+	lib/argentum/sys/uio/preadv.c \
+	lib/argentum/sys/uio/pwritev.c \
+	lib/argentum/sys/uio/readv.c \
+	lib/argentum/sys/uio/writev.c \
 	lib/argentum/sys/utsname/uname.c \
 	lib/argentum/sys/vfs/statfs.c \
 	lib/argentum/sys/wait/wait.c \
@@ -140,12 +212,15 @@ LIB_SRCFILES := \
 	lib/argentum/unistd/getpid.c \
 	lib/argentum/unistd/getppid.c \
 	lib/argentum/unistd/getuid.c \
+	lib/argentum/unistd/isatty.c \
 	lib/argentum/unistd/issetugid.c \
 	lib/argentum/unistd/lchown.c \
 	lib/argentum/unistd/link.c \
 	lib/argentum/unistd/lseek.c \
 	lib/argentum/unistd/pathconf.c \
 	lib/argentum/unistd/pipe.c \
+	lib/argentum/unistd/pread.c \
+	lib/argentum/unistd/pwrite.c \
 	lib/argentum/unistd/read.c \
 	lib/argentum/unistd/readlink.c \
 	lib/argentum/unistd/rmdir.c \
@@ -163,7 +238,6 @@ LIB_SRCFILES := \
 	lib/argentum/unistd/tcgetpgrp.c \
 	lib/argentum/unistd/tcsetpgrp.c \
 	lib/argentum/unistd/unlink.c \
-	lib/argentum/unistd/vfork.c \
 	lib/argentum/unistd/write.c \
 	lib/argentum/utime/utime.c \
 	lib/argentum/crt0.c
@@ -203,6 +277,8 @@ $(OBJ)/lib/Makefile: $(NEWLIB)/newlib/Makefile.in
 		--disable-multilib \
 		--disable-newlib-nano-formatted-io \
 		--enable-newlib-io-c99-formats \
+		--enable-newlib-retargetable-locking \
+		--enable-newlib-global-stdio-streams \
 		--enable-shared
 
 $(SYSROOT)/usr/lib/libc.a: $(OBJ)/lib/Makefile $(LIB_SRCFILES)
@@ -210,7 +286,53 @@ $(SYSROOT)/usr/lib/libc.a: $(OBJ)/lib/Makefile $(LIB_SRCFILES)
 	$(V)cd $(OBJ)/lib && make CFLAGS="$(LIB_CFLAGS)" DESTDIR=/$(HOME)/argentum/sysroot all install
 	$(V)cp -ar $(SYSROOT)/usr/arm-none-argentum/* $(SYSROOT)/usr/
 
-all-lib: $(SYSROOT)/usr/lib/libc.a
+# The shared C library is made of the libc.a objects except for the startup
+# code and __libc_init_array(), which must see the constructors of the program
+# rather than those of the library. They go into libc_nonshared.a, and libc.so
+# is a linker script that adds it to every dynamically linked program.
+LIBC_NONSHARED := libc_a-crt0.o libc_a-init.o libc_a-fini.o
+
+$(OBJ)/libso/libc.so.1: $(SYSROOT)/usr/lib/libc.a
+	@echo "+ LD [LIB] $@"
+	$(V)rm -rf $@.d
+	$(V)mkdir -p $@.d
+	$(V)cd $@.d && $(AR) x $(abspath $<)
+	$(V)cd $@.d && $(AR) rcs ../libc_nonshared.a $(LIBC_NONSHARED)
+	$(V)cd $@.d && rm -f $(LIBC_NONSHARED)
+	$(V)$(LD) $(LDFLAGS) -shared -soname libc.so.1 --hash-style=sysv \
+		-o $@ $@.d/*.o $(LIBGCC)
+
+$(OBJ)/libso/libc_nonshared.a: $(OBJ)/libso/libc.so.1
+
+$(SYSROOT)/usr/lib/libc.so.1 $(SYSROOT)/usr/lib/libc_nonshared.a: \
+		$(SYSROOT)/usr/lib/%: $(OBJ)/libso/%
+	cp $< $@
+
+$(SYSROOT)/usr/lib/libc.so: $(SYSROOT)/usr/lib/libc.so.1 \
+		$(SYSROOT)/usr/lib/libc_nonshared.a
+	echo "GROUP ( /usr/lib/libc.so.1 /usr/lib/libc_nonshared.a )" > $@
+
+# The dynamic loader (see lib/argentum/ldso/rtld.c). It relocates itself, so
+# it must not need anything but relative relocations.
+LDSO_CFLAGS := $(CFLAGS) -O2 -fPIC -fvisibility=hidden -ffreestanding \
+	-fno-builtin -fno-tree-loop-distribute-patterns
+
+$(OBJ)/ldso/rtld.o: lib/argentum/ldso/rtld.c $(OBJ)/.vars.LDSO_CFLAGS \
+		$(SYSROOT)/usr/lib/libc.a
+	@echo "+ CC [LIB] $<"
+	@mkdir -p $(@D)
+	$(V)$(CC) $(LDSO_CFLAGS) -c -o $@ $<
+
+$(OBJ)/ldso/ld.so.1: $(OBJ)/ldso/rtld.o
+	@echo "+ LD [LIB] $@"
+	$(V)$(LD) $(LDFLAGS) -shared -Bsymbolic --no-undefined --hash-style=sysv \
+		-soname ld.so.1 -e _rtld_start -o $@ $< $(LIBGCC)
+
+$(SYSROOT)/usr/lib/ld.so.1: $(OBJ)/ldso/ld.so.1
+	cp $< $@
+
+all-lib: $(SYSROOT)/usr/lib/libc.a $(SYSROOT)/usr/lib/libc.so \
+	$(SYSROOT)/usr/lib/ld.so.1
 
 clean-lib:
-	rm -rf $(OBJ)/lib
+	rm -rf $(OBJ)/lib $(OBJ)/libso $(OBJ)/ldso
@@ -0,0 +1,97 @@
+/*
+ * Faster CRC32 for gzip, built when PORTS_FLAVOUR=neon.
+ *
+ * Cortex-A9 has neither the CRC32 instructions nor a 64-bit polynomial
+ * multiply, so instead of the byte-at-a-time loop of util.c this one uses
+ * eight tables and consumes eight bytes per iteration (slicing-by-8).
+ *
+ * gzip is linked with --wrap for updcrc, getcrc and setcrc, so that all calls
+ * from the other files come here and share the shift register below.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+typedef unsigned char uch;
+typedef unsigned long ulg;
+
+ulg  __wrap_updcrc(const uch *, unsigned);
+ulg  __wrap_getcrc(void);
+void __wrap_setcrc(ulg);
+
+/** Shift register contents */
+static uint32_t crc = 0xffffffffUL;
+
+static uint32_t crc_table[8][256];
+static int      crc_table_ready;
+
+static void
+crc_table_init(void)
+{
+  unsigned i, k;
+
+  for (i = 0; i < 256; i++) {
+    uint32_t c = i;
+
+    for (k = 0; k < 8; k++)
+      c = (c & 1) ? (c >> 1) ^ 0xedb88320UL : (c >> 1);
+    crc_table[0][i] = c;
+  }
+
+  // crc_table[k][i] is the CRC of byte i followed by k zero bytes
+  for (i = 0; i < 256; i++)
+    for (k = 1; k < 8; k++)
+      crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^
+                        crc_table[0][crc_table[k - 1][i] & 0xff];
+
+  crc_table_ready = 1;
+}
+
+static uint32_t
+crc_update(uint32_t c, const uch *s, unsigned n)
+{
+  if (!crc_table_ready)
+    crc_table_init();
+
+  for ( ; n >= 8; s += 8, n -= 8) {
+    uint32_t a, b;
+
+    memcpy(&a, s, 4);
+    memcpy(&b, s + 4, 4);
+    a ^= c;
+
+    c = crc_table[7][a & 0xff] ^ crc_table[6][(a >> 8) & 0xff] ^
+        crc_table[5][(a >> 16) & 0xff] ^ crc_table[4][a >> 24] ^
+        crc_table[3][b & 0xff] ^ crc_table[2][(b >> 8) & 0xff] ^
+        crc_table[1][(b >> 16) & 0xff] ^ crc_table[0][b >> 24];
+  }
+
+  for ( ; n > 0; s++, n--)
+    c = crc_table[0][(c ^ *s) & 0xff] ^ (c >> 8);
+
+  return c;
+}
+
+/*
+ * Run a set of bytes through the crc shift register. If s is a NULL pointer,
+ * then initialize the crc shift register contents instead. Return the current
+ * crc in either case.
+ */
+ulg
+__wrap_updcrc(const uch *s, unsigned n)
+{
+  crc = (s == NULL) ? 0xffffffffUL : crc_update(crc, s, n);
+  return crc ^ 0xffffffffUL;
+}
+
+ulg
+__wrap_getcrc(void)
+{
+  return crc ^ 0xffffffffUL;
+}
+
+void
+__wrap_setcrc(ulg c)
+{
+  crc = c ^ 0xffffffffUL;
+}
@@ -0,0 +1,107 @@
+/*
+ * NEON longest_match() for gzip, built when PORTS_FLAVOUR=neon.
+ *
+ * Compiling gzip with -DASMV makes deflate.c call an external longest_match()
+ * and match_init() instead of its own C version. This one checks the same
+ * candidates in the same order, but compares the strings 16 bytes at a time.
+ *
+ * The declarations below mirror gzip.h and deflate.c, which cannot be included
+ * here because the library is built before gzip is configured.
+ */
+
+#include <arm_neon.h>
+#include <stdint.h>
+
+typedef unsigned char  uch;
+typedef unsigned short ush;
+typedef unsigned       IPos;
+
+#define WSIZE          0x8000
+#define WMASK          (WSIZE - 1)
+#define MIN_MATCH      3
+#define MAX_MATCH      258
+#define MIN_LOOKAHEAD  (MAX_MATCH + MIN_MATCH + 1)
+#define MAX_DIST       (WSIZE - MIN_LOOKAHEAD)
+#define NIL            0
+
+extern uch window[];
+extern ush prev[];
+
+extern unsigned prev_length;
+extern unsigned strstart;
+extern unsigned match_start;
+extern unsigned max_chain_length;
+extern unsigned good_match;
+extern int      nice_match;
+
+void match_init(void);
+int  longest_match(IPos);
+
+void
+match_init(void)
+{
+}
+
+// Count the equal leading bytes of two strings, up to MAX_MATCH - 2. The
+// window always holds MAX_MATCH bytes after strstart, so nothing is read past
+// the end of the string being matched.
+static unsigned
+match_length(const uch *scan, const uch *match)
+{
+  unsigned len;
+
+  for (len = 0; len < MAX_MATCH - 2; len += 16) {
+    uint8x16_t eq = vceqq_u8(vld1q_u8(scan + len), vld1q_u8(match + len));
+    uint64_t lo = ~vgetq_lane_u64(vreinterpretq_u64_u8(eq), 0);
+    uint64_t hi = ~vgetq_lane_u64(vreinterpretq_u64_u8(eq), 1);
+
+    // Each lane is 0xff if the bytes are equal, the first zero lane is the
+    // first mismatch
+    if (lo != 0)
+      return len + __builtin_ctzll(lo) / 8;
+    if (hi != 0)
+      return len + 8 + __builtin_ctzll(hi) / 8;
+  }
+
+  return len;
+}
+
+int
+longest_match(IPos cur_match)
+{
+  unsigned chain_length = max_chain_length;
+  const uch *scan = window + strstart;
+  unsigned best_len = prev_length;
+  IPos limit = strstart > (IPos) MAX_DIST ? strstart - (IPos) MAX_DIST : NIL;
+  uch scan_end1 = scan[best_len - 1];
+  uch scan_end = scan[best_len];
+
+  // Do not waste too much time if we already have a good match
+  if (prev_length >= good_match)
+    chain_length >>= 2;
+
+  do {
+    const uch *match = window + cur_match;
+    unsigned len;
+
+    // Skip to the next candidate if the end of the best match so far or the
+    // first two bytes differ, as the C version does
+    if ((match[best_len] != scan_end) || (match[best_len - 1] != scan_end1) ||
+        (match[0] != scan[0]) || (match[1] != scan[1]))
+      continue;
+
+    len = 2 + match_length(scan + 2, match + 2);
+
+    if (len > best_len) {
+      match_start = cur_match;
+      best_len = len;
+      if (len >= (unsigned) nice_match)
+        break;
+      scan_end1 = scan[best_len - 1];
+      scan_end  = scan[best_len];
+    }
+  } while (((cur_match = prev[cur_match & WMASK]) > limit) &&
+           (--chain_length != 0));
+
+  return best_len;
+}
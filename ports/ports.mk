@@ -1,2 +1,15 @@
+# Build flavour of the ports:
+#   generic - the default flags of each package
+#   neon    - tune for Cortex-A9 and enable the NEON routines of the ports that
+#             have them (gzip); needs a CPU with NEON
+PORTS_FLAVOUR ?= generic
+
+ifeq ($(PORTS_FLAVOUR),neon)
+PORTS_CFLAGS := -O2 -mcpu=cortex-a9 -mfpu=neon -mfloat-abi=softfp
+export PORTS_CFLAGS
+endif
+
+export PORTS_FLAVOUR
+
 ports-%:
 	make -C ports/$* install
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The benchmarks, in the order in which they are run
+static const char *const benchmarks[] = {
+  "null",
+  "fork",
+  "exec",
+  "pipe",
+  "ctxsw",
+  "file",
+  "read",
+  "stat",
+  "tcp",
+  "kernel",
+};
+
+#define NBENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+#define BENCH_DIR   "/bench"
+
+static int
+run(const char *name)
+{
+  char path[64];
+  int status;
+  pid_t pid;
+
+  snprintf(path, sizeof(path), "%s/%s", BENCH_DIR, name);
+
+  if ((pid = fork()) < 0)
+    return -1;
+
+  if (pid == 0) {
+    execl(path, path, NULL);
+    perror(path);
+    _exit(127);
+  }
+
+  if (waitpid(pid, &status, 0) < 0)
+    return -1;
+
+  return (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) ? 0 : -1;
+}
+
+// Run the given benchmarks (all of them by default) one after another. The
+// markers around the results let scripts tell when the run is complete.
+int
+main(int argc, char **argv)
+{
+  const char *const *names = benchmarks;
+  size_t i, n = NBENCHMARKS;
+  int failed = 0;
+
+  if (argc > 1) {
+    names = (const char *const *) &argv[1];
+    n     = argc - 1;
+  }
+
+  printf("BENCH-BEGIN\n");
+  fflush(stdout);
+
+  for (i = 0; i < n; i++) {
+    if (run(names[i]) != 0) {
+      printf("BENCH-FAIL %s\n", names[i]);
+      failed++;
+    }
+  }
+
+  printf("BENCH-END %d\n", failed);
+  fflush(stdout);
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
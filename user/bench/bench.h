@@ -0,0 +1,95 @@
+#ifndef __USER_BENCH_BENCH_H__
+#define __USER_BENCH_BENCH_H__
+
+/**
+ * @file user/bench/bench.h
+ *
+ * Helpers shared by the benchmark programs. Every benchmark prints its
+ * results as lines of the form
+ *
+ *   BENCH <name> <value> <unit>
+ *
+ * so that the summary can be extracted from the console log with grep.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Get the current value of the monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ */
+static inline uint64_t
+bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Get the number of iterations to run, either from the first argument or the
+ * default one.
+ */
+static inline unsigned long
+bench_iterations(int argc, char **argv, unsigned long dflt)
+{
+  unsigned long n;
+
+  if ((argc < 2) || ((n = strtoul(argv[1], NULL, 10)) == 0))
+    return dflt;
+  return n;
+}
+
+/**
+ * Print the average time of one operation.
+ *
+ * @param name  The name of the benchmark
+ * @param start The start time, as returned by bench_now()
+ * @param n     The number of operations performed
+ */
+static inline void
+bench_report_latency(const char *name, uint64_t start, unsigned long n)
+{
+  uint64_t elapsed = bench_now() - start;
+
+  printf("BENCH %s %llu ns/op\n", name,
+         (unsigned long long) (elapsed / n));
+  fflush(stdout);
+}
+
+/**
+ * Print the throughput of a transfer.
+ *
+ * @param name  The name of the benchmark
+ * @param start The start time, as returned by bench_now()
+ * @param bytes The number of bytes transferred
+ */
+static inline void
+bench_report_bandwidth(const char *name, uint64_t start, uint64_t bytes)
+{
+  uint64_t elapsed = bench_now() - start;
+
+  if (elapsed == 0)
+    elapsed = 1;
+
+  printf("BENCH %s %llu KB/s\n", name,
+         (unsigned long long) (bytes * 1000000000ULL / 1024 / elapsed));
+  fflush(stdout);
+}
+
+/**
+ * Report a failed system call and terminate the benchmark.
+ */
+static inline void
+bench_die(const char *what)
+{
+  perror(what);
+  exit(EXIT_FAILURE);
+}
+
+#endif  // !__USER_BENCH_BENCH_H__
@@ -0,0 +1,57 @@
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define NPROC 4
+
+// Pass a token around a ring of processes connected with pipes, so that every
+// hop wakes up another process. As in lmbench, the result includes the cost of
+// the pipe operations.
+int
+main(int argc, char **argv)
+{
+  unsigned long i, n = bench_iterations(argc, argv, 5000);
+  int fds[NPROC][2];
+  pid_t pids[NPROC];
+  uint64_t start;
+  char c = 0;
+  int j;
+
+  for (j = 0; j < NPROC; j++)
+    if (pipe(fds[j]) < 0)
+      bench_die("pipe");
+
+  // Process j reads from pipe j and writes to pipe j + 1, the parent closes
+  // the ring
+  for (j = 1; j < NPROC; j++) {
+    if ((pids[j] = fork()) < 0)
+      bench_die("fork");
+
+    if (pids[j] == 0) {
+      while (read(fds[j][0], &c, 1) == 1)
+        if (write(fds[(j + 1) % NPROC][1], &c, 1) != 1)
+          break;
+      _exit(0);
+    }
+  }
+
+  start = bench_now();
+  for (i = 0; i < n; i++) {
+    if (write(fds[1][1], &c, 1) != 1)
+      bench_die("write");
+    if (read(fds[0][0], &c, 1) != 1)
+      bench_die("read");
+  }
+  bench_report_latency("context_switch", start, n * NPROC);
+
+  // Every child still holds the write ends of all pipes, so they never see
+  // the end of file
+  for (j = 1; j < NPROC; j++) {
+    kill(pids[j], SIGKILL);
+    waitpid(pids[j], NULL, 0);
+  }
+
+  return 0;
+}
@@ -0,0 +1,37 @@
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define CHILD_ARG "--child"
+
+// Measure the cost of creating a process that loads a new program, this one
+// executed again with an argument that makes it exit at once
+int
+main(int argc, char **argv)
+{
+  unsigned long i, n;
+  uint64_t start;
+  pid_t pid;
+
+  if ((argc > 1) && (strcmp(argv[1], CHILD_ARG) == 0))
+    return 0;
+
+  n = bench_iterations(argc, argv, 200);
+
+  start = bench_now();
+  for (i = 0; i < n; i++) {
+    if ((pid = fork()) < 0)
+      bench_die("fork");
+    if (pid == 0) {
+      execl(argv[0], argv[0], CHILD_ARG, NULL);
+      _exit(127);
+    }
+    if (waitpid(pid, NULL, 0) < 0)
+      bench_die("waitpid");
+  }
+  bench_report_latency("fork_exec", start, n);
+
+  return 0;
+}
@@ -0,0 +1,35 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+// Measure the cost of creating and then deleting empty files in the current
+// directory
+int
+main(int argc, char **argv)
+{
+  unsigned long i, n = bench_iterations(argc, argv, 1000);
+  char path[32];
+  uint64_t start;
+  int fd;
+
+  start = bench_now();
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "bench.%lu", i);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+      bench_die(path);
+    close(fd);
+  }
+  bench_report_latency("file_create", start, n);
+
+  start = bench_now();
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "bench.%lu", i);
+    if (unlink(path) < 0)
+      bench_die(path);
+  }
+  bench_report_latency("file_delete", start, n);
+
+  return 0;
+}
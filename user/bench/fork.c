@@ -0,0 +1,27 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+// Measure the cost of creating a process that exits immediately, including
+// waiting for it
+int
+main(int argc, char **argv)
+{
+  unsigned long i, n = bench_iterations(argc, argv, 500);
+  uint64_t start;
+  pid_t pid;
+
+  start = bench_now();
+  for (i = 0; i < n; i++) {
+    if ((pid = fork()) < 0)
+      bench_die("fork");
+    if (pid == 0)
+      _exit(0);
+    if (waitpid(pid, NULL, 0) < 0)
+      bench_die("waitpid");
+  }
+  bench_report_latency("fork_exit", start, n);
+
+  return 0;
+}
@@ -0,0 +1,21 @@
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "bench.h"
+
+// Run the kernel microbenchmarks. They print their own results to the
+// system console, the buffer cache one uses the device of the root directory.
+int
+main(int argc, char **argv)
+{
+  unsigned long n = bench_iterations(argc, argv, 200);
+  struct stat st;
+
+  if (stat("/", &st) < 0)
+    bench_die("/");
+
+  if (__syscall4(__SYS_TEST, __SYS_TEST_BENCH, st.st_dev, st.st_blksize, n) < 0)
+    bench_die("kernel benchmarks");
+
+  return 0;
+}
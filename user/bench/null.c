@@ -0,0 +1,19 @@
+#include <sys/syscall.h>
+
+#include "bench.h"
+
+// Measure the cost of entering and leaving the kernel with a system call that
+// does almost nothing (getppid() is never cached by the C library)
+int
+main(int argc, char **argv)
+{
+  unsigned long i, n = bench_iterations(argc, argv, 200000);
+  uint64_t start;
+
+  start = bench_now();
+  for (i = 0; i < n; i++)
+    __syscall0(__SYS_GETPPID);
+  bench_report_latency("null_syscall", start, n);
+
+  return 0;
+}
@@ -0,0 +1,96 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define BW_CHUNK      (64 * 1024)
+#define BW_TOTAL      (16 * 1024 * 1024)
+
+static char buf[BW_CHUNK];
+
+// Bounce a byte between two processes through a pair of pipes
+static void
+pipe_latency(unsigned long n)
+{
+  int to_child[2], to_parent[2];
+  unsigned long i;
+  uint64_t start;
+  pid_t pid;
+  char c = 0;
+
+  if ((pipe(to_child) < 0) || (pipe(to_parent) < 0))
+    bench_die("pipe");
+
+  if ((pid = fork()) < 0)
+    bench_die("fork");
+
+  if (pid == 0) {
+    while (read(to_child[0], &c, 1) == 1)
+      if (write(to_parent[1], &c, 1) != 1)
+        break;
+    _exit(0);
+  }
+
+  close(to_child[0]);
+  close(to_parent[1]);
+
+  start = bench_now();
+  for (i = 0; i < n; i++) {
+    if (write(to_child[1], &c, 1) != 1)
+      bench_die("write");
+    if (read(to_parent[0], &c, 1) != 1)
+      bench_die("read");
+  }
+  bench_report_latency("pipe_latency", start, n);
+
+  close(to_child[1]);
+  close(to_parent[0]);
+  waitpid(pid, NULL, 0);
+}
+
+// Stream data from a child process through a pipe
+static void
+pipe_bandwidth(void)
+{
+  uint64_t start, total = 0;
+  ssize_t nread;
+  int fds[2];
+  pid_t pid;
+
+  if (pipe(fds) < 0)
+    bench_die("pipe");
+
+  if ((pid = fork()) < 0)
+    bench_die("fork");
+
+  if (pid == 0) {
+    size_t left;
+
+    close(fds[0]);
+    for (left = BW_TOTAL; left > 0; left -= BW_CHUNK)
+      if (write(fds[1], buf, BW_CHUNK) != BW_CHUNK)
+        _exit(1);
+    _exit(0);
+  }
+
+  close(fds[1]);
+
+  start = bench_now();
+  while ((nread = read(fds[0], buf, sizeof(buf))) > 0)
+    total += nread;
+  if (nread < 0)
+    bench_die("read");
+  bench_report_bandwidth("pipe_bandwidth", start, total);
+
+  close(fds[0]);
+  waitpid(pid, NULL, 0);
+}
+
+int
+main(int argc, char **argv)
+{
+  pipe_latency(bench_iterations(argc, argv, 20000));
+  pipe_bandwidth();
+
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define FILE_NAME   "bench.data"
+#define FILE_SIZE   (8 * 1024 * 1024)
+#define SEQ_CHUNK   (64 * 1024)
+#define RAND_CHUNK  4096
+
+static char buf[SEQ_CHUNK] __attribute__((aligned(RAND_CHUNK)));
+
+// Measure reading a file in the current directory, first sequentially in
+// large chunks and then one block at a time at random offsets. The file has
+// just been written, so both mostly measure the page cache.
+int
+main(int argc, char **argv)
+{
+  unsigned long i, n = bench_iterations(argc, argv, 5000);
+  uint64_t start, total = 0;
+  ssize_t nread;
+  off_t off;
+  int fd;
+
+  if ((fd = open(FILE_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    bench_die(FILE_NAME);
+
+  for (total = 0; total < FILE_SIZE; total += SEQ_CHUNK)
+    if (write(fd, buf, SEQ_CHUNK) != SEQ_CHUNK)
+      bench_die("write");
+  fsync(fd);
+
+  lseek(fd, 0, SEEK_SET);
+  total = 0;
+
+  start = bench_now();
+  while ((nread = read(fd, buf, SEQ_CHUNK)) > 0)
+    total += nread;
+  if (nread < 0)
+    bench_die("read");
+  bench_report_bandwidth("read_sequential", start, total);
+
+  srand(1);
+
+  start = bench_now();
+  for (i = 0; i < n; i++) {
+    off = (off_t) (rand() % (FILE_SIZE / RAND_CHUNK)) * RAND_CHUNK;
+    if (pread(fd, buf, RAND_CHUNK, off) != RAND_CHUNK)
+      bench_die("pread");
+  }
+  bench_report_latency("read_random", start, n);
+
+  close(fd);
+  unlink(FILE_NAME);
+
+  return 0;
+}
@@ -0,0 +1,30 @@
+#include <sys/stat.h>
+
+#include "bench.h"
+
+static const char *const paths[] = {
+  "/bin/sh",
+  "/usr/lib/libc.a",
+  "/dev/tty0",
+  "/bench/stat",
+};
+
+#define NPATHS  (sizeof(paths) / sizeof(paths[0]))
+
+// Measure path lookups by calling stat() on a few existing files over and
+// over
+int
+main(int argc, char **argv)
+{
+  unsigned long i, n = bench_iterations(argc, argv, 20000);
+  struct stat st;
+  uint64_t start;
+
+  start = bench_now();
+  for (i = 0; i < n; i++)
+    if (stat(paths[i % NPATHS], &st) < 0)
+      bench_die(paths[i % NPATHS]);
+  bench_report_latency("stat", start, n);
+
+  return 0;
+}
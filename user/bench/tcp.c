@@ -0,0 +1,77 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define TCP_PORT    5002
+#define TCP_CHUNK   (32 * 1024)
+#define TCP_TOTAL   (8 * 1024 * 1024)
+
+static char buf[TCP_CHUNK];
+
+// Stream data from a child process to the parent over a loopback TCP
+// connection
+int
+main(void)
+{
+  struct sockaddr_in addr;
+  uint64_t start, total = 0;
+  int listenfd, fd, opt = 1;
+  ssize_t nread;
+  pid_t pid;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(TCP_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    bench_die("socket");
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    bench_die("bind");
+  if (listen(listenfd, 1) < 0)
+    bench_die("listen");
+
+  if ((pid = fork()) < 0)
+    bench_die("fork");
+
+  if (pid == 0) {
+    size_t left;
+    ssize_t nwritten;
+
+    close(listenfd);
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+      _exit(1);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+      _exit(1);
+
+    for (left = TCP_TOTAL; left > 0; left -= nwritten)
+      if ((nwritten = write(fd, buf, left < TCP_CHUNK ? left : TCP_CHUNK)) < 0)
+        _exit(1);
+
+    close(fd);
+    _exit(0);
+  }
+
+  if ((fd = accept(listenfd, NULL, NULL)) < 0)
+    bench_die("accept");
+
+  start = bench_now();
+  while ((nread = read(fd, buf, sizeof(buf))) > 0)
+    total += nread;
+  if (nread < 0)
+    bench_die("read");
+  bench_report_bandwidth("tcp_loopback", start, total);
+
+  close(fd);
+  close(listenfd);
+  waitpid(pid, NULL, 0);
+
+  return 0;
+}
@@ -0,0 +1,39 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define KMSG_PATH   "/dev/kmsg"
+
+static char buf[4096];
+
+// Print the kernel messages still kept in the log
+int
+main(void)
+{
+  ssize_t nread, nwritten, off;
+  int fd;
+
+  if ((fd = open(KMSG_PATH, O_RDONLY)) < 0) {
+    perror(KMSG_PATH);
+    exit(EXIT_FAILURE);
+  }
+
+  while ((nread = read(fd, buf, sizeof(buf))) > 0) {
+    for (off = 0; off < nread; off += nwritten) {
+      if ((nwritten = write(1, buf + off, nread - off)) < 0) {
+        perror("write");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (nread < 0) {
+    perror(KMSG_PATH);
+    exit(EXIT_FAILURE);
+  }
+
+  close(fd);
+
+  return 0;
+}
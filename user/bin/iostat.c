@@ -0,0 +1,175 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/iostat.h>
+#include <unistd.h>
+
+#define IOSTAT_PATH   "/dev/iostat"
+
+#define DEVICES_MAX   8
+
+struct snapshot {
+  struct iostat devices[DEVICES_MAX];
+  int           ndevices;
+};
+
+static struct snapshot snapshots[2];
+
+static void
+take(struct snapshot *s)
+{
+  ssize_t nread, total;
+  int fd;
+
+  if ((fd = open(IOSTAT_PATH, O_RDONLY)) < 0) {
+    perror(IOSTAT_PATH);
+    exit(EXIT_FAILURE);
+  }
+
+  total = 0;
+  while ((size_t) total < sizeof(s->devices)) {
+    nread = read(fd, (char *) s->devices + total,
+                 sizeof(s->devices) - total);
+    if (nread < 0) {
+      perror(IOSTAT_PATH);
+      exit(EXIT_FAILURE);
+    }
+    if (nread == 0)
+      break;
+    total += nread;
+  }
+
+  close(fd);
+
+  s->ndevices = total / sizeof(struct iostat);
+}
+
+static void
+show_hist(const char *title, const uint32_t *hist, const uint32_t *prev)
+{
+  int k;
+
+  printf("  %s\n", title);
+
+  for (k = 0; k < IOSTAT_BUCKETS; k++) {
+    uint32_t count = hist[k] - (prev ? prev[k] : 0);
+
+    if (count != 0)
+      printf("  %10lu .. %-10lu %10lu\n", (k == 0) ? 0UL : 1UL << k,
+             (2UL << k) - 1, (unsigned long) count);
+  }
+}
+
+// Show the totals since boot if there is no previous snapshot, otherwise the
+// rates over the interval of `delay` seconds
+static void
+show(struct snapshot *prev, struct snapshot *s, int delay, int histograms)
+{
+  int i;
+
+  if (prev == NULL)
+    printf("%-8s %8s %8s %10s %10s %7s %7s %8s %8s %5s\n",
+           "device", "reads", "writes", "read kB", "write kB", "rmerge",
+           "wmerge", "wait ms", "svc ms", "queue");
+  else
+    printf("%-8s %8s %8s %10s %10s %7s %7s %8s %8s %5s\n",
+           "device", "r/s", "w/s", "rkB/s", "wkB/s", "rmrg/s",
+           "wmrg/s", "wait ms", "util %", "queue");
+
+  for (i = 0; i < s->ndevices; i++) {
+    struct iostat *d = &s->devices[i];
+    struct iostat *p = NULL;
+    struct iostat zero;
+    unsigned long ios, div;
+    int j;
+
+    if (prev != NULL)
+      for (j = 0; j < prev->ndevices; j++)
+        if (prev->devices[j].dev == d->dev)
+          p = &prev->devices[j];
+
+    if (p == NULL) {
+      memset(&zero, 0, sizeof(zero));
+      p = &zero;
+    }
+
+    ios = (d->reads - p->reads) + (d->writes - p->writes);
+    div = (prev != NULL) ? (unsigned long) delay : 1;
+
+    printf("%-8.*s %8lu %8lu %10llu %10llu %7lu %7lu %8llu ",
+           IOSTAT_NAME_MAX, d->name,
+           (unsigned long) (d->reads - p->reads) / div,
+           (unsigned long) (d->writes - p->writes) / div,
+           (unsigned long long) (d->read_sectors - p->read_sectors)
+             * IOSTAT_SECTOR / 1024 / div,
+           (unsigned long long) (d->write_sectors - p->write_sectors)
+             * IOSTAT_SECTOR / 1024 / div,
+           (unsigned long) (d->read_merges - p->read_merges) / div,
+           (unsigned long) (d->write_merges - p->write_merges) / div,
+           ios ? (unsigned long long) (d->wait_ms - p->wait_ms) / ios : 0ULL);
+
+    if (prev == NULL)
+      printf("%8llu ", ios
+             ? (unsigned long long) (d->service_ms - p->service_ms) / ios
+             : 0ULL);
+    else
+      printf("%8llu ", (unsigned long long) (d->service_ms - p->service_ms)
+             / (10 * div));
+
+    printf("%2lu/%-2lu\n", (unsigned long) d->queued,
+           (unsigned long) d->max_queued);
+
+    if (!histograms)
+      continue;
+
+    show_hist("wait (ms)", d->wait_hist, (p != &zero) ? p->wait_hist : NULL);
+    show_hist("service (ms)", d->service_hist,
+              (p != &zero) ? p->service_hist : NULL);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int delay = 0, iterations = 0, histograms = 0;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "hd:n:")) != -1) {
+    switch (opt) {
+    case 'h':
+      histograms = 1;
+      break;
+    case 'd':
+      delay = atoi(optarg);
+      break;
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-h] [-d delay [-n iterations]]\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  take(&snapshots[0]);
+  show(NULL, &snapshots[0], delay, histograms);
+
+  if (delay <= 0)
+    return 0;
+
+  for (i = 1; (iterations <= 0) || (i < iterations); i++) {
+    struct snapshot *s    = &snapshots[i % 2];
+    struct snapshot *prev = &snapshots[(i - 1) % 2];
+
+    sleep(delay);
+
+    take(s);
+    printf("\n");
+    show(prev, s, delay, histograms);
+    fflush(stdout);
+  }
+
+  return 0;
+}
@@ -4,12 +4,10 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
-static char name[256];
 static char datebuf[256];
 
 int
@@ -30,13 +28,10 @@ main(int argc, char **argv)
     struct stat st;
     const char *color;
 
-    // TODO: check boundaries!
-    strcat(name, dirname);
-    strcat(name, "/");
-    strcat(name, de->d_name);
-
-    if (stat(name, &st) < 0) {
-      perror(name);
+    // Look the entry up in the open directory instead of walking the full
+    // path again
+    if (fstatat(__dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+      perror(de->d_name);
       closedir(dir);
       exit(EXIT_FAILURE);
     }
@@ -74,8 +69,6 @@ main(int argc, char **argv)
     strftime(datebuf, 256, "%b %d %H:%M", gmtime(&st.st_mtime));
     printf(" %s", datebuf);
     printf(" \x1b[%sm%s\x1b[m\n", color, de->d_name);
-
-    name[0] = '\0';
   }
 
   if (errno) {
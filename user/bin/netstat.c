@@ -0,0 +1,67 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define NETSTAT_PATH  "/dev/netstat"
+
+// The kernel generates at most this much text
+#define BUF_SIZE      8192
+char buf[BUF_SIZE];
+
+static void
+show(void)
+{
+  ssize_t nread, total;
+  int fd;
+
+  if ((fd = open(NETSTAT_PATH, O_RDONLY)) < 0) {
+    perror(NETSTAT_PATH);
+    exit(EXIT_FAILURE);
+  }
+
+  // Fetch the whole snapshot before printing anything, so that all of the
+  // counters come from the same moment
+  total = 0;
+  while ((nread = read(fd, buf + total, BUF_SIZE - total)) != 0) {
+    if (nread < 0) {
+      perror(NETSTAT_PATH);
+      close(fd);
+      exit(EXIT_FAILURE);
+    }
+    total += nread;
+    if (total == BUF_SIZE)
+      break;
+  }
+
+  close(fd);
+
+  if (write(1, buf, total) != total) {
+    perror("netstat");
+    exit(EXIT_FAILURE);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int interval;
+
+  if (argc > 2) {
+    fprintf(stderr, "usage: %s [interval]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  interval = argc < 2 ? 0 : atoi(argv[1]);
+
+  show();
+
+  while (interval > 0) {
+    sleep(interval);
+    printf("\n");
+    fflush(stdout);
+    show();
+  }
+
+  return 0;
+}
@@ -1,19 +1,57 @@
 #include <netinet/in.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/evloop.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
+#define HANDLER_STACK_SIZE	16384
+
+static void
+handle_connection(void *arg)
+{
+	int connfd = (int) (intptr_t) arg;
+	char sendBuff[1025];
+	time_t ticks;
+
+	ticks = time(NULL);
+	snprintf(sendBuff, sizeof(sendBuff), "%.24s\r\n", ctime(&ticks));
+
+	if (ev_task_write(connfd, sendBuff, strlen(sendBuff)) < 0)
+		perror("write");
+
+	close(connfd);
+}
+
+static void
+accept_connections(void *arg)
+{
+	struct evloop *loop = ev_task_loop();
+	int listenfd = (int) (intptr_t) arg;
+	int connfd;
+
+	while ((connfd = ev_task_accept(listenfd, NULL, NULL)) >= 0) {
+		if ((evloop_set_nonblock(connfd) < 0) ||
+		    (ev_task_spawn(loop, handle_connection, (void *) (intptr_t) connfd,
+		                   HANDLER_STACK_SIZE) < 0)) {
+			perror("connection");
+			close(connfd);
+		}
+	}
+
+	perror("accept");
+	evloop_stop(loop);
+}
+
 int
 main(int argc, char *argv[])
 {
-	int listenfd = 0, connfd = 0;
+	int listenfd = 0;
 	struct sockaddr_in serv_addr;
-
-	char sendBuff[1025];
-	time_t ticks;
+	struct evloop *loop;
 
 	(void) argc;
 	(void) argv;
@@ -24,7 +62,6 @@ main(int argc, char *argv[])
 	}
 
 	memset(&serv_addr, '0', sizeof(serv_addr));
-	memset(sendBuff, '0', sizeof(sendBuff));
 
 	serv_addr.sin_family = AF_INET;
 	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -40,19 +77,28 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	while(1)
-	{
-		if ((connfd = accept(listenfd, (struct sockaddr*)NULL, NULL)) < 0) {
-			perror("accept");
-			exit(1);
-		}
+	if (evloop_set_nonblock(listenfd) < 0) {
+		perror("fcntl");
+		exit(1);
+	}
 
-		ticks = time(NULL);
-		snprintf(sendBuff, sizeof(sendBuff), "%.24s\r\n", ctime(&ticks));
+	// One process serves all connections, each in a task of its own
+	if ((loop = evloop_create()) == NULL) {
+		perror("evloop_create");
+		exit(1);
+	}
 
-		if (write(connfd, sendBuff, strlen(sendBuff)) < 0)
-			perror("write");
+	if (ev_task_spawn(loop, accept_connections, (void *) (intptr_t) listenfd,
+	                  0) < 0) {
+		perror("ev_task_spawn");
+		exit(1);
+	}
 
-		close(connfd);
+	if (evloop_run(loop) < 0) {
+		perror("evloop_run");
+		exit(1);
 	}
+
+	evloop_destroy(loop);
+	return 1;
 }
@@ -13,8 +13,13 @@ struct Cmd;
 
 static struct Cmd *cmd_parse(char *);
 static void        cmd_run(const struct Cmd *);
+static void        cmd_run_child(const struct Cmd *);
 static void        cmd_free(struct Cmd *);
 
+static const char *hash_lookup(const char *);
+static void        hash_forget(const char *);
+static void        hash_clear(void);
+
 #define MAXBUF  1024
 static char buf[MAXBUF];
 static char cwd[PATH_MAX];
@@ -133,22 +138,363 @@ builtin_export(int argc, char **argv)
     perror("setenv");
     return EXIT_FAILURE;
   }
+
+  // The remembered locations may be wrong for the new search path
+  if (strcmp(argv[1], "PATH") == 0)
+    hash_clear();
   
   return 0;
 }
 
+static int
+builtin_echo(int argc, char **argv)
+{
+  int i, newline = 1;
+
+  if ((argc > 1) && (strcmp(argv[1], "-n") == 0)) {
+    newline = 0;
+    argv++;
+    argc--;
+  }
+
+  for (i = 1; i < argc; i++) {
+    if (i > 1)
+      putchar(' ');
+    fputs(argv[i], stdout);
+  }
+
+  if (newline)
+    putchar('\n');
+
+  return 0;
+}
+
+static int
+builtin_pwd(int argc, char **argv)
+{
+  (void) argc;
+  (void) argv;
+
+  printf("%s\n", cwd);
+
+  return 0;
+}
+
+static int
+test_unary(const char *op, const char *arg)
+{
+  struct stat st;
+
+  if (strcmp(op, "-n") == 0)
+    return arg[0] != '\0';
+  if (strcmp(op, "-z") == 0)
+    return arg[0] == '\0';
+
+  if (strcmp(op, "-r") == 0)
+    return access(arg, R_OK) == 0;
+  if (strcmp(op, "-w") == 0)
+    return access(arg, W_OK) == 0;
+  if (strcmp(op, "-x") == 0)
+    return access(arg, X_OK) == 0;
+
+  if ((op[0] != '-') || (strchr("edfs", op[1]) == NULL) || (op[2] != '\0'))
+    return -1;
+
+  if (stat(arg, &st) != 0)
+    return 0;
+
+  switch (op[1]) {
+  case 'd':
+    return S_ISDIR(st.st_mode);
+  case 'f':
+    return S_ISREG(st.st_mode);
+  case 's':
+    return st.st_size > 0;
+  default:
+    return 1;
+  }
+}
+
+static int
+test_binary(const char *arg1, const char *op, const char *arg2)
+{
+  long n1, n2;
+
+  if (strcmp(op, "=") == 0)
+    return strcmp(arg1, arg2) == 0;
+  if (strcmp(op, "!=") == 0)
+    return strcmp(arg1, arg2) != 0;
+
+  n1 = strtol(arg1, NULL, 10);
+  n2 = strtol(arg2, NULL, 10);
+
+  if (strcmp(op, "-eq") == 0)
+    return n1 == n2;
+  if (strcmp(op, "-ne") == 0)
+    return n1 != n2;
+  if (strcmp(op, "-lt") == 0)
+    return n1 < n2;
+  if (strcmp(op, "-le") == 0)
+    return n1 <= n2;
+  if (strcmp(op, "-gt") == 0)
+    return n1 > n2;
+  if (strcmp(op, "-ge") == 0)
+    return n1 >= n2;
+
+  return -1;
+}
+
+static int
+builtin_test(int argc, char **argv)
+{
+  const char *name = argv[0];
+  int negate = 0, r;
+
+  if (strcmp(name, "[") == 0) {
+    if (strcmp(argv[argc - 1], "]") != 0) {
+      fprintf(stderr, "%s: missing ]\n", name);
+      return 2;
+    }
+    argc--;
+  }
+
+  argv++;
+  argc--;
+
+  if ((argc > 0) && (strcmp(argv[0], "!") == 0)) {
+    negate = 1;
+    argv++;
+    argc--;
+  }
+
+  switch (argc) {
+  case 0:
+    r = 0;
+    break;
+  case 1:
+    r = argv[0][0] != '\0';
+    break;
+  case 2:
+    r = test_unary(argv[0], argv[1]);
+    break;
+  case 3:
+    r = test_binary(argv[0], argv[1], argv[2]);
+    break;
+  default:
+    r = -1;
+    break;
+  }
+
+  if (r < 0) {
+    fprintf(stderr, "%s: syntax error\n", name);
+    return 2;
+  }
+
+  return (r != negate) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int builtin_hash(int, char **);
+
 struct BuiltinCmd {
   const char  *name;
   int        (*func)(int, char **);
 };
 
 static struct BuiltinCmd builtins[] = {
+  { "[",      builtin_test   },
   { "cd",     builtin_cd     },
+  { "echo",   builtin_echo   },
   { "export", builtin_export },
+  { "hash",   builtin_hash   },
+  { "pwd",    builtin_pwd    },
+  { "test",   builtin_test   },
 };
 
 #define NBUILTINS   (sizeof(builtins) / sizeof(builtins[0]))
 
+static struct BuiltinCmd *
+builtin_lookup(const char *name)
+{
+  struct BuiltinCmd *builtin;
+
+  for (builtin = builtins; builtin < &builtins[NBUILTINS]; builtin++)
+    if (strcmp(name, builtin->name) == 0)
+      return builtin;
+
+  return NULL;
+}
+
+/*
+ * Command hash table. The location of each command is searched for in PATH
+ * only the first time it is run, like the "hash" builtin of other shells.
+ */
+
+#define NHASH   31
+
+struct HashEntry {
+  struct HashEntry *next;
+  char             *name;
+  char             *path;
+};
+
+static struct HashEntry *hash_table[NHASH];
+
+static unsigned
+hash_key(const char *name)
+{
+  unsigned h = 0;
+
+  while (*name != '\0')
+    h = h * 31 + (unsigned char) *name++;
+
+  return h % NHASH;
+}
+
+static int
+hash_is_command(const char *path)
+{
+  struct stat st;
+
+  return (stat(path, &st) == 0) && S_ISREG(st.st_mode) &&
+         (access(path, X_OK) == 0);
+}
+
+static const char *
+hash_lookup(const char *name)
+{
+  static const char *default_path = "/bin:/usr/bin";
+
+  struct HashEntry *entry;
+  char path[PATH_MAX];
+  const char *dir, *end;
+  unsigned key;
+
+  // Paths are never searched for
+  if (strchr(name, '/') != NULL)
+    return name;
+
+  key = hash_key(name);
+  for (entry = hash_table[key]; entry != NULL; entry = entry->next)
+    if (strcmp(entry->name, name) == 0)
+      return entry->path;
+
+  if ((dir = getenv("PATH")) == NULL)
+    dir = default_path;
+
+  for ( ; ; dir = end + 1) {
+    int n;
+
+    if ((end = strchr(dir, ':')) == NULL)
+      end = dir + strlen(dir);
+
+    // An empty entry stands for the current directory
+    n = snprintf(path, sizeof(path), "%.*s/%s",
+                 (end > dir) ? (int) (end - dir) : 1,
+                 (end > dir) ? dir : ".",
+                 name);
+
+    if ((n < (int) sizeof(path)) && hash_is_command(path))
+      break;
+
+    if (*end == '\0')
+      return NULL;
+  }
+
+  if ((entry = malloc(sizeof(*entry))) == NULL)
+    return NULL;
+
+  if (((entry->name = strdup(name)) == NULL) ||
+      ((entry->path = strdup(path)) == NULL)) {
+    free(entry->name);
+    free(entry);
+    return NULL;
+  }
+
+  entry->next = hash_table[key];
+  hash_table[key] = entry;
+
+  return entry->path;
+}
+
+// Remove a location that turned out to be wrong
+static void
+hash_forget(const char *name)
+{
+  struct HashEntry **prev, *entry;
+
+  for (prev = &hash_table[hash_key(name)]; (entry = *prev) != NULL; ) {
+    if (strcmp(entry->name, name) == 0) {
+      *prev = entry->next;
+
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+    } else {
+      prev = &entry->next;
+    }
+  }
+}
+
+static void
+hash_clear(void)
+{
+  struct HashEntry *entry;
+  unsigned i;
+
+  for (i = 0; i < NHASH; i++) {
+    while ((entry = hash_table[i]) != NULL) {
+      hash_table[i] = entry->next;
+
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+    }
+  }
+}
+
+static int
+builtin_hash(int argc, char **argv)
+{
+  struct HashEntry *entry;
+  int i, r = 0;
+
+  if (argc < 2) {
+    for (i = 0; i < NHASH; i++)
+      for (entry = hash_table[i]; entry != NULL; entry = entry->next)
+        printf("%s\n", entry->path);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "-r") == 0) {
+    hash_clear();
+    return 0;
+  }
+
+  for (i = 1; i < argc; i++) {
+    if ((builtin_lookup(argv[i]) == NULL) && (hash_lookup(argv[i]) == NULL)) {
+      fprintf(stderr, "%s: %s: not found\n", argv[0], argv[i]);
+      r = EXIT_FAILURE;
+    }
+  }
+
+  return r;
+}
+
+// Replace the current process with an external command
+static void
+cmd_exec(const struct ExecCmd *ecmd)
+{
+  const char *path;
+
+  if ((path = hash_lookup(ecmd->argv[0])) == NULL) {
+    fprintf(stderr, "%s: not found\n", ecmd->argv[0]);
+    return;
+  }
+
+  execv(path, ecmd->argv);
+  perror(ecmd->argv[0]);
+}
+
 int
 main(void)
 {
@@ -193,20 +539,31 @@ cmd_run(const struct Cmd * cmd)
   case CMD_EXEC:
     ecmd = (struct ExecCmd *) cmd;
 
-    for (builtin = builtins; builtin < &builtins[NBUILTINS]; builtin++)
-      if (strcmp(ecmd->argv[0], builtin->name) == 0) {
-        builtin->func(ecmd->argc, ecmd->argv);
-        return;
-      }
+    if ((builtin = builtin_lookup(ecmd->argv[0])) != NULL) {
+      builtin->func(ecmd->argc, ecmd->argv);
+      fflush(stdout);
+      return;
+    }
 
-    if ((pid = fork()) == 0) {
-      execvp(ecmd->argv[0], ecmd->argv);
-      perror(ecmd->argv[0]);
-      exit(1);
+    // Look the command up before vfork(), so that the hash table is updated
+    // in this process rather than in the child sharing its memory
+    if (hash_lookup(ecmd->argv[0]) == NULL) {
+      fprintf(stderr, "%s: not found\n", ecmd->argv[0]);
+      return;
+    }
+
+    // The child only execs, so there is no need to copy the address space
+    if ((pid = vfork()) == 0) {
+      cmd_exec(ecmd);
+      _exit(127);
     } else if (pid > 0) {
       waitpid(pid, &status, 0);
+
+      // The command may have been removed since it was looked up
+      if (WIFEXITED(status) && (WEXITSTATUS(status) == 127))
+        hash_forget(ecmd->argv[0]);
     } else {
-      perror("fork");
+      perror("vfork");
     }
     break;
 
@@ -214,8 +571,7 @@ cmd_run(const struct Cmd * cmd)
     bcmd = (struct BgCmd *) cmd;
 
     if ((pid = fork()) == 0) {
-      cmd_run(bcmd->cmd);
-      exit(0);
+      cmd_run_child(bcmd->cmd);
     } else if (pid < 0) {
       perror("fork");
     }
@@ -246,8 +602,7 @@ cmd_run(const struct Cmd * cmd)
         exit(1);
       }
 
-      cmd_run(rcmd->cmd);
-      exit(0);
+      cmd_run_child(rcmd->cmd);
     } else if (pid > 0) {
       waitpid(pid, &status, 0);
     } else {
@@ -270,8 +625,7 @@ cmd_run(const struct Cmd * cmd)
       close(fildes[0]);
       close(fildes[1]);
 
-      cmd_run(pcmd->left);
-      exit(0);
+      cmd_run_child(pcmd->left);
     } else if (pid < 0) {
       perror("fork");
       return;
@@ -284,8 +638,7 @@ cmd_run(const struct Cmd * cmd)
       close(fildes[0]);
       close(fildes[1]);
 
-      cmd_run(pcmd->right);
-      exit(0);
+      cmd_run_child(pcmd->right);
     } else if (pid2 < 0) {
       perror("fork");
       waitpid(pid, &status, 0);
@@ -302,6 +655,28 @@ cmd_run(const struct Cmd * cmd)
   }
 }
 
+// Run a command in a child process that exits afterwards. An external
+// command replaces the child instead of being started in yet another process.
+static void
+cmd_run_child(const struct Cmd *cmd)
+{
+  struct ExecCmd *ecmd;
+  struct BuiltinCmd *builtin;
+
+  if (cmd->type != CMD_EXEC) {
+    cmd_run(cmd);
+    exit(0);
+  }
+
+  ecmd = (struct ExecCmd *) cmd;
+
+  if ((builtin = builtin_lookup(ecmd->argv[0])) != NULL)
+    exit(builtin->func(ecmd->argc, ecmd->argv));
+
+  cmd_exec(ecmd);
+  exit(127);
+}
+
 static struct Cmd *
 cmd_null_terminate(struct Cmd *cmd)
 {
@@ -0,0 +1,241 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/sysstat.h>
+#include <unistd.h>
+
+#define SYSSTAT_PATH  "/dev/sysstat"
+
+static const char *const names[SYSSTAT_MAX] = {
+  [__SYS_TEST]          = "test",
+  [__SYS_FORK]          = "fork",
+  [__SYS_EXEC]          = "exec",
+  [__SYS_WAIT]          = "wait",
+  [__SYS_EXIT]          = "exit",
+  [__SYS_ALARM]         = "alarm",
+  [__SYS_GETPID]        = "getpid",
+  [__SYS_GETPPID]       = "getppid",
+  [__SYS_GETDENTS]      = "getdents",
+  [__SYS_CHDIR]         = "chdir",
+  [__SYS_FCHDIR]        = "fchdir",
+  [__SYS_OPEN]          = "open",
+  [__SYS_FCNTL]         = "fcntl",
+  [__SYS_SEEK]          = "seek",
+  [__SYS_UMASK]         = "umask",
+  [__SYS_LINK]          = "link",
+  [__SYS_MKNOD]         = "mknod",
+  [__SYS_UNLINK]        = "unlink",
+  [__SYS_RMDIR]         = "rmdir",
+  [__SYS_STAT]          = "stat",
+  [__SYS_CLOSE]         = "close",
+  [__SYS_READ]          = "read",
+  [__SYS_WRITE]         = "write",
+  [__SYS_SBRK]          = "sbrk",
+  [__SYS_UNAME]         = "uname",
+  [__SYS_CHMOD]         = "chmod",
+  [__SYS_FCHMOD]        = "fchmod",
+  [__SYS_CLOCK_TIME]    = "clock_time",
+  [__SYS_SOCKET]        = "socket",
+  [__SYS_BIND]          = "bind",
+  [__SYS_LISTEN]        = "listen",
+  [__SYS_CONNECT]       = "connect",
+  [__SYS_ACCEPT]        = "accept",
+  [__SYS_SIGPROCMASK]   = "sigprocmask",
+  [__SYS_KILL]          = "kill",
+  [__SYS_SIGACTION]     = "sigaction",
+  [__SYS_SIGRETURN]     = "sigreturn",
+  [__SYS_SIGPENDING]    = "sigpending",
+  [__SYS_NANOSLEEP]     = "nanosleep",
+  [__SYS_SENDTO]        = "sendto",
+  [__SYS_RECVFROM]      = "recvfrom",
+  [__SYS_SETSOCKOPT]    = "setsockopt",
+  [__SYS_GETUID]        = "getuid",
+  [__SYS_GETEUID]       = "geteuid",
+  [__SYS_GETGID]        = "getgid",
+  [__SYS_GETEGID]       = "getegid",
+  [__SYS_GETPGID]       = "getpgid",
+  [__SYS_SETUID]        = "setuid",
+  [__SYS_SETEUID]       = "seteuid",
+  [__SYS_SETGID]        = "setgid",
+  [__SYS_SETEGID]       = "setegid",
+  [__SYS_SETPGID]       = "setpgid",
+  [__SYS_ACCESS]        = "access",
+  [__SYS_PIPE]          = "pipe",
+  [__SYS_IOCTL]         = "ioctl",
+  [__SYS_MMAP]          = "mmap",
+  [__SYS_MPROTECT]      = "mprotect",
+  [__SYS_MUNMAP]        = "munmap",
+  [__SYS_SELECT]        = "select",
+  [__SYS_SIGSUSPEND]    = "sigsuspend",
+  [__SYS_GETHOSTBYNAME] = "gethostbyname",
+  [__SYS_FSYNC]         = "fsync",
+  [__SYS_FTRUNCATE]     = "ftruncate",
+  [__SYS_FCHOWN]        = "fchown",
+  [__SYS_READLINK]      = "readlink",
+  [__SYS_TIMES]         = "times",
+  [__SYS_MOUNT]         = "mount",
+  [__SYS_SETITIMER]     = "setitimer",
+  [__SYS_SYNC]          = "sync",
+  [__SYS_SPLICE]        = "splice",
+  [__SYS_TEE]           = "tee",
+  [__SYS_SENDFILE]      = "sendfile",
+  [__SYS_POLL]          = "poll",
+  [__SYS_EPOLL_CREATE]  = "epoll_create",
+  [__SYS_EPOLL_CTL]     = "epoll_ctl",
+  [__SYS_EPOLL_WAIT]    = "epoll_wait",
+  [__SYS_READV]         = "readv",
+  [__SYS_WRITEV]        = "writev",
+  [__SYS_PREAD]         = "pread",
+  [__SYS_PWRITE]        = "pwrite",
+  [__SYS_PREADV]        = "preadv",
+  [__SYS_PWRITEV]       = "pwritev",
+  [__SYS_GETSOCKOPT]    = "getsockopt",
+  [__SYS_CLONE]         = "clone",
+  [__SYS_THREAD_EXIT]   = "thread_exit",
+  [__SYS_FUTEX]         = "futex",
+  [__SYS_SCHED_YIELD]   = "sched_yield",
+  [__SYS_RING_ENTER]    = "ring_enter",
+  [__SYS_PERF_CTL]      = "perf_ctl",
+  [__SYS_MSYNC]         = "msync",
+  [__SYS_MADVISE]       = "madvise",
+  [__SYS_FSTATAT]       = "fstatat",
+  [__SYS_CHANNEL_CREATE]  = "channel_create",
+  [__SYS_CHANNEL_DESTROY] = "channel_destroy",
+  [__SYS_CONNECT_ATTACH]  = "connect_attach",
+  [__SYS_CONNECT_DETACH]  = "connect_detach",
+  [__SYS_MSG_SEND]      = "msg_send",
+  [__SYS_MSG_RECEIVE]   = "msg_receive",
+  [__SYS_MSG_REPLY]     = "msg_reply",
+  [__SYS_SCHED_SETSCHEDULER]    = "sched_setscheduler",
+  [__SYS_SCHED_GETSCHEDULER]    = "sched_getscheduler",
+  [__SYS_SCHED_GETPARAM]        = "sched_getparam",
+  [__SYS_SCHED_RR_GET_INTERVAL] = "sched_rr_get_interval",
+  [__SYS_SCHED_SETAFFINITY]     = "sched_setaffinity",
+  [__SYS_SCHED_GETAFFINITY]     = "sched_getaffinity",
+};
+
+static struct sysstat stats[SYSSTAT_MAX];
+static int order[SYSSTAT_MAX];
+
+static void
+control(const char *cmd)
+{
+  int fd;
+
+  if ((fd = open(SYSSTAT_PATH, O_WRONLY)) < 0) {
+    perror(SYSSTAT_PATH);
+    exit(EXIT_FAILURE);
+  }
+
+  if (write(fd, cmd, strlen(cmd)) < 0) {
+    perror(SYSSTAT_PATH);
+    exit(EXIT_FAILURE);
+  }
+
+  close(fd);
+}
+
+// Sort by the time spent, the calls that dominate the workload come first
+static int
+compare(const void *a, const void *b)
+{
+  uint64_t ca = stats[*(const int *) a].cycles;
+  uint64_t cb = stats[*(const int *) b].cycles;
+
+  return (ca < cb) - (ca > cb);
+}
+
+static void
+show(int histograms)
+{
+  ssize_t nread, total;
+  int fd, i, k;
+
+  if ((fd = open(SYSSTAT_PATH, O_RDONLY)) < 0) {
+    perror(SYSSTAT_PATH);
+    exit(EXIT_FAILURE);
+  }
+
+  total = 0;
+  while ((size_t) total < sizeof(stats)) {
+    nread = read(fd, (char *) stats + total, sizeof(stats) - total);
+    if (nread < 0) {
+      perror(SYSSTAT_PATH);
+      exit(EXIT_FAILURE);
+    }
+    if (nread == 0)
+      break;
+    total += nread;
+  }
+
+  close(fd);
+
+  for (i = 0; i < SYSSTAT_MAX; i++)
+    order[i] = i;
+  qsort(order, SYSSTAT_MAX, sizeof(order[0]), compare);
+
+  printf("%-14s %10s %10s %14s %10s\n",
+         "syscall", "calls", "migrated", "cycles", "avg");
+
+  for (i = 0; i < SYSSTAT_MAX; i++) {
+    struct sysstat *stat = &stats[order[i]];
+    uint32_t measured = stat->calls - stat->migrated;
+    char num[16];
+    const char *name = names[order[i]];
+
+    if (stat->calls == 0)
+      continue;
+
+    if (name == NULL) {
+      snprintf(num, sizeof(num), "#%d", order[i]);
+      name = num;
+    }
+
+    printf("%-14s %10lu %10lu %14llu %10llu\n", name,
+           (unsigned long) stat->calls, (unsigned long) stat->migrated,
+           (unsigned long long) stat->cycles,
+           measured ? (unsigned long long) stat->cycles / measured : 0ULL);
+
+    if (!histograms)
+      continue;
+
+    for (k = 0; k < SYSSTAT_BUCKETS; k++)
+      if (stat->hist[k] != 0)
+        printf("  %10lu .. %-10lu %10lu\n", 1UL << k,
+               (k < 31) ? (2UL << k) - 1 : ~0UL,
+               (unsigned long) stat->hist[k]);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int histograms = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hsxc")) != -1) {
+    switch (opt) {
+    case 'h':
+      histograms = 1;
+      break;
+    case 's':
+      control("start");
+      return 0;
+    case 'x':
+      control("stop");
+      return 0;
+    case 'c':
+      control("clear");
+      return 0;
+    default:
+      fprintf(stderr, "usage: %s [-h] [-s | -x | -c]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  show(histograms);
+
+  return 0;
+}
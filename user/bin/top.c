@@ -0,0 +1,236 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CPUSTAT_PATH  "/dev/cpustat"
+
+#define REPORT_SIZE   8192
+#define CPU_MAX       32
+#define PROC_MAX      64
+
+struct cpu {
+  int           id;
+  unsigned long user, system, irq, idle, switches;
+  char          runq[16];
+};
+
+struct proc {
+  int           pid, ppid, uid, threads, policy, priority;
+  char          state;
+  unsigned long utime, stime;
+  unsigned long delta;
+  char          name[32];
+};
+
+struct snapshot {
+  unsigned long long ticks;
+  unsigned      hz;
+  char          load[64];
+  struct cpu    cpus[CPU_MAX];
+  int           ncpus;
+  struct proc   procs[PROC_MAX];
+  int           nprocs;
+};
+
+static char report[REPORT_SIZE + 1];
+static struct snapshot snapshots[2];
+// Sorted copy of the process list, the next update looks processes up by PID
+static struct proc sorted[PROC_MAX];
+
+static const char *policies[] = { "other", "fifo", "rr" };
+
+static void
+take(struct snapshot *s)
+{
+  ssize_t nread, total;
+  char *line, *next;
+  int fd;
+
+  if ((fd = open(CPUSTAT_PATH, O_RDONLY)) < 0) {
+    perror(CPUSTAT_PATH);
+    exit(EXIT_FAILURE);
+  }
+
+  total = 0;
+  while (total < REPORT_SIZE) {
+    nread = read(fd, report + total, REPORT_SIZE - total);
+    if (nread < 0) {
+      perror(CPUSTAT_PATH);
+      exit(EXIT_FAILURE);
+    }
+    if (nread == 0)
+      break;
+    total += nread;
+  }
+  report[total] = '\0';
+
+  close(fd);
+
+  memset(s, 0, sizeof(*s));
+  s->hz = 100;
+
+  for (line = report; *line != '\0'; line = next) {
+    if ((next = strchr(line, '\n')) != NULL)
+      *next++ = '\0';
+    else
+      next = line + strlen(line);
+
+    if (strncmp(line, "ticks ", 6) == 0) {
+      sscanf(line + 6, "%llu %u", &s->ticks, &s->hz);
+    } else if (strncmp(line, "load ", 5) == 0) {
+      strncpy(s->load, line + 5, sizeof(s->load) - 1);
+    } else if ((strncmp(line, "cpu", 3) == 0) && (s->ncpus < CPU_MAX)) {
+      struct cpu *c = &s->cpus[s->ncpus];
+
+      if (sscanf(line + 3, "%d %lu %lu %lu %lu %lu %15s", &c->id, &c->user,
+                 &c->system, &c->irq, &c->idle, &c->switches, c->runq) == 7)
+        s->ncpus++;
+    } else if ((strncmp(line, "proc ", 5) == 0) && (s->nprocs < PROC_MAX)) {
+      struct proc *p = &s->procs[s->nprocs];
+
+      if (sscanf(line + 5, "%d %d %d %c %d %d %d %lu %lu %31s", &p->pid,
+                 &p->ppid, &p->uid, &p->state, &p->threads, &p->policy,
+                 &p->priority, &p->utime, &p->stime, p->name) == 10)
+        s->nprocs++;
+    }
+  }
+}
+
+// The CPU time charged to a process since the previous snapshot
+static unsigned long
+proc_delta(const struct snapshot *prev, const struct proc *p)
+{
+  unsigned long now = p->utime + p->stime;
+  int i;
+
+  if (prev != NULL)
+    for (i = 0; i < prev->nprocs; i++)
+      if (prev->procs[i].pid == p->pid)
+        return now - (prev->procs[i].utime + prev->procs[i].stime);
+
+  return now;
+}
+
+// Busiest processes first
+static int
+compare(const void *a, const void *b)
+{
+  const struct proc *pa = (const struct proc *) a;
+  const struct proc *pb = (const struct proc *) b;
+
+  if (pa->delta != pb->delta)
+    return (pa->delta < pb->delta) - (pa->delta > pb->delta);
+  return pa->pid - pb->pid;
+}
+
+static unsigned long
+percent(unsigned long part, unsigned long whole)
+{
+  return whole ? part * 100 / whole : 0;
+}
+
+static void
+show(const struct snapshot *prev, struct snapshot *s, int nlines)
+{
+  unsigned long elapsed;
+  int i, j;
+
+  elapsed = (unsigned long) (s->ticks - (prev ? prev->ticks : 0));
+
+  printf("load average: %s, %d processes\n", s->load, s->nprocs);
+
+  printf("%-5s %6s %6s %6s %6s %10s %6s\n",
+         "cpu", "user%", "sys%", "irq%", "idle%", "ctxsw/s", "runq");
+
+  for (i = 0; i < s->ncpus; i++) {
+    const struct cpu *c = &s->cpus[i];
+    struct cpu d = *c;
+    unsigned long total;
+
+    if (prev != NULL) {
+      for (j = 0; j < prev->ncpus; j++) {
+        if (prev->cpus[j].id == c->id) {
+          d.user     -= prev->cpus[j].user;
+          d.system   -= prev->cpus[j].system;
+          d.irq      -= prev->cpus[j].irq;
+          d.idle     -= prev->cpus[j].idle;
+          d.switches -= prev->cpus[j].switches;
+        }
+      }
+    }
+
+    total = d.user + d.system + d.irq + d.idle;
+
+    printf("cpu%-2d %6lu %6lu %6lu %6lu %10lu %6s\n", c->id,
+           percent(d.user, total), percent(d.system, total),
+           percent(d.irq, total), percent(d.idle, total),
+           elapsed ? d.switches * s->hz / elapsed : 0, c->runq);
+  }
+
+  for (i = 0; i < s->nprocs; i++)
+    s->procs[i].delta = proc_delta(prev, &s->procs[i]);
+
+  memcpy(sorted, s->procs, s->nprocs * sizeof(sorted[0]));
+  qsort(sorted, s->nprocs, sizeof(sorted[0]), compare);
+
+  printf("\n%5s %5s %5s %c %4s %-5s %4s %5s %9s %s\n",
+         "PID", "PPID", "UID", 'S', "THR", "POL", "PRI", "CPU%", "TIME",
+         "NAME");
+
+  for (i = 0; (i < s->nprocs) && ((nlines <= 0) || (i < nlines)); i++) {
+    const struct proc *p = &sorted[i];
+    unsigned long t = p->utime + p->stime;
+
+    printf("%5d %5d %5d %c %4d %-5s %4d %5lu %6lu.%02lu %s\n",
+           p->pid, p->ppid, p->uid, p->state, p->threads,
+           ((unsigned) p->policy < 3) ? policies[p->policy] : "?",
+           p->priority, percent(p->delta, elapsed),
+           t / s->hz, (t % s->hz) * 100 / s->hz, p->name);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int delay = 3, iterations = 0, nlines = 20;
+  int opt, i, clear;
+
+  while ((opt = getopt(argc, argv, "d:n:l:")) != -1) {
+    switch (opt) {
+    case 'd':
+      delay = atoi(optarg);
+      break;
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    case 'l':
+      nlines = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-d delay] [-n iterations] [-l lines]\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  clear = isatty(1);
+
+  for (i = 0; (iterations <= 0) || (i < iterations); i++) {
+    struct snapshot *s    = &snapshots[i % 2];
+    struct snapshot *prev = (i > 0) ? &snapshots[(i - 1) % 2] : NULL;
+
+    take(s);
+
+    if (clear)
+      printf("\033[H\033[J");
+    show(prev, s, nlines);
+    fflush(stdout);
+
+    if ((iterations <= 0) || (i + 1 < iterations))
+      sleep(delay > 0 ? delay : 1);
+  }
+
+  return 0;
+}
@@ -23,6 +23,40 @@ struct DevFile {
 
 #define NDEV  (sizeof(dev_files) / sizeof(dev_files[0]))
 
+// Present in images built by `make bench`
+#define BENCH_MARKER  "/etc/bench"
+
+// Run the benchmark suite on the system console (which is also connected to
+// the serial port) before starting the shells
+static void
+run_bench(void)
+{
+  pid_t pid;
+
+  if ((pid = fork()) < 0) {
+    perror("fork");
+    return;
+  }
+
+  if (pid == 0) {
+    open(dev_files[0].name, O_RDONLY);
+    open(dev_files[0].name, O_WRONLY);
+    open(dev_files[0].name, O_WRONLY);
+
+    // Let the file system benchmarks use the disk rather than tmpfs
+    if (chdir("/home/root") != 0) {
+      perror("chdir");
+      exit(EXIT_FAILURE);
+    }
+
+    execl("/bench/bench", "/bench/bench", NULL);
+    perror("/bench/bench");
+    exit(EXIT_FAILURE);
+  }
+
+  waitpid(pid, NULL, 0);
+}
+
 int
 main(void)
 {
@@ -39,7 +73,18 @@ main(void)
 
   // Mount devfs
   mkdir("/dev", 0755);
-  mount("devfs", "/dev");
+  mount("devfs", "/dev", MNT_NOATIME);
+
+  // Kernel statistics
+  mkdir("/proc", 0555);
+  mount("procfs", "/proc", MNT_NOATIME);
+
+  // Keep temporary files in memory
+  mount("tmpfs", "/tmp", 0);
+
+  // POSIX shared memory objects (see shm_open)
+  mkdir("/dev/shm", 01777);
+  mount("tmpfs", "/dev/shm", 0);
 
   open("/etc/passwd", O_WRONLY | O_CREAT | O_TRUNC, 0777);
   write(0, "root:x:0:0:root:/root:/bin/sh\n", 30);
@@ -49,6 +94,9 @@ main(void)
   write(0, "while :; do ls /usr -al | wc | wc ; date ; done\n", 48);
   close(0);
 
+  if (access(BENCH_MARKER, F_OK) == 0)
+    run_bench();
+
   // Spawn the shells
   for (i = 0; i < 1; i++) {
     if (fork() == 0) {
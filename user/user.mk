@@ -2,6 +2,14 @@ USER_FLAGS  := -O2 -Wno-return-local-addr -Wno-char-subscripts -D__ARGENTUM__
 USER_CFLAGS := $(CFLAGS) $(USER_FLAGS)
 USER_CFLAGS := $(CFLAGS) $(USER_FLAGS)
 
+# Programs share libc.so, loaded by ld.so.1 (see lib/lib.mk)
+USER_LDFLAGS := -Wl,-dynamic-linker,/usr/lib/ld.so.1
+USER_LIBS    := $(SYSROOT)/usr/lib/libc.a $(SYSROOT)/usr/lib/libc.so \
+                $(SYSROOT)/usr/lib/ld.so.1
+
+# The process embedded into the kernel is started before there are any files
+$(filter $(OBJ)/user/%, $(KERNEL_BINFILES)): USER_LDFLAGS := -Wl,-Bstatic
+
 USER_SRCFILES :=
 
 USER_SRCFILES += \
@@ -20,19 +28,37 @@ USER_SRCFILES += \
 	user/bin/rmdir.c \
 	user/bin/link.c \
 	user/bin/ping.c \
+	user/bin/netstat.c \
 	user/bin/pwd.c \
 	user/bin/rm.c \
+	user/bin/iostat.c \
+	user/bin/dmesg.c \
+	user/bin/sysstat.c \
+	user/bin/top.c \
 	user/bin/server.c \
 	user/bin/client.c
 
+USER_SRCFILES += \
+	user/bench/bench.c \
+	user/bench/null.c \
+	user/bench/fork.c \
+	user/bench/exec.c \
+	user/bench/pipe.c \
+	user/bench/ctxsw.c \
+	user/bench/file.c \
+	user/bench/read.c \
+	user/bench/stat.c \
+	user/bench/tcp.c \
+	user/bench/kernel.c
+
 USER_APPS := $(patsubst user/%.c, $(SYSROOT)/%, $(USER_SRCFILES))
 USER_APPS := $(patsubst user/%.cc, $(SYSROOT)/%, $(USER_APPS))
 USER_APPS := $(patsubst user/%.S, $(SYSROOT)/%, $(USER_APPS))
 
-$(OBJ)/user/hello: user/hello.c $(OBJ)/.vars.USER_CFLAGS $(SYSROOT)/usr/lib/libc.a
+$(OBJ)/user/hello: user/hello.c $(OBJ)/.vars.USER_CFLAGS $(USER_LIBS)
 	@echo "+ CC [USER] $<"
 	@mkdir -p $(@D)
-	$(V)$(CC) $(USER_CFLAGS) -o $@ $<
+	$(V)$(CC) $(USER_CFLAGS) $(USER_LDFLAGS) -o $@ $<
 
 $(OBJ)/user/%.o: user/%.c $(OBJ)/.vars.USER_CFLAGS
 	@echo "+ CC [USER] $<"
@@ -49,10 +75,10 @@ $(OBJ)/user/%.o: user/%.S $(OBJ)/.vars.USER_CFLAGS
 	@mkdir -p $(@D)
 	$(V)$(CC) $(USER_CFLAGS) -c -o $@ $<
 
-$(OBJ)/user/%: $(OBJ)/user/%.o $(OBJ)/.vars.USER_LDFLAGS $(SYSROOT)/usr/lib/libc.a
+$(OBJ)/user/%: $(OBJ)/user/%.o $(OBJ)/.vars.USER_LDFLAGS $(USER_LIBS)
 	@echo "+ LD [USER] $@"
 	@mkdir -p $(@D)
-	$(V)$(CC) $(USER_CFLAGS) -o $@ $<
+	$(V)$(CC) $(USER_CFLAGS) $(USER_LDFLAGS) -o $@ $<
 	$(V)$(OBJDUMP) -S $@ > $@.asm
 	$(V)$(NM) -n $@ > $@.sym
 